@@ -0,0 +1,195 @@
+#include "arena.h"
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "aux.h"
+#include "log.h"
+#include "numa.h"
+
+
+#define ARENA_REGION_SIZE	(2 * 1024 * 1024)	// one huge page on x86
+#define ARENA_BLOCK_SIZE	(16 * 1024)
+#define ARENA_ALIGN		16
+#define ARENA_ALIGN_LARGE	64			// bigger objects start on a cache line
+#define ARENA_LARGE_LIMIT	(ARENA_BLOCK_SIZE / 4)
+
+
+struct arena_block {
+	struct arena_block *next;
+	char *tail;
+	char *end;
+	int node;
+};
+struct arena_large {
+	struct arena_large *next;
+	char buf[] __attribute__ ((aligned (ARENA_ALIGN_LARGE)));
+};
+
+
+static enum arena_mode arena_mode;
+static mutex_t arena_lock = MUTEX_STATIC_INIT;
+// one list per NUMA node, plus one at index 0 for memory not bound to any node
+static struct arena_block *arena_free_blocks[NUMA_MAX_NODES + 1]; // LOCK: arena_lock
+static unsigned int arena_regions; // LOCK: arena_lock
+
+
+void arena_init(enum arena_mode mode) {
+	arena_mode = mode;
+}
+
+void arena_new(struct arena *a) {
+	ZERO(*a);
+	a->node = -1;
+	a->active = arena_mode != ARENA_OFF;
+}
+
+
+static void *arena_region_map(int node) {
+	void *p;
+
+#ifdef MAP_HUGETLB
+	if (arena_mode == ARENA_HUGETLB) {
+		p = mmap(NULL, ARENA_REGION_SIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			numa_bind_memory(p, ARENA_REGION_SIZE, node);
+			return p;
+		}
+		ilog(LOG_WARN, "Failed to map huge page for call arena, falling back to "
+				"transparent huge pages: %s", strerror(errno));
+		arena_mode = ARENA_THP;
+	}
+#endif
+
+	// over-allocate so that the region can be aligned to the huge page size, which
+	// is a precondition for the kernel to back it with a huge page
+	size_t len = ARENA_REGION_SIZE * 2;
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	uintptr_t start = ((uintptr_t) p + ARENA_REGION_SIZE - 1) & ~((uintptr_t) ARENA_REGION_SIZE - 1);
+	if (start > (uintptr_t) p)
+		munmap(p, start - (uintptr_t) p);
+	uintptr_t end = start + ARENA_REGION_SIZE;
+	if ((uintptr_t) p + len > end)
+		munmap((void *) end, (uintptr_t) p + len - end);
+	p = (void *) start;
+
+#ifdef MADV_HUGEPAGE
+	madvise(p, ARENA_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+	numa_bind_memory(p, ARENA_REGION_SIZE, node);
+
+	return p;
+}
+
+// called with arena_lock held
+static int arena_region_new(int node) {
+	char *p = arena_region_map(node);
+	if (!p) {
+		ilog(LOG_ERR, "Failed to map memory for call arena: %s", strerror(errno));
+		return -1;
+	}
+
+	arena_regions++;
+	ilog(LOG_DEBUG, "Mapped call arena region #%u for NUMA node %i", arena_regions, node);
+
+	for (size_t off = 0; off + ARENA_BLOCK_SIZE <= ARENA_REGION_SIZE; off += ARENA_BLOCK_SIZE) {
+		struct arena_block *b = (void *) (p + off);
+		b->node = node;
+		b->next = arena_free_blocks[node + 1];
+		arena_free_blocks[node + 1] = b;
+	}
+
+	return 0;
+}
+
+static struct arena_block *arena_block_get(int node) {
+	struct arena_block *b;
+
+	if (node < -1 || node >= NUMA_MAX_NODES)
+		node = -1;
+
+	mutex_lock(&arena_lock);
+	if (!arena_free_blocks[node + 1] && arena_region_new(node)) {
+		mutex_unlock(&arena_lock);
+		return NULL;
+	}
+	b = arena_free_blocks[node + 1];
+	arena_free_blocks[node + 1] = b->next;
+	mutex_unlock(&arena_lock);
+
+	// blocks are recycled, so the contents must be cleared. the header is
+	// followed directly by the usable space
+	b->next = NULL;
+	b->tail = (char *) b + ((sizeof(*b) + ARENA_ALIGN_LARGE - 1) & ~(ARENA_ALIGN_LARGE - 1));
+	b->end = (char *) b + ARENA_BLOCK_SIZE;
+	memset(b->tail, 0, b->end - b->tail);
+
+	return b;
+}
+
+
+static void *arena_large_alloc(struct arena *a, size_t len) {
+	struct arena_large *l;
+	if (posix_memalign((void **) &l, ARENA_ALIGN_LARGE, sizeof(*l) + len))
+		return NULL;
+	memset(l->buf, 0, len);
+	l->next = a->large;
+	a->large = l;
+	return l->buf;
+}
+
+void *arena_alloc(struct arena *a, size_t len) {
+	if (len > ARENA_LARGE_LIMIT)
+		return arena_large_alloc(a, len);
+
+	size_t align = len >= 256 ? ARENA_ALIGN_LARGE : ARENA_ALIGN;
+
+	struct arena_block *b = a->blocks;
+	if (b) {
+		char *p = (char *) (((uintptr_t) b->tail + align - 1) & ~((uintptr_t) align - 1));
+		if (p + len <= b->end) {
+			b->tail = p + len;
+			return p;
+		}
+	}
+
+	b = arena_block_get(a->node);
+	if (!b)
+		return arena_large_alloc(a, len);
+	b->next = a->blocks;
+	a->blocks = b;
+
+	// first allocation in a new block is always aligned
+	char *p = b->tail;
+	b->tail = p + len;
+	return p;
+}
+
+
+void arena_free(struct arena *a) {
+	while (a->large) {
+		struct arena_large *l = a->large;
+		a->large = l->next;
+		free(l);
+	}
+
+	if (!a->blocks)
+		return;
+
+	// blocks may come from different nodes if the call's node was set after
+	// the first allocations
+	mutex_lock(&arena_lock);
+	while (a->blocks) {
+		struct arena_block *b = a->blocks;
+		a->blocks = b->next;
+		b->next = arena_free_blocks[b->node + 1];
+		arena_free_blocks[b->node + 1] = b;
+	}
+	mutex_unlock(&arena_lock);
+}
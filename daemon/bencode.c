@@ -88,7 +88,11 @@ static struct __bencode_buffer_piece *__bencode_piece_new(unsigned int size) {
 }
 
 int bencode_buffer_init(bencode_buffer_t *buf) {
-	buf->pieces = __bencode_piece_new(0);
+	return bencode_buffer_init_size(buf, 0);
+}
+
+int bencode_buffer_init_size(bencode_buffer_t *buf, unsigned int size) {
+	buf->pieces = __bencode_piece_new(size);
 	if (!buf->pieces)
 		return -1;
 	buf->free_list = NULL;
@@ -127,6 +131,15 @@ alloc:
 	return ret;
 }
 
+unsigned int bencode_buffer_used(bencode_buffer_t *buf) {
+	struct __bencode_buffer_piece *piece;
+	unsigned int ret = 0;
+
+	for (piece = buf->pieces; piece; piece = piece->next)
+		ret += piece->tail - piece->buf;
+	return ret;
+}
+
 void bencode_buffer_free(bencode_buffer_t *buf) {
 	struct __bencode_free_list *fl;
 	struct __bencode_buffer_piece *piece, *next;
@@ -387,6 +400,16 @@ char *bencode_collapse(bencode_item_t *root, int *len) {
 	return ret;
 }
 
+int bencode_collapse_buf(bencode_item_t *root, char *out, unsigned int size) {
+	if (!root)
+		return -1;
+	assert(root->str_len > 0);
+
+	if (root->str_len >= size)
+		return -1;
+	return __bencode_str_dump(out, root);
+}
+
 char *bencode_collapse_dup(bencode_item_t *root, int *len) {
 	char *ret;
 	int l;
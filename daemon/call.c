@@ -13,10 +13,10 @@
 #include <stdlib.h>
 #include <time.h>
 #include <xmlrpc_client.h>
-#include <sys/wait.h>
 #include <time.h>
 #include <sys/time.h>
 #include <inttypes.h>
+#include <sched.h>
 
 #include "poller.h"
 #include "aux.h"
@@ -45,8 +45,20 @@
 #include "graphite.h"
 #include "codec.h"
 #include "media_player.h"
+#include "conference.h"
+#include "simulcast.h"
 #include "jitter_buffer.h"
 #include "t38.h"
+#include "dtmf.h"
+#include "dtmflib.h"
+#include "replication.h"
+#include "handover.h"
+
+
+// max number of seconds a call can be skipped by a sliced timer sweep
+#define TIMER_MAX_SKIP 30
+#define ENDPOINT_MAPS_MAX 8 // per media, older unused ones are dropped from the lookup
+#define CALL_REAPER_BATCH 64 // calls released together by the reaper thread
 
 
 struct iterator_helper {
@@ -54,20 +66,50 @@ struct iterator_helper {
 	GSList			*del_scheduled;
 	GHashTable		*addr_sfd;
 	uint64_t		transcoded_media;
+	int			deadlines; // calculate timer_next_check for each call
+};
+struct sweep_helper {
+	GSList			*calls;
+	uint64_t		transcoded_media; // from calls that were skipped
 };
 struct xmlrpc_helper {
 	enum xmlrpc_format fmt;
 	GStringChunk		*c;
 	GQueue			strings;
+	GQueue			retry; // struct xmlrpc_entry
 };
 
 
+// the per-packet fields of these must stay within the first few cache lines. if this
+// fails after adding a field, move the new field further down
+G_STATIC_ASSERT(offsetof(struct packet_stream, stats.errors) + sizeof(atomic64) <= 4 * 64);
+#if !OBJ_DEBUG
+G_STATIC_ASSERT(offsetof(struct stream_fd, socket) + sizeof(socket_t) <= 2 * 64);
+#endif
+
+
+const char * const call_mem_names[__CALL_MEM_LAST] = {
+	[CALL_MEM_BUFFER]	= "buffer",
+	[CALL_MEM_CODEC]	= "codec",
+	[CALL_MEM_SSRC]		= "SSRC",
+	[CALL_MEM_JB]		= "jitter buffer",
+	[CALL_MEM_PLAYER]	= "player",
+	[CALL_MEM_RECORDING]	= "recording",
+	[CALL_MEM_REDIS]	= "Redis",
+};
+
 /* XXX rework these */
 struct stats rtpe_statsps;
 struct stats rtpe_stats;
 
-rwlock_t rtpe_callhash_lock;
-GHashTable *rtpe_callhash;
+struct callhash_shard rtpe_callhash[CALLHASH_SHARDS];
+atomic64 rtpe_callhash_size;
+
+// deleted calls waiting for their resources to be released
+static mutex_t call_reaper_lock = MUTEX_STATIC_INIT;
+static cond_t call_reaper_cond = COND_STATIC_INIT;
+static GQueue call_reaper_queue = G_QUEUE_INIT;
+static int call_reaper_running;
 
 /* ********** */
 
@@ -79,6 +121,7 @@ static void __call_free(void *p);
 static void __call_cleanup(struct call *c);
 static void __monologue_stop(struct call_monologue *ml);
 static void media_stop(struct call_media *m);
+static void call_reap_batch(GQueue *q);
 
 /* called with call->master_lock held in R */
 static int call_timer_delete_monologues(struct call *c) {
@@ -89,7 +132,7 @@ static int call_timer_delete_monologues(struct call *c) {
 
 	/* we need a write lock here */
 	rwlock_unlock_r(&c->master_lock);
-	rwlock_lock_w(&c->master_lock);
+	call_lock_w(c);
 
 	for (i = c->monologues.head; i; i = i->next) {
 		ml = i->data;
@@ -111,7 +154,7 @@ static int call_timer_delete_monologues(struct call *c) {
 out:
 	c->ml_deleted = min_deleted;
 
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 	rwlock_lock_r(&c->master_lock);
 
 	// coverity[missing_unlock : FALSE]
@@ -139,6 +182,10 @@ static void call_timer_iterator(struct call *c, struct iterator_helper *hlp) {
 	struct call_monologue *ml;
 	enum call_stream_state css;
 	atomic64 *timestamp;
+	// earliest time at which the next run of this function can do anything for this call
+	time_t next_check = rtpe_now.tv_sec + TIMER_MAX_SKIP;
+	time_t streams_timeout = 0;
+	unsigned int transcoded = 0;
 
 	rwlock_lock_r(&c->master_lock);
 	log_info_call(c);
@@ -157,6 +204,8 @@ static void call_timer_iterator(struct call *c, struct iterator_helper *hlp) {
 
 		goto delete;
 	}
+	if (rtpe_config.final_timeout)
+		next_check = MIN(next_check, c->created.tv_sec + rtpe_config.final_timeout);
 
 	// other timeouts not applicable to foreign calls
 	if (IS_FOREIGN_CALL(c)) {
@@ -166,11 +215,15 @@ static void call_timer_iterator(struct call *c, struct iterator_helper *hlp) {
 	if (c->deleted && rtpe_now.tv_sec >= c->deleted
 			&& c->last_signal <= c->deleted)
 		goto delete;
+	if (c->deleted)
+		next_check = MIN(next_check, c->deleted);
 
 	if (c->ml_deleted && rtpe_now.tv_sec >= c->ml_deleted) {
 		if (call_timer_delete_monologues(c))
 			goto delete;
 	}
+	if (c->ml_deleted)
+		next_check = MIN(next_check, c->ml_deleted);
 
 	if (!c->streams.head)
 		goto drop;
@@ -182,6 +235,9 @@ static void call_timer_iterator(struct call *c, struct iterator_helper *hlp) {
 
 		if (!ps->media)
 			goto next;
+		// kernel stats are only updated through this timer
+		if (PS_ISSET(ps, KERNELIZED))
+			next_check = 0;
 		sfd = ps->selected_sfd;
 		if (!sfd)
 			goto no_sfd;
@@ -198,32 +254,44 @@ static void call_timer_iterator(struct call *c, struct iterator_helper *hlp) {
 		g_hash_table_insert(hlp->addr_sfd, &sfd->socket.local, obj_get(sfd));
 
 no_sfd:
-		if (good)
+		if (good && !hlp->deadlines)
 			goto next;
 
+		int reason = TIMEOUT;
 		check = rtpe_config.timeout;
-		tmp_t_reason = TIMEOUT;
 		if (!MEDIA_ISSET(ps->media, RECV) || !sfd) {
 			check = rtpe_config.silent_timeout;
-			tmp_t_reason = SILENT_TIMEOUT;
+			reason = SILENT_TIMEOUT;
 		}
 		else if (!PS_ISSET(ps, FILLED)) {
 			check = rtpe_config.offer_timeout;
-			tmp_t_reason = OFFER_TIMEOUT;
+			reason = OFFER_TIMEOUT;
 		}
 
+		// the call times out once all of its streams have
+		streams_timeout = MAX(streams_timeout, atomic64_get(timestamp) + check);
+
+		if (good)
+			goto next;
+
+		tmp_t_reason = reason;
+
 		if (rtpe_now.tv_sec - atomic64_get(timestamp) < check)
 			good = 1;
 
 next:
 		;
 	}
+	if (streams_timeout)
+		next_check = MIN(next_check, streams_timeout);
 
 	for (it = c->medias.head; it; it = it->next) {
 		struct call_media *media = it->data;
 		if (MEDIA_ISSET(media, TRANSCODE))
-			hlp->transcoded_media++;
+			transcoded++;
 	}
+	hlp->transcoded_media += transcoded;
+	c->timer_transcoded = transcoded;
 
 	if (good || IS_FOREIGN_CALL(c)) {
 		goto out;
@@ -249,123 +317,135 @@ delete:
 	goto out;
 
 out:
+	if (hlp->deadlines)
+		c->timer_next_check = next_check;
 	rwlock_unlock_r(&rtpe_config.config_lock);
 	rwlock_unlock_r(&c->master_lock);
 	log_info_clear();
 	obj_put(c);
 }
 
+#define XMLRPC_CONCURRENCY 64 // requests in flight at once per teardown thread
+#define XMLRPC_TRIES 4
+#define XMLRPC_TIMEOUT 5000 // ms
+
+// one teardown request. strings are owned by the helper's string chunk
+struct xmlrpc_entry {
+	struct xmlrpc_helper *xh;
+	const char *url;
+	str *tag, *tag2, *tag3;
+	unsigned int tries;
+};
+
+static void xmlrpc_entry_free(struct xmlrpc_entry *ent) {
+	g_slice_free1(sizeof(*ent), ent);
+}
+
+static void xmlrpc_kill_done(const char *url, const char *method, xmlrpc_value *params, void *p,
+		xmlrpc_env *fault, xmlrpc_value *result)
+{
+	struct xmlrpc_entry *ent = p;
+
+	if (!fault->fault_occurred || strcasestr(fault->fault_string, "dialog not found")) {
+		xmlrpc_entry_free(ent);
+		return;
+	}
+
+	ilog(LOG_WARNING, "XMLRPC fault occurred for tag " STR_FORMAT_M ": %s",
+			STR_FMT_M(ent->tag), fault->fault_string);
+	if (ent->tries >= XMLRPC_TRIES) {
+		xmlrpc_entry_free(ent);
+		return;
+	}
+	g_queue_push_tail(&ent->xh->retry, ent);
+}
+
+static void xmlrpc_kill_start(xmlrpc_client *c, struct xmlrpc_entry *ent) {
+	xmlrpc_env e;
+
+	ent->tries++;
+	ilog(LOG_INFO, "Closing call with tag " STR_FORMAT_M " via XMLRPC call to %s",
+			STR_FMT_M(ent->tag), ent->url);
+
+	xmlrpc_env_init(&e);
+	switch (ent->xh->fmt) {
+	case XF_SEMS:
+		xmlrpc_client_start_rpcf(&e, c, ent->url, "di", xmlrpc_kill_done, ent, "(ssss)",
+					"sbc", "postControlCmd", ent->tag->s, "teardown");
+		break;
+	case XF_CALLID:
+		xmlrpc_client_start_rpcf(&e, c, ent->url, "teardown", xmlrpc_kill_done, ent, "(s)",
+					ent->tag->s);
+		break;
+	case XF_KAMAILIO:
+		xmlrpc_client_start_rpcf(&e, c, ent->url, "dlg.terminate_dlg", xmlrpc_kill_done, ent,
+				"(sss)", ent->tag->s, ent->tag2->s, ent->tag3->s);
+		break;
+	}
+	// the handler isn't called if the request couldn't be started
+	if (e.fault_occurred)
+		xmlrpc_kill_done(ent->url, NULL, NULL, ent, &e, NULL);
+	xmlrpc_env_clean(&e);
+}
+
+/* runs all teardown requests of the helper concurrently, up to XMLRPC_CONCURRENCY at a time,
+ * using the asynchronous client of xmlrpc-c. failed requests are retried in the next round */
 void xmlrpc_kill_calls(void *p) {
 	struct xmlrpc_helper *xh = p;
 	xmlrpc_env e;
-	xmlrpc_client *c;
-	xmlrpc_value *r;
-	pid_t pid;
-	sigset_t ss;
-	int i = 0;
-	int status;
-	str *tag, *tag2 = NULL, *tag3 = NULL;
-	const char *url;
+	xmlrpc_client *c = NULL;
+	GQueue pending = G_QUEUE_INIT;
+	struct xmlrpc_entry *ent;
 
 	int els_per_ent = 2;
 	if (xh->fmt == XF_KAMAILIO)
 		els_per_ent = 4;
 
 	while (xh->strings.length >= els_per_ent) {
-		usleep(10000);
-
-		url = xh->strings.head->data;
-		tag = xh->strings.head->next->data;
+		ent = g_slice_alloc0(sizeof(*ent));
+		ent->xh = xh;
+		ent->url = g_queue_pop_head(&xh->strings);
+		ent->tag = g_queue_pop_head(&xh->strings);
 		if (xh->fmt == XF_KAMAILIO) {
-			tag2 = xh->strings.head->next->next->data;
-			tag3 = xh->strings.head->next->next->next->data;
-		}
-
-		ilog(LOG_INFO, "Forking child to close call with tag " STR_FORMAT_M " via XMLRPC call to %s",
-				STR_FMT_M(tag), url);
-		pid = fork();
-
-		if (pid) {
-retry:
-			pid = waitpid(pid, &status, 0);
-			if ((pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0) || i >= 3) {
-				for (int i = 0; i < els_per_ent; i++)
-					g_queue_pop_head(&xh->strings);
-				i = 0;
-			}
-			else {
-				if (pid == -1 && errno == EINTR)
-					goto retry;
-				ilog(LOG_INFO, "XMLRPC child exited with status %i", status);
-				i++;
-			}
-			continue;
+			ent->tag2 = g_queue_pop_head(&xh->strings);
+			ent->tag3 = g_queue_pop_head(&xh->strings);
 		}
+		g_queue_push_tail(&pending, ent);
+	}
 
-		/* child process */
-		alarm(1); /* syslog functions contain a lock, which may be locked at
-			     this point and can't be unlocked */
-		rlim(RLIMIT_CORE, 0);
-		sigemptyset(&ss);
-		sigprocmask(SIG_SETMASK, &ss, NULL);
-		closelog();
-
-		for (i = 0; i < 100; i++) {
-			if (i == 2 && rtpe_config.common.log_stderr)
-				continue;
-			close(i);
-		}
-
-		if (!rtpe_config.common.log_stderr) {
-			openlog("rtpengine/child", LOG_PID | LOG_NDELAY, LOG_DAEMON);
-		}
-		ilog(LOG_INFO, "Initiating XMLRPC call for tag " STR_FORMAT_M "", STR_FMT_M(tag));
-
-		alarm(5);
+	struct xmlrpc_curl_xportparms curl_parms = {
+		.timeout = XMLRPC_TIMEOUT,
+	};
+	struct xmlrpc_clientparms client_parms = {
+		.transport = "curl",
+		.transportparmsP = &curl_parms,
+		.transportparm_size = XMLRPC_CXPSIZE(timeout),
+	};
 
-		xmlrpc_env_init(&e);
-		xmlrpc_client_setup_global_const(&e);
-		xmlrpc_client_create(&e, XMLRPC_CLIENT_NO_FLAGS, "ngcp-rtpengine", RTPENGINE_VERSION,
-			NULL, 0, &c);
-		if (e.fault_occurred)
-			goto fault;
+	xmlrpc_env_init(&e);
+	xmlrpc_client_create(&e, XMLRPC_CLIENT_NO_FLAGS, "ngcp-rtpengine", RTPENGINE_VERSION,
+		&client_parms, XMLRPC_CPSIZE(transportparm_size), &c);
+	if (e.fault_occurred) {
+		ilog(LOG_ERR, "Failed to create XMLRPC client: %s", e.fault_string);
+		g_queue_clear_full(&pending, (GDestroyNotify) xmlrpc_entry_free);
+		goto out;
+	}
 
-		r = NULL;
-		switch (xh->fmt) {
-		case XF_SEMS:
-			xmlrpc_client_call2f(&e, c, url, "di", &r, "(ssss)",
-						"sbc", "postControlCmd", tag->s, "teardown");
-			break;
-		case XF_CALLID:
-			xmlrpc_client_call2f(&e, c, url, "teardown", &r, "(s)", tag->s);
-			break;
-		case XF_KAMAILIO:
-			xmlrpc_client_call2f(&e, c, url, "dlg.terminate_dlg", &r, "(sss)",
-					tag->s, tag2->s, tag3->s);
-			break;
-		}
+	while (pending.length) {
+		for (unsigned int i = 0; i < XMLRPC_CONCURRENCY && (ent = g_queue_pop_head(&pending)); i++)
+			xmlrpc_kill_start(c, ent);
+		xmlrpc_client_event_loop_finish(c);
 
-		if (r)
-			xmlrpc_DECREF(r);
-		if (e.fault_occurred) {
-			if (strcasestr(e.fault_string, "dialog not found"))
-				;
-			else
-				goto fault;
+		if (!pending.length && xh->retry.length) {
+			pending = xh->retry;
+			g_queue_init(&xh->retry);
+			usleep(10000);
 		}
-
-		xmlrpc_client_destroy(c);
-		for (int i = 0; i < els_per_ent; i++)
-			g_queue_pop_head(&xh->strings);
-		xmlrpc_env_clean(&e);
-
-		_exit(0);
-
-fault:
-		ilog(LOG_WARNING, "XMLRPC fault occurred: %s", e.fault_string);
-		_exit(1);
 	}
 
+	xmlrpc_client_destroy(c);
+out:
+	xmlrpc_env_clean(&e);
 	g_string_chunk_free(xh->c);
 	g_slice_free1(sizeof(*xh), xh);
 }
@@ -394,6 +474,7 @@ void kill_calls_timer(GSList *list, const char *url) {
 		else
 			url_suffix = g_string_chunk_insert(xh->c, url);
 		g_queue_init(&xh->strings);
+		g_queue_init(&xh->retry);
 		xh->fmt = rtpe_config.fmt;
 	}
 
@@ -516,6 +597,135 @@ static void calls_build_list(void *k, void *v, void *d) {
 	*list = g_slist_prepend(*list, obj_get(c));
 }
 
+// only calls for which the timer has something to do
+static void calls_build_list_due(void *k, void *v, void *d) {
+	struct sweep_helper *sh = d;
+	struct call *c = v;
+	if (c->timer_next_check && rtpe_now.tv_sec < c->timer_next_check) {
+		sh->transcoded_media += c->timer_transcoded;
+		return;
+	}
+	sh->calls = g_slist_prepend(sh->calls, obj_get(c));
+}
+
+// processes the next 1/N of all call hash shards. returns the total number of transcoded
+// media, using the last known numbers for shards not processed in this run
+static uint64_t call_timer_sweep_slice(struct iterator_helper *hlp) {
+	// timers are run in a single thread, so no locking required here
+	static unsigned int next_shard;
+	static uint64_t shard_transcoded[CALLHASH_SHARDS];
+	unsigned int slices = rtpe_config.timer_sweep_slices;
+	unsigned int num = (CALLHASH_SHARDS + slices - 1) / slices;
+	uint64_t ret = 0;
+
+	hlp->deadlines = 1;
+
+	for (unsigned int k = 0; k < num; k++) {
+		struct callhash_shard *shard = &rtpe_callhash[next_shard];
+		struct sweep_helper sh = {0,};
+
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_foreach(shard->ht, calls_build_list_due, &sh);
+		rwlock_unlock_r(&shard->lock);
+
+		uint64_t before = hlp->transcoded_media;
+		while (sh.calls) {
+			struct call *c = sh.calls->data;
+			call_timer_iterator(c, hlp);
+			sh.calls = g_slist_delete_link(sh.calls, sh.calls);
+		}
+		shard_transcoded[next_shard] = sh.transcoded_media + hlp->transcoded_media - before;
+
+		next_shard = (next_shard + 1) % CALLHASH_SHARDS;
+	}
+
+	for (unsigned int k = 0; k < CALLHASH_SHARDS; k++)
+		ret += shard_transcoded[k];
+	return ret;
+}
+
+static void call_kernel_dtmf_event(const struct rtpengine_dtmf_event *ev, GHashTable *addr_sfd) {
+	endpoint_t ep;
+
+	kernel2endpoint(&ep, &ev->local);
+	struct stream_fd *sfd = g_hash_table_lookup(addr_sfd, &ep);
+	if (!sfd)
+		return;
+
+	struct call *call = sfd->call;
+	rwlock_lock_r(&call->master_lock);
+
+	struct packet_stream *ps = sfd->stream;
+	if (!ps || ps->selected_sfd != sfd || !ps->media)
+		goto out;
+
+	log_info_stream_fd(sfd);
+
+	struct telephone_event_payload te = {
+		.event = ev->event,
+		.volume = ev->volume,
+		.end = ev->end,
+		.duration = htons(ev->duration),
+	};
+	struct media_packet mp = {
+		.sfd = sfd,
+		.call = call,
+		.stream = ps,
+		.media = ps->media,
+	};
+	kernel2endpoint(&mp.fsin, &ev->src);
+	str payload = STR_CONST_INIT_LEN((char *) &te, sizeof(te));
+
+	dtmf_event(&mp, &payload, ev->clock_rate);
+
+	log_info_clear();
+out:
+	rwlock_unlock_r(&call->master_lock);
+}
+
+// RFC 4733 events seen by the kernel module for streams that it forwards by itself.
+// the lookup over all calls is only done when events are pending
+static void call_timer_kernel_dtmf(void) {
+	struct rtpengine_dtmf_event evs[KERNEL_DTMF_BATCH];
+	GSList *calls = NULL;
+
+	int num = kernel_read_dtmf(evs, G_N_ELEMENTS(evs));
+	if (num <= 0)
+		return;
+
+	GHashTable *addr_sfd = g_hash_table_new(g_endpoint_hash, g_endpoint_eq);
+
+	calls_foreach(calls_build_list, &calls);
+	while (calls) {
+		struct call *c = calls->data;
+		rwlock_lock_r(&c->master_lock);
+		for (GList *l = c->streams.head; l; l = l->next) {
+			struct packet_stream *ps = l->data;
+			struct stream_fd *sfd = ps->selected_sfd;
+			if (!sfd || !PS_ISSET(ps, KERNELIZED))
+				continue;
+			if (g_hash_table_contains(addr_sfd, &sfd->socket.local))
+				continue;
+			g_hash_table_insert(addr_sfd, &sfd->socket.local, obj_get(sfd));
+		}
+		rwlock_unlock_r(&c->master_lock);
+		obj_put(c);
+		calls = g_slist_delete_link(calls, calls);
+	}
+
+	while (num > 0) {
+		for (int i = 0; i < num; i++)
+			call_kernel_dtmf_event(&evs[i], addr_sfd);
+		num = kernel_read_dtmf(evs, G_N_ELEMENTS(evs));
+	}
+
+	GList *l = g_hash_table_get_values(addr_sfd);
+	for (GList *k = l; k; k = k->next)
+		obj_put((struct stream_fd *) k->data);
+	g_list_free(l);
+	g_hash_table_destroy(addr_sfd);
+}
+
 static void call_timer(void *ptr) {
 	struct iterator_helper hlp;
 	GList *i, *l;
@@ -536,6 +746,10 @@ static void call_timer(void *ptr) {
 	static struct timeval last_run;
 	static long long interval = 1000000; // usec
 
+	// no calls must time out or change while they're being handed over
+	if (handover_active())
+		return;
+
 	gettimeofday(&tv_start, NULL);
 
 	// ready to start?
@@ -554,15 +768,17 @@ static void call_timer(void *ptr) {
 	ZERO(hlp);
 	hlp.addr_sfd = g_hash_table_new(g_endpoint_hash, g_endpoint_eq);
 
-	/* obtain the call list and make a copy from it so not to hold the lock */
-	rwlock_lock_r(&rtpe_callhash_lock);
-	g_hash_table_foreach(rtpe_callhash, calls_build_list, &calls);
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	if (rtpe_config.timer_sweep_slices > 1)
+		hlp.transcoded_media = call_timer_sweep_slice(&hlp);
+	else {
+		/* obtain the call list and make a copy from it so not to hold the lock */
+		calls_foreach(calls_build_list, &calls);
 
-	while (calls) {
-		struct call *c = calls->data;
-		call_timer_iterator(c, &hlp);
-		calls = g_slist_delete_link(calls, calls);
+		while (calls) {
+			struct call *c = calls->data;
+			call_timer_iterator(c, &hlp);
+			calls = g_slist_delete_link(calls, calls);
+		}
 	}
 
 	atomic64_local_copy_zero_struct(&tmpstats, &rtpe_statsps, bytes);
@@ -603,11 +819,16 @@ static void call_timer(void *ptr) {
 			goto next;
 		}
 
-		uint64_t diff_packets, diff_bytes, diff_errors;
+		uint64_t diff_packets, diff_bytes, diff_errors, diff_junk;
 
 		DS(packets);
 		DS(bytes);
 		DS(errors);
+		DS(junk);
+
+		atomic64_add(&sfd->local_intf->spec->kernel_packets, diff_packets);
+		atomic64_add(&sfd->local_intf->spec->kernel_bytes, diff_bytes);
+		atomic64_add(&sfd->local_intf->spec->kernel_junk, diff_junk);
 
 
 		if (ke->stats.packets != atomic64_get(&ps->kernel_stats.packets))
@@ -625,10 +846,11 @@ static void call_timer(void *ptr) {
 		atomic64_set(&ps->kernel_stats.bytes, ke->stats.bytes);
 		atomic64_set(&ps->kernel_stats.packets, ke->stats.packets);
 		atomic64_set(&ps->kernel_stats.errors, ke->stats.errors);
+		atomic64_set(&ps->kernel_stats.junk, ke->stats.junk);
 
 		for (j = 0; j < ke->target.num_payload_types; j++) {
 			pt = ke->target.payload_types[j];
-			rs = g_hash_table_lookup(ps->rtp_stats, &pt);
+			rs = rtp_stats_get(ps, pt);
 			if (!rs)
 				continue;
 			if (ke->rtp_stats[j].packets > atomic64_get(&rs->packets))
@@ -655,6 +877,12 @@ static void call_timer(void *ptr) {
 					sink->ssrc_out->srtp_index = ke->target.encrypt.last_index;
 					update = 1;
 				}
+				if (ke->target.rtcp_fw && sink->ssrc_out
+						&& ke->target.encrypt.rtcp_index > sink->ssrc_out->srtcp_index)
+				{
+					sink->ssrc_out->srtcp_index = ke->target.encrypt.rtcp_index;
+					update = 1;
+				}
 				mutex_unlock(&sink->out_lock);
 			}
 
@@ -666,6 +894,20 @@ static void call_timer(void *ptr) {
 				atomic64_set(&ps->ssrc_in->last_seq, ke->target.decrypt.last_index);
 				ps->ssrc_in->srtp_index = ke->target.decrypt.last_index;
 
+				// SSRC stats come along with the list entry, no need to
+				// query each target separately. the shared map is more recent
+				// than the list snapshot if the target has a slot in it
+				struct rtpengine_ssrc_stats live, *ss = &ke->ssrc_stats;
+				if (!kernel_read_ssrc_stats(ps->kernel_stats_slot, &ke->target.local,
+							ke->target.ssrc, &live))
+					ss = &live;
+				if (ss->total_lost > ps->kernel_lost)
+					atomic64_add(&ps->ssrc_in->packets_lost,
+							ss->total_lost - ps->kernel_lost);
+				ps->kernel_lost = ss->total_lost;
+				atomic64_set(&ps->ssrc_in->last_ts, ss->timestamp);
+				ps->ssrc_in->parent->jitter = ss->jitter;
+
 				if (sfd->crypto.params.crypto_suite
 						&& ke->target.decrypt.last_index
 						- ps->ssrc_in->srtp_index > 0x4000)
@@ -677,7 +919,8 @@ static void call_timer(void *ptr) {
 		rwlock_unlock_r(&sfd->call->master_lock);
 
 		if (update) {
-				redis_update_onekey(ps->call, rtpe_redis_write);
+				redis_update_async(ps->call, rtpe_redis_write);
+				replication_update(ps->call);
 		}
 
 next:
@@ -694,6 +937,8 @@ next:
 	g_list_free(l);
 	g_hash_table_destroy(hlp.addr_sfd);
 
+	call_timer_kernel_dtmf();
+
 	kill_calls_timer(hlp.del_scheduled, NULL);
 	kill_calls_timer(hlp.del_timeout, rtpe_config.b2b_url);
 
@@ -702,6 +947,8 @@ next:
 	long long duration = timeval_diff(&tv_stop, &tv_start);
 	ilog(LOG_DEBUG, "timer run time = %llu.%06llu sec", duration / 1000000, duration % 1000000);
 
+	statistics_snapshot_update();
+
 	// increase timer run duration if runtime was within 10% of the interval
 	if (duration > interval / 10) {
 		interval *= 2;
@@ -717,25 +964,48 @@ next:
 
 
 int call_init() {
-	rtpe_callhash = g_hash_table_new(str_hash, str_equal);
-	if (!rtpe_callhash)
-		return -1;
-	rwlock_init(&rtpe_callhash_lock);
+	ITERATE_CALLHASH_SHARDS(shard) {
+		shard->ht = g_hash_table_new(str_hash, str_equal);
+		if (!shard->ht)
+			return -1;
+		rwlock_init(&shard->lock);
+	}
 
 	poller_add_timer(rtpe_poller, call_timer, NULL);
 
+	// not thread safe, so done once here for the XMLRPC teardown threads
+	xmlrpc_env e;
+	xmlrpc_env_init(&e);
+	xmlrpc_client_setup_global_const(&e);
+	xmlrpc_env_clean(&e);
+
 	return 0;
 }
 
 void call_free(void) {
-	GList *ll = g_hash_table_get_values(rtpe_callhash);
-	for (GList *l = ll; l; l = l->next) {
-		struct call *c = l->data;
-		__call_cleanup(c);
-		obj_put(c);
+	call_reap_batch(&call_reaper_queue);
+
+	ITERATE_CALLHASH_SHARDS(shard) {
+		GList *ll = g_hash_table_get_values(shard->ht);
+		for (GList *l = ll; l; l = l->next) {
+			struct call *c = l->data;
+			__call_cleanup(c);
+			obj_put(c);
+		}
+		g_list_free(ll);
+		g_hash_table_destroy(shard->ht);
+		rwlock_destroy(&shard->lock);
+	}
+	xmlrpc_client_teardown_global_const();
+}
+
+// runs `func` on all calls, taking the lock of one shard at a time
+void calls_foreach(GHFunc func, void *data) {
+	ITERATE_CALLHASH_SHARDS(shard) {
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_foreach(shard->ht, func, data);
+		rwlock_unlock_r(&shard->lock);
 	}
-	g_list_free(ll);
-	g_hash_table_destroy(rtpe_callhash);
 }
 
 
@@ -746,7 +1016,7 @@ void payload_type_free(struct rtp_payload_type *p) {
 
 struct call_media *call_media_new(struct call *call) {
 	struct call_media *med;
-	med = uid_slice_alloc0(med, &call->medias);
+	med = call_uid_alloc0(call, med, &call->medias);
 	med->call = call;
 	med->codecs_recv = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, NULL);
 	med->codecs_send = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, NULL);
@@ -774,7 +1044,7 @@ static struct call_media *__get_media(struct call_monologue *ml, GList **it, con
 		// in this case, the media sections are out of order and the media ID
 		// string is used to determine which media section to operate on. this
 		// info must be present and valid.
-		med = g_hash_table_lookup(ml->media_ids, &sp->media_id);
+		med = str_map_lookup(&ml->media_ids, &sp->media_id);
 		if (med)
 			return med;
 		ilog(LOG_ERR, "Received trickle ICE SDP fragment with unknown media ID '"
@@ -807,40 +1077,172 @@ static struct call_media *__get_media(struct call_monologue *ml, GList **it, con
 	return med;
 }
 
+static unsigned int endpoint_map_hash(const void *p) {
+	const struct endpoint_map_key *k = p;
+	return g_direct_hash(k->logical_intf) ^ k->port;
+}
+static gboolean endpoint_map_eq(const void *a, const void *b) {
+	const struct endpoint_map_key *A = a, *B = b;
+	return A->logical_intf == B->logical_intf && A->port == B->port;
+}
+
+// buckets are kept newest first, which gives the same precedence as scanning the list from the tail
+static void __endpoint_map_index(struct call_media *media, struct endpoint_map *em) {
+	struct endpoint_map *head, **pp;
+
+	em->key.logical_intf = em->logical_intf;
+	em->key.port = em->endpoint.port;
+
+	head = g_hash_table_lookup(media->endpoint_maps_ht, &em->key);
+	if (!head || head->unique_id < em->unique_id) {
+		em->older = head;
+		g_hash_table_replace(media->endpoint_maps_ht, &em->key, em);
+		return;
+	}
+	for (pp = &head->older; *pp && (*pp)->unique_id > em->unique_id; pp = &(*pp)->older)
+		;
+	em->older = *pp;
+	*pp = em;
+}
+
+static void __endpoint_map_unindex(struct call_media *media, struct endpoint_map *em) {
+	struct endpoint_map *head, **pp;
+
+	head = g_hash_table_lookup(media->endpoint_maps_ht, &em->key);
+	if (!head)
+		return;
+	if (head == em) {
+		if (em->older)
+			g_hash_table_replace(media->endpoint_maps_ht, &em->older->key, em->older);
+		else
+			g_hash_table_remove(media->endpoint_maps_ht, &em->key);
+		em->older = NULL;
+		return;
+	}
+	for (pp = &head->older; *pp; pp = &(*pp)->older) {
+		if (*pp != em)
+			continue;
+		*pp = em->older;
+		em->older = NULL;
+		return;
+	}
+}
+
+// maps restored from redis are indexed the first time they're needed
+static void __endpoint_maps_index(struct call_media *media) {
+	GList *l;
+
+	if (media->endpoint_maps_ht)
+		return;
+
+	media->endpoint_maps_ht = g_hash_table_new(endpoint_map_hash, endpoint_map_eq);
+	for (l = media->endpoint_maps.head; l; l = l->next)
+		__endpoint_map_index(media, l->data);
+}
+
+static int __endpoint_map_in_use(struct call_media *media, struct endpoint_map *em) {
+	GList *l, *k, *m;
+	struct packet_stream *ps;
+	struct intf_list *il;
+
+	for (l = media->streams.head; l; l = l->next) {
+		ps = l->data;
+		for (k = em->intf_sfds.head; k; k = k->next) {
+			il = k->data;
+			for (m = il->list.head; m; m = m->next) {
+				if (ps->selected_sfd == m->data || g_queue_find(&ps->sfds, m->data))
+					return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+// Drops the oldest unused maps from the media once it has collected too many of them,
+// e.g. from an endpoint changing with every re-invite. They stay in the call's list
+// (and keep their ports) until the call is released, as the redis data refers to maps
+// and stream_fds by their unique IDs.
+static void __endpoint_maps_gc(struct call_media *media) {
+	GList *l, *next;
+	struct endpoint_map *em;
+
+	for (l = media->endpoint_maps.head; l && media->endpoint_maps.length >= ENDPOINT_MAPS_MAX; l = next) {
+		next = l->next;
+		em = l->data;
+		if (__endpoint_map_in_use(media, em))
+			continue;
+		__C_DBG("dropping unused endpoint map %u", em->unique_id);
+		__endpoint_map_unindex(media, em);
+		g_queue_delete_link(&media->endpoint_maps, l);
+	}
+}
+
+// the newest map in the bucket that the endpoint (if any) matches, or a wildcard map with enough ports
+static struct endpoint_map *__endpoint_map_bucket(struct call_media *media, unsigned int port,
+		unsigned int num_ports, const struct endpoint *ep)
+{
+	struct endpoint_map_key key = { .logical_intf = media->logical_intf, .port = port };
+	struct endpoint_map *em;
+
+	for (em = g_hash_table_lookup(media->endpoint_maps_ht, &key); em; em = em->older) {
+		if (em->wildcard && em->num_ports >= num_ports)
+			return em;
+		if (!ep)
+			continue;
+		/* ports are equal within the bucket. with a zero endpoint address, that's all we compare */
+		if (is_addr_unspecified(&ep->address) || is_addr_unspecified(&em->endpoint.address))
+			return em;
+		if (!memcmp(&em->endpoint, ep, sizeof(*ep)))
+			return em;
+	}
+	return NULL;
+}
+
 static struct endpoint_map *__get_endpoint_map(struct call_media *media, unsigned int num_ports,
 		const struct endpoint *ep, const struct sdp_ng_flags *flags)
 {
 	GList *l;
-	struct endpoint_map *em;
+	struct endpoint_map *em, *wc;
 	struct stream_fd *sfd;
 	GQueue intf_sockets = G_QUEUE_INIT;
 	socket_t *sock;
 	struct intf_list *il, *em_il;
 
-	for (l = media->endpoint_maps.tail; l; l = l->prev) {
-		em = l->data;
-		if (em->logical_intf != media->logical_intf)
-			continue;
+	__endpoint_maps_index(media);
+
+	em = NULL;
+	if (!ep || (flags && flags->port_latching)) {
+		/* creating wildcard map, or ignoring endpoint addresses:
+		 * only the most recent map of this interface is considered */
+		for (l = media->endpoint_maps.tail; l; l = l->prev) {
+			em = l->data;
+			if (em->logical_intf == media->logical_intf)
+				break;
+			em = NULL;
+		}
+		if (em && !ep && !(em->wildcard && em->num_ports >= num_ports))
+			em = NULL;
+	}
+	else {
+		em = __endpoint_map_bucket(media, ep->port, num_ports, ep);
+		if (ep->port) {
+			wc = __endpoint_map_bucket(media, 0, num_ports, NULL);
+			if (wc && (!em || wc->unique_id > em->unique_id))
+				em = wc;
+		}
+	}
+
+	if (em) {
 		if (em->wildcard && em->num_ports >= num_ports) {
 			__C_DBG("found a wildcard endpoint map%s", ep ? " and filling it in" : "");
 			if (ep) {
+				__endpoint_map_unindex(media, em);
 				em->endpoint = *ep;
 				em->wildcard = 0;
+				__endpoint_map_index(media, em);
 			}
 			return em;
 		}
-		if (!ep) /* creating wildcard map */
-			break;
-
-		if (flags && flags->port_latching)
-			/* do nothing - ignore endpoint addresses */ ;
-		else if (is_addr_unspecified(&ep->address) || is_addr_unspecified(&em->endpoint.address)) {
-			/* handle zero endpoint address: only compare ports */
-			if (ep->port != em->endpoint.port)
-				continue;
-		}
-		else if (memcmp(&em->endpoint, ep, sizeof(*ep)))
-			continue;
 
 		if (em->num_ports >= num_ports) {
 			if (is_addr_unspecified(&em->endpoint.address))
@@ -854,8 +1256,10 @@ static struct endpoint_map *__get_endpoint_map(struct call_media *media, unsigne
 		goto alloc;
 	}
 
+	__endpoint_maps_gc(media);
+
 	__C_DBG("allocating new %sendpoint map", ep ? "" : "wildcard ");
-	em = uid_slice_alloc0(em, &media->call->endpoint_maps);
+	em = call_uid_alloc0(media->call, em, &media->call->endpoint_maps);
 	if (ep)
 		em->endpoint = *ep;
 	else
@@ -864,11 +1268,13 @@ static struct endpoint_map *__get_endpoint_map(struct call_media *media, unsigne
 	em->num_ports = num_ports;
 	g_queue_init(&em->intf_sfds);
 	g_queue_push_tail(&media->endpoint_maps, em);
+	__endpoint_map_index(media, em);
 
 alloc:
 	if (num_ports > 16)
 		return NULL;
-	if (get_consecutive_ports(&intf_sockets, num_ports, media->logical_intf, &media->call->callid))
+	if (get_consecutive_ports(&intf_sockets, num_ports, media->logical_intf, &media->call->callid,
+				media->call->poller))
 		return NULL;
 
 	__C_DBG("allocating stream_fds for %u ports", num_ports);
@@ -949,19 +1355,14 @@ static int __wildcard_endpoint_map(struct call_media *media, unsigned int num_po
 	return 0;
 }
 
-static void __rtp_stats_free(void *p) {
-	g_slice_free1(sizeof(struct rtp_stats), p);
-}
-
 struct packet_stream *__packet_stream_new(struct call *call) {
 	struct packet_stream *stream;
 
-	stream = uid_slice_alloc0(stream, &call->streams);
+	stream = call_uid_alloc0(call, stream, &call->streams);
 	mutex_init(&stream->in_lock);
 	mutex_init(&stream->out_lock);
 	stream->call = call;
 	atomic64_set_na(&stream->last_packet, rtpe_now.tv_sec);
-	stream->rtp_stats = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, __rtp_stats_free);
 	recording_init_stream(stream);
 	stream->send_timer = send_timer_new(stream);
 
@@ -1125,25 +1526,29 @@ int __init_stream(struct packet_stream *ps) {
 	return 0;
 }
 
-void __rtp_stats_update(GHashTable *dst, GHashTable *src) {
+void __rtp_stats_update(struct packet_stream *ps, GHashTable *src) {
 	struct rtp_stats *rs;
 	struct rtp_payload_type *pt;
 	GList *values, *l;
 
-	/* "src" is a call_media->codecs table, while "dst" is a
-	 * packet_stream->rtp_stats table */
+	/* "src" is a call_media->codecs table */
 
 	values = g_hash_table_get_values(src);
 
 	for (l = values; l; l = l->next) {
 		pt = l->data;
-		rs = g_hash_table_lookup(dst, &pt->payload_type);
-		if (rs)
+		if (pt->payload_type < 0 || pt->payload_type >= G_N_ELEMENTS(ps->rtp_stats_idx))
 			continue;
+		if (ps->rtp_stats_idx[pt->payload_type])
+			continue;
+		if (ps->num_rtp_stats >= G_N_ELEMENTS(ps->rtp_stats)) {
+			ilog(LOG_DEBUG, "No room to keep stats for RTP payload type %i", pt->payload_type);
+			continue;
+		}
 
-		rs = g_slice_alloc0(sizeof(*rs));
+		rs = &ps->rtp_stats[ps->num_rtp_stats++];
 		rs->payload_type = pt->payload_type;
-		g_hash_table_insert(dst, &rs->payload_type, rs);
+		ps->rtp_stats_idx[pt->payload_type] = ps->num_rtp_stats;
 	}
 
 	g_list_free(values);
@@ -1168,7 +1573,7 @@ static int __init_streams(struct call_media *A, struct call_media *B, const stru
 		a->rtp_sink = b;
 		PS_SET(a, RTP); /* XXX technically not correct, could be udptl too */
 
-		__rtp_stats_update(a->rtp_stats, A->codecs_recv);
+		__rtp_stats_update(a, A->codecs_recv);
 
 		if (sp) {
 			__fill_stream(a, &sp->rtp_endpoint, port_off, sp);
@@ -1885,7 +2290,7 @@ static void __update_media_id(struct call_media *media, struct call_media *other
 			if (sp->media_id.s)
 				call_str_cpy(call, &other_media->media_id, &sp->media_id);
 			if (other_media->media_id.s)
-				g_hash_table_insert(other_ml->media_ids, &other_media->media_id,
+				str_map_insert(&other_ml->media_ids, &other_media->media_id,
 						other_media);
 		}
 		else {
@@ -1894,9 +2299,9 @@ static void __update_media_id(struct call_media *media, struct call_media *other
 			if (sp->media_id.s) {
 				if (str_cmp_str(&other_media->media_id, &sp->media_id)) {
 					// mismatch - update
-					g_hash_table_remove(other_ml->media_ids, &other_media->media_id);
+					str_map_remove(&other_ml->media_ids, &other_media->media_id);
 					call_str_cpy(call, &other_media->media_id, &sp->media_id);
-					g_hash_table_insert(other_ml->media_ids, &other_media->media_id,
+					str_map_insert(&other_ml->media_ids, &other_media->media_id,
 							other_media);
 				}
 			}
@@ -1917,7 +2322,7 @@ static void __update_media_id(struct call_media *media, struct call_media *other
 				call_str_cpy_c(call, &media->media_id, buf);
 			}
 			if (media->media_id.s)
-				g_hash_table_insert(ml->media_ids, &media->media_id, media);
+				str_map_insert(&ml->media_ids, &media->media_id, media);
 		}
 		else {
 			// we already have a media ID. keep what we have and ignore what's
@@ -2088,7 +2493,7 @@ int monologue_offer_answer(struct call_monologue *other_ml, GQueue *streams,
 
 	if (flags && flags->label.s) {
 		call_str_cpy(call, &other_ml->label, &flags->label);
-		g_hash_table_replace(call->labels, &other_ml->label, other_ml);
+		str_map_insert(&call->labels, &other_ml->label, other_ml);
 	}
 
 	ml_media = other_ml_media = NULL;
@@ -2180,6 +2585,7 @@ int monologue_offer_answer(struct call_monologue *other_ml, GQueue *streams,
 		codec_rtp_payload_types(media, other_media, &sp->rtp_payload_types, flags);
 		codec_handlers_update(media, other_media, flags, sp);
 		codec_tracker_finish(media);
+		simulcast_update(other_media, sp, flags);
 
 		/* send and recv are from our POV */
 		bf_copy_same(&media->media_flags, &sp->sp_flags,
@@ -2293,22 +2699,9 @@ error_intf:
 }
 
 
-static int __rtp_stats_sort(const void *ap, const void *bp) {
-	const struct rtp_stats *a = ap, *b = bp;
-
-	/* descending order */
-	if (atomic64_get(&a->packets) > atomic64_get(&b->packets))
-		return -1;
-	if (atomic64_get(&a->packets) < atomic64_get(&b->packets))
-		return 1;
-	return 0;
-}
-
 const struct rtp_payload_type *__rtp_stats_codec(struct call_media *m) {
 	struct packet_stream *ps;
-	GList *values;
-	struct rtp_stats *rtp_s;
-	const struct rtp_payload_type *rtp_pt = NULL;
+	struct rtp_stats *rtp_s = NULL;
 
 	/* we only use the primary packet stream for the time being */
 	if (!m->streams.head)
@@ -2316,33 +2709,22 @@ const struct rtp_payload_type *__rtp_stats_codec(struct call_media *m) {
 
 	ps = m->streams.head->data;
 
-	values = g_hash_table_get_values(ps->rtp_stats);
-	if (!values)
-		return NULL;
-
-	values = g_list_sort(values, __rtp_stats_sort);
-
 	/* payload type with the most packets */
-	rtp_s = values->data;
-	if (atomic64_get(&rtp_s->packets) == 0)
-		goto out;
-
-	rtp_pt = rtp_payload_type(rtp_s->payload_type, m->codecs_recv);
+	for (unsigned int i = 0; i < ps->num_rtp_stats; i++) {
+		if (!rtp_s || atomic64_get(&ps->rtp_stats[i].packets) > atomic64_get(&rtp_s->packets))
+			rtp_s = &ps->rtp_stats[i];
+	}
+	if (!rtp_s || atomic64_get(&rtp_s->packets) == 0)
+		return NULL;
 
-out:
-	g_list_free(values);
-	return rtp_pt; /* may be NULL */
+	return rtp_payload_type(rtp_s->payload_type, m->codecs_recv); /* may be NULL */
 }
 
 void add_total_calls_duration_in_interval(struct timeval *interval_tv) {
 	struct timeval ongoing_calls_dur = add_ongoing_calls_dur_in_interval(
 			&rtpe_latest_graphite_interval_start, interval_tv);
 
-	mutex_lock(&rtpe_totalstats_interval.total_calls_duration_lock);
-	timeval_add(&rtpe_totalstats_interval.total_calls_duration_interval,
-			&rtpe_totalstats_interval.total_calls_duration_interval,
-			&ongoing_calls_dur);
-	mutex_unlock(&rtpe_totalstats_interval.total_calls_duration_lock);
+	statistics_update_calls_duration(&ongoing_calls_dur);
 }
 
 static struct timeval add_ongoing_calls_dur_in_interval(struct timeval *interval_start,
@@ -2354,33 +2736,42 @@ static struct timeval add_ongoing_calls_dur_in_interval(struct timeval *interval
 	struct call *call;
 	struct call_monologue *ml;
 
-	rwlock_lock_r(&rtpe_callhash_lock);
-	g_hash_table_iter_init(&iter, rtpe_callhash);
+	ITERATE_CALLHASH_SHARDS(shard) {
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_iter_init(&iter, shard->ht);
 
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		call = (struct call*) value;
-		if (!call->monologues.head || IS_FOREIGN_CALL(call))
-			continue;
-		ml = call->monologues.head->data;
-		if (timercmp(interval_start, &ml->started, >)) {
-			timeval_add(&res, &res, interval_duration);
-		} else {
-			timeval_subtract(&call_duration, &rtpe_now, &ml->started);
-			timeval_add(&res, &res, &call_duration);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			call = (struct call*) value;
+			if (!call->monologues.head || IS_FOREIGN_CALL(call))
+				continue;
+			ml = call->monologues.head->data;
+			if (timercmp(interval_start, &ml->started, >)) {
+				timeval_add(&res, &res, interval_duration);
+			} else {
+				timeval_subtract(&call_duration, &rtpe_now, &ml->started);
+				timeval_add(&res, &res, &call_duration);
+			}
 		}
+		rwlock_unlock_r(&shard->lock);
 	}
-	rwlock_unlock_r(&rtpe_callhash_lock);
 	return res;
 }
 
 static void __call_cleanup(struct call *c) {
+	conference_put(c);
+
+	kernel_batch_start();
+
 	for (GList *l = c->streams.head; l; l = l->next) {
 		struct packet_stream *ps = l->data;
 
 		send_timer_put(&ps->send_timer);
 		jb_put(&ps->jb);
-		__unkernelize(ps);
-		dtls_shutdown(ps);
+		// after a handover, kernel targets and DTLS sessions belong to the new process
+		if (!handover_sent) {
+			__unkernelize(ps);
+			dtls_shutdown(ps);
+		}
 		ps->selected_sfd = NULL;
 		g_queue_clear(&ps->sfds);
 		crypto_cleanup(&ps->crypto);
@@ -2389,6 +2780,8 @@ static void __call_cleanup(struct call *c) {
 		ps->rtcp_sink = NULL;
 	}
 
+	kernel_batch_flush();
+
 	for (GList *l = c->medias.head; l; l = l->next) {
 		struct call_media *md = l->data;
 		ice_shutdown(&md->ice_agent);
@@ -2404,47 +2797,25 @@ static void __call_cleanup(struct call *c) {
 
 	while (c->stream_fds.head) {
 		struct stream_fd *sfd = g_queue_pop_head(&c->stream_fds);
-		poller_del_item(rtpe_poller, sfd->socket.fd);
+		poller_del_item(sfd->poller, sfd->socket.fd);
 		obj_put(sfd);
 	}
 
-	recording_finish(c);
+	if (!handover_sent)
+		recording_finish(c);
 }
 
-/* called lock-free, but must hold a reference to the call */
-void call_destroy(struct call *c) {
+/* final stats output and release of all resources of a call that has been removed from
+ * the call hash. runs on the reaper thread */
+static void __call_reap(struct call *c) {
 	struct packet_stream *ps=0;
 	GList *l;
-	int ret;
 	struct call_monologue *ml;
 	struct call_media *md;
 	GList *k, *o;
 	const struct rtp_payload_type *rtp_pt;
 
-	if (!c) {
-		return;
-	}
-
-	rwlock_lock_w(&rtpe_callhash_lock);
-	ret = (g_hash_table_lookup(rtpe_callhash, &c->callid) == c);
-	if (ret)
-		g_hash_table_remove(rtpe_callhash, &c->callid);
-	rwlock_unlock_w(&rtpe_callhash_lock);
-
-	// if call not found in callhash => previously deleted
-	if (!ret)
-		return;
-
-	obj_put(c);
-
-
-	statistics_update_foreignown_dec(c);
-
-	if (IS_OWN_CALL(c)) {
-		redis_delete(c, rtpe_redis_write);
-	}
-
-	rwlock_lock_w(&c->master_lock);
+	call_lock_w(c);
 	/* at this point, no more packet streams can be added */
 
 	if (!IS_OWN_CALL(c))
@@ -2531,23 +2902,23 @@ void call_destroy(struct call *c) {
 
 		// stats output only - no cleanups
 
-		if (!se->stats_blocks.length || !se->lowest_mos || !se->highest_mos)
+		if (!se->num_stats_blocks)
 			continue;
 
 		ilog(LOG_INFO, "--- SSRC %s%" PRIx32 "%s", FMT_M(se->h.ssrc));
 		ilog(LOG_INFO, "------ Average MOS %" PRIu64 ".%" PRIu64 ", "
 				"lowest MOS %" PRIu64 ".%" PRIu64 " (at %u:%02u), "
 				"highest MOS %" PRIu64 ".%" PRIu64 " (at %u:%02u)",
-			se->average_mos.mos / se->stats_blocks.length / 10,
-			se->average_mos.mos / se->stats_blocks.length % 10,
-			se->lowest_mos->mos / 10,
-			se->lowest_mos->mos % 10,
-			(unsigned int) (timeval_diff(&se->lowest_mos->reported, &c->created) / 1000000) / 60,
-			(unsigned int) (timeval_diff(&se->lowest_mos->reported, &c->created) / 1000000) % 60,
-			se->highest_mos->mos / 10,
-			se->highest_mos->mos % 10,
-			(unsigned int) (timeval_diff(&se->highest_mos->reported, &c->created) / 1000000) / 60,
-			(unsigned int) (timeval_diff(&se->highest_mos->reported, &c->created) / 1000000) % 60);
+			se->average_mos.mos / se->num_stats_blocks / 10,
+			se->average_mos.mos / se->num_stats_blocks % 10,
+			se->lowest_mos.mos / 10,
+			se->lowest_mos.mos % 10,
+			(unsigned int) (timeval_diff(&se->lowest_mos.reported, &c->created) / 1000000) / 60,
+			(unsigned int) (timeval_diff(&se->lowest_mos.reported, &c->created) / 1000000) % 60,
+			se->highest_mos.mos / 10,
+			se->highest_mos.mos % 10,
+			(unsigned int) (timeval_diff(&se->highest_mos.reported, &c->created) / 1000000) / 60,
+			(unsigned int) (timeval_diff(&se->highest_mos.reported, &c->created) / 1000000) % 60);
 	}
 	g_list_free(k);
 
@@ -2560,7 +2931,101 @@ no_stats_output:
 
 	__call_cleanup(c);
 
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
+}
+
+/* kernel targets of all calls in a batch are deleted in one go */
+static void call_reap_batch(GQueue *q) {
+	gettimeofday(&rtpe_now, NULL);
+
+	kernel_batch_start();
+	for (GList *l = q->head; l; l = l->next)
+		__call_reap(l->data);
+	kernel_batch_flush();
+
+	struct call *c;
+	while ((c = g_queue_pop_head(q)))
+		obj_put(c);
+}
+
+void call_reaper_loop(void *p) {
+	mutex_lock(&call_reaper_lock);
+	call_reaper_running = 1;
+
+	while (!rtpe_shutdown) {
+		if (!call_reaper_queue.length) {
+			rtpe_now_coarse();
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&call_reaper_cond, &call_reaper_lock, &tv);
+			continue;
+		}
+
+		GQueue batch = G_QUEUE_INIT;
+		while (batch.length < CALL_REAPER_BATCH && call_reaper_queue.length)
+			g_queue_push_tail(&batch, g_queue_pop_head(&call_reaper_queue));
+		mutex_unlock(&call_reaper_lock);
+
+		call_reap_batch(&batch);
+
+		mutex_lock(&call_reaper_lock);
+	}
+
+	// anything left over is done by call_free()
+	call_reaper_running = 0;
+	mutex_unlock(&call_reaper_lock);
+}
+
+/* called lock-free, but must hold a reference to the call */
+void call_destroy(struct call *c) {
+	int ret;
+
+	if (!c) {
+		return;
+	}
+
+	struct callhash_shard *shard = callhash_shard(&c->callid);
+	rwlock_lock_w(&shard->lock);
+	ret = (g_hash_table_lookup(shard->ht, &c->callid) == c);
+	if (ret) {
+		g_hash_table_remove(shard->ht, &c->callid);
+		atomic64_dec(&rtpe_callhash_size);
+	}
+	rwlock_unlock_w(&shard->lock);
+
+	// if call not found in callhash => previously deleted
+	if (!ret)
+		return;
+
+	statistics_update_foreignown_dec(c);
+
+	if (IS_OWN_CALL(c)) {
+		redis_delete(c, rtpe_redis_write);
+		replication_update(c);
+	}
+
+	// stop forwarding in userspace. the rest (kernel targets, sockets and their
+	// firewall rules, codecs, timers, CDR) is left to the reaper thread, so that
+	// this stays quick even during mass hangups
+	call_lock_w(c);
+	c->drop_traffic = 1;
+	c->destroyed = 1;
+	call_unlock_w(c);
+
+	// the reference from the call hash goes to the reaper
+	mutex_lock(&call_reaper_lock);
+	if (call_reaper_running) {
+		g_queue_push_tail(&call_reaper_queue, c);
+		if (call_reaper_queue.length == 1)
+			cond_signal(&call_reaper_cond);
+		c = NULL;
+	}
+	mutex_unlock(&call_reaper_lock);
+
+	if (c) {
+		__call_reap(c);
+		obj_put(c);
+	}
 }
 
 
@@ -2606,16 +3071,21 @@ static void __call_free(void *p) {
 
 	//ilog(LOG_DEBUG, "freeing main call struct");
 
-	obj_put(c->dtls_cert);
+	if (c->dtls_cert)
+		obj_put(c->dtls_cert);
+	if (c->redis_fields)
+		g_hash_table_destroy(c->redis_fields);
 
 	while (c->monologues.head) {
 		m = g_queue_pop_head(&c->monologues);
 
 		g_queue_clear(&m->medias);
-		g_hash_table_destroy(m->other_tags);
-		g_hash_table_destroy(m->branches);
-		g_hash_table_destroy(m->media_ids);
-		g_slice_free1(sizeof(*m), m);
+		str_map_free(&m->other_tags);
+		str_map_free(&m->branches);
+		str_map_free(&m->media_ids);
+		g_free(m->sdp_cache_in.s);
+		g_free(m->sdp_cache_out.s);
+		call_obj_free(c, sizeof(*m), m);
 	}
 
 	while (c->medias.head) {
@@ -2625,6 +3095,8 @@ static void __call_free(void *p) {
 		crypto_params_sdes_queue_clear(&md->sdes_out);
 		g_queue_clear(&md->streams);
 		g_queue_clear(&md->endpoint_maps);
+		if (md->endpoint_maps_ht)
+			g_hash_table_destroy(md->endpoint_maps_ht);
 		g_hash_table_destroy(md->codecs_recv);
 		g_hash_table_destroy(md->codecs_send);
 		g_hash_table_destroy(md->codec_names_recv);
@@ -2634,33 +3106,36 @@ static void __call_free(void *p) {
 		codec_handlers_free(md);
 		codec_handler_free(&md->t38_handler);
 		t38_gateway_put(&md->t38_gateway);
+		simulcast_free(&md->simulcast);
 		g_queue_clear_full(&md->sdp_attributes, free);
-		g_slice_free1(sizeof(*md), md);
+		call_obj_free(c, sizeof(*md), md);
 	}
 
 	while (c->endpoint_maps.head) {
 		em = g_queue_pop_head(&c->endpoint_maps);
 
 		g_queue_clear_full(&em->intf_sfds, (void *) free_intf_list);
-		g_slice_free1(sizeof(*em), em);
+		call_obj_free(c, sizeof(*em), em);
 	}
 
-	g_hash_table_destroy(c->tags);
-	g_hash_table_destroy(c->viabranches);
-	g_hash_table_destroy(c->labels);
+	str_map_free(&c->tags);
+	str_map_free(&c->viabranches);
+	str_map_free(&c->labels);
 	free_ssrc_hash(&c->ssrc_hash);
 
 	while (c->streams.head) {
 		ps = g_queue_pop_head(&c->streams);
 		crypto_cleanup(&ps->crypto);
 		g_queue_clear(&ps->sfds);
-		g_hash_table_destroy(ps->rtp_stats);
 		ssrc_ctx_put(&ps->ssrc_in);
 		ssrc_ctx_put(&ps->ssrc_out);
-		g_slice_free1(sizeof(*ps), ps);
+		ssrc_ctx_put(&ps->ssrc_in_alt);
+		ssrc_ctx_put(&ps->ssrc_out_alt);
+		call_obj_free(c, sizeof(*ps), ps);
 	}
 
 	call_buffer_free(&c->buffer);
+	arena_free(&c->arena);
 	mutex_destroy(&c->buffer_lock);
 	rwlock_destroy(&c->master_lock);
 
@@ -2674,15 +3149,17 @@ static struct call *call_create(const str *callid) {
 	c = obj_alloc0("call", sizeof(*c), __call_free);
 	mutex_init(&c->buffer_lock);
 	call_buffer_init(&c->buffer);
+	arena_new(&c->arena);
 	rwlock_init(&c->master_lock);
-	c->tags = g_hash_table_new(str_hash, str_equal);
-	c->viabranches = g_hash_table_new(str_hash, str_equal);
-	c->labels = g_hash_table_new(str_hash, str_equal);
 	call_str_cpy(c, &c->callid, callid);
 	c->created = rtpe_now;
 	c->dtls_cert = dtls_cert();
 	c->tos = rtpe_config.default_tos;
 	c->ssrc_hash = create_ssrc_hash_call();
+	c->ssrc_hash->mem = &c->mem[CALL_MEM_SSRC];
+	c->poller = rtpe_poller;
+	if (rtpe_media_pollers)
+		c->poller = rtpe_media_pollers[str_hash(&c->callid) % rtpe_config.media_pollers];
 
 	return c;
 }
@@ -2690,54 +3167,129 @@ static struct call *call_create(const str *callid) {
 /* returns call with master_lock held in W */
 struct call *call_get_or_create(const str *callid, int foreign) {
 	struct call *c;
+	struct callhash_shard *shard = callhash_shard(callid);
 
 restart:
-	rwlock_lock_r(&rtpe_callhash_lock);
-	c = g_hash_table_lookup(rtpe_callhash, callid);
+	rwlock_lock_r(&shard->lock);
+	c = g_hash_table_lookup(shard->ht, callid);
 	if (!c) {
-		rwlock_unlock_r(&rtpe_callhash_lock);
+		rwlock_unlock_r(&shard->lock);
 		/* completely new call-id, create call */
 		c = call_create(callid);
-		rwlock_lock_w(&rtpe_callhash_lock);
-		if (g_hash_table_lookup(rtpe_callhash, callid)) {
+		rwlock_lock_w(&shard->lock);
+		if (g_hash_table_lookup(shard->ht, callid)) {
 			/* preempted */
-			rwlock_unlock_w(&rtpe_callhash_lock);
+			rwlock_unlock_w(&shard->lock);
 			obj_put(c);
 			goto restart;
 		}
-		g_hash_table_insert(rtpe_callhash, &c->callid, obj_get(c));
+		g_hash_table_insert(shard->ht, &c->callid, obj_get(c));
+		atomic64_inc(&rtpe_callhash_size);
 
 		c->foreign_call = foreign;
 
 		statistics_update_foreignown_inc(c);
 
-		rwlock_lock_w(&c->master_lock);
-		rwlock_unlock_w(&rtpe_callhash_lock);
+		call_lock_w(c);
+		rwlock_unlock_w(&shard->lock);
 	}
 	else {
 		obj_hold(c);
-		rwlock_lock_w(&c->master_lock);
-		rwlock_unlock_r(&rtpe_callhash_lock);
+		call_lock_w(c);
+		rwlock_unlock_r(&shard->lock);
 	}
 
+	c->timer_next_check = 0; // signalling can change timeouts
+
 	log_info_call(c);
 	return c;
 }
 
+// Read locking for the packet path. Taking master_lock in R writes to the lock itself,
+// so every packet of a call would bounce its cache line between the threads handling
+// it. Instead, a reader marks the call in its own per-thread slot and checks that no
+// writer is present. A writer announces itself in packet_writers, takes master_lock
+// in W, and then waits until no slot has the call marked. Readers that find a writer
+// present fall back to taking master_lock in R. Both sides use sequentially consistent
+// operations so that at least one of them sees the other.
+struct packet_reader {
+	struct call *call;
+	struct packet_reader *next;
+} __attribute__ ((aligned (64)));
+
+static struct packet_reader *packet_readers; // only ever grows
+static __thread struct packet_reader *packet_reader_self;
+
+static struct packet_reader *packet_reader_get(void) {
+	struct packet_reader *r = packet_reader_self;
+	if (G_LIKELY(r))
+		return r;
+	if (posix_memalign((void **) &r, 64, sizeof(*r)))
+		abort();
+	ZERO(*r);
+	do
+		r->next = __atomic_load_n(&packet_readers, __ATOMIC_SEQ_CST);
+	while (!__atomic_compare_exchange_n(&packet_readers, &r->next, r, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	packet_reader_self = r;
+	return r;
+}
+
+void call_packet_lock(struct call *c) {
+	struct packet_reader *r = packet_reader_get();
+	if (G_LIKELY(!r->call)) {
+		__atomic_store_n(&r->call, c, __ATOMIC_SEQ_CST);
+		if (G_LIKELY(!__atomic_load_n(&c->packet_writers, __ATOMIC_SEQ_CST)))
+			return;
+		__atomic_store_n(&r->call, NULL, __ATOMIC_SEQ_CST);
+	}
+	// writer present, or a call marked already
+	rwlock_lock_r(&c->master_lock);
+}
+
+void call_packet_unlock(struct call *c) {
+	struct packet_reader *r = packet_reader_self;
+	if (r && r->call == c) {
+		__atomic_store_n(&r->call, NULL, __ATOMIC_RELEASE);
+		return;
+	}
+	rwlock_unlock_r(&c->master_lock);
+}
+
+// master_lock in W, also excluding packet readers
+void call_lock_w(struct call *c) {
+	__atomic_add_fetch(&c->packet_writers, 1, __ATOMIC_SEQ_CST);
+	rwlock_lock_w(&c->master_lock);
+	for (struct packet_reader *r = __atomic_load_n(&packet_readers, __ATOMIC_SEQ_CST); r;
+			r = r->next)
+	{
+		while (__atomic_load_n(&r->call, __ATOMIC_SEQ_CST) == c)
+			sched_yield();
+	}
+}
+
+void call_unlock_w(struct call *c) {
+	rwlock_unlock_w(&c->master_lock);
+	__atomic_sub_fetch(&c->packet_writers, 1, __ATOMIC_SEQ_CST);
+}
+
 /* returns call with master_lock held in W, or NULL if not found */
 struct call *call_get(const str *callid) {
 	struct call *ret;
+	struct callhash_shard *shard = callhash_shard(callid);
 
-	rwlock_lock_r(&rtpe_callhash_lock);
-	ret = g_hash_table_lookup(rtpe_callhash, callid);
+	rwlock_lock_r(&shard->lock);
+	ret = g_hash_table_lookup(shard->ht, callid);
 	if (!ret) {
-		rwlock_unlock_r(&rtpe_callhash_lock);
+		rwlock_unlock_r(&shard->lock);
 		return NULL;
 	}
 
-	rwlock_lock_w(&ret->master_lock);
+	call_lock_w(ret);
 	obj_hold(ret);
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	rwlock_unlock_r(&shard->lock);
+
+	ret->timer_next_check = 0; // signalling can change timeouts
 
 	log_info_call(ret);
 	return ret;
@@ -2755,13 +3307,10 @@ struct call_monologue *__monologue_create(struct call *call) {
 	struct call_monologue *ret;
 
 	__C_DBG("creating new monologue");
-	ret = uid_slice_alloc0(ret, &call->monologues);
+	ret = call_uid_alloc0(call, ret, &call->monologues);
 
 	ret->call = call;
 	ret->created = rtpe_now.tv_sec;
-	ret->other_tags = g_hash_table_new(str_hash, str_equal);
-	ret->branches = g_hash_table_new(str_hash, str_equal);
-	ret->media_ids = g_hash_table_new(str_hash, str_equal);
 
 	g_queue_init(&ret->medias);
 	gettimeofday(&ret->started, NULL);
@@ -2775,9 +3324,9 @@ void __monologue_tag(struct call_monologue *ml, const str *tag) {
 
 	__C_DBG("tagging monologue with '"STR_FORMAT"'", STR_FMT(tag));
 	if (ml->tag.s)
-		g_hash_table_remove(call->tags, &ml->tag);
+		str_map_remove(&call->tags, &ml->tag);
 	call_str_cpy(call, &ml->tag, tag);
-	g_hash_table_insert(call->tags, &ml->tag, ml);
+	str_map_insert(&call->tags, &ml->tag, ml);
 }
 void __monologue_viabranch(struct call_monologue *ml, const str *viabranch) {
 	struct call *call = ml->call;
@@ -2788,14 +3337,14 @@ void __monologue_viabranch(struct call_monologue *ml, const str *viabranch) {
 
 	__C_DBG("tagging monologue with viabranch '"STR_FORMAT"'", STR_FMT(viabranch));
 	if (ml->viabranch.s) {
-		g_hash_table_remove(call->viabranches, &ml->viabranch);
+		str_map_remove(&call->viabranches, &ml->viabranch);
 		if (other)
-			g_hash_table_remove(other->branches, &ml->viabranch);
+			str_map_remove(&other->branches, &ml->viabranch);
 	}
 	call_str_cpy(call, &ml->viabranch, viabranch);
-	g_hash_table_insert(call->viabranches, &ml->viabranch, ml);
+	str_map_insert(&call->viabranches, &ml->viabranch, ml);
 	if (other)
-		g_hash_table_insert(other->branches, &ml->viabranch, ml);
+		str_map_insert(&other->branches, &ml->viabranch, ml);
 }
 
 /* must be called with call->master_lock held in W */
@@ -2810,6 +3359,8 @@ void __monologue_unkernelize(struct call_monologue *monologue) {
 	monologue->deleted = 0; /* not really related, but indicates activity, so cancel
 				   any pending deletion */
 
+	kernel_batch_start();
+
 	for (l = monologue->medias.head; l; l = l->next) {
 		media = l->data;
 
@@ -2822,6 +3373,8 @@ void __monologue_unkernelize(struct call_monologue *monologue) {
 				__stream_unconfirm(stream->rtcp_sink);
 		}
 	}
+
+	kernel_batch_flush();
 }
 
 /* call locked in R */
@@ -2843,14 +3396,17 @@ static void __monologue_destroy(struct call_monologue *monologue, int recurse) {
 	struct call_monologue *dialogue;
 
 	call = monologue->call;
+	call_sdp_changed(call);
 
 	ilog(LOG_DEBUG, "Destroying monologue '" STR_FORMAT "' (" STR_FORMAT ")",
 			STR_FMT(&monologue->tag),
 			STR_FMT0(&monologue->viabranch));
 
-	g_hash_table_remove(call->tags, &monologue->tag);
+	conference_leave(monologue);
+
+	str_map_remove(&call->tags, &monologue->tag);
 	if (monologue->viabranch.s)
-		g_hash_table_remove(call->viabranches, &monologue->viabranch);
+		str_map_remove(&call->viabranches, &monologue->viabranch);
 
 	for (GList *l = call->monologues.head; l; l = l->next) {
 		dialogue = l->data;
@@ -2859,20 +3415,20 @@ static void __monologue_destroy(struct call_monologue *monologue, int recurse) {
 			continue;
 		if (monologue->tag.len
 				&& dialogue->tag.len
-				&& !g_hash_table_lookup(dialogue->other_tags, &monologue->tag))
+				&& !str_map_lookup(&dialogue->other_tags, &monologue->tag))
 			continue;
 		if (monologue->viabranch.len
 				&& !monologue->tag.len
-				&& !g_hash_table_lookup(dialogue->branches, &monologue->viabranch))
+				&& !str_map_lookup(&dialogue->branches, &monologue->viabranch))
 			continue;
 		if (!dialogue->tag.len
 				&& dialogue->viabranch.len
-				&& !g_hash_table_lookup(monologue->branches, &dialogue->viabranch))
+				&& !str_map_lookup(&monologue->branches, &dialogue->viabranch))
 			continue;
 
-		g_hash_table_remove(dialogue->other_tags, &monologue->tag);
-		g_hash_table_remove(dialogue->branches, &monologue->viabranch);
-		if (recurse && !g_hash_table_size(dialogue->other_tags) && !g_hash_table_size(dialogue->branches))
+		str_map_remove(&dialogue->other_tags, &monologue->tag);
+		str_map_remove(&dialogue->branches, &monologue->viabranch);
+		if (recurse && !str_map_size(&dialogue->other_tags) && !str_map_size(&dialogue->branches))
 			__monologue_destroy(dialogue, 0);
 	}
 
@@ -2885,7 +3441,7 @@ static int monologue_destroy(struct call_monologue *ml) {
 
 	__monologue_destroy(ml, 1);
 
-	if (g_hash_table_size(c->tags) < 2 && g_hash_table_size(c->viabranches) == 0) {
+	if (str_map_size(&c->tags) < 2 && str_map_size(&c->viabranches) == 0) {
 		ilog(LOG_INFO, "Call branch '" STR_FORMAT_M "' (%s" STR_FORMAT "%svia-branch '" STR_FORMAT_M "') "
 				"deleted, no more branches remaining",
 				STR_FMT_M(&ml->tag),
@@ -2915,8 +3471,8 @@ static void __fix_other_tags(struct call_monologue *one) {
 	if (!two || !two->tag.len)
 		return;
 
-	g_hash_table_insert(one->other_tags, &two->tag, two);
-	g_hash_table_insert(two->other_tags, &one->tag, one);
+	str_map_insert(&one->other_tags, &two->tag, two);
+	str_map_insert(&two->other_tags, &one->tag, one);
 }
 
 /* must be called with call->master_lock held in W */
@@ -2927,7 +3483,7 @@ static struct call_monologue *call_get_monologue(struct call *call, const str *f
 
 	__C_DBG("getting monologue for tag '"STR_FORMAT"' in call '"STR_FORMAT"'",
 			STR_FMT(fromtag), STR_FMT(&call->callid));
-	ret = g_hash_table_lookup(call->tags, fromtag);
+	ret = str_map_lookup(&call->tags, fromtag);
 	if (!ret) {
 		ret = __monologue_create(call);
 		__monologue_tag(ret, fromtag);
@@ -2951,7 +3507,7 @@ static struct call_monologue *call_get_monologue(struct call *call, const str *f
 	}
 	if (!str_cmp_str(&ret->active_dialogue->viabranch, viabranch))
 		goto ok_check_tag; /* dialogue still intact */
-	os = g_hash_table_lookup(call->viabranches, viabranch);
+	os = str_map_lookup(&call->viabranches, viabranch);
 	if (os) {
 		/* previously seen branch. use it */
 		__monologue_unkernelize(os);
@@ -2988,12 +3544,12 @@ static struct call_monologue *call_get_dialogue(struct call *call, const str *fr
 			STR_FMT(fromtag), STR_FMT(totag), STR_FMT(&call->callid));
 
 	/* we start with the to-tag. if it's not known, we treat it as a branched offer */
-	tt = g_hash_table_lookup(call->tags, totag);
+	tt = str_map_lookup(&call->tags, totag);
 	if (!tt)
 		return call_get_monologue(call, fromtag, totag, viabranch);
 
 	/* if the from-tag is known already, return that */
-	ft = g_hash_table_lookup(call->tags, fromtag);
+	ft = str_map_lookup(&call->tags, fromtag);
 	if (ft) {
 		__C_DBG("found existing dialogue");
 
@@ -3005,7 +3561,7 @@ static struct call_monologue *call_get_dialogue(struct call *call, const str *fr
 	else {
 		/* perhaps we can determine the monologue from the viabranch */
 		if (viabranch)
-			ft = g_hash_table_lookup(call->viabranches, viabranch);
+			ft = str_map_lookup(&call->viabranches, viabranch);
 	}
 
 	if (!ft) {
@@ -3064,7 +3620,19 @@ static void monologue_stop(struct call_monologue *ml) {
 int call_delete_branch(const str *callid, const str *branch,
 	const str *fromtag, const str *totag, bencode_item_t *output, int delete_delay)
 {
-	struct call *c;
+	struct call *c = call_get(callid);
+	if (!c) {
+		ilog(LOG_INFO, "Call-ID to delete not found");
+		return -1;
+	}
+	return call_delete_branch_call(c, branch, fromtag, totag, output, delete_delay, NG_STATS_ALL);
+}
+
+/* call must be locked in W and a reference held, both of which are released */
+int call_delete_branch_call(struct call *c, const str *branch,
+	const str *fromtag, const str *totag, bencode_item_t *output, int delete_delay,
+	unsigned int stats_fields)
+{
 	struct call_monologue *ml;
 	int ret;
 	const str *match_tag;
@@ -3073,11 +3641,7 @@ int call_delete_branch(const str *callid, const str *branch,
 	if (delete_delay < 0)
 		delete_delay = rtpe_config.delete_delay;
 
-	c = call_get(callid);
-	if (!c) {
-		ilog(LOG_INFO, "Call-ID to delete not found");
-		goto err;
-	}
+	call_sdp_changed(c);
 
 	for (i = c->monologues.head; i; i = i->next) {
 		ml = i->data;
@@ -3090,18 +3654,18 @@ int call_delete_branch(const str *callid, const str *branch,
 
 	if ((!totag || !totag->len) && branch && branch->len) {
 		// try a via-branch match
-		ml = g_hash_table_lookup(c->viabranches, branch);
+		ml = str_map_lookup(&c->viabranches, branch);
 		if (ml)
 			goto do_delete;
 	}
 
 	match_tag = (totag && totag->len) ? totag : fromtag;
 
-	ml = g_hash_table_lookup(c->tags, match_tag);
+	ml = str_map_lookup(&c->tags, match_tag);
 	if (!ml) {
 		if (branch && branch->len) {
 			// also try a via-branch match here
-			ml = g_hash_table_lookup(c->viabranches, branch);
+			ml = str_map_lookup(&c->viabranches, branch);
 			if (ml)
 				goto do_delete;
 		}
@@ -3109,7 +3673,7 @@ int call_delete_branch(const str *callid, const str *branch,
 		// last resort: try the from-tag if we tried the to-tag before and see
 		// if the associated dialogue has an empty tag (unknown)
 		if (match_tag == totag) {
-			ml = g_hash_table_lookup(c->tags, fromtag);
+			ml = str_map_lookup(&c->tags, fromtag);
 			if (ml && ml->active_dialogue && ml->active_dialogue->tag.len == 0)
 				goto do_delete;
 		}
@@ -3121,7 +3685,7 @@ int call_delete_branch(const str *callid, const str *branch,
 
 do_delete:
 	if (output)
-		ng_call_stats(c, fromtag, totag, output, NULL);
+		ng_call_stats(c, fromtag, totag, output, NULL, stats_fields);
 
 	monologue_stop(ml);
 	if (ml->active_dialogue && ml->active_dialogue->active_dialogue == ml)
@@ -3152,30 +3716,28 @@ del_all:
 	if (delete_delay > 0) {
 		ilog(LOG_INFO, "Scheduling deletion of entire call in %d seconds", delete_delay);
 		c->deleted = rtpe_now.tv_sec + delete_delay;
-		rwlock_unlock_w(&c->master_lock);
+		call_unlock_w(c);
 	}
 	else {
 		ilog(LOG_INFO, "Deleting entire call");
-		rwlock_unlock_w(&c->master_lock);
+		call_unlock_w(c);
 		call_destroy(c);
 	}
 	goto success;
 
 success_unlock:
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 success:
 	ret = 0;
 	goto out;
 
 err:
-	if (c)
-		rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 	ret = -1;
 	goto out;
 
 out:
-	if (c)
-		obj_put(c);
+	obj_put(c);
 	return ret;
 }
 
@@ -3186,8 +3748,6 @@ static void call_get_all_calls_interator(void *key, void *val, void *ptr) {
 }
 
 void call_get_all_calls(GQueue *q) {
-	rwlock_lock_r(&rtpe_callhash_lock);
-	g_hash_table_foreach(rtpe_callhash, call_get_all_calls_interator, q);
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	calls_foreach(call_get_all_calls_interator, q);
 
 }
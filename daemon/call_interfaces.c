@@ -4,7 +4,6 @@
 #include <unistd.h>
 #include <glib.h>
 #include <stdlib.h>
-#include <pcre.h>
 #include <inttypes.h>
 
 #include "call_interfaces.h"
@@ -29,13 +28,11 @@
 #include "load.h"
 #include "media_player.h"
 #include "dtmf.h"
+#include "replication.h"
+#include "codec.h"
+#include "conference.h"
 
 
-static pcre *info_re;
-static pcre_extra *info_ree;
-static pcre *streams_re;
-static pcre_extra *streams_ree;
-
 int trust_address_def;
 int dtls_passive_def;
 
@@ -202,9 +199,10 @@ static str *call_update_lookup_udp(char **out, enum call_opmode opmode, const ch
 
 	ret = streams_print(&monologue->active_dialogue->medias,
 			sp.index, sp.index, out[RE_UDP_COOKIE], SAF_UDP);
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 
 	redis_update_onekey(c, rtpe_redis_write);
+	replication_update(c);
 
 	gettimeofday(&(monologue->started), NULL);
 
@@ -221,7 +219,7 @@ addr_fail:
 	goto unlock_fail;
 
 unlock_fail:
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 	ret = str_sprintf("%s E8\n", out[RE_UDP_COOKIE]);
 out:
 	obj_put(c);
@@ -236,31 +234,41 @@ str *call_lookup_udp(char **out) {
 }
 
 
-static int info_parse_func(char **a, void **ret, void *p) {
-	GHashTable *ih = p;
-
-	g_hash_table_replace(ih, strdup(a[0]), strdup(a[1]));
-
-	return -1;
-}
-
+// comma-separated "key:value" list. a key without a value gets an empty string, as with
+// the RE this replaced
 static void info_parse(const char *s, GHashTable *ih) {
-	pcre_multi_match(info_re, info_ree, s, 2, info_parse_func, ih, NULL);
+	size_t klen, vlen;
+	const char *k, *v;
+
+	while (*s && *s != ':' && *s != ',') {
+		k = s;
+		klen = strcspn(s, ":,");
+		s += klen;
+		v = "";
+		vlen = 0;
+		if (*s == ':') {
+			v = ++s;
+			vlen = strcspn(s, ",");
+			s += vlen;
+		}
+		if (*s == ',')
+			s++;
+
+		g_hash_table_replace(ih, strndup(k, klen), strndup(v, vlen));
+	}
 }
 
 
-static int streams_parse_func(char **a, void **ret, void *p) {
+static struct stream_params *streams_parse_one(const char *addr, const char *port, int *i) {
 	struct stream_params *sp;
-	int *i;
 
-	i = p;
 	sp = g_slice_alloc0(sizeof(*sp));
 
 	SP_SET(sp, SEND);
 	SP_SET(sp, RECV);
 	sp->protocol = &transport_protocols[PROTO_RTP_AVP];
 
-	if (endpoint_parse_port_any(&sp->rtp_endpoint, a[0], atoi(a[1])))
+	if (endpoint_parse_port_any(&sp->rtp_endpoint, addr, atoi(port)))
 		goto fail;
 
 	sp->index = ++(*i);
@@ -269,23 +277,47 @@ static int streams_parse_func(char **a, void **ret, void *p) {
 	sp->rtcp_endpoint = sp->rtp_endpoint;
 	sp->rtcp_endpoint.port++;
 
-	if (!sp->rtp_endpoint.port && strcmp(a[1], "0"))
+	if (!sp->rtp_endpoint.port && strcmp(port, "0"))
 		goto fail;
 
-	*ret = sp;
-	return 0;
+	return sp;
 
 fail:
-	ilog(LOG_WARNING, "Failed to parse a media stream: %s%s:%s%s", FMT_M(a[0], a[1]));
+	ilog(LOG_WARNING, "Failed to parse a media stream: %s%s:%s%s", FMT_M(addr, port));
 	g_slice_free1(sizeof(*sp), sp);
-	return -1;
+	return NULL;
 }
 
 
+// comma-separated "addr:port" list, anything after another colon is ignored
 static void streams_parse(const char *s, GQueue *q) {
-	int i;
-	i = 0;
-	pcre_multi_match(streams_re, streams_ree, s, 3, streams_parse_func, &i, q);
+	int i = 0;
+	size_t alen, plen;
+	char addr[64], port[16];
+	struct stream_params *sp;
+
+	while (1) {
+		alen = strspn(s, "0123456789.");
+		if (!alen || s[alen] != ':')
+			break;
+		plen = strspn(s + alen + 1, "0123456789");
+		if (!plen)
+			break;
+		snprintf(addr, sizeof(addr), "%.*s", (int) alen, s);
+		snprintf(port, sizeof(port), "%.*s", (int) plen, s + alen + 1);
+
+		s += alen + 1 + plen;
+		if (*s == ':')
+			s += strcspn(s, ",");
+		else if (*s && *s != ',')
+			break;
+		if (*s == ',')
+			s++;
+
+		sp = streams_parse_one(addr, port, &i);
+		if (sp)
+			g_queue_push_tail(q, sp);
+	}
 }
 
 /* XXX move these somewhere else */
@@ -348,10 +380,11 @@ static str *call_request_lookup_tcp(char **out, enum call_opmode opmode) {
 	ret = streams_print(&monologue->active_dialogue->medias, 1, s.length, NULL, SAF_TCP);
 
 out2:
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 	streams_free(&s);
 
 	redis_update_onekey(c, rtpe_redis_write);
+	replication_update(c);
 
 	ilog(LOG_INFO, "Returning to SIP proxy: "STR_FORMAT"", STR_FMT0(ret));
 	obj_put(c);
@@ -401,9 +434,9 @@ str *call_query_udp(char **out) {
 		goto err;
 	}
 
-	ng_call_stats(c, &fromtag, &totag, NULL, &stats);
+	ng_call_stats(c, &fromtag, &totag, NULL, &stats, NG_STATS_TOTALS);
 
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 
 	rwlock_lock_r(&rtpe_config.config_lock);
 	ret = str_sprintf("%s %lld "UINT64F" "UINT64F" "UINT64F" "UINT64F"\n", out[RE_UDP_COOKIE],
@@ -415,7 +448,7 @@ str *call_query_udp(char **out) {
 
 err:
 	if (c)
-		rwlock_unlock_w(&c->master_lock);
+		call_unlock_w(c);
 	ret = str_sprintf("%s E8\n", out[RE_UDP_COOKIE]);
 	goto out;
 
@@ -655,19 +688,24 @@ INLINE void ng_t38_option(struct sdp_ng_flags *out, str *s, void *dummy) {
 #endif
 
 
-static void call_ng_flags_list(struct sdp_ng_flags *out, bencode_item_t *input, const char *key,
+static void call_ng_flags_list_item(struct sdp_ng_flags *out, bencode_item_t *list,
 		void (*callback)(struct sdp_ng_flags *, str *, void *), void *parm)
 {
-	bencode_item_t *list, *it;
+	bencode_item_t *it;
 	str s;
-	if ((list = bencode_dictionary_get_expect(input, key, BENCODE_LIST))) {
-		for (it = list->child; it; it = it->sibling) {
-			if (!bencode_get_str(it, &s))
-				continue;
-			callback(out, &s, parm);
-		}
+	if (!list || list->type != BENCODE_LIST)
+		return;
+	for (it = list->child; it; it = it->sibling) {
+		if (!bencode_get_str(it, &s))
+			continue;
+		callback(out, &s, parm);
 	}
 }
+static void call_ng_flags_list(struct sdp_ng_flags *out, bencode_item_t *input, const char *key,
+		void (*callback)(struct sdp_ng_flags *, str *, void *), void *parm)
+{
+	call_ng_flags_list_item(out, bencode_dictionary_get(input, key), callback, parm);
+}
 static void call_ng_flags_rtcp_mux(struct sdp_ng_flags *out, str *s, void *dummy) {
 	switch (__csh_lookup(s)) {
 		case CSH_LOOKUP("offer"):
@@ -692,17 +730,24 @@ static void call_ng_flags_rtcp_mux(struct sdp_ng_flags *out, str *s, void *dummy
 }
 static void call_ng_flags_replace(struct sdp_ng_flags *out, str *s, void *dummy) {
 	str_hyphenate(s);
-	if (!str_cmp(s, "origin"))
-		out->replace_origin = 1;
-	else if (!str_cmp(s, "session-connection"))
-		out->replace_sess_conn = 1;
-	else
-		ilog(LOG_WARN, "Unknown 'replace' flag encountered: '" STR_FORMAT "'",
-				STR_FMT(s));
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("origin"):
+			out->replace_origin = 1;
+			break;
+		case CSH_LOOKUP("session-connection"):
+			out->replace_sess_conn = 1;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'replace' flag encountered: '" STR_FORMAT "'",
+					STR_FMT(s));
+	}
 }
 static void call_ng_flags_supports(struct sdp_ng_flags *out, str *s, void *dummy) {
-	if (!str_cmp(s, "load limit"))
-		out->supports_load_limit = 1;
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("load limit"):
+			out->supports_load_limit = 1;
+			break;
+	}
 }
 static str *str_dup_escape(const str *s) {
 	str *ret = str_dup(s);
@@ -826,6 +871,12 @@ static void call_ng_flags_flags(struct sdp_ng_flags *out, str *s, void *dummy) {
 		case CSH_LOOKUP("inject-DTMF"):
 			out->inject_dtmf = 1;
 			break;
+		case CSH_LOOKUP("conference"):
+			out->conference = 1;
+			break;
+		case CSH_LOOKUP("SFU"):
+			out->sfu = 1;
+			break;
 		case CSH_LOOKUP("pad-crypto"):
 			out->sdes_pad = 1;
 			break;
@@ -883,10 +934,150 @@ static void call_ng_flags_flags(struct sdp_ng_flags *out, str *s, void *dummy) {
 					STR_FMT(s));
 	}
 }
+static void call_ng_flags_drop_traffic(struct sdp_ng_flags *out, str *s, void *dummy) {
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("start"):
+			out->drop_traffic_start = 1;
+			break;
+		case CSH_LOOKUP("stop"):
+			out->drop_traffic_stop = 1;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'drop-traffic' flag encountered: '"STR_FORMAT"'",
+					STR_FMT(s));
+	}
+}
+static void call_ng_flags_ice(struct sdp_ng_flags *out, str *s, void *dummy) {
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("remove"):
+			out->ice_option = ICE_REMOVE;
+			break;
+		case CSH_LOOKUP("force"):
+			out->ice_option = ICE_FORCE;
+			break;
+		case CSH_LOOKUP("default"):
+			out->ice_option = ICE_DEFAULT;
+			break;
+		case CSH_LOOKUP("optional"):
+			out->ice_option = ICE_OPTIONAL;
+			break;
+		case CSH_LOOKUP("force_relay"):
+		case CSH_LOOKUP("force-relay"):
+		case CSH_LOOKUP("force relay"):
+			out->ice_option = ICE_FORCE_RELAY;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'ICE' flag encountered: '"STR_FORMAT"'",
+					STR_FMT(s));
+	}
+}
+static void call_ng_flags_ice_lite(struct sdp_ng_flags *out, str *s, void *dummy) {
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("off"):
+		case CSH_LOOKUP("none"):
+		case CSH_LOOKUP("no"):
+			out->ice_lite_option = ICE_LITE_OFF;
+			break;
+		case CSH_LOOKUP("forward"):
+		case CSH_LOOKUP("offer"):
+		case CSH_LOOKUP("fwd"):
+		case CSH_LOOKUP("fw"):
+			out->ice_lite_option = ICE_LITE_FWD;
+			break;
+		case CSH_LOOKUP("backward"):
+		case CSH_LOOKUP("backwards"):
+		case CSH_LOOKUP("reverse"):
+		case CSH_LOOKUP("answer"):
+		case CSH_LOOKUP("back"):
+		case CSH_LOOKUP("bkw"):
+		case CSH_LOOKUP("bk"):
+			out->ice_lite_option = ICE_LITE_BKW;
+			break;
+		case CSH_LOOKUP("both"):
+			out->ice_lite_option = ICE_LITE_BOTH;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'ICE-lite' flag encountered: '" STR_FORMAT "'",
+					STR_FMT(s));
+	}
+}
+static void call_ng_flags_dtls(struct sdp_ng_flags *out, str *s, void *dummy) {
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("passive"):
+			out->dtls_passive = 1;
+			break;
+		case CSH_LOOKUP("active"):
+			out->dtls_passive = 0;
+			break;
+		case CSH_LOOKUP("no"):
+		case CSH_LOOKUP("off"):
+		case CSH_LOOKUP("disabled"):
+		case CSH_LOOKUP("disable"):
+			out->dtls_off = 1;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'DTLS' flag encountered: '"STR_FORMAT"'",
+					STR_FMT(s));
+	}
+}
+static void call_ng_flags_dtls_reverse(struct sdp_ng_flags *out, str *s, void *dummy) {
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("passive"):
+			out->dtls_reverse_passive = 1;
+			break;
+		case CSH_LOOKUP("active"):
+			out->dtls_reverse_passive = 0;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'DTLS-reverse' flag encountered: '"STR_FORMAT"'",
+					STR_FMT(s));
+	}
+}
+static void call_ng_flags_passthrough(struct sdp_ng_flags *out, str *s, void *dummy) {
+	switch (__csh_lookup(s)) {
+		case CSH_LOOKUP("on"):
+		case CSH_LOOKUP("yes"):
+		case CSH_LOOKUP("enable"):
+		case CSH_LOOKUP("enabled"):
+			out->passthrough_on = 1;
+			break;
+		case CSH_LOOKUP("no"):
+		case CSH_LOOKUP("off"):
+		case CSH_LOOKUP("disable"):
+		case CSH_LOOKUP("disabled"):
+			out->passthrough_off = 1;
+			break;
+		default:
+			ilog(LOG_WARN, "Unknown 'passthrough' flag encountered: '"STR_FORMAT"'",
+					STR_FMT(s));
+	}
+}
+// for keys with an alternative spelling: the preferred one wins if both are present
+INLINE void call_ng_flags_alt_str(str *out, bencode_item_t *value, int preferred) {
+	if (preferred || !out->s)
+		bencode_get_str(value, out);
+}
+static void call_ng_flags_codec(struct sdp_ng_flags *out, bencode_item_t *dict) {
+	call_ng_flags_list(out, dict, "strip", call_ng_flags_str_ht, &out->codec_strip);
+	call_ng_flags_list(out, dict, "offer", call_ng_flags_codec_list, &out->codec_offer);
+	call_ng_flags_list(out, dict, "except", call_ng_flags_str_ht, &out->codec_except);
+#ifdef WITH_TRANSCODING
+	if (out->opmode == OP_OFFER) {
+		call_ng_flags_list(out, dict, "transcode", call_ng_flags_codec_list, &out->codec_transcode);
+		call_ng_flags_list(out, dict, "mask", call_ng_flags_str_ht, &out->codec_mask);
+		call_ng_flags_list(out, dict, "set", call_ng_flags_str_ht_split, &out->codec_set);
+		call_ng_flags_list(out, dict, "accept", call_ng_flags_str_ht, &out->codec_accept);
+		call_ng_flags_list(out, dict, "consume", call_ng_flags_str_ht, &out->codec_consume);
+	}
+#endif
+}
+// walks the input dictionary once, dispatching on the keys through the precomputed
+// CSH_LOOKUP hashes instead of looking up each known key in the dictionary
 static void call_ng_process_flags(struct sdp_ng_flags *out, bencode_item_t *input, enum call_opmode opmode) {
-	bencode_item_t *list, *it, *dict;
-	int diridx;
-	str s;
+	bencode_item_t *key, *value, *it;
+	int diridx, alt = 0;
+	long long int ll;
+	str k, s, transport_protocol_str = STR_NULL;
 
 	ZERO(*out);
 	out->opmode = opmode;
@@ -894,206 +1085,171 @@ static void call_ng_process_flags(struct sdp_ng_flags *out, bencode_item_t *inpu
 	out->trust_address = trust_address_def;
 	out->dtls_passive = dtls_passive_def;
 	out->dtls_reverse_passive = dtls_passive_def;
+	out->tos = 256;
 
+	if (!input || input->type != BENCODE_DICTIONARY)
+		return;
+
+	// these are applied first regardless of key order, so that explicit keys take precedence
 	call_ng_flags_list(out, input, "flags", call_ng_flags_flags, NULL);
 	call_ng_flags_list(out, input, "replace", call_ng_flags_replace, NULL);
 	call_ng_flags_list(out, input, "supports", call_ng_flags_supports, NULL);
 
-	bencode_dictionary_get_str(input, "call-id", &out->call_id);
-	bencode_dictionary_get_str(input, "from-tag", &out->from_tag);
-	bencode_dictionary_get_str(input, "to-tag", &out->to_tag);
-	bencode_dictionary_get_str(input, "via-branch", &out->via_branch);
-	bencode_dictionary_get_str(input, "label", &out->label);
-	bencode_dictionary_get_str(input, "address", &out->address);
-
-	diridx = 0;
-	if ((list = bencode_dictionary_get_expect(input, "direction", BENCODE_LIST))) {
-		for (it = list->child; it && diridx < 2; it = it->sibling)
-			bencode_get_str(it, &out->direction[diridx++]);
-	}
-
-	list = bencode_dictionary_get_expect(input, "received from", BENCODE_LIST);
-	if (!list)
-		list = bencode_dictionary_get_expect(input, "received-from", BENCODE_LIST);
-	if (list && (it = list->child)) {
-		bencode_get_str(it, &out->received_from_family);
-		bencode_get_str(it->sibling, &out->received_from_address);
-	}
+	for (key = input->child; key; key = value->sibling) {
+		value = key->sibling;
+		if (!value)
+			break;
+		if (!bencode_get_str(key, &k))
+			continue;
 
-	if (bencode_dictionary_get_str(input, "drop-traffic", &s)) {
-		switch (__csh_lookup(&s)) {
-			case CSH_LOOKUP("start"):
-				out->drop_traffic_start = 1;
+		switch (__csh_lookup(&k)) {
+			case CSH_LOOKUP("call-id"):
+				bencode_get_str(value, &out->call_id);
 				break;
-			case CSH_LOOKUP("stop"):
-				out->drop_traffic_stop = 1;
+			case CSH_LOOKUP("from-tag"):
+				bencode_get_str(value, &out->from_tag);
 				break;
-			default:
-				ilog(LOG_WARN, "Unknown 'drop-traffic' flag encountered: '"STR_FORMAT"'",
-						STR_FMT(&s));
-		}
-	}
-
-	if (bencode_dictionary_get_str(input, "ICE", &s)) {
-		switch (__csh_lookup(&s)) {
-			case CSH_LOOKUP("remove"):
-				out->ice_option = ICE_REMOVE;
+			case CSH_LOOKUP("to-tag"):
+				bencode_get_str(value, &out->to_tag);
 				break;
-			case CSH_LOOKUP("force"):
-				out->ice_option = ICE_FORCE;
+			case CSH_LOOKUP("via-branch"):
+				bencode_get_str(value, &out->via_branch);
 				break;
-			case CSH_LOOKUP("default"):
-				out->ice_option = ICE_DEFAULT;
+			case CSH_LOOKUP("label"):
+				bencode_get_str(value, &out->label);
 				break;
-			case CSH_LOOKUP("optional"):
-				out->ice_option = ICE_OPTIONAL;
+			case CSH_LOOKUP("address"):
+				bencode_get_str(value, &out->address);
 				break;
-			case CSH_LOOKUP("force_relay"):
-			case CSH_LOOKUP("force-relay"):
-			case CSH_LOOKUP("force relay"):
-				out->ice_option = ICE_FORCE_RELAY;
+			case CSH_LOOKUP("direction"):
+				if (value->type != BENCODE_LIST)
+					break;
+				diridx = 0;
+				for (it = value->child; it && diridx < 2; it = it->sibling)
+					bencode_get_str(it, &out->direction[diridx++]);
 				break;
-			default:
-				ilog(LOG_WARN, "Unknown 'ICE' flag encountered: '"STR_FORMAT"'",
-						STR_FMT(&s));
-		}
-	}
-
-	if (bencode_dictionary_get_str(input, "ICE-lite", &s)) {
-		switch (__csh_lookup(&s)) {
-			case CSH_LOOKUP("off"):
-			case CSH_LOOKUP("none"):
-			case CSH_LOOKUP("no"):
-				out->ice_lite_option = ICE_LITE_OFF;
+			case CSH_LOOKUP("received-from"):
+				if (out->received_from_family.s)
+					break;
+				// fall through
+			case CSH_LOOKUP("received from"):
+				if (value->type != BENCODE_LIST || !(it = value->child))
+					break;
+				bencode_get_str(it, &out->received_from_family);
+				bencode_get_str(it->sibling, &out->received_from_address);
 				break;
-			case CSH_LOOKUP("forward"):
-			case CSH_LOOKUP("offer"):
-			case CSH_LOOKUP("fwd"):
-			case CSH_LOOKUP("fw"):
-				out->ice_lite_option = ICE_LITE_FWD;
+			case CSH_LOOKUP("drop-traffic"):
+				if (bencode_get_str(value, &s))
+					call_ng_flags_drop_traffic(out, &s, NULL);
 				break;
-			case CSH_LOOKUP("backward"):
-			case CSH_LOOKUP("backwards"):
-			case CSH_LOOKUP("reverse"):
-			case CSH_LOOKUP("answer"):
-			case CSH_LOOKUP("back"):
-			case CSH_LOOKUP("bkw"):
-			case CSH_LOOKUP("bk"):
-				out->ice_lite_option = ICE_LITE_BKW;
+			case CSH_LOOKUP("ICE"):
+				if (bencode_get_str(value, &s))
+					call_ng_flags_ice(out, &s, NULL);
 				break;
-			case CSH_LOOKUP("both"):
-				out->ice_lite_option = ICE_LITE_BOTH;
+			case CSH_LOOKUP("ICE-lite"):
+				if (bencode_get_str(value, &s))
+					call_ng_flags_ice_lite(out, &s, NULL);
 				break;
-			default:
-				ilog(LOG_WARN, "Unknown 'ICE-lite' flag encountered: '" STR_FORMAT "'",
-						STR_FMT(&s));
-		}
-	}
-
-	if (bencode_dictionary_get_str(input, "DTLS", &s)) {
-		switch (__csh_lookup(&s)) {
-			case CSH_LOOKUP("passive"):
-				out->dtls_passive = 1;
+			case CSH_LOOKUP("DTLS"):
+				if (bencode_get_str(value, &s))
+					call_ng_flags_dtls(out, &s, NULL);
 				break;
-			case CSH_LOOKUP("active"):
-				out->dtls_passive = 0;
+			case CSH_LOOKUP("DTLS-reverse"):
+				if (bencode_get_str(value, &s))
+					call_ng_flags_dtls_reverse(out, &s, NULL);
 				break;
-			case CSH_LOOKUP("no"):
-			case CSH_LOOKUP("off"):
-			case CSH_LOOKUP("disabled"):
-			case CSH_LOOKUP("disable"):
-				out->dtls_off = 1;
+			case CSH_LOOKUP("passthrough"):
+				if (bencode_get_str(value, &s))
+					call_ng_flags_passthrough(out, &s, NULL);
 				break;
-			default:
-				ilog(LOG_WARN, "Unknown 'DTLS' flag encountered: '"STR_FORMAT"'",
-						STR_FMT(&s));
-		}
-	}
-
-	if (bencode_dictionary_get_str(input, "DTLS-reverse", &s)) {
-		switch (__csh_lookup(&s)) {
-			case CSH_LOOKUP("passive"):
-				out->dtls_reverse_passive = 1;
+			case CSH_LOOKUP("rtcp-mux"):
+				call_ng_flags_list_item(out, value, call_ng_flags_rtcp_mux, NULL);
 				break;
-			case CSH_LOOKUP("active"):
-				out->dtls_reverse_passive = 0;
+			case CSH_LOOKUP("SDES"):
+				call_ng_flags_list_item(out, value, ng_sdes_option, NULL);
+				break;
+			case CSH_LOOKUP("OSRTP"):
+				call_ng_flags_list_item(out, value, ng_osrtp_option, NULL);
+				break;
+#ifdef WITH_TRANSCODING
+			case CSH_LOOKUP("T38"):
+			case CSH_LOOKUP("T.38"):
+				call_ng_flags_list_item(out, value, ng_t38_option, NULL);
+				break;
+#endif
+			case CSH_LOOKUP("transport-protocol"):
+				alt = 1;
+				// fall through
+			case CSH_LOOKUP("transport protocol"):
+				call_ng_flags_alt_str(&transport_protocol_str, value, alt);
+				break;
+			case CSH_LOOKUP("media-address"):
+				alt = 1;
+				// fall through
+			case CSH_LOOKUP("media address"):
+				call_ng_flags_alt_str(&out->media_address, value, alt);
+				break;
+			case CSH_LOOKUP("address-family"):
+				alt = 1;
+				// fall through
+			case CSH_LOOKUP("address family"):
+				call_ng_flags_alt_str(&out->address_family_str, value, alt);
+				break;
+			case CSH_LOOKUP("record-call"):
+				alt = 1;
+				// fall through
+			case CSH_LOOKUP("record call"):
+				call_ng_flags_alt_str(&out->record_call_str, value, alt);
+				break;
+			case CSH_LOOKUP("TOS"):
+				out->tos = bencode_get_int_str(value, 256);
+				break;
+			case CSH_LOOKUP("metadata"):
+				bencode_get_str(value, &out->metadata);
+				break;
+			case CSH_LOOKUP("DTLS-fingerprint"):
+				bencode_get_str(value, &out->dtls_fingerprint);
+				break;
+			case CSH_LOOKUP("ptime"):
+				if (opmode == OP_OFFER)
+					out->ptime = bencode_get_int_str(value, 0);
+				break;
+			case CSH_LOOKUP("ptime-reverse"):
+				alt = 1;
+				// fall through
+			case CSH_LOOKUP("ptime reverse"):
+				ll = bencode_get_int_str(value, 0);
+				if (opmode == OP_OFFER && ll && (alt || !out->rev_ptime))
+					out->rev_ptime = ll;
+				break;
+			case CSH_LOOKUP("xmlrpc-callback"):
+				if (!bencode_get_str(value, &s))
+					break;
+				if (sockaddr_parse_any_str(&out->xmlrpc_callback, &s))
+					ilog(LOG_WARN, "Failed to parse 'xmlrpc-callback' address '" STR_FORMAT "'",
+							STR_FMT(&s));
+				break;
+			case CSH_LOOKUP("codec"):
+				if (value->type == BENCODE_DICTIONARY)
+					call_ng_flags_codec(out, value);
 				break;
-			default:
-				ilog(LOG_WARN, "Unknown 'DTLS-reverse' flag encountered: '"STR_FORMAT"'",
-						STR_FMT(&s));
 		}
+
+		alt = 0;
 	}
 
-	if (bencode_dictionary_get_str(input, "passthrough", &s)) {
-		switch (__csh_lookup(&s)) {
-			case CSH_LOOKUP("on"):
-			case CSH_LOOKUP("yes"):
-			case CSH_LOOKUP("enable"):
-			case CSH_LOOKUP("enabled"):
-				out->passthrough_on = 1;
-				break;
-			case CSH_LOOKUP("no"):
-			case CSH_LOOKUP("off"):
-			case CSH_LOOKUP("disable"):
-			case CSH_LOOKUP("disabled"):
-				out->passthrough_off = 1;
+	if (transport_protocol_str.s) {
+		switch (__csh_lookup(&transport_protocol_str)) {
+			case CSH_LOOKUP("accept"):
+				out->protocol_accept = 1;
 				break;
 			default:
-				ilog(LOG_WARN, "Unknown 'passthrough' flag encountered: '"STR_FORMAT"'",
-						STR_FMT(&s));
+				out->transport_protocol = transport_protocol(&transport_protocol_str);
 		}
 	}
 
-	call_ng_flags_list(out, input, "rtcp-mux", call_ng_flags_rtcp_mux, NULL);
-	call_ng_flags_list(out, input, "SDES", ng_sdes_option, NULL);
-	call_ng_flags_list(out, input, "OSRTP", ng_osrtp_option, NULL);
-#ifdef WITH_TRANSCODING
-	call_ng_flags_list(out, input, "T38", ng_t38_option, NULL);
-	call_ng_flags_list(out, input, "T.38", ng_t38_option, NULL);
-#endif
-
-	str transport_protocol_str;
-	bencode_get_alt(input, "transport-protocol", "transport protocol", &transport_protocol_str);
-	if (!str_cmp(&transport_protocol_str, "accept"))
-		out->protocol_accept = 1;
-	else
-		out->transport_protocol = transport_protocol(&transport_protocol_str);
-
-	bencode_get_alt(input, "media-address", "media address", &out->media_address);
-	if (bencode_get_alt(input, "address-family", "address family", &out->address_family_str))
+	if (out->address_family_str.s)
 		out->address_family = get_socket_family_rfc(&out->address_family_str);
-	out->tos = bencode_dictionary_get_int_str(input, "TOS", 256);
-	bencode_get_alt(input, "record-call", "record call", &out->record_call_str);
-	bencode_dictionary_get_str(input, "metadata", &out->metadata);
-	bencode_dictionary_get_str(input, "DTLS-fingerprint", &out->dtls_fingerprint);
-
-	if (opmode == OP_OFFER) {
-		out->ptime = bencode_dictionary_get_int_str(input, "ptime", 0);
-		out->rev_ptime = bencode_dictionary_get_int_str(input, "ptime-reverse", 0);
-		if (out->rev_ptime == 0)
-			out->rev_ptime = bencode_dictionary_get_int_str(input, "ptime reverse", 0);
-	}
-
-	if (bencode_dictionary_get_str(input, "xmlrpc-callback", &s)) {
-		if (sockaddr_parse_any_str(&out->xmlrpc_callback, &s))
-			ilog(LOG_WARN, "Failed to parse 'xmlrpc-callback' address '" STR_FORMAT "'",
-					STR_FMT(&s));
-	}
-
-	if ((dict = bencode_dictionary_get_expect(input, "codec", BENCODE_DICTIONARY))) {
-		call_ng_flags_list(out, dict, "strip", call_ng_flags_str_ht, &out->codec_strip);
-		call_ng_flags_list(out, dict, "offer", call_ng_flags_codec_list, &out->codec_offer);
-		call_ng_flags_list(out, dict, "except", call_ng_flags_str_ht, &out->codec_except);
-#ifdef WITH_TRANSCODING
-		if (opmode == OP_OFFER) {
-			call_ng_flags_list(out, dict, "transcode", call_ng_flags_codec_list, &out->codec_transcode);
-			call_ng_flags_list(out, dict, "mask", call_ng_flags_str_ht, &out->codec_mask);
-			call_ng_flags_list(out, dict, "set", call_ng_flags_str_ht_split, &out->codec_set);
-			call_ng_flags_list(out, dict, "accept", call_ng_flags_str_ht, &out->codec_accept);
-			call_ng_flags_list(out, dict, "consume", call_ng_flags_str_ht, &out->codec_consume);
-		}
-#endif
-	}
 }
 static void call_ng_free_flags(struct sdp_ng_flags *flags) {
 	if (flags->codec_strip)
@@ -1114,24 +1270,64 @@ static void call_ng_free_flags(struct sdp_ng_flags *flags) {
 	g_queue_clear_full(&flags->codec_transcode, free);
 }
 
+static int call_needs_transcoding(struct call *call) {
+	for (GList *l = call->medias.head; l; l = l->next) {
+		struct call_media *media = l->data;
+		if (MEDIA_ISSET(media, TRANSCODE))
+			return 1;
+	}
+	return 0;
+}
+
+// CPU usage that transcoding the call is estimated to add, in the same units as cpu_usage.
+// 0 if the codecs haven't been benchmarked
+static int call_transcoding_cost(struct call *call) {
+	int64_t ns = 0;
+	for (GList *l = call->medias.head; l; l = l->next) {
+		struct call_media *media = l->data;
+		if (MEDIA_ISSET(media, TRANSCODE))
+			ns += codec_media_cost(media);
+	}
+	return load_cpu_cost(ns);
+}
+
+// a new call that needs transcoding is only taken on if the estimated cost of it stays
+// within max-cpu
+static int call_transcoding_limit(struct call *call) {
+	int cost = call_transcoding_cost(call);
+	if (!cost)
+		return 0;
+
+	rwlock_lock_r(&rtpe_config.config_lock);
+	int cpu_limit = rtpe_config.cpu_limit;
+	rwlock_unlock_r(&rtpe_config.config_lock);
+
+	if (!cpu_limit) {
+		ilog(LOG_INFO, "Transcoding adds an estimated %.2f%% CPU", (double) cost / 100.0);
+		return 0;
+	}
+
+	int cpu = g_atomic_int_get(&cpu_usage);
+	ilog(LOG_INFO, "Transcoding adds an estimated %.2f%% CPU to the current %.2f%%",
+			(double) cost / 100.0, (double) cpu / 100.0);
+	return cpu + cost >= cpu_limit;
+}
+
 static enum load_limit_reasons call_offer_session_limit(void) {
 	enum load_limit_reasons ret = LOAD_LIMIT_NONE;
 
 	rwlock_lock_r(&rtpe_config.config_lock);
 	if (rtpe_config.max_sessions>=0) {
-		rwlock_lock_r(&rtpe_callhash_lock);
-		if (g_hash_table_size(rtpe_callhash) -
+		if (atomic64_get(&rtpe_callhash_size) -
 				atomic64_get(&rtpe_stats.foreign_sessions) >= rtpe_config.max_sessions)
 		{
 			/* foreign calls can't get rejected
 			 * total_rejected_sess applies only to "own" sessions */
-			atomic64_inc(&rtpe_totalstats.total_rejected_sess);
-			atomic64_inc(&rtpe_totalstats_interval.total_rejected_sess);
+			TOTALSTATS_INC(total_rejected_sess);
 			ilog(LOG_ERROR, "Parallel session limit reached (%i)",rtpe_config.max_sessions);
 
 			ret = LOAD_LIMIT_MAX_SESSIONS;
 		}
-		rwlock_unlock_r(&rtpe_callhash_lock);
 	}
 
 	if (ret == LOAD_LIMIT_NONE && rtpe_config.load_limit) {
@@ -1166,6 +1362,90 @@ static enum load_limit_reasons call_offer_session_limit(void) {
 	return ret;
 }
 
+// FNV-1a. decoded items are contiguous in the received message, starting at iov[0]
+static uint64_t __ng_item_hash(uint64_t h, bencode_item_t *it) {
+	const unsigned char *s = it->iov[0].iov_base;
+	for (int i = 0; i < it->str_len; i++) {
+		h ^= s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+// covers all keys and values of the message other than the SDP body
+static uint64_t ng_flags_hash(bencode_item_t *input) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (bencode_item_t *k = input->child; k && k->sibling; k = k->sibling->sibling) {
+		if (!bencode_strcmp(k, "sdp"))
+			continue;
+		h = __ng_item_hash(h, k);
+		h = __ng_item_hash(h, k->sibling);
+	}
+	return h;
+}
+
+// re-INVITEs that are byte-identical to the previous offer or answer of a dialogue get the
+// previous output. this is only valid as long as nothing in the call has changed since
+// that output was produced, which is tracked through call->sdp_gen
+static int ng_sdp_cache_lookup(const struct sdp_ng_flags *flags, const str *sdp, uint64_t flags_hash,
+		bencode_item_t *output)
+{
+	if (flags->fragment)
+		return 0;
+
+	struct call *call = call_get(&flags->call_id);
+	if (!call)
+		return 0;
+
+	int ret = 0;
+	struct call_monologue *ml = str_map_lookup(&call->tags, &flags->from_tag);
+	if (!ml || !ml->sdp_cache_in.s || call->deleted || ml->deleted)
+		goto out;
+	if (call->recording) // wants to see every SDP
+		goto out;
+	if (ml->sdp_cache_gen != call->sdp_gen || ml->sdp_cache_flags != flags_hash)
+		goto out;
+	if (str_cmp_str(&ml->sdp_cache_in, sdp))
+		goto out;
+
+	ilog(LOG_INFO, "SDP is unchanged from the previous one, returning cached output");
+	bencode_dictionary_add_string_len(output, "sdp", ml->sdp_cache_out.s, ml->sdp_cache_out.len);
+	gettimeofday(&ml->started, NULL);
+	// still counts as signalling for the call timeouts
+	call->last_signal = rtpe_now.tv_sec;
+	ret = 1;
+
+out:
+	call_unlock_w(call);
+	obj_put(call);
+	return ret;
+}
+
+/* call must be locked in W */
+static void ng_sdp_cache_store(struct call_monologue *ml, const str *sdp, uint64_t flags_hash,
+		struct sdp_chopper *out)
+{
+	struct call *call = ml->call;
+
+	// processing the same message again without any resulting change leaves the other
+	// cached outputs valid, everything else invalidates them
+	if (!ml->sdp_cache_in.s || ml->sdp_cache_flags != flags_hash
+			|| str_cmp_str(&ml->sdp_cache_in, sdp)
+			|| sdp_chopper_cmp(out, &ml->sdp_cache_out))
+	{
+		call_sdp_changed(call);
+
+		g_free(ml->sdp_cache_in.s);
+		g_free(ml->sdp_cache_out.s);
+		str_init_len(&ml->sdp_cache_in, g_memdup(sdp->s, sdp->len), sdp->len);
+		str_init_len(&ml->sdp_cache_out, g_malloc(out->str_len), out->str_len);
+		sdp_chopper_collapse(out, ml->sdp_cache_out.s);
+		ml->sdp_cache_flags = flags_hash;
+	}
+
+	ml->sdp_cache_gen = call->sdp_gen;
+}
+
 static const char *call_offer_answer_ng(bencode_item_t *input,
 		bencode_item_t *output, enum call_opmode opmode, const char* addr,
 		const endpoint_t *sin)
@@ -1179,6 +1459,8 @@ static const char *call_offer_answer_ng(bencode_item_t *input,
 	int ret;
 	struct sdp_ng_flags flags;
 	struct sdp_chopper *chopper;
+	uint64_t flags_hash;
+	int new_call = 0, overload_reject = 0, cost_reject = 0;
 
 	if (!bencode_dictionary_get_str(input, "sdp", &sdp))
 		return "No SDP body in message";
@@ -1206,6 +1488,12 @@ static const char *call_offer_answer_ng(bencode_item_t *input,
 		}
 	}
 
+	flags_hash = ng_flags_hash(input);
+	if (ng_sdp_cache_lookup(&flags, &sdp, flags_hash, output)) {
+		errstr = NULL;
+		goto out;
+	}
+
 	errstr = "Failed to parse SDP";
 	if (sdp_parse(&sdp, &parsed, &flags))
 		goto out;
@@ -1233,6 +1521,7 @@ static const char *call_offer_answer_ng(bencode_item_t *input,
 		if (!call) {
 			/* call == NULL, should create call */
 			call = call_get_or_create(&flags.call_id, 0);
+			new_call = 1;
 		}
 	}
 
@@ -1258,7 +1547,7 @@ static const char *call_offer_answer_ng(bencode_item_t *input,
 			flags.via_branch.s ? &flags.via_branch : NULL);
 	errstr = "Invalid dialogue association";
 	if (!monologue) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 		goto out;
 	}
@@ -1286,29 +1575,58 @@ static const char *call_offer_answer_ng(bencode_item_t *input,
 		call->drop_traffic = 0;
 	}
 
+	// the participant is the party sending the offer
+	if (flags.conference && opmode == OP_OFFER)
+		monologue->conference = 1;
+	else if (flags.conference && monologue->active_dialogue)
+		monologue->active_dialogue->conference = 1;
+
 	ret = monologue_offer_answer(monologue, &streams, &flags);
+	if (!ret && new_call && call_needs_transcoding(call)) {
+		// existing calls carry on, only new ones are turned away
+		if (g_atomic_int_get(&overload_level) >= OVERLOAD_NO_TRANSCODING) {
+			overload_reject = 1;
+			ret = -1;
+		}
+		else if (call_transcoding_limit(call)) {
+			cost_reject = 1;
+			ret = -1;
+		}
+	}
 	if (!ret) {
 		// SDP fragments for trickle ICE are consumed with no replacement returned
 		if (!flags.fragment)
 			ret = sdp_replace(chopper, &parsed, monologue->active_dialogue, &flags);
 	}
+	if (!ret && !flags.fragment)
+		ng_sdp_cache_store(monologue, &sdp, flags_hash, chopper);
+	else
+		call_sdp_changed(call);
 
 	struct recording *recording = call->recording;
 	if (recording != NULL) {
 		meta_write_sdp_before(recording, &sdp, monologue, opmode);
-		meta_write_sdp_after(recording, chopper->output,
+		GString *sdp_after = g_string_sized_new(chopper->str_len);
+		sdp_chopper_collapse(chopper, sdp_after->str);
+		g_string_set_size(sdp_after, chopper->str_len);
+		meta_write_sdp_after(recording, sdp_after,
 			       monologue, opmode);
+		g_string_free(sdp_after, TRUE);
 
 		recording_response(recording, output);
 	}
 
-	rwlock_unlock_w(&call->master_lock);
+	if (!ret)
+		conference_update(call);
+
+	call_unlock_w(call);
 
 	if (!flags.no_redis_update) {
 			redis_update_onekey(call, rtpe_redis_write);
 	} else {
 		ilog(LOG_DEBUG, "Not updating Redis due to present no-redis-update flag");
 	}
+	replication_update(call);
 	obj_put(call);
 
 	gettimeofday(&(monologue->started), NULL);
@@ -1320,12 +1638,32 @@ static const char *call_offer_answer_ng(bencode_item_t *input,
 		errstr = "Ran out of ports";
 		call_destroy(call);
 	}
+	else if (overload_reject) {
+		ilog(LOG_WARN, "Rejecting offer that requires transcoding due to overload");
+		atomic64_inc(&overload_rejected);
+		if (!flags.supports_load_limit)
+			errstr = "Parallel session limit reached"; // legacy protocol
+		else
+			errstr = magic_load_limit_strings[LOAD_LIMIT_TRANSCODING];
+		call_destroy(call);
+	}
+	else if (cost_reject) {
+		ilog(LOG_WARN, "Rejecting offer as the transcoding it requires would exceed the CPU limit");
+		if (!flags.supports_load_limit)
+			errstr = "Parallel session limit reached"; // legacy protocol
+		else
+			errstr = magic_load_limit_strings[LOAD_LIMIT_CPU];
+		call_destroy(call);
+	}
 
 	if (ret)
 		goto out;
 
-	if (chopper->output->len)
-		bencode_dictionary_add_string_len(output, "sdp", chopper->output->str, chopper->output->len);
+	// unchanged parts of the SDP are referenced from the received message and are only
+	// copied once, when the response is encoded
+	if (chopper->str_len)
+		bencode_dictionary_add_iovec(output, "sdp", &g_array_index(chopper->iov, struct iovec, 0),
+				chopper->iov_num, chopper->str_len);
 
 	errstr = NULL;
 out:
@@ -1346,10 +1684,32 @@ const char *call_answer_ng(bencode_item_t *input, bencode_item_t *output) {
 	return call_offer_answer_ng(input, output, OP_ANSWER, NULL, NULL);
 }
 
-const char *call_delete_ng(bencode_item_t *input, bencode_item_t *output) {
+// "calls" optionally holds calls that have been looked up in advance, see call_batch_ng()
+static struct call *ng_call_get(GHashTable *calls, const str *callid) {
+	struct call *c = calls ? g_hash_table_lookup(calls, callid) : NULL;
+	if (!c)
+		return call_get(callid);
+
+	call_lock_w(c);
+	// deleted since it was looked up, possibly by an earlier sub-command or another
+	// thread. a new call may have been created under the same ID in the meantime
+	if (c->destroyed) {
+		call_unlock_w(c);
+		return call_get(callid);
+	}
+
+	// same as call_get()
+	obj_hold(c);
+	c->timer_next_check = 0;
+	log_info_call(c);
+	return c;
+}
+
+static const char *__call_delete_ng(bencode_item_t *input, bencode_item_t *output, GHashTable *calls) {
 	str fromtag, totag, viabranch, callid;
 	bencode_item_t *flags, *it;
-	int fatal = 0, delete_delay;
+	int fatal = 0, delete_delay, ret;
+	struct call *c;
 
 	if (!bencode_dictionary_get_str(input, "call-id", &callid))
 		return "No call-id in message";
@@ -1376,7 +1736,22 @@ const char *call_delete_ng(bencode_item_t *input, bencode_item_t *output) {
 		}
 	}
 
-	if (call_delete_branch(&callid, &viabranch, &fromtag, &totag, output, delete_delay)) {
+	c = ng_call_get(calls, &callid);
+	if (!c) {
+		ilog(LOG_INFO, "Call-ID to delete not found");
+		ret = -1;
+	}
+	else {
+		if (calls && g_hash_table_lookup(calls, &callid) == c) {
+			// the call may be gone after this, so make further lookups go through the hash
+			g_hash_table_remove(calls, &callid);
+			obj_put(c);
+		}
+		ret = call_delete_branch_call(c, &viabranch, &fromtag, &totag, output, delete_delay,
+				ng_stats_fields(input));
+	}
+
+	if (ret) {
 		if (fatal)
 			return "Call-ID not found or tags didn't match";
 		bencode_dictionary_add_string(output, "warning", "Call-ID not found or tags didn't match");
@@ -1385,6 +1760,10 @@ const char *call_delete_ng(bencode_item_t *input, bencode_item_t *output) {
 	return NULL;
 }
 
+const char *call_delete_ng(bencode_item_t *input, bencode_item_t *output) {
+	return __call_delete_ng(input, output, NULL);
+}
+
 static void ng_stats(bencode_item_t *d, const struct stats *s, struct stats *totals) {
 	bencode_dictionary_add_integer(d, "packets", atomic64_get(&s->packets));
 	bencode_dictionary_add_integer(d, "bytes", atomic64_get(&s->bytes));
@@ -1422,6 +1801,16 @@ static void ng_stats_stream(bencode_item_t *list, const struct packet_stream *ps
 		bencode_dictionary_add_string_dup(dict, "local address",
 				sockaddr_print_buf(&ps->selected_sfd->socket.local.address));
 		bencode_dictionary_add_string(dict, "family", ps->selected_sfd->socket.local.address.family->name);
+
+		bencode_dictionary_add_integer(dict, "receive drops",
+				atomic64_get(&ps->selected_sfd->rx_dropped));
+
+		unsigned long p50, p99;
+		if (stream_fd_relay_latency(ps->selected_sfd, &p50, &p99)) {
+			bencode_item_t *lat = bencode_dictionary_add_dictionary(dict, "relay latency");
+			bencode_dictionary_add_integer(lat, "p50", p50);
+			bencode_dictionary_add_integer(lat, "p99", p99);
+		}
 	}
 	ng_stats_endpoint(bencode_dictionary_add_dictionary(dict, "endpoint"), &ps->endpoint);
 	ng_stats_endpoint(bencode_dictionary_add_dictionary(dict, "advertised endpoint"),
@@ -1575,41 +1964,78 @@ static void ng_stats_ssrc(bencode_item_t *dict, struct ssrc_hash *ht) {
 		snprintf(tmp, 12, "%" PRIu32, se->h.ssrc);
 		bencode_item_t *ent = bencode_dictionary_add_dictionary(dict, tmp);
 
-		if (!se->stats_blocks.length || !se->lowest_mos || !se->highest_mos)
+		mutex_lock(&se->h.lock);
+
+		if (!se->num_stats_blocks) {
+			mutex_unlock(&se->h.lock);
 			continue;
+		}
 
-		ng_stats_ssrc_mos_entry_dict_avg(ent, "average MOS", &se->average_mos, se->stats_blocks.length);
-		ng_stats_ssrc_mos_entry_dict(ent, "lowest MOS", se->lowest_mos);
-		ng_stats_ssrc_mos_entry_dict(ent, "highest MOS", se->highest_mos);
+		ng_stats_ssrc_mos_entry_dict_avg(ent, "average MOS", &se->average_mos, se->num_stats_blocks);
+		ng_stats_ssrc_mos_entry_dict(ent, "lowest MOS", &se->lowest_mos);
+		ng_stats_ssrc_mos_entry_dict(ent, "highest MOS", &se->highest_mos);
+		ng_stats_ssrc_mos_entry_common(bencode_dictionary_add_dictionary(ent, "minimum values"),
+				&se->min_stats, 1);
+		ng_stats_ssrc_mos_entry_common(bencode_dictionary_add_dictionary(ent, "maximum values"),
+				&se->max_stats, 1);
+
+		bencode_item_t *histdict = bencode_dictionary_add_dictionary(ent, "MOS histogram");
+		for (unsigned int i = 0; i < SSRC_MOS_BUCKETS; i++) {
+			if (!se->mos_histogram[i])
+				continue;
+			char *key = bencode_buffer_alloc(dict->buffer, 8);
+			snprintf(key, 8, "%u.%u", i / 10, i % 10);
+			bencode_dictionary_add_integer(histdict, key, se->mos_histogram[i]);
+		}
 
+		// only the most recent stats blocks are retained
 		bencode_item_t *progdict = bencode_dictionary_add_dictionary(ent, "MOS progression");
-		// aim for about 10 entries to the list
-		GList *listent = se->stats_blocks.head;
-		struct ssrc_stats_block *sb = listent->data;
-		int interval
-			= ((struct ssrc_stats_block *) se->stats_blocks.tail->data)->reported.tv_sec
-			- sb->reported.tv_sec;
-		interval /= 10;
+		unsigned int num = MIN(se->num_stats_blocks, SSRC_RECENT_STATS);
+		struct ssrc_stats_block *sb = ssrc_recent_stats(se, 0);
+		int interval = ssrc_recent_stats(se, num - 1)->reported.tv_sec - sb->reported.tv_sec;
+		if (num > 1)
+			interval /= num - 1;
 		bencode_dictionary_add_integer(progdict, "interval", interval);
-		time_t next_step = sb->reported.tv_sec;
 		bencode_item_t *entlist = bencode_dictionary_add_list(progdict, "entries");
 
-		for (; listent; listent = listent->next) {
-			sb = listent->data;
-			if (sb->reported.tv_sec < next_step)
-				continue;
-			next_step += interval;
+		for (unsigned int i = 0; i < num; i++) {
+			sb = ssrc_recent_stats(se, i);
 			bencode_item_t *ent = bencode_list_add_dictionary(entlist);
 			ng_stats_ssrc_mos_entry(ent, sb);
 		}
+
+		mutex_unlock(&se->h.lock);
 	}
 
 	g_list_free(ll);
 }
 
+// list of section names in "fields", or everything
+unsigned int ng_stats_fields(bencode_item_t *input) {
+	bencode_item_t *list = bencode_dictionary_get_expect(input, "fields", BENCODE_LIST);
+	if (!list)
+		return NG_STATS_ALL;
+
+	unsigned int ret = 0;
+	for (bencode_item_t *it = list->child; it; it = it->sibling) {
+		if (!bencode_strcmp(it, "SSRC"))
+			ret |= NG_STATS_SSRC;
+		else if (!bencode_strcmp(it, "memory"))
+			ret |= NG_STATS_MEMORY;
+		else if (!bencode_strcmp(it, "tags"))
+			ret |= NG_STATS_TAGS;
+		else if (!bencode_strcmp(it, "totals"))
+			ret |= NG_STATS_TOTALS;
+		else
+			ilog(LOG_DEBUG, "Ignoring unknown query field '" BENCODE_FORMAT "'",
+					BENCODE_FMT(it));
+	}
+	return ret;
+}
+
 /* call must be locked */
 void ng_call_stats(struct call *call, const str *fromtag, const str *totag, bencode_item_t *output,
-		struct call_stats *totals)
+		struct call_stats *totals, unsigned int fields)
 {
 	bencode_item_t *tags = NULL, *dict;
 	const str *match_tag;
@@ -1629,9 +2055,22 @@ void ng_call_stats(struct call *call, const str *fromtag, const str *totag, benc
 	bencode_dictionary_add_integer(output, "created", call->created.tv_sec);
 	bencode_dictionary_add_integer(output, "created_us", call->created.tv_usec);
 	bencode_dictionary_add_integer(output, "last signal", call->last_signal);
-	ng_stats_ssrc(bencode_dictionary_add_dictionary(output, "SSRC"), call->ssrc_hash);
+	bencode_dictionary_add_integer(output, "transcode_us", atomic64_get(&call->transcode_ns) / 1000);
+	if ((fields & NG_STATS_SSRC))
+		ng_stats_ssrc(bencode_dictionary_add_dictionary(output, "SSRC"), call->ssrc_hash);
 
-	tags = bencode_dictionary_add_dictionary(output, "tags");
+	if ((fields & NG_STATS_MEMORY)) {
+		dict = bencode_dictionary_add_dictionary(output, "memory");
+		for (unsigned int i = 0; i < __CALL_MEM_LAST; i++)
+			bencode_dictionary_add_integer(dict, call_mem_names[i], atomic64_get(&call->mem[i]));
+		bencode_dictionary_add_integer(dict, "total", call_mem_total(call));
+	}
+
+	// without the tags, walking the monologues only sums up the totals
+	if ((fields & NG_STATS_TAGS))
+		tags = bencode_dictionary_add_dictionary(output, "tags");
+	else if (!(fields & NG_STATS_TOTALS))
+		return;
 
 stats:
 	match_tag = (totag && totag->s && totag->len) ? totag : fromtag;
@@ -1643,14 +2082,14 @@ stats:
 		}
 	}
 	else {
-		ml = g_hash_table_lookup(call->tags, match_tag);
+		ml = str_map_lookup(&call->tags, match_tag);
 		if (ml) {
 			ng_stats_monologue(tags, ml, totals);
 			ng_stats_monologue(tags, ml->active_dialogue, totals);
 		}
 	}
 
-	if (!output)
+	if (!output || !(fields & NG_STATS_TOTALS))
 		return;
 
 	dict = bencode_dictionary_add_dictionary(output, "totals");
@@ -1662,37 +2101,128 @@ static void ng_list_calls(bencode_item_t *output, long long int limit) {
 	GHashTableIter iter;
 	gpointer key, value;
 
-	rwlock_lock_r(&rtpe_callhash_lock);
+	ITERATE_CALLHASH_SHARDS(shard) {
+		rwlock_lock_r(&shard->lock);
 
-	g_hash_table_iter_init (&iter, rtpe_callhash);
-	while (limit-- && g_hash_table_iter_next (&iter, &key, &value)) {
-		bencode_list_add_str_dup(output, key);
-	}
+		g_hash_table_iter_init (&iter, shard->ht);
+		while (limit && g_hash_table_iter_next (&iter, &key, &value)) {
+			bencode_list_add_str_dup(output, key);
+			limit--;
+		}
 
-	rwlock_unlock_r(&rtpe_callhash_lock);
+		rwlock_unlock_r(&shard->lock);
+	}
 }
 
 
 
-const char *call_query_ng(bencode_item_t *input, bencode_item_t *output) {
+static const char *__call_query_ng(bencode_item_t *input, bencode_item_t *output, GHashTable *calls) {
 	str callid, fromtag, totag;
 	struct call *call;
 
 	if (!bencode_dictionary_get_str(input, "call-id", &callid))
 		return "No call-id in message";
-	call = call_get_opmode(&callid, OP_OTHER);
+	call = ng_call_get(calls, &callid);
 	if (!call)
 		return "Unknown call-id";
 	bencode_dictionary_get_str(input, "from-tag", &fromtag);
 	bencode_dictionary_get_str(input, "to-tag", &totag);
 
-	ng_call_stats(call, &fromtag, &totag, output, NULL);
-	rwlock_unlock_w(&call->master_lock);
+	ng_call_stats(call, &fromtag, &totag, output, NULL, ng_stats_fields(input));
+	call_unlock_w(call);
 	obj_put(call);
 
 	return NULL;
 }
 
+const char *call_query_ng(bencode_item_t *input, bencode_item_t *output) {
+	return __call_query_ng(input, output, NULL);
+}
+
+
+static const char *call_batch_one(bencode_item_t *input, bencode_item_t *output, GHashTable *calls) {
+	str cmd;
+
+	if (input->type != BENCODE_DICTIONARY)
+		return "Sub-command is not a dictionary";
+	if (!bencode_dictionary_get_str(input, "command", &cmd))
+		return "Dictionary contains no key \"command\"";
+
+	switch (__csh_lookup(&cmd)) {
+		case CSH_LOOKUP("query"):
+			return __call_query_ng(input, output, calls);
+		case CSH_LOOKUP("delete"):
+			return __call_delete_ng(input, output, calls);
+	}
+	return "Unsupported command in batch";
+}
+
+// runs a list of "query" and "delete" sub-commands. all call IDs are looked up first, locking
+// each shard of the call hash only once, then the sub-commands are run in the given order and
+// a list of results is returned, each of which looks like the response to the individual command
+const char *call_batch_ng(bencode_item_t *input, bencode_item_t *output) {
+	bencode_item_t *cmds, *it, *results, *res;
+	GSList *shard_ids[CALLHASH_SHARDS] = {NULL,};
+	str callid;
+
+	cmds = bencode_dictionary_get_expect(input, "commands", BENCODE_LIST);
+	if (!cmds)
+		return "No list of commands in message";
+
+	for (it = cmds->child; it; it = it->sibling) {
+		if (!bencode_dictionary_get_str(it, "call-id", &callid))
+			continue;
+		str *cid = bencode_buffer_alloc(input->buffer, sizeof(*cid));
+		if (!cid)
+			return "Failed to allocate memory";
+		*cid = callid;
+		unsigned int idx = callhash_shard(cid) - rtpe_callhash;
+		shard_ids[idx] = g_slist_prepend(shard_ids[idx], cid);
+	}
+
+	GHashTable *calls = g_hash_table_new(str_hash, str_equal);
+
+	for (unsigned int i = 0; i < CALLHASH_SHARDS; i++) {
+		if (!shard_ids[i])
+			continue;
+		struct callhash_shard *shard = &rtpe_callhash[i];
+		rwlock_lock_r(&shard->lock);
+		for (GSList *l = shard_ids[i]; l; l = l->next) {
+			str *cid = l->data;
+			if (g_hash_table_lookup(calls, cid))
+				continue;
+			struct call *c = g_hash_table_lookup(shard->ht, cid);
+			if (c)
+				g_hash_table_insert(calls, &c->callid, obj_get(c));
+		}
+		rwlock_unlock_r(&shard->lock);
+		g_slist_free(shard_ids[i]);
+	}
+
+	results = bencode_dictionary_add_list(output, "results");
+
+	for (it = cmds->child; it; it = it->sibling) {
+		res = bencode_list_add_dictionary(results);
+		const char *errstr = call_batch_one(it, res, calls);
+		if (errstr) {
+			bencode_dictionary_add_string(res, "result", "error");
+			bencode_dictionary_add_string(res, "error-reason", errstr);
+		}
+		else
+			bencode_dictionary_add_string(res, "result", "ok");
+		log_info_clear();
+	}
+
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, calls);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		obj_put((struct call *) value);
+	g_hash_table_destroy(calls);
+
+	return NULL;
+}
+
 
 const char *call_list_ng(bencode_item_t *input, bencode_item_t *output) {
 	bencode_item_t *calls = NULL;
@@ -1726,7 +2256,7 @@ const char *call_start_recording_ng(bencode_item_t *input, bencode_item_t *outpu
 	call->recording_on = 1;
 	recording_start(call, NULL, &metadata);
 
-	rwlock_unlock_w(&call->master_lock);
+	call_unlock_w(call);
 	obj_put(call);
 
 	return NULL;
@@ -1747,7 +2277,7 @@ const char *call_stop_recording_ng(bencode_item_t *input, bencode_item_t *output
 	call->recording_on = 0;
 	recording_stop(call, &metadata);
 
-	rwlock_unlock_w(&call->master_lock);
+	call_unlock_w(call);
 	obj_put(call);
 
 	return NULL;
@@ -1771,13 +2301,15 @@ static const char *media_block_match(struct call **call, struct call_monologue *
 	*call = call_get_opmode(&flags->call_id, OP_OTHER);
 	if (!*call)
 		return "Unknown call-id";
+	// all of these commands change what a re-offer would produce
+	call_sdp_changed(*call);
 
 	// directional?
 	if (flags->all) // explicitly non-directional, so skip the rest
 		return NULL;
 
 	if (flags->label.s) {
-		*monologue = g_hash_table_lookup((*call)->labels, &flags->label);
+		*monologue = str_map_lookup(&(*call)->labels, &flags->label);
 		if (!*monologue)
 			return "No monologue matching the given label";
 	}
@@ -1838,7 +2370,7 @@ const char *call_start_forwarding_ng(bencode_item_t *input, bencode_item_t *outp
 	errstr = NULL;
 out:
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 
@@ -1876,7 +2408,7 @@ const char *call_stop_forwarding_ng(bencode_item_t *input, bencode_item_t *outpu
 	errstr = NULL;
 out:
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 
@@ -1897,16 +2429,19 @@ const char *call_block_dtmf_ng(bencode_item_t *input, bencode_item_t *output) {
 		ilog(LOG_INFO, "Blocking directional DTMF (tag '" STR_FORMAT_M "')",
 				STR_FMT_M(&monologue->tag));
 		monologue->block_dtmf = 1;
+		// the kernel module may be forwarding DTMF by itself
+		__monologue_unkernelize(monologue);
 	}
 	else {
 		ilog(LOG_INFO, "Blocking DTMF (entire call)");
 		call->block_dtmf = 1;
+		__call_unkernelize(call);
 	}
 
 	errstr = NULL;
 out:
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 
@@ -1942,7 +2477,7 @@ const char *call_unblock_dtmf_ng(bencode_item_t *input, bencode_item_t *output)
 	errstr = NULL;
 out:
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 
@@ -1974,7 +2509,7 @@ const char *call_block_media_ng(bencode_item_t *input, bencode_item_t *output) {
 	errstr = NULL;
 out:
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 
@@ -2012,7 +2547,7 @@ const char *call_unblock_media_ng(bencode_item_t *input, bencode_item_t *output)
 	errstr = NULL;
 out:
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 
@@ -2064,8 +2599,11 @@ const char *call_play_media_ng(bencode_item_t *input, bencode_item_t *output) {
 		err = "No media file specified";
 		if (bencode_dictionary_get_str(input, "file", &str)) {
 			err = "Failed to start media playback from file";
-			if (media_player_play_file(monologue->player, &str))
+			int ret = media_player_play_file(monologue->player, &str);
+			if (ret < 0)
 				goto out;
+			if (ret == 1 && l == monologues.head)
+				bencode_dictionary_add_string(output, "status", "queued");
 		}
 		else if (bencode_dictionary_get_str(input, "blob", &str)) {
 			err = "Failed to start media playback from blob";
@@ -2089,7 +2627,7 @@ const char *call_play_media_ng(bencode_item_t *input, bencode_item_t *output) {
 out:
 	g_queue_clear(&monologues);
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 	return err;
@@ -2124,7 +2662,7 @@ const char *call_stop_media_ng(bencode_item_t *input, bencode_item_t *output) {
 out:
 	g_queue_clear(&monologues);
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 	return err;
@@ -2218,7 +2756,7 @@ found:;
 out:
 	g_queue_clear(&monologues);
 	if (call) {
-		rwlock_unlock_w(&call->master_lock);
+		call_unlock_w(call);
 		obj_put(call);
 	}
 	return err;
@@ -2228,40 +2766,8 @@ out:
 }
 
 void call_interfaces_free() {
-	if (info_re) {
-		pcre_free(info_re);
-		info_re = NULL;
-	}
-
-	if (streams_re) {
-		pcre_free(streams_re);
-		streams_re= NULL;
-	}
-
-	if (info_ree) {
-		pcre_free_study(info_ree);
-		info_ree = NULL;
-	}
-
-	if (streams_ree) {
-		pcre_free_study(streams_ree);
-		streams_ree = NULL;
-	}
 }
 
 int call_interfaces_init() {
-	const char *errptr;
-	int erroff;
-
-	info_re = pcre_compile("^([^:,]+)(?::(.*?))?(?:$|,)", PCRE_DOLLAR_ENDONLY | PCRE_DOTALL, &errptr, &erroff, NULL);
-	if (!info_re)
-		return -1;
-	info_ree = pcre_study(info_re, 0, &errptr);
-
-	streams_re = pcre_compile("^([\\d.]+):(\\d+)(?::(.*?))?(?:$|,)", PCRE_DOLLAR_ENDONLY | PCRE_DOTALL, &errptr, &erroff, NULL);
-	if (!streams_re)
-		return -1;
-	streams_ree = pcre_study(streams_re, 0, &errptr);
-
 	return 0;
 }
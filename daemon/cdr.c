@@ -4,8 +4,74 @@
 #include "call.h"
 #include "poller.h"
 #include "str.h"
+#include "main.h"
+
+
+// The CDR is built in two steps. While the call is still locked, only the values that
+// go into the CDR are copied into a flat list of items, in the order in which they're
+// printed. The snapshot is then handed to the CDR thread, which does all the string
+// formatting and the syslog call, so that neither happens while the call lock is held.
+
+enum cdr_item_type {
+	CDR_MONOLOGUE = 0,
+	CDR_MEDIA,
+	CDR_STREAM,
+};
+
+struct cdr_monologue {
+	struct timeval started;
+	struct timeval terminated;
+	enum termination_reason term_reason;
+	enum tag_type tagtype;
+	const char *tag;
+	const char *remote_tag; // NULL if no active dialogue
+};
+struct cdr_media {
+	unsigned int index;
+	int payload_type; // -1 if unknown
+};
+struct cdr_stream {
+	sockaddr_t endpoint_addr;
+	sockaddr_t local_addr;
+	unsigned int endpoint_port;
+	unsigned int local_port;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t last_packet;
+#if (RE_HAS_MEASUREDELAY)
+	uint64_t delay_min;
+	uint64_t delay_avg;
+	uint64_t delay_max;
+#endif
+	uint8_t in_tos_tclass;
+	unsigned int rtcp:1;
+	unsigned int has_local:1;
+};
+struct cdr_item {
+	enum cdr_item_type type;
+	union {
+		struct cdr_monologue ml;
+		struct cdr_media md;
+		struct cdr_stream ps;
+	};
+};
+
+struct cdr_entry {
+	GStringChunk *strings;
+	const char *callid;
+	const char *created_from;
+	time_t last_signal;
+	unsigned int tos;
+	GArray *items;
+};
+
+
+static mutex_t cdr_lock = MUTEX_STATIC_INIT;
+static cond_t cdr_cond = COND_STATIC_INIT;
+static GQueue cdr_queue = G_QUEUE_INIT; // LOCK: cdr_lock
+static int cdr_thread_running; // LOCK: cdr_lock
 
-#define CDRBUFREMAINDER cdrbufend-cdrbufcur
 
 static const char * const __term_reason_texts[] = {
 	[TIMEOUT] = "TIMEOUT",
@@ -35,47 +101,106 @@ static const char * get_term_reason_text(enum termination_reason t) {
 	return get_enum_array_text(__term_reason_texts, t, "UNKNOWN");
 }
 
-void cdr_update_entry(struct call* c) {
-	GList *l;
-	struct call_monologue *ml;
-	struct timeval tim_result_duration;
-	int printlen=0;
-	int cdrlinecnt = 0;
-	static const int CDRBUFLENGTH = 4096*2;
-	char cdrbuffer[CDRBUFLENGTH];
-	char* cdrbufcur = cdrbuffer;
-	char* cdrbufend = cdrbuffer+CDRBUFLENGTH-1;
-	struct call_media *md;
-	GList *k, *o;
-	const struct rtp_payload_type *rtp_pt;
-	struct packet_stream *ps=0;
-
-	if (IS_OWN_CALL(c)) {
-
-		/* CDRs and statistics */
-		if (_log_facility_cdr) {
-			printlen = snprintf(cdrbufcur,CDRBUFREMAINDER,"ci=%s, ",c->callid.s);
-			ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-			printlen = snprintf(cdrbufcur,CDRBUFREMAINDER,"created_from=%s, ", c->created_from);
-			ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-			printlen = snprintf(cdrbufcur,CDRBUFREMAINDER,"last_signal=%llu, ", (unsigned long long)c->last_signal);
-			ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-			printlen = snprintf(cdrbufcur,CDRBUFREMAINDER,"tos=%u, ", (unsigned int)c->tos);
-			ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-		}
 
-		for (l = c->monologues.head; l; l = l->next) {
-			ml = l->data;
+static const char *cdr_strdup(struct cdr_entry *e, const char *s) {
+	if (!s)
+		return "(null)";
+	return g_string_chunk_insert(e->strings, s);
+}
+
+static void cdr_entry_free(struct cdr_entry *e) {
+	g_string_chunk_free(e->strings);
+	g_array_free(e->items, TRUE);
+	g_slice_free1(sizeof(*e), e);
+}
+
+// call must be locked in W
+static struct cdr_entry *cdr_snapshot(struct call *c) {
+	struct cdr_entry *e = g_slice_alloc0(sizeof(*e));
+	e->strings = g_string_chunk_new(256);
+	e->items = g_array_sized_new(FALSE, TRUE, sizeof(struct cdr_item), 16);
+
+	e->callid = cdr_strdup(e, c->callid.s);
+	e->created_from = cdr_strdup(e, c->created_from);
+	e->last_signal = c->last_signal;
+	e->tos = c->tos;
+
+	for (GList *l = c->monologues.head; l; l = l->next) {
+		struct call_monologue *ml = l->data;
 
-			if (!ml->terminated.tv_sec) {
-				gettimeofday(&ml->terminated, NULL);
-				ml->term_reason = UNKNOWN;
+		struct cdr_item it = { .type = CDR_MONOLOGUE };
+		it.ml.started = ml->started;
+		it.ml.terminated = ml->terminated;
+		it.ml.term_reason = ml->term_reason;
+		it.ml.tagtype = ml->tagtype;
+		it.ml.tag = cdr_strdup(e, ml->tag.s);
+		if (ml->active_dialogue)
+			it.ml.remote_tag = cdr_strdup(e, ml->active_dialogue->tag.s);
+		g_array_append_val(e->items, it);
+
+		for (GList *k = ml->medias.head; k; k = k->next) {
+			struct call_media *md = k->data;
+			const struct rtp_payload_type *rtp_pt = __rtp_stats_codec(md);
+
+			it = (struct cdr_item) { .type = CDR_MEDIA };
+			it.md.index = md->index;
+			it.md.payload_type = rtp_pt ? rtp_pt->payload_type : -1;
+			g_array_append_val(e->items, it);
+
+			for (GList *o = md->streams.head; o; o = o->next) {
+				struct packet_stream *ps = o->data;
+
+				if (PS_ISSET(ps, FALLBACK_RTCP))
+					continue;
+
+				it = (struct cdr_item) { .type = CDR_STREAM };
+				it.ps.endpoint_addr = ps->endpoint.address;
+				it.ps.endpoint_port = ps->endpoint.port;
+				if (ps->selected_sfd) {
+					it.ps.local_addr = ps->selected_sfd->socket.local.address;
+					it.ps.local_port = ps->selected_sfd->socket.local.port;
+					it.ps.has_local = 1;
+				}
+				it.ps.packets = atomic64_get(&ps->stats.packets);
+				it.ps.bytes = atomic64_get(&ps->stats.bytes);
+				it.ps.errors = atomic64_get(&ps->stats.errors);
+				it.ps.last_packet = atomic64_get(&ps->last_packet);
+				it.ps.in_tos_tclass = ps->stats.in_tos_tclass;
+#if (RE_HAS_MEASUREDELAY)
+				it.ps.delay_min = ps->stats.delay_min;
+				it.ps.delay_avg = ps->stats.delay_avg;
+				it.ps.delay_max = ps->stats.delay_max;
+#endif
+				it.ps.rtcp = (!PS_ISSET(ps, RTP) && PS_ISSET(ps, RTCP)) ? 1 : 0;
+				g_array_append_val(e->items, it);
 			}
+		}
+	}
+
+	return e;
+}
 
-			timeval_subtract(&tim_result_duration,&ml->terminated,&ml->started);
 
-			if (_log_facility_cdr) {
-				printlen = snprintf(cdrbufcur, CDRBUFREMAINDER,
+static void cdr_format_text(GString *s, const struct cdr_entry *e) {
+	int cdrlinecnt = -1;
+	unsigned int midx = 0;
+
+	g_string_append_printf(s, "ci=%s, ", e->callid);
+	g_string_append_printf(s, "created_from=%s, ", e->created_from);
+	g_string_append_printf(s, "last_signal=%llu, ", (unsigned long long) e->last_signal);
+	g_string_append_printf(s, "tos=%u, ", e->tos);
+
+	for (unsigned int i = 0; i < e->items->len; i++) {
+		const struct cdr_item *it = &g_array_index(e->items, struct cdr_item, i);
+
+		switch (it->type) {
+			case CDR_MONOLOGUE:;
+				const struct cdr_monologue *ml = &it->ml;
+				struct timeval dur;
+				timeval_subtract(&dur, &ml->terminated, &ml->started);
+				cdrlinecnt++;
+
+				g_string_append_printf(s,
 					"ml%i_start_time=%ld.%06lu, "
 					"ml%i_end_time=%ld.%06ld, "
 					"ml%i_duration=%ld.%06ld, "
@@ -85,138 +210,248 @@ void cdr_update_entry(struct call* c) {
 					"ml%i_remote_tag=%s, ",
 					cdrlinecnt, ml->started.tv_sec, ml->started.tv_usec,
 					cdrlinecnt, ml->terminated.tv_sec, ml->terminated.tv_usec,
-					cdrlinecnt, tim_result_duration.tv_sec, tim_result_duration.tv_usec,
+					cdrlinecnt, dur.tv_sec, dur.tv_usec,
 					cdrlinecnt, get_term_reason_text(ml->term_reason),
-					cdrlinecnt, ml->tag.s,
+					cdrlinecnt, ml->tag,
 					cdrlinecnt, get_tag_type_text(ml->tagtype),
-					cdrlinecnt, ml->active_dialogue ? ml->active_dialogue->tag.s : "(none)");
-				ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-			}
+					cdrlinecnt, ml->remote_tag ? ml->remote_tag : "(none)");
+				break;
 
-			for (k = ml->medias.head; k; k = k->next) {
-				md = k->data;
+			case CDR_MEDIA:
+				midx = it->md.index;
+				/* add PayloadType(codec) info in CDR logging */
+				if (it->md.payload_type >= 0)
+					g_string_append_printf(s, "payload_type=%u, ",
+							(unsigned int) it->md.payload_type);
+				else
+					g_string_append(s, "payload_type=unknown, ");
+				break;
 
-				rtp_pt = __rtp_stats_codec(md);
+			case CDR_STREAM:;
+				const struct cdr_stream *ps = &it->ps;
+				const char *protocol = ps->rtcp ? "rtcp" : "rtp";
 
-				/* add PayloadType(codec) info in CDR logging */
-				if (_log_facility_cdr && rtp_pt) {
-					printlen = snprintf(cdrbufcur, CDRBUFREMAINDER, "payload_type=%u, ", rtp_pt->payload_type);
-					ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-				} else if (_log_facility_cdr && !rtp_pt) {
-					printlen = snprintf(cdrbufcur, CDRBUFREMAINDER, "payload_type=unknown, ");
-					ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-				}
+				g_string_append_printf(s,
+					"ml%i_midx%u_%s_endpoint_ip=%s, "
+					"ml%i_midx%u_%s_endpoint_port=%u, "
+					"ml%i_midx%u_%s_local_relay_ip=%s, "
+					"ml%i_midx%u_%s_local_relay_port=%u, "
+					"ml%i_midx%u_%s_relayed_packets="UINT64F", "
+					"ml%i_midx%u_%s_relayed_bytes="UINT64F", "
+					"ml%i_midx%u_%s_relayed_errors="UINT64F", "
+					"ml%i_midx%u_%s_last_packet="UINT64F", "
+					"ml%i_midx%u_%s_in_tos_tclass=%" PRIu8 ", ",
+					cdrlinecnt, midx, protocol, sockaddr_print_buf(&ps->endpoint_addr),
+					cdrlinecnt, midx, protocol, ps->endpoint_port,
+					cdrlinecnt, midx, protocol,
+					ps->has_local ? sockaddr_print_buf(&ps->local_addr) : "0.0.0.0",
+					cdrlinecnt, midx, protocol, ps->local_port,
+					cdrlinecnt, midx, protocol, ps->packets,
+					cdrlinecnt, midx, protocol, ps->bytes,
+					cdrlinecnt, midx, protocol, ps->errors,
+					cdrlinecnt, midx, protocol, ps->last_packet,
+					cdrlinecnt, midx, protocol, ps->in_tos_tclass);
+#if (RE_HAS_MEASUREDELAY)
+				if (!ps->rtcp)
+					g_string_append_printf(s,
+						"ml%i_midx%u_%s_delay_min=%.9f, "
+						"ml%i_midx%u_%s_delay_avg=%.9f, "
+						"ml%i_midx%u_%s_delay_max=%.9f, ",
+						cdrlinecnt, midx, protocol, (double) ps->delay_min / 1000000,
+						cdrlinecnt, midx, protocol, (double) ps->delay_avg / 1000000,
+						cdrlinecnt, midx, protocol, (double) ps->delay_max / 1000000);
+#endif
+				break;
+		}
+	}
+}
+
+
+static void cdr_json_str(GString *s, const char *k, const char *v) {
+	g_string_append_printf(s, "\"%s\":\"", k);
+	for (; *v; v++) {
+		unsigned char c = *v;
+		if (c == '"' || c == '\\')
+			g_string_append_printf(s, "\\%c", c);
+		else if (c < 0x20)
+			g_string_append_printf(s, "\\u%04x", c);
+		else
+			g_string_append_c(s, c);
+	}
+	g_string_append_c(s, '"');
+}
+
+static void cdr_format_json(GString *s, const struct cdr_entry *e) {
+	int in_ml = 0, in_md = 0, first_ps = 1;
+
+	g_string_append_c(s, '{');
+	cdr_json_str(s, "ci", e->callid);
+	g_string_append_c(s, ',');
+	cdr_json_str(s, "created_from", e->created_from);
+	g_string_append_printf(s, ",\"last_signal\":%llu,\"tos\":%u,\"monologues\":[",
+			(unsigned long long) e->last_signal, e->tos);
+
+	for (unsigned int i = 0; i < e->items->len; i++) {
+		const struct cdr_item *it = &g_array_index(e->items, struct cdr_item, i);
+
+		switch (it->type) {
+			case CDR_MONOLOGUE:;
+				const struct cdr_monologue *ml = &it->ml;
+				struct timeval dur;
+				timeval_subtract(&dur, &ml->terminated, &ml->started);
+
+				if (in_md)
+					g_string_append(s, "]}");
+				if (in_ml)
+					g_string_append(s, "]},");
+				in_ml = 1;
+				in_md = 0;
+
+				g_string_append_printf(s, "{\"start_time\":%ld.%06lu,\"end_time\":%ld.%06ld,"
+						"\"duration\":%ld.%06ld,\"termination\":\"%s\",",
+						ml->started.tv_sec, ml->started.tv_usec,
+						ml->terminated.tv_sec, ml->terminated.tv_usec,
+						dur.tv_sec, dur.tv_usec,
+						get_term_reason_text(ml->term_reason));
+				cdr_json_str(s, "local_tag", ml->tag);
+				g_string_append_printf(s, ",\"local_tag_type\":\"%s\",",
+						get_tag_type_text(ml->tagtype));
+				if (ml->remote_tag)
+					cdr_json_str(s, "remote_tag", ml->remote_tag);
+				else
+					g_string_append(s, "\"remote_tag\":null");
+				g_string_append(s, ",\"medias\":[");
+				break;
+
+			case CDR_MEDIA:
+				if (in_md)
+					g_string_append(s, "]},");
+				in_md = 1;
+				first_ps = 1;
 
-				for (o = md->streams.head; o; o = o->next) {
-					ps = o->data;
-
-					if (PS_ISSET(ps, FALLBACK_RTCP))
-						continue;
-
-					char *addr = sockaddr_print_buf(&ps->endpoint.address);
-                                        char *local_addr = ps->selected_sfd ? sockaddr_print_buf(&ps->selected_sfd->socket.local.address) : "0.0.0.0";
-
-					if (_log_facility_cdr) {
-					    const char* protocol = (!PS_ISSET(ps, RTP) && PS_ISSET(ps, RTCP)) ? "rtcp" : "rtp";
-
-					    if(!PS_ISSET(ps, RTP) && PS_ISSET(ps, RTCP)) {
-						printlen = snprintf(cdrbufcur, CDRBUFREMAINDER,
-							"ml%i_midx%u_%s_endpoint_ip=%s, "
-							"ml%i_midx%u_%s_endpoint_port=%u, "
-  						        "ml%i_midx%u_%s_local_relay_ip=%s, "
-							"ml%i_midx%u_%s_local_relay_port=%u, "
-							"ml%i_midx%u_%s_relayed_packets="UINT64F", "
-							"ml%i_midx%u_%s_relayed_bytes="UINT64F", "
-							"ml%i_midx%u_%s_relayed_errors="UINT64F", "
-							"ml%i_midx%u_%s_last_packet="UINT64F", "
-							"ml%i_midx%u_%s_in_tos_tclass=%" PRIu8 ", ",
-							cdrlinecnt, md->index, protocol, addr,
-							cdrlinecnt, md->index, protocol, ps->endpoint.port,
-							cdrlinecnt, md->index, protocol, local_addr,
-							cdrlinecnt, md->index, protocol,
-							(ps->selected_sfd ? ps->selected_sfd->socket.local.port : 0),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.packets),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.bytes),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.errors),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->last_packet),
-							cdrlinecnt, md->index, protocol,
-							ps->stats.in_tos_tclass);
-						ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-					    } else {
+				g_string_append_printf(s, "{\"index\":%u,", it->md.index);
+				if (it->md.payload_type >= 0)
+					g_string_append_printf(s, "\"payload_type\":%i,", it->md.payload_type);
+				else
+					g_string_append(s, "\"payload_type\":null,");
+				g_string_append(s, "\"streams\":[");
+				break;
+
+			case CDR_STREAM:;
+				const struct cdr_stream *ps = &it->ps;
+
+				if (!first_ps)
+					g_string_append_c(s, ',');
+				first_ps = 0;
+
+				g_string_append_printf(s, "{\"protocol\":\"%s\","
+						"\"endpoint_ip\":\"%s\",\"endpoint_port\":%u,"
+						"\"local_relay_ip\":\"%s\",\"local_relay_port\":%u,"
+						"\"relayed_packets\":"UINT64F",\"relayed_bytes\":"UINT64F","
+						"\"relayed_errors\":"UINT64F",\"last_packet\":"UINT64F","
+						"\"in_tos_tclass\":%" PRIu8,
+						ps->rtcp ? "rtcp" : "rtp",
+						sockaddr_print_buf(&ps->endpoint_addr), ps->endpoint_port,
+						ps->has_local ? sockaddr_print_buf(&ps->local_addr) : "0.0.0.0",
+						ps->local_port,
+						ps->packets, ps->bytes, ps->errors, ps->last_packet,
+						ps->in_tos_tclass);
 #if (RE_HAS_MEASUREDELAY)
-					    	printlen = snprintf(cdrbufcur, CDRBUFREMAINDER,
-							"ml%i_midx%u_%s_endpoint_ip=%s, "
-							"ml%i_midx%u_%s_endpoint_port=%u, "
-					    	        "ml%i_midx%u_%s_local_relay_ip=%s, "
-							"ml%i_midx%u_%s_local_relay_port=%u, "
-							"ml%i_midx%u_%s_relayed_packets="UINT64F", "
-							"ml%i_midx%u_%s_relayed_bytes="UINT64F", "
-							"ml%i_midx%u_%s_relayed_errors="UINT64F", "
-							"ml%i_midx%u_%s_last_packet="UINT64F", "
-							"ml%i_midx%u_%s_in_tos_tclass=%" PRIu8 ", "
-							"ml%i_midx%u_%s_delay_min=%.9f, "
-							"ml%i_midx%u_%s_delay_avg=%.9f, "
-							"ml%i_midx%u_%s_delay_max=%.9f, ",
-							cdrlinecnt, md->index, protocol, addr,
-							cdrlinecnt, md->index, protocol, ps->endpoint.port,
-							cdrlinecnt, md->index, protocol, local_addr,
-							cdrlinecnt, md->index, protocol, (unsigned int) (ps->sfd ? ps->sfd->fd.localport : 0),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.packets),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.bytes),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.errors),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->last_packet),
-							cdrlinecnt, md->index, protocol,
-							ps->stats.in_tos_tclass,
-							cdrlinecnt, md->index, protocol, (double) ps->stats.delay_min / 1000000,
-							cdrlinecnt, md->index, protocol, (double) ps->stats.delay_avg / 1000000,
-							cdrlinecnt, md->index, protocol, (double) ps->stats.delay_max / 1000000);
-						ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
-#else
-						printlen = snprintf(cdrbufcur, CDRBUFREMAINDER,
-							"ml%i_midx%u_%s_endpoint_ip=%s, "
-							"ml%i_midx%u_%s_endpoint_port=%u, "
-  						        "ml%i_midx%u_%s_local_relay_ip=%s, "
-							"ml%i_midx%u_%s_local_relay_port=%u, "
-							"ml%i_midx%u_%s_relayed_packets="UINT64F", "
-							"ml%i_midx%u_%s_relayed_bytes="UINT64F", "
-							"ml%i_midx%u_%s_relayed_errors="UINT64F", "
-							"ml%i_midx%u_%s_last_packet="UINT64F", "
-							"ml%i_midx%u_%s_in_tos_tclass=%" PRIu8 ", ",
-							cdrlinecnt, md->index, protocol, addr,
-							cdrlinecnt, md->index, protocol, ps->endpoint.port,
-							cdrlinecnt, md->index, protocol, local_addr,
-							cdrlinecnt, md->index, protocol,
-							(ps->selected_sfd ? ps->selected_sfd->socket.local.port : 0),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.packets),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.bytes),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->stats.errors),
-							cdrlinecnt, md->index, protocol,
-							atomic64_get(&ps->last_packet),
-							cdrlinecnt, md->index, protocol,
-							ps->stats.in_tos_tclass);
-						ADJUSTLEN(printlen,cdrbufend,cdrbufcur);
+				if (!ps->rtcp)
+					g_string_append_printf(s, ",\"delay_min\":%.9f,\"delay_avg\":%.9f,"
+							"\"delay_max\":%.9f",
+							(double) ps->delay_min / 1000000,
+							(double) ps->delay_avg / 1000000,
+							(double) ps->delay_max / 1000000);
 #endif
-					    }
-					}
+				g_string_append_c(s, '}');
+				break;
+		}
+	}
 
-				}
-			}
-			if (_log_facility_cdr)
-			    ++cdrlinecnt;
+	if (in_md)
+		g_string_append(s, "]}");
+	if (in_ml)
+		g_string_append(s, "]}");
+	g_string_append(s, "]}");
+}
+
+
+static void cdr_output(struct cdr_entry *e) {
+	GString *s = g_string_sized_new(1024);
+
+	if (rtpe_config.cdr_format == CDR_FORMAT_JSON)
+		cdr_format_json(s, e);
+	else
+		cdr_format_text(s, e);
+
+	/* log it */
+	cdrlog(s->str);
+
+	g_string_free(s, TRUE);
+	cdr_entry_free(e);
+}
+
+
+void cdr_update_entry(struct call* c) {
+	GList *l;
+	struct call_monologue *ml;
+
+	if (!IS_OWN_CALL(c))
+		return;
+
+	for (l = c->monologues.head; l; l = l->next) {
+		ml = l->data;
+
+		if (!ml->terminated.tv_sec) {
+			gettimeofday(&ml->terminated, NULL);
+			ml->term_reason = UNKNOWN;
 		}
-		/* log it */
-		cdrlog(cdrbuffer);
 	}
+
+	/* CDRs and statistics */
+	if (!_log_facility_cdr)
+		return;
+
+	struct cdr_entry *e = cdr_snapshot(c);
+
+	mutex_lock(&cdr_lock);
+	if (cdr_thread_running) {
+		g_queue_push_tail(&cdr_queue, e);
+		cond_signal(&cdr_cond);
+		e = NULL;
+	}
+	mutex_unlock(&cdr_lock);
+
+	if (e)
+		cdr_output(e);
 }
 
+
+void cdr_loop(void *p) {
+	mutex_lock(&cdr_lock);
+	cdr_thread_running = 1;
+
+	// keep going until the queue is drained, so that CDRs of calls that were deleted
+	// just before the shutdown aren't lost
+	while (!rtpe_shutdown || cdr_queue.length) {
+		struct cdr_entry *e = g_queue_pop_head(&cdr_queue);
+		if (!e) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&cdr_cond, &cdr_lock, &tv);
+			continue;
+		}
+		mutex_unlock(&cdr_lock);
+
+		cdr_output(e);
+
+		mutex_lock(&cdr_lock);
+	}
+
+	// from now on CDRs are output directly
+	cdr_thread_running = 0;
+
+	mutex_unlock(&cdr_lock);
+}
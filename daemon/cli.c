@@ -28,6 +28,9 @@
 #include "media_socket.h"
 #include "rtplib.h"
 #include "ssrc.h"
+#include "trace.h"
+#include "load.h"
+#include "codeclib.h"
 
 #include "rtpengine_config.h"
 
@@ -47,10 +50,13 @@ static void cli_incoming_ksrm(str *instr, struct cli_writer *cw);
 static void cli_incoming_kslist(str *instr, struct cli_writer *cw);
 static void cli_incoming_active(str *instr, struct cli_writer *cw);
 static void cli_incoming_standby(str *instr, struct cli_writer *cw);
+static void cli_incoming_trace(str *instr, struct cli_writer *cw);
+static void cli_incoming_benchmark(str *instr, struct cli_writer *cw);
 
 static void cli_incoming_set_maxopenfiles(str *instr, struct cli_writer *cw);
 static void cli_incoming_set_maxsessions(str *instr, struct cli_writer *cw);
 static void cli_incoming_set_maxcpu(str *instr, struct cli_writer *cw);
+static void cli_incoming_set_overloadthreshold(str *instr, struct cli_writer *cw);
 static void cli_incoming_set_maxload(str *instr, struct cli_writer *cw);
 static void cli_incoming_set_maxbw(str *instr, struct cli_writer *cw);
 static void cli_incoming_set_timeout(str *instr, struct cli_writer *cw);
@@ -72,6 +78,7 @@ static void cli_incoming_params_revert(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_numsessions(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_maxsessions(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_maxcpu(str *instr, struct cli_writer *cw);
+static void cli_incoming_list_overload(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_maxload(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_maxbw(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_maxopenfiles(str *instr, struct cli_writer *cw);
@@ -92,6 +99,8 @@ static void cli_incoming_list_controltos(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_interfaces(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_jsonstats(str *instr, struct cli_writer *cw);
 static void cli_incoming_list_transcoders(str *instr, struct cli_writer *cw);
+static void cli_incoming_list_restore(str *instr, struct cli_writer *cw);
+static void cli_incoming_list_memory(str *instr, struct cli_writer *cw);
 
 static const cli_handler_t cli_top_handlers[] = {
 	{ "list",		cli_incoming_list		},
@@ -104,12 +113,15 @@ static const cli_handler_t cli_top_handlers[] = {
 	{ "kslist",		cli_incoming_kslist		},
 	{ "active",		cli_incoming_active		},
 	{ "standby",		cli_incoming_standby		},
+	{ "trace",		cli_incoming_trace		},
+	{ "benchmark",		cli_incoming_benchmark		},
 	{ NULL, },
 };
 static const cli_handler_t cli_set_handlers[] = {
 	{ "maxopenfiles",		cli_incoming_set_maxopenfiles		},
 	{ "maxsessions",		cli_incoming_set_maxsessions		},
 	{ "maxcpu",			cli_incoming_set_maxcpu			},
+	{ "overloadthreshold",		cli_incoming_set_overloadthreshold	},
 	{ "maxload",			cli_incoming_set_maxload		},
 	{ "maxbw",			cli_incoming_set_maxbw			},
 	{ "timeout",			cli_incoming_set_timeout		},
@@ -132,6 +144,7 @@ static const cli_handler_t cli_list_handlers[] = {
 	{ "maxopenfiles",		cli_incoming_list_maxopenfiles		},
 	{ "maxsessions",		cli_incoming_list_maxsessions		},
 	{ "maxcpu",			cli_incoming_list_maxcpu		},
+	{ "overload",			cli_incoming_list_overload		},
 	{ "maxload",			cli_incoming_list_maxload		},
 	{ "maxbw",			cli_incoming_list_maxbw			},
 	{ "timeout",			cli_incoming_list_timeout		},
@@ -147,6 +160,8 @@ static const cli_handler_t cli_list_handlers[] = {
 	{ "interfaces",			cli_incoming_list_interfaces		},
 	{ "jsonstats",			cli_incoming_list_jsonstats		},
 	{ "transcoders",		cli_incoming_list_transcoders		},
+	{ "restore",			cli_incoming_list_restore		},
+	{ "memory",			cli_incoming_list_memory		},
 	{ NULL, },
 };
 
@@ -181,36 +196,38 @@ static void destroy_own_foreign_calls(int foreign_call, unsigned int uint_keyspa
 	gpointer key, value;
 	GList *i;
 
-	// lock read
-	rwlock_lock_r(&rtpe_callhash_lock);
+	ITERATE_CALLHASH_SHARDS(shard) {
+		// lock read
+		rwlock_lock_r(&shard->lock);
 
-	g_hash_table_iter_init(&iter, rtpe_callhash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		c = (struct call*)value;
-		if (!c) {
-			continue;
-		}
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			c = (struct call*)value;
+			if (!c) {
+				continue;
+			}
 
-		// match foreign_call flag
-		if ((foreign_call != UNDEFINED) && !(foreign_call == IS_FOREIGN_CALL(c))) {
-			continue;
-		}
+			// match foreign_call flag
+			if ((foreign_call != UNDEFINED) && !(foreign_call == IS_FOREIGN_CALL(c))) {
+				continue;
+			}
 
-		// match uint_keyspace_db, if some given
-		if ((uint_keyspace_db != UNDEFINED) && !(uint_keyspace_db == c->redis_hosted_db)) {
-			continue;
+			// match uint_keyspace_db, if some given
+			if ((uint_keyspace_db != UNDEFINED) && !(uint_keyspace_db == c->redis_hosted_db)) {
+				continue;
+			}
+
+			// increase ref counter
+			obj_get(c);
+
+			// save call reference
+			g_queue_push_tail(&call_list, c);
 		}
-		
-		// increase ref counter
-		obj_get(c);
 
-		// save call reference
-		g_queue_push_tail(&call_list, c);
+		// unlock read
+		rwlock_unlock_r(&shard->lock);
 	}
 
-	// unlock read
-	rwlock_unlock_r(&rtpe_callhash_lock);
-
 	// destroy calls
 	while ((c = g_queue_pop_head(&call_list))) {
 		if (!c->ml_deleted) {
@@ -370,6 +387,7 @@ static void cli_incoming_diff_or_revert(struct cli_writer *cw, char* option) {
 	int_diff_print(common.log_level, "log-level");
 	int_diff_print(max_sessions, "max-sessions");
 	int_diff_print(cpu_limit, "max-cpu");
+	int_diff_print(overload_threshold, "overload-threshold");
 	int_diff_print(load_limit, "max-load");
 	int_diff_print(bw_limit, "max-bw");
 	int_diff_print(timeout, "timeout");
@@ -422,11 +440,9 @@ static void cli_incoming_list_totals(str *instr, struct cli_writer *cw) {
 }
 
 static void cli_incoming_list_numsessions(str *instr, struct cli_writer *cw) {
-       rwlock_lock_r(&rtpe_callhash_lock);
-       cw->cw_printf(cw, "Current sessions own: "UINT64F"\n", g_hash_table_size(rtpe_callhash) - atomic64_get(&rtpe_stats.foreign_sessions));
+       cw->cw_printf(cw, "Current sessions own: "UINT64F"\n", atomic64_get(&rtpe_callhash_size) - atomic64_get(&rtpe_stats.foreign_sessions));
        cw->cw_printf(cw, "Current sessions foreign: "UINT64F"\n", atomic64_get(&rtpe_stats.foreign_sessions));
-       cw->cw_printf(cw, "Current sessions total: %i\n", g_hash_table_size(rtpe_callhash));
-       rwlock_unlock_r(&rtpe_callhash_lock);
+       cw->cw_printf(cw, "Current sessions total: "UINT64F"\n", atomic64_get(&rtpe_callhash_size));
        cw->cw_printf(cw, "Current transcoded media: "UINT64F"\n", atomic64_get(&rtpe_stats.transcoded_media));
 }
 
@@ -442,6 +458,24 @@ static void cli_incoming_list_maxcpu(str *instr, struct cli_writer *cw) {
 
 	return ;
 }
+static void cli_incoming_list_overload(str *instr, struct cli_writer *cw) {
+	int level = g_atomic_int_get(&overload_level);
+	int threshold = overload_threshold();
+	int busy = overload_busy();
+
+	if (threshold)
+		cw->cw_printf(cw, "Overload threshold: %.1f%%\n", (double) threshold / 100.0);
+	else
+		cw->cw_printf(cw, "Overload threshold: disabled\n");
+	if (busy >= 0)
+		cw->cw_printf(cw, "Busy level: %.1f%%\n", (double) busy / 100.0);
+	cw->cw_printf(cw, "Current step: %i (%s)\n", level, overload_level_names[level]);
+	cw->cw_printf(cw, "Rejected transcoding offers: %" PRIu64 "\n", atomic64_get(&overload_rejected));
+	cw->cw_printf(cw, "Steps:\n");
+	for (int i = OVERLOAD_NONE + 1; i < __OVERLOAD_MAX; i++)
+		cw->cw_printf(cw, "  %i: %s%s\n", i, overload_level_names[i], i <= level ? " (active)" : "");
+}
+
 static void cli_incoming_list_maxload(str *instr, struct cli_writer *cw) {
 	/* don't lock anything while reading the value */
 	cw->cw_printf(cw, "Maximum load average configured on rtpengine: %.2f\n", (double) rtpe_config.load_limit / 100.0);
@@ -541,10 +575,11 @@ static void cli_incoming_list_callid(str *instr, struct cli_writer *cw) {
 
 	cw->cw_printf(cw,
 			 "\ncallid: %s\ndeletionmark: %s\ncreated: %i\nproxy: %s\ntos: %u\nlast_signal: %llu\n"
-			 "redis_keyspace: %i\nforeign: %s\n\n",
+			 "redis_keyspace: %i\nforeign: %s\nmemory: %llu\ntranscoding: %.3f s\n\n",
 			 c->callid.s, c->ml_deleted ? "yes" : "no", (int) c->created.tv_sec, c->created_from,
 			 (unsigned int) c->tos, (unsigned long long) c->last_signal, c->redis_hosted_db,
-			 IS_FOREIGN_CALL(c) ? "yes" : "no");
+			 IS_FOREIGN_CALL(c) ? "yes" : "no", (unsigned long long) call_mem_total(c),
+			 (double) atomic64_get(&c->transcode_ns) / 1000000000.0);
 
 	for (l = c->monologues.head; l; l = l->next) {
 		ml = l->data;
@@ -614,79 +649,214 @@ static void cli_incoming_list_callid(str *instr, struct cli_writer *cw) {
 	}
 	cw->cw_printf(cw, "\n");
 
-	rwlock_unlock_w(&c->master_lock);	// because of call_get(..)
+	call_unlock_w(c);	// because of call_get(..)
 	obj_put(c);
 }
 
+// stop listing once this much output is waiting to be written to the client
+#define CLI_LIST_MAX_PENDING (1024 * 1024)
+
+enum cli_list_mode {
+	CLI_LIST_ALL = 0,
+	CLI_LIST_OWN,
+	CLI_LIST_FOREIGN,
+};
+
+struct cli_session_filter {
+	enum cli_list_mode mode;
+	str interface;
+	str codec;
+	long min_age, max_age; // seconds, -1 if not set
+	int state; // 0: any, 1: deleted only, 2: not deleted only
+	unsigned long offset, limit;
+};
+
+static int cli_session_filter_parse(struct cli_session_filter *f, str *args, struct cli_writer *cw) {
+	while (args->len) {
+		if (args->s[0] == ' ') {
+			str_shift(args, 1);
+			continue;
+		}
+
+		str tok = *args, key, val;
+		char *sp = memchr(args->s, ' ', args->len);
+		if (sp)
+			tok.len = sp - args->s;
+		str_shift(args, tok.len);
+
+		char *eq = memchr(tok.s, '=', tok.len);
+		if (!eq)
+			goto bad;
+		key = tok;
+		key.len = eq - tok.s;
+		val = tok;
+		str_shift(&val, key.len + 1);
+
+		char buf[32];
+		char *endp;
+		unsigned long num = ULONG_MAX;
+		if (val.len && val.len < sizeof(buf)) {
+			str_ncpy(buf, sizeof(buf), &val);
+			num = strtoul(buf, &endp, 10);
+			if (*endp)
+				num = ULONG_MAX;
+		}
+
+		if (!str_cmp(&key, "interface"))
+			f->interface = val;
+		else if (!str_cmp(&key, "codec"))
+			f->codec = val;
+		else if (!str_cmp(&key, "state")) {
+			if (!str_cmp(&val, "deleted"))
+				f->state = 1;
+			else if (!str_cmp(&val, "active"))
+				f->state = 2;
+			else
+				goto bad;
+		}
+		else {
+			if (num == ULONG_MAX)
+				goto bad;
+			if (!str_cmp(&key, "minage"))
+				f->min_age = num;
+			else if (!str_cmp(&key, "maxage"))
+				f->max_age = num;
+			else if (!str_cmp(&key, "offset"))
+				f->offset = num;
+			else if (!str_cmp(&key, "limit"))
+				f->limit = num;
+			else
+				goto bad;
+		}
+		continue;
+
+bad:
+		cw->cw_printf(cw, "Invalid filter '" STR_FORMAT "'\n", STR_FMT(&tok));
+		return -1;
+	}
+	return 0;
+}
+
+static int cli_session_matches(struct call *c, const struct cli_session_filter *f) {
+	if (f->mode == CLI_LIST_OWN && IS_FOREIGN_CALL(c))
+		return 0;
+	if (f->mode == CLI_LIST_FOREIGN && !IS_FOREIGN_CALL(c))
+		return 0;
+	if (f->state == 1 && !c->ml_deleted)
+		return 0;
+	if (f->state == 2 && c->ml_deleted)
+		return 0;
+
+	long age = rtpe_now.tv_sec - c->created.tv_sec;
+	if (f->min_age >= 0 && age < f->min_age)
+		return 0;
+	if (f->max_age >= 0 && age > f->max_age)
+		return 0;
+
+	if (!f->interface.s && !f->codec.s)
+		return 1;
+
+	int intf_ok = !f->interface.s, codec_ok = !f->codec.s;
+
+	rwlock_lock_r(&c->master_lock);
+	for (GList *l = c->medias.head; l && (!intf_ok || !codec_ok); l = l->next) {
+		struct call_media *md = l->data;
+		if (!intf_ok && md->logical_intf && !str_cmp_str(&md->logical_intf->name, &f->interface))
+			intf_ok = 1;
+		if (!codec_ok) {
+			const struct rtp_payload_type *pt = __rtp_stats_codec(md);
+			if (pt && !str_casecmp_str(&pt->encoding, &f->codec))
+				codec_ok = 1;
+		}
+	}
+	rwlock_unlock_r(&c->master_lock);
+
+	return intf_ok && codec_ok;
+}
+
 static void cli_incoming_list_sessions(str *instr, struct cli_writer *cw) {
-	GHashTableIter iter;
-	gpointer key, value;
-	str *ptrkey;
 	struct call *call;
-	int found_own = 0, found_foreign = 0;
-
-	static const char* LIST_ALL = "all";
-	static const char* LIST_OWN = "own";
-	static const char* LIST_FOREIGN = "foreign";
+	unsigned long found = 0, printed = 0;
+	int stopped = 0;
 
 	if (str_shift(instr, 1)) {
 		cw->cw_printf(cw, "%s\n", "More parameters required.");
 		return;
 	}
 
-	rwlock_lock_r(&rtpe_callhash_lock);
-
-	if (g_hash_table_size(rtpe_callhash)==0) {
+	if (atomic64_get(&rtpe_callhash_size)==0) {
 		cw->cw_printf(cw, "No sessions on this media relay.\n");
-		rwlock_unlock_r(&rtpe_callhash_lock);
 		return;
 	}
 
-	g_hash_table_iter_init (&iter, rtpe_callhash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		ptrkey = (str*)key;
-		call = (struct call*)value;
-
-		if (str_cmp(instr, LIST_ALL) == 0) {
-			if (!call) {
-				continue;
-			}
-		} else if (str_cmp(instr, LIST_OWN) == 0) {
-			if (!call || IS_FOREIGN_CALL(call)) {
-				continue;
-			} else {
-				found_own = 1;
-			}
-		} else if (str_cmp(instr, LIST_FOREIGN) == 0) {
-			if (!call || !IS_FOREIGN_CALL(call)) {
-				continue;
-			} else {
-				found_foreign = 1;
-			}
-		} else {
-			// expect callid parameter
-			break;
-		}
+	struct cli_session_filter filter = {
+		.min_age = -1,
+		.max_age = -1,
+	};
+	str mode = *instr, args = STR_NULL;
+	char *sp = memchr(instr->s, ' ', instr->len);
+	if (sp) {
+		mode.len = sp - instr->s;
+		args = *instr;
+		str_shift(&args, mode.len);
+	}
 
-		cw->cw_printf(cw, "callid: %60s | deletionmark:%4s | created:%12i | proxy:%s | redis_keyspace:%i | foreign:%s\n", ptrkey->s, call->ml_deleted?"yes":"no", (int)call->created.tv_sec, call->created_from, call->redis_hosted_db, IS_FOREIGN_CALL(call)?"yes":"no");
+	if (!str_cmp(&mode, "all"))
+		filter.mode = CLI_LIST_ALL;
+	else if (!str_cmp(&mode, "own"))
+		filter.mode = CLI_LIST_OWN;
+	else if (!str_cmp(&mode, "foreign"))
+		filter.mode = CLI_LIST_FOREIGN;
+	else {
+		// list session for callid
+		cli_incoming_list_callid(instr, cw);
+		return;
 	}
-	rwlock_unlock_r(&rtpe_callhash_lock);
 
-	if (str_cmp(instr, LIST_ALL) == 0) {
-		;
-	} else if (str_cmp(instr, LIST_OWN) == 0) {
-		if (!found_own) {
-			cw->cw_printf(cw, "No own sessions on this media relay.\n");
+	if (cli_session_filter_parse(&filter, &args, cw))
+		return;
+
+	ITERATE_CALLHASH_SHARDS(shard) {
+		// take references and let go of the shard before printing anything
+		GQueue calls = G_QUEUE_INIT;
+
+		rwlock_lock_r(&shard->lock);
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			if (value)
+				g_queue_push_tail(&calls, obj_get((struct call *) value));
 		}
-	} else if (str_cmp(instr, LIST_FOREIGN) == 0) {
-		if (!found_foreign) {
-			cw->cw_printf(cw, "No foreign sessions on this media relay.\n");
+		rwlock_unlock_r(&shard->lock);
+
+		while ((call = g_queue_pop_head(&calls))) {
+			if (!stopped && cli_session_matches(call, &filter) && found++ >= filter.offset) {
+				if (filter.limit && printed >= filter.limit)
+					stopped = 1;
+				else if (cw->cw_pending && cw->cw_pending(cw) > CLI_LIST_MAX_PENDING)
+					stopped = 2;
+				else {
+					cw->cw_printf(cw, "callid: %60.*s | deletionmark:%4s | created:%12i | proxy:%s | redis_keyspace:%i | foreign:%s | memory:%llu\n", STR_FMT(&call->callid), call->ml_deleted?"yes":"no", (int)call->created.tv_sec, call->created_from, call->redis_hosted_db, IS_FOREIGN_CALL(call)?"yes":"no", (unsigned long long) call_mem_total(call));
+					printed++;
+				}
+			}
+			obj_put(call);
 		}
-	} else {
-		// list session for callid
-		cli_incoming_list_callid(instr, cw);
 	}
 
+	if (stopped == 2)
+		cw->cw_printf(cw, "Output stopped after %lu sessions as the client isn't keeping up, "
+				"continue with 'offset=%lu'\n", printed, filter.offset + printed);
+	else if (found)
+		;
+	else if (args.len)
+		cw->cw_printf(cw, "No matching sessions on this media relay.\n");
+	else if (filter.mode == CLI_LIST_OWN)
+		cw->cw_printf(cw, "No own sessions on this media relay.\n");
+	else if (filter.mode == CLI_LIST_FOREIGN)
+		cw->cw_printf(cw, "No foreign sessions on this media relay.\n");
+
 	return;
 }
 
@@ -788,6 +958,33 @@ static void cli_incoming_set_maxcpu(str *instr, struct cli_writer *cw) {
 	return;
 }
 
+static void cli_incoming_set_overloadthreshold(str *instr, struct cli_writer *cw) {
+	char *endptr;
+
+	if (str_shift(instr, 1)) {
+		cw->cw_printf(cw, "%s\n", "More parameters required.");
+		return;
+	}
+
+	errno = 0;
+	double num = strtod(instr->s, &endptr);
+
+	if ((errno == ERANGE && (num == HUGE_VAL || num == -HUGE_VAL)) || (errno != 0 && num == 0) || isnan(num) || !isfinite(num) || num < 0) {
+		cw->cw_printf(cw,  "Fail setting overloadthreshold to %s; errno=%d\n", instr->s, errno);
+		return;
+	} else if (endptr == instr->s) {
+		cw->cw_printf(cw,  "Fail setting overloadthreshold to %s; no digists found\n", instr->s);
+		return;
+	} else {
+		rwlock_lock_w(&rtpe_config.config_lock);
+		rtpe_config.overload_threshold = num * 100;
+		rwlock_unlock_w(&rtpe_config.config_lock);
+		cw->cw_printf(cw,  "Success setting overloadthreshold to %.1f\n", num);
+	}
+
+	return;
+}
+
 static void cli_incoming_set_maxload(str *instr, struct cli_writer *cw) {
 	char *endptr;
 
@@ -907,6 +1104,72 @@ static void cli_incoming_params(str *instr, struct cli_writer *cw) {
 	cli_handler_do(cli_params_handlers, instr, cw);
 }
 
+static void cli_incoming_trace(str *instr, struct cli_writer *cw) {
+	str callid;
+	int enable = 1;
+
+	if (str_shift(instr, 1) || !instr->len) {
+		cw->cw_printf(cw, "%s\n", "More parameters required.");
+		return;
+	}
+	if (!rtpe_config.trace_dir) {
+		cw->cw_printf(cw, "%s\n", "Tracing is not enabled (no --trace-dir configured).");
+		return;
+	}
+
+	// trace <callid> [on|off]
+	callid = *instr;
+	char *sp = memchr(instr->s, ' ', instr->len);
+	if (sp) {
+		callid.len = sp - instr->s;
+		str_shift(instr, callid.len + 1);
+		if (!str_cmp(instr, "off"))
+			enable = 0;
+		else if (str_cmp(instr, "on")) {
+			cw->cw_printf(cw, "Invalid argument '" STR_FORMAT "', expected 'on' or 'off'\n",
+					STR_FMT(instr));
+			return;
+		}
+	}
+
+	struct call *c = call_get(&callid);
+	if (!c) {
+		cw->cw_printf(cw, "\nCall Id not found (" STR_FORMAT ").\n\n", STR_FMT(&callid));
+		return;
+	}
+
+	unsigned int id = trace_call_enable(c, enable);
+
+	call_unlock_w(c);
+	obj_put(c);
+
+	if (id)
+		cw->cw_printf(cw, "Tracing call " STR_FORMAT " with trace ID %u\n", STR_FMT(&callid), id);
+	else
+		cw->cw_printf(cw, "Stopped tracing call " STR_FORMAT "\n", STR_FMT(&callid));
+}
+
+#ifdef WITH_TRANSCODING
+static void __cli_codec_cost(const codec_def_t *def, void *arg) {
+	struct cli_writer *cw = arg;
+	cw->cw_printf(cw, "%20s: encode %.3f%%, decode %.3f%%, resample %.3f%% of one core\n",
+			def->rtpname,
+			(double) def->bench_encode_ns / 10000000.0,
+			(double) def->bench_decode_ns / 10000000.0,
+			(double) def->bench_resample_ns / 10000000.0);
+}
+#endif
+
+// runs in the CLI thread and is skewed by whatever else the machine is doing
+static void cli_incoming_benchmark(str *instr, struct cli_writer *cw) {
+#ifdef WITH_TRANSCODING
+	codeclib_benchmark();
+	codeclib_benchmarked(__cli_codec_cost, cw);
+#else
+	cw->cw_printf(cw, "Transcoding is not supported\n");
+#endif
+}
+
 static void cli_incoming_terminate(str *instr, struct cli_writer *cw) {
    struct call* c=0;
    struct call_monologue *ml;
@@ -973,7 +1236,7 @@ static void cli_incoming_terminate(str *instr, struct cli_writer *cw) {
    cw->cw_printf(cw, "\nCall Id (%s) successfully terminated by operator.\n\n",instr->s);
    ilog(LOG_WARN, "Call Id (%s) successfully terminated by operator.",instr->s);
 
-   rwlock_unlock_w(&c->master_lock);
+   call_unlock_w(c);
 
    call_destroy(c);
    obj_put(c);
@@ -999,7 +1262,7 @@ static void cli_incoming_ksadd(str *instr, struct cli_writer *cw) {
 		rwlock_lock_w(&rtpe_config.config_lock);
 		if (!g_queue_find(&rtpe_config.redis_subscribed_keyspaces, GUINT_TO_POINTER(uint_keyspace_db))) {
 			g_queue_push_tail(&rtpe_config.redis_subscribed_keyspaces, GUINT_TO_POINTER(uint_keyspace_db));
-			redis_notify_subscribe_action(rtpe_redis_notify, SUBSCRIBE_KEYSPACE, uint_keyspace_db);
+			redis_notify_subscribe_all(SUBSCRIBE_KEYSPACE, uint_keyspace_db);
 			cw->cw_printf(cw, "Success adding keyspace %lu to redis notifications.\n", uint_keyspace_db);
 		} else {
 			cw->cw_printf(cw, "Keyspace %lu is already among redis notifications.\n", uint_keyspace_db);
@@ -1028,7 +1291,7 @@ static void cli_incoming_ksrm(str *instr, struct cli_writer *cw) {
                 cw->cw_printf(cw, "Fail removing keyspace %s to redis notifications; no digists found\n", instr->s);
 	} else if ((l = g_queue_find(&rtpe_config.redis_subscribed_keyspaces, GUINT_TO_POINTER(uint_keyspace_db)))) {
 		// remove this keyspace
-		redis_notify_subscribe_action(rtpe_redis_notify, UNSUBSCRIBE_KEYSPACE, uint_keyspace_db);
+		redis_notify_subscribe_all(UNSUBSCRIBE_KEYSPACE, uint_keyspace_db);
 		g_queue_remove(&rtpe_config.redis_subscribed_keyspaces, l->data);
 		cw->cw_printf(cw, "Successfully unsubscribed from keyspace %lu.\n", uint_keyspace_db);
 
@@ -1062,14 +1325,16 @@ static void cli_incoming_active_standby(struct cli_writer *cw, int foreign) {
 	GHashTableIter iter;
 	gpointer key, value;
 
-	rwlock_lock_r(&rtpe_callhash_lock);
+	ITERATE_CALLHASH_SHARDS(shard) {
+		rwlock_lock_r(&shard->lock);
 
-	g_hash_table_iter_init(&iter, rtpe_callhash);
-	while (g_hash_table_iter_next(&iter, &key, &value)) {
-		struct call *c = value;
-		call_make_own_foreign(c, foreign);
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, &key, &value)) {
+			struct call *c = value;
+			call_make_own_foreign(c, foreign);
+		}
+		rwlock_unlock_r(&shard->lock);
 	}
-	rwlock_unlock_r(&rtpe_callhash_lock);
 
 	cw->cw_printf(cw, "Ok, all calls set to '%s'\n", foreign ? "foreign (standby)" : "owned (active)");
 }
@@ -1091,6 +1356,10 @@ static void cli_streambuf_printf(struct cli_writer *cw, const char *fmt, ...) {
 	va_end(va);
 }
 
+static unsigned int cli_streambuf_pending(struct cli_writer *cw) {
+	return streambuf_bufsize(cw->ptr);
+}
+
 static void cli_stream_readable(struct streambuf_stream *s) {
    static const int MAXINPUT = 1024;
    char *inbuf;
@@ -1109,6 +1378,7 @@ static void cli_stream_readable(struct streambuf_stream *s) {
 
    struct cli_writer cw = {
        .cw_printf = cli_streambuf_printf,
+       .cw_pending = cli_streambuf_pending,
        .ptr = s->outbuf,
    };
    cli_handle(&instr, &cw);
@@ -1123,6 +1393,11 @@ void cli_handle(str *instr, struct cli_writer *cw) {
 	cli_handler_do(cli_top_handlers, instr, cw);
 }
 
+void cli_close(struct cli *c) {
+	streambuf_listener_close(&c->listeners[0]);
+	streambuf_listener_close(&c->listeners[1]);
+}
+
 static void cli_free(void *p) {
 	struct cli *c = p;
 	streambuf_listener_shutdown(&c->listeners[0]);
@@ -1351,8 +1626,8 @@ static void cli_incoming_list_interfaces(str *instr, struct cli_writer *cw) {
 		cw->cw_printf(cw, " Port range: %5u - %5u\n",
 				lif->spec->port_pool.min,
 				lif->spec->port_pool.max);
-		unsigned int f = g_atomic_int_get(&lif->spec->port_pool.free_ports);
-		unsigned int l = g_atomic_int_get(&lif->spec->port_pool.last_used);
+		unsigned int f = port_pool_free_ports(&lif->spec->port_pool);
+		unsigned int l = port_pool_last_used(&lif->spec->port_pool);
 		unsigned int r = lif->spec->port_pool.max - lif->spec->port_pool.min + 1;
 		cw->cw_printf(cw, " Ports used: %5u / %5u (%5.1f%%)\n",
 				r - f, r, (double) (r - f) * 100.0 / r);
@@ -1394,6 +1669,8 @@ static void cli_incoming_list_transcoders(str *instr, struct cli_writer *cw) {
 			char *chain = l->data;
 			struct codec_stats *stats_entry = g_hash_table_lookup(rtpe_codec_stats, chain);
 			cw->cw_printf(cw, "%s: %i transcoders\n", chain, g_atomic_int_get(&stats_entry->num_transcoders));
+			cw->cw_printf(cw, "     %.3f s CPU time in total\n",
+					(double) atomic64_get(&stats_entry->time_ns) / 1000000000.0);
 			if (g_atomic_int_get(&stats_entry->last_tv_sec[idx]) != last_tv_sec)
 				continue;
 			cw->cw_printf(cw, "     " UINT64F " packets/s\n", atomic64_get(&stats_entry->packets_input[idx]));
@@ -1407,6 +1684,111 @@ static void cli_incoming_list_transcoders(str *instr, struct cli_writer *cw) {
 	g_list_free(chains);
 }
 
+static void cli_incoming_list_restore(str *instr, struct cli_writer *cw) {
+	struct timeval now;
+
+	mutex_lock(&rtpe_redis_restore_stats.lock);
+
+	if (!rtpe_redis_restore_stats.start.tv_sec) {
+		cw->cw_printf(cw, "No restore from Redis was done\n");
+		goto out;
+	}
+
+	if (rtpe_redis_restore_stats.running)
+		gettimeofday(&now, NULL);
+	else
+		now = rtpe_redis_restore_stats.end;
+	double secs = timeval_diff(&now, &rtpe_redis_restore_stats.start) / 1000000.0;
+	unsigned int done = rtpe_redis_restore_stats.restored + rtpe_redis_restore_stats.failed;
+
+	cw->cw_printf(cw, "Status: %s\n", rtpe_redis_restore_stats.running ? "running" : "finished");
+	cw->cw_printf(cw, "Keys found: %u\n", rtpe_redis_restore_stats.keys);
+	cw->cw_printf(cw, "Calls restored: %u\n", rtpe_redis_restore_stats.restored);
+	cw->cw_printf(cw, "Calls failed: %u\n", rtpe_redis_restore_stats.failed);
+	cw->cw_printf(cw, "Streams kernelized: %u\n", rtpe_redis_restore_stats.kernelized);
+	if (rtpe_redis_restore_stats.keys)
+		cw->cw_printf(cw, "Progress: %.1f%%\n", done * 100.0 / rtpe_redis_restore_stats.keys);
+	cw->cw_printf(cw, "Time: %.3f s\n", secs);
+	if (secs > 0)
+		cw->cw_printf(cw, "Rate: %.1f calls/s\n", done / secs);
+
+out:
+	mutex_unlock(&rtpe_redis_restore_stats.lock);
+}
+
+struct cli_mem_entry {
+	struct call *call;
+	uint64_t total;
+};
+
+static gint __cli_mem_cmp(gconstpointer a, gconstpointer b) {
+	const struct cli_mem_entry *A = a, *B = b;
+	if (A->total > B->total)
+		return -1;
+	if (A->total < B->total)
+		return 1;
+	return 0;
+}
+
+static void cli_incoming_list_memory(str *instr, struct cli_writer *cw) {
+	long num = 10;
+	char *endptr;
+
+	if (!str_shift(instr, 1) && instr->len) {
+		num = strtol(instr->s, &endptr, 10);
+		if (endptr == instr->s || num <= 0) {
+			cw->cw_printf(cw, "Invalid number of calls: %s\n", instr->s);
+			return;
+		}
+	}
+
+	// take a snapshot of the totals first, so that the sort order remains stable
+	GArray *calls = g_array_new(FALSE, FALSE, sizeof(struct cli_mem_entry));
+	uint64_t totals[__CALL_MEM_LAST] = {0,};
+
+	ITERATE_CALLHASH_SHARDS(shard) {
+		GHashTableIter iter;
+		gpointer value;
+
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct call *c = value;
+			if (!c)
+				continue;
+			struct cli_mem_entry e = { .call = obj_get(c), .total = call_mem_total(c) };
+			for (unsigned int i = 0; i < __CALL_MEM_LAST; i++)
+				totals[i] += atomic64_get(&c->mem[i]);
+			g_array_append_val(calls, e);
+		}
+		rwlock_unlock_r(&shard->lock);
+	}
+
+	uint64_t total = 0;
+	cw->cw_printf(cw, "Total over %u calls:\n", calls->len);
+	for (unsigned int i = 0; i < __CALL_MEM_LAST; i++) {
+		cw->cw_printf(cw, "     %-16s " UINT64F " bytes\n", call_mem_names[i], totals[i]);
+		total += totals[i];
+	}
+	cw->cw_printf(cw, "     %-16s " UINT64F " bytes\n", "total", total);
+
+	g_array_sort(calls, __cli_mem_cmp);
+
+	for (unsigned int j = 0; j < calls->len; j++) {
+		struct cli_mem_entry *e = &g_array_index(calls, struct cli_mem_entry, j);
+		if (j < (unsigned long) num) {
+			cw->cw_printf(cw, "\ncallid: " STR_FORMAT " | memory: " UINT64F "\n",
+					STR_FMT(&e->call->callid), e->total);
+			for (unsigned int i = 0; i < __CALL_MEM_LAST; i++)
+				cw->cw_printf(cw, "     %-16s " UINT64F " bytes\n", call_mem_names[i],
+						atomic64_get(&e->call->mem[i]));
+		}
+		obj_put(e->call);
+	}
+
+	g_array_free(calls, TRUE);
+}
+
 static void cli_incoming_list_controltos(str *instr, struct cli_writer *cw) {
 	rwlock_lock_r(&rtpe_config.config_lock);
 	cw->cw_printf(cw, "%d\n", rtpe_config.control_tos);
@@ -16,6 +16,11 @@
 #include "media_player.h"
 #include "timerthread.h"
 #include "log_funcs.h"
+#include "xt_RTPENGINE.h"
+#include "trace.h"
+#include "probes.h"
+#include "load.h"
+#include "conference.h"
 
 
 
@@ -67,6 +72,13 @@ static GList *__delete_receiver_codec(struct call_media *receiver, GList *link)
 struct codec_ssrc_handler;
 struct transcode_packet;
 
+#define DTX_RING 32 // packets held back per SSRC, more than any sensible --dtx-delay needs
+
+struct dtx_frame {
+	struct transcode_packet *packet;
+	struct media_packet mp;
+	struct timeval when;
+};
 struct dtx_buffer {
 	struct timerthread_queue ttq;
 	mutex_t lock;
@@ -74,15 +86,22 @@ struct dtx_buffer {
 	int ptime; // ms per packet
 	int tspp; // timestamp increment per packet
 	struct call *call;
-	unsigned long ts;
-	time_t start;
-};
-struct dtx_entry {
-	struct timerthread_queue_entry ttq_entry;
-	struct transcode_packet *packet;
-	struct media_packet mp;
-	unsigned long ts;
-	void *ssrc_ptr; // opaque pointer, doesn't hold a reference
+	time_t start; // last packet received
+
+	// received packets waiting for the delay to pass, oldest first
+	struct dtx_frame frames[DTX_RING];
+	unsigned int head, len;
+
+	// the only timer entry, running once per ptime for as long as there's something
+	// to do. `tick_queued` is also set while it's running
+	struct timerthread_queue_entry tick;
+	int tick_queued;
+
+	// touched only by the tick: last packet sent, as template for DTX
+	struct media_packet last_mp;
+	unsigned long last_ts;
+	void *last_ssrc; // opaque pointer, doesn't hold a reference
+	int dtx_active; // last_mp is set
 };
 
 struct silence_event {
@@ -110,6 +129,7 @@ struct codec_ssrc_handler {
 
 	// DTMF DSP stuff
 	dtmf_rx_state_t *dtmf_dsp;
+	struct dtmf_detect *dtmf_goertzel;
 	resample_t dtmf_resampler;
 	format_t dtmf_format;
 	uint64_t dtmf_ts, last_dtmf_event_ts;
@@ -121,6 +141,21 @@ struct codec_ssrc_handler {
 
 	uint64_t skip_pts;
 
+	// transcoding worker pool
+	GQueue tc_jobs; // LOCK: transcode_pool_lock
+	unsigned int tc_scheduled:1, // LOCK: transcode_pool_lock
+		     tc_stopped:1; // LOCK: transcode_pool_lock
+
+	// repacketizing
+	unsigned int repack_unit_bytes,
+		     repack_unit_ticks;
+	unsigned long repack_ts; // TS of first byte in sample_buffer
+	unsigned long repack_in_ts; // input TS expected to follow what's in sample_buffer
+
+	// output DTX: silence is being suppressed
+	int dtx_out:1;
+	uint64_t cn_pts; // last CN packet sent
+
 	int rtp_mark:1;
 };
 struct transcode_packet {
@@ -130,6 +165,7 @@ struct transcode_packet {
 	struct codec_handler *handler;
 	int marker:1,
 	    ignore_seq:1;
+	unsigned int lost; // packets missing right before this one
 	int (*func)(struct codec_ssrc_handler *, struct transcode_packet *, struct media_packet *);
 	int (*dup_func)(struct codec_ssrc_handler *, struct transcode_packet *, struct media_packet *);
 	struct rtp_header rtp;
@@ -141,39 +177,73 @@ struct codec_tracker {
 	GHashTable *supp_codecs; // telephone-event etc => hash table of clock rates
 };
 
+struct transcode_job {
+	struct transcode_packet *packet;
+	struct media_packet mp;
+	struct call *call;
+};
+
 struct rtcp_timer_queue {
 	struct timerthread_queue ttq;
 };
 struct rtcp_timer {
 	struct timerthread_queue_entry ttq_entry;
 	struct call *call;
-	struct call_media *media;
 };
 
+// reports are sent in batches: timers fire on a 100 ms grid, and once one of a call's
+// reports is due, all others due within the next half second are sent with it
+#define RTCP_TIMER_TICK		100000
+#define RTCP_TIMER_SLACK	500000
+
+// output DTX: interval of comfort noise updates while silence is suppressed
+#define CN_REFRESH_MS		400
+
+// longest gap in received packets for which the decoder can try to recover the lost
+// frames (Opus in-band FEC), instead of simply skipping over them
+#define FEC_MAX_LOST		5
 
 
-static struct timerthread codec_timers_thread;
-static struct rtcp_timer_queue *rtcp_timer_queue;
+
+// run by the threads of the poller that handles the call's sockets. each has its own
+// rtcp_timer_queue as ->priv
+static struct timerthread_pollers codec_timers;
+
+// SSRC handlers with pending transcode jobs, each one listed at most once
+static mutex_t transcode_pool_lock = MUTEX_STATIC_INIT;
+static cond_t transcode_pool_cond = COND_STATIC_INIT;
+static GQueue transcode_pool_queue = G_QUEUE_INIT;
+static unsigned int transcode_pool_jobs; // total queued, for stats
 
 
 static codec_handler_func handler_func_passthrough_ssrc;
+static codec_handler_func handler_func_repacketize;
 static codec_handler_func handler_func_transcode;
 static codec_handler_func handler_func_playback;
 static codec_handler_func handler_func_inject_dtmf;
 static codec_handler_func handler_func_supplemental;
 static codec_handler_func handler_func_dtmf;
 static codec_handler_func handler_func_t38;
+static codec_handler_func handler_func_conference;
+static codec_handler_func handler_func_drop;
 
 static struct ssrc_entry *__ssrc_handler_transcode_new(void *p);
 static struct ssrc_entry *__ssrc_handler_new(void *p);
+static struct ssrc_entry *__ssrc_handler_repacketize_new(void *p);
+static struct ssrc_entry *__ssrc_handler_decode_new(void *p);
 static void __free_ssrc_handler(void *);
 
+static struct transcode_packet *transcode_packet_new(void);
 static void __transcode_packet_free(struct transcode_packet *);
+static void __transcode_jobs_stop(void *);
 
 static int packet_decode(struct codec_ssrc_handler *, struct transcode_packet *, struct media_packet *);
+static int packet_g711_direct(struct codec_ssrc_handler *, struct transcode_packet *, struct media_packet *);
+static int packet_repacketize(struct codec_ssrc_handler *, struct transcode_packet *, struct media_packet *);
 static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2);
 static int packet_decoded_fifo(decoder_t *decoder, AVFrame *frame, void *u1, void *u2);
 static int packet_decoded_direct(decoder_t *decoder, AVFrame *frame, void *u1, void *u2);
+static int packet_decoded_conference(decoder_t *decoder, AVFrame *frame, void *u1, void *u2);
 
 static void codec_touched(struct rtp_payload_type *pt, struct call_media *media);
 
@@ -183,10 +253,16 @@ static struct codec_handler codec_handler_stub_ssrc = {
 	.func = handler_func_passthrough_ssrc,
 	.kernelize = 1,
 };
+static struct codec_handler codec_handler_stub_drop = {
+	.source_pt.payload_type = -1,
+	.func = handler_func_drop,
+};
 
 
 
 static void __handler_shutdown(struct codec_handler *handler) {
+	if (handler->ssrc_hash)
+		ssrc_hash_foreach(handler->ssrc_hash, __transcode_jobs_stop);
 	free_ssrc_hash(&handler->ssrc_hash);
 	if (handler->ssrc_handler)
 		obj_put(&handler->ssrc_handler->h);
@@ -198,6 +274,8 @@ static void __handler_shutdown(struct codec_handler *handler) {
 	handler->dtmf_payload_type = -1;
 	handler->cn_payload_type = -1;
 	handler->pcm_dtmf_detect = 0;
+	handler->packet_encoded = packet_encoded_rtp;
+	handler->packet_decoded = packet_decoded_fifo;
 
 	if (handler->stats_entry) {
 		g_atomic_int_add(&handler->stats_entry->num_transcoders, -1);
@@ -209,6 +287,7 @@ static void __handler_shutdown(struct codec_handler *handler) {
 static void __codec_handler_free(void *pp) {
 	struct codec_handler *h = pp;
 	__handler_shutdown(h);
+	call_mem_add(h->mem, -(ssize_t) sizeof(*h));
 	g_slice_free1(sizeof(*h), h);
 }
 void codec_handler_free(struct codec_handler **handler) {
@@ -228,9 +307,18 @@ static struct codec_handler *__handler_new(const struct rtp_payload_type *pt, st
 	handler->packet_encoded = packet_encoded_rtp;
 	handler->packet_decoded = packet_decoded_fifo;
 	handler->media = media;
+	if (media && media->call) {
+		handler->mem = &media->call->mem[CALL_MEM_CODEC];
+		call_mem_add(handler->mem, sizeof(*handler));
+	}
 	return handler;
 }
 
+static void __handler_ssrc_hash(struct codec_handler *handler, ssrc_create_func_t func) {
+	handler->ssrc_hash = create_ssrc_hash_full(func, handler);
+	handler->ssrc_hash->mem = handler->mem;
+}
+
 static void __make_passthrough(struct codec_handler *handler) {
 	__handler_shutdown(handler);
 	ilog(LOG_DEBUG, "Using passthrough handler for " STR_FORMAT,
@@ -244,7 +332,7 @@ static void __make_passthrough(struct codec_handler *handler) {
 		handler->kernelize = 1;
 	}
 	handler->dest_pt = handler->source_pt;
-	handler->ssrc_hash = create_ssrc_hash_full(__ssrc_handler_new, handler);
+	__handler_ssrc_hash(handler, __ssrc_handler_new);
 }
 static void __make_passthrough_ssrc(struct codec_handler *handler) {
 	__handler_shutdown(handler);
@@ -259,7 +347,63 @@ static void __make_passthrough_ssrc(struct codec_handler *handler) {
 		handler->kernelize = 1;
 	}
 	handler->dest_pt = handler->source_pt;
-	handler->ssrc_hash = create_ssrc_hash_full(__ssrc_handler_new, handler);
+	__handler_ssrc_hash(handler, __ssrc_handler_new);
+}
+
+// same codec on both sides, only the ptime differs: payloads can be regrouped as they are
+static int __repacketize_possible(const struct rtp_payload_type *src, const struct rtp_payload_type *dst) {
+	unsigned int bytes, ticks;
+
+	if (!src->codec_def || src->codec_def != dst->codec_def)
+		return 0;
+	if (src->clock_rate != dst->clock_rate || src->channels != dst->channels)
+		return 0;
+	if (src->ptime <= 0 || dst->ptime <= 0)
+		return 0;
+	if (src->codec_def->format_cmp) {
+		if (src->codec_def->format_cmp(src, dst))
+			return 0;
+	}
+	else if (str_cmp_str(&src->format_parameters, &dst->format_parameters))
+		return 0;
+	if (codec_frame_unit(dst->codec_def, dst->channels, &bytes, &ticks))
+		return 0;
+	// output packets must consist of whole units
+	if ((dst->clock_rate * dst->ptime / 1000) % ticks)
+		return 0;
+	return 1;
+}
+static void __make_repacketizer(struct codec_handler *handler, struct rtp_payload_type *dest) {
+	__handler_shutdown(handler);
+	ilog(LOG_DEBUG, "Using repacketizer for " STR_FORMAT " (ptime %i -> %i)",
+			STR_FMT(&handler->source_pt.encoding_with_params),
+			handler->source_pt.ptime, dest->ptime);
+	handler->dest_pt = *dest;
+	handler->func = handler_func_repacketize;
+	__handler_ssrc_hash(handler, __ssrc_handler_repacketize_new);
+}
+
+// decodes into the conference mixer, nothing is sent to the sink
+static void __make_conference_input(struct codec_handler *handler) {
+	if (handler->func == handler_func_conference)
+		return;
+	__handler_shutdown(handler);
+	ilog(LOG_DEBUG, "Using conference input for " STR_FORMAT,
+			STR_FMT(&handler->source_pt.encoding_with_params));
+	handler->dest_pt = handler->source_pt;
+	handler->func = handler_func_conference;
+	handler->transcoder = 1;
+	handler->packet_decoded = packet_decoded_conference;
+	__handler_ssrc_hash(handler, __ssrc_handler_decode_new);
+}
+static void __make_drop(struct codec_handler *handler) {
+	if (handler->func == handler_func_drop)
+		return;
+	__handler_shutdown(handler);
+	ilog(LOG_DEBUG, "Dropping media for " STR_FORMAT,
+			STR_FMT(&handler->source_pt.encoding_with_params));
+	handler->dest_pt = handler->source_pt;
+	handler->func = handler_func_drop;
 }
 
 static void __make_transcoder(struct codec_handler *handler, struct rtp_payload_type *dest,
@@ -272,6 +416,12 @@ static void __make_transcoder(struct codec_handler *handler, struct rtp_payload_
 	if (dtmf_payload_type == -1 && dest->codec_def && dest->codec_def->dtmf)
 		dtmf_payload_type = dest->payload_type;
 
+	// check if we have multiple decoders transcoding to the same output PT
+	struct codec_handler *output_handler = NULL;
+	if (output_transcoders)
+		output_handler = g_hash_table_lookup(output_transcoders,
+				GINT_TO_POINTER(dest->payload_type));
+
 	// don't reset handler if it already matches what we want
 	if (!handler->transcoder)
 		goto reset;
@@ -279,6 +429,9 @@ static void __make_transcoder(struct codec_handler *handler, struct rtp_payload_
 		goto reset;
 	if (handler->func != handler_func_transcode)
 		goto reset;
+	// existing SSRC contexts only have an encoder if they were created as the output
+	if ((output_handler ? : handler) != handler->output_handler)
+		goto reset;
 
 	ilog(LOG_DEBUG, "Leaving transcode context for " STR_FORMAT " -> " STR_FORMAT " intact",
 			STR_FMT(&handler->source_pt.encoding_with_params),
@@ -309,7 +462,7 @@ reset:
 				STR_FMT(&handler->source_pt.encoding_with_params),
 				STR_FMT(&dest->encoding_with_params), dtmf_payload_type);
 
-	handler->ssrc_hash = create_ssrc_hash_full(__ssrc_handler_transcode_new, handler);
+	__handler_ssrc_hash(handler, __ssrc_handler_transcode_new);
 
 	// stats entry
 	handler->stats_chain = g_strdup_printf(STR_FORMAT " -> " STR_FORMAT,
@@ -332,12 +485,7 @@ reset:
 
 	g_atomic_int_inc(&stats_entry->num_transcoders);
 
-check_output:;
-	// check if we have multiple decoders transcoding to the same output PT
-	struct codec_handler *output_handler = NULL;
-	if (output_transcoders)
-		output_handler = g_hash_table_lookup(output_transcoders,
-				GINT_TO_POINTER(dest->payload_type));
+check_output:
 	if (output_handler) {
 		ilog(LOG_DEBUG, "Using existing encoder context");
 		handler->output_handler = output_handler;
@@ -959,7 +1107,8 @@ static struct codec_handler *__get_pt_handler(struct call_media *receiver, struc
 		if (rtp_payload_type_cmp(pt, &handler->source_pt)) {
 			ilog(LOG_DEBUG, "Resetting codec handler for PT %u", pt->payload_type);
 			handler = NULL;
-			g_atomic_pointer_set(&receiver->codec_handler_cache, NULL);
+			if (pt->payload_type >= 0 && pt->payload_type < G_N_ELEMENTS(receiver->codec_handlers_pt))
+				g_atomic_pointer_set(&receiver->codec_handlers_pt[pt->payload_type], NULL);
 			g_hash_table_remove(receiver->codec_handlers, GINT_TO_POINTER(pt->payload_type));
 		}
 	}
@@ -970,6 +1119,10 @@ static struct codec_handler *__get_pt_handler(struct call_media *receiver, struc
 		g_hash_table_insert(receiver->codec_handlers,
 				GINT_TO_POINTER(handler->source_pt.payload_type),
 				handler);
+		if (handler->source_pt.payload_type >= 0
+				&& handler->source_pt.payload_type < G_N_ELEMENTS(receiver->codec_handlers_pt))
+			g_atomic_pointer_set(&receiver->codec_handlers_pt[handler->source_pt.payload_type],
+					handler);
 		g_queue_push_tail(&receiver->codec_handlers_store, handler);
 	}
 
@@ -1112,40 +1265,30 @@ static void __rtcp_timer_free(void *p) {
 		obj_put(rt->call);
 	g_slice_free1(sizeof(*rt), rt);
 }
-// master lock held in W
-static void __codec_rtcp_timer_schedule(struct call_media *media) {
-	struct rtcp_timer *rt = g_slice_alloc0(sizeof(*rt));
-	rt->ttq_entry.when = media->rtcp_timer;
-	rt->call = obj_get(media->call);
-	rt->media = media;
-
-	timerthread_queue_push(&rtcp_timer_queue->ttq, &rt->ttq_entry);
-}
-// no lock held
-static void __rtcp_timer_run(struct timerthread_queue *q, void *p) {
-	struct rtcp_timer *rt = p;
-
-	// check scheduling
-	rwlock_lock_w(&rt->call->master_lock);
-	struct call_media *media = rt->media;
-	struct timeval rtcp_timer = media->rtcp_timer;
+// master lock held in W. one timer per call, set to fire when the first of its
+// media's reports is due. older timers of the call that are still queued are stale
+// and detected as such when they fire.
+static void __codec_rtcp_timer_schedule(struct call *call, const struct timeval *due) {
+	struct timeval when = *due;
+	// round up to the next tick, so that timers of many calls fire together
+	long rem = when.tv_usec % RTCP_TIMER_TICK;
+	if (rem)
+		timeval_add_usec(&when, RTCP_TIMER_TICK - rem);
 
-	log_info_call(rt->call);
+	if (call->rtcp_timer.tv_sec && timeval_cmp(&call->rtcp_timer, &when) <= 0)
+		return; // already scheduled early enough
 
-	if (!rtcp_timer.tv_sec || timeval_diff(&rtpe_now, &rtcp_timer) < 0 || !proto_is_rtp(media->protocol)) {
-		__rtcp_timer_free(rt);
-		rwlock_unlock_w(&rt->call->master_lock);
-		goto out;
-	}
-	timeval_add_usec(&rtcp_timer, 5000000 + (random() % 2000000));
-	media->rtcp_timer = rtcp_timer;
-	__codec_rtcp_timer_schedule(media);
+	call->rtcp_timer = when;
 
-	// switch locks to be more graceful
-	rwlock_unlock_w(&rt->call->master_lock);
-
-	rwlock_lock_r(&rt->call->master_lock);
+	struct rtcp_timer *rt = g_slice_alloc0(sizeof(*rt));
+	rt->ttq_entry.when = when;
+	rt->call = obj_get(call);
 
+	struct rtcp_timer_queue *rtq = timerthread_pollers_get(&codec_timers, call->poller)->priv;
+	timerthread_queue_push(&rtq->ttq, &rt->ttq_entry);
+}
+// master lock held in W
+static void __rtcp_timer_send(struct call_media *media, GString *buf) {
 	struct ssrc_ctx *ssrc_out = NULL;
 	if (media->streams.head) {
 		struct packet_stream *ps = media->streams.head->data;
@@ -1156,17 +1299,58 @@ static void __rtcp_timer_run(struct timerthread_queue *q, void *p) {
 		mutex_unlock(&ps->out_lock);
 	}
 
-	if (ssrc_out)
-		rtcp_send_report(media, ssrc_out);
+	if (!ssrc_out)
+		return;
 
-	rwlock_unlock_r(&rt->call->master_lock);
+	rtcp_send_report(media, ssrc_out, buf);
+	obj_put(&ssrc_out->parent->h);
+}
+// no lock held
+static void __rtcp_timer_run(struct timerthread_queue *q, void *p) {
+	struct rtcp_timer *rt = p;
+	struct call *call = rt->call;
+	static __thread GString *buf; // reused for all reports
 
-	if (ssrc_out)
-		obj_put(&ssrc_out->parent->h);
+	if (!buf)
+		buf = g_string_sized_new(256);
 
-	__rtcp_timer_free(rt);
+	call_lock_w(call);
+
+	log_info_call(call);
+
+	// superseded by an earlier timer?
+	if (timeval_cmp(&call->rtcp_timer, &rt->ttq_entry.when))
+		goto out;
+	call->rtcp_timer.tv_sec = 0;
+
+	struct timeval deadline = rtpe_now;
+	timeval_add_usec(&deadline, RTCP_TIMER_SLACK);
+	struct timeval next = {0,};
+
+	for (GList *l = call->medias.head; l; l = l->next) {
+		struct call_media *media = l->data;
+		if (!media->rtcp_timer.tv_sec)
+			continue;
+		if (!proto_is_rtp(media->protocol)) {
+			media->rtcp_timer.tv_sec = 0;
+			continue;
+		}
+
+		if (timeval_cmp(&media->rtcp_timer, &deadline) <= 0) {
+			__rtcp_timer_send(media, buf);
+			media->rtcp_timer = rtpe_now;
+			timeval_add_usec(&media->rtcp_timer, 5000000 + (random() % 2000000));
+		}
+
+		timeval_lowest(&next, &media->rtcp_timer);
+	}
+
+	if (next.tv_sec)
+		__codec_rtcp_timer_schedule(call, &next);
 
 out:
+	call_unlock_w(call);
+	__rtcp_timer_free(rt);
 	log_info_clear();
 }
 // master lock held in W
@@ -1176,7 +1360,7 @@ static void __codec_rtcp_timer(struct call_media *receiver) {
 
 	receiver->rtcp_timer = rtpe_now;
 	timeval_add_usec(&receiver->rtcp_timer, 5000000 + (random() % 2000000));
-	__codec_rtcp_timer_schedule(receiver);
+	__codec_rtcp_timer_schedule(receiver->call, &receiver->rtcp_timer);
 	// XXX unify with media player into a generic RTCP player
 }
 
@@ -1212,6 +1396,112 @@ int __supp_codec_match(struct call_media *receiver, struct call_media *sink, int
 	return 2;
 }
 
+// Memoised outcomes of codec_handlers_update() which resulted in plain passthrough
+// without touching any of the codec lists. Keyed by a signature of everything that
+// the decision depends on. Transcoding outcomes are never cached as they create
+// per-call state.
+#define CODEC_PLAN_CACHE_MAX 1024
+
+struct codec_plan {
+	uint64_t dtmf_shutdown[2]; // PTs for which __dtmf_dsp_shutdown() was called
+};
+
+static mutex_t codec_plan_lock = MUTEX_STATIC_INIT;
+static GHashTable *codec_plan_cache;
+
+static void __codec_plan_sig_pts(GString *s, char tag, GQueue *q) {
+	g_string_append_c(s, tag);
+	for (GList *l = q->head; l; l = l->next) {
+		struct rtp_payload_type *pt = l->data;
+		g_string_append_printf(s, "%i " STR_FORMAT " " STR_FORMAT " " STR_FORMAT " %i %i %i %i|",
+				pt->payload_type, STR_FMT(&pt->encoding_with_params),
+				STR_FMT(&pt->format_parameters), STR_FMT(&pt->codec_opts),
+				pt->ptime, pt->bitrate, pt->for_transcoding ? 1 : 0,
+				pt->codec_def ? 1 : 0);
+	}
+}
+// returns NULL if the outcome can't be cached
+static GString *__codec_plan_sig(struct call_media *receiver, struct call_media *sink,
+		const struct sdp_ng_flags *flags)
+{
+	if (MEDIA_ISSET(sink, TRANSCODE))
+		return NULL;
+	GString *s = g_string_sized_new(256);
+	if (flags)
+		g_string_append_printf(s, "%i %i %i %i %i", flags->opmode, flags->symmetric_codecs ? 1 : 0,
+				flags->asymmetric_codecs ? 1 : 0, flags->inject_dtmf ? 1 : 0,
+				flags->single_codec ? 1 : 0);
+	g_string_append_printf(s, "/%i", sink->ptime);
+	__codec_plan_sig_pts(s, 'a', &receiver->codecs_prefs_recv);
+	__codec_plan_sig_pts(s, 'b', &receiver->codecs_prefs_send);
+	__codec_plan_sig_pts(s, 'c', &sink->codecs_prefs_recv);
+	__codec_plan_sig_pts(s, 'd', &sink->codecs_prefs_send);
+	return s;
+}
+static int __codec_plan_lookup(const GString *sig, struct codec_plan *out) {
+	int ret = 0;
+	mutex_lock(&codec_plan_lock);
+	struct codec_plan *plan = codec_plan_cache ? g_hash_table_lookup(codec_plan_cache, sig->str) : NULL;
+	if (plan) {
+		*out = *plan;
+		ret = 1;
+	}
+	mutex_unlock(&codec_plan_lock);
+	return ret;
+}
+static void __codec_plan_store(GString *sig, const struct codec_plan *plan) {
+	mutex_lock(&codec_plan_lock);
+	if (!codec_plan_cache)
+		codec_plan_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	else if (g_hash_table_size(codec_plan_cache) >= CODEC_PLAN_CACHE_MAX)
+		g_hash_table_remove_all(codec_plan_cache);
+	g_hash_table_replace(codec_plan_cache, g_string_free(sig, FALSE), g_memdup(plan, sizeof(*plan)));
+	mutex_unlock(&codec_plan_lock);
+}
+static void __codec_plan_dtmf_shutdown(struct codec_plan *plan, struct call_media *sink, int payload_type) {
+	__dtmf_dsp_shutdown(sink, payload_type);
+	if (payload_type >= 0 && payload_type < 128)
+		plan->dtmf_shutdown[payload_type / 64] |= 1ULL << (payload_type % 64);
+}
+static void __codec_plan_apply(const struct codec_plan *plan, struct call_media *receiver,
+		struct call_media *sink)
+{
+	ilog(LOG_DEBUG, "Using cached passthrough codec plan");
+	for (GList *l = receiver->codecs_prefs_recv.head; l; l = l->next) {
+		struct rtp_payload_type *pt = l->data;
+		struct codec_handler *handler = __get_pt_handler(receiver, pt);
+		__make_passthrough(handler);
+		int ptype = pt->payload_type;
+		if (ptype >= 0 && ptype < 128 && (plan->dtmf_shutdown[ptype / 64] & (1ULL << (ptype % 64))))
+			__dtmf_dsp_shutdown(sink, ptype);
+	}
+}
+
+
+// media from a conference participant goes to the mixer, media from the other side of
+// a participant goes nowhere. call must be locked in W
+static void __conference_handlers(struct call_media *receiver) {
+	int input = 0;
+
+	for (GList *l = receiver->codecs_prefs_recv.head; l; l = l->next) {
+		struct rtp_payload_type *pt = l->data;
+		struct codec_handler *handler = __get_pt_handler(receiver, pt);
+		if (receiver->monologue->conference && receiver->type_id == MT_AUDIO
+				&& pt->codec_def && !pt->codec_def->supplemental)
+		{
+			__make_conference_input(handler);
+			input = 1;
+		}
+		else
+			__make_drop(handler);
+	}
+
+	if (input)
+		MEDIA_SET(receiver, TRANSCODE);
+	// RTCP goes nowhere either, the mixer produces its own
+	receiver->rtcp_handler = rtcp_sink_handler;
+}
+
 // call must be locked in W
 void codec_handlers_update(struct call_media *receiver, struct call_media *sink,
 		const struct sdp_ng_flags *flags, const struct stream_params *sp)
@@ -1246,6 +1536,20 @@ void codec_handlers_update(struct call_media *receiver, struct call_media *sink,
 
 	MEDIA_CLEAR(receiver, TRANSCODE);
 	receiver->rtcp_handler = NULL;
+
+	if (receiver->monologue->conference || sink->monologue->conference) {
+		__conference_handlers(receiver);
+		goto out;
+	}
+
+	struct codec_plan plan = {{0,}};
+	GString *plan_sig = __codec_plan_sig(receiver, sink, flags);
+	if (plan_sig && __codec_plan_lookup(plan_sig, &plan)) {
+		g_string_free(plan_sig, TRUE);
+		__codec_plan_apply(&plan, receiver, sink);
+		goto out;
+	}
+
 	GSList *passthrough_handlers = NULL;
 
 	// we go through the list of codecs that the receiver supports and compare it
@@ -1413,6 +1717,18 @@ void codec_handlers_update(struct call_media *receiver, struct call_media *sink,
 			if (dest_pt->ptime && pt->ptime
 					&& dest_pt->ptime != pt->ptime)
 			{
+				// no need to go through the codecs if we can just regroup the payloads
+				if (!(flags && flags->inject_dtmf)
+						&& !(cn_pt_match == 2 && MEDIA_ISSET(sink, TRANSCODE))
+						&& __repacketize_possible(pt, dest_pt))
+				{
+					ilog(LOG_DEBUG, "Mismatched ptime between source and sink (%i <> %i), "
+							"repacketizing",
+						dest_pt->ptime, pt->ptime);
+					MEDIA_SET(receiver, TRANSCODE);
+					__make_repacketizer(handler, dest_pt);
+					goto next;
+				}
 				ilog(LOG_DEBUG, "Mismatched ptime between source and sink (%i <> %i), "
 						"enabling transcoding",
 					dest_pt->ptime, pt->ptime);
@@ -1438,7 +1754,7 @@ void codec_handlers_update(struct call_media *receiver, struct call_media *sink,
 			ilog(LOG_DEBUG, "Sink supports codec " STR_FORMAT, STR_FMT(&pt->encoding_with_params));
 			__make_passthrough_gsl(handler, &passthrough_handlers);
 			if (pt->codec_def && pt->codec_def->dtmf)
-				__dtmf_dsp_shutdown(sink, pt->payload_type);
+				__codec_plan_dtmf_shutdown(&plan, sink, pt->payload_type);
 			goto next;
 		}
 
@@ -1530,6 +1846,22 @@ next:
 
 	g_hash_table_destroy(output_transcoders);
 
+	// remember the outcome if nothing was transcoded and none of the inputs changed
+	if (plan_sig) {
+		GString *after = NULL;
+		if (!MEDIA_ISSET(receiver, TRANSCODE))
+			after = __codec_plan_sig(receiver, sink, flags);
+		if (after && g_string_equal(after, plan_sig)) {
+			__codec_plan_store(plan_sig, &plan);
+			plan_sig = NULL;
+		}
+		if (after)
+			g_string_free(after, TRUE);
+		if (plan_sig)
+			g_string_free(plan_sig, TRUE);
+	}
+
+out:
 	if (MEDIA_ISSET(receiver, RTCP_GEN)) {
 		receiver->rtcp_handler = rtcp_sink_handler;
 		__codec_rtcp_timer(receiver);
@@ -1538,24 +1870,12 @@ next:
 
 
 static struct codec_handler *codec_handler_get_rtp(struct call_media *m, int payload_type) {
-	struct codec_handler *h;
-
-	if (payload_type < 0)
-		return NULL;
-
-	h = g_atomic_pointer_get(&m->codec_handler_cache);
-	if (G_LIKELY(G_LIKELY(h) && G_LIKELY(h->source_pt.payload_type == payload_type)))
-		return h;
+	if (G_LIKELY(payload_type >= 0 && payload_type < G_N_ELEMENTS(m->codec_handlers_pt)))
+		return g_atomic_pointer_get(&m->codec_handlers_pt[payload_type]);
 
-	if (G_UNLIKELY(!m->codec_handlers))
+	if (payload_type < 0 || !m->codec_handlers)
 		return NULL;
-	h = g_hash_table_lookup(m->codec_handlers, GINT_TO_POINTER(payload_type));
-	if (!h)
-		return NULL;
-
-	g_atomic_pointer_set(&m->codec_handler_cache, h);
-
-	return h;
+	return g_hash_table_lookup(m->codec_handlers, GINT_TO_POINTER(payload_type));
 }
 static struct codec_handler *codec_handler_get_udptl(struct call_media *m) {
 	if (m->t38_handler)
@@ -1582,6 +1902,9 @@ struct codec_handler *codec_handler_get(struct call_media *m, int payload_type)
 out:
 	if (ret)
 		return ret;
+	if (m->monologue && (m->monologue->conference
+				|| (m->monologue->active_dialogue && m->monologue->active_dialogue->conference)))
+		return &codec_handler_stub_drop;
 	if (MEDIA_ISSET(m, TRANSCODE))
 		return &codec_handler_stub_ssrc;
 #endif
@@ -1592,7 +1915,7 @@ void codec_handlers_free(struct call_media *m) {
 	if (m->codec_handlers)
 		g_hash_table_destroy(m->codec_handlers);
 	m->codec_handlers = NULL;
-	m->codec_handler_cache = NULL;
+	memset(m->codec_handlers_pt, 0, sizeof(m->codec_handlers_pt));
 #ifdef WITH_TRANSCODING
 	g_queue_clear_full(&m->codec_handlers_store, __codec_handler_free);
 	m->dtmf_injector = NULL;
@@ -1601,9 +1924,11 @@ void codec_handlers_free(struct call_media *m) {
 
 
 void codec_add_raw_packet(struct media_packet *mp) {
-	struct codec_packet *p = g_slice_alloc0(sizeof(*p));
+	struct codec_packet *p = codec_packet_new();
 	p->s = mp->raw;
 	p->free_func = NULL;
+	p->rx_tv = mp->tv;
+	p->rx_hwts = mp->hwts;
 	if (mp->rtp && mp->ssrc_out) {
 		p->ssrc_out = ssrc_ctx_get(mp->ssrc_out);
 		p->rtp = mp->rtp;
@@ -1692,6 +2017,8 @@ static int __handler_func_sequencer(struct media_packet *mp, struct transcode_pa
 
 	u_int16_t seq_ori = ssrc_in_p->sequencer.seq;
 	int seq_ret = packet_sequencer_insert(&ssrc_in_p->sequencer, &packet->p);
+	TRACE(mp->call, mp->sfd ? mp->sfd->socket.local.port : 0, SEQ_INSERT, packet->p.seq, packet_ts,
+			seq_ret, ssrc_in_p->sequencer.seq);
 	if (seq_ret < 0) {
 		// dupe
 		if (packet->dup_func)
@@ -1707,6 +2034,7 @@ static int __handler_func_sequencer(struct media_packet *mp, struct transcode_pa
 
 	while (1) {
 		int func_ret = 0;
+		int seq_expected = ssrc_in_p->sequencer.seq;
 
 		packet = seq_next_packet(&ssrc_in_p->sequencer);
 		if (G_UNLIKELY(!packet)) {
@@ -1745,6 +2073,12 @@ static int __handler_func_sequencer(struct media_packet *mp, struct transcode_pa
 			ssrc_out_p->seq_diff -= packet->p.seq - seq_ori;
 			seq_ret = 0;
 		}
+		else if (seq_expected >= 0) {
+			// tell the decoder about a short gap, so it can recover what's there
+			uint16_t gap = packet->p.seq - seq_expected;
+			if (gap && gap <= FEC_MAX_LOST)
+				packet->lost = gap;
+		}
 
 		// we might be working with a different packet now
 		mp->rtp = &packet->rtp;
@@ -1752,6 +2086,8 @@ static int __handler_func_sequencer(struct media_packet *mp, struct transcode_pa
 		func_ret = packet->func(ch, packet, mp);
 		if (func_ret < 0)
 			ilog(LOG_WARN | LOG_FLAG_LIMIT, "Decoder error while processing RTP packet");
+		TRACE(mp->call, mp->sfd ? mp->sfd->socket.local.port : 0, SEQ_OUTPUT, packet->p.seq,
+				packet->ts, ssrc_in_p->sequencer.lost_count, func_ret);
 next:
 		if (func_ret != 1)
 			__transcode_packet_free(packet);
@@ -1766,7 +2102,7 @@ out:
 
 static void __output_rtp(struct media_packet *mp, struct codec_ssrc_handler *ch,
 		struct codec_handler *handler, // normally == ch->handler except for DTMF
-		char *buf, // malloc'd, room for rtp_header + filled-in payload
+		char *buf, // from codec_packet_buffer(), with filled-in payload
 		unsigned int payload_len,
 		unsigned long payload_ts,
 		int marker, int seq, int seq_inc, int payload_type)
@@ -1789,15 +2125,17 @@ static void __output_rtp(struct media_packet *mp, struct codec_ssrc_handler *ch,
 	rh->ssrc = htonl(ssrc_out_p->h.ssrc);
 
 	// add to output queue
-	struct codec_packet *p = g_slice_alloc0(sizeof(*p));
+	struct codec_packet *p = codec_packet_new();
 	p->s.s = buf;
 	p->s.len = payload_len + sizeof(struct rtp_header);
 	payload_tracker_add(&ssrc_out->tracker, handler->dest_pt.payload_type);
-	p->free_func = free;
+	p->free_func = codec_packet_buffer_free;
 	p->ttq_entry.source = handler;
 	p->rtp = rh;
 	p->ts = ts;
 	p->ssrc_out = ssrc_ctx_get(ssrc_out);
+	p->rx_tv = mp->tv;
+	p->rx_hwts = mp->hwts;
 
 	// this packet is dynamically allocated, so we're able to schedule it.
 	// determine scheduled time to send
@@ -1875,8 +2213,10 @@ static void packet_dtmf_fwd(struct codec_ssrc_handler *ch, struct transcode_pack
 		// this is actually a DTMF -> PCM handler
 		// grab our underlying PCM transcoder
 		struct codec_ssrc_handler *output_ch = __output_ssrc_handler(ch, mp);
-		if (G_UNLIKELY(!ch->encoder || !output_ch->encoder))
+		if (G_UNLIKELY(!output_ch->encoder)) {
+			obj_put(&output_ch->h);
 			goto skip;
+		}
 
 		// init some vars
 		if (!ch->first_ts)
@@ -1919,7 +2259,7 @@ static void packet_dtmf_fwd(struct codec_ssrc_handler *ch, struct transcode_pack
 	}
 
 skip:;
-	char *buf = malloc(packet->payload->len + sizeof(struct rtp_header) + RTP_BUFFER_TAIL_ROOM);
+	char *buf = codec_packet_buffer(packet->payload->len);
 	memcpy(buf + sizeof(struct rtp_header), packet->payload->s, packet->payload->len);
 	if (packet->ignore_seq) // inject original seq
 		__output_rtp(mp, ch, packet->handler ? : ch->handler, buf, packet->payload->len, packet->ts,
@@ -1992,7 +2332,7 @@ static int __handler_func_supplemental(struct codec_handler *h, struct media_pac
 
 	// XXX ? h->output_handler = sequencer_h->output_handler; // XXX locking?
 
-	struct transcode_packet *packet = g_slice_alloc0(sizeof(*packet));
+	struct transcode_packet *packet = transcode_packet_new();
 	packet->func = func;
 	packet->dup_func = dup_func;
 	packet->handler = h;
@@ -2024,12 +2364,53 @@ static int handler_func_t38(struct codec_handler *h, struct media_packet *mp) {
 
 
 
+// output packets and their buffers are recycled, see struct freelist
+#define CODEC_PACKETS_CACHED 64
+#define PACKET_BUFFERS_CACHED 32
+// big enough for any usual payload
+#define PACKET_BUFFER_SIZE (sizeof(struct rtp_header) + 1500 + RTP_BUFFER_TAIL_ROOM)
+
+struct packet_buffer_hdr {
+	size_t size;
+} __attribute__ ((aligned (16)));
+
+static __thread struct freelist codec_packets;
+static __thread struct freelist packet_buffers;
+
+struct codec_packet *codec_packet_new(void) {
+	return freelist_alloc0(&codec_packets, sizeof(struct codec_packet));
+}
+
 void codec_packet_free(void *pp) {
 	struct codec_packet *p = pp;
 	if (p->free_func)
 		p->free_func(p->s.s);
 	ssrc_ctx_put(&p->ssrc_out);
-	g_slice_free1(sizeof(*p), p);
+	freelist_free(&codec_packets, p, sizeof(*p), CODEC_PACKETS_CACHED);
+}
+
+// room for an RTP header, `len` bytes of payload and RTP_BUFFER_TAIL_ROOM
+char *codec_packet_buffer(size_t len) {
+	size_t size = sizeof(struct rtp_header) + len + RTP_BUFFER_TAIL_ROOM;
+	struct packet_buffer_hdr *h;
+
+	if (G_UNLIKELY(size > PACKET_BUFFER_SIZE))
+		h = g_malloc(sizeof(*h) + size);
+	else {
+		size = PACKET_BUFFER_SIZE;
+		h = freelist_alloc(&packet_buffers, sizeof(*h) + size);
+	}
+	h->size = size;
+	return (char *) (h + 1);
+}
+
+void codec_packet_buffer_free(void *p) {
+	struct packet_buffer_hdr *h = (struct packet_buffer_hdr *) p - 1;
+	if (G_UNLIKELY(h->size != PACKET_BUFFER_SIZE)) {
+		g_free(h);
+		return;
+	}
+	freelist_free(&packet_buffers, h, sizeof(*h) + PACKET_BUFFER_SIZE, PACKET_BUFFERS_CACHED);
 }
 
 
@@ -2150,9 +2531,15 @@ static int handler_func_passthrough_ssrc(struct codec_handler *h, struct media_p
 }
 
 
+static __thread struct freelist transcode_packets;
+
+static struct transcode_packet *transcode_packet_new(void) {
+	return freelist_alloc0(&transcode_packets, sizeof(struct transcode_packet));
+}
+
 static void __transcode_packet_free(struct transcode_packet *p) {
 	free(p->payload);
-	g_slice_free1(sizeof(*p), p);
+	freelist_free(&transcode_packets, p, sizeof(*p), CODEC_PACKETS_CACHED);
 }
 
 static struct ssrc_entry *__ssrc_handler_new(void *p) {
@@ -2163,6 +2550,122 @@ static struct ssrc_entry *__ssrc_handler_new(void *p) {
 	return &ch->h;
 }
 
+static struct ssrc_entry *__ssrc_handler_repacketize_new(void *p) {
+	struct codec_handler *h = p;
+	struct codec_ssrc_handler *ch = obj_alloc0("codec_ssrc_handler", sizeof(*ch), __free_ssrc_handler);
+	ch->handler = h;
+	ch->ptime = h->dest_pt.ptime;
+	ch->sample_buffer = g_string_new("");
+	// used for output scheduling
+	ch->encoder_format.clockrate = h->dest_pt.clock_rate * h->dest_pt.codec_def->clockrate_mult;
+	ch->encoder_format.channels = h->dest_pt.channels;
+	codec_frame_unit(h->dest_pt.codec_def, h->dest_pt.channels, &ch->repack_unit_bytes,
+			&ch->repack_unit_ticks);
+	ch->bytes_per_packet = h->dest_pt.clock_rate * ch->ptime / 1000 / ch->repack_unit_ticks
+		* ch->repack_unit_bytes;
+	ilog(LOG_DEBUG, "Creating SSRC repacketizer for %s/%u/%i, %i bytes per packet",
+			h->dest_pt.codec_def->rtpname, h->dest_pt.clock_rate, h->dest_pt.channels,
+			ch->bytes_per_packet);
+	return &ch->h;
+}
+
+// send out the first `len` bytes of the sample buffer
+static void __repacketize_send(struct codec_ssrc_handler *ch, struct media_packet *mp, unsigned int len,
+		unsigned int ticks)
+{
+	char *buf = codec_packet_buffer(len);
+	memcpy(buf + sizeof(struct rtp_header), ch->sample_buffer->str, len);
+	g_string_erase(ch->sample_buffer, 0, len);
+
+	__output_rtp(mp, ch, ch->handler, buf, len, ch->repack_ts, ch->rtp_mark ? 1 : 0, -1, 1, -1);
+	ch->rtp_mark = 0;
+	ch->repack_ts += ticks;
+}
+
+// send out whatever is left in the sample buffer, even if it's less than a full packet
+static void __repacketize_flush(struct codec_ssrc_handler *ch, struct media_packet *mp) {
+	if (!ch->sample_buffer->len)
+		return;
+	__repacketize_send(ch, mp, ch->sample_buffer->len,
+			ch->sample_buffer->len / ch->repack_unit_bytes * ch->repack_unit_ticks);
+}
+
+// like the transcoder, we produce a continuous output stream: input gaps and TS resets
+// don't show up in the output TS
+static int packet_repacketize(struct codec_ssrc_handler *ch, struct transcode_packet *packet,
+		struct media_packet *mp)
+{
+	if (!ch->first_ts) {
+		ch->first_ts = packet->ts;
+		ch->repack_ts = packet->ts;
+		ch->repack_in_ts = packet->ts;
+	}
+	ch->last_ts = packet->ts;
+
+	// output seq numbers advance once per packet sent
+	mp->ssrc_out->parent->seq_diff--;
+
+	// a new talkspurt or a gap in the input: the remainder of what came before doesn't
+	// continue into this packet, so it goes out on its own
+	if (packet->marker || (uint32_t) packet->ts != (uint32_t) ch->repack_in_ts)
+		__repacketize_flush(ch, mp);
+	if (packet->marker)
+		ch->rtp_mark = 1;
+
+	unsigned int len = packet->payload->len;
+
+	if (G_UNLIKELY(len % ch->repack_unit_bytes)) {
+		// odd-sized payload (e.g. G.729 SID) can't be split up: send out what we have
+		// first, then pass it on as it is
+		__repacketize_flush(ch, mp);
+		g_string_append_len(ch->sample_buffer, packet->payload->s, len);
+		unsigned int ticks = MAX(len / ch->repack_unit_bytes, 1) * ch->repack_unit_ticks;
+		__repacketize_send(ch, mp, len, ticks);
+		ch->repack_in_ts = packet->ts + ticks;
+		return 0;
+	}
+
+	g_string_append_len(ch->sample_buffer, packet->payload->s, len);
+	ch->repack_in_ts = packet->ts + len / ch->repack_unit_bytes * ch->repack_unit_ticks;
+
+	while (ch->sample_buffer->len >= ch->bytes_per_packet)
+		__repacketize_send(ch, mp, ch->bytes_per_packet,
+				ch->bytes_per_packet / ch->repack_unit_bytes * ch->repack_unit_ticks);
+
+	return 0;
+}
+
+// released DTMF RX states are kept and re-initialised in place for new SSRC handlers
+#define DTMF_RX_POOL_MAX 64
+
+static mutex_t dtmf_rx_pool_lock = MUTEX_STATIC_INIT;
+static GQueue dtmf_rx_pool = G_QUEUE_INIT;
+
+static dtmf_rx_state_t *__dtmf_rx_pool_get(void) {
+	mutex_lock(&dtmf_rx_pool_lock);
+	dtmf_rx_state_t *dsp = g_queue_pop_head(&dtmf_rx_pool);
+	mutex_unlock(&dtmf_rx_pool_lock);
+
+	if (!dsp)
+		return dtmf_rx_init(NULL, NULL, NULL);
+
+	dtmf_rx_release(dsp);
+	if (dtmf_rx_init(dsp, NULL, NULL))
+		return dsp;
+	dtmf_rx_free(dsp);
+	return NULL;
+}
+static void __dtmf_rx_pool_put(dtmf_rx_state_t *dsp) {
+	mutex_lock(&dtmf_rx_pool_lock);
+	if (dtmf_rx_pool.length < DTMF_RX_POOL_MAX) {
+		g_queue_push_tail(&dtmf_rx_pool, dsp);
+		dsp = NULL;
+	}
+	mutex_unlock(&dtmf_rx_pool_lock);
+	if (dsp)
+		dtmf_rx_free(dsp);
+}
+
 static void __dtmf_dsp_callback(void *ptr, int code, int level, int delay) {
 	struct codec_ssrc_handler *ch = ptr;
 	uint64_t ts = ch->last_dtmf_event_ts + delay;
@@ -2187,6 +2690,8 @@ uint64_t codec_last_dtmf_event(struct codec_ssrc_handler *ch) {
 }
 
 uint64_t codec_encoder_pts(struct codec_ssrc_handler *ch) {
+	if (!ch->encoder)
+		return 0;
 	return ch->encoder->fifo_pts;
 }
 
@@ -2223,114 +2728,222 @@ static int codec_decoder_event(enum codec_event event, void *ptr, void *data) {
 	return 0;
 }
 
-static void __dtx_add_callback(struct dtx_buffer *dtxb, const struct timeval *base, unsigned int offset,
-		const struct media_packet *mp, unsigned long ts, int seq_add, void *ssrc_ptr)
+static void __dtx_frame_release(struct dtx_frame *f) {
+	if (f->packet)
+		__transcode_packet_free(f->packet);
+	f->packet = NULL;
+	media_packet_release(&f->mp);
+}
+// dtxb->lock must be held
+static void __dtx_frames_clear(struct dtx_buffer *dtxb) {
+	while (dtxb->len) {
+		__dtx_frame_release(&dtxb->frames[dtxb->head]);
+		dtxb->head = (dtxb->head + 1) % DTX_RING;
+		dtxb->len--;
+	}
+}
+// takes over the packet. call is locked in R
+static void __dtx_add_frame(struct dtx_buffer *dtxb, struct transcode_packet *packet,
+		const struct media_packet *mp)
+{
+	int start_tick = 0;
+
+	mutex_lock(&dtxb->lock);
+
+	dtxb->start = rtpe_now.tv_sec;
+
+	if (dtxb->len == DTX_RING) {
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "DTX buffer overflow, discarding oldest packet");
+		__dtx_frame_release(&dtxb->frames[dtxb->head]);
+		dtxb->head = (dtxb->head + 1) % DTX_RING;
+		dtxb->len--;
+	}
+
+	struct dtx_frame *f = &dtxb->frames[(dtxb->head + dtxb->len) % DTX_RING];
+	f->packet = packet;
+	media_packet_copy(&f->mp, mp);
+	f->when = rtpe_now;
+	timeval_add_usec(&f->when, rtpe_config.dtx_delay * 1000);
+	dtxb->len++;
+
+	if (!dtxb->tick_queued && dtxb->call) {
+		dtxb->tick_queued = 1;
+		dtxb->tick.when = f->when;
+		start_tick = 1;
+	}
+
+	mutex_unlock(&dtxb->lock);
+
+	if (start_tick)
+		timerthread_queue_push(&dtxb->ttq, &dtxb->tick);
+}
+// sends out packets that were produced outside of the stream's receiving context.
+// call must be locked in R
+static void __buffered_send(struct media_packet *mp) {
+	struct packet_stream *ps = mp->stream;
+
+	if (!mp->packets_out.length)
+		return;
+
+	struct packet_stream *sink = ps->rtp_sink;
+
+	if (!sink)
+		media_socket_dequeue(mp, NULL); // just free
+	else {
+		if (ps->handler && media_packet_encrypt(ps->handler->out->rtp_crypt,
+					ps->handler->out->rtp_crypt_batch, sink, mp))
+			ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error encrypting buffered RTP media");
+
+		mutex_lock(&sink->out_lock);
+		if (media_socket_dequeue(mp, sink))
+			ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error sending buffered media to RTP sink");
+		mutex_unlock(&sink->out_lock);
+	}
+}
+// decodes and, through the decoder callback, resamples, runs DSP on and encodes one
+// packet. the thread CPU time taken is accounted to the handler's codec chain and call
+static int __packet_transcode(struct codec_ssrc_handler *ch, struct transcode_packet *packet,
+		struct media_packet *mp)
 {
-	struct dtx_entry *dtxe = g_slice_alloc0(sizeof(*dtxe));
-	dtxe->ttq_entry.when = *base;
-	timeval_add_usec(&dtxe->ttq_entry.when, offset);
-	dtxe->ts = ts;
-	media_packet_copy(&dtxe->mp, mp);
-	dtxe->mp.rtp->seq_num += htons(seq_add);
-	dtxe->ssrc_ptr = ssrc_ptr;
-	timerthread_queue_push(&dtxb->ttq, &dtxe->ttq_entry);
-}
-
-static void __dtx_entry_free(void *p) {
-	struct dtx_entry *dtxe = p;
-	if (dtxe->packet)
-		__transcode_packet_free(dtxe->packet);
-	media_packet_release(&dtxe->mp);
-	g_slice_free1(sizeof(*dtxe), dtxe);
-}
-static void __dtx_send_later(struct timerthread_queue *ttq, void *p) {
+	struct codec_stats *stats_entry = ch->handler->stats_entry;
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+	int ret = decoder_input_data_fec(ch->decoder, packet->payload, packet->ts, packet->lost,
+			ch->handler->packet_decoded, ch, mp);
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	int64_t ns = (end.tv_sec - start.tv_sec) * 1000000000LL + end.tv_nsec - start.tv_nsec;
+	if (stats_entry)
+		atomic64_add(&stats_entry->time_ns, ns);
+	atomic64_add(&ch->handler->media->call->transcode_ns, ns);
+
+	return ret;
+}
+// sends the packets whose delay has passed, or generates DTX if there are none
+static void __dtx_run(struct timerthread_queue *ttq, void *p) {
 	struct dtx_buffer *dtxb = (void *) ttq;
-	struct dtx_entry *dtxe = p;
-	struct transcode_packet *packet = dtxe->packet;
-	struct media_packet *mp = &dtxe->mp;
-	struct packet_stream *ps = mp->stream;
-	int ret = 0;
+	struct dtx_frame due[DTX_RING];
+	unsigned int num_due = 0;
+	int ret;
 
 	mutex_lock(&dtxb->lock);
+
 	struct codec_ssrc_handler *ch = dtxb->csh ? obj_get(&dtxb->csh->h) : NULL;
 	struct call *call = dtxb->call ? obj_get(dtxb->call) : NULL;
-	mutex_unlock(&dtxb->lock);
+	if (!call) {
+		// shut down
+		dtxb->tick_queued = 0;
+		mutex_unlock(&dtxb->lock);
+		return;
+	}
 
-	if (!call)
-		goto out; // shut down
+	// everything that's due within half a tick
+	struct timeval limit = rtpe_now;
+	timeval_add_usec(&limit, dtxb->ptime * 500);
+	while (dtxb->len) {
+		struct dtx_frame *f = &dtxb->frames[dtxb->head];
+		if (timeval_cmp(&f->when, &limit) > 0)
+			break;
+		due[num_due++] = *f;
+		dtxb->head = (dtxb->head + 1) % DTX_RING;
+		dtxb->len--;
+	}
 
-	log_info_stream_fd(mp->sfd);
+	int dtx = 0;
+	if (!num_due && !dtxb->len && dtxb->dtx_active) {
+		unsigned int diff = rtpe_now.tv_sec - dtxb->start;
+		if (dtxb->last_mp.stream->ssrc_in == dtxb->last_ssrc
+				&& (rtpe_config.max_dtx <= 0 || diff < rtpe_config.max_dtx))
+			dtx = 1;
+		else
+			dtxb->dtx_active = 0;
+	}
+
+	mutex_unlock(&dtxb->lock);
 
 	rwlock_lock_r(&call->master_lock);
-	__ssrc_lock_both(mp);
 
-	if (packet) {
-		ilog(LOG_DEBUG, "Decoding DTX-buffered RTP packet (TS %lu) now", packet->ts);
+	for (unsigned int i = 0; i < num_due; i++) {
+		struct dtx_frame *f = &due[i];
+		struct media_packet *mp = &f->mp;
+
+		log_info_stream_fd(mp->sfd);
+		__ssrc_lock_both(mp);
 
-		ret = decoder_input_data(ch->decoder, packet->payload, packet->ts,
-				ch->handler->packet_decoded, ch, &dtxe->mp);
+		ilog(LOG_DEBUG, "Decoding DTX-buffered RTP packet (TS %lu) now", f->packet->ts);
+
+		ret = __packet_transcode(ch, f->packet, mp);
 		mp->ssrc_out->parent->seq_diff--;
 		if (ret)
 			ilog(LOG_WARN | LOG_FLAG_LIMIT, "Decoder error while processing buffered RTP packet");
-	}
-	else {
-		unsigned long dtxe_ts = dtxe->ts;
-
-		mutex_lock(&dtxb->lock);
-		unsigned int diff = rtpe_now.tv_sec - dtxb->start;
-		unsigned long dtxb_ts = dtxb->ts;
-		void *ssrc_ptr = dtxe->mp.stream->ssrc_in;
 
-		if (dtxe_ts == dtxb_ts
-				&& ssrc_ptr == dtxe->ssrc_ptr
-				&& (rtpe_config.max_dtx <= 0 || diff < rtpe_config.max_dtx))
-		{
-			ilog(LOG_DEBUG, "RTP media for TS %lu+ missing, triggering DTX",
-					dtxe_ts);
+		__ssrc_unlock_both(mp);
 
-			dtxb_ts += dtxb->tspp;
-			dtxe_ts = dtxb_ts;
-			dtxb->ts = dtxb_ts;
-			mutex_unlock(&dtxb->lock);
+		if (ret == 0)
+			__buffered_send(mp);
 
-			ret = decoder_lost_packet(ch->decoder, dtxe_ts,
-					ch->handler->packet_decoded, ch, &dtxe->mp);
-			if (ret)
-				ilog(LOG_WARN | LOG_FLAG_LIMIT, "Decoder error handling DTX/lost packet");
+		// this becomes the template for DTX
+		if (dtxb->dtx_active)
+			media_packet_release(&dtxb->last_mp);
+		dtxb->last_mp = *mp;
+		dtxb->last_mp.rtp->seq_num += htons(1);
+		dtxb->last_ts = f->packet->ts;
+		dtxb->last_ssrc = mp->stream->ssrc_in;
+		dtxb->dtx_active = 1;
 
-			__dtx_add_callback(dtxb, &dtxe->ttq_entry.when, dtxb->ptime * 1000, mp, dtxe_ts, 0, ssrc_ptr);
-		}
-		else
-			mutex_unlock(&dtxb->lock);
+		__transcode_packet_free(f->packet);
 	}
 
-	__ssrc_unlock_both(mp);
+	if (dtx) {
+		struct media_packet *mp = &dtxb->last_mp;
 
-	if (mp->packets_out.length && ret == 0) {
-		struct packet_stream *sink = ps->rtp_sink;
+		log_info_stream_fd(mp->sfd);
+		__ssrc_lock_both(mp);
 
-		if (!sink)
-			media_socket_dequeue(mp, NULL); // just free
-		else {
-			if (ps->handler && media_packet_encrypt(ps->handler->out->rtp_crypt, sink, mp))
-				ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error encrypting buffered RTP media");
+		dtxb->last_ts += dtxb->tspp;
+		ilog(LOG_DEBUG, "RTP media for TS %lu missing, triggering DTX", dtxb->last_ts);
 
-			mutex_lock(&sink->out_lock);
-			if (media_socket_dequeue(mp, sink))
-				ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error sending buffered media to RTP sink");
-			mutex_unlock(&sink->out_lock);
-		}
+		ret = decoder_lost_packet(ch->decoder, dtxb->last_ts,
+				ch->handler->packet_decoded, ch, mp);
+		if (ret)
+			ilog(LOG_WARN | LOG_FLAG_LIMIT, "Decoder error handling DTX/lost packet");
+
+		__ssrc_unlock_both(mp);
+
+		if (ret == 0)
+			__buffered_send(mp);
 	}
 
+	// the call may have been moved to another poller meanwhile
+	timerthread_obj_follow(&dtxb->ttq.tt_obj, &codec_timers, call->poller);
+
 	rwlock_unlock_r(&call->master_lock);
+
+	// keep ticking on the same grid
+	mutex_lock(&dtxb->lock);
+	if (dtxb->call && (dtxb->len || dtxb->dtx_active)) {
+		timeval_add_usec(&dtxb->tick.when, dtxb->ptime * 1000);
+		if (timeval_cmp(&dtxb->tick.when, &rtpe_now) < 0)
+			dtxb->tick.when = rtpe_now;
+		mutex_unlock(&dtxb->lock);
+		timerthread_queue_push(&dtxb->ttq, &dtxb->tick);
+	}
+	else {
+		dtxb->tick_queued = 0;
+		mutex_unlock(&dtxb->lock);
+	}
+
 	obj_put(call);
 	obj_put(&ch->h);
-
-out:
-	__dtx_entry_free(dtxe);
 	log_info_clear();
 }
+// the tick is part of the buffer
+static void __dtx_tick_free(void *p) {
+}
 static void __dtx_shutdown(struct dtx_buffer *dtxb) {
+	__dtx_frames_clear(dtxb);
 	if (dtxb->csh)
 		obj_put(&dtxb->csh->h);
 	dtxb->csh = NULL;
@@ -2342,6 +2955,8 @@ static void __dtx_free(void *p) {
 	struct dtx_buffer *dtxb = p;
 	ilog(LOG_DEBUG, "__dtx_free");
 	__dtx_shutdown(dtxb);
+	if (dtxb->dtx_active)
+		media_packet_release(&dtxb->last_mp);
 	mutex_destroy(&dtxb->lock);
 }
 static void __dtx_setup(struct codec_ssrc_handler *ch) {
@@ -2353,7 +2968,8 @@ static void __dtx_setup(struct codec_ssrc_handler *ch) {
 
 	struct dtx_buffer *dtx =
 		ch->dtx_buffer = timerthread_queue_new("dtx_buffer", sizeof(*ch->dtx_buffer),
-				&codec_timers_thread, NULL, __dtx_send_later, __dtx_free, __dtx_entry_free);
+				&timerthread_pollers_get(&codec_timers, ch->handler->media->call->poller)->tt,
+				NULL, __dtx_run, __dtx_free, __dtx_tick_free);
 	dtx->csh = obj_get(&ch->h);
 	dtx->call = obj_get(ch->handler->media->call);
 	mutex_init(&dtx->lock);
@@ -2377,10 +2993,143 @@ void codec_handlers_stop(GQueue *q) {
 	for (GList *l = q->head; l; l = l->next) {
 		struct codec_handler *h = l->data;
 		ssrc_hash_foreach(h->ssrc_hash, __ssrc_handler_stop);
+		ssrc_hash_foreach(h->ssrc_hash, __transcode_jobs_stop);
 	}
 }
 
 
+static void __transcode_job_free(struct transcode_job *job) {
+	if (job->packet)
+		__transcode_packet_free(job->packet);
+	media_packet_release(&job->mp);
+	if (job->call)
+		obj_put(job->call);
+	g_slice_free1(sizeof(*job), job);
+}
+// hands the packet over to the worker pool. SSRC handler must not be stopped.
+// called with both SSRCs locked
+static void __transcode_job_push(struct codec_ssrc_handler *ch, struct transcode_packet *packet,
+		struct media_packet *mp)
+{
+	struct transcode_job *job = g_slice_alloc0(sizeof(*job));
+	job->packet = packet;
+	media_packet_copy(&job->mp, mp);
+	job->call = obj_get(mp->call);
+
+	mutex_lock(&transcode_pool_lock);
+	if (G_UNLIKELY(ch->tc_stopped)) {
+		mutex_unlock(&transcode_pool_lock);
+		__transcode_job_free(job);
+		return;
+	}
+	g_queue_push_tail(&ch->tc_jobs, job);
+	if (!ch->tc_scheduled) {
+		ch->tc_scheduled = 1;
+		g_queue_push_tail(&transcode_pool_queue, obj_get(&ch->h));
+		cond_signal(&transcode_pool_cond);
+	}
+	transcode_pool_jobs++;
+	atomic64_set(&rtpe_stats.transcode_queue, transcode_pool_jobs);
+	if (transcode_pool_jobs > atomic64_get(&rtpe_stats.transcode_queue_max))
+		atomic64_set(&rtpe_stats.transcode_queue_max, transcode_pool_jobs);
+	mutex_unlock(&transcode_pool_lock);
+}
+// drops all queued jobs and refuses new ones, as the codec handler is going away
+static void __transcode_jobs_stop(void *p) {
+	struct codec_ssrc_handler *ch = p;
+	GQueue jobs;
+
+	mutex_lock(&transcode_pool_lock);
+	ch->tc_stopped = 1;
+	jobs = ch->tc_jobs;
+	g_queue_init(&ch->tc_jobs);
+	transcode_pool_jobs -= jobs.length;
+	atomic64_set(&rtpe_stats.transcode_queue, transcode_pool_jobs);
+	mutex_unlock(&transcode_pool_lock);
+
+	g_queue_clear_full(&jobs, (GDestroyNotify) __transcode_job_free);
+}
+static void __transcode_job_run(struct codec_ssrc_handler *ch, struct transcode_job *job) {
+	struct media_packet *mp = &job->mp;
+	struct call *call = job->call;
+	struct transcode_packet *packet = job->packet;
+
+	log_info_stream_fd(mp->sfd);
+
+	rwlock_lock_r(&call->master_lock);
+
+	// the codec handler may have been replaced while this was waiting. this is
+	// set under the call's W lock, so holding the R lock keeps it stable
+	mutex_lock(&transcode_pool_lock);
+	int stopped = ch->tc_stopped;
+	mutex_unlock(&transcode_pool_lock);
+
+	if (!stopped) {
+		__ssrc_lock_both(mp);
+
+		ilog(LOG_DEBUG, "Decoding queued RTP packet (TS %lu) now", packet->ts);
+		int ret = __packet_transcode(ch, packet, mp);
+		mp->ssrc_out->parent->seq_diff--;
+		if (ret)
+			ilog(LOG_WARN | LOG_FLAG_LIMIT, "Decoder error while processing RTP packet");
+
+		__ssrc_unlock_both(mp);
+
+		if (ret == 0)
+			__buffered_send(mp);
+	}
+
+	rwlock_unlock_r(&call->master_lock);
+
+	__transcode_job_free(job);
+	log_info_clear();
+}
+#endif
+
+// runs one transcoding worker thread. SSRC handlers are taken off the pool queue one at
+// a time, so that the packets of one stream are decoded and encoded in order
+void codec_worker_loop(void *p) {
+#ifdef WITH_TRANSCODING
+	mutex_lock(&transcode_pool_lock);
+
+	while (!rtpe_shutdown) {
+		gettimeofday(&rtpe_now, NULL);
+
+		struct codec_ssrc_handler *ch = g_queue_pop_head(&transcode_pool_queue);
+		if (!ch) {
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&transcode_pool_cond, &transcode_pool_lock, &tv);
+			continue;
+		}
+
+		while (1) {
+			struct transcode_job *job = g_queue_pop_head(&ch->tc_jobs);
+			if (!job) {
+				ch->tc_scheduled = 0;
+				break;
+			}
+			transcode_pool_jobs--;
+			atomic64_set(&rtpe_stats.transcode_queue, transcode_pool_jobs);
+			mutex_unlock(&transcode_pool_lock);
+
+			gettimeofday(&rtpe_now, NULL);
+			__transcode_job_run(ch, job);
+
+			mutex_lock(&transcode_pool_lock);
+		}
+
+		mutex_unlock(&transcode_pool_lock);
+		obj_put(&ch->h);
+		mutex_lock(&transcode_pool_lock);
+	}
+
+	mutex_unlock(&transcode_pool_lock);
+#endif
+}
+#ifdef WITH_TRANSCODING
+
+
 
 
 static void silence_event_free(void *p) {
@@ -2390,14 +3139,37 @@ static void silence_event_free(void *p) {
 #define __silence_detect_type(type) \
 static void __silence_detect_ ## type(struct codec_ssrc_handler *ch, AVFrame *frame, type thres) { \
 	type *s = (void *) frame->data[0]; \
+	unsigned int num = frame->nb_samples; \
 	struct silence_event *last = g_queue_peek_tail(&ch->silence_events); \
  \
 	if (last && last->end) /* last event finished? */ \
 		last = NULL; \
+	if (!num) \
+		return; \
  \
-	for (unsigned int i = 0; i < frame->nb_samples; i++) { \
-		/* ilog(LOG_DEBUG, "XXXXXXXXXXXX checking %u %i vs %i", i, (int) s[i], (int) thres); */ \
-		if (s[i] <= thres && s[1] >= -thres) { \
+	/* branch-free count of silent samples, which the compiler turns into a single \
+	 * vector compare-and-reduce. this settles the common frames that are entirely \
+	 * silent or entirely not, so that only mixed frames need the per-sample walk */ \
+	unsigned int silent = 0; \
+	for (unsigned int i = 0; i < num; i++) \
+		silent += (s[i] <= thres) & (s[i] >= -thres); \
+ \
+	if (silent == num) { \
+		if (!last) { \
+			last = g_slice_alloc0(sizeof(*last)); \
+			last->start = frame->pts; \
+			g_queue_push_tail(&ch->silence_events, last); \
+		} \
+		return; \
+	} \
+	if (silent == 0) { \
+		if (last) \
+			last->end = frame->pts; \
+		return; \
+	} \
+ \
+	for (unsigned int i = 0; i < num; i++) { \
+		if (s[i] <= thres && s[i] >= -thres) { \
 			/* silence */ \
 			if (!last) { \
 				/* new event */ \
@@ -2426,6 +3198,8 @@ static void __silence_detect(struct codec_ssrc_handler *ch, AVFrame *frame) {
 	//ilog(LOG_DEBUG, "XXXXXXXXXXXXXXXXXXXX silence detect %i %i", rtpe_config.silence_detect_int, ch->handler->cn_payload_type);
 	if (!rtpe_config.silence_detect_int)
 		return;
+	if (g_atomic_int_get(&overload_level) >= OVERLOAD_NO_DETECTION)
+		return;
 	if (ch->handler->cn_payload_type < 0)
 		return;
 	switch (frame->format) {
@@ -2479,6 +3253,22 @@ silence:
 
 
 
+static int __encoder_flush(encoder_t *enc, void *u1, void *u2) {
+	int *going = u1;
+	*going = 1;
+	return 0;
+}
+static void __encoder_release(encoder_t *enc) {
+	if (!encoder_pool_put(enc))
+		return;
+	// flush out queue to avoid ffmpeg warnings
+	int going;
+	do {
+		going = 0;
+		encoder_input_data(enc, NULL, __encoder_flush, &going, NULL);
+	} while (going);
+	encoder_free(enc);
+}
 static struct ssrc_entry *__ssrc_handler_transcode_new(void *p) {
 	struct codec_handler *h = p;
 
@@ -2507,27 +3297,35 @@ static struct ssrc_entry *__ssrc_handler_transcode_new(void *p) {
 		.channels = h->dest_pt.channels,
 		.format = -1,
 	};
-	ch->encoder = encoder_new();
-	if (!ch->encoder)
-		goto err;
-	if (encoder_config_fmtp(ch->encoder, h->dest_pt.codec_def,
+	ch->encoder = encoder_pool_get(h->dest_pt.codec_def,
 				ch->bitrate,
 				ch->ptime,
 				&enc_format, &ch->encoder_format, &h->dest_pt.format_parameters,
-				&h->dest_pt.codec_opts))
+				&h->dest_pt.codec_opts);
+	if (!ch->encoder)
 		goto err;
 
-	if (h->pcm_dtmf_detect) {
+	// decoded audio goes into the encoder of the output handler's context if that's not
+	// us (see __output_ssrc_handler), so one encoder serves all inputs of an output PT
+	int shared_output = h->output_handler != h;
+
+	if (h->pcm_dtmf_detect && !shared_output) {
 		ilog(LOG_DEBUG, "Inserting DTMF DSP for output payload type %i", h->dtmf_payload_type);
 		ch->dtmf_format = (format_t) { .clockrate = 8000, .channels = 1, .format = AV_SAMPLE_FMT_S16 };
-		ch->dtmf_dsp = dtmf_rx_init(NULL, NULL, NULL);
-		if (!ch->dtmf_dsp)
-			ilog(LOG_ERR, "Failed to allocate DTMF RX context");
-		else
-			dtmf_rx_set_realtime_callback(ch->dtmf_dsp, __dtmf_dsp_callback, ch);
+		if (rtpe_config.dtmf_detector == DTMF_DSP_GOERTZEL) {
+			ch->dtmf_goertzel = g_slice_alloc(sizeof(*ch->dtmf_goertzel));
+			dtmf_detect_init(ch->dtmf_goertzel, __dtmf_dsp_callback, ch);
+		}
+		else {
+			ch->dtmf_dsp = __dtmf_rx_pool_get();
+			if (!ch->dtmf_dsp)
+				ilog(LOG_ERR, "Failed to allocate DTMF RX context");
+			else
+				dtmf_rx_set_realtime_callback(ch->dtmf_dsp, __dtmf_dsp_callback, ch);
+		}
 	}
 
-	ch->decoder = decoder_new_fmtp(h->source_pt.codec_def, h->source_pt.clock_rate, h->source_pt.channels,
+	ch->decoder = decoder_pool_get(h->source_pt.codec_def, h->source_pt.clock_rate, h->source_pt.channels,
 			h->source_pt.ptime,
 			&ch->encoder_format, &h->source_pt.format_parameters, &h->source_pt.codec_opts);
 	if (!ch->decoder)
@@ -2547,34 +3345,65 @@ static struct ssrc_entry *__ssrc_handler_transcode_new(void *p) {
 			ch->ptime, ch->encoder->samples_per_frame, ch->encoder->samples_per_packet,
 			ch->bytes_per_packet, ch->bitrate);
 
+	if (shared_output) {
+		// only needed to determine the decoder's output format
+		ilog(LOG_DEBUG, "Releasing encoder, output goes through handler for PT %i",
+				h->output_handler->source_pt.payload_type);
+		__encoder_release(ch->encoder);
+		ch->encoder = NULL;
+	}
+
 	return &ch->h;
 
 err:
 	obj_put(&ch->h);
 	return NULL;
 }
-static int __encoder_flush(encoder_t *enc, void *u1, void *u2) {
-	int *going = u1;
-	*going = 1;
-	return 0;
+// decoder only, for the conference mixer
+static struct ssrc_entry *__ssrc_handler_decode_new(void *p) {
+	struct codec_handler *h = p;
+
+	ilog(LOG_DEBUG, "Creating SSRC conference decoder for %s/%u/%i",
+			h->source_pt.codec_def->rtpname, h->source_pt.clock_rate,
+			h->source_pt.channels);
+
+	struct codec_ssrc_handler *ch = obj_alloc0("codec_ssrc_handler", sizeof(*ch), __free_ssrc_handler);
+	ch->handler = h;
+	ch->ptime = h->source_pt.ptime;
+	ch->encoder_format = (format_t) {
+		.clockrate = CONFERENCE_CLOCKRATE,
+		.channels = 1,
+		.format = AV_SAMPLE_FMT_S16,
+	};
+
+	ch->decoder = decoder_pool_get(h->source_pt.codec_def, h->source_pt.clock_rate, h->source_pt.channels,
+			h->source_pt.ptime,
+			&ch->encoder_format, &h->source_pt.format_parameters, &h->source_pt.codec_opts);
+	if (!ch->decoder)
+		goto err;
+
+	ch->decoder->event_data = h->media;
+	ch->decoder->event_func = codec_decoder_event;
+
+	return &ch->h;
+
+err:
+	obj_put(&ch->h);
+	return NULL;
 }
+
 static void __free_ssrc_handler(void *chp) {
 	struct codec_ssrc_handler *ch = chp;
 	if (ch->decoder)
-		decoder_close(ch->decoder);
-	if (ch->encoder) {
-		// flush out queue to avoid ffmpeg warnings
-		int going;
-		do {
-			going = 0;
-			encoder_input_data(ch->encoder, NULL, __encoder_flush, &going, NULL);
-		} while (going);
-		encoder_free(ch->encoder);
-	}
+		decoder_pool_put(ch->decoder);
+	if (ch->encoder)
+		__encoder_release(ch->encoder);
 	if (ch->sample_buffer)
 		g_string_free(ch->sample_buffer, TRUE);
 	if (ch->dtmf_dsp)
-		dtmf_rx_free(ch->dtmf_dsp);
+		__dtmf_rx_pool_put(ch->dtmf_dsp);
+	if (ch->dtmf_goertzel)
+		g_slice_free1(sizeof(*ch->dtmf_goertzel), ch->dtmf_goertzel);
 	resample_shutdown(&ch->dtmf_resampler);
 	g_queue_clear_full(&ch->dtmf_events, dtmf_event_free);
 	g_queue_clear_full(&ch->silence_events, silence_event_free);
@@ -2589,6 +3418,14 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 
 	ilog(LOG_DEBUG, "RTP media successfully encoded: TS %llu, len %i",
 			(unsigned long long) enc->avpkt.pts, enc->avpkt.size);
+	PROBE(codec_encode, ch->handler->dest_pt.payload_type, enc->avpkt.size, enc->avpkt.pts);
+
+	// codec-native DTX: frames that the encoder says need no transmission are left
+	// out, and the first one after them starts a new talkspurt
+	if (rtpe_config.output_dtx && enc->def->dtx_frame && enc->def->dtx_frame(&enc->avpkt)) {
+		ch->dtx_out = 1;
+		return 0;
+	}
 
 	// run this through our packetizer
 	AVPacket *in_pkt = &enc->avpkt;
@@ -2599,7 +3436,7 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 				sizeof(struct telephone_event_payload));
 		unsigned int pkt_len = sizeof(struct rtp_header) + payload_len + RTP_BUFFER_TAIL_ROOM;
 		// prepare our buffers
-		char *buf = malloc(pkt_len);
+		char *buf = codec_packet_buffer(payload_len);
 		char *payload = buf + sizeof(struct rtp_header);
 		// tell our packetizer how much we want
 		str inout;
@@ -2612,7 +3449,7 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 
 		if (G_UNLIKELY(ret == -1 || enc->avpkt.pts == AV_NOPTS_VALUE)) {
 			// nothing
-			free(buf);
+			codec_packet_buffer_free(buf);
 			break;
 		}
 
@@ -2632,9 +3469,23 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 			else if (is_dtmf == 3)
 				repeats = 2; // DTMF end event
 		}
-		else {
-			if (is_silence_event(&inout, &ch->silence_events, enc->avpkt.pts, enc->avpkt.duration))
-				payload_type = ch->handler->cn_payload_type;
+		else if (is_silence_event(&inout, &ch->silence_events, enc->avpkt.pts, enc->avpkt.duration)) {
+			payload_type = ch->handler->cn_payload_type;
+			// with output DTX, silence starts with one CN packet, followed only by
+			// periodic updates
+			if (rtpe_config.output_dtx) {
+				uint64_t refresh = (uint64_t) enc->actual_format.clockrate * CN_REFRESH_MS / 1000;
+				if (ch->dtx_out && enc->avpkt.pts - ch->cn_pts < refresh) {
+					codec_packet_buffer_free(buf);
+					goto next;
+				}
+				ch->dtx_out = 1;
+				ch->cn_pts = enc->avpkt.pts;
+			}
+		}
+		if (ch->dtx_out && payload_type == -1) {
+			ch->dtx_out = 0;
+			ch->rtp_mark = 1;
 		}
 
 		// ready to send
@@ -2643,7 +3494,7 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 			char *send_buf = buf;
 			if (repeats > 0) {
 				// need to duplicate the payload as __output_rtp consumes it
-				send_buf = malloc(pkt_len);
+				send_buf = codec_packet_buffer(payload_len);
 				memcpy(send_buf, buf, pkt_len);
 			}
 			__output_rtp(mp, ch, ch->handler, send_buf, inout.len, ch->first_ts
@@ -2655,6 +3506,7 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 			ch->rtp_mark = 0;
 		} while (repeats--);
 
+next:
 		if (ret == 0) {
 			// no more to go
 			break;
@@ -2669,9 +3521,12 @@ static int packet_encoded_rtp(encoder_t *enc, void *u1, void *u2) {
 }
 
 static void __dtmf_detect(struct codec_ssrc_handler *ch, AVFrame *frame) {
-	if (!ch->dtmf_dsp)
+	if (!ch->dtmf_dsp && !ch->dtmf_goertzel)
 		return;
-	if (ch->handler->dtmf_payload_type == -1 || !ch->handler->pcm_dtmf_detect) {
+	// under overload, tones are only passed on in-band
+	if (ch->handler->dtmf_payload_type == -1 || !ch->handler->pcm_dtmf_detect
+			|| g_atomic_int_get(&overload_level) >= OVERLOAD_NO_DETECTION)
+	{
 		ch->dtmf_event.code = 0;
 		return;
 	}
@@ -2688,8 +3543,12 @@ static void __dtmf_detect(struct codec_ssrc_handler *ch, AVFrame *frame) {
 			frame->nb_samples,
 			dsp_frame->nb_samples);
 
-	if (dsp_frame->pts > ch->dtmf_ts)
-		dtmf_rx_fillin(ch->dtmf_dsp, dsp_frame->pts - ch->dtmf_ts);
+	if (dsp_frame->pts > ch->dtmf_ts) {
+		if (ch->dtmf_goertzel)
+			dtmf_detect_fillin(ch->dtmf_goertzel, dsp_frame->pts - ch->dtmf_ts);
+		else
+			dtmf_rx_fillin(ch->dtmf_dsp, dsp_frame->pts - ch->dtmf_ts);
+	}
 	else if (dsp_frame->pts < ch->dtmf_ts)
 		ilog(LOG_ERR | LOG_FLAG_LIMIT, "DTMF TS seems to run backwards (%lu < %lu)",
 				(unsigned long) dsp_frame->pts,
@@ -2697,17 +3556,21 @@ static void __dtmf_detect(struct codec_ssrc_handler *ch, AVFrame *frame) {
 
 	int num_samples = dsp_frame->nb_samples;
 	int16_t *samples = (void *) dsp_frame->extended_data[0];
-	while (num_samples > 0) {
-		int ret = dtmf_rx(ch->dtmf_dsp, samples, num_samples);
-		if (ret < 0 || ret >= num_samples) {
-			ilog(LOG_ERR | LOG_FLAG_LIMIT, "DTMF DSP returned error %i", ret);
-			break;
+	if (ch->dtmf_goertzel)
+		dtmf_detect(ch->dtmf_goertzel, samples, num_samples);
+	else {
+		while (num_samples > 0) {
+			int ret = dtmf_rx(ch->dtmf_dsp, samples, num_samples);
+			if (ret < 0 || ret >= num_samples) {
+				ilog(LOG_ERR | LOG_FLAG_LIMIT, "DTMF DSP returned error %i", ret);
+				break;
+			}
+			samples += num_samples - ret;
+			num_samples = ret;
 		}
-		samples += num_samples - ret;
-		num_samples = ret;
 	}
 	ch->dtmf_ts = dsp_frame->pts + dsp_frame->nb_samples;
-	av_frame_free(&dsp_frame);
+	codeclib_frame_free(&dsp_frame);
 }
 
 static int packet_decoded_common(decoder_t *decoder, AVFrame *frame, void *u1, void *u2,
@@ -2765,7 +3628,7 @@ static int packet_decoded_common(decoder_t *decoder, AVFrame *frame, void *u1, v
 	input_func(ch->encoder, frame, h->packet_encoded, ch, mp);
 
 discard:
-	av_frame_free(&frame);
+	codeclib_frame_free(&frame);
 	obj_put(&new_ch->h);
 
 	return 0;
@@ -2778,6 +3641,13 @@ static int packet_decoded_direct(decoder_t *decoder, AVFrame *frame, void *u1, v
 	return packet_decoded_common(decoder, frame, u1, u2, encoder_input_data);
 }
 
+static int packet_decoded_conference(decoder_t *decoder, AVFrame *frame, void *u1, void *u2) {
+	struct codec_ssrc_handler *ch = u1;
+	conference_add_frame(ch->handler->media, frame);
+	codeclib_frame_free(&frame);
+	return 0;
+}
+
 static int packet_decode(struct codec_ssrc_handler *ch, struct transcode_packet *packet, struct media_packet *mp)
 {
 	int ret = 0;
@@ -2789,33 +3659,20 @@ static int packet_decode(struct codec_ssrc_handler *ch, struct transcode_packet
 	if (ch->dtx_buffer && mp->sfd && mp->ssrc_in && mp->ssrc_out) {
 		ilog(LOG_DEBUG, "Adding packet to DTX buffer");
 
-		struct dtx_buffer *dtxb = ch->dtx_buffer;
-		unsigned long ts = packet->ts;
-
-		mutex_lock(&dtxb->lock);
-		if (ts != dtxb->ts)
-			dtxb->ts = ts;
-		dtxb->start = rtpe_now.tv_sec;
-		mutex_unlock(&dtxb->lock);
-
-		struct dtx_entry *dtxe = g_slice_alloc0(sizeof(*dtxe));
-		dtxe->ttq_entry.when = rtpe_now;
-		timeval_add_usec(&dtxe->ttq_entry.when, rtpe_config.dtx_delay * 1000);
-		dtxe->packet = packet;
-		media_packet_copy(&dtxe->mp, mp);
-		timerthread_queue_push(&dtxb->ttq, &dtxe->ttq_entry);
+		__dtx_add_frame(ch->dtx_buffer, packet, mp);
+		// packet now consumed
+		ret = 1;
+	}
+	else if (rtpe_config.transcode_threads > 0 && mp->sfd && mp->ssrc_in && mp->ssrc_out) {
+		ilog(LOG_DEBUG, "Handing RTP packet to transcoding worker");
+		__transcode_job_push(ch, packet, mp);
 		// packet now consumed
-		packet = NULL;
-
-		__dtx_add_callback(dtxb, &rtpe_now, (rtpe_config.dtx_delay + dtxb->ptime) * 1000, mp, ts, 1,
-				mp->stream->ssrc_in);
-
 		ret = 1;
 	}
 	else {
 		ilog(LOG_DEBUG, "Decoding RTP packet now");
-		ret = decoder_input_data(ch->decoder, packet->payload, packet->ts, ch->handler->packet_decoded,
-				ch, mp);
+		PROBE(codec_decode, ch->handler->source_pt.payload_type, packet->payload->len, packet->ts);
+		ret = __packet_transcode(ch, packet, mp);
 		ret = ret ? -1 : 0;
 		mp->ssrc_out->parent->seq_diff--;
 	}
@@ -2823,6 +3680,100 @@ static int packet_decode(struct codec_ssrc_handler *ch, struct transcode_packet
 	return ret;
 }
 
+// A-law <> mu-law with nothing else to do: map the payload bytes directly
+static int packet_g711_direct(struct codec_ssrc_handler *ch, struct transcode_packet *packet,
+		struct media_packet *mp)
+{
+	struct codec_handler *h = ch->handler;
+	const unsigned char *table = codec_g711_transcode_table(h->source_pt.codec_def, h->dest_pt.codec_def);
+	if (G_UNLIKELY(!table))
+		return -1;
+
+	if (!ch->first_ts)
+		ch->first_ts = packet->ts;
+	ch->last_ts = packet->ts;
+
+	unsigned int len = packet->payload->len;
+	char *buf = codec_packet_buffer(len);
+	const unsigned char *in = (const unsigned char *) packet->payload->s;
+	unsigned char *out = (unsigned char *) buf + sizeof(struct rtp_header);
+	for (unsigned int i = 0; i < len; i++)
+		out[i] = table[in[i]];
+
+	ilog(LOG_DEBUG, "Converting %u bytes of G.711 directly", len);
+
+	// one packet in, one packet out: sequence numbers stay as they are
+	__output_rtp(mp, ch, h, buf, len, packet->ts, packet->marker, -1, 0, -1);
+
+	return 0;
+}
+
+// whether packets can skip the decoder and encoder entirely
+static int __g711_direct_possible(struct codec_handler *h) {
+	if (!codec_g711_transcode_table(h->source_pt.codec_def, h->dest_pt.codec_def))
+		return 0;
+	if (h->source_pt.clock_rate != h->dest_pt.clock_rate)
+		return 0;
+	if (h->source_pt.channels != 1 || h->dest_pt.channels != 1)
+		return 0;
+	if (h->source_pt.ptime != h->dest_pt.ptime)
+		return 0;
+	if (h->dtmf_payload_type != -1 || h->pcm_dtmf_detect || h->cn_payload_type != -1)
+		return 0;
+	if (h->output_handler != h)
+		return 0;
+	if (h->media && h->media->dtmf_injector)
+		return 0;
+	if (rtpe_config.silence_detect_int)
+		return 0;
+	return 1;
+}
+
+// the part of the transcoding that the kernel module can do by itself, as one of the
+// REX_ constants. REX_NONE if packets must go through this handler in userspace
+int codec_handler_kernel_xcode(struct codec_handler *h) {
+	if (!h->transcoder || h->func != handler_func_transcode || h->dtmf_scaler)
+		return REX_NONE;
+	if (!__g711_direct_possible(h))
+		return REX_NONE;
+	if (h->source_pt.codec_def->avcodec_id == AV_CODEC_ID_PCM_ALAW)
+		return REX_ALAW_ULAW;
+	return REX_ULAW_ALAW;
+}
+
+// RFC 4733 passthrough that the kernel module can forward unchanged, reporting the
+// events back to us. the caller must still check for blocked DTMF
+int codec_handler_kernel_dtmf(struct codec_handler *h) {
+	if (h->func != handler_func_dtmf || h->dtmf_scaler)
+		return 0;
+	if (!h->media || h->media->dtmf_injector)
+		return 0;
+	return 1;
+}
+
+// estimated CPU time in ns per second that transcoding the media received on `m` takes,
+// from the codec benchmark. only one payload type is received at a time, so the most
+// expensive one counts. 0 if nothing is transcoded or the codecs haven't been measured
+int64_t codec_media_cost(struct call_media *m) {
+	int64_t ret = 0;
+
+	for (GList *l = m->codec_handlers_store.head; l; l = l->next) {
+		struct codec_handler *h = l->data;
+		if (!h->transcoder || h->dtmf_scaler || h->func != handler_func_transcode)
+			continue;
+		const codec_def_t *src = h->source_pt.codec_def;
+		const codec_def_t *dst = h->dest_pt.codec_def;
+		if (!src || !dst || !src->bench_decode_ns || !dst->bench_encode_ns)
+			continue;
+		int64_t cost = src->bench_decode_ns + dst->bench_encode_ns;
+		if (h->source_pt.clock_rate != h->dest_pt.clock_rate)
+			cost += src->bench_resample_ns;
+		ret = MAX(ret, cost);
+	}
+
+	return ret;
+}
+
 
 static void codec_calc_jitter(struct media_packet *mp, unsigned int clockrate) {
 	if (!mp->ssrc_in)
@@ -2877,7 +3828,7 @@ static int handler_func_transcode(struct codec_handler *h, struct media_packet *
 		atomic64_add(&h->stats_entry->bytes_input[2], mp->payload.len);
 	}
 
-	struct transcode_packet *packet = g_slice_alloc0(sizeof(*packet));
+	struct transcode_packet *packet = transcode_packet_new();
 	packet->func = packet_decode;
 	packet->rtp = *mp->rtp;
 	packet->handler = h;
@@ -2886,6 +3837,8 @@ static int handler_func_transcode(struct codec_handler *h, struct media_packet *
 		packet->func = packet_dtmf;
 		packet->dup_func = packet_dtmf_dup;
 	}
+	else if (__g711_direct_possible(h))
+		packet->func = packet_g711_direct;
 
 	int ret = __handler_func_sequencer(mp, packet);
 
@@ -2894,6 +3847,45 @@ static int handler_func_transcode(struct codec_handler *h, struct media_packet *
 	return ret;
 }
 
+static int handler_func_conference(struct codec_handler *h, struct media_packet *mp) {
+	if (G_UNLIKELY(!mp->rtp))
+		return 0;
+	if (mp->call->block_media || mp->media->monologue->block_media)
+		return 0;
+
+	codec_calc_jitter(mp, h->source_pt.clock_rate);
+
+	struct transcode_packet *packet = transcode_packet_new();
+	packet->func = packet_decode;
+	packet->rtp = *mp->rtp;
+	packet->handler = h;
+
+	return __handler_func_sequencer(mp, packet);
+}
+
+static int handler_func_drop(struct codec_handler *h, struct media_packet *mp) {
+	return 0;
+}
+
+static int handler_func_repacketize(struct codec_handler *h, struct media_packet *mp) {
+	if (G_UNLIKELY(!mp->rtp))
+		return handler_func_passthrough(h, mp);
+	if (mp->call->block_media || mp->media->monologue->block_media)
+		return 0;
+
+	ilog(LOG_DEBUG, "Received RTP packet for repacketizing: SSRC %" PRIx32 ", PT %u, seq %u, "
+			"TS %u, len %i",
+			ntohl(mp->rtp->ssrc), mp->rtp->m_pt, ntohs(mp->rtp->seq_num),
+			ntohl(mp->rtp->timestamp), mp->payload.len);
+
+	struct transcode_packet *packet = transcode_packet_new();
+	packet->func = packet_repacketize;
+	packet->rtp = *mp->rtp;
+	packet->handler = h;
+
+	return __handler_func_sequencer(mp, packet);
+}
+
 static int handler_func_playback(struct codec_handler *h, struct media_packet *mp) {
 	decoder_input_data(h->ssrc_handler->decoder, &mp->payload, mp->rtp->timestamp,
 			h->packet_decoded, h->ssrc_handler, mp);
@@ -3545,21 +4537,22 @@ void codec_rtp_payload_types(struct call_media *media, struct call_media *other_
 	g_hash_table_destroy(masked);
 }
 
-void codecs_init(void) {
 #ifdef WITH_TRANSCODING
-	timerthread_init(&codec_timers_thread, timerthread_queue_run);
-	rtcp_timer_queue = timerthread_queue_new("rtcp_timer_queue", sizeof(*rtcp_timer_queue),
-			&codec_timers_thread, NULL, __rtcp_timer_run, NULL, __rtcp_timer_free);
-#endif
+static void *__rtcp_timer_queue_new(struct timerthread *tt) {
+	return timerthread_queue_new("rtcp_timer_queue", sizeof(struct rtcp_timer_queue),
+			tt, NULL, __rtcp_timer_run, NULL, __rtcp_timer_free);
 }
-void codecs_cleanup(void) {
+#endif
+void codecs_init(void) {
 #ifdef WITH_TRANSCODING
-	timerthread_free(&codec_timers_thread);
+	timerthread_pollers_init(&codec_timers, timerthread_queue_run, __rtcp_timer_queue_new);
 #endif
 }
-void codec_timers_loop(void *p) {
+void codecs_cleanup(void) {
 #ifdef WITH_TRANSCODING
-	//ilog(LOG_DEBUG, "codec_timers_loop");
-	timerthread_run(&codec_timers_thread);
+	timerthread_pollers_free(&codec_timers);
+	if (codec_plan_cache)
+		g_hash_table_destroy(codec_plan_cache);
+	g_queue_clear_full(&dtmf_rx_pool, (GDestroyNotify) dtmf_rx_free);
 #endif
 }
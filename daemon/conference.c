@@ -0,0 +1,741 @@
+#include "conference.h"
+
+
+
+#ifdef WITH_TRANSCODING
+
+
+#include <glib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <libavutil/audio_fifo.h>
+#include "call.h"
+#include "codec.h"
+#include "codeclib.h"
+#include "resample.h"
+#include "rtplib.h"
+#include "ssrc.h"
+#include "media_socket.h"
+#include "timerthread.h"
+#include "log.h"
+#include "log_funcs.h"
+#include "main.h"
+#include "obj.h"
+
+
+
+#define CONF_PTIME 20 // ms per mixing cycle
+#define CONF_FRAME (CONFERENCE_CLOCKRATE * CONF_PTIME / 1000) // samples per mixing cycle
+#define CONF_RING 8192 // input samples buffered per participant, about half a second
+#define CONF_DELAY (2 * CONF_FRAME) // jitter allowance for input that starts or resyncs
+#define CONF_HANGOVER 10 // cycles a speaker stays active after going quiet
+#define CONF_CATCHUP 3 // cycles run in one go when the timer is late, the rest are skipped
+#define CONF_VAD_THRES 100 // mean absolute amplitude of a speaker, without --silence-detect
+
+
+// one encoder instance and the RTP payloads it produced in the current cycle
+struct conf_encoder {
+	struct rtp_payload_type pt; // PT number is ignored for shared encoders
+	encoder_t *encoder;
+	format_t format; // input format of the encoder
+	resample_t resampler;
+	GString *sample_buffer; // for the packetizer
+	unsigned int bytes_per_packet;
+	unsigned int users; // participants holding a reference
+	unsigned int listeners; // participants receiving this output in the current cycle
+	int synced:1;
+	uint64_t next_pts; // conference pts of the next expected frame
+	unsigned long ts_offset; // RTP TS = ts_offset + encoder pts
+	GQueue payloads; // struct conf_payload
+};
+
+struct conf_payload {
+	unsigned long ts;
+	unsigned int len;
+	char data[0];
+};
+
+struct conf_participant {
+	struct call_monologue *ml;
+	struct call_media *media;
+	struct packet_stream *sink; // sends to the participant
+	const struct streamhandler *crypt_handler;
+	struct ssrc_ctx *ssrc_out;
+	uint16_t seq;
+	int marker:1,
+	    synced:1; // input position established
+
+	struct rtp_payload_type pt; // output codec, no codec_def if none is usable
+	struct conf_encoder *shared; // full mix, while not speaking
+	struct conf_encoder *own; // everybody else, while speaking
+	unsigned int hangover; // cycles until no longer considered a speaker
+
+	// decoded input, indexed by conference pts and zeroed once mixed
+	int16_t ring[CONF_RING];
+	uint64_t in_pts; // conference pts of the next input sample
+	uint64_t dec_pts; // decoder pts of the next input sample
+	int16_t in[CONF_FRAME]; // this cycle's input
+};
+
+struct conference {
+	struct timerthread_obj tt_obj;
+	mutex_t lock;
+	struct call *call;
+	GQueue participants; // struct conf_participant
+	GQueue encoders; // shared struct conf_encoder, one per distinct output codec
+	struct timeval next_run; // zero if not running
+	uint64_t pts; // first sample of the next cycle
+	unsigned long ts_base; // RTP TS of pts 0
+	struct codec_buffer_pool frame_pool;
+	int32_t sum[CONF_FRAME]; // all speakers of this cycle
+};
+
+
+
+// run by the threads of the poller that handles the call's sockets
+static struct timerthread_pollers conference_timers;
+
+
+
+// the vector loops below are written so that the compiler turns them into SIMD instructions.
+// all buffers are CONF_FRAME samples and don't overlap
+
+static void conf_sum(int32_t *restrict sum, const int16_t *restrict in) {
+	for (unsigned int i = 0; i < CONF_FRAME; i++)
+		sum[i] += in[i];
+}
+
+static void conf_clamp(int16_t *restrict out, const int32_t *restrict sum) {
+	for (unsigned int i = 0; i < CONF_FRAME; i++) {
+		int32_t s = sum[i];
+		out[i] = s > INT16_MAX ? INT16_MAX : (s < INT16_MIN ? INT16_MIN : s);
+	}
+}
+
+// N-1 mix: everybody except the one participant
+static void conf_minus(int16_t *restrict out, const int32_t *restrict sum, const int16_t *restrict own) {
+	for (unsigned int i = 0; i < CONF_FRAME; i++) {
+		int32_t s = sum[i] - own[i];
+		out[i] = s > INT16_MAX ? INT16_MAX : (s < INT16_MIN ? INT16_MIN : s);
+	}
+}
+
+static int conf_active(const int16_t *restrict in, int32_t thres) {
+	int32_t sum = 0;
+	for (unsigned int i = 0; i < CONF_FRAME; i++) {
+		int32_t s = in[i];
+		sum += s < 0 ? -s : s;
+	}
+	return sum > thres * CONF_FRAME;
+}
+
+
+static void conf_payloads_clear(struct conf_encoder *ce) {
+	struct conf_payload *cp;
+	while ((cp = g_queue_pop_head(&ce->payloads)))
+		g_free(cp);
+}
+
+static int conf_encoder_flush(encoder_t *enc, void *u1, void *u2) {
+	int *going = u1;
+	*going = 1;
+	return 0;
+}
+
+static void conf_encoder_free(struct conf_encoder *ce) {
+	if (ce->encoder && encoder_pool_put(ce->encoder)) {
+		// flush out queue to avoid ffmpeg warnings
+		int going;
+		do {
+			going = 0;
+			encoder_input_data(ce->encoder, NULL, conf_encoder_flush, &going, NULL);
+		} while (going);
+		encoder_free(ce->encoder);
+	}
+	resample_shutdown(&ce->resampler);
+	if (ce->sample_buffer)
+		g_string_free(ce->sample_buffer, TRUE);
+	conf_payloads_clear(ce);
+	g_slice_free1(sizeof(*ce), ce);
+}
+
+static struct conf_encoder *conf_encoder_new(const struct rtp_payload_type *pt) {
+	struct conf_encoder *ce = g_slice_alloc0(sizeof(*ce));
+	ce->pt = *pt;
+	ce->users = 1;
+
+	format_t req_format = {
+		.clockrate = pt->clock_rate * pt->codec_def->clockrate_mult,
+		.channels = pt->channels,
+		.format = -1,
+	};
+	ce->encoder = encoder_pool_get(pt->codec_def, pt->bitrate ? : pt->codec_def->default_bitrate,
+			pt->ptime, &req_format, &ce->format, &pt->format_parameters, &pt->codec_opts);
+	if (!ce->encoder) {
+		ilog(LOG_ERR, "Failed to create conference encoder for " STR_FORMAT,
+				STR_FMT(&pt->encoding_with_params));
+		conf_encoder_free(ce);
+		return NULL;
+	}
+	ce->sample_buffer = g_string_new("");
+	ce->bytes_per_packet = (ce->encoder->samples_per_packet ? : ce->encoder->samples_per_frame)
+		* pt->codec_def->bits_per_sample / 8;
+
+	return ce;
+}
+
+// participants with the same output codec share one encoder while they're not speaking,
+// regardless of the payload type number they use for it
+static int conf_pt_cmp(const struct rtp_payload_type *a, const struct rtp_payload_type *b) {
+	struct rtp_payload_type b_pt = *b;
+	b_pt.payload_type = a->payload_type;
+	if (rtp_payload_type_cmp(a, &b_pt))
+		return 1;
+	if (a->ptime != b->ptime || a->bitrate != b->bitrate)
+		return 1;
+	if (str_cmp_str(&a->codec_opts, &b->codec_opts))
+		return 1;
+	return 0;
+}
+
+static struct conf_encoder *conf_encoder_shared(struct conference *conf, const struct rtp_payload_type *pt) {
+	for (GList *l = conf->encoders.head; l; l = l->next) {
+		struct conf_encoder *ce = l->data;
+		if (conf_pt_cmp(&ce->pt, pt))
+			continue;
+		ce->users++;
+		return ce;
+	}
+
+	struct conf_encoder *ce = conf_encoder_new(pt);
+	if (ce)
+		g_queue_push_tail(&conf->encoders, ce);
+	return ce;
+}
+
+static void conf_encoder_shared_put(struct conference *conf, struct conf_encoder **cep) {
+	struct conf_encoder *ce = *cep;
+	if (!ce)
+		return;
+	*cep = NULL;
+	if (--ce->users)
+		return;
+	g_queue_remove(&conf->encoders, ce);
+	conf_encoder_free(ce);
+}
+
+
+// collects the payloads of one cycle, to be sent to all users of the encoder
+static int conf_packet_encoded(encoder_t *enc, void *u1, void *u2) {
+	struct conf_encoder *ce = u1;
+	AVPacket *in_pkt = &enc->avpkt;
+
+	while (1) {
+		unsigned int payload_len = MAX(enc->avpkt.size, ce->bytes_per_packet);
+		struct conf_payload *cp = g_malloc(sizeof(*cp) + payload_len);
+		str inout;
+		str_init_len(&inout, cp->data, payload_len);
+
+		int ret = ce->pt.codec_def->packetizer(in_pkt, ce->sample_buffer, &inout, enc);
+		if (G_UNLIKELY(ret == -1 || enc->avpkt.pts == AV_NOPTS_VALUE)) {
+			g_free(cp);
+			break;
+		}
+
+		cp->len = inout.len;
+		cp->ts = ce->ts_offset + enc->avpkt.pts / enc->def->clockrate_mult;
+		g_queue_push_tail(&ce->payloads, cp);
+
+		if (ret == 0)
+			break;
+		in_pkt = NULL;
+	}
+
+	return 0;
+}
+
+// conf->lock must be held
+static void conf_encode(struct conference *conf, struct conf_encoder *ce, AVFrame *frame) {
+	if (!ce->synced || ce->next_pts != conf->pts) {
+		// first frame, or the encoder was idle: line its RTP TS up with the conference
+		// clock, so that switching between encoders keeps the TS continuous
+		uint64_t queued = ce->encoder->fifo_pts + av_audio_fifo_size(ce->encoder->fifo);
+		ce->ts_offset = conf->ts_base
+			+ conf->pts * ce->pt.clock_rate / CONFERENCE_CLOCKRATE
+			- queued / ce->pt.codec_def->clockrate_mult;
+		ce->synced = 1;
+	}
+	ce->next_pts = conf->pts + CONF_FRAME;
+
+	AVFrame *rsmp_frame = resample_frame(&ce->resampler, frame, &ce->format);
+	if (!rsmp_frame) {
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Resampling of conference audio failed");
+		return;
+	}
+	encoder_input_fifo(ce->encoder, rsmp_frame, conf_packet_encoded, ce, NULL);
+	codeclib_frame_free(&rsmp_frame);
+}
+
+static AVFrame *conf_frame_new(struct conference *conf) {
+	AVFrame *frame = codeclib_frame_alloc();
+	if (!frame)
+		return NULL;
+	frame->format = AV_SAMPLE_FMT_S16;
+	frame->channel_layout = av_get_default_channel_layout(1);
+	frame->sample_rate = CONFERENCE_CLOCKRATE;
+	frame->nb_samples = CONF_FRAME;
+	frame->pts = conf->pts;
+	if (codec_buffer_pool_frame(&conf->frame_pool, frame) < 0) {
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to get buffers for conference frame");
+		codeclib_frame_free(&frame);
+		return NULL;
+	}
+	return frame;
+}
+
+
+// call is locked in R, conf->lock is held
+static void conf_send(struct conference *conf, struct conf_participant *p, struct conf_encoder *ce) {
+	if (!ce || !ce->payloads.length)
+		return;
+	if (!p->sink || !p->sink->selected_sfd || !p->sink->endpoint.address.family || !p->crypt_handler)
+		return;
+
+	struct media_packet mp = {
+		.tv = rtpe_now,
+		.call = conf->call,
+		.media = p->media,
+		.media_out = p->media,
+		.ssrc_out = p->ssrc_out,
+	};
+
+	for (GList *l = ce->payloads.head; l; l = l->next) {
+		struct conf_payload *cp = l->data;
+
+		char *buf = codec_packet_buffer(cp->len);
+		struct rtp_header *rh = (void *) buf;
+		*rh = (struct rtp_header) {
+			.v_p_x_cc = 0x80,
+			.m_pt = p->pt.payload_type | (p->marker ? 0x80 : 0),
+			.seq_num = htons(p->seq++),
+			.timestamp = htonl(cp->ts),
+			.ssrc = htonl(p->ssrc_out->parent->h.ssrc),
+		};
+		memcpy(buf + sizeof(*rh), cp->data, cp->len);
+		p->marker = 0;
+
+		struct codec_packet *pkt = codec_packet_new();
+		pkt->s.s = buf;
+		pkt->s.len = cp->len + sizeof(*rh);
+		pkt->free_func = codec_packet_buffer_free;
+		pkt->ttq_entry.source = conf;
+		pkt->ttq_entry.when = rtpe_now;
+		pkt->rtp = rh;
+		pkt->ts = cp->ts;
+		pkt->ssrc_out = ssrc_ctx_get(p->ssrc_out);
+		payload_tracker_add(&p->ssrc_out->tracker, p->pt.payload_type);
+		g_queue_push_tail(&mp.packets_out, pkt);
+	}
+
+	media_packet_encrypt(p->crypt_handler->out->rtp_crypt, p->crypt_handler->out->rtp_crypt_batch,
+			p->sink, &mp);
+
+	mutex_lock(&p->sink->out_lock);
+	if (media_socket_dequeue(&mp, p->sink))
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error sending conference media to RTP sink");
+	mutex_unlock(&p->sink->out_lock);
+}
+
+
+static void conf_ring_write(struct conf_participant *p, const int16_t *src, unsigned int num) {
+	unsigned int pos = p->in_pts % CONF_RING;
+	unsigned int first = MIN(num, CONF_RING - pos);
+	memcpy(p->ring + pos, src, first * sizeof(*src));
+	memcpy(p->ring, src + first, (num - first) * sizeof(*src));
+}
+
+static void conf_ring_read(struct conf_participant *p, uint64_t pts) {
+	unsigned int pos = pts % CONF_RING;
+	unsigned int first = MIN(CONF_FRAME, CONF_RING - pos);
+	memcpy(p->in, p->ring + pos, first * sizeof(*p->in));
+	memset(p->ring + pos, 0, first * sizeof(*p->in));
+	memcpy(p->in + first, p->ring, (CONF_FRAME - first) * sizeof(*p->in));
+	memset(p->ring, 0, (CONF_FRAME - first) * sizeof(*p->in));
+}
+
+
+// one mixing cycle. call is locked in R, conf->lock is held
+static void conference_mix(struct conference *conf) {
+	int32_t thres = rtpe_config.silence_detect_int ? (rtpe_config.silence_detect_int >> 16)
+		: CONF_VAD_THRES;
+
+	memset(conf->sum, 0, sizeof(conf->sum));
+	for (GList *l = conf->encoders.head; l; l = l->next) {
+		struct conf_encoder *ce = l->data;
+		ce->listeners = 0;
+	}
+
+	for (GList *l = conf->participants.head; l; l = l->next) {
+		struct conf_participant *p = l->data;
+
+		conf_ring_read(p, conf->pts);
+		if (conf_active(p->in, thres))
+			p->hangover = CONF_HANGOVER;
+		else if (p->hangover)
+			p->hangover--;
+
+		if (p->hangover)
+			conf_sum(conf->sum, p->in);
+		else if (p->shared)
+			p->shared->listeners++;
+	}
+
+	// speakers get their own encode without themselves in it
+	for (GList *l = conf->participants.head; l; l = l->next) {
+		struct conf_participant *p = l->data;
+		if (!p->hangover || !p->own)
+			continue;
+
+		AVFrame *frame = conf_frame_new(conf);
+		if (!frame)
+			continue;
+		conf_minus((void *) frame->extended_data[0], conf->sum, p->in);
+		conf_encode(conf, p->own, frame);
+		codeclib_frame_free(&frame);
+
+		conf_send(conf, p, p->own);
+		conf_payloads_clear(p->own);
+	}
+
+	// everybody else gets the full mix, encoded once per output codec
+	AVFrame *frame = NULL;
+	for (GList *l = conf->encoders.head; l; l = l->next) {
+		struct conf_encoder *ce = l->data;
+		if (!ce->listeners)
+			continue;
+		if (!frame) {
+			frame = conf_frame_new(conf);
+			if (!frame)
+				return;
+			conf_clamp((void *) frame->extended_data[0], conf->sum);
+		}
+		conf_encode(conf, ce, frame);
+	}
+	codeclib_frame_free(&frame);
+
+	for (GList *l = conf->participants.head; l; l = l->next) {
+		struct conf_participant *p = l->data;
+		if (!p->hangover)
+			conf_send(conf, p, p->shared);
+	}
+
+	for (GList *l = conf->encoders.head; l; l = l->next)
+		conf_payloads_clear(l->data);
+}
+
+
+static void conference_run(void *ptr) {
+	struct conference *conf = ptr;
+	struct call *call = conf->call;
+
+	log_info_call(call);
+
+	rwlock_lock_r(&call->master_lock);
+	mutex_lock(&conf->lock);
+
+	if (call->conference != conf || !conf->participants.length) {
+		conf->next_run.tv_sec = 0;
+		goto out;
+	}
+
+	unsigned int cycles = 0;
+	while (timeval_cmp(&conf->next_run, &rtpe_now) <= 0) {
+		if (cycles++ >= CONF_CATCHUP) {
+			// too far behind: skip ahead and start over with all inputs
+			long long behind = timeval_diff(&rtpe_now, &conf->next_run);
+			unsigned int skip = behind / (CONF_PTIME * 1000) + 1;
+			ilog(LOG_WARN | LOG_FLAG_LIMIT, "Conference mixer running late, skipping %u cycles",
+					skip);
+			conf->pts += (uint64_t) skip * CONF_FRAME;
+			timeval_add_usec(&conf->next_run, (long long) skip * CONF_PTIME * 1000);
+			for (GList *l = conf->participants.head; l; l = l->next) {
+				struct conf_participant *p = l->data;
+				memset(p->ring, 0, sizeof(p->ring));
+				p->synced = 0;
+			}
+			break;
+		}
+		conference_mix(conf);
+		conf->pts += CONF_FRAME;
+		timeval_add_usec(&conf->next_run, CONF_PTIME * 1000);
+	}
+
+	// the call may have been moved to another poller meanwhile
+	timerthread_obj_follow(&conf->tt_obj, &conference_timers, call->poller);
+	timerthread_obj_schedule_abs(&conf->tt_obj, &conf->next_run);
+
+out:
+	mutex_unlock(&conf->lock);
+	rwlock_unlock_r(&call->master_lock);
+
+	log_info_clear();
+}
+
+
+// call->master_lock held in R
+void conference_add_frame(struct call_media *media, AVFrame *frame) {
+	struct conference *conf = media->call->conference;
+	if (!conf)
+		return;
+	if (G_UNLIKELY(frame->format != AV_SAMPLE_FMT_S16 || frame->channels != 1
+				|| frame->sample_rate != CONFERENCE_CLOCKRATE))
+		return;
+
+	mutex_lock(&conf->lock);
+
+	struct conf_participant *p = NULL;
+	for (GList *l = conf->participants.head; l; l = l->next) {
+		p = l->data;
+		if (p->media == media)
+			break;
+		p = NULL;
+	}
+	if (!p)
+		goto out;
+
+	const int16_t *src = (void *) frame->extended_data[0];
+	unsigned int num = MIN(frame->nb_samples, CONF_RING / 2);
+	uint64_t pts = frame->pts;
+
+	if (p->synced && pts != p->dec_pts) {
+		// lost packets leave a gap of silence, anything else starts over
+		uint64_t gap = pts - p->dec_pts;
+		if (gap < CONF_RING / 2)
+			p->in_pts += gap;
+		else
+			p->synced = 0;
+	}
+	if (p->synced && p->in_pts < conf->pts)
+		p->synced = 0; // input fell behind
+	if (p->synced && p->in_pts + num > conf->pts + CONF_RING - CONF_FRAME) {
+		// input running ahead, e.g. from clock drift
+		memset(p->ring, 0, sizeof(p->ring));
+		p->synced = 0;
+	}
+	if (!p->synced) {
+		p->in_pts = conf->pts + CONF_DELAY;
+		p->synced = 1;
+	}
+
+	conf_ring_write(p, src, num);
+	p->in_pts += num;
+	p->dec_pts = pts + frame->nb_samples;
+
+out:
+	mutex_unlock(&conf->lock);
+}
+
+
+static void conf_participant_free(struct conference *conf, struct conf_participant *p) {
+	ilog(LOG_INFO, "Participant '" STR_FORMAT_M "' leaving conference", STR_FMT_M(&p->ml->tag));
+	conf_encoder_shared_put(conf, &p->shared);
+	if (p->own)
+		conf_encoder_free(p->own);
+	ssrc_ctx_put(&p->ssrc_out);
+	call_mem_add(&conf->call->mem[CALL_MEM_CODEC], -(ssize_t) sizeof(*p));
+	g_slice_free1(sizeof(*p), p);
+}
+
+static void __conference_free(void *p) {
+	struct conference *conf = p;
+
+	codec_buffer_pool_free(&conf->frame_pool);
+	mutex_destroy(&conf->lock);
+	call_mem_add(&conf->call->mem[CALL_MEM_CODEC], -(ssize_t) sizeof(*conf));
+	obj_put(conf->call);
+}
+
+static struct conference *conference_new(struct call *call) {
+	struct conference *conf = obj_alloc0("conference", sizeof(*conf), __conference_free);
+	conf->tt_obj.tt = &timerthread_pollers_get(&conference_timers, call->poller)->tt;
+	mutex_init(&conf->lock);
+	conf->call = obj_get(call);
+	while (conf->ts_base == 0)
+		conf->ts_base = random();
+	call_mem_add(&call->mem[CALL_MEM_CODEC], sizeof(*conf));
+	return conf;
+}
+
+
+// picks the output codec and sets up the encoders for it. call->master_lock held in W
+static void conf_participant_codec(struct conference *conf, struct conf_participant *p) {
+	struct rtp_payload_type *pt = NULL;
+	for (GList *l = p->media->codecs_prefs_send.head; l; l = l->next) {
+		pt = l->data;
+		ensure_codec_def(pt, p->media);
+		if (pt->codec_def && !pt->codec_def->supplemental && pt->codec_def->support_encoding)
+			break;
+		pt = NULL;
+	}
+
+	if (pt && p->pt.codec_def && !conf_pt_cmp(&p->pt, pt) && p->pt.payload_type == pt->payload_type)
+		return; // unchanged
+
+	conf_encoder_shared_put(conf, &p->shared);
+	if (p->own)
+		conf_encoder_free(p->own);
+	p->own = NULL;
+	p->pt.codec_def = NULL;
+
+	if (!pt) {
+		ilog(LOG_WARN, "No supported output codec for conference participant '" STR_FORMAT_M "'",
+				STR_FMT_M(&p->ml->tag));
+		return;
+	}
+
+	p->pt = *pt;
+	if (!p->pt.ptime)
+		p->pt.ptime = pt->codec_def->default_ptime;
+	p->own = conf_encoder_new(&p->pt);
+	p->shared = conf_encoder_shared(conf, &p->pt);
+	p->marker = 1;
+
+	ilog(LOG_DEBUG, "Output codec for conference participant '" STR_FORMAT_M "' is " STR_FORMAT
+			" (%u participants sharing it)",
+			STR_FMT_M(&p->ml->tag), STR_FMT(&p->pt.encoding_with_params),
+			p->shared ? p->shared->users : 0);
+}
+
+static struct call_media *conf_participant_media(struct call_monologue *ml) {
+	for (GList *l = ml->medias.head; l; l = l->next) {
+		struct call_media *media = l->data;
+		if (media->type_id != MT_AUDIO)
+			continue;
+		if (!media->streams.length)
+			continue;
+		return media;
+	}
+	return NULL;
+}
+
+static struct conf_participant *conf_participant_new(struct conference *conf, struct call_monologue *ml) {
+	ilog(LOG_INFO, "Participant '" STR_FORMAT_M "' joining conference", STR_FMT_M(&ml->tag));
+
+	struct conf_participant *p = g_slice_alloc0(sizeof(*p));
+	p->ml = ml;
+	uint32_t ssrc = 0;
+	while (ssrc == 0)
+		ssrc = random();
+	p->ssrc_out = get_ssrc_ctx(ssrc, conf->call->ssrc_hash, SSRC_DIR_OUTPUT, ml);
+	p->ssrc_out->next_rtcp = rtpe_now;
+	p->seq = random();
+	call_mem_add(&conf->call->mem[CALL_MEM_CODEC], sizeof(*p));
+	g_queue_push_tail(&conf->participants, p);
+
+	// the codec handlers take over from the kernel
+	__monologue_unkernelize(ml);
+
+	return p;
+}
+
+
+// called after each offer/answer. call->master_lock held in W
+void conference_update(struct call *call) {
+	struct conference *conf = call->conference;
+
+	// participants that are gone or have lost their audio
+	if (conf) {
+		for (GList *l = conf->participants.head; l; ) {
+			struct conf_participant *p = l->data;
+			GList *next = l->next;
+			if (!p->ml->conference || !conf_participant_media(p->ml)) {
+				g_queue_delete_link(&conf->participants, l);
+				conf_participant_free(conf, p);
+			}
+			l = next;
+		}
+	}
+
+	for (GList *l = call->monologues.head; l; l = l->next) {
+		struct call_monologue *ml = l->data;
+		if (!ml->conference)
+			continue;
+		struct call_media *media = conf_participant_media(ml);
+		if (!media)
+			continue;
+
+		if (!conf)
+			conf = call->conference = conference_new(call);
+
+		struct conf_participant *p = NULL;
+		for (GList *k = conf->participants.head; k; k = k->next) {
+			p = k->data;
+			if (p->ml == ml)
+				break;
+			p = NULL;
+		}
+		if (!p)
+			p = conf_participant_new(conf, ml);
+
+		p->media = media;
+		p->sink = media->streams.head->data;
+		p->crypt_handler = determine_handler(&transport_protocols[PROTO_RTP_AVP], media, 1);
+		conf_participant_codec(conf, p);
+	}
+
+	if (!conf || !conf->participants.length || conf->next_run.tv_sec)
+		return;
+
+	ilog(LOG_DEBUG, "Starting conference mixer with %u participants", conf->participants.length);
+	conf->next_run = rtpe_now;
+	timerthread_obj_follow(&conf->tt_obj, &conference_timers, call->poller);
+	timerthread_obj_schedule_abs(&conf->tt_obj, &conf->next_run);
+}
+
+// call->master_lock held in W
+void conference_leave(struct call_monologue *ml) {
+	struct conference *conf = ml->call->conference;
+
+	ml->conference = 0;
+	if (!conf)
+		return;
+
+	for (GList *l = conf->participants.head; l; l = l->next) {
+		struct conf_participant *p = l->data;
+		if (p->ml != ml)
+			continue;
+		g_queue_delete_link(&conf->participants, l);
+		conf_participant_free(conf, p);
+		break;
+	}
+}
+
+// call->master_lock held in W
+void conference_put(struct call *call) {
+	struct conference *conf = call->conference;
+	if (!conf)
+		return;
+	call->conference = NULL;
+	timerthread_obj_deschedule(&conf->tt_obj);
+	conf->next_run.tv_sec = 0;
+
+	// the monologues go away before the conference object does
+	struct conf_participant *p;
+	while ((p = g_queue_pop_head(&conf->participants)))
+		conf_participant_free(conf, p);
+
+	obj_put(&conf->tt_obj);
+}
+
+
+void conference_init(void) {
+	timerthread_pollers_init(&conference_timers, conference_run, NULL);
+}
+
+void conference_free(void) {
+	timerthread_pollers_free(&conference_timers);
+}
+
+
+
+#endif
@@ -16,58 +16,79 @@
 #include "log_funcs.h"
 #include "main.h"
 #include "statistics.h"
+#include "tcp_listener.h"
+#include "streambuf.h"
+#include "probes.h"
+#include "load.h"
+#include "handover.h"
 
 
 mutex_t rtpe_cngs_lock;
 GHashTable *rtpe_cngs_hash;
 struct control_ng *rtpe_control_ng;
+struct control_ng_tcp *rtpe_control_ng_tcp;
 static struct cookie_cache ng_cookie_cache;
 
+#define NG_BUFFER_HINT_MAX	65536
+
+// per-thread size hint for the bencode buffer, taken from the previous command, and a
+// reusable output buffer that responses are encoded into
+static __thread unsigned int ng_buffer_hint;
+static __thread struct {
+	char *s;
+	unsigned int size;
+} ng_reply_buf;
+
+struct latency_histogram rtpe_ng_latency[NGC_COUNT];
+
+#define NG_TCP_MAX_FRAME	1048576
+
+typedef void ng_send_func(str *, str *, const endpoint_t *, void *);
+
+// commands received on the UDP socket or a TCP connection, queued for the worker pool.
+// holds a reference to "obj" which keeps "p1" alive. without an "obj", "done" is
+// called at the end and "p1" must stay valid until then
+struct control_ng_job {
+	struct obj *obj;
+	ng_send_func *cb;
+	void *p1;
+	void (*done)(void *p1, int ret);
+	endpoint_t sin;
+	char addr[64];
+	str buf;
+	char data[0];
+};
+
+struct control_ng_worker {
+	mutex_t lock;
+	cond_t cond;
+	GQueue jobs;
+};
+
+static struct control_ng_worker *ng_workers;
+static unsigned int ng_num_workers;
+
 const char magic_load_limit_strings[__LOAD_LIMIT_MAX][64] = {
 	[LOAD_LIMIT_MAX_SESSIONS] = "Parallel session limit reached",
 	[LOAD_LIMIT_CPU] = "CPU usage limit exceeded",
 	[LOAD_LIMIT_LOAD] = "Load limit exceeded",
 	[LOAD_LIMIT_BW] = "Bandwidth limit exceeded",
+	[LOAD_LIMIT_TRANSCODING] = "Transcoding unavailable due to overload",
 };
 const char *ng_command_strings[NGC_COUNT] = {
 	"ping", "offer", "answer", "delete", "query", "list", "start recording",
 	"stop recording", "start forwarding", "stop forwarding", "block DTMF",
 	"unblock DTMF", "block media", "unblock media", "play media", "stop media",
-	"play DTMF", "statistics",
+	"play DTMF", "statistics", "batch", "capacity",
 };
 const char *ng_command_strings_short[NGC_COUNT] = {
 	"Ping", "Offer", "Answer", "Delete", "Query", "List", "StartRec",
 	"StopRec", "StartFwd", "StopFwd", "BlkDTMF",
 	"UnblkDTMF", "BlkMedia", "UnblkMedia", "PlayMedia", "StopMedia",
-	"PlayDTMF", "Stats",
+	"PlayDTMF", "Stats", "Batch", "Capacity",
 };
 
 
-static void timeval_update_request_time(struct request_time *request, const struct timeval *offer_diff) {
-	// lock offers
-	mutex_lock(&request->lock);
-
-	// update min value
-	if (timeval_us(&request->time_min) == 0 ||
-	    timeval_cmp(&request->time_min, offer_diff) > 0) {
-		timeval_from_us(&request->time_min, timeval_us(offer_diff));
-	}
-
-	// update max value
-	if (timeval_us(&request->time_max) == 0 ||
-	    timeval_cmp(&request->time_max, offer_diff) < 0) {
-		timeval_from_us(&request->time_max, timeval_us(offer_diff));
-	}
-
-	// update avg value
-	timeval_add(&request->time_avg, &request->time_avg, offer_diff);
-	request->count++;
-
-	// unlock offers
-	mutex_unlock(&request->lock);
-}
-
-
 static void pretty_print(bencode_item_t *el, GString *s) {
 	bencode_item_t *chld;
 	const char *sep;
@@ -113,6 +134,19 @@ static void pretty_print(bencode_item_t *el, GString *s) {
 	}
 }
 
+static void ng_reply_collapse(bencode_item_t *resp, str *out) {
+	unsigned int need = resp->str_len + 1;
+
+	if (need > ng_reply_buf.size) {
+		ng_reply_buf.size = MAX(need, ng_reply_buf.size * 2);
+		ng_reply_buf.s = g_realloc(ng_reply_buf.s, ng_reply_buf.size);
+	}
+
+	out->s = ng_reply_buf.s;
+	out->len = bencode_collapse_buf(resp, ng_reply_buf.s, ng_reply_buf.size);
+	assert(out->len >= 0);
+}
+
 struct control_ng_stats* get_control_ng_stats(const sockaddr_t *addr) {
 	struct control_ng_stats* cur;
 
@@ -154,7 +188,7 @@ int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 		return funcret;
 	}
 
-	int ret = bencode_buffer_init(&bencbuf);
+	int ret = bencode_buffer_init_size(&bencbuf, ng_buffer_hint);
 	assert(ret == 0);
 	(void) ret;
 	resp = bencode_dictionary(&bencbuf);
@@ -186,6 +220,11 @@ int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 	if (!cmd.s)
 		goto err_send;
 
+	// the listeners are closed by then, but websocket connections can still send commands
+	errstr = "Handover to a new process in progress";
+	if (handover_active())
+		goto err_send;
+
 	bencode_dictionary_get_str(dict, "call-id", &callid);
 	log_info_str(&callid);
 
@@ -207,6 +246,8 @@ int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 	// start command timer
 	gettimeofday(&cmd_start, NULL);
 
+	PROBE(ng_command_start, cmd.s, cmd.len, callid.s, callid.len);
+
 	switch (__csh_lookup(&cmd)) {
 		case CSH_LOOKUP("ping"):
 			resultstr = "pong";
@@ -280,6 +321,14 @@ int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 			errstr = statistics_ng(dict, resp);
 			command = NGC_STATISTICS;
 			break;
+		case CSH_LOOKUP("batch"):
+			errstr = call_batch_ng(dict, resp);
+			command = NGC_BATCH;
+			break;
+		case CSH_LOOKUP("capacity"):
+			errstr = load_capacity_ng(dict, resp);
+			command = NGC_CAPACITY;
+			break;
 		default:
 			errstr = "Unrecognized command";
 	}
@@ -289,11 +338,14 @@ int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 	//print command duration
 	timeval_from_us(&cmd_process_time, timeval_diff(&cmd_stop, &cmd_start));
 
+	PROBE(ng_command_done, cmd.s, cmd.len, errstr, timeval_us(&cmd_process_time));
+
 	if (command >= 0 && command < NGC_COUNT) {
 		mutex_lock(&cur->cmd[command].lock);
 		cur->cmd[command].count++;
 		timeval_add(&cur->cmd[command].time, &cur->cmd[command].time, &cmd_process_time);
 		mutex_unlock(&cur->cmd[command].lock);
+		latency_histogram_add(&rtpe_ng_latency[command], timeval_us(&cmd_process_time));
 	}
 
 	if (errstr)
@@ -306,15 +358,15 @@ int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 	switch (command) {
 		case NGC_OFFER:
 			atomic64_inc(&rtpe_statsps.offers);
-			timeval_update_request_time(&rtpe_totalstats_interval.offer, &cmd_process_time);
+			statistics_update_request_time(&totalstats_block()->offer, &cmd_process_time);
 			break;
 		case NGC_ANSWER:
 			atomic64_inc(&rtpe_statsps.answers);
-			timeval_update_request_time(&rtpe_totalstats_interval.answer, &cmd_process_time);
+			statistics_update_request_time(&totalstats_block()->answer, &cmd_process_time);
 			break;
 		case NGC_DELETE:
 			atomic64_inc(&rtpe_statsps.deletes);
-			timeval_update_request_time(&rtpe_totalstats_interval.delete, &cmd_process_time);
+			statistics_update_request_time(&totalstats_block()->delete, &cmd_process_time);
 			break;
 		default:
 			break;
@@ -338,7 +390,7 @@ err_send:
 	}
 
 send_resp:
-	bencode_collapse_str(resp, &reply);
+	ng_reply_collapse(resp, &reply);
 	to_send = &reply;
 
 	if (cmd.s) {
@@ -371,6 +423,7 @@ send_only:
 	goto out;
 
 out:
+	ng_buffer_hint = MIN(bencode_buffer_used(&bencbuf), NG_BUFFER_HINT_MAX);
 	bencode_buffer_free(&bencbuf);
 	log_info_clear();
 	return funcret;
@@ -395,12 +448,130 @@ static void control_ng_send(str *cookie, str *body, const endpoint_t *sin, void
 }
 
 
+// commands for the same call must be handled in order, so the worker is picked based on the
+// call ID, which is located without decoding the whole dictionary
+static unsigned int control_ng_job_hash(const str *buf) {
+	static const char key[] = "7:call-id";
+	const char *end = buf->s + buf->len;
+	const char *p = memmem(buf->s, buf->len, key, sizeof(key) - 1);
+	if (!p)
+		goto cookie;
+	p += sizeof(key) - 1;
+
+	unsigned int len = 0;
+	while (p < end && *p >= '0' && *p <= '9')
+		len = len * 10 + (*p++ - '0');
+	if (p >= end || *p != ':')
+		goto cookie;
+	p++;
+	if (len > end - p)
+		goto cookie;
+
+	str callid;
+	str_init_len(&callid, (char *) p, len);
+	return str_hash(&callid);
+
+cookie:;
+	// no call ID: any worker will do
+	str cookie;
+	str_chr_str(&cookie, buf, ' ');
+	if (cookie.s)
+		str_init_len(&cookie, buf->s, cookie.s - buf->s);
+	else
+		cookie = *buf;
+	return str_hash(&cookie);
+}
+
+static void control_ng_job_free(struct control_ng_job *job, int ret) {
+	if (job->done)
+		job->done(job->p1, ret);
+	if (job->obj)
+		obj_put_o(job->obj);
+	g_free(job);
+}
+
+static void __control_ng_queue(struct obj *obj, str *buf, const endpoint_t *sin, char *addr,
+		ng_send_func *cb, void *p1, void (*done)(void *, int))
+{
+	struct control_ng_job *job = g_malloc(sizeof(*job) + buf->len + 1);
+	job->obj = obj ? obj_get_o(obj) : NULL;
+	job->cb = cb;
+	job->p1 = p1;
+	job->done = done;
+	job->sin = *sin;
+	g_strlcpy(job->addr, addr, sizeof(job->addr));
+	memcpy(job->data, buf->s, buf->len);
+	job->data[buf->len] = '\0';
+	str_init_len(&job->buf, job->data, buf->len);
+
+	struct control_ng_worker *w = &ng_workers[control_ng_job_hash(buf) % ng_num_workers];
+	mutex_lock(&w->lock);
+	g_queue_push_tail(&w->jobs, job);
+	cond_signal(&w->cond);
+	mutex_unlock(&w->lock);
+}
+
+// runs the command directly if there are no workers
+static void control_ng_dispatch(struct obj *obj, str *buf, const endpoint_t *sin, char *addr,
+		ng_send_func *cb, void *p1)
+{
+	if (!ng_num_workers) {
+		control_ng_process(buf, sin, addr, cb, p1);
+		return;
+	}
+	__control_ng_queue(obj, buf, sin, addr, cb, p1, NULL);
+}
+
+// for callers that have their own threads: returns -1 if there are no workers, and the
+// command must then be run by the caller
+int control_ng_queue(str *buf, const endpoint_t *sin, char *addr, ng_send_func *cb, void *p1,
+		void (*done)(void *, int))
+{
+	if (!ng_num_workers)
+		return -1;
+	__control_ng_queue(NULL, buf, sin, addr, cb, p1, done);
+	return 0;
+}
+
 static void control_ng_incoming(struct obj *obj, str *buf, const endpoint_t *sin, char *addr,
 		socket_t *ul)
 {
-	control_ng_process(buf, sin, addr, control_ng_send, ul);
+	control_ng_dispatch(obj, buf, sin, addr, control_ng_send, ul);
 }
 
+void control_ng_worker_loop(void *p) {
+	struct control_ng_worker *w = &ng_workers[GPOINTER_TO_UINT(p)];
+
+	mutex_lock(&w->lock);
+
+	while (!rtpe_shutdown) {
+		gettimeofday(&rtpe_now, NULL);
+
+		struct control_ng_job *job = g_queue_pop_head(&w->jobs);
+		if (!job) {
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&w->cond, &w->lock, &tv);
+			continue;
+		}
+		mutex_unlock(&w->lock);
+
+		int ret = control_ng_process(&job->buf, &job->sin, job->addr, job->cb, job->p1);
+		control_ng_job_free(job, ret);
+
+		mutex_lock(&w->lock);
+	}
+
+	mutex_unlock(&w->lock);
+}
+
+
+void control_ng_close(struct control_ng *c) {
+	poller_del_item(c->poller, c->udp_listeners[0].fd);
+	poller_del_item(c->poller, c->udp_listeners[1].fd);
+	close_socket(&c->udp_listeners[0]);
+	close_socket(&c->udp_listeners[1]);
+}
 
 void control_ng_free(void *p) {
 	struct control_ng *c = p;
@@ -453,11 +624,116 @@ fail2:
 }
 
 
+// each message is framed as "LENGTH:COOKIE DATA", in both directions. replies can be sent in
+// a different order than the requests were received in and are matched up by the cookie
+static void control_ng_tcp_send(str *cookie, str *body, const endpoint_t *sin, void *p1) {
+	struct streambuf_stream *s = p1;
+	GString *out = g_string_sized_new(cookie->len + body->len + 12);
+
+	g_string_append_printf(out, "%u:", cookie->len + 1 + body->len);
+	g_string_append_len(out, cookie->s, cookie->len);
+	g_string_append_c(out, ' ');
+	g_string_append_len(out, body->s, body->len);
+
+	// single write so that replies from different workers don't interleave
+	streambuf_write(s->outbuf, out->str, out->len);
+	g_string_free(out, TRUE);
+}
+
+static void control_ng_tcp_incoming(struct streambuf_stream *s) {
+	ilog(LOG_INFO, "New TCP NG connection from %s", s->addr);
+}
+
+static void control_ng_tcp_closed(struct streambuf_stream *s) {
+	ilog(LOG_INFO, "TCP NG connection from %s closed", s->addr);
+}
+
+static void control_ng_tcp_readable(struct streambuf_stream *s) {
+	str frame;
+	int ret;
+
+	while ((ret = streambuf_getframe(s->inbuf, &frame, NG_TCP_MAX_FRAME)) == 1) {
+		control_ng_dispatch(&s->obj, &frame, &s->sock.remote, s->addr, control_ng_tcp_send, s);
+		free(frame.s);
+	}
+
+	if (ret < 0) {
+		ilog(LOG_WARNING, "Invalid or oversized frame on TCP NG connection from %s", s->addr);
+		streambuf_stream_close(s);
+	}
+}
+
+void control_ng_tcp_close(struct control_ng_tcp *c) {
+	streambuf_listener_close(&c->listeners[0]);
+	streambuf_listener_close(&c->listeners[1]);
+}
+
+static void control_ng_tcp_free(void *p) {
+	struct control_ng_tcp *c = p;
+	streambuf_listener_shutdown(&c->listeners[0]);
+	streambuf_listener_shutdown(&c->listeners[1]);
+}
+
+struct control_ng_tcp *control_ng_tcp_new(struct poller *p, endpoint_t *ep) {
+	struct control_ng_tcp *c;
+
+	if (!p)
+		return NULL;
+
+	c = obj_alloc0("control_ng_tcp", sizeof(*c), control_ng_tcp_free);
+	c->poller = p;
+
+	if (streambuf_listener_init(&c->listeners[0], p, ep,
+				control_ng_tcp_incoming, control_ng_tcp_readable,
+				control_ng_tcp_closed, NULL, &c->obj))
+	{
+		ilog(LOG_ERR, "Failed to open TCP NG port: %s", strerror(errno));
+		goto fail;
+	}
+	if (ipv46_any_convert(ep)) {
+		if (streambuf_listener_init(&c->listeners[1], p, ep,
+					control_ng_tcp_incoming, control_ng_tcp_readable,
+					control_ng_tcp_closed, NULL, &c->obj))
+		{
+			ilog(LOG_ERR, "Failed to open TCP NG port: %s", strerror(errno));
+			goto fail;
+		}
+	}
+
+	obj_put(c);
+	return c;
+
+fail:
+	obj_put(c);
+	return NULL;
+}
+
+
 void control_ng_init() {
 	mutex_init(&rtpe_cngs_lock);
 	rtpe_cngs_hash = g_hash_table_new(g_sockaddr_hash, g_sockaddr_eq);
 	cookie_cache_init(&ng_cookie_cache);
+
+	ng_num_workers = rtpe_config.control_ng_threads;
+	if (ng_num_workers) {
+		ng_workers = g_malloc0(sizeof(*ng_workers) * ng_num_workers);
+		for (unsigned int i = 0; i < ng_num_workers; i++) {
+			mutex_init(&ng_workers[i].lock);
+			cond_init(&ng_workers[i].cond);
+			g_queue_init(&ng_workers[i].jobs);
+		}
+	}
 }
 void control_ng_cleanup() {
+	for (unsigned int i = 0; i < ng_num_workers; i++) {
+		struct control_ng_job *job;
+		while ((job = g_queue_pop_head(&ng_workers[i].jobs)))
+			control_ng_job_free(job, -1);
+		mutex_destroy(&ng_workers[i].lock);
+	}
+	g_free(ng_workers);
+	ng_workers = NULL;
+	ng_num_workers = 0;
+
 	cookie_cache_cleanup(&ng_cookie_cache);
 }
@@ -65,22 +65,92 @@ static void control_list(struct control_tcp *c, struct streambuf_stream *s) {
 }
 
 
+/*
+ * Parser for the commands matched by parse_re. Fields are recorded first and only
+ * terminated in place by control_tcp_tokens_out(), so that the line can still be
+ * logged or handed to the RE unmodified.
+ */
+struct tcp_tokens {
+	str			part[RE_TCP_DIV_CMD + 1];
+};
+
+static int control_tcp_tokenize(struct tcp_tokens *tok, char *line) {
+	str l, t[10];
+	unsigned int n;
+	str *p = tok->part;
+
+	ZERO(*tok);
+
+	str_init(&l, line);
+	if (!l.len || str_isspace(l.s[0]) || str_isspace(l.s[l.len - 1]))
+		return -1;
+	n = str_split_ws(t, G_N_ELEMENTS(t), &l);
+
+	if (n == 10 && (!str_cmp(&t[0], "request") || !str_cmp(&t[0], "lookup"))) {
+		if (str_shift_cmp(&t[9], "info="))
+			return -1;
+		memcpy(&p[RE_TCP_RL_CMD], t, sizeof(t));
+		return 0;
+	}
+	if (n == 3 && !str_cmp(&t[0], "delete")) {
+		if (str_shift_cmp(&t[2], "info="))
+			return -1;
+		memcpy(&p[RE_TCP_D_CMD], t, sizeof(*t) * 3);
+		return 0;
+	}
+	if (n == 1 && (!str_cmp(&t[0], "build") || !str_cmp(&t[0], "version")
+				|| !str_cmp(&t[0], "controls") || !str_cmp(&t[0], "quit")
+				|| !str_cmp(&t[0], "exit") || !str_cmp(&t[0], "status")))
+	{
+		p[RE_TCP_DIV_CMD] = t[0];
+		return 0;
+	}
+
+	return -1;
+}
+
+// unset fields are empty strings, as from the RE
+static void control_tcp_tokens_out(char **out, struct tcp_tokens *tok) {
+	str *p;
+
+	for (unsigned int i = 0; i <= RE_TCP_DIV_CMD; i++) {
+		p = &tok->part[i];
+		if (!p->s)
+			out[i] = (char *) "";
+		else {
+			p->s[p->len] = '\0';
+			out[i] = p->s;
+		}
+	}
+	out[RE_TCP_DIV_CMD + 1] = NULL;
+}
+
+
 static int control_stream_parse(struct streambuf_stream *s, char *line) {
 	int ovec[60];
-	int ret;
+	int ret = 0, tokenized;
 	char **out;
+	char *tokens[RE_TCP_DIV_CMD + 2];
+	struct tcp_tokens tok;
 	struct control_tcp *c = (void *) s->parent;
 	str *output = NULL;
 
-	ret = pcre_exec(c->parse_re, c->parse_ree, line, strlen(line), 0, 0, ovec, G_N_ELEMENTS(ovec));
-	if (ret <= 0) {
+	tokenized = !control_tcp_tokenize(&tok, line);
+	if (!tokenized)
+		ret = pcre_exec(c->parse_re, c->parse_ree, line, strlen(line), 0, 0, ovec, G_N_ELEMENTS(ovec));
+	if (!tokenized && ret <= 0) {
 		ilog(LOG_WARNING, "Unable to parse command line from %s: %s", s->addr, line);
 		return -1;
 	}
 
 	ilog(LOG_INFO, "Got valid command from %s: %s", s->addr, line);
 
-	pcre_get_substring_list(line, ovec, ret, (const char ***) &out);
+	if (tokenized) {
+		control_tcp_tokens_out(tokens, &tok);
+		out = tokens;
+	}
+	else
+		pcre_get_substring_list(line, ovec, ret, (const char ***) &out);
 
 
 	if (out[RE_TCP_RL_CALLID])
@@ -109,7 +179,8 @@ static int control_stream_parse(struct streambuf_stream *s, char *line) {
 		free(output);
 	}
 
-	pcre_free(out);
+	if (out != tokens)
+		pcre_free(out);
 	log_info_clear();
 	return 1;
 }
@@ -154,6 +225,11 @@ static void control_incoming(struct streambuf_stream *s) {
 }
 
 
+void control_tcp_close(struct control_tcp *c) {
+	streambuf_listener_close(&c->listeners[0]);
+	streambuf_listener_close(&c->listeners[1]);
+}
+
 static void control_tcp_free(void *p) {
 	struct control_tcp *c = p;
 	streambuf_listener_shutdown(&c->listeners[0]);
@@ -21,18 +21,168 @@
 #include "log_funcs.h"
 
 
+#define UDP_DIGITS "0123456789"
+#define UDP_HEX UDP_DIGITS "abcdefABCDEF"
+
+static int __udp_all(const str *s, const char *set) {
+	if (!s->len)
+		return 0;
+	for (int i = 0; i < s->len; i++) {
+		if (!s->s[i] || !strchr(set, s->s[i]))
+			return 0;
+	}
+	return 1;
+}
+
+// "callid;viabranch" with the branch being optional
+static int __udp_callid(str *callid, str *branch, const str *t) {
+	char *sc = str_chr(t, ';');
+
+	*callid = *t;
+	if (!sc)
+		return 0;
+	callid->len = sc - t->s;
+	str_init_len(branch, sc + 1, t->len - callid->len - 1);
+	return (callid->len && branch->len) ? 0 : -1;
+}
+
+// "tag;num" - the tag ends at the first semicolon that is followed by nothing but digits.
+// with `opt` set, a tag without a number is accepted as well
+static int __udp_tag(str *tag, str *num, const str *t, int opt) {
+	str n;
+
+	for (int i = 1; i < t->len - 1; i++) {
+		if (t->s[i] != ';')
+			continue;
+		str_init_len(&n, t->s + i + 1, t->len - i - 1);
+		if (!__udp_all(&n, UDP_DIGITS))
+			continue;
+		str_init_len(tag, t->s, i);
+		if (num)
+			*num = n;
+		return 0;
+	}
+	if (!opt)
+		return -1;
+	*tag = *t;
+	return 0;
+}
+
+static void __udp_cmd(str *p, unsigned int idx, const str *t) {
+	str_init_len(&p[idx], t->s, 1);
+	str_init_len(&p[idx + 1], t->s + 1, t->len - 1);
+}
+
+int control_udp_tokenize(struct udp_tokens *tok, const str *buf) {
+	str b = *buf, t[7];
+	str *p = tok->part;
+	unsigned int n;
+
+	ZERO(*tok);
+
+	// a single trailing CR/LF is allowed, any other trailing white space goes to the RE
+	if (b.len && b.s[b.len - 1] == '\n')
+		b.len--;
+	if (b.len && b.s[b.len - 1] == '\r')
+		b.len--;
+	if (!b.len || str_isspace(b.s[0]) || str_isspace(b.s[b.len - 1]))
+		return -1;
+
+	n = str_split_ws(t, G_N_ELEMENTS(t), &b);
+	if (n < 2)
+		return -1;
+
+	p[RE_UDP_COOKIE] = t[0];
+
+	switch (chrtoupper(t[1].s[0])) {
+		case 'U':
+		case 'L':
+			if (n < 6)
+				return -1;
+			// the RE lets a call-ID without via-branch swallow all but the last white
+			// space character before the address
+			if (t[3].s != t[2].s + t[2].len + 1)
+				return -1;
+			__udp_cmd(p, RE_UDP_UL_CMD, &t[1]);
+			if (__udp_callid(&p[RE_UDP_UL_CALLID], &p[RE_UDP_UL_VIABRANCH], &t[2]))
+				return -1;
+			if (__udp_all(&t[3], UDP_DIGITS "."))
+				p[RE_UDP_UL_ADDR4] = t[3];
+			else if (__udp_all(&t[3], UDP_HEX ":"))
+				p[RE_UDP_UL_ADDR6] = t[3];
+			else
+				return -1;
+			if (!__udp_all(&t[4], UDP_DIGITS))
+				return -1;
+			p[RE_UDP_UL_PORT] = t[4];
+			if (__udp_tag(&p[RE_UDP_UL_FROMTAG], &p[RE_UDP_UL_NUM], &t[5], 0))
+				return -1;
+			// anything after the to-tag is ignored
+			if (n > 6 && __udp_tag(&p[RE_UDP_UL_TOTAG], NULL, &t[6], 0))
+				return -1;
+			return 0;
+
+		case 'D':
+		case 'Q':
+			if (n != 4 && n != 5)
+				return -1;
+			__udp_cmd(p, RE_UDP_DQ_CMD, &t[1]);
+			if (__udp_callid(&p[RE_UDP_DQ_CALLID], &p[RE_UDP_DQ_VIABRANCH], &t[2]))
+				return -1;
+			__udp_tag(&p[RE_UDP_DQ_FROMTAG], NULL, &t[3], 1);
+			if (n == 5)
+				__udp_tag(&p[RE_UDP_DQ_TOTAG], NULL, &t[4], 1);
+			return 0;
+
+		case 'V':
+			__udp_cmd(p, RE_UDP_V_CMD, &t[1]);
+			if (n > 2)
+				p[RE_UDP_V_PARMS] = t[2];
+			return 0;
+	}
+
+	return -1;
+}
+
+// terminates all fields in place. unset fields are empty strings, as from the RE
+void control_udp_tokens_out(char **out, struct udp_tokens *tok, char *cmd) {
+	str *p;
+
+	for (unsigned int i = 0; i <= RE_UDP_V_PARMS; i++) {
+		p = &tok->part[i];
+		if (!p->s)
+			out[i] = (char *) "";
+		else if (i == RE_UDP_UL_CMD || i == RE_UDP_DQ_CMD || i == RE_UDP_V_CMD) {
+			// immediately followed by the flags
+			cmd[0] = p->s[0];
+			cmd[1] = '\0';
+			out[i] = cmd;
+		}
+		else {
+			p->s[p->len] = '\0';
+			out[i] = p->s;
+		}
+	}
+	out[RE_UDP_V_PARMS + 1] = NULL;
+}
+
 static void control_udp_incoming(struct obj *obj, str *buf, const endpoint_t *sin, char *addr,
 		socket_t *ul) {
 	struct control_udp *u = (void *) obj;
-	int ret;
+	int ret = 0, tokenized;
 	int ovec[100];
 	char **out;
+	char *tokens[RE_UDP_V_PARMS + 2];
+	char cmd[2];
+	struct udp_tokens tok;
 	struct iovec iov[10];
 	unsigned int iovlen;
 	str cookie, *reply;
 
-	ret = pcre_exec(u->parse_re, u->parse_ree, buf->s, buf->len, 0, 0, ovec, G_N_ELEMENTS(ovec));
-	if (ret <= 0) {
+	tokenized = !control_udp_tokenize(&tok, buf);
+	if (!tokenized)
+		ret = pcre_exec(u->parse_re, u->parse_ree, buf->s, buf->len, 0, 0, ovec, G_N_ELEMENTS(ovec));
+	if (!tokenized && ret <= 0) {
 		ret = pcre_exec(u->fallback_re, NULL, buf->s, buf->len, 0, 0, ovec, G_N_ELEMENTS(ovec));
 		if (ret <= 0) {
 			ilog(LOG_WARNING, "Unable to parse command line from udp:%s: %.*s", addr, STR_FMT(buf));
@@ -69,7 +219,12 @@ static void control_udp_incoming(struct obj *obj, str *buf, const endpoint_t *si
 
 	ilog(LOG_INFO, "Got valid command from udp:%s: %.*s", addr, STR_FMT(buf));
 
-	pcre_get_substring_list(buf->s, ovec, ret, (const char ***) &out);
+	if (tokenized) {
+		control_udp_tokens_out(tokens, &tok, cmd);
+		out = tokens;
+	}
+	else
+		pcre_get_substring_list(buf->s, ovec, ret, (const char ***) &out);
 
 	str_init(&cookie, (void *) out[RE_UDP_COOKIE]);
 	reply = cookie_cache_lookup(&u->cookie_cache, &cookie);
@@ -130,10 +285,18 @@ static void control_udp_incoming(struct obj *obj, str *buf, const endpoint_t *si
 		cookie_cache_remove(&u->cookie_cache, &cookie);
 
 out:
-	pcre_free(out);
+	if (out != tokens)
+		pcre_free(out);
 	log_info_clear();
 }
 
+void control_udp_close(struct control_udp *u) {
+	poller_del_item(u->poller, u->udp_listeners[0].fd);
+	poller_del_item(u->poller, u->udp_listeners[1].fd);
+	close_socket(&u->udp_listeners[0]);
+	close_socket(&u->udp_listeners[1]);
+}
+
 void control_udp_free(void *p) {
 	struct control_udp *u = p;
 	pcre_free_study(u->parse_ree);
@@ -144,17 +307,11 @@ void control_udp_free(void *p) {
 	cookie_cache_cleanup(&u->cookie_cache);
 }
 
-struct control_udp *control_udp_new(struct poller *p, endpoint_t *ep) {
-	struct control_udp *c;
+pcre *control_udp_parse_re(pcre_extra **ree) {
 	const char *errptr;
 	int erroff;
 
-	if (!p)
-		return NULL;
-
-	c = obj_alloc0("control_udp", sizeof(*c), control_udp_free);
-
-	c->parse_re = pcre_compile(
+	pcre *re = pcre_compile(
 			/* cookie cmd flags callid viabranch:5 */
 			"^(\\S+)\\s+(?:([ul])(\\S*)\\s+([^;]+)(?:;(\\S+))?\\s+" \
 			/* addr4 addr6:7 */
@@ -166,7 +323,25 @@ struct control_udp *control_udp_new(struct poller *p, endpoint_t *ep) {
 			/* v flags params:20 */
 			"|(v)(\\S*)(?:\\s+(\\S+))?)",
 			PCRE_DOLLAR_ENDONLY | PCRE_DOTALL | PCRE_CASELESS, &errptr, &erroff, NULL);
-	c->parse_ree = pcre_study(c->parse_re, 0, &errptr);
+	if (re)
+		*ree = pcre_study(re, 0, &errptr);
+	return re;
+}
+
+struct control_udp *control_udp_new(struct poller *p, endpoint_t *ep) {
+	struct control_udp *c;
+	const char *errptr;
+	int erroff;
+
+	if (!p)
+		return NULL;
+
+	c = obj_alloc0("control_udp", sizeof(*c), control_udp_free);
+	c->poller = p;
+	c->udp_listeners[0].fd = -1;
+	c->udp_listeners[1].fd = -1;
+
+	c->parse_re = control_udp_parse_re(&c->parse_ree);
 			              /* cookie       cmd flags callid   addr      port */
 	c->fallback_re = pcre_compile("^(\\S+)(?:\\s+(\\S)\\S*\\s+\\S+(\\s+\\S+)(\\s+\\S+))?", PCRE_DOLLAR_ENDONLY | PCRE_DOTALL | PCRE_CASELESS, &errptr, &erroff, NULL);
 
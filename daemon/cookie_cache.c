@@ -8,78 +8,135 @@
 #include "poller.h"
 #include "str.h"
 
-static const char *cookie_in_use = "MAGIC";
+#define COOKIE_CACHE_SHARD_MAX (COOKIE_CACHE_MAX_ENTRIES / COOKIE_CACHE_SHARDS)
+
+/* one per cookie that is being processed, waited on by threads that receive a duplicate
+ * in the meantime. freed by whoever drops the last reference. */
+struct cookie_cache_wait {
+	cond_t cond;
+	unsigned int refs;
+	int done:1;
+};
 
 INLINE void cookie_cache_state_init(struct cookie_cache_state *s) {
 	s->cookies = g_hash_table_new(str_hash, str_equal);
 	s->chunks = g_string_chunk_new(4 * 1024);
 }
 
+INLINE struct cookie_cache_shard *cookie_cache_shard(struct cookie_cache *c, const str *s) {
+	return &c->shards[str_hash(s) % COOKIE_CACHE_SHARDS];
+}
+
 void cookie_cache_init(struct cookie_cache *c) {
-	cookie_cache_state_init(&c->current);
-	cookie_cache_state_init(&c->old);
-	c->swap_time = rtpe_now.tv_sec;
-	mutex_init(&c->lock);
-	cond_init(&c->cond);
+	for (int i = 0; i < COOKIE_CACHE_SHARDS; i++) {
+		struct cookie_cache_shard *cs = &c->shards[i];
+		cookie_cache_state_init(&cs->current);
+		cookie_cache_state_init(&cs->old);
+		cs->in_use = g_hash_table_new(str_hash, str_equal);
+		cs->swap_time = rtpe_now.tv_sec;
+		mutex_init(&cs->lock);
+	}
 }
 
 /* lock must be held */
-static void __cookie_cache_check_swap(struct cookie_cache *c) {
-	if (rtpe_now.tv_sec - c->swap_time >= 30) {
-		g_hash_table_remove_all(c->old.cookies);
-		g_string_chunk_clear(c->old.chunks);
-		swap_ptrs(&c->old.chunks, &c->current.chunks);
-		swap_ptrs(&c->old.cookies, &c->current.cookies);
-		c->swap_time = rtpe_now.tv_sec;
+static void __cookie_cache_check_swap(struct cookie_cache_shard *cs) {
+	if (rtpe_now.tv_sec - cs->swap_time >= 30
+			|| g_hash_table_size(cs->current.cookies) >= COOKIE_CACHE_SHARD_MAX)
+	{
+		g_hash_table_remove_all(cs->old.cookies);
+		g_string_chunk_clear(cs->old.chunks);
+		swap_ptrs(&cs->old.chunks, &cs->current.chunks);
+		swap_ptrs(&cs->old.cookies, &cs->current.cookies);
+		cs->swap_time = rtpe_now.tv_sec;
 	}
 }
 
+/* lock must be held */
+static void __cookie_cache_wait_put(struct cookie_cache_wait *w) {
+	if (--w->refs)
+		return;
+	pthread_cond_destroy(&w->cond);
+	g_slice_free1(sizeof(*w), w);
+}
+
+/* lock must be held */
+static void __cookie_cache_done(struct cookie_cache_shard *cs, const str *s) {
+	struct cookie_cache_wait *w = g_hash_table_lookup(cs->in_use, s);
+	if (!w)
+		return;
+	g_hash_table_remove(cs->in_use, s);
+	w->done = 1;
+	cond_broadcast(&w->cond);
+	__cookie_cache_wait_put(w);
+}
+
 str *cookie_cache_lookup(struct cookie_cache *c, const str *s) {
+	struct cookie_cache_shard *cs = cookie_cache_shard(c, s);
+	struct cookie_cache_wait *w;
 	str *ret;
 
-	mutex_lock(&c->lock);
+	mutex_lock(&cs->lock);
 
-	__cookie_cache_check_swap(c);
+	__cookie_cache_check_swap(cs);
 
 restart:
-	ret = g_hash_table_lookup(c->current.cookies, s);
+	w = g_hash_table_lookup(cs->in_use, s);
+	if (w) {
+		/* another thread is working on this right now */
+		w->refs++;
+		while (!w->done)
+			cond_wait(&w->cond, &cs->lock);
+		__cookie_cache_wait_put(w);
+		goto restart;
+	}
+
+	ret = g_hash_table_lookup(cs->current.cookies, s);
 	if (!ret)
-		ret = g_hash_table_lookup(c->old.cookies, s);
+		ret = g_hash_table_lookup(cs->old.cookies, s);
 	if (ret) {
-		if (ret == (void *) cookie_in_use) {
-			/* another thread is working on this right now */
-			cond_wait(&c->cond, &c->lock);
-			goto restart;
-		}
 		ret = str_dup(ret);
-		mutex_unlock(&c->lock);
+		mutex_unlock(&cs->lock);
 		return ret;
 	}
-	g_hash_table_replace(c->current.cookies, (void *) s, (void *) cookie_in_use);
-	mutex_unlock(&c->lock);
+
+	/* the key remains owned by the caller until it calls insert or remove */
+	w = g_slice_alloc0(sizeof(*w));
+	cond_init(&w->cond);
+	w->refs = 1;
+	g_hash_table_insert(cs->in_use, (void *) s, w);
+	mutex_unlock(&cs->lock);
 	return NULL;
 }
 
 void cookie_cache_insert(struct cookie_cache *c, const str *s, const str *r) {
-	mutex_lock(&c->lock);
-	g_hash_table_replace(c->current.cookies, str_chunk_insert(c->current.chunks, s),
-		str_chunk_insert(c->current.chunks, r));
-	g_hash_table_remove(c->old.cookies, s);
-	cond_broadcast(&c->cond);
-	mutex_unlock(&c->lock);
+	struct cookie_cache_shard *cs = cookie_cache_shard(c, s);
+
+	mutex_lock(&cs->lock);
+	g_hash_table_replace(cs->current.cookies, str_chunk_insert(cs->current.chunks, s),
+		str_chunk_insert(cs->current.chunks, r));
+	g_hash_table_remove(cs->old.cookies, s);
+	__cookie_cache_done(cs, s);
+	mutex_unlock(&cs->lock);
 }
 
 void cookie_cache_remove(struct cookie_cache *c, const str *s) {
-	mutex_lock(&c->lock);
-	g_hash_table_remove(c->current.cookies, s);
-	g_hash_table_remove(c->old.cookies, s);
-	cond_broadcast(&c->cond);
-	mutex_unlock(&c->lock);
+	struct cookie_cache_shard *cs = cookie_cache_shard(c, s);
+
+	mutex_lock(&cs->lock);
+	g_hash_table_remove(cs->current.cookies, s);
+	g_hash_table_remove(cs->old.cookies, s);
+	__cookie_cache_done(cs, s);
+	mutex_unlock(&cs->lock);
 }
 
 void cookie_cache_cleanup(struct cookie_cache *c) {
-	g_hash_table_destroy(c->current.cookies);
-	g_hash_table_destroy(c->old.cookies);
-	g_string_chunk_free(c->current.chunks);
-	g_string_chunk_free(c->old.chunks);
+	for (int i = 0; i < COOKIE_CACHE_SHARDS; i++) {
+		struct cookie_cache_shard *cs = &c->shards[i];
+		g_hash_table_destroy(cs->current.cookies);
+		g_hash_table_destroy(cs->old.cookies);
+		g_hash_table_destroy(cs->in_use);
+		g_string_chunk_free(cs->current.chunks);
+		g_string_chunk_free(cs->old.chunks);
+		mutex_destroy(&cs->lock);
+	}
 }
@@ -24,6 +24,8 @@ GString __thread *crypto_debug_string;
 
 
 static int aes_cm_encrypt_rtp(struct crypto_context *, struct rtp_header *, str *, u_int64_t);
+static int aes_cm_encrypt_rtp_batch(struct crypto_context *, struct rtp_header **, str *, const u_int64_t *,
+		unsigned int);
 static int aes_cm_encrypt_rtcp(struct crypto_context *, struct rtcp_packet *, str *, u_int64_t);
 static int hmac_sha1_rtp(struct crypto_context *, char *out, str *in, u_int64_t);
 static int hmac_sha1_rtcp(struct crypto_context *, char *out, str *in);
@@ -34,6 +36,11 @@ static int aes_f8_session_key_init(struct crypto_context *c);
 static int evp_session_key_cleanup(struct crypto_context *c);
 static int null_crypt_rtp(struct crypto_context *c, struct rtp_header *r, str *s, u_int64_t idx);
 static int null_crypt_rtcp(struct crypto_context *c, struct rtcp_packet *r, str *s, u_int64_t idx);
+static int aes_gcm_encrypt_rtp(struct crypto_context *c, struct rtp_header *r, str *s, u_int64_t idx);
+static int aes_gcm_decrypt_rtp(struct crypto_context *c, struct rtp_header *r, str *s, u_int64_t idx);
+static int aes_gcm_encrypt_rtcp(struct crypto_context *c, struct rtcp_packet *r, str *s, u_int64_t idx);
+static int aes_gcm_decrypt_rtcp(struct crypto_context *c, struct rtcp_packet *r, str *s, u_int64_t idx);
+static int aes_gcm_session_key_init(struct crypto_context *c);
 
 /* all lengths are in bytes */
 struct crypto_suite __crypto_suites[] = {
@@ -53,6 +60,7 @@ struct crypto_suite __crypto_suites[] = {
 		.srtp_auth_key_len	= 20,
 		.srtcp_auth_key_len	= 20,
 		.encrypt_rtp		= aes_cm_encrypt_rtp,
+		.encrypt_rtp_batch	= aes_cm_encrypt_rtp_batch,
 		.decrypt_rtp		= aes_cm_encrypt_rtp,
 		.encrypt_rtcp		= aes_cm_encrypt_rtcp,
 		.decrypt_rtcp		= aes_cm_encrypt_rtcp,
@@ -77,6 +85,7 @@ struct crypto_suite __crypto_suites[] = {
 		.srtp_auth_key_len	= 20,
 		.srtcp_auth_key_len	= 20,
 		.encrypt_rtp		= aes_cm_encrypt_rtp,
+		.encrypt_rtp_batch	= aes_cm_encrypt_rtp_batch,
 		.decrypt_rtp		= aes_cm_encrypt_rtp,
 		.encrypt_rtcp		= aes_cm_encrypt_rtcp,
 		.decrypt_rtcp		= aes_cm_encrypt_rtcp,
@@ -101,6 +110,7 @@ struct crypto_suite __crypto_suites[] = {
 		.srtp_auth_key_len	= 20,
 		.srtcp_auth_key_len	= 20,
 		.encrypt_rtp		= aes_cm_encrypt_rtp,
+		.encrypt_rtp_batch	= aes_cm_encrypt_rtp_batch,
 		.decrypt_rtp		= aes_cm_encrypt_rtp,
 		.encrypt_rtcp		= aes_cm_encrypt_rtcp,
 		.decrypt_rtcp		= aes_cm_encrypt_rtcp,
@@ -125,6 +135,7 @@ struct crypto_suite __crypto_suites[] = {
 		.srtp_auth_key_len	= 20,
 		.srtcp_auth_key_len	= 20,
 		.encrypt_rtp		= aes_cm_encrypt_rtp,
+		.encrypt_rtp_batch	= aes_cm_encrypt_rtp_batch,
 		.decrypt_rtp		= aes_cm_encrypt_rtp,
 		.encrypt_rtcp		= aes_cm_encrypt_rtcp,
 		.decrypt_rtcp		= aes_cm_encrypt_rtcp,
@@ -149,6 +160,7 @@ struct crypto_suite __crypto_suites[] = {
 		.srtp_auth_key_len	= 20,
 		.srtcp_auth_key_len	= 20,
 		.encrypt_rtp		= aes_cm_encrypt_rtp,
+		.encrypt_rtp_batch	= aes_cm_encrypt_rtp_batch,
 		.decrypt_rtp		= aes_cm_encrypt_rtp,
 		.encrypt_rtcp		= aes_cm_encrypt_rtcp,
 		.decrypt_rtcp		= aes_cm_encrypt_rtcp,
@@ -173,6 +185,7 @@ struct crypto_suite __crypto_suites[] = {
 		.srtp_auth_key_len	= 20,
 		.srtcp_auth_key_len	= 20,
 		.encrypt_rtp		= aes_cm_encrypt_rtp,
+		.encrypt_rtp_batch	= aes_cm_encrypt_rtp_batch,
 		.decrypt_rtp		= aes_cm_encrypt_rtp,
 		.encrypt_rtcp		= aes_cm_encrypt_rtcp,
 		.decrypt_rtcp		= aes_cm_encrypt_rtcp,
@@ -275,6 +288,56 @@ struct crypto_suite __crypto_suites[] = {
 		.hash_rtcp		= hmac_sha1_rtcp,
 		.session_key_cleanup	= evp_session_key_cleanup,
 	},
+	{
+		.name			= "AEAD_AES_128_GCM",
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		.dtls_name		= "SRTP_AEAD_AES_128_GCM",
+#endif
+		.master_key_len		= 16,
+		.master_salt_len	= 12,
+		.session_key_len	= 16,
+		.session_salt_len	= 12,
+		.srtp_lifetime		= 1ULL << 48,
+		.srtcp_lifetime		= 1ULL << 31,
+		.kernel_cipher		= REC_AEAD_AES_GCM_128,
+		.kernel_hmac		= REH_NULL,
+		.srtp_auth_tag		= 0,
+		.srtcp_auth_tag		= 0,
+		.srtp_auth_key_len	= 0,
+		.srtcp_auth_key_len	= 0,
+		.encrypt_rtp		= aes_gcm_encrypt_rtp,
+		.decrypt_rtp		= aes_gcm_decrypt_rtp,
+		.encrypt_rtcp		= aes_gcm_encrypt_rtcp,
+		.decrypt_rtcp		= aes_gcm_decrypt_rtcp,
+		.session_key_init	= aes_gcm_session_key_init,
+		.session_key_cleanup	= evp_session_key_cleanup,
+		.aead_evp		= EVP_aes_128_gcm,
+	},
+	{
+		.name			= "AEAD_AES_256_GCM",
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		.dtls_name		= "SRTP_AEAD_AES_256_GCM",
+#endif
+		.master_key_len		= 32,
+		.master_salt_len	= 12,
+		.session_key_len	= 32,
+		.session_salt_len	= 12,
+		.srtp_lifetime		= 1ULL << 48,
+		.srtcp_lifetime		= 1ULL << 31,
+		.kernel_cipher		= REC_AEAD_AES_GCM_256,
+		.kernel_hmac		= REH_NULL,
+		.srtp_auth_tag		= 0,
+		.srtcp_auth_tag		= 0,
+		.srtp_auth_key_len	= 0,
+		.srtcp_auth_key_len	= 0,
+		.encrypt_rtp		= aes_gcm_encrypt_rtp,
+		.decrypt_rtp		= aes_gcm_decrypt_rtp,
+		.encrypt_rtcp		= aes_gcm_encrypt_rtcp,
+		.decrypt_rtcp		= aes_gcm_decrypt_rtcp,
+		.session_key_init	= aes_gcm_session_key_init,
+		.session_key_cleanup	= evp_session_key_cleanup,
+		.aead_evp		= EVP_aes_256_gcm,
+	},
 };
 
 const struct crypto_suite *crypto_suites = __crypto_suites;
@@ -307,54 +370,80 @@ const struct crypto_suite *crypto_find_suite(const str *s) {
 
 
 
+/* number of counter blocks handed to the cipher in one call. ECB over a run of
+ * blocks lets OpenSSL interleave several AES rounds in flight (AES-NI) instead
+ * of doing one block at a time */
+#define AES_CTR_CHUNK 64
+
+/* fills "ks" with "nblocks" consecutive counter blocks starting at "ivx" and
+ * advances "ivx" past them */
+static void aes_ctr_counters(unsigned char *ks, unsigned int nblocks, unsigned char *ivx) {
+	int i;
+
+	while (nblocks--) {
+		memcpy(ks, ivx, 16);
+		ks += 16;
+
+		for (i = 15; i >= 0; i--) {
+			ivx[i]++;
+			if (G_LIKELY(ivx[i]))
+				break;
+		}
+	}
+}
+
+static void aes_ctr_xor(unsigned char *out, const unsigned char *in, const unsigned char *ks,
+		unsigned int len)
+{
+	u_int64_t *qi = (void *) out;
+	const u_int64_t *pi = (const void *) in, *ki = (const void *) ks;
+
+	for (; len >= 8; len -= 8)
+		*qi++ = *pi++ ^ *ki++;
+
+	out = (void *) qi;
+	in = (const void *) pi;
+	ks = (const void *) ki;
+	while (len--)
+		*out++ = *in++ ^ *ks++;
+}
+
+static void aes_ctr_keystream(EVP_CIPHER_CTX *ecc, unsigned char *ks, unsigned int nblocks) {
+	int outlen;
+
+	EVP_EncryptUpdate(ecc, ks, &outlen, ks, nblocks * 16);
+	assert(outlen == nblocks * 16);
+}
+
 /* rfc 3711 section 4.1 and 4.1.1
  * "in" and "out" MAY point to the same buffer */
 static void aes_ctr(unsigned char *out, str *in, EVP_CIPHER_CTX *ecc, const unsigned char *iv) {
 	unsigned char ivx[16];
-	unsigned char key_block[16];
-	unsigned char *p, *q;
-	unsigned int left;
-	int outlen, i;
-	u_int64_t *pi, *qi, *ki;
+	unsigned char ks[AES_CTR_CHUNK * 16];
+	unsigned char *p;
+	unsigned int left, nblocks, len;
 
 	if (!ecc)
 		return;
 
 	memcpy(ivx, iv, 16);
-	pi = (void *) in->s;
-	qi = (void *) out;
-	ki = (void *) key_block;
+	p = (void *) in->s;
 	left = in->len;
 
 	while (left) {
-		EVP_EncryptUpdate(ecc, key_block, &outlen, ivx, 16);
-		assert(outlen == 16);
-
-		if (G_UNLIKELY(left < 16)) {
-			p = (void *) pi;
-			q = (void *) qi;
-			for (i = 0; i < 16; i++) {
-				*q++ = *p++ ^ key_block[i];
-				left--;
-				if (!left)
-					goto done;
-			}
-			abort();
-		}
-
-		*qi++ = *pi++ ^ ki[0];
-		*qi++ = *pi++ ^ ki[1];
-		left -= 16;
-
-		for (i = 15; i >= 0; i--) {
-			ivx[i]++;
-			if (G_LIKELY(ivx[i]))
-				break;
-		}
+		nblocks = (left + 15) / 16;
+		if (nblocks > AES_CTR_CHUNK)
+			nblocks = AES_CTR_CHUNK;
+		len = MIN(left, nblocks * 16);
+
+		aes_ctr_counters(ks, nblocks, ivx);
+		aes_ctr_keystream(ecc, ks, nblocks);
+		aes_ctr_xor(out, p, ks, len);
+
+		out += len;
+		p += len;
+		left -= len;
 	}
-
-done:
-	;
 }
 
 static void aes_ctr_no_ctx(unsigned char *out, str *in, const unsigned char *key, const EVP_CIPHER *ciph,
@@ -418,7 +507,9 @@ int crypto_gen_session_key(struct crypto_context *c, str *out, unsigned char lab
 	 * key_derivation_rate == 0 --> r == 0 */
 
 	key_id[0] = label;
-	memcpy(x, c->params.master_salt, 14);
+	// AEAD suites use a 96-bit master salt, padded with zeroes (rfc 7714 section 11)
+	ZERO(x);
+	memcpy(x, c->params.master_salt, c->params.crypto_suite->master_salt_len);
 	for (i = 13 - index_len; i < 14; i++)
 		x[i] = key_id[i - (13 - index_len)] ^ x[i];
 
@@ -461,8 +552,7 @@ int crypto_gen_session_key(struct crypto_context *c, str *out, unsigned char lab
  */
 
 /* rfc 3711 section 4.1.1 */
-static int aes_cm_encrypt(struct crypto_context *c, u_int32_t ssrc, str *s, u_int64_t idx) {
-	unsigned char iv[16];
+static void aes_cm_iv(unsigned char *iv, struct crypto_context *c, u_int32_t ssrc, u_int64_t idx) {
 	u_int32_t *ivi;
 	u_int32_t idxh, idxl;
 
@@ -476,12 +566,74 @@ static int aes_cm_encrypt(struct crypto_context *c, u_int32_t ssrc, str *s, u_in
 	ivi[1] ^= ssrc;
 	ivi[2] ^= idxh;
 	ivi[3] ^= idxl;
+}
+
+static int aes_cm_encrypt(struct crypto_context *c, u_int32_t ssrc, str *s, u_int64_t idx) {
+	unsigned char iv[16];
 
+	aes_cm_iv(iv, c, ssrc, idx);
 	aes_ctr((void *) s->s, s, c->session_key_ctx[0], iv);
 
 	return 0;
 }
 
+/* encrypts the keystream collected so far in one cipher call and applies it to
+ * the payloads it was built for, in order */
+static void aes_cm_batch_flush(EVP_CIPHER_CTX *ecc, unsigned char *ks, unsigned int nblocks,
+		str *s, unsigned int num)
+{
+	unsigned int i;
+
+	if (!nblocks)
+		return;
+
+	aes_ctr_keystream(ecc, ks, nblocks);
+
+	for (i = 0; i < num; i++) {
+		aes_ctr_xor((void *) s[i].s, (void *) s[i].s, ks, s[i].len);
+		ks += (s[i].len + 15) / 16 * 16;
+	}
+}
+
+/* counter blocks for consecutive packets are laid out back to back, so that a
+ * burst of short payloads still makes up a long run for the cipher */
+static int aes_cm_encrypt_rtp_batch(struct crypto_context *c, struct rtp_header **r, str *s,
+		const u_int64_t *idx, unsigned int num)
+{
+	unsigned char ks[AES_CTR_CHUNK * 16];
+	unsigned char iv[16];
+	unsigned int i, first = 0, nblocks = 0, pb;
+	EVP_CIPHER_CTX *ecc = c->session_key_ctx[0];
+
+	if (!ecc)
+		return 0;
+
+	for (i = 0; i < num; i++) {
+		pb = (s[i].len + 15) / 16;
+
+		if (nblocks + pb > AES_CTR_CHUNK) {
+			aes_cm_batch_flush(ecc, ks, nblocks, &s[first], i - first);
+			first = i;
+			nblocks = 0;
+		}
+
+		aes_cm_iv(iv, c, r[i]->ssrc, idx[i]);
+
+		if (G_UNLIKELY(pb > AES_CTR_CHUNK)) {
+			aes_ctr((void *) s[i].s, &s[i], ecc, iv);
+			first = i + 1;
+			continue;
+		}
+
+		aes_ctr_counters(ks + nblocks * 16, pb, iv);
+		nblocks += pb;
+	}
+
+	aes_cm_batch_flush(ecc, ks, nblocks, &s[first], num - first);
+
+	return 0;
+}
+
 /* rfc 3711 section 4.1 */
 static int aes_cm_encrypt_rtp(struct crypto_context *c, struct rtp_header *r, str *s, u_int64_t idx) {
 	return aes_cm_encrypt(c, r->ssrc, s, idx);
@@ -582,30 +734,53 @@ static int aes_f8_encrypt_rtcp(struct crypto_context *c, struct rtcp_packet *r,
 
 	return 0;
 }
-/* rfc 3711, sections 4.2 and 4.2.1 */
-static int hmac_sha1_rtp(struct crypto_context *c, char *out, str *in, u_int64_t index) {
-	unsigned char hmac[20];
-	u_int32_t roc;
-	HMAC_CTX *hc;
+
+/* the HMAC key schedule (inner and outer pads) is computed once per session key and
+ * kept in the context; each packet then only restarts from the precomputed state */
+static HMAC_CTX *hmac_sha1_ctx(struct crypto_context *c, int key_len) {
+	HMAC_CTX *hc = c->session_auth_ctx;
+
+	if (G_LIKELY(hc)) {
+		HMAC_Init_ex(hc, NULL, 0, NULL, NULL);
+		return hc;
+	}
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	hc = HMAC_CTX_new();
 #else
-	HMAC_CTX hc_s;
-	HMAC_CTX_init(&hc_s);
-	hc = &hc_s;
+	hc = g_slice_alloc(sizeof(HMAC_CTX));
+	HMAC_CTX_init(hc);
 #endif
+	HMAC_Init_ex(hc, c->session_auth_key, key_len, EVP_sha1(), NULL);
+	c->session_auth_ctx = hc;
+	return hc;
+}
 
-	HMAC_Init_ex(hc, c->session_auth_key, c->params.crypto_suite->srtp_auth_key_len, EVP_sha1(), NULL);
-	HMAC_Update(hc, (unsigned char *) in->s, in->len);
-	roc = htonl((index & 0xffffffff0000ULL) >> 16);
-	HMAC_Update(hc, (unsigned char *) &roc, sizeof(roc));
-	HMAC_Final(hc, hmac, NULL);
+static void hmac_sha1_ctx_cleanup(struct crypto_context *c) {
+	HMAC_CTX *hc = c->session_auth_ctx;
+
+	if (!hc)
+		return;
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
 	HMAC_CTX_free(hc);
 #else
 	HMAC_CTX_cleanup(hc);
+	g_slice_free1(sizeof(HMAC_CTX), hc);
 #endif
+	c->session_auth_ctx = NULL;
+}
+
+/* rfc 3711, sections 4.2 and 4.2.1 */
+static int hmac_sha1_rtp(struct crypto_context *c, char *out, str *in, u_int64_t index) {
+	unsigned char hmac[20];
+	u_int32_t roc;
+	HMAC_CTX *hc;
+
+	hc = hmac_sha1_ctx(c, c->params.crypto_suite->srtp_auth_key_len);
+	HMAC_Update(hc, (unsigned char *) in->s, in->len);
+	roc = htonl((index & 0xffffffff0000ULL) >> 16);
+	HMAC_Update(hc, (unsigned char *) &roc, sizeof(roc));
+	HMAC_Final(hc, hmac, NULL);
 
 	assert(sizeof(hmac) >= c->params.crypto_suite->srtp_auth_tag);
 	memcpy(out, hmac, c->params.crypto_suite->srtp_auth_tag);
@@ -616,9 +791,11 @@ static int hmac_sha1_rtp(struct crypto_context *c, char *out, str *in, u_int64_t
 /* rfc 3711, sections 4.2 and 4.2.1 */
 static int hmac_sha1_rtcp(struct crypto_context *c, char *out, str *in) {
 	unsigned char hmac[20];
+	HMAC_CTX *hc;
 
-	HMAC(EVP_sha1(), c->session_auth_key, c->params.crypto_suite->srtcp_auth_key_len,
-			(unsigned char *) in->s, in->len, hmac, NULL);
+	hc = hmac_sha1_ctx(c, c->params.crypto_suite->srtcp_auth_key_len);
+	HMAC_Update(hc, (unsigned char *) in->s, in->len);
+	HMAC_Final(hc, hmac, NULL);
 
 	assert(sizeof(hmac) >= c->params.crypto_suite->srtcp_auth_tag);
 	memcpy(out, hmac, c->params.crypto_suite->srtcp_auth_tag);
@@ -626,6 +803,137 @@ static int hmac_sha1_rtcp(struct crypto_context *c, char *out, str *in) {
 	return 0;
 }
 
+/* rfc 7714 section 8.1 */
+static void aes_gcm_rtp_iv(unsigned char *iv, struct crypto_context *c, u_int32_t ssrc, u_int64_t idx) {
+	u_int32_t roc = htonl((idx & 0xffffffff0000ULL) >> 16);
+	u_int16_t seq = htons(idx & 0xffffULL);
+	int i;
+
+	iv[0] = iv[1] = 0;
+	memcpy(&iv[2], &ssrc, 4);
+	memcpy(&iv[6], &roc, 4);
+	memcpy(&iv[10], &seq, 2);
+	for (i = 0; i < 12; i++)
+		iv[i] ^= c->session_salt[i];
+}
+
+/* rfc 7714 section 9.1 */
+static void aes_gcm_rtcp_iv(unsigned char *iv, struct crypto_context *c, u_int32_t ssrc, u_int64_t idx) {
+	u_int32_t i32 = htonl(idx & 0x7fffffffULL);
+	int i;
+
+	iv[0] = iv[1] = 0;
+	memcpy(&iv[2], &ssrc, 4);
+	iv[6] = iv[7] = 0;
+	memcpy(&iv[8], &i32, 4);
+	for (i = 0; i < 12; i++)
+		iv[i] ^= c->session_salt[i];
+}
+
+/* encrypts s in place and appends the 16-byte tag, extending s->len.
+ * aad covers everything from `aad` up to the payload, plus the optional `aad2`. if `encrypt` is
+ * false, the payload is left as it is and becomes part of the aad, so that it's still
+ * authenticated (rfc 7714 section 9.3) */
+static int aes_gcm_encrypt(struct crypto_context *c, const unsigned char *iv, void *aad, str *s,
+		const void *aad2, int aad2_len, int encrypt)
+{
+	EVP_CIPHER_CTX *ctx = c->session_key_ctx[0];
+	int len, ciphertext_len;
+	unsigned char *aad_end = (unsigned char *) s->s;
+
+	if (!ctx)
+		return -1;
+	if (!encrypt)
+		aad_end += s->len;
+
+	EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+	EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_end - (unsigned char *) aad);
+	if (aad2)
+		EVP_EncryptUpdate(ctx, NULL, &len, aad2, aad2_len);
+	if (encrypt) {
+		EVP_EncryptUpdate(ctx, (unsigned char *) s->s, &len, (unsigned char *) s->s, s->len);
+		ciphertext_len = len;
+	}
+	else
+		ciphertext_len = s->len;
+	if (!EVP_EncryptFinal_ex(ctx, (unsigned char *) s->s + ciphertext_len, &len))
+		return -1;
+	ciphertext_len += len;
+	/* RTP_BUFFER_TAIL_ROOM guarantees enough room */
+	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, s->s + ciphertext_len);
+	s->len = ciphertext_len + 16;
+
+	return 0;
+}
+
+/* verifies and strips the tag, decrypts in place unless `decrypt` is false. the tag is
+ * always verified, over the same aad as above */
+static int aes_gcm_decrypt(struct crypto_context *c, const unsigned char *iv, void *aad, str *s,
+		const void *aad2, int aad2_len, int decrypt)
+{
+	EVP_CIPHER_CTX *ctx = c->session_key_ctx[1];
+	int len, plaintext_len;
+	unsigned char *aad_end = (unsigned char *) s->s;
+
+	if (!ctx)
+		return -1;
+	if (s->len < 16)
+		return -1;
+	if (!decrypt)
+		aad_end += s->len - 16;
+
+	EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, iv);
+	EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_end - (unsigned char *) aad);
+	if (aad2)
+		EVP_DecryptUpdate(ctx, NULL, &len, aad2, aad2_len);
+	if (decrypt) {
+		EVP_DecryptUpdate(ctx, (unsigned char *) s->s, &len, (unsigned char *) s->s, s->len - 16);
+		plaintext_len = len;
+	}
+	else
+		plaintext_len = s->len - 16;
+	EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, s->s + s->len - 16);
+	if (!EVP_DecryptFinal_ex(ctx, (unsigned char *) s->s + plaintext_len, &len))
+		return -1;
+	s->len = plaintext_len + len;
+
+	return 0;
+}
+
+/* unencrypted SRTP is still authenticated, with the whole packet as aad */
+static int aes_gcm_encrypt_rtp(struct crypto_context *c, struct rtp_header *r, str *s, u_int64_t idx) {
+	unsigned char iv[12];
+
+	aes_gcm_rtp_iv(iv, c, r->ssrc, idx);
+	return aes_gcm_encrypt(c, iv, r, s, NULL, 0, !c->params.session_params.unencrypted_srtp);
+}
+
+static int aes_gcm_decrypt_rtp(struct crypto_context *c, struct rtp_header *r, str *s, u_int64_t idx) {
+	unsigned char iv[12];
+
+	aes_gcm_rtp_iv(iv, c, r->ssrc, idx);
+	return aes_gcm_decrypt(c, iv, r, s, NULL, 0, !c->params.session_params.unencrypted_srtp);
+}
+
+/* the E flag and SRTCP index are part of the AAD, rfc 7714 section 9.2. unlike the other
+ * suites, these get the index together with the E flag in the top bit, and are called for
+ * unencrypted packets too */
+static int aes_gcm_encrypt_rtcp(struct crypto_context *c, struct rtcp_packet *r, str *s, u_int64_t idx) {
+	unsigned char iv[12];
+	u_int32_t e_idx = htonl(idx & 0xffffffffULL);
+
+	aes_gcm_rtcp_iv(iv, c, r->ssrc, idx);
+	return aes_gcm_encrypt(c, iv, r, s, &e_idx, sizeof(e_idx), (idx & 0x80000000ULL) ? 1 : 0);
+}
+
+static int aes_gcm_decrypt_rtcp(struct crypto_context *c, struct rtcp_packet *r, str *s, u_int64_t idx) {
+	unsigned char iv[12];
+	u_int32_t e_idx = htonl(idx & 0xffffffffULL);
+
+	aes_gcm_rtcp_iv(iv, c, r->ssrc, idx);
+	return aes_gcm_decrypt(c, iv, r, s, &e_idx, sizeof(e_idx), (idx & 0x80000000ULL) ? 1 : 0);
+}
+
 static int aes_cm_session_key_init(struct crypto_context *c) {
 	evp_session_key_cleanup(c);
 
@@ -671,6 +979,26 @@ static int aes_f8_session_key_init(struct crypto_context *c) {
 	return 0;
 }
 
+// one context each for encryption and decryption, with the key schedule set up once
+static int aes_gcm_session_key_init(struct crypto_context *c) {
+	evp_session_key_cleanup(c);
+
+	for (int i = 0; i < 2; i++) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		c->session_key_ctx[i] = EVP_CIPHER_CTX_new();
+#else
+		c->session_key_ctx[i] = g_slice_alloc(sizeof(EVP_CIPHER_CTX));
+		EVP_CIPHER_CTX_init(c->session_key_ctx[i]);
+#endif
+	}
+	EVP_EncryptInit_ex(c->session_key_ctx[0], c->params.crypto_suite->aead_evp(), NULL,
+			(unsigned char *) c->session_key, NULL);
+	EVP_DecryptInit_ex(c->session_key_ctx[1], c->params.crypto_suite->aead_evp(), NULL,
+			(unsigned char *) c->session_key, NULL);
+
+	return 0;
+}
+
 static int evp_session_key_cleanup(struct crypto_context *c) {
 	unsigned char block[16];
 	int len, i;
@@ -689,6 +1017,8 @@ static int evp_session_key_cleanup(struct crypto_context *c) {
 		c->session_key_ctx[i] = NULL;
 	}
 
+	hmac_sha1_ctx_cleanup(c);
+
 	return 0;
 }
 
@@ -7,6 +7,7 @@
 #include <openssl/x509.h>
 #include <openssl/bn.h>
 #include <openssl/rsa.h>
+#include <openssl/ec.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <openssl/err.h>
@@ -19,6 +20,7 @@
 #include "call.h"
 #include "poller.h"
 #include "ice.h"
+#include "statistics.h"
 
 
 #if OPENSSL_VERSION_NUMBER >= 0x10002000L
@@ -39,6 +41,7 @@
 
 
 #define CERT_EXPIRY_TIME (60*60*24*30) /* 30 days */
+#define CERT_PREGEN_TIME (60*60) /* generate the next cert this long before it's needed */
 
 struct dtls_connection *dtls_ptr(struct stream_fd *sfd) {
 	if (!sfd)
@@ -101,6 +104,17 @@ const int num_hash_funcs = G_N_ELEMENTS(hash_funcs);
 static struct dtls_cert *__dtls_cert;
 static rwlock_t __dtls_cert_lock;
 
+// successor of the current cert, generated by a background thread
+static struct dtls_cert *__dtls_next_cert;
+static mutex_t __dtls_next_cert_lock = MUTEX_STATIC_INIT;
+static int __dtls_next_cert_busy;
+
+// the first cert is generated in the background during startup
+static mutex_t __dtls_first_cert_lock = MUTEX_STATIC_INIT;
+static cond_t __dtls_first_cert_cond = COND_STATIC_INIT;
+static volatile int __dtls_first_cert_done;
+static int __dtls_next_cert_failed;
+
 
 
 const struct dtls_hash_func *dtls_find_hash_func(const str *s) {
@@ -176,13 +190,14 @@ static void dump_cert(struct dtls_cert *cert) {
 	buf_dump_free(buf, len);
 }
 
-static int cert_init(void) {
+static struct dtls_cert *cert_new(void) {
 	X509 *x509 = NULL;
 	EVP_PKEY *pkey = NULL;
 	BIGNUM *exponent = NULL, *serial_number = NULL;
 	RSA *rsa = NULL;
+	EC_KEY *ec_key = NULL;
 	ASN1_INTEGER *asn1_serial_number;
-	X509_NAME *name;
+	X509_NAME *name = NULL;
 	struct dtls_cert *new_cert;
 
 	ilog(LOG_INFO, "Generating new DTLS certificate");
@@ -190,24 +205,44 @@ static int cert_init(void) {
 	/* objects */
 
 	pkey = EVP_PKEY_new();
-	exponent = BN_new();
-	rsa = RSA_new();
 	serial_number = BN_new();
 	name = X509_NAME_new();
 	x509 = X509_new();
-	if (!exponent || !pkey || !rsa || !serial_number || !name || !x509)
+	if (!pkey || !serial_number || !name || !x509)
 		goto err;
 
 	/* key */
 
-	if (!BN_set_word(exponent, 0x10001))
-		goto err;
+	if (rtpe_config.dtls_cert_cipher == DCC_EC_PRIME256v1) {
+		ec_key = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+		if (!ec_key)
+			goto err;
 
-	if (!RSA_generate_key_ex(rsa, rtpe_config.dtls_rsa_key_size, exponent, NULL))
-		goto err;
+		EC_KEY_set_asn1_flag(ec_key, OPENSSL_EC_NAMED_CURVE);
 
-	if (!EVP_PKEY_assign_RSA(pkey, rsa))
-		goto err;
+		if (!EC_KEY_generate_key(ec_key))
+			goto err;
+
+		if (!EVP_PKEY_assign_EC_KEY(pkey, ec_key))
+			goto err;
+		ec_key = NULL; /* owned by pkey now */
+	}
+	else {
+		exponent = BN_new();
+		rsa = RSA_new();
+		if (!exponent || !rsa)
+			goto err;
+
+		if (!BN_set_word(exponent, 0x10001))
+			goto err;
+
+		if (!RSA_generate_key_ex(rsa, rtpe_config.dtls_rsa_key_size, exponent, NULL))
+			goto err;
+
+		if (!EVP_PKEY_assign_RSA(pkey, rsa))
+			goto err;
+		rsa = NULL; /* owned by pkey now */
+	}
 
 	/* x509 cert */
 
@@ -270,26 +305,18 @@ static int cert_init(void) {
 	new_cert->x509 = x509;
 	new_cert->pkey = pkey;
 	new_cert->expires = time(NULL) + CERT_EXPIRY_TIME;
+	random_string(new_cert->ticket_keys, sizeof(new_cert->ticket_keys));
 
 	dump_cert(new_cert);
 
-	/* swap out certs */
-
-	rwlock_lock_w(&__dtls_cert_lock);
-
-	if (__dtls_cert)
-		obj_put(__dtls_cert);
-	__dtls_cert = new_cert;
-
-	rwlock_unlock_w(&__dtls_cert_lock);
-
 	/* cleanup */
 
-	BN_free(exponent);
+	if (exponent)
+		BN_free(exponent);
 	BN_free(serial_number);
 	X509_NAME_free(name);
 
-	return 0;
+	return new_cert;
 
 err:
 	ilog(LOG_ERROR, "Failed to generate DTLS certificate");
@@ -300,21 +327,71 @@ err:
 		BN_free(exponent);
 	if (rsa)
 		RSA_free(rsa);
+	if (ec_key)
+		EC_KEY_free(ec_key);
 	if (x509)
 		X509_free(x509);
 	if (serial_number)
 		BN_free(serial_number);
+	if (name)
+		X509_NAME_free(name);
 
-	return -1;
+	return NULL;
+}
+
+static void cert_install(struct dtls_cert *new_cert) {
+	/* swap out certs */
+
+	rwlock_lock_w(&__dtls_cert_lock);
+
+	if (__dtls_cert)
+		obj_put(__dtls_cert);
+	__dtls_cert = new_cert;
+
+	rwlock_unlock_w(&__dtls_cert_lock);
+}
+
+static int cert_init(void) {
+	struct dtls_cert *new_cert = cert_new();
+	if (!new_cert)
+		return -1;
+	cert_install(new_cert);
+	return 0;
 }
 
+static void cert_first_thread(void *p) {
+	if (cert_init())
+		ilog(LOG_ERR, "Failed to generate DTLS certificate, DTLS-SRTP will be unavailable");
+	else
+		ilog(LOG_DEBUG, "DTLS certificate generated");
+
+	mutex_lock(&__dtls_first_cert_lock);
+	g_atomic_int_set(&__dtls_first_cert_done, 1);
+	cond_broadcast(&__dtls_first_cert_cond);
+	mutex_unlock(&__dtls_first_cert_lock);
+}
+
+void dtls_cert_init(void) {
+	thread_create_detach(cert_first_thread, NULL);
+}
+
+static void cert_pregen_thread(void *p) {
+	struct dtls_cert *new_cert = cert_new();
+
+	mutex_lock(&__dtls_next_cert_lock);
+	__dtls_next_cert = new_cert;
+	if (!new_cert)
+		__dtls_next_cert_failed = 1; // don't retry, generate it directly once it's due
+	__dtls_next_cert_busy = 0;
+	mutex_unlock(&__dtls_next_cert_lock);
+}
+
+
 int dtls_init() {
 	int i;
 	char *p;
 
 	rwlock_init(&__dtls_cert_lock);
-	if (cert_init())
-		return -1;
 
 	p = ciphers_str;
 	for (i = 0; i < num_crypto_suites; i++) {
@@ -333,15 +410,45 @@ int dtls_init() {
 }
 
 static void __dtls_timer(void *p) {
-	struct dtls_cert *c;
+	struct dtls_cert *c, *next;
 	long int left;
 
+	if (!g_atomic_int_get(&__dtls_first_cert_done))
+		return;
+
 	c = dtls_cert();
+	if (!c) {
+		// first generation failed, keep trying
+		cert_init();
+		return;
+	}
 	left = c->expires - rtpe_now.tv_sec;
-	if (left > CERT_EXPIRY_TIME/2)
+	if (left > CERT_EXPIRY_TIME/2 + CERT_PREGEN_TIME)
+		goto out;
+
+	mutex_lock(&__dtls_next_cert_lock);
+	if (left > CERT_EXPIRY_TIME/2) {
+		if (!__dtls_next_cert && !__dtls_next_cert_busy && !__dtls_next_cert_failed) {
+			__dtls_next_cert_busy = 1;
+			thread_create_detach(cert_pregen_thread, NULL);
+		}
+		mutex_unlock(&__dtls_next_cert_lock);
+		goto out;
+	}
+	if (__dtls_next_cert_busy) {
+		// still being generated, pick it up next time
+		mutex_unlock(&__dtls_next_cert_lock);
 		goto out;
+	}
+	next = __dtls_next_cert;
+	__dtls_next_cert = NULL;
+	__dtls_next_cert_failed = 0;
+	mutex_unlock(&__dtls_next_cert_lock);
 
-	cert_init();
+	if (next)
+		cert_install(next);
+	else
+		cert_init();
 
 out:
 	obj_put(c);
@@ -388,8 +495,15 @@ static unsigned int sha_512_func(unsigned char *o, X509 *x) {
 struct dtls_cert *dtls_cert() {
 	struct dtls_cert *ret;
 
+	if (G_UNLIKELY(!g_atomic_int_get(&__dtls_first_cert_done))) {
+		mutex_lock(&__dtls_first_cert_lock);
+		while (!__dtls_first_cert_done)
+			cond_wait(&__dtls_first_cert_cond, &__dtls_first_cert_lock);
+		mutex_unlock(&__dtls_first_cert_lock);
+	}
+
 	rwlock_lock_r(&__dtls_cert_lock);
-	ret = obj_get(__dtls_cert);
+	ret = __dtls_cert ? obj_get(__dtls_cert) : NULL;
 	rwlock_unlock_r(&__dtls_cert_lock);
 
 	return ret;
@@ -405,6 +519,12 @@ void dtls_cert_free(void) {
 
 	rwlock_unlock_w(&__dtls_cert_lock);
 
+	mutex_lock(&__dtls_next_cert_lock);
+	if (__dtls_next_cert)
+		obj_put(__dtls_next_cert);
+	__dtls_next_cert = NULL;
+	mutex_unlock(&__dtls_next_cert_lock);
+
 	return ;
 }
 
@@ -517,6 +637,9 @@ int dtls_connection_init(struct dtls_connection *d, struct packet_stream *ps, in
 		dtls_connection_cleanup(d);
 	}
 
+	if (!cert)
+		goto error;
+
 	d->ptr = ps;
 
 	ilog(LOG_DEBUG, "Creating %s DTLS connection context", active ? "active" : "passive");
@@ -539,6 +662,13 @@ int dtls_connection_init(struct dtls_connection *d, struct packet_stream *ps, in
 	SSL_CTX_set_verify_depth(d->ssl_ctx, 4);
 	SSL_CTX_set_cipher_list(d->ssl_ctx, rtpe_config.dtls_ciphers);
 
+	if (!active) {
+		// stateless session tickets. every connection has its own context, so the ticket keys
+		// are kept with the certificate to make tickets valid across connections
+		SSL_CTX_set_session_id_context(d->ssl_ctx, (const unsigned char *) "rtpengine", 9);
+		SSL_CTX_set_tlsext_ticket_keys(d->ssl_ctx, cert->ticket_keys, sizeof(cert->ticket_keys));
+	}
+
 	if (SSL_CTX_set_tlsext_use_srtp(d->ssl_ctx, ciphers_str))
 		goto error;
 	if (SSL_CTX_set_read_ahead(d->ssl_ctx, 1))
@@ -678,31 +808,43 @@ error:
 	return -1;
 }
 
+// the peer certificate isn't verified again during an abbreviated handshake, so do it here
+static int dtls_verify_resumed(struct packet_stream *ps, struct dtls_connection *d) {
+	struct call_media *media = ps->media;
+
+	X509 *cert = SSL_get_peer_certificate(d->ssl);
+	if (!cert)
+		return -1;
+	if (ps->dtls_cert)
+		X509_free(ps->dtls_cert);
+	ps->dtls_cert = cert;
+
+	if (!media->fingerprint.hash_func || !media->fingerprint.digest_len)
+		return 0; /* delay verification */
+
+	return dtls_verify_cert(ps);
+}
+
+static void dtls_handshake_done(struct dtls_connection *d) {
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	latency_histogram_add(&rtpe_dtls_handshake_latency, MAX(timeval_diff(&now, &d->hs_start), 0));
+
+	if (SSL_session_reused(d->ssl)) {
+		ilog(LOG_DEBUG, "DTLS session resumed");
+		TOTALSTATS_INC(total_dtls_resumed);
+	}
+	else
+		TOTALSTATS_INC(total_dtls_handshakes);
+}
+
 /* called with call locked in W or R with ps->in_lock held */
-int dtls(struct stream_fd *sfd, const str *s, const endpoint_t *fsin) {
+static int __dtls(struct stream_fd *sfd, struct dtls_connection *d, const str *s, const endpoint_t *fsin) {
 	struct packet_stream *ps = sfd->stream;
 	int ret;
 	unsigned char buf[0x10000];
 
-	if (!ps)
-		return 0;
-	if (!MEDIA_ISSET(ps->media, DTLS))
-		return 0;
-	struct dtls_connection *d = dtls_ptr(sfd);
-	if (!d)
-		return 0;
-
-	if (s)
-		__DBG("dtls packet input: len %u %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-			s->len,
-			(unsigned char) s->s[0], (unsigned char) s->s[1], (unsigned char) s->s[2], (unsigned char) s->s[3],
-			(unsigned char) s->s[4], (unsigned char) s->s[5], (unsigned char) s->s[6], (unsigned char) s->s[7],
-			(unsigned char) s->s[8], (unsigned char) s->s[9], (unsigned char) s->s[10], (unsigned char) s->s[11],
-			(unsigned char) s->s[12], (unsigned char) s->s[13], (unsigned char) s->s[14], (unsigned char) s->s[15]);
-
-	if (!d->init || !d->ssl)
-		return -1;
-
 	if (s) {
 		ilog(LOG_DEBUG, "Processing incoming DTLS packet");
 		BIO_write(d->r_bio, s->s, s->len);
@@ -710,7 +852,12 @@ int dtls(struct stream_fd *sfd, const str *s, const endpoint_t *fsin) {
 		MEDIA_CLEAR(ps->media, SDES);
 	}
 
+	if (!d->connected && !d->hs_start.tv_sec)
+		gettimeofday(&d->hs_start, NULL);
+
 	ret = try_connect(d);
+	if (ret == 1 && SSL_session_reused(d->ssl) && dtls_verify_resumed(ps, d))
+		ret = -1;
 	if (ret == -1) {
 		ilog(LOG_ERROR, "DTLS error on local port %u", sfd->socket.local.port);
 		/* fatal error */
@@ -719,6 +866,8 @@ int dtls(struct stream_fd *sfd, const str *s, const endpoint_t *fsin) {
 	}
 	else if (ret == 1) {
 		/* connected! */
+		dtls_handshake_done(d);
+
 		mutex_lock(&ps->out_lock); // nested lock!
 		if (dtls_setup_crypto(ps, d))
 			/* XXX ?? */ ;
@@ -770,6 +919,152 @@ int dtls(struct stream_fd *sfd, const str *s, const endpoint_t *fsin) {
 	return 0;
 }
 
+// handshake packets waiting for a DTLS worker thread. packets are queued per stream_fd and
+// the worker queue holds each stream_fd at most once, so that only one worker at a time
+// handles a given connection and its packets are processed in the order they were received
+struct dtls_job {
+	struct call *call;
+	endpoint_t fsin;
+	str s;
+	char buf[0];
+};
+
+// per connection. a peer retransmitting faster than the workers can keep up with
+// doesn't need more than that
+#define DTLS_JOB_QUEUE_MAX 16
+
+static mutex_t dtls_pool_lock = MUTEX_STATIC_INIT;
+static cond_t dtls_pool_cond = COND_STATIC_INIT;
+static GQueue dtls_pool_queue = G_QUEUE_INIT; // of stream_fd, each holding a reference
+static unsigned int dtls_pool_jobs;
+
+static void __dtls_job_push(struct stream_fd *sfd, const str *s, const endpoint_t *fsin) {
+	struct dtls_job *job = malloc(sizeof(*job) + s->len);
+	if (!job) {
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to allocate DTLS handshake job, discarding packet");
+		return;
+	}
+	job->fsin = *fsin;
+	memcpy(job->buf, s->s, s->len);
+	str_init_len(&job->s, job->buf, s->len);
+
+	mutex_lock(&dtls_pool_lock);
+
+	if (sfd->dtls_jobs.length >= DTLS_JOB_QUEUE_MAX) {
+		mutex_unlock(&dtls_pool_lock);
+		free(job);
+		ilog(LOG_WARNING | LOG_FLAG_LIMIT, "Too many DTLS handshake packets queued on "
+				"local port %u, discarding packet", sfd->socket.local.port);
+		return;
+	}
+
+	job->call = obj_get(sfd->call);
+	g_queue_push_tail(&sfd->dtls_jobs, job);
+	atomic64_set(&rtpe_stats.dtls_queue, ++dtls_pool_jobs);
+
+	if (!sfd->dtls_job_sched) {
+		sfd->dtls_job_sched = 1;
+		g_queue_push_tail(&dtls_pool_queue, obj_get(sfd));
+		cond_signal(&dtls_pool_cond);
+	}
+
+	mutex_unlock(&dtls_pool_lock);
+}
+
+static void __dtls_job_run(struct stream_fd *sfd, struct dtls_job *job) {
+	struct call *call = job->call;
+
+	log_info_stream_fd(sfd);
+
+	rwlock_lock_r(&call->master_lock);
+
+	// the stream may have been switched to a different transport in the meantime
+	struct packet_stream *ps = sfd->stream;
+	if (ps && ps->media && MEDIA_ISSET(ps->media, DTLS)) {
+		mutex_lock(&ps->in_lock);
+		struct dtls_connection *d = dtls_ptr(sfd);
+		if (d && d->init && d->ssl)
+			__dtls(sfd, d, &job->s, &job->fsin);
+		mutex_unlock(&ps->in_lock);
+	}
+
+	rwlock_unlock_r(&call->master_lock);
+
+	obj_put(call);
+	free(job);
+	log_info_clear();
+}
+
+// runs one DTLS handshake worker thread
+void dtls_worker_loop(void *p) {
+	mutex_lock(&dtls_pool_lock);
+
+	while (!rtpe_shutdown) {
+		gettimeofday(&rtpe_now, NULL);
+
+		struct stream_fd *sfd = g_queue_pop_head(&dtls_pool_queue);
+		if (!sfd) {
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&dtls_pool_cond, &dtls_pool_lock, &tv);
+			continue;
+		}
+		struct dtls_job *job = g_queue_pop_head(&sfd->dtls_jobs);
+		atomic64_set(&rtpe_stats.dtls_queue, --dtls_pool_jobs);
+		mutex_unlock(&dtls_pool_lock);
+
+		// the stream_fd is no longer in the worker queue, but is still marked as
+		// scheduled, so no other worker can pick up its next packet in the meantime
+		__dtls_job_run(sfd, job);
+
+		mutex_lock(&dtls_pool_lock);
+		// one packet at a time, so that a busy connection doesn't starve others
+		if (sfd->dtls_jobs.length) {
+			g_queue_push_tail(&dtls_pool_queue, sfd);
+			continue;
+		}
+		sfd->dtls_job_sched = 0;
+		mutex_unlock(&dtls_pool_lock);
+		obj_put(sfd);
+		mutex_lock(&dtls_pool_lock);
+	}
+
+	mutex_unlock(&dtls_pool_lock);
+}
+
+/* called with call locked in W or R with ps->in_lock held */
+int dtls(struct stream_fd *sfd, const str *s, const endpoint_t *fsin) {
+	struct packet_stream *ps = sfd->stream;
+
+	if (!ps)
+		return 0;
+	if (!MEDIA_ISSET(ps->media, DTLS))
+		return 0;
+	struct dtls_connection *d = dtls_ptr(sfd);
+	if (!d)
+		return 0;
+
+	if (s)
+		__DBG("dtls packet input: len %u %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
+			s->len,
+			(unsigned char) s->s[0], (unsigned char) s->s[1], (unsigned char) s->s[2], (unsigned char) s->s[3],
+			(unsigned char) s->s[4], (unsigned char) s->s[5], (unsigned char) s->s[6], (unsigned char) s->s[7],
+			(unsigned char) s->s[8], (unsigned char) s->s[9], (unsigned char) s->s[10], (unsigned char) s->s[11],
+			(unsigned char) s->s[12], (unsigned char) s->s[13], (unsigned char) s->s[14], (unsigned char) s->s[15]);
+
+	if (!d->init || !d->ssl)
+		return -1;
+
+	// handshakes are CPU heavy and are moved off the media threads if so configured.
+	// everything after that, i.e. alerts and renegotiation, is handled inline
+	if (s && fsin && !d->connected && rtpe_config.dtls_threads > 0) {
+		__dtls_job_push(sfd, s, fsin);
+		return 0;
+	}
+
+	return __dtls(sfd, d, s, fsin);
+}
+
 /* call must be locked */
 void dtls_shutdown(struct packet_stream *ps) {
 
@@ -8,11 +8,38 @@
 #include "rtplib.h"
 #include "codec.h"
 #include "ssrc.h"
+#include "homer.h"
+#include "redis.h"
 
 
 
+// DTMF end events are logged from a background thread. The media path only fills in a
+// record in a fixed ring, taking a reference to the call, and dtmf_log_loop() does the
+// JSON formatting and all the output in batches. Events are dropped if the ring is full.
+#define DTMF_LOG_RING		1024 // power of two
+#define DTMF_LOG_BATCH		64
+#define DTMF_LOG_INTERVAL	100000 // us, how long events can sit in the ring
+
+struct dtmf_log_record {
+	struct call *call; // referenced
+	struct call_monologue *ml;
+	endpoint_t src;
+	endpoint_t dst;
+	struct timeval tv;
+	unsigned int event;
+	unsigned int duration; // ms
+	unsigned int volume;
+};
+
 static socket_t dtmf_log_sock;
 
+static mutex_t dtmf_log_lock = MUTEX_STATIC_INIT;
+static cond_t dtmf_log_cond = COND_STATIC_INIT;
+static struct dtmf_log_record dtmf_log_ring[DTMF_LOG_RING]; // LOCK: dtmf_log_lock
+static unsigned int dtmf_log_head, dtmf_log_tail; // LOCK: dtmf_log_lock
+static int dtmf_log_thread_running; // LOCK: dtmf_log_lock
+static atomic64 dtmf_log_dropped;
+
 void dtmf_init(void) {
 	if (rtpe_config.dtmf_udp_ep.port) {
 		if (connect_socket(&dtmf_log_sock, SOCK_DGRAM, &rtpe_config.dtmf_udp_ep))
@@ -21,25 +48,18 @@ void dtmf_init(void) {
 }
 
 
-static GString *dtmf_json_print(struct media_packet *mp,
-		struct telephone_event_payload *dtmf, int clockrate)
-{
-	if (!dtmf->end)
-		return NULL;
-
+// call->master_lock must be held
+static GString *dtmf_json_print(const struct dtmf_log_record *r) {
 	GString *buf = g_string_new("");
 
-	if (!clockrate)
-		clockrate = 8000;
-
 	g_string_append_printf(buf, "{"
 			"\"callid\":\"" STR_FORMAT "\","
 			"\"source_tag\":\"" STR_FORMAT "\","
 			"\"tags\":[",
-			STR_FMT(&mp->call->callid),
-			STR_FMT(&mp->media->monologue->tag));
+			STR_FMT(&r->call->callid),
+			STR_FMT(&r->ml->tag));
 
-	GList *tag_values = g_hash_table_get_values(mp->call->tags);
+	GList *tag_values = str_map_values(&r->call->tags);
 	int i = 0;
 	for (GList *tag_it = tag_values; tag_it; tag_it = tag_it->next) {
 		struct call_monologue *ml = tag_it->data;
@@ -54,17 +74,141 @@ static GString *dtmf_json_print(struct media_packet *mp,
 	g_string_append_printf(buf, "],"
 			"\"type\":\"DTMF\",\"timestamp\":%lu,\"source_ip\":\"%s\","
 			"\"event\":%u,\"duration\":%u,\"volume\":%u}",
-			(unsigned long) rtpe_now.tv_sec,
-			sockaddr_print_buf(&mp->fsin.address),
-			(unsigned int) dtmf->event,
-			(ntohs(dtmf->duration) * (1000000 / clockrate)) / 1000,
-			(unsigned int) dtmf->volume);
+			(unsigned long) r->tv.tv_sec,
+			sockaddr_print_buf(&r->src.address),
+			r->event,
+			r->duration,
+			r->volume);
 
 	return buf;
 }
 
+// the records' call references are released. `locked` if the calls' master locks are held
+static void dtmf_log_output(struct dtmf_log_record *recs, unsigned int num, int locked) {
+	GString *bufs[DTMF_LOG_BATCH];
+	struct mmsghdr mm[DTMF_LOG_BATCH];
+	struct iovec iov[DTMF_LOG_BATCH];
+	str msgs[DTMF_LOG_BATCH];
+
+	for (unsigned int i = 0; i < num; i++) {
+		struct dtmf_log_record *r = &recs[i];
+
+		if (!locked)
+			rwlock_lock_r(&r->call->master_lock);
+		bufs[i] = dtmf_json_print(r);
+		if (!locked)
+			rwlock_unlock_r(&r->call->master_lock);
+
+		if (_log_facility_dtmf)
+			dtmflog(bufs[i]);
+		if (rtpe_config.dtmf_log_homer)
+			homer_send(g_string_new_len(bufs[i]->str, bufs[i]->len), &r->call->callid,
+					&r->src, &r->dst, &r->tv);
+
+		iov[i] = (struct iovec) { .iov_base = bufs[i]->str, .iov_len = bufs[i]->len };
+		mm[i] = (struct mmsghdr) { .msg_hdr = { .msg_iov = &iov[i], .msg_iovlen = 1 } };
+		str_init_len(&msgs[i], bufs[i]->str, bufs[i]->len);
+	}
+
+	if (dtmf_log_sock.family) {
+		for (unsigned int sent = 0; sent < num; ) {
+			int ret = sendmmsg(dtmf_log_sock.fd, mm + sent, num - sent, 0);
+			if (ret <= 0) {
+				ilog(LOG_WARN | LOG_FLAG_LIMIT, "Failed to send DTMF log message: %s",
+						strerror(errno));
+				break;
+			}
+			sent += ret;
+		}
+	}
+	if (rtpe_config.dtmf_log_redis)
+		redis_publish(rtpe_redis_write, rtpe_config.dtmf_log_redis, msgs, num);
+
+	for (unsigned int i = 0; i < num; i++) {
+		g_string_free(bufs[i], TRUE);
+		obj_put(recs[i].call);
+	}
+}
+
+void dtmf_log_loop(void *p) {
+	struct dtmf_log_record batch[DTMF_LOG_BATCH];
+
+	mutex_lock(&dtmf_log_lock);
+	dtmf_log_thread_running = 1;
+
+	// keep going until the ring is drained, so that events from just before the
+	// shutdown aren't lost
+	while (!rtpe_shutdown || dtmf_log_head != dtmf_log_tail) {
+		unsigned int num = 0;
+		while (num < DTMF_LOG_BATCH && dtmf_log_tail != dtmf_log_head)
+			batch[num++] = dtmf_log_ring[dtmf_log_tail++ % DTMF_LOG_RING];
+
+		if (!num) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, DTMF_LOG_INTERVAL);
+			cond_timedwait(&dtmf_log_cond, &dtmf_log_lock, &tv);
+			continue;
+		}
+		mutex_unlock(&dtmf_log_lock);
+
+		dtmf_log_output(batch, num, 0);
+
+		mutex_lock(&dtmf_log_lock);
+	}
+
+	// from now on events are output directly
+	dtmf_log_thread_running = 0;
+
+	mutex_unlock(&dtmf_log_lock);
+}
+
+uint64_t dtmf_log_drops(void) {
+	return atomic64_get(&dtmf_log_dropped);
+}
+
+// call->master_lock is held. nothing is allocated while the logging thread runs
+static void dtmf_log_event(struct media_packet *mp, struct telephone_event_payload *dtmf, int clockrate) {
+	if (!clockrate)
+		clockrate = 8000;
+
+	struct dtmf_log_record r = {
+		.ml = mp->media->monologue,
+		.src = mp->fsin,
+		.tv = rtpe_now,
+		.event = dtmf->event,
+		.duration = (ntohs(dtmf->duration) * (1000000 / clockrate)) / 1000,
+		.volume = dtmf->volume,
+	};
+	if (mp->sfd)
+		r.dst = mp->sfd->socket.local;
+
+	r.call = obj_get(mp->call);
+
+	mutex_lock(&dtmf_log_lock);
+	if (!dtmf_log_thread_running) {
+		mutex_unlock(&dtmf_log_lock);
+		dtmf_log_output(&r, 1, 1);
+		return;
+	}
+	unsigned int used = dtmf_log_head - dtmf_log_tail;
+	if (used >= DTMF_LOG_RING) {
+		mutex_unlock(&dtmf_log_lock);
+		obj_put(r.call);
+		atomic64_inc(&dtmf_log_dropped);
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "DTMF log queue full, dropping event");
+		return;
+	}
+	dtmf_log_ring[dtmf_log_head++ % DTMF_LOG_RING] = r;
+	// the thread picks up events by itself, only hurry it along if it's falling behind
+	if (used == DTMF_LOG_RING / 2)
+		cond_signal(&dtmf_log_cond);
+	mutex_unlock(&dtmf_log_lock);
+}
+
 int dtmf_do_logging(void) {
-	if (_log_facility_dtmf || dtmf_log_sock.family)
+	if (_log_facility_dtmf || dtmf_log_sock.family || rtpe_config.dtmf_log_redis
+			|| rtpe_config.dtmf_log_homer)
 		return 1;
 	return 0;
 }
@@ -80,24 +224,12 @@ int dtmf_event(struct media_packet *mp, str *payload, int clockrate) {
 	ilog(LOG_DEBUG, "DTMF event: event %u, volume %u, end %u, duration %u",
 			dtmf->event, dtmf->volume, dtmf->end, dtmf->duration);
 
-	int ret = 0;
-
-	GString *buf = NULL;
-
-	if (dtmf_do_logging())
-		buf = dtmf_json_print(mp, dtmf, clockrate);
-
-	if (buf) {
-		if (_log_facility_dtmf)
-			dtmflog(buf);
-		if (dtmf_log_sock.family)
-			send(dtmf_log_sock.fd, buf->str, buf->len, 0);
-		g_string_free(buf, TRUE);
+	if (!dtmf->end || !dtmf_do_logging())
+		return 0;
 
-		ret = 1; // END event
-	}
+	dtmf_log_event(mp, dtmf, clockrate);
 
-	return ret;
+	return 1; // END event
 }
 
 void dtmf_event_free(void *e) {
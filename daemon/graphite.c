@@ -6,7 +6,6 @@
  */
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -15,6 +14,7 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "log.h"
 #include "call.h"
@@ -22,17 +22,38 @@
 #include "socket.h"
 #include "statistics.h"
 #include "main.h"
+#include "obj.h"
+#include "poller.h"
+
+// largest UDP datagram to send. batches are split into datagrams at line boundaries
+#define GRAPHITE_UDP_MAX 1400
+
+// The connection to the graphite server is served by the main poller, so that neither
+// connecting nor a slow server can hold up the graphite thread. Batches that can't be
+// sent right away are queued, up to a limit in bytes, beyond which the oldest ones are
+// dropped.
+struct graphite_sender {
+	struct obj			obj;
+	mutex_t				lock;
+	socket_t			sock;
+	enum connection_state		state;
+
+	GQueue				send_queue;	// GString batches, oldest first
+	size_t				queued;		// bytes in the send queue
+	size_t				sent;		// of the head batch, TCP only
+	uint64_t			dropped;	// batches
+	uint64_t			dropped_bytes;
+};
 
 struct timeval rtpe_latest_graphite_interval_start;
 
-static socket_t graphite_sock;
-static int connection_state = STATE_DISCONNECTED;
-//struct totalstats totalstats_prev;
+static struct graphite_sender *graphite_sender;
 static time_t next_run;
 // HEAD: static time_t rtpe_now, next_run;
 static char* graphite_prefix = NULL;
 static struct timeval graphite_interval_tv;
 static struct totalstats graphite_stats;
+static struct totalstats_block graphite_last_totals;
 
 void set_graphite_interval_tv(struct timeval *tv) {
 	graphite_interval_tv = *tv;
@@ -58,104 +79,245 @@ static struct requests_ps clear_requests_per_second(struct requests_ps *requests
 	return ret;
 }
 
-static struct request_time timeval_clear_request_time(struct request_time *request) {
-	struct request_time ret;
+static void graphite_reset(struct graphite_sender *gs) {
+	if (gs->sock.fd != -1) {
+		poller_del_item(rtpe_poller, gs->sock.fd);
+		close_socket(&gs->sock);
+	}
+	gs->state = STATE_DISCONNECTED;
+	// a partially sent batch is sent again in full after reconnecting
+	gs->sent = 0;
+}
 
-        mutex_lock(&request->lock);
-        ret = *request;
-        request->time_min.tv_sec = 0;
-        request->time_min.tv_usec = 0;
-        request->time_max.tv_sec = 0;
-        request->time_max.tv_usec = 0;
-        request->time_avg.tv_sec = 0;
-        request->time_avg.tv_usec = 0;
-        request->count = 0;
-        mutex_unlock(&request->lock);
+// gs->lock must be held
+static void graphite_flush(struct graphite_sender *gs) {
+	GString *b;
+
+	while ((b = g_queue_peek_head(&gs->send_queue))) {
+		size_t len = b->len - gs->sent;
+		if (rtpe_config.graphite_protocol == SOCK_DGRAM && len > GRAPHITE_UDP_MAX) {
+			const char *nl = memrchr(b->str + gs->sent, '\n', GRAPHITE_UDP_MAX);
+			if (nl)
+				len = nl - (b->str + gs->sent) + 1;
+			else
+				len = GRAPHITE_UDP_MAX;
+		}
 
-	return ret;
+		ssize_t ret = write(gs->sock.fd, b->str + gs->sent, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				poller_blocked(rtpe_poller, GINT_TO_POINTER(gs->sock.fd));
+				return;
+			}
+			ilog(LOG_ERROR, "Could not write to graphite socket (%s). "
+					"Disconnecting graphite server.", strerror(errno));
+			graphite_reset(gs);
+			return;
+		}
+
+		gs->sent += ret;
+		if (gs->sent < b->len)
+			continue;
+
+		g_queue_pop_head(&gs->send_queue);
+		gs->queued -= b->len;
+		gs->sent = 0;
+		g_string_free(b, TRUE);
+	}
+}
+
+static void graphite_readable(int fd, void *p, uintptr_t u) {
+	struct graphite_sender *gs = p;
+	char buf[256];
+
+	mutex_lock(&gs->lock);
+	if (gs->sock.fd != fd)
+		goto out;
+
+	// nothing is expected from the server. this only detects closed connections
+	// and, for UDP, ICMP errors
+	while (1) {
+		ssize_t ret = read(fd, buf, sizeof(buf));
+		if (ret > 0)
+			continue;
+		if (ret < 0 && (errno == EINTR))
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret < 0 && rtpe_config.graphite_protocol == SOCK_DGRAM) {
+			ilog(LOG_WARN | LOG_FLAG_LIMIT, "Error sending to graphite server: %s",
+					strerror(errno));
+			break;
+		}
+		ilog(LOG_ERROR, "Graphite server closed the connection");
+		graphite_reset(gs);
+		break;
+	}
+
+out:
+	mutex_unlock(&gs->lock);
 }
 
-static int connect_to_graphite_server(const endpoint_t *graphite_ep) {
-	int rc;
+static void graphite_writeable(int fd, void *p, uintptr_t u) {
+	struct graphite_sender *gs = p;
 
-        if (!graphite_ep) {
-                ilog(LOG_ERROR, "NULL graphite_ep");
-                return -1;
-        }
+	mutex_lock(&gs->lock);
+	if (gs->sock.fd != fd)
+		goto out;
 
-	ilog(LOG_INFO, "Connecting to graphite server %s", endpoint_print_buf(graphite_ep));
+	if (gs->state == STATE_IN_PROGRESS) {
+		int rc = socket_error(&gs->sock);
+		if (rc) {
+			ilog(LOG_ERROR, "Socket connect failed. fd: %i, Reason: %s", fd,
+					strerror(rc < 0 ? errno : rc));
+			graphite_reset(gs);
+			goto out;
+		}
+		ilog(LOG_INFO, "Graphite server connected.");
+		gs->state = STATE_CONNECTED;
+	}
 
-	rc = connect_socket_nb(&graphite_sock, SOCK_STREAM, graphite_ep);
+	graphite_flush(gs);
+
+out:
+	mutex_unlock(&gs->lock);
+}
+
+static void graphite_closed(int fd, void *p, uintptr_t u) {
+	struct graphite_sender *gs = p;
+
+	mutex_lock(&gs->lock);
+	if (gs->sock.fd == fd) {
+		int err = socket_error(&gs->sock);
+		ilog(LOG_ERROR, "Connection to graphite server failed: %s",
+				err > 0 ? strerror(err) : "connection closed");
+		graphite_reset(gs);
+	}
+	mutex_unlock(&gs->lock);
+}
+
+// gs->lock must be held
+static void graphite_connect(struct graphite_sender *gs, const endpoint_t *ep) {
+	ilog(LOG_INFO, "Connecting to graphite server %s", endpoint_print_buf(ep));
+
+	int rc = connect_socket_nb(&gs->sock, rtpe_config.graphite_protocol, ep);
 	if (rc == -1) {
 		ilog(LOG_ERROR,"Couldn't make socket for connecting to graphite.");
-		return -1;
+		return;
 	}
-	if (rc == 0)
+
+	struct poller_item pi = {
+		.fd = gs->sock.fd,
+		.obj = &gs->obj,
+		.readable = graphite_readable,
+		.writeable = graphite_writeable,
+		.closed = graphite_closed,
+	};
+	if (poller_add_item(rtpe_poller, &pi)) {
+		ilog(LOG_ERROR, "Failed to add graphite socket to poller");
+		close_socket(&gs->sock);
+		return;
+	}
+
+	if (rc == 0) {
 		ilog(LOG_INFO, "Graphite server connected.");
+		gs->state = STATE_CONNECTED;
+	}
 	else {
 		/* EINPROGRESS */
 		ilog(LOG_INFO, "Connection to graphite is in progress.");
-		connection_state = STATE_IN_PROGRESS;
+		gs->state = STATE_IN_PROGRESS;
+		// completion of the connect is signalled as the socket becoming writeable
+		poller_blocked(rtpe_poller, GINT_TO_POINTER(gs->sock.fd));
 	}
-
-	return 0;
 }
 
-static int send_graphite_data(struct totalstats *sent_data) {
-
-	if (graphite_sock.fd < 0) {
-		ilog(LOG_ERROR,"Graphite socket is not connected.");
-		return -1;
+// takes over the GString. gs->lock must be held
+static void graphite_queue(struct graphite_sender *gs, GString *b) {
+	g_queue_push_tail(&gs->send_queue, b);
+	gs->queued += b->len;
+
+	// drop the oldest batches, but not one that has been partially sent
+	GList *l = gs->send_queue.head;
+	if (gs->sent)
+		l = l->next;
+	while (gs->queued > rtpe_config.graphite_queue && l && l->next) {
+		GList *next = l->next;
+		GString *d = l->data;
+		gs->queued -= d->len;
+		gs->dropped++;
+		gs->dropped_bytes += d->len;
+		g_string_free(d, TRUE);
+		g_queue_delete_link(&gs->send_queue, l);
+		l = next;
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "Graphite send queue is full, dropping oldest data "
+				"(%" PRIu64 " batches dropped so far)", gs->dropped);
 	}
 
+	if (gs->state == STATE_CONNECTED && poller_isblocked(rtpe_poller, GINT_TO_POINTER(gs->sock.fd)) == 0)
+		graphite_flush(gs);
+}
+
+// returns the lines to send
+static GString *format_graphite_data(struct totalstats *sent_data, uint64_t dropped) {
 	struct totalstats *ts = sent_data;
 
-	/* atomically copy values to stack and reset to zero */
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_timeout_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_rejected_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_silent_timeout_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_final_timeout_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_offer_timeout_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_regular_term_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_forced_term_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_relayed_packets);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_relayed_errors);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_nopacket_relayed_sess);
-	atomic64_local_copy_zero_struct(ts, &rtpe_totalstats_interval, total_oneway_stream_sess);
-
-	mutex_lock(&rtpe_totalstats_interval.total_average_lock);
-	ts->total_average_call_dur = rtpe_totalstats_interval.total_average_call_dur;
-	ts->total_managed_sess = rtpe_totalstats_interval.total_managed_sess;
-	ZERO(rtpe_totalstats_interval.total_average_call_dur);
-	ZERO(rtpe_totalstats_interval.total_managed_sess);
-	mutex_unlock(&rtpe_totalstats_interval.total_average_lock);
-
-	mutex_lock(&rtpe_totalstats_interval.total_calls_duration_lock);
-	ts->total_calls_duration_interval = rtpe_totalstats_interval.total_calls_duration_interval;
-	rtpe_totalstats_interval.total_calls_duration_interval.tv_sec = 0;
-	rtpe_totalstats_interval.total_calls_duration_interval.tv_usec = 0;
-	//ZERO(rtpe_totalstats_interval.total_calls_duration_interval);
-	mutex_unlock(&rtpe_totalstats_interval.total_calls_duration_lock);
-
-	ts->offer = timeval_clear_request_time(&rtpe_totalstats_interval.offer);
-	ts->answer = timeval_clear_request_time(&rtpe_totalstats_interval.answer);
-	ts->delete = timeval_clear_request_time(&rtpe_totalstats_interval.delete);
+	/* sum up all threads' counters and report the difference to the previous run */
+	struct totalstats_block now;
+	statistics_sum_totals(&now);
+	// start a new epoch for min/max request times
+	g_atomic_int_inc(&rtpe_totalstats_epoch);
+
+#define TS_DIFF(f) atomic64_set_na(&ts->f, atomic64_get_na(&now.f) - atomic64_get_na(&graphite_last_totals.f))
+	TS_DIFF(total_timeout_sess);
+	TS_DIFF(total_rejected_sess);
+	TS_DIFF(total_silent_timeout_sess);
+	TS_DIFF(total_final_timeout_sess);
+	TS_DIFF(total_offer_timeout_sess);
+	TS_DIFF(total_regular_term_sess);
+	TS_DIFF(total_forced_term_sess);
+	TS_DIFF(total_relayed_packets);
+	TS_DIFF(total_relayed_errors);
+	TS_DIFF(total_nopacket_relayed_sess);
+	TS_DIFF(total_oneway_stream_sess);
+#undef TS_DIFF
+
+#define DIFF(f) (atomic64_get_na(&now.f) - atomic64_get_na(&graphite_last_totals.f))
+	ts->total_managed_sess = DIFF(total_managed_sess);
+	timeval_from_us(&ts->total_average_call_dur,
+			ts->total_managed_sess ? DIFF(total_sess_duration) / ts->total_managed_sess : 0);
+	timeval_from_us(&ts->total_calls_duration_interval, DIFF(total_calls_duration_interval));
+
+#define REQ_DIFF(r) \
+	do { \
+		ts->r.count = DIFF(r.count); \
+		timeval_from_us(&ts->r.time_avg, DIFF(r.time_sum)); \
+		timeval_from_us(&ts->r.time_min, atomic64_get_na(&now.r.time_min)); \
+		timeval_from_us(&ts->r.time_max, atomic64_get_na(&now.r.time_max)); \
+	} while (0)
+	REQ_DIFF(offer);
+	REQ_DIFF(answer);
+	REQ_DIFF(delete);
+#undef REQ_DIFF
+#undef DIFF
+
+	graphite_last_totals = now;
 
 	ts->offers_ps = clear_requests_per_second(&rtpe_totalstats_interval.offers_ps);
 	ts->answers_ps = clear_requests_per_second(&rtpe_totalstats_interval.answers_ps);
 	ts->deletes_ps = clear_requests_per_second(&rtpe_totalstats_interval.deletes_ps);
 
-	rwlock_lock_r(&rtpe_callhash_lock);
 	mutex_lock(&rtpe_totalstats_interval.managed_sess_lock);
 	ts->managed_sess_max = rtpe_totalstats_interval.managed_sess_max;
 	ts->managed_sess_min = rtpe_totalstats_interval.managed_sess_min;
-        ts->total_sessions = g_hash_table_size(rtpe_callhash);
+        ts->total_sessions = atomic64_get(&rtpe_callhash_size);
         ts->foreign_sessions = atomic64_get(&rtpe_stats.foreign_sessions);
 	ts->own_sessions = ts->total_sessions - ts->foreign_sessions;
 	rtpe_totalstats_interval.managed_sess_max = ts->own_sessions;;
 	rtpe_totalstats_interval.managed_sess_min = ts->own_sessions;
 	mutex_unlock(&rtpe_totalstats_interval.managed_sess_lock);
-	rwlock_unlock_r(&rtpe_callhash_lock);
 
 	// compute average offer/answer/delete time
 	timeval_divide(&ts->offer.time_avg, &ts->offer.time_avg, ts->offer.count);
@@ -205,6 +367,7 @@ static int send_graphite_data(struct totalstats *sent_data) {
 	GPF("offer_timeout_sess "UINT64F, atomic64_get_na(&ts->total_offer_timeout_sess));
 	GPF("timeout_sess "UINT64F, atomic64_get_na(&ts->total_timeout_sess));
 	GPF("reject_sess "UINT64F, atomic64_get_na(&ts->total_rejected_sess));
+	GPF("graphite_dropped "UINT64F, dropped);
 
 	GPF("offers_ps_min %llu",(unsigned long long)ts->offers_ps.ps_min);
 	GPF("offers_ps_max %llu",(unsigned long long)ts->offers_ps.ps_max);
@@ -226,10 +389,10 @@ static int send_graphite_data(struct totalstats *sent_data) {
 		int num_ports = lif->spec->port_pool.max - lif->spec->port_pool.min + 1;
 		GPF("ports_free_%s_%s %i", lif->logical->name.s,
 				sockaddr_print_buf(&lif->spec->local_address.addr),
-				g_atomic_int_get(&lif->spec->port_pool.free_ports));
+				port_pool_free_ports(&lif->spec->port_pool));
 		GPF("ports_used_%s_%s %i", lif->logical->name.s,
 				sockaddr_print_buf(&lif->spec->local_address.addr),
-				num_ports - g_atomic_int_get(&lif->spec->port_pool.free_ports));
+				num_ports - port_pool_free_ports(&lif->spec->port_pool));
 	}
 
 	mutex_lock(&rtpe_codec_stats_lock);
@@ -277,34 +440,7 @@ static int send_graphite_data(struct totalstats *sent_data) {
 		(unsigned long long)ts->delete.time_max.tv_sec,(unsigned long long)ts->delete.time_max.tv_usec,
 		(unsigned long long)ts->delete.time_avg.tv_sec,(unsigned long long)ts->delete.time_avg.tv_usec);
 
-	size_t sent = 0;
-	int blockings = 10; // let it block that many times
-	while (sent < graph_str->len) {
-		int rc = write(graphite_sock.fd, graph_str->str + sent, graph_str->len - sent);
-		if (rc<0) {
-			if (blockings <= 0 || (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR)) {
-				ilog(LOG_ERROR,"Could not write to graphite socket (%s). " \
-						"Disconnecting graphite server.", strerror(errno));
-				goto error;
-			}
-			rc = 0;
-		}
-		if (rc == 0) {
-			// poor man's blocking handling
-			blockings--;
-			usleep(500000);
-			continue;
-		}
-		sent += rc;
-	}
-
-	g_string_free(graph_str, TRUE);
-	return 0;
-
-error:
-	g_string_free(graph_str, TRUE);
-	close_socket(&graphite_sock);
-	return -1;
+	return graph_str;
 }
 
 static inline void copy_with_lock(struct totalstats *ts_dst, struct totalstats *ts_src, mutex_t *ts_lock) {
@@ -314,50 +450,9 @@ static inline void copy_with_lock(struct totalstats *ts_dst, struct totalstats *
 }
 
 static void graphite_loop_run(endpoint_t *graphite_ep, int seconds) {
+	struct graphite_sender *gs = graphite_sender;
 
-	int rc=0;
-	struct pollfd wfds[1];
-
-        if (!graphite_ep) {
-                ilog(LOG_ERROR, "NULL graphite_ep");
-                return ;
-        }
-
-	if (connection_state == STATE_IN_PROGRESS && graphite_sock.fd >= 0) {
-		wfds[0].fd=graphite_sock.fd;
-		wfds[0].events = POLLOUT | POLLERR | POLLHUP | POLLNVAL;
-
-		rc = poll(wfds,1,1000);
-		if (rc == -1) {
-			ilog(LOG_ERROR,"Error on the socket.");
-			close_socket(&graphite_sock);
-			connection_state = STATE_DISCONNECTED;
-			return;
-		} else if (rc==0) {
-			// timeout
-			return;
-		} else {
-			if (!(wfds[0].revents & POLLOUT)) {
-				ilog(LOG_WARN,"fd is active but not ready for writing, poll events=%x",wfds[0].revents);
-				close_socket(&graphite_sock);
-				connection_state = STATE_DISCONNECTED;
-				return;
-			}
-			rc = socket_error(&graphite_sock);
-			if (rc < 0) ilog(LOG_ERROR,"getsockopt failure.");
-			if (rc != 0) {
-				ilog(LOG_ERROR,"Socket connect failed. fd: %i, Reason: %s\n",graphite_sock.fd, strerror(rc));
-				close_socket(&graphite_sock);
-				connection_state = STATE_DISCONNECTED;
-				return;
-			}
-			ilog(LOG_INFO, "Graphite server connected.");
-			connection_state = STATE_CONNECTED;
-			next_run=0; // fake next run to skip sleep after reconnect
-		}
-	}
-
-	gettimeofday(&rtpe_now, NULL);
+	rtpe_now_coarse();
 	if (rtpe_now.tv_sec < next_run) {
 		usleep(100000);
 		return;
@@ -365,24 +460,27 @@ static void graphite_loop_run(endpoint_t *graphite_ep, int seconds) {
 
 	next_run = rtpe_now.tv_sec + seconds;
 
-	if (graphite_sock.fd < 0 && connection_state == STATE_DISCONNECTED) {
-		connect_to_graphite_server(graphite_ep);
-	}
+	mutex_lock(&gs->lock);
+	if (gs->state == STATE_DISCONNECTED)
+		graphite_connect(gs, graphite_ep);
+	int active = gs->state != STATE_DISCONNECTED;
+	uint64_t dropped = gs->dropped;
+	mutex_unlock(&gs->lock);
+
+	if (!active)
+		return;
 
-	if (graphite_sock.fd >= 0 && connection_state == STATE_CONNECTED) {
-		add_total_calls_duration_in_interval(&graphite_interval_tv);
+	// data gathered while the connection is still in progress is sent once it's established
+	add_total_calls_duration_in_interval(&graphite_interval_tv);
 
-		rc = send_graphite_data(&graphite_stats);
-		gettimeofday(&rtpe_latest_graphite_interval_start, NULL);
-		if (rc < 0) {
-			ilog(LOG_ERROR,"Sending graphite data failed.");
-			close_socket(&graphite_sock);
-			connection_state = STATE_DISCONNECTED;
-		}
+	GString *b = format_graphite_data(&graphite_stats, dropped);
+	gettimeofday(&rtpe_latest_graphite_interval_start, NULL);
 
-		copy_with_lock(&rtpe_totalstats_lastinterval, &graphite_stats, &rtpe_totalstats_lastinterval_lock);
-	}
+	mutex_lock(&gs->lock);
+	graphite_queue(gs, b);
+	mutex_unlock(&gs->lock);
 
+	copy_with_lock(&rtpe_totalstats_lastinterval, &graphite_stats, &rtpe_totalstats_lastinterval_lock);
 }
 
 void graphite_loop(void *d) {
@@ -391,7 +489,13 @@ void graphite_loop(void *d) {
 		rtpe_config.graphite_interval=1;
 	}
 
-	connect_to_graphite_server(&rtpe_config.graphite_ep);
+	graphite_sender = obj_alloc0("graphite_sender", sizeof(*graphite_sender), NULL);
+	mutex_init(&graphite_sender->lock);
+	graphite_sender->sock.fd = -1;
+
+	mutex_lock(&graphite_sender->lock);
+	graphite_connect(graphite_sender, &rtpe_config.graphite_ep);
+	mutex_unlock(&graphite_sender->lock);
 
 	while (!rtpe_shutdown)
 		graphite_loop_run(&rtpe_config.graphite_ep, rtpe_config.graphite_interval); // time in seconds
@@ -0,0 +1,550 @@
+#include "handover.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "main.h"
+#include "log.h"
+#include "aux.h"
+#include "obj.h"
+#include "poller.h"
+#include "call.h"
+#include "redis.h"
+#include "kernel.h"
+#include "media_socket.h"
+
+
+// Protocol: a sequence of messages over a unix stream socket, each a struct
+// handover_hdr followed by `len` bytes of payload. File descriptors travel as
+// SCM_RIGHTS attached to the header. The media sockets of a call are always sent
+// before its snapshot, so that they're known when the call is restored.
+
+#define HANDOVER_FD_BATCH	64
+#define HANDOVER_MAX_CALL	(16 * 1024 * 1024)
+
+enum handover_msg {
+	HO_FDS = 1,	// media sockets, no payload
+	HO_CALL,	// call ID followed by the binary snapshot
+	HO_KERNEL,	// control fd of the kernel table
+	HO_END,
+};
+
+struct handover_hdr {
+	uint32_t		type;
+	uint32_t		len;
+	uint32_t		aux;		// call ID length, or kernel table ID
+	uint32_t		num_fds;
+};
+
+struct handover_call {
+	str			callid;
+	char			*buf;		// call ID, then snapshot
+	size_t			len;
+};
+
+struct handover_listener {
+	struct obj		obj;
+	int			fd;
+};
+
+
+// receiving side, only used during startup before any other threads are running
+static GHashTable *handover_fds; // endpoint_t -> fd + 1
+static GQueue handover_calls = G_QUEUE_INIT;
+static int handover_kfd = -1;
+static unsigned int handover_ktable;
+
+// sending side
+static struct handover_listener *handover_listener;
+static volatile int handover_busy;
+volatile int handover_sent;
+
+
+
+static int ho_write(int fd, const void *buf, size_t len) {
+	while (len) {
+		ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *) buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int ho_read(int fd, void *buf, size_t len) {
+	while (len) {
+		ssize_t ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			errno = ECONNRESET;
+		if (ret <= 0)
+			return -1;
+		buf = (char *) buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+// payload is the concatenation of `a` and `b`
+static int ho_send(int fd, enum handover_msg type, uint32_t aux, const int *fds, unsigned int num_fds,
+		const void *a, size_t a_len, const void *b, size_t b_len)
+{
+	struct handover_hdr hdr = {
+		.type = type,
+		.len = a_len + b_len,
+		.aux = aux,
+		.num_fds = num_fds,
+	};
+	struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+	struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_FD_BATCH)];
+
+	assert(num_fds <= HANDOVER_FD_BATCH);
+
+	if (num_fds) {
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+		memcpy(CMSG_DATA(cm), fds, sizeof(int) * num_fds);
+	}
+
+	ssize_t ret;
+	do
+		ret = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -1;
+	// the fds went out with the first byte, so the rest of the header can follow normally
+	if (ho_write(fd, (char *) &hdr + ret, sizeof(hdr) - ret))
+		return -1;
+	if (a_len && ho_write(fd, a, a_len))
+		return -1;
+	if (b_len && ho_write(fd, b, b_len))
+		return -1;
+	return 0;
+}
+
+// returns 0 on EOF, 1 if a header was received, -1 on error
+static int ho_recv(int fd, struct handover_hdr *hdr, int *fds) {
+	struct iovec iov = { .iov_base = hdr, .iov_len = sizeof(*hdr) };
+	char cbuf[CMSG_SPACE(sizeof(int) * HANDOVER_FD_BATCH)];
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = cbuf,
+		.msg_controllen = sizeof(cbuf),
+	};
+
+	ssize_t ret;
+	do
+		ret = recvmsg(fd, &mh, MSG_WAITALL);
+	while (ret < 0 && errno == EINTR);
+	if (ret == 0)
+		return 0;
+	if (ret < 0)
+		return -1;
+
+	unsigned int num = 0;
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+			continue;
+		unsigned int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (n > HANDOVER_FD_BATCH - num)
+			n = HANDOVER_FD_BATCH - num;
+		memcpy(fds + num, CMSG_DATA(cm), sizeof(int) * n);
+		num += n;
+	}
+
+	if (ret < sizeof(*hdr) && ho_read(fd, (char *) hdr + ret, sizeof(*hdr) - ret))
+		goto err;
+	if ((mh.msg_flags & MSG_CTRUNC) || num != hdr->num_fds)
+		goto err;
+	return 1;
+
+err:
+	for (unsigned int i = 0; i < num; i++)
+		close(fds[i]);
+	return -1;
+}
+
+static void ho_add_fd(int fd) {
+	struct sockaddr_storage ss;
+	socklen_t sl = sizeof(ss);
+
+	if (getsockname(fd, (struct sockaddr *) &ss, &sl)
+			|| (ss.ss_family != AF_INET && ss.ss_family != AF_INET6))
+	{
+		close(fd);
+		return;
+	}
+
+	endpoint_t *ep = g_new0(endpoint_t, 1);
+	endpoint_parse_sockaddr_storage(ep, &ss);
+	int old = GPOINTER_TO_INT(g_hash_table_lookup(handover_fds, ep));
+	if (old)
+		close(old - 1);
+	g_hash_table_replace(handover_fds, ep, GINT_TO_POINTER(fd + 1));
+}
+
+static void ho_free_call(struct handover_call *hc) {
+	g_free(hc->buf);
+	g_slice_free1(sizeof(*hc), hc);
+}
+
+static void ho_cleanup(void) {
+	if (handover_fds) {
+		GHashTableIter iter;
+		gpointer val;
+		g_hash_table_iter_init(&iter, handover_fds);
+		while (g_hash_table_iter_next(&iter, NULL, &val))
+			close(GPOINTER_TO_INT(val) - 1);
+		g_hash_table_destroy(handover_fds);
+		handover_fds = NULL;
+	}
+
+	struct handover_call *hc;
+	while ((hc = g_queue_pop_head(&handover_calls)))
+		ho_free_call(hc);
+
+	if (handover_kfd != -1)
+		close(handover_kfd);
+	handover_kfd = -1;
+}
+
+static int ho_sockaddr(struct sockaddr_un *sun) {
+	ZERO(*sun);
+	sun->sun_family = AF_UNIX;
+	if (strlen(rtpe_config.handover_socket) >= sizeof(sun->sun_path))
+		return -1;
+	g_strlcpy(sun->sun_path, rtpe_config.handover_socket, sizeof(sun->sun_path));
+	return 0;
+}
+
+int handover_receive(void) {
+	struct sockaddr_un sun;
+	struct handover_hdr hdr;
+	int fds[HANDOVER_FD_BATCH];
+	unsigned int num_socks = 0;
+	const char *err;
+	int ret;
+
+	if (!rtpe_config.handover_socket)
+		return 0;
+	if (ho_sockaddr(&sun))
+		die("Handover socket path '%s' is too long", rtpe_config.handover_socket);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		die("Failed to create handover socket: %s", strerror(errno));
+	if (connect(fd, (struct sockaddr *) &sun, sizeof(sun))) {
+		int errsv = errno;
+		close(fd);
+		if (errsv == ENOENT || errsv == ECONNREFUSED) {
+			ilog(LOG_INFO, "No running process on handover socket '%s', starting normally",
+					rtpe_config.handover_socket);
+			return 0;
+		}
+		ilog(LOG_ERR, "Failed to connect to handover socket '%s': %s",
+				rtpe_config.handover_socket, strerror(errsv));
+		return -1;
+	}
+
+	ilog(LOG_NOTICE, "Taking over from the running process through '%s'", rtpe_config.handover_socket);
+
+	handover_fds = g_hash_table_new_full(g_endpoint_hash, g_endpoint_eq, g_free, NULL);
+
+	while (1) {
+		err = "failed to receive message";
+		ret = ho_recv(fd, &hdr, fds);
+		if (ret == 0)
+			err = "connection closed prematurely";
+		if (ret <= 0)
+			goto fail;
+
+		err = "unexpected file descriptors";
+		if (hdr.num_fds && hdr.type != HO_FDS && hdr.type != HO_KERNEL)
+			goto fail_fds;
+		err = "unexpected payload";
+		if (hdr.len && hdr.type != HO_CALL)
+			goto fail_fds;
+
+		switch (hdr.type) {
+			case HO_FDS:
+				for (unsigned int i = 0; i < hdr.num_fds; i++)
+					ho_add_fd(fds[i]);
+				num_socks += hdr.num_fds;
+				break;
+
+			case HO_KERNEL:
+				err = "missing kernel table fd";
+				if (hdr.num_fds != 1)
+					goto fail_fds;
+				if (handover_kfd != -1)
+					close(handover_kfd);
+				handover_kfd = fds[0];
+				handover_ktable = hdr.aux;
+				break;
+
+			case HO_CALL:;
+				err = "invalid call snapshot";
+				if (!hdr.aux || hdr.aux > hdr.len || hdr.len > HANDOVER_MAX_CALL)
+					goto fail;
+				struct handover_call *hc = g_slice_alloc(sizeof(*hc));
+				hc->len = hdr.len;
+				hc->buf = g_malloc(hc->len);
+				str_init_len(&hc->callid, hc->buf, hdr.aux);
+				g_queue_push_tail(&handover_calls, hc);
+				err = "failed to receive call snapshot";
+				if (ho_read(fd, hc->buf, hc->len))
+					goto fail;
+				break;
+
+			case HO_END:
+				goto done;
+
+			default:
+				err = "unknown message type";
+				goto fail_fds;
+		}
+	}
+
+done:
+	ilog(LOG_INFO, "Received %u calls and %u media sockets, waiting for the previous process to exit",
+			handover_calls.length, num_socks);
+
+	// it exits right after sending everything, which closes the connection. only then can
+	// its control sockets be re-bound
+	char c;
+	do
+		ret = read(fd, &c, 1);
+	while (ret > 0 || (ret < 0 && errno == EINTR));
+	close(fd);
+	return 1;
+
+fail_fds:
+	for (unsigned int i = 0; i < hdr.num_fds; i++)
+		close(fds[i]);
+fail:
+	ilog(LOG_ERR, "Handover from the running process failed: %s", err);
+	close(fd);
+	ho_cleanup();
+	return -1;
+}
+
+int handover_kernel_fd(unsigned int table) {
+	int fd = handover_kfd;
+	if (fd == -1)
+		return -1;
+	handover_kfd = -1;
+	if (table != handover_ktable) {
+		ilog(LOG_WARN, "Handed over kernel table %u doesn't match configured table %u, not using it",
+				handover_ktable, table);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int handover_take_fd(const sockaddr_t *addr, unsigned int port) {
+	if (!handover_fds)
+		return -1;
+
+	endpoint_t ep = { .address = *addr, .port = port };
+	int fd = GPOINTER_TO_INT(g_hash_table_lookup(handover_fds, &ep));
+	if (!fd)
+		return -1;
+	g_hash_table_remove(handover_fds, &ep);
+	return fd - 1;
+}
+
+void handover_restore(void) {
+	struct handover_call *hc;
+	unsigned int restored = 0, failed = 0;
+
+	while ((hc = g_queue_pop_head(&handover_calls))) {
+		if (redis_restore_snapshot(&hc->callid, hc->buf + hc->callid.len, hc->len - hc->callid.len))
+			failed++;
+		else
+			restored++;
+		ho_free_call(hc);
+	}
+
+	unsigned int unused = handover_fds ? g_hash_table_size(handover_fds) : 0;
+	ho_cleanup();
+
+	ilog(LOG_NOTICE, "Took over %u calls from the previous process (%u failed, %u unused media sockets)",
+			restored, failed, unused);
+}
+
+
+
+static void handover_send(void *p) {
+	int fd = GPOINTER_TO_INT(p);
+	GQueue calls = G_QUEUE_INIT;
+	unsigned int num_calls = 0, num_socks = 0;
+	int fds[HANDOVER_FD_BATCH];
+	struct call *c;
+
+	ilog(LOG_NOTICE, "New process connected to the handover socket, handing over all calls");
+
+	// from here on, the calls must not change any more: no control commands (the call
+	// timer also stands still, see handover_active()) and no packets handled in userspace.
+	// kernel forwarding carries on as it is
+	control_listeners_close();
+
+	ITERATE_CALLHASH_SHARDS(shard) {
+		GHashTableIter iter;
+		gpointer val;
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, NULL, &val))
+			g_queue_push_tail(&calls, obj_get((struct call *) val));
+		rwlock_unlock_r(&shard->lock);
+	}
+
+	for (GList *l = calls.head; l; l = l->next) {
+		c = l->data;
+		call_lock_w(c);
+		stream_fds_detach(c);
+		call_unlock_w(c);
+	}
+
+	// the new process takes over writing to Redis, so nothing must be left behind here
+	redis_writer_flush();
+
+	for (GList *l = calls.head; l; l = l->next) {
+		unsigned int num = 0;
+		int ret = 0;
+
+		c = l->data;
+
+		// call_lock_w() waits for packet handlers that were already running during the
+		// detach, including those that got in through call_packet_lock() without master_lock
+		call_lock_w(c);
+
+		for (GList *k = c->stream_fds.head; k && !ret; k = k->next) {
+			struct stream_fd *sfd = k->data;
+			if (sfd->socket.fd == -1)
+				continue;
+			fds[num++] = sfd->socket.fd;
+			num_socks++;
+			if (num == HANDOVER_FD_BATCH) {
+				ret = ho_send(fd, HO_FDS, 0, fds, num, NULL, 0, NULL, 0);
+				num = 0;
+			}
+		}
+		if (!ret && num)
+			ret = ho_send(fd, HO_FDS, 0, fds, num, NULL, 0, NULL, 0);
+		if (!ret) {
+			GString *snap = redis_call_snapshot(c);
+			ret = ho_send(fd, HO_CALL, c->callid.len, NULL, 0, c->callid.s, c->callid.len,
+					snap->str, snap->len);
+			g_string_free(snap, TRUE);
+		}
+
+		call_unlock_w(c);
+
+		if (ret)
+			goto fail;
+		num_calls++;
+	}
+
+	if (kernel.is_open) {
+		// pushes whatever other threads have queued up
+		kernel_batch_start();
+		kernel_batch_flush();
+		if (ho_send(fd, HO_KERNEL, kernel.table, &kernel.fd, 1, NULL, 0, NULL, 0))
+			goto fail;
+	}
+	if (ho_send(fd, HO_END, 0, NULL, 0, NULL, 0, NULL, 0))
+		goto fail;
+
+	// the regular shutdown follows, which leaves sockets, kernel targets, iptables rules
+	// and Redis keys as they are
+	ilog(LOG_NOTICE, "Handed over %u calls and %u media sockets to the new process, shutting down",
+			num_calls, num_socks);
+	handover_sent = 1;
+	rtpe_shutdown = 1;
+
+	while ((c = g_queue_pop_head(&calls)))
+		obj_put(c);
+	close(fd);
+	return;
+
+fail:
+	ilog(LOG_ERR, "Handover to the new process failed (%s), resuming media, but the control "
+			"ports remain closed", strerror(errno));
+	while ((c = g_queue_pop_head(&calls))) {
+		call_lock_w(c);
+		stream_fds_attach(c);
+		call_unlock_w(c);
+		obj_put(c);
+	}
+	close(fd);
+	g_atomic_int_set(&handover_busy, 0);
+}
+
+int handover_active(void) {
+	return g_atomic_int_get(&handover_busy);
+}
+
+static void handover_accept(int fd, void *p, uintptr_t u) {
+	int nfd = accept(fd, NULL, NULL);
+	if (nfd == -1)
+		return;
+	if (!g_atomic_int_compare_and_exchange(&handover_busy, 0, 1)) {
+		close(nfd);
+		return;
+	}
+	thread_create_detach(handover_send, GINT_TO_POINTER(nfd));
+}
+
+static void handover_closed(int fd, void *p, uintptr_t u) {
+	ilog(LOG_WARN, "Handover socket was closed");
+}
+
+void handover_listen(void) {
+	struct sockaddr_un sun;
+
+	if (!rtpe_config.handover_socket)
+		return;
+	if (ho_sockaddr(&sun))
+		die("Handover socket path '%s' is too long", rtpe_config.handover_socket);
+
+	// a previous process is gone by now, see handover_receive()
+	unlink(rtpe_config.handover_socket);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		die("Failed to create handover socket: %s", strerror(errno));
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) || listen(fd, 1))
+		die("Failed to listen on handover socket '%s': %s", rtpe_config.handover_socket,
+				strerror(errno));
+	nonblock(fd);
+
+	handover_listener = obj_alloc0("handover_listener", sizeof(*handover_listener), NULL);
+	handover_listener->fd = fd;
+
+	struct poller_item pi = {
+		.fd = fd,
+		.obj = &handover_listener->obj,
+		.readable = handover_accept,
+		.closed = handover_closed,
+	};
+	if (poller_add_item(rtpe_poller, &pi))
+		die("Failed to add handover socket to poller");
+}
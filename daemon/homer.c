@@ -8,30 +8,51 @@
 #include <string.h>
 #include <glib.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "log.h"
 #include "aux.h"
 #include "str.h"
+#include "main.h"
 
 
 
 
-#define SEND_QUEUE_LIMIT 200
+// messages waiting for the sender thread. must be a power of two
+#define SEND_QUEUE_SIZE 1024
+// messages written with one sendmmsg() or writev()
+#define SEND_BATCH 32
+#define SENDER_SLEEP_US 10000
 
 
 
 
-struct homer_sender {
-	mutex_t		lock;
+// Bounded multi-producer single-consumer ring. A slot is free for the producer claiming
+// position `pos` when its sequence number equals `pos`, and holds a message for the
+// consumer when it equals `pos + 1`.
+struct homer_slot {
+	volatile unsigned int	seq;
+	GString			*s;
+};
 
+struct homer_sender {
 	endpoint_t	endpoint;
 	int		protocol;
 	int		capture_id;
+
+	struct homer_slot ring[SEND_QUEUE_SIZE];
+	volatile unsigned int head; // next position to claim by producers
+	unsigned int	tail; // next position to consume, sender thread only
+	atomic64	dropped; // ring full
+	atomic64	lost; // dequeued, but discarded because of connection errors
+
+	// everything below is only used by the sender thread
 	socket_t	socket;
 	time_t		retry;
-
-	GQueue		send_queue;
-	GString		*partial;
+	GString		*pending[SEND_BATCH];
+	unsigned int	num_pending;
+	size_t		partial; // already written part of pending[0], TCP only
 
 	int		(*state)(struct homer_sender *);
 };
@@ -54,52 +75,139 @@ static int __no_socket(struct homer_sender *hs);
 
 
 
+static int __ring_push(struct homer_sender *hs, GString *s) {
+	unsigned int pos = __atomic_load_n(&hs->head, __ATOMIC_RELAXED);
+
+	while (1) {
+		struct homer_slot *slot = &hs->ring[pos % SEND_QUEUE_SIZE];
+		unsigned int seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		int diff = (int) (seq - pos);
+		if (diff < 0)
+			return -1; // full
+		if (diff > 0) {
+			pos = __atomic_load_n(&hs->head, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&hs->head, &pos, pos + 1, 1, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+		{
+			slot->s = s;
+			__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		// `pos` was updated by the failed exchange
+	}
+}
+
+static GString *__ring_pop(struct homer_sender *hs) {
+	struct homer_slot *slot = &hs->ring[hs->tail % SEND_QUEUE_SIZE];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != hs->tail + 1)
+		return NULL;
+	GString *s = slot->s;
+	__atomic_store_n(&slot->seq, hs->tail + SEND_QUEUE_SIZE, __ATOMIC_RELEASE);
+	hs->tail++;
+	return s;
+}
+
+static void __pending_drop(struct homer_sender *hs, unsigned int num) {
+	for (unsigned int i = 0; i < num; i++)
+		g_string_free(hs->pending[i], TRUE);
+	hs->num_pending -= num;
+	memmove(hs->pending, hs->pending + num, hs->num_pending * sizeof(*hs->pending));
+}
+
 static void __reset(struct homer_sender *hs) {
 	close_socket(&hs->socket);
 	hs->state = __no_socket;
 	hs->retry = time(NULL) + 30;
 
 	// discard partially written packet
-	if (hs->partial)
-		g_string_free(hs->partial, TRUE);
-	hs->partial = NULL;
+	if (hs->partial && hs->num_pending) {
+		atomic64_inc(&hs->lost);
+		__pending_drop(hs, 1);
+	}
+	hs->partial = 0;
 }
 
-static int __attempt_send(struct homer_sender *hs, GString *gs) {
-	int ret;
+// returns 0 if everything was sent, 1 on write errors, 2 if blocked
+static int __send_udp(struct homer_sender *hs) {
+	struct mmsghdr mm[SEND_BATCH];
+	struct iovec iov[SEND_BATCH];
+
+	ZERO(mm);
+	for (unsigned int i = 0; i < hs->num_pending; i++) {
+		iov[i].iov_base = hs->pending[i]->str;
+		iov[i].iov_len = hs->pending[i]->len;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
 
-	ret = write(hs->socket.fd, gs->str, gs->len);
-	if (ret == gs->len) {
-		// full write
-		g_string_free(gs, TRUE);
-		return 0;
+	while (hs->num_pending) {
+		int ret = sendmmsg(hs->socket.fd, mm, hs->num_pending, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN)
+				return 2;
+			ilog(LOG_ERR | LOG_FLAG_LIMIT, "Write error to Homer at %s: %s",
+					endpoint_print_buf(&hs->endpoint), strerror(errno));
+			// UDP errors are usually transient. drop the offending packet only
+			atomic64_inc(&hs->lost);
+			ret = 1;
+		}
+		__pending_drop(hs, ret);
+		memmove(mm, mm + ret, hs->num_pending * sizeof(*mm));
 	}
-	if (ret < 0) {
-		if (errno != EWOULDBLOCK && errno != EAGAIN) {
+	return 0;
+}
+
+// returns 0 if everything was sent, 1 on write errors, 2 if blocked
+static int __send_tcp(struct homer_sender *hs) {
+	struct iovec iov[SEND_BATCH];
+
+	while (hs->num_pending) {
+		for (unsigned int i = 0; i < hs->num_pending; i++) {
+			iov[i].iov_base = hs->pending[i]->str;
+			iov[i].iov_len = hs->pending[i]->len;
+		}
+		iov[0].iov_base = hs->pending[0]->str + hs->partial;
+		iov[0].iov_len -= hs->partial;
+
+		ssize_t ret = writev(hs->socket.fd, iov, hs->num_pending);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EWOULDBLOCK || errno == EAGAIN) {
+				ilog(LOG_DEBUG, "Homer write blocked");
+				return 2;
+			}
 			ilog(LOG_ERR, "Write error to Homer at %s: %s",
 					endpoint_print_buf(&hs->endpoint), strerror(errno));
 			__reset(hs);
 			return 1;
 		}
-		ilog(LOG_DEBUG, "Home write blocked");
-		// XXX use poller for blocked writes?
-		return 2;
+
+		// count fully written packets
+		size_t len = ret + hs->partial;
+		unsigned int done = 0;
+		while (done < hs->num_pending && len >= hs->pending[done]->len)
+			len -= hs->pending[done++]->len;
+		__pending_drop(hs, done);
+		hs->partial = len;
+		if (hs->partial)
+			ilog(LOG_DEBUG, "Homer write blocked (partial write)");
 	}
-	// partial write
-	ilog(LOG_DEBUG, "Home write blocked (partial write)");
-	g_string_erase(gs, 0, ret);
-	return 3;
+	return 0;
 }
 
 static int __established(struct homer_sender *hs) {
 	char buf[16];
 	int ret;
-	GString *gs;
 
 	// test connection with a dummy read
 	ret = read(hs->socket.fd, buf, sizeof(buf));
 	if (ret < 0) {
-		if (errno != EWOULDBLOCK && errno != EAGAIN) {
+		if (errno != EWOULDBLOCK && errno != EAGAIN && hs->protocol == SOCK_STREAM) {
 			ilog(LOG_ERR, "Connection error from Homer at %s: %s",
 					endpoint_print_buf(&hs->endpoint), strerror(errno));
 			__reset(hs);
@@ -108,37 +216,24 @@ static int __established(struct homer_sender *hs) {
 	}
 	// XXX handle return data from Homer?
 
-	if (hs->partial) {
-		ilog(LOG_DEBUG, "dequeue partial packet to Homer");
-		ret = __attempt_send(hs, hs->partial);
-		if (ret == 3 || ret == 2) // partial write or not sent at all
-			return 0;
-		if (ret == 1) // write error, takes care of deleting hs->partial
-			return -1;
-		// ret == 0 -> sent OK, drop through to unqueue
-		g_string_free(hs->partial, TRUE);
-		hs->partial = NULL;
-	}
-
 	// unqueue as much as we can
-	while ((gs = g_queue_pop_head(&hs->send_queue))) {
-		ilog(LOG_DEBUG, "dequeue send queue to Homer");
-		ret = __attempt_send(hs, gs);
-		if (ret == 0) // everything sent OK
-			continue;
-		if (ret == 3) { // partial write
-			hs->partial = gs;
+	while (1) {
+		GString *gs;
+		while (hs->num_pending < SEND_BATCH && (gs = __ring_pop(hs)))
+			hs->pending[hs->num_pending++] = gs;
+		if (!hs->num_pending)
 			return 0;
-		}
-		g_queue_push_head(&hs->send_queue, gs);
+
+		ilog(LOG_DEBUG, "dequeue %u packets to Homer", hs->num_pending);
+		if (hs->protocol == SOCK_DGRAM)
+			ret = __send_udp(hs);
+		else
+			ret = __send_tcp(hs);
 		if (ret == 1) // write error
 			return -1;
-		// ret == 2 -> blocked
-		return 0;
+		if (ret == 2) // blocked
+			return 0;
 	}
-
-	// everything unqueued
-	return 0;
 }
 
 static int __check_conn(struct homer_sender *hs, int ret) {
@@ -192,11 +287,13 @@ void homer_sender_init(const endpoint_t *ep, int protocol, int capture_id) {
 
 	ret = malloc(sizeof(*ret));
 	ZERO(*ret);
-	mutex_init(&ret->lock);
 	ret->endpoint = *ep;
 	ret->protocol = protocol;
 	ret->capture_id = capture_id;
 	ret->retry = time(NULL);
+	ret->socket.fd = -1;
+	for (unsigned int i = 0; i < SEND_QUEUE_SIZE; i++)
+		ret->ring[i].seq = i;
 
 	ret->state = __no_socket;
 
@@ -205,6 +302,22 @@ void homer_sender_init(const endpoint_t *ep, int protocol, int capture_id) {
 	return;
 }
 
+// Runs the connection and does all the writing, so that a slow or unreachable Homer
+// server never holds up RTCP processing. Sleeps while there's nothing to send, or while
+// the socket is blocked or disconnected, in which case the queue fills up and further
+// messages are dropped.
+void homer_sender_loop(void *p) {
+	struct homer_sender *hs = main_homer_sender;
+
+	if (!hs)
+		return;
+
+	while (!rtpe_shutdown) {
+		hs->state(hs);
+		usleep(SENDER_SLEEP_US);
+	}
+}
+
 // takes over the GString
 int homer_send(GString *s, const str *id, const endpoint_t *src,
 		const endpoint_t *dst, const struct timeval *tv)
@@ -221,15 +334,13 @@ int homer_send(GString *s, const str *id, const endpoint_t *src,
 	if (send_hepv3(s, id, main_homer_sender->capture_id, src, dst, tv))
 		goto out;
 
-	mutex_lock(&main_homer_sender->lock);
-	if (main_homer_sender->send_queue.length < SEND_QUEUE_LIMIT) {
-		g_queue_push_tail(&main_homer_sender->send_queue, s);
+	if (!__ring_push(main_homer_sender, s))
 		s = NULL;
+	else {
+		atomic64_inc(&main_homer_sender->dropped);
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Send queue length limit (%i) reached, dropping Homer message",
+				SEND_QUEUE_SIZE);
 	}
-	else
-		ilog(LOG_ERR, "Send queue length limit (%i) reached, dropping Homer message", SEND_QUEUE_LIMIT);
-	main_homer_sender->state(main_homer_sender);
-	mutex_unlock(&main_homer_sender->lock);
 
 out:
 	if (s)
@@ -237,6 +348,12 @@ out:
 	return 0;
 }
 
+uint64_t homer_dropped(void) {
+	if (!main_homer_sender)
+		return 0;
+	return atomic64_get(&main_homer_sender->dropped) + atomic64_get(&main_homer_sender->lost);
+}
+
 
 
 
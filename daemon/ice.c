@@ -11,6 +11,7 @@
 #include "poller.h"
 #include "log_funcs.h"
 #include "timerthread.h"
+#include "xt_RTPENGINE.h"
 
 
 
@@ -59,6 +60,15 @@ static u_int64_t tie_breaker;
 
 static struct timerthread ice_agents_timer_thread;
 
+/* global pacing of ordinary checks across all agents (RFC 8445 Ta). each slot of the wheel
+ * covers one TIMER_RUN_INTERVAL and takes a limited number of checks */
+struct ice_pacing_slot {
+	long long		tick;
+	unsigned int		checks;
+};
+static struct ice_pacing_slot ice_pacing_wheel[ICE_PACING_SLOTS];
+static mutex_t ice_pacing_lock = MUTEX_STATIC_INIT;
+
 static const char ice_chars[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
 
 const unsigned int ice_type_preferences[] = {
@@ -226,6 +236,17 @@ static int __pair_prio_cmp(const void *a, const void *b) {
 		return 1;
 	return 0;
 }
+static int __pair_retransmit_cmp(const void *a, const void *b) {
+	const struct ice_candidate_pair *A = a, *B = b;
+	int ret = timeval_cmp(&A->retransmit, &B->retransmit);
+	if (ret)
+		return ret;
+	if (A < B)
+		return -1;
+	if (A > B)
+		return 1;
+	return 0;
+}
 
 static void __ice_agent_initialize(struct ice_agent *ag) {
 	struct call_media *media = ag->media;
@@ -244,9 +265,11 @@ static void __ice_agent_initialize(struct ice_agent *ag) {
 	ag->valid_pairs = g_tree_new(__pair_prio_cmp);
 	ag->succeeded_pairs = g_tree_new(__pair_prio_cmp);
 	ag->all_pairs = g_tree_new(__pair_prio_cmp);
+	ag->retransmit_pairs = g_tree_new(__pair_retransmit_cmp);
 
 	create_random_ice_string(call, &ag->ufrag[1], 8);
 	create_random_ice_string(call, &ag->pwd[1], 26);
+	stun_hmac_set(&ag->hmac[1], &ag->pwd[1]);
 
 	atomic64_set(&ag->last_activity, rtpe_now.tv_sec);
 }
@@ -289,6 +312,7 @@ static void __ice_reset(struct ice_agent *ag) {
 	__ice_agent_free_components(ag);
 	ZERO(ag->active_components);
 	ZERO(ag->start_nominating);
+	ZERO(ag->next_check);
 	ZERO(ag->tt_obj.last_run);
 	__ice_agent_initialize(ag);
 }
@@ -342,8 +366,10 @@ void ice_update(struct ice_agent *ag, struct stream_params *sp) {
 		/* update remote info */
 		if (sp->ice_ufrag.s)
 			call_str_cpy(call, &ag->ufrag[0], &sp->ice_ufrag);
-		if (sp->ice_pwd.s)
+		if (sp->ice_pwd.s) {
 			call_str_cpy(call, &ag->pwd[0], &sp->ice_pwd);
+			stun_hmac_set(&ag->hmac[0], &ag->pwd[0]);
+		}
 
 		candidates = &sp->ice_candidates;
 	}
@@ -506,6 +532,7 @@ static void __ice_agent_free_components(struct ice_agent *ag) {
 	g_tree_destroy(ag->nominated_pairs);
 	g_tree_destroy(ag->succeeded_pairs);
 	g_tree_destroy(ag->valid_pairs);
+	g_tree_destroy(ag->retransmit_pairs);
 	ice_candidates_free(&ag->remote_candidates);
 	ice_candidate_pairs_free(&ag->candidate_pairs);
 }
@@ -520,6 +547,8 @@ static void __ice_agent_free(void *p) {
 	__DBG("freeing ice_agent");
 
 	__ice_agent_free_components(ag);
+	stun_hmac_free(&ag->hmac[0]);
+	stun_hmac_free(&ag->hmac[1]);
 	mutex_destroy(&ag->lock);
 
 	obj_put(ag->call);
@@ -568,6 +597,47 @@ void ice_free(void) {
 
 
 
+/* agent must be locked. returns true if an ordinary check may be sent now. otherwise the
+ * earliest slot with room has been reserved in ag->next_check */
+static int __ice_pace(struct ice_agent *ag) {
+	struct ice_pacing_slot *slot;
+	unsigned int cap, i;
+	long long tick;
+
+	if (!rtpe_config.ice_check_rate)
+		return 1;
+
+	if (ag->next_check.tv_sec) {
+		if (timeval_cmp(&rtpe_now, &ag->next_check) < 0)
+			return 0;
+		ZERO(ag->next_check);
+		return 1;
+	}
+
+	cap = MAX(1, rtpe_config.ice_check_rate * TIMER_RUN_INTERVAL / 1000);
+	tick = timeval_us(&rtpe_now) / (TIMER_RUN_INTERVAL * 1000);
+
+	mutex_lock(&ice_pacing_lock);
+	for (i = 0; ; i++, tick++) {
+		slot = &ice_pacing_wheel[tick % ICE_PACING_SLOTS];
+		if (slot->tick != tick) {
+			slot->tick = tick;
+			slot->checks = 0;
+		}
+		// once around the wheel, overbook the last slot
+		if (slot->checks < cap || i == ICE_PACING_SLOTS - 1)
+			break;
+	}
+	slot->checks++;
+	mutex_unlock(&ice_pacing_lock);
+
+	if (!i)
+		return 1;
+
+	timeval_from_us(&ag->next_check, tick * TIMER_RUN_INTERVAL * 1000);
+	return 0;
+}
+
 static void __fail_pair(struct ice_candidate_pair *pair) {
 	ilog(LOG_DEBUG, "Setting ICE candidate pair "PAIR_FORMAT" as failed", PAIR_FMT(pair));
 	PAIR_SET(pair, FAILED);
@@ -594,6 +664,9 @@ static void __do_ice_check(struct ice_candidate_pair *pair) {
 
 	mutex_lock(&ag->lock);
 
+	// re-inserted below with the new time
+	g_tree_remove(ag->retransmit_pairs, pair);
+
 	pair->retransmit = rtpe_now;
 	if (!PAIR_SET(pair, IN_PROGRESS)) {
 		PAIR_CLEAR2(pair, FROZEN, FAILED);
@@ -610,6 +683,7 @@ static void __do_ice_check(struct ice_candidate_pair *pair) {
 		pair->retransmits++;
 	}
 	timeval_add_usec(&pair->retransmit, pair->retransmit_ms * 1000);
+	g_tree_insert(ag->retransmit_pairs, pair, pair);
 	__agent_schedule_abs(pair->agent, &pair->retransmit);
 	memcpy(transact, pair->stun_transaction, sizeof(transact));
 
@@ -623,7 +697,7 @@ static void __do_ice_check(struct ice_candidate_pair *pair) {
 			PAIR_FMT(pair), sockaddr_print_buf(&pair->local_intf->spec->local_address.addr),
 			FMT_M(endpoint_print_buf(&pair->remote_candidate->endpoint)));
 
-	stun_binding_request(&pair->remote_candidate->endpoint, transact, &ag->pwd[0], ag->ufrag,
+	stun_binding_request(&pair->remote_candidate->endpoint, transact, &ag->pwd[0], &ag->hmac[0], ag->ufrag,
 			AGENT_ISSET(ag, CONTROLLING), tie_breaker,
 			prio, &sfd->socket,
 			PAIR_ISSET(pair, TO_USE));
@@ -676,14 +750,25 @@ static void __nominate_pairs(struct ice_agent *ag) {
 	g_queue_clear(&complete);
 }
 
+/* agent must be locked */
+static struct ice_candidate_pair *__valid_pair(struct ice_candidate_pair **valid, struct ice_agent *ag,
+		unsigned int component)
+{
+	if (component >= 1 && component <= MAX_COMPONENTS)
+		return valid[component - 1];
+	return __get_pair_by_component(ag->valid_pairs, component);
+}
+
 /* call must be locked R or W, agent must not be locked */
 static void __do_ice_checks(struct ice_agent *ag) {
 	GList *l;
 	struct ice_candidate_pair *pair, *highest = NULL, *frozen = NULL, *valid;
+	struct ice_candidate_pair *valid_comps[MAX_COMPONENTS];
 	struct stream_fd *sfd;
 	GQueue retransmits = G_QUEUE_INIT;
 	struct timeval next_run = {0,0};
 	int have_more = 0;
+	unsigned int i;
 
 	if (!ag) {
 		ilog(LOG_ERR, "ice ag is NULL");
@@ -716,6 +801,37 @@ static void __do_ice_checks(struct ice_agent *ag) {
 		goto check;
 	}
 
+	for (i = 0; i < MAX_COMPONENTS; i++)
+		valid_comps[i] = __get_pair_by_component(ag->valid_pairs, i + 1);
+
+	/* handle retransmits that are due, in order of their deadlines. pairs that have changed
+	 * state in the meantime are dropped here */
+	while ((pair = g_tree_find_first(ag->retransmit_pairs, NULL, NULL))) {
+		if (timeval_cmp(&pair->retransmit, &rtpe_now) > 0) {
+			timeval_lowest(&next_run, &pair->retransmit);
+			break;
+		}
+		g_tree_remove(ag->retransmit_pairs, pair);
+
+		if (!PAIR_ISSET(pair, IN_PROGRESS) || PAIR_ISSET(pair, FAILED))
+			continue;
+		if (PAIR_ISSET(pair, SUCCEEDED) && !PAIR_ISSET(pair, TO_USE))
+			continue;
+		sfd = pair->sfd;
+		if (!sfd || !sfd->stream || !sfd->stream->selected_sfd)
+			continue;
+		/* but only if our priority is lower than any valid pair */
+		valid = __valid_pair(valid_comps, ag, pair->remote_candidate->component_id);
+		if (valid && valid->pair_priority > pair->pair_priority)
+			continue;
+
+		g_queue_push_tail(&retransmits, pair); /* can't run check directly due to locks */
+	}
+
+	/* nothing else to do if we're in or past the final phase */
+	if (AGENT_ISSET2(ag, NOMINATING, COMPLETED))
+		goto check;
+
 	/* find the highest-priority non-frozen non-in-progress pair */
 	for (l = ag->all_pairs_list.head; l; l = l->next) {
 		pair = l->data;
@@ -730,28 +846,12 @@ static void __do_ice_checks(struct ice_agent *ag) {
 			continue;
 		if (PAIR_ISSET(pair, SUCCEEDED) && !PAIR_ISSET(pair, TO_USE))
 			continue;
-
-		valid = __get_pair_by_component(ag->valid_pairs, pair->remote_candidate->component_id);
-
-		if (PAIR_ISSET(pair, IN_PROGRESS)) {
-			/* handle retransmits */
-			/* but only if our priority is lower than any valid pair */
-			if (valid && valid->pair_priority > pair->pair_priority)
-				continue;
-
-			if (timeval_cmp(&pair->retransmit, &rtpe_now) <= 0)
-				g_queue_push_tail(&retransmits, pair); /* can't run check directly
-									  due to locks */
-			else
-				timeval_lowest(&next_run, &pair->retransmit);
+		/* retransmits are handled above */
+		if (PAIR_ISSET(pair, IN_PROGRESS))
 			continue;
-		}
 
 		/* don't do anything else if we already have a valid pair */
-		if (valid)
-			continue;
-		/* or if we're in or past the final phase */
-		if (AGENT_ISSET2(ag, NOMINATING, COMPLETED))
+		if (__valid_pair(valid_comps, ag, pair->remote_candidate->component_id))
 			continue;
 
 		have_more = 1;
@@ -779,6 +879,13 @@ static void __do_ice_checks(struct ice_agent *ag) {
 	else
 		pair = NULL;
 
+	if (pair && !__ice_pace(ag)) {
+		__DBG("pacing ordinary check on " PAIR_FORMAT, PAIR_FMT(pair));
+		pair = NULL;
+		have_more = 0;
+		timeval_lowest(&next_run, &ag->next_check);
+	}
+
 check:
 	mutex_unlock(&ag->lock);
 
@@ -1051,6 +1158,8 @@ static int __check_valid(struct ice_agent *ag) {
 	}
 
 	call_media_unkernelize(media);
+	// candidates and addresses in the SDP follow the selected pair
+	call_sdp_changed(media->call);
 
 	g_queue_clear(&all_compos);
 	return 1;
@@ -1368,3 +1477,29 @@ void ice_remote_candidates(GQueue *out, struct ice_agent *ag) {
 
 	g_queue_clear(&all_compos);
 }
+
+/* lets the kernel module answer consent freshness checks once ICE has completed. called with
+ * the call lock held in R, while the credentials only change under W. requests that don't match
+ * these credentials are still passed up to us, e.g. after an ICE restart */
+void ice_kernel_info(struct ice_agent *ag, struct rtpengine_target_info *reti) {
+	if (!ag)
+		return;
+	if (!AGENT_ISSET(ag, COMPLETED))
+		return;
+	if (!ag->ufrag[1].len || ag->ufrag[1].len > sizeof(reti->ice.ufrag))
+		return;
+	if (!ag->pwd[1].len || ag->pwd[1].len > sizeof(reti->ice.pwd))
+		return;
+
+	memcpy(reti->ice.ufrag, ag->ufrag[1].s, ag->ufrag[1].len);
+	reti->ice.ufrag_len = ag->ufrag[1].len;
+	memcpy(reti->ice.pwd, ag->pwd[1].s, ag->pwd[1].len);
+	reti->ice.pwd_len = ag->pwd[1].len;
+
+	if (AGENT_ISSET(ag, LITE_SELF))
+		;
+	else if (AGENT_ISSET(ag, CONTROLLING))
+		reti->ice_controlling = 1;
+	else
+		reti->ice_controlled = 1;
+}
@@ -1,6 +1,19 @@
 #include "iptables.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <glib.h>
+
 #include "main.h"
 #include "str.h"
+#include "aux.h"
+#include "log.h"
 
 int (*iptables_add_rule)(const socket_t *local_sock, const str *comment);
 int (*iptables_del_rule)(const socket_t *local_sock);
@@ -310,6 +323,233 @@ static int __iptables_del_rule(const socket_t *local_sock) {
 
 #endif // WITH_IPTABLES_OPTION
 
+
+
+// ipset support: one netlink message per port, sent in batches by ipset_loop()
+
+#define IPSET_PROTO_VERSION 6 // oldest one understood by all kernels that have ipset
+#define IPSET_BATCH_SIZE 0x10000
+
+struct ipset_op {
+	int cmd;
+	sockaddr_t addr;
+	unsigned int port;
+};
+
+static int ipset_fd = -1;
+static unsigned int ipset_seq;
+static mutex_t ipset_lock = MUTEX_STATIC_INIT;
+static cond_t ipset_cond = COND_STATIC_INIT;
+static GQueue ipset_ops = G_QUEUE_INIT;
+
+static struct nlattr *nla_put(char **p, uint16_t type, const void *data, unsigned int len) {
+	struct nlattr *nla = (void *) *p;
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len)
+		memcpy(*p + NLA_HDRLEN, data, len);
+	*p += NLA_ALIGN(nla->nla_len);
+	return nla;
+}
+INLINE void nla_put_u8(char **p, uint16_t type, uint8_t val) {
+	nla_put(p, type, &val, sizeof(val));
+}
+INLINE void nla_put_str(char **p, uint16_t type, const char *s) {
+	nla_put(p, type, s, strlen(s) + 1);
+}
+INLINE struct nlattr *nla_nest_start(char **p, uint16_t type) {
+	return nla_put(p, type | NLA_F_NESTED, NULL, 0);
+}
+INLINE void nla_nest_end(char **p, struct nlattr *nla) {
+	nla->nla_len = *p - (char *) nla;
+}
+
+// appends one request to the buffer, which must have enough room
+static void ipset_msg(char **p, int cmd, int af, const char *name, const sockaddr_t *addr, unsigned int port) {
+	struct nlmsghdr *nlh = (void *) *p;
+	nlh->nlmsg_type = (NFNL_SUBSYS_IPSET << 8) | cmd;
+	nlh->nlmsg_flags = NLM_F_REQUEST; // without NLM_F_EXCL, existing or missing entries aren't errors
+	nlh->nlmsg_seq = ++ipset_seq;
+	*p += NLMSG_HDRLEN;
+
+	struct nfgenmsg *nfg = (void *) *p;
+	nfg->nfgen_family = af;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = 0;
+	*p += NLMSG_ALIGN(sizeof(*nfg));
+
+	nla_put_u8(p, IPSET_ATTR_PROTOCOL, IPSET_PROTO_VERSION);
+	nla_put_str(p, IPSET_ATTR_SETNAME, name);
+
+	if (addr) {
+		struct nlattr *data = nla_nest_start(p, IPSET_ATTR_DATA);
+		struct nlattr *ip = nla_nest_start(p, IPSET_ATTR_IP);
+		if (af == AF_INET)
+			nla_put(p, IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER, &addr->u.ipv4, 4);
+		else
+			nla_put(p, IPSET_ATTR_IPADDR_IPV6 | NLA_F_NET_BYTEORDER, &addr->u.ipv6, 16);
+		nla_nest_end(p, ip);
+		uint16_t nport = htons(port);
+		nla_put(p, IPSET_ATTR_PORT | NLA_F_NET_BYTEORDER, &nport, sizeof(nport));
+		nla_put_u8(p, IPSET_ATTR_PROTO, IPPROTO_UDP);
+		nla_nest_end(p, data);
+	}
+
+	nlh->nlmsg_len = *p - (char *) nlh;
+}
+
+static const char *ipset_name(int af) {
+	if (af == AF_INET)
+		return rtpe_config.ipset;
+	if (af == AF_INET6)
+		return rtpe_config.ipset6;
+	return NULL;
+}
+
+// errors are reported asynchronously, so just log them
+static void ipset_read_errors(void) {
+	char buf[8192];
+
+	while (1) {
+		ssize_t len = recv(ipset_fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len <= 0)
+			break;
+		for (struct nlmsghdr *nlh = (void *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			struct nlmsgerr *e = NLMSG_DATA(nlh);
+			if (e->error)
+				ilog(LOG_ERROR | LOG_FLAG_LIMIT, "Error updating ipset: %s", strerror(-e->error));
+		}
+	}
+}
+
+static void ipset_send(char *buf, size_t len) {
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+	if (sendto(ipset_fd, buf, len, 0, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+		ilog(LOG_ERROR | LOG_FLAG_LIMIT, "Failed to send ipset update: %s", strerror(errno));
+	ipset_read_errors();
+}
+
+static int __ipset_push(int cmd, const socket_t *local_sock) {
+	if (!local_sock || !local_sock->family)
+		return 0;
+	if (!ipset_name(local_sock->family->af))
+		return 0;
+
+	struct ipset_op *op = g_slice_alloc(sizeof(*op));
+	op->cmd = cmd;
+	op->addr = local_sock->local.address;
+	op->port = local_sock->local.port;
+
+	mutex_lock(&ipset_lock);
+	g_queue_push_tail(&ipset_ops, op);
+	if (ipset_ops.length == 1)
+		cond_signal(&ipset_cond);
+	mutex_unlock(&ipset_lock);
+
+	return 0;
+}
+
+static int __ipset_add_rule(const socket_t *local_sock, const str *comment) {
+	return __ipset_push(IPSET_CMD_ADD, local_sock);
+}
+static int __ipset_del_rule(const socket_t *local_sock) {
+	return __ipset_push(IPSET_CMD_DEL, local_sock);
+}
+
+// sends out all queued changes, as many per system call as fit in the buffer
+void ipset_loop(void *p) {
+	char *buf = malloc(IPSET_BATCH_SIZE);
+	// upper bound of one message
+	const size_t max_msg = NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg)) + 256
+		+ NLA_ALIGN(IPSET_MAXNAMELEN);
+
+	mutex_lock(&ipset_lock);
+
+	while (!rtpe_shutdown) {
+		if (!ipset_ops.length) {
+			rtpe_now_coarse();
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&ipset_cond, &ipset_lock, &tv);
+			continue;
+		}
+
+		GQueue ops = ipset_ops;
+		g_queue_init(&ipset_ops);
+		mutex_unlock(&ipset_lock);
+
+		memset(buf, 0, IPSET_BATCH_SIZE);
+		char *bp = buf;
+		struct ipset_op *op;
+		while ((op = g_queue_pop_head(&ops))) {
+			if (bp - buf + max_msg > IPSET_BATCH_SIZE) {
+				ipset_send(buf, bp - buf);
+				memset(buf, 0, IPSET_BATCH_SIZE);
+				bp = buf;
+			}
+			int af = op->addr.family->af;
+			ipset_msg(&bp, op->cmd, af, ipset_name(af), &op->addr, op->port);
+			g_slice_free1(sizeof(*op), op);
+		}
+		if (bp != buf)
+			ipset_send(buf, bp - buf);
+
+		mutex_lock(&ipset_lock);
+	}
+
+	mutex_unlock(&ipset_lock);
+	free(buf);
+}
+
+static int ipset_init(void) {
+	struct sockaddr_nl sa = { .nl_family = AF_NETLINK };
+
+	ipset_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+	if (ipset_fd == -1) {
+		ilog(LOG_ERROR, "Failed to open netlink socket for ipset: %s", strerror(errno));
+		return -1;
+	}
+	if (bind(ipset_fd, (struct sockaddr *) &sa, sizeof(sa))) {
+		ilog(LOG_ERROR, "Failed to bind netlink socket for ipset: %s", strerror(errno));
+		close(ipset_fd);
+		ipset_fd = -1;
+		return -1;
+	}
+
+	// flush the sets, synchronously, so that configuration errors show up right away
+	char buf[512] = {0};
+	char *bp = buf;
+	if (rtpe_config.ipset)
+		ipset_msg(&bp, IPSET_CMD_FLUSH, AF_INET, rtpe_config.ipset, NULL, 0);
+	if (rtpe_config.ipset6)
+		ipset_msg(&bp, IPSET_CMD_FLUSH, AF_INET6, rtpe_config.ipset6, NULL, 0);
+	for (struct nlmsghdr *nlh = (void *) buf; (char *) nlh < bp; nlh = (void *) ((char *) nlh + NLMSG_ALIGN(nlh->nlmsg_len)))
+		nlh->nlmsg_flags |= NLM_F_ACK;
+
+	if (send(ipset_fd, buf, bp - buf, 0) < 0) {
+		ilog(LOG_ERROR, "Failed to flush ipset: %s", strerror(errno));
+		return 0;
+	}
+	for (int acks = (rtpe_config.ipset ? 1 : 0) + (rtpe_config.ipset6 ? 1 : 0); acks > 0; ) {
+		ssize_t len = recv(ipset_fd, buf, sizeof(buf), 0);
+		if (len <= 0)
+			break;
+		for (struct nlmsghdr *nlh = (void *) buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			acks--;
+			struct nlmsgerr *e = NLMSG_DATA(nlh);
+			if (e->error)
+				ilog(LOG_ERROR, "Failed to flush ipset: %s", strerror(-e->error));
+		}
+	}
+
+	return 0;
+}
+
 static int __iptables_stub(void) {
 	return 0;
 }
@@ -318,6 +558,25 @@ static int __iptables_stub(void) {
 void iptables_init(void) {
 	if (rtpe_config.iptables_chain && !rtpe_config.iptables_chain[0])
 		rtpe_config.iptables_chain = NULL;
+	if (rtpe_config.ipset && !rtpe_config.ipset[0])
+		rtpe_config.ipset = NULL;
+	if (rtpe_config.ipset6 && !rtpe_config.ipset6[0])
+		rtpe_config.ipset6 = NULL;
+
+	if (rtpe_config.ipset || rtpe_config.ipset6) {
+		if (rtpe_config.iptables_chain)
+			ilog(LOG_WARN, "Using ipset for media ports, ignoring --iptables-chain");
+		rtpe_config.iptables_chain = NULL;
+		if (ipset_init()) {
+			rtpe_config.ipset = rtpe_config.ipset6 = NULL;
+			iptables_add_rule = (void *) __iptables_stub;
+			iptables_del_rule = (void *) __iptables_stub;
+			return;
+		}
+		iptables_add_rule = __ipset_add_rule;
+		iptables_del_rule = __ipset_del_rule;
+		return;
+	}
 
 	if (!rtpe_config.iptables_chain) {
 		iptables_add_rule = (void *) __iptables_stub;
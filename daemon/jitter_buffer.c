@@ -5,6 +5,7 @@
 #include "codec.h"
 #include "main.h"
 #include "rtcplib.h"
+#include "trace.h"
 #include <math.h>
 #include <errno.h>
 
@@ -14,25 +15,162 @@
 #define CLOCK_DRIFT_MULT 0x28
 #define DELAY_FACTOR 0x64
 #define COMFORT_NOISE 0x0D
+#define ADAPTIVE_JITTER_MULT 3 // adaptive playout delay in multiples of the jitter
 
 
-static struct timerthread jitter_buffer_thread;
+// run by the threads of the poller that handles the call's sockets
+static struct timerthread_pollers jitter_buffer_timers;
+
+static void jitter_buffer_run(void *ptr);
+static void set_jitter_values(struct media_packet *mp);
 
 
 void jitter_buffer_init(void) {
 	//ilog(LOG_DEBUG, "jitter_buffer_init");
-	timerthread_init(&jitter_buffer_thread, timerthread_queue_run);
+	timerthread_pollers_init(&jitter_buffer_timers, jitter_buffer_run, NULL);
 }
 
 void jitter_buffer_init_free(void) {
 	//ilog(LOG_DEBUG, "jitter_buffer_free");
-	timerthread_free(&jitter_buffer_thread);
+	timerthread_pollers_free(&jitter_buffer_timers);
 }
 
-static void jitter_buffer_flush(struct jitter_buffer *jb) {
+// jb is locked. releases what the slot holds on to, but keeps the buffer for reuse
+static void jb_packet_release(struct jb_packet *p) {
+	if (p->mp.sfd)
+		obj_put(p->mp.sfd);
+	p->mp = (struct media_packet) {0,};
+	p->state = JB_SLOT_EMPTY;
+}
+
+// jb is locked. copies the packet into the given slot, without allocating anything
+// once the slot's buffer is large enough
+static int jb_packet_fill(struct jb_packet *p, struct media_packet *mp, const str *s, atomic64 *mem) {
+	unsigned int size = s->len + RTP_BUFFER_HEAD_ROOM + RTP_BUFFER_TAIL_ROOM;
+	if (size > p->buf_size) {
+		char *buf = realloc(p->buf, size);
+		if (!buf) {
+			ilog(LOG_ERROR, "Failed to allocate memory: %s", strerror(errno));
+			return -1;
+		}
+		call_mem_add(mem, size - p->buf_size);
+		p->buf = buf;
+		p->buf_size = size;
+	}
+
+	p->mp = (struct media_packet) {
+		.fsin = mp->fsin,
+		.tv = mp->tv,
+		.sfd = mp->sfd,
+		.call = mp->call,
+		.stream = mp->stream,
+		.media = mp->media,
+	};
+	obj_hold(p->mp.sfd);
+
+	str_init_len(&p->mp.raw, p->buf + RTP_BUFFER_HEAD_ROOM, s->len);
+	memcpy(p->mp.raw.s, s->s, s->len);
+
+	if (rtp_payload(&p->mp.rtp, &p->mp.payload, &p->mp.raw)) {
+		jb_packet_release(p);
+		return -1;
+	}
+
+	return 0;
+}
+
+// jb is locked. returns the queued packet that is next in sequence
+static struct jb_packet *jb_next(struct jitter_buffer *jb) {
+	if (!jb->ring_count)
+		return NULL;
+	for (unsigned int i = 0; i <= jb->ring_mask; i++) {
+		struct jb_packet *p = &jb->ring[(jb->ring_head + i) & jb->ring_mask];
+		if (p->state == JB_SLOT_QUEUED)
+			return p;
+	}
+	return NULL;
+}
+
+// not to schedule a wakeup for less than 1 ms
+static int jb_due(const struct timeval *when) {
+	return timeval_diff(when, &rtpe_now) <= 1000;
+}
+
+// jb is locked. plays out one queued packet, which skips over any missing ones before it.
+// the lock is released meanwhile, and also the call's master lock if it's held
+static void jb_play(struct jitter_buffer *jb, struct jb_packet *p, int call_locked) {
+	p->state = JB_SLOT_PLAYING;
+	jb->ring_count--;
+	jb->ring_head = (p->seq + 1) & 0xffff;
+
+	TRACE(jb->call, p->mp.sfd ? p->mp.sfd->socket.local.port : 0, JB_PLAY, p->seq,
+			ntohl(p->mp.rtp->timestamp), jb->ring_count,
+			timeval_diff(&rtpe_now, &p->when) / 1000);
+
 	mutex_unlock(&jb->lock);
-	timerthread_queue_flush_data(&jb->ttq);
+	if (call_locked)
+		call_packet_unlock(jb->call);
+
+	set_jitter_values(&p->mp);
+	play_buffered(p);
+
+	if (call_locked)
+		call_packet_lock(jb->call);
 	mutex_lock(&jb->lock);
+
+	jb_packet_release(p);
+}
+
+// jb is locked
+static void jitter_buffer_flush(struct jitter_buffer *jb) {
+	struct jb_packet *p;
+	while ((p = jb_next(jb)))
+		jb_play(jb, p, 0);
+}
+
+// jb and call are locked. puts the packet into its ring slot and makes sure that the jitter
+// buffer runs when it's due. returns 0 if the packet was consumed
+static int jb_queue(struct jitter_buffer *jb, struct media_packet *mp, const str *s,
+		const struct timeval *when)
+{
+	unsigned int seq = ntohs(mp->rtp->seq_num);
+
+	if (!jb->ring_count)
+		jb->ring_head = seq;
+
+	uint16_t dist = seq - jb->ring_head;
+	if (dist >= 0x8000)
+		return 1; // behind the playout point already, send right away
+	if (dist > jb->ring_mask) {
+		// too far ahead: play out everything and start over from here
+		jitter_buffer_flush(jb);
+		jb->ring_head = seq;
+	}
+
+	struct jb_packet *p = &jb->ring[seq & jb->ring_mask];
+	if (p->state != JB_SLOT_EMPTY)
+		return 1; // duplicate, or still being played out
+	if (jb_packet_fill(p, mp, s, jb->call ? &jb->call->mem[CALL_MEM_JB] : NULL))
+		return 1;
+
+	p->when = *when;
+	p->seq = seq;
+	p->state = JB_SLOT_QUEUED;
+	jb->ring_count++;
+
+	TRACE(jb->call, mp->sfd ? mp->sfd->socket.local.port : 0, JB_QUEUE, seq,
+			ntohl(mp->rtp->timestamp), jb->ring_count, timeval_diff(when, &rtpe_now) / 1000);
+
+	if (jb_due(when) && jb_next(jb) == p)
+		jb_play(jb, p, 1);
+	else {
+		// the call may have been moved to another poller meanwhile
+		if (jb->call)
+			timerthread_obj_follow(&jb->ttq.tt_obj, &jitter_buffer_timers, jb->call->poller);
+		timerthread_obj_schedule_abs(&jb->ttq.tt_obj, when);
+	}
+
+	return 0;
 }
 
 
@@ -54,9 +192,12 @@ static void reset_jitter_buffer(struct jitter_buffer *jb) {
 	jb->clock_drift_val     = 0;
 	jb->prev_seq_ts         = rtpe_now;
 	jb->prev_seq            = 0;
+	jb->transit		= 0;
+	jb->jitter		= 0;
+	jb->target_len		= 0;
 
 	jb->num_resets++;
-	if(g_tree_nnodes(jb->ttq.entries) > 0)
+	if(jb->ring_count > 0)
 		jitter_buffer_flush(jb);
 
 	//disable jitter buffer in case of more than 2 resets
@@ -98,39 +239,52 @@ static int get_clock_rate(struct media_packet *mp, int payload_type) {
 	return clock_rate;
 }
 
-static struct jb_packet* get_jb_packet(struct media_packet *mp, const str *s) {
-	char *buf = malloc(s->len + RTP_BUFFER_HEAD_ROOM + RTP_BUFFER_TAIL_ROOM);
-	if (!buf) {
-		ilog(LOG_ERROR, "Failed to allocate memory: %s", strerror(errno));
-		return NULL;
-	}
-
-	struct jb_packet *p = g_slice_alloc0(sizeof(*p));
-
-	p->buf = buf;
-	media_packet_copy(&p->mp, mp);
-
-	str_init_len(&p->mp.raw, buf + RTP_BUFFER_HEAD_ROOM, s->len);
-	memcpy(p->mp.raw.s, s->s, s->len);
-
-	if(rtp_payload(&p->mp.rtp, &p->mp.payload, &p->mp.raw)) {
-		jb_packet_free(&p);
-		return NULL;
-	}
-
-	return p;
-}
-
 // jb is locked
 static void check_buffered_packets(struct jitter_buffer *jb) {
-	if (g_tree_nnodes(jb->ttq.entries) >= (3* rtpe_config.jb_length)) {
+	if (jb->ring_count >= (3* rtpe_config.jb_length)) {
 		ilog(LOG_DEBUG, "Jitter reset due to buffer overflow");
 		reset_jitter_buffer(jb);
 	}
 }
 
-// jb is locked
-static int queue_packet(struct media_packet *mp, struct jb_packet *p) {
+// jb is locked. RFC 3550 A.8, same as codec_calc_jitter()
+static void calc_jitter(struct jitter_buffer *jb, struct media_packet *mp, unsigned int clockrate) {
+	uint32_t transit = (((timeval_us(&mp->tv) / 1000) * clockrate) / 1000)
+		- ntohl(mp->rtp->timestamp);
+	int32_t d = 0;
+	if (jb->transit)
+		d = transit - jb->transit;
+	jb->transit = transit;
+	if (d < 0)
+		d = -d;
+	jb->jitter += d - ((jb->jitter + 8) >> 4);
+
+	if (!jb->rtptime_delta)
+		return;
+	unsigned int delay = (jb->jitter >> 4) * ADAPTIVE_JITTER_MULT;
+	jb->target_len = (delay + jb->rtptime_delta - 1) / jb->rtptime_delta;
+	if (jb->target_len > rtpe_config.jb_length)
+		jb->target_len = rtpe_config.jb_length;
+}
+
+// jb is locked. called when the playout point is re-established, normally at the start
+// of a talkspurt, so that changing the delay doesn't cause a glitch
+static void adapt_playout_delay(struct jitter_buffer *jb) {
+	int old_len = jb->buffer_len;
+
+	// grow at once to avoid late packets, but shrink gradually
+	if (jb->target_len > jb->buffer_len)
+		jb->buffer_len = jb->target_len;
+	else if (jb->target_len < jb->buffer_len)
+		jb->buffer_len--;
+
+	if (jb->buffer_len != old_len)
+		ilog(LOG_DEBUG, "Adaptive jitter buffer: jitter %u, playout delay %i -> %i packets",
+				jb->jitter >> 4, old_len, jb->buffer_len);
+}
+
+// jb and call are locked
+static int queue_packet(struct media_packet *mp, const str *s) {
 	struct jitter_buffer *jb = mp->stream->jb;
 	unsigned long ts = ntohl(mp->rtp->timestamp);
 	int payload_type =  (mp->rtp->m_pt & 0x7f);
@@ -153,42 +307,40 @@ static int queue_packet(struct media_packet *mp, struct jb_packet *p) {
 		jb->rtptime_delta = ts_diff/seq_diff;
 	}
 
-	p->ttq_entry.when = jb->first_send;
+	struct timeval when = jb->first_send;
 	long long ts_diff_us =
 		(long long) (ts_diff + (jb->rtptime_delta * jb->buffer_len))* 1000000 / clockrate;
 
 	ts_diff_us += (jb->clock_drift_val * seq_diff); 
 	ts_diff_us += (jb->dtmf_mult_factor * DELAY_FACTOR);
 
-	timeval_add_usec(&p->ttq_entry.when, ts_diff_us);
+	timeval_add_usec(&when, ts_diff_us);
 
-	ts_diff_us = timeval_diff(&p->ttq_entry.when, &rtpe_now);
+	ts_diff_us = timeval_diff(&when, &rtpe_now);
 
 	if (ts_diff_us > 1000000) { // more than one second, can't be right
 		ilog(LOG_DEBUG, "Partial reset due to timestamp");
 		jb->first_send.tv_sec = 0;
-		p->ttq_entry.when = rtpe_now;
+		when = rtpe_now;
 	}
 
 	if(jb->prev_seq_ts.tv_sec == 0)
 		jb->prev_seq_ts = rtpe_now;
 
-	if((timeval_diff(&p->ttq_entry.when, &jb->prev_seq_ts) < 0) &&  (curr_seq > jb->prev_seq)) {
-		p->ttq_entry.when =  jb->prev_seq_ts;
-		timeval_add_usec(&p->ttq_entry.when, DELAY_FACTOR);
+	if((timeval_diff(&when, &jb->prev_seq_ts) < 0) &&  (curr_seq > jb->prev_seq)) {
+		when =  jb->prev_seq_ts;
+		timeval_add_usec(&when, DELAY_FACTOR);
 	}
 
-	if(timeval_diff(&p->ttq_entry.when, &jb->prev_seq_ts) > 0) {
-		jb->prev_seq_ts = p->ttq_entry.when;
+	if(timeval_diff(&when, &jb->prev_seq_ts) > 0) {
+		jb->prev_seq_ts = when;
 		jb->prev_seq = curr_seq;
 	}
 
 	if(seq_diff > 3000)  //readjust after 3k packets
 		jb->first_send.tv_sec = 0;
 
-	timerthread_queue_push(&jb->ttq, &p->ttq_entry);
-
-	return 0;
+	return jb_queue(jb, mp, s, &when);
 }
 
 static int handle_clock_drift(struct media_packet *mp) {
@@ -223,7 +375,6 @@ static int handle_clock_drift(struct media_packet *mp) {
 }
 
 int buffer_packet(struct media_packet *mp, const str *s) {
-	struct jb_packet *p = NULL;
 	int ret = 1; // must call stream_packet
 
 	mp->stream = mp->sfd->stream;
@@ -231,7 +382,7 @@ int buffer_packet(struct media_packet *mp, const str *s) {
 	mp->call = mp->sfd->call;
 	struct call *call = mp->call;
 
-	rwlock_lock_r(&call->master_lock);
+	call_packet_lock(call);
 
 	struct jitter_buffer *jb = mp->stream->jb;
 	if (!jb || jb->disabled || !PS_ISSET(mp->sfd->stream, RTP))
@@ -242,19 +393,22 @@ int buffer_packet(struct media_packet *mp, const str *s) {
 		goto end;
 	}
 
-	p = get_jb_packet(mp, s);
-	if (!p)
+	// look at the header in place. the packet is only copied into its ring slot once it's
+	// actually queued
+	struct media_packet hdr = *mp;
+	str raw = *s;
+	if (rtp_payload(&hdr.rtp, &hdr.payload, &raw))
 		goto end;
 
-        if (PS_ISSET(mp->sfd->stream, RTCP) && rtcp_demux_is_rtcp((void *) &p->mp.raw)){
-            ilog(LOG_DEBUG, "Discarding from JB. This is RTCP packet. SSRC %u Payload %d", ntohl(p->mp.rtp->ssrc), (p->mp.rtp->m_pt & 0x7f));
+        if (PS_ISSET(mp->sfd->stream, RTCP) && rtcp_demux_is_rtcp((void *) s)){
+            ilog(LOG_DEBUG, "Discarding from JB. This is RTCP packet. SSRC %u Payload %d", ntohl(hdr.rtp->ssrc), (hdr.rtp->m_pt & 0x7f));
             goto end;
         }
 	
 	ilog(LOG_DEBUG, "Handling JB packet on: %s:%d (RTP SSRC %u Payload: %d)", sockaddr_print_buf(&mp->stream->endpoint.address),
-            mp->stream->endpoint.port, ntohl(p->mp.rtp->ssrc), (p->mp.rtp->m_pt & 0x7f));
+            mp->stream->endpoint.port, ntohl(hdr.rtp->ssrc), (hdr.rtp->m_pt & 0x7f));
 
-	mp = &p->mp;
+	mp = &hdr;
 
 	mutex_lock(&jb->lock);
 
@@ -285,12 +439,18 @@ int buffer_packet(struct media_packet *mp, const str *s) {
 	}
 
 
+	if (rtpe_config.jb_adaptive && !dtmf) {
+		int clockrate = get_clock_rate(mp, payload_type);
+		if (clockrate)
+			calc_jitter(jb, mp, clockrate);
+	}
+
 	if (jb->first_send.tv_sec) {
 		if(rtpe_config.jb_clock_drift) {
 			if(handle_clock_drift(mp))
 				goto end_unlock;
 		}
-		ret = queue_packet(mp,p);
+		ret = queue_packet(mp, s);
 	}
 	else {
 		// store data from first packet and use for successive packets and queue the first packet
@@ -304,38 +464,39 @@ int buffer_packet(struct media_packet *mp, const str *s) {
 			}
 			goto end_unlock;
 		}
-		p->ttq_entry.when = jb->first_send = rtpe_now;
+		if (rtpe_config.jb_adaptive)
+			adapt_playout_delay(jb);
+		jb->first_send = rtpe_now;
 		jb->first_send_ts = ts;
 		jb->first_seq = ntohs(mp->rtp->seq_num);
 		jb->ssrc = ntohl(mp->rtp->ssrc);
 		if(jb->rtptime_delta)
-			ret = queue_packet(mp,p);
+			ret = queue_packet(mp, s);
                 if(!dtmf)
 			jb->rtptime_delta = 0;
 	}
 
-	// packet consumed?
-	if (ret == 0)
-		p = NULL;
-
 	check_buffered_packets(jb);
 
 end_unlock:
 	mutex_unlock(&jb->lock);
 
 end:
-	rwlock_unlock_r(&call->master_lock);
-	if (p)
-		jb_packet_free(&p);
+	call_packet_unlock(call);
 	return ret;
 }
 
+// in adaptive mode the delay follows the jitter estimate instead of packet loss
 static void increment_buffer(struct jitter_buffer *jb) {
+	if (rtpe_config.jb_adaptive)
+		return;
 	if(jb->buffer_len < rtpe_config.jb_length)
 		jb->buffer_len++;
 }
 
 static void decrement_buffer(struct jitter_buffer *jb) {
+	if (rtpe_config.jb_adaptive)
+		return;
 	if(jb->buffer_len > 0)
 		jb->buffer_len--;
 }
@@ -385,47 +546,52 @@ static void set_jitter_values(struct media_packet *mp) {
 		jb->next_exp_seq = curr_seq + 1;
 }
 
-static void __jb_send_later(struct timerthread_queue *ttq, void *p) {
-	struct jb_packet *cp = p;
-	set_jitter_values(&cp->mp);
-	play_buffered(p);
-};
-// jb and call are locked
-static void __jb_send_now(struct timerthread_queue *ttq, void *p) {
-	struct jitter_buffer *jb = (void *) ttq;
+// runs from the timer thread when the next packet is due
+static void jitter_buffer_run(void *ptr) {
+	struct jitter_buffer *jb = ptr;
+	struct timeval next = {0,};
+
+	mutex_lock(&jb->lock);
+
+	struct jb_packet *p;
+	while ((p = jb_next(jb))) {
+		if (!jb_due(&p->when)) {
+			next = p->when;
+			break;
+		}
+		jb_play(jb, p, 0);
+	}
 
 	mutex_unlock(&jb->lock);
-	rwlock_unlock_r(&jb->call->master_lock);
 
-	__jb_send_later(ttq, p);
+	if (next.tv_sec)
+		timerthread_obj_schedule_abs(&jb->ttq.tt_obj, &next);
+}
 
-	rwlock_lock_r(&jb->call->master_lock);
-	mutex_lock(&jb->lock);
-};
 static void __jb_free(void *p) {
 	struct jitter_buffer *jb = p;
 	jitter_buffer_free(&jb);
 }
-void __jb_packet_free(void *p) {
-	struct jb_packet *jbp = p;
-	jb_packet_free(&jbp);
-}
-
-void jitter_buffer_loop(void *p) {
-	ilog(LOG_DEBUG, "jitter_buffer_loop");
-	timerthread_run(&jitter_buffer_thread);
-}
 
 struct jitter_buffer *jitter_buffer_new(struct call *c) {
 	ilog(LOG_DEBUG, "creating jitter_buffer");
 
+	// the queue's own entries aren't used, packets are kept in the ring instead
 	struct jitter_buffer *jb = timerthread_queue_new("jitter_buffer", sizeof(*jb),
-			&jitter_buffer_thread,
-			__jb_send_now,
-			__jb_send_later,
-			__jb_free, __jb_packet_free);
+			&timerthread_pollers_get(&jitter_buffer_timers, c->poller)->tt,
+			NULL, NULL,
+			__jb_free, NULL);
 	mutex_init(&jb->lock);
 	jb->call = obj_get(c);
+
+	// large enough to never wrap before check_buffered_packets() resets the buffer
+	unsigned int ring_size = 16;
+	while (ring_size <= 3 * rtpe_config.jb_length)
+		ring_size <<= 1;
+	jb->ring = g_new0(struct jb_packet, ring_size);
+	jb->ring_mask = ring_size - 1;
+	call_mem_add(&c->mem[CALL_MEM_JB], sizeof(*jb) + sizeof(*jb->ring) * ring_size);
+
 	return jb;
 }
 
@@ -435,17 +601,20 @@ void jitter_buffer_free(struct jitter_buffer **jbp) {
 
 	ilog(LOG_DEBUG, "freeing jitter_buffer");
 
+	struct jitter_buffer *jb = *jbp;
+	if (jb->ring) {
+		size_t mem = sizeof(*jb) + sizeof(*jb->ring) * (jb->ring_mask + 1);
+		for (unsigned int i = 0; i <= jb->ring_mask; i++) {
+			jb_packet_release(&jb->ring[i]);
+			mem += jb->ring[i].buf_size;
+			free(jb->ring[i].buf);
+		}
+		g_free(jb->ring);
+		if (jb->call)
+			call_mem_add(&jb->call->mem[CALL_MEM_JB], -(ssize_t) mem);
+	}
+
 	mutex_destroy(&(*jbp)->lock);
 	if ((*jbp)->call)
 		obj_put((*jbp)->call);
 }
-
-void jb_packet_free(struct jb_packet **jbp) {
-	if (!jbp || !*jbp)
-		return;
-
-	free((*jbp)->buf);
-	media_packet_release(&(*jbp)->mp);
-	g_slice_free1(sizeof(**jbp), *jbp);
-	*jbp = NULL;
-}
@@ -8,11 +8,13 @@
 #include <unistd.h>
 #include <glib.h>
 #include <errno.h>
+#include <sys/mman.h>
 
 #include "xt_RTPENGINE.h"
 
 #include "aux.h"
 #include "log.h"
+#include "obj.h"
 
 
 
@@ -24,6 +26,28 @@
 
 struct kernel_interface kernel;
 
+// Target add/update/delete operations can be queued up and pushed to the kernel in a
+// single batch. Each thread opts in with kernel_batch_start(). The queue is shared and
+// any direct operation flushes it first, so the kernel always sees operations in the
+// order they were issued.
+static mutex_t kernel_batch_lock = MUTEX_STATIC_INIT;
+static unsigned int kernel_batch_num;
+static struct {
+	struct rtpengine_message msg;
+	struct rtpengine_batch_entry entries[KERNEL_BATCH_MAX];
+} kernel_batch_buf;
+static struct {
+	kernel_add_failed_t *failed;
+	void *arg;
+	struct obj *ref;
+} kernel_batch_owners[KERNEL_BATCH_MAX];
+static __thread unsigned int kernel_batching;
+
+// SSRC stats slots are handed out by us and passed to the kernel in the target info
+static mutex_t kernel_stats_slots_lock = MUTEX_STATIC_INIT;
+static BIT_ARRAY_DECLARE(kernel_stats_slots_used, RTPENGINE_SSRC_STATS_SLOTS);
+static unsigned int kernel_stats_slots_next;
+
 
 
 
@@ -89,11 +113,57 @@ fail:
 	return -1;
 }
 
+#define SSRC_STATS_MAP_SIZE (RTPENGINE_SSRC_STATS_HDR \
+		+ RTPENGINE_SSRC_STATS_SLOTS * sizeof(struct rtpengine_ssrc_stats_slot))
+
+// not fatal, older kernel modules don't provide it
+static void kernel_map_ssrc_stats(unsigned int id) {
+	char str[64];
+	int fd;
+	void *p;
+	struct rtpengine_ssrc_stats_map *hdr;
+
+	sprintf(str, PREFIX "/%u/ssrc_stats", id);
+	fd = open(str, O_RDONLY);
+	if (fd == -1) {
+		ilog(LOG_INFO, "Kernel module doesn't provide SSRC stats map (%s)", strerror(errno));
+		return;
+	}
+	p = mmap(NULL, SSRC_STATS_MAP_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		ilog(LOG_WARN, "Failed to map kernel SSRC stats: %s", strerror(errno));
+		return;
+	}
+
+	hdr = p;
+	if (hdr->slots != RTPENGINE_SSRC_STATS_SLOTS
+			|| hdr->slot_size != sizeof(struct rtpengine_ssrc_stats_slot))
+	{
+		ilog(LOG_WARN, "Kernel SSRC stats map has an unexpected layout, not using it");
+		munmap(p, SSRC_STATS_MAP_SIZE);
+		return;
+	}
+
+	kernel.ssrc_stats = p;
+}
+
+// not fatal either
+static void kernel_open_dtmf(unsigned int id) {
+	char str[64];
+
+	sprintf(str, PREFIX "/%u/dtmf", id);
+	kernel.dtmf_fd = open(str, O_RDONLY | O_NONBLOCK);
+	if (kernel.dtmf_fd == -1)
+		ilog(LOG_INFO, "Kernel module doesn't provide DTMF event reporting (%s)", strerror(errno));
+}
+
 int kernel_setup_table(unsigned int id) {
 	if (kernel.is_wanted)
 		abort();
 
 	kernel.is_wanted = 1;
+	kernel.dtmf_fd = -1;
 
 	if (kernel_delete_table(id) && errno != ENOENT) {
 		ilog(LOG_ERR, "FAILED TO DELETE KERNEL TABLE %i (%s), KERNEL FORWARDING DISABLED",
@@ -116,11 +186,123 @@ int kernel_setup_table(unsigned int id) {
 	kernel.table = id;
 	kernel.is_open = 1;
 
+	kernel_map_ssrc_stats(id);
+	kernel_open_dtmf(id);
+
+	return 0;
+}
+
+// takes over the control fd of a table that another process has handed over, with
+// all its targets left in place
+int kernel_adopt_table(unsigned int id, int fd) {
+	if (kernel.is_wanted)
+		abort();
+
+	kernel.is_wanted = 1;
+	kernel.dtmf_fd = -1;
+
+	kernel.fd = fd;
+	kernel.table = id;
+	kernel.is_open = 1;
+
+	kernel_map_ssrc_stats(id);
+	kernel_open_dtmf(id);
+
 	return 0;
 }
 
 
-int kernel_add_stream(struct rtpengine_target_info *mti, int update) {
+
+// kernel_batch_lock must be held
+static void __kernel_batch_flush(void) {
+	unsigned int num = kernel_batch_num;
+	int ret;
+
+	if (!num)
+		return;
+	kernel_batch_num = 0;
+
+	ZERO(kernel_batch_buf.msg);
+	kernel_batch_buf.msg.cmd = REMG_BATCH;
+	kernel_batch_buf.msg.u.batch.num = num;
+
+	size_t len = sizeof(kernel_batch_buf.msg) + sizeof(kernel_batch_buf.entries[0]) * num;
+	ret = read(kernel.fd, &kernel_batch_buf, len);
+	int batch_err = (ret != len) ? (errno ? : EIO) : 0;
+	if (batch_err)
+		ilog(LOG_ERROR | LOG_FLAG_LIMIT, "Failed to push batch of %u relay stream operations "
+				"to kernel: %s", num, strerror(batch_err));
+
+	// a failed batch as a whole fails all of its operations
+	for (unsigned int i = 0; i < num; i++) {
+		struct rtpengine_batch_entry *e = &kernel_batch_buf.entries[i];
+		int err = batch_err ? : -e->result;
+
+		if (err && !batch_err)
+			ilog(LOG_ERROR | LOG_FLAG_LIMIT, "Failed to %s relay stream in kernel: %s",
+					e->cmd == REMG_DEL ? "delete" : "push", strerror(err));
+		if (err && kernel_batch_owners[i].failed)
+			kernel_batch_owners[i].failed(kernel_batch_owners[i].arg);
+		if (kernel_batch_owners[i].ref)
+			obj_put_o(kernel_batch_owners[i].ref);
+		ZERO(kernel_batch_owners[i]);
+	}
+}
+
+void kernel_batch_start(void) {
+	kernel_batching++;
+}
+
+void kernel_batch_flush(void) {
+	if (!kernel_batching)
+		return;
+	if (--kernel_batching)
+		return;
+	if (!kernel.is_open)
+		return;
+	if (!kernel_batch_num) // unlocked check, anything queued by us is visible
+		return;
+
+	mutex_lock(&kernel_batch_lock);
+	__kernel_batch_flush();
+	mutex_unlock(&kernel_batch_lock);
+}
+
+// returns 1 if the operation was queued
+static int kernel_batch_queue(int cmd, const struct rtpengine_target_info *ti, const struct re_address *a,
+		kernel_add_failed_t *failed, void *arg, struct obj *ref)
+{
+	if (!kernel_batching)
+		return 0;
+
+	mutex_lock(&kernel_batch_lock);
+
+	if (kernel_batch_num >= KERNEL_BATCH_MAX)
+		__kernel_batch_flush();
+
+	kernel_batch_owners[kernel_batch_num].failed = failed;
+	kernel_batch_owners[kernel_batch_num].arg = arg;
+	kernel_batch_owners[kernel_batch_num].ref = ref ? obj_get_o(ref) : NULL;
+
+	struct rtpengine_batch_entry *e = &kernel_batch_buf.entries[kernel_batch_num++];
+	ZERO(*e);
+	e->cmd = cmd;
+	if (ti)
+		e->target = *ti;
+	else
+		e->target.local = *a;
+
+	mutex_unlock(&kernel_batch_lock);
+
+	return 1;
+}
+
+// returns 0 if the target was added, or if the operation was queued. `failed` is then
+// called if the kernel rejects it later on, from whichever thread pushes the batch and
+// with the batch lock held. `ref` is held until then
+int kernel_add_stream(struct rtpengine_target_info *mti, int update,
+		kernel_add_failed_t *failed, void *arg, struct obj *ref)
+{
 	struct rtpengine_message msg;
 	int ret;
 
@@ -128,14 +310,46 @@ int kernel_add_stream(struct rtpengine_target_info *mti, int update) {
 		return -1;
 
 	msg.cmd = update ? REMG_UPDATE : REMG_ADD;
+
+	if (kernel_batch_queue(msg.cmd, mti, NULL, failed, arg, ref))
+		return 0;
+
 	msg.u.target = *mti;
 
+	mutex_lock(&kernel_batch_lock);
+	__kernel_batch_flush();
 	// coverity[uninit_use_in_call : FALSE]
 	ret = write(kernel.fd, &msg, sizeof(msg));
+	mutex_unlock(&kernel_batch_lock);
 	if (ret > 0)
 		return 0;
 
-	ilog(LOG_ERROR, "Failed to push relay stream to kernel: %s", strerror(errno));
+	ilog(LOG_ERROR | LOG_FLAG_LIMIT, "Failed to push relay stream to kernel: %s", strerror(errno));
+	return -1;
+}
+
+
+// the target must have been added with num_destinations set, and destinations must be
+// added in order. goes out right away, after any batched target updates
+int kernel_add_destination(struct rtpengine_destination_info *mdi) {
+	struct rtpengine_message msg;
+	int ret;
+
+	if (!kernel.is_open)
+		return -1;
+
+	ZERO(msg);
+	msg.cmd = REMG_ADD_DESTINATION;
+	msg.u.destination = *mdi;
+
+	mutex_lock(&kernel_batch_lock);
+	__kernel_batch_flush();
+	ret = write(kernel.fd, &msg, sizeof(msg));
+	mutex_unlock(&kernel_batch_lock);
+	if (ret > 0)
+		return 0;
+
+	ilog(LOG_ERROR, "Failed to push relay stream destination to kernel: %s", strerror(errno));
 	return -1;
 }
 
@@ -147,11 +361,17 @@ int kernel_del_stream(const struct re_address *a) {
 	if (!kernel.is_open)
 		return -1;
 
+	if (kernel_batch_queue(REMG_DEL, NULL, a, NULL, NULL, NULL))
+		return 0;
+
 	ZERO(msg);
 	msg.cmd = REMG_DEL;
 	msg.u.target.local = *a;
 
+	mutex_lock(&kernel_batch_lock);
+	__kernel_batch_flush();
 	ret = write(kernel.fd, &msg, sizeof(msg));
+	mutex_unlock(&kernel_batch_lock);
 	if (ret > 0)
 		return 0;
 
@@ -164,7 +384,7 @@ GList *kernel_list() {
 	int fd;
 	struct rtpengine_list_entry *buf;
 	GList *li = NULL;
-	int ret;
+	int ret, i, num;
 
 	if (!kernel.is_open)
 		return NULL;
@@ -174,16 +394,21 @@ GList *kernel_list() {
 	if (fd == -1)
 		return NULL;
 
+	// pull in up to KERNEL_LIST_BATCH entries per read
+	buf = g_malloc(sizeof(*buf) * KERNEL_LIST_BATCH);
 
 	for (;;) {
-		buf = g_slice_alloc(sizeof(*buf));
-		ret = read(fd, buf, sizeof(*buf));
-		if (ret != sizeof(*buf))
+		ret = read(fd, buf, sizeof(*buf) * KERNEL_LIST_BATCH);
+		if (ret <= 0)
+			break;
+		num = ret / sizeof(*buf);
+		for (i = 0; i < num; i++)
+			li = g_list_prepend(li, g_slice_copy(sizeof(*buf), &buf[i]));
+		if (num < KERNEL_LIST_BATCH)
 			break;
-		li = g_list_prepend(li, buf);
 	}
 
-	g_slice_free1(sizeof(*buf), buf);
+	g_free(buf);
 	close(fd);
 
 	return li;
@@ -264,3 +489,78 @@ int kernel_update_stats(const struct re_address *a, uint32_t ssrc, struct rtpeng
 
 	return 0;
 }
+
+
+
+// returns a 1-based slot number, or zero if there's no map or it's full
+unsigned int kernel_stats_slot_get(void) {
+	unsigned int ret = 0;
+
+	if (!kernel.ssrc_stats)
+		return 0;
+
+	mutex_lock(&kernel_stats_slots_lock);
+	for (unsigned int i = 0; i < RTPENGINE_SSRC_STATS_SLOTS; i++) {
+		unsigned int slot = (kernel_stats_slots_next + i) % RTPENGINE_SSRC_STATS_SLOTS;
+		if (bit_array_set(kernel_stats_slots_used, slot))
+			continue;
+		kernel_stats_slots_next = slot + 1;
+		ret = slot + 1;
+		break;
+	}
+	mutex_unlock(&kernel_stats_slots_lock);
+
+	return ret;
+}
+
+void kernel_stats_slot_put(unsigned int slot) {
+	if (!slot)
+		return;
+	bit_array_clear(kernel_stats_slots_used, slot - 1);
+}
+
+// no syscall involved. fails if the slot is being updated continuously, or if it hasn't
+// been written to by the expected target yet
+int kernel_read_ssrc_stats(unsigned int slot, const struct re_address *a, uint32_t ssrc,
+		struct rtpengine_ssrc_stats *out)
+{
+	struct rtpengine_ssrc_stats_slot *s, copy;
+	uint32_t seq;
+
+	if (!kernel.ssrc_stats || !slot || slot > RTPENGINE_SSRC_STATS_SLOTS)
+		return -1;
+
+	s = kernel.ssrc_stats + RTPENGINE_SSRC_STATS_HDR + (slot - 1) * sizeof(*s);
+
+	for (int tries = 0; tries < 10; tries++) {
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1))
+			continue;
+		memcpy(&copy, s, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (copy.ssrc != ssrc || memcmp(&copy.local, a, sizeof(*a)))
+			return -1;
+		*out = copy.stats;
+		return 0;
+	}
+
+	return -1;
+}
+
+// returns the number of events read, never blocks
+int kernel_read_dtmf(struct rtpengine_dtmf_event *evs, unsigned int num) {
+	if (!kernel.is_open || kernel.dtmf_fd == -1)
+		return 0;
+
+	ssize_t ret = read(kernel.dtmf_fd, evs, sizeof(*evs) * num);
+	if (ret == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			ilog(LOG_ERR, "Failed to read DTMF events from kernel: %s", strerror(errno));
+		return 0;
+	}
+
+	return ret / sizeof(*evs);
+}
@@ -5,15 +5,294 @@
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
 #include "aux.h"
 #include "log.h"
 #include "main.h"
+#include "poller.h"
+#include "call.h"
+#include "statistics.h"
+#include "bencode.h"
+#include "media_socket.h"
+#include "numa.h"
+#include "codeclib.h"
+#include "resample.h"
 
 int load_average; // times 100
 int cpu_usage; // percent times 100 (0 - 9999)
+int overload_level;
+atomic64 overload_rejected;
+
+const char * const overload_level_names[__OVERLOAD_MAX] = {
+	[OVERLOAD_NONE]				= "none",
+	[OVERLOAD_LOW_COMPLEXITY]		= "low complexity encoding, no FEC",
+	[OVERLOAD_LOW_QUALITY_RESAMPLING]	= "low quality resampling",
+	[OVERLOAD_NO_DETECTION]			= "no silence and DTMF detection",
+	[OVERLOAD_NO_TRANSCODING]		= "no new transcoding",
+};
 
 static long used_last, idle_last;
 
+struct core_busy {
+	unsigned int poller;
+	uint64_t cpu_ns; // running total at the last sample
+	int busy; // percent times 100 over the last interval, -1 if unknown
+};
+
+// per poller thread, indexed by the global thread number
+static mutex_t core_lock = MUTEX_STATIC_INIT;
+static GArray *core_busy;
+static int transcode_busy = -1; // percent of one core times 100, -1 if unknown
+static int busy_average = -1; // over all poller threads, percent times 100, -1 if unknown
+static uint64_t transcode_ns_last;
+static uint64_t sample_ns_last; // CLOCK_MONOTONIC
+
+static void __core_sample(unsigned int poller, unsigned int thread, uint64_t cpu_ns, void *arg) {
+	uint64_t *elapsed = arg;
+
+	if (thread >= core_busy->len) {
+		unsigned int old_len = core_busy->len;
+		g_array_set_size(core_busy, thread + 1);
+		for (unsigned int i = old_len; i < core_busy->len; i++)
+			g_array_index(core_busy, struct core_busy, i).busy = -1;
+	}
+
+	struct core_busy *cb = &g_array_index(core_busy, struct core_busy, thread);
+	if (*elapsed && cb->cpu_ns && cpu_ns >= cb->cpu_ns)
+		cb->busy = MIN((cpu_ns - cb->cpu_ns) * 10000 / *elapsed, 10000);
+	cb->poller = poller;
+	cb->cpu_ns = cpu_ns;
+}
+
+static void core_sample(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	uint64_t transcode_ns = 0;
+	mutex_lock(&rtpe_codec_stats_lock);
+	GHashTableIter iter;
+	g_hash_table_iter_init(&iter, rtpe_codec_stats);
+	struct codec_stats *stats_entry;
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &stats_entry))
+		transcode_ns += atomic64_get(&stats_entry->time_ns);
+	mutex_unlock(&rtpe_codec_stats_lock);
+
+	mutex_lock(&core_lock);
+
+	if (!core_busy)
+		core_busy = g_array_new(FALSE, TRUE, sizeof(struct core_busy));
+
+	uint64_t elapsed = sample_ns_last ? now - sample_ns_last : 0;
+	poller_threads_cpu(__core_sample, &elapsed);
+
+	int64_t busy_total = 0;
+	unsigned int num_cores = 0;
+	for (unsigned int i = 0; i < core_busy->len; i++) {
+		struct core_busy *cb = &g_array_index(core_busy, struct core_busy, i);
+		if (cb->busy < 0)
+			continue;
+		busy_total += cb->busy;
+		num_cores++;
+	}
+	busy_average = num_cores ? busy_total / num_cores : -1;
+
+	if (elapsed && transcode_ns >= transcode_ns_last)
+		transcode_busy = (transcode_ns - transcode_ns_last) * 10000 / elapsed;
+	transcode_ns_last = transcode_ns;
+	sample_ns_last = now;
+
+	mutex_unlock(&core_lock);
+}
+
+#define OVERLOAD_UP_SECS 2 // above the threshold for this long: one step up
+#define OVERLOAD_DOWN_SECS 10 // below the threshold minus the hysteresis for this long: one step down
+#define OVERLOAD_HYSTERESIS 10 // percent of the threshold
+
+static int overload_busy_last = -1;
+static int overload_dir; // 1 = above the threshold, -1 = below it, 0 = in between
+static time_t overload_since; // when overload_dir or the level last changed
+
+int overload_threshold(void) {
+	rwlock_lock_r(&rtpe_config.config_lock);
+	int ret = rtpe_config.overload_threshold;
+	if (!ret)
+		ret = rtpe_config.cpu_limit * 9 / 10; // approaching max-cpu
+	rwlock_unlock_r(&rtpe_config.config_lock);
+	return ret;
+}
+
+int load_cpu_cost(int64_t ns) {
+	static long num_cpus;
+	if (ns <= 0)
+		return 0;
+	if (!num_cpus) {
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		num_cpus = n > 0 ? n : 1;
+	}
+	// anything that costs at all counts as at least 0.01%
+	return MAX(ns * 10000 / (1000000000LL * num_cpus), 1);
+}
+
+int overload_busy(void) {
+	return g_atomic_int_get(&overload_busy_last);
+}
+
+static void overload_apply(int level) {
+	g_atomic_int_set(&codeclib_low_complexity, level >= OVERLOAD_LOW_COMPLEXITY);
+	g_atomic_int_set(&codeclib_no_fec, level >= OVERLOAD_LOW_COMPLEXITY);
+	g_atomic_int_set(&resample_low_quality, level >= OVERLOAD_LOW_QUALITY_RESAMPLING);
+	// silence/DTMF detection and new transcoding check the level itself
+	g_atomic_int_set(&overload_level, level);
+}
+
+// the busy level is the average over all poller threads, or the overall CPU usage if
+// that's higher and being measured
+static void overload_control(void) {
+	int level = g_atomic_int_get(&overload_level);
+	int threshold = overload_threshold();
+
+	mutex_lock(&core_lock);
+	int busy = busy_average;
+	mutex_unlock(&core_lock);
+	if (rtpe_config.cpu_limit)
+		busy = MAX(busy, g_atomic_int_get(&cpu_usage));
+	g_atomic_int_set(&overload_busy_last, busy);
+
+	if (!threshold || busy < 0) {
+		if (level != OVERLOAD_NONE) {
+			ilog(LOG_NOTICE, "Overload protection disabled, returning to normal operation");
+			overload_apply(OVERLOAD_NONE);
+		}
+		overload_dir = 0;
+		return;
+	}
+
+	int dir = 0;
+	if (busy >= threshold)
+		dir = 1;
+	else if (busy < threshold - threshold * OVERLOAD_HYSTERESIS / 100)
+		dir = -1;
+
+	if (dir != overload_dir) {
+		overload_dir = dir;
+		overload_since = rtpe_now.tv_sec;
+		return;
+	}
+
+	int new_level = level;
+	if (dir > 0 && level < __OVERLOAD_MAX - 1 && rtpe_now.tv_sec - overload_since >= OVERLOAD_UP_SECS)
+		new_level++;
+	else if (dir < 0 && level > OVERLOAD_NONE && rtpe_now.tv_sec - overload_since >= OVERLOAD_DOWN_SECS)
+		new_level--;
+	else
+		return;
+
+	overload_since = rtpe_now.tv_sec;
+	ilog(new_level > level ? LOG_WARN : LOG_NOTICE,
+			"Overload protection step %i -> %i (%s), busy %.2f%%, threshold %.2f%%",
+			level, new_level, overload_level_names[new_level],
+			(double) busy / 100.0, (double) threshold / 100.0);
+	overload_apply(new_level);
+}
+
+// per media poller, for the rebalancing
+static uint64_t *rebalance_busy_last;
+static uint64_t rebalance_ns_last;
+static time_t rebalance_next;
+
+static void __rebalance_busy(const struct poller_thread_stats *st, void *arg) {
+	uint64_t *busy = arg;
+	for (unsigned int i = 0; i < rtpe_config.media_pollers; i++) {
+		if (poller_id(rtpe_media_pollers[i]) != st->poller)
+			continue;
+		for (unsigned int j = 0; j < __POLLER_CB_MAX; j++)
+			busy[i] += st->busy_ns[j];
+		break;
+	}
+}
+
+// moves at most one call per run, from the busiest to the least busy media poller
+static void media_pollers_rebalance(void) {
+	unsigned int num = rtpe_config.media_pollers;
+	uint64_t *busy = g_alloca(sizeof(*busy) * num);
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	uint64_t elapsed = now - rebalance_ns_last;
+
+	memset(busy, 0, sizeof(*busy) * num);
+	poller_threads_stats(__rebalance_busy, busy);
+
+	unsigned int hi = 0, lo = 0;
+	for (unsigned int i = 0; i < num; i++) {
+		uint64_t total = busy[i];
+		busy[i] -= rebalance_busy_last[i];
+		rebalance_busy_last[i] = total;
+		if (busy[i] > busy[hi])
+			hi = i;
+	}
+	// with NUMA placement, calls only move between pollers of the same node
+	lo = hi;
+	for (unsigned int i = 0; i < num; i++) {
+		if (numa_media_poller_node(i) != numa_media_poller_node(hi))
+			continue;
+		if (busy[i] < busy[lo])
+			lo = i;
+	}
+
+	int first = !rebalance_ns_last;
+	rebalance_ns_last = now;
+
+	// the cost of all calls is sampled in any case, for the next run
+	uint64_t target = (busy[hi] - busy[lo]) / 2;
+	if (first || busy[hi] - busy[lo] < elapsed / 10)
+		target = 0;
+
+	struct poller *from = rtpe_media_pollers[hi];
+	struct call *best = NULL;
+	uint64_t best_cost = 0;
+
+	ITERATE_CALLHASH_SHARDS(shard) {
+		GHashTableIter iter;
+		gpointer val;
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, NULL, &val)) {
+			struct call *c = val;
+			uint64_t total = atomic64_get(&c->poller_ns);
+			uint64_t cost = total - c->poller_ns_last;
+			int new = !c->poller_ns_last;
+			c->poller_ns_last = total;
+			if (new || c->poller != from) // unlocked read, checked again below
+				continue;
+			if (cost > target || cost <= best_cost)
+				continue;
+			if (best)
+				obj_put(best);
+			best = obj_get(c);
+			best_cost = cost;
+		}
+		rwlock_unlock_r(&shard->lock);
+	}
+
+	if (!best)
+		return;
+
+	call_lock_w(best);
+	if (best->poller == from) {
+		ilog(LOG_INFO, "Moving call '" STR_FORMAT "' from media poller %u to %u "
+				"(%" PRIu64 " of %" PRIu64 " ms busy)",
+				STR_FMT(&best->callid), hi, lo,
+				best_cost / 1000000, busy[hi] / 1000000);
+		stream_fds_move(best, rtpe_media_pollers[lo]);
+	}
+	call_unlock_w(best);
+	obj_put(best);
+}
+
 void load_thread(void *dummy) {
 	while (!rtpe_shutdown) {
 		if (rtpe_config.load_limit) {
@@ -48,6 +327,138 @@ void load_thread(void *dummy) {
 			}
 		}
 
+		core_sample();
+		overload_control();
+
+		if (rtpe_config.media_poller_rebalance && rtpe_config.media_pollers > 1
+				&& rtpe_now.tv_sec >= rebalance_next)
+		{
+			if (!rebalance_busy_last)
+				rebalance_busy_last = g_new0(uint64_t, rtpe_config.media_pollers);
+			media_pollers_rebalance();
+			rebalance_next = rtpe_now.tv_sec + rtpe_config.media_poller_rebalance;
+		}
+
 		usleep(500000);
 	}
 }
+
+static void bencode_percent(bencode_item_t *dict, const char *key, int val) {
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%.2f", (double) val / 100.0);
+	bencode_dictionary_add_string_dup(dict, key, buf);
+}
+
+#ifdef WITH_TRANSCODING
+// percent of one core per stream
+static void __capacity_codec_cost(const codec_def_t *def, void *arg) {
+	bencode_item_t *costs = arg;
+	bencode_item_t *cost = bencode_list_add_dictionary(costs);
+	char buf[16];
+
+	bencode_dictionary_add_string(cost, "codec", def->rtpname);
+	snprintf(buf, sizeof(buf), "%.3f", (double) def->bench_encode_ns / 10000000.0);
+	bencode_dictionary_add_string_dup(cost, "encode", buf);
+	snprintf(buf, sizeof(buf), "%.3f", (double) def->bench_decode_ns / 10000000.0);
+	bencode_dictionary_add_string_dup(cost, "decode", buf);
+	snprintf(buf, sizeof(buf), "%.3f", (double) def->bench_resample_ns / 10000000.0);
+	bencode_dictionary_add_string_dup(cost, "resample", buf);
+}
+#endif
+
+const char *load_capacity_ng(bencode_item_t *input, bencode_item_t *output) {
+	int64_t sessions = atomic64_get(&rtpe_callhash_size) - atomic64_get(&rtpe_stats.foreign_sessions);
+	int64_t transcoded = atomic64_get(&rtpe_stats.transcoded_media);
+
+	rwlock_lock_r(&rtpe_config.config_lock);
+	int max_sessions = rtpe_config.max_sessions;
+	int cpu_limit = rtpe_config.cpu_limit;
+	int transcode_threads = rtpe_config.transcode_threads;
+	rwlock_unlock_r(&rtpe_config.config_lock);
+
+	bencode_item_t *sess = bencode_dictionary_add_dictionary(output, "sessions");
+	bencode_dictionary_add_integer(sess, "own", sessions);
+	bencode_dictionary_add_integer(sess, "foreign", atomic64_get(&rtpe_stats.foreign_sessions));
+	bencode_dictionary_add_integer(sess, "transcoded media", transcoded);
+	if (max_sessions >= 0)
+		bencode_dictionary_add_integer(sess, "max", max_sessions);
+
+	if (rtpe_config.load_limit)
+		bencode_percent(output, "load average", g_atomic_int_get(&load_average));
+	if (cpu_limit)
+		bencode_percent(output, "CPU usage", g_atomic_int_get(&cpu_usage));
+	bencode_dictionary_add_integer(output, "overload step", g_atomic_int_get(&overload_level));
+
+	// per-core load, plus the totals needed for the estimate
+	bencode_item_t *cores = bencode_dictionary_add_list(output, "cores");
+	unsigned int num_cores = 0;
+	int64_t busy_total = 0;
+	int busy_max = 0;
+	int tc_busy;
+
+	mutex_lock(&core_lock);
+	for (unsigned int i = 0; core_busy && i < core_busy->len; i++) {
+		struct core_busy *cb = &g_array_index(core_busy, struct core_busy, i);
+		if (cb->busy < 0)
+			continue;
+		bencode_item_t *core = bencode_list_add_dictionary(cores);
+		bencode_dictionary_add_integer(core, "poller", cb->poller);
+		bencode_dictionary_add_integer(core, "thread", i);
+		bencode_percent(core, "busy", cb->busy);
+		num_cores++;
+		busy_total += cb->busy;
+		busy_max = MAX(busy_max, cb->busy);
+	}
+	tc_busy = transcode_busy;
+	mutex_unlock(&core_lock);
+
+#ifdef WITH_TRANSCODING
+	// measured at startup, with --codec-benchmark
+	bencode_item_t *costs = bencode_dictionary_add_list(output, "codec costs");
+	codeclib_benchmarked(__capacity_codec_cost, costs);
+#endif
+
+	if (!num_cores || tc_busy < 0)
+		return NULL; // no samples yet: no estimate
+
+	bencode_percent(output, "busy average", busy_total / num_cores);
+	bencode_percent(output, "busy max", busy_max);
+	bencode_percent(output, "transcoding", tc_busy);
+
+	// With transcoding done inside the poller threads, its share has to be taken
+	// out of the poller load to get the cost of plain media handling. With separate
+	// transcoding threads, it adds to the load on top.
+	int64_t media_busy = busy_total;
+	int64_t budget = (int64_t) num_cores * (cpu_limit ? cpu_limit : 10000) - busy_total;
+	if (!transcode_threads)
+		media_busy = MAX(media_busy - tc_busy, 0);
+	else
+		budget -= tc_busy;
+	if (budget < 0)
+		budget = 0;
+
+	if (sessions <= 0 || media_busy <= 0)
+		return NULL; // no calls to base an estimate on
+
+	int64_t session_limit = -1;
+	if (max_sessions >= 0)
+		session_limit = MAX(max_sessions - sessions, 0);
+
+	bencode_item_t *headroom = bencode_dictionary_add_dictionary(output, "headroom");
+
+	int64_t plain = budget * sessions / media_busy;
+	if (session_limit >= 0)
+		plain = MIN(plain, session_limit);
+	bencode_dictionary_add_integer(headroom, "plain", plain);
+
+	if (transcoded > 0 && tc_busy > 0) {
+		// cost of one transcoded call: media handling plus one transcoded media
+		int64_t cost_num = media_busy * transcoded + tc_busy * sessions;
+		int64_t tc = budget * sessions * transcoded / cost_num;
+		if (session_limit >= 0)
+			tc = MIN(tc, session_limit);
+		bencode_dictionary_add_integer(headroom, "transcoded", tc);
+	}
+
+	return NULL;
+}
@@ -16,6 +16,8 @@
 #include <ifaddrs.h>
 #include <net/if.h>
 #include <netdb.h>
+#include <sched.h>
+#include <pthread.h>
 
 #include "poller.h"
 #include "control_tcp.h"
@@ -47,12 +49,20 @@
 #include "media_player.h"
 #include "dtmf.h"
 #include "jitter_buffer.h"
+#include "conference.h"
 #include "websocket.h"
 #include "codec.h"
+#include "trace.h"
+#include "handover.h"
+#include "replication.h"
+#include "cdr.h"
+#include "arena.h"
+#include "numa.h"
 
 
 
 struct poller *rtpe_poller;
+struct poller **rtpe_media_pollers;
 struct rtpengine_config initial_rtpe_config;
 
 static struct control_tcp *rtpe_tcp;
@@ -65,9 +75,12 @@ struct rtpengine_config rtpe_config = {
 	.max_sessions = -1,
 	.delete_delay = 30,
 	.redis_subscribed_keyspaces = G_QUEUE_INIT,
+	.redis_shards = G_QUEUE_INIT,
 	.redis_expires_secs = 86400,
 	.interfaces = G_QUEUE_INIT,
 	.homer_protocol = SOCK_DGRAM,
+	.graphite_protocol = SOCK_STREAM,
+	.graphite_queue = 1048576,
 	.homer_id = 2001,
 	.port_min = 30000,
 	.port_max = 40000,
@@ -355,58 +368,88 @@ static int redis_ep_parse(endpoint_t *ep, int *db, char **auth, const char *auth
 static void options(int *argc, char ***argv) {
 	AUTO_CLEANUP_GVBUF(if_a);
 	AUTO_CLEANUP_GVBUF(ks_a);
+	AUTO_CLEANUP_GVBUF(redis_shards_a);
 	unsigned long uint_keyspace_db;
 	str str_keyspace_db;
 	char **iter;
 	AUTO_CLEANUP_GBUF(listenps);
 	AUTO_CLEANUP_GBUF(listenudps);
 	AUTO_CLEANUP_GBUF(listenngs);
+	AUTO_CLEANUP_GBUF(listenngtcps);
 	AUTO_CLEANUP_GBUF(listencli);
 	AUTO_CLEANUP_GBUF(graphitep);
 	AUTO_CLEANUP_GBUF(graphite_prefix_s);
+	AUTO_CLEANUP_GBUF(graphiteproto);
 	AUTO_CLEANUP_GBUF(redisps);
 	AUTO_CLEANUP_GBUF(redisps_write);
+	AUTO_CLEANUP_GBUF(redis_format);
 	AUTO_CLEANUP_GBUF(log_facility_cdr_s);
 	AUTO_CLEANUP_GBUF(log_facility_rtcp_s);
 	AUTO_CLEANUP_GBUF(log_facility_dtmf_s);
 	AUTO_CLEANUP_GBUF(log_format);
+	AUTO_CLEANUP_GBUF(cdr_format);
+	AUTO_CLEANUP_GBUF(call_arena);
+	AUTO_CLEANUP_GBUF(timestamping);
 	int sip_source = 0;
 	AUTO_CLEANUP_GBUF(homerp);
 	AUTO_CLEANUP_GBUF(homerproto);
+	AUTO_CLEANUP_GBUF(replicate_to);
+	AUTO_CLEANUP_GBUF(replicate_listen);
 	char *endptr;
 	int codecs = 0;
 	double max_load = 0;
 	double max_cpu = 0;
+	double overload_thres = 0;
 	AUTO_CLEANUP_GBUF(dtmf_udp_ep);
 	AUTO_CLEANUP_GBUF(endpoint_learning);
 	AUTO_CLEANUP_GBUF(dtls_sig);
+	AUTO_CLEANUP_GBUF(dtls_cert_cipher);
 	double silence_detect = 0;
+	AUTO_CLEANUP_GBUF(dtmf_detector);
 	AUTO_CLEANUP_GVBUF(cn_payload);
 
 	GOptionEntry e[] = {
 		{ "table",	't', 0, G_OPTION_ARG_INT,	&rtpe_config.kernel_table,		"Kernel table to use",		"INT"		},
 		{ "no-fallback",'F', 0, G_OPTION_ARG_NONE,	&rtpe_config.no_fallback,	"Only start when kernel module is available", NULL },
+		{ "kernel-rtcp",0, 0,	G_OPTION_ARG_NONE,	&rtpe_config.kernel_rtcp,	"Forward RTCP in the kernel module for plain relay streams", NULL },
+		{ "kernel-rtcp-sample",0,0,G_OPTION_ARG_INT,	&rtpe_config.kernel_rtcp_sample,"Pass every Nth RTCP packet forwarded by the kernel to userspace for statistics","INT"},
+		{ "kernel-junk-filter",0,0,G_OPTION_ARG_NONE,	&rtpe_config.kernel_junk_filter,"Drop malformed packets from unexpected sources in the kernel module", NULL },
+		{ "no-rtcp-stats",0, 0,	G_OPTION_ARG_NONE,	&rtpe_config.no_rtcp_stats,	"Don't evaluate RTCP for call quality statistics", NULL },
 		{ "interface",	'i', 0, G_OPTION_ARG_STRING_ARRAY,&if_a,	"Local interface for RTP",	"[NAME/]IP[!IP]"},
 		{ "subscribe-keyspace", 'k', 0, G_OPTION_ARG_STRING_ARRAY,&ks_a,	"Subscription keyspace list",	"INT INT ..."},
 		{ "listen-tcp",	'l', 0, G_OPTION_ARG_STRING,	&listenps,	"TCP port to listen on",	"[IP:]PORT"	},
 		{ "listen-udp",	'u', 0, G_OPTION_ARG_STRING,	&listenudps,	"UDP port to listen on",	"[IP46|HOSTNAME:]PORT"	},
 		{ "listen-ng",	'n', 0, G_OPTION_ARG_STRING,	&listenngs,	"UDP port to listen on, NG protocol", "[IP46|HOSTNAME:]PORT"	},
+		{ "listen-ng-tcp",0,0,	G_OPTION_ARG_STRING,	&listenngtcps,	"TCP port to listen on, NG protocol", "[IP46|HOSTNAME:]PORT"	},
 		{ "listen-cli", 'c', 0, G_OPTION_ARG_STRING,    &listencli,     "UDP port to listen on, CLI",   "[IP46|HOSTNAME:]PORT"     },
 		{ "graphite", 'g', 0, G_OPTION_ARG_STRING,    &graphitep,     "Address of the graphite server",   "IP46|HOSTNAME:PORT"     },
 		{ "graphite-interval",  'G', 0, G_OPTION_ARG_INT,    &rtpe_config.graphite_interval,  "Graphite send interval in seconds",    "INT"   },
 		{ "graphite-prefix",0,  0,	G_OPTION_ARG_STRING, &graphite_prefix_s, "Prefix for graphite line", "STRING"},
+		{ "graphite-protocol",0,0,	G_OPTION_ARG_STRING, &graphiteproto,	"Transport protocol for graphite (default tcp)",	"udp|tcp"	},
+		{ "graphite-queue",0,	0,	G_OPTION_ARG_INT,    &rtpe_config.graphite_queue,	"Max bytes of graphite data to queue while the server is slow",	"INT"	},
 		{ "tos",	'T', 0, G_OPTION_ARG_INT,	&rtpe_config.default_tos,		"Default TOS value to set on streams",	"INT"		},
 		{ "control-tos",0 , 0, G_OPTION_ARG_INT,	&rtpe_config.control_tos,		"Default TOS value to set on control-ng",	"INT"		},
+		{ "control-ng-threads",0,0,G_OPTION_ARG_INT,	&rtpe_config.control_ng_threads,	"Number of worker threads for control-ng commands",	"INT"		},
 		{ "timeout",	'o', 0, G_OPTION_ARG_INT,	&rtpe_config.timeout,	"RTP timeout",			"SECS"		},
 		{ "silent-timeout",'s',0,G_OPTION_ARG_INT,	&rtpe_config.silent_timeout,"RTP timeout for muted",	"SECS"		},
 		{ "final-timeout",'a',0,G_OPTION_ARG_INT,	&rtpe_config.final_timeout,	"Call timeout",			"SECS"		},
 		{ "offer-timeout",0,0,	G_OPTION_ARG_INT,	&rtpe_config.offer_timeout,	"Timeout for incomplete one-sided calls",	"SECS"		},
 		{ "port-min",	'm', 0, G_OPTION_ARG_INT,	&rtpe_config.port_min,	"Lowest port to use for RTP",	"INT"		},
 		{ "port-max",	'M', 0, G_OPTION_ARG_INT,	&rtpe_config.port_max,	"Highest port to use for RTP",	"INT"		},
+		{ "socket-pool",0, 0,	G_OPTION_ARG_INT,	&rtpe_config.socket_pool,"Number of pre-opened port pairs to keep for each interface","INT"},
+		{ "call-arena",0, 0,	G_OPTION_ARG_STRING,	&call_arena,	"Allocate per-call objects from hugepage-backed arenas","off|thp|hugetlb"},
+		{ "timestamping",0, 0,	G_OPTION_ARG_STRING,	&timestamping,	"Measure the time packets spend inside rtpengine from receive and transmit timestamps","off|software|hardware"},
+		{ "trace-dir",	0, 0,	G_OPTION_ARG_FILENAME,	&rtpe_config.trace_dir,	"Directory for binary per-packet trace files","PATH"},
+		{ "trace-events",0, 0,	G_OPTION_ARG_INT,	&rtpe_config.trace_events,"Number of trace events to keep per thread","INT"},
+		{ "handover-socket",0,0,G_OPTION_ARG_FILENAME,	&rtpe_config.handover_socket,	"Unix socket for live handover to a new process","PATH"},
+		{ "replicate-to",0,0,	G_OPTION_ARG_STRING,	&replicate_to,	"Standby to replicate call state to","IP46|HOSTNAME:PORT"},
+		{ "replicate-listen",0,0,G_OPTION_ARG_STRING,	&replicate_listen,	"Accept replicated call state from an active node","[IP46:]PORT"},
 		{ "redis",	'r', 0, G_OPTION_ARG_STRING,	&redisps,	"Connect to Redis database",	"[PW@]IP:PORT/INT"	},
 		{ "redis-write",'w', 0, G_OPTION_ARG_STRING,    &redisps_write, "Connect to Redis write database",      "[PW@]IP:PORT/INT"       },
+		{ "redis-shard", 0, 0,	G_OPTION_ARG_STRING_ARRAY,&redis_shards_a, "Additional Redis write database to distribute calls to", "[PW@]IP:PORT/INT" },
 		{ "redis-num-threads", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_num_threads, "Number of Redis restore threads",      "INT"       },
 		{ "redis-expires", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_expires_secs, "Expire time in seconds for redis keys",      "INT"       },
+		{ "redis-format", 0, 0, G_OPTION_ARG_STRING, &redis_format, "Encoding used for storing calls in redis", "json|binary|delta" },
 		{ "no-redis-required", 'q', 0, G_OPTION_ARG_NONE, &rtpe_config.no_redis_required, "Start no matter of redis connection state", NULL },
 		{ "redis-allowed-errors", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_allowed_errors, "Number of allowed errors before redis is temporarily disabled", "INT" },
 		{ "redis-disable-time", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_disable_time, "Number of seconds redis communication is disabled because of errors", "INT" },
@@ -414,12 +457,20 @@ static void options(int *argc, char ***argv) {
 		{ "redis-connect-timeout", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_connect_timeout, "Sets a timeout in milliseconds for redis connections", "INT" },
 		{ "redis-delete-async", 'y', 0, G_OPTION_ARG_INT, &rtpe_config.redis_delete_async, "Enable asynchronous redis delete", NULL },
 		{ "redis-delete-async-interval", 'y', 0, G_OPTION_ARG_INT, &rtpe_config.redis_delete_async_interval, "Set asynchronous redis delete interval (seconds)", NULL },
+		{ "redis-restore-batch", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_restore_batch, "Restore calls using SCAN and one MGET per batch of this many keys", "INT" },
+		{ "redis-restore-background", 0, 0, G_OPTION_ARG_NONE, &rtpe_config.redis_restore_background, "Restore calls from redis after startup has completed", NULL },
+		{ "redis-write-delay", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_write_delay, "Delay in milliseconds for coalescing redis updates from the media path", "INT" },
+		{ "redis-notify-threads", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_notify_threads, "Number of threads handling redis keyspace notifications", "INT" },
+		{ "redis-write-connections", 0, 0, G_OPTION_ARG_INT, &rtpe_config.redis_write_connections, "Number of connections to each redis write database", "INT" },
 		{ "b2b-url",	'b', 0, G_OPTION_ARG_STRING,	&rtpe_config.b2b_url,	"XMLRPC URL of B2B UA"	,	"STRING"	},
 		{ "log-facility-cdr",0,  0, G_OPTION_ARG_STRING, &log_facility_cdr_s, "Syslog facility to use for logging CDRs", "daemon|local0|...|local7"},
+		{ "cdr-format",	0, 0,	G_OPTION_ARG_STRING,	&cdr_format,	"Format of CDR log lines",	"text|json"},
 		{ "log-facility-rtcp",0,  0, G_OPTION_ARG_STRING, &log_facility_rtcp_s, "Syslog facility to use for logging RTCP", "daemon|local0|...|local7"},
 #ifdef WITH_TRANSCODING
 		{ "log-facility-dtmf",0,  0, G_OPTION_ARG_STRING, &log_facility_dtmf_s, "Syslog facility to use for logging DTMF", "daemon|local0|...|local7"},
 		{ "dtmf-log-dest", 0,0,	G_OPTION_ARG_STRING,	&dtmf_udp_ep,	"Destination address for DTMF logging via UDP",	"IP46|HOSTNAME:PORT"	},
+		{ "dtmf-log-redis", 0,0, G_OPTION_ARG_STRING,	&rtpe_config.dtmf_log_redis,	"Redis channel to publish DTMF events to",	"STRING"	},
+		{ "dtmf-log-homer", 0,0, G_OPTION_ARG_NONE,	&rtpe_config.dtmf_log_homer,	"Send DTMF events to Homer",	NULL	},
 #endif
 		{ "log-format",	0, 0,	G_OPTION_ARG_STRING,	&log_format,	"Log prefix format",		"default|parsable"},
 		{ "xmlrpc-format",'x', 0, G_OPTION_ARG_INT,	&rtpe_config.fmt,	"XMLRPC timeout request format to use. 0: SEMS DI, 1: call-id only, 2: Kamailio",	"INT"	},
@@ -431,6 +482,7 @@ static void options(int *argc, char ***argv) {
 		{ "max-sessions", 0, 0, G_OPTION_ARG_INT,	&rtpe_config.max_sessions,	"Limit of maximum number of sessions",	"INT"	},
 		{ "max-load",	0, 0,	G_OPTION_ARG_DOUBLE,	&max_load,	"Reject new sessions if load averages exceeds this value",	"FLOAT"	},
 		{ "max-cpu",	0, 0,	G_OPTION_ARG_DOUBLE,	&max_cpu,	"Reject new sessions if CPU usage (in percent) exceeds this value",	"FLOAT"	},
+		{ "overload-threshold",0,0,G_OPTION_ARG_DOUBLE,	&overload_thres,"Busy level (in percent) at which transcoding is degraded step by step","FLOAT"},
 		{ "max-bandwidth",0, 0,	G_OPTION_ARG_INT64,	&rtpe_config.bw_limit,	"Reject new sessions if bandwidth usage (in bytes per second) exceeds this value",	"INT"	},
 		{ "homer",	0,  0, G_OPTION_ARG_STRING,	&homerp,	"Address of Homer server for RTCP stats","IP46|HOSTNAME:PORT"},
 		{ "homer-protocol",0,0,G_OPTION_ARG_STRING,	&homerproto,	"Transport protocol for Homer (default udp)",	"udp|tcp"	},
@@ -440,6 +492,8 @@ static void options(int *argc, char ***argv) {
 		{ "recording-format",0, 0, G_OPTION_ARG_STRING,	&rtpe_config.rec_format,	"File format for stored pcap files",	"raw|eth"	},
 #ifdef WITH_IPTABLES_OPTION
 		{ "iptables-chain",0,0,	G_OPTION_ARG_STRING,	&rtpe_config.iptables_chain,"Add explicit firewall rules to this iptables chain","STRING" },
+		{ "ipset",0,0,		G_OPTION_ARG_STRING,	&rtpe_config.ipset,	"Add media ports to this hash:ip,port ipset instead of an iptables chain","STRING" },
+		{ "ipset6",0,0,		G_OPTION_ARG_STRING,	&rtpe_config.ipset6,	"Same as --ipset for IPv6 media ports","STRING" },
 #endif
 		{ "codecs",	0, 0,	G_OPTION_ARG_NONE,	&codecs,		"Print a list of supported codecs and exit",	NULL },
 		{ "scheduling",	0, 0,	G_OPTION_ARG_STRING,	&rtpe_config.scheduling,"Thread scheduling policy",	"default|none|fifo|rr|other|batch|idle" },
@@ -455,20 +509,52 @@ static void options(int *argc, char ***argv) {
 		{ "endpoint-learning",0,0,G_OPTION_ARG_STRING,	&endpoint_learning,	"RTP endpoint learning algorithm",	"delayed|immediate|off|heuristic"	},
 		{ "jitter-buffer",0, 0,	G_OPTION_ARG_INT,	&rtpe_config.jb_length,	"Size of jitter buffer",		"INT" },
 		{ "jb-clock-drift",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.jb_clock_drift,"Compensate for source clock drift",NULL },
+		{ "jb-adaptive",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.jb_adaptive,"Adapt jitter buffer delay to measured jitter",NULL },
 		{ "debug-srtp",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.debug_srtp,"Log raw encryption details for SRTP",	NULL },
 		{ "dtls-rsa-key-size",0, 0,	G_OPTION_ARG_INT,&rtpe_config.dtls_rsa_key_size,"Size of RSA key for DTLS",	"INT"		},
 		{ "dtls-ciphers",0,  0,	G_OPTION_ARG_STRING,	&rtpe_config.dtls_ciphers,"List of ciphers for DTLS",		"STRING"	},
 		{ "dtls-signature",0,  0,G_OPTION_ARG_STRING,	&dtls_sig,		"Signature algorithm for DTLS",		"SHA-256|SHA-1"	},
+		{ "dtls-cert-cipher",0,0,G_OPTION_ARG_STRING,	&dtls_cert_cipher,	"Key type for the DTLS certificate",	"prime256v1|RSA"},
 		{ "listen-http", 0,0,	G_OPTION_ARG_STRING_ARRAY,&rtpe_config.http_ifs,"Interface for HTTP and WS",	"[IP46|HOSTNAME:]PORT"},
 		{ "listen-https", 0,0,	G_OPTION_ARG_STRING_ARRAY,&rtpe_config.https_ifs,"Interface for HTTPS and WSS",	"[IP46|HOSTNAME:]PORT"},
 		{ "https-cert", 0,0,	G_OPTION_ARG_STRING,	&rtpe_config.https_cert,"Certificate for HTTPS and WSS","FILE"},
 		{ "https-key", 0,0,	G_OPTION_ARG_STRING,	&rtpe_config.https_key,	"Private key for HTTPS and WSS","FILE"},
 		{ "http-threads", 0,0,	G_OPTION_ARG_INT,	&rtpe_config.http_threads,"Number of worker threads for HTTP and WS","INT"},
+		{ "http-service-threads", 0,0,G_OPTION_ARG_INT,	&rtpe_config.http_service_threads,"Number of threads handling HTTP and WS connections","INT"},
+		{ "media-recv-batch",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_recv_batch,"Max number of packets to receive per syscall on media sockets","INT"},
+		{ "media-send-batch",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_send_batch,"Max number of packets to send per syscall on media sockets","INT"},
+		{ "media-pollers",0,0,	G_OPTION_ARG_INT,	&rtpe_config.media_pollers,"Number of dedicated pinned poller threads for media sockets","INT"},
+		{ "media-busy-poll",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_busy_poll,"Let media pollers spin and busy-poll media sockets for this many microseconds","INT"},
+		{ "media-busy-pollers",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_busy_pollers,"Only run this many of the media pollers in busy-poll mode","INT"},
+		{ "media-busy-poll-budget",0,0,G_OPTION_ARG_INT,&rtpe_config.media_busy_poll_budget,"Let the epoll instance of busy media pollers poll the device queues, handling this many packets per round","INT"},
+		{ "media-poller-rebalance",0,0,G_OPTION_ARG_INT,&rtpe_config.media_poller_rebalance,"Move calls off the busiest media poller every this many seconds","INT"},
+		{ "interface-pollers",0,0,G_OPTION_ARG_STRING_ARRAY,&rtpe_config.interface_pollers,"Handle media sockets of this interface with a dedicated poller and number of threads","NAME:INT"},
+		{ "interface-unknown-limit",0,0,G_OPTION_ARG_STRING_ARRAY,&rtpe_config.interface_unknown_limits,"Max number of packets per second from unknown sources on this interface","NAME:INT"},
+		{ "numa",	0,0,	G_OPTION_ARG_NONE,	&rtpe_config.numa,	"Place media pollers, calls and interface sockets on NUMA nodes",NULL},
+		{ "timer-sweep-slices",0,0,G_OPTION_ARG_INT,	&rtpe_config.timer_sweep_slices,"Spread the periodic call timer sweep over this many runs","INT"},
+		{ "timer-wheel",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.timer_wheel,"Use timing wheels for internal timer threads",NULL},
+		{ "ice-check-rate",0,0,	G_OPTION_ARG_INT,	&rtpe_config.ice_check_rate,"Max number of new ICE connectivity checks per second across all calls","INT"},
+#ifdef HAVE_LIBURING
+		{ "io-uring",	0,0,	G_OPTION_ARG_NONE,	&rtpe_config.poller_io_uring,"Use io_uring instead of epoll for event polling",NULL},
+#endif
+		{ "media-send-gso",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.media_send_gso,"Use UDP segmentation offload for batched media output",NULL},
+		{ "media-recv-gro",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.media_recv_gro,"Receive coalesced datagrams on media sockets using UDP GRO",NULL},
+		{ "media-rcvbuf",0,0,	G_OPTION_ARG_INT,	&rtpe_config.media_rcvbuf,"Receive buffer size of media sockets in bytes","INT"},
+		{ "media-rcvbuf-max",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_rcvbuf_max,"Grow the receive buffer of media sockets dropping packets up to this size","INT"},
 #ifdef WITH_TRANSCODING
 		{ "dtx-delay",	0,0,	G_OPTION_ARG_INT,	&rtpe_config.dtx_delay,	"Delay in milliseconds to trigger DTX handling","INT"},
 		{ "max-dtx",	0,0,	G_OPTION_ARG_INT,	&rtpe_config.max_dtx,	"Maximum duration of DTX handling",	"INT"},
+		{ "transcode-threads",0,0,G_OPTION_ARG_INT,	&rtpe_config.transcode_threads,"Number of dedicated pinned threads for transcoding","INT"},
+		{ "t38-threads",0,0,G_OPTION_ARG_INT,	&rtpe_config.t38_threads,"Number of dedicated pinned threads for T.38 gateways","INT"},
+		{ "dtls-threads",0,0,	G_OPTION_ARG_INT,	&rtpe_config.dtls_threads,"Number of dedicated threads for DTLS handshakes","INT"},
 		{ "silence-detect",0,0,	G_OPTION_ARG_DOUBLE,	&silence_detect,	"Audio level threshold in percent for silence detection","FLOAT"},
+		{ "dtmf-detector",0,0,	G_OPTION_ARG_STRING,	&dtmf_detector,		"Algorithm used for in-band DTMF detection","spandsp|goertzel"},
+		{ "player-cache",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.player_cache,"Cache media files and database prompts in encoded form",NULL},
+		{ "player-mmap",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.player_mmap,"Map media files for playback into memory once and share them between calls",NULL},
+		{ "media-open-threads",0,0,G_OPTION_ARG_INT,	&rtpe_config.media_open_threads,"Number of threads opening media files for playback in the background","INT"},
 		{ "cn-payload",0,0,	G_OPTION_ARG_STRING_ARRAY,&cn_payload,		"Comfort noise parameters to replace silence with","INT INT INT ..."},
+		{ "output-dtx",0,0,	G_OPTION_ARG_NONE,	&rtpe_config.output_dtx,"Suppress silence on transcoded output using CN or codec-native DTX",NULL},
+		{ "codec-benchmark",0,0,G_OPTION_ARG_NONE,	&rtpe_config.codec_benchmark,"Measure the CPU cost of each codec during startup",NULL},
 #endif
 
 		{ NULL, }
@@ -494,8 +580,8 @@ static void options(int *argc, char ***argv) {
 
 	if (!if_a)
 		die("Missing option --interface");
-	if (!listenps && !listenudps && !listenngs)
-		die("Missing option --listen-tcp, --listen-udp or --listen-ng");
+	if (!listenps && !listenudps && !listenngs && !listenngtcps)
+		die("Missing option --listen-tcp, --listen-udp, --listen-ng or --listen-ng-tcp");
 
 	struct ifaddrs *ifas;
 	if (getifaddrs(&ifas)) {
@@ -542,6 +628,10 @@ static void options(int *argc, char ***argv) {
 		if (endpoint_parse_any_getaddrinfo(&rtpe_config.ng_listen_ep, listenngs))
 			die("Invalid IP or port '%s' (--listen-ng)", listenngs);
 	}
+	if (listenngtcps) {
+		if (endpoint_parse_any_getaddrinfo(&rtpe_config.ng_tcp_listen_ep, listenngtcps))
+			die("Invalid IP or port '%s' (--listen-ng-tcp)", listenngtcps);
+	}
 
 	if (listencli) {if (endpoint_parse_any_getaddrinfo(&rtpe_config.cli_listen_ep, listencli))
 	    die("Invalid IP or port '%s' (--listen-cli)", listencli);
@@ -554,10 +644,29 @@ static void options(int *argc, char ***argv) {
 	if (graphite_prefix_s)
 		set_prefix(graphite_prefix_s);
 
+	if (graphiteproto) {
+		if (!strcmp(graphiteproto, "tcp"))
+			rtpe_config.graphite_protocol = SOCK_STREAM;
+		else if (!strcmp(graphiteproto, "udp"))
+			rtpe_config.graphite_protocol = SOCK_DGRAM;
+		else
+			die("Invalid protocol '%s' (--graphite-protocol)", graphiteproto);
+	}
+	if (rtpe_config.graphite_queue < 0)
+		die("Invalid negative value for --graphite-queue");
+
 	if (homerp) {
 		if (endpoint_parse_any_getaddrinfo_full(&rtpe_config.homer_ep, homerp))
 			die("Invalid IP or port '%s' (--homer)", homerp);
 	}
+	if (replicate_to) {
+		if (endpoint_parse_any_getaddrinfo_full(&rtpe_config.replicate_to, replicate_to))
+			die("Invalid IP or port '%s' (--replicate-to)", replicate_to);
+	}
+	if (replicate_listen) {
+		if (endpoint_parse_any_getaddrinfo(&rtpe_config.replicate_listen, replicate_listen))
+			die("Invalid IP or port '%s' (--replicate-listen)", replicate_listen);
+	}
 	if (homerproto) {
 		if (!strcmp(homerproto, "tcp"))
 			rtpe_config.homer_protocol = SOCK_STREAM;
@@ -573,6 +682,9 @@ static void options(int *argc, char ***argv) {
 	if (rtpe_config.control_tos < 0 || rtpe_config.control_tos > 255)
 		die("Invalid control-ng TOS value");
 
+	if (rtpe_config.control_ng_threads < 0)
+		die("Invalid negative --control-ng-threads value");
+
 	if (rtpe_config.timeout <= 0)
 		rtpe_config.timeout = 60;
 
@@ -594,6 +706,15 @@ static void options(int *argc, char ***argv) {
 					"RTPENGINE_REDIS_WRITE_AUTH_PW", redisps_write))
 			die("Invalid Redis endpoint [IP:PORT/INT] '%s' (--redis-write)", redisps_write);
 
+	if (redis_shards_a) {
+		for (iter = redis_shards_a; *iter; iter++) {
+			struct redis_shard_config *sc = g_slice_alloc0(sizeof(*sc));
+			if (redis_ep_parse(&sc->ep, &sc->db, &sc->auth, "RTPENGINE_REDIS_SHARD_AUTH_PW", *iter))
+				die("Invalid Redis endpoint [IP:PORT/INT] '%s' (--redis-shard)", *iter);
+			g_queue_push_tail(&rtpe_config.redis_shards, sc);
+		}
+	}
+
 	if (rtpe_config.fmt > 2)
 		die("Invalid XMLRPC format");
 
@@ -619,6 +740,17 @@ static void options(int *argc, char ***argv) {
 		}
 	}
 
+	if (redis_format) {
+		if (!strcmp(redis_format, "json"))
+			rtpe_config.redis_format = REDIS_FORMAT_JSON;
+		else if (!strcmp(redis_format, "binary"))
+			rtpe_config.redis_format = REDIS_FORMAT_BINARY;
+		else if (!strcmp(redis_format, "delta"))
+			rtpe_config.redis_format = REDIS_FORMAT_DELTA;
+		else
+			die("Invalid --redis-format option");
+	}
+
 	if (log_format) {
 		if (!strcmp(log_format, "default"))
 			rtpe_config.log_format = LF_DEFAULT;
@@ -628,15 +760,54 @@ static void options(int *argc, char ***argv) {
 			die("Invalid --log-format option");
 	}
 
+	if (call_arena) {
+		if (!strcmp(call_arena, "off"))
+			rtpe_config.call_arena = ARENA_OFF;
+		else if (!strcmp(call_arena, "thp"))
+			rtpe_config.call_arena = ARENA_THP;
+		else if (!strcmp(call_arena, "hugetlb"))
+			rtpe_config.call_arena = ARENA_HUGETLB;
+		else
+			die("Invalid --call-arena option");
+	}
+
+	if (timestamping) {
+		if (!strcmp(timestamping, "off"))
+			rtpe_config.timestamping = SOCKET_TS_DEFAULT;
+		else if (!strcmp(timestamping, "software"))
+			rtpe_config.timestamping = SOCKET_TS_SOFTWARE;
+		else if (!strcmp(timestamping, "hardware"))
+			rtpe_config.timestamping = SOCKET_TS_HARDWARE;
+		else
+			die("Invalid --timestamping option");
+	}
+
+	if (cdr_format) {
+		if (!strcmp(cdr_format, "text"))
+			rtpe_config.cdr_format = CDR_FORMAT_TEXT;
+		else if (!strcmp(cdr_format, "json"))
+			rtpe_config.cdr_format = CDR_FORMAT_JSON;
+		else
+			die("Invalid --cdr-format option");
+	}
+
 	if (dtmf_udp_ep) {
 		if (endpoint_parse_any_getaddrinfo_full(&rtpe_config.dtmf_udp_ep, dtmf_udp_ep))
 			die("Invalid IP or port '%s' (--dtmf-log-dest)", dtmf_udp_ep);
 	}
+	if (rtpe_config.dtmf_log_redis && is_addr_unspecified(&rtpe_config.redis_ep.address)
+			&& is_addr_unspecified(&rtpe_config.redis_write_ep.address))
+		die("--dtmf-log-redis requires a Redis database (--redis or --redis-write)");
+	if (rtpe_config.dtmf_log_homer && is_addr_unspecified(&rtpe_config.homer_ep.address))
+		die("--dtmf-log-homer requires --homer");
 
 	if (!sip_source)
 		trust_address_def = 1;
 
 	rtpe_config.cpu_limit = max_cpu * 100;
+	if (overload_thres < 0)
+		die("Invalid negative --overload-threshold value");
+	rtpe_config.overload_threshold = overload_thres * 100;
 	rtpe_config.load_limit = max_load * 100;
 
 	if (rtpe_config.mysql_query) {
@@ -683,17 +854,95 @@ static void options(int *argc, char ***argv) {
 			die("Invalid --dtls-signature option ('%s')", dtls_sig);
 	}
 
+	if (dtls_cert_cipher) {
+		if (!strcasecmp(dtls_cert_cipher, "rsa"))
+			rtpe_config.dtls_cert_cipher = DCC_RSA;
+		else if (!strcasecmp(dtls_cert_cipher, "prime256v1"))
+			rtpe_config.dtls_cert_cipher = DCC_EC_PRIME256v1;
+		else if (!strcasecmp(dtls_cert_cipher, "ecdsa"))
+			rtpe_config.dtls_cert_cipher = DCC_EC_PRIME256v1;
+		else
+			die("Invalid --dtls-cert-cipher option ('%s')", dtls_cert_cipher);
+	}
+
 	if (rtpe_config.dtls_rsa_key_size < 0)
 		die("Invalid --dtls-rsa-key-size (%i)", rtpe_config.dtls_rsa_key_size);
 
 	if (rtpe_config.jb_length < 0)
 		die("Invalid negative jitter buffer size");
 
+	if (rtpe_config.http_service_threads < 0)
+		die("Invalid negative --http-service-threads value");
+
+	if (rtpe_config.media_recv_batch < 0 || rtpe_config.media_recv_batch > MAX_RECVMMSG)
+		die("Invalid --media-recv-batch value (must be between 0 and %i)", MAX_RECVMMSG);
+	if (rtpe_config.media_recv_gro && rtpe_config.media_recv_batch <= 1)
+		die("--media-recv-gro requires --media-recv-batch");
+	if (rtpe_config.media_rcvbuf < 0 || rtpe_config.media_rcvbuf_max < 0)
+		die("Invalid negative --media-rcvbuf or --media-rcvbuf-max value");
+	if (rtpe_config.media_rcvbuf_max && rtpe_config.media_rcvbuf_max < rtpe_config.media_rcvbuf)
+		die("--media-rcvbuf-max must not be smaller than --media-rcvbuf");
+	if (rtpe_config.timer_sweep_slices < 0 || rtpe_config.timer_sweep_slices > CALLHASH_SHARDS)
+		die("Invalid --timer-sweep-slices value (must be between 0 and %i)", CALLHASH_SHARDS);
+	if (rtpe_config.media_pollers < 0)
+		die("Invalid negative --media-pollers value");
+	if (rtpe_config.media_busy_poll < 0)
+		die("Invalid negative --media-busy-poll value");
+	if (rtpe_config.media_busy_poll && !rtpe_config.media_pollers)
+		die("--media-busy-poll requires --media-pollers");
+	if (rtpe_config.media_busy_pollers < 0 || rtpe_config.media_busy_pollers > rtpe_config.media_pollers)
+		die("Invalid --media-busy-pollers value (must be between 0 and --media-pollers)");
+	if (rtpe_config.media_busy_pollers && !rtpe_config.media_busy_poll)
+		die("--media-busy-pollers requires --media-busy-poll");
+	if (rtpe_config.media_busy_poll_budget < 0 || rtpe_config.media_busy_poll_budget > 65535)
+		die("Invalid --media-busy-poll-budget value (must be between 0 and 65535)");
+	if (rtpe_config.media_busy_poll_budget && !rtpe_config.media_busy_poll)
+		die("--media-busy-poll-budget requires --media-busy-poll");
+	if (rtpe_config.media_busy_poll && !rtpe_config.media_busy_pollers)
+		rtpe_config.media_busy_pollers = rtpe_config.media_pollers;
+	if (rtpe_config.media_poller_rebalance < 0)
+		die("Invalid negative --media-poller-rebalance value");
+	if (rtpe_config.ice_check_rate < 0)
+		die("Invalid negative --ice-check-rate value");
+	if (rtpe_config.transcode_threads < 0)
+		die("Invalid negative --transcode-threads value");
+	if (rtpe_config.t38_threads < 0)
+		die("Invalid negative --t38-threads value");
+	if (rtpe_config.dtls_threads < 0)
+		die("Invalid negative --dtls-threads value");
+	if (rtpe_config.media_open_threads < 0)
+		die("Invalid negative --media-open-threads value");
+	if (rtpe_config.socket_pool < 0)
+		die("Invalid negative --socket-pool value");
+	if (rtpe_config.trace_events < 0)
+		die("Invalid negative --trace-events value");
+	if (rtpe_config.kernel_rtcp_sample < 0)
+		die("Invalid negative --kernel-rtcp-sample value");
+	if (rtpe_config.redis_write_delay < 0)
+		die("Invalid negative --redis-write-delay value");
+	if (rtpe_config.redis_notify_threads < 0)
+		die("Invalid negative --redis-notify-threads value");
+	if (rtpe_config.redis_write_connections < 0)
+		die("Invalid negative --redis-write-connections value");
+	if (rtpe_config.redis_restore_batch < 0)
+		die("Invalid negative --redis-restore-batch value");
+	if (rtpe_config.media_send_batch < 0 || rtpe_config.media_send_batch > MAX_SENDMMSG)
+		die("Invalid --media-send-batch value (must be between 0 and %i)", MAX_SENDMMSG);
+
 	if (silence_detect > 0) {
 		rtpe_config.silence_detect_double = silence_detect / 100.0;
 		rtpe_config.silence_detect_int = (int) ((silence_detect / 100.0) * UINT32_MAX);
 	}
 
+	if (dtmf_detector) {
+		if (!strcasecmp(dtmf_detector, "spandsp"))
+			rtpe_config.dtmf_detector = DTMF_DSP_SPANDSP;
+		else if (!strcasecmp(dtmf_detector, "goertzel"))
+			rtpe_config.dtmf_detector = DTMF_DSP_GOERTZEL;
+		else
+			die("Invalid --dtmf-detector option ('%s')", dtmf_detector);
+	}
+
 	if (!cn_payload)
 		str_init_dup(&rtpe_config.cn_payload, "\x20");
 	else {
@@ -716,6 +965,20 @@ static void options(int *argc, char ***argv) {
 	}
 }
 
+// stops taking any control commands. the objects themselves are released during shutdown
+void control_listeners_close(void) {
+	if (rtpe_tcp)
+		control_tcp_close(rtpe_tcp);
+	if (rtpe_udp)
+		control_udp_close(rtpe_udp);
+	if (rtpe_control_ng)
+		control_ng_close(rtpe_control_ng);
+	if (rtpe_control_ng_tcp)
+		control_ng_tcp_close(rtpe_control_ng_tcp);
+	if (rtpe_cli)
+		cli_close(rtpe_cli);
+}
+
 void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 
 	GList* l;
@@ -738,6 +1001,7 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->kernel_table = rtpe_config.kernel_table;
 	ini_rtpe_cfg->max_sessions = rtpe_config.max_sessions;
 	ini_rtpe_cfg->cpu_limit = rtpe_config.cpu_limit;
+	ini_rtpe_cfg->overload_threshold = rtpe_config.overload_threshold;
 	ini_rtpe_cfg->load_limit = rtpe_config.load_limit;
 	ini_rtpe_cfg->bw_limit = rtpe_config.bw_limit;
 	ini_rtpe_cfg->timeout = rtpe_config.timeout;
@@ -746,6 +1010,7 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->final_timeout = rtpe_config.final_timeout;
 	ini_rtpe_cfg->delete_delay = rtpe_config.delete_delay;
 	ini_rtpe_cfg->redis_expires_secs = rtpe_config.redis_expires_secs;
+	ini_rtpe_cfg->redis_format = rtpe_config.redis_format;
 	ini_rtpe_cfg->default_tos = rtpe_config.default_tos;
 	ini_rtpe_cfg->control_tos = rtpe_config.control_tos;
 	ini_rtpe_cfg->graphite_interval = rtpe_config.graphite_interval;
@@ -753,6 +1018,9 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->homer_protocol = rtpe_config.homer_protocol;
 	ini_rtpe_cfg->homer_id = rtpe_config.homer_id;
 	ini_rtpe_cfg->no_fallback = rtpe_config.no_fallback;
+	ini_rtpe_cfg->kernel_rtcp = rtpe_config.kernel_rtcp;
+	ini_rtpe_cfg->kernel_rtcp_sample = rtpe_config.kernel_rtcp_sample;
+	ini_rtpe_cfg->kernel_junk_filter = rtpe_config.kernel_junk_filter;
 	ini_rtpe_cfg->port_min = rtpe_config.port_min;
 	ini_rtpe_cfg->port_max = rtpe_config.port_max;
 	ini_rtpe_cfg->redis_db = rtpe_config.redis_db;
@@ -762,18 +1030,25 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->media_num_threads = rtpe_config.media_num_threads;
 	ini_rtpe_cfg->fmt = rtpe_config.fmt;
 	ini_rtpe_cfg->log_format = rtpe_config.log_format;
+	ini_rtpe_cfg->cdr_format = rtpe_config.cdr_format;
 	ini_rtpe_cfg->redis_allowed_errors = rtpe_config.redis_allowed_errors;
 	ini_rtpe_cfg->redis_disable_time = rtpe_config.redis_disable_time;
 	ini_rtpe_cfg->redis_cmd_timeout = rtpe_config.redis_cmd_timeout;
 	ini_rtpe_cfg->redis_connect_timeout = rtpe_config.redis_connect_timeout;
 	ini_rtpe_cfg->redis_delete_async = rtpe_config.redis_delete_async;
 	ini_rtpe_cfg->redis_delete_async_interval = rtpe_config.redis_delete_async_interval;
+	ini_rtpe_cfg->redis_write_delay = rtpe_config.redis_write_delay;
+	ini_rtpe_cfg->redis_notify_threads = rtpe_config.redis_notify_threads;
+	ini_rtpe_cfg->redis_write_connections = rtpe_config.redis_write_connections;
+	ini_rtpe_cfg->redis_restore_batch = rtpe_config.redis_restore_batch;
+	ini_rtpe_cfg->redis_restore_background = rtpe_config.redis_restore_background;
 	ini_rtpe_cfg->common.log_level = rtpe_config.common.log_level;
 
 	ini_rtpe_cfg->graphite_ep = rtpe_config.graphite_ep;
 	ini_rtpe_cfg->tcp_listen_ep = rtpe_config.tcp_listen_ep;
 	ini_rtpe_cfg->udp_listen_ep = rtpe_config.udp_listen_ep;
 	ini_rtpe_cfg->ng_listen_ep = rtpe_config.ng_listen_ep;
+	ini_rtpe_cfg->ng_tcp_listen_ep = rtpe_config.ng_tcp_listen_ep;
 	ini_rtpe_cfg->cli_listen_ep = rtpe_config.cli_listen_ep;
 	ini_rtpe_cfg->redis_ep = rtpe_config.redis_ep;
 	ini_rtpe_cfg->redis_write_ep = rtpe_config.redis_write_ep;
@@ -785,11 +1060,15 @@ void fill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	ini_rtpe_cfg->redis_write_auth = g_strdup(rtpe_config.redis_write_auth);
 	ini_rtpe_cfg->spooldir = g_strdup(rtpe_config.spooldir);
 	ini_rtpe_cfg->iptables_chain = g_strdup(rtpe_config.iptables_chain);
+	ini_rtpe_cfg->ipset = g_strdup(rtpe_config.ipset);
+	ini_rtpe_cfg->ipset6 = g_strdup(rtpe_config.ipset6);
 	ini_rtpe_cfg->rec_method = g_strdup(rtpe_config.rec_method);
 	ini_rtpe_cfg->rec_format = g_strdup(rtpe_config.rec_format);
 
 	ini_rtpe_cfg->jb_length = rtpe_config.jb_length;
 	ini_rtpe_cfg->jb_clock_drift = rtpe_config.jb_clock_drift;
+	ini_rtpe_cfg->jb_adaptive = rtpe_config.jb_adaptive;
+	ini_rtpe_cfg->ice_check_rate = rtpe_config.ice_check_rate;
 }
 
 static void
@@ -812,21 +1091,32 @@ static void unfill_initial_rtpe_cfg(struct rtpengine_config* ini_rtpe_cfg) {
 	g_free(ini_rtpe_cfg->redis_write_auth);
 	g_free(ini_rtpe_cfg->spooldir);
 	g_free(ini_rtpe_cfg->iptables_chain);
+	g_free(ini_rtpe_cfg->ipset);
+	g_free(ini_rtpe_cfg->ipset6);
 	g_free(ini_rtpe_cfg->rec_method);
 	g_free(ini_rtpe_cfg->rec_format);
 }
 
+static void free_redis_shard_config(struct redis_shard_config *sc) {
+	g_free(sc->auth);
+	g_slice_free1(sizeof(*sc), sc);
+}
+
 static void options_free(void) {
 	// clear queues
 	g_queue_clear_full(&rtpe_config.interfaces, (GDestroyNotify)free_config_interfaces);
 	g_queue_clear(&rtpe_config.redis_subscribed_keyspaces);
+	g_queue_clear_full(&rtpe_config.redis_shards, (GDestroyNotify)free_redis_shard_config);
 
 	// free config options
 	g_free(rtpe_config.b2b_url);
+	g_free(rtpe_config.dtmf_log_redis);
 	g_free(rtpe_config.spooldir);
 	g_free(rtpe_config.rec_method);
 	g_free(rtpe_config.rec_format);
 	g_free(rtpe_config.iptables_chain);
+	g_free(rtpe_config.ipset);
+	g_free(rtpe_config.ipset6);
 	g_free(rtpe_config.scheduling);
 	g_free(rtpe_config.idle_scheduling);
 	g_free(rtpe_config.mysql_host);
@@ -835,6 +1125,8 @@ static void options_free(void) {
 	g_free(rtpe_config.mysql_query);
 	g_free(rtpe_config.dtls_ciphers);
 	g_strfreev(rtpe_config.http_ifs);
+	g_strfreev(rtpe_config.interface_pollers);
+	g_strfreev(rtpe_config.interface_unknown_limits);
 	g_strfreev(rtpe_config.https_ifs);
 	g_free(rtpe_config.https_cert);
 	g_free(rtpe_config.https_key);
@@ -867,43 +1159,84 @@ static void init_everything(void) {
 	dtls_init();
 	ice_init();
 	crypto_init_main();
+	numa_init(); // before interfaces_init()
+	socket_timestamping_mode(rtpe_config.timestamping);
 	interfaces_init(&rtpe_config.interfaces);
+	if (interfaces_isolation_init(rtpe_config.interface_pollers, rtpe_config.interface_unknown_limits))
+		die("Failed to set up interface isolation");
 	iptables_init();
 	control_ng_init();
 	if (call_interfaces_init())
 		abort();
 	statistics_init();
+	codeclib_output_dtx = rtpe_config.output_dtx;
 	codeclib_init(0);
 	media_player_init();
 	dtmf_init();
 	jitter_buffer_init();
 	t38_init();
+	conference_init();
 	codecs_init();
+	if (rtpe_config.codec_benchmark)
+		codeclib_benchmark();
+	trace_init();
+	replication_init();
 }
 
 
+static int handover; // calls were taken over from a running process
+
+// deleting a table with many leftover targets can take a while, so this runs alongside
+// the rest of the setup
+static void *kernel_setup_thread(void *p) {
+	int fd = handover_kernel_fd(rtpe_config.kernel_table);
+	if (fd != -1)
+		return GINT_TO_POINTER(kernel_adopt_table(rtpe_config.kernel_table, fd));
+	return GINT_TO_POINTER(kernel_setup_table(rtpe_config.kernel_table));
+}
+
 static void create_everything(void) {
 	struct timeval tmp_tv;
 	struct timeval redis_start, redis_stop;
 	double redis_diff = 0;
-
-	if (rtpe_config.kernel_table < 0)
-		goto no_kernel;
-	if (kernel_setup_table(rtpe_config.kernel_table)) {
-		if (rtpe_config.no_fallback) {
-			ilog(LOG_CRIT, "Userspace fallback disallowed - exiting");
-			exit(-1);
-		}
-		goto no_kernel;
+	int idx;
+	pthread_t kernel_thread;
+	int kernel_pending = 0;
+
+	// must come first: the previous process releases the kernel table and its
+	// control sockets only once everything has been handed over
+	handover = handover_receive();
+	if (handover < 0)
+		die("Failed to take over from the running process");
+
+	if (rtpe_config.kernel_table >= 0) {
+		if (pthread_create(&kernel_thread, NULL, kernel_setup_thread, NULL))
+			die("Failed to create thread for kernel table setup");
+		kernel_pending = 1;
 	}
 
-no_kernel:
 	rtpe_poller = poller_new();
 	if (!rtpe_poller)
 		die("poller creation failed");
 
 	dtls_timer(rtpe_poller);
 
+	if (rtpe_config.media_pollers > 0) {
+		rtpe_media_pollers = g_new0(struct poller *, rtpe_config.media_pollers);
+		for (idx = 0; idx < rtpe_config.media_pollers; idx++) {
+			rtpe_media_pollers[idx] = poller_new();
+			if (!rtpe_media_pollers[idx])
+				die("poller creation failed");
+			if (idx < rtpe_config.media_busy_pollers && rtpe_config.media_busy_poll_budget
+					&& poller_busy_poll(rtpe_media_pollers[idx], rtpe_config.media_busy_poll,
+						rtpe_config.media_busy_poll_budget))
+				ilog(LOG_WARN, "Failed to set busy poll parameters on media poller %i: %s",
+						idx, strerror(errno));
+		}
+	}
+
+	arena_init(rtpe_config.call_arena);
+
 	if (call_init())
 		abort();
 
@@ -944,6 +1277,14 @@ no_kernel:
 			die("Failed to open UDP control connection port");
 	}
 
+	rtpe_control_ng_tcp = NULL;
+	if (rtpe_config.ng_tcp_listen_ep.port) {
+		interfaces_exclude_port(rtpe_config.ng_tcp_listen_ep.port);
+		rtpe_control_ng_tcp = control_ng_tcp_new(rtpe_poller, &rtpe_config.ng_tcp_listen_ep);
+		if (!rtpe_control_ng_tcp)
+			die("Failed to open TCP NG control connection port");
+	}
+
 	rtpe_cli = NULL;
 	if (rtpe_config.cli_listen_ep.port) {
 		interfaces_exclude_port(rtpe_config.cli_listen_ep.port);
@@ -980,6 +1321,16 @@ no_kernel:
 			rtpe_redis_write = rtpe_redis;
 	}
 
+	if (rtpe_config.redis_shards.length) {
+		if (!rtpe_redis_write)
+			die("Redis shards (--redis-shard) require a Redis database (--redis or --redis-write)");
+		redis_shards_init();
+	}
+
+	redis_write_pool_init(rtpe_redis_write);
+	for (unsigned int i = 0; i < rtpe_redis_num_shards; i++)
+		redis_write_pool_init(rtpe_redis_shards[i].write);
+
 	if (rtpe_config.num_threads < 1) {
 #ifdef _SC_NPROCESSORS_ONLN
 		rtpe_config.num_threads = sysconf( _SC_NPROCESSORS_ONLN ) + 3;
@@ -991,20 +1342,39 @@ no_kernel:
 	if (websocket_init())
 		die("Failed to init websocket listener");
 
+	// must be done before forking into the background
+	if (kernel_pending) {
+		void *ret;
+		pthread_join(kernel_thread, &ret);
+		if (GPOINTER_TO_INT(ret) && rtpe_config.no_fallback) {
+			ilog(LOG_CRIT, "Userspace fallback disallowed - exiting");
+			exit(-1);
+		}
+	}
+
 	daemonize();
+	log_async_start();
 	wpidfile();
 
+	dtls_cert_init();
+
 	homer_sender_init(&rtpe_config.homer_ep, rtpe_config.homer_protocol, rtpe_config.homer_id);
 
 	rtcp_init(); // must come after Homer init
 
-	if (rtpe_redis) {
+	if (handover)
+		handover_restore(); // the calls are also in Redis, if used
+	else if (rtpe_redis && !rtpe_config.redis_restore_background) {
 		// start redis restore timer
 		gettimeofday(&redis_start, NULL);
 
 		// restore
 		if (redis_restore(rtpe_redis))
 			die("Refusing to continue without working Redis database");
+		for (unsigned int i = 0; i < rtpe_redis_num_shards; i++) {
+			if (redis_restore(rtpe_redis_shards[i].write))
+				die("Refusing to continue without working Redis database");
+		}
 
 		// stop redis restore timer
 		gettimeofday(&redis_stop, NULL);
@@ -1014,6 +1384,8 @@ no_kernel:
 		ilog(LOG_INFO, "Redis restore time = %.0lf ms", redis_diff);
 	}
 
+	handover_listen();
+
 	gettimeofday(&rtpe_latest_graphite_interval_start, NULL);
 
 	timeval_from_us(&tmp_tv, (long long) rtpe_config.graphite_interval*1000000);
@@ -1021,6 +1393,63 @@ no_kernel:
 }
 
 
+static void thread_pin_cpu(int idx, const char *what) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus <= 0)
+		return;
+
+	cpu_set_t cs;
+	CPU_ZERO(&cs);
+	CPU_SET(idx % cpus, &cs);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+	if (ret)
+		ilog(LOG_ERR, "Failed to pin %s thread to CPU %li: %s", what, idx % cpus,
+				strerror(ret));
+}
+
+// runs one of the dedicated media pollers, pinned to one CPU
+static void media_poller_loop(void *d) {
+	int idx = GPOINTER_TO_INT(d);
+
+	if (numa_num_nodes)
+		numa_pin_media_poller(idx);
+	else
+		thread_pin_cpu(idx, "media poller");
+	if (idx < rtpe_config.media_busy_pollers)
+		poller_loop_busy(rtpe_media_pollers[idx]);
+	else
+		poller_loop(rtpe_media_pollers[idx]);
+}
+
+// restores calls while media and signalling are already being processed
+static void redis_restore_thread(void *d) {
+	if (redis_restore(rtpe_redis))
+		ilog(LOG_ERR, "Failed to restore calls from Redis");
+	for (unsigned int i = 0; i < rtpe_redis_num_shards; i++) {
+		if (redis_restore(rtpe_redis_shards[i].write))
+			ilog(LOG_ERR, "Failed to restore calls from Redis shard %s",
+					endpoint_print_buf(&rtpe_redis_shards[i].write->endpoint));
+	}
+}
+
+// transcoding workers are pinned to the CPUs following the ones used by the media pollers
+static void transcode_worker_loop(void *d) {
+	int idx = GPOINTER_TO_INT(d);
+
+	thread_pin_cpu(rtpe_config.media_pollers + idx, "transcoding");
+	codec_worker_loop(NULL);
+}
+
+// T.38 gateway threads come after the transcoding workers
+static void t38_thread_loop(void *d) {
+	int idx = GPOINTER_TO_INT(d);
+
+	thread_pin_cpu(rtpe_config.media_pollers + rtpe_config.transcode_threads + idx, "T.38");
+	t38_worker_loop(NULL);
+}
+
+
 int main(int argc, char **argv) {
 	int idx;
 
@@ -1039,20 +1468,72 @@ int main(int argc, char **argv) {
 	if (!is_addr_unspecified(&rtpe_config.redis_ep.address) && initial_rtpe_config.redis_delete_async)
 		thread_create_detach(redis_delete_async_loop, NULL);
 
+	if (rtpe_config.redis_notify_threads && rtpe_config.redis_subscribed_keyspaces.length) {
+		redis_notify_workers_init();
+		for (idx = 0; idx < rtpe_config.redis_notify_threads; idx++)
+			thread_create_detach(redis_notify_worker_loop, GUINT_TO_POINTER(idx));
+	}
 	if (!is_addr_unspecified(&rtpe_config.redis_ep.address) && rtpe_redis_notify)
 		thread_create_detach(redis_notify_loop, NULL);
+	for (idx = 0; idx < rtpe_redis_num_shards; idx++) {
+		if (rtpe_redis_shards[idx].notify)
+			thread_create_detach(redis_notify_loop, rtpe_redis_shards[idx].notify);
+	}
+
+	if (rtpe_redis_write)
+		thread_create_detach(redis_writer_loop, NULL);
 
 	if (!is_addr_unspecified(&rtpe_config.graphite_ep.address))
 		thread_create_detach(graphite_loop, NULL);
 
+	if (has_homer())
+		thread_create_detach(homer_sender_loop, NULL);
+	if (selected_recording_method && !strcmp(selected_recording_method->name, "pcap"))
+		thread_create_detach(recording_pcap_writer_loop, NULL);
+	if (rtpe_config.replicate_to.port)
+		thread_create_detach(replication_sender_loop, NULL);
+	if (rtpe_config.replicate_listen.port)
+		thread_create_detach(replication_standby_loop, NULL);
+
 	thread_create_detach(ice_thread_run, NULL);
+	thread_create_detach(call_reaper_loop, NULL);
 
 	websocket_start();
 
 	service_notify("READY=1\n");
 
+	for (idx = 0; idx < rtpe_config.control_ng_threads; ++idx)
+		thread_create_detach(control_ng_worker_loop, GINT_TO_POINTER(idx));
+
 	for (idx = 0; idx < rtpe_config.num_threads; ++idx)
 		thread_create_detach_prio(poller_loop, rtpe_poller, rtpe_config.scheduling, rtpe_config.priority);
+	if (rtpe_redis && rtpe_config.redis_restore_background && !handover)
+		thread_create_detach(redis_restore_thread, NULL);
+
+	for (idx = 0; idx < rtpe_config.media_pollers; ++idx)
+		thread_create_detach_prio(media_poller_loop, GINT_TO_POINTER(idx), rtpe_config.scheduling,
+				rtpe_config.priority);
+	interfaces_isolation_start();
+	for (idx = 0; idx < rtpe_config.transcode_threads; ++idx)
+		thread_create_detach_prio(transcode_worker_loop, GINT_TO_POINTER(idx), rtpe_config.scheduling,
+				rtpe_config.priority);
+	for (idx = 0; idx < rtpe_config.t38_threads; ++idx)
+		thread_create_detach_prio(t38_thread_loop, GINT_TO_POINTER(idx), rtpe_config.scheduling,
+				rtpe_config.priority);
+	for (idx = 0; idx < rtpe_config.dtls_threads; ++idx)
+		thread_create_detach(dtls_worker_loop, NULL);
+#ifdef WITH_TRANSCODING
+	for (idx = 0; idx < rtpe_config.media_open_threads; ++idx)
+		thread_create_detach(media_player_open_loop, NULL);
+#endif
+	if (rtpe_config.socket_pool > 0)
+		thread_create_detach(socket_pool_loop, NULL);
+	if (rtpe_config.ipset || rtpe_config.ipset6)
+		thread_create_detach(ipset_loop, NULL);
+	if (_log_facility_cdr)
+		thread_create_detach(cdr_loop, NULL);
+	if (dtmf_do_logging())
+		thread_create_detach(dtmf_log_loop, NULL);
 
 	if (rtpe_config.media_num_threads < 0)
 		rtpe_config.media_num_threads = rtpe_config.num_threads;
@@ -1061,10 +1542,6 @@ int main(int argc, char **argv) {
 		thread_create_detach_prio(media_player_loop, NULL, rtpe_config.scheduling, rtpe_config.priority);
 #endif
 		thread_create_detach_prio(send_timer_loop, NULL, rtpe_config.scheduling, rtpe_config.priority);
-		if (rtpe_config.jb_length > 0)
-			thread_create_detach_prio(jitter_buffer_loop, NULL, rtpe_config.scheduling,
-					rtpe_config.priority);
-		thread_create_detach_prio(codec_timers_loop, NULL, rtpe_config.scheduling, rtpe_config.priority);
 	}
 
 
@@ -1085,6 +1562,10 @@ int main(int argc, char **argv) {
 
 	if (!is_addr_unspecified(&rtpe_config.redis_ep.address) && rtpe_redis_notify)
 		redis_async_event_base_action(rtpe_redis_notify, EVENT_BASE_LOOPBREAK);
+	for (idx = 0; idx < rtpe_redis_num_shards; idx++) {
+		if (rtpe_redis_shards[idx].notify)
+			redis_async_event_base_action(rtpe_redis_shards[idx].notify, EVENT_BASE_LOOPBREAK);
+	}
 
 	threads_join_all(1);
 
@@ -1093,6 +1574,10 @@ int main(int argc, char **argv) {
 
 	if (!is_addr_unspecified(&rtpe_config.redis_ep.address) && rtpe_redis_notify)
 		redis_async_event_base_action(rtpe_redis_notify, EVENT_BASE_FREE);
+	for (idx = 0; idx < rtpe_redis_num_shards; idx++) {
+		if (rtpe_redis_shards[idx].notify)
+			redis_async_event_base_action(rtpe_redis_shards[idx].notify, EVENT_BASE_FREE);
+	}
 
 	ilog(LOG_INFO, "Version %s shutting down", RTPENGINE_VERSION);
 
@@ -1104,6 +1589,7 @@ int main(int argc, char **argv) {
 
 	jitter_buffer_init_free();
 	media_player_free();
+	conference_free();
 	codeclib_free();
 	statistics_free();
 	call_interfaces_free();
@@ -1112,11 +1598,14 @@ int main(int argc, char **argv) {
 	dtls_cert_free();
 	control_ng_cleanup();
 	codecs_cleanup();
+	t38_cleanup();
 
 	redis_close(rtpe_redis);
 	if (rtpe_redis_write != rtpe_redis)
 		redis_close(rtpe_redis_write);
 	redis_close(rtpe_redis_notify);
+	redis_shards_free();
+	redis_notify_workers_free();
 
 	free_prefix();
 
@@ -1129,6 +1618,9 @@ int main(int argc, char **argv) {
 	obj_release(rtpe_tcp);
 	obj_release(rtpe_control_ng);
 	poller_free(&rtpe_poller);
+	for (idx = 0; idx < rtpe_config.media_pollers; idx++)
+		poller_free(&rtpe_media_pollers[idx]);
+	g_free(rtpe_media_pollers);
 
 	return 0;
 }
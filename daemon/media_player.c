@@ -1,5 +1,9 @@
 #include "media_player.h"
 #include <glib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #ifdef WITH_TRANSCODING
 #include <mysql.h>
 #include <mysql/errmsg.h>
@@ -24,10 +28,55 @@
 
 
 #ifdef WITH_TRANSCODING
+struct media_player_cache_entry {
+	str *key;
+	int complete; // LOCK: media_player_cache_lock
+	GPtrArray *packets; // of struct media_player_cache_packet, immutable once complete
+	unsigned long first_ts;
+	unsigned int clock_rate;
+	unsigned long duration;
+};
+struct media_player_cache_packet {
+	unsigned long ts_off; // relative to the first packet
+	unsigned int len;
+	char payload[0];
+};
+
 static struct timerthread media_player_thread;
 static MYSQL __thread *mysql_conn;
 
+// encoded prompts keyed by source and output codec, plus raw audio from the DB keyed by ID
+static mutex_t media_player_cache_lock = MUTEX_STATIC_INIT;
+static GHashTable *media_player_cache;
+static GHashTable *media_player_db_cache;
+
+// files mapped through --player-mmap, shared read-only between all players. the table
+// holds one reference, and a mapping is replaced when the file changes on disk
+struct media_player_map {
+	str data;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	unsigned int refs; // LOCK: media_player_map_lock
+};
+static mutex_t media_player_map_lock = MUTEX_STATIC_INIT;
+static GHashTable *media_player_maps;
+
 static void media_player_read_packet(struct media_player *mp);
+static void media_player_cache_abort(struct media_player *mp);
+static void media_player_map_put(struct media_player_map *map);
+static int __media_player_play_blob(struct media_player *mp, const str *blob, int shared);
+
+// files waiting to be opened by a worker thread
+struct media_player_open_job {
+	struct media_player *mp;
+	unsigned int gen;
+	char file[0];
+};
+
+static mutex_t media_player_open_lock = MUTEX_STATIC_INIT;
+static cond_t media_player_open_cond = COND_STATIC_INIT;
+static GQueue media_player_open_queue = G_QUEUE_INIT;
 #endif
 
 static struct timerthread send_timer_thread;
@@ -53,12 +102,22 @@ static void media_player_shutdown(struct media_player *mp) {
 		return;
 
 	//ilog(LOG_DEBUG, "shutting down media_player");
+	// discard the result of a file open that is still in progress
+	mutex_lock(&mp->lock);
+	mp->open_gen++;
+	mutex_unlock(&mp->lock);
+
 	timerthread_obj_deschedule(&mp->tt_obj);
 	mp->next_run.tv_sec = 0;
 	avformat_close_input(&mp->fmtctx);
 
+	media_player_cache_abort(mp);
+	mp->cache_entry = NULL;
+
 	if (mp->sink) {
 		unsigned int num = send_timer_flush(mp->sink->send_timer, mp->handler);
+		// packets played out from the cache have no handler
+		num += send_timer_flush(mp->sink->send_timer, mp);
 		ilog(LOG_DEBUG, "%u packets removed from send queue", num);
 		// roll back seq numbers already used
 		mp->ssrc_out->parent->seq_diff -= num;
@@ -71,9 +130,15 @@ static void media_player_shutdown(struct media_player *mp) {
 			av_freep(&mp->avioctx->buffer);
 		av_freep(&mp->avioctx);
 	}
-	if (mp->blob)
+	if (mp->blob) {
+		call_mem_add(&mp->call->mem[CALL_MEM_PLAYER], -(ssize_t) (sizeof(*mp->blob) + mp->blob->len));
 		free(mp->blob);
+	}
 	mp->blob = NULL;
+	if (mp->map)
+		media_player_map_put(mp->map);
+	mp->map = NULL;
+	mp->read_src = STR_NULL;
 	mp->read_pos = STR_NULL;
 }
 #endif
@@ -95,6 +160,7 @@ static void __media_player_free(void *p) {
 	media_player_shutdown(mp);
 	ssrc_ctx_put(&mp->ssrc_out);
 	mutex_destroy(&mp->lock);
+	call_mem_add(&mp->call->mem[CALL_MEM_PLAYER], -(ssize_t) sizeof(*mp));
 	obj_put(mp->call);
 }
 #endif
@@ -119,6 +185,7 @@ struct media_player *media_player_new(struct call_monologue *ml) {
 	mp->call = obj_get(ml->call);
 	mp->ml = ml;
 	mp->seq = random();
+	call_mem_add(&mp->call->mem[CALL_MEM_PLAYER], sizeof(*mp));
 	mp->ssrc_out = ssrc_ctx;
 
 	av_init_packet(&mp->pkt);
@@ -169,7 +236,10 @@ static void send_timer_rtcp(struct send_timer *st, struct ssrc_ctx *ssrc_out) {
 	if (!media)
 		return;
 
-	rtcp_send_report(media, ssrc_out);
+	static __thread GString *buf; // reused for all reports
+	if (!buf)
+		buf = g_string_sized_new(256);
+	rtcp_send_report(media, ssrc_out, buf);
 
 	// XXX missing locking?
 	ssrc_out->next_rtcp = rtpe_now;
@@ -193,9 +263,6 @@ static void __send_timer_send_common(struct send_timer *st, struct codec_packet
 				FMT_M(sockaddr_print_buf(&st->sink->endpoint.address),
 				st->sink->endpoint.port));
 
-	socket_sendto(&st->sink->selected_sfd->socket,
-			cp->s.s, cp->s.len, &st->sink->endpoint);
-
 	if (cp->ssrc_out && cp->rtp) {
 		atomic64_inc(&cp->ssrc_out->packets);
 		atomic64_add(&cp->ssrc_out->octets, cp->s.len);
@@ -208,10 +275,20 @@ static void __send_timer_send_common(struct send_timer *st, struct codec_packet
 
 	// do we send RTCP?
 	struct ssrc_ctx *ssrc_out = cp->ssrc_out;
-	if (ssrc_out && ssrc_out->next_rtcp.tv_sec) {
-		if (timeval_diff(&ssrc_out->next_rtcp, &rtpe_now) < 0)
-			send_timer_rtcp(st, ssrc_out);
+	if (ssrc_out && ssrc_out->next_rtcp.tv_sec && timeval_diff(&ssrc_out->next_rtcp, &rtpe_now) < 0)
+		ssrc_ctx_hold(ssrc_out);
+	else
+		ssrc_out = NULL;
+
+	media_socket_send_packet(st->sink->selected_sfd, &st->sink->endpoint, cp);
+
+	if (ssrc_out) {
+		// RTCP is sent directly, so anything batched up must go out before it
+		media_socket_send_batch_sync();
+		send_timer_rtcp(st, ssrc_out);
+		ssrc_ctx_put(&ssrc_out);
 	}
+	return;
 
 out:
 	codec_packet_free(cp);
@@ -223,11 +300,11 @@ static void send_timer_send_lock(struct send_timer *st, struct codec_packet *cp)
 		return;
 
 	log_info_call(call);
-	rwlock_lock_r(&call->master_lock);
+	call_packet_lock(call);
 
 	__send_timer_send_common(st, cp);
 
-	rwlock_unlock_r(&call->master_lock);
+	call_packet_unlock(call);
 	log_info_clear();
 
 }
@@ -255,17 +332,28 @@ void send_timer_push(struct send_timer *st, struct codec_packet *cp) {
 
 
 
-int media_player_setup(struct media_player *mp, const struct rtp_payload_type *src_pt) {
-	// find suitable output payload type
-	struct rtp_payload_type *dst_pt;
+// find suitable output payload type
+static struct rtp_payload_type *media_player_dst_pt(struct media_player *mp) {
 	for (GList *l = mp->media->codecs_prefs_send.head; l; l = l->next) {
-		dst_pt = l->data;
+		struct rtp_payload_type *dst_pt = l->data;
 		ensure_codec_def(dst_pt, mp->media);
 		if (dst_pt->codec_def && !dst_pt->codec_def->supplemental)
-			goto found;
+			return dst_pt;
 	}
-	dst_pt = NULL;
-found:
+	return NULL;
+}
+
+// if we played anything before, scale our sync TS according to the time
+// that has passed
+static void media_player_sync_ts(struct media_player *mp, const struct rtp_payload_type *dst_pt) {
+	if (!mp->sync_ts_tv.tv_sec)
+		return;
+	long long ts_diff_us = timeval_diff(&rtpe_now, &mp->sync_ts_tv);
+	mp->sync_ts += ts_diff_us * dst_pt->clock_rate / 1000000 / dst_pt->codec_def->clockrate_mult;
+}
+
+int media_player_setup(struct media_player *mp, const struct rtp_payload_type *src_pt) {
+	struct rtp_payload_type *dst_pt = media_player_dst_pt(mp);
 	if (!dst_pt) {
 		ilog(LOG_ERR, "No supported output codec found in SDP");
 		return -1;
@@ -273,12 +361,7 @@ found:
 	ilog(LOG_DEBUG, "Output codec for media playback is " STR_FORMAT,
 			STR_FMT(&dst_pt->encoding_with_params));
 
-	// if we played anything before, scale our sync TS according to the time
-	// that has passed
-	if (mp->sync_ts_tv.tv_sec) {
-		long long ts_diff_us = timeval_diff(&rtpe_now, &mp->sync_ts_tv);
-		mp->sync_ts += ts_diff_us * dst_pt->clock_rate / 1000000 / dst_pt->codec_def->clockrate_mult;
-	}
+	media_player_sync_ts(mp, dst_pt);
 
 	// if we already have a handler, see if anything needs changing
 	if (mp->handler) {
@@ -329,6 +412,224 @@ static int __ensure_codec_handler(struct media_player *mp, AVStream *avs) {
 }
 
 
+// appropriate lock must be held
+static void media_player_send_packets(struct media_player *mp, struct media_packet *packet) {
+	media_packet_encrypt(mp->crypt_handler->out->rtp_crypt, mp->crypt_handler->out->rtp_crypt_batch,
+			mp->sink, packet);
+
+	mutex_lock(&mp->sink->out_lock);
+	if (media_socket_dequeue(packet, mp->sink))
+		ilog(LOG_ERR, "Error sending playback media to RTP sink");
+	mutex_unlock(&mp->sink->out_lock);
+}
+
+
+static void media_player_cache_entry_free(void *p) {
+	struct media_player_cache_entry *entry = p;
+	g_ptr_array_free(entry->packets, TRUE);
+	g_free(entry->key);
+	g_slice_free1(sizeof(*entry), entry);
+}
+
+static str *media_player_cache_key(const struct rtp_payload_type *dst_pt, char type, const str *source) {
+	GString *s = g_string_new_str();
+	g_string_append_printf(s, "%c/" STR_FORMAT "/" STR_FORMAT "/%i/%i/", type,
+			STR_FMT(&dst_pt->encoding_with_params),
+			STR_FMT(&dst_pt->format_parameters),
+			dst_pt->ptime, dst_pt->bitrate);
+	g_string_append_len(s, source->s, source->len);
+	return g_string_free_str(s);
+}
+
+// appropriate lock must be held
+static void media_player_play_cached_packet(struct media_player *mp) {
+	struct media_player_cache_entry *entry = mp->cache_entry;
+	if (!entry || !mp->sink)
+		return;
+	if (mp->cache_index >= entry->packets->len) {
+		ilog(LOG_DEBUG, "End of cached media prompt");
+		return;
+	}
+
+	struct media_player_cache_packet *cp = g_ptr_array_index(entry->packets, mp->cache_index);
+	struct ssrc_entry_call *ssrc_out_p = mp->ssrc_out->parent;
+	unsigned long ts = mp->cache_ts + cp->ts_off;
+
+	char *buf = codec_packet_buffer(cp->len);
+	struct rtp_header *rh = (void *) buf;
+	*rh = (struct rtp_header) {
+		.v_p_x_cc = 0x80,
+		.m_pt = mp->cache_pt | (mp->cache_index == 0 ? 0x80 : 0),
+		.seq_num = htons(mp->seq + (ssrc_out_p->seq_diff += 1)),
+		.timestamp = htonl(ts),
+		.ssrc = htonl(ssrc_out_p->h.ssrc),
+	};
+	memcpy(buf + sizeof(*rh), cp->payload, cp->len);
+
+	struct codec_packet *p = codec_packet_new();
+	p->s.s = buf;
+	p->s.len = cp->len + sizeof(*rh);
+	p->free_func = codec_packet_buffer_free;
+	p->ttq_entry.source = mp;
+	p->ttq_entry.when = mp->next_run;
+	p->rtp = rh;
+	p->ts = ts;
+	p->ssrc_out = ssrc_ctx_get(mp->ssrc_out);
+	payload_tracker_add(&mp->ssrc_out->tracker, mp->cache_pt);
+
+	struct media_packet packet = {
+		.tv = rtpe_now,
+		.call = mp->call,
+		.media = mp->media,
+		.media_out = mp->media,
+		.rtp = rh,
+		.ssrc_out = mp->ssrc_out,
+	};
+	g_queue_push_tail(&packet.packets_out, p);
+
+	mp->sync_ts = ts;
+	mp->sync_ts_tv = mp->next_run;
+
+	media_player_send_packets(mp, &packet);
+
+	mp->cache_index++;
+	if (mp->cache_index >= entry->packets->len)
+		return;
+
+	struct media_player_cache_packet *next = g_ptr_array_index(entry->packets, mp->cache_index);
+	timeval_add_usec(&mp->next_run, (next->ts_off - cp->ts_off) * 1000000LL / entry->clock_rate);
+	timerthread_obj_schedule_abs(&mp->tt_obj, &mp->next_run);
+}
+
+// call->master_lock held in W. returns 1 if playback from the cache has started. otherwise
+// the caller must play the media itself, which may populate a new cache entry.
+static int media_player_cache_lookup(struct media_player *mp, char type, const str *source) {
+	if (!rtpe_config.player_cache)
+		return 0;
+
+	struct rtp_payload_type *dst_pt = media_player_dst_pt(mp);
+	if (!dst_pt)
+		return 0;
+
+	str *key = media_player_cache_key(dst_pt, type, source);
+
+	mutex_lock(&media_player_cache_lock);
+
+	struct media_player_cache_entry *entry = g_hash_table_lookup(media_player_cache, key);
+	if (entry) {
+		g_free(key);
+		if (!entry->complete) {
+			// someone else is still encoding it
+			mutex_unlock(&media_player_cache_lock);
+			return 0;
+		}
+		mutex_unlock(&media_player_cache_lock);
+
+		ilog(LOG_DEBUG, "Playing media prompt from cache (%u packets)", entry->packets->len);
+
+		media_player_sync_ts(mp, dst_pt);
+		while (!mp->sync_ts)
+			mp->sync_ts = random();
+
+		mp->cache_entry = entry;
+		mp->cache_index = 0;
+		mp->cache_ts = mp->sync_ts;
+		mp->cache_pt = dst_pt->payload_type;
+		mp->duration = entry->duration;
+		mp->run_func = media_player_play_cached_packet;
+		mp->next_run = rtpe_now;
+		media_player_play_cached_packet(mp);
+		return 1;
+	}
+
+	entry = g_slice_alloc0(sizeof(*entry));
+	entry->key = key;
+	entry->packets = g_ptr_array_new_with_free_func(g_free);
+	entry->clock_rate = dst_pt->clock_rate;
+	g_hash_table_insert(media_player_cache, entry->key, entry);
+
+	mutex_unlock(&media_player_cache_lock);
+
+	mp->cache_fill = entry;
+	return 0;
+}
+
+// records freshly encoded output into the cache entry being filled
+static void media_player_cache_add(struct media_player *mp, GQueue *packets) {
+	struct media_player_cache_entry *entry = mp->cache_fill;
+
+	for (GList *l = packets->head; l; l = l->next) {
+		struct codec_packet *p = l->data;
+		if (!p->rtp)
+			continue;
+		if ((p->rtp->m_pt & 0x7f) != mp->handler->dest_pt.payload_type) {
+			// DTMF, CN etc - don't cache anything
+			media_player_cache_abort(mp);
+			return;
+		}
+		if (!entry->packets->len)
+			entry->first_ts = p->ts;
+
+		unsigned int len = p->s.len - sizeof(struct rtp_header);
+		struct media_player_cache_packet *cp = g_malloc(sizeof(*cp) + len);
+		cp->ts_off = (uint32_t) (p->ts - entry->first_ts);
+		cp->len = len;
+		memcpy(cp->payload, p->s.s + sizeof(struct rtp_header), len);
+		g_ptr_array_add(entry->packets, cp);
+	}
+}
+
+static void media_player_cache_finish(struct media_player *mp) {
+	struct media_player_cache_entry *entry = mp->cache_fill;
+	if (!entry)
+		return;
+	if (!entry->packets->len) {
+		media_player_cache_abort(mp);
+		return;
+	}
+
+	mp->cache_fill = NULL;
+	entry->duration = mp->duration;
+
+	ilog(LOG_DEBUG, "Media prompt cached (%u packets)", entry->packets->len);
+
+	mutex_lock(&media_player_cache_lock);
+	entry->complete = 1;
+	mutex_unlock(&media_player_cache_lock);
+}
+
+// drop an incomplete cache entry so that the next playback tries again
+static void media_player_cache_abort(struct media_player *mp) {
+	struct media_player_cache_entry *entry = mp->cache_fill;
+	if (!entry)
+		return;
+	mp->cache_fill = NULL;
+
+	mutex_lock(&media_player_cache_lock);
+	g_hash_table_remove(media_player_cache, entry->key);
+	mutex_unlock(&media_player_cache_lock);
+}
+
+// returns the cached database prompt, or NULL. the returned blob remains valid until shutdown.
+static str *media_player_db_cache_get(const char *id) {
+	if (!rtpe_config.player_cache)
+		return NULL;
+	mutex_lock(&media_player_cache_lock);
+	str *ret = g_hash_table_lookup(media_player_db_cache, id);
+	mutex_unlock(&media_player_cache_lock);
+	return ret;
+}
+
+static void media_player_db_cache_add(const char *id, const str *blob) {
+	if (!rtpe_config.player_cache)
+		return;
+	mutex_lock(&media_player_cache_lock);
+	if (!g_hash_table_lookup(media_player_db_cache, id))
+		g_hash_table_insert(media_player_db_cache, g_strdup(id), str_dup(blob));
+	mutex_unlock(&media_player_cache_lock);
+}
+
+
 // appropriate lock must be held
 void media_player_add_packet(struct media_player *mp, char *buf, size_t len,
 		long long us_dur, unsigned long long pts)
@@ -352,6 +653,9 @@ void media_player_add_packet(struct media_player *mp, char *buf, size_t len,
 
 	mp->handler->func(mp->handler, &packet);
 
+	if (mp->cache_fill)
+		media_player_cache_add(mp, &packet.packets_out);
+
 	// as this is timing sensitive and we may have spent some time decoding,
 	// update our global "now" timestamp
 	gettimeofday(&rtpe_now, NULL);
@@ -366,12 +670,7 @@ void media_player_add_packet(struct media_player *mp, char *buf, size_t len,
 		}
 	}
 
-	media_packet_encrypt(mp->crypt_handler->out->rtp_crypt, mp->sink, &packet);
-
-	mutex_lock(&mp->sink->out_lock);
-	if (media_socket_dequeue(&packet, mp->sink))
-		ilog(LOG_ERR, "Error sending playback media to RTP sink");
-	mutex_unlock(&mp->sink->out_lock);
+	media_player_send_packets(mp, &packet);
 
 	timeval_add_usec(&mp->next_run, us_dur);
 	timerthread_obj_schedule_abs(&mp->tt_obj, &mp->next_run);
@@ -387,9 +686,11 @@ static void media_player_read_packet(struct media_player *mp) {
 	if (ret < 0) {
 		if (ret == AVERROR_EOF) {
 			ilog(LOG_DEBUG, "EOF reading from media stream");
+			media_player_cache_finish(mp);
 			return;
 		}
 		ilog(LOG_ERR, "Error while reading from media stream");
+		media_player_cache_abort(mp);
 		return;
 	}
 
@@ -475,6 +776,7 @@ static void media_player_play_start(struct media_player *mp) {
 	// needed to have usable duration for some formats. ignore errors.
 	avformat_find_stream_info(mp->fmtctx, NULL);
 
+	mp->run_func = media_player_read_packet;
 	mp->next_run = rtpe_now;
 	// give ourselves a bit of a head start with decoding
 	timeval_add_usec(&mp->next_run, -50000);
@@ -483,18 +785,195 @@ static void media_player_play_start(struct media_player *mp) {
 #endif
 
 
-// call->master_lock held in W
+#ifdef WITH_TRANSCODING
+static void media_player_map_put(struct media_player_map *map) {
+	mutex_lock(&media_player_map_lock);
+	unsigned int refs = --map->refs;
+	mutex_unlock(&media_player_map_lock);
+	if (refs)
+		return;
+	munmap(map->data.s, map->data.len);
+	g_slice_free1(sizeof(*map), map);
+}
+
+// returns a new reference to the mapped file, or NULL
+static struct media_player_map *media_player_map_get(const char *path) {
+	struct stat st;
+	if (stat(path, &st)) {
+		ilog(LOG_ERR, "Failed to stat media file '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	mutex_lock(&media_player_map_lock);
+	struct media_player_map *map = g_hash_table_lookup(media_player_maps, path);
+	if (map && map->dev == st.st_dev && map->ino == st.st_ino && map->data.len == st.st_size
+			&& map->mtime.tv_sec == st.st_mtim.tv_sec
+			&& map->mtime.tv_nsec == st.st_mtim.tv_nsec)
+	{
+		map->refs++;
+		mutex_unlock(&media_player_map_lock);
+		return map;
+	}
+	mutex_unlock(&media_player_map_lock);
+
+	// not mapped yet, or changed
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		ilog(LOG_ERR, "Failed to open media file '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fstat(fd, &st) || !st.st_size) {
+		ilog(LOG_ERR, "Media file '%s' is empty or unreadable", path);
+		close(fd);
+		return NULL;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		ilog(LOG_ERR, "Failed to map media file '%s': %s", path, strerror(errno));
+		return NULL;
+	}
+
+	map = g_slice_alloc0(sizeof(*map));
+	str_init_len(&map->data, p, st.st_size);
+	map->dev = st.st_dev;
+	map->ino = st.st_ino;
+	map->mtime = st.st_mtim;
+	map->refs = 2; // table and caller
+
+	ilog(LOG_DEBUG, "Mapped media file '%s' (%lu bytes)", path, (unsigned long) st.st_size);
+
+	// an older mapping stays around until its last player is done with it
+	mutex_lock(&media_player_map_lock);
+	struct media_player_map *old = g_hash_table_lookup(media_player_maps, path);
+	g_hash_table_insert(media_player_maps, g_strdup(path), map);
+	mutex_unlock(&media_player_map_lock);
+	if (old)
+		media_player_map_put(old);
+
+	return map;
+}
+
+// runs from the media player timer once a worker has opened the file
+static void media_player_open_done(struct media_player *mp) {
+	mp->run_func = media_player_read_packet;
+
+	if (mp->open_err) {
+		ilog(LOG_ERR, "Failed to open media file for playback: %s", av_error(mp->open_err));
+		media_player_cache_abort(mp);
+		return;
+	}
+
+	mp->next_run = rtpe_now;
+	// give ourselves a bit of a head start with decoding
+	timeval_add_usec(&mp->next_run, -50000);
+	media_player_read_packet(mp);
+}
+
+static void media_player_open_job_run(struct media_player_open_job *job) {
+	struct media_player *mp = job->mp;
+	AVFormatContext *fmtctx = NULL;
+
+	log_info_call(mp->call);
+
+	int ret = avformat_open_input(&fmtctx, job->file, NULL, NULL);
+	if (ret >= 0) {
+		// needed to have usable duration for some formats. ignore errors.
+		avformat_find_stream_info(fmtctx, NULL);
+	}
+
+	mutex_lock(&mp->lock);
+	if (mp->open_gen != job->gen) {
+		// stopped or restarted in the meantime
+		mutex_unlock(&mp->lock);
+		ilog(LOG_DEBUG, "Discarding media file opened for stopped playback");
+		avformat_close_input(&fmtctx);
+		goto out;
+	}
+	mp->fmtctx = fmtctx;
+	mp->open_err = ret < 0 ? ret : 0;
+	mp->run_func = media_player_open_done;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	timerthread_obj_schedule_abs(&mp->tt_obj, &now);
+	mutex_unlock(&mp->lock);
+
+out:
+	media_player_put(&mp);
+	free(job);
+	log_info_clear();
+}
+
+static void media_player_open_push(struct media_player *mp, const char *file) {
+	size_t len = strlen(file);
+	struct media_player_open_job *job = malloc(sizeof(*job) + len + 1);
+	job->mp = media_player_get(mp);
+	mutex_lock(&mp->lock);
+	job->gen = mp->open_gen;
+	mutex_unlock(&mp->lock);
+	memcpy(job->file, file, len + 1);
+
+	mutex_lock(&media_player_open_lock);
+	g_queue_push_tail(&media_player_open_queue, job);
+	cond_signal(&media_player_open_cond);
+	mutex_unlock(&media_player_open_lock);
+}
+
+// runs one thread opening media files for playback
+void media_player_open_loop(void *p) {
+	mutex_lock(&media_player_open_lock);
+
+	while (!rtpe_shutdown) {
+		struct media_player_open_job *job = g_queue_pop_head(&media_player_open_queue);
+		if (!job) {
+			struct timeval tv;
+			gettimeofday(&tv, NULL);
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&media_player_open_cond, &media_player_open_lock, &tv);
+			continue;
+		}
+		mutex_unlock(&media_player_open_lock);
+
+		media_player_open_job_run(job);
+
+		mutex_lock(&media_player_open_lock);
+	}
+
+	mutex_unlock(&media_player_open_lock);
+}
+#endif
+
+
+// call->master_lock held in W. returns 1 if the file is being opened in the background
 int media_player_play_file(struct media_player *mp, const str *file) {
 #ifdef WITH_TRANSCODING
 	if (media_player_play_init(mp))
 		return -1;
+	if (media_player_cache_lookup(mp, 'F', file))
+		return 0;
 
 	char file_s[PATH_MAX];
 	snprintf(file_s, sizeof(file_s), STR_FORMAT, STR_FMT(file));
 
+	if (media_player_maps) {
+		struct media_player_map *map = media_player_map_get(file_s);
+		if (!map) {
+			media_player_cache_abort(mp);
+			return -1;
+		}
+		mp->map = map;
+		return __media_player_play_blob(mp, &map->data, 1);
+	}
+
+	if (rtpe_config.media_open_threads > 0) {
+		media_player_open_push(mp, file_s);
+		return 1;
+	}
+
 	int ret = avformat_open_input(&mp->fmtctx, file_s, NULL, NULL);
 	if (ret < 0) {
 		ilog(LOG_ERR, "Failed to open media file for playback: %s", av_error(ret));
+		media_player_cache_abort(mp);
 		return -1;
 	}
 
@@ -534,7 +1013,7 @@ static int64_t __mp_avio_seek_set(struct media_player *mp, int64_t offset) {
 	ilog(LOG_DEBUG, "__mp_avio_seek_set(%" PRIi64 ")", offset);
 	if (offset < 0)
 		return AVERROR(EINVAL);
-	mp->read_pos = *mp->blob;
+	mp->read_pos = mp->read_src;
 	if (str_shift(&mp->read_pos, offset))
 		return AVERROR_EOF;
 	return offset;
@@ -545,29 +1024,32 @@ static int64_t __mp_avio_seek(void *opaque, int64_t offset, int whence) {
 	if (whence == SEEK_SET)
 		return __mp_avio_seek_set(mp, offset);
 	if (whence == SEEK_CUR)
-		return __mp_avio_seek_set(mp, ((int64_t) (mp->read_pos.s - mp->blob->s)) + offset);
+		return __mp_avio_seek_set(mp, ((int64_t) (mp->read_pos.s - mp->read_src.s)) + offset);
 	if (whence == SEEK_END)
-		return __mp_avio_seek_set(mp, ((int64_t) mp->blob->len) + offset);
+		return __mp_avio_seek_set(mp, ((int64_t) mp->read_src.len) + offset);
 	return AVERROR(EINVAL);
 }
 #endif
 
 
 
-// call->master_lock held in W
-int media_player_play_blob(struct media_player *mp, const str *blob) {
 #ifdef WITH_TRANSCODING
+// call->master_lock held in W. a `shared` blob must remain valid until playback is stopped
+static int __media_player_play_blob(struct media_player *mp, const str *blob, int shared) {
 	const char *err;
 	int av_ret = 0;
 
-	if (media_player_play_init(mp))
-		return -1;
-
-	mp->blob = str_dup(blob);
-	err = "out of memory";
-	if (!mp->blob)
-		goto err;
-	mp->read_pos = *mp->blob;
+	if (shared)
+		mp->read_src = *blob;
+	else {
+		mp->blob = str_dup(blob);
+		err = "out of memory";
+		if (!mp->blob)
+			goto err;
+		call_mem_add(&mp->call->mem[CALL_MEM_PLAYER], sizeof(*mp->blob) + mp->blob->len);
+		mp->read_src = *mp->blob;
+	}
+	mp->read_pos = mp->read_src;
 
 	err = "could not allocate AVFormatContext";
 	mp->fmtctx = avformat_alloc_context();
@@ -601,8 +1083,24 @@ err:
 	ilog(LOG_ERR, "Failed to start media playback from memory: %s", err);
 	if (av_ret)
 		ilog(LOG_ERR, "Error returned from libav: %s", av_error(av_ret));
+	media_player_cache_abort(mp);
+	return -1;
+}
 #endif
+
+
+// call->master_lock held in W
+int media_player_play_blob(struct media_player *mp, const str *blob) {
+#ifdef WITH_TRANSCODING
+	if (media_player_play_init(mp))
+		return -1;
+	if (media_player_cache_lookup(mp, 'B', blob))
+		return 0;
+
+	return __media_player_play_blob(mp, blob, 0);
+#else
 	return -1;
+#endif
 }
 
 
@@ -638,6 +1136,20 @@ int media_player_play_db(struct media_player *mp, long long id) {
 	if (!rtpe_config.mysql_host || !rtpe_config.mysql_query)
 		goto err;
 
+	if (media_player_play_init(mp))
+		return -1;
+
+	char id_buf[32];
+	snprintf(id_buf, sizeof(id_buf), "%lld", id);
+	str id_str;
+	str_init(&id_str, id_buf);
+	if (media_player_cache_lookup(mp, 'D', &id_str))
+		return 0;
+
+	str *cached_blob = media_player_db_cache_get(id_buf);
+	if (cached_blob)
+		return __media_player_play_blob(mp, cached_blob, 1);
+
 	query = g_strdup_printf(rtpe_config.mysql_query, (unsigned long long) id);
 	size_t len = strlen(query);
 
@@ -677,7 +1189,8 @@ success:;
 
 	str blob;
 	str_init_len(&blob, row[0], lengths[0]);
-	int ret = media_player_play_blob(mp, &blob);
+	media_player_db_cache_add(id_buf, &blob);
+	int ret = __media_player_play_blob(mp, &blob, 0);
 
 	mysql_free_result(res);
 
@@ -688,6 +1201,7 @@ err:
 		ilog(LOG_ERR, "Failed to start media playback from database (used query '%s'): %s", query, err);
 	else
 		ilog(LOG_ERR, "Failed to start media playback from database: %s", err);
+	media_player_cache_abort(mp);
 	return -1;
 }
 
@@ -715,14 +1229,37 @@ static void media_player_run(void *ptr) {
 
 void media_player_init(void) {
 #ifdef WITH_TRANSCODING
+	if (rtpe_config.player_cache) {
+		media_player_cache = g_hash_table_new_full(str_hash, str_equal, NULL,
+				media_player_cache_entry_free);
+		media_player_db_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	}
+	if (rtpe_config.player_mmap)
+		media_player_maps = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	timerthread_init(&media_player_thread, media_player_run);
 #endif
 	timerthread_init(&send_timer_thread, timerthread_queue_run);
+	send_timer_thread.idle_func = media_socket_send_batch_sync;
+	// run everything due within the same millisecond together. entries in the queues are
+	// sent up to 1 ms early anyway
+	send_timer_thread.slack = 1000;
 }
 
 void media_player_free(void) {
 #ifdef WITH_TRANSCODING
 	timerthread_free(&media_player_thread);
+	if (media_player_cache)
+		g_hash_table_destroy(media_player_cache);
+	if (media_player_db_cache)
+		g_hash_table_destroy(media_player_db_cache);
+	if (media_player_maps) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, media_player_maps);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			media_player_map_put(value);
+		g_hash_table_destroy(media_player_maps);
+	}
 #endif
 	timerthread_free(&send_timer_thread);
 }
@@ -736,5 +1273,9 @@ void media_player_loop(void *p) {
 #endif
 void send_timer_loop(void *p) {
 	//ilog(LOG_DEBUG, "send_timer_loop");
+	// output is batched up across all queues that are run in one go, so that consecutive
+	// packets for the same socket go out through one sendmmsg(). see idle_func above
+	media_socket_send_batch_start();
 	timerthread_run(&send_timer_thread);
+	media_socket_send_batch_flush();
 }
@@ -28,6 +28,12 @@
 #include "media_player.h"
 #include "jitter_buffer.h"
 #include "dtmf.h"
+#include "trace.h"
+#include "probes.h"
+#include "handover.h"
+#include "replication.h"
+#include "numa.h"
+#include "simulcast.h"
 
 
 #ifndef PORT_RANDOM_MIN
@@ -43,9 +49,10 @@
 
 struct intf_rr {
 	struct logical_intf hash_key;
-	mutex_t lock;
-	GQueue logical_intfs;
-	struct logical_intf *singular; // set iff only one is present in the list - no lock needed
+	struct logical_intf **logical_intfs; // set up during startup, read-only afterwards
+	unsigned int num_logical_intfs;
+	volatile unsigned int next; // rotating index into logical_intfs
+	struct logical_intf *singular; // set iff only one is present in the list
 };
 struct packet_handler_ctx {
 	// inputs:
@@ -53,10 +60,13 @@ struct packet_handler_ctx {
 
 	struct packet_stream *sink; // where to send output packets to (forward destination)
 	rewrite_func decrypt_func, encrypt_func; // handlers for decrypt/encrypt
+	rewrite_batch_func encrypt_batch_func;
 	rtcp_filter_func *rtcp_filter;
 	struct packet_stream *in_srtp, *out_srtp; // SRTP contexts for decrypt/encrypt (relevant for muxed RTCP)
 	int payload_type; // -1 if unknown or not RTP
 	int rtcp; // true if this is an RTCP packet
+	int buffered; // true if this comes out of the jitter buffer
+	struct re_demux demux; // classification of the raw input packet
 
 	// verdicts:
 	int update; // true if Redis info needs to be updated
@@ -78,6 +88,7 @@ static int call_avp2savp_rtp(str *s, struct packet_stream *, struct stream_fd *,
 		const struct timeval *, struct ssrc_ctx *);
 static int call_savp2avp_rtp(str *s, struct packet_stream *, struct stream_fd *, const endpoint_t *,
 		const struct timeval *, struct ssrc_ctx *);
+static int call_avp2savp_rtp_batch(str *const *s, unsigned int, struct packet_stream *, struct ssrc_ctx *);
 static int call_avp2savp_rtcp(str *s, struct packet_stream *, struct stream_fd *, const endpoint_t *,
 		const struct timeval *, struct ssrc_ctx *);
 static int call_savp2avp_rtcp(str *s, struct packet_stream *, struct stream_fd *, const endpoint_t *,
@@ -192,6 +203,7 @@ static const struct streamhandler_io __shio_decrypt = {
 static const struct streamhandler_io __shio_encrypt = {
 	.kernel		= __k_srtp_encrypt,
 	.rtp_crypt	= call_avp2savp_rtp,
+	.rtp_crypt_batch = call_avp2savp_rtp_batch,
 	.rtcp_crypt	= call_avp2savp_rtcp,
 };
 static const struct streamhandler_io __shio_decrypt_rtcp_only = {
@@ -382,6 +394,7 @@ static GHashTable *__local_intf_addr_type_hash; // addr + type -> GList of struc
 static GQueue __preferred_lists_for_family[__SF_LAST];
 
 GQueue all_local_interfaces = G_QUEUE_INIT;
+GQueue all_intf_isolations = G_QUEUE_INIT;
 
 
 
@@ -392,7 +405,7 @@ static int has_free_ports_loc(struct local_intf *loc, unsigned int num_ports) {
 		return 0;
 	}
 
-	if (num_ports > g_atomic_int_get(&loc->spec->port_pool.free_ports)) {
+	if (num_ports > port_pool_free_ports(&loc->spec->port_pool)) {
 		ilog(LOG_ERR, "Didn't find %d ports available for " STR_FORMAT "/%s",
 			num_ports, STR_FMT(&loc->logical->name),
 			sockaddr_print_buf(&loc->spec->local_address.addr));
@@ -402,7 +415,7 @@ static int has_free_ports_loc(struct local_intf *loc, unsigned int num_ports) {
 	__C_DBG("Found %d ports available for " STR_FORMAT "/%s from total of %d free ports",
 		num_ports, STR_FMT(&loc->logical->name),
 		sockaddr_print_buf(&loc->spec->local_address.addr),
-		loc->spec->port_pool.free_ports);
+		port_pool_free_ports(&loc->spec->port_pool));
 
 	return 1;
 }
@@ -451,32 +464,22 @@ static int has_free_ports_log_all(struct logical_intf *log, unsigned int num_por
 	return 1;
 }
 
-/* run round-robin-calls algorithm */
+/* run round-robin-calls algorithm. each call starts at the next interface, the
+ * following ones are only tried if it's out of ports */
 static struct logical_intf* run_round_robin_calls(struct intf_rr *rr, unsigned int num_ports) {
 	struct logical_intf *log = NULL;
+	unsigned int start = g_atomic_int_add(&rr->next, 1);
 
-	mutex_lock(&rr->lock);
-
-	unsigned int max_tries = rr->logical_intfs.length;
-	unsigned int num_tries = 0;
-
-	while (num_tries++ < max_tries) {
-		log = g_queue_pop_head(&rr->logical_intfs);
-		g_queue_push_tail(&rr->logical_intfs, log);
-
-		mutex_unlock(&rr->lock);
+	for (unsigned int i = 0; i < rr->num_logical_intfs; i++) {
+		log = rr->logical_intfs[(start + i) % rr->num_logical_intfs];
 
 		__C_DBG("Trying %d ports on logical interface " STR_FORMAT, num_ports, STR_FMT(&log->name));
 
 		if (has_free_ports_log_all(log, num_ports))
 			goto done;
 		log = NULL;
-
-		mutex_lock(&rr->lock);
 	}
 
-	mutex_unlock(&rr->lock);
-
 done:
 	if (!log) {
 		ilog(LOG_ERR, "No logical interface with free ports found; fallback to default behaviour");
@@ -620,11 +623,11 @@ static void __add_intf_rr_1(struct logical_intf *lif, str *name_base, sockfamily
 	if (!rr) {
 		rr = g_slice_alloc0(sizeof(*rr));
 		rr->hash_key = key;
-		mutex_init(&rr->lock);
 		g_hash_table_insert(__logical_intf_name_family_rr_hash, &rr->hash_key, rr);
 	}
-	g_queue_push_tail(&rr->logical_intfs, lif);
-	rr->singular = (rr->logical_intfs.length == 1) ? lif : NULL;
+	rr->logical_intfs = g_renew(struct logical_intf *, rr->logical_intfs, rr->num_logical_intfs + 1);
+	rr->logical_intfs[rr->num_logical_intfs++] = lif;
+	rr->singular = (rr->num_logical_intfs == 1) ? lif : NULL;
 	g_hash_table_insert(lif->rr_specs, &rr->hash_key.name, lif);
 }
 static void __add_intf_rr(struct logical_intf *lif, str *name_base, sockfamily_t *fam) {
@@ -636,6 +639,50 @@ static GQueue *__interface_list_for_family(sockfamily_t *fam) {
 	return &__preferred_lists_for_family[fam->idx];
 }
 // called during single-threaded startup only
+// the part of the pool that the pair of a port belongs to. part N starts at pair
+// first + N * pairs / num_parts
+static unsigned int __port_pool_part(const struct port_pool *pp, unsigned int port) {
+	unsigned int first = pp->parts[0].first_pair;
+	unsigned int pairs = pp->parts[pp->num_parts - 1].last_pair + 1 - first;
+	unsigned int idx = port / 2;
+
+	if (pp->num_parts == 1 || idx < first)
+		return 0;
+	unsigned int part = ((idx - first + 1) * pp->num_parts + pairs - 1) / pairs - 1;
+	return MIN(part, pp->num_parts - 1);
+}
+
+// splits the pairs of the pool into one part per media poller
+static void __port_pool_parts_init(struct port_pool *pp) {
+	unsigned int first = (pp->min + 1) / 2;
+	unsigned int end = (pp->max + 1) / 2;
+	unsigned int pairs = (end > first) ? end - first : 0;
+
+	pp->num_parts = MAX(rtpe_config.media_pollers, 1);
+	if (pp->num_parts > pairs)
+		pp->num_parts = MAX(pairs, 1);
+
+	if (posix_memalign((void **) &pp->parts, 64, pp->num_parts * sizeof(*pp->parts)))
+		abort();
+	memset(pp->parts, 0, pp->num_parts * sizeof(*pp->parts));
+
+	for (unsigned int i = 0; i < pp->num_parts; i++) {
+		struct port_pool_part *part = &pp->parts[i];
+		part->first_pair = first + i * pairs / pp->num_parts;
+		part->last_pair = first + (i + 1) * pairs / pp->num_parts - 1;
+		part->last_used = part->first_pair * 2;
+		mutex_init(&part->spare_lock);
+	}
+	if (!pairs) {
+		// nothing to find, but single ports can still be requested
+		pp->parts[0].first_pair = first + 1;
+		pp->parts[0].last_pair = first;
+	}
+
+	for (unsigned int port = pp->min; port <= pp->max; port++)
+		pp->parts[__port_pool_part(pp, port)].free_ports++;
+}
+
 static void __interface_append(struct intf_config *ifa, sockfamily_t *fam) {
 	struct logical_intf *lif;
 	GQueue *q;
@@ -666,8 +713,12 @@ static void __interface_append(struct intf_config *ifa, sockfamily_t *fam) {
 		spec->local_address = ifa->local_address;
 		spec->port_pool.min = ifa->port_min;
 		spec->port_pool.max = ifa->port_max;
-		spec->port_pool.free_ports = spec->port_pool.max - spec->port_pool.min + 1;
-		mutex_init(&spec->port_pool.free_list_lock);
+		unsigned int first_pair = (ifa->port_min + 1) / 2;
+		unsigned int end_pair = (ifa->port_max + 1) / 2;
+		if (first_pair < end_pair)
+			bit_array_set_range(spec->port_pool.pairs_free, first_pair, end_pair);
+		__port_pool_parts_init(&spec->port_pool);
+		spec->numa_node = numa_addr_node(&spec->local_address.addr);
 		g_hash_table_insert(__intf_spec_addr_type_hash, &spec->local_address, spec);
 	}
 
@@ -677,6 +728,14 @@ static void __interface_append(struct intf_config *ifa, sockfamily_t *fam) {
 	ifc->spec = spec;
 	ifc->logical = lif;
 
+	// everything in a host candidate except the port is fixed for this interface
+	for (unsigned int i = 0; i < G_N_ELEMENTS(ifc->ice_candidate); i++)
+		ifc->ice_candidate[i] = str_sprintf("a=candidate:" STR_FORMAT " %u UDP %lu %s ",
+				STR_FMT(&ifc->ice_foundation), i + 1,
+				(unsigned long) ice_priority_pref(ice_type_preference(ICT_HOST),
+					ifc->unique_id, i + 1),
+				sockaddr_print_buf(&ifc->advertised_address.addr));
+
 	g_hash_table_insert(lif->addr_hash, &spec->local_address, ifc);
 	g_queue_push_tail(&all_local_interfaces, ifc);
 
@@ -718,6 +777,95 @@ void interfaces_init(GQueue *interfaces) {
 	}
 }
 
+static struct intf_isolation *__intf_isolation(const char *spec, unsigned int *val) {
+	const char *sep = strrchr(spec, ':');
+	if (!sep || sep == spec || !sep[1])
+		return NULL;
+	char *endp;
+	unsigned long n = strtoul(sep + 1, &endp, 10);
+	if (*endp || n == 0 || n > 0x10000)
+		return NULL;
+	*val = n;
+
+	str name;
+	str_init_len(&name, (char *) spec, sep - spec);
+	for (GList *l = all_intf_isolations.head; l; l = l->next) {
+		struct intf_isolation *iso = l->data;
+		if (!str_cmp_str(&iso->name, &name))
+			return iso;
+	}
+
+	struct intf_isolation *iso = g_slice_alloc0(sizeof(*iso));
+	iso->name.s = g_strndup(name.s, name.len);
+	iso->name.len = name.len;
+	g_queue_push_tail(&all_intf_isolations, iso);
+	return iso;
+}
+
+// called during single-threaded startup only, after interfaces_init().
+// entries are "NAME:THREADS" and "NAME:PPS", where NAME is matched against both the full and
+// the base name of the logical interfaces
+int interfaces_isolation_init(char **pollers, char **limits) {
+	struct intf_isolation *iso;
+	unsigned int val;
+
+	for (char **p = pollers; p && *p; p++) {
+		if (!(iso = __intf_isolation(*p, &val))) {
+			ilog(LOG_ERR, "Invalid interface poller specification '%s'", *p);
+			return -1;
+		}
+		iso->threads = val;
+	}
+	for (char **p = limits; p && *p; p++) {
+		if (!(iso = __intf_isolation(*p, &val))) {
+			ilog(LOG_ERR, "Invalid interface unknown-source limit '%s'", *p);
+			return -1;
+		}
+		iso->unknown_limit = val;
+	}
+
+	for (GList *k = all_intf_isolations.head; k; k = k->next) {
+		iso = k->data;
+
+		if (iso->threads) {
+			iso->poller = poller_new();
+			if (!iso->poller) {
+				ilog(LOG_ERR, "Failed to create poller for interface '" STR_FORMAT "'",
+						STR_FMT(&iso->name));
+				return -1;
+			}
+		}
+
+		unsigned int found = 0;
+		GList *ll = g_hash_table_get_values(__logical_intf_name_family_hash);
+		for (GList *l = ll; l; l = l->next) {
+			struct logical_intf *lif = l->data;
+			if (str_cmp_str(&lif->name, &iso->name) && str_cmp_str(&lif->name_base, &iso->name))
+				continue;
+			lif->isolation = iso;
+			found++;
+		}
+		g_list_free(ll);
+
+		if (!found) {
+			ilog(LOG_ERR, "Interface '" STR_FORMAT "' given for isolation doesn't exist",
+					STR_FMT(&iso->name));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void interfaces_isolation_start(void) {
+	for (GList *l = all_intf_isolations.head; l; l = l->next) {
+		struct intf_isolation *iso = l->data;
+		for (unsigned int i = 0; i < iso->threads; i++)
+			thread_create_detach_prio(poller_loop, iso->poller, rtpe_config.scheduling,
+					rtpe_config.priority);
+	}
+}
+
 void interfaces_exclude_port(unsigned int port) {
 	GList *vals, *l;
 	struct intf_spec *spec;
@@ -727,6 +875,7 @@ void interfaces_exclude_port(unsigned int port) {
 	for (l = vals; l; l = l->next) {
 		spec = l->data;
 		bit_array_set(spec->port_pool.ports_used, port);
+		bit_array_clear(spec->port_pool.pairs_free, port / 2);
 	}
 
 	g_list_free(vals);
@@ -758,6 +907,54 @@ struct local_intf *get_any_interface_address(const struct logical_intf *lif, soc
 
 
 
+// The `pairs_free` bits are only used to find candidate ports quickly. Whether a port is taken is
+// always decided by the atomic test-and-set in `ports_used`, so a stale bit just costs one failed
+// attempt. A bit is set again after any release that leaves both ports of a pair free, and after
+// clearing a bit found to be stale, so that no free pair can get lost.
+static void __port_pool_pair_check(struct port_pool *pp, unsigned int port) {
+	port &= ~1U;
+	if (port < pp->min || port + 1 > pp->max)
+		return;
+	if (bit_array_isset(pp->ports_used, port) || bit_array_isset(pp->ports_used, port + 1))
+		return;
+	bit_array_set(pp->pairs_free, port / 2);
+}
+
+// returns the first port of the next pair at or after `port` that appears to be free, wrapping
+// around the range of the given part of the pool. each call consumes at least one word of the
+// bit array from the given budget. returns 0 if the budget runs out.
+static unsigned int __port_pool_find(struct port_pool *pp, const struct port_pool_part *part,
+		unsigned int port, unsigned int *words)
+{
+	const unsigned int bits = sizeof(int) * 8;
+	unsigned int first = part->first_pair;
+	unsigned int last = part->last_pair;
+
+	if (first > last)
+		return 0;
+
+	unsigned int idx = port / 2;
+	if (idx < first || idx > last)
+		idx = first;
+
+	while (*words) {
+		unsigned int w = idx / bits;
+		unsigned int word = pp->pairs_free[w] & (~0U << (idx % bits));
+		if (word) {
+			unsigned int found = w * bits + __builtin_ctz(word);
+			if (found <= last)
+				return found * 2;
+			// the rest of this word belongs to the next part
+		}
+		(*words)--;
+		idx = (w + 1) * bits;
+		if (idx > last)
+			idx = first;
+	}
+
+	return 0;
+}
+
 static int get_port(socket_t *r, unsigned int port, struct intf_spec *spec, const str *label) {
 	struct port_pool *pp;
 
@@ -767,21 +964,44 @@ static int get_port(socket_t *r, unsigned int port, struct intf_spec *spec, cons
 
 	if (bit_array_set(pp->ports_used, port)) {
 		__C_DBG("port %d in use", port);
+		if (bit_array_clear(pp->pairs_free, port / 2))
+			__port_pool_pair_check(pp, port);
 		return -1;
 	}
 	__C_DBG("port %d locked", port);
-
-	if (open_socket(r, SOCK_DGRAM, port, &spec->local_address.addr)) {
+	bit_array_clear(pp->pairs_free, port / 2);
+
+	// during a live handover, the previous process' socket is taken over as it is
+	int fd = handover_take_fd(&spec->local_address.addr, port);
+	if (fd != -1) {
+		ZERO(*r);
+		r->fd = fd;
+		r->family = spec->local_address.addr.family;
+		r->local.address = spec->local_address.addr;
+		r->local.port = port;
+		label = NULL; // rule is still in place
+	}
+	else if (open_socket(r, SOCK_DGRAM, port, &spec->local_address.addr)) {
 		__C_DBG("couldn't open port %d", port);
 		bit_array_clear(pp->ports_used, port);
+		__port_pool_pair_check(pp, port);
 		return -1;
 	}
 
-	iptables_add_rule(r, label);
+	if (label) // otherwise done when taken from the spare pool
+		iptables_add_rule(r, label);
 	socket_timestamping(r);
-
-	g_atomic_int_dec_and_test(&pp->free_ports);
-	__C_DBG("%d free ports remaining on interface %s", pp->free_ports,
+	if (rtpe_config.media_busy_poll && busy_poll(r->fd, rtpe_config.media_busy_poll))
+		ilog(LOG_DEBUG, "Failed to enable busy polling on port %u: %s", port, strerror(errno));
+	if (rtpe_config.media_recv_gro && udp_gro(r->fd))
+		ilog(LOG_DEBUG, "Failed to enable UDP GRO on port %u: %s", port, strerror(errno));
+	if (rxq_ovfl(r->fd))
+		ilog(LOG_DEBUG, "Failed to enable drop counter on port %u: %s", port, strerror(errno));
+	if (rtpe_config.media_rcvbuf && rcvbuf_size(r->fd, rtpe_config.media_rcvbuf))
+		ilog(LOG_DEBUG, "Failed to set receive buffer size on port %u: %s", port, strerror(errno));
+
+	g_atomic_int_dec_and_test(&pp->parts[__port_pool_part(pp, port)].free_ports);
+	__C_DBG("%d free ports remaining on interface %s", port_pool_free_ports(pp),
 			sockaddr_print_buf(&spec->local_address.addr));
 
 	return 0;
@@ -793,20 +1013,15 @@ static void release_port(socket_t *r, struct intf_spec *spec) {
 
 	__C_DBG("trying to release port %u", port);
 
-	iptables_del_rule(r);
+	// the socket lives on in the new process, and so does its rule
+	if (!handover_sent)
+		iptables_del_rule(r);
 
 	if (close_socket(r) == 0) {
 		__C_DBG("port %u is released", port);
 		bit_array_clear(pp->ports_used, port);
-		g_atomic_int_inc(&pp->free_ports);
-		if ((port & 1) == 0) {
-			mutex_lock(&pp->free_list_lock);
-			if (!bit_array_isset(pp->free_list_used, port)) {
-				g_queue_push_tail(&pp->free_list, GUINT_TO_POINTER(port));
-				bit_array_set(pp->free_list_used, port);
-			}
-			mutex_unlock(&pp->free_list_lock);
-		}
+		g_atomic_int_inc(&pp->parts[__port_pool_part(pp, port)].free_ports);
+		__port_pool_pair_check(pp, port);
 	} else {
 		__C_DBG("port %u is NOT released", port);
 	}
@@ -816,90 +1031,214 @@ static void free_port(socket_t *r, struct intf_spec *spec) {
 	g_slice_free1(sizeof(*r), r);
 }
 
-
-
-/* puts list of socket_t into "out" */
-int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+// opens `num_ports` ports starting at `port`, or none at all
+static int __get_ports_at(GQueue *out, unsigned int num_ports, unsigned int port, int check_range,
 		struct intf_spec *spec, const str *label)
 {
-	int i, cycle = 0;
 	socket_t *sk;
-	int port;
-	struct port_pool *pp;
 
-	if (num_ports == 0)
-		return 0;
+	for (unsigned int i = 0; i < num_ports; i++) {
+		if (check_range && port + i > spec->port_pool.max)
+			goto release;
 
-	pp = &spec->port_pool;
+		sk = g_slice_alloc0(sizeof(*sk));
+		// fd=0 is a valid file descriptor that may be closed
+		// accidentally by free_port if previously bounded
+		sk->fd = -1;
+		g_queue_push_tail(out, sk);
 
-	__C_DBG("wanted_start_port=%d", wanted_start_port);
+		if (get_port(sk, port + i, spec, label))
+			goto release;
+	}
 
-	if (wanted_start_port > 0) {
-		port = wanted_start_port;
-		__C_DBG("port=%d", port);
-	} else {
-		port = g_atomic_int_get(&pp->last_used);
-		__C_DBG("before randomization port=%d", port);
+	return 0;
+
+release:
+	while ((sk = g_queue_pop_head(out)))
+		free_port(sk, spec);
+	return -1;
+}
+
+
+// searches a part of the pool for `num_ports` consecutive free ports, starting from an even port
+static int __find_free_ports_part(GQueue *out, unsigned int num_ports, struct intf_spec *spec,
+		struct port_pool_part *part, const str *label)
+{
+	struct port_pool *pp = &spec->port_pool;
+	unsigned int port;
+
+	port = g_atomic_int_get(&part->last_used);
+	__C_DBG("before randomization port=%d", port);
 #if PORT_RANDOM_MIN && PORT_RANDOM_MAX
-		port += PORT_RANDOM_MIN + (ssl_random() % (PORT_RANDOM_MAX - PORT_RANDOM_MIN));
+	port += PORT_RANDOM_MIN + (ssl_random() % (PORT_RANDOM_MAX - PORT_RANDOM_MIN));
 #endif
-		__C_DBG("after  randomization port=%d", port);
-	}
-
-	// debug msg if port is in the given interval
-	if (bit_array_isset(pp->ports_used, port)) {
-		__C_DBG("port %d is USED in port pool", port);
-		mutex_lock(&pp->free_list_lock);
-		unsigned int fport = GPOINTER_TO_UINT(g_queue_pop_head(&pp->free_list));
-		if (fport)
-			bit_array_clear(pp->free_list_used, fport);
-		mutex_unlock(&pp->free_list_lock);
-		if (fport) {
-			port = fport;
-			__C_DBG("Picked port %u from free list", port);
-		}
-	} else {
-		__C_DBG("port %d is NOT USED in port pool", port);
-	}
+	__C_DBG("after  randomization port=%d", port);
+
+	// enough to visit every word of the part once, plus the partial first one again
+	unsigned int words = part->last_pair / (sizeof(int) * 8) - part->first_pair / (sizeof(int) * 8) + 2;
+	// pairs that look free but fail to open get their free bit back, so the number of attempts
+	// is limited separately to one round through the part
+	unsigned int attempts = part->last_pair - part->first_pair + 1;
 
 	while (1) {
-		__C_DBG("cycle=%d, port=%d", cycle, port);
-		if (!wanted_start_port) {
-			if (port < pp->min)
-				port = pp->min;
-			if ((port & 1))
-				port++;
-		}
+		if (!attempts--)
+			return -1;
+		port = __port_pool_find(pp, part, port, &words);
+		if (!port)
+			return -1;
+		__C_DBG("trying free pair at port %u", port);
+		if (!__get_ports_at(out, num_ports, port, 1, spec, label))
+			break;
+		port += 2;
+	}
 
-		for (i = 0; i < num_ports; i++) {
-			sk = g_slice_alloc0(sizeof(*sk));
-			// fd=0 is a valid file descriptor that may be closed
-			// accidentally by free_port if previously bounded
-			sk->fd = -1;
-			g_queue_push_tail(out, sk);
-
-			if (!wanted_start_port && port > pp->max) {
-				port = 0;
-				cycle++;
-				goto release_restart;
-			}
+	g_atomic_int_set(&part->last_used, port + num_ports);
+	return 0;
+}
+
+// searches the given part of the pool first, then takes ports from its neighbours
+static int __find_free_ports(GQueue *out, unsigned int num_ports, struct intf_spec *spec, unsigned int part,
+		const str *label)
+{
+	struct port_pool *pp = &spec->port_pool;
+
+	for (unsigned int i = 0; i < pp->num_parts; i++) {
+		if (!__find_free_ports_part(out, num_ports, spec, &pp->parts[(part + i) % pp->num_parts],
+					label))
+			return 0;
+	}
+	return -1;
+}
+
+// spare RTP/RTCP socket pairs, bound and set up ahead of time by socket_pool_loop()
+struct spare_pair {
+	socket_t *socks[2];
+};
+
+static mutex_t socket_pool_lock = MUTEX_STATIC_INIT;
+static cond_t socket_pool_cond = COND_STATIC_INIT;
+
+static int __spare_pair_get(GQueue *out, struct intf_spec *spec, unsigned int part_idx, const str *label) {
+	struct port_pool_part *part = &spec->port_pool.parts[part_idx];
+
+	if (!rtpe_config.socket_pool)
+		return -1;
 
-			if (get_port(sk, port++, spec, label))
-				goto release_restart;
+	mutex_lock(&part->spare_lock);
+	struct spare_pair *sp = g_queue_pop_head(&part->spare_pairs);
+	mutex_unlock(&part->spare_lock);
+
+	cond_signal(&socket_pool_cond);
+
+	if (!sp)
+		return -1;
+
+	g_atomic_int_add(&part->free_ports, -2);
+	for (unsigned int i = 0; i < 2; i++) {
+		iptables_add_rule(sp->socks[i], label);
+		g_queue_push_tail(out, sp->socks[i]);
+	}
+	g_slice_free1(sizeof(*sp), sp);
+
+	__C_DBG("Took ports %u/%u from spare pool", ((socket_t *) out->head->data)->local.port,
+			((socket_t *) out->tail->data)->local.port);
+	return 0;
+}
+
+// each part keeps its share of the spare pairs, taken from its own range only
+static void __spare_pairs_fill(struct intf_spec *spec, struct port_pool_part *part) {
+	struct port_pool *pp = &spec->port_pool;
+	unsigned int target = (rtpe_config.socket_pool + pp->num_parts - 1) / pp->num_parts;
+
+	while (!rtpe_shutdown) {
+		mutex_lock(&part->spare_lock);
+		unsigned int num = part->spare_pairs.length;
+		mutex_unlock(&part->spare_lock);
+
+		if (num >= target)
+			break;
+
+		GQueue q = G_QUEUE_INIT;
+		if (__find_free_ports_part(&q, 2, spec, part, NULL))
+			break; // port range exhausted, try again later
+
+		struct spare_pair *sp = g_slice_alloc(sizeof(*sp));
+		sp->socks[0] = g_queue_pop_head(&q);
+		sp->socks[1] = g_queue_pop_head(&q);
+		// still available to calls as far as the accounting is concerned
+		g_atomic_int_add(&part->free_ports, 2);
+
+		mutex_lock(&part->spare_lock);
+		g_queue_push_tail(&part->spare_pairs, sp);
+		mutex_unlock(&part->spare_lock);
+	}
+}
+
+static void __spare_pairs_free(struct intf_spec *spec, struct port_pool_part *part) {
+	struct spare_pair *sp;
+
+	while ((sp = g_queue_pop_head(&part->spare_pairs))) {
+		g_atomic_int_add(&part->free_ports, -2);
+		free_port(sp->socks[0], spec);
+		free_port(sp->socks[1], spec);
+		g_slice_free1(sizeof(*sp), sp);
+	}
+}
+
+// keeps the spare pools of all interfaces filled, woken up whenever a pair is taken
+void socket_pool_loop(void *p) {
+	mutex_lock(&socket_pool_lock);
+
+	while (!rtpe_shutdown) {
+		mutex_unlock(&socket_pool_lock);
+
+		GList *specs = g_hash_table_get_values(__intf_spec_addr_type_hash);
+		for (GList *l = specs; l; l = l->next) {
+			struct intf_spec *spec = l->data;
+			numa_pin_node(spec->numa_node);
+			for (unsigned int i = 0; i < spec->port_pool.num_parts; i++)
+				__spare_pairs_fill(spec, &spec->port_pool.parts[i]);
 		}
-		break;
+		g_list_free(specs);
+
+		rtpe_now_coarse();
+		struct timeval tv = rtpe_now;
+		timeval_add_usec(&tv, 1000000);
+
+		mutex_lock(&socket_pool_lock);
+		cond_timedwait(&socket_pool_cond, &socket_pool_lock, &tv);
+	}
+
+	mutex_unlock(&socket_pool_lock);
+}
+
 
-release_restart:
-		while ((sk = g_queue_pop_head(out)))
-			free_port(sk, spec);
+/* puts list of socket_t into "out" */
+int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
+		struct intf_spec *spec, const str *label, unsigned int part)
+{
+	struct port_pool *pp = &spec->port_pool;
+
+	if (num_ports == 0)
+		return 0;
 
-		if (cycle >= 2 || wanted_start_port > 0)
+	part %= pp->num_parts;
+
+	__C_DBG("wanted_start_port=%d", wanted_start_port);
+
+	if (wanted_start_port > 0) {
+		__C_DBG("port=%d", wanted_start_port);
+		if (__get_ports_at(out, num_ports, wanted_start_port, 0, spec, label))
 			goto fail;
+		g_atomic_int_set(&pp->parts[__port_pool_part(pp, wanted_start_port)].last_used,
+				wanted_start_port + num_ports);
 	}
+	else if (num_ports == 2 && !__spare_pair_get(out, spec, part, label))
+		;
+	else if (__find_free_ports(out, num_ports, spec, part, label))
+		goto fail;
 
 	/* success */
-	g_atomic_int_set(&pp->last_used, port);
-
 	__C_DBG("Opened ports %u.. on interface %s for media relay",
 		((socket_t *) out->head->data)->local.port, sockaddr_print_buf(&spec->local_address.addr));
 	return 0;
@@ -910,13 +1249,23 @@ fail:
 	return -1;
 }
 
+// calls take their ports from the part of each pool that belongs to their media poller
+static unsigned int __poller_part(const struct poller *p) {
+	for (int i = 0; rtpe_media_pollers && i < rtpe_config.media_pollers; i++) {
+		if (rtpe_media_pollers[i] == p)
+			return i;
+	}
+	return 0;
+}
+
 /* puts a list of "struct intf_list" into "out", containing socket_t list */
 int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logical_intf *log,
-		const str *label)
+		const str *label, const struct poller *poller)
 {
 	GList *l;
 	struct intf_list *il;
 	const struct local_intf *loc;
+	unsigned int part = __poller_part(poller);
 
 	for (l = log->list.head; l; l = l->next) {
 		loc = l->data;
@@ -924,7 +1273,7 @@ int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logi
 		il = g_slice_alloc0(sizeof(*il));
 		il->local_intf = loc;
 		g_queue_push_tail(out, il);
-		if (G_LIKELY(!__get_consecutive_ports(&il->list, num_ports, 0, loc->spec, label))) {
+		if (G_LIKELY(!__get_consecutive_ports(&il->list, num_ports, 0, loc->spec, label, part))) {
 			// success - found available ports on local interfaces, so far
 			continue;
 		}
@@ -961,6 +1310,9 @@ void free_intf_list(struct intf_list *il) {
 
 
 /* called lock-free */
+static void stream_fd_readable(int fd, void *p, uintptr_t u);
+static void stream_fd_tx_timestamps(struct stream_fd *sfd);
+
 static void stream_fd_closed(int fd, void *p, uintptr_t u) {
 	struct stream_fd *sfd = p;
 	struct call *c;
@@ -976,6 +1328,15 @@ static void stream_fd_closed(int fd, void *p, uintptr_t u) {
 	i = 0;
 	// coverity[check_return : FALSE]
 	getsockopt(fd, SOL_SOCKET, SO_ERROR, &i, &j);
+
+	if (sfd->tx_ts && !i) {
+		// transmit timestamps waiting in the error queue, not an actual error.
+		// the socket may also have become readable at the same time
+		stream_fd_tx_timestamps(sfd);
+		stream_fd_readable(fd, p, u);
+		return;
+	}
+
 	ilog(LOG_WARNING, "Read error on media socket: %i (%s) -- closing call", i, strerror(i));
 
 	call_destroy(c);
@@ -984,10 +1345,10 @@ static void stream_fd_closed(int fd, void *p, uintptr_t u) {
 
 
 /* returns: 0 = not a muxed stream, 1 = muxed, RTP, 2 = muxed, RTCP */
-static int rtcp_demux(const str *s, struct call_media *media) {
+static int rtcp_demux(const struct re_demux *d, struct call_media *media) {
 	if (!MEDIA_ISSET(media, RTCP_MUX))
 		return 0;
-	return rtcp_demux_is_rtcp(s) ? 2 : 1;
+	return (d->cls & RE_DEMUX_RTCP) ? 2 : 1;
 }
 
 static int call_avp2savp_rtp(str *s, struct packet_stream *stream, struct stream_fd *sfd, const endpoint_t *src,
@@ -995,6 +1356,11 @@ static int call_avp2savp_rtp(str *s, struct packet_stream *stream, struct stream
 {
 	return rtp_avp2savp(s, &stream->crypto, ssrc_ctx);
 }
+static void call_avp2savp_rtp_batch(str *const *s, unsigned int num, struct packet_stream *stream,
+		struct ssrc_ctx *ssrc_ctx, int *rets)
+{
+	rtp_avp2savp_batch(s, num, &stream->crypto, ssrc_ctx, rets);
+}
 static int call_avp2savp_rtcp(str *s, struct packet_stream *stream, struct stream_fd *sfd, const endpoint_t *src,
 		const struct timeval *tv, struct ssrc_ctx *ssrc_ctx)
 {
@@ -1019,6 +1385,9 @@ static int __k_null(struct rtpengine_srtp *s, struct packet_stream *stream) {
 static int __k_srtp_crypt(struct rtpengine_srtp *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 	if (!c->params.crypto_suite)
 		return -1;
+	// AEAD ciphers still authenticate unencrypted packets, which the kernel module doesn't do
+	if (c->params.crypto_suite->aead_evp && c->params.session_params.unencrypted_srtp)
+		return -1;
 
 	*s = (struct rtpengine_srtp) {
 		.cipher		= c->params.crypto_suite->kernel_cipher,
@@ -1026,6 +1395,8 @@ static int __k_srtp_crypt(struct rtpengine_srtp *s, struct crypto_context *c, st
 		.mki_len	= c->params.mki_len,
 		.last_index	= ssrc_ctx ? ssrc_ctx->srtp_index : 0,
 		.auth_tag_len	= c->params.crypto_suite->srtp_auth_tag,
+		.rtcp_index	= ssrc_ctx ? ssrc_ctx->srtcp_index : 0,
+		.rtcp_auth_tag_len = c->params.crypto_suite->srtcp_auth_tag,
 	};
 	if (c->params.mki_len)
 		memcpy(s->mki, c->params.mki, c->params.mki_len);
@@ -1052,27 +1423,73 @@ INLINE void __re_address_translate_ep(struct re_address *o, const endpoint_t *ep
 	ep->address.family->endpoint2kernel(o, ep);
 }
 
-static int __rtp_stats_pt_sort(const void *ap, const void *bp) {
-	const struct rtp_stats *a = ap, *b = bp;
+static int __kernel_rtcp_crypto_ok(const struct crypto_context *c) {
+	const struct crypto_suite *cs = c->params.crypto_suite;
 
-	if (a->payload_type < b->payload_type)
-		return -1;
-	if (a->payload_type > b->payload_type)
+	if (!cs)
 		return 1;
-	return 0;
+	if (cs->aead_evp)
+		return 0;
+	if (c->params.session_params.unencrypted_srtcp || c->params.session_params.unencrypted_srtp
+			|| c->params.session_params.unauthenticated_srtp)
+		return 0;
+	return 1;
 }
 
+/* called with sink->out_lock held. true if the kernel module can forward RTCP for this
+ * stream without userspace having to look at it */
+static int __kernel_rtcp_ok(struct packet_stream *stream, struct packet_stream *sink) {
+	struct call_media *media = stream->media;
 
-/* called with in_lock held */
-void kernelize(struct packet_stream *stream) {
+	if (!rtpe_config.kernel_rtcp)
+		return 0;
+	if (!proto_is_rtp(media->protocol))
+		return 0;
+	if (MEDIA_ISSET(media, TRANSCODE) || MEDIA_ISSET(media, RTCP_GEN))
+		return 0;
+	if (stream->call->recording)
+		return 0;
+	if (stream->handler->in->rtcp_filter)
+		return 0;
+	if (!__kernel_rtcp_crypto_ok(&stream->selected_sfd->crypto) || !__kernel_rtcp_crypto_ok(&sink->crypto))
+		return 0;
+
+	if (PS_ISSET(stream, RTP)) {
+		// muxed RTCP must go out through the same port as the RTP, and the RTCP crypto
+		// contexts used by userspace must match the RTP ones
+		if (!MEDIA_ISSET(media, RTCP_MUX) || stream->rtcp_sink != sink)
+			return 0;
+		if (stream->rtcp_sibling && stream->rtcp_sibling->selected_sfd
+				&& crypto_params_cmp(&stream->selected_sfd->crypto.params,
+					&stream->rtcp_sibling->selected_sfd->crypto.params))
+			return 0;
+		if (sink->rtcp_sibling && crypto_params_cmp(&sink->crypto.params,
+					&sink->rtcp_sibling->crypto.params))
+			return 0;
+	}
+
+	return 1;
+}
+
+// a queued target add or update was rejected by the kernel. the stream goes back to
+// userspace and is kernelized again on its next packet
+static void __kernelize_failed(void *p) {
+	struct packet_stream *ps = p;
+	PS_CLEAR(ps, KERNELIZED);
+	PS_CLEAR(ps, KERNEL_RTCP);
+}
+
+/* called with in_lock held. with `update` set, an existing target is replaced in place */
+static void __kernelize(struct packet_stream *stream, int update) {
 	struct rtpengine_target_info reti;
 	struct call *call = stream->call;
 	struct packet_stream *sink = NULL;
 	const char *nk_warn_msg;
-	int non_forwarding = 0;
+	int rtcp_only = 0, rtcp_fw;
+	unsigned int num_pts = 0;
 	struct call_media *media = stream->media;
 
-	if (PS_ISSET(stream, KERNELIZED))
+	if (PS_ISSET(stream, KERNELIZED) && !update)
 		return;
 	if (call->recording != NULL && !selected_recording_method->kernel_support)
 		goto no_kernel;
@@ -1082,8 +1499,8 @@ void kernelize(struct packet_stream *stream) {
 	if (!kernel.is_open)
 		goto no_kernel_warn;
 	if (!PS_ISSET(stream, RTP)) {
-		if (PS_ISSET(stream, RTCP) && PS_ISSET(stream, STRICT_SOURCE))
-			non_forwarding = 1; // use the kernel's source checking capability
+		if (PS_ISSET(stream, RTCP) && (rtpe_config.kernel_rtcp || PS_ISSET(stream, STRICT_SOURCE)))
+			rtcp_only = 1;
 		else
 			goto no_kernel;
 	}
@@ -1093,6 +1510,10 @@ void kernelize(struct packet_stream *stream) {
 		goto no_kernel;
 	if (media->monologue->block_media || call->block_media)
 		goto no_kernel;
+	if (media->monologue->conference)
+		goto no_kernel;
+	if (media->simulcast)
+		goto no_kernel;
 	if (!stream->endpoint.address.family)
 		goto no_kernel;
 
@@ -1106,6 +1527,12 @@ void kernelize(struct packet_stream *stream) {
 	}
 	if (!sink->endpoint.address.family)
 		goto no_kernel;
+	// the conference mixer sends to the participant itself
+	if (sink->media->monologue->conference)
+		goto no_kernel;
+	// RTCP feedback for simulcast layers needs rewriting
+	if (sink->media->simulcast)
+		goto no_kernel;
 
 	__determine_handler(stream, sink);
 
@@ -1136,7 +1563,6 @@ void kernelize(struct packet_stream *stream) {
 	reti.rtcp_mux = MEDIA_ISSET(media, RTCP_MUX);
 	reti.dtls = MEDIA_ISSET(media, DTLS);
 	reti.stun = media->ice_agent ? 1 : 0;
-	reti.non_forwarding = non_forwarding;
 	reti.rtp_stats = MEDIA_ISSET(media, RTCP_GEN) ? 1 : 0;
 
 	__re_address_translate_ep(&reti.dst_addr, &sink->endpoint);
@@ -1145,15 +1571,40 @@ void kernelize(struct packet_stream *stream) {
 		reti.ssrc = htonl(stream->ssrc_in->parent->h.ssrc);
 		if (MEDIA_ISSET(media, TRANSCODE)) {
 			reti.ssrc_out = htonl(stream->ssrc_in->ssrc_map_out);
+			// carries on from where any earlier transcoding left it
+			if (sink->ssrc_out)
+				reti.seq_diff = sink->ssrc_out->parent->seq_diff;
 			reti.transcoding = 1;
 		}
 	}
 
 	stream->handler->in->kernel(&reti.decrypt, stream);
 	stream->handler->out->kernel(&reti.encrypt, sink);
+	rtcp_fw = __kernel_rtcp_ok(stream, sink);
 
 	mutex_unlock(&sink->out_lock);
 
+	if (rtcp_only) {
+		if (rtcp_fw)
+			reti.rtcp = 1;
+		else if (PS_ISSET(stream, STRICT_SOURCE))
+			reti.non_forwarding = 1; // use the kernel's source checking capability
+		else
+			goto no_kernel;
+	}
+	if (rtcp_fw) {
+		reti.rtcp_fw = 1;
+		reti.rtcp_sample = rtpe_config.kernel_rtcp_sample;
+	}
+
+	ice_kernel_info(media->ice_agent, &reti);
+	if (reti.ice.pwd_len && !reti.expected_src.family) {
+		// the responder only answers the established candidate pair
+		mutex_lock(&stream->out_lock);
+		__re_address_translate_ep(&reti.expected_src, &stream->endpoint);
+		mutex_unlock(&stream->out_lock);
+	}
+
 	nk_warn_msg = "encryption cipher or HMAC not supported by kernel module";
 	if (!reti.encrypt.cipher || !reti.encrypt.hmac)
 		goto no_kernel_warn;
@@ -1161,48 +1612,131 @@ void kernelize(struct packet_stream *stream) {
 	if (!reti.decrypt.cipher || !reti.decrypt.hmac)
 		goto no_kernel_warn;
 
-	ZERO(stream->kernel_stats);
+	// the kernel carries the counters over on an update
+	if (!update) {
+		ZERO(stream->kernel_stats);
+		stream->kernel_lost = 0;
+	}
 
 	if (proto_is_rtp(media->protocol)) {
-		GList *values, *l;
 		struct rtp_stats *rs;
 
 		reti.rtp = 1;
-		values = g_hash_table_get_values(stream->rtp_stats);
-		values = g_list_sort(values, __rtp_stats_pt_sort);
-		for (l = values; l; l = l->next) {
+		// walking the PT map gives the sorted order that the kernel module wants
+		for (unsigned int pt = 0; pt < G_N_ELEMENTS(stream->rtp_stats_idx); pt++) {
+			rs = rtp_stats_get(stream, pt);
+			if (!rs)
+				continue;
+			num_pts++;
 			if (reti.num_payload_types >= G_N_ELEMENTS(reti.payload_types)) {
 				ilog(LOG_WARNING, "Too many RTP payload types for kernel module");
 				break;
 			}
-			rs = l->data;
-			// only add payload types that are passthrough
+			// only add payload types that are passthrough, or transcoded in a way
+			// that the kernel module can do
 			struct codec_handler *ch = codec_handler_get(media, rs->payload_type);
-			if (!ch->kernelize)
-				continue;
+			int xcode = REX_NONE;
+			int dtmf = 0;
+			if (!ch->kernelize) {
+				if (!MEDIA_ISSET(media, TRANSCODE) && !call->block_dtmf
+						&& !media->monologue->block_dtmf
+						&& codec_handler_kernel_dtmf(ch))
+					dtmf = 1;
+				// the output SSRC must be known, and recordings want the input
+				else if (!reti.transcoding || call->recording)
+					continue;
+				else {
+					xcode = codec_handler_kernel_xcode(ch);
+					if (xcode == REX_NONE)
+						continue;
+				}
+			}
+			// events get logged by us, the kernel tells us about them
+			if (dtmf && dtmf_do_logging())
+				reti.dtmf_mask |= 1U << reti.num_payload_types;
 			reti.payload_types[reti.num_payload_types] = rs->payload_type;
 			reti.clock_rates[reti.num_payload_types] = ch->source_pt.clock_rate;
+			reti.pt_output[reti.num_payload_types] = rs->payload_type;
+			if (xcode != REX_NONE) {
+				reti.xcode[reti.num_payload_types] = xcode;
+				reti.pt_output[reti.num_payload_types] = ch->dest_pt.payload_type;
+				reti.pt_rewrite = 1;
+			}
 			reti.num_payload_types++;
 		}
-		g_list_free(values);
 	}
 	else {
 		if (MEDIA_ISSET(media, TRANSCODE))
 			goto no_kernel;
 	}
 
+	// the junk filter drops RTP of unlisted payload types, so it's only used if the kernel
+	// knows all of them. the current peer is exempt if there's no expected source yet
+	if (rtpe_config.kernel_junk_filter && reti.rtp && !rtcp_only
+			&& reti.num_payload_types == num_pts)
+	{
+		reti.junk_filter = 1;
+		if (!reti.expected_src.family) {
+			mutex_lock(&stream->out_lock);
+			__re_address_translate_ep(&reti.expected_src, &stream->endpoint);
+			mutex_unlock(&stream->out_lock);
+		}
+	}
+
+	// publish quality metrics through the kernel's shared SSRC stats map
+	if (reti.ssrc && reti.num_payload_types) {
+		if (!stream->kernel_stats_slot)
+			stream->kernel_stats_slot = kernel_stats_slot_get();
+		if (stream->kernel_stats_slot) {
+			reti.stats_slot = stream->kernel_stats_slot;
+			reti.rtp_stats = 1;
+		}
+	}
+
 	recording_stream_kernel_info(stream, &reti);
 
-	kernel_add_stream(&reti, 0);
+	// when queued, this is only tentative until the batch is pushed, see __kernelize_failed()
 	PS_SET(stream, KERNELIZED);
+	if (reti.rtcp_fw)
+		PS_SET(stream, KERNEL_RTCP);
+	if (kernel_add_stream(&reti, update, __kernelize_failed, stream, &call->obj)
+			&& (!update || kernel_add_stream(&reti, 0, __kernelize_failed, stream, &call->obj)))
+	{
+		__kernelize_failed(stream);
+		return;
+	}
+
+	TRACE(call, stream->selected_sfd->socket.local.port, KERNELIZE, 1, rtcp_only,
+			reti.num_payload_types, reti.dtmf_mask);
+	PROBE(kernelize, stream->selected_sfd->socket.local.port, reti.num_payload_types);
 
 	return;
 
 no_kernel_warn:
 	ilog(LOG_WARNING, "No support for kernel packet forwarding available (%s)", nk_warn_msg);
 no_kernel:
+	if (update)
+		__unkernelize(stream);
 	PS_SET(stream, KERNELIZED);
 	PS_SET(stream, NO_KERNEL_SUPPORT);
+	TRACE(call, stream->selected_sfd ? stream->selected_sfd->socket.local.port : 0, KERNELIZE,
+			0, rtcp_only, 0, 0);
+}
+
+/* called with in_lock held */
+void kernelize(struct packet_stream *stream) {
+	__kernelize(stream, 0);
+}
+
+/* called with in_lock held. for changes that don't need the peer to be confirmed again:
+ * the kernel swaps the target without dropping packets to us in between, and keeps its
+ * stats and any unchanged SRTP state */
+void __rekernelize(struct packet_stream *stream) {
+	if (!PS_ISSET(stream, KERNELIZED) || PS_ISSET(stream, NO_KERNEL_SUPPORT))
+		return;
+	if (!kernel.is_open)
+		return;
+	__kernelize(stream, 1);
 }
 
 // must be called with appropriate locks (master lock and/or in_lock)
@@ -1232,7 +1766,10 @@ static void __stream_update_stats(struct packet_stream *ps, int have_in_lock) {
 
 	atomic64_add(&ssrc_ctx->packets, stats.basic_stats.packets);
 	atomic64_add(&ssrc_ctx->octets, stats.basic_stats.bytes);
-	atomic64_add(&ssrc_ctx->packets_lost, stats.total_lost);
+	// losses seen so far have already been picked up by call_timer()
+	if (stats.total_lost > ps->kernel_lost)
+		atomic64_add(&ssrc_ctx->packets_lost, stats.total_lost - ps->kernel_lost);
+	ps->kernel_lost = 0;
 	atomic64_set(&ssrc_ctx->last_seq, stats.ext_seq);
 	atomic64_set(&ssrc_ctx->last_ts, stats.timestamp);
 	parent->jitter = stats.jitter;
@@ -1260,6 +1797,41 @@ static void __stream_update_stats(struct packet_stream *ps, int have_in_lock) {
 
 
 /* must be called with in_lock held or call->master_lock held in W */
+// Kernelizes all streams of the call that media_packet_kernel_check() would kernelize upon
+// their next packet, e.g. after the call was restored from Redis. Call must be locked in W.
+// Returns the number of streams kernelized.
+unsigned int kernelize_call(struct call *call) {
+	unsigned int ret = 0;
+
+	if (!kernel.is_open)
+		return 0;
+
+	kernel_batch_start();
+
+	for (GList *l = call->streams.head; l; l = l->next) {
+		struct packet_stream *ps = l->data;
+
+		if (PS_ISSET(ps, KERNELIZED) || PS_ISSET(ps, NO_KERNEL_SUPPORT) || !PS_ISSET(ps, CONFIRMED))
+			continue;
+		struct packet_stream *sink = packet_stream_sink(ps);
+		if (!sink || !PS_ISSET(sink, FILLED))
+			continue;
+		if (!PS_ISSET(sink, CONFIRMED) && !MEDIA_ISSET(sink->media, ASYMMETRIC))
+			continue;
+
+		mutex_lock(&ps->in_lock);
+		kernelize(ps);
+		mutex_unlock(&ps->in_lock);
+
+		if (PS_ISSET(ps, KERNELIZED))
+			ret++;
+	}
+
+	kernel_batch_flush();
+
+	return ret;
+}
+
 void __unkernelize(struct packet_stream *p) {
 	struct re_address rea;
 
@@ -1272,9 +1844,13 @@ void __unkernelize(struct packet_stream *p) {
 		__stream_update_stats(p, 1);
 		__re_address_translate_ep(&rea, &p->selected_sfd->socket.local);
 		kernel_del_stream(&rea);
+		PROBE(unkernelize, p->selected_sfd->socket.local.port);
 	}
+	kernel_stats_slot_put(p->kernel_stats_slot);
+	p->kernel_stats_slot = 0;
 
 	PS_CLEAR(p, KERNELIZED);
+	PS_CLEAR(p, KERNEL_RTCP);
 }
 
 
@@ -1400,6 +1976,7 @@ static void __stream_ssrc(struct packet_stream *in_srtp, struct packet_stream *o
 {
 	u_int32_t in_ssrc = ntohl(ssrc_bs);
 	u_int32_t out_ssrc;
+	int rekernelize = 0;
 
 	// input direction
 	mutex_lock(&in_srtp->in_lock);
@@ -1407,17 +1984,33 @@ static void __stream_ssrc(struct packet_stream *in_srtp, struct packet_stream *o
 	(*ssrc_in_p) = in_srtp->ssrc_in;
 	ssrc_ctx_hold(*ssrc_in_p);
 	if (G_UNLIKELY(!(*ssrc_in_p) || (*ssrc_in_p)->parent->h.ssrc != in_ssrc)) {
-		// SSRC mismatch - get the new entry
 		ssrc_ctx_put(ssrc_in_p);
-		ssrc_ctx_put(&in_srtp->ssrc_in);
-		(*ssrc_in_p) = in_srtp->ssrc_in =
-			get_ssrc_ctx(in_ssrc, ssrc_hash, SSRC_DIR_INPUT, in_srtp->media->monologue);
+		struct ssrc_ctx *alt = in_srtp->ssrc_in_alt;
+		if (alt && alt->parent->h.ssrc == in_ssrc) {
+			// alternating between two SSRCs, such as video plus RTX: swap them
+			in_srtp->ssrc_in_alt = in_srtp->ssrc_in;
+			(*ssrc_in_p) = in_srtp->ssrc_in = alt;
+		}
+		else {
+			// SSRC mismatch - get the new entry and keep the old one as alternate
+			ssrc_ctx_put(&in_srtp->ssrc_in_alt);
+			in_srtp->ssrc_in_alt = in_srtp->ssrc_in;
+			(*ssrc_in_p) = in_srtp->ssrc_in =
+				get_ssrc_ctx(in_ssrc, ssrc_hash, SSRC_DIR_INPUT, in_srtp->media->monologue);
+
+			// might have created a new entry, which would have a new random
+			// ssrc_map_out. we don't need this if we're not transcoding
+			if (!MEDIA_ISSET(in_srtp->media, TRANSCODE))
+				(*ssrc_in_p)->ssrc_map_out = in_ssrc;
+			if (in_srtp->media->simulcast)
+				simulcast_ssrc_map(in_srtp->media, *ssrc_in_p);
+
+			// the kernel passes a new SSRC up to us. audio doesn't alternate between
+			// SSRCs like video with RTX does, so the new one replaces the old one
+			if (in_srtp->ssrc_in_alt && in_srtp->media->type_id == MT_AUDIO)
+				rekernelize = 1;
+		}
 		ssrc_ctx_hold(in_srtp->ssrc_in);
-
-		// might have created a new entry, which would have a new random
-		// ssrc_map_out. we don't need this if we're not transcoding
-		if (!MEDIA_ISSET(in_srtp->media, TRANSCODE))
-			(*ssrc_in_p)->ssrc_map_out = in_ssrc;
 	}
 
 	mutex_unlock(&in_srtp->in_lock);
@@ -1429,11 +2022,19 @@ static void __stream_ssrc(struct packet_stream *in_srtp, struct packet_stream *o
 	(*ssrc_out_p) = out_srtp->ssrc_out;
 	ssrc_ctx_hold(*ssrc_out_p);
 	if (G_UNLIKELY(!(*ssrc_out_p) || (*ssrc_out_p)->parent->h.ssrc != out_ssrc)) {
-		// SSRC mismatch - get the new entry
 		ssrc_ctx_put(ssrc_out_p);
-		ssrc_ctx_put(&out_srtp->ssrc_out);
-		(*ssrc_out_p) = out_srtp->ssrc_out =
-			get_ssrc_ctx(out_ssrc, ssrc_hash, SSRC_DIR_OUTPUT, out_srtp->media->monologue);
+		struct ssrc_ctx *alt = out_srtp->ssrc_out_alt;
+		if (alt && alt->parent->h.ssrc == out_ssrc) {
+			out_srtp->ssrc_out_alt = out_srtp->ssrc_out;
+			(*ssrc_out_p) = out_srtp->ssrc_out = alt;
+		}
+		else {
+			// SSRC mismatch - get the new entry
+			ssrc_ctx_put(&out_srtp->ssrc_out_alt);
+			out_srtp->ssrc_out_alt = out_srtp->ssrc_out;
+			(*ssrc_out_p) = out_srtp->ssrc_out =
+				get_ssrc_ctx(out_ssrc, ssrc_hash, SSRC_DIR_OUTPUT, out_srtp->media->monologue);
+		}
 		ssrc_ctx_hold(out_srtp->ssrc_out);
 
 		// reverse SSRC mapping
@@ -1441,6 +2042,12 @@ static void __stream_ssrc(struct packet_stream *in_srtp, struct packet_stream *o
 	}
 
 	mutex_unlock(&out_srtp->out_lock);
+
+	if (rekernelize) {
+		mutex_lock(&in_srtp->in_lock);
+		__rekernelize(in_srtp);
+		mutex_unlock(&in_srtp->in_lock);
+	}
 }
 
 
@@ -1448,7 +2055,9 @@ static void __stream_ssrc(struct packet_stream *in_srtp, struct packet_stream *o
 // -1 = packet not handled, proceed;
 // 1 = same as 0, but stream can be kernelized
 static int media_demux_protocols(struct packet_handler_ctx *phc) {
-	if (MEDIA_ISSET(phc->mp.media, DTLS) && is_dtls(&phc->s)) {
+	re_demux(&phc->demux, (const unsigned char *) phc->s.s, phc->s.len);
+
+	if (MEDIA_ISSET(phc->mp.media, DTLS) && (phc->demux.cls & RE_DEMUX_DTLS)) {
 		mutex_lock(&phc->mp.stream->in_lock);
 		int ret = dtls(phc->mp.sfd, &phc->s, &phc->mp.fsin);
 		mutex_unlock(&phc->mp.stream->in_lock);
@@ -1456,7 +2065,7 @@ static int media_demux_protocols(struct packet_handler_ctx *phc) {
 			return 0;
 	}
 
-	if (phc->mp.media->ice_agent && is_stun(&phc->s)) {
+	if (phc->mp.media->ice_agent && (phc->demux.cls & RE_DEMUX_STUN)) {
 		int stun_ret = stun(&phc->s, phc->mp.sfd, &phc->mp.fsin);
 		if (!stun_ret)
 			return 0;
@@ -1473,16 +2082,31 @@ static int media_demux_protocols(struct packet_handler_ctx *phc) {
 
 
 #if RTP_LOOP_PROTECT
+// 64-bit fingerprint of the packet length and its first RTP_LOOP_PROTECT bytes
+static uint64_t media_loop_fingerprint(const str *s) {
+	uint64_t w[(RTP_LOOP_PROTECT + 7) / 8] = {0,};
+	memcpy(w, s->s, MIN(s->len, RTP_LOOP_PROTECT));
+
+	uint64_t h = (uint64_t) s->len * 0x9e3779b97f4a7c15ULL;
+	for (unsigned int i = 0; i < G_N_ELEMENTS(w); i++) {
+		h ^= w[i];
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+	}
+	return h | 1; // never zero, which marks an unused slot
+}
+
 // returns: 0 = ok, proceed; -1 = duplicate detected, drop packet
 static int media_loop_detect(struct packet_handler_ctx *phc) {
+	uint64_t fp = media_loop_fingerprint(&phc->s);
+	int dupe = 0;
+
 	mutex_lock(&phc->mp.stream->in_lock);
 
-	for (int i = 0; i < RTP_LOOP_PACKETS; i++) {
-		if (phc->mp.stream->lp_buf[i].len != phc->s.len)
-			continue;
-		if (memcmp(phc->mp.stream->lp_buf[i].buf, phc->s.s, MIN(phc->s.len, RTP_LOOP_PROTECT)))
-			continue;
+	for (int i = 0; i < RTP_LOOP_PACKETS; i++)
+		dupe |= (phc->mp.stream->lp_buf[i] == fp);
 
+	if (dupe) {
 		__C_DBG("packet dupe");
 		if (phc->mp.stream->lp_count >= RTP_LOOP_MAX_COUNT) {
 			ilog(LOG_WARNING, "More than %d duplicate packets detected, dropping packet "
@@ -1497,8 +2121,7 @@ static int media_loop_detect(struct packet_handler_ctx *phc) {
 
 	/* not a dupe */
 	phc->mp.stream->lp_count = 0;
-	phc->mp.stream->lp_buf[phc->mp.stream->lp_idx].len = phc->s.len;
-	memcpy(phc->mp.stream->lp_buf[phc->mp.stream->lp_idx].buf, phc->s.s, MIN(phc->s.len, RTP_LOOP_PROTECT));
+	phc->mp.stream->lp_buf[phc->mp.stream->lp_idx] = fp;
 	phc->mp.stream->lp_idx = (phc->mp.stream->lp_idx + 1) % RTP_LOOP_PACKETS;
 loop_ok:
 	mutex_unlock(&phc->mp.stream->in_lock);
@@ -1520,7 +2143,7 @@ static void media_packet_rtcp_demux(struct packet_handler_ctx *phc)
 		phc->rtcp = 1;
 	}
 	else if (phc->mp.stream->rtcp_sink) {
-		int muxed_rtcp = rtcp_demux(&phc->s, phc->mp.media);
+		int muxed_rtcp = rtcp_demux(&phc->demux, phc->mp.media);
 		if (muxed_rtcp == 2) {
 			phc->sink = phc->mp.stream->rtcp_sink;
 			phc->rtcp = 1;
@@ -1542,7 +2165,8 @@ static void media_packet_rtp(struct packet_handler_ctx *phc)
 	if (G_UNLIKELY(!proto_is_rtp(phc->mp.media->protocol)))
 		return;
 
-	if (G_LIKELY(!phc->rtcp && !rtp_payload(&phc->mp.rtp, &phc->mp.payload, &phc->s))) {
+	if (G_LIKELY(!phc->rtcp && !rtp_payload_demuxed(&phc->mp.rtp, &phc->mp.payload, &phc->s,
+					&phc->demux))) {
 		rtp_padding(phc->mp.rtp, &phc->mp.payload);
 
 		if (G_LIKELY(phc->out_srtp != NULL))
@@ -1555,10 +2179,7 @@ static void media_packet_rtp(struct packet_handler_ctx *phc)
 		if (G_LIKELY(phc->mp.ssrc_in))
 			payload_tracker_add(&phc->mp.ssrc_in->tracker, phc->payload_type);
 
-		// XXX yet another hash table per payload type -> combine
-		struct rtp_stats *rtp_s = g_atomic_pointer_get(&phc->mp.stream->rtp_stats_cache);
-		if (G_UNLIKELY(!rtp_s) || G_UNLIKELY(rtp_s->payload_type != phc->payload_type))
-			rtp_s = g_hash_table_lookup(phc->mp.stream->rtp_stats, &phc->payload_type);
+		struct rtp_stats *rtp_s = rtp_stats_get(phc->mp.stream, phc->payload_type);
 		if (!rtp_s) {
 			ilog(LOG_WARNING | LOG_FLAG_LIMIT,
 					"RTP packet with unknown payload type %u received", phc->payload_type);
@@ -1568,7 +2189,6 @@ static void media_packet_rtp(struct packet_handler_ctx *phc)
 		else {
 			atomic64_inc(&rtp_s->packets);
 			atomic64_add(&rtp_s->bytes, phc->s.len);
-			g_atomic_pointer_set(&phc->mp.stream->rtp_stats_cache, rtp_s);
 		}
 	}
 	else if (phc->rtcp && !rtcp_payload(&phc->mp.rtcp, NULL, &phc->s)) {
@@ -1588,10 +2208,12 @@ static int media_packet_decrypt(struct packet_handler_ctx *phc)
 	if (G_LIKELY(!phc->rtcp)) {
 		phc->decrypt_func = phc->in_srtp->handler->in->rtp_crypt;
 		phc->encrypt_func = phc->in_srtp->handler->out->rtp_crypt;
+		phc->encrypt_batch_func = phc->in_srtp->handler->out->rtp_crypt_batch;
 	}
 	else {
 		phc->decrypt_func = phc->in_srtp->handler->in->rtcp_crypt;
 		phc->encrypt_func = phc->in_srtp->handler->out->rtcp_crypt;
+		phc->encrypt_batch_func = NULL;
 		phc->rtcp_filter = phc->in_srtp->handler->in->rtcp_filter;
 	}
 
@@ -1615,7 +2237,17 @@ static int media_packet_decrypt(struct packet_handler_ctx *phc)
 	return ret;
 }
 
-int media_packet_encrypt(rewrite_func encrypt_func, struct packet_stream *out, struct media_packet *mp) {
+static int __media_packet_encrypt_ret(int encret) {
+	if (encret == 1)
+		return 0x02;
+	if (encret != 0)
+		return 0x01;
+	return 0x00;
+}
+
+int media_packet_encrypt(rewrite_func encrypt_func, rewrite_batch_func encrypt_batch_func,
+		struct packet_stream *out, struct media_packet *mp)
+{
 	int ret = 0x00; // 0x01 = error, 0x02 = update
 
 	if (!encrypt_func)
@@ -1623,13 +2255,30 @@ int media_packet_encrypt(rewrite_func encrypt_func, struct packet_stream *out, s
 
 	mutex_lock(&out->out_lock);
 
+	// several output packets (e.g. from the transcoder) go through the cipher together
+	if (encrypt_batch_func && mp->packets_out.length > 1) {
+		str *batch[CRYPTO_BATCH_MAX];
+		int rets[CRYPTO_BATCH_MAX];
+		unsigned int num = 0;
+
+		for (GList *l = mp->packets_out.head; l; l = l->next) {
+			struct codec_packet *p = l->data;
+			batch[num++] = &p->s;
+			if (num < CRYPTO_BATCH_MAX && l->next)
+				continue;
+			encrypt_batch_func(batch, num, out, mp->ssrc_out, rets);
+			for (unsigned int i = 0; i < num; i++)
+				ret |= __media_packet_encrypt_ret(rets[i]);
+			num = 0;
+		}
+
+		mutex_unlock(&out->out_lock);
+		return ret;
+	}
+
 	for (GList *l = mp->packets_out.head; l; l = l->next) {
 		struct codec_packet *p = l->data;
-		int encret = encrypt_func(&p->s, out, NULL, NULL, NULL, mp->ssrc_out);
-		if (encret == 1)
-			ret |= 0x02;
-		else if (encret != 0)
-			ret |= 0x01;
+		ret |= __media_packet_encrypt_ret(encrypt_func(&p->s, out, NULL, NULL, NULL, mp->ssrc_out));
 	}
 
 	mutex_unlock(&out->out_lock);
@@ -1638,7 +2287,7 @@ int media_packet_encrypt(rewrite_func encrypt_func, struct packet_stream *out, s
 }
 
 static int __media_packet_encrypt(struct packet_handler_ctx *phc) {
-	int ret = media_packet_encrypt(phc->encrypt_func, phc->out_srtp, &phc->mp);
+	int ret = media_packet_encrypt(phc->encrypt_func, phc->encrypt_batch_func, phc->out_srtp, &phc->mp);
 	if (ret & 0x02)
 		phc->update = 1;
 	return (ret & 0x01) ? -1 : 0;
@@ -1668,7 +2317,7 @@ static int media_packet_address_check(struct packet_handler_ctx *phc)
 	// confirmation purposes when needed. This is regardless of whether rtcp-mux
 	// is enabled or not.
 	if (!PS_ISSET(phc->mp.stream, CONFIRMED) && PS_ISSET(phc->mp.stream, RTP)) {
-		if (rtcp_demux_is_rtcp(&phc->s)) {
+		if ((phc->demux.cls & RE_DEMUX_RTCP)) {
 			ilog(LOG_DEBUG | LOG_FLAG_LIMIT, "Ignoring stray RTCP packet for "
 					"peer address confirmation purposes");
 			goto out;
@@ -1787,9 +2436,13 @@ update_addr:
 		phc->mp.stream->selected_sfd = phc->mp.sfd;
 		phc->unkernelize = 1;
 		phc->update = 1;
+		call_sdp_changed(phc->mp.call);
 	}
 
 out:
+	TRACE(phc->mp.call, phc->mp.sfd->socket.local.port, ADDRESS_CHECK, ret,
+			PS_ISSET(phc->mp.stream, CONFIRMED) ? 1 : 0, phc->update, phc->unkernelize);
+
 	mutex_unlock(&phc->mp.stream->in_lock);
 
 	return ret;
@@ -1840,7 +2493,8 @@ static int do_rtcp(struct packet_handler_ctx *phc) {
 	int ret = -1;
 
 	GQueue rtcp_list = G_QUEUE_INIT;
-	int rtcp_ret = rtcp_parse(&rtcp_list, &phc->mp);
+	// the individual packets are only needed for the filter
+	int rtcp_ret = rtcp_parse(phc->rtcp_filter ? &rtcp_list : NULL, &phc->mp);
 	if (rtcp_ret < 0)
 		goto out;
 	if (rtcp_ret == 1)
@@ -1848,6 +2502,10 @@ static int do_rtcp(struct packet_handler_ctx *phc) {
 	if (phc->rtcp_filter)
 		if (phc->rtcp_filter(&phc->mp, &rtcp_list))
 			goto out;
+	if (phc->mp.media->simulcast && simulcast_rtcp_in(&phc->mp))
+		goto ok;
+	if (phc->mp.media_out && phc->mp.media_out->simulcast && simulcast_rtcp_out(&phc->mp))
+		goto ok;
 
 	// queue for output
 	codec_add_raw_packet(&phc->mp);
@@ -1871,6 +2529,205 @@ int media_socket_dequeue(struct media_packet *mp, struct packet_stream *sink) {
 	return 0;
 }
 
+
+// transmit timestamps (--timestamping). Every datagram sent on a socket has a key,
+// which is the socket's tx_seq at the time. The receive timestamp of the packet that
+// it was made from is kept under that key until the kernel reports it as sent.
+#define TX_TS_PENDING 64
+
+struct tx_ts_pending {
+	unsigned int key;
+	struct timeval rx_tv; // zero if unused
+	struct timespec rx_hwts;
+};
+struct stream_fd_tx_ts {
+	mutex_t lock;
+	struct tx_ts_pending pending[TX_TS_PENDING];
+	struct latency_histogram relay_latency; // microseconds
+};
+
+static void stream_fd_tx_pending(struct stream_fd *sfd, unsigned int key, const struct codec_packet *cp) {
+	struct stream_fd_tx_ts *t = sfd->tx_ts;
+	if (!cp->rx_tv.tv_sec)
+		return; // not relayed, e.g. from a media player
+
+	mutex_lock(&t->lock);
+	struct tx_ts_pending *e = &t->pending[key % TX_TS_PENDING];
+	e->key = key;
+	e->rx_tv = cp->rx_tv;
+	e->rx_hwts = cp->rx_hwts;
+	mutex_unlock(&t->lock);
+}
+
+static void stream_fd_tx_timestamps(struct stream_fd *sfd) {
+	struct stream_fd_tx_ts *t = sfd->tx_ts;
+	struct socket_tx_ts ts;
+
+	while (socket_tx_timestamp(&sfd->socket, &ts) == 1) {
+		long us;
+
+		mutex_lock(&t->lock);
+		struct tx_ts_pending *e = &t->pending[ts.key % TX_TS_PENDING];
+		if (e->key != ts.key || !e->rx_tv.tv_sec) {
+			// overwritten already, or a packet not relayed from another stream
+			mutex_unlock(&t->lock);
+			continue;
+		}
+		// hardware timestamps are in the NIC's clock, so only compared to each other
+		if (ts.hw.tv_sec && e->rx_hwts.tv_sec)
+			us = (ts.hw.tv_sec - e->rx_hwts.tv_sec) * 1000000L
+				+ (ts.hw.tv_nsec - e->rx_hwts.tv_nsec) / 1000;
+		else
+			us = (ts.sw.tv_sec - e->rx_tv.tv_sec) * 1000000L
+				+ (ts.sw.tv_nsec / 1000 - e->rx_tv.tv_usec);
+		e->rx_tv.tv_sec = 0;
+		if (us < 0)
+			us = 0;
+		latency_histogram_add(&t->relay_latency, us);
+		mutex_unlock(&t->lock);
+
+		statistics_relay_latency(us);
+	}
+}
+
+// returns 0 if no packets have been timestamped yet
+int stream_fd_relay_latency(struct stream_fd *sfd, unsigned long *p50, unsigned long *p99) {
+	if (!sfd->tx_ts)
+		return 0;
+	*p50 = latency_histogram_percentile(&sfd->tx_ts->relay_latency, 50);
+	*p99 = latency_histogram_percentile(&sfd->tx_ts->relay_latency, 99);
+	return *p99 != 0;
+}
+
+
+// per-thread transmit queue for batched sending. collects outgoing packets for the same
+// socket between media_socket_send_batch_start() and media_socket_send_batch_flush().
+// the batch is sent without any call lock held: every entry holds a reference to the
+// stream_fd, which keeps its socket open (see stream_fd_free())
+static __thread struct {
+	int active;
+	struct stream_fd *sfd;
+	unsigned int num;
+	struct socket_mmsg mm[MAX_SENDMMSG];
+	struct codec_packet *cp[MAX_SENDMMSG];
+} send_batch;
+static int send_gso_disabled;
+
+// number of consecutive packets starting at `idx` that can go out as one GSO send
+static unsigned int __send_batch_gso_run(unsigned int idx) {
+	struct socket_mmsg *first = &send_batch.mm[idx];
+	size_t total = first->len;
+	unsigned int n;
+
+	for (n = 1; idx + n < send_batch.num; n++) {
+		struct socket_mmsg *mm = &send_batch.mm[idx + n];
+		if (mm->len != first->len)
+			break;
+		if (!endpoint_eq(&mm->ep, &first->ep))
+			break;
+		if (total + mm->len > MAX_GSO_SIZE)
+			break;
+		total += mm->len;
+	}
+
+	return n;
+}
+
+static void __send_batch_flush(void) {
+	if (!send_batch.num)
+		return;
+
+	socket_t *sock = &send_batch.sfd->socket;
+	// a GSO send gets only one transmit timestamp
+	int gso = rtpe_config.media_send_gso && !g_atomic_int_get(&send_gso_disabled)
+		&& !send_batch.sfd->tx_ts;
+
+	for (unsigned int idx = 0; idx < send_batch.num; ) {
+		unsigned int n = send_batch.num - idx;
+		unsigned int gso_size = 0;
+
+		if (gso) {
+			unsigned int run = __send_batch_gso_run(idx);
+			if (run >= 2) {
+				n = run;
+				gso_size = send_batch.mm[idx].len;
+			}
+			else {
+				// plain sendmmsg() up to where the next GSO run starts
+				for (n = 1; idx + n < send_batch.num; n++) {
+					if (__send_batch_gso_run(idx + n) >= 2)
+						break;
+				}
+			}
+		}
+
+		unsigned int key = sock->tx_seq;
+		int ret = socket_sendmmsg(sock, &send_batch.mm[idx], n, gso_size);
+
+		if (ret < 0 && gso_size && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+			ilog(LOG_WARNING, "UDP segmentation offload not supported (%s), disabling",
+					strerror(errno));
+			g_atomic_int_set(&send_gso_disabled, 1);
+			gso = 0;
+			continue;
+		}
+		if (ret <= 0) {
+			ilog(LOG_WARNING | LOG_FLAG_LIMIT, "Error sending %u batched packets to %s: %s",
+					n, endpoint_print_buf(&send_batch.mm[idx].ep), strerror(errno));
+			ret = n; // drop them
+		}
+		else if (send_batch.sfd->tx_ts) {
+			for (int i = 0; i < ret; i++)
+				stream_fd_tx_pending(send_batch.sfd, key + i, send_batch.cp[idx + i]);
+		}
+
+		idx += ret;
+	}
+
+	for (unsigned int i = 0; i < send_batch.num; i++) {
+		codec_packet_free(send_batch.cp[i]);
+		obj_put(send_batch.sfd);
+	}
+	send_batch.num = 0;
+	send_batch.sfd = NULL;
+}
+
+void media_socket_send_batch_start(void) {
+	send_batch.active = 1;
+}
+// sends out what was collected so far, the batch stays active
+void media_socket_send_batch_sync(void) {
+	__send_batch_flush();
+}
+void media_socket_send_batch_flush(void) {
+	__send_batch_flush();
+	send_batch.active = 0;
+}
+
+// takes over ownership of `cp`. sends immediately unless the thread has a batch started.
+void media_socket_send_packet(struct stream_fd *sfd, const endpoint_t *ep, struct codec_packet *cp) {
+	if (!send_batch.active || rtpe_config.media_send_batch <= 1) {
+		unsigned int key = sfd->socket.tx_seq;
+		if (socket_sendto(&sfd->socket, cp->s.s, cp->s.len, ep) >= 0 && sfd->tx_ts)
+			stream_fd_tx_pending(sfd, key, cp);
+		codec_packet_free(cp);
+		return;
+	}
+
+	if (send_batch.sfd != sfd || send_batch.num >= rtpe_config.media_send_batch)
+		__send_batch_flush();
+	send_batch.sfd = obj_get(sfd);
+
+	struct socket_mmsg *mm = &send_batch.mm[send_batch.num];
+	mm->buf = cp->s.s;
+	mm->len = cp->s.len;
+	mm->ep = *ep;
+	send_batch.cp[send_batch.num++] = cp;
+}
+
+// for the RTP header copies below, see struct freelist
+static __thread struct freelist rtp_header_copies;
+
 void media_packet_copy(struct media_packet *dst, const struct media_packet *src) {
 	*dst = *src;
 	g_queue_init(&dst->packets_out);
@@ -1880,7 +2737,10 @@ void media_packet_copy(struct media_packet *dst, const struct media_packet *src)
 		obj_hold(&dst->ssrc_in->parent->h);
 	if (dst->ssrc_out)
 		obj_hold(&dst->ssrc_out->parent->h);
-	dst->rtp = g_memdup(src->rtp, sizeof(*src->rtp));
+	if (src->rtp) {
+		dst->rtp = freelist_alloc(&rtp_header_copies, sizeof(*dst->rtp));
+		*dst->rtp = *src->rtp;
+	}
 	dst->rtcp = g_memdup(src->rtp, sizeof(*src->rtp));
 	dst->payload = STR_NULL;
 	dst->raw = STR_NULL;
@@ -1890,7 +2750,8 @@ void media_packet_release(struct media_packet *mp) {
 	obj_put(&mp->ssrc_in->parent->h);
 	obj_put(&mp->ssrc_out->parent->h);
 	g_queue_clear_full(&mp->packets_out, codec_packet_free);
-	g_free(mp->rtp);
+	if (mp->rtp)
+		freelist_free(&rtp_header_copies, mp->rtp, sizeof(*mp->rtp), 64);
 	g_free(mp->rtcp);
 }
 
@@ -1918,10 +2779,16 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 /* TODO move the above comments to the data structure definitions, if the above
  * always holds true */
 	int ret = 0, handler_ret = 0;
+	struct timespec start;
+	enum packet_latency_type lat_type = phc->buffered ? PKT_LAT_JITTER_BUFFER : PKT_LAT_PASSTHROUGH;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	PROBE(packet_start, phc->mp.sfd->socket.local.port, phc->s.len);
 
 	phc->mp.call = phc->mp.sfd->call;
 
-	rwlock_lock_r(&phc->mp.call->master_lock);
+	call_packet_lock(phc->mp.call);
 
 	phc->mp.stream = phc->mp.sfd->stream;
 	if (G_UNLIKELY(!phc->mp.stream))
@@ -1964,6 +2831,10 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 	// this set payload_type, ssrc_in, ssrc_out and mp
 	media_packet_rtp(phc);
 
+	TRACE(phc->mp.call, phc->mp.sfd->socket.local.port, PACKET_IN, phc->s.len, phc->payload_type,
+			phc->mp.rtp ? ntohs(phc->mp.rtp->seq_num) : 0,
+			phc->mp.rtp ? ntohl(phc->mp.rtp->ssrc) : 0);
+
 	// SSRC receive stats
 	if (phc->mp.ssrc_in && phc->mp.rtp) {
 		atomic64_inc(&phc->mp.ssrc_in->packets);
@@ -1997,6 +2868,8 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 
 
 	handler_ret = media_packet_decrypt(phc);
+	if (phc->decrypt_func && lat_type == PKT_LAT_PASSTHROUGH)
+		lat_type = PKT_LAT_DECRYPT;
 
 	// If recording pcap dumper is set, then we record the call.
 	if (phc->mp.call->recording)
@@ -2009,9 +2882,16 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 	if (phc->rtcp) {
 		if (do_rtcp(phc))
 			goto drop;
+		// sampled copy of a packet that the kernel module has forwarded and counted already
+		if (PS_ISSET(phc->mp.stream, KERNEL_RTCP) && endpoint_eq(&phc->mp.fsin, &phc->mp.stream->endpoint))
+			goto out;
 	}
 	else {
+		if (phc->mp.media->simulcast && simulcast_rtp(&phc->mp))
+			goto drop;
 		struct codec_handler *transcoder = codec_handler_get(phc->mp.media, phc->payload_type);
+		if (transcoder->transcoder && !phc->buffered)
+			lat_type = PKT_LAT_TRANSCODE;
 		// this transfers the packet from 's' to 'packets_out'
 		if (transcoder->func(transcoder, &phc->mp))
 			goto drop;
@@ -2045,6 +2925,9 @@ static int stream_packet(struct packet_handler_ctx *phc) {
 
 	mutex_unlock(&phc->sink->out_lock);
 
+	TRACE(phc->mp.call, phc->mp.sfd->socket.local.port, PACKET_OUT, ret, phc->rtcp, phc->kernelize,
+			handler_ret);
+
 	if (ret == -1) {
 		ret = -errno;
                 ilog(LOG_DEBUG,"Error when sending message. Error: %s",strerror(errno));
@@ -2061,6 +2944,8 @@ drop:
 	atomic64_set(&phc->mp.stream->last_packet, rtpe_now.tv_sec);
 	atomic64_inc(&rtpe_statsps.packets);
 	atomic64_add(&rtpe_statsps.bytes, phc->s.len);
+	atomic64_inc(&phc->mp.sfd->local_intf->spec->packets);
+	atomic64_add(&phc->mp.sfd->local_intf->spec->bytes, phc->s.len);
 
 out:
 	if (phc->unkernelize) {
@@ -2069,29 +2954,274 @@ out:
 		stream_unconfirm(phc->mp.stream->rtcp_sink);
 	}
 
-	rwlock_unlock_r(&phc->mp.call->master_lock);
+	call_packet_unlock(phc->mp.call);
 
 	g_queue_clear_full(&phc->mp.packets_out, codec_packet_free);
 
 	ssrc_ctx_put(&phc->mp.ssrc_in);
 	ssrc_ctx_put(&phc->mp.ssrc_out);
 
+	statistics_packet_latency(lat_type, &start);
+
+	PROBE(packet_done, phc->mp.sfd->socket.local.port, ret);
+
 	return ret;
 }
 
 
+// Packets from anywhere but the confirmed peer of the stream count towards the limit of
+// an isolated interface, so that a flood can be dropped before any further processing.
+// Unlocked reads, so the odd packet may be misjudged while the endpoint is changing.
+static int __unknown_source_drop(struct intf_isolation *iso, struct stream_fd *sfd,
+		const endpoint_t *fsin, const struct timeval *tv)
+{
+	struct packet_stream *ps = sfd->stream;
+	if (ps && PS_ISSET(ps, CONFIRMED) && endpoint_eq(&ps->endpoint, fsin))
+		return 0;
+
+	int sec = tv->tv_sec;
+	if (g_atomic_int_get(&iso->unknown_sec) != sec) {
+		g_atomic_int_set(&iso->unknown_sec, sec);
+		g_atomic_int_set(&iso->unknown_count, 0);
+	}
+	if ((unsigned int) g_atomic_int_add(&iso->unknown_count, 1) < iso->unknown_limit)
+		return 0;
+
+	atomic64_inc(&iso->unknown_dropped);
+	ilog(LOG_DEBUG | LOG_FLAG_LIMIT, "Dropping packet from %s%s%s on interface '" STR_FORMAT
+			"': unknown-source limit reached",
+			FMT_M(endpoint_print_buf(fsin)), STR_FMT(&iso->name));
+	return 1;
+}
+
+// returns: 0 = ok, 1 = stream needs Redis update
+static int stream_fd_packet(struct stream_fd *sfd, char *buf, int len, const endpoint_t *fsin,
+		const struct timeval *tv, const struct timespec *hwts)
+{
+	struct packet_handler_ctx phc;
+	int ret;
+
+	statistics_wakeup_latency(tv);
+
+	struct intf_isolation *iso = sfd->local_intf->logical->isolation;
+	if (G_UNLIKELY(iso && iso->unknown_limit) && __unknown_source_drop(iso, sfd, fsin, tv))
+		return 0;
+
+	ZERO(phc);
+	phc.mp.sfd = sfd;
+	phc.mp.fsin = *fsin;
+	phc.mp.tv = *tv;
+	if (hwts)
+		phc.mp.hwts = *hwts;
+
+	if (len >= MAX_RTP_PACKET_SIZE)
+		ilog(LOG_WARNING, "UDP packet possibly truncated");
+
+	str_init_len(&phc.s, buf, len);
+
+	if (sfd->stream && sfd->stream->jb) {
+		ret = buffer_packet(&phc.mp, &phc.s);
+		if (ret == 1)
+			ret = stream_packet(&phc);
+	}
+	else
+		ret = stream_packet(&phc);
+
+	if (G_UNLIKELY(ret < 0))
+		ilog(LOG_WARNING, "Write error on media socket: %s", strerror(-ret));
+	else if (phc.update)
+		return 1;
+	return 0;
+}
+
+#define RECV_GRO_BATCH 8
+
+// preallocated per-thread receive buffers for batched receiving, released when the thread exits
+struct recv_batch_bufs {
+	char (*bufs)[RTP_BUFFER_SIZE];
+	// with UDP GRO, datagrams are received into these and then split up into bufs
+	char (*gro_bufs)[MAX_GRO_SIZE];
+};
+static __thread struct recv_batch_bufs *recv_batch;
+static pthread_key_t recv_batch_key;
+static pthread_once_t recv_batch_once = PTHREAD_ONCE_INIT;
+
+static void recv_batch_free(void *p) {
+	struct recv_batch_bufs *b = p;
+	free(b->bufs);
+	free(b->gro_bufs);
+	free(b);
+}
+static void recv_batch_key_init(void) {
+	pthread_key_create(&recv_batch_key, recv_batch_free);
+}
+
+// returns NULL if the buffers can't be allocated. packets are then received one by one
+static struct recv_batch_bufs *recv_batch_get(void) {
+	if (G_LIKELY(recv_batch))
+		return recv_batch;
+
+	pthread_once(&recv_batch_once, recv_batch_key_init);
+
+	struct recv_batch_bufs *b = calloc(1, sizeof(*b));
+	if (!b)
+		goto err;
+	b->bufs = malloc(sizeof(*b->bufs) * rtpe_config.media_recv_batch);
+	if (rtpe_config.media_recv_gro)
+		b->gro_bufs = malloc(sizeof(*b->gro_bufs) * RECV_GRO_BATCH);
+	if (!b->bufs || (rtpe_config.media_recv_gro && !b->gro_bufs)) {
+		recv_batch_free(b);
+		goto err;
+	}
+
+	pthread_setspecific(recv_batch_key, b);
+	recv_batch = b;
+	return b;
+
+err:
+	ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to allocate buffers for batched receiving, "
+			"falling back to single packets");
+	return NULL;
+}
+
+// returns: 0 = socket drained or iteration limit reached, -1 = socket closed
+static int stream_fd_readable_batch(int fd, struct stream_fd *sfd, int *update) {
+	struct socket_mmsg mm[MAX_RECVMMSG];
+	unsigned int batch = rtpe_config.media_recv_batch;
+	int ret, iters;
+	char (*recv_batch_bufs)[RTP_BUFFER_SIZE] = recv_batch->bufs;
+	char (*recv_gro_bufs)[MAX_GRO_SIZE] = recv_batch->gro_bufs;
+
+	for (iters = 0; ; ) {
+#if MAX_RECV_ITERS
+		if (iters >= MAX_RECV_ITERS) {
+			ilog(LOG_ERROR, "Too many packets in UDP receive queue (more than %d), "
+					"aborting loop. Dropped packets possible", iters);
+			break;
+		}
+		batch = MIN(batch, MAX_RECV_ITERS - iters);
+#endif
+
+		if (rtpe_config.media_recv_gro) {
+			for (unsigned int i = 0; i < RECV_GRO_BATCH; i++) {
+				mm[i].buf = recv_gro_bufs[i];
+				mm[i].len = MAX_GRO_SIZE;
+			}
+			ret = socket_recvmmsg_ts(&sfd->socket, mm, MIN(batch, RECV_GRO_BATCH));
+		}
+		else {
+			for (unsigned int i = 0; i < batch; i++) {
+				mm[i].buf = recv_batch_bufs[i] + RTP_BUFFER_HEAD_ROOM;
+				mm[i].len = MAX_RTP_PACKET_SIZE;
+			}
+			ret = socket_recvmmsg_ts(&sfd->socket, mm, batch);
+		}
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			stream_fd_closed(fd, sfd, 0);
+			return -1;
+		}
+		if (ret == 0)
+			break;
+
+		// passed-through packets point into our receive buffers, so output must be
+		// flushed before they're reused
+		media_socket_send_batch_start();
+		kernel_batch_start();
+		unsigned int slot = 0;
+		for (int i = 0; i < ret; i++) {
+			if (!rtpe_config.media_recv_gro) {
+				if (stream_fd_packet(sfd, mm[i].buf, mm[i].len, &mm[i].ep, &mm[i].tv, &mm[i].hwts))
+					*update = 1;
+				continue;
+			}
+
+			// split up coalesced datagrams. each segment is copied into a buffer with
+			// head and tail room as packets may be modified in place
+			size_t seg = mm[i].gro_size ? : mm[i].len;
+			for (size_t off = 0; off < mm[i].len; off += seg) {
+				size_t len = MIN(seg, mm[i].len - off);
+				if (len > MAX_RTP_PACKET_SIZE)
+					break;
+				if (slot == batch) {
+					kernel_batch_flush();
+					media_socket_send_batch_flush();
+					media_socket_send_batch_start();
+					kernel_batch_start();
+					slot = 0;
+				}
+				char *buf = recv_batch_bufs[slot++] + RTP_BUFFER_HEAD_ROOM;
+				memcpy(buf, (char *) mm[i].buf + off, len);
+				if (stream_fd_packet(sfd, buf, len, &mm[i].ep, &mm[i].tv, &mm[i].hwts))
+					*update = 1;
+			}
+		}
+		kernel_batch_flush();
+		media_socket_send_batch_flush();
+
+		iters += ret;
+	}
+
+	return 0;
+}
+
+// picks up what the kernel reported through SO_RXQ_OVFL, and with --media-rcvbuf-max
+// doubles the receive buffer of a socket each time it overflows
+static void stream_fd_rx_drops(struct stream_fd *sfd) {
+	unsigned int drops = sfd->socket.rx_drops - sfd->rx_drops_seen;
+	if (G_LIKELY(!drops))
+		return;
+	sfd->rx_drops_seen = sfd->socket.rx_drops;
+
+	atomic64_add(&sfd->rx_dropped, drops);
+	atomic64_add(&sfd->local_intf->spec->rx_dropped, drops);
+
+	ilog(LOG_WARNING | LOG_FLAG_LIMIT, "Kernel dropped %u packets on media port %u due to a full "
+			"receive buffer", drops, sfd->socket.local.port);
+
+	if (!rtpe_config.media_rcvbuf_max)
+		return;
+
+	int cur = sfd->rcvbuf ? : rcvbuf_get(sfd->socket.fd);
+	if (cur <= 0 || cur >= rtpe_config.media_rcvbuf_max)
+		return;
+	int size = MIN(cur * 2, rtpe_config.media_rcvbuf_max);
+	if (rcvbuf_size(sfd->socket.fd, size)) {
+		ilog(LOG_WARNING | LOG_FLAG_LIMIT, "Failed to increase receive buffer of media port %u: %s",
+				sfd->socket.local.port, strerror(errno));
+		return;
+	}
+	sfd->rcvbuf = size;
+	ilog(LOG_INFO, "Increased receive buffer of media port %u to %i bytes",
+			sfd->socket.local.port, size);
+}
+
 static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 	struct stream_fd *sfd = p;
 	char buf[RTP_BUFFER_SIZE];
 	int ret, iters;
 	int update = 0;
 	struct call *ca;
+	endpoint_t fsin;
+	struct timeval tv;
+	struct socket_mmsg mm; // to get hardware timestamps
 
 	if (sfd->socket.fd != fd)
 		goto out;
 
 	log_info_stream_fd(sfd);
 
+	// a batch size of 1 is the same as no batching
+	if (rtpe_config.media_recv_batch > 1 && recv_batch_get()) {
+		if (stream_fd_readable_batch(fd, sfd, &update))
+			goto done;
+		goto out;
+	}
+
 	for (iters = 0; ; iters++) {
 #if MAX_RECV_ITERS
 		if (iters >= MAX_RECV_ITERS) {
@@ -2101,12 +3231,19 @@ static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 		}
 #endif
 
-		struct packet_handler_ctx phc;
-		ZERO(phc);
-		phc.mp.sfd = sfd;
-
-		ret = socket_recvfrom_ts(&sfd->socket, buf + RTP_BUFFER_HEAD_ROOM, MAX_RTP_PACKET_SIZE,
-				&phc.mp.fsin, &phc.mp.tv);
+		if (sfd->tx_ts) {
+			mm.buf = buf + RTP_BUFFER_HEAD_ROOM;
+			mm.len = MAX_RTP_PACKET_SIZE;
+			ret = socket_recvmmsg_ts(&sfd->socket, &mm, 1);
+			if (ret > 0) {
+				ret = mm.len;
+				fsin = mm.ep;
+				tv = mm.tv;
+			}
+		}
+		else
+			ret = socket_recvfrom_ts(&sfd->socket, buf + RTP_BUFFER_HEAD_ROOM, MAX_RTP_PACKET_SIZE,
+					&fsin, &tv);
 
 		if (ret < 0) {
 			if (errno == EINTR)
@@ -2116,30 +3253,20 @@ static void stream_fd_readable(int fd, void *p, uintptr_t u) {
 			stream_fd_closed(fd, sfd, 0);
 			goto done;
 		}
-		if (ret >= MAX_RTP_PACKET_SIZE)
-			ilog(LOG_WARNING, "UDP packet possibly truncated");
-
-		str_init_len(&phc.s, buf + RTP_BUFFER_HEAD_ROOM, ret);
-
-		if (sfd->stream && sfd->stream->jb) {
-			ret = buffer_packet(&phc.mp, &phc.s);
-			if (ret == 1)
-				ret = stream_packet(&phc);
-		}
-		else
-			ret = stream_packet(&phc);
 
-		if (G_UNLIKELY(ret < 0))
-			ilog(LOG_WARNING, "Write error on media socket: %s", strerror(-ret));
-		else if (phc.update)
+		if (stream_fd_packet(sfd, buf + RTP_BUFFER_HEAD_ROOM, ret, &fsin, &tv,
+					sfd->tx_ts ? &mm.hwts : NULL))
 			update = 1;
 	}
 
 out:
+	stream_fd_rx_drops(sfd);
+
 	ca = sfd->call ? : NULL;
 
 	if (ca && update) {
-		redis_update_onekey(ca, rtpe_redis_write);
+		redis_update_async(ca, rtpe_redis_write);
+		replication_update(ca);
 	}
 done:
 	log_info_clear();
@@ -2154,10 +3281,24 @@ static void stream_fd_free(void *p) {
 	release_port(&f->socket, f->local_intf->spec);
 	crypto_cleanup(&f->crypto);
 	dtls_connection_cleanup(&f->dtls);
+	if (f->tx_ts) {
+		mutex_destroy(&f->tx_ts->lock);
+		g_slice_free1(sizeof(*f->tx_ts), f->tx_ts);
+	}
 
 	obj_put(f->call);
 }
 
+static void stream_fd_poller_item(struct stream_fd *sfd, struct poller_item *pi) {
+	ZERO(*pi);
+	pi->fd = sfd->socket.fd;
+	pi->obj = &sfd->obj;
+	pi->readable = stream_fd_readable;
+	pi->closed = stream_fd_closed;
+	pi->type = POLLER_CB_MEDIA;
+	pi->cost_ns = &sfd->call->poller_ns;
+}
+
 struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct local_intf *lif) {
 	struct stream_fd *sfd;
 	struct poller_item pi;
@@ -2167,23 +3308,84 @@ struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct lo
 	sfd->socket = *fd;
 	sfd->call = obj_get(call);
 	sfd->local_intf = lif;
+	sfd->rcvbuf = rtpe_config.media_rcvbuf;
+	if (rtpe_config.timestamping) {
+		sfd->tx_ts = g_slice_alloc0(sizeof(*sfd->tx_ts));
+		mutex_init(&sfd->tx_ts->lock);
+	}
 	g_queue_push_tail(&call->stream_fds, sfd); /* hand over ref */
 	g_slice_free1(sizeof(*fd), fd); /* moved into sfd, thus free */
 
 	__C_DBG("stream_fd_new localport=%d", sfd->socket.local.port);
 
-	ZERO(pi);
-	pi.fd = sfd->socket.fd;
-	pi.obj = &sfd->obj;
-	pi.readable = stream_fd_readable;
-	pi.closed = stream_fd_closed;
+	// with NUMA placement, the first socket decides which node the call is handled on
+	if (numa_num_nodes && call->stream_fds.length == 1 && lif->spec->numa_node >= 0) {
+		struct poller *p = numa_node_poller(lif->spec->numa_node, str_hash(&call->callid));
+		if (p) {
+			call->poller = p;
+			mutex_lock(&call->buffer_lock);
+			call->arena.node = lif->spec->numa_node;
+			mutex_unlock(&call->buffer_lock);
+		}
+	}
+
+	// sockets of an isolated interface stay on its own poller, regardless of the call
+	sfd->poller = call->poller;
+	if (lif->logical->isolation && lif->logical->isolation->poller)
+		sfd->poller = lif->logical->isolation->poller;
 
-	if (poller_add_item(rtpe_poller, &pi))
+	stream_fd_poller_item(sfd, &pi);
+	if (poller_add_item(sfd->poller, &pi))
 		ilog(LOG_ERR, "Failed to add stream_fd to poller");
 
 	return sfd;
 }
 
+/* call must be locked in W */
+void stream_fds_move(struct call *call, struct poller *p) {
+	struct poller_item pi;
+
+	if (call->poller == p)
+		return;
+
+	for (GList *l = call->stream_fds.head; l; l = l->next) {
+		struct stream_fd *sfd = l->data;
+		if (sfd->socket.fd == -1 || sfd->poller != call->poller)
+			continue;
+		poller_del_item(sfd->poller, sfd->socket.fd);
+		stream_fd_poller_item(sfd, &pi);
+		sfd->poller = p;
+		if (poller_add_item(p, &pi))
+			ilog(LOG_ERR, "Failed to move stream_fd to new poller");
+	}
+
+	call->poller = p;
+}
+
+/* call must be locked in W. the sockets stay open, but no more packets are read from them */
+void stream_fds_detach(struct call *call) {
+	for (GList *l = call->stream_fds.head; l; l = l->next) {
+		struct stream_fd *sfd = l->data;
+		if (sfd->socket.fd == -1)
+			continue;
+		poller_del_item(sfd->poller, sfd->socket.fd);
+	}
+}
+
+/* call must be locked in W. reverses stream_fds_detach() */
+void stream_fds_attach(struct call *call) {
+	struct poller_item pi;
+
+	for (GList *l = call->stream_fds.head; l; l = l->next) {
+		struct stream_fd *sfd = l->data;
+		if (sfd->socket.fd == -1)
+			continue;
+		stream_fd_poller_item(sfd, &pi);
+		if (poller_add_item(sfd->poller, &pi))
+			ilog(LOG_ERR, "Failed to re-add stream_fd to poller");
+	}
+}
+
 const struct transport_protocol *transport_protocol(const str *s) {
 	int i;
 
@@ -2202,14 +3404,14 @@ out:
 	return NULL;
 }
 
+// the jitter buffer keeps ownership of the packet
 void play_buffered(struct jb_packet *cp) {
 	struct packet_handler_ctx phc;
 	ZERO(phc);
 	phc.mp = cp->mp;
 	phc.s = cp->mp.raw;
-	//phc.buffered_packet = buffered;
+	phc.buffered = 1;
 	stream_packet(&phc);
-	jb_packet_free(&cp);
 }
 
 void interfaces_free(void) {
@@ -2218,6 +3420,8 @@ void interfaces_free(void) {
 
 	while ((ifc = g_queue_pop_head(&all_local_interfaces))) {
 		free(ifc->ice_foundation.s);
+		for (unsigned int i = 0; i < G_N_ELEMENTS(ifc->ice_candidate); i++)
+			free(ifc->ice_candidate[i]);
 		g_slice_free1(sizeof(*ifc), ifc);
 	}
 
@@ -2243,8 +3447,11 @@ void interfaces_free(void) {
 	ll = g_hash_table_get_values(__intf_spec_addr_type_hash);
 	for (GList *l = ll; l; l = l->next) {
 		struct intf_spec *spec = l->data;
-		struct port_pool *pp = &spec->port_pool;
-		g_queue_clear(&pp->free_list);
+		for (unsigned int i = 0; i < spec->port_pool.num_parts; i++) {
+			__spare_pairs_free(spec, &spec->port_pool.parts[i]);
+			mutex_destroy(&spec->port_pool.parts[i].spare_lock);
+		}
+		free(spec->port_pool.parts);
 		g_slice_free1(sizeof(*spec), spec);
 	}
 	g_list_free(ll);
@@ -2253,7 +3460,7 @@ void interfaces_free(void) {
 	ll = g_hash_table_get_values(__logical_intf_name_family_rr_hash);
 	for (GList *l = ll; l; l = l->next) {
 		struct intf_rr *rr = l->data;
-		g_queue_clear(&rr->logical_intfs);
+		g_free(rr->logical_intfs);
 		g_slice_free1(sizeof(*rr), rr);
 	}
 	g_list_free(ll);
@@ -2261,4 +3468,12 @@ void interfaces_free(void) {
 
 	for (int i = 0; i < G_N_ELEMENTS(__preferred_lists_for_family); i++)
 		g_queue_clear(&__preferred_lists_for_family[i]);
+
+	struct intf_isolation *iso;
+	while ((iso = g_queue_pop_head(&all_intf_isolations))) {
+		if (iso->poller)
+			poller_free(&iso->poller);
+		g_free(iso->name.s);
+		g_slice_free1(sizeof(*iso), iso);
+	}
 }
@@ -0,0 +1,226 @@
+#include "numa.h"
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <ifaddrs.h>
+#include <sys/syscall.h>
+#include "main.h"
+#include "log.h"
+#include "poller.h"
+
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+
+struct numa_node {
+	GArray *cpus;		// of int
+	GArray *pollers;	// of unsigned int, media poller indexes
+};
+
+
+unsigned int numa_num_nodes;
+
+static struct numa_node numa_nodes[NUMA_MAX_NODES];
+static int *numa_poller_nodes; // node of each media poller
+
+
+static GArray *numa_parse_cpulist(const char *s) {
+	GArray *ret = g_array_new(FALSE, FALSE, sizeof(int));
+
+	// "0-7,16-23"
+	while (*s && *s != '\n') {
+		char *end;
+		long from = strtol(s, &end, 10);
+		if (end == s)
+			break;
+		long to = from;
+		if (*end == '-') {
+			s = end + 1;
+			to = strtol(s, &end, 10);
+			if (end == s)
+				break;
+		}
+		for (long i = from; i <= to; i++) {
+			int cpu = i;
+			g_array_append_val(ret, cpu);
+		}
+		s = end;
+		if (*s == ',')
+			s++;
+	}
+
+	return ret;
+}
+
+static int numa_read_int(const char *path, int def) {
+	AUTO_CLEANUP_GBUF(buf);
+	if (!g_file_get_contents(path, &buf, NULL, NULL))
+		return def;
+	char *end;
+	long ret = strtol(buf, &end, 10);
+	if (end == buf)
+		return def;
+	return ret;
+}
+
+
+void numa_init(void) {
+	if (!rtpe_config.numa)
+		return;
+	if (rtpe_config.media_pollers <= 0)
+		die("--numa requires --media-pollers");
+
+	unsigned int num = 0;
+	for (unsigned int i = 0; i < NUMA_MAX_NODES; i++) {
+		AUTO_CLEANUP_GBUF(path);
+		AUTO_CLEANUP_GBUF(buf);
+		path = g_strdup_printf("/sys/devices/system/node/node%u/cpulist", i);
+		if (!g_file_get_contents(path, &buf, NULL, NULL))
+			break;
+		numa_nodes[i].cpus = numa_parse_cpulist(buf);
+		numa_nodes[i].pollers = g_array_new(FALSE, FALSE, sizeof(unsigned int));
+		if (!numa_nodes[i].cpus->len)
+			die("NUMA node %u has no CPUs", i);
+		num++;
+	}
+
+	if (num < 2) {
+		ilog(LOG_INFO, "Only %u NUMA node(s) found, ignoring --numa", num);
+		for (unsigned int i = 0; i < num; i++) {
+			g_array_free(numa_nodes[i].cpus, TRUE);
+			g_array_free(numa_nodes[i].pollers, TRUE);
+		}
+		return;
+	}
+
+	numa_num_nodes = num;
+
+	numa_poller_nodes = g_new0(int, rtpe_config.media_pollers);
+	for (unsigned int idx = 0; idx < rtpe_config.media_pollers; idx++) {
+		int node = idx % num;
+		numa_poller_nodes[idx] = node;
+		g_array_append_val(numa_nodes[node].pollers, idx);
+	}
+
+	ilog(LOG_INFO, "Distributing %i media pollers over %u NUMA nodes",
+			rtpe_config.media_pollers, num);
+}
+
+
+void numa_pin_media_poller(unsigned int idx) {
+	int node = numa_poller_nodes[idx];
+	struct numa_node *n = &numa_nodes[node];
+	// pollers of one node take that node's CPUs in order
+	unsigned int nth = idx / numa_num_nodes;
+	int cpu = g_array_index(n->cpus, int, nth % n->cpus->len);
+
+	cpu_set_t cs;
+	CPU_ZERO(&cs);
+	CPU_SET(cpu, &cs);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+	if (ret)
+		ilog(LOG_ERR, "Failed to pin media poller thread to CPU %i on NUMA node %i: %s",
+				cpu, node, strerror(ret));
+}
+
+// lets the calling thread run on any CPU of the given node, so that memory it
+// allocates from now on is local to that node
+void numa_pin_node(int node) {
+	if (node < 0 || node >= (int) numa_num_nodes)
+		return;
+	GArray *cpus = numa_nodes[node].cpus;
+
+	cpu_set_t cs;
+	CPU_ZERO(&cs);
+	for (unsigned int i = 0; i < cpus->len; i++)
+		CPU_SET(g_array_index(cpus, int, i), &cs);
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(cs), &cs);
+	if (ret)
+		ilog(LOG_ERR, "Failed to pin thread to NUMA node %i: %s", node, strerror(ret));
+}
+
+int numa_media_poller_node(unsigned int idx) {
+	if (!numa_num_nodes)
+		return 0;
+	return numa_poller_nodes[idx];
+}
+
+
+// finds the network device that has the given address and returns its node, or -1
+int numa_addr_node(const sockaddr_t *addr) {
+	if (!numa_num_nodes)
+		return -1;
+
+	struct ifaddrs *ifas;
+	if (getifaddrs(&ifas)) {
+		ilog(LOG_WARN, "Failed to get network interface addresses: %s", strerror(errno));
+		return -1;
+	}
+
+	int ret = -1;
+
+	for (struct ifaddrs *ifa = ifas; ifa; ifa = ifa->ifa_next) {
+		if (!ifa->ifa_addr || !ifa->ifa_name)
+			continue;
+
+		sockfamily_t *fam;
+		if (ifa->ifa_addr->sa_family == AF_INET)
+			fam = get_socket_family_enum(SF_IP4);
+		else if (ifa->ifa_addr->sa_family == AF_INET6)
+			fam = get_socket_family_enum(SF_IP6);
+		else
+			continue;
+		if (fam != addr->family)
+			continue;
+
+		endpoint_t ep;
+		if (fam->sockaddr2endpoint(&ep, ifa->ifa_addr))
+			continue;
+		if (!sockaddr_eq(&ep.address, addr))
+			continue;
+
+		AUTO_CLEANUP_GBUF(path);
+		path = g_strdup_printf("/sys/class/net/%s/device/numa_node", ifa->ifa_name);
+		ret = numa_read_int(path, -1);
+		if (ret >= (int) numa_num_nodes)
+			ret = -1;
+		ilog(LOG_DEBUG, "Interface address %s is on device %s, NUMA node %i",
+				sockaddr_print_buf(addr), ifa->ifa_name, ret);
+		break;
+	}
+
+	freeifaddrs(ifas);
+	return ret;
+}
+
+
+struct poller *numa_node_poller(int node, unsigned int hash) {
+	if (node < 0 || node >= (int) numa_num_nodes)
+		return NULL;
+	GArray *p = numa_nodes[node].pollers;
+	if (!p->len)
+		return NULL;
+	return rtpe_media_pollers[g_array_index(p, unsigned int, hash % p->len)];
+}
+
+
+// sets the preferred node for a range of memory that hasn't been touched yet
+int numa_bind_memory(void *p, size_t len, int node) {
+	if (node < 0 || node >= (int) numa_num_nodes)
+		return 0;
+#ifdef SYS_mbind
+	unsigned long mask = 1UL << node;
+	if (syscall(SYS_mbind, p, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0)) {
+		ilog(LOG_WARN, "Failed to bind memory to NUMA node %i: %s", node, strerror(errno));
+		return -1;
+	}
+#endif
+	return 0;
+}
@@ -10,15 +10,26 @@
 #include <assert.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <glib.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <main.h>
 #include <redis.h>
 #include <hiredis/adapters/libevent.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 
 #include "aux.h"
 #include "obj.h"
+#include "log.h"
+
+
+
+#define URING_ENTRIES 4096
+#define POLLER_EVENTS 128
 
 
 
@@ -33,12 +44,49 @@ struct poller_item_int {
 	struct obj			obj;
 	struct poller_item		item;
 
+	unsigned int			serial; /* io_uring only: tags completions of this item */
 	int				blocked:1;
 	int				error:1;
 };
 
+// threads running one of the poller loops, for the per-thread CPU time metrics
+struct poller_thread {
+	unsigned int			poller_id;
+	unsigned int			idx;
+	clockid_t			clock;
+	int				timer;
+
+	// wall clock time, updated only by the thread itself
+	atomic64			busy_ns[__POLLER_CB_MAX];
+	atomic64			idle_ns;
+};
+
+static volatile unsigned int poller_next_id;
+static mutex_t poller_threads_lock = MUTEX_STATIC_INIT;
+static GQueue poller_threads = G_QUEUE_INIT;
+static __thread struct poller_thread *poller_self;
+__thread int poller_thread_busy;
+
+const char * const poller_cb_type_names[__POLLER_CB_MAX] = {
+	[POLLER_CB_CONTROL] = "control",
+	[POLLER_CB_MEDIA] = "media",
+	[POLLER_CB_TIMER] = "timer",
+};
+
+// per-epoll busy polling parameters, available from Linux 6.9
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
 struct poller {
 	int				fd;
+	unsigned int			id;
 	mutex_t				lock;
 	struct poller_item_int		**items;
 	unsigned int			items_size;
@@ -48,25 +96,76 @@ struct poller {
 	mutex_t				timers_add_del_lock; /* nested below timers_lock */
 	GSList				*timers_add;
 	GSList				*timers_del;
+
+#ifdef HAVE_LIBURING
+	int				uring; /* io_uring used instead of epoll */
+	struct io_uring			ring;
+	mutex_t				sq_lock; /* nested below lock */
+	mutex_t				cq_lock; /* for consuming completions, not held while waiting */
+	unsigned int			serial;
+#endif
 };
 
 
 
 
 
+static inline uint64_t poller_clock_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// returns the current time as the new start, or 0 in threads not running a poller loop
+static inline uint64_t poller_account(uint64_t start, atomic64 *counter, atomic64 *cost) {
+	if (!poller_self)
+		return 0;
+	uint64_t now = poller_clock_ns();
+	if (start) {
+		atomic64_add_na(counter, now - start);
+		if (cost)
+			atomic64_add(cost, now - start);
+	}
+	return now;
+}
+
+
 struct poller *poller_new(void) {
 	struct poller *p;
 
 	p = malloc(sizeof(*p));
 	memset(p, 0, sizeof(*p));
+	p->id = g_atomic_int_add(&poller_next_id, 1);
 	gettimeofday(&rtpe_now, NULL);
-	p->fd = epoll_create1(0);
-	if (p->fd == -1)
-		abort();
 	mutex_init(&p->lock);
 	mutex_init(&p->timers_lock);
 	mutex_init(&p->timers_add_del_lock);
 
+#ifdef HAVE_LIBURING
+	if (rtpe_config.poller_io_uring) {
+		int ret = io_uring_queue_init(URING_ENTRIES, &p->ring, 0);
+		if (ret)
+			ilog(LOG_ERR, "Failed to create io_uring (%s), using epoll instead",
+					strerror(-ret));
+		else if (!(p->ring.features & IORING_FEAT_EXT_ARG)) {
+			ilog(LOG_ERR, "Kernel io_uring support is too old, using epoll instead");
+			io_uring_queue_exit(&p->ring);
+		}
+		else {
+			p->uring = 1;
+			p->fd = -1;
+			p->serial = 1;
+			mutex_init(&p->sq_lock);
+			mutex_init(&p->cq_lock);
+			return p;
+		}
+	}
+#endif
+
+	p->fd = epoll_create1(0);
+	if (p->fd == -1)
+		abort();
+
 	return p;
 }
 
@@ -74,6 +173,10 @@ static void __ti_put(void *p) {
 	struct timer_item *ti = p;
 	obj_put(ti);
 }
+unsigned int poller_id(const struct poller *p) {
+	return p->id;
+}
+
 void poller_free(struct poller **pp) {
 	struct poller *p = *pp;
 	for (unsigned int i = 0; i < p->items_size; i++) {
@@ -89,6 +192,10 @@ void poller_free(struct poller **pp) {
 	if (p->fd != -1)
 		close(p->fd);
 	p->fd = -1;
+#ifdef HAVE_LIBURING
+	if (p->uring)
+		io_uring_queue_exit(&p->ring);
+#endif
 	if (p->items)
 		free(p->items);
 	free(p);
@@ -105,6 +212,82 @@ static int epoll_events(struct poller_item *it, struct poller_item_int *ii) {
 }
 
 
+#ifdef HAVE_LIBURING
+
+#define poller_uring(p) ((p)->uring)
+
+static uint64_t uring_data(struct poller_item_int *ii) {
+	return ((uint64_t) ii->serial << 32) | (uint32_t) ii->item.fd;
+}
+
+/* sq_lock must be held */
+static struct io_uring_sqe *uring_sqe(struct poller *p) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&p->ring);
+	if (sqe)
+		return sqe;
+	io_uring_submit(&p->ring);
+	sqe = io_uring_get_sqe(&p->ring);
+	if (!sqe)
+		abort();
+	return sqe;
+}
+
+/* p->lock must be held */
+static void uring_poll_add(struct poller *p, struct poller_item_int *ii) {
+	mutex_lock(&p->sq_lock);
+	struct io_uring_sqe *sqe = uring_sqe(p);
+	/* multishot poll wakes us up on every state change, so EPOLLET semantics apply */
+	io_uring_prep_poll_multishot(sqe, ii->item.fd, epoll_events(NULL, ii) & ~EPOLLET);
+	sqe->user_data = uring_data(ii);
+	io_uring_submit(&p->ring);
+	mutex_unlock(&p->sq_lock);
+}
+
+/* p->lock must be held */
+static void uring_poll_remove(struct poller *p, struct poller_item_int *ii) {
+	mutex_lock(&p->sq_lock);
+	struct io_uring_sqe *sqe = uring_sqe(p);
+	io_uring_prep_poll_remove(sqe, uring_data(ii));
+	sqe->user_data = 0; /* completion is ignored */
+	io_uring_submit(&p->ring);
+	mutex_unlock(&p->sq_lock);
+}
+
+/* p->lock must be held. outstanding completions of the old poll request are
+ * discarded through the serial number */
+static void uring_poll_mod(struct poller *p, struct poller_item_int *ii) {
+	uring_poll_remove(p, ii);
+	ii->serial = p->serial++;
+	uring_poll_add(p, ii);
+}
+
+#else
+
+#define poller_uring(p) 0
+
+INLINE void uring_poll_add(struct poller *p, struct poller_item_int *ii) { }
+INLINE void uring_poll_remove(struct poller *p, struct poller_item_int *ii) { }
+INLINE void uring_poll_mod(struct poller *p, struct poller_item_int *ii) { }
+
+#endif
+
+
+/* p->lock must be held */
+static int poller_item_mod(struct poller *p, struct poller_item_int *ii) {
+	struct epoll_event e;
+
+	if (poller_uring(p)) {
+		uring_poll_mod(p, ii);
+		return 0;
+	}
+
+	ZERO(e);
+	e.events = epoll_events(NULL, ii);
+	e.data.fd = ii->item.fd;
+	return epoll_ctl(p->fd, EPOLL_CTL_MOD, ii->item.fd, &e);
+}
+
+
 static void poller_fd_timer(void *p) {
 	struct poller_item_int *it = p;
 
@@ -142,11 +325,13 @@ static int __poller_add_item(struct poller *p, struct poller_item *i, int has_lo
 	if (i->fd < p->items_size && p->items[i->fd])
 		goto fail;
 
-	ZERO(e);
-	e.events = epoll_events(i, NULL);
-	e.data.fd = i->fd;
-	if (epoll_ctl(p->fd, EPOLL_CTL_ADD, i->fd, &e))
-		abort();
+	if (!poller_uring(p)) {
+		ZERO(e);
+		e.events = epoll_events(i, NULL);
+		e.data.fd = i->fd;
+		if (epoll_ctl(p->fd, EPOLL_CTL_ADD, i->fd, &e))
+			abort();
+	}
 
 	if (i->fd >= p->items_size) {
 		u = p->items_size;
@@ -160,6 +345,13 @@ static int __poller_add_item(struct poller *p, struct poller_item *i, int has_lo
 	obj_hold_o(ip->item.obj); /* new ref in *ip */
 	p->items[i->fd] = obj_get(ip);
 
+#ifdef HAVE_LIBURING
+	if (poller_uring(p)) {
+		ip->serial = p->serial++;
+		uring_poll_add(p, ip);
+	}
+#endif
+
 	mutex_unlock(&p->lock);
 
 	if (i->timer)
@@ -197,7 +389,9 @@ int poller_del_item(struct poller *p, int fd) {
 	if (!p->items || !(it = p->items[fd]))
 		goto fail;
 
-	if (epoll_ctl(p->fd, EPOLL_CTL_DEL, fd, NULL))
+	if (poller_uring(p))
+		uring_poll_remove(p, it);
+	else if (epoll_ctl(p->fd, EPOLL_CTL_DEL, fd, NULL))
 		abort();
 
 	p->items[fd] = NULL; /* stealing the ref */
@@ -296,6 +490,7 @@ found:
 static void poller_timers_run(struct poller *p) {
 	GSList *l;
 	struct timer_item *ti;
+	uint64_t start = poller_account(0, NULL, NULL);
 
 	mutex_lock(&p->timers_lock);
 	mutex_lock(&p->timers_add_del_lock);
@@ -311,13 +506,131 @@ static void poller_timers_run(struct poller *p) {
 	poller_timers_mod(p);
 	mutex_unlock(&p->timers_add_del_lock);
 	mutex_unlock(&p->timers_lock);
+
+	if (start)
+		poller_account(start, &poller_self->busy_ns[POLLER_CB_TIMER], NULL);
+}
+
+
+static void __poller_item_event(struct poller *p, struct poller_item_int *it, unsigned int events) {
+	if (it->error) {
+		it->item.closed(it->item.fd, it->item.obj, it->item.uintp);
+		return;
+	}
+
+	if ((events & (POLLERR | POLLHUP)))
+		it->item.closed(it->item.fd, it->item.obj, it->item.uintp);
+	else if ((events & POLLOUT)) {
+		mutex_lock(&p->lock);
+		it->blocked = 0;
+		int ret = poller_item_mod(p, it);
+		mutex_unlock(&p->lock);
+
+		if (ret == 0 && it->item.writeable)
+			it->item.writeable(it->item.fd, it->item.obj, it->item.uintp);
+	}
+	else if ((events & POLLIN))
+		it->item.readable(it->item.fd, it->item.obj, it->item.uintp);
+	else if (!events)
+		return;
+	else
+		abort();
 }
 
+/* called without p->lock and with a reference held to `it` */
+static void poller_item_event(struct poller *p, struct poller_item_int *it, unsigned int events) {
+	uint64_t start = poller_account(0, NULL, NULL);
+	__poller_item_event(p, it, events);
+	if (start)
+		poller_account(start, &poller_self->busy_ns[it->item.type], it->item.cost_ns);
+}
+
+
+#ifdef HAVE_LIBURING
+static int poller_poll_uring(struct poller *p, int timeout) {
+	struct io_uring_cqe *cqes[POLLER_EVENTS], *cqe;
+	struct {
+		uint64_t data;
+		int res;
+		unsigned int flags;
+	} evs[POLLER_EVENTS];
+	struct __kernel_timespec ts;
+	struct poller_item_int *it;
+	int ret;
+	unsigned int i, num;
+
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000LL;
+
+	/* waiting doesn't submit or consume anything (the timeout is passed through
+	 * IORING_ENTER_EXT_ARG), so all threads can wait at the same time without
+	 * holding a lock. only one thread at a time can consume completions: we copy
+	 * them out and release the ring before running any callbacks. a thread woken
+	 * up for completions that another thread took first simply finds none */
+	uint64_t start = poller_account(0, NULL, NULL);
+	ret = io_uring_wait_cqe_timeout(&p->ring, &cqe, &ts);
+	if (start)
+		poller_account(start, &poller_self->idle_ns, NULL);
+	if (ret == -ETIME || ret == -EINTR)
+		return 0;
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+	mutex_lock(&p->cq_lock);
+	num = io_uring_peek_batch_cqe(&p->ring, cqes, POLLER_EVENTS);
+	for (i = 0; i < num; i++) {
+		evs[i].data = cqes[i]->user_data;
+		evs[i].res = cqes[i]->res;
+		evs[i].flags = cqes[i]->flags;
+	}
+	io_uring_cq_advance(&p->ring, num);
+	mutex_unlock(&p->cq_lock);
+
+	gettimeofday(&rtpe_now, NULL);
+
+	for (i = 0; i < num; i++) {
+		if (!evs[i].data)
+			continue;
+		if (evs[i].res == -ECANCELED)
+			continue;
+
+		int fd = (uint32_t) evs[i].data;
+		unsigned int serial = evs[i].data >> 32;
+
+		mutex_lock(&p->lock);
+
+		it = (fd < p->items_size) ? p->items[fd] : NULL;
+		if (!it || it->serial != serial) {
+			/* stale completion */
+			mutex_unlock(&p->lock);
+			continue;
+		}
+
+		obj_hold(it);
+
+		/* multishot poll was terminated by the kernel: re-arm */
+		if (!(evs[i].flags & IORING_CQE_F_MORE)) {
+			it->serial = p->serial++;
+			uring_poll_add(p, it);
+		}
+
+		mutex_unlock(&p->lock);
+
+		poller_item_event(p, it, evs[i].res < 0 ? POLLERR : evs[i].res);
+
+		obj_put(it);
+	}
+
+	return num;
+}
+#endif
+
 
 int poller_poll(struct poller *p, int timeout) {
 	int ret, i;
 	struct poller_item_int *it;
-	struct epoll_event evs[128], *ev, e;
+	struct epoll_event evs[POLLER_EVENTS], *ev;
 
 	if (!p)
 		return -1;
@@ -328,9 +641,19 @@ int poller_poll(struct poller *p, int timeout) {
 	if (!p->items || !p->items_size)
 		goto out;
 
+#ifdef HAVE_LIBURING
+	if (poller_uring(p)) {
+		mutex_unlock(&p->lock);
+		return poller_poll_uring(p, timeout);
+	}
+#endif
+
 	mutex_unlock(&p->lock);
+	uint64_t start = poller_account(0, NULL, NULL);
 	errno = 0;
 	ret = epoll_wait(p->fd, evs, sizeof(evs) / sizeof(*evs), timeout);
+	if (start)
+		poller_account(start, &poller_self->idle_ns, NULL);
 	mutex_lock(&p->lock);
 
 	if (errno == EINTR)
@@ -355,35 +678,8 @@ int poller_poll(struct poller *p, int timeout) {
 		obj_hold(it);
 		mutex_unlock(&p->lock);
 
-		if (it->error) {
-			it->item.closed(it->item.fd, it->item.obj, it->item.uintp);
-			goto next;
-		}
-
-		if ((ev->events & (POLLERR | POLLHUP)))
-			it->item.closed(it->item.fd, it->item.obj, it->item.uintp);
-		else if ((ev->events & POLLOUT)) {
-			mutex_lock(&p->lock);
-			it->blocked = 0;
+		poller_item_event(p, it, ev->events);
 
-			ZERO(e);
-			e.events = epoll_events(NULL, it);
-			e.data.fd = it->item.fd;
-			int ret = epoll_ctl(p->fd, EPOLL_CTL_MOD, it->item.fd, &e);
-
-			mutex_unlock(&p->lock);
-
-			if (ret == 0 && it->item.writeable)
-				it->item.writeable(it->item.fd, it->item.obj, it->item.uintp);
-		}
-		else if ((ev->events & POLLIN))
-			it->item.readable(it->item.fd, it->item.obj, it->item.uintp);
-		else if (!ev->events)
-			goto next;
-		else
-			abort();
-
-next:
 		obj_put(it);
 		mutex_lock(&p->lock);
 	}
@@ -397,7 +693,6 @@ out:
 
 void poller_blocked(struct poller *p, void *fdp) {
 	int fd = GPOINTER_TO_INT(fdp);
-	struct epoll_event e;
 
 	if (!p || fd < 0)
 		return;
@@ -413,10 +708,7 @@ void poller_blocked(struct poller *p, void *fdp) {
 
 	p->items[fd]->blocked = 1;
 
-	ZERO(e);
-	e.events = epoll_events(NULL, p->items[fd]);
-	e.data.fd = fd;
-	epoll_ctl(p->fd, EPOLL_CTL_MOD, fd, &e);
+	poller_item_mod(p, p->items[fd]);
 
 fail:
 	mutex_unlock(&p->lock);
@@ -508,12 +800,16 @@ int poller_add_timer(struct poller *p, void (*f)(void *), struct obj *o) {
 	return poller_timer_link(p, &p->timers_add, f, o);
 }
 
+static void poller_thread_register(struct poller *p, int timer);
+
 /* run in thread separate from poller_poll() */
 void poller_timer_loop(void *d) {
 	struct poller *p = d;
 	struct timeval tv;
 	int wt;
 
+	poller_thread_register(p, 1);
+
 	while (!rtpe_shutdown) {
 		gettimeofday(&tv, NULL);
 		if (tv.tv_sec != rtpe_now.tv_sec)
@@ -521,7 +817,10 @@ void poller_timer_loop(void *d) {
 
 		wt = 1000000 - tv.tv_usec;
 		wt = MIN(wt, 100000);
+		uint64_t start = poller_account(0, NULL, NULL);
 		usleep(wt);
+		if (start)
+			poller_account(start, &poller_self->idle_ns, NULL);
 		continue;
 
 now:
@@ -537,9 +836,94 @@ now:
 	}
 }
 
+static void poller_thread_register(struct poller *p, int timer) {
+	struct poller_thread *pt = g_slice_alloc0(sizeof(*pt));
+	pt->poller_id = p->id;
+	pt->timer = timer;
+	if (pthread_getcpuclockid(pthread_self(), &pt->clock)) {
+		g_slice_free1(sizeof(*pt), pt);
+		return;
+	}
+
+	mutex_lock(&poller_threads_lock);
+	pt->idx = poller_threads.length;
+	g_queue_push_tail(&poller_threads, pt);
+	mutex_unlock(&poller_threads_lock);
+
+	poller_self = pt;
+}
+
+void poller_threads_cpu(void (*func)(unsigned int poller, unsigned int thread, uint64_t cpu_ns, void *),
+		void *arg)
+{
+	mutex_lock(&poller_threads_lock);
+	for (GList *l = poller_threads.head; l; l = l->next) {
+		struct poller_thread *pt = l->data;
+		struct timespec ts;
+		if (pt->timer)
+			continue;
+		if (clock_gettime(pt->clock, &ts))
+			continue; // thread has exited
+		func(pt->poller_id, pt->idx, ts.tv_sec * 1000000000ULL + ts.tv_nsec, arg);
+	}
+	mutex_unlock(&poller_threads_lock);
+}
+
+void poller_threads_stats(void (*func)(const struct poller_thread_stats *, void *), void *arg) {
+	mutex_lock(&poller_threads_lock);
+	for (GList *l = poller_threads.head; l; l = l->next) {
+		struct poller_thread *pt = l->data;
+		struct poller_thread_stats st = {
+			.poller = pt->poller_id,
+			.thread = pt->idx,
+			.timer = pt->timer,
+			.idle_ns = atomic64_get(&pt->idle_ns),
+		};
+		for (unsigned int i = 0; i < __POLLER_CB_MAX; i++)
+			st.busy_ns[i] = atomic64_get(&pt->busy_ns[i]);
+		func(&st, arg);
+	}
+	mutex_unlock(&poller_threads_lock);
+}
+
 void poller_loop(void *d) {
 	struct poller *p = d;
 
-	while (!rtpe_shutdown)
-		poller_poll(p, 100);
+	poller_thread_register(p, 0);
+
+	while (!rtpe_shutdown) {
+		// returns immediately if no items have been added yet
+		if (poller_poll(p, 100) < 0)
+			usleep(100000);
+	}
+}
+
+// never blocks in the kernel. only for pollers that have a CPU to themselves
+void poller_loop_busy(void *d) {
+	struct poller *p = d;
+
+	poller_thread_register(p, 0);
+	poller_thread_busy = 1;
+
+	while (!rtpe_shutdown) {
+		if (poller_poll(p, 0) < 0)
+			usleep(100000);
+	}
+}
+
+// makes each epoll_wait() on this poller poll the network device queues of its
+// sockets for up to `usecs`, handling at most `budget` packets per round
+int poller_busy_poll(struct poller *p, unsigned int usecs, unsigned int budget) {
+#ifdef HAVE_LIBURING
+	if (p->uring) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+#endif
+	struct epoll_params ep = {
+		.busy_poll_usecs = usecs,
+		.busy_poll_budget = budget,
+		.prefer_busy_poll = 1,
+	};
+	return ioctl(p->fd, EPIOCSPARAMS, &ep);
 }
@@ -12,8 +12,12 @@
 #include <unistd.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "xt_RTPENGINE.h"
+#include "metachunk.h"
 
 #include "call.h"
 #include "kernel.h"
@@ -21,6 +25,8 @@
 #include "rtplib.h"
 #include "cdr.h"
 #include "log.h"
+#include "obj.h"
+#include "main.h"
 
 
 
@@ -30,6 +36,37 @@ struct pcap_format {
 	void (*header)(unsigned char *, struct packet_stream *);
 };
 
+// Packets of a pcap recording are collected in memory and written out by
+// recording_pcap_writer_loop(), so that no disk I/O happens in the media path.
+struct pcap_writer {
+	struct obj obj;
+	int fd;
+	mutex_t lock; // protects everything below
+	GString *buf;
+	int closed;
+	unsigned int dropped;
+};
+
+// on-disk formats of the pcap file header and of struct pcap_pkthdr
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+#define PCAP_WRITER_FLUSH	(64 * 1024) // wake up the writer thread
+#define PCAP_WRITER_MAX		(8 * 1024 * 1024) // packets are dropped beyond this
+
 
 
 static int check_main_spool_dir(const char *spoolpath);
@@ -111,6 +148,17 @@ static char *spooldir = NULL;
 const struct recording_method *selected_recording_method;
 static const struct pcap_format *pcap_format;
 
+// all open pcap writers, each holding a reference
+static mutex_t pcap_writers_lock = MUTEX_STATIC_INIT;
+static cond_t pcap_writers_cond = COND_STATIC_INIT;
+static GQueue pcap_writers = G_QUEUE_INIT;
+
+static void pcap_writers_flush(GString **spare);
+
+// unix socket of the recording daemon, see metachunk.h
+static int metachunk_sock = -1;
+static struct sockaddr_un metachunk_addr;
+
 
 
 /**
@@ -119,10 +167,33 @@ static const struct pcap_format *pcap_format;
  */
 
 void recording_fs_free(void) {
+	// whatever is left after the writer thread has stopped
+	GString *spare = g_string_new("");
+	pcap_writers_flush(&spare);
+	g_string_free(spare, TRUE);
+
 	if (spooldir)
 		free(spooldir);
 
 	spooldir = NULL;
+
+	if (metachunk_sock != -1)
+		close(metachunk_sock);
+	metachunk_sock = -1;
+}
+
+static void metachunk_init(void) {
+	ZERO(metachunk_addr);
+	metachunk_addr.sun_family = AF_UNIX;
+	if (snprintf(metachunk_addr.sun_path, sizeof(metachunk_addr.sun_path), "%s/%s", spooldir,
+				METACHUNK_SOCKET_NAME) >= sizeof(metachunk_addr.sun_path))
+	{
+		ilog(LOG_WARN, "Spool directory path too long for the recording metadata socket");
+		return;
+	}
+	metachunk_sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (metachunk_sock == -1)
+		ilog(LOG_WARN, "Failed to create recording metadata socket: %s", strerror(errno));
 }
 
 /**
@@ -168,6 +239,9 @@ found:
 		ilog(LOG_ERR, "Please run `mkdir %s` and start rtpengine again.", spooldir);
 		exit(-1);
 	}
+
+	if (!strcmp(selected_recording_method->name, "proc"))
+		metachunk_init();
 }
 
 static int check_create_dir(const char *dir, const char *desc, mode_t creat_mode) {
@@ -270,6 +344,7 @@ void recording_start(struct call *call, const char *prefix, str *metadata) {
 	ilog(LOG_NOTICE, "Turning on call recording.");
 
 	call->recording = g_slice_alloc0(sizeof(struct recording));
+	call_mem_add(&call->mem[CALL_MEM_RECORDING], sizeof(struct recording));
 	struct recording *recording = call->recording;
 	recording->escaped_callid = g_uri_escape_string(call->callid.s, NULL, 0);
 	if (!prefix) {
@@ -360,12 +435,11 @@ static void pcap_init(struct call *call) {
 
 	// Wireshark starts at packet index 1, so we start there, too
 	recording->u.pcap.packet_num = 1;
-	mutex_init(&recording->u.pcap.recording_lock);
 	meta_setup_file(recording);
 
 	// set up pcap file
 	char *pcap_path = recording_setup_file(recording);
-	if (pcap_path != NULL && recording->u.pcap.recording_pdumper != NULL
+	if (pcap_path != NULL && recording->u.pcap.writer != NULL
 	    && recording->u.pcap.meta_fp) {
 		// Write the location of the PCAP file to the metadata file
 		fprintf(recording->u.pcap.meta_fp, "%s\n\n", pcap_path);
@@ -497,11 +571,114 @@ static int pcap_meta_finish_file(struct call *call) {
 				 recording->meta_filepath, spooldir);
 	}
 
-	mutex_destroy(&recording->u.pcap.recording_lock);
-
 	return return_code;
 }
 
+static void pcap_writer_free(void *p) {
+	struct pcap_writer *w = p;
+	if (w->fd != -1)
+		close(w->fd);
+	g_string_free(w->buf, TRUE);
+	mutex_destroy(&w->lock);
+}
+
+static struct pcap_writer *pcap_writer_open(const char *path) {
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd == -1)
+		return NULL;
+
+	struct pcap_file_hdr fh = {
+		.magic = 0xa1b2c3d4,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = 65535,
+		.linktype = pcap_format->linktype,
+	};
+	if (write(fd, &fh, sizeof(fh)) != sizeof(fh)) {
+		close(fd);
+		return NULL;
+	}
+
+	struct pcap_writer *w = obj_alloc0("pcap_writer", sizeof(*w), pcap_writer_free);
+	w->fd = fd;
+	mutex_init(&w->lock);
+	w->buf = g_string_sized_new(PCAP_WRITER_FLUSH * 2);
+	return w;
+}
+
+static void pcap_write_all(int fd, const char *s, size_t len) {
+	while (len) {
+		ssize_t ret = write(fd, s, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ilog(LOG_ERR, "Failed to write to pcap recording file: %s", strerror(errno));
+			return;
+		}
+		s += ret;
+		len -= ret;
+	}
+}
+
+// swaps the pending data with the empty buffer `*spare` and writes it out.
+// returns true if the writer was closed and is now done.
+static int pcap_writer_flush(struct pcap_writer *w, GString **spare) {
+	mutex_lock(&w->lock);
+	GString *buf = w->buf;
+	w->buf = *spare;
+	*spare = buf;
+	int closed = w->closed;
+	unsigned int dropped = w->dropped;
+	w->dropped = 0;
+	mutex_unlock(&w->lock);
+
+	if (dropped)
+		ilog(LOG_WARN, "Pcap recording fell behind, %u packets dropped", dropped);
+
+	pcap_write_all(w->fd, buf->str, buf->len);
+	g_string_truncate(buf, 0);
+
+	return closed;
+}
+
+static void pcap_writers_flush(GString **spare) {
+	GQueue writers = G_QUEUE_INIT;
+	struct pcap_writer *w;
+
+	mutex_lock(&pcap_writers_lock);
+	for (GList *l = pcap_writers.head; l; l = l->next)
+		g_queue_push_tail(&writers, obj_get((struct pcap_writer *) l->data));
+	mutex_unlock(&pcap_writers_lock);
+
+	while ((w = g_queue_pop_head(&writers))) {
+		if (pcap_writer_flush(w, spare)) {
+			mutex_lock(&pcap_writers_lock);
+			if (g_queue_remove(&pcap_writers, w))
+				obj_put(w);
+			mutex_unlock(&pcap_writers_lock);
+		}
+		obj_put(w);
+	}
+}
+
+void recording_pcap_writer_loop(void *p) {
+	GString *spare = g_string_sized_new(PCAP_WRITER_FLUSH * 2);
+
+	while (!rtpe_shutdown) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		timeval_add_usec(&tv, 1000000);
+
+		mutex_lock(&pcap_writers_lock);
+		cond_timedwait(&pcap_writers_cond, &pcap_writers_lock, &tv);
+		mutex_unlock(&pcap_writers_lock);
+
+		pcap_writers_flush(&spare);
+	}
+
+	g_string_free(spare, TRUE);
+}
+
 /**
  * Generate a random PCAP filepath to write recorded RTP stream.
  * Returns path to created file.
@@ -511,37 +688,46 @@ static char *recording_setup_file(struct recording *recording) {
 
 	if (!spooldir)
 		return NULL;
-	if (recording->u.pcap.recording_pd || recording->u.pcap.recording_pdumper)
+	if (recording->u.pcap.writer || recording->u.pcap.recording_path)
 		return NULL;
 
 	recording_path = file_path_str(recording->meta_prefix, "/pcaps/", ".pcap");
 	recording->u.pcap.recording_path = recording_path;
 
-	recording->u.pcap.recording_pd = pcap_open_dead(pcap_format->linktype, 65535);
-	recording->u.pcap.recording_pdumper = pcap_dump_open(recording->u.pcap.recording_pd, recording_path);
-	if (recording->u.pcap.recording_pdumper == NULL) {
-		pcap_close(recording->u.pcap.recording_pd);
-		recording->u.pcap.recording_pd = NULL;
+	struct pcap_writer *w = pcap_writer_open(recording_path);
+	if (!w) {
 		ilog(LOG_INFO, "Failed to write recording file: %s", recording_path);
-	} else {
-		ilog(LOG_INFO, "Writing recording file: %s", recording_path);
+		return recording_path;
 	}
+	ilog(LOG_INFO, "Writing recording file: %s", recording_path);
+
+	recording->u.pcap.writer = w;
+	mutex_lock(&pcap_writers_lock);
+	g_queue_push_tail(&pcap_writers, obj_get(w));
+	mutex_unlock(&pcap_writers_lock);
 
 	return recording_path;
 }
 
 /**
- * Flushes PCAP file, closes the dumper and descriptors, and frees object memory.
+ * Hands the PCAP file over to the writer thread for the final flush and closing,
+ * and frees object memory.
  */
 static void pcap_recording_finish_file(struct recording *recording) {
-	if (recording->u.pcap.recording_pdumper != NULL) {
-		pcap_dump_flush(recording->u.pcap.recording_pdumper);
-		pcap_dump_close(recording->u.pcap.recording_pdumper);
-		free(recording->u.pcap.recording_path);
-	}
-	if (recording->u.pcap.recording_pd != NULL) {
-		pcap_close(recording->u.pcap.recording_pd);
+	struct pcap_writer *w = recording->u.pcap.writer;
+	if (w) {
+		mutex_lock(&w->lock);
+		w->closed = 1;
+		mutex_unlock(&w->lock);
+		obj_put(w);
+		recording->u.pcap.writer = NULL;
+
+		mutex_lock(&pcap_writers_lock);
+		cond_signal(&pcap_writers_cond);
+		mutex_unlock(&pcap_writers_lock);
 	}
+	free(recording->u.pcap.recording_path);
+	recording->u.pcap.recording_path = NULL;
 }
 
 // "out" must be at least inp->len + MAX_PACKET_HEADER_LEN bytes
@@ -567,37 +753,51 @@ static void pcap_eth_header(unsigned char *pkt, struct packet_stream *stream) {
 }
 
 /**
- * Write out a PCAP packet with payload string.
+ * Append a PCAP packet with payload string to the writer's buffer.
  * A fair amount extraneous of packet data is spoofed.
  */
-static void stream_pcap_dump(struct media_packet *mp, const str *s) {
-	pcap_dumper_t *pdumper = mp->call->recording->u.pcap.recording_pdumper;
-	if (!pdumper)
+static void dump_packet_pcap(struct media_packet *mp, const str *s) {
+	struct recording *recording = mp->call->recording;
+	struct pcap_writer *w = recording->u.pcap.writer;
+	if (!w)
+		return;
+
+	mutex_lock(&w->lock);
+
+	size_t off = w->buf->len;
+	if (off >= PCAP_WRITER_MAX) {
+		w->dropped++;
+		mutex_unlock(&w->lock);
 		return;
+	}
 
-	unsigned char pkt[s->len + MAX_PACKET_HEADER_LEN + pcap_format->headerlen];
+	// packet is built in place, directly behind its record header
+	g_string_set_size(w->buf, off + sizeof(struct pcap_rec_hdr) + pcap_format->headerlen
+			+ MAX_PACKET_HEADER_LEN + s->len);
+	unsigned char *pkt = (unsigned char *) w->buf->str + off + sizeof(struct pcap_rec_hdr);
 	unsigned int pkt_len = fake_ip_header(pkt + pcap_format->headerlen, mp, s) + pcap_format->headerlen;
 	if (pcap_format->header)
 		pcap_format->header(pkt, mp->stream);
 
-	// Set up PCAP packet header
-	struct pcap_pkthdr header;
-	ZERO(header);
-	header.ts = rtpe_now;
-	header.caplen = pkt_len;
-	header.len = pkt_len;
+	struct pcap_rec_hdr header = {
+		.ts_sec = rtpe_now.tv_sec,
+		.ts_usec = rtpe_now.tv_usec,
+		.caplen = pkt_len,
+		.len = pkt_len,
+	};
+	memcpy(w->buf->str + off, &header, sizeof(header));
+	g_string_set_size(w->buf, off + sizeof(header) + pkt_len);
 
-	// Write the packet to the PCAP file
-	// Casting quiets compiler warning.
-	pcap_dump((unsigned char *)pdumper, &header, pkt);
-}
-
-static void dump_packet_pcap(struct media_packet *mp, const str *s) {
-	struct recording *recording = mp->call->recording;
-	mutex_lock(&recording->u.pcap.recording_lock);
-	stream_pcap_dump(mp, s);
 	recording->u.pcap.packet_num++;
-	mutex_unlock(&recording->u.pcap.recording_lock);
+	int wake = (off < PCAP_WRITER_FLUSH && w->buf->len >= PCAP_WRITER_FLUSH);
+
+	mutex_unlock(&w->lock);
+
+	if (wake) {
+		mutex_lock(&pcap_writers_lock);
+		cond_signal(&pcap_writers_cond);
+		mutex_unlock(&pcap_writers_lock);
+	}
 }
 
 static void finish_pcap(struct call *call) {
@@ -634,6 +834,7 @@ void recording_finish(struct call *call) {
 	free(recording->meta_filepath);
 
 	g_slice_free1(sizeof(*(recording)), recording);
+	call_mem_add(&call->mem[CALL_MEM_RECORDING], -(ssize_t) sizeof(*recording));
 	call->recording = NULL;
 }
 
@@ -655,10 +856,54 @@ static int open_proc_meta_file(struct recording *recording) {
 	return fd;
 }
 
+// passes a chunk that was just appended to the metadata file to the recording daemon.
+// returns 0 if it was sent
+static int metachunk_send(struct recording *recording, const char *label, unsigned int lablen,
+		struct iovec *in_iov, int iovcnt, unsigned int str_len, off_t start, off_t end)
+{
+	if (metachunk_sock == -1)
+		return -1;
+
+	const char *name = strrchr(recording->meta_filepath, '/');
+	name = name ? name + 1 : recording->meta_filepath;
+
+	struct metachunk_hdr hdr = {
+		.magic = METACHUNK_MAGIC,
+		.name_len = strlen(name),
+		.label_len = lablen,
+		.content_len = str_len,
+		.file_start = start,
+		.file_end = end,
+	};
+	if (sizeof(hdr) + hdr.name_len + lablen + str_len > METACHUNK_MAX_SIZE)
+		return -1;
+
+	struct iovec iov[iovcnt + 3];
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *) name;
+	iov[1].iov_len = hdr.name_len;
+	iov[2].iov_base = (void *) label;
+	iov[2].iov_len = lablen;
+	memcpy(&iov[3], in_iov, iovcnt * sizeof(*iov));
+
+	struct msghdr mh = {
+		.msg_name = &metachunk_addr,
+		.msg_namelen = sizeof(metachunk_addr),
+		.msg_iov = iov,
+		.msg_iovlen = iovcnt + 3,
+	};
+	if (sendmsg(metachunk_sock, &mh, 0) == -1)
+		return -1; // not listening, or its queue is full
+	return 0;
+}
+
 static int vappend_meta_chunk_iov(struct recording *recording, struct iovec *in_iov, int iovcnt,
 		unsigned int str_len, const char *label_fmt, va_list ap)
 {
-	int fd = open_proc_meta_file(recording);
+	int fd = recording->u.proc.meta_fd;
+	if (fd == -1)
+		fd = open_proc_meta_file(recording);
 	if (fd == -1)
 		return -1;
 
@@ -677,10 +922,22 @@ static int vappend_meta_chunk_iov(struct recording *recording, struct iovec *in_
 	iov[iovcnt + 2].iov_base = "\n\n";
 	iov[iovcnt + 2].iov_len = 2;
 
-	if (writev(fd, iov, iovcnt + 3) != (str_len + lablen + inflen + 2))
+	unsigned int total = str_len + lablen + inflen + 2;
+	if (writev(fd, iov, iovcnt + 3) != total)
 		ilog(LOG_WARN, "writev return value incorrect");
 
+	// with O_APPEND we're at the end of our chunk now
+	off_t end = lseek(fd, 0, SEEK_CUR);
+	if (end >= total && !metachunk_send(recording, label, lablen, in_iov, iovcnt, str_len,
+				end - total, end))
+	{
+		// keep it open. closing it would make the recording daemon read the file again
+		recording->u.proc.meta_fd = fd;
+		return 0;
+	}
+
 	close(fd); // this triggers the inotify
+	recording->u.proc.meta_fd = -1;
 
 	return 0;
 }
@@ -704,6 +961,7 @@ static void proc_init(struct call *call) {
 	struct recording *recording = call->recording;
 
 	recording->u.proc.call_idx = UNINIT_IDX;
+	recording->u.proc.meta_fd = -1;
 	if (!kernel.is_open) {
 		ilog(LOG_WARN, "Call recording through /proc interface requested, but kernel table not open");
 		return;
@@ -743,6 +1001,10 @@ static void sdp_after_proc(struct recording *recording, GString *str, struct cal
 
 static void finish_proc(struct call *call) {
 	struct recording *recording = call->recording;
+	if (recording->u.proc.meta_fd != -1) {
+		close(recording->u.proc.meta_fd);
+		recording->u.proc.meta_fd = -1;
+	}
 	if (!kernel.is_open)
 		return;
 	if (recording->u.proc.call_idx != UNINIT_IDX) {
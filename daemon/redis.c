@@ -32,10 +32,13 @@
 #include "ssrc.h"
 #include "main.h"
 #include "codec.h"
+#include "probes.h"
 
 struct redis		*rtpe_redis;
 struct redis		*rtpe_redis_write;
 struct redis		*rtpe_redis_notify;
+struct redis_shard	*rtpe_redis_shards;
+unsigned int		rtpe_redis_num_shards;
 
 
 INLINE redisReply *redis_expect(int type, redisReply *r) {
@@ -77,6 +80,9 @@ static int redisCommandNR(redisContext *r, const char *fmt, ...)
 
 static int redis_check_conn(struct redis *r);
 static void json_restore_call(struct redis *r, const str *id, int foreign);
+static int json_restore_call_reader(const str *callid, JsonReader *root_reader, const char *err,
+		int foreign, int keep_existing, int handover);
+static JsonReader *redis_decode_call(redisReply *rr, const char **err);
 static int redis_connect(struct redis *r, int wait);
 
 static void redis_pipe(struct redis *r, const char *fmt, ...) {
@@ -91,6 +97,14 @@ static void redis_pipe(struct redis *r, const char *fmt, ...) {
 	va_end(ap);
 	r->pipeline++;
 }
+static void redis_pipe_argv(struct redis *r, int argc, const char **argv, const size_t *argvlen) {
+	if (!r->ctx) {
+		ilog(LOG_ERROR, "Unable to pipe redis command. No redis context");
+		return;
+	}
+	redisAppendCommandArgv(r->ctx, argc, argv, argvlen);
+	r->pipeline++;
+}
 static redisReply *redis_get(struct redis *r, int type, const char *fmt, ...) {
 	va_list ap;
 	redisReply *ret;
@@ -170,6 +184,36 @@ static void redis_consume(struct redis *r) {
 	}
 }
 
+/* called with r->lock held. like redis_consume() but returns -1 if any of the replies,
+ * including the ones inside a transaction, was an error */
+static int redis_consume_check(struct redis *r) {
+	redisReply *rp;
+	int ret = 0;
+
+	if (!r->ctx) {
+		ilog(LOG_ERROR, "Unable to consume pipelined replies. No redis context");
+		r->pipeline = 0;
+		return -1;
+	}
+	while (r->pipeline) {
+		if (redisGetReply(r->ctx, (void **) &rp) == REDIS_OK) {
+			if (rp->type == REDIS_REPLY_ERROR)
+				ret = -1;
+			else if (rp->type == REDIS_REPLY_ARRAY) {
+				for (size_t i = 0; i < rp->elements; i++) {
+					if (rp->element[i]->type == REDIS_REPLY_ERROR)
+						ret = -1;
+				}
+			}
+			freeReplyObject(rp);
+		}
+		else
+			ret = -1;
+		r->pipeline--;
+	}
+	return ret;
+}
+
 int redis_set_timeout(struct redis* r, int timeout) {
 	struct timeval tv_cmd;
 
@@ -179,6 +223,10 @@ int redis_set_timeout(struct redis* r, int timeout) {
 	tv_cmd.tv_usec = (int) (timeout % 1000) * 1000;
 	if (redisSetTimeout(r->ctx, tv_cmd))
 		return -1;
+	for (unsigned int i = 0; i < r->pool_len; i++) {
+		if (r->pool[i]->ctx && redisSetTimeout(r->pool[i]->ctx, tv_cmd))
+			return -1;
+	}
 	ilog(LOG_INFO, "Setting timeout for Redis commands to %d milliseconds",timeout);
 	return 0;
 }
@@ -190,6 +238,8 @@ int redis_reconnect(struct redis* r) {
 	if (rval)
 		r->state = REDIS_STATE_DISCONNECTED;
 	mutex_unlock(&r->lock);
+	for (unsigned int i = 0; !rval && i < r->pool_len; i++)
+		rval = redis_reconnect(r->pool[i]);
 	return rval;
 }
 
@@ -212,6 +262,7 @@ static int redis_connect(struct redis *r, int wait) {
 	tv.tv_sec = (int) connect_timeout / 1000;
 	tv.tv_usec = (int) (connect_timeout % 1000) * 1000;
 	r->ctx = redisConnectWithTimeout(r->host, r->endpoint.port, tv);
+	r->gen++;
 
 	if (!r->ctx)
 		goto err;
@@ -298,19 +349,262 @@ err:
 }
 
 
+// returns true if the notification concerns one of our own calls and must be ignored.
+// an existing foreign call is destroyed, to be replaced by the restored one
+static int redis_notify_own_call(const str *callid) {
+	struct call *c = call_get(callid);
+	if (!c)
+		return 0;
+	call_unlock_w(c);
+	int own = !IS_FOREIGN_CALL(c);
+	if (own)
+		rlog(LOG_WARN, "Redis-Notifier: Ignoring SET received for OWN call: " STR_FORMAT "\n",
+				STR_FMT(callid));
+	else
+		call_destroy(c);
+	obj_put(c);
+	log_info_clear();
+	return own;
+}
+
+static void redis_notify_del(const str *callid) {
+	struct call *c = call_get(callid);
+	if (!c) {
+		rlog(LOG_NOTICE, "Redis-Notifier: DEL did not find call with callid: " STR_FORMAT "\n",
+				STR_FMT(callid));
+		return;
+	}
+	call_unlock_w(c);
+	if (!IS_FOREIGN_CALL(c))
+		rlog(LOG_WARN, "Redis-Notifier: Ignoring DEL received for an OWN call: " STR_FORMAT "\n",
+				STR_FMT(callid));
+	else
+		call_destroy(c);
+	obj_put(c);
+	log_info_clear();
+}
+
+
+/* With --redis-notify-threads, keyspace events are handed from the libevent thread to a
+ * pool of workers, each with its own connections. Events are sharded by call ID, so the
+ * ones for a call are handled in order, and at most one job per key is queued: a newer
+ * event replaces the pending one, as restoring or deleting is always done according to
+ * the latest event. Workers fetch the calls of consecutive SET jobs with pipelined GETs. */
+
+#define REDIS_NOTIFY_BATCH 64
+
+struct redis_notify_job {
+	char *key; // pending table key: source, db and call ID
+	struct redis *src; // subscribing context the event came from
+	int db;
+	str callid; // points into key
+	int del;
+};
+
+struct redis_notify_worker {
+	mutex_t lock;
+	cond_t cond;
+	GQueue jobs;
+	GHashTable *pending; // key -> struct redis_notify_job
+	GHashTable *conns; // struct redis *src -> own struct redis, only used by the worker
+};
+
+static struct redis_notify_worker *redis_notify_workers;
+static unsigned int redis_notify_num_workers;
+
+static void redis_notify_job_free(struct redis_notify_job *job) {
+	g_free(job->key);
+	g_slice_free1(sizeof(*job), job);
+}
+
+// called from the libevent thread
+static void redis_notify_dispatch(struct redis *src, int db, const str *callid, int del) {
+	struct redis_notify_worker *w =
+		&redis_notify_workers[str_hash(callid) % redis_notify_num_workers];
+	char *key = g_strdup_printf("%p/%i/" STR_FORMAT, src, db, STR_FMT(callid));
+
+	mutex_lock(&w->lock);
+	struct redis_notify_job *job = g_hash_table_lookup(w->pending, key);
+	if (job) {
+		job->del = del;
+		g_free(key);
+		mutex_unlock(&w->lock);
+		return;
+	}
+	job = g_slice_alloc0(sizeof(*job));
+	job->key = key;
+	job->src = src;
+	job->db = db;
+	str_init_len(&job->callid, key + strlen(key) - callid->len, callid->len);
+	job->del = del;
+	g_hash_table_insert(w->pending, job->key, job);
+	g_queue_push_tail(&w->jobs, job);
+	cond_signal(&w->cond);
+	mutex_unlock(&w->lock);
+}
+
+static struct redis *redis_notify_conn(struct redis_notify_worker *w, struct redis *src) {
+	struct redis *r = g_hash_table_lookup(w->conns, src);
+	if (r)
+		return r;
+	r = redis_new(&src->endpoint, src->db, src->auth, src->role, 1);
+	g_hash_table_insert(w->conns, src, r);
+	return r;
+}
+
+// restores the calls of `n` SET jobs with the same source and db
+static void redis_notify_fetch(struct redis_notify_worker *w, struct redis_notify_job **jobs,
+		unsigned int n)
+{
+	struct redis *r = redis_notify_conn(w, jobs[0]->src);
+	redisReply *replies[REDIS_NOTIFY_BATCH] = { NULL, };
+	unsigned int i;
+
+	mutex_lock(&r->lock);
+
+	// as with inline handling, the events are lost if the database is unavailable
+	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
+		mutex_unlock(&r->lock);
+		return;
+	}
+	if (redisCommandNR(r->ctx, "SELECT %i", jobs[0]->db)) {
+		if (r->ctx && r->ctx->err)
+			rlog(LOG_ERROR, "Redis error: %s", r->ctx->errstr);
+		redisFree(r->ctx);
+		r->ctx = NULL;
+		mutex_unlock(&r->lock);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+		redis_pipe(r, "GET " PB, STR(&jobs[i]->callid));
+	for (i = 0; i < n && r->pipeline; i++) {
+		if (!r->ctx || redisGetReply(r->ctx, (void **) &replies[i]) != REDIS_OK)
+			replies[i] = NULL;
+		r->pipeline--;
+	}
+	r->pipeline = 0;
+
+	// wrong type: delta format
+	for (i = 0; i < n; i++) {
+		if (!replies[i] || replies[i]->type != REDIS_REPLY_ERROR)
+			continue;
+		freeReplyObject(replies[i]);
+		replies[i] = redis_get(r, REDIS_REPLY_ARRAY, "HGETALL " PB, STR(&jobs[i]->callid));
+	}
+
+	mutex_unlock(&r->lock);
+
+	for (i = 0; i < n; i++) {
+		const char *err;
+		JsonReader *reader = redis_decode_call(replies[i], &err);
+		if (replies[i])
+			freeReplyObject(replies[i]);
+		if (redis_notify_own_call(&jobs[i]->callid)) {
+			if (reader)
+				g_object_unref(reader);
+			continue;
+		}
+		PROBE(redis_start, "restore", jobs[i]->callid.s, jobs[i]->callid.len);
+		json_restore_call_reader(&jobs[i]->callid, reader, err, 1, 0, 0);
+		PROBE(redis_done, "restore", jobs[i]->callid.s, jobs[i]->callid.len);
+	}
+}
+
+static void redis_notify_run(struct redis_notify_worker *w, struct redis_notify_job **jobs,
+		unsigned int n)
+{
+	unsigned int i = 0, j;
+
+	while (i < n) {
+		if (jobs[i]->del) {
+			redis_notify_del(&jobs[i]->callid);
+			i++;
+			continue;
+		}
+		for (j = i + 1; j < n; j++) {
+			if (jobs[j]->del || jobs[j]->src != jobs[i]->src || jobs[j]->db != jobs[i]->db)
+				break;
+		}
+		redis_notify_fetch(w, jobs + i, j - i);
+		i = j;
+	}
+}
+
+void redis_notify_workers_init(void) {
+	redis_notify_num_workers = rtpe_config.redis_notify_threads;
+	redis_notify_workers = g_new0(struct redis_notify_worker, redis_notify_num_workers);
+	for (unsigned int i = 0; i < redis_notify_num_workers; i++) {
+		struct redis_notify_worker *w = &redis_notify_workers[i];
+		mutex_init(&w->lock);
+		cond_init(&w->cond);
+		g_queue_init(&w->jobs);
+		w->pending = g_hash_table_new(g_str_hash, g_str_equal);
+		w->conns = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+				(GDestroyNotify) redis_close);
+	}
+}
+
+void redis_notify_workers_free(void) {
+	for (unsigned int i = 0; i < redis_notify_num_workers; i++) {
+		struct redis_notify_worker *w = &redis_notify_workers[i];
+		g_queue_clear_full(&w->jobs, (GDestroyNotify) redis_notify_job_free);
+		g_hash_table_destroy(w->pending);
+		g_hash_table_destroy(w->conns);
+		mutex_destroy(&w->lock);
+	}
+	g_free(redis_notify_workers);
+	redis_notify_workers = NULL;
+	redis_notify_num_workers = 0;
+}
+
+void redis_notify_worker_loop(void *d) {
+	struct redis_notify_worker *w = &redis_notify_workers[GPOINTER_TO_UINT(d)];
+	struct redis_notify_job *jobs[REDIS_NOTIFY_BATCH];
+	unsigned int n;
+
+	mutex_lock(&w->lock);
+
+	while (!rtpe_shutdown) {
+		gettimeofday(&rtpe_now, NULL);
+
+		for (n = 0; n < REDIS_NOTIFY_BATCH; n++) {
+			jobs[n] = g_queue_pop_head(&w->jobs);
+			if (!jobs[n])
+				break;
+			g_hash_table_remove(w->pending, jobs[n]->key);
+		}
+		if (!n) {
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&w->cond, &w->lock, &tv);
+			continue;
+		}
+		mutex_unlock(&w->lock);
+
+		redis_notify_run(w, jobs, n);
+		for (unsigned int i = 0; i < n; i++)
+			redis_notify_job_free(jobs[i]);
+
+		mutex_lock(&w->lock);
+	}
+
+	mutex_unlock(&w->lock);
+}
+
+
 void on_redis_notification(redisAsyncContext *actx, void *reply, void *privdata) {
 	struct redis *r = 0;
-	struct call *c = NULL;
 	str callid;
 	str keyspace_id;
 
-	if (!rtpe_redis_notify) {
+	// the subscribing context, one per shard
+	r = privdata ? : rtpe_redis_notify;
+	if (!r) {
 		rlog(LOG_ERROR, "A redis notification has been received but no redis_notify database found");
 		return;
 	}
 
-	r = rtpe_redis_notify;
-
 	mutex_lock(&r->lock);
 
 	redisReply *rr = (redisReply*)reply;
@@ -344,6 +638,17 @@ void on_redis_notification(redisAsyncContext *actx, void *reply, void *privdata)
 	// now at <key>
 	callid = keyspace_id;
 
+	// delta format updates show up as "hset"
+	int set = strncmp(rr->element[3]->str,"set",3)==0 || strcmp(rr->element[3]->str,"hset")==0;
+	int del = strncmp(rr->element[3]->str,"del",3)==0;
+	if (!set && !del)
+		goto err;
+
+	if (redis_notify_num_workers) {
+		redis_notify_dispatch(r, r->db, &callid, del);
+		goto err;
+	}
+
 	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED)
 		goto err;
 
@@ -356,41 +661,14 @@ void on_redis_notification(redisAsyncContext *actx, void *reply, void *privdata)
 		goto err;
 	}
 
-	if (strncmp(rr->element[3]->str,"set",3)==0) {
-		c = call_get(&callid);
-		if (c) {
-			rwlock_unlock_w(&c->master_lock);
-			if (IS_FOREIGN_CALL(c))
-				call_destroy(c);
-			else {
-				rlog(LOG_WARN, "Redis-Notifier: Ignoring SET received for OWN call: %s\n", rr->element[2]->str);
-				goto err;
-			}
-		}
-		json_restore_call(r, &callid, 1);
-	}
-
-	if (strncmp(rr->element[3]->str,"del",3)==0) {
-		c = call_get(&callid);
-		if (!c) {
-			rlog(LOG_NOTICE, "Redis-Notifier: DEL did not find call with callid: %s\n", rr->element[2]->str);
-			goto err;
-		}
-		rwlock_unlock_w(&c->master_lock);
-		if (!IS_FOREIGN_CALL(c)) {
-			rlog(LOG_WARN, "Redis-Notifier: Ignoring DEL received for an OWN call: %s\n", rr->element[2]->str);
-			goto err;
-		}
-		call_destroy(c);
+	if (set) {
+		if (!redis_notify_own_call(&callid))
+			json_restore_call(r, &callid, 1);
 	}
+	else
+		redis_notify_del(&callid);
 
 err:
-	if (c) {
-		// because of call_get(..)
-		obj_put(c);
-		log_info_clear();
-	}
-
 	mutex_unlock(&r->lock);
 }
 
@@ -543,19 +821,19 @@ int redis_notify_subscribe_action(struct redis *r, enum subscribe_action action,
 
 	switch (action) {
 	case SUBSCRIBE_KEYSPACE:
-		if (redisAsyncCommand(r->async_ctx, on_redis_notification, NULL, "psubscribe __keyspace@%i__:*", keyspace) != REDIS_OK) {
+		if (redisAsyncCommand(r->async_ctx, on_redis_notification, r, "psubscribe __keyspace@%i__:*", keyspace) != REDIS_OK) {
 			rlog(LOG_ERROR, "Fail redisAsyncCommand on JSON SUBSCRIBE_KEYSPACE");
 			return -1;
 		}
 		break;
 	case UNSUBSCRIBE_KEYSPACE:
-		if (redisAsyncCommand(r->async_ctx, on_redis_notification, NULL, "punsubscribe __keyspace@%i__:*", keyspace) != REDIS_OK) {
+		if (redisAsyncCommand(r->async_ctx, on_redis_notification, r, "punsubscribe __keyspace@%i__:*", keyspace) != REDIS_OK) {
 			rlog(LOG_ERROR, "Fail redisAsyncCommand on JSON UNSUBSCRIBE_KEYSPACE");
 			return -1;
 		}
 		break;
 	case UNSUBSCRIBE_ALL:
-		if (redisAsyncCommand(r->async_ctx, on_redis_notification, NULL, "punsubscribe") != REDIS_OK) {
+		if (redisAsyncCommand(r->async_ctx, on_redis_notification, r, "punsubscribe") != REDIS_OK) {
 			rlog(LOG_ERROR, "Fail redisAsyncCommand on JSON UNSUBSCRIBE_ALL");
 			return -1;
 		}
@@ -677,7 +955,7 @@ static int redis_notify(struct redis *r) {
 	}
 
 	if (r->auth) {
-		if (redisAsyncCommand(r->async_ctx, on_redis_notification, NULL, "AUTH %s", r->auth) != REDIS_OK) {
+		if (redisAsyncCommand(r->async_ctx, on_redis_notification, r, "AUTH %s", r->auth) != REDIS_OK) {
 			rlog(LOG_ERROR, "Fail redisAsyncCommand on AUTH");
 			return -1;
 		}
@@ -735,7 +1013,7 @@ void redis_notify_loop(void *d) {
 	time_t next_run = rtpe_now.tv_sec;
 	struct redis *r;
 
-	r = rtpe_redis_notify;
+	r = d ? : rtpe_redis_notify;
 	if (!r) {
 		rlog(LOG_ERROR, "Don't use Redis notifications. See --redis-notifications parameter.");
 		return ;
@@ -764,7 +1042,7 @@ void redis_notify_loop(void *d) {
 
 	// loop redis_notify => in case of lost connection
 	while (!rtpe_shutdown) {
-		gettimeofday(&rtpe_now, NULL);
+		rtpe_now_coarse();
 		if (rtpe_now.tv_sec < next_run) {
 			usleep(100000);
 			continue;
@@ -833,6 +1111,9 @@ err:
 void redis_close(struct redis *r) {
 	if (!r)
 		return;
+	for (unsigned int i = 0; i < r->pool_len; i++)
+		redis_close(r->pool[i]);
+	g_free(r->pool);
 	if (r->ctx)
 		redisFree(r->ctx);
 	r->ctx = NULL;
@@ -840,6 +1121,107 @@ void redis_close(struct redis *r) {
 	g_slice_free1(sizeof(*r), r);
 }
 
+void redis_shards_init(void) {
+	unsigned int i = 0;
+
+	rtpe_redis_num_shards = rtpe_config.redis_shards.length;
+	rtpe_redis_shards = g_new0(struct redis_shard, rtpe_redis_num_shards);
+
+	for (GList *l = rtpe_config.redis_shards.head; l; l = l->next, i++) {
+		struct redis_shard_config *sc = l->data;
+		struct redis_shard *sh = &rtpe_redis_shards[i];
+
+		sh->write = redis_new(&sc->ep, sc->db, sc->auth, ANY_REDIS_ROLE, rtpe_config.no_redis_required);
+		if (!sh->write)
+			die("Cannot start up without running Redis %s shard database! "
+					"See also NO_REDIS_REQUIRED parameter.",
+				endpoint_print_buf(&sc->ep));
+
+		if (!rtpe_config.redis_subscribed_keyspaces.length)
+			continue;
+		sh->notify = redis_new(&sc->ep, sc->db, sc->auth, ANY_REDIS_ROLE, rtpe_config.no_redis_required);
+		if (!sh->notify)
+			die("Cannot start up without running notification Redis %s shard database! "
+					"See also NO_REDIS_REQUIRED parameter.",
+				endpoint_print_buf(&sc->ep));
+	}
+}
+
+void redis_shards_free(void) {
+	for (unsigned int i = 0; i < rtpe_redis_num_shards; i++) {
+		redis_close(rtpe_redis_shards[i].write);
+		redis_close(rtpe_redis_shards[i].notify);
+	}
+	g_free(rtpe_redis_shards);
+	rtpe_redis_shards = NULL;
+	rtpe_redis_num_shards = 0;
+}
+
+// jump consistent hash: growing the number of buckets only moves keys into the new ones
+static unsigned int redis_jump_hash(uint64_t key, unsigned int buckets) {
+	int64_t b = -1, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+	}
+	return b;
+}
+
+/* maps writes to the main write database onto the shard responsible for the call ID. the
+ * main write database itself is the first shard */
+static uint64_t redis_callid_hash(const str *callid) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int i = 0; i < callid->len; i++) {
+		h ^= (unsigned char) callid->s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* maps writes to the main write database onto the shard responsible for the call ID. the
+ * main write database itself is the first shard */
+struct redis *redis_shard_for(const str *callid, struct redis *r) {
+	if (!rtpe_redis_num_shards || r != rtpe_redis_write)
+		return r;
+
+	unsigned int idx = redis_jump_hash(redis_callid_hash(callid), rtpe_redis_num_shards + 1);
+	return idx ? rtpe_redis_shards[idx - 1].write : r;
+}
+
+// opens the additional connections to a write database
+void redis_write_pool_init(struct redis *r) {
+	if (!r || rtpe_config.redis_write_connections <= 1)
+		return;
+	r->pool_len = rtpe_config.redis_write_connections - 1;
+	r->pool = g_new0(struct redis *, r->pool_len);
+	for (unsigned int i = 0; i < r->pool_len; i++)
+		r->pool[i] = redis_new(&r->endpoint, r->db, r->auth, r->role, 1);
+}
+
+/* picks the connection of a write database (as returned by redis_shard_for()) to use for a
+ * call. it's always the same one for a call, which keeps its writes in order, while writes
+ * of different calls don't wait for each other. the upper half of the hash is used as the
+ * lower one already selected the shard */
+struct redis *redis_pool_conn(const str *callid, struct redis *r) {
+	if (!r || !r->pool_len)
+		return r;
+
+	unsigned int idx = (redis_callid_hash(callid) >> 32) % (r->pool_len + 1);
+	return idx ? r->pool[idx - 1] : r;
+}
+
+void redis_notify_subscribe_all(enum subscribe_action action, int keyspace) {
+	if (rtpe_redis_notify)
+		redis_notify_subscribe_action(rtpe_redis_notify, action, keyspace);
+	for (unsigned int i = 0; i < rtpe_redis_num_shards; i++) {
+		if (rtpe_redis_shards[i].notify)
+			redis_notify_subscribe_action(rtpe_redis_shards[i].notify, action, keyspace);
+	}
+}
+
 static void redis_count_err_and_disable(struct redis *r)
 {
 	int allowed_errors;
@@ -1322,7 +1704,7 @@ static int redis_sfds(struct call *c, struct redis_list *sfds) {
 			goto err;
 
 		err = "failed to open ports";
-		if (__get_consecutive_ports(&q, 1, port, loc->spec, &c->callid))
+		if (__get_consecutive_ports(&q, 1, port, loc->spec, &c->callid, 0))
 			goto err;
 		err = "no port returned";
 		sock = g_queue_pop_head(&q);
@@ -1343,7 +1725,7 @@ err:
 	return -1;
 }
 
-static int redis_streams(struct call *c, struct redis_list *streams) {
+static int redis_streams(struct call *c, struct redis_list *streams, int handover) {
 	unsigned int i;
 	struct redis_hash *rh;
 	struct packet_stream *ps;
@@ -1371,7 +1753,9 @@ static int redis_streams(struct call *c, struct redis_list *streams) {
 
 		streams->ptrs[i] = ps;
 
-		PS_CLEAR(ps, KERNELIZED);
+		// targets of a handed over kernel table are still in place
+		if (!handover)
+			PS_CLEAR(ps, KERNELIZED);
 	}
 	return 0;
 }
@@ -1503,7 +1887,7 @@ static int redis_maps(struct call *c, struct redis_list *maps) {
 		rh = &maps->rh[i];
 
 		/* from call.c:__get_endpoint_map() */
-		em = uid_slice_alloc0(em, &c->endpoint_maps);
+		em = call_uid_alloc0(c, em, &c->endpoint_maps);
 		g_queue_init(&em->intf_sfds);
 
 		em->wildcard = redis_hash_get_bool_flag(rh, "wildcard");
@@ -1562,7 +1946,7 @@ static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_
 			other_ml = l->data;
 			if (!other_ml)
 			    return -1;
-			g_hash_table_insert(ml->other_tags, &other_ml->tag, other_ml);
+			str_map_insert(&ml->other_tags, &other_ml->tag, other_ml);
 		}
 		g_queue_clear(&q);
 
@@ -1572,7 +1956,7 @@ static int json_link_tags(struct call *c, struct redis_list *tags, struct redis_
 			other_ml = l->data;
 			if (!other_ml)
 			    return -1;
-			g_hash_table_insert(ml->branches, &other_ml->viabranch, other_ml);
+			str_map_insert(&ml->branches, &other_ml->viabranch, other_ml);
 		}
 		g_queue_clear(&q);
 
@@ -1602,7 +1986,7 @@ static int json_link_streams(struct call *c, struct redis_list *streams,
 			return -1;
 
 		if (ps->media)
-			__rtp_stats_update(ps->rtp_stats, ps->media->codecs_recv);
+			__rtp_stats_update(ps, ps->media->codecs_recv);
 
 		__init_stream(ps);
 	}
@@ -1628,7 +2012,7 @@ static int json_link_medias(struct call *c, struct redis_list *medias,
 			return -1;
 
 		if (med->media_id.s)
-			g_hash_table_insert(med->monologue->media_ids, &med->media_id, med);
+			str_map_insert(&med->monologue->media_ids, &med->media_id, med);
 
 		// find the pair media
 		struct call_monologue *ml = med->monologue;
@@ -1713,29 +2097,379 @@ static int json_build_ssrc(struct call *c, JsonReader *root_reader) {
 	return 0;
 }
 
-static void json_restore_call(struct redis *r, const str *callid, int foreign) {
-	redisReply* rr_jsonStr;
+/*
+ * Calls are encoded through a small emitter interface, which either feeds a JsonBuilder
+ * (JSON format) or produces a compact binary token stream (binary and delta formats).
+ *
+ * Binary layout: REDIS_BIN_MAGIC, followed by the tokens of the root object. Each token is a
+ * tag byte, optionally followed by a varint length and that many bytes of payload. Member
+ * names are sent once per top-level key and referenced by index afterwards. Each top-level
+ * key ("json", "sfd-3", ...) is self-contained, so its value can be stored as a field of
+ * its own in the delta format.
+ */
+#define REDIS_BIN_MAGIC "\xffRB1"
+#define REDIS_BIN_MAGIC_LEN 4
+
+enum redis_bin_tag {
+	RB_OBJECT = '{',
+	RB_OBJECT_END = '}',
+	RB_ARRAY = '[',
+	RB_ARRAY_END = ']',
+	RB_STRING = 's', // len + bytes
+	RB_KEY = 'k', // len + bytes, top-level member name
+	RB_NAME = 'n', // len + bytes, new member name
+	RB_NAME_REF = 'r', // index of a previous RB_NAME
+};
+
+struct redis_field {
+	gsize name, name_len; // offsets into redis_enc.buf
+	gsize val, val_len;
+};
+
+struct redis_enc {
+	JsonBuilder *builder; // JSON format, NULL otherwise
+	GString *buf;
+	GHashTable *names; // member name -> index, reset for each top-level key
+	GArray *fields; // struct redis_field
+	unsigned int depth;
+};
+
+static void redis_enc_init_bin(struct redis_enc *e) {
+	ZERO(*e);
+	e->buf = g_string_sized_new(4096);
+	g_string_append_len(e->buf, REDIS_BIN_MAGIC, REDIS_BIN_MAGIC_LEN);
+	e->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	e->fields = g_array_new(FALSE, FALSE, sizeof(struct redis_field));
+}
+static void redis_enc_free_bin(struct redis_enc *e) {
+	g_string_free(e->buf, TRUE);
+	g_hash_table_destroy(e->names);
+	g_array_free(e->fields, TRUE);
+}
+
+static void rb_put_varint(GString *b, uint64_t v) {
+	while (v >= 0x80) {
+		g_string_append_c(b, (v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	g_string_append_c(b, v);
+}
+static void rb_put_bytes(GString *b, char tag, const char *s, size_t len) {
+	g_string_append_c(b, tag);
+	rb_put_varint(b, len);
+	g_string_append_len(b, s, len);
+}
+static int rb_get_varint(const char **p, const char *end, uint64_t *out) {
+	uint64_t v = 0;
+	for (unsigned int shift = 0; *p < end && shift < 64; shift += 7) {
+		unsigned char c = *(*p)++;
+		v |= (uint64_t) (c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*out = v;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// completes a top-level field once its value has been written out
+static void redis_enc_value_done(struct redis_enc *e) {
+	if (e->depth != 1 || !e->fields->len)
+		return;
+	struct redis_field *f = &g_array_index(e->fields, struct redis_field, e->fields->len - 1);
+	f->val_len = e->buf->len - f->val;
+}
+
+static void redis_enc_member(struct redis_enc *e, const char *name) {
+	if (e->builder) {
+		json_builder_set_member_name(e->builder, name);
+		return;
+	}
+	size_t len = strlen(name);
+	if (e->depth == 1) {
+		g_hash_table_remove_all(e->names);
+		g_string_append_c(e->buf, RB_KEY);
+		rb_put_varint(e->buf, len);
+		struct redis_field f = { .name = e->buf->len, .name_len = len };
+		g_string_append_len(e->buf, name, len);
+		f.val = e->buf->len;
+		g_array_append_val(e->fields, f);
+		return;
+	}
+	gpointer idx;
+	if (g_hash_table_lookup_extended(e->names, name, NULL, &idx)) {
+		g_string_append_c(e->buf, RB_NAME_REF);
+		rb_put_varint(e->buf, GPOINTER_TO_UINT(idx));
+		return;
+	}
+	g_hash_table_insert(e->names, g_strdup(name), GUINT_TO_POINTER(g_hash_table_size(e->names)));
+	rb_put_bytes(e->buf, RB_NAME, name, len);
+}
+static void redis_enc_string(struct redis_enc *e, const char *s, int len) {
+	if (e->builder) {
+		json_builder_add_string_value_uri_enc(e->builder, s, len);
+		return;
+	}
+	rb_put_bytes(e->buf, RB_STRING, s, len);
+	redis_enc_value_done(e);
+}
+static void redis_enc_begin_object(struct redis_enc *e) {
+	if (e->builder)
+		json_builder_begin_object(e->builder);
+	else
+		g_string_append_c(e->buf, RB_OBJECT);
+	e->depth++;
+}
+static void redis_enc_end_object(struct redis_enc *e) {
+	if (e->builder)
+		json_builder_end_object(e->builder);
+	else
+		g_string_append_c(e->buf, RB_OBJECT_END);
+	e->depth--;
+	if (!e->builder)
+		redis_enc_value_done(e);
+}
+static void redis_enc_begin_array(struct redis_enc *e) {
+	if (e->builder)
+		json_builder_begin_array(e->builder);
+	else
+		g_string_append_c(e->buf, RB_ARRAY);
+	e->depth++;
+}
+static void redis_enc_end_array(struct redis_enc *e) {
+	if (e->builder)
+		json_builder_end_array(e->builder);
+	else
+		g_string_append_c(e->buf, RB_ARRAY_END);
+	e->depth--;
+	if (!e->builder)
+		redis_enc_value_done(e);
+}
+
+// decodes a binary token stream into the builder as one complete value. member names
+// are strings in JSON form and get URI encoded accordingly
+static int redis_bin_replay(JsonBuilder *b, const char *s, size_t len) {
+	const char *p = s, *end = s + len;
+	GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+	unsigned int depth = 0;
+	int ret = -1;
+	uint64_t n;
+	char *name, tag;
+
+	while (p < end) {
+		tag = *p++;
+		switch (tag) {
+			case RB_OBJECT:
+				json_builder_begin_object(b);
+				depth++;
+				break;
+			case RB_ARRAY:
+				json_builder_begin_array(b);
+				depth++;
+				break;
+			case RB_OBJECT_END:
+				if (!depth)
+					goto out;
+				json_builder_end_object(b);
+				depth--;
+				break;
+			case RB_ARRAY_END:
+				if (!depth)
+					goto out;
+				json_builder_end_array(b);
+				depth--;
+				break;
+			case RB_STRING:
+				if (rb_get_varint(&p, end, &n) || n > end - p)
+					goto out;
+				json_builder_add_string_value_uri_enc(b, p, n);
+				p += n;
+				break;
+			case RB_KEY:
+				g_ptr_array_set_size(names, 0);
+				// fall through
+			case RB_NAME:
+				if (rb_get_varint(&p, end, &n) || n > end - p)
+					goto out;
+				name = g_strndup(p, n);
+				json_builder_set_member_name(b, name);
+				if (tag == RB_NAME)
+					g_ptr_array_add(names, name);
+				else
+					g_free(name);
+				p += n;
+				break;
+			case RB_NAME_REF:
+				if (rb_get_varint(&p, end, &n) || n >= names->len)
+					goto out;
+				json_builder_set_member_name(b, g_ptr_array_index(names, n));
+				break;
+			default:
+				goto out;
+		}
+	}
+	if (!depth)
+		ret = 0;
+out:
+	g_ptr_array_free(names, TRUE);
+	return ret;
+}
+
+static JsonNode *redis_bin_decode(const char *s, size_t len) {
+	JsonBuilder *b = json_builder_new();
+	JsonNode *ret = NULL;
+
+	if (!redis_bin_replay(b, s, len))
+		ret = json_builder_get_root(b);
+
+	g_object_unref(b);
+	return ret;
+}
+
+// encodes a generic tree of objects, arrays and strings, for the unit tests. scalars other
+// than strings are not produced by the call encoder and come out as empty strings
+static void redis_enc_node(struct redis_enc *e, JsonNode *node) {
+	GList *l, *list;
+	JsonObject *o;
+	const char *s;
+
+	switch (json_node_get_node_type(node)) {
+		case JSON_NODE_OBJECT:
+			redis_enc_begin_object(e);
+			o = json_node_get_object(node);
+			list = json_object_get_members(o);
+			for (l = list; l; l = l->next) {
+				redis_enc_member(e, l->data);
+				redis_enc_node(e, json_object_get_member(o, l->data));
+			}
+			g_list_free(list);
+			redis_enc_end_object(e);
+			break;
+		case JSON_NODE_ARRAY:
+			redis_enc_begin_array(e);
+			list = json_array_get_elements(json_node_get_array(node));
+			for (l = list; l; l = l->next)
+				redis_enc_node(e, l->data);
+			g_list_free(list);
+			redis_enc_end_array(e);
+			break;
+		default:
+			s = json_node_get_string(node) ? : "";
+			redis_enc_string(e, s, strlen(s));
+			break;
+	}
+}
+
+GString *redis_bin_encode_node(JsonNode *node) {
+	struct redis_enc enc;
+
+	redis_enc_init_bin(&enc);
+	redis_enc_node(&enc, node);
+
+	GString *ret = enc.buf;
+	enc.buf = g_string_new("");
+	redis_enc_free_bin(&enc);
+	return ret;
+}
+
+// the reverse of redis_bin_encode_node(), with strings URI encoded as in the JSON format.
+// NULL if the input is malformed
+JsonNode *redis_bin_decode_node(const char *s, size_t len) {
+	if (len < REDIS_BIN_MAGIC_LEN || memcmp(s, REDIS_BIN_MAGIC, REDIS_BIN_MAGIC_LEN))
+		return NULL;
+	return redis_bin_decode(s + REDIS_BIN_MAGIC_LEN, len - REDIS_BIN_MAGIC_LEN);
+}
+
+// assembles the fields of a delta format hash (HGETALL reply) into one object
+static JsonNode *redis_bin_decode_hash(redisReply *rr) {
+	JsonBuilder *b = json_builder_new();
+	JsonNode *ret = NULL;
+
+	json_builder_begin_object(b);
+	for (size_t i = 0; i + 1 < rr->elements; i += 2) {
+		redisReply *key = rr->element[i], *val = rr->element[i + 1];
+		if (key->type != REDIS_REPLY_STRING || val->type != REDIS_REPLY_STRING)
+			goto out;
+		char *name = g_strndup(key->str, key->len);
+		json_builder_set_member_name(b, name);
+		g_free(name);
+		if (redis_bin_replay(b, val->str, val->len))
+			goto out;
+	}
+	json_builder_end_object(b);
+
+	ret = json_builder_get_root(b);
+out:
+	g_object_unref(b);
+	return ret;
+}
+
+// decodes a GET or HGETALL reply, in any of the supported formats
+static JsonReader *redis_decode_call(redisReply *rr, const char **err) {
+	JsonNode *root = NULL;
+	JsonParser *parser = NULL;
+	JsonReader *ret = NULL;
+
+	*err = "could not retrieve call data from redis";
+	if (!rr)
+		return NULL;
+	if (rr->type == REDIS_REPLY_ARRAY) {
+		// delta format, stored as a hash
+		*err = "could not decode binary data";
+		root = redis_bin_decode_hash(rr);
+	}
+	else if (rr->type != REDIS_REPLY_STRING)
+		return NULL;
+	else if (rr->len >= REDIS_BIN_MAGIC_LEN && !memcmp(rr->str, REDIS_BIN_MAGIC, REDIS_BIN_MAGIC_LEN)) {
+		*err = "could not decode binary data";
+		root = redis_bin_decode(rr->str + REDIS_BIN_MAGIC_LEN, rr->len - REDIS_BIN_MAGIC_LEN);
+	}
+	else {
+		parser = json_parser_new();
+		*err = "could not parse JSON data";
+		if (!json_parser_load_from_data (parser, rr->str, -1, NULL))
+			goto out;
+	}
+
+	if (!root && !parser)
+		goto out;
+
+	// the reader holds a copy of the tree
+	ret = json_reader_new (root ? : json_parser_get_root (parser));
+	*err = "could not read JSON data";
+
+out:
+	if (root)
+		json_node_free (root);
+	if (parser)
+		g_object_unref (parser);
+	return ret;
+}
+
+static redisReply *redis_fetch_call(struct redis *r, const str *callid) {
+	redisReply *rr;
+
+	if (!r->ctx)
+		return NULL;
+	rr = redisCommand(r->ctx, "GET " PB, STR(callid));
+	if (!rr || rr->type != REDIS_REPLY_ERROR)
+		return rr;
+	// wrong type: delta format
+	freeReplyObject(rr);
+	return redis_get(r, REDIS_REPLY_ARRAY, "HGETALL " PB, STR(callid));
+}
+
+/* takes ownership of the reader. decoding errors are passed in as `err` with a NULL reader.
+ * with `keep_existing` set, a call that already exists is left alone instead of being replaced */
+static int json_restore_call_reader(const str *callid, JsonReader *root_reader, const char *err,
+		int foreign, int keep_existing, int handover)
+{
 	struct redis_hash call;
 	struct redis_list tags, sfds, streams, medias, maps;
 	struct call *c = NULL;
 	str s, id, meta;
-
-	const char *err = 0;
 	int i;
-	JsonReader *root_reader =0;
-	JsonParser *parser =0;
 
-	rr_jsonStr = redis_get(r, REDIS_REPLY_STRING, "GET " PB, STR(callid));
-	err = "could not retrieve JSON data from redis";
-	if (!rr_jsonStr)
-		goto err1;
-
-	parser = json_parser_new();
-	err = "could not parse JSON data";
-	if (!json_parser_load_from_data (parser, rr_jsonStr->str, -1, NULL))
-		goto err1;
-	root_reader = json_reader_new (json_parser_get_root (parser));
-	err = "could not read JSON data";
 	if (!root_reader)
 		goto err1;
 
@@ -1745,8 +2479,16 @@ static void json_restore_call(struct redis *r, const str *callid, int foreign) {
 		goto err1;
 
 	err = "call already exists";
-	if (c->last_signal)
+	if (c->last_signal) {
+		if (keep_existing) {
+			call_unlock_w(c);
+			obj_put(c);
+			g_object_unref (root_reader);
+			log_info_clear();
+			return 0;
+		}
 		goto err2;
+	}
 	err = "'call' data incomplete";
 
 	if (json_get_hash(&call, "json", -1, root_reader))
@@ -1796,7 +2538,7 @@ static void json_restore_call(struct redis *r, const str *callid, int foreign) {
 	if (redis_sfds(c, &sfds))
 		goto err8;
 	err = "failed to create streams";
-	if (redis_streams(c, &streams))
+	if (redis_streams(c, &streams, handover))
 		goto err8;
 	err = "failed to create tags";
 	if (redis_tags(c, &tags))
@@ -1833,6 +2575,17 @@ static void json_restore_call(struct redis *r, const str *callid, int foreign) {
 		recording_start(c, s.s, &meta);
 	}
 
+	// rather than waiting for the first packet of each stream, which would then all go
+	// through userspace at once. targets of a handed over kernel table are still in place
+	if (!foreign && !handover) {
+		unsigned int num = kernelize_call(c);
+		if (num) {
+			mutex_lock(&rtpe_redis_restore_stats.lock);
+			rtpe_redis_restore_stats.kernelized += num;
+			mutex_unlock(&rtpe_redis_restore_stats.lock);
+		}
+	}
+
 	err = NULL;
 
 err8:
@@ -1848,14 +2601,10 @@ err4:
 err3:
 	json_destroy_hash(&call);
 err2:
-	rwlock_unlock_w(&c->master_lock);
+	call_unlock_w(c);
 err1:
 	if (root_reader)
 		g_object_unref (root_reader);
-	if (parser)
-		g_object_unref (parser);
-	if (rr_jsonStr)
-		freeReplyObject(rr_jsonStr);	
 	log_info_clear();
 	if (err) {
 		rlog(LOG_WARNING, "Failed to restore call ID '" STR_FORMAT_M "' from Redis: %s",
@@ -1863,14 +2612,43 @@ err1:
 				err);
 		if (c) 
 			call_destroy(c);
-		else {
-			mutex_lock(&rtpe_redis_write->lock);
-			redisCommandNR(rtpe_redis_write->ctx, "DEL " PB, STR(callid));
-			mutex_unlock(&rtpe_redis_write->lock);
+		else if (rtpe_redis_write) {
+			struct redis *w = redis_pool_conn(callid, redis_shard_for(callid, rtpe_redis_write));
+			mutex_lock(&w->lock);
+			redisCommandNR(w->ctx, "DEL " PB, STR(callid));
+			mutex_unlock(&w->lock);
 		}
 	}
 	if (c)
 		obj_put(c);
+	return err ? -1 : 0;
+}
+
+static void json_restore_call(struct redis *r, const str *callid, int foreign) {
+	const char *err;
+	PROBE(redis_start, "restore", callid->s, callid->len);
+	redisReply *rr = redis_fetch_call(r, callid);
+	JsonReader *root_reader = redis_decode_call(rr, &err);
+	if (rr)
+		freeReplyObject(rr);
+	json_restore_call_reader(callid, root_reader, err, foreign, 0, 0);
+	PROBE(redis_done, "restore", callid->s, callid->len);
+}
+
+// restores a call from a redis_call_snapshot() received during a live handover
+int redis_restore_snapshot(const str *callid, const char *s, size_t len) {
+	JsonReader *root_reader = NULL;
+	const char *err = "could not decode binary data";
+
+	if (len >= REDIS_BIN_MAGIC_LEN && !memcmp(s, REDIS_BIN_MAGIC, REDIS_BIN_MAGIC_LEN)) {
+		JsonNode *root = redis_bin_decode(s + REDIS_BIN_MAGIC_LEN, len - REDIS_BIN_MAGIC_LEN);
+		if (root) {
+			root_reader = json_reader_new(root);
+			json_node_free(root);
+		}
+	}
+
+	return json_restore_call_reader(callid, root_reader, err, 0, 0, 1);
 }
 
 struct thread_ctx {
@@ -1878,11 +2656,25 @@ struct thread_ctx {
 	mutex_t r_m;
 };
 
+struct redis_restore_stats rtpe_redis_restore_stats = {
+	.lock = MUTEX_STATIC_INIT,
+};
+
+static void redis_restore_count(int ret) {
+	mutex_lock(&rtpe_redis_restore_stats.lock);
+	if (ret)
+		rtpe_redis_restore_stats.failed++;
+	else
+		rtpe_redis_restore_stats.restored++;
+	mutex_unlock(&rtpe_redis_restore_stats.lock);
+}
+
 static void restore_thread(void *call_p, void *ctx_p) {
 	struct thread_ctx *ctx = ctx_p;
 	redisReply *call = call_p;
 	struct redis *r;
 	str callid;
+	const char *err;
 	str_init_len(&callid, call->str, call->len);
 
 	rlog(LOG_DEBUG, "Processing call ID '%s%.*s%s' from Redis", FMT_M(REDIS_FMT(call)));
@@ -1891,26 +2683,223 @@ static void restore_thread(void *call_p, void *ctx_p) {
 	r = g_queue_pop_head(&ctx->r_q);
 	mutex_unlock(&ctx->r_m);
 
-	json_restore_call(r, &callid, 0);
+	redisReply *rr = redis_fetch_call(r, &callid);
+	JsonReader *root_reader = redis_decode_call(rr, &err);
+	if (rr)
+		freeReplyObject(rr);
+	redis_restore_count(json_restore_call_reader(&callid, root_reader, err, 0,
+				rtpe_config.redis_restore_background, 0));
 
 	mutex_lock(&ctx->r_m);
 	g_queue_push_tail(&ctx->r_q, r);
 	mutex_unlock(&ctx->r_m);
 }
 
+
+struct restore_entry {
+	str callid;
+	JsonReader *reader;
+	const char *err;
+	long long activity;
+};
+
+// latest "last_packet" of all streams of the call
+static long long redis_restore_activity(JsonReader *reader) {
+	long long num = 0, ret = 0;
+	const char *v;
+	char key[32];
+
+	// every read needs a matching end, even if it failed
+	if (json_reader_read_member(reader, "json")) {
+		if (json_reader_read_member(reader, "num_streams") && (v = json_reader_get_string_value(reader)))
+			num = strtoll(v, NULL, 10);
+		json_reader_end_member(reader);
+	}
+	json_reader_end_member(reader);
+
+	for (long long i = 0; i < num; i++) {
+		snprintf(key, sizeof(key), "stream-%lli", i);
+		if (json_reader_read_member(reader, key)) {
+			if (json_reader_read_member(reader, "last_packet")
+					&& (v = json_reader_get_string_value(reader)))
+				ret = MAX(ret, strtoll(v, NULL, 10));
+			json_reader_end_member(reader);
+		}
+		json_reader_end_member(reader);
+	}
+
+	return ret;
+}
+
+static int restore_entry_cmp(const void *A, const void *B) {
+	const struct restore_entry *a = A, *b = B;
+	if (a->activity > b->activity)
+		return -1;
+	if (a->activity < b->activity)
+		return 1;
+	return 0;
+}
+
+/* restores one batch of keys (a SCAN reply) using a single MGET, plus one pipelined HGETALL
+ * for each key that isn't a plain string. within the batch, calls with the most recent media
+ * activity are restored first */
+static void restore_batch_thread(void *scan_p, void *ctx_p) {
+	struct thread_ctx *ctx = ctx_p;
+	redisReply *scan = scan_p;
+	redisReply *keys = scan->element[1];
+	redisReply *values = NULL, **hashes;
+	struct redis *r;
+	unsigned int n = keys->elements, i;
+	struct restore_entry *ents = g_new0(struct restore_entry, n);
+	const char **argv = g_new(const char *, n + 1);
+	size_t *argvlen = g_new(size_t, n + 1);
+
+	hashes = g_new0(redisReply *, n);
+
+	mutex_lock(&ctx->r_m);
+	r = g_queue_pop_head(&ctx->r_q);
+	mutex_unlock(&ctx->r_m);
+
+	argv[0] = "MGET";
+	argvlen[0] = 4;
+	for (i = 0; i < n; i++) {
+		str_init_len(&ents[i].callid, keys->element[i]->str, keys->element[i]->len);
+		argv[i + 1] = ents[i].callid.s;
+		argvlen[i + 1] = ents[i].callid.len;
+	}
+
+	if (r->ctx)
+		values = redisCommandArgv(r->ctx, n + 1, argv, argvlen);
+	if (!values || values->type != REDIS_REPLY_ARRAY || values->elements != n) {
+		rlog(LOG_ERR, "Failed to fetch batch of %u calls from Redis", n);
+		mutex_lock(&rtpe_redis_restore_stats.lock);
+		rtpe_redis_restore_stats.failed += n;
+		mutex_unlock(&rtpe_redis_restore_stats.lock);
+		goto out;
+	}
+
+	// MGET returns nil for keys of other types: the delta format
+	for (i = 0; i < n; i++) {
+		if (values->element[i]->type != REDIS_REPLY_STRING)
+			redis_pipe(r, "HGETALL " PB, STR(&ents[i].callid));
+	}
+	for (i = 0; i < n && r->pipeline; i++) {
+		if (values->element[i]->type == REDIS_REPLY_STRING)
+			continue;
+		if (!r->ctx || redisGetReply(r->ctx, (void **) &hashes[i]) != REDIS_OK)
+			hashes[i] = NULL;
+		r->pipeline--;
+	}
+	r->pipeline = 0;
+
+	for (i = 0; i < n; i++) {
+		redisReply *rr = hashes[i] ? : values->element[i];
+		if (rr->type == REDIS_REPLY_ARRAY && !rr->elements) {
+			// gone since the SCAN
+			ents[i].err = NULL;
+			continue;
+		}
+		ents[i].reader = redis_decode_call(rr, &ents[i].err);
+		if (ents[i].reader)
+			ents[i].activity = redis_restore_activity(ents[i].reader);
+		else if (!ents[i].err)
+			ents[i].err = "could not retrieve call data from redis";
+	}
+
+	qsort(ents, n, sizeof(*ents), restore_entry_cmp);
+
+	for (i = 0; i < n; i++) {
+		if (!ents[i].reader && !ents[i].err)
+			continue;
+		rlog(LOG_DEBUG, "Processing call ID '%s" STR_FORMAT "%s' from Redis",
+				FMT_M(STR_FMT(&ents[i].callid)));
+		// SCAN may return keys more than once
+		redis_restore_count(json_restore_call_reader(&ents[i].callid, ents[i].reader, ents[i].err,
+					0, 1, 0));
+	}
+
+out:
+	for (i = 0; i < n; i++) {
+		if (hashes[i])
+			freeReplyObject(hashes[i]);
+	}
+	if (values)
+		freeReplyObject(values);
+	freeReplyObject(scan);
+	g_free(hashes);
+	g_free(ents);
+	g_free(argv);
+	g_free(argvlen);
+
+	mutex_lock(&ctx->r_m);
+	g_queue_push_tail(&ctx->r_q, r);
+	mutex_unlock(&ctx->r_m);
+}
+
+// iterates the key space with SCAN and hands each batch to the thread pool as it comes in
+static int redis_restore_scan(struct redis *r, GThreadPool *gtp) {
+	unsigned long long cursor = 0;
+	redisReply *scan;
+
+	do {
+		scan = redis_get(r, REDIS_REPLY_ARRAY, "SCAN %llu COUNT %i", cursor,
+				rtpe_config.redis_restore_batch);
+		if (!scan || scan->elements != 2 || scan->element[0]->type != REDIS_REPLY_STRING
+				|| scan->element[1]->type != REDIS_REPLY_ARRAY)
+		{
+			rlog(LOG_ERR, "Could not retrieve call list from Redis: %s",
+					r->ctx ? r->ctx->errstr : "No redis context");
+			if (scan)
+				freeReplyObject(scan);
+			return -1;
+		}
+		cursor = strtoull(scan->element[0]->str, NULL, 10);
+
+		// only plain strings are call IDs
+		for (size_t i = 0; i < scan->element[1]->elements; i++) {
+			if (scan->element[1]->element[i]->type != REDIS_REPLY_STRING) {
+				freeReplyObject(scan);
+				rlog(LOG_ERR, "Unexpected reply to SCAN from Redis");
+				return -1;
+			}
+		}
+
+		mutex_lock(&rtpe_redis_restore_stats.lock);
+		rtpe_redis_restore_stats.keys += scan->element[1]->elements;
+		mutex_unlock(&rtpe_redis_restore_stats.lock);
+
+		if (scan->element[1]->elements)
+			g_thread_pool_push(gtp, scan, NULL);
+		else
+			freeReplyObject(scan);
+	} while (cursor);
+
+	return 0;
+}
+
 int redis_restore(struct redis *r) {
 	redisReply *calls = NULL, *call;
 	int i, ret = -1;
 	GThreadPool *gtp;
 	struct thread_ctx ctx;
+	int batch = rtpe_config.redis_restore_batch > 0;
+	// while running in the background, other log messages must go through
+	int log_flag = rtpe_config.redis_restore_background ? 0 : LOG_FLAG_RESTORE;
 
 	if (!r)
 		return 0;
 
-	rtpe_config.common.log_level |= LOG_FLAG_RESTORE;
+	rtpe_config.common.log_level |= log_flag;
 
 	rlog(LOG_DEBUG, "Restoring calls from Redis...");
 
+	// counts accumulate over all databases (shards) restored from
+	mutex_lock(&rtpe_redis_restore_stats.lock);
+	rtpe_redis_restore_stats.running++;
+	if (!rtpe_redis_restore_stats.start.tv_sec)
+		gettimeofday(&rtpe_redis_restore_stats.start, NULL);
+	mutex_unlock(&rtpe_redis_restore_stats.lock);
+
 	mutex_lock(&r->lock);
 	// coverity[sleep : FALSE]
 	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
@@ -1920,12 +2909,18 @@ int redis_restore(struct redis *r) {
 	}
 	mutex_unlock(&r->lock);
 
-	calls = redis_get(r, REDIS_REPLY_ARRAY, "KEYS *");
+	if (!batch) {
+		calls = redis_get(r, REDIS_REPLY_ARRAY, "KEYS *");
 
-	if (!calls) {
-		rlog(LOG_ERR, "Could not retrieve call list from Redis: %s",
-				r->ctx ? r->ctx->errstr : "No redis context");
-		goto err;
+		if (!calls) {
+			rlog(LOG_ERR, "Could not retrieve call list from Redis: %s",
+					r->ctx ? r->ctx->errstr : "No redis context");
+			goto err;
+		}
+
+		mutex_lock(&rtpe_redis_restore_stats.lock);
+		rtpe_redis_restore_stats.keys += calls->elements;
+		mutex_unlock(&rtpe_redis_restore_stats.lock);
 	}
 
 	mutex_init(&ctx.r_m);
@@ -1933,14 +2928,20 @@ int redis_restore(struct redis *r) {
 	for (i = 0; i < rtpe_config.redis_num_threads; i++)
 		g_queue_push_tail(&ctx.r_q,
 				redis_new(&r->endpoint, r->db, r->auth, r->role, r->no_redis_required));
-	gtp = g_thread_pool_new(restore_thread, &ctx, rtpe_config.redis_num_threads, TRUE, NULL);
+	gtp = g_thread_pool_new(batch ? restore_batch_thread : restore_thread, &ctx,
+			rtpe_config.redis_num_threads, TRUE, NULL);
 
-	for (i = 0; i < calls->elements; i++) {
-		call = calls->element[i];
-		if (call->type != REDIS_REPLY_STRING)
-			continue;
+	if (batch)
+		ret = redis_restore_scan(r, gtp);
+	else {
+		for (i = 0; i < calls->elements; i++) {
+			call = calls->element[i];
+			if (call->type != REDIS_REPLY_STRING)
+				continue;
 
-		g_thread_pool_push(gtp, call, NULL);
+			g_thread_pool_push(gtp, call, NULL);
+		}
+		ret = 0;
 	}
 
 	g_thread_pool_stop_unused_threads();
@@ -1949,42 +2950,50 @@ int redis_restore(struct redis *r) {
 	g_thread_pool_free(gtp, FALSE, TRUE);
 	while ((r = g_queue_pop_head(&ctx.r_q)))
 		redis_close(r);
-	ret = 0;
 
-	freeReplyObject(calls);
+	if (calls)
+		freeReplyObject(calls);
 
 err:
-	rtpe_config.common.log_level &= ~LOG_FLAG_RESTORE;
+	mutex_lock(&rtpe_redis_restore_stats.lock);
+	rtpe_redis_restore_stats.running--;
+	gettimeofday(&rtpe_redis_restore_stats.end, NULL);
+	rlog(LOG_INFO, "Restored %u of %u calls from Redis so far, %u failed",
+			rtpe_redis_restore_stats.restored, rtpe_redis_restore_stats.keys,
+			rtpe_redis_restore_stats.failed);
+	mutex_unlock(&rtpe_redis_restore_stats.lock);
+
+	rtpe_config.common.log_level &= ~log_flag;
 	return ret;
 }
 
 #define JSON_ADD_STRING(f...) do { \
 		int len = snprintf(tmp,sizeof(tmp), f); \
-		json_builder_add_string_value_uri_enc(builder, tmp, len); \
+		redis_enc_string(enc, tmp, len); \
 	} while (0)
 #define JSON_SET_NSTRING(a,b,c,d) do { \
 		snprintf(tmp,sizeof(tmp), a,b); \
-		json_builder_set_member_name(builder, tmp); \
+		redis_enc_member(enc, tmp); \
 		JSON_ADD_STRING(c, d); \
 	} while (0)
 #define JSON_SET_NSTRING_CSTR(a,b,d) JSON_SET_NSTRING_LEN(a, b, strlen(d), d)
 #define JSON_SET_NSTRING_LEN(a,b,l,d) do { \
 		snprintf(tmp,sizeof(tmp), a,b); \
-		json_builder_set_member_name(builder, tmp); \
-		json_builder_add_string_value_uri_enc(builder, d, l); \
+		redis_enc_member(enc, tmp); \
+		redis_enc_string(enc, d, l); \
 	} while (0)
 #define JSON_SET_SIMPLE(a,c,d) do { \
-		json_builder_set_member_name(builder, a); \
+		redis_enc_member(enc, a); \
 		JSON_ADD_STRING(c, d); \
 	} while (0)
 #define JSON_SET_SIMPLE_LEN(a,l,d) do { \
-		json_builder_set_member_name(builder, a); \
-		json_builder_add_string_value_uri_enc(builder, d, l); \
+		redis_enc_member(enc, a); \
+		redis_enc_string(enc, d, l); \
 	} while (0)
 #define JSON_SET_SIMPLE_CSTR(a,d) JSON_SET_SIMPLE_LEN(a, strlen(d), d)
 #define JSON_SET_SIMPLE_STR(a,d) JSON_SET_SIMPLE_LEN(a, (d)->len, (d)->s)
 
-static void json_update_crypto_params(JsonBuilder *builder, const char *key, struct crypto_params *p) {
+static void json_update_crypto_params(struct redis_enc *enc, const char *key, struct crypto_params *p) {
 	char tmp[2048];
 
 	if (!p->crypto_suite)
@@ -2002,7 +3011,7 @@ static void json_update_crypto_params(JsonBuilder *builder, const char *key, str
 		JSON_SET_NSTRING_LEN("%s-mki", key, p->mki_len, (char *) p->mki);
 }
 
-static int json_update_sdes_params(JsonBuilder *builder, const char *pref,
+static int json_update_sdes_params(struct redis_enc *enc, const char *pref,
 		unsigned int unique_id,
 		const char *k, GQueue *q)
 {
@@ -2019,7 +3028,7 @@ static int json_update_sdes_params(JsonBuilder *builder, const char *pref,
 			return -1;
 
 		JSON_SET_NSTRING("%s_tag", key, "%u", cps->tag);
-		json_update_crypto_params(builder, key, p);
+		json_update_crypto_params(enc, key, p);
 
 		snprintf(keybuf, sizeof(keybuf), "%s-%u", k, iter++);
 		key = keybuf;
@@ -2028,7 +3037,7 @@ static int json_update_sdes_params(JsonBuilder *builder, const char *pref,
 	return 0;
 }
 
-static void json_update_dtls_fingerprint(JsonBuilder *builder, const char *pref,
+static void json_update_dtls_fingerprint(struct redis_enc *enc, const char *pref,
 		unsigned int unique_id,
 		const struct dtls_fingerprint *f)
 {
@@ -2043,7 +3052,7 @@ static void json_update_dtls_fingerprint(JsonBuilder *builder, const char *pref,
  * encodes the few (k,v) pairs for one call under one json structure
  */
 
-char* redis_encode_json(struct call *c) {
+static void redis_encode_call(struct redis_enc *enc, struct call *c) {
 
 	GList *l=0,*k=0, *m=0, *n=0;
 	struct endpoint_map *ep;
@@ -2053,16 +3062,15 @@ char* redis_encode_json(struct call *c) {
 	struct packet_stream *ps;
 	struct intf_list *il;
 	struct call_monologue *ml, *ml2;
-	JsonBuilder *builder = json_builder_new ();
 	struct recording *rec = 0;
 
 	char tmp[2048];
 
-	json_builder_begin_object (builder);
+	redis_enc_begin_object(enc);
 	{
-		json_builder_set_member_name(builder, "json");
+		redis_enc_member(enc, "json");
 
-		json_builder_begin_object (builder);
+		redis_enc_begin_object(enc);
 
 		{
 			JSON_SET_SIMPLE("created","%lli", timeval_us(&c->created));
@@ -2087,15 +3095,15 @@ char* redis_encode_json(struct call *c) {
 			}
 		}
 
-		json_builder_end_object (builder);
+		redis_enc_end_object(enc);
 
 		for (l = c->stream_fds.head; l; l = l->next) {
 			sfd = l->data;
 
 			snprintf(tmp, sizeof(tmp), "sfd-%u", sfd->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(enc, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(enc);
 
 			{
 				JSON_SET_SIMPLE_CSTR("pref_family",sfd->local_intf->logical->preferred_family->rfc_name);
@@ -2104,10 +3112,10 @@ char* redis_encode_json(struct call *c) {
 				JSON_SET_SIMPLE("local_intf_uid","%u",sfd->local_intf->unique_id);
 				JSON_SET_SIMPLE("stream","%u",sfd->stream->unique_id);
 
-				json_update_crypto_params(builder, "", &sfd->crypto.params);
+				json_update_crypto_params(enc, "", &sfd->crypto.params);
 
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(enc);
 
 		} // --- for
 
@@ -2118,9 +3126,9 @@ char* redis_encode_json(struct call *c) {
 			mutex_lock(&ps->out_lock);
 
 			snprintf(tmp, sizeof(tmp), "stream-%u", ps->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(enc, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(enc);
 
 			{
 				JSON_SET_SIMPLE("media","%u",ps->media->unique_id);
@@ -2137,10 +3145,10 @@ char* redis_encode_json(struct call *c) {
 				JSON_SET_SIMPLE("stats-bytes","%" PRIu64, atomic64_get(&ps->stats.bytes));
 				JSON_SET_SIMPLE("stats-errors","%" PRIu64, atomic64_get(&ps->stats.errors));
 
-				json_update_crypto_params(builder, "", &ps->crypto.params);
+				json_update_crypto_params(enc, "", &ps->crypto.params);
 			}
 
-			json_builder_end_object (builder);
+			redis_enc_end_object(enc);
 
 			// stream_sfds was here before
 			mutex_unlock(&ps->in_lock);
@@ -2156,13 +3164,13 @@ char* redis_encode_json(struct call *c) {
 			mutex_lock(&ps->out_lock);
 
 			snprintf(tmp, sizeof(tmp), "stream_sfds-%u", ps->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (k = ps->sfds.head; k; k = k->next) {
 				sfd = k->data;
 				JSON_ADD_STRING("%u",sfd->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 
 			mutex_unlock(&ps->in_lock);
 			mutex_unlock(&ps->out_lock);
@@ -2173,9 +3181,9 @@ char* redis_encode_json(struct call *c) {
 			ml = l->data;
 
 			snprintf(tmp, sizeof(tmp), "tag-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(enc, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(enc);
 			{
 
 				JSON_SET_SIMPLE("created","%llu",(long long unsigned) ml->created);
@@ -2191,7 +3199,7 @@ char* redis_encode_json(struct call *c) {
 				if (ml->label.s)
 					JSON_SET_SIMPLE_STR("label",&ml->label);
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(enc);
 
 			// other_tags and medias- was here before
 
@@ -2200,38 +3208,38 @@ char* redis_encode_json(struct call *c) {
 		for (l = c->monologues.head; l; l = l->next) {
 			ml = l->data;
 			// -- we do it again here since the jsonbuilder is linear straight forward
-			k = g_hash_table_get_values(ml->other_tags);
+			k = str_map_values(&ml->other_tags);
 			snprintf(tmp, sizeof(tmp), "other_tags-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = k; m; m = m->next) {
 				ml2 = m->data;
 				JSON_ADD_STRING("%u",ml2->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 
 			g_list_free(k);
 
-			k = g_hash_table_get_values(ml->branches);
+			k = str_map_values(&ml->branches);
 			snprintf(tmp, sizeof(tmp), "branches-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = k; m; m = m->next) {
 				ml2 = m->data;
 				JSON_ADD_STRING("%u",ml2->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 
 			g_list_free(k);
 
 			snprintf(tmp, sizeof(tmp), "medias-%u", ml->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (k = ml->medias.head; k; k = k->next) {
 				media = k->data;
 				JSON_ADD_STRING("%u",media->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 		}
 
 
@@ -2239,9 +3247,9 @@ char* redis_encode_json(struct call *c) {
 			media = l->data;
 
 			snprintf(tmp, sizeof(tmp), "media-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(enc, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(enc);
 			{
 				JSON_SET_SIMPLE("tag","%u",media->monologue->unique_id);
 				JSON_SET_SIMPLE("index","%u",media->index);
@@ -2256,13 +3264,13 @@ char* redis_encode_json(struct call *c) {
 				JSON_SET_SIMPLE("ptime","%i",media->ptime);
 				JSON_SET_SIMPLE("media_flags","%u",media->media_flags);
 
-				json_update_sdes_params(builder, "media", media->unique_id, "sdes_in",
+				json_update_sdes_params(enc, "media", media->unique_id, "sdes_in",
 						&media->sdes_in);
-				json_update_sdes_params(builder, "media", media->unique_id, "sdes_out",
+				json_update_sdes_params(enc, "media", media->unique_id, "sdes_out",
 						&media->sdes_out);
-				json_update_dtls_fingerprint(builder, "media", media->unique_id, &media->fingerprint);
+				json_update_dtls_fingerprint(enc, "media", media->unique_id, &media->fingerprint);
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(enc);
 
 		} // --- for medias.head
 
@@ -2272,26 +3280,26 @@ char* redis_encode_json(struct call *c) {
 			media = l->data;
 
 			snprintf(tmp, sizeof(tmp), "streams-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = media->streams.head; m; m = m->next) {
 				ps = m->data;
 				JSON_ADD_STRING("%u",ps->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 
 			snprintf(tmp, sizeof(tmp), "maps-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = media->endpoint_maps.head; m; m = m->next) {
 				ep = m->data;
 				JSON_ADD_STRING("%u",ep->unique_id);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 
 			snprintf(tmp, sizeof(tmp), "payload_types-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = media->codecs_prefs_recv.head; m; m = m->next) {
 				pt = m->data;
 				JSON_ADD_STRING("%u/" STR_FORMAT "/%u/" STR_FORMAT "/" STR_FORMAT "/%i/%i",
@@ -2299,11 +3307,11 @@ char* redis_encode_json(struct call *c) {
 						pt->clock_rate, STR_FMT(&pt->encoding_parameters),
 						STR_FMT(&pt->format_parameters), pt->bitrate, pt->ptime);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 
 			snprintf(tmp, sizeof(tmp), "payload_types_send-%u", media->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = media->codecs_prefs_send.head; m; m = m->next) {
 				pt = m->data;
 				JSON_ADD_STRING("%u/" STR_FORMAT "/%u/" STR_FORMAT "/" STR_FORMAT "/%i/%i",
@@ -2311,16 +3319,16 @@ char* redis_encode_json(struct call *c) {
 						pt->clock_rate, STR_FMT(&pt->encoding_parameters),
 						STR_FMT(&pt->format_parameters), pt->bitrate, pt->ptime);
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 		}
 
 		for (l = c->endpoint_maps.head; l; l = l->next) {
 			ep = l->data;
 
 			snprintf(tmp, sizeof(tmp), "map-%u", ep->unique_id);
-			json_builder_set_member_name(builder, tmp);
+			redis_enc_member(enc, tmp);
 
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(enc);
 			{
 				JSON_SET_SIMPLE("wildcard","%i",ep->wildcard);
 				JSON_SET_SIMPLE("num_ports","%u",ep->num_ports);
@@ -2329,7 +3337,7 @@ char* redis_encode_json(struct call *c) {
 				JSON_SET_SIMPLE_CSTR("endpoint",endpoint_print_buf(&ep->endpoint));
 
 			}
-			json_builder_end_object (builder);
+			redis_enc_end_object(enc);
 
 		} // --- for c->endpoint_maps.head
 
@@ -2338,8 +3346,8 @@ char* redis_encode_json(struct call *c) {
 			ep = l->data;
 
 			snprintf(tmp, sizeof(tmp), "map_sfds-%u", ep->unique_id);
-			json_builder_set_member_name(builder, tmp);
-			json_builder_begin_array (builder);
+			redis_enc_member(enc, tmp);
+			redis_enc_begin_array(enc);
 			for (m = ep->intf_sfds.head; m; m = m->next) {
 				il = m->data;
 				JSON_ADD_STRING("loc-%u",il->local_intf->unique_id);
@@ -2348,17 +3356,17 @@ char* redis_encode_json(struct call *c) {
 					JSON_ADD_STRING("%u",sfd->unique_id);
 				}
 			}
-			json_builder_end_array (builder);
+			redis_enc_end_array(enc);
 		}
 
 		// SSRC table dump
 		rwlock_lock_r(&c->ssrc_hash->lock);
 		k = g_hash_table_get_values(c->ssrc_hash->ht);
-		json_builder_set_member_name(builder, "ssrc_table");
-		json_builder_begin_array (builder);
+		redis_enc_member(enc, "ssrc_table");
+		redis_enc_begin_array(enc);
 		for (m = k; m; m = m->next) {
 			struct ssrc_entry_call *se = m->data;
-			json_builder_begin_object (builder);
+			redis_enc_begin_object(enc);
 
 			JSON_SET_SIMPLE("ssrc","%" PRIu32, se->h.ssrc);
 			// XXX use function for in/out
@@ -2370,36 +3378,242 @@ char* redis_encode_json(struct call *c) {
 			JSON_SET_SIMPLE("out_payload_type","%i", se->output_ctx.tracker.most[0]);
 			// XXX add rest of info
 
-			json_builder_end_object (builder);
+			redis_enc_end_object(enc);
 		}
-		json_builder_end_array (builder);
+		redis_enc_end_array(enc);
 
 		g_list_free(k);
 		rwlock_unlock_r(&c->ssrc_hash->lock);
 	}
-	json_builder_end_object (builder);
+	redis_enc_end_object(enc);
+}
+
+char* redis_encode_json(struct call *c) {
+	struct redis_enc enc = { .builder = json_builder_new () };
+
+	redis_encode_call(&enc, c);
 
 	JsonGenerator *gen = json_generator_new ();
-	JsonNode * root = json_builder_get_root (builder);
+	JsonNode * root = json_builder_get_root (enc.builder);
 	json_generator_set_root (gen, root);
 	char* result = json_generator_to_data (gen, NULL);
 
 	json_node_free (root);
 	g_object_unref (gen);
-	g_object_unref (builder);
+	g_object_unref (enc.builder);
 
 	return result;
 
 }
 
+// call must be locked in R. binary format, regardless of --redis-format
+GString *redis_call_snapshot(struct call *c) {
+	struct redis_enc enc;
+
+	redis_enc_init_bin(&enc);
+	redis_encode_call(&enc, c);
+
+	GString *ret = enc.buf;
+	enc.buf = g_string_new("");
+	redis_enc_free_bin(&enc);
+	return ret;
+}
+
+static void __gstring_free(void *p) {
+	g_string_free(p, TRUE);
+}
+
+// call must be locked in R. the top-level fields of the binary format ("json", "sfd-0",
+// ...) as a hash of name -> GString, which can be replicated independently
+GHashTable *redis_call_fields(struct call *c) {
+	struct redis_enc enc;
+
+	redis_enc_init_bin(&enc);
+	redis_encode_call(&enc, c);
+
+	GHashTable *ret = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, __gstring_free);
+	for (unsigned int i = 0; i < enc.fields->len; i++) {
+		struct redis_field *f = &g_array_index(enc.fields, struct redis_field, i);
+		g_hash_table_replace(ret, g_strndup(enc.buf->str + f->name, f->name_len),
+				g_string_new_len(enc.buf->str + f->val, f->val_len));
+	}
+
+	redis_enc_free_bin(&enc);
+	return ret;
+}
+
+// restores a call from a complete set of fields as returned by redis_call_fields()
+int redis_restore_fields(const str *callid, GHashTable *fields, int foreign) {
+	JsonBuilder *b = json_builder_new();
+	JsonReader *root_reader = NULL;
+	GHashTableIter iter;
+	gpointer key, val;
+
+	json_builder_begin_object(b);
+	g_hash_table_iter_init(&iter, fields);
+	while (g_hash_table_iter_next(&iter, &key, &val)) {
+		GString *v = val;
+		json_builder_set_member_name(b, key);
+		if (redis_bin_replay(b, v->str, v->len))
+			goto out;
+	}
+	json_builder_end_object(b);
+
+	JsonNode *root = json_builder_get_root(b);
+	if (root) {
+		root_reader = json_reader_new(root);
+		json_node_free(root);
+	}
+
+out:
+	g_object_unref(b);
+	return json_restore_call_reader(callid, root_reader, "could not decode binary data", foreign, 0, 0);
+}
+
+
+static uint64_t redis_field_hash(const char *s, size_t len) {
+	// FNV-1a
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/* called with r->lock held and c->master_lock held. r->lock also protects c->redis_fields
+ *
+ * writes only the top-level fields which have changed since the last update, and removes
+ * the ones which have gone away. the first update, and any after a reconnect or a failed
+ * write, replaces the key completely */
+static void redis_update_delta(struct call *c, struct redis *r, struct redis_enc *enc,
+		unsigned int expires)
+{
+	GHashTable *old = c->redis_fields;
+	c->redis_fields = NULL;
+	if (old && c->redis_fields_gen != r->gen) {
+		g_hash_table_destroy(old);
+		old = NULL;
+	}
+
+	GHashTable *fields = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	unsigned int num = enc->fields->len;
+	const char **argv = g_new(const char *, 2 + num * 2);
+	size_t *argvlen = g_new(size_t, 2 + num * 2);
+	int argc = 2;
+
+	argv[0] = "HSET";
+	argvlen[0] = 4;
+	argv[1] = c->callid.s;
+	argvlen[1] = c->callid.len;
+
+	for (unsigned int i = 0; i < num; i++) {
+		struct redis_field *f = &g_array_index(enc->fields, struct redis_field, i);
+		const char *name = enc->buf->str + f->name;
+		const char *val = enc->buf->str + f->val;
+
+		uint64_t *hash = g_new(uint64_t, 1);
+		*hash = redis_field_hash(val, f->val_len);
+		char *key = g_strndup(name, f->name_len);
+
+		int changed = 1;
+		if (old) {
+			uint64_t *prev = g_hash_table_lookup(old, key);
+			if (prev && *prev == *hash)
+				changed = 0;
+			g_hash_table_remove(old, key);
+		}
+		g_hash_table_insert(fields, key, hash);
+
+		if (!changed)
+			continue;
+		argv[argc] = name;
+		argvlen[argc++] = f->name_len;
+		argv[argc] = val;
+		argvlen[argc++] = f->val_len;
+	}
+
+	redis_pipe(r, "MULTI");
+	if (!old)
+		redis_pipe(r, "DEL "PB"", STR(&c->callid));
+	else if (g_hash_table_size(old)) {
+		// whatever is left over doesn't exist any more
+		unsigned int num_del = g_hash_table_size(old);
+		const char **del_argv = g_new(const char *, 2 + num_del);
+		size_t *del_argvlen = g_new(size_t, 2 + num_del);
+		int del_argc = 2;
+		GHashTableIter iter;
+		gpointer key;
+
+		del_argv[0] = "HDEL";
+		del_argvlen[0] = 4;
+		del_argv[1] = c->callid.s;
+		del_argvlen[1] = c->callid.len;
+		g_hash_table_iter_init(&iter, old);
+		while (g_hash_table_iter_next(&iter, &key, NULL)) {
+			del_argv[del_argc] = key;
+			del_argvlen[del_argc++] = strlen(key);
+		}
+		redis_pipe_argv(r, del_argc, del_argv, del_argvlen);
+
+		g_free(del_argv);
+		g_free(del_argvlen);
+	}
+	if (argc > 2)
+		redis_pipe_argv(r, argc, argv, argvlen);
+	redis_pipe(r, "EXPIRE "PB" %i", STR(&c->callid), expires);
+	redis_pipe(r, "EXEC");
+
+	if (redis_consume_check(r)) {
+		rlog(LOG_WARN, "Failed to write delta update to redis, doing a full update next time");
+		g_hash_table_destroy(fields);
+		fields = NULL;
+	}
+
+	c->redis_fields = fields;
+	c->redis_fields_gen = r->gen;
+
+	if (old)
+		g_hash_table_destroy(old);
+	g_free(argv);
+	g_free(argvlen);
+}
+
+
+enum redis_write_state {
+	REDIS_WRITE_IDLE = 0,
+	REDIS_WRITE_QUEUED, // on the writer queue
+	REDIS_WRITE_DELETED, // removed from redis, must not be written again
+};
+
+static mutex_t redis_writer_lock = MUTEX_STATIC_INIT;
+static cond_t redis_writer_cond = COND_STATIC_INIT;
+static GQueue redis_writer_queue = G_QUEUE_INIT; // calls holding a reference, in order of due time
+static int redis_writer_running;
+
+
+static void redis_write_latency_add(const struct timeval *start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	latency_histogram_add(&rtpe_redis_write_latency, MAX(timeval_diff(&now, start), 0));
+}
 
 void redis_update_onekey(struct call *c, struct redis *r) {
 	unsigned int redis_expires_s;
+	enum redis_format format;
+	struct redis_enc enc;
+	struct timeval start;
 
 	if (!r)
 		return;
+	r = redis_pool_conn(&c->callid, redis_shard_for(&c->callid, r));
 
 	mutex_lock(&r->lock);
+	// redis_delete() sets this before taking r->lock, so a write can't overtake the DEL
+	if (c->redis_write_state == REDIS_WRITE_DELETED) {
+		mutex_unlock(&r->lock);
+		return;
+	}
 	// coverity[sleep : FALSE]
 	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
 		mutex_unlock(&r->lock);
@@ -2408,7 +3622,17 @@ void redis_update_onekey(struct call *c, struct redis *r) {
 
 	rwlock_lock_r(&c->master_lock);
 
+	gettimeofday(&start, NULL);
+	PROBE(redis_start, "update", c->callid.s, c->callid.len);
+
 	redis_expires_s = rtpe_config.redis_expires_secs;
+	format = rtpe_config.redis_format;
+
+	// stored delta state is only valid for the same db and format
+	if (c->redis_fields && (c->redis_hosted_db != r->db || format != REDIS_FORMAT_DELTA)) {
+		g_hash_table_destroy(c->redis_fields);
+		c->redis_fields = NULL;
+	}
 
 	c->redis_hosted_db = r->db;
 	if (redisCommandNR(r->ctx, "SELECT %i", c->redis_hosted_db)) {
@@ -2416,9 +3640,31 @@ void redis_update_onekey(struct call *c, struct redis *r) {
 		goto err;
 	}
 
+	if (format == REDIS_FORMAT_BINARY || format == REDIS_FORMAT_DELTA) {
+		redis_enc_init_bin(&enc);
+		redis_encode_call(&enc, c);
+		atomic64_set(&c->mem[CALL_MEM_REDIS], enc.buf->len);
+
+		if (format == REDIS_FORMAT_DELTA)
+			redis_update_delta(c, r, &enc, redis_expires_s);
+		else {
+			redis_pipe(r, "SET "PB" %b", STR(&c->callid), enc.buf->str, (size_t) enc.buf->len);
+			redis_pipe(r, "EXPIRE "PB" %i", STR(&c->callid), redis_expires_s);
+			redis_consume(r);
+		}
+
+		redis_enc_free_bin(&enc);
+		redis_write_latency_add(&start);
+		PROBE(redis_done, "update", c->callid.s, c->callid.len);
+		mutex_unlock(&r->lock);
+		rwlock_unlock_r(&c->master_lock);
+		return;
+	}
+
 	char* result = redis_encode_json(c);
 	if (!result)
 		goto err;
+	atomic64_set(&c->mem[CALL_MEM_REDIS], strlen(result));
 
 	redis_pipe(r, "SET "PB" %s", STR(&c->callid), result);
 	redis_pipe(r, "EXPIRE "PB" %i", STR(&c->callid), redis_expires_s);
@@ -2427,6 +3673,8 @@ void redis_update_onekey(struct call *c, struct redis *r) {
 
 	if (result)
 		free(result);
+	redis_write_latency_add(&start);
+	PROBE(redis_done, "update", c->callid.s, c->callid.len);
 	mutex_unlock(&r->lock);
 	rwlock_unlock_r(&c->master_lock);
 
@@ -2436,11 +3684,105 @@ err:
 		rlog(LOG_ERR, "Redis error: %s", r->ctx->errstr);
 	redisFree(r->ctx);
 	r->ctx = NULL;
+	PROBE(redis_done, "update", c->callid.s, c->callid.len);
 
 	mutex_unlock(&r->lock);
 	rwlock_unlock_r(&c->master_lock);
 }
 
+/* must be called lock-free
+ *
+ * marks the call for an update by the writer thread. updates requested before the writer
+ * gets to the call are merged into a single write, which happens no earlier than
+ * --redis-write-delay after the first request. falls back to a direct update if the
+ * writer isn't running */
+void redis_update_async(struct call *c, struct redis *r) {
+	if (!r)
+		return;
+
+	mutex_lock(&redis_writer_lock);
+	if (!redis_writer_running || r != rtpe_redis_write) {
+		mutex_unlock(&redis_writer_lock);
+		redis_update_onekey(c, r);
+		return;
+	}
+	if (c->redis_write_state == REDIS_WRITE_IDLE) {
+		c->redis_write_state = REDIS_WRITE_QUEUED;
+		c->redis_write_due = rtpe_now;
+		timeval_add_usec(&c->redis_write_due, rtpe_config.redis_write_delay * 1000L);
+		g_queue_push_tail(&redis_writer_queue, obj_get(c));
+		cond_signal(&redis_writer_cond);
+	}
+	mutex_unlock(&redis_writer_lock);
+}
+
+void redis_writer_loop(void *d) {
+	mutex_lock(&redis_writer_lock);
+	redis_writer_running = 1;
+
+	while (1) {
+		gettimeofday(&rtpe_now, NULL);
+
+		struct call *c = g_queue_peek_head(&redis_writer_queue);
+		if (!c) {
+			if (rtpe_shutdown)
+				break;
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&redis_writer_cond, &redis_writer_lock, &tv);
+			continue;
+		}
+		// during shutdown, everything still pending is written out right away
+		if (!rtpe_shutdown && timeval_cmp(&c->redis_write_due, &rtpe_now) > 0) {
+			cond_timedwait(&redis_writer_cond, &redis_writer_lock, &c->redis_write_due);
+			continue;
+		}
+
+		g_queue_pop_head(&redis_writer_queue);
+		c->redis_write_state = REDIS_WRITE_IDLE;
+		mutex_unlock(&redis_writer_lock);
+
+		redis_update_onekey(c, rtpe_redis_write);
+		obj_put(c);
+
+		mutex_lock(&redis_writer_lock);
+	}
+
+	redis_writer_running = 0;
+	mutex_unlock(&redis_writer_lock);
+}
+
+// writes out all pending updates right away, in the calling thread
+void redis_writer_flush(void) {
+	mutex_lock(&redis_writer_lock);
+	struct call *c;
+	while ((c = g_queue_pop_head(&redis_writer_queue))) {
+		c->redis_write_state = REDIS_WRITE_IDLE;
+		mutex_unlock(&redis_writer_lock);
+
+		redis_update_onekey(c, rtpe_redis_write);
+		obj_put(c);
+
+		mutex_lock(&redis_writer_lock);
+	}
+	mutex_unlock(&redis_writer_lock);
+}
+
+// drops a pending update and prevents any further ones
+static void redis_writer_forget(struct call *c) {
+	int queued;
+
+	mutex_lock(&redis_writer_lock);
+	queued = (c->redis_write_state == REDIS_WRITE_QUEUED);
+	if (queued)
+		g_queue_remove(&redis_writer_queue, c);
+	c->redis_write_state = REDIS_WRITE_DELETED;
+	mutex_unlock(&redis_writer_lock);
+
+	if (queued)
+		obj_put(c);
+}
+
 /* must be called lock-free */
 void redis_delete(struct call *c, struct redis *r) {
 	int delete_async = rtpe_config.redis_delete_async;
@@ -2449,15 +3791,23 @@ void redis_delete(struct call *c, struct redis *r) {
 	if (!r)
 		return;
 
-	if (delete_async) {
+	redis_writer_forget(c);
+	r = redis_shard_for(&c->callid, r);
+
+	// only the main write database runs the async delete loop
+	if (delete_async && r == rtpe_redis_write) {
 		mutex_lock(&r->async_lock);
 		rwlock_lock_r(&c->master_lock);
+		PROBE(redis_start, "delete", c->callid.s, c->callid.len);
 		redis_delete_async_call_json(c, r);
+		PROBE(redis_done, "delete", c->callid.s, c->callid.len);
 		rwlock_unlock_r(&c->master_lock);
 		mutex_unlock(&r->async_lock);
 		return;
 	}
 
+	r = redis_pool_conn(&c->callid, r);
+
 	mutex_lock(&r->lock);
 	// coverity[sleep : FALSE]
 	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
@@ -2466,10 +3816,13 @@ void redis_delete(struct call *c, struct redis *r) {
 	}
 	rwlock_lock_r(&c->master_lock);
 
+	PROBE(redis_start, "delete", c->callid.s, c->callid.len);
+
 	if (redisCommandNR(r->ctx, "SELECT %i", c->redis_hosted_db))
 		goto err;
 
 	redis_delete_call_json(c, r);
+	PROBE(redis_done, "delete", c->callid.s, c->callid.len);
 
 	rwlock_unlock_r(&c->master_lock);
 	mutex_unlock(&r->lock);
@@ -2480,6 +3833,7 @@ err:
 		rlog(LOG_ERR, "Redis error: %s", r->ctx->errstr);
 	redisFree(r->ctx);
 	r->ctx = NULL;
+	PROBE(redis_done, "delete", c->callid.s, c->callid.len);
 
 	rwlock_unlock_r(&c->master_lock);
 	mutex_unlock(&r->lock);
@@ -2488,6 +3842,27 @@ err:
 
 
 
+/* publishes a batch of messages to a channel in a single pipelined round trip */
+void redis_publish(struct redis *r, const char *channel, const str *msgs, unsigned int num) {
+	if (!r || !num)
+		return;
+
+	mutex_lock(&r->lock);
+	// coverity[sleep : FALSE]
+	if (redis_check_conn(r) == REDIS_STATE_DISCONNECTED) {
+		mutex_unlock(&r->lock);
+		return;
+	}
+
+	for (unsigned int i = 0; i < num; i++)
+		redis_pipe(r, "PUBLISH %s %b", channel, msgs[i].s, (size_t) msgs[i].len);
+	if (redis_consume_check(r))
+		rlog(LOG_WARN, "Failed to publish %u messages to Redis channel '%s'", num, channel);
+
+	mutex_unlock(&r->lock);
+}
+
+
 
 void redis_wipe(struct redis *r) {
 	if (!r)
@@ -0,0 +1,516 @@
+#include "replication.h"
+#include <glib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "main.h"
+#include "log.h"
+#include "aux.h"
+#include "str.h"
+#include "socket.h"
+#include "call.h"
+#include "redis.h"
+
+
+// Each message is a struct repl_hdr, the call ID and `len` bytes of payload. The payload
+// of REPL_FULL and REPL_DELTA is a list of entries: an op byte, the field name and, for
+// REPL_SET, its value, both prefixed by their length. REPL_FULL replaces all fields of
+// the call, REPL_DELTA only touches the ones listed. After (re)connecting, the standby
+// gets a REPL_FULL of every call followed by REPL_SYNC, which removes the calls it
+// didn't hear about.
+
+#define REPL_MAX_MSG		(16 * 1024 * 1024)
+#define REPL_WAIT_US		100000
+
+enum repl_msg {
+	REPL_FULL = 1,
+	REPL_DELTA,
+	REPL_DELETE,
+	REPL_SYNC,
+};
+
+enum repl_op {
+	REPL_SET = 1,
+	REPL_UNSET,
+};
+
+struct repl_hdr {
+	uint32_t		type;
+	uint32_t		callid_len;
+	uint32_t		len;
+};
+
+// standby side
+struct repl_call {
+	GHashTable		*fields; // name -> GString
+	unsigned int		gen; // connection it was last fully received on
+};
+
+
+// active side. calls waiting to be sent, coalesced, with their sender thread picking them up
+static mutex_t repl_lock = MUTEX_STATIC_INIT;
+static cond_t repl_cond = COND_STATIC_INIT;
+static GHashTable *repl_dirty; // str * callid -> NULL
+// sender thread only: fields as last sent, str * callid -> GHashTable
+static GHashTable *repl_sent;
+
+// standby thread only: str * callid -> struct repl_call
+static GHashTable *repl_calls;
+static unsigned int repl_gen;
+
+
+
+static void repl_gstring_free(void *p) {
+	g_string_free(p, TRUE);
+}
+
+static void repl_call_free(void *p) {
+	struct repl_call *rc = p;
+	g_hash_table_destroy(rc->fields);
+	g_slice_free1(sizeof(*rc), rc);
+}
+
+void replication_init(void) {
+	if (rtpe_config.replicate_to.port) {
+		repl_dirty = g_hash_table_new_full(str_hash, str_equal, free, NULL);
+		repl_sent = g_hash_table_new_full(str_hash, str_equal, free,
+				(GDestroyNotify) g_hash_table_destroy);
+	}
+	if (rtpe_config.replicate_listen.port)
+		repl_calls = g_hash_table_new_full(str_hash, str_equal, free, repl_call_free);
+}
+
+// also used for deleted calls, which are told apart by not being found any more
+void replication_update(struct call *c) {
+	if (!repl_dirty)
+		return;
+	if (IS_FOREIGN_CALL(c))
+		return;
+
+	mutex_lock(&repl_lock);
+	if (!g_hash_table_lookup_extended(repl_dirty, &c->callid, NULL, NULL)) {
+		g_hash_table_insert(repl_dirty, str_dup(&c->callid), NULL);
+		cond_signal(&repl_cond);
+	}
+	mutex_unlock(&repl_lock);
+}
+
+
+
+static void repl_put_u32(GString *s, uint32_t v) {
+	v = htonl(v);
+	g_string_append_len(s, (char *) &v, sizeof(v));
+}
+
+static void repl_put_entry(GString *s, enum repl_op op, const char *name, const GString *val) {
+	size_t len = strlen(name);
+	g_string_append_c(s, op);
+	repl_put_u32(s, len);
+	g_string_append_len(s, name, len);
+	if (!val)
+		return;
+	repl_put_u32(s, val->len);
+	g_string_append_len(s, val->str, val->len);
+}
+
+static int repl_write(int fd, const void *buf, size_t len) {
+	while (len) {
+		ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *) buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int repl_send(int fd, enum repl_msg type, const str *callid, const GString *payload) {
+	struct repl_hdr hdr = {
+		.type = htonl(type),
+		.callid_len = htonl(callid ? callid->len : 0),
+		.len = htonl(payload ? payload->len : 0),
+	};
+	if (repl_write(fd, &hdr, sizeof(hdr)))
+		return -1;
+	if (callid && repl_write(fd, callid->s, callid->len))
+		return -1;
+	if (payload && repl_write(fd, payload->str, payload->len))
+		return -1;
+	return 0;
+}
+
+// returns -1 if the link failed
+static int repl_send_call(int fd, const str *callid) {
+	struct call *c = call_get(callid);
+
+	if (!c) {
+		if (!g_hash_table_remove(repl_sent, callid))
+			return 0; // never made it to the standby
+		return repl_send(fd, REPL_DELETE, callid, NULL);
+	}
+
+	if (IS_FOREIGN_CALL(c)) {
+		// we've become the standby for it
+		call_unlock_w(c);
+		obj_put(c);
+		log_info_clear();
+		g_hash_table_remove(repl_sent, callid);
+		return 0;
+	}
+
+	GHashTable *fields = redis_call_fields(c);
+	call_unlock_w(c);
+	obj_put(c);
+	log_info_clear();
+
+	GHashTable *prev = g_hash_table_lookup(repl_sent, callid);
+	GString *out = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer key, val;
+
+	g_hash_table_iter_init(&iter, fields);
+	while (g_hash_table_iter_next(&iter, &key, &val)) {
+		GString *old = prev ? g_hash_table_lookup(prev, key) : NULL;
+		if (old && g_string_equal(old, val))
+			continue;
+		repl_put_entry(out, REPL_SET, key, val);
+	}
+	if (prev) {
+		g_hash_table_iter_init(&iter, prev);
+		while (g_hash_table_iter_next(&iter, &key, NULL)) {
+			if (!g_hash_table_lookup(fields, key))
+				repl_put_entry(out, REPL_UNSET, key, NULL);
+		}
+	}
+
+	int ret = 0;
+	if (!prev || out->len)
+		ret = repl_send(fd, prev ? REPL_DELTA : REPL_FULL, callid, out);
+	g_string_free(out, TRUE);
+
+	if (ret)
+		g_hash_table_destroy(fields);
+	else
+		g_hash_table_replace(repl_sent, str_dup(callid), fields);
+	return ret;
+}
+
+static void repl_mark_all(void) {
+	GHashTableIter iter;
+	gpointer val;
+
+	mutex_lock(&repl_lock);
+	ITERATE_CALLHASH_SHARDS(shard) {
+		rwlock_lock_r(&shard->lock);
+		g_hash_table_iter_init(&iter, shard->ht);
+		while (g_hash_table_iter_next(&iter, NULL, &val)) {
+			struct call *c = val;
+			if (IS_OWN_CALL(c))
+				g_hash_table_replace(repl_dirty, str_dup(&c->callid), NULL);
+		}
+		rwlock_unlock_r(&shard->lock);
+	}
+	mutex_unlock(&repl_lock);
+}
+
+// takes over the current set of pending calls, waiting a bit for some to show up
+static GHashTable *repl_wait(void) {
+	GHashTable *ret = NULL;
+
+	mutex_lock(&repl_lock);
+	if (!g_hash_table_size(repl_dirty)) {
+		struct timeval tv = rtpe_now;
+		timeval_add_usec(&tv, REPL_WAIT_US);
+		cond_timedwait(&repl_cond, &repl_lock, &tv);
+	}
+	if (g_hash_table_size(repl_dirty)) {
+		ret = repl_dirty;
+		repl_dirty = g_hash_table_new_full(str_hash, str_equal, free, NULL);
+	}
+	mutex_unlock(&repl_lock);
+
+	return ret;
+}
+
+void replication_sender_loop(void *p) {
+	socket_t sock = { .fd = -1 };
+	time_t next_connect = 0;
+	int syncing = 0;
+
+	while (!rtpe_shutdown) {
+		rtpe_now_coarse();
+
+		if (sock.fd == -1) {
+			if (rtpe_now.tv_sec < next_connect) {
+				usleep(REPL_WAIT_US);
+				continue;
+			}
+			next_connect = rtpe_now.tv_sec + 1;
+			if (connect_socket(&sock, SOCK_STREAM, &rtpe_config.replicate_to)) {
+				sock.fd = -1;
+				continue;
+			}
+			ilog(LOG_INFO, "Connected to replication standby at %s",
+					endpoint_print_buf(&rtpe_config.replicate_to));
+			// it gets everything from scratch
+			g_hash_table_remove_all(repl_sent);
+			repl_mark_all();
+			syncing = 1;
+		}
+
+		GHashTable *batch = repl_wait();
+		int ret = 0;
+		if (batch) {
+			GHashTableIter iter;
+			gpointer key;
+			g_hash_table_iter_init(&iter, batch);
+			while (!ret && g_hash_table_iter_next(&iter, &key, NULL))
+				ret = repl_send_call(sock.fd, key);
+			g_hash_table_destroy(batch);
+		}
+		if (!ret && syncing) {
+			ret = repl_send(sock.fd, REPL_SYNC, NULL, NULL);
+			syncing = 0;
+		}
+
+		if (ret) {
+			ilog(LOG_WARN, "Lost connection to replication standby at %s: %s",
+					endpoint_print_buf(&rtpe_config.replicate_to), strerror(errno));
+			close_socket(&sock);
+			sock.fd = -1;
+		}
+	}
+
+	if (sock.fd != -1)
+		close_socket(&sock);
+}
+
+
+
+// waits for the socket to become readable, so that shutdown isn't held up
+static int repl_poll(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	while (!rtpe_shutdown) {
+		int ret = poll(&pfd, 1, REPL_WAIT_US / 1000);
+		if (ret > 0)
+			return 0;
+		if (ret < 0 && errno != EINTR)
+			return -1;
+	}
+	return -1;
+}
+
+static int repl_read(int fd, void *buf, size_t len) {
+	while (len) {
+		ssize_t ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret == 0)
+			errno = ECONNRESET;
+		if (ret <= 0)
+			return -1;
+		buf = (char *) buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int repl_get_u32(str *s, uint32_t *out) {
+	if (s->len < sizeof(*out))
+		return -1;
+	memcpy(out, s->s, sizeof(*out));
+	*out = ntohl(*out);
+	str_shift(s, sizeof(*out));
+	return 0;
+}
+
+static int repl_get_bytes(str *s, str *out) {
+	uint32_t len;
+	if (repl_get_u32(s, &len) || len > s->len)
+		return -1;
+	str_init_len(out, s->s, len);
+	str_shift(s, len);
+	return 0;
+}
+
+static int repl_apply_entries(GHashTable *fields, str *payload) {
+	while (payload->len) {
+		str name, val;
+		enum repl_op op = (unsigned char) payload->s[0];
+		str_shift(payload, 1);
+		if (repl_get_bytes(payload, &name))
+			return -1;
+		char *key = g_strndup(name.s, name.len);
+		if (op == REPL_UNSET) {
+			g_hash_table_remove(fields, key);
+			g_free(key);
+			continue;
+		}
+		if (op != REPL_SET || repl_get_bytes(payload, &val)) {
+			g_free(key);
+			return -1;
+		}
+		g_hash_table_replace(fields, key, g_string_new_len(val.s, val.len));
+	}
+	return 0;
+}
+
+// destroys the local copy of the call if it's one of ours, no-op otherwise
+static int repl_drop_call(const str *callid) {
+	struct call *c = call_get(callid);
+	if (!c)
+		return 0;
+	call_unlock_w(c);
+	int own = IS_OWN_CALL(c);
+	if (own)
+		ilog(LOG_WARN, "Ignoring replicated update for own call");
+	else
+		call_destroy(c);
+	obj_put(c);
+	log_info_clear();
+	return own ? -1 : 0;
+}
+
+// same as with Redis keyspace notifications, the call is recreated from scratch
+static void repl_restore(const str *callid, struct repl_call *rc) {
+	if (repl_drop_call(callid))
+		return;
+	redis_restore_fields(callid, rc->fields, 1);
+}
+
+static void repl_sync(void) {
+	GHashTableIter iter;
+	gpointer key, val;
+	unsigned int num = 0;
+
+	g_hash_table_iter_init(&iter, repl_calls);
+	while (g_hash_table_iter_next(&iter, &key, &val)) {
+		struct repl_call *rc = val;
+		if (rc->gen == repl_gen)
+			continue;
+		repl_drop_call(key);
+		g_hash_table_iter_remove(&iter);
+		num++;
+	}
+	ilog(LOG_INFO, "Replication in sync, %u calls held, %u stale ones removed",
+			g_hash_table_size(repl_calls), num);
+}
+
+// returns -1 to drop the connection, which makes the active side send everything again
+static int repl_handle(const struct repl_hdr *hdr, str *callid, str *payload) {
+	struct repl_call *rc;
+
+	switch (hdr->type) {
+		case REPL_FULL:
+			rc = g_slice_alloc0(sizeof(*rc));
+			rc->fields = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, repl_gstring_free);
+			break;
+		case REPL_DELTA:
+			rc = g_hash_table_lookup(repl_calls, callid);
+			if (!rc) {
+				ilog(LOG_WARN, "Received replication update for unknown call [" STR_FORMAT_M "]",
+						STR_FMT_M(callid));
+				return -1;
+			}
+			// updated in place
+			break;
+		case REPL_DELETE:
+			repl_drop_call(callid);
+			g_hash_table_remove(repl_calls, callid);
+			return 0;
+		case REPL_SYNC:
+			repl_sync();
+			return 0;
+		default:
+			ilog(LOG_WARN, "Received unknown replication message type %u", hdr->type);
+			return -1;
+	}
+
+	if (repl_apply_entries(rc->fields, payload)) {
+		ilog(LOG_WARN, "Received malformed replication update for call [" STR_FORMAT_M "]",
+				STR_FMT_M(callid));
+		// a partially applied delta is dropped together with its call, which
+		// is sent again in full after reconnecting
+		if (hdr->type == REPL_FULL)
+			repl_call_free(rc);
+		else
+			g_hash_table_remove(repl_calls, callid);
+		return -1;
+	}
+	if (hdr->type == REPL_FULL) {
+		rc->gen = repl_gen;
+		g_hash_table_replace(repl_calls, str_dup(callid), rc);
+	}
+
+	repl_restore(callid, rc);
+	return 0;
+}
+
+static void repl_receive(int fd) {
+	struct repl_hdr hdr;
+	char *buf = NULL;
+
+	repl_gen++;
+
+	while (!repl_poll(fd)) {
+		if (repl_read(fd, &hdr, sizeof(hdr)))
+			break;
+		hdr.type = ntohl(hdr.type);
+		hdr.callid_len = ntohl(hdr.callid_len);
+		hdr.len = ntohl(hdr.len);
+		if (hdr.callid_len > REPL_MAX_MSG || hdr.len > REPL_MAX_MSG) {
+			ilog(LOG_WARN, "Oversized replication message received");
+			break;
+		}
+
+		buf = g_realloc(buf, hdr.callid_len + hdr.len);
+		if (repl_read(fd, buf, hdr.callid_len + hdr.len))
+			break;
+
+		str callid, payload;
+		str_init_len(&callid, buf, hdr.callid_len);
+		str_init_len(&payload, buf + hdr.callid_len, hdr.len);
+		if (repl_handle(&hdr, &callid, &payload))
+			break;
+	}
+
+	g_free(buf);
+}
+
+void replication_standby_loop(void *p) {
+	socket_t sock;
+
+	if (open_socket(&sock, SOCK_STREAM, rtpe_config.replicate_listen.port,
+				&rtpe_config.replicate_listen.address))
+		goto err;
+	if (listen(sock.fd, 1)) {
+		close_socket(&sock);
+		goto err;
+	}
+
+	while (!repl_poll(sock.fd)) {
+		endpoint_t ep;
+		socket_t conn;
+		if (sock.family->accept(&sock, &conn))
+			continue;
+		ep = conn.remote;
+		ilog(LOG_INFO, "Replication link from %s established", endpoint_print_buf(&ep));
+		repl_receive(conn.fd);
+		ilog(LOG_INFO, "Replication link from %s closed", endpoint_print_buf(&ep));
+		close_socket(&conn);
+	}
+
+	close_socket(&sock);
+	return;
+
+err:
+	ilog(LOG_ERR, "Failed to listen for replication on %s: %s",
+			endpoint_print_buf(&rtpe_config.replicate_listen), strerror(errno));
+}
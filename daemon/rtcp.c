@@ -226,6 +226,8 @@ struct rtcp_chain_element {
 // log handlers
 // struct defs
 // context to hold state variables
+#define RTCP_PLAN_MAX 5 // scratch, MOS, logging, Homer, transcoding/sink
+
 struct rtcp_process_ctx {
 	// input
 	struct media_packet *mp;
@@ -248,6 +250,10 @@ struct rtcp_process_ctx {
 	GString *json;
 	int json_init_len;
 
+	// handlers to run, in order
+	const struct rtcp_handler *plan[RTCP_PLAN_MAX];
+	unsigned int plan_len;
+
 	// verdict
 	int discard:1;
 };
@@ -274,16 +280,6 @@ struct rtcp_handler {
 			const struct timeval *);
 	void (*destroy)(struct rtcp_process_ctx *);
 };
-// collection of all handler types
-struct rtcp_handlers {
-	const struct rtcp_handler
-		*scratch,
-		*mos,
-		*transcode,
-		*logging,
-		*homer;
-};
-
 // log handler function prototypes
 
 // scratch area (prepare/parse packet)
@@ -306,11 +302,6 @@ static void transcode_common(struct rtcp_process_ctx *, struct rtcp_packet *);
 static void transcode_rr(struct rtcp_process_ctx *, struct report_block *);
 static void transcode_sr(struct rtcp_process_ctx *, struct sender_report_packet *);
 
-// wrappers to enable dynamic transcoding
-static void transcode_common_wrap(struct rtcp_process_ctx *, struct rtcp_packet *);
-static void transcode_rr_wrap(struct rtcp_process_ctx *, struct report_block *);
-static void transcode_sr_wrap(struct rtcp_process_ctx *, struct sender_report_packet *);
-
 // RTCP sinks for local RTCP generation
 static void sink_common(struct rtcp_process_ctx *, struct rtcp_packet *);
 
@@ -344,7 +335,6 @@ static void logging_finish(struct rtcp_process_ctx *, struct call *, const endpo
 static void logging_destroy(struct rtcp_process_ctx *);
 
 // structs for each handler type
-static struct rtcp_handler dummy_handlers;
 static struct rtcp_handler scratch_handlers = {
 	.common = scratch_common,
 	.rr = scratch_rr,
@@ -368,11 +358,6 @@ static struct rtcp_handler transcode_handlers = {
 static struct rtcp_handler sink_handlers = {
 	.common = sink_common,
 };
-static struct rtcp_handler transcode_handlers_wrap = {
-	.common = transcode_common_wrap,
-	.rr = transcode_rr_wrap,
-	.sr = transcode_sr_wrap,
-};
 static struct rtcp_handler log_handlers = {
 	.init = logging_init,
 	.start = logging_start,
@@ -400,27 +385,18 @@ static struct rtcp_handler homer_handlers = {
 	.finish = homer_finish,
 };
 
-// main var to hold references
-static struct rtcp_handlers rtcp_handlers = {
-	.scratch = &scratch_handlers,
-	.mos = &mos_handlers,
-	.transcode = &transcode_handlers_wrap,
-	// remainder is variable
-};
+// The handlers which are enabled globally, in order: MOS calculation, logging to syslog,
+// sending to Homer. Set up once by rtcp_init(). The scratch handler (parsing out the
+// values) goes in front of them and the media's own transcoding or sink handler, if any,
+// behind them. If nothing is left, packets take the fast path and are only validated.
+static const struct rtcp_handler *rtcp_plan[RTCP_PLAN_MAX - 2];
+static unsigned int rtcp_plan_len;
 
-// macro to call one handler
-#define CH(func, type, ...) do { \
-		if (rtcp_handlers.type->func) \
-			rtcp_handlers.type->func(log_ctx, ##__VA_ARGS__); \
-	} while (0)
-// macro to call all function handlers in one go
-// order is important
+// macro to call all function handlers of the plan in one go
 #define CAH(func, ...) do { \
-		CH(func, scratch, ##__VA_ARGS__); /* first parse out the values into scratch area */ \
-		CH(func, mos, ##__VA_ARGS__); /* process for MOS calculation */ \
-		CH(func, logging, ##__VA_ARGS__); /* log packets to syslog */ \
-		CH(func, homer, ##__VA_ARGS__); /* send contents to homer */ \
-		CH(func, transcode, ##__VA_ARGS__); /* translate for transcoding */ \
+		for (unsigned int __i = 0; __i < log_ctx->plan_len; __i++) \
+			if (log_ctx->plan[__i]->func) \
+				log_ctx->plan[__i]->func(log_ctx, ##__VA_ARGS__); \
 	} while (0)
 
 
@@ -656,7 +632,48 @@ void rtcp_list_free(GQueue *q) {
 
 
 
+// only checks the compound packet's structure and splits it up, without looking at the
+// contents. `q` can be NULL.
+static int rtcp_parse_fast(GQueue *q, struct media_packet *mp) {
+	struct rtcp_header *hdr;
+	str s = mp->raw;
+	unsigned int len;
+
+	while ((hdr = rtcp_length_check(&s, sizeof(*hdr), &len))) {
+		if (hdr->version != 2) {
+			ilog(LOG_DEBUG, "Unknown RTCP version %u", hdr->version);
+			goto error;
+		}
+		if (hdr->pt < G_N_ELEMENTS(min_packet_sizes) && len < min_packet_sizes[hdr->pt]) {
+			ilog(LOG_WARN, "Invalid RTCP packet type %u (short: %u < %i)",
+					hdr->pt, len, min_packet_sizes[hdr->pt]);
+			goto error;
+		}
+		// sender SSRC plus the announced number of report blocks must be present
+		if ((hdr->pt == RTCP_PT_SR || hdr->pt == RTCP_PT_RR)
+				&& len < hdr->count * sizeof(struct report_block))
+		{
+			ilog(LOG_WARN, "Failed to handle or parse RTCP packet type %u", hdr->pt);
+			goto error;
+		}
+
+		if (q)
+			g_queue_push_tail(q, rtcp_new_element(hdr, len));
+
+		if (str_shift(&s, len))
+			abort();
+	}
+
+	return 0;
+
+error:
+	if (q)
+		rtcp_list_free(q);
+	return -1;
+}
+
 // returns: 0 = ok, forward, -1 = error, drop, 1 = ok, but discard (no forward)
+// `q` receives the individual packets and can be NULL if they're not needed
 int rtcp_parse(GQueue *q, struct media_packet *mp) {
 	struct rtcp_header *hdr;
 	struct rtcp_chain_element *el;
@@ -668,12 +685,26 @@ int rtcp_parse(GQueue *q, struct media_packet *mp) {
 	unsigned int len;
 	int ret;
 	int min_packet_size;
+	const struct rtcp_handler *media_handler = mp->media->rtcp_handler;
+	GQueue q_local = G_QUEUE_INIT;
+
+	if (!rtcp_plan_len && !media_handler)
+		return rtcp_parse_fast(q, mp);
+
+	if (!q)
+		q = &q_local;
 
 	ZERO(log_ctx_s);
 	log_ctx_s.mp = mp;
 
 	log_ctx = &log_ctx_s;
 
+	log_ctx->plan[log_ctx->plan_len++] = &scratch_handlers;
+	memcpy(&log_ctx->plan[log_ctx->plan_len], rtcp_plan, rtcp_plan_len * sizeof(*rtcp_plan));
+	log_ctx->plan_len += rtcp_plan_len;
+	if (media_handler)
+		log_ctx->plan[log_ctx->plan_len++] = media_handler;
+
 	CAH(init);
 	CAH(start, c);
 
@@ -725,6 +756,8 @@ next:
 	CAH(finish, c, &mp->fsin, &mp->sfd->socket.local, &mp->tv);
 	CAH(destroy);
 
+	rtcp_list_free(&q_local);
+
 	return log_ctx->discard ? 1 : 0;
 
 error:
@@ -861,26 +894,39 @@ int rtcp_avp2savp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 			rtcp->ssrc, ssrc_ctx->srtcp_index);
 	crypto_debug_dump(&payload);
 
-	if (!c->params.session_params.unencrypted_srtcp && crypto_encrypt_rtcp(c, rtcp, &payload,
+	u_int32_t e_idx = (c->params.session_params.unencrypted_srtcp ? 0ULL : 0x80000000ULL) |
+			ssrc_ctx->srtcp_index;
+	unsigned int prev_len = payload.len;
+	if (c->params.crypto_suite->aead_evp) {
+		// AEAD ciphers take the E flag along with the index, and authenticate unencrypted
+		// packets as well
+		if (crypto_encrypt_rtcp(c, rtcp, &payload, e_idx))
+			return -1;
+	}
+	else if (!c->params.session_params.unencrypted_srtcp && crypto_encrypt_rtcp(c, rtcp, &payload,
 				ssrc_ctx->srtcp_index))
 		return -1;
+	// AEAD ciphers append their auth tag to the payload
+	s->len += payload.len - prev_len;
 
 	crypto_debug_printf(", enc pl: ");
 	crypto_debug_dump(&payload);
 
 	idx = (void *) s->s + s->len;
-	*idx = htonl((c->params.session_params.unencrypted_srtcp ? 0ULL : 0x80000000ULL) |
-			ssrc_ctx->srtcp_index++);
+	*idx = htonl(e_idx);
+	ssrc_ctx->srtcp_index++;
 	s->len += sizeof(*idx);
 
 	to_auth = *s;
 
 	rtp_append_mki(s, c);
 
-	c->params.crypto_suite->hash_rtcp(c, s->s + s->len, &to_auth);
-	crypto_debug_printf(", auth: ");
-	crypto_debug_dump_raw(s->s + s->len, c->params.crypto_suite->srtcp_auth_tag);
-	s->len += c->params.crypto_suite->srtcp_auth_tag;
+	if (c->params.crypto_suite->srtcp_auth_tag) {
+		c->params.crypto_suite->hash_rtcp(c, s->s + s->len, &to_auth);
+		crypto_debug_printf(", auth: ");
+		crypto_debug_dump_raw(s->s + s->len, c->params.crypto_suite->srtcp_auth_tag);
+		s->len += c->params.crypto_suite->srtcp_auth_tag;
+	}
 
 	crypto_debug_finish();
 
@@ -923,21 +969,35 @@ int rtcp_savp2avp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 
 	crypto_debug_printf(", idx %" PRIu32, idx);
 
-	assert(sizeof(hmac) >= auth_tag.len);
-	c->params.crypto_suite->hash_rtcp(c, hmac, &to_auth);
+	if (auth_tag.len) {
+		assert(sizeof(hmac) >= auth_tag.len);
+		c->params.crypto_suite->hash_rtcp(c, hmac, &to_auth);
 
-	crypto_debug_printf(", rcv hmac: ");
-	crypto_debug_dump(&auth_tag);
-	crypto_debug_printf(", calc hmac: ");
-	crypto_debug_dump_raw(hmac, auth_tag.len);
+		crypto_debug_printf(", rcv hmac: ");
+		crypto_debug_dump(&auth_tag);
+		crypto_debug_printf(", calc hmac: ");
+		crypto_debug_dump_raw(hmac, auth_tag.len);
 
-	err = "authentication failed";
-	if (str_memcmp(&auth_tag, hmac))
-		goto error;
+		err = "authentication failed";
+		if (str_memcmp(&auth_tag, hmac))
+			goto error;
+	}
 
-	if ((idx & 0x80000000ULL)) {
+	unsigned int prev_len = to_decrypt.len;
+	if (c->params.crypto_suite->aead_evp) {
+		// AEAD ciphers authenticate here, whether the E flag is set or not (rfc 7714
+		// section 9.3), and take it along with the index
+		err = "authentication failed";
+		if (crypto_decrypt_rtcp(c, rtcp, &to_decrypt, idx))
+			goto error;
+
+		crypto_debug_printf(", dec pl: ");
+		crypto_debug_dump(&to_decrypt);
+	}
+	else if ((idx & 0x80000000ULL)) {
+		err = "decryption failed";
 		if (crypto_decrypt_rtcp(c, rtcp, &to_decrypt, idx & 0x7fffffffULL))
-			return -1;
+			goto error;
 
 		crypto_debug_printf(", dec pl: ");
 		crypto_debug_dump(&to_decrypt);
@@ -945,6 +1005,8 @@ int rtcp_savp2avp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 
 	*s = to_auth;
 	s->len -= sizeof(idx);
+	// AEAD ciphers strip their auth tag
+	s->len -= prev_len - to_decrypt.len;
 
 	crypto_debug_finish();
 
@@ -1366,37 +1428,26 @@ static void transcode_sr(struct rtcp_process_ctx *ctx, struct sender_report_pack
 
 
 
-static void transcode_common_wrap(struct rtcp_process_ctx *ctx, struct rtcp_packet *common) {
-	if (!ctx->mp->media->rtcp_handler)
-		return;
-	if (ctx->mp->media->rtcp_handler->common)
-		ctx->mp->media->rtcp_handler->common(ctx, common);
-}
-static void transcode_rr_wrap(struct rtcp_process_ctx *ctx, struct report_block *rr) {
-	if (!ctx->mp->media->rtcp_handler)
-		return;
-	if (ctx->mp->media->rtcp_handler->rr)
-		ctx->mp->media->rtcp_handler->rr(ctx, rr);
-}
-static void transcode_sr_wrap(struct rtcp_process_ctx *ctx, struct sender_report_packet *sr) {
-	if (!ctx->mp->media->rtcp_handler)
-		return;
-	if (ctx->mp->media->rtcp_handler->sr)
-		ctx->mp->media->rtcp_handler->sr(ctx, sr);
-}
 
 
 
 
 void rtcp_init() {
-	rtcp_handlers.logging = _log_facility_rtcp ? &log_handlers : &dummy_handlers;
-	rtcp_handlers.homer = has_homer() ? &homer_handlers : &dummy_handlers;
+	rtcp_plan_len = 0;
+	if (!rtpe_config.no_rtcp_stats)
+		rtcp_plan[rtcp_plan_len++] = &mos_handlers;
+	if (_log_facility_rtcp)
+		rtcp_plan[rtcp_plan_len++] = &log_handlers;
+	if (has_homer())
+		rtcp_plan[rtcp_plan_len++] = &homer_handlers;
 }
 
 
 
-GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32_t octets, GQueue *rrs) {
-	GString *ret = g_string_sized_new(128);
+// builds the compound SR + SDES packet in `ret`, replacing its contents
+void rtcp_sender_report(GString *ret, uint32_t ssrc, uint32_t ts, uint32_t packets, uint32_t octets,
+		GQueue *rrs)
+{
 	g_string_set_size(ret, sizeof(struct sender_report_packet));
 	struct sender_report_packet *sr = (void *) ret->str;
 
@@ -1416,8 +1467,8 @@ GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32
 	while (rrs->length) {
 		struct ssrc_ctx *s = g_queue_pop_head(rrs);
 		if (i < 30) {
-			struct report_block *rr = (void *) ret->str + ret->len;
-			g_string_set_size(ret, ret->len + sizeof(*rr));
+			g_string_set_size(ret, ret->len + sizeof(struct report_block));
+			struct report_block *rr = (void *) ret->str + ret->len - sizeof(*rr);
 
 			// XXX unify with transcode_rr
 
@@ -1426,8 +1477,8 @@ GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32
 			long long tv_diff = 0;
 			uint32_t ntp_middle_bits = 0;
 			mutex_lock(&se->h.lock);
-			if (se->sender_reports.length) {
-				struct ssrc_time_item *si = se->sender_reports.tail->data;
+			struct ssrc_time_item *si = ssrc_time_ring_last(&se->sender_reports);
+			if (si) {
 				tv_diff = timeval_diff(&rtpe_now, &si->received);
 				ntp_middle_bits = si->ntp_middle_bits;
 			}
@@ -1454,6 +1505,7 @@ GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32
 		i++;
 	}
 
+	sr = (void *) ret->str; // might have been reallocated
 	sr->rtcp.header.count = n;
 	sr->rtcp.header.length = htons((ret->len >> 2) - 1);
 
@@ -1471,8 +1523,8 @@ GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32
 
 	assert(sizeof(*sdes) == 24);
 
-	sdes = (void *) ret->str + ret->len;
 	g_string_set_size(ret, ret->len + sizeof(*sdes));
+	sdes = (void *) ret->str + ret->len - sizeof(*sdes);
 
 	*sdes = (__typeof(*sdes)) {
 		.sdes.header.version = 2,
@@ -1486,8 +1538,6 @@ GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32
 		.pad = 0,
 	};
 	memcpy(sdes->str, rtpe_instance_id.s, rtpe_instance_id.len);
-
-	return ret;
 }
 
 void rtcp_receiver_reports(GQueue *out, struct ssrc_hash *hash, struct call_monologue *ml) {
@@ -1508,7 +1558,7 @@ void rtcp_receiver_reports(GQueue *out, struct ssrc_hash *hash, struct call_mono
 
 
 // call must be locked in R
-void rtcp_send_report(struct call_media *media, struct ssrc_ctx *ssrc_out) {
+void rtcp_send_report(struct call_media *media, struct ssrc_ctx *ssrc_out, GString *buf) {
 	struct call *call = media->call;
 
 	// figure out where to send it
@@ -1531,14 +1581,13 @@ void rtcp_send_report(struct call_media *media, struct ssrc_ctx *ssrc_out) {
 	ilog(LOG_DEBUG, "Generating and sending RTCP SR for %x and up to %i source(s)",
 			ssrc_out->parent->h.ssrc, rrs.length);
 
-	GString *sr = rtcp_sender_report(ssrc_out->parent->h.ssrc,
+	rtcp_sender_report(buf, ssrc_out->parent->h.ssrc,
 			atomic64_get(&ssrc_out->last_ts),
 			atomic64_get(&ssrc_out->packets),
 			atomic64_get(&ssrc_out->octets),
 			&rrs);
 
-	socket_sendto(&ps->selected_sfd->socket, sr->str, sr->len, &ps->endpoint);
-	g_string_free(sr, TRUE);
+	socket_sendto(&ps->selected_sfd->socket, buf->str, buf->len, &ps->endpoint);
 }
 
 
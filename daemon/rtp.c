@@ -99,10 +99,36 @@ void rtp_append_mki(str *s, struct crypto_context *c) {
 	crypto_debug_dump_raw(p, c->params.mki_len);
 }
 
+/* everything after the payload encryption: MKI and auth tag */
+static void avp2savp_finish(str *s, struct crypto_context *c, const str *payload, unsigned int prev_len,
+		u_int64_t index)
+{
+	str to_auth;
+
+	// AEAD ciphers append their auth tag to the payload
+	s->len += payload->len - prev_len;
+
+	crypto_debug_printf(", enc pl: ");
+	crypto_debug_dump(payload);
+
+	to_auth = *s;
+
+	rtp_append_mki(s, c);
+
+	if (!c->params.session_params.unauthenticated_srtp && c->params.crypto_suite->srtp_auth_tag) {
+		c->params.crypto_suite->hash_rtp(c, s->s + s->len, &to_auth, index);
+		crypto_debug_printf(", auth: ");
+		crypto_debug_dump_raw(s->s + s->len, c->params.crypto_suite->srtp_auth_tag);
+		s->len += c->params.crypto_suite->srtp_auth_tag;
+	}
+
+	crypto_debug_finish();
+}
+
 /* rfc 3711, section 3.3 */
 int rtp_avp2savp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 	struct rtp_header *rtp;
-	str payload, to_auth;
+	str payload;
 	u_int64_t index;
 
 	if (G_UNLIKELY(!ssrc_ctx))
@@ -118,26 +144,64 @@ int rtp_avp2savp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 	crypto_debug_dump(&payload);
 
 	/* rfc 3711 section 3.1 */
-	if (!c->params.session_params.unencrypted_srtp && crypto_encrypt_rtp(c, rtp, &payload, index))
+	unsigned int prev_len = payload.len;
+	if (crypto_srtp_cipher(c) && crypto_encrypt_rtp(c, rtp, &payload, index))
 		return -1;
 
-	crypto_debug_printf(", enc pl: ");
-	crypto_debug_dump(&payload);
+	avp2savp_finish(s, c, &payload, prev_len, index);
 
-	to_auth = *s;
+	return 0;
+}
 
-	rtp_append_mki(s, c);
+/* same as above for a burst of packets of the same SSRC, with all the payloads
+ * going through the cipher together. `rets` receives what rtp_avp2savp() would have
+ * returned for each packet */
+void rtp_avp2savp_batch(str *const *s, unsigned int num, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx,
+		int *rets)
+{
+	struct rtp_header *rtp[CRYPTO_BATCH_MAX];
+	str payload[CRYPTO_BATCH_MAX];
+	unsigned int prev_len[CRYPTO_BATCH_MAX];
+	u_int64_t index[CRYPTO_BATCH_MAX];
+	unsigned int pkt[CRYPTO_BATCH_MAX];
+	unsigned int i, n = 0;
+
+	// the debug output is per packet
+	if (G_UNLIKELY(rtpe_config.debug_srtp) || num > CRYPTO_BATCH_MAX)
+		goto single;
+
+	if (G_UNLIKELY(!ssrc_ctx) || check_session_keys(c)) {
+		for (i = 0; i < num; i++)
+			rets[i] = -1;
+		return;
+	}
 
-	if (!c->params.session_params.unauthenticated_srtp && c->params.crypto_suite->srtp_auth_tag) {
-		c->params.crypto_suite->hash_rtp(c, s->s + s->len, &to_auth, index);
-		crypto_debug_printf(", auth: ");
-		crypto_debug_dump_raw(s->s + s->len, c->params.crypto_suite->srtp_auth_tag);
-		s->len += c->params.crypto_suite->srtp_auth_tag;
+	for (i = 0; i < num; i++) {
+		if (rtp_payload(&rtp[n], &payload[n], s[i])) {
+			rets[i] = -1;
+			continue;
+		}
+		index[n] = packet_index(ssrc_ctx, rtp[n]);
+		prev_len[n] = payload[n].len;
+		pkt[n++] = i;
 	}
 
-	crypto_debug_finish();
+	if (crypto_srtp_cipher(c) && crypto_encrypt_rtp_batch(c, rtp, payload, index, n)) {
+		for (i = 0; i < n; i++)
+			rets[pkt[i]] = -1;
+		return;
+	}
 
-	return 0;
+	for (i = 0; i < n; i++) {
+		avp2savp_finish(s[pkt[i]], c, &payload[i], prev_len[i], index[i]);
+		rets[pkt[i]] = 0;
+	}
+
+	return;
+
+single:
+	for (i = 0; i < num; i++)
+		rets[i] = rtp_avp2savp(s[i], c, ssrc_ctx);
 }
 
 /* rfc 3711, section 3.3 */
@@ -154,7 +218,18 @@ int rtp_savp2avp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 	if (check_session_keys(c))
 		return -1;
 
+	u_int64_t prev_index = ssrc_ctx->srtp_index;
 	index = packet_index(ssrc_ctx, rtp);
+
+	/* rfc 3711 section 3.3.2, only meaningful for authenticated packets */
+	int replay_check = !c->params.session_params.unauthenticated_srtp;
+	if (replay_check && re_replay_check(&ssrc_ctx->srtp_replay, index)) {
+		ssrc_ctx->srtp_index = prev_index;
+		crypto_debug_finish();
+		ilog(LOG_DEBUG | LOG_FLAG_LIMIT, "Discarded SRTP packet: replayed or too old");
+		return -1;
+	}
+
 	if (srtp_payloads(&to_auth, &to_decrypt, &auth_tag, NULL,
 			c->params.session_params.unauthenticated_srtp ? 0 : c->params.crypto_suite->srtp_auth_tag,
 			c->params.mki_len,
@@ -212,14 +287,19 @@ int rtp_savp2avp(str *s, struct crypto_context *c, struct ssrc_ctx *ssrc_ctx) {
 
 decrypt_idx:
 	ssrc_ctx->srtp_index = index;
-decrypt:
-	if (!c->params.session_params.unencrypted_srtp && crypto_decrypt_rtp(c, rtp, &to_decrypt, index))
-		return -1;
+decrypt:;
+	unsigned int prev_len = to_decrypt.len;
+	if (crypto_srtp_cipher(c) && crypto_decrypt_rtp(c, rtp, &to_decrypt, index))
+		goto error;
+	if (replay_check)
+		re_replay_add(&ssrc_ctx->srtp_replay, index);
 
 	crypto_debug_printf(", dec pl: ");
 	crypto_debug_dump(&to_decrypt);
 
 	*s = to_auth;
+	// AEAD ciphers strip their auth tag
+	s->len -= prev_len - to_decrypt.len;
 
 	crypto_debug_finish();
 
@@ -40,42 +40,6 @@ struct sdp_connection {
 	int parsed:1;
 };
 
-struct sdp_attributes {
-	GQueue list;
-	/* GHashTable *name_hash; */
-	/* GHashTable *name_lists_hash; */
-	GHashTable *id_lists_hash;
-	GHashTable *id_hash;
-};
-
-struct sdp_session {
-	str s;
-	struct sdp_origin origin;
-	struct sdp_connection connection;
-	int rr, rs;
-	struct sdp_attributes attributes;
-	GQueue media_streams;
-};
-
-struct sdp_media {
-	struct sdp_session *session;
-
-	str s;
-	str media_type;
-	str port;
-	str transport;
-	str formats; /* space separated */
-
-	long int port_num;
-	int port_count;
-
-	struct sdp_connection connection;
-	const char *c_line_pos;
-	int rr, rs;
-	struct sdp_attributes attributes;
-	GQueue format_list; /* list of slice-alloc'd str objects */
-};
-
 struct attribute_rtcp {
 	long int port_num;
 	struct network_address address;
@@ -137,6 +101,16 @@ struct attribute_group {
 	} semantics;
 };
 
+struct attribute_ssrc_group {
+	enum {
+		SSRC_GROUP_OTHER = 0,
+		SSRC_GROUP_SIM,
+		SSRC_GROUP_FID,
+	} semantics;
+	u_int32_t ssrcs[SIMULCAST_LAYERS];
+	unsigned int num;
+};
+
 struct attribute_fingerprint {
 	str hash_func_str;
 	str fingerprint_str;
@@ -222,6 +196,7 @@ struct sdp_attribute {	/* example: a=rtpmap:8 PCMA/8000 */
 		ATTR_ICE_PWD,
 		ATTR_CRYPTO,
 		ATTR_SSRC,
+		ATTR_SSRC_GROUP,
 		ATTR_INACTIVE,
 		ATTR_SENDRECV,
 		ATTR_SENDONLY,
@@ -249,6 +224,8 @@ struct sdp_attribute {	/* example: a=rtpmap:8 PCMA/8000 */
 		ATTR_T38FAXTRANSCODINGJBIG,
 		ATTR_T38FAXRATEMANAGEMENT,
 		ATTR_END_OF_CANDIDATES,
+
+		__ATTR_LAST
 	} attr;
 
 	union {
@@ -256,6 +233,7 @@ struct sdp_attribute {	/* example: a=rtpmap:8 PCMA/8000 */
 		struct attribute_candidate candidate;
 		struct attribute_crypto crypto;
 		struct attribute_ssrc ssrc;
+		struct attribute_ssrc_group ssrc_group;
 		struct attribute_group group;
 		struct attribute_fingerprint fingerprint;
 		struct attribute_setup setup;
@@ -267,8 +245,48 @@ struct sdp_attribute {	/* example: a=rtpmap:8 PCMA/8000 */
 		struct attribute_t38faxudpecdepth t38faxudpecdepth;
 		struct attribute_t38faxratemanagement t38faxratemanagement;
 	} u;
+
+	GList link, id_link;	/* in sdp_attributes' list and id_lists */
+};
+
+// attributes and the list links are allocated from the session's buffer. the per-ID
+// lists are only built when an attribute is first looked up by ID
+struct sdp_attributes {
+	GQueue list;
+	int indexed;
+	GQueue id_lists[__ATTR_LAST];
+};
+
+struct sdp_session {
+	str s;
+	struct sdp_origin origin;
+	struct sdp_connection connection;
+	int rr, rs;
+	struct sdp_attributes attributes;
+	GQueue media_streams;
+	call_buffer_t buffer;	/* holds media sections and attributes */
 };
 
+struct sdp_media {
+	struct sdp_session *session;
+
+	str s;
+	str media_type;
+	str port;
+	str transport;
+	str formats; /* space separated */
+
+	long int port_num;
+	int port_count;
+
+	struct sdp_connection connection;
+	const char *c_line_pos;
+	int rr, rs;
+	struct sdp_attributes attributes;
+	GQueue format_list; /* list of str objects allocated from the session's buffer */
+};
+
+
 
 
 static char __id_buf[6*2 + 1]; // 6 hex encoded characters
@@ -277,11 +295,30 @@ const str rtpe_instance_id = STR_CONST_INIT(__id_buf);
 
 
 
-INLINE struct sdp_attribute *attr_get_by_id(struct sdp_attributes *a, int id) {
-	return g_hash_table_lookup(a->id_hash, &id);
+static void attrs_index(struct sdp_attributes *a) {
+	for (GList *l = a->list.head; l; l = l->next) {
+		struct sdp_attribute *attr = l->data;
+		attr->id_link.data = attr;
+		g_queue_push_tail_link(&a->id_lists[attr->attr], &attr->id_link);
+	}
+	a->indexed = 1;
 }
 INLINE GQueue *attr_list_get_by_id(struct sdp_attributes *a, int id) {
-	return g_hash_table_lookup(a->id_lists_hash, &id);
+	if (G_UNLIKELY(!a->indexed))
+		attrs_index(a);
+	if (!a->id_lists[id].length)
+		return NULL;
+	return &a->id_lists[id];
+}
+INLINE struct sdp_attribute *attr_get_by_id(struct sdp_attributes *a, int id) {
+	GQueue *q = attr_list_get_by_id(a, id);
+	return q ? q->head->data : NULL;
+}
+INLINE void *sdp_alloc0(struct sdp_session *s, size_t len) {
+	void *ret = call_buffer_alloc(&s->buffer, len);
+	if (ret)
+		memset(ret, 0, len);
+	return ret;
 }
 
 static struct sdp_attribute *attr_get_by_id_m_s(struct sdp_media *m, int id) {
@@ -395,7 +432,9 @@ static int parse_media(str *value_str, struct sdp_media *output) {
 	str formats = output->formats;
 	str format;
 	while (!str_token_sep(&format, &formats, ' ')) {
-		sp = g_slice_alloc(sizeof(*sp));
+		sp = call_buffer_alloc(&output->session->buffer, sizeof(*sp));
+		if (!sp)
+			return -1;
 		*sp = format;
 		g_queue_push_tail(&output->format_list, sp);
 	}
@@ -403,15 +442,6 @@ static int parse_media(str *value_str, struct sdp_media *output) {
 	return 0;
 }
 
-static void attrs_init(struct sdp_attributes *a) {
-	g_queue_init(&a->list);
-	/* a->name_hash = g_hash_table_new(str_hash, str_equal); */
-	a->id_hash = g_hash_table_new(g_int_hash, g_int_equal);
-	/* a->name_lists_hash = g_hash_table_new_full(str_hash, str_equal,
-			NULL, (GDestroyNotify) g_queue_free); */
-	a->id_lists_hash = g_hash_table_new_full(g_int_hash, g_int_equal,
-			NULL, (GDestroyNotify) g_queue_free);
-}
 
 static int parse_attribute_group(struct sdp_attribute *output) {
 	output->attr = ATTR_GROUP;
@@ -448,6 +478,35 @@ static int parse_attribute_ssrc(struct sdp_attribute *output) {
 	return 0;
 }
 
+static int parse_attribute_ssrc_group(struct sdp_attribute *output) {
+	PARSE_DECL;
+	struct attribute_ssrc_group *g = &output->u.ssrc_group;
+	str semantics, token;
+
+	output->attr = ATTR_SSRC_GROUP;
+
+	PARSE_INIT;
+	if (str_token_sep(&semantics, value_str, ' '))
+		return -1;
+
+	if (!str_cmp(&semantics, "SIM"))
+		g->semantics = SSRC_GROUP_SIM;
+	else if (!str_cmp(&semantics, "FID"))
+		g->semantics = SSRC_GROUP_FID;
+	else
+		g->semantics = SSRC_GROUP_OTHER;
+
+	// anything beyond the max number of layers is ignored
+	while (g->num < G_N_ELEMENTS(g->ssrcs) && !str_token_sep(&token, value_str, ' ')) {
+		g->ssrcs[g->num] = strtoul(token.s, NULL, 10);
+		if (!g->ssrcs[g->num])
+			return -1;
+		g->num++;
+	}
+
+	return 0;
+}
+
 static int parse_attribute_crypto(struct sdp_attribute *output) {
 	PARSE_DECL;
 	char *endp;
@@ -942,6 +1001,9 @@ static int parse_attribute(struct sdp_attribute *a) {
 		case CSH_LOOKUP("ssrc"):
 			ret = parse_attribute_ssrc(a);
 			break;
+		case CSH_LOOKUP("ssrc-group"):
+			ret = parse_attribute_ssrc_group(a);
+			break;
 		case CSH_LOOKUP("fmtp"):
 			ret = parse_attribute_fmtp(a);
 			break;
@@ -1054,7 +1116,6 @@ int sdp_parse(str *body, GQueue *sessions, const struct sdp_ng_flags *flags) {
 	struct sdp_attributes *attrs;
 	struct sdp_attribute *attr;
 	str *adj_s;
-	GQueue *attr_queue;
 
 	b = body->s;
 	end = str_end(body);
@@ -1104,8 +1165,13 @@ int sdp_parse(str *body, GQueue *sessions, const struct sdp_ng_flags *flags) {
 
 new_session:
 				session = g_slice_alloc0(sizeof(*session));
-				g_queue_init(&session->media_streams);
-				attrs_init(&session->attributes);
+				// sized so that all of the session normally fits into one piece
+				if (bencode_buffer_init_size(&session->buffer, body->len * 4)) {
+					g_slice_free1(sizeof(*session), session);
+					session = NULL;
+					errstr = "Out of memory";
+					goto error;
+				}
 				g_queue_push_tail(sessions, session);
 				media = NULL;
 				session->s.s = b;
@@ -1127,12 +1193,16 @@ new_session:
 				if (media && !media->c_line_pos)
 					media->c_line_pos = b;
 
-				media = g_slice_alloc0(sizeof(*media));
+				errstr = "Out of memory";
+				media = sdp_alloc0(session, sizeof(*media));
+				if (!media)
+					goto error;
 				media->session = session;
-				attrs_init(&media->attributes);
 				errstr = "Error parsing m= line";
-				if (parse_media(&value_str, media))
+				if (parse_media(&value_str, media)) {
+					g_queue_clear(&media->format_list);
 					goto error;
+				}
 				g_queue_push_tail(&session->media_streams, media);
 				media->s.s = b;
 				media->rr = media->rs = -1;
@@ -1151,7 +1221,10 @@ new_session:
 				if (media && !media->c_line_pos)
 					media->c_line_pos = b;
 
-				attr = g_slice_alloc0(sizeof(*attr));
+				errstr = "Out of memory";
+				attr = sdp_alloc0(session, sizeof(*attr));
+				if (!attr)
+					goto error;
 
 				attr->full_line.s = b;
 				attr->full_line.len = next_line ? (next_line - b) : (line_end - b);
@@ -1159,24 +1232,12 @@ new_session:
 				attr->line_value.s = value;
 				attr->line_value.len = line_end - value;
 
-				if (parse_attribute(attr)) {
-					g_slice_free1(sizeof(*attr), attr);
-					break;
-				}
+				if (parse_attribute(attr))
+					break; // left unused in the buffer
 
 				attrs = media ? &media->attributes : &session->attributes;
-				g_queue_push_tail(&attrs->list, attr);
-				/* g_hash_table_insert(attrs->name_hash, &attr->name, attr); */
-				if (!g_hash_table_lookup(attrs->id_hash, &attr->attr))
-					g_hash_table_insert(attrs->id_hash, &attr->attr, attr);
-				/* if (attr->key.s)
-					g_hash_table_insert(attrs->name_hash, &attr->key, attr); */
-
-				/* attr_queue = g_hash_table_lookup_queue_new(attrs->name_lists_hash, &attr->name);
-				g_queue_push_tail(attr_queue, attr); */
-				attr_queue = g_hash_table_lookup_queue_new(attrs->id_lists_hash, &attr->attr,
-						NULL);
-				g_queue_push_tail(attr_queue, attr);
+				attr->link.data = attr;
+				g_queue_push_tail_link(&attrs->list, &attr->link);
 
 				break;
 
@@ -1233,26 +1294,15 @@ error:
 	return -1;
 }
 
-static void attr_free(void *p) {
-	g_slice_free1(sizeof(struct sdp_attribute), p);
-}
-static void free_attributes(struct sdp_attributes *a) {
-	/* g_hash_table_destroy(a->name_hash); */
-	g_hash_table_destroy(a->id_hash);
-	/* g_hash_table_destroy(a->name_lists_hash); */
-	g_hash_table_destroy(a->id_lists_hash);
-	g_queue_clear_full(&a->list, attr_free);
-}
+// attributes, media sections and their list links live in the session's buffer
 static void media_free(void *p) {
 	struct sdp_media *media = p;
-	free_attributes(&media->attributes);
-	g_queue_clear_full(&media->format_list, str_slice_free);
-	g_slice_free1(sizeof(*media), media);
+	g_queue_clear(&media->format_list);
 }
 static void session_free(void *p) {
 	struct sdp_session *session = p;
 	g_queue_clear_full(&session->media_streams, media_free);
-	free_attributes(&session->attributes);
+	bencode_buffer_free(&session->buffer);
 	g_slice_free1(sizeof(*session), session);
 }
 void sdp_free(GQueue *sessions) {
@@ -1480,6 +1530,64 @@ static void __sdp_t38(struct stream_params *sp, struct sdp_media *media) {
 		to->local_tcf = (attr->u.t38faxratemanagement.rm == RM_LOCALTCF) ? 1 : 0;
 }
 
+// fills in the layers of a=ssrc-group:SIM and their retransmission SSRCs from a=ssrc-group:FID.
+// returns the number of layers, or 0 if there's no simulcast
+static unsigned int __sdp_simulcast_ssrcs(struct sdp_media *media, u_int32_t *ssrcs, u_int32_t *rtx) {
+	GQueue *q;
+	GList *l;
+	struct sdp_attribute *attr;
+	struct attribute_ssrc_group *g, *sim = NULL;
+	unsigned int i;
+
+	q = attr_list_get_by_id(&media->attributes, ATTR_SSRC_GROUP);
+	if (!q)
+		return 0;
+
+	for (l = q->head; l; l = l->next) {
+		attr = l->data;
+		g = &attr->u.ssrc_group;
+		if (g->semantics == SSRC_GROUP_SIM && g->num > 1) {
+			sim = g;
+			break;
+		}
+	}
+	if (!sim)
+		return 0;
+
+	for (i = 0; i < sim->num; i++) {
+		ssrcs[i] = sim->ssrcs[i];
+		rtx[i] = 0;
+	}
+
+	for (l = q->head; l; l = l->next) {
+		attr = l->data;
+		g = &attr->u.ssrc_group;
+		if (g->semantics != SSRC_GROUP_FID || g->num != 2)
+			continue;
+		for (i = 0; i < sim->num; i++) {
+			if (ssrcs[i] == g->ssrcs[0])
+				rtx[i] = g->ssrcs[1];
+		}
+	}
+
+	return sim->num;
+}
+
+// with SFU enabled, only the first simulcast layer (and its RTX) is announced to the receiver
+static int __sdp_simulcast_strip(struct sdp_media *media, u_int32_t ssrc) {
+	u_int32_t ssrcs[SIMULCAST_LAYERS], rtx[SIMULCAST_LAYERS];
+	unsigned int i, num;
+
+	num = __sdp_simulcast_ssrcs(media, ssrcs, rtx);
+	for (i = 1; i < num; i++) {
+		if (ssrc == ssrcs[i])
+			return 1;
+		if (rtx[i] && ssrc == rtx[i])
+			return 1;
+	}
+	return 0;
+}
+
 
 /* XXX split this function up */
 int sdp_streams(const GQueue *sessions, GQueue *streams, struct sdp_ng_flags *flags) {
@@ -1600,6 +1708,9 @@ int sdp_streams(const GQueue *sessions, GQueue *streams, struct sdp_ng_flags *fl
 			if (attr_get_by_id(&media->attributes, ATTR_RTCP_FB))
 				SP_SET(sp, RTCP_FB);
 
+			sp->simulcast_layers = __sdp_simulcast_ssrcs(media, sp->simulcast_ssrcs,
+					sp->simulcast_rtx);
+
 			__sdp_ice(sp, media);
 			__sdp_t38(sp, media);
 
@@ -1643,9 +1754,35 @@ struct sdp_chopper *sdp_chopper_new(str *input) {
 	struct sdp_chopper *c = g_slice_alloc0(sizeof(*c));
 	c->input = input;
 	c->output = g_string_new("");
+	c->chunk = g_string_chunk_new(512);
+	c->iov = g_array_new(0, 0, sizeof(struct iovec));
 	return c;
 }
 
+static void chopper_iov_add(struct sdp_chopper *c, char *s, int len) {
+	if (!len)
+		return;
+	c->str_len += len;
+	if (c->iov_num) {
+		struct iovec *last = &g_array_index(c->iov, struct iovec, c->iov_num - 1);
+		if ((char *) last->iov_base + last->iov_len == s) {
+			last->iov_len += len;
+			return;
+		}
+	}
+	struct iovec iov = { .iov_base = s, .iov_len = len };
+	g_array_append_val(c->iov, iov);
+	c->iov_num++;
+}
+
+static void chopper_flush(struct sdp_chopper *c) {
+	if (!c->output->len)
+		return;
+	char *s = g_string_chunk_insert_len(c->chunk, c->output->str, c->output->len);
+	chopper_iov_add(c, s, c->output->len);
+	g_string_truncate(c->output, 0);
+}
+
 INLINE void chopper_append(struct sdp_chopper *c, const char *s, int len) {
 	g_string_append_len(c->output, s, len);
 }
@@ -1673,7 +1810,8 @@ static int copy_up_to_ptr(struct sdp_chopper *chop, const char *b) {
 		ilog(LOG_WARNING, "Malformed SDP, cannot rewrite");
 		return -1;
 	}
-	chopper_append(chop, chop->input->s + chop->position, len);
+	chopper_flush(chop);
+	chopper_iov_add(chop, chop->input->s + chop->position, len);
 	chop->position += len;
 	return 0;
 }
@@ -1929,9 +2067,34 @@ static int synth_session_connection(struct sdp_chopper *chop, struct sdp_media *
 
 void sdp_chopper_destroy(struct sdp_chopper *chop) {
 	g_string_free(chop->output, TRUE);
+	g_string_chunk_free(chop->chunk);
+	g_array_free(chop->iov, TRUE);
 	g_slice_free1(sizeof(*chop), chop);
 }
 
+// compares the rewritten SDP against a flat string, like str_cmp_str()
+int sdp_chopper_cmp(struct sdp_chopper *chop, const str *s) {
+	if (chop->str_len != s->len)
+		return 1;
+	const char *p = s->s;
+	for (int i = 0; i < chop->iov_num; i++) {
+		struct iovec *iov = &g_array_index(chop->iov, struct iovec, i);
+		if (memcmp(p, iov->iov_base, iov->iov_len))
+			return 1;
+		p += iov->iov_len;
+	}
+	return 0;
+}
+
+// writes out the rewritten SDP. "out" must have room for chop->str_len bytes
+void sdp_chopper_collapse(struct sdp_chopper *chop, char *out) {
+	for (int i = 0; i < chop->iov_num; i++) {
+		struct iovec *iov = &g_array_index(chop->iov, struct iovec, i);
+		memcpy(out, iov->iov_base, iov->iov_len);
+		out += iov->iov_len;
+	}
+}
+
 static int process_session_attributes(struct sdp_chopper *chop, struct sdp_attributes *attrs,
 		struct sdp_ng_flags *flags)
 {
@@ -2082,6 +2245,22 @@ static int process_media_attributes(struct sdp_chopper *chop, struct sdp_media *
 					break;
 				goto strip;
 
+			case ATTR_SSRC_GROUP:
+				if (!flags->sfu)
+					break;
+				if (attr->u.ssrc_group.semantics == SSRC_GROUP_SIM)
+					goto strip;
+				if (attr->u.ssrc_group.semantics == SSRC_GROUP_FID
+						&& __sdp_simulcast_strip(sdp, attr->u.ssrc_group.ssrcs[0]))
+					goto strip;
+				break;
+			case ATTR_SSRC:
+				if (!flags->sfu)
+					break;
+				if (__sdp_simulcast_strip(sdp, attr->u.ssrc.id))
+					goto strip;
+				break;
+
 			default:
 				break;
 		}
@@ -2155,6 +2334,16 @@ static void insert_candidate(struct sdp_chopper *chop, struct stream_fd *sfd,
 	if (local_pref == -1)
 		local_pref = ifa->unique_id;
 
+	if (type == ICT_HOST && local_pref == ifa->unique_id
+			&& type_pref == ice_type_preference(ICT_HOST)
+			&& ps->component >= 1 && ps->component <= G_N_ELEMENTS(ifa->ice_candidate)
+			&& is_addr_unspecified(&flags->parsed_media_address))
+	{
+		chopper_append_str(chop, ifa->ice_candidate[ps->component - 1]);
+		chopper_append_printf(chop, "%u typ host\r\n", sfd->socket.local.port);
+		return;
+	}
+
 	priority = ice_priority_pref(type_pref, local_pref, ps->component);
 	chopper_append_c(chop, "a=candidate:");
 	chopper_append_str(chop, &ifa->ice_foundation);
@@ -2553,6 +2742,7 @@ next:
 	}
 
 	copy_remainder(chop);
+	chopper_flush(chop);
 	return 0;
 
 error:
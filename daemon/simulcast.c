@@ -0,0 +1,744 @@
+#include "simulcast.h"
+#include <glib.h>
+#include <string.h>
+#include <strings.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include "call.h"
+#include "call_interfaces.h"
+#include "codec.h"
+#include "media_socket.h"
+#include "rtplib.h"
+#include "rtcplib.h"
+#include "ssrc.h"
+#include "auxlib.h"
+#include "log.h"
+#include "log_funcs.h"
+
+
+#define RTCP_PT_SR	200
+#define RTCP_PT_RR	201
+#define RTCP_PT_RTPFB	205
+#define RTCP_PT_PSFB	206
+
+#define RTPFB_NACK	1
+#define RTPFB_TWCC	15
+#define PSFB_PLI	1
+#define PSFB_FIR	4
+#define PSFB_AFB	15
+
+#define SC_SELECT_INTERVAL	500000	// usec between layer selections
+#define SC_LAYER_TIMEOUT	1000000	// usec without packets until a layer is considered inactive
+#define SC_ESTIMATE_TIMEOUT	5000000	// usec until a bandwidth estimate is considered stale
+#define SC_PLI_INTERVAL		300000	// usec between key frame requests
+#define SC_UP_HEADROOM		120	// percent of a higher layer's rate needed to switch up
+
+
+enum sc_codec {
+	SC_CODEC_OTHER = 0,
+	SC_CODEC_VP8,
+	SC_CODEC_VP9,
+	SC_CODEC_H264,
+	SC_CODEC_H265,
+};
+
+struct sc_layer {
+	u_int32_t ssrc;
+	u_int32_t rtx; // or 0
+	uint64_t bytes; // since the last selection
+	uint64_t bps; // smoothed
+	struct timeval last_packet;
+};
+
+struct simulcast {
+	mutex_t lock;
+	struct call_media *media; // the sender of the layers
+
+	// set under call->master_lock in W
+	unsigned int num_layers;
+	struct sc_layer layers[SIMULCAST_LAYERS];
+	u_int32_t out_ssrc, out_rtx; // the first layer's, as announced to the receiver
+	enum sc_codec codecs[128]; // by payload type
+	unsigned int clock_rates[128];
+	const struct streamhandler *crypt_handler;
+	struct ssrc_ctx *pli_ssrc;
+
+	// everything below is protected by the lock
+	int cur, target; // layer indexes, -1 for none
+	uint16_t seq_off, rtx_seq_off;
+	u_int32_t ts_off;
+	uint16_t last_seq, last_rtx_seq;
+	u_int32_t last_ts;
+	struct timeval last_out;
+	int rtx_resync:1;
+
+	uint64_t remb_bps, loss_bps;
+	struct timeval remb_time, loss_time;
+	struct timeval last_select;
+	struct timeval last_pli;
+};
+
+struct sc_report_block {
+	u_int32_t ssrc;
+	unsigned char fraction_lost;
+	unsigned char number_lost[3];
+	u_int32_t high_seq_received;
+	u_int32_t jitter;
+	u_int32_t lsr;
+	u_int32_t dlsr;
+} __attribute__ ((packed));
+
+struct sc_fb_packet {
+	struct rtcp_packet rtcp;
+	u_int32_t media_ssrc;
+} __attribute__ ((packed));
+
+#define SC_SENDER_INFO_LEN 20
+
+
+
+static enum sc_codec sc_codec_type(const str *enc) {
+	if (enc->len == 3 && !strncasecmp(enc->s, "VP8", 3))
+		return SC_CODEC_VP8;
+	if (enc->len == 3 && !strncasecmp(enc->s, "VP9", 3))
+		return SC_CODEC_VP9;
+	if (enc->len == 4 && !strncasecmp(enc->s, "H264", 4))
+		return SC_CODEC_H264;
+	if (enc->len == 4 && !strncasecmp(enc->s, "H265", 4))
+		return SC_CODEC_H265;
+	return SC_CODEC_OTHER;
+}
+
+// returns the layer index, or -1 if the SSRC isn't part of the simulcast group
+static int sc_layer_find(const struct simulcast *sc, u_int32_t ssrc, int *rtx) {
+	for (unsigned int i = 0; i < sc->num_layers; i++) {
+		if (sc->layers[i].ssrc == ssrc) {
+			*rtx = 0;
+			return i;
+		}
+		if (sc->layers[i].rtx && sc->layers[i].rtx == ssrc) {
+			*rtx = 1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+// call->master_lock held in W
+void simulcast_update(struct call_media *media, const struct stream_params *sp,
+		const struct sdp_ng_flags *flags)
+{
+	struct simulcast *sc = media->simulcast;
+
+	if (!flags || !flags->sfu || media->type_id != MT_VIDEO || !proto_is_rtp(media->protocol)
+			|| sp->simulcast_layers < 2)
+	{
+		if (sc) {
+			ilog(LOG_INFO, "Disabling simulcast layer selection");
+			simulcast_free(&media->simulcast);
+		}
+		return;
+	}
+
+	if (!sc) {
+		sc = g_slice_alloc0(sizeof(*sc));
+		mutex_init(&sc->lock);
+		sc->media = media;
+		sc->cur = sc->target = -1;
+		u_int32_t ssrc = 0;
+		while (ssrc == 0)
+			ssrc = random();
+		sc->pli_ssrc = get_ssrc_ctx(ssrc, media->call->ssrc_hash, SSRC_DIR_OUTPUT, media->monologue);
+		call_mem_add(&media->call->mem[CALL_MEM_SSRC], sizeof(*sc));
+		media->simulcast = sc;
+	}
+
+	// keep the state of layers that remain the same
+	struct sc_layer old[SIMULCAST_LAYERS];
+	memcpy(old, sc->layers, sizeof(old));
+	unsigned int old_num = sc->num_layers;
+
+	sc->num_layers = sp->simulcast_layers;
+	for (unsigned int i = 0; i < sc->num_layers; i++) {
+		struct sc_layer *l = &sc->layers[i];
+		if (i < old_num && old[i].ssrc == sp->simulcast_ssrcs[i])
+			*l = old[i];
+		else
+			ZERO(*l);
+		l->ssrc = sp->simulcast_ssrcs[i];
+		l->rtx = sp->simulcast_rtx[i];
+	}
+	sc->out_ssrc = sc->layers[0].ssrc;
+	sc->out_rtx = sc->layers[0].rtx;
+	if (sc->cur >= 0 && ((unsigned int) sc->cur >= sc->num_layers || (unsigned int) sc->cur >= old_num
+				|| old[sc->cur].ssrc != sc->layers[sc->cur].ssrc))
+		sc->cur = sc->target = -1;
+
+	memset(sc->codecs, 0, sizeof(sc->codecs));
+	memset(sc->clock_rates, 0, sizeof(sc->clock_rates));
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, media->codecs_recv);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct rtp_payload_type *pt = value;
+		if (pt->payload_type < 0 || pt->payload_type >= 128)
+			continue;
+		sc->codecs[pt->payload_type] = sc_codec_type(&pt->encoding);
+		sc->clock_rates[pt->payload_type] = pt->clock_rate;
+	}
+
+	sc->crypt_handler = determine_handler(&transport_protocols[PROTO_RTP_AVP], media, 1);
+
+	ilog(LOG_INFO, "Selective forwarding of %u simulcast layers, forwarded as SSRC %" PRIx32,
+			sc->num_layers, sc->out_ssrc);
+
+	// layer selection happens in userspace
+	call_media_unkernelize(media);
+}
+
+void simulcast_free(struct simulcast **scp) {
+	struct simulcast *sc = *scp;
+	if (!sc)
+		return;
+	ssrc_ctx_put(&sc->pli_ssrc);
+	mutex_destroy(&sc->lock);
+	call_mem_add(&sc->media->call->mem[CALL_MEM_SSRC], -(ssize_t) sizeof(*sc));
+	g_slice_free1(sizeof(*sc), sc);
+	*scp = NULL;
+}
+
+
+// called for each new SSRC of the sender, to make all layers go out under the same SSRC
+void simulcast_ssrc_map(struct call_media *media, struct ssrc_ctx *ctx) {
+	struct simulcast *sc = media->simulcast;
+	int rtx;
+
+	if (sc_layer_find(sc, ctx->parent->h.ssrc, &rtx) < 0)
+		return;
+	ctx->ssrc_map_out = (rtx && sc->out_rtx) ? sc->out_rtx : sc->out_ssrc;
+}
+
+
+
+static int sc_vp8_keyframe(const unsigned char *p, size_t len) {
+	size_t off = 1;
+
+	if (len < 1)
+		return 0;
+	// start of partition 0
+	if (!(p[0] & 0x10) || (p[0] & 0x07))
+		return 0;
+	if (p[0] & 0x80) {
+		if (len < 2)
+			return 0;
+		unsigned char x = p[1];
+		off = 2;
+		if (x & 0x80) { // picture ID, 7 or 15 bits
+			if (len <= off)
+				return 0;
+			off += (p[off] & 0x80) ? 2 : 1;
+		}
+		if (x & 0x40) // TL0PICIDX
+			off++;
+		if (x & 0x30) // TID/KEYIDX
+			off++;
+	}
+	if (len <= off)
+		return 0;
+	// inverse key frame flag of the VP8 payload header
+	return !(p[off] & 0x01);
+}
+
+static int sc_vp9_keyframe(const unsigned char *p, size_t len) {
+	// not inter-picture predicted, and start of a frame
+	return len >= 1 && !(p[0] & 0x40) && (p[0] & 0x08);
+}
+
+static int sc_h264_nal_key(unsigned char type) {
+	return type == 5 || type == 7; // IDR or SPS
+}
+
+static int sc_h264_keyframe(const unsigned char *p, size_t len) {
+	if (len < 1)
+		return 0;
+	unsigned char type = p[0] & 0x1f;
+	if (sc_h264_nal_key(type))
+		return 1;
+	if (type == 24) { // STAP-A
+		size_t off = 1;
+		while (off + 2 < len) {
+			size_t size = (p[off] << 8) | p[off + 1];
+			off += 2;
+			if (sc_h264_nal_key(p[off] & 0x1f))
+				return 1;
+			off += size;
+		}
+		return 0;
+	}
+	if (type == 28) // FU-A, start of the fragmented NAL
+		return len >= 2 && (p[1] & 0x80) && sc_h264_nal_key(p[1] & 0x1f);
+	return 0;
+}
+
+static int sc_h265_nal_key(unsigned char type) {
+	return (type >= 16 && type <= 21) || type == 32; // IRAP or VPS
+}
+
+static int sc_h265_keyframe(const unsigned char *p, size_t len) {
+	if (len < 2)
+		return 0;
+	unsigned char type = (p[0] >> 1) & 0x3f;
+	if (sc_h265_nal_key(type))
+		return 1;
+	if (type == 48) { // aggregation packet
+		size_t off = 2;
+		while (off + 2 < len) {
+			size_t size = (p[off] << 8) | p[off + 1];
+			off += 2;
+			if (sc_h265_nal_key((p[off] >> 1) & 0x3f))
+				return 1;
+			off += size;
+		}
+		return 0;
+	}
+	if (type == 49) // fragmentation unit, start of the fragmented NAL
+		return len >= 3 && (p[2] & 0x80) && sc_h265_nal_key(p[2] & 0x3f);
+	return 0;
+}
+
+// layers are only switched on key frames. unknown codecs switch straight away
+static int sc_keyframe(const struct simulcast *sc, const struct media_packet *mp) {
+	const unsigned char *p = (const unsigned char *) mp->payload.s;
+	size_t len = mp->payload.len;
+
+	switch (sc->codecs[mp->rtp->m_pt & 0x7f]) {
+		case SC_CODEC_VP8:
+			return sc_vp8_keyframe(p, len);
+		case SC_CODEC_VP9:
+			return sc_vp9_keyframe(p, len);
+		case SC_CODEC_H264:
+			return sc_h264_keyframe(p, len);
+		case SC_CODEC_H265:
+			return sc_h265_keyframe(p, len);
+		default:
+			return 1;
+	}
+}
+
+
+
+// lock held
+static uint64_t sc_estimate(const struct simulcast *sc) {
+	uint64_t est = UINT64_MAX;
+
+	if (sc->remb_bps && timeval_diff(&rtpe_now, &sc->remb_time) < SC_ESTIMATE_TIMEOUT)
+		est = sc->remb_bps;
+	if (sc->loss_bps && timeval_diff(&rtpe_now, &sc->loss_time) < SC_ESTIMATE_TIMEOUT)
+		est = MIN(est, sc->loss_bps);
+
+	return est;
+}
+
+// lock held. updates the layer rates and picks the highest one that fits
+static void sc_select(struct simulcast *sc) {
+	long long elapsed = timeval_diff(&rtpe_now, &sc->last_select);
+	sc->last_select = rtpe_now;
+
+	for (unsigned int i = 0; i < sc->num_layers; i++) {
+		struct sc_layer *l = &sc->layers[i];
+		if (elapsed > 0 && elapsed < SC_LAYER_TIMEOUT * 10) {
+			uint64_t rate = l->bytes * 8 * 1000000 / elapsed;
+			l->bps = l->bps ? (l->bps * 3 + rate) / 4 : rate;
+		}
+		l->bytes = 0;
+	}
+
+	uint64_t est = sc_estimate(sc);
+	int want = -1;
+
+	for (unsigned int i = 0; i < sc->num_layers; i++) {
+		struct sc_layer *l = &sc->layers[i];
+		if (!l->last_packet.tv_sec || timeval_diff(&rtpe_now, &l->last_packet) > SC_LAYER_TIMEOUT)
+			continue;
+		// the lowest active layer is always forwarded
+		if (want == -1) {
+			want = i;
+			continue;
+		}
+		uint64_t need = l->bps;
+		if ((int) i > sc->cur)
+			need = need * SC_UP_HEADROOM / 100;
+		if (need <= est)
+			want = i;
+	}
+
+	if (want == -1 || want == sc->target)
+		return;
+
+	ilog(LOG_DEBUG, "Simulcast layer %i selected (estimate %" PRIu64 " bps, current layer %i)",
+			want, est, sc->cur);
+	sc->target = want;
+}
+
+
+// lock held
+static void sc_send_pli(struct simulcast *sc, struct media_packet *in_mp, u_int32_t media_ssrc) {
+	if (sc->last_pli.tv_sec && timeval_diff(&rtpe_now, &sc->last_pli) < SC_PLI_INTERVAL)
+		return;
+	sc->last_pli = rtpe_now;
+
+	struct call_media *media = sc->media;
+	if (!media->streams.head || !sc->crypt_handler || !sc->pli_ssrc)
+		return;
+
+	// RTCP goes to the sender's RTCP stream, same as our own reports
+	struct packet_stream *ps = media->streams.head->data;
+	if (!MEDIA_ISSET(media, RTCP_MUX) && media->streams.head->next) {
+		struct packet_stream *next_ps = media->streams.head->next->data;
+		if (PS_ISSET(next_ps, RTCP))
+			ps = next_ps;
+	}
+	if (!ps->selected_sfd || !ps->endpoint.address.family)
+		return;
+
+	ilog(LOG_DEBUG, "Requesting key frame for simulcast SSRC %" PRIx32, media_ssrc);
+
+	struct media_packet mp = {
+		.tv = rtpe_now,
+		.call = in_mp->call,
+		.media = media,
+		.media_out = media,
+		.ssrc_out = sc->pli_ssrc,
+	};
+
+	char *buf = codec_packet_buffer(sizeof(struct sc_fb_packet));
+	struct sc_fb_packet *pli = (void *) buf;
+	*pli = (struct sc_fb_packet) {
+		.rtcp = {
+			.header = {
+				.version = 2,
+				.count = PSFB_PLI,
+				.pt = RTCP_PT_PSFB,
+				.length = htons(sizeof(*pli) / 4 - 1),
+			},
+			.ssrc = htonl(sc->pli_ssrc->parent->h.ssrc),
+		},
+		.media_ssrc = htonl(media_ssrc),
+	};
+
+	struct codec_packet *pkt = codec_packet_new();
+	pkt->s.s = buf;
+	pkt->s.len = sizeof(*pli);
+	pkt->free_func = codec_packet_buffer_free;
+	pkt->ttq_entry.source = sc;
+	pkt->ttq_entry.when = rtpe_now;
+	pkt->ssrc_out = ssrc_ctx_get(sc->pli_ssrc);
+	g_queue_push_tail(&mp.packets_out, pkt);
+
+	media_packet_encrypt(sc->crypt_handler->out->rtcp_crypt, NULL, ps, &mp);
+
+	mutex_lock(&ps->out_lock);
+	if (media_socket_dequeue(&mp, ps))
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error sending simulcast key frame request");
+	mutex_unlock(&ps->out_lock);
+}
+
+
+// lock held. the packet is a key frame of the target layer
+static void sc_switch(struct simulcast *sc, struct media_packet *mp, int idx) {
+	uint16_t seq = ntohs(mp->rtp->seq_num);
+	u_int32_t ts = ntohl(mp->rtp->timestamp);
+
+	if (sc->cur >= 0) {
+		// continue where the previous layer left off, advancing the timestamp by
+		// the time that has passed since
+		long long elapsed = timeval_diff(&rtpe_now, &sc->last_out);
+		unsigned int clock_rate = sc->clock_rates[mp->rtp->m_pt & 0x7f] ? : 90000;
+		if (elapsed < 0)
+			elapsed = 0;
+		sc->seq_off = sc->last_seq + 1 - seq;
+		sc->ts_off = sc->last_ts + (u_int32_t) (elapsed * clock_rate / 1000000) - ts;
+	}
+	else
+		sc->seq_off = sc->ts_off = 0;
+
+	ilog(LOG_INFO, "Switching simulcast layer from %i to %i", sc->cur, idx);
+
+	sc->cur = idx;
+	sc->rtx_resync = 1;
+}
+
+// call is locked in R
+int simulcast_rtp(struct media_packet *mp) {
+	struct simulcast *sc = mp->media->simulcast;
+	int rtx, ret = 1;
+
+	if (!mp->rtp)
+		return 0;
+	int idx = sc_layer_find(sc, ntohl(mp->rtp->ssrc), &rtx);
+	if (idx < 0)
+		return 0;
+
+	mutex_lock(&sc->lock);
+
+	if (!rtx) {
+		struct sc_layer *l = &sc->layers[idx];
+		l->bytes += mp->raw.len;
+		l->last_packet = rtpe_now;
+	}
+	if (!sc->last_select.tv_sec || timeval_diff(&rtpe_now, &sc->last_select) >= SC_SELECT_INTERVAL)
+		sc_select(sc);
+
+	if (rtx) {
+		// retransmissions of the current layer only
+		if (idx != sc->cur || !sc->out_rtx)
+			goto out;
+
+		uint16_t seq = ntohs(mp->rtp->seq_num);
+		if (sc->rtx_resync) {
+			sc->rtx_seq_off = sc->last_rtx_seq + 1 - seq;
+			sc->rtx_resync = 0;
+		}
+		seq += sc->rtx_seq_off;
+		if ((int16_t) (seq - sc->last_rtx_seq) > 0)
+			sc->last_rtx_seq = seq;
+
+		mp->rtp->seq_num = htons(seq);
+		mp->rtp->timestamp = htonl(ntohl(mp->rtp->timestamp) + sc->ts_off);
+		mp->rtp->ssrc = htonl(sc->out_rtx);
+
+		// original sequence number
+		if (mp->payload.len >= 2) {
+			uint16_t osn;
+			memcpy(&osn, mp->payload.s, sizeof(osn));
+			osn = htons(ntohs(osn) + sc->seq_off);
+			memcpy(mp->payload.s, &osn, sizeof(osn));
+		}
+
+		ret = 0;
+		goto out;
+	}
+
+	if (idx != sc->cur) {
+		if (idx != sc->target)
+			goto out;
+		if (!sc_keyframe(sc, mp)) {
+			sc_send_pli(sc, mp, sc->layers[idx].ssrc);
+			goto out;
+		}
+		sc_switch(sc, mp, idx);
+	}
+
+	uint16_t seq = ntohs(mp->rtp->seq_num) + sc->seq_off;
+	u_int32_t ts = ntohl(mp->rtp->timestamp) + sc->ts_off;
+	mp->rtp->seq_num = htons(seq);
+	mp->rtp->timestamp = htonl(ts);
+	mp->rtp->ssrc = htonl(sc->out_ssrc);
+
+	if ((int16_t) (seq - sc->last_seq) > 0 || !sc->last_out.tv_sec) {
+		sc->last_seq = seq;
+		sc->last_ts = ts;
+		sc->last_out = rtpe_now;
+	}
+
+	ret = 0;
+
+out:
+	mutex_unlock(&sc->lock);
+	return ret;
+}
+
+
+
+// walks a compound RTCP packet and lets `func` rewrite each one in place. `func` returns
+// the new length of the packet, or 0 to remove it. returns the remaining length
+typedef size_t sc_rtcp_func(struct simulcast *, struct rtcp_packet *, size_t);
+
+static size_t sc_rtcp_walk(struct simulcast *sc, struct media_packet *mp, sc_rtcp_func *func) {
+	char *p = mp->raw.s;
+	char *end = p + mp->raw.len;
+	char *w = p;
+
+	while (p + sizeof(struct rtcp_packet) <= end) {
+		struct rtcp_packet *rp = (void *) p;
+		size_t len = (ntohs(rp->header.length) + 1) * 4;
+		if (p + len > end)
+			break;
+
+		size_t new_len = func(sc, rp, len);
+		if (new_len) {
+			rp->header.length = htons(new_len / 4 - 1);
+			if (w != p)
+				memmove(w, p, new_len);
+			w += new_len;
+		}
+		p += len;
+	}
+
+	// anything we couldn't parse stays as it is
+	if (w != p && p < end)
+		memmove(w, p, end - p);
+	w += end - p;
+
+	mp->raw.len = w - mp->raw.s;
+	return mp->raw.len;
+}
+
+// RTCP from the sender
+static size_t sc_rtcp_in(struct simulcast *sc, struct rtcp_packet *rp, size_t len) {
+	if (rp->header.pt != RTCP_PT_SR || len < sizeof(*rp) + SC_SENDER_INFO_LEN)
+		return len;
+
+	int rtx;
+	int idx = sc_layer_find(sc, ntohl(rp->ssrc), &rtx);
+	if (idx < 0)
+		return len;
+
+	if (idx == sc->cur && (!rtx || sc->out_rtx)) {
+		u_int32_t *ts = (void *) ((char *) rp + sizeof(*rp) + 8);
+		*ts = htonl(ntohl(*ts) + sc->ts_off);
+		rp->ssrc = htonl(rtx ? sc->out_rtx : sc->out_ssrc);
+		return len;
+	}
+
+	// the receiver doesn't know about other layers: keep only the report blocks
+	char *info = (char *) rp + sizeof(*rp);
+	memmove(info, info + SC_SENDER_INFO_LEN, len - sizeof(*rp) - SC_SENDER_INFO_LEN);
+	rp->header.pt = RTCP_PT_RR;
+	rp->ssrc = htonl(sc->out_ssrc);
+	return len - SC_SENDER_INFO_LEN;
+}
+
+// lock held
+static void sc_report_block(struct simulcast *sc, struct sc_report_block *rb) {
+	u_int32_t ssrc = ntohl(rb->ssrc);
+
+	if (sc->cur < 0)
+		return;
+	struct sc_layer *cur = &sc->layers[sc->cur];
+
+	if (ssrc == sc->out_rtx && cur->rtx) {
+		rb->ssrc = htonl(cur->rtx);
+		return;
+	}
+	if (ssrc != sc->out_ssrc)
+		return;
+
+	// loss based estimate
+	unsigned int lost = rb->fraction_lost;
+	if (lost > 26) // more than 10%
+		sc->loss_bps = cur->bps * (512 - lost) / 512;
+	else if (lost < 5) // less than 2%
+		sc->loss_bps = MAX(sc->loss_bps, cur->bps) * 108 / 100;
+	else if (!sc->loss_bps)
+		sc->loss_bps = cur->bps;
+	sc->loss_time = rtpe_now;
+
+	rb->ssrc = htonl(cur->ssrc);
+	u_int32_t high_seq = ntohl(rb->high_seq_received);
+	high_seq = (high_seq & 0xffff0000) | ((uint16_t) ((high_seq & 0xffff) - sc->seq_off));
+	rb->high_seq_received = htonl(high_seq);
+}
+
+// lock held. maps a feedback target SSRC back to the current layer
+static void sc_media_ssrc(struct simulcast *sc, u_int32_t *ssrcp) {
+	if (sc->cur < 0)
+		return;
+	if (ntohl(*ssrcp) == sc->out_ssrc)
+		*ssrcp = htonl(sc->layers[sc->cur].ssrc);
+}
+
+// RTCP from the receiver
+static size_t sc_rtcp_out(struct simulcast *sc, struct rtcp_packet *rp, size_t len) {
+	char *p = (char *) rp;
+
+	switch (rp->header.pt) {
+		case RTCP_PT_SR:
+		case RTCP_PT_RR: {
+			size_t off = sizeof(*rp) + (rp->header.pt == RTCP_PT_SR ? SC_SENDER_INFO_LEN : 0);
+			for (unsigned int i = 0; i < rp->header.count; i++) {
+				if (off + sizeof(struct sc_report_block) > len)
+					break;
+				sc_report_block(sc, (void *) (p + off));
+				off += sizeof(struct sc_report_block);
+			}
+			return len;
+		}
+
+		case RTCP_PT_PSFB: {
+			if (len < sizeof(struct sc_fb_packet))
+				return len;
+			struct sc_fb_packet *fb = (void *) rp;
+
+			if (rp->header.count == PSFB_PLI)
+				sc_media_ssrc(sc, &fb->media_ssrc);
+			else if (rp->header.count == PSFB_FIR) {
+				// FCI entries: SSRC, seq, reserved
+				for (size_t off = sizeof(*fb); off + 8 <= len; off += 8)
+					sc_media_ssrc(sc, (void *) (p + off));
+			}
+			else if (rp->header.count == PSFB_AFB && len >= sizeof(*fb) + 8
+					&& !memcmp(p + sizeof(*fb), "REMB", 4))
+			{
+				// num SSRCs, 6 bits exponent, 18 bits mantissa
+				const unsigned char *b = (void *) (p + sizeof(*fb) + 4);
+				unsigned int exp = b[1] >> 2;
+				uint64_t mantissa = ((b[1] & 0x03) << 16) | (b[2] << 8) | b[3];
+				sc->remb_bps = exp < 46 ? mantissa << exp : UINT64_MAX;
+				sc->remb_time = rtpe_now;
+				// consumed here: the sender's own estimate would be about a layer
+				// that it may not even be sending to this receiver
+				return 0;
+			}
+			return len;
+		}
+
+		case RTCP_PT_RTPFB: {
+			if (len < sizeof(struct sc_fb_packet))
+				return len;
+			struct sc_fb_packet *fb = (void *) rp;
+
+			if (rp->header.count == RTPFB_TWCC)
+				return 0; // transport-wide sequence numbers don't survive the layer switches
+			if (rp->header.count != RTPFB_NACK || ntohl(fb->media_ssrc) != sc->out_ssrc)
+				return len;
+			if (sc->cur < 0)
+				return len;
+
+			sc_media_ssrc(sc, &fb->media_ssrc);
+			// FCI entries: packet ID, bitmask of following lost packets
+			for (size_t off = sizeof(*fb); off + 4 <= len; off += 4) {
+				uint16_t pid;
+				memcpy(&pid, p + off, sizeof(pid));
+				pid = htons(ntohs(pid) - sc->seq_off);
+				memcpy(p + off, &pid, sizeof(pid));
+			}
+			return len;
+		}
+	}
+
+	return len;
+}
+
+// call is locked in R
+int simulcast_rtcp_in(struct media_packet *mp) {
+	struct simulcast *sc = mp->media->simulcast;
+
+	mutex_lock(&sc->lock);
+	size_t len = sc_rtcp_walk(sc, mp, sc_rtcp_in);
+	mutex_unlock(&sc->lock);
+
+	return len ? 0 : 1;
+}
+
+// call is locked in R
+int simulcast_rtcp_out(struct media_packet *mp) {
+	struct simulcast *sc = mp->media_out->simulcast;
+
+	mutex_lock(&sc->lock);
+	size_t len = sc_rtcp_walk(sc, mp, sc_rtcp_out);
+	mutex_unlock(&sc->lock);
+
+	return len ? 0 : 1;
+}
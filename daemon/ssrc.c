@@ -36,21 +36,10 @@ static void add_ssrc_entry(u_int32_t ssrc, struct ssrc_entry *ent, struct ssrc_h
 	obj_hold(ent); // HT entry
 	g_queue_push_tail(&ht->q, ent);
 	obj_hold(ent); // queue entry
-}
-static void free_sender_report(struct ssrc_sender_report_item *i) {
-	g_slice_free1(sizeof(*i), i);
-}
-static void free_rr_time(struct ssrc_rr_time_item *i) {
-	g_slice_free1(sizeof(*i), i);
-}
-static void free_stats_block(struct ssrc_stats_block *ssb) {
-	g_slice_free1(sizeof(*ssb), ssb);
+	call_mem_add(ht->mem, ent->obj.size);
 }
 static void __free_ssrc_entry_call(void *ep) {
 	struct ssrc_entry_call *e = ep;
-	g_queue_clear_full(&e->sender_reports, (GDestroyNotify) free_sender_report);
-	g_queue_clear_full(&e->rr_time_reports, (GDestroyNotify) free_rr_time);
-	g_queue_clear_full(&e->stats_blocks, (GDestroyNotify) free_stats_block);
 	packet_sequencer_destroy(&e->sequencer);
 }
 static void ssrc_entry_put(void *ep) {
@@ -77,21 +66,93 @@ static void mos_calc(struct ssrc_stats_block *ssb) {
 	ssb->mos = intmos;
 }
 
-static struct ssrc_entry *find_ssrc(u_int32_t ssrc, struct ssrc_hash *ht) {
-	rwlock_lock_r(&ht->lock);
-	struct ssrc_entry *ret = g_atomic_pointer_get(&ht->cache);
-	if (!ret || ret->ssrc != ssrc) {
-		ret = g_hash_table_lookup(ht->ht, &ssrc);
-		if (ret) {
-			obj_hold(ret);
-			// cache shares the reference from ht
-			g_atomic_pointer_set(&ht->cache, ret);
-			ret->last_used = rtpe_now.tv_sec;
-		}
+#define __STATS_MIN_MAX(field) \
+	do { \
+		if (ssb->field < e->min_stats.field) \
+			e->min_stats.field = ssb->field; \
+		if (ssb->field > e->max_stats.field) \
+			e->max_stats.field = ssb->field; \
+	} while (0)
+
+// entry must be locked
+static void ssrc_stats_block_add(struct ssrc_entry_call *e, const struct ssrc_stats_block *ssb) {
+	if (G_UNLIKELY(!e->num_stats_blocks)) {
+		e->lowest_mos = e->highest_mos = *ssb;
+		e->min_stats = e->max_stats = *ssb;
 	}
 	else {
+		if (ssb->mos < e->lowest_mos.mos)
+			e->lowest_mos = *ssb;
+		if (ssb->mos > e->highest_mos.mos)
+			e->highest_mos = *ssb;
+		__STATS_MIN_MAX(jitter);
+		__STATS_MIN_MAX(rtt);
+		__STATS_MIN_MAX(rtt_leg);
+		__STATS_MIN_MAX(packetloss);
+		__STATS_MIN_MAX(mos);
+	}
+
+	// running tally
+	e->average_mos.jitter += ssb->jitter;
+	e->average_mos.rtt += ssb->rtt;
+	e->average_mos.rtt_leg += ssb->rtt_leg;
+	e->average_mos.packetloss += ssb->packetloss;
+	e->average_mos.mos += ssb->mos;
+
+	e->mos_histogram[MIN(ssb->mos, SSRC_MOS_BUCKETS - 1)]++;
+
+	e->recent_stats[e->recent_stats_idx] = *ssb;
+	e->recent_stats_idx = (e->recent_stats_idx + 1) % SSRC_RECENT_STATS;
+
+	e->num_stats_blocks++;
+}
+
+INLINE void ssrc_entry_touch(struct ssrc_entry *ent) {
+	// avoid dirtying the cache line for every packet
+	if (ent->last_used != rtpe_now.tv_sec)
+		ent->last_used = rtpe_now.tv_sec;
+}
+
+// lock-free, see struct ssrc_hash
+static struct ssrc_entry *find_ssrc_fast(u_int32_t ssrc, struct ssrc_hash *ht) {
+	for (unsigned int i = 0; i < SSRC_HASH_FAST_SLOTS; i++) {
+		struct ssrc_entry *ent = g_atomic_pointer_get(
+				&ht->fast[(ssrc + i) % SSRC_HASH_FAST_SLOTS]);
+		// slots are filled in probe order and never emptied
+		if (!ent)
+			return NULL;
+		if (ent->ssrc == ssrc) {
+			obj_hold(ent);
+			ssrc_entry_touch(ent);
+			return ent;
+		}
+	}
+	return NULL;
+}
+
+// write lock must be held
+static void ssrc_fast_insert(struct ssrc_entry *ent, struct ssrc_hash *ht) {
+	for (unsigned int i = 0; i < SSRC_HASH_FAST_SLOTS; i++) {
+		struct ssrc_entry **slot = &ht->fast[(ent->ssrc + i) % SSRC_HASH_FAST_SLOTS];
+		if (*slot)
+			continue;
+		ent->pinned = 1;
+		obj_hold(ent); // fast slot entry
+		g_atomic_pointer_set(slot, ent);
+		return;
+	}
+}
+
+static struct ssrc_entry *find_ssrc(u_int32_t ssrc, struct ssrc_hash *ht) {
+	struct ssrc_entry *ret = find_ssrc_fast(ssrc, ht);
+	if (G_LIKELY(ret))
+		return ret;
+
+	rwlock_lock_r(&ht->lock);
+	ret = g_hash_table_lookup(ht->ht, &ssrc);
+	if (ret) {
 		obj_hold(ret);
-		ret->last_used = rtpe_now.tv_sec;
+		ssrc_entry_touch(ret);
 	}
 	rwlock_unlock_r(&ht->lock);
 	return ret;
@@ -136,11 +197,16 @@ restart:
 
 	while (G_UNLIKELY(ht->q.length > 20)) { // arbitrary limit
 		g_queue_sort(&ht->q, ssrc_time_cmp, NULL);
-		struct ssrc_entry *old_ent = g_queue_pop_head(&ht->q);
+		// pinned entries stay, there are fewer of them than the limit
+		GList *l = ht->q.head;
+		while (((struct ssrc_entry *) l->data)->pinned)
+			l = l->next;
+		struct ssrc_entry *old_ent = l->data;
+		g_queue_delete_link(&ht->q, l);
 		ilog(LOG_DEBUG, "SSRC hash table exceeded size limit (trying to add %s%x%s) - "
 				"deleting SSRC %s%x%s",
 				FMT_M(ssrc), FMT_M(old_ent->ssrc));
-		g_atomic_pointer_set(&ht->cache, NULL);
+		call_mem_add(ht->mem, -(ssize_t) old_ent->obj.size);
 		g_hash_table_remove(ht->ht, &old_ent->ssrc); // does obj_put
 		obj_put(old_ent); // for the queue entry
 	}
@@ -154,7 +220,7 @@ restart:
 		goto restart;
 	}
 	add_ssrc_entry(ssrc, ent, ht);
-	g_atomic_pointer_set(&ht->cache, ent);
+	ssrc_fast_insert(ent, ht);
 	rwlock_unlock_w(&ht->lock);
 //	if (created)
 //		*created = 1;
@@ -172,7 +238,13 @@ void free_ssrc_hash(struct ssrc_hash **ht) {
 	if (!*ht)
 		return;
 	g_hash_table_destroy((*ht)->ht);
+	for (GList *l = (*ht)->q.head; l; l = l->next)
+		call_mem_add((*ht)->mem, -(ssize_t) ((struct ssrc_entry *) l->data)->obj.size);
 	g_queue_clear_full(&(*ht)->q, ssrc_entry_put);
+	for (unsigned int i = 0; i < SSRC_HASH_FAST_SLOTS; i++) {
+		if ((*ht)->fast[i])
+			obj_put((*ht)->fast[i]);
+	}
 	if ((*ht)->precreat)
 		obj_put((struct ssrc_entry *) (*ht)->precreat);
 	g_slice_free1(sizeof(**ht), *ht);
@@ -216,39 +288,37 @@ struct ssrc_ctx *get_ssrc_ctx(u_int32_t ssrc, struct ssrc_hash *ht, enum ssrc_di
 
 
 
-static void *__do_time_report_item(struct call_media *m, size_t struct_size, size_t reports_queue_offset,
+static struct ssrc_time_item *__do_time_report_item(struct call_media *m, size_t ring_offset,
 		const struct timeval *tv, u_int32_t ssrc, u_int32_t ntp_msw, u_int32_t ntp_lsw,
-		GDestroyNotify free_func, struct ssrc_entry **e_p)
+		struct ssrc_entry **e_p)
 {
 	struct call *c = m->call;
 	struct ssrc_entry *e;
-	struct ssrc_time_item *sti;
-
-	sti = g_slice_alloc0(struct_size);
-	sti->received = *tv;
-	sti->ntp_middle_bits = ntp_msw << 16 | ntp_lsw >> 16;
-	sti->ntp_ts = ntp_ts_to_double(ntp_msw, ntp_lsw);
 
 	e = get_ssrc(ssrc, c->ssrc_hash);
-	if (G_UNLIKELY(!e)) {
-		free_func(sti);
+	if (G_UNLIKELY(!e))
 		return NULL;
-	}
 
 	mutex_lock(&e->lock);
 
-	GQueue *q = (((void *) e) + reports_queue_offset);
+	struct ssrc_time_ring *r = (((void *) e) + ring_offset);
+
+	// overwrite the oldest entry once the ring is full
+	struct ssrc_time_item *sti = &r->items[r->idx];
+	r->idx = (r->idx + 1) % SSRC_TIME_REPORTS;
+	if (r->len < SSRC_TIME_REPORTS)
+		r->len++;
 
-	g_queue_push_tail(q, sti);
-	while (q->length > 10)
-		free_func(g_queue_pop_head(q));
+	sti->received = *tv;
+	sti->ntp_middle_bits = ntp_msw << 16 | ntp_lsw >> 16;
+	sti->ntp_ts = ntp_ts_to_double(ntp_msw, ntp_lsw);
 
 	*e_p = e;
 	return sti;
 }
 
 static long long __calc_rtt(struct call *c, u_int32_t ssrc, u_int32_t ntp_middle_bits,
-		u_int32_t delay, size_t reports_queue_offset, const struct timeval *tv, int *pt_p)
+		u_int32_t delay, size_t ring_offset, const struct timeval *tv, int *pt_p)
 {
 	if (pt_p)
 		*pt_p = -1;
@@ -264,11 +334,11 @@ static long long __calc_rtt(struct call *c, u_int32_t ssrc, u_int32_t ntp_middle
 		*pt_p = e->output_ctx.tracker.most[0] == 255 ? -1 : e->output_ctx.tracker.most[0];
 
 	struct ssrc_time_item *sti;
-	GQueue *q = (((void *) e) + reports_queue_offset);
+	struct ssrc_time_ring *r = (((void *) e) + ring_offset);
 	mutex_lock(&e->h.lock);
-	// go through the list backwards until we find the SR referenced
-	for (GList *l = q->tail; l; l = l->prev) {
-		sti = l->data;
+	// go through the ring backwards until we find the SR referenced
+	for (unsigned int i = 1; i <= r->len; i++) {
+		sti = &r->items[(r->idx + SSRC_TIME_REPORTS - i) % SSRC_TIME_REPORTS];
 		if (sti->ntp_middle_bits != ntp_middle_bits)
 			continue;
 		goto found;
@@ -304,17 +374,15 @@ void ssrc_sender_report(struct call_media *m, const struct ssrc_sender_report *s
 		const struct timeval *tv)
 {
 	struct ssrc_entry *e;
-	struct ssrc_sender_report_item *seri = __do_time_report_item(m, sizeof(*seri),
+	struct ssrc_time_item *sti = __do_time_report_item(m,
 			G_STRUCT_OFFSET(struct ssrc_entry_call, sender_reports), tv, sr->ssrc,
-			sr->ntp_msw, sr->ntp_lsw, (GDestroyNotify) free_sender_report, &e);
-	if (!seri)
+			sr->ntp_msw, sr->ntp_lsw, &e);
+	if (!sti)
 		return;
 
-	seri->report = *sr;
-
 	ilog(LOG_DEBUG, "SR from %s%x%s: RTP TS %u PC %u OC %u NTP TS %u/%u=%f",
 			FMT_M(sr->ssrc), sr->timestamp, sr->packet_count, sr->octet_count,
-			sr->ntp_msw, sr->ntp_lsw, seri->time_item.ntp_ts);
+			sr->ntp_msw, sr->ntp_lsw, sti->ntp_ts);
 
 	mutex_unlock(&e->lock);
 	obj_put(e);
@@ -353,8 +421,7 @@ void ssrc_receiver_report(struct call_media *m, const struct ssrc_receiver_repor
 
 	ilog(LOG_DEBUG, "Adding opposide side RTT of %u us", other_e->last_rtt);
 
-	struct ssrc_stats_block *ssb = g_slice_alloc(sizeof(*ssb));
-	*ssb = (struct ssrc_stats_block) {
+	struct ssrc_stats_block ssb = {
 		.jitter = jitter,
 		.rtt = rtt + other_e->last_rtt,
 		.rtt_leg = rtt,
@@ -362,34 +429,21 @@ void ssrc_receiver_report(struct call_media *m, const struct ssrc_receiver_repor
 		.packetloss = (unsigned int) rr->fraction_lost * 100 / 256,
 	};
 
-	mos_calc(ssb);
-	ilog(LOG_DEBUG, "Calculated MOS from RR for %s%x%s is %.1f", FMT_M(rr->from), (double) ssb->mos / 10.0);
+	mos_calc(&ssb);
+	ilog(LOG_DEBUG, "Calculated MOS from RR for %s%x%s is %.1f", FMT_M(rr->from), (double) ssb.mos / 10.0);
 
 	// got a new stats block, add it to reporting ssrc
 	mutex_lock(&other_e->h.lock);
 
 	// discard stats block if last has been received less than a second ago
-	if (G_LIKELY(other_e->stats_blocks.length > 0)) {
-		struct ssrc_stats_block *last_ssb = g_queue_peek_tail(&other_e->stats_blocks);
-		if (G_UNLIKELY(timeval_diff(tv, &last_ssb->reported) < 1000000)) {
-			free_stats_block(ssb);
+	if (G_LIKELY(other_e->num_stats_blocks > 0)) {
+		struct ssrc_stats_block *last_ssb = ssrc_recent_stats(other_e,
+				MIN(other_e->num_stats_blocks, SSRC_RECENT_STATS) - 1);
+		if (G_UNLIKELY(timeval_diff(tv, &last_ssb->reported) < 1000000))
 			goto out_ul_oe;
-		}
 	}
 
-	g_queue_push_tail(&other_e->stats_blocks, ssb);
-
-	if (G_UNLIKELY(!other_e->lowest_mos) || ssb->mos < other_e->lowest_mos->mos)
-		other_e->lowest_mos = ssb;
-	if (G_UNLIKELY(!other_e->highest_mos) || ssb->mos > other_e->highest_mos->mos)
-		other_e->highest_mos = ssb;
-
-	// running tally
-	other_e->average_mos.jitter += ssb->jitter;
-	other_e->average_mos.rtt += ssb->rtt;
-	other_e->average_mos.rtt_leg += ssb->rtt_leg;
-	other_e->average_mos.packetloss += ssb->packetloss;
-	other_e->average_mos.mos += ssb->mos;
+	ssrc_stats_block_add(other_e, &ssb);
 
 	goto out_ul_oe;
 
@@ -407,15 +461,15 @@ void ssrc_receiver_rr_time(struct call_media *m, const struct ssrc_xr_rr_time *r
 		const struct timeval *tv)
 {
 	struct ssrc_entry *e;
-	struct ssrc_rr_time_item *srti = __do_time_report_item(m, sizeof(*srti),
+	struct ssrc_time_item *sti = __do_time_report_item(m,
 			G_STRUCT_OFFSET(struct ssrc_entry_call, rr_time_reports), tv, rr->ssrc,
-			rr->ntp_msw, rr->ntp_lsw, (GDestroyNotify) free_rr_time, &e);
-	if (!srti)
+			rr->ntp_msw, rr->ntp_lsw, &e);
+	if (!sti)
 		return;
 
 	ilog(LOG_DEBUG, "XR RR TIME from %s%x%s: NTP TS %u/%u=%f",
 			FMT_M(rr->ssrc),
-			rr->ntp_msw, rr->ntp_lsw, srti->time_item.ntp_ts);
+			rr->ntp_msw, rr->ntp_lsw, sti->ntp_ts);
 
 	mutex_unlock(&e->lock);
 	obj_put(e);
@@ -1,8 +1,14 @@
 #include "call.h"
+#include <inttypes.h>
 #include "statistics.h"
 #include "graphite.h"
 #include "main.h"
 #include "control_ng.h"
+#include "poller.h"
+#include "homer.h"
+#include "redis.h"
+#include "load.h"
+#include "dtmf.h"
 
 
 struct totalstats       rtpe_totalstats;
@@ -14,33 +20,191 @@ struct totalstats       rtpe_totalstats_lastinterval;
 mutex_t rtpe_codec_stats_lock;
 GHashTable *rtpe_codec_stats;
 
+__thread struct totalstats_block *rtpe_totalstats_local;
+volatile unsigned int rtpe_totalstats_epoch;
+struct latency_histogram rtpe_redis_write_latency;
+struct latency_histogram rtpe_dtls_handshake_latency;
+static mutex_t totalstats_blocks_lock;
+static GQueue totalstats_blocks = G_QUEUE_INIT;
+
+
+static const char *packet_latency_names[__PKT_LAT_LAST] = {
+	[PKT_LAT_PASSTHROUGH]	= "passthrough",
+	[PKT_LAT_DECRYPT]	= "decrypt",
+	[PKT_LAT_TRANSCODE]	= "transcode",
+	[PKT_LAT_JITTER_BUFFER]	= "jitter_buffer",
+};
+
+static const char *wakeup_latency_names[__WAKE_LAT_LAST] = {
+	[WAKE_LAT_EPOLL]	= "epoll",
+	[WAKE_LAT_BUSY]		= "busy_poll",
+};
+static const char *wakeup_latency_short[__WAKE_LAT_LAST] = {
+	[WAKE_LAT_EPOLL]	= "wakeupepoll",
+	[WAKE_LAT_BUSY]		= "wakeupbusypoll",
+};
+
+// returns the upper bound of the bucket
+static unsigned long latency_bucket_max(unsigned int idx) {
+	if (idx < 4)
+		return idx;
+	unsigned int l = idx / 4 + 1;
+	unsigned long sub = idx % 4;
+	return ((4 + sub + 1) << (l - 2)) - 1;
+}
+
+unsigned long latency_histogram_percentile(const struct latency_histogram *h, unsigned int pct) {
+	unsigned int counts[LATENCY_BUCKETS];
+	uint64_t total = 0;
+
+	for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+		counts[i] = g_atomic_int_get(&h->buckets[i]);
+		total += counts[i];
+	}
+	if (!total)
+		return 0;
+
+	uint64_t target = (total * pct + 99) / 100;
+	uint64_t sum = 0;
+	for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+		sum += counts[i];
+		if (sum >= target)
+			return latency_bucket_max(i);
+	}
+	return latency_bucket_max(LATENCY_BUCKETS - 1);
+}
+
+// called once per packet, so this goes into the thread's own block without atomic ops
+void statistics_packet_latency(enum packet_latency_type type, const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ns = (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+	if (ns < 0)
+		ns = 0;
+	totalstats_block()->packet_latency[type].buckets[latency_bucket(ns)]++;
+}
+
+// rx is the SO_TIMESTAMP of the packet, which is in wall clock time
+void statistics_wakeup_latency(const struct timeval *rx) {
+	if (!rx->tv_sec)
+		return;
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long us = (now.tv_sec - rx->tv_sec) * 1000000L + (now.tv_nsec / 1000 - rx->tv_usec);
+	if (us < 0)
+		us = 0;
+	enum wakeup_latency_type type = poller_thread_busy ? WAKE_LAT_BUSY : WAKE_LAT_EPOLL;
+	totalstats_block()->wakeup_latency[type].buckets[latency_bucket(us)]++;
+}
+
+// from the receive timestamp of a packet to the transmit timestamp of the packet it was
+// relayed as, see stream_fd_tx_timestamps()
+void statistics_relay_latency(unsigned long us) {
+	totalstats_block()->relay_latency.buckets[latency_bucket(us)]++;
+}
 
-static void timeval_totalstats_average_add(struct totalstats *s, const struct timeval *add) {
-	struct timeval dp, oa;
+struct totalstats_block *__totalstats_block_new(void) {
+	struct totalstats_block *b;
 
-	mutex_lock(&s->total_average_lock);
+	if (posix_memalign((void **) &b, 64, sizeof(*b)))
+		abort();
+	memset(b, 0, sizeof(*b));
 
-	// new average = ((old average * old num sessions) + datapoint) / new num sessions
-	// ... but this will overflow when num sessions becomes very large
+	mutex_lock(&totalstats_blocks_lock);
+	g_queue_push_tail(&totalstats_blocks, b);
+	mutex_unlock(&totalstats_blocks_lock);
 
-	// timeval_multiply(&t, &s->total_average_call_dur, s->total_managed_sess);
-	// timeval_add(&t, &t, add);
-	// s->total_managed_sess++;
-	// timeval_divide(&s->total_average_call_dur, &t, s->total_managed_sess);
+	return b;
+}
+
+#define TOTALSTATS_SUM(f) atomic64_add_na(&out->f, atomic64_get(&b->f))
+#define TOTALSTATS_SUM_REQ(r) \
+	do { \
+		TOTALSTATS_SUM(r.count); \
+		TOTALSTATS_SUM(r.time_sum); \
+		if (b->epoch != epoch) \
+			break; \
+		u_int64_t min = atomic64_get(&b->r.time_min), max = atomic64_get(&b->r.time_max); \
+		if (min && (!atomic64_get_na(&out->r.time_min) || min < atomic64_get_na(&out->r.time_min))) \
+			atomic64_set_na(&out->r.time_min, min); \
+		if (max > atomic64_get_na(&out->r.time_max)) \
+			atomic64_set_na(&out->r.time_max, max); \
+	} while (0)
+
+// min/max request times are taken only from blocks updated in the current epoch
+void statistics_sum_totals(struct totalstats_block *out) {
+	unsigned int epoch = g_atomic_int_get(&rtpe_totalstats_epoch);
+
+	ZERO(*out);
+	out->epoch = epoch;
+
+	mutex_lock(&totalstats_blocks_lock);
+	for (GList *l = totalstats_blocks.head; l; l = l->next) {
+		struct totalstats_block *b = l->data;
+		TOTALSTATS_SUM(total_timeout_sess);
+		TOTALSTATS_SUM(total_foreign_sessions);
+		TOTALSTATS_SUM(total_rejected_sess);
+		TOTALSTATS_SUM(total_silent_timeout_sess);
+		TOTALSTATS_SUM(total_offer_timeout_sess);
+		TOTALSTATS_SUM(total_final_timeout_sess);
+		TOTALSTATS_SUM(total_regular_term_sess);
+		TOTALSTATS_SUM(total_forced_term_sess);
+		TOTALSTATS_SUM(total_relayed_packets);
+		TOTALSTATS_SUM(total_relayed_errors);
+		TOTALSTATS_SUM(total_relayed_bytes);
+		TOTALSTATS_SUM(total_nopacket_relayed_sess);
+		TOTALSTATS_SUM(total_oneway_stream_sess);
+		TOTALSTATS_SUM(total_managed_sess);
+		TOTALSTATS_SUM(total_sess_duration);
+		TOTALSTATS_SUM(total_calls_duration_interval);
+		TOTALSTATS_SUM(total_dtls_handshakes);
+		TOTALSTATS_SUM(total_dtls_resumed);
+		TOTALSTATS_SUM_REQ(offer);
+		TOTALSTATS_SUM_REQ(answer);
+		TOTALSTATS_SUM_REQ(delete);
+		for (unsigned int i = 0; i < __PKT_LAT_LAST; i++) {
+			for (unsigned int j = 0; j < LATENCY_BUCKETS; j++)
+				out->packet_latency[i].buckets[j] += b->packet_latency[i].buckets[j];
+		}
+		for (unsigned int i = 0; i < __WAKE_LAT_LAST; i++) {
+			for (unsigned int j = 0; j < LATENCY_BUCKETS; j++)
+				out->wakeup_latency[i].buckets[j] += b->wakeup_latency[i].buckets[j];
+		}
+		for (unsigned int j = 0; j < LATENCY_BUCKETS; j++)
+			out->relay_latency.buckets[j] += b->relay_latency.buckets[j];
+	}
+	mutex_unlock(&totalstats_blocks_lock);
+}
 
-	// alternative:
-	// new average = old average + (datapoint / new num sessions) - (old average / new num sessions)
+void statistics_update_request_time(struct request_counters *r, const struct timeval *diff) {
+	struct totalstats_block *b = totalstats_block();
+	unsigned int epoch = g_atomic_int_get(&rtpe_totalstats_epoch);
+	u_int64_t us = timeval_us(diff);
+
+	if (b->epoch != epoch) {
+		// new graphite interval: all min/max values of this thread are stale
+		atomic64_set(&b->offer.time_min, 0);
+		atomic64_set(&b->offer.time_max, 0);
+		atomic64_set(&b->answer.time_min, 0);
+		atomic64_set(&b->answer.time_max, 0);
+		atomic64_set(&b->delete.time_min, 0);
+		atomic64_set(&b->delete.time_max, 0);
+		b->epoch = epoch;
+	}
 
-	s->total_managed_sess++;
-	timeval_divide(&dp, add, s->total_managed_sess);
-	timeval_divide(&oa, &s->total_average_call_dur, s->total_managed_sess);
-	timeval_add(&s->total_average_call_dur, &s->total_average_call_dur, &dp);
-	timeval_subtract(&s->total_average_call_dur, &s->total_average_call_dur, &oa);
+	if (!atomic64_get_na(&r->time_min) || us < atomic64_get_na(&r->time_min))
+		atomic64_set(&r->time_min, us);
+	if (us > atomic64_get_na(&r->time_max))
+		atomic64_set(&r->time_max, us);
+	atomic64_add_na(&r->time_sum, us);
+	atomic64_add_na(&r->count, 1);
+}
 
-	mutex_unlock(&s->total_average_lock);
+void statistics_update_calls_duration(const struct timeval *add) {
+	TOTALSTATS_ADD(total_calls_duration_interval, timeval_us(add));
 }
 
-static void timeval_totalstats_call_duration_add(struct totalstats *s,
+static void timeval_totalstats_call_duration_add(
 		struct timeval *call_start, struct timeval *call_stop,
 		struct timeval *interval_start, int interval_dur_s) {
 
@@ -75,26 +239,14 @@ static void timeval_totalstats_call_duration_add(struct totalstats *s,
 
 	timeval_subtract(&call_duration, call_stop, call_start_in_iv);
 
-	mutex_lock(&s->total_calls_duration_lock);
-	timeval_add(&s->total_calls_duration_interval,
-			&s->total_calls_duration_interval, &call_duration);
-	mutex_unlock(&s->total_calls_duration_lock);
+	statistics_update_calls_duration(&call_duration);
 }
 
 
 void statistics_update_totals(struct packet_stream *ps) {
-	atomic64_add(&rtpe_totalstats.total_relayed_packets,
-			atomic64_get(&ps->stats.packets));
-	atomic64_add(&rtpe_totalstats_interval.total_relayed_packets,
-		atomic64_get(&ps->stats.packets));
-	atomic64_add(&rtpe_totalstats.total_relayed_errors,
-		atomic64_get(&ps->stats.errors));
-	atomic64_add(&rtpe_totalstats_interval.total_relayed_errors,
-		atomic64_get(&ps->stats.errors));
-	atomic64_add(&rtpe_totalstats.total_relayed_bytes,
-		atomic64_get(&ps->stats.bytes));
-	atomic64_add(&rtpe_totalstats_interval.total_relayed_bytes,
-		atomic64_get(&ps->stats.bytes));
+	TOTALSTATS_ADD(total_relayed_packets, atomic64_get(&ps->stats.packets));
+	TOTALSTATS_ADD(total_relayed_errors, atomic64_get(&ps->stats.errors));
+	TOTALSTATS_ADD(total_relayed_bytes, atomic64_get(&ps->stats.bytes));
 }
 
 void statistics_update_foreignown_dec(struct call* c) {
@@ -105,7 +257,7 @@ void statistics_update_foreignown_dec(struct call* c) {
 	if(IS_OWN_CALL(c)) 	{
 		mutex_lock(&rtpe_totalstats_interval.managed_sess_lock);
 		rtpe_totalstats_interval.managed_sess_min = MIN(rtpe_totalstats_interval.managed_sess_min,
-				g_hash_table_size(rtpe_callhash) - atomic64_get(&rtpe_stats.foreign_sessions));
+				atomic64_get(&rtpe_callhash_size) - atomic64_get(&rtpe_stats.foreign_sessions));
 		mutex_unlock(&rtpe_totalstats_interval.managed_sess_lock);
 	}
 
@@ -116,13 +268,13 @@ void statistics_update_foreignown_inc(struct call* c) {
 		mutex_lock(&rtpe_totalstats_interval.managed_sess_lock);
 		rtpe_totalstats_interval.managed_sess_max = MAX(
 				rtpe_totalstats_interval.managed_sess_max,
-				g_hash_table_size(rtpe_callhash)
+				atomic64_get(&rtpe_callhash_size)
 						- atomic64_get(&rtpe_stats.foreign_sessions));
 		mutex_unlock(&rtpe_totalstats_interval.managed_sess_lock);
 	}
 	else if (IS_FOREIGN_CALL(c)) { /* foreign call*/
 		atomic64_inc(&rtpe_stats.foreign_sessions);
-		atomic64_inc(&rtpe_totalstats.total_foreign_sessions);
+		TOTALSTATS_INC(total_foreign_sessions);
 	}
 
 }
@@ -182,8 +334,7 @@ void statistics_update_oneway(struct call* c) {
 		if (ps && ps2 && atomic64_get(&ps2->stats.packets)==0) {
 			if (atomic64_get(&ps->stats.packets)!=0 && IS_OWN_CALL(c)){
 				if (atomic64_get(&ps->stats.packets)!=0) {
-					atomic64_inc(&rtpe_totalstats.total_oneway_stream_sess);
-					atomic64_inc(&rtpe_totalstats_interval.total_oneway_stream_sess);
+					TOTALSTATS_INC(total_oneway_stream_sess);
 				}
 			}
 			else {
@@ -193,8 +344,7 @@ void statistics_update_oneway(struct call* c) {
 	}
 
 	if (IS_OWN_CALL(c)) {
-		atomic64_add(&rtpe_totalstats.total_nopacket_relayed_sess, total_nopacket_relayed_sess / 2);
-		atomic64_add(&rtpe_totalstats_interval.total_nopacket_relayed_sess, total_nopacket_relayed_sess / 2);
+		TOTALSTATS_ADD(total_nopacket_relayed_sess, total_nopacket_relayed_sess / 2);
 	}
 
 	if (c->monologues.head) {
@@ -204,36 +354,27 @@ void statistics_update_oneway(struct call* c) {
 
 		if (IS_OWN_CALL(c)) {
 			if (ml->term_reason==TIMEOUT) {
-				atomic64_inc(&rtpe_totalstats.total_timeout_sess);
-				atomic64_inc(&rtpe_totalstats_interval.total_timeout_sess);
+				TOTALSTATS_INC(total_timeout_sess);
 			} else if (ml->term_reason==SILENT_TIMEOUT) {
-				atomic64_inc(&rtpe_totalstats.total_silent_timeout_sess);
-				atomic64_inc(&rtpe_totalstats_interval.total_silent_timeout_sess);
+				TOTALSTATS_INC(total_silent_timeout_sess);
 			} else if (ml->term_reason==OFFER_TIMEOUT) {
-				atomic64_inc(&rtpe_totalstats.total_offer_timeout_sess);
-				atomic64_inc(&rtpe_totalstats_interval.total_offer_timeout_sess);
+				TOTALSTATS_INC(total_offer_timeout_sess);
 			} else if (ml->term_reason==REGULAR) {
-				atomic64_inc(&rtpe_totalstats.total_regular_term_sess);
-				atomic64_inc(&rtpe_totalstats_interval.total_regular_term_sess);
+				TOTALSTATS_INC(total_regular_term_sess);
 			} else if (ml->term_reason==FORCED) {
-				atomic64_inc(&rtpe_totalstats.total_forced_term_sess);
-				atomic64_inc(&rtpe_totalstats_interval.total_forced_term_sess);
+				TOTALSTATS_INC(total_forced_term_sess);
 			}
 
-			timeval_totalstats_average_add(&rtpe_totalstats, &tim_result_duration);
-			timeval_totalstats_average_add(&rtpe_totalstats_interval, &tim_result_duration);
+			TOTALSTATS_INC(total_managed_sess);
+			TOTALSTATS_ADD(total_sess_duration, timeval_us(&tim_result_duration));
 			timeval_totalstats_call_duration_add(
-					&rtpe_totalstats_interval, &ml->started, &ml->terminated,
+					&ml->started, &ml->terminated,
 					&rtpe_latest_graphite_interval_start,
 					rtpe_config.graphite_interval);
-			timeval_totalstats_call_duration_add(
-					&rtpe_totalstats, &ml->started, &ml->terminated,
-					NULL, 0);
 		}
 
 		if (ml->term_reason==FINAL_TIMEOUT) {
-			atomic64_inc(&rtpe_totalstats.total_final_timeout_sess);
-			atomic64_inc(&rtpe_totalstats_interval.total_final_timeout_sess);
+			TOTALSTATS_INC(total_final_timeout_sess);
 		}
 	}
 
@@ -379,26 +520,46 @@ void statistics_update_oneway(struct call* c) {
 		SM_PUSH(ret, m); \
 	} while (0)
 
-GQueue *statistics_gather_metrics(void) {
-	GQueue *ret = g_queue_new();
+// p50 and p99 of a histogram, `scale` units per second
+static void latency_metrics(GQueue *ret, const char *name, const struct latency_histogram *h,
+		unsigned long scale, const char *prom_name, const char *prom_lab)
+{
+	unsigned long p50 = latency_histogram_percentile(h, 50);
+	unsigned long p99 = latency_histogram_percentile(h, 99);
+	int digits = scale >= 1000000000 ? 9 : 6;
+
+	char *mn = g_strdup_printf("%sp50latency", name);
+	char *lw = g_ascii_strdown(mn, -1);
+	METRICsva(lw, "%lu.%0*lu", p50 / scale, digits, p50 % scale);
+	PROM(prom_name, "gauge");
+	PROMLAB("%s,quantile=\"0.5\"", prom_lab);
+	free(mn);
+	free(lw);
+
+	mn = g_strdup_printf("%sp99latency", name);
+	lw = g_ascii_strdown(mn, -1);
+	METRICsva(lw, "%lu.%0*lu", p99 / scale, digits, p99 % scale);
+	PROM(prom_name, "gauge");
+	PROMLAB("%s,quantile=\"0.99\"", prom_lab);
+	free(mn);
+	free(lw);
+
+	METRICl("", "%15s p50/p99 latency: %lu.%0*lu/%lu.%0*lu sec", name,
+			p50 / scale, digits, p50 % scale, p99 / scale, digits, p99 % scale);
+}
 
+static void __statistics_gather_metrics(GQueue *ret) {
 	struct timeval avg, calls_dur_iv;
 	u_int64_t cur_sessions, num_sessions, min_sess_iv, max_sess_iv;
 	struct request_time offer_iv, answer_iv, delete_iv;
 	struct requests_ps offers_ps, answers_ps, deletes_ps;
-
-	mutex_lock(&rtpe_totalstats.total_average_lock);
-	avg = rtpe_totalstats.total_average_call_dur;
-	num_sessions = rtpe_totalstats.total_managed_sess;
-	mutex_unlock(&rtpe_totalstats.total_average_lock);
+	struct totalstats_block totals;
 
 	HEADER("{", "");
 	HEADER("currentstatistics", "Statistics over currently running sessions:");
 	HEADER("{", "");
 
-	rwlock_lock_r(&rtpe_callhash_lock);
-	cur_sessions = g_hash_table_size(rtpe_callhash);
-	rwlock_unlock_r(&rtpe_callhash_lock);
+	cur_sessions = atomic64_get(&rtpe_callhash_size);
 
 	METRIC("sessionsown", "Owned sessions", UINT64F, UINT64F, cur_sessions - atomic64_get(&rtpe_stats.foreign_sessions));
 	PROM("sessions", "gauge");
@@ -410,15 +571,51 @@ GQueue *statistics_gather_metrics(void) {
 	METRIC("sessionstotal", "Total sessions", UINT64F, UINT64F, cur_sessions);
 	METRIC("transcodedmedia", "Transcoded media", UINT64F, UINT64F, atomic64_get(&rtpe_stats.transcoded_media));
 	PROM("transcoded_media", "gauge");
+	METRIC("transcodequeue", "Packets queued for transcoding", UINT64F, UINT64F,
+			atomic64_get(&rtpe_stats.transcode_queue));
+	PROM("transcode_queue", "gauge");
+	METRIC("transcodequeuemax", "Highest number of packets queued for transcoding", UINT64F, UINT64F,
+			atomic64_get(&rtpe_stats.transcode_queue_max));
+	PROM("transcode_queue_max", "gauge");
+	METRIC("dtlsqueue", "Packets queued for DTLS handshake processing", UINT64F, UINT64F,
+			atomic64_get(&rtpe_stats.dtls_queue));
+	PROM("dtls_queue", "gauge");
+	METRIC("t38queue", "Packets queued for T.38 gateway processing", UINT64F, UINT64F,
+			atomic64_get(&rtpe_stats.t38_queue));
+	PROM("t38_queue", "gauge");
+	METRIC("t38busytime", "Busy time of the T.38 gateway threads", "%.6f", "%.6f seconds",
+			(double) atomic64_get(&rtpe_stats.t38_busy_us) / 1000000.0);
+	PROM("t38_busy_seconds_total", "counter");
+
+	int overload_busy_now = overload_busy();
+	METRIC("overloadlevel", "Overload protection step", "%i", "%i", g_atomic_int_get(&overload_level));
+	PROM("overload_level", "gauge");
+	METRIC("overloadthreshold", "Overload protection threshold", "%.2f", "%.2f%%",
+			(double) overload_threshold() / 100.0);
+	PROM("overload_threshold_percent", "gauge");
+	if (overload_busy_now >= 0) {
+		METRIC("overloadbusy", "Busy level seen by overload protection", "%.2f", "%.2f%%",
+				(double) overload_busy_now / 100.0);
+		PROM("overload_busy_percent", "gauge");
+	}
+	METRIC("overloadrejected", "Transcoding offers rejected due to overload", UINT64F, UINT64F,
+			atomic64_get(&overload_rejected));
+	PROM("overload_rejected_total", "counter");
 
 	METRIC("packetrate", "Packets per second", UINT64F, UINT64F, atomic64_get(&rtpe_stats.packets));
 	METRIC("byterate", "Bytes per second", UINT64F, UINT64F, atomic64_get(&rtpe_stats.bytes));
 	METRIC("errorrate", "Errors per second", UINT64F, UINT64F, atomic64_get(&rtpe_stats.errors));
 
-	mutex_lock(&rtpe_totalstats.total_average_lock);
-	avg = rtpe_totalstats.total_average_call_dur;
-	num_sessions = rtpe_totalstats.total_managed_sess;
-	mutex_unlock(&rtpe_totalstats.total_average_lock);
+	mutex_lock(&rtpe_redis_restore_stats.lock);
+	unsigned int restore_kernelized = rtpe_redis_restore_stats.kernelized;
+	mutex_unlock(&rtpe_redis_restore_stats.lock);
+	METRIC("restorekernelized", "Streams kernelized when restored from Redis", "%u", "%u",
+			restore_kernelized);
+	PROM("redis_restore_kernelized_total", "counter");
+
+	statistics_sum_totals(&totals);
+	num_sessions = atomic64_get_na(&totals.total_managed_sess);
+	timeval_from_us(&avg, num_sessions ? atomic64_get_na(&totals.total_sess_duration) / num_sessions : 0);
 
 	HEADER("}", "");
 	HEADER("totalstatistics", "Total statistics (does not include current running sessions):");
@@ -429,39 +626,51 @@ GQueue *statistics_gather_metrics(void) {
 
 	METRIC("managedsessions", "Total managed sessions", UINT64F, UINT64F, num_sessions);
 	PROM("sessions_total", "counter");
-	METRIC("rejectedsessions", "Total rejected sessions", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_rejected_sess));
+	METRIC("rejectedsessions", "Total rejected sessions", UINT64F, UINT64F, atomic64_get_na(&totals.total_rejected_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"rejected\"");
-	METRIC("timeoutsessions", "Total timed-out sessions via TIMEOUT", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_timeout_sess));
+	METRIC("timeoutsessions", "Total timed-out sessions via TIMEOUT", UINT64F, UINT64F, atomic64_get_na(&totals.total_timeout_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"timeout\"");
-	METRIC("silenttimeoutsessions", "Total timed-out sessions via SILENT_TIMEOUT", UINT64F, UINT64F,atomic64_get(&rtpe_totalstats.total_silent_timeout_sess));
+	METRIC("silenttimeoutsessions", "Total timed-out sessions via SILENT_TIMEOUT", UINT64F, UINT64F,atomic64_get_na(&totals.total_silent_timeout_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"silent_timeout\"");
-	METRIC("finaltimeoutsessions", "Total timed-out sessions via FINAL_TIMEOUT", UINT64F, UINT64F,atomic64_get(&rtpe_totalstats.total_final_timeout_sess));
+	METRIC("finaltimeoutsessions", "Total timed-out sessions via FINAL_TIMEOUT", UINT64F, UINT64F,atomic64_get_na(&totals.total_final_timeout_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"final_timeout\"");
-	METRIC("offertimeoutsessions", "Total timed-out sessions via OFFER_TIMEOUT", UINT64F, UINT64F,atomic64_get(&rtpe_totalstats.total_offer_timeout_sess));
+	METRIC("offertimeoutsessions", "Total timed-out sessions via OFFER_TIMEOUT", UINT64F, UINT64F,atomic64_get_na(&totals.total_offer_timeout_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"offer_timeout\"");
-	METRIC("regularterminatedsessions", "Total regular terminated sessions", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_regular_term_sess));
+	METRIC("regularterminatedsessions", "Total regular terminated sessions", UINT64F, UINT64F, atomic64_get_na(&totals.total_regular_term_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"terminated\"");
-	METRIC("forcedterminatedsessions", "Total forced terminated sessions", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_forced_term_sess));
+	METRIC("forcedterminatedsessions", "Total forced terminated sessions", UINT64F, UINT64F, atomic64_get_na(&totals.total_forced_term_sess));
 	PROM("closed_sessions_total", "counter");
 	PROMLAB("reason=\"force_terminated\"");
 
-	METRIC("relayedpackets", "Total relayed packets", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_relayed_packets));
+	METRIC("relayedpackets", "Total relayed packets", UINT64F, UINT64F, atomic64_get_na(&totals.total_relayed_packets));
 	PROM("packets_total", "counter");
-	METRIC("relayedpacketerrors", "Total relayed packet errors", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_relayed_errors));
+	METRIC("relayedpacketerrors", "Total relayed packet errors", UINT64F, UINT64F, atomic64_get_na(&totals.total_relayed_errors));
 	PROM("packet_errors_total", "counter");
-	METRIC("relayedbytes", "Total relayed bytes", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_relayed_bytes));
+	METRIC("relayedbytes", "Total relayed bytes", UINT64F, UINT64F, atomic64_get_na(&totals.total_relayed_bytes));
 	PROM("bytes_total", "counter");
 
-	METRIC("zerowaystreams", "Total number of streams with no relayed packets", UINT64F, UINT64F, atomic64_get(&rtpe_totalstats.total_nopacket_relayed_sess));
+	METRIC("zerowaystreams", "Total number of streams with no relayed packets", UINT64F, UINT64F, atomic64_get_na(&totals.total_nopacket_relayed_sess));
 	PROM("zero_packet_streams_total", "counter");
-	METRIC("onewaystreams", "Total number of 1-way streams", UINT64F, UINT64F,atomic64_get(&rtpe_totalstats.total_oneway_stream_sess));
+	METRIC("onewaystreams", "Total number of 1-way streams", UINT64F, UINT64F,atomic64_get_na(&totals.total_oneway_stream_sess));
 	PROM("one_way_sessions_total", "counter");
+	METRIC("dtlshandshakes", "Total completed full DTLS handshakes", UINT64F, UINT64F,
+			atomic64_get_na(&totals.total_dtls_handshakes));
+	PROM("dtls_handshakes_total", "counter");
+	PROMLAB("type=\"full\"");
+	METRIC("dtlsresumed", "Total completed resumed DTLS handshakes", UINT64F, UINT64F,
+			atomic64_get_na(&totals.total_dtls_resumed));
+	PROM("dtls_handshakes_total", "counter");
+	PROMLAB("type=\"resumed\"");
+	METRIC("homerdropped", "Total Homer messages dropped", UINT64F, UINT64F, homer_dropped());
+	PROM("homer_dropped_total", "counter");
+	METRIC("dtmflogdropped", "Total DTMF log events dropped", UINT64F, UINT64F, dtmf_log_drops());
+	PROM("dtmf_log_dropped_total", "counter");
 	METRICva("avgcallduration", "Average call duration", "%ld.%06ld", "%ld.%06ld", avg.tv_sec, avg.tv_usec);
 
 	mutex_lock(&rtpe_totalstats_lastinterval_lock);
@@ -612,6 +821,38 @@ GQueue *statistics_gather_metrics(void) {
 		free(lw);
 	}
 
+	HEADER(NULL, "");
+	for (int i = 0; i < NGC_COUNT; i++) {
+		char *lab = g_strdup_printf("request=\"%s\"", ng_command_strings[i]);
+		latency_metrics(ret, ng_command_strings_short[i], &rtpe_ng_latency[i], 1000000,
+				"request_latency_seconds", lab);
+		g_free(lab);
+	}
+
+	HEADER("}", "");
+	HEADER("latencystatistics", "Processing latency:");
+	HEADER("{", "");
+
+	for (int i = 0; i < __PKT_LAT_LAST; i++) {
+		char *lab = g_strdup_printf("type=\"%s\"", packet_latency_names[i]);
+		latency_metrics(ret, packet_latency_names[i], &totals.packet_latency[i], 1000000000,
+				"packet_latency_seconds", lab);
+		g_free(lab);
+	}
+	for (int i = 0; i < __WAKE_LAT_LAST; i++) {
+		char *lab = g_strdup_printf("wait=\"%s\"", wakeup_latency_names[i]);
+		latency_metrics(ret, wakeup_latency_short[i], &totals.wakeup_latency[i], 1000000,
+				"packet_wakeup_latency_seconds", lab);
+		g_free(lab);
+	}
+	latency_metrics(ret, "rediswrite", &rtpe_redis_write_latency, 1000000,
+			"redis_write_latency_seconds", "type=\"update\"");
+	latency_metrics(ret, "dtlshandshake", &rtpe_dtls_handshake_latency, 1000000,
+			"dtls_handshake_latency_seconds", "type=\"handshake\"");
+	if (rtpe_config.timestamping)
+		latency_metrics(ret, "relay", &totals.relay_latency, 1000000,
+				"relay_latency_seconds", "type=\"relay\"");
+
 	HEADER("}", "");
 
 	HEADER("interfaces", NULL);
@@ -632,8 +873,8 @@ GQueue *statistics_gather_metrics(void) {
 
 		METRICs("min", "%u", lif->spec->port_pool.min);
 		METRICs("max", "%u", lif->spec->port_pool.max);
-		unsigned int f = g_atomic_int_get(&lif->spec->port_pool.free_ports);
-		unsigned int l = g_atomic_int_get(&lif->spec->port_pool.last_used);
+		unsigned int f = port_pool_free_ports(&lif->spec->port_pool);
+		unsigned int l = port_pool_last_used(&lif->spec->port_pool);
 		unsigned int r = lif->spec->port_pool.max - lif->spec->port_pool.min + 1;
 		METRICs("used", "%u", r - f);
 		PROM("ports_used", "gauge");
@@ -692,11 +933,169 @@ GQueue *statistics_gather_metrics(void) {
 	HEADER("]", "");
 
 	HEADER("}", NULL);
+}
+
+
+// the metrics are gathered once per timer run and published as an immutable snapshot, which
+// readers hold a reference to. the lock only covers swapping and grabbing the pointer
+struct stats_snapshot {
+	GQueue metrics; // must be first
+	volatile gint refs;
+	time_t created;
+};
+
+static mutex_t stats_snapshot_lock = MUTEX_STATIC_INIT;
+static struct stats_snapshot *stats_snapshot;
+
+static void free_stats_metric(void *p);
+
+static struct stats_snapshot *stats_snapshot_new(void) {
+	struct stats_snapshot *s = g_slice_alloc0(sizeof(*s));
+	g_queue_init(&s->metrics);
+	s->refs = 1;
+	s->created = rtpe_now.tv_sec;
+	__statistics_gather_metrics(&s->metrics);
+	return s;
+}
+
+static void stats_snapshot_put(struct stats_snapshot *s) {
+	if (!s || !g_atomic_int_dec_and_test(&s->refs))
+		return;
+	g_queue_clear_full(&s->metrics, free_stats_metric);
+	g_slice_free1(sizeof(*s), s);
+}
 
-	return ret;
+// takes over the reference
+static void stats_snapshot_publish(struct stats_snapshot *s) {
+	mutex_lock(&stats_snapshot_lock);
+	struct stats_snapshot *old = stats_snapshot;
+	stats_snapshot = s;
+	mutex_unlock(&stats_snapshot_lock);
+	stats_snapshot_put(old);
+}
+
+void statistics_snapshot_update(void) {
+	stats_snapshot_publish(stats_snapshot_new());
+}
+
+// the returned list must not be modified, and must be released with statistics_free_metrics()
+GQueue *statistics_gather_metrics(void) {
+	mutex_lock(&stats_snapshot_lock);
+	struct stats_snapshot *s = stats_snapshot;
+	// the timer may run less often when it's busy, so don't go too far back
+	if (s && s->created + 2 >= rtpe_now.tv_sec)
+		g_atomic_int_inc(&s->refs);
+	else
+		s = NULL;
+	mutex_unlock(&stats_snapshot_lock);
+
+	if (!s) {
+		s = stats_snapshot_new();
+		g_atomic_int_inc(&s->refs);
+		stats_snapshot_publish(s);
+	}
+
+	return &s->metrics;
 }
 #pragma GCC diagnostic warning "-Wformat-zero-length"
 
+static void prom_family(GString *s, const char *name, const char *type, const char *descr) {
+	g_string_append_printf(s, "# HELP rtpengine_%s %s\n", name, descr);
+	g_string_append_printf(s, "# TYPE rtpengine_%s %s\n", name, type);
+}
+
+static void prom_interface(GString *s, const char *name, const struct local_intf *lif, const char *path,
+		atomic64 *val)
+{
+	g_string_append_printf(s, "rtpengine_%s{name=\"%s\",address=\"%s\",path=\"%s\"} " UINT64F "\n",
+			name, lif->logical->name.s, sockaddr_print_buf(&lif->spec->local_address.addr),
+			path, atomic64_get(val));
+}
+
+static void prom_poller_thread(unsigned int poller, unsigned int thread, uint64_t cpu_ns, void *p) {
+	GString *s = p;
+	g_string_append_printf(s, "rtpengine_poller_thread_cpu_seconds_total{poller=\"%u\",thread=\"%u\"} "
+			"%" PRIu64 ".%09" PRIu64 "\n", poller, thread, cpu_ns / 1000000000, cpu_ns % 1000000000);
+}
+
+static void prom_poller_thread_time(const struct poller_thread_stats *st, void *p) {
+	GString *s = p;
+	for (unsigned int i = 0; i < __POLLER_CB_MAX; i++)
+		g_string_append_printf(s, "rtpengine_poller_thread_seconds_total{poller=\"%u\",thread=\"%u\","
+				"state=\"%s\"} %" PRIu64 ".%09" PRIu64 "\n", st->poller, st->thread,
+				poller_cb_type_names[i], st->busy_ns[i] / 1000000000, st->busy_ns[i] % 1000000000);
+	g_string_append_printf(s, "rtpengine_poller_thread_seconds_total{poller=\"%u\",thread=\"%u\","
+			"state=\"idle\"} %" PRIu64 ".%09" PRIu64 "\n", st->poller, st->thread,
+			st->idle_ns / 1000000000, st->idle_ns % 1000000000);
+}
+
+// Labelled series that are only exported to Prometheus. Unlike the metrics list above, these
+// are written straight into the output buffer.
+void statistics_prometheus(GString *s) {
+	// only first-order interface entries, as in the metrics list
+	prom_family(s, "interface_packets_total", "counter", "Packets received per interface");
+	for (GList *l = all_local_interfaces.head; l; l = l->next) {
+		struct local_intf *lif = l->data;
+		if (lif->logical->preferred_family != lif->spec->local_address.addr.family)
+			continue;
+		prom_interface(s, "interface_packets_total", lif, "userspace", &lif->spec->packets);
+		prom_interface(s, "interface_packets_total", lif, "kernel", &lif->spec->kernel_packets);
+	}
+	prom_family(s, "interface_bytes_total", "counter", "Bytes received per interface");
+	for (GList *l = all_local_interfaces.head; l; l = l->next) {
+		struct local_intf *lif = l->data;
+		if (lif->logical->preferred_family != lif->spec->local_address.addr.family)
+			continue;
+		prom_interface(s, "interface_bytes_total", lif, "userspace", &lif->spec->bytes);
+		prom_interface(s, "interface_bytes_total", lif, "kernel", &lif->spec->kernel_bytes);
+	}
+	prom_family(s, "interface_junk_packets_total", "counter",
+			"Packets dropped by the kernel's junk filter per interface");
+	for (GList *l = all_local_interfaces.head; l; l = l->next) {
+		struct local_intf *lif = l->data;
+		if (lif->logical->preferred_family != lif->spec->local_address.addr.family)
+			continue;
+		prom_interface(s, "interface_junk_packets_total", lif, "kernel", &lif->spec->kernel_junk);
+	}
+	prom_family(s, "interface_receive_drops_total", "counter",
+			"Packets dropped due to full socket receive buffers per interface");
+	for (GList *l = all_local_interfaces.head; l; l = l->next) {
+		struct local_intf *lif = l->data;
+		if (lif->logical->preferred_family != lif->spec->local_address.addr.family)
+			continue;
+		prom_interface(s, "interface_receive_drops_total", lif, "userspace", &lif->spec->rx_dropped);
+	}
+
+	prom_family(s, "interface_unknown_dropped_total", "counter",
+			"Packets from unknown sources dropped per isolated interface");
+	for (GList *l = all_intf_isolations.head; l; l = l->next) {
+		struct intf_isolation *iso = l->data;
+		if (!iso->unknown_limit)
+			continue;
+		g_string_append_printf(s, "rtpengine_interface_unknown_dropped_total{name=\"" STR_FORMAT "\"} "
+				UINT64F "\n", STR_FMT(&iso->name), atomic64_get(&iso->unknown_dropped));
+	}
+
+	prom_family(s, "transcode_seconds_total", "counter", "CPU time spent transcoding per codec chain");
+	mutex_lock(&rtpe_codec_stats_lock);
+	GHashTableIter iter;
+	g_hash_table_iter_init(&iter, rtpe_codec_stats);
+	struct codec_stats *stats_entry;
+	while (g_hash_table_iter_next(&iter, NULL, (void **) &stats_entry)) {
+		uint64_t ns = atomic64_get(&stats_entry->time_ns);
+		g_string_append_printf(s, "rtpengine_transcode_seconds_total{chain=\"%s\"} "
+				"%" PRIu64 ".%09" PRIu64 "\n", stats_entry->chain, ns / 1000000000, ns % 1000000000);
+	}
+	mutex_unlock(&rtpe_codec_stats_lock);
+
+	prom_family(s, "poller_thread_cpu_seconds_total", "counter", "CPU time used per poller thread");
+	poller_threads_cpu(prom_poller_thread, s);
+
+	prom_family(s, "poller_thread_seconds_total", "counter",
+			"Time spent per poller thread in callbacks by type, and waiting for events");
+	poller_threads_stats(prom_poller_thread_time, s);
+}
+
 static void free_stats_metric(void *p) {
 	struct stats_metric *m = p;
 	g_free(m->descr);
@@ -708,21 +1107,19 @@ static void free_stats_metric(void *p) {
 }
 
 void statistics_free_metrics(GQueue **q) {
-	g_queue_free_full(*q, free_stats_metric);
+	stats_snapshot_put((struct stats_snapshot *) *q);
 	*q = NULL;
 }
 
 void statistics_free() {
-	mutex_destroy(&rtpe_totalstats.total_average_lock);
-	mutex_destroy(&rtpe_totalstats_interval.total_average_lock);
+	stats_snapshot_publish(NULL);
+
 	mutex_destroy(&rtpe_totalstats_interval.managed_sess_lock);
-	mutex_destroy(&rtpe_totalstats_interval.total_calls_duration_lock);
 
 	mutex_destroy(&rtpe_totalstats_lastinterval_lock);
 
-	mutex_destroy(&rtpe_totalstats_interval.offer.lock);
-	mutex_destroy(&rtpe_totalstats_interval.answer.lock);
-	mutex_destroy(&rtpe_totalstats_interval.delete.lock);
+	g_queue_clear_full(&totalstats_blocks, free);
+	mutex_destroy(&totalstats_blocks_lock);
 
 	mutex_destroy(&rtpe_totalstats_interval.offers_ps.lock);
 	mutex_destroy(&rtpe_totalstats_interval.answers_ps.lock);
@@ -740,10 +1137,8 @@ static void codec_stats_free(void *p) {
 }
 
 void statistics_init() {
-	mutex_init(&rtpe_totalstats.total_average_lock);
-	mutex_init(&rtpe_totalstats_interval.total_average_lock);
 	mutex_init(&rtpe_totalstats_interval.managed_sess_lock);
-	mutex_init(&rtpe_totalstats_interval.total_calls_duration_lock);
+	mutex_init(&totalstats_blocks_lock);
 
 	time(&rtpe_totalstats.started);
 	//rtpe_totalstats_interval.managed_sess_min = 0; // already zeroed
@@ -751,10 +1146,6 @@ void statistics_init() {
 
 	mutex_init(&rtpe_totalstats_lastinterval_lock);
 
-	mutex_init(&rtpe_totalstats_interval.offer.lock);
-	mutex_init(&rtpe_totalstats_interval.answer.lock);
-	mutex_init(&rtpe_totalstats_interval.delete.lock);
-
 	mutex_init(&rtpe_totalstats_interval.offers_ps.lock);
 	mutex_init(&rtpe_totalstats_interval.answers_ps.lock);
 	mutex_init(&rtpe_totalstats_interval.deletes_ps.lock);
@@ -329,32 +329,73 @@ static void fingerprint(struct msghdr *mh, struct fingerprint *fp) {
 	hdr->msg_len = ntohs(hdr->msg_len);
 }
 
-static void __integrity(struct iovec *iov, int iov_cnt, str *pwd, char *digest) {
+void stun_hmac_set(struct ice_hmac *h, const str *pwd) {
+	if (!pwd->s || !pwd->len) {
+		stun_hmac_free(h);
+		return;
+	}
+	if (h->ctx && h->key.s == pwd->s && h->key.len == pwd->len)
+		return;
+
+	if (!h->ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		h->ctx = HMAC_CTX_new();
+#else
+		h->ctx = g_slice_alloc(sizeof(HMAC_CTX));
+		HMAC_CTX_init(h->ctx);
+#endif
+	}
+	/* do we need to SASLprep here? */
+	HMAC_Init_ex(h->ctx, pwd->s, pwd->len, EVP_sha1(), NULL);
+	h->key = *pwd;
+}
+
+void stun_hmac_free(struct ice_hmac *h) {
+	if (!h->ctx)
+		return;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	HMAC_CTX_free(h->ctx);
+#else
+	HMAC_CTX_cleanup(h->ctx);
+	g_slice_free1(sizeof(HMAC_CTX), h->ctx);
+#endif
+	h->ctx = NULL;
+	h->key = STR_NULL;
+}
+
+/* the keyed state from `h` is used if it matches the password, which saves the two extra SHA1
+ * blocks of the key schedule for each message */
+static void __integrity(struct iovec *iov, int iov_cnt, str *pwd, struct ice_hmac *h, char *digest) {
 	int i;
 	HMAC_CTX *ctx;
+	int keyed = (h && h->ctx && h->key.s == pwd->s && h->key.len == pwd->len);
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	ctx = HMAC_CTX_new();
+	static __thread HMAC_CTX *ctx_tls;
+	if (!ctx_tls)
+		ctx_tls = HMAC_CTX_new();
+	ctx = ctx_tls;
 #else
 	HMAC_CTX ctx_s;
 	HMAC_CTX_init(&ctx_s);
 	ctx = &ctx_s;
 #endif
-	/* do we need to SASLprep here? */
-	HMAC_Init_ex(ctx, pwd->s, pwd->len, EVP_sha1(), NULL);
+	if (keyed)
+		HMAC_CTX_copy(ctx, h->ctx);
+	else
+		/* do we need to SASLprep here? */
+		HMAC_Init_ex(ctx, pwd->s, pwd->len, EVP_sha1(), NULL);
 
 	for (i = 0; i < iov_cnt; i++)
 		HMAC_Update(ctx, iov[i].iov_base, iov[i].iov_len);
 
 	HMAC_Final(ctx, (void *) digest, NULL);
-#if OPENSSL_VERSION_NUMBER >= 0x10100000L
-	HMAC_CTX_free(ctx);
-#else
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
 	HMAC_CTX_cleanup(ctx);
 #endif
 }
 
-static void integrity(struct msghdr *mh, struct msg_integrity *mi, str *pwd) {
+static void integrity(struct msghdr *mh, struct msg_integrity *mi, str *pwd, struct ice_hmac *h) {
 	struct iovec *iov;
 	struct header *hdr;
 
@@ -366,7 +407,7 @@ static void integrity(struct msghdr *mh, struct msg_integrity *mi, str *pwd) {
 	hdr = iov->iov_base;
 	hdr->msg_len = htons(hdr->msg_len);
 
-	__integrity(mh->msg_iov, mh->msg_iovlen - 1, pwd, mi->digest);
+	__integrity(mh->msg_iov, mh->msg_iovlen - 1, pwd, h, mi->digest);
 
 	hdr->msg_len = ntohs(hdr->msg_len);
 }
@@ -393,7 +434,8 @@ static void stun_error_len(struct stream_fd *sfd, const endpoint_t *sin,
 	if (attr_cont)
 		output_add_data_wr(&mh, &aa, add_attr, attr_cont, attr_len);
 
-	integrity(&mh, &mi, &sfd->stream->media->ice_agent->pwd[0]);
+	struct ice_agent *ag = sfd->stream->media->ice_agent;
+	integrity(&mh, &mi, &ag->pwd[0], &ag->hmac[0]);
 	fingerprint(&mh, &fp);
 
 	output_finish_src(&mh);
@@ -459,7 +501,7 @@ static int check_auth(const str *msg, struct stun_attrs *attrs, struct call_medi
 	iov[2].iov_base = msg->s + G_STRUCT_OFFSET(struct header, cookie);
 	iov[2].iov_len = ntohs(lenX) + - 24 + 20 - G_STRUCT_OFFSET(struct header, cookie);
 
-	__integrity(iov, G_N_ELEMENTS(iov), &ag->pwd[dst], digest);
+	__integrity(iov, G_N_ELEMENTS(iov), &ag->pwd[dst], &ag->hmac[dst], digest);
 
 	return memcmp(digest, attrs->msg_integrity.s, 20) ? -1 : 0;
 }
@@ -494,7 +536,8 @@ static int stun_binding_success(struct stream_fd *sfd, struct header *req, struc
 		output_add(&mh, &xma, STUN_XOR_MAPPED_ADDRESS);
 	}
 
-	integrity(&mh, &mi, &sfd->stream->media->ice_agent->pwd[1]);
+	struct ice_agent *ag = sfd->stream->media->ice_agent;
+	integrity(&mh, &mi, &ag->pwd[1], &ag->hmac[1]);
 	fingerprint(&mh, &fp);
 
 	output_finish_src(&mh);
@@ -643,7 +686,7 @@ ignore:
 	return -1;
 }
 
-int stun_binding_request(const endpoint_t *dst, u_int32_t transaction[3], str *pwd,
+int stun_binding_request(const endpoint_t *dst, u_int32_t transaction[3], str *pwd, struct ice_hmac *hmac,
 		str ufrags[2], int controlling, u_int64_t tiebreaker, u_int32_t priority,
 		socket_t *sock, int to_use)
 {
@@ -678,7 +721,7 @@ int stun_binding_request(const endpoint_t *dst, u_int32_t transaction[3], str *p
 	if (to_use)
 		output_add(&mh, &uc, STUN_USE_CANDIDATE);
 
-	integrity(&mh, &mi, pwd);
+	integrity(&mh, &mi, pwd, hmac);
 	fingerprint(&mh, &fp);
 
 	output_finish_src(&mh);
@@ -15,14 +15,38 @@
 #include "str.h"
 #include "media_player.h"
 #include "log_funcs.h"
+#include "main.h"
+#include "statistics.h"
 
 
 
 struct udptl_packet {
 	seq_packet_t p;
-	str *s;
+	GString *s;
 };
 
+// input for a gateway queued towards the T.38 threads
+struct t38_job {
+	int udptl; // otherwise PCM samples
+	size_t len;
+	char data[];
+};
+
+#define T38_JOBS_MAX 500 // per gateway, some 10 seconds worth of packets
+#define UDPTL_SPARE_MAX 32 // unused udptl_packet structs kept per gateway
+#define T38_GW_POOL_MAX 16 // idle spandsp gateway states kept for reuse
+
+
+static mutex_t t38_pool_lock = MUTEX_STATIC_INIT;
+static cond_t t38_pool_cond = COND_STATIC_INIT;
+static GQueue t38_pool_queue = G_QUEUE_INIT; // gateways with pending work, each listed once
+static unsigned int t38_pool_jobs;
+
+// spandsp gateway states are large, so released ones are kept initialised and
+// re-initialised in place for the next gateway instead of being freed
+static mutex_t t38_gw_pool_lock = MUTEX_STATIC_INIT;
+static GQueue t38_gw_pool = G_QUEUE_INIT;
+
 
 
 static void __add_udptl_len(GString *s, const void *buf, unsigned int len) {
@@ -77,6 +101,22 @@ static void g_string_null_extend(GString *s, size_t len) {
 	memset(s->str + oldb, 0, newb);
 }
 
+// the i-th last IFP we've sent, starting from zero
+static GString *__udptl_ec_out_nth(struct t38_gateway *tg, unsigned int i) {
+	return tg->udptl_ec_out[(tg->udptl_ec_out_pos - 1 - i) % tg->udptl_ec_out_size];
+}
+
+static void __udptl_ec_out_push(struct t38_gateway *tg, const str *s) {
+	GString **slot = &tg->udptl_ec_out[tg->udptl_ec_out_pos % tg->udptl_ec_out_size];
+	if (!*slot)
+		*slot = g_string_sized_new(s->len);
+	g_string_truncate(*slot, 0);
+	g_string_append_len(*slot, s->s, s->len);
+	tg->udptl_ec_out_pos++;
+	if (tg->udptl_ec_out_len < tg->udptl_ec_out_size)
+		tg->udptl_ec_out_len++;
+}
+
 static void spandsp_logging_func(SPAN_LOG_ARGS) {
 	if (level <= SPAN_LOG_PROTOCOL_ERROR)
 		level = LOG_ERR;
@@ -100,8 +140,9 @@ static int t38_gateway_handler(t38_core_state_t *stat, void *user_data, const ui
 
 	ilog(LOG_DEBUG, "Received %i bytes from T.38 encoder", len);
 
-	// build udptl packet: use a conservative guess for required buffer
-	GString *s = g_string_sized_new(512);
+	// build udptl packet
+	GString *s = tg->udptl_out;
+	g_string_truncate(s, 0);
 
 	// add seqnum
 	uint16_t seq = htons(tg->seqnum);
@@ -118,15 +159,15 @@ static int t38_gateway_handler(t38_core_state_t *stat, void *user_data, const ui
 
 		// figure out how many packets we have and which span to use
 		unsigned int packets = tg->options.fec_span * tg->options.max_ec_entries;
-		if (packets > tg->udptl_ec_out.length)
-			packets = tg->udptl_ec_out.length;
+		if (packets > tg->udptl_ec_out_len)
+			packets = tg->udptl_ec_out_len;
 		unsigned int span = packets / tg->options.max_ec_entries;
 		if (!span)
 			span = 1;
 		packets = span * tg->options.max_ec_entries; // our own packets we use
 		unsigned int entries = packets / span; // FEC entries in the output
-		if (entries > tg->udptl_ec_out.length)
-			entries = tg->udptl_ec_out.length;
+		if (entries > tg->udptl_ec_out_len)
+			entries = tg->udptl_ec_out_len;
 		packets = entries * span;
 
 		assert(span < 0x80);
@@ -135,84 +176,68 @@ static int t38_gateway_handler(t38_core_state_t *stat, void *user_data, const ui
 		g_string_append_c(s, 0x01);
 		g_string_append_c(s, span);
 
-		// create needed number of FEC packet entries
-		GQueue fec = G_QUEUE_INIT;
-		for (int i = 0; i < entries; i++)
-			g_queue_push_tail(&fec, g_string_new(""));
+		// reset the needed number of FEC packet entries
+		for (int i = 0; i < entries; i++) {
+			if (!tg->udptl_fec_out[i])
+				tg->udptl_fec_out[i] = g_string_sized_new(512);
+			g_string_truncate(tg->udptl_fec_out[i], 0);
+		}
 
 		// take each input packet, going backwards in time, and XOR it into
-		// the respective output FEC packet
-		GList *inp = tg->udptl_ec_out.head;
+		// the respective output FEC packet, going round the entries
 		for (int i = 0; i < packets; i++) {
-			assert(inp != NULL);
-			str *ip = inp->data;
-			// just keep shifting the list around
-			GString *outp = g_queue_pop_head(&fec);
+			GString *ip = __udptl_ec_out_nth(tg, i);
+			GString *outp = tg->udptl_fec_out[i % entries];
 
 			// extend string as needed
 			g_string_null_extend(outp, ip->len);
 
 			for (size_t j = 0; j < ip->len; j++)
-				outp->str[j] ^= ip->s[j];
-
-			g_queue_push_tail(&fec, outp);
-			inp = inp->next;
+				outp->str[j] ^= ip->str[j];
 		}
 
 		// output list is now complete, but in reverse. append it to output buffer
-		GString *ec = g_string_sized_new(512);
-		entries = 0;
-		int going = 1;
-		while (fec.length) {
-			GString *outp = g_queue_pop_tail(&fec);
-			if (going) {
-				if (s->len + ec->len + outp->len > tg->options.max_datagram)
-					going = 0;
-				else {
-					__add_udptl_raw(ec, outp->str, outp->len);
-					entries++;
-				}
-			}
-			g_string_free(outp, TRUE);
+		GString *ec = tg->udptl_ec;
+		g_string_truncate(ec, 0);
+		unsigned int num = 0;
+		for (int i = entries - 1; i >= 0; i--) {
+			GString *outp = tg->udptl_fec_out[i];
+			if (s->len + ec->len + outp->len > tg->options.max_datagram)
+				break;
+			__add_udptl_raw(ec, outp->str, outp->len);
+			num++;
 		}
 
-		g_string_append_c(s, entries);
+		g_string_append_c(s, num);
 		g_string_append_len(s, ec->str, ec->len);
-		g_string_free(ec, TRUE);
 	}
 	else {
 		// redundancy error correction
 		g_string_append_c(s, 0x00);
 
-		GString *ec = g_string_sized_new(512);
+		GString *ec = tg->udptl_ec;
+		g_string_truncate(ec, 0);
 		int entries = 0;
 
-		for (GList *l = tg->udptl_ec_out.head; l; l = l->next) {
-			str *ec_s = l->data;
+		for (unsigned int i = 0; i < tg->udptl_ec_out_len; i++) {
+			GString *ec_s = __udptl_ec_out_nth(tg, i);
 			// stop when we exceed max datagram length
 			if (s->len + ec->len + ec_s->len > tg->options.max_datagram)
 				break;
 			// add redundancy packet
-			__add_udptl(ec, ec_s);
+			__add_udptl_raw(ec, ec_s->str, ec_s->len);
 			entries++;
 		}
 
 		// number of entries - must be <0x80 as verified in settings
 		g_string_append_c(s, entries);
 		g_string_append_len(s, ec->str, ec->len);
-		g_string_free(ec, TRUE);
 	}
 
 	// done building our packet - add primary to our error correction buffer
 	tg->seqnum++;
-	unsigned int q_entries = tg->options.max_ec_entries * tg->options.fec_span;
-	if (q_entries) {
-		while (tg->udptl_ec_out.length >= q_entries) {
-			str *ec_s = g_queue_pop_tail(&tg->udptl_ec_out);
-			free(ec_s);
-		}
-		g_queue_push_head(&tg->udptl_ec_out, str_dup(&buf));
-	}
+	if (tg->udptl_ec_out_size)
+		__udptl_ec_out_push(tg, &buf);
 
 	// send our packet if we can
 	struct packet_stream *ps = NULL;
@@ -235,24 +260,121 @@ static int t38_gateway_handler(t38_core_state_t *stat, void *user_data, const ui
 	if (ps)
 		mutex_unlock(&ps->out_lock);
 
-	g_string_free(s, TRUE);
-
 	return 0;
 }
 
+static void __udptl_packet_free(struct udptl_packet *p) {
+	if (p->s)
+		g_string_free(p->s, TRUE);
+	g_slice_free1(sizeof(*p), p);
+}
+
+static t38_gateway_state_t *__t38_gw_pool_get(t38_tx_packet_handler_t handler, void *user_data) {
+	mutex_lock(&t38_gw_pool_lock);
+	t38_gateway_state_t *gw = g_queue_pop_head(&t38_gw_pool);
+	mutex_unlock(&t38_gw_pool_lock);
+
+	if (!gw)
+		return t38_gateway_init(NULL, handler, user_data);
+
+	ilog(LOG_DEBUG, "Reusing pooled spandsp T.38 gateway state");
+	t38_gateway_release(gw);
+	if (t38_gateway_init(gw, handler, user_data))
+		return gw;
+	t38_gateway_free(gw);
+	return NULL;
+}
+static void __t38_gw_pool_put(t38_gateway_state_t *gw) {
+	mutex_lock(&t38_gw_pool_lock);
+	if (t38_gw_pool.length < T38_GW_POOL_MAX) {
+		g_queue_push_tail(&t38_gw_pool, gw);
+		gw = NULL;
+	}
+	mutex_unlock(&t38_gw_pool_lock);
+	if (gw)
+		t38_gateway_free(gw);
+}
+
 void __t38_gateway_free(void *p) {
 	struct t38_gateway *tg = p;
 	ilog(LOG_DEBUG, "Destroying T.38 gateway");
 	if (tg->gw)
-		t38_gateway_free(tg->gw);
+		__t38_gw_pool_put(tg->gw);
 	if (tg->pcm_player) {
 		media_player_stop(tg->pcm_player);
 		media_player_put(&tg->pcm_player);
 	}
-	if (tg->udptl_fec)
-		g_hash_table_destroy(tg->udptl_fec);
-	g_queue_clear_full(&tg->udptl_ec_out, free);
+	for (unsigned int i = 0; i < tg->udptl_ec_out_size; i++)
+		if (tg->udptl_ec_out[i])
+			g_string_free(tg->udptl_ec_out[i], TRUE);
+	g_free(tg->udptl_ec_out);
+	for (unsigned int i = 0; i < G_N_ELEMENTS(tg->udptl_fec_out); i++)
+		if (tg->udptl_fec_out[i])
+			g_string_free(tg->udptl_fec_out[i], TRUE);
+	for (unsigned int i = 0; i < G_N_ELEMENTS(tg->udptl_fec); i++)
+		if (tg->udptl_fec[i].s)
+			g_string_free(tg->udptl_fec[i].s, TRUE);
+	if (tg->udptl_out)
+		g_string_free(tg->udptl_out, TRUE);
+	if (tg->udptl_ec)
+		g_string_free(tg->udptl_ec, TRUE);
+	if (tg->udptl_rec)
+		g_string_free(tg->udptl_rec, TRUE);
 	packet_sequencer_destroy(&tg->sequencer);
+	g_queue_clear_full(&tg->udptl_spare, (GDestroyNotify) __udptl_packet_free);
+	g_queue_clear_full(&tg->jobs, g_free);
+}
+
+
+// pool lock must be held
+static void __t38_schedule(struct t38_gateway *tg) {
+	if (tg->scheduled || tg->stopped || !tg->t38_media)
+		return;
+	tg->scheduled = 1;
+	tg->sched_call = obj_get(tg->t38_media->call);
+	g_queue_push_tail(&t38_pool_queue, obj_get(tg));
+	cond_signal(&t38_pool_cond);
+}
+
+static void __t38_job_push(struct t38_gateway *tg, int udptl, const void *data, size_t len) {
+	mutex_lock(&t38_pool_lock);
+
+	if (tg->stopped)
+		goto out;
+	if (tg->jobs.length >= T38_JOBS_MAX) {
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "T.38 gateway is falling behind, discarding %s input",
+				udptl ? "UDPTL" : "PCM");
+		goto out;
+	}
+
+	struct t38_job *job = g_malloc(sizeof(*job) + len);
+	job->udptl = udptl;
+	job->len = len;
+	memcpy(job->data, data, len);
+	g_queue_push_tail(&tg->jobs, job);
+
+	t38_pool_jobs++;
+	atomic64_set(&rtpe_stats.t38_queue, t38_pool_jobs);
+	__t38_schedule(tg);
+
+out:
+	mutex_unlock(&t38_pool_lock);
+}
+
+// gateway is locked
+static int __t38_pcm_generate(struct t38_gateway *tg, int16_t *smp, unsigned int len) {
+	return t38_gateway_tx(tg->gw, smp, len);
+}
+
+// pool lock must be held. takes samples which were generated ahead by a T.38 thread
+static int __t38_pcm_take(struct t38_gateway *tg, int16_t *smp, unsigned int len) {
+	unsigned int num = MIN(len, tg->tx_len);
+	memcpy(smp, tg->tx_buf, num * sizeof(*smp));
+	tg->tx_len -= num;
+	memmove(tg->tx_buf, tg->tx_buf + num, tg->tx_len * sizeof(*smp));
+	if (tg->tx_len < T38_TX_BUF_SAMPLES / 2)
+		__t38_schedule(tg);
+	return num;
 }
 
 // call is locked in R and mp is locked
@@ -270,15 +392,19 @@ static void t38_pcm_player(struct media_player *mp) {
 
 	ilog(LOG_DEBUG, "Generating T.38 PCM samples");
 
-	mutex_lock(&tg->lock);
+	// with T.38 threads, the samples are already there and the DSP work must not be
+	// blocked on here
+	mutex_t *lock = rtpe_config.t38_threads ? &t38_pool_lock : &tg->lock;
+	mutex_lock(lock);
 
 	int16_t smp[80];
-	int num = t38_gateway_tx(tg->gw, smp, 80);
+	int num = rtpe_config.t38_threads ? __t38_pcm_take(tg, smp, G_N_ELEMENTS(smp))
+		: __t38_pcm_generate(tg, smp, G_N_ELEMENTS(smp));
 	if (num <= 0) {
 		// use a fixed interval of 10 ms
 		timeval_add_usec(&mp->next_run, 10000);
 		timerthread_obj_schedule_abs(&mp->tt_obj, &mp->next_run);
-		mutex_unlock(&tg->lock);
+		mutex_unlock(lock);
 		return;
 	}
 
@@ -290,7 +416,7 @@ static void t38_pcm_player(struct media_player *mp) {
 	unsigned long long pts = tg->pts;
 	tg->pts += num;
 
-	mutex_unlock(&tg->lock);
+	mutex_unlock(lock);
 
 	// this reschedules our player as well
 	media_player_add_packet(pcm_player, (char *) smp, num * 2, num * 1000000 / 8000, pts);
@@ -298,13 +424,6 @@ static void t38_pcm_player(struct media_player *mp) {
 }
 
 
-static void __udptl_packet_free(struct udptl_packet *p) {
-	if (p->s)
-		free(p->s);
-	g_slice_free1(sizeof(*p), p);
-}
-
-
 static void __t38_options_normalise(struct t38_options *opts) {
 	if (opts->version < 0)
 		opts->version = 0;
@@ -366,9 +485,15 @@ int t38_gateway_pair(struct call_media *t38_media, struct call_media *pcm_media,
 	tg->t38_media = t38_media;
 	tg->pcm_media = pcm_media;
 	mutex_init(&tg->lock);
-	tg->udptl_fec = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
-			(GDestroyNotify) __udptl_packet_free);
 	tg->options = opts;
+	tg->udptl_ec_out_size = opts.max_ec_entries * opts.fec_span;
+	if (tg->udptl_ec_out_size)
+		tg->udptl_ec_out = g_new0(GString *, tg->udptl_ec_out_size);
+	tg->udptl_out = g_string_sized_new(512);
+	tg->udptl_ec = g_string_sized_new(512);
+	tg->udptl_rec = g_string_sized_new(512);
+	for (unsigned int i = 0; i < G_N_ELEMENTS(tg->udptl_fec); i++)
+		tg->udptl_fec[i].seq = -1;
 
 	tg->pcm_pt.payload_type = -1;
 	str_init(&tg->pcm_pt.encoding, "PCM-S16LE");
@@ -382,7 +507,7 @@ int t38_gateway_pair(struct call_media *t38_media, struct call_media *pcm_media,
 		goto err;
 
 	err = "Failed to create spandsp T.38 gateway";
-	if (!(tg->gw = t38_gateway_init(NULL, t38_gateway_handler, tg)))
+	if (!(tg->gw = __t38_gw_pool_get(t38_gateway_handler, tg)))
 		goto err;
 
 	err = "Failed to create media player";
@@ -484,12 +609,26 @@ void t38_gateway_start(struct t38_gateway *tg) {
 
 	ilog(LOG_DEBUG, "Starting T.38 PCM player");
 
+	mutex_lock(&t38_pool_lock);
+	tg->stopped = 0;
+	mutex_unlock(&t38_pool_lock);
+
 	// start off PCM player
 	tg->pcm_player->next_run = rtpe_now;
 	timerthread_obj_schedule_abs(&tg->pcm_player->tt_obj, &tg->pcm_player->next_run);
 }
 
 
+// call is locked in R and gateway is locked
+static void __t38_input_samples(struct t38_gateway *tg, int16_t amp[], int len) {
+	ilog(LOG_DEBUG, "Adding %i samples to T.38 encoder", len);
+
+	int left = t38_gateway_rx(tg->gw, amp, len);
+	if (left)
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "%i PCM samples were not processed by the T.38 gateway",
+				left);
+}
+
 // call is locked in R
 int t38_gateway_input_samples(struct t38_gateway *tg, int16_t amp[], int len) {
 	if (!tg)
@@ -497,15 +636,13 @@ int t38_gateway_input_samples(struct t38_gateway *tg, int16_t amp[], int len) {
 	if (len <= 0)
 		return 0;
 
-	ilog(LOG_DEBUG, "Adding %i samples to T.38 encoder", len);
+	if (rtpe_config.t38_threads) {
+		__t38_job_push(tg, 0, amp, len * sizeof(*amp));
+		return 0;
+	}
 
 	mutex_lock(&tg->lock);
-
-	int left = t38_gateway_rx(tg->gw, amp, len);
-	if (left)
-		ilog(LOG_WARN | LOG_FLAG_LIMIT, "%i PCM samples were not processed by the T.38 gateway",
-				left);
-
+	__t38_input_samples(tg, amp, len);
 	mutex_unlock(&tg->lock);
 
 	return 0;
@@ -546,27 +683,53 @@ static int __get_udptl(str *piece, str *s) {
 }
 
 
-static struct udptl_packet *__make_udptl_packet(const str *piece, uint16_t seq) {
-	struct udptl_packet *up = g_slice_alloc0(sizeof(*up));
+static struct udptl_packet *__make_udptl_packet(struct t38_gateway *tg, const str *piece, uint16_t seq) {
+	struct udptl_packet *up = g_queue_pop_head(&tg->udptl_spare);
+	if (!up) {
+		up = g_slice_alloc0(sizeof(*up));
+		up->s = g_string_sized_new(piece->len);
+	}
 	up->p.seq = seq;
-	up->s = str_dup(piece);
+	g_string_truncate(up->s, 0);
+	g_string_append_len(up->s, piece->s, piece->len);
 	return up;
 }
 
+static void __udptl_packet_recycle(struct t38_gateway *tg, struct udptl_packet *up) {
+	if (tg->udptl_spare.length >= UDPTL_SPARE_MAX) {
+		__udptl_packet_free(up);
+		return;
+	}
+	g_queue_push_tail(&tg->udptl_spare, up);
+}
+
+// inserts into the sequencer or recycles right away if it's a dupe
+static void __udptl_sequence(struct t38_gateway *tg, struct udptl_packet *up) {
+	if (packet_sequencer_insert(&tg->sequencer, &up->p) < 0)
+		__udptl_packet_recycle(tg, up);
+}
+
 static void __fec_save(struct t38_gateway *tg, const str *piece, uint16_t seq) {
-	struct udptl_packet *up = __make_udptl_packet(piece, seq);
-	g_hash_table_insert(tg->udptl_fec, GUINT_TO_POINTER(seq), up);
+	struct udptl_fec_slot *slot = &tg->udptl_fec[seq % UDPTL_FEC_RING];
+	slot->seq = seq;
+	if (!slot->s)
+		slot->s = g_string_sized_new(piece->len);
+	g_string_truncate(slot->s, 0);
+	g_string_append_len(slot->s, piece->s, piece->len);
 }
 
-int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
+static GString *__fec_lookup(struct t38_gateway *tg, uint16_t seq) {
+	struct udptl_fec_slot *slot = &tg->udptl_fec[seq % UDPTL_FEC_RING];
+	if (slot->seq != seq)
+		return NULL;
+	return slot->s;
+}
+
+// call is locked in R and gateway is locked
+static int __t38_input_udptl(struct t38_gateway *tg, const str *buf) {
 	const char *err = NULL;
 	struct udptl_packet *up = NULL;
 
-	if (!tg)
-		return 0;
-	if (!buf || !buf->len)
-		return 0;
-
 	if (buf->len < 4) {
 		ilog(LOG_INFO | LOG_FLAG_LIMIT, "Ignoring short UDPTL packet (%i bytes)", buf->len);
 		return 0;
@@ -589,15 +752,13 @@ int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
 
 	ilog(LOG_DEBUG, "Received primary IFP packet, len %i, seq %i", piece.len, seq);
 	str primary = piece;
-	up = __make_udptl_packet(&primary, seq);
+	up = __make_udptl_packet(tg, &primary, seq);
 
 	err = "Error correction mode byte missing";
 	if (str_shift_ret(&s, 1, &piece))
 		goto err;
 	char fec = piece.s[0];
 
-	mutex_lock(&tg->lock);
-
 	long diff = seq - up->p.seq;
 	if (diff > 100 || diff < -100) {
 		ilog(LOG_INFO | LOG_FLAG_LIMIT, "Ignoring UDPTL packet with wildly off seq (%u <> %u)",
@@ -610,7 +771,7 @@ int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
 	int ret = packet_sequencer_insert(&tg->sequencer, &up->p);
 	if (ret < 0) {
 		// main seq is dupe - everything else must be dupe too
-		__udptl_packet_free(up);
+		__udptl_packet_recycle(tg, up);
 		goto out;
 	}
 
@@ -638,9 +799,7 @@ int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
 				continue;
 			ilog(LOG_DEBUG, "Received secondary IFP packet, len %i, seq %i", piece.len,
 					seq - 1 - i);
-			up = __make_udptl_packet(&piece, seq - 1 - i);
-			packet_sequencer_insert(&tg->sequencer, &up->p);
-			up = NULL;
+			__udptl_sequence(tg, __make_udptl_packet(tg, &piece, seq - 1 - i));
 
 			// can we stop here?
 			if (packet_sequencer_next_ok(&tg->sequencer))
@@ -683,19 +842,21 @@ int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
 			for (int i = 0; i < span; i++) {
 				uint16_t seq_fec = seq_start + i * span;
 				// skip if we already know this packet
-				if (g_hash_table_lookup(tg->udptl_fec, GUINT_TO_POINTER(seq_fec)))
+				if (__fec_lookup(tg, seq_fec))
 					continue;
 
-				// can we recover it? we need all other packets from the series
-				GString *rec_s = g_string_new("");
+				// can we recover it? we need all other packets from the series,
+				// XORed into the FEC entry
+				GString *rec_s = tg->udptl_rec;
+				g_string_truncate(rec_s, 0);
+				g_string_append_len(rec_s, piece.s, piece.len);
 				int complete = 1;
 
 				for (int j = 0; j < span; j++) {
-					uint16_t seq_rec = seq_start + i * span;
+					uint16_t seq_rec = seq_start + j * span;
 					if (seq_rec == seq_fec)
 						continue;
-					struct udptl_packet *recp =
-						g_hash_table_lookup(tg->udptl_fec, GUINT_TO_POINTER(seq_rec));
+					GString *recp = __fec_lookup(tg, seq_rec);
 					if (!recp) {
 						ilog(LOG_WARN | LOG_FLAG_LIMIT, "Unable to recover UDPTL FEC "
 								"packet with seq %i due to missing seq %i",
@@ -705,8 +866,9 @@ int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
 					}
 
 					// XOR in packet
-					for (size_t j = 0; j < recp->s->len; j++)
-						rec_s->str[j] ^= recp->s->s[j];
+					g_string_null_extend(rec_s, recp->len);
+					for (size_t k = 0; k < recp->len; k++)
+						rec_s->str[k] ^= recp->str[k];
 				}
 
 				if (complete) {
@@ -716,13 +878,9 @@ int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
 
 					str rec_str = STR_CONST_INIT_LEN(rec_s->str, rec_s->len);
 					__fec_save(tg, &rec_str, seq_fec);
-					up = __make_udptl_packet(&rec_str, seq_fec);
-					packet_sequencer_insert(&tg->sequencer, &up->p);
-					up = NULL;
+					__udptl_sequence(tg, __make_udptl_packet(tg, &rec_str, seq_fec));
 				}
 
-				g_string_free(rec_s, TRUE);
-
 				// no point in continuing further: one packet was missing, which means
 				// that no other packet in this span can be recovered
 				break;
@@ -744,25 +902,43 @@ seq_ok:;
 		if (!up)
 			break;
 
-		ilog(LOG_DEBUG, "Processing %i IFP bytes, seq %i", up->s->len, up->p.seq);
+		ilog(LOG_DEBUG, "Processing %zu IFP bytes, seq %i", up->s->len, up->p.seq);
 
-		t38_core_rx_ifp_packet(t38, (uint8_t *) up->s->s, up->s->len, up->p.seq);
+		t38_core_rx_ifp_packet(t38, (uint8_t *) up->s->str, up->s->len, up->p.seq);
 
-		__udptl_packet_free(up);
+		__udptl_packet_recycle(tg, up);
 	}
 
 out:
-	mutex_unlock(&tg->lock);
 	return 0;
 
 err:
 	if (err)
 		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to process UDPTL/T.38/IFP packet: %s", err);
 	if (up)
-		__udptl_packet_free(up);
+		__udptl_packet_recycle(tg, up);
 	return -1;
 }
 
+// call is locked in R
+int t38_gateway_input_udptl(struct t38_gateway *tg, const str *buf) {
+	if (!tg)
+		return 0;
+	if (!buf || !buf->len)
+		return 0;
+
+	if (rtpe_config.t38_threads) {
+		__t38_job_push(tg, 1, buf->s, buf->len);
+		return 0;
+	}
+
+	mutex_lock(&tg->lock);
+	int ret = __t38_input_udptl(tg, buf);
+	mutex_unlock(&tg->lock);
+
+	return ret;
+}
+
 
 void t38_gateway_stop(struct t38_gateway *tg) {
 	if (!tg)
@@ -771,6 +947,115 @@ void t38_gateway_stop(struct t38_gateway *tg) {
 		media_player_stop(tg->pcm_player);
 	if (tg->t38_media)
 		g_queue_clear_full(&tg->t38_media->sdp_attributes, free);
+
+	// drop whatever is still waiting for the T.38 threads
+	mutex_lock(&t38_pool_lock);
+	tg->stopped = 1;
+	GQueue jobs = tg->jobs;
+	g_queue_init(&tg->jobs);
+	t38_pool_jobs -= jobs.length;
+	atomic64_set(&rtpe_stats.t38_queue, t38_pool_jobs);
+	tg->tx_len = 0;
+	mutex_unlock(&t38_pool_lock);
+
+	g_queue_clear_full(&jobs, g_free);
+}
+
+
+// processes all queued input of one gateway and generates PCM ahead of the player
+static void __t38_gateway_run(struct t38_gateway *tg, struct call *call) {
+	struct timeval start;
+	struct timespec cpu_start, cpu_end;
+	gettimeofday(&start, NULL);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+
+	log_info_call(call);
+
+	rwlock_lock_r(&call->master_lock);
+	mutex_lock(&tg->lock);
+
+	mutex_lock(&t38_pool_lock);
+	while (1) {
+		struct t38_job *job = g_queue_pop_head(&tg->jobs);
+		if (!job)
+			break;
+		t38_pool_jobs--;
+		atomic64_set(&rtpe_stats.t38_queue, t38_pool_jobs);
+		mutex_unlock(&t38_pool_lock);
+
+		if (job->udptl) {
+			str s = STR_CONST_INIT_LEN(job->data, job->len);
+			__t38_input_udptl(tg, &s);
+		}
+		else
+			__t38_input_samples(tg, (int16_t *) job->data, job->len / sizeof(int16_t));
+		g_free(job);
+
+		mutex_lock(&t38_pool_lock);
+	}
+
+	// only the holder of the gateway lock adds to the buffer, so the space can only grow
+	unsigned int space = tg->stopped ? 0 : T38_TX_BUF_SAMPLES - tg->tx_len;
+	mutex_unlock(&t38_pool_lock);
+
+	if (space) {
+		int16_t smp[T38_TX_BUF_SAMPLES];
+		int num = __t38_pcm_generate(tg, smp, space);
+		if (num > 0) {
+			ilog(LOG_DEBUG, "Generated %i T.38 PCM samples ahead", num);
+			mutex_lock(&t38_pool_lock);
+			if (!tg->stopped) {
+				memcpy(tg->tx_buf + tg->tx_len, smp, num * sizeof(*smp));
+				tg->tx_len += num;
+			}
+			mutex_unlock(&t38_pool_lock);
+		}
+	}
+
+	mutex_unlock(&tg->lock);
+	rwlock_unlock_r(&call->master_lock);
+
+	log_info_clear();
+
+	struct timeval end;
+	gettimeofday(&end, NULL);
+	atomic64_add(&rtpe_stats.t38_busy_us, timeval_diff(&end, &start));
+	// the call is only charged for CPU time, not for waiting on its locks
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	atomic64_add(&call->transcode_ns, (cpu_end.tv_sec - cpu_start.tv_sec) * 1000000000LL
+			+ cpu_end.tv_nsec - cpu_start.tv_nsec);
+}
+
+// runs one T.38 thread. a gateway is only ever handled by one thread at a time
+void t38_worker_loop(void *p) {
+	mutex_lock(&t38_pool_lock);
+
+	while (!rtpe_shutdown) {
+		gettimeofday(&rtpe_now, NULL);
+
+		struct t38_gateway *tg = g_queue_pop_head(&t38_pool_queue);
+		if (!tg) {
+			struct timeval tv = rtpe_now;
+			timeval_add_usec(&tv, 100000);
+			cond_timedwait(&t38_pool_cond, &t38_pool_lock, &tv);
+			continue;
+		}
+
+		// new work arriving from here on needs another round. that one waits for the
+		// gateway lock, so the input is still processed in order
+		struct call *call = tg->sched_call;
+		tg->sched_call = NULL;
+		tg->scheduled = 0;
+		mutex_unlock(&t38_pool_lock);
+
+		__t38_gateway_run(tg, call);
+
+		obj_put(call);
+		obj_put(tg);
+		mutex_lock(&t38_pool_lock);
+	}
+
+	mutex_unlock(&t38_pool_lock);
 }
 
 
@@ -778,6 +1063,12 @@ void t38_init(void) {
 	my_span_mh(NULL);
 }
 
+void t38_cleanup(void) {
+	t38_gateway_state_t *gw;
+	while ((gw = g_queue_pop_head(&t38_gw_pool)))
+		t38_gateway_free(gw);
+}
+
 
 
 #endif
@@ -242,6 +242,26 @@ fail:
 	obj_put(cb);
 	return -1;
 }
+// stops accepting connections and detaches the established ones from the poller,
+// without releasing anything
+void streambuf_listener_close(struct streambuf_listener *listener) {
+	GHashTableIter iter;
+	gpointer key;
+
+	if (!listener)
+		return;
+	poller_del_item(listener->poller, listener->listener.fd);
+	close_socket(&listener->listener);
+	if (!listener->streams)
+		return;
+	mutex_lock(&listener->lock);
+	g_hash_table_iter_init(&iter, listener->streams);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		struct streambuf_stream *s = key;
+		poller_del_item(listener->poller, s->sock.fd);
+	}
+	mutex_unlock(&listener->lock);
+}
 void streambuf_listener_shutdown(struct streambuf_listener *listener) {
 	if (!listener)
 		return;
@@ -249,6 +269,7 @@ void streambuf_listener_shutdown(struct streambuf_listener *listener) {
 	close_socket(&listener->listener);
 	if (listener->streams)
 		g_hash_table_destroy(listener->streams);
+	listener->streams = NULL;
 }
 
 void streambuf_stream_close(struct streambuf_stream *s) {
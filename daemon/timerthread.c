@@ -1,5 +1,13 @@
 #include "timerthread.h"
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
 #include "aux.h"
+#include "main.h"
+#include "probes.h"
+#include "poller.h"
+#include "log.h"
 
 
 static int tt_obj_cmp(const void *a, const void *b) {
@@ -7,20 +15,192 @@ static int tt_obj_cmp(const void *a, const void *b) {
 	return timeval_cmp_ptr(&A->next_check, &B->next_check);
 }
 
+
+// rounded up, so that an object never runs before its scheduled time
+static uint64_t tt_wheel_tick(const struct timeval *tv) {
+	return (uint64_t) tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+}
+static uint64_t tt_wheel_now(void) {
+	return (uint64_t) rtpe_now.tv_sec * 1000 + rtpe_now.tv_usec / 1000;
+}
+
+static void tt_wheel_insert(struct timerthread_wheel *w, struct timerthread_obj *tt_obj) {
+	uint64_t expires = tt_wheel_tick(&tt_obj->next_check);
+	if (expires < w->cur)
+		expires = w->cur;
+	uint64_t delta = expires - w->cur;
+
+	unsigned int level;
+	for (level = 0; level < TT_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1ULL << (TT_WHEEL_BITS * (level + 1))))
+			break;
+	}
+	if (level == TT_WHEEL_LEVELS - 1 && delta >= (1ULL << (TT_WHEEL_BITS * TT_WHEEL_LEVELS)))
+		expires = w->cur + (1ULL << (TT_WHEEL_BITS * TT_WHEEL_LEVELS)) - 1;
+
+	GQueue *slot = &w->slots[level][(expires >> (TT_WHEEL_BITS * level)) & TT_WHEEL_MASK];
+	tt_obj->wheel_link.data = tt_obj;
+	g_queue_push_tail_link(slot, &tt_obj->wheel_link);
+	tt_obj->wheel_slot = slot;
+}
+
+static void tt_wheel_remove(struct timerthread_wheel *w, struct timerthread_obj *tt_obj) {
+	g_queue_unlink(tt_obj->wheel_slot, &tt_obj->wheel_link);
+	tt_obj->wheel_slot = NULL;
+}
+
+// re-sort all objects of one slot into lower levels
+static void tt_wheel_cascade(struct timerthread_wheel *w, GQueue *slot) {
+	GList *l;
+	while ((l = g_queue_pop_head_link(slot)))
+		tt_wheel_insert(w, l->data);
+}
+
+// moves everything that is due at `now` to the list of expired objects
+static void tt_wheel_advance(struct timerthread_wheel *w, uint64_t now) {
+	if (now < w->cur)
+		return;
+
+	if (now - w->cur > TT_WHEEL_SIZE * TT_WHEEL_SIZE) {
+		// clock jump or long stall: re-sort everything instead of walking all ticks
+		GQueue all = G_QUEUE_INIT;
+		GList *l;
+		for (unsigned int i = 0; i < TT_WHEEL_LEVELS; i++) {
+			for (unsigned int j = 0; j < TT_WHEEL_SIZE; j++) {
+				while ((l = g_queue_pop_head_link(&w->slots[i][j])))
+					g_queue_push_tail_link(&all, l);
+			}
+		}
+		w->cur = now;
+		tt_wheel_cascade(w, &all);
+	}
+
+	while (w->cur <= now) {
+		unsigned int idx = w->cur & TT_WHEEL_MASK;
+
+		if (idx == 0) {
+			for (unsigned int level = 1; level < TT_WHEEL_LEVELS; level++) {
+				unsigned int lidx = (w->cur >> (TT_WHEEL_BITS * level)) & TT_WHEEL_MASK;
+				tt_wheel_cascade(w, &w->slots[level][lidx]);
+				if (lidx != 0)
+					break;
+			}
+		}
+
+		GQueue *slot = &w->slots[0][idx];
+		GList *l;
+		while ((l = g_queue_pop_head_link(slot))) {
+			struct timerthread_obj *tt_obj = l->data;
+			g_queue_push_tail_link(&w->expired, l);
+			tt_obj->wheel_slot = &w->expired;
+		}
+
+		w->cur++;
+	}
+}
+
+// returns the number of us until the next tick that needs processing, up to `max`
+static long long tt_wheel_sleeptime(struct timerthread_wheel *w, long long max) {
+	uint64_t now = tt_wheel_now();
+	uint64_t limit = now + max / 1000;
+	// must also wake up for the next cascade
+	uint64_t cascade = (w->cur + TT_WHEEL_MASK) & ~(uint64_t) TT_WHEEL_MASK;
+	if (cascade < limit)
+		limit = cascade;
+
+	uint64_t t;
+	for (t = w->cur; t < limit; t++) {
+		if (w->slots[0][t & TT_WHEEL_MASK].length)
+			break;
+	}
+	if (t <= now)
+		return 0;
+	return (t - now) * 1000 - rtpe_now.tv_usec % 1000;
+}
+
+
 void timerthread_init(struct timerthread *tt, void (*func)(void *)) {
-	tt->tree = g_tree_new(tt_obj_cmp);
+	if (rtpe_config.timer_wheel) {
+		tt->wheel = g_slice_alloc0(sizeof(*tt->wheel));
+		gettimeofday(&rtpe_now, NULL);
+		tt->wheel->cur = tt_wheel_now();
+	}
+	else
+		tt->tree = g_tree_new(tt_obj_cmp);
 	mutex_init(&tt->lock);
 	cond_init(&tt->cond);
 	tt->func = func;
+	tt->idle_func = NULL;
+	tt->slack = 0;
+	tt->poller = NULL;
+	tt->timerfd = -1;
+	ZERO(tt->armed);
 }
 
 void timerthread_free(struct timerthread *tt) {
-	g_tree_destroy(tt->tree);
+	if (tt->tree)
+		g_tree_destroy(tt->tree);
+	if (tt->wheel)
+		g_slice_free1(sizeof(*tt->wheel), tt->wheel);
+	if (tt->timerfd != -1)
+		close(tt->timerfd);
+	tt->timerfd = -1;
 	mutex_destroy(&tt->lock);
 }
 
+// returns the next object to run (without removing it), or NULL with *sleeptime set
+static struct timerthread_obj *timerthread_next(struct timerthread *tt, long long *sleeptime) {
+	struct timerthread_obj *tt_obj;
+
+	if (tt->wheel) {
+		tt_wheel_advance(tt->wheel, tt_wheel_now());
+		tt_obj = g_queue_peek_head(&tt->wheel->expired);
+		if (tt_obj)
+			return tt_obj;
+		*sleeptime = tt_wheel_sleeptime(tt->wheel, 100000);
+		return NULL;
+	}
+
+	tt_obj = g_tree_find_first(tt->tree, NULL, NULL);
+	if (!tt_obj) {
+		*sleeptime = 100000;
+		return NULL;
+	}
+	*sleeptime = timeval_diff(&tt_obj->next_check, &rtpe_now);
+	if (*sleeptime <= tt->slack)
+		return tt_obj;
+	return NULL;
+}
+
+// ->lock must be held. returns true if the object was scheduled
+static int timerthread_remove(struct timerthread *tt, struct timerthread_obj *tt_obj) {
+	if (tt->wheel) {
+		if (!tt_obj->wheel_slot)
+			return 0;
+		tt_wheel_remove(tt->wheel, tt_obj);
+		return 1;
+	}
+	return g_tree_remove(tt->tree, tt_obj);
+}
+
+// ->lock must be held. it's released while the object runs
+static void timerthread_run_obj(struct timerthread *tt, struct timerthread_obj *tt_obj) {
+	// steal reference
+	timerthread_remove(tt, tt_obj);
+	ZERO(tt_obj->next_check);
+	tt_obj->last_run = rtpe_now;
+	mutex_unlock(&tt->lock);
+
+	// run and release
+	tt->func(tt_obj);
+	obj_put(tt_obj);
+
+	mutex_lock(&tt->lock);
+}
+
 void timerthread_run(void *p) {
 	struct timerthread *tt = p;
+	int ran = 0;
 
 	mutex_lock(&tt->lock);
 
@@ -28,30 +208,26 @@ void timerthread_run(void *p) {
 		gettimeofday(&rtpe_now, NULL);
 
 		/* lock our list and get the first element */
-		struct timerthread_obj *tt_obj = g_tree_find_first(tt->tree, NULL, NULL);
+		long long sleeptime;
+		struct timerthread_obj *tt_obj = timerthread_next(tt, &sleeptime);
 		/* scheduled to run? if not, we just go to sleep, otherwise we remove it from the tree,
 		 * steal the reference and run it */
 		if (!tt_obj)
 			goto sleep;
-		if (timeval_cmp(&rtpe_now, &tt_obj->next_check) < 0)
-			goto sleep;
 
-		// steal reference
-		g_tree_remove(tt->tree, tt_obj);
-		ZERO(tt_obj->next_check);
-		tt_obj->last_run = rtpe_now;
-		mutex_unlock(&tt->lock);
-
-		// run and release
-		tt->func(tt_obj);
-		obj_put(tt_obj);
-
-		mutex_lock(&tt->lock);
+		timerthread_run_obj(tt, tt_obj);
+		ran = 1;
 		continue;
 
 sleep:;
+		if (ran && tt->idle_func) {
+			ran = 0;
+			mutex_unlock(&tt->lock);
+			tt->idle_func();
+			mutex_lock(&tt->lock);
+			continue; // new objects may have become due meanwhile
+		}
 		/* figure out how long we should sleep */
-		long long sleeptime = tt_obj ? timeval_diff(&tt_obj->next_check, &rtpe_now) : 100000;
 		sleeptime = MIN(100000, sleeptime); /* 100 ms at the most */
 		struct timeval tv = rtpe_now;
 		timeval_add_usec(&tv, sleeptime);
@@ -61,6 +237,126 @@ sleep:;
 	mutex_unlock(&tt->lock);
 }
 
+// ->lock must be held. only ever moves the timerfd expiry forward
+static void timerthread_arm(struct timerthread *tt, const struct timeval *tv) {
+	if (tt->armed.tv_sec && timeval_cmp(&tt->armed, tv) <= 0)
+		return;
+
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = tv->tv_sec,
+			.tv_nsec = tv->tv_usec * 1000,
+		},
+	};
+	if (timerfd_settime(tt->timerfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		ilog(LOG_ERR, "Failed to arm timerfd: %s", strerror(errno));
+		return;
+	}
+	tt->armed = *tv;
+}
+
+// runs from the poller threads when the timerfd expires. any thread of the poller can
+// get here, so this runs everything that is due and then re-arms for the next object
+static void timerthread_poller_readable(int fd, void *p, uintptr_t u) {
+	struct timerthread_poller *ttp = p;
+	struct timerthread *tt = &ttp->tt;
+	uint64_t exp;
+
+	if (read(fd, &exp, sizeof(exp)) != sizeof(exp) && errno == EAGAIN)
+		return; // another thread beat us to it
+
+	mutex_lock(&tt->lock);
+	ZERO(tt->armed);
+
+	long long sleeptime = 100000;
+	struct timerthread_obj *tt_obj;
+	while (!rtpe_shutdown) {
+		gettimeofday(&rtpe_now, NULL);
+		tt_obj = timerthread_next(tt, &sleeptime);
+		if (!tt_obj)
+			break;
+		timerthread_run_obj(tt, tt_obj);
+	}
+
+	if (tt->wheel || g_tree_nnodes(tt->tree)) {
+		struct timeval tv = rtpe_now;
+		timeval_add_usec(&tv, MIN(100000, sleeptime));
+		timerthread_arm(tt, &tv);
+	}
+
+	mutex_unlock(&tt->lock);
+}
+
+static void timerthread_poller_closed(int fd, void *p, uintptr_t u) {
+	ilog(LOG_ERR, "Timer file descriptor closed unexpectedly");
+}
+
+static void __ttp_put(void *p) {
+	struct timerthread_poller *ttp = p;
+	obj_put(ttp);
+}
+
+static void timerthread_poller_free(void *p) {
+	struct timerthread_poller *ttp = p;
+	timerthread_free(&ttp->tt);
+}
+
+void timerthread_pollers_init(struct timerthread_pollers *ttps, void (*func)(void *),
+		void *(*init)(struct timerthread *))
+{
+	ttps->func = func;
+	ttps->init = init;
+	mutex_init(&ttps->lock);
+	ttps->tts = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, __ttp_put);
+}
+
+void timerthread_pollers_free(struct timerthread_pollers *ttps) {
+	if (ttps->tts)
+		g_hash_table_destroy(ttps->tts);
+	ttps->tts = NULL;
+	mutex_destroy(&ttps->lock);
+}
+
+struct timerthread_poller *timerthread_pollers_get(struct timerthread_pollers *ttps, struct poller *p) {
+	mutex_lock(&ttps->lock);
+
+	struct timerthread_poller *ttp = g_hash_table_lookup(ttps->tts, p);
+	if (ttp)
+		goto out;
+
+	ttp = obj_alloc0("timerthread_poller", sizeof(*ttp), timerthread_poller_free);
+	timerthread_init(&ttp->tt, ttps->func);
+	ttp->tt.poller = p;
+	if (ttps->init)
+		ttp->priv = ttps->init(&ttp->tt);
+	g_hash_table_insert(ttps->tts, p, ttp);
+
+	if (!p)
+		goto out;
+
+	ttp->tt.timerfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ttp->tt.timerfd == -1) {
+		ilog(LOG_ERR, "Failed to create timerfd: %s", strerror(errno));
+		abort();
+	}
+
+	struct poller_item pi = {
+		.fd = ttp->tt.timerfd,
+		.obj = &ttp->obj,
+		.readable = timerthread_poller_readable,
+		.closed = timerthread_poller_closed,
+		.type = POLLER_CB_TIMER,
+	};
+	if (poller_add_item(p, &pi)) {
+		ilog(LOG_ERR, "Failed to add timerfd to poller");
+		abort();
+	}
+
+out:
+	mutex_unlock(&ttps->lock);
+	return ttp;
+}
+
 void timerthread_obj_schedule_abs_nl(struct timerthread_obj *tt_obj, const struct timeval *tv) {
 	if (!tt_obj)
 		return;
@@ -71,10 +367,15 @@ void timerthread_obj_schedule_abs_nl(struct timerthread_obj *tt_obj, const struc
 	struct timerthread *tt = tt_obj->tt;
 	if (tt_obj->next_check.tv_sec && timeval_cmp(&tt_obj->next_check, tv) <= 0)
 		return; /* already scheduled sooner */
-	if (!g_tree_remove(tt->tree, tt_obj))
+	if (!timerthread_remove(tt, tt_obj))
 		obj_hold(tt_obj); /* if it wasn't removed, we make a new reference */
 	tt_obj->next_check = *tv;
-	g_tree_insert(tt->tree, tt_obj, tt_obj);
+	if (tt->wheel)
+		tt_wheel_insert(tt->wheel, tt_obj);
+	else
+		g_tree_insert(tt->tree, tt_obj, tt_obj);
+	if (tt->timerfd != -1)
+		timerthread_arm(tt, tv);
 	cond_broadcast(&tt->cond);
 }
 
@@ -82,11 +383,10 @@ void timerthread_obj_deschedule(struct timerthread_obj *tt_obj) {
 	if (!tt_obj)
 		return;
 
-	struct timerthread *tt = tt_obj->tt;
-	mutex_lock(&tt->lock);
+	struct timerthread *tt = timerthread_obj_lock(tt_obj);
 	if (!tt_obj->next_check.tv_sec)
 		goto nope; /* already descheduled */
-	int ret = g_tree_remove(tt->tree, tt_obj);
+	int ret = timerthread_remove(tt, tt_obj);
 	ZERO(tt_obj->next_check);
 	if (ret)
 		obj_put(tt_obj);
@@ -94,6 +394,42 @@ nope:
 	mutex_unlock(&tt->lock);
 }
 
+// takes a scheduled object along, keeping its due time
+void timerthread_obj_move(struct timerthread_obj *tt_obj, struct timerthread *to) {
+	struct timerthread *from;
+
+	while (1) {
+		from = g_atomic_pointer_get(&tt_obj->tt);
+		if (from == to)
+			return;
+		// fixed lock order, in case of objects moving the other way
+		if (from < to) {
+			mutex_lock(&from->lock);
+			mutex_lock(&to->lock);
+		}
+		else {
+			mutex_lock(&to->lock);
+			mutex_lock(&from->lock);
+		}
+		if (tt_obj->tt == from)
+			break;
+		mutex_unlock(&from->lock);
+		mutex_unlock(&to->lock);
+	}
+
+	struct timeval next = tt_obj->next_check;
+	int scheduled = next.tv_sec && timerthread_remove(from, tt_obj);
+	ZERO(tt_obj->next_check);
+	g_atomic_pointer_set(&tt_obj->tt, to);
+	if (scheduled) {
+		timerthread_obj_schedule_abs_nl(tt_obj, &next); // makes a new reference
+		obj_put(tt_obj); // held by the old one
+	}
+
+	mutex_unlock(&from->lock);
+	mutex_unlock(&to->lock);
+}
+
 static int timerthread_queue_run_one(struct timerthread_queue *ttq,
 		struct timerthread_queue_entry *ttqe,
 		void (*run_func)(struct timerthread_queue *, void *)) {
@@ -101,6 +437,7 @@ static int timerthread_queue_run_one(struct timerthread_queue *ttq,
 		if(timeval_diff(&ttqe->when, &rtpe_now) > 1000) // not to queue packet less than 1ms
 			return -1; // not yet
 	}
+	PROBE(timer_fire, ttq->type, ttqe->when.tv_sec ? timeval_diff(&rtpe_now, &ttqe->when) : 0);
 	run_func(ttq, ttqe);
 	return 0;
 }
@@ -0,0 +1,119 @@
+#include "trace.h"
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "main.h"
+#include "log.h"
+#include "call.h"
+
+
+struct trace_ring {
+	struct trace_header *hdr;
+	struct trace_event *events;
+};
+
+static volatile unsigned int trace_next_id;
+// NULL: not set up yet. points to trace_ring_failed if the file couldn't be created
+static __thread struct trace_ring *trace_ring;
+static struct trace_ring trace_ring_failed;
+
+
+void trace_init(void) {
+	if (!rtpe_config.trace_dir)
+		return;
+	if (!g_file_test(rtpe_config.trace_dir, G_FILE_TEST_IS_DIR))
+		die("Trace directory '%s' doesn't exist (--trace-dir)", rtpe_config.trace_dir);
+	if (rtpe_config.trace_events <= 0)
+		rtpe_config.trace_events = 65536;
+}
+
+static struct trace_ring *trace_ring_open(void) {
+	pid_t tid = syscall(SYS_gettid);
+	size_t size = sizeof(struct trace_header) + sizeof(struct trace_event) * rtpe_config.trace_events;
+	AUTO_CLEANUP_GBUF(path);
+	path = g_strdup_printf("%s/rtpengine-trace.%u.%u", rtpe_config.trace_dir,
+			(unsigned int) getpid(), (unsigned int) tid);
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		goto err;
+	if (ftruncate(fd, size)) {
+		close(fd);
+		goto err;
+	}
+	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		goto err;
+
+	struct trace_ring *r = g_slice_alloc(sizeof(*r));
+	r->hdr = map;
+	r->events = (void *) (r->hdr + 1);
+	memcpy(r->hdr->magic, TRACE_MAGIC, sizeof(r->hdr->magic));
+	r->hdr->version = TRACE_VERSION;
+	r->hdr->event_size = sizeof(struct trace_event);
+	r->hdr->num_events = rtpe_config.trace_events;
+	r->hdr->tid = tid;
+	r->hdr->head = 0;
+
+	ilog(LOG_INFO, "Writing trace events of thread %u to '%s'", (unsigned int) tid, path);
+	return r;
+
+err:
+	ilog(LOG_ERR, "Failed to create trace file '%s': %s", path, strerror(errno));
+	return &trace_ring_failed;
+}
+
+void __trace_event(uint32_t id, uint16_t port, enum trace_event_id ev,
+		uint32_t a, uint32_t b, uint32_t c, uint32_t d)
+{
+	struct trace_ring *r = trace_ring;
+	if (G_UNLIKELY(!r))
+		r = trace_ring = trace_ring_open();
+	if (G_UNLIKELY(!r->hdr))
+		return;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	// the ring is only ever written by this thread
+	uint64_t head = r->hdr->head;
+	struct trace_event *e = &r->events[head % r->hdr->num_events];
+	*e = (struct trace_event) {
+		.ts = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec,
+		.call = id,
+		.port = port,
+		.event = ev,
+		.args = { a, b, c, d },
+	};
+	__atomic_store_n(&r->hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+unsigned int trace_call_enable(struct call *c, int enable) {
+	if (!enable) {
+		if (c->trace_id)
+			ilog(LOG_NOTICE, "Stopped tracing call [" STR_FORMAT_M "] with trace ID %u",
+					STR_FMT_M(&c->callid), c->trace_id);
+		g_atomic_int_set(&c->trace_id, 0);
+		return 0;
+	}
+	if (!rtpe_config.trace_dir)
+		return 0;
+	if (c->trace_id)
+		return c->trace_id;
+
+	unsigned int id;
+	do
+		id = g_atomic_int_add(&trace_next_id, 1) + 1;
+	while (!id);
+	g_atomic_int_set(&c->trace_id, id);
+
+	ilog(LOG_NOTICE, "Tracing call [" STR_FORMAT_M "] with trace ID %u", STR_FMT_M(&c->callid), id);
+	return id;
+}
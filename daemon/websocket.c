@@ -18,10 +18,11 @@ struct websocket_output {
 	GString *str;
 	size_t str_done;
 	enum lws_write_protocol protocol;
+	int padded:1;
 };
 
 struct websocket_conn {
-	// used in the single threaded libwebsockets context
+	// used by the libwebsockets service thread which owns the connection
 	struct lws *wsi;
 	endpoint_t endpoint;
 	char *uri; // for websocket connections only
@@ -38,9 +39,18 @@ struct websocket_conn {
 };
 
 
+// output buffers are recycled. they can grow large for /metrics and such
+#define WEBSOCKET_BUF_POOL	16
+#define WEBSOCKET_BUF_MAX	(1024 * 1024)	// larger ones aren't kept
+#define WEBSOCKET_HTTP_CHUNK	65536		// max HTTP body bytes written per writeable callback
+
+
 static GQueue websocket_vhost_configs;
+static mutex_t websocket_bufs_lock = MUTEX_STATIC_INIT;
+static GQueue websocket_bufs = G_QUEUE_INIT;
 static struct lws_context *websocket_context;
 static GThreadPool *websocket_threads;
+static volatile int websocket_service_threads; // still running
 
 
 static struct websocket_message *websocket_message_new(struct websocket_conn *wc) {
@@ -61,6 +71,31 @@ static void websocket_message_free(struct websocket_message **wm) {
 }
 
 
+// returns a buffer with LWS_PRE bytes reserved at the start
+static GString *websocket_buf_get(void) {
+	mutex_lock(&websocket_bufs_lock);
+	GString *s = g_queue_pop_head(&websocket_bufs);
+	mutex_unlock(&websocket_bufs_lock);
+	if (!s)
+		s = g_string_sized_new(4096);
+	g_string_set_size(s, LWS_PRE);
+	return s;
+}
+
+static void websocket_buf_put(GString *s) {
+	if (s->allocated_len <= WEBSOCKET_BUF_MAX) {
+		mutex_lock(&websocket_bufs_lock);
+		if (websocket_bufs.length < WEBSOCKET_BUF_POOL) {
+			g_queue_push_tail(&websocket_bufs, s);
+			s = NULL;
+		}
+		mutex_unlock(&websocket_bufs_lock);
+	}
+	if (s)
+		g_string_free(s, TRUE);
+}
+
+
 static struct websocket_output *websocket_output_new(void) {
 	struct websocket_output *wo = g_slice_alloc0(sizeof(*wo));
 	// str remains NULL -> unused output slot
@@ -70,7 +105,7 @@ static struct websocket_output *websocket_output_new(void) {
 static void websocket_output_free(void *p) {
 	struct websocket_output *wo = p;
 	if (wo->str)
-		g_string_free(wo->str, TRUE);
+		websocket_buf_put(wo->str);
 	g_slice_free1(sizeof(*wo), wo);
 }
 
@@ -80,9 +115,7 @@ static void __websocket_queue_raw(struct websocket_conn *wc, const char *msg, si
 	struct websocket_output *wo = g_queue_peek_tail(&wc->output_q);
 
 	if (!wo->str) {
-		wo->str = g_string_new("");
-		// allocate pre-buffer
-		g_string_set_size(wo->str, LWS_PRE);
+		wo->str = websocket_buf_get();
 		wo->str_done = LWS_PRE;
 	}
 
@@ -91,6 +124,23 @@ static void __websocket_queue_raw(struct websocket_conn *wc, const char *msg, si
 }
 
 
+// appends a buffer from websocket_buf_get() to the output without copying it if possible,
+// and takes ownership of it
+static void websocket_queue_buf(struct websocket_conn *wc, GString *s) {
+	mutex_lock(&wc->lock);
+	struct websocket_output *wo = g_queue_peek_tail(&wc->output_q);
+	if (!wo->str) {
+		wo->str = s;
+		wo->str_done = LWS_PRE;
+	}
+	else {
+		g_string_append_len(wo->str, s->str + LWS_PRE, s->len - LWS_PRE);
+		websocket_buf_put(s);
+	}
+	mutex_unlock(&wc->lock);
+}
+
+
 // appends to output buffer without triggering a response
 void websocket_queue_raw(struct websocket_conn *wc, const char *msg, size_t len) {
 	mutex_lock(&wc->lock);
@@ -215,30 +265,47 @@ static int websocket_dequeue(struct websocket_conn *wc) {
 
 	mutex_lock(&wc->lock);
 	struct websocket_output *wo;
-	while ((wo = g_queue_pop_head(&wc->output_q))) {
+	while ((wo = g_queue_peek_head(&wc->output_q))) {
 		// used buffer slot?
 		if (wo->str) {
 			// allocate post-buffer
-			g_string_set_size(wo->str, wo->str->len + LWS_SEND_BUFFER_POST_PADDING);
+			if (!wo->padded) {
+				g_string_set_size(wo->str, wo->str->len + LWS_SEND_BUFFER_POST_PADDING);
+				wo->padded = 1;
+			}
 			size_t to_send = wo->str->len - wo->str_done - LWS_SEND_BUFFER_POST_PADDING;
 			if (to_send) {
-				if (to_send > 500)
-					ilog(LOG_DEBUG, "Writing %lu bytes to LWS", (unsigned long) to_send);
+				// large HTTP bodies go out in pieces, one per writeable callback
+				size_t len = to_send;
+				if (wo->protocol == LWS_WRITE_HTTP && len > WEBSOCKET_HTTP_CHUNK)
+					len = WEBSOCKET_HTTP_CHUNK;
+
+				if (len > 500)
+					ilog(LOG_DEBUG, "Writing %lu bytes to LWS", (unsigned long) len);
 				else
 					ilog(LOG_DEBUG, "Writing back to LWS: '%.*s'",
-							(int) to_send, wo->str->str + wo->str_done);
+							(int) len, wo->str->str + wo->str_done);
 				size_t ret = lws_write(wc->wsi, (unsigned char *) wo->str->str + wo->str_done,
-						to_send, wo->protocol);
-				if (ret != to_send)
+						len, wo->protocol);
+				if (ret != len) {
 					ilog(LOG_ERR, "Invalid LWS write: %lu != %lu",
 							(unsigned long) ret,
-							(unsigned long) to_send);
+							(unsigned long) len);
+					ret = to_send; // give up on the rest
+				}
 				wo->str_done += ret;
 
+				if (ret < to_send) {
+					lws_callback_on_writable(wc->wsi);
+					mutex_unlock(&wc->lock);
+					return 0;
+				}
+
 				if (wo->protocol == LWS_WRITE_HTTP)
 					is_http = 1;
 			}
 		}
+		g_queue_pop_head(&wc->output_q);
 		websocket_output_free(wo);
 	}
 	g_queue_push_tail(&wc->output_q, websocket_output_new());
@@ -303,9 +370,6 @@ static const char *websocket_http_ping(struct websocket_message *wm) {
 }
 
 
-static void __g_string_free(GString **s) {
-	g_string_free(*s, TRUE);
-}
 static void __g_hash_table_destroy(GHashTable **s) {
 	g_hash_table_destroy(*s);
 }
@@ -313,9 +377,10 @@ static const char *websocket_http_metrics(struct websocket_message *wm) {
 	ilog(LOG_DEBUG, "Respoding to GET /metrics");
 
 	AUTO_CLEANUP_INIT(GQueue *metrics, statistics_free_metrics, statistics_gather_metrics());
-	AUTO_CLEANUP_INIT(GString *outp, __g_string_free, g_string_new(""));
 	AUTO_CLEANUP_INIT(GHashTable *metric_types, __g_hash_table_destroy,
 			g_hash_table_new(g_str_hash, g_str_equal));
+	// formatted straight into an output buffer
+	GString *outp = websocket_buf_get();
 
 	for (GList *l = metrics->head; l; l = l->next) {
 		struct stats_metric *m = l->data;
@@ -342,7 +407,15 @@ static const char *websocket_http_metrics(struct websocket_message *wm) {
 		g_string_append_printf(outp, " %s\n", m->value_short);
 	}
 
-	return websocket_http_complete(wm->wc, 200, "text/plain", outp->len, outp->str);
+	statistics_prometheus(outp);
+
+	if (websocket_http_response(wm->wc, 200, "text/plain", outp->len - LWS_PRE)) {
+		websocket_buf_put(outp);
+		return "Failed to write response HTTP headers";
+	}
+	websocket_queue_buf(wm->wc, outp);
+	websocket_write_http(wm->wc, NULL, 1);
+	return NULL;
 }
 
 
@@ -442,6 +515,57 @@ static const char *websocket_http_ng(struct websocket_message *wm) {
 }
 
 
+static void websocket_ng_job_done(struct websocket_conn *wc) {
+	mutex_lock(&wc->lock);
+	assert(wc->jobs >= 1);
+	wc->jobs--;
+	cond_signal(&wc->cond);
+	mutex_unlock(&wc->lock);
+}
+static void websocket_ng_done_ws(void *p1, int ret) {
+	websocket_ng_job_done(p1);
+}
+static void websocket_ng_done_http(void *p1, int ret) {
+	struct websocket_conn *wc = p1;
+	if (ret)
+		websocket_http_complete(wc, 600, "text/plain", 6, "error\n");
+	websocket_ng_job_done(wc);
+}
+
+// NG commands go to the control worker pool, which keeps the commands for each call in
+// order. called from the service thread, so the order of commands is preserved
+static void websocket_ng_push(struct websocket_conn *wc, websocket_message_func_t func) {
+	struct websocket_message *wm = wc->wm;
+	char addr[64];
+	str cmd;
+
+	endpoint_print(&wc->endpoint, addr, sizeof(addr));
+	str_init_len(&cmd, wm->body->str, wm->body->len);
+
+	mutex_lock(&wc->lock);
+	wc->jobs++;
+	mutex_unlock(&wc->lock);
+
+	if (control_ng_queue(&cmd, &wc->endpoint, addr,
+				func == websocket_http_ng ? websocket_ng_send_http : websocket_ng_send_ws, wc,
+				func == websocket_http_ng ? websocket_ng_done_http : websocket_ng_done_ws))
+	{
+		// no workers
+		websocket_ng_job_done(wc);
+		websocket_message_push(wc, func);
+		return;
+	}
+
+	ilog(LOG_DEBUG, "Queued HTTP/WS NG request from %s", addr);
+
+	// the command was copied
+	mutex_lock(&wc->lock);
+	websocket_message_free(&wc->wm);
+	wc->wm = websocket_message_new(wc);
+	mutex_unlock(&wc->lock);
+}
+
+
 
 
 static int websocket_http_get(struct websocket_conn *wc) {
@@ -532,6 +656,11 @@ static int websocket_http_body(struct websocket_conn *wc, const char *body, size
 		return 0;
 	}
 
+	if (handler == websocket_http_ng) {
+		websocket_ng_push(wc, handler);
+		return 0;
+	}
+
 	websocket_message_push(wc, handler);
 	return 0;
 }
@@ -732,7 +861,10 @@ static int websocket_protocol(struct lws *wsi, enum lws_callback_reasons reason,
 					name, wc->uri, (int) len, (const char *) in);
 			wc->wm->method = M_WEBSOCKET;
 			g_string_append_len(wc->wm->body, in, len);
-			websocket_message_push(wc, handler_func);
+			if (handler_func == websocket_ng_process)
+				websocket_ng_push(wc, handler_func);
+			else
+				websocket_message_push(wc, handler_func);
 			break;
 		case LWS_CALLBACK_SERVER_WRITEABLE:
 			return websocket_dequeue(user);
@@ -810,6 +942,10 @@ static void websocket_cleanup(void) {
 		g_thread_pool_free(websocket_threads, TRUE, TRUE);
 	websocket_threads = NULL;
 
+	GString *s;
+	while ((s = g_queue_pop_head(&websocket_bufs)))
+		g_string_free(s, TRUE);
+
 	while (websocket_vhost_configs.length) {
 		struct lws_context_creation_info *vhost = g_queue_pop_head(&websocket_vhost_configs);
 		free((void *) vhost->iface);
@@ -835,6 +971,8 @@ int websocket_init(void) {
 			LWS_SERVER_OPTION_FAIL_UPON_UNABLE_TO_BIND |
 #endif
 			0,
+		// connections are spread across the service threads, each one owning its own
+		.count_threads = rtpe_config.http_service_threads ? : 1,
 	};
 	websocket_context = lws_create_context(&wci);
 	err = "Failed to create LWS context";
@@ -896,7 +1034,8 @@ int websocket_init(void) {
 	int num_threads = rtpe_config.http_threads ? : rtpe_config.num_threads;
 	websocket_threads = g_thread_pool_new(websocket_process, NULL, num_threads, FALSE, NULL);
 
-	ilog(LOG_DEBUG, "Websocket init complete with %i threads", num_threads);
+	ilog(LOG_DEBUG, "Websocket init complete with %i threads and %i service threads", num_threads,
+			lws_get_count_threads(websocket_context));
 	return 0;
 
 err:
@@ -906,15 +1045,23 @@ err:
 }
 
 static void websocket_loop(void *p) {
-	ilog(LOG_INFO, "Websocket listener thread running");
+	int tsi = GPOINTER_TO_INT(p);
+
+	ilog(LOG_INFO, "Websocket listener thread %i running", tsi);
 	while (!rtpe_shutdown)
-		lws_service(websocket_context, 100);
+		lws_service_tsi(websocket_context, 100, tsi);
 
-	websocket_cleanup();
+	// the last one out tears down the context
+	if (g_atomic_int_dec_and_test(&websocket_service_threads))
+		websocket_cleanup();
 }
 
 void websocket_start(void) {
 	if (!websocket_context)
 		return;
-	thread_create_detach_prio(websocket_loop, NULL, rtpe_config.scheduling, rtpe_config.priority);
+	int num = lws_get_count_threads(websocket_context);
+	g_atomic_int_set(&websocket_service_threads, num);
+	for (int i = 0; i < num; i++)
+		thread_create_detach_prio(websocket_loop, GINT_TO_POINTER(i), rtpe_config.scheduling,
+				rtpe_config.priority);
 }
@@ -165,6 +165,10 @@ install -D -p -m644 kernel-module/xt_RTPENGINE.h \
 mkdir -p %{buildroot}%{_usrsrc}/%{name}-%{version}-%{release}
 install -D -p -m644 kernel-module/rtpengine_config.h \
 	 %{buildroot}%{_usrsrc}/%{name}-%{version}-%{release}/rtpengine_config.h
+install -D -p -m644 kernel-module/rtpengine_demux.h \
+	 %{buildroot}%{_usrsrc}/%{name}-%{version}-%{release}/rtpengine_demux.h
+install -D -p -m644 kernel-module/rtpengine_replay.h \
+	 %{buildroot}%{_usrsrc}/%{name}-%{version}-%{release}/rtpengine_replay.h
 install -D -p -m644 debian/dkms.conf.in %{buildroot}%{_usrsrc}/%{name}-%{version}-%{release}/dkms.conf
 sed -i -e "s/__VERSION__/%{version}-%{release}/g" %{buildroot}%{_usrsrc}/%{name}-%{version}-%{release}/dkms.conf
 
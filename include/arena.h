@@ -0,0 +1,37 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <glib.h>
+#include <sys/types.h>
+
+
+// Optional per-call arena (--call-arena). The call's monologues, media sections,
+// packet streams, endpoint maps and call_malloc() memory are carved out of blocks
+// which are themselves taken from large hugepage-backed regions, so that one call's
+// objects sit close together. Nothing is freed individually; all blocks go back to
+// the global pool at once when the call is freed.
+
+enum arena_mode {
+	ARENA_OFF = 0,
+	ARENA_THP,		// regular mmap() plus MADV_HUGEPAGE
+	ARENA_HUGETLB,		// MAP_HUGETLB, falling back to ARENA_THP
+};
+
+struct arena_block;
+struct arena_large;
+
+struct arena {
+	struct arena_block	*blocks;	// current block first
+	struct arena_large	*large;		// allocations too big for a block
+	int			node;		// NUMA node to take new blocks from, or -1
+	unsigned int		active:1;
+};
+
+
+void arena_init(enum arena_mode);
+void arena_new(struct arena *);
+void *arena_alloc(struct arena *, size_t); // zeroed memory
+void arena_free(struct arena *);
+
+
+#endif
@@ -276,6 +276,42 @@ INLINE void thread_create_detach(void (*f)(void *), void *a) {
 
 
 
+/*** PER-THREAD FREE LISTS ***/
+
+// keeps fixed-size objects around for reuse, to be declared as __thread. objects go into
+// the list of whichever thread releases them. threads live for the lifetime of the
+// process, so the objects in the lists are never freed
+struct freelist {
+	void *head;
+	unsigned int len;
+};
+
+INLINE void *freelist_alloc(struct freelist *fl, size_t size) {
+	void *p = fl->head;
+	if (!p)
+		return g_slice_alloc(size);
+	fl->head = *(void **) p;
+	fl->len--;
+	return p;
+}
+INLINE void *freelist_alloc0(struct freelist *fl, size_t size) {
+	void *p = freelist_alloc(fl, size);
+	memset(p, 0, size);
+	return p;
+}
+INLINE void freelist_free(struct freelist *fl, void *p, size_t size, unsigned int max) {
+	if (fl->len >= max) {
+		g_slice_free1(size, p);
+		return;
+	}
+	*(void **) p = fl->head;
+	fl->head = p;
+	fl->len++;
+}
+
+
+
+
 /*** ATOMIC BITFIELD OPERATIONS ***/
 
 /* checks if at least one of the flags is set */
@@ -336,6 +372,16 @@ INLINE int bit_array_set(volatile unsigned int *name, unsigned int bit) {
 INLINE int bit_array_clear(volatile unsigned int *name, unsigned int bit) {
 	return bf_clear(&name[bit / (sizeof(int) * 8)], 1U << (bit % (sizeof(int) * 8)));
 }
+// sets bits [from, to), a word at a time and non-atomically. for initialisation only
+INLINE void bit_array_set_range(volatile unsigned int *name, unsigned int from, unsigned int to) {
+	const unsigned int wbits = sizeof(int) * 8;
+	for (; from < to && (from % wbits); from++)
+		name[from / wbits] |= 1U << (from % wbits);
+	for (; from + wbits <= to; from += wbits)
+		name[from / wbits] = ~0U;
+	for (; from < to; from++)
+		name[from / wbits] |= 1U << (from % wbits);
+}
 
 
 
@@ -64,6 +64,14 @@ struct bencode_buffer {
  * Returns 0 on success or -1 on failure (if no memory could be allocated). */
 int bencode_buffer_init(bencode_buffer_t *buf);
 
+/* Identical to bencode_buffer_init(), but makes the first piece of memory at least "size" bytes
+ * large. Using a size hint taken from previous similar documents (see bencode_buffer_used()) lets
+ * a complete decode and encode run be served from a single allocation. */
+int bencode_buffer_init_size(bencode_buffer_t *buf, unsigned int size);
+
+/* Returns the number of bytes that have been allocated from the buffer object so far. */
+unsigned int bencode_buffer_used(bencode_buffer_t *buf);
+
 /* Allocate a piece of memory from the given buffer object */
 void *bencode_buffer_alloc(bencode_buffer_t *, unsigned int);
 
@@ -235,6 +243,12 @@ char *bencode_collapse(bencode_item_t *root, int *len);
 /* Identical to bencode_collapse() but fills in a "str" object. Returns "out". */
 static str *bencode_collapse_str(bencode_item_t *root, str *out);
 
+/* Similar to bencode_collapse(), but writes the encoded document into the memory pointed to by "out",
+ * which is "size" bytes large, instead of allocating it. The size required (excluding the null
+ * terminator) is known in advance through the "str_len" member of the root object. Returns the length
+ * of the generated string, or -1 if the given memory is too small. */
+int bencode_collapse_buf(bencode_item_t *root, char *out, unsigned int size);
+
 /* Identical to bencode_collapse(), but the memory for the returned string is not allocated from
  * a bencode_buffer_t object, but instead using the function defined as BENCODE_MALLOC (normally
  * malloc() or pkg_malloc()), similar to strdup(). Using this function, the bencode_buffer_t
@@ -345,6 +359,10 @@ INLINE long long int bencode_dictionary_get_integer(bencode_item_t *dict, const
 /* Identical to bencode_dictionary_get_integer() but allows for the item to be a string. */
 INLINE long long int bencode_dictionary_get_int_str(bencode_item_t *dict, const char *key, long long int defval);
 
+/* Identical to bencode_dictionary_get_int_str() but operates on an item already retrieved, e.g. while
+ * iterating over a dictionary. */
+INLINE long long int bencode_get_int_str(bencode_item_t *val, long long int defval);
+
 /* Identical to bencode_dictionary_get(), but returns the object only if its type matches "expect". */
 INLINE bencode_item_t *bencode_dictionary_get_expect(bencode_item_t *dict, const char *key, bencode_type_t expect);
 
@@ -519,8 +537,10 @@ INLINE long long int bencode_dictionary_get_integer(bencode_item_t *dict, const
 }
 
 INLINE long long int bencode_dictionary_get_int_str(bencode_item_t *dict, const char *key, long long int defval) {
-	bencode_item_t *val;
-	val = bencode_dictionary_get(dict, key);
+	return bencode_get_int_str(bencode_dictionary_get(dict, key), defval);
+}
+
+INLINE long long int bencode_get_int_str(bencode_item_t *val, long long int defval) {
 	if (!val)
 		return defval;
 	if (val->type == BENCODE_INTEGER)
@@ -60,6 +60,19 @@ enum call_stream_state {
 	CSS_RUNNING,
 };
 
+// categories of memory accounted to a call, see call_mem_add()
+enum call_mem {
+	CALL_MEM_BUFFER = 0,	// call_malloc()
+	CALL_MEM_CODEC,		// codec handlers and their SSRC handlers
+	CALL_MEM_SSRC,		// the call's SSRC hash
+	CALL_MEM_JB,		// jitter buffers
+	CALL_MEM_PLAYER,	// media players
+	CALL_MEM_RECORDING,
+	CALL_MEM_REDIS,		// size of the last call encoding written to Redis
+
+	__CALL_MEM_LAST
+};
+
 #define ERROR_NO_FREE_PORTS	-100
 #define ERROR_NO_FREE_LOGS	-101
 
@@ -72,6 +85,10 @@ enum call_stream_state {
 #define RTP_LOOP_PROTECT	28 /* number of bytes */
 #define RTP_LOOP_PACKETS	2  /* number of packets */
 #define RTP_LOOP_MAX_COUNT	30 /* number of consecutively detected dupes to trigger protection */
+
+#define RTP_STATS_SLOTS		32 /* per-PT stats kept for each packet_stream */
+
+#define SIMULCAST_LAYERS	4  /* max number of simulcast layers per video stream */
 #endif
 
 #define IS_FOREIGN_CALL(c) (c->foreign_call)
@@ -115,7 +132,7 @@ enum call_stream_state {
 #define PS_FLAG_RTCP				0x00020000
 #define PS_FLAG_IMPLICIT_RTCP			SHARED_FLAG_IMPLICIT_RTCP
 #define PS_FLAG_FALLBACK_RTCP			0x00040000
-#define PS_FLAG_UNUSED2				0x00080000
+#define PS_FLAG_KERNEL_RTCP			0x00080000
 #define PS_FLAG_FILLED				0x00100000
 #define PS_FLAG_CONFIRMED			0x00200000
 #define PS_FLAG_KERNELIZED			0x00400000
@@ -173,6 +190,7 @@ enum call_stream_state {
 #include "bencode.h"
 #include "crypto.h"
 #include "dtls.h"
+#include "arena.h"
 
 
 struct poller;
@@ -194,6 +212,8 @@ struct send_timer;
 struct transport_protocol;
 struct jitter_buffer;
 struct codec_tracker;
+struct conference;
+struct simulcast;
 
 
 typedef bencode_buffer_t call_buffer_t;
@@ -224,6 +244,14 @@ struct stream_params {
 	int			ptime;
 	str			media_id;
 	struct t38_options	t38_options;
+	unsigned int		simulcast_layers; // from a=ssrc-group:SIM, lowest layer first
+	u_int32_t		simulcast_ssrcs[SIMULCAST_LAYERS];
+	u_int32_t		simulcast_rtx[SIMULCAST_LAYERS]; // from a=ssrc-group:FID, or 0
+};
+
+struct endpoint_map_key {
+	const struct logical_intf *logical_intf;
+	unsigned int		port;
 };
 
 struct endpoint_map {
@@ -233,16 +261,18 @@ struct endpoint_map {
 	const struct logical_intf *logical_intf;
 	GQueue			intf_sfds; /* list of struct intf_list - contains stream_fd list */
 	int			wildcard:1;
-};
 
-struct loop_protector {
-	unsigned int		len;
-	unsigned char		buf[RTP_LOOP_PROTECT];
+	struct endpoint_map_key	key; // as indexed in call_media->endpoint_maps_ht
+	struct endpoint_map	*older; // next map in the same hash bucket
 };
 
 
 
 struct packet_stream {
+	/* The fields needed to forward a packet come first and are kept together, so that
+	 * each packet touches as few cache lines as possible. See the layout check in
+	 * call.c. Setup data and the bigger structures follow after that. */
+
 	mutex_t			in_lock,
 				out_lock;
 	/* Both locks valid only with call->master_lock held in R.
@@ -251,44 +281,55 @@ struct packet_stream {
 
 	struct call_media	*media;		/* RO */
 	struct call		*call;		/* RO */
+	struct stream_fd * volatile selected_sfd;
+	struct packet_stream	*rtp_sink;	/* LOCK: call->master_lock */
+	struct packet_stream	*rtcp_sink;	/* LOCK: call->master_lock */
+	const struct streamhandler *handler;	/* LOCK: in_lock */
+	struct ssrc_ctx		*ssrc_in,	/* LOCK: in_lock */ // XXX eliminate these
+				*ssrc_out;	/* LOCK: out_lock */
+
+	/* in_lock must be held for SETTING these: */
+	volatile unsigned int	ps_flags;
+	atomic64		last_packet;
+
+	struct endpoint		endpoint;	/* LOCK: out_lock */
+	struct stats		stats;		/* only the first counters are per packet */
+
+	/* end of the per-packet fields */
+
 	unsigned int		component;	/* RO, starts with 1 */
 	unsigned int		unique_id;	/* RO */
 	struct recording_stream recording;	/* LOCK: call->master_lock */
 
 	GQueue			sfds;		/* LOCK: call->master_lock */
-	struct stream_fd * volatile selected_sfd;
 	struct dtls_connection	ice_dtls;	/* LOCK: in_lock */
-	struct packet_stream	*rtp_sink;	/* LOCK: call->master_lock */
-	struct packet_stream	*rtcp_sink;	/* LOCK: call->master_lock */
 	struct packet_stream	*rtcp_sibling;	/* LOCK: call->master_lock */
-	const struct streamhandler *handler;	/* LOCK: in_lock */
-	struct endpoint		endpoint;	/* LOCK: out_lock */
+	struct endpoint		advertised_endpoint; /* RO */ // only needed until the endpoint is confirmed
 	struct endpoint		detected_endpoints[4];	/* LOCK: out_lock */
 	struct timeval		ep_detect_signal; /* LOCK: out_lock */
-	struct endpoint		advertised_endpoint; /* RO */
 	struct crypto_context	crypto;		/* OUT direction, LOCK: out_lock */
-	struct ssrc_ctx		*ssrc_in,	/* LOCK: in_lock */ // XXX eliminate these
-				*ssrc_out;	/* LOCK: out_lock */
 	struct send_timer	*send_timer;	/* RO */
 	struct jitter_buffer	*jb;		/* RO */
 
-	struct stats		stats;
+	struct ssrc_ctx		*ssrc_in_alt,	/* LOCK: in_lock */ // previous SSRC, e.g. RTX or FEC
+				*ssrc_out_alt;	/* LOCK: out_lock */
+
 	struct stats		kernel_stats;
-	atomic64		last_packet;
-	GHashTable		*rtp_stats;	/* LOCK: call->master_lock */
-	struct rtp_stats	*rtp_stats_cache;
+	u_int32_t		kernel_lost;	/* LOCK: in_lock */
+	unsigned int		kernel_stats_slot; /* LOCK: in_lock */
+	/* LOCK: call->master_lock in W for adding entries: */
+	unsigned char		rtp_stats_idx[128]; // PT -> 1-based index into rtp_stats[], 0 = none
+	unsigned int		num_rtp_stats;
+	struct rtp_stats	rtp_stats[RTP_STATS_SLOTS];
 
 #if RTP_LOOP_PROTECT
 	/* LOCK: in_lock: */
 	unsigned int		lp_idx;
-	struct loop_protector	lp_buf[RTP_LOOP_PACKETS];
+	uint64_t		lp_buf[RTP_LOOP_PACKETS]; // fingerprints of the last packets, 0 = unused
 	unsigned int		lp_count;
 #endif
 
 	X509			*dtls_cert;	/* LOCK: in_lock */
-
-	/* in_lock must be held for SETTING these: */
-	volatile unsigned int	ps_flags;
 };
 
 /* protected by call->master_lock, except the RO elements */
@@ -313,6 +354,7 @@ struct call_media {
 
 	GQueue			streams; /* normally RTP + RTCP */
 	GQueue			endpoint_maps;
+	GHashTable		*endpoint_maps_ht; // endpoint_map_key -> newest endpoint_map; built on first use
 
 	// what we say we can receive (outgoing SDP):
 	GHashTable		*codecs_recv; // int payload type -> struct rtp_payload_type
@@ -330,12 +372,13 @@ struct call_media {
 	GHashTable		*codec_handlers; // int payload type -> struct codec_handler
 						// XXX combine this with 'codecs_recv' hash table?
 	GQueue			codec_handlers_store; // storage for struct codec_handler
-	struct codec_handler	*codec_handler_cache;
+	struct codec_handler	*codec_handlers_pt[128]; // same as codec_handlers, indexed by PT
 	struct rtcp_handler	*rtcp_handler;
 	struct timeval		rtcp_timer;	// master lock for scheduling purposes
 	struct codec_handler	*dtmf_injector;
 	struct t38_gateway	*t38_gateway;
 	struct codec_handler	*t38_handler;
+	struct simulcast	*simulcast; // layer selection for received simulcast video, or NULL
 #ifdef WITH_TRANSCODING
 	union {
 		struct {
@@ -364,16 +407,23 @@ struct call_monologue {
 	struct timeval         started; /* for CDR */
 	struct timeval         terminated; /* for CDR */
 	enum termination_reason term_reason;
-	GHashTable		*other_tags;
-	GHashTable		*branches;
+	struct str_map		other_tags;
+	struct str_map		branches;
 	struct call_monologue	*active_dialogue;
 	GQueue			medias;
-	GHashTable		*media_ids;
+	struct str_map		media_ids;
 	struct media_player	*player;
 
+	// last offer/answer that was processed in full, to answer unchanged re-INVITEs
+	str			sdp_cache_in;	// g_malloc'd
+	str			sdp_cache_out;	// g_malloc'd
+	uint64_t		sdp_cache_flags; // hash of the rest of the message
+	unsigned int		sdp_cache_gen;	// call's sdp_gen after it was processed
+
 	int			block_dtmf:1;
 	int			block_media:1;
 	int			rec_forwarding:1;
+	int			conference:1; // participant in the call's conference
 };
 
 struct call {
@@ -381,34 +431,45 @@ struct call {
 
 	mutex_t			buffer_lock;
 	call_buffer_t		buffer;
+	struct arena		arena;		// LOCK: buffer_lock
 
 	/* everything below protected by master_lock */
 	rwlock_t		master_lock;
+	volatile int		packet_writers;	// see call_lock_w()
 	GQueue			monologues;
 	GQueue			medias;
-	GHashTable		*tags;
-	GHashTable		*viabranches;
-	GHashTable		*labels;
+	struct str_map		tags;
+	struct str_map		viabranches;
+	struct str_map		labels;
 	GQueue			streams;
 	GQueue			stream_fds;
 	GQueue			endpoint_maps;
 	struct dtls_cert	*dtls_cert; /* for outgoing */
 	struct ssrc_hash	*ssrc_hash;
+	struct poller		*poller; // for all media sockets of this call
+	atomic64		poller_ns; // time spent in the callbacks of its media sockets
+	uint64_t		poller_ns_last; // for the poller rebalancing
 
 	str			callid;
 	struct timeval		created;
 	time_t			last_signal;
 	time_t			deleted;
 	time_t			ml_deleted;
+	struct timeval		rtcp_timer; // earliest queued RTCP timer of all media
 	unsigned char		tos;
 	char			*created_from;
 	sockaddr_t		created_from_addr;
 	sockaddr_t		xmlrpc_callback;
 
 	unsigned int		redis_hosted_db;
+	GHashTable		*redis_fields; // delta format: field name -> hash of the last written value
+	unsigned int		redis_fields_gen; // redis connection the above refers to
+	int			redis_write_state; // protected by the redis writer lock
+	struct timeval		redis_write_due;
 
 	struct recording 	*recording;
 	str			metadata;
+	struct conference	*conference; // mixer for the participating monologues, or NULL
 
 	int			block_dtmf:1;
 	int			block_media:1;
@@ -416,12 +477,35 @@ struct call {
 	int			rec_forwarding:1;
 	int			drop_traffic:1;
 	int			foreign_call:1; // created_via_redis_notify call
+	int			destroyed:1; // removed from the call hash by call_destroy()
+
+	time_t			timer_next_check; // for sliced timer sweeps, 0 = check on next run
+	unsigned int		timer_transcoded; // as seen by the last timer run
+	unsigned int		sdp_gen; // changes whenever cached SDPs of the monologues become invalid
+
+	// bytes held by this call, updated where the memory is allocated and released. only
+	// the objects themselves are counted, not what libraries allocate internally
+	atomic64		mem[__CALL_MEM_LAST];
+	atomic64		transcode_ns;	// CPU time spent transcoding this call's media
+	volatile unsigned int	trace_id;	// non-zero if tracing is enabled, see trace.h
 };
 
 
 
-extern rwlock_t rtpe_callhash_lock;
-extern GHashTable *rtpe_callhash;
+#define CALLHASH_SHARDS 64
+
+struct callhash_shard {
+	rwlock_t		lock;
+	GHashTable		*ht;
+};
+
+extern struct callhash_shard rtpe_callhash[CALLHASH_SHARDS];
+extern atomic64 rtpe_callhash_size; // total number of calls in all shards
+
+#define ITERATE_CALLHASH_SHARDS(s) \
+	for (struct callhash_shard *s = rtpe_callhash; s < rtpe_callhash + CALLHASH_SHARDS; s++)
+
+extern const char * const call_mem_names[__CALL_MEM_LAST];
 
 extern struct stats rtpe_statsps;	/* per second stats, running timer */
 extern struct stats rtpe_stats;		/* copied from statsps once a second */
@@ -429,6 +513,7 @@ extern struct stats rtpe_stats;		/* copied from statsps once a second */
 
 int call_init(void);
 void call_free(void);
+void calls_foreach(GHFunc, void *);
 void call_get_all_calls(GQueue *q);
 
 struct call_monologue *__monologue_create(struct call *call);
@@ -443,10 +528,18 @@ void call_make_own_foreign(struct call *c, int foreign);
 struct call_monologue *call_get_mono_dialogue(struct call *call, const str *fromtag, const str *totag,
 		const str *viabranch);
 struct call *call_get(const str *callid);
+void call_lock_w(struct call *);
+void call_unlock_w(struct call *);
+void call_packet_lock(struct call *);
+void call_packet_unlock(struct call *);
 int monologue_offer_answer(struct call_monologue *monologue, GQueue *streams, struct sdp_ng_flags *flags);
 int call_delete_branch(const str *callid, const str *branch,
 	const str *fromtag, const str *totag, bencode_item_t *output, int delete_delay);
+int call_delete_branch_call(struct call *c, const str *branch,
+	const str *fromtag, const str *totag, bencode_item_t *output, int delete_delay,
+	unsigned int stats_fields);
 void call_destroy(struct call *);
+void call_reaper_loop(void *);
 struct call_media *call_media_new(struct call *call);
 enum call_stream_state call_stream_state_machine(struct packet_stream *);
 void call_media_state_machine(struct call_media *m);
@@ -459,7 +552,7 @@ int call_stream_address46(char *o, struct packet_stream *ps, enum stream_address
 void add_total_calls_duration_in_interval(struct timeval *interval_tv);
 
 void payload_type_free(struct rtp_payload_type *p);
-void __rtp_stats_update(GHashTable *dst, GHashTable *src);
+void __rtp_stats_update(struct packet_stream *, GHashTable *src);
 int __init_stream(struct packet_stream *ps);
 
 const struct rtp_payload_type *__rtp_stats_codec(struct call_media *m);
@@ -467,13 +560,64 @@ const struct rtp_payload_type *__rtp_stats_codec(struct call_media *m);
 #include "str.h"
 #include "rtp.h"
 
+INLINE struct callhash_shard *callhash_shard(const str *callid) {
+	return &rtpe_callhash[str_hash(callid) % CALLHASH_SHARDS];
+}
+// invalidates the cached SDP outputs of the call's monologues. call must be locked, in R at least
+INLINE void call_sdp_changed(struct call *c) {
+	g_atomic_int_inc(&c->sdp_gen);
+}
+INLINE struct rtp_stats *rtp_stats_get(struct packet_stream *ps, unsigned int payload_type) {
+	if (payload_type >= G_N_ELEMENTS(ps->rtp_stats_idx))
+		return NULL;
+	unsigned int idx = ps->rtp_stats_idx[payload_type];
+	if (!idx)
+		return NULL;
+	return &ps->rtp_stats[idx - 1];
+}
+INLINE void call_mem_add(atomic64 *mem, ssize_t bytes) {
+	if (mem)
+		atomic64_add(mem, bytes); // wraps around for negative values
+}
+INLINE uint64_t call_mem_total(struct call *c) {
+	uint64_t ret = 0;
+	for (unsigned int i = 0; i < __CALL_MEM_LAST; i++)
+		ret += atomic64_get(&c->mem[i]);
+	return ret;
+}
 INLINE void *call_malloc(struct call *c, size_t l) {
 	void *ret;
 	mutex_lock(&c->buffer_lock);
-	ret = call_buffer_alloc(&c->buffer, l);
+	if (c->arena.active)
+		ret = arena_alloc(&c->arena, l);
+	else
+		ret = call_buffer_alloc(&c->buffer, l);
+	mutex_unlock(&c->buffer_lock);
+	call_mem_add(&c->mem[CALL_MEM_BUFFER], l);
+	return ret;
+}
+// for objects that are freed together with the call. with the arena enabled,
+// call_obj_free() is a no-op and the memory is released in __call_free()
+INLINE void *call_obj_alloc0(struct call *c, size_t l) {
+	if (!c->arena.active)
+		return g_slice_alloc0(l);
+	void *ret;
+	mutex_lock(&c->buffer_lock);
+	ret = arena_alloc(&c->arena, l);
 	mutex_unlock(&c->buffer_lock);
 	return ret;
 }
+INLINE void call_obj_free(struct call *c, size_t l, void *p) {
+	if (!c->arena.active)
+		g_slice_free1(l, p);
+}
+#define call_uid_alloc0(c, ptr, q) __call_uid_alloc0(c, sizeof(*(ptr)), q, \
+		G_STRUCT_OFFSET(__typeof__(*(ptr)), unique_id))
+INLINE void *__call_uid_alloc0(struct call *c, unsigned int size, GQueue *q, unsigned int offset) {
+	void *ret = call_obj_alloc0(c, size);
+	__uid_slice_alloc_fill(ret, q, offset);
+	return ret;
+}
 
 INLINE char *call_strdup_len(struct call *c, const char *s, unsigned int len) {
 	char *r;
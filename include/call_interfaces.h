@@ -16,6 +16,15 @@ struct call_stats;
 struct streambuf_stream;
 struct sockaddr_in6;
 
+// sections of the query and delete responses, selected through "fields"
+enum ng_stats_field {
+	NG_STATS_SSRC		= 1 << 0,
+	NG_STATS_MEMORY		= 1 << 1,
+	NG_STATS_TAGS		= 1 << 2,
+	NG_STATS_TOTALS		= 1 << 3,
+};
+#define NG_STATS_ALL (NG_STATS_SSRC | NG_STATS_MEMORY | NG_STATS_TAGS | NG_STATS_TOTALS)
+
 struct sdp_ng_flags {
 	enum call_opmode opmode;
 	str call_id;
@@ -95,6 +104,8 @@ struct sdp_ng_flags {
 	    symmetric_codecs:1,
 	    single_codec:1,
 	    inject_dtmf:1,
+	    conference:1,
+	    sfu:1,
 	    t38_decode:1,
 	    t38_force:1,
 	    t38_stop:1,
@@ -141,6 +152,7 @@ const char *call_offer_ng(bencode_item_t *, bencode_item_t *, const char*,
 const char *call_answer_ng(bencode_item_t *, bencode_item_t *);
 const char *call_delete_ng(bencode_item_t *, bencode_item_t *);
 const char *call_query_ng(bencode_item_t *, bencode_item_t *);
+const char *call_batch_ng(bencode_item_t *, bencode_item_t *);
 const char *call_list_ng(bencode_item_t *, bencode_item_t *);
 const char *call_start_recording_ng(bencode_item_t *, bencode_item_t *);
 const char *call_stop_recording_ng(bencode_item_t *, bencode_item_t *);
@@ -154,7 +166,8 @@ const char *call_play_media_ng(bencode_item_t *, bencode_item_t *);
 const char *call_stop_media_ng(bencode_item_t *, bencode_item_t *);
 const char *call_play_dtmf_ng(bencode_item_t *, bencode_item_t *);
 void ng_call_stats(struct call *call, const str *fromtag, const str *totag, bencode_item_t *output,
-		struct call_stats *totals);
+		struct call_stats *totals, unsigned int fields);
+unsigned int ng_stats_fields(bencode_item_t *input);
 
 int call_interfaces_init(void);
 void call_interfaces_free(void);
@@ -17,5 +17,6 @@ enum call_opmode;
 const char *get_tag_type_text(enum tag_type t);
 const char *get_opmode_text(enum call_opmode);
 void cdr_update_entry(struct call* c);
+void cdr_loop(void *);
 
 #endif /* CDR_H_ */
@@ -17,10 +17,12 @@ struct cli_writer;
 
 struct cli_writer {
 	void (*cw_printf)(struct cli_writer *, const char *, ...) __attribute__ ((format (printf, 2, 3)));
+	unsigned int (*cw_pending)(struct cli_writer *); // bytes not yet sent, optional
 	void *ptr;
 };
 
 struct cli *cli_new(struct poller *p, endpoint_t *);
+void cli_close(struct cli *);
 
 void cli_handle(str *instr, struct cli_writer *);
 
@@ -39,6 +39,7 @@ struct codec_handler {
 	struct ssrc_hash *ssrc_hash;
 	struct codec_handler *output_handler; // == self, or other PT handler
 	struct call_media *media;
+	atomic64 *mem; // the call's CALL_MEM_CODEC, or NULL
 #ifdef WITH_TRANSCODING
 	int (*packet_encoded)(encoder_t *enc, void *u1, void *u2);
 	int (*packet_decoded)(decoder_t *, AVFrame *, void *, void *);
@@ -59,12 +60,14 @@ struct codec_packet {
 	unsigned long ts;
 	struct ssrc_ctx *ssrc_out;
 	void (*free_func)(void *);
+	struct timeval rx_tv; // receive timestamp of the packet this was made from, if any
+	struct timespec rx_hwts;
 };
 
 
 void codecs_init(void);
 void codecs_cleanup(void);
-void codec_timers_loop(void *);
+void codec_worker_loop(void *);
 
 struct codec_handler *codec_handler_get(struct call_media *, int payload_type);
 void codec_handlers_free(struct call_media *);
@@ -73,7 +76,10 @@ struct codec_handler *codec_handler_make_playback(const struct rtp_payload_type
 void ensure_codec_def(struct rtp_payload_type *pt, struct call_media *media);
 
 void codec_add_raw_packet(struct media_packet *mp);
+struct codec_packet *codec_packet_new(void);
 void codec_packet_free(void *);
+char *codec_packet_buffer(size_t len);
+void codec_packet_buffer_free(void *);
 
 void codec_rtp_payload_types(struct call_media *media, struct call_media *other_media,
 		GQueue *types, struct sdp_ng_flags *flags);
@@ -102,6 +108,9 @@ uint64_t codec_decoder_unskip_pts(struct codec_ssrc_handler *ch);
 void codec_tracker_init(struct call_media *);
 void codec_tracker_finish(struct call_media *);
 void codec_handlers_stop(GQueue *);
+int codec_handler_kernel_xcode(struct codec_handler *);
+int codec_handler_kernel_dtmf(struct codec_handler *);
+int64_t codec_media_cost(struct call_media *);
 
 #else
 
@@ -111,6 +120,9 @@ INLINE void codec_handler_free(struct codec_handler **handler) { }
 INLINE void codec_tracker_init(struct call_media *m) { }
 INLINE void codec_tracker_finish(struct call_media *m) { }
 INLINE void codec_handlers_stop(GQueue *q) { }
+INLINE int codec_handler_kernel_xcode(struct codec_handler *h) { return 0; }
+INLINE int codec_handler_kernel_dtmf(struct codec_handler *h) { return 0; }
+INLINE int64_t codec_media_cost(struct call_media *m) { return 0; }
 
 #endif
 
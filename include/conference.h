@@ -0,0 +1,52 @@
+#ifndef _CONFERENCE_H_
+#define _CONFERENCE_H_
+
+
+// Server-side audio conferencing: all monologues of a call that were flagged as
+// conference participants are decoded, mixed, and each of them receives the mix of
+// everybody else. Media from and to the other side of each participant is dropped.
+
+
+struct call;
+struct call_monologue;
+struct call_media;
+struct conference;
+
+
+// participants are decoded to mono S16 at this rate, and mixed at this rate
+#define CONFERENCE_CLOCKRATE 16000
+
+
+
+#ifdef WITH_TRANSCODING
+
+
+
+#include <libavutil/frame.h>
+
+
+
+void conference_init(void);
+void conference_free(void);
+
+void conference_update(struct call *);
+void conference_leave(struct call_monologue *);
+void conference_put(struct call *);
+void conference_add_frame(struct call_media *, AVFrame *);
+
+
+#else
+
+#include "compat.h"
+
+// stubs
+INLINE void conference_init(void) { }
+INLINE void conference_free(void) { }
+INLINE void conference_update(struct call *c) { }
+INLINE void conference_leave(struct call_monologue *ml) { }
+INLINE void conference_put(struct call *c) { }
+
+
+#endif
+
+#endif
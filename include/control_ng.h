@@ -3,8 +3,10 @@
 
 #include "obj.h"
 #include "udp_listener.h"
+#include "tcp_listener.h"
 #include "socket.h"
 #include "str.h"
+#include "statistics.h"
 
 
 struct poller;
@@ -28,6 +30,8 @@ enum ng_command {
 	NGC_STOP_MEDIA,
 	NGC_PLAY_DTMF,
 	NGC_STATISTICS,
+	NGC_BATCH,
+	NGC_CAPACITY,
 
 	NGC_COUNT // last, number of elements
 };
@@ -50,18 +54,32 @@ struct control_ng {
 	struct poller *poller;
 };
 
+struct control_ng_tcp {
+	struct obj obj;
+	struct streambuf_listener listeners[2];
+	struct poller *poller;
+};
+
 extern const char *ng_command_strings[NGC_COUNT];
+extern struct latency_histogram rtpe_ng_latency[NGC_COUNT]; // microseconds
 extern const char *ng_command_strings_short[NGC_COUNT];
 
 struct control_ng *control_ng_new(struct poller *, endpoint_t *, unsigned char);
+struct control_ng_tcp *control_ng_tcp_new(struct poller *, endpoint_t *);
+void control_ng_close(struct control_ng *);
+void control_ng_tcp_close(struct control_ng_tcp *);
 void control_ng_init(void);
 void control_ng_cleanup(void);
+void control_ng_worker_loop(void *);
 int control_ng_process(str *buf, const endpoint_t *sin, char *addr,
 		void (*cb)(str *, str *, const endpoint_t *, void *), void *p1);
+int control_ng_queue(str *buf, const endpoint_t *sin, char *addr,
+		void (*cb)(str *, str *, const endpoint_t *, void *), void *p1, void (*done)(void *, int));
 
 extern mutex_t rtpe_cngs_lock;
 extern GHashTable *rtpe_cngs_hash;
 extern struct control_ng *rtpe_control_ng;
+extern struct control_ng_tcp *rtpe_control_ng_tcp;
 
 enum load_limit_reasons {
 	LOAD_LIMIT_NONE = -1,
@@ -69,6 +87,7 @@ enum load_limit_reasons {
 	LOAD_LIMIT_CPU,
 	LOAD_LIMIT_LOAD,
 	LOAD_LIMIT_BW,
+	LOAD_LIMIT_TRANSCODING, // overload protection, see load.h
 
 	__LOAD_LIMIT_MAX
 };
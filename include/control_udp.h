@@ -14,6 +14,7 @@
 #include "cookie_cache.h"
 #include "udp_listener.h"
 #include "socket.h"
+#include "str.h"
 
 
 
@@ -40,6 +41,15 @@
 
 struct poller;
 
+/*
+ * Parser for the well-formed subset of what parse_re accepts. It only records where
+ * the fields are and doesn't touch the buffer until control_udp_tokens_out(). Anything
+ * it isn't sure about is left to the regular expressions.
+ */
+struct udp_tokens {
+	str			part[RE_UDP_V_PARMS + 1];
+};
+
 
 
 
@@ -49,6 +59,7 @@ struct control_udp {
 
 	struct cookie_cache	cookie_cache;
 	socket_t		udp_listeners[2];
+	struct poller		*poller;
 
 	pcre			*parse_re;
 	pcre_extra		*parse_ree;
@@ -60,6 +71,11 @@ struct control_udp {
 
 
 struct control_udp *control_udp_new(struct poller *, endpoint_t *);
+void control_udp_close(struct control_udp *);
+
+pcre *control_udp_parse_re(pcre_extra **);
+int control_udp_tokenize(struct udp_tokens *, const str *);
+void control_udp_tokens_out(char **out, struct udp_tokens *, char *cmd);
 
 
 
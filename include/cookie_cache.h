@@ -6,18 +6,25 @@
 #include "aux.h"
 #include "str.h"
 
+#define COOKIE_CACHE_SHARDS		16
+#define COOKIE_CACHE_MAX_ENTRIES	200000	/* over all shards, per generation */
+
 struct cookie_cache_state {
 	GHashTable *cookies;
 	GStringChunk *chunks;
 };
 
-struct cookie_cache {
+struct cookie_cache_shard {
 	mutex_t lock;
-	cond_t cond;
 	struct cookie_cache_state current, old;
+	GHashTable *in_use;		/* cookies currently being processed -> struct cookie_cache_wait */
 	time_t swap_time;
 };
 
+struct cookie_cache {
+	struct cookie_cache_shard shards[COOKIE_CACHE_SHARDS];
+};
+
 void cookie_cache_init(struct cookie_cache *);
 str *cookie_cache_lookup(struct cookie_cache *, const str *);
 void cookie_cache_insert(struct cookie_cache *, const str *, const str *);
@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <glib.h>
+#include <openssl/evp.h>
 #include "compat.h"
 #include "str.h"
 #include "aux.h"
@@ -17,6 +18,8 @@
 #define SRTP_MAX_SESSION_SALT_LEN 14
 #define SRTP_MAX_SESSION_AUTH_LEN 20
 
+#define CRYPTO_BATCH_MAX 16 /* packets per batched encryption call */
+
 
 
 struct crypto_context;
@@ -24,6 +27,8 @@ struct rtp_header;
 struct rtcp_packet;
 
 typedef int (*crypto_func_rtp)(struct crypto_context *, struct rtp_header *, str *, u_int64_t);
+typedef int (*crypto_func_rtp_batch)(struct crypto_context *, struct rtp_header **, str *,
+		const u_int64_t *, unsigned int);
 typedef int (*crypto_func_rtcp)(struct crypto_context *, struct rtcp_packet *, str *, u_int64_t);
 typedef int (*hash_func_rtp)(struct crypto_context *, char *out, str *in, u_int64_t);
 typedef int (*hash_func_rtcp)(struct crypto_context *, char *out, str *in);
@@ -49,6 +54,7 @@ struct crypto_suite {
 	int kernel_hmac;
 	crypto_func_rtp encrypt_rtp,
 			decrypt_rtp;
+	crypto_func_rtp_batch encrypt_rtp_batch; /* optional */
 	crypto_func_rtcp encrypt_rtcp,
 			 decrypt_rtcp;
 	hash_func_rtp hash_rtp;
@@ -57,6 +63,7 @@ struct crypto_suite {
 	session_key_cleanup_func session_key_cleanup;
 	//const char *dtls_profile_code; // unused
 	const void *lib_cipher_ptr;
+	const EVP_CIPHER *(*aead_evp)(void); // set for AEAD suites, which carry their own auth tag
 	unsigned int idx; // filled in during crypto_init_main()
 	str name_str; // same as `name`
 };
@@ -89,10 +96,10 @@ struct crypto_context {
 	char session_salt[SRTP_MAX_SESSION_SALT_LEN]; /* k_s */
 	char session_auth_key[SRTP_MAX_SESSION_AUTH_LEN];
 
-	/* XXX replay list */
-	/* <from, to>? */
+	/* the replay list is per SSRC, in struct ssrc_ctx */
 
 	void *session_key_ctx[2];
+	void *session_auth_ctx; /* precomputed HMAC state */
 
 	int have_session_key:1;
 };
@@ -119,6 +126,19 @@ INLINE int crypto_encrypt_rtp(struct crypto_context *c, struct rtp_header *rtp,
 {
 	return c->params.crypto_suite->encrypt_rtp(c, rtp, payload, index);
 }
+/* encrypts several payloads of the same context in one go, falling back to
+ * one call per packet if the suite has no batched implementation */
+INLINE int crypto_encrypt_rtp_batch(struct crypto_context *c, struct rtp_header **rtp,
+		str *payload, const u_int64_t *index, unsigned int num)
+{
+	if (c->params.crypto_suite->encrypt_rtp_batch)
+		return c->params.crypto_suite->encrypt_rtp_batch(c, rtp, payload, index, num);
+	for (unsigned int i = 0; i < num; i++) {
+		if (c->params.crypto_suite->encrypt_rtp(c, rtp[i], &payload[i], index[i]))
+			return -1;
+	}
+	return 0;
+}
 INLINE int crypto_decrypt_rtp(struct crypto_context *c, struct rtp_header *rtp,
 		str *payload, u_int64_t index)
 {
@@ -134,6 +154,11 @@ INLINE int crypto_decrypt_rtcp(struct crypto_context *c, struct rtcp_packet *rtc
 {
 	return c->params.crypto_suite->decrypt_rtcp(c, rtcp, payload, index);
 }
+/* true if the SRTP payload goes through the cipher. AEAD suites always do, as they authenticate
+ * unencrypted packets too */
+INLINE int crypto_srtp_cipher(const struct crypto_context *c) {
+	return !c->params.session_params.unencrypted_srtp || c->params.crypto_suite->aead_evp;
+}
 INLINE int crypto_init_session_key(struct crypto_context *c) {
 	return c->params.crypto_suite->session_key_init(c);
 }
@@ -46,6 +46,7 @@ struct dtls_cert {
 	EVP_PKEY *pkey;
 	X509 *x509;
 	time_t expires;
+	unsigned char ticket_keys[48]; // session ticket name, HMAC and AES keys
 };
 
 struct dtls_connection {
@@ -53,6 +54,7 @@ struct dtls_connection {
 	SSL *ssl;
 	BIO *r_bio, *w_bio;
 	void *ptr;
+	struct timeval hs_start; // first handshake packet, for stats
 	int init:1,
 	    active:1,
 	    connected:1;
@@ -62,6 +64,7 @@ struct dtls_connection {
 
 
 int dtls_init(void);
+void dtls_cert_init(void);
 void dtls_timer(struct poller *);
 
 int dtls_verify_cert(struct packet_stream *ps);
@@ -71,6 +74,7 @@ void dtls_cert_free(void);
 
 int dtls_connection_init(struct dtls_connection *, struct packet_stream *, int active, struct dtls_cert *cert);
 int dtls(struct stream_fd *, const str *s, const endpoint_t *sin);
+void dtls_worker_loop(void *);
 void dtls_connection_cleanup(struct dtls_connection *);
 void dtls_shutdown(struct packet_stream *ps);
 
@@ -24,6 +24,8 @@ void dtmf_event_free(void *);
 int dtmf_code_from_char(char);
 const char *dtmf_inject(struct call_media *media, int code, int volume, int duration, int pause);
 int dtmf_do_logging(void);
+void dtmf_log_loop(void *);
+uint64_t dtmf_log_drops(void);
 
 
 #endif
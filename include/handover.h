@@ -0,0 +1,21 @@
+#ifndef _HANDOVER_H_
+#define _HANDOVER_H_
+
+#include "socket.h"
+
+
+// Live handover to a newly started daemon process (--handover-socket). The running
+// process passes its media sockets, the kernel table and a snapshot of every call
+// to the new one and then exits. Nothing is re-bound or re-created.
+
+extern volatile int handover_sent; // everything was passed on, shutdown must leave it intact
+
+int handover_receive(void); // 1 if state was received, 0 if there was no peer, -1 on error
+int handover_kernel_fd(unsigned int table); // -1 if none was received for this table
+int handover_take_fd(const sockaddr_t *, unsigned int port);
+void handover_restore(void);
+void handover_listen(void);
+int handover_active(void); // a handover to a new process is underway or done
+
+
+#endif
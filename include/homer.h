@@ -1,6 +1,7 @@
 #ifndef __HOMER_H__
 #define __HOMER_H__
 
+#include <stdint.h>
 #include "socket.h"
 
 
@@ -8,6 +9,8 @@ void homer_sender_init(const endpoint_t *, int, int);
 int homer_send(GString *, const str *, const endpoint_t *, const endpoint_t *,
 		const struct timeval *tv);
 int has_homer(void);
+void homer_sender_loop(void *);
+uint64_t homer_dropped(void);
 
 
 #endif
@@ -23,6 +23,7 @@
 #define STUN_MAX_RETRANSMITS		7
 #define MAX_ICE_CANDIDATES		100
 #define ICE_FOUNDATION_LENGTH		16
+#define ICE_PACING_SLOTS		256 /* of TIMER_RUN_INTERVAL each */
 
 
 
@@ -65,6 +66,7 @@ struct call_media;
 struct call;
 struct stream_params;
 struct stun_attrs;
+struct rtpengine_target_info;
 
 
 
@@ -88,6 +90,13 @@ struct ice_candidate {
 	endpoint_t		related;
 };
 
+/* HMAC-SHA1 state keyed with one of the ICE passwords, so that the key schedule is only
+ * computed once per credential. set up with the call locked in W */
+struct ice_hmac {
+	str			key; /* the password this has been keyed with */
+	void			*ctx; /* HMAC_CTX */
+};
+
 struct ice_candidate_pair {
 	struct ice_candidate	*remote_candidate;
 	const struct local_intf	*local_intf;
@@ -126,11 +135,14 @@ struct ice_agent {
 	GTree			*nominated_pairs; /* nominated by peer */
 	GTree			*succeeded_pairs; /* checked by us */
 	GTree			*valid_pairs; /* succeeded and nominated */
+	GTree			*retransmit_pairs; /* in progress, by retransmit time */
 	unsigned int		active_components;
 	struct timeval		start_nominating;
+	struct timeval		next_check; /* reserved pacing slot for the next ordinary check */
 
 	str			ufrag[2]; /* 0 = remote, 1 = local */
 	str			pwd[2]; /* ditto */
+	struct ice_hmac		hmac[2]; /* ditto */
 	volatile unsigned int	agent_flags;
 };
 
@@ -164,6 +176,8 @@ int ice_request(struct stream_fd *, const endpoint_t *, struct stun_attrs *);
 int ice_response(struct stream_fd *, const endpoint_t *src,
 		struct stun_attrs *attrs, void *transaction);
 
+void ice_kernel_info(struct ice_agent *, struct rtpengine_target_info *);
+
 
 
 #include "call.h"
@@ -9,6 +9,7 @@
 void iptables_init(void);
 extern int (*iptables_add_rule)(const socket_t *local_sock, const str *comment);
 extern int (*iptables_del_rule)(const socket_t *local_sock);
+void ipset_loop(void *);
 
 
 
@@ -11,10 +11,20 @@
 struct jb_packet;
 struct media_packet;
 //
+enum jb_slot_state {
+	JB_SLOT_EMPTY = 0,
+	JB_SLOT_QUEUED,
+	JB_SLOT_PLAYING, // being played out with the lock released
+};
+
+// one slot of the ring buffer, reused for every packet that maps to it
 struct jb_packet {
-	struct timerthread_queue_entry ttq_entry;
+	struct timeval when;
 	char *buf;
+	unsigned int buf_size;
 	struct media_packet mp;
+	enum jb_slot_state state;
+	unsigned int seq;
 };
 
 struct jitter_buffer {
@@ -37,6 +47,13 @@ struct jitter_buffer {
 	unsigned int            dtmf_mult_factor;
 	int            		buffer_len;
 	int                     clock_drift_val;
+	uint32_t		transit;
+	unsigned int		jitter; // RFC 3550 A.8, in clock rate units times 16
+	int			target_len; // playout delay in packets wanted by --jb-adaptive
+	struct jb_packet	*ring; // indexed by RTP sequence number
+	unsigned int		ring_mask;
+	unsigned int		ring_head; // next sequence number to be played out
+	unsigned int		ring_count; // number of queued packets
 	struct call             *call;
 	int			disabled;
 };
@@ -48,9 +65,6 @@ struct jitter_buffer *jitter_buffer_new(struct call *);
 void jitter_buffer_free(struct jitter_buffer **);
 
 int buffer_packet(struct media_packet *mp, const str *s);
-void jb_packet_free(struct jb_packet **jbp);
-
-void jitter_buffer_loop(void *p);
 
 INLINE void jb_put(struct jitter_buffer **jb) {
 	if (!*jb)
@@ -11,13 +11,19 @@
 
 
 #define UNINIT_IDX ((unsigned int) -1)
+#define KERNEL_LIST_BATCH 64
+#define KERNEL_BATCH_MAX 64
+#define KERNEL_DTMF_BATCH 32
 
 
 
 
 struct rtpengine_target_info;
+struct rtpengine_destination_info;
 struct re_address;
 struct rtpengine_ssrc_stats;
+struct rtpengine_dtmf_event;
+struct obj;
 
 
 
@@ -26,18 +32,34 @@ struct kernel_interface {
 	int fd;
 	int is_open;
 	int is_wanted;
+	void *ssrc_stats; // read-only mapping of the table's SSRC stats slots, or NULL
+	int dtmf_fd; // RFC 4733 events detected by the kernel, or -1
 };
 extern struct kernel_interface kernel;
 
 
 
 int kernel_setup_table(unsigned int);
+int kernel_adopt_table(unsigned int, int);
 
-int kernel_add_stream(struct rtpengine_target_info *, int);
+typedef void kernel_add_failed_t(void *);
+
+int kernel_add_stream(struct rtpengine_target_info *, int update, kernel_add_failed_t *, void *,
+		struct obj *);
+int kernel_add_destination(struct rtpengine_destination_info *);
 int kernel_del_stream(const struct re_address *);
 GList *kernel_list(void);
+
+void kernel_batch_start(void);
+void kernel_batch_flush(void);
 int kernel_update_stats(const struct re_address *a, uint32_t ssrc, struct rtpengine_ssrc_stats *out);
 
+unsigned int kernel_stats_slot_get(void);
+void kernel_stats_slot_put(unsigned int);
+int kernel_read_ssrc_stats(unsigned int slot, const struct re_address *a, uint32_t ssrc,
+		struct rtpengine_ssrc_stats *out);
+int kernel_read_dtmf(struct rtpengine_dtmf_event *, unsigned int num);
+
 unsigned int kernel_add_call(const char *id);
 int kernel_del_call(unsigned int);
 
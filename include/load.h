@@ -1,9 +1,32 @@
 #ifndef _LOAD_H_
 #define _LOAD_H_
 
+#include "bencode.h"
+#include "aux.h"
+
+// Overload protection. Steps are taken one at a time while the busy level stays above
+// the configured threshold, and are undone in reverse order once it has dropped again.
+enum overload_level {
+	OVERLOAD_NONE = 0,
+	OVERLOAD_LOW_COMPLEXITY, // lower Opus complexity, no Opus FEC in encoders or decoders
+	OVERLOAD_LOW_QUALITY_RESAMPLING,
+	OVERLOAD_NO_DETECTION, // no silence or in-band DTMF detection
+	OVERLOAD_NO_TRANSCODING, // offers for new calls that need transcoding are rejected
+
+	__OVERLOAD_MAX
+};
+
 extern int load_average; // times 100
 extern int cpu_usage; // times 100
+extern int overload_level; // enum overload_level
+extern const char * const overload_level_names[__OVERLOAD_MAX];
+extern atomic64 overload_rejected; // transcoding offers
+
+int overload_busy(void); // percent times 100 as last seen by the controller, -1 if unknown
+int overload_threshold(void); // percent times 100, 0 if disabled
+int load_cpu_cost(int64_t ns); // CPU time per second -> percent of all CPUs times 100, like cpu_usage
 
 void load_thread(void *);
+const char *load_capacity_ng(bencode_item_t *input, bencode_item_t *output);
 
 #endif
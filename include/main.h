@@ -18,6 +18,25 @@ enum log_format {
 
 	__LF_LAST
 };
+enum cdr_format {
+	CDR_FORMAT_TEXT = 0,
+	CDR_FORMAT_JSON,
+};
+enum dtmf_detector {
+	DTMF_DSP_SPANDSP = 0,
+	DTMF_DSP_GOERTZEL,
+};
+enum redis_format {
+	REDIS_FORMAT_JSON = 0,
+	REDIS_FORMAT_BINARY,
+	REDIS_FORMAT_DELTA,
+};
+
+enum dtls_cert_cipher {
+	DCC_RSA = 0,
+	DCC_EC_PRIME256v1,
+};
+
 enum endpoint_learning {
 	EL_DELAYED = 0,
 	EL_IMMEDIATE = 1,
@@ -27,6 +46,12 @@ enum endpoint_learning {
 	__EL_LAST
 };
 
+struct redis_shard_config {
+	endpoint_t		ep;
+	int			db;
+	char			*auth;
+};
+
 struct rtpengine_config {
 	/* everything below protected by config_lock */
 	rwlock_t		config_lock;
@@ -42,18 +67,24 @@ struct rtpengine_config {
 	int			delete_delay;
 	GQueue		        redis_subscribed_keyspaces;
 	int			redis_expires_secs;
+	enum redis_format	redis_format;
 	char			*b2b_url;
 	int			default_tos;
 	int			control_tos;
+	int			control_ng_threads;
 	enum xmlrpc_format	fmt;
 	enum log_format		log_format;
+	enum cdr_format		cdr_format;
 	endpoint_t		graphite_ep;
 	int			graphite_interval;
+	int			graphite_protocol;
+	int			graphite_queue;
 	int			redis_num_threads;
 	GQueue			interfaces;
 	endpoint_t		tcp_listen_ep;
 	endpoint_t		udp_listen_ep;
 	endpoint_t		ng_listen_ep;
+	endpoint_t		ng_tcp_listen_ep;
 	endpoint_t		cli_listen_ep;
 	endpoint_t		redis_ep;
 	endpoint_t		redis_write_ep;
@@ -61,6 +92,10 @@ struct rtpengine_config {
 	int			homer_protocol;
 	int			homer_id;
 	int			no_fallback;
+	int			kernel_rtcp;
+	int			kernel_rtcp_sample;
+	int			kernel_junk_filter;
+	int			no_rtcp_stats;
 	int			port_min;
 	int			port_max;
 	int			redis_db;
@@ -72,16 +107,25 @@ struct rtpengine_config {
 	int			redis_connect_timeout;
 	int			redis_delete_async;
 	int			redis_delete_async_interval;
+	int			redis_write_delay;
+	int			redis_notify_threads;
+	int			redis_write_connections;
+	int			redis_restore_batch;
+	int			redis_restore_background;
 	char			*redis_auth;
 	char			*redis_write_auth;
+	GQueue			redis_shards; // struct redis_shard_config
 	int			num_threads;
 	int			media_num_threads;
 	char			*spooldir;
 	char			*rec_method;
 	char			*rec_format;
 	char			*iptables_chain;
+	char			*ipset;
+	char			*ipset6;
 	int			load_limit;
 	int			cpu_limit;
+	int			overload_threshold; // percent times 100
 	uint64_t		bw_limit;
 	char			*scheduling;
 	int			priority;
@@ -94,33 +138,76 @@ struct rtpengine_config {
 	char			*mysql_pass;
 	char			*mysql_query;
 	endpoint_t		dtmf_udp_ep;
+	char			*dtmf_log_redis;
+	int			dtmf_log_homer;
 	enum endpoint_learning	endpoint_learning;
 	int                     jb_length;
 	int                     jb_clock_drift;
+	int                     jb_adaptive;
 	int			debug_srtp;
 	int			dtls_rsa_key_size;
 	char			*dtls_ciphers;
 	int			dtls_signature;
+	enum dtls_cert_cipher	dtls_cert_cipher;
 	char			**http_ifs;
 	char			**https_ifs;
 	char			*https_cert;
 	char			*https_key;
 	int			http_threads;
+	int			http_service_threads;
 	int			dtx_delay;
 	int			max_dtx;
 	double			silence_detect_double;
 	uint32_t		silence_detect_int;
+	enum dtmf_detector	dtmf_detector;
+	int			player_cache;
+	int			player_mmap;
+	int			media_open_threads;
 	str			cn_payload;
+	int			output_dtx;
+	int			codec_benchmark;
+	int			media_recv_batch;
+	int			media_send_batch;
+	int			media_send_gso;
+	int			media_recv_gro;
+	int			media_rcvbuf;
+	int			media_rcvbuf_max;
+	int			media_pollers;
+	char			**interface_pollers;
+	char			**interface_unknown_limits;
+	int			media_busy_poll;
+	int			media_busy_pollers;
+	int			media_busy_poll_budget;
+	int			media_poller_rebalance;
+	int			numa;
+	int			poller_io_uring;
+	int			timer_wheel;
+	int			timer_sweep_slices;
+	int			ice_check_rate;
+	int			transcode_threads;
+	int			t38_threads;
+	int			dtls_threads;
+	int			socket_pool;
+	int			call_arena;	// enum arena_mode
+	int			timestamping;	// enum socket_ts_mode
+	char			*trace_dir;
+	int			trace_events;
+	char			*handover_socket;
+	endpoint_t		replicate_to;
+	endpoint_t		replicate_listen;
 };
 
 
 struct poller;
 extern struct poller *rtpe_poller; // main global poller instance XXX convert to struct instead of pointer?
+extern struct poller **rtpe_media_pollers; // optional dedicated pollers for media sockets
 
 
 extern struct rtpengine_config rtpe_config;
 extern struct rtpengine_config initial_rtpe_config;
 
+void control_listeners_close(void);
+
 
 
 #endif
@@ -17,6 +17,8 @@ struct packet_stream;
 struct codec_packet;
 struct media_player;
 struct rtp_payload_type;
+struct media_player_cache_entry;
+struct media_player_map;
 
 
 #ifdef WITH_TRANSCODING
@@ -50,8 +52,21 @@ struct media_player {
 	struct timeval sync_ts_tv;
 
 	AVIOContext *avioctx;
-	str *blob;
+	str *blob; // own copy, or NULL if reading from shared memory
+	struct media_player_map *map; // reference to a --player-mmap file
+	str read_src; // the whole input
 	str read_pos;
+
+	// pre-encoded prompt cache
+	struct media_player_cache_entry *cache_entry; // playing back from this
+	struct media_player_cache_entry *cache_fill; // recording into this
+	unsigned int cache_index;
+	unsigned long cache_ts;
+	int cache_pt;
+
+	// files opened by a --media-open-threads worker
+	unsigned int open_gen; // LOCK: lock
+	int open_err;
 };
 
 INLINE void media_player_put(struct media_player **mp) {
@@ -98,6 +113,7 @@ void media_player_add_packet(struct media_player *mp, char *buf, size_t len,
 void media_player_init(void);
 void media_player_free(void);
 void media_player_loop(void *);
+void media_player_open_loop(void *);
 
 struct send_timer *send_timer_new(struct packet_stream *);
 void send_timer_push(struct send_timer *, struct codec_packet *);
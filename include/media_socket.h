@@ -20,10 +20,15 @@ struct transport_protocol;
 struct ssrc_ctx;
 struct rtpengine_srtp;
 struct jb_packet;
+struct codec_packet;
+struct stream_fd_tx_ts;
 
 typedef int rtcp_filter_func(struct media_packet *, GQueue *);
 typedef int (*rewrite_func)(str *, struct packet_stream *, struct stream_fd *, const endpoint_t *,
 		const struct timeval *, struct ssrc_ctx *);
+// same as rewrite_func for several packets, each with its own result
+typedef void (*rewrite_batch_func)(str *const *, unsigned int, struct packet_stream *, struct ssrc_ctx *,
+		int *);
 
 
 enum transport_protocol_index {
@@ -55,6 +60,7 @@ extern const struct transport_protocol transport_protocols[];
 
 struct streamhandler_io {
 	rewrite_func		rtp_crypt;
+	rewrite_batch_func	rtp_crypt_batch; // optional, same as rtp_crypt for several packets at once
 	rewrite_func		rtcp_crypt;
 	rtcp_filter_func	*rtcp_filter;
 	int			(*kernel)(struct rtpengine_srtp *, struct packet_stream *);
@@ -66,6 +72,17 @@ struct streamhandler {
 
 
 
+// dedicated poller and unknown-source packet limit for all logical interfaces
+// of one name, see --interface-pollers and --interface-unknown-limit
+struct intf_isolation {
+	str				name;
+	struct poller			*poller; // or NULL to use the shared pollers
+	unsigned int			threads;
+	unsigned int			unknown_limit; // packets per second, zero for unlimited
+	volatile int			unknown_sec;
+	volatile int			unknown_count;
+	atomic64			unknown_dropped;
+};
 struct logical_intf {
 	str				name;
 	sockfamily_t			*preferred_family;
@@ -73,17 +90,27 @@ struct logical_intf {
 	GHashTable			*addr_hash; // addr + type -> struct local_intf XXX obsolete?
 	GHashTable			*rr_specs;
 	str				name_base; // if name is "foo:bar", this is "foo"
+	struct intf_isolation		*isolation; // or NULL
 };
+// A slice of the pairs of a port pool. There's one per media poller, and calls allocate from
+// the one of their poller, so that concurrent call setups don't contend for the same cache
+// lines. A part that runs out takes pairs from its neighbours.
+struct port_pool_part {
+	volatile unsigned int		last_used;
+	volatile unsigned int		free_ports; // including those in the spare pool
+	unsigned int			first_pair, last_pair;
+
+	mutex_t				spare_lock;
+	GQueue				spare_pairs; // pre-opened RTP/RTCP pairs, see --socket-pool
+} __attribute__ ((aligned (64)));
 struct port_pool {
 	BIT_ARRAY_DECLARE(ports_used, 0x10000);
-	volatile unsigned int		last_used;
-	volatile unsigned int		free_ports;
+	BIT_ARRAY_DECLARE(pairs_free, 0x8000); // bit N set: ports 2N and 2N+1 are both free
 
 	unsigned int			min, max;
 
-	mutex_t				free_list_lock;
-	GQueue				free_list;
-	BIT_ARRAY_DECLARE(free_list_used, 0x10000);
+	unsigned int			num_parts;
+	struct port_pool_part		*parts;
 };
 struct intf_address {
 	socktype_t			*type;
@@ -100,6 +127,13 @@ struct intf_config {
 struct intf_spec {
 	struct intf_address		local_address;
 	struct port_pool		port_pool;
+	int				numa_node;	// of the network device, or -1
+
+	// media received on this address, for the per-interface metrics
+	atomic64			packets, bytes;
+	atomic64			kernel_packets, kernel_bytes;
+	atomic64			kernel_junk;
+	atomic64			rx_dropped; // by the kernel, due to full socket receive buffers
 };
 struct local_intf {
 	struct intf_spec		*spec;
@@ -107,26 +141,36 @@ struct local_intf {
 	unsigned int			unique_id; /* starting with 0 - serves as preference */
 	const struct logical_intf	*logical;
 	str				ice_foundation;
+	str				*ice_candidate[2]; /* host candidate up to the port, per component */
 };
 struct intf_list {
 	const struct local_intf		*local_intf;
 	GQueue				list;
 };
+/* per-packet fields first, see call.c */
 struct stream_fd {
 	struct obj			obj;
-	unsigned int			unique_id;	/* RO */
-	socket_t			socket;		/* RO */
-	const struct local_intf		*local_intf;	/* RO */
 	struct call			*call;		/* RO */
 	struct packet_stream		*stream;	/* LOCK: call->master_lock */
+	socket_t			socket;		/* RO */
+	const struct local_intf		*local_intf;	/* RO */
+	struct poller			*poller;	/* LOCK: call->master_lock in W */
+	unsigned int			unique_id;	/* RO */
 	struct crypto_context		crypto;		/* IN direction, LOCK: stream->in_lock */
 	struct dtls_connection		dtls;		/* LOCK: stream->in_lock */
+	struct stream_fd_tx_ts		*tx_ts;		/* with --timestamping, has its own lock */
+	atomic64			rx_dropped;	// receive buffer overflows
+	unsigned int			rx_drops_seen;	// these two only touched by stream_fd_readable()
+	int				rcvbuf;		// requested size, or 0 for the system default
+	GQueue				dtls_jobs;	// handshake packets for a DTLS worker, LOCK: dtls.c
+	int				dtls_job_sched;	// in the DTLS worker queue or being run, LOCK: dtls.c
 };
 struct media_packet {
 	str raw;
 
 	endpoint_t fsin; // source address of received packet
 	struct timeval tv; // timestamp when packet was received
+	struct timespec hwts; // hardware receive timestamp, or zero
 	struct stream_fd *sfd; // fd which received the packet
 	struct call *call; // sfd->call
 	struct packet_stream *stream; // sfd->stream
@@ -144,10 +188,13 @@ struct media_packet {
 
 
 extern GQueue all_local_interfaces; // read-only during runtime
+extern GQueue all_intf_isolations; // read-only during runtime
 
 
 
 void interfaces_init(GQueue *interfaces);
+int interfaces_isolation_init(char **pollers, char **limits);
+void interfaces_isolation_start(void);
 void interfaces_free(void);
 
 struct logical_intf *get_logical_interface(const str *name, sockfamily_t *fam, int num_ports);
@@ -160,9 +207,15 @@ int is_local_endpoint(const struct intf_address *addr, unsigned int port);
 //void release_port(socket_t *r, const struct local_intf *);
 
 int __get_consecutive_ports(GQueue *out, unsigned int num_ports, unsigned int wanted_start_port,
-		struct intf_spec *spec, const str *);
-int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logical_intf *log, const str *);
+		struct intf_spec *spec, const str *, unsigned int part);
+int get_consecutive_ports(GQueue *out, unsigned int num_ports, const struct logical_intf *log, const str *,
+		const struct poller *);
+void socket_pool_loop(void *);
+int stream_fd_relay_latency(struct stream_fd *, unsigned long *p50, unsigned long *p99);
 struct stream_fd *stream_fd_new(socket_t *fd, struct call *call, const struct local_intf *lif);
+void stream_fds_move(struct call *, struct poller *);
+void stream_fds_detach(struct call *);
+void stream_fds_attach(struct call *);
 
 void free_intf_list(struct intf_list *il);
 void free_socket_intf_list(struct intf_list *il);
@@ -172,6 +225,8 @@ INLINE int open_intf_socket(socket_t *r, unsigned int port, const struct local_i
 }
 
 void kernelize(struct packet_stream *);
+void __rekernelize(struct packet_stream *);
+unsigned int kernelize_call(struct call *);
 void __unkernelize(struct packet_stream *);
 void unkernelize(struct packet_stream *);
 void __stream_unconfirm(struct packet_stream *);
@@ -181,9 +236,14 @@ void media_update_stats(struct call_media *m);
 void media_packet_copy(struct media_packet *, const struct media_packet *);
 void media_packet_release(struct media_packet *);
 int media_socket_dequeue(struct media_packet *mp, struct packet_stream *sink);
+void media_socket_send_packet(struct stream_fd *, const endpoint_t *, struct codec_packet *);
+void media_socket_send_batch_start(void);
+void media_socket_send_batch_sync(void);
+void media_socket_send_batch_flush(void);
 const struct streamhandler *determine_handler(const struct transport_protocol *in_proto,
 		struct call_media *out_media, int must_recrypt);
-int media_packet_encrypt(rewrite_func encrypt_func, struct packet_stream *out, struct media_packet *mp);
+int media_packet_encrypt(rewrite_func encrypt_func, rewrite_batch_func encrypt_batch_func,
+		struct packet_stream *out, struct media_packet *mp);
 const struct transport_protocol *transport_protocol(const str *s);
 //void play_buffered(struct packet_stream *sink, struct codec_packet *cp, int buffered);
 void play_buffered(struct jb_packet *cp);
@@ -200,6 +260,20 @@ INLINE struct local_intf *get_interface_from_address(const struct logical_intf *
 }
 */
 
+INLINE unsigned int port_pool_free_ports(const struct port_pool *pp) {
+	unsigned int ret = 0;
+	for (unsigned int i = 0; i < pp->num_parts; i++)
+		ret += g_atomic_int_get(&pp->parts[i].free_ports);
+	return ret;
+}
+// the highest port any of the parts has handed out last
+INLINE unsigned int port_pool_last_used(const struct port_pool *pp) {
+	unsigned int ret = 0;
+	for (unsigned int i = 0; i < pp->num_parts; i++)
+		ret = MAX(ret, g_atomic_int_get(&pp->parts[i].last_used));
+	return ret;
+}
+
 INLINE int proto_is_rtp(const struct transport_protocol *protocol) {
 	// known to be RTP? therefore unknown is not RTP
 	if (!protocol)
@@ -0,0 +1,30 @@
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include "socket.h"
+
+
+// NUMA placement (--numa). The nodes and their CPUs are read from sysfs at startup.
+// The dedicated media pollers are spread evenly over the nodes and each one is pinned
+// to a CPU of its node. Each interface address learns the node of the network device
+// it lives on, and a call is put on a media poller of that node (and given arena
+// memory from that node) when its first media socket is opened. The spare sockets
+// of each interface's pool are opened while running on the interface's node.
+
+#define NUMA_MAX_NODES 64
+
+struct poller;
+
+extern unsigned int numa_num_nodes; // 0 if disabled
+
+
+void numa_init(void);
+void numa_pin_media_poller(unsigned int idx);
+void numa_pin_node(int node);
+int numa_media_poller_node(unsigned int idx);
+int numa_addr_node(const sockaddr_t *);
+struct poller *numa_node_poller(int node, unsigned int hash);
+int numa_bind_memory(void *, size_t, int node);
+
+
+#endif
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <time.h>
 #include <glib.h>
+#include "aux.h"
 
 
 
@@ -16,6 +17,15 @@ struct obj;
 
 typedef void (*poller_func_t)(int, void *, uintptr_t);
 
+// what a callback's time is accounted to in the per-thread busy time
+enum poller_cb_type {
+	POLLER_CB_CONTROL = 0,
+	POLLER_CB_MEDIA,
+	POLLER_CB_TIMER,
+
+	__POLLER_CB_MAX
+};
+
 struct poller_item {
 	int				fd;
 	struct obj			*obj;
@@ -25,12 +35,24 @@ struct poller_item {
 	poller_func_t			writeable;
 	poller_func_t			closed;
 	poller_func_t			timer;
+
+	enum poller_cb_type		type;
+	atomic64			*cost_ns; // optional, time spent in the callbacks is added here
+};
+
+struct poller_thread_stats {
+	unsigned int			poller;
+	unsigned int			thread;
+	int				timer; // runs poller_timer_loop
+	uint64_t			busy_ns[__POLLER_CB_MAX];
+	uint64_t			idle_ns; // waiting for events
 };
 
 struct poller;
 
 
 struct poller *poller_new(void);
+unsigned int poller_id(const struct poller *);
 void poller_free(struct poller **);
 int poller_add_item(struct poller *, struct poller_item *);
 int poller_update_item(struct poller *, struct poller_item *);
@@ -43,6 +65,15 @@ void poller_error(struct poller *, void *);
 int poller_poll(struct poller *, int);
 void poller_timer_loop(void *);
 void poller_loop(void *);
+void poller_loop_busy(void *);
+int poller_busy_poll(struct poller *, unsigned int usecs, unsigned int budget);
+// calls `func` with the CPU time used so far by each thread running a poller loop
+void poller_threads_cpu(void (*func)(unsigned int poller, unsigned int thread, uint64_t cpu_ns, void *),
+		void *);
+// calls `func` with the time spent in callbacks and waiting for events by each poller thread
+void poller_threads_stats(void (*func)(const struct poller_thread_stats *, void *), void *);
+extern const char * const poller_cb_type_names[__POLLER_CB_MAX];
+extern __thread int poller_thread_busy; // running poller_loop_busy()
 
 int poller_add_timer(struct poller *, void (*)(void *), struct obj *);
 int poller_del_timer(struct poller *, void (*)(void *), struct obj *);
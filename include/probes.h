@@ -0,0 +1,38 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+
+// USDT probes for use with bpftrace, perf or SystemTap, e.g.
+//   bpftrace -e 'usdt:/usr/sbin/rtpengine:rtpengine:packet_done { @[arg1] = count(); }'
+// Each probe is a single nop while nothing is attached to it. Without <sys/sdt.h> at
+// build time they are compiled out entirely. As arguments are always evaluated, they
+// must be cheap; latencies are best measured between a start and a done probe.
+//
+// Probes and their arguments:
+//   packet_start		(port, length)
+//   packet_done		(port, result)
+//   codec_decode		(payload type, payload length, RTP timestamp)
+//   codec_encode		(payload type, encoded length, pts)
+//   timer_fire			(timer queue type, lateness in us)
+//   ng_command_start		(command, command length, call ID, call ID length)
+//   ng_command_done		(command, command length, error string or NULL, time in us)
+//   redis_start		(operation, call ID, call ID length)
+//   redis_done			(operation, call ID, call ID length)
+//   kernelize			(local port, number of payload types)
+//   unkernelize		(local port)
+
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PROBE(name, ...) STAP_PROBEV(rtpengine, name, ##__VA_ARGS__)
+
+#else
+
+#define PROBE(name, ...) do { } while (0)
+
+#endif
+
+
+#endif
@@ -24,20 +24,19 @@ enum call_opmode;
 struct rtpengine_target_info;
 struct call_monologue;
 struct call_media;
+struct pcap_writer;
 
 
 struct recording_pcap {
 	FILE          *meta_fp;
-	pcap_t        *recording_pd;
-	pcap_dumper_t *recording_pdumper;
-	uint64_t      packet_num;
+	struct pcap_writer *writer;
+	uint64_t      packet_num; // protected by the writer's lock
 	char          *recording_path;
-
-	mutex_t       recording_lock;
 };
 
 struct recording_proc {
 	unsigned int call_idx;
+	int meta_fd; // kept open while the recording daemon takes chunks through its socket
 };
 struct recording_stream_proc {
 	unsigned int stream_idx;
@@ -103,6 +102,9 @@ extern const struct recording_method *selected_recording_method;
 void recording_fs_init(const char *spooldir, const char *method, const char *format);
 void recording_fs_free(void);
 
+// writes out the buffered packets of all pcap recordings
+void recording_pcap_writer_loop(void *);
+
 
 /**
  *
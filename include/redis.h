@@ -12,6 +12,7 @@
 #include <glib.h>
 #include <sys/types.h>
 #include <hiredis/hiredis.h>
+#include <json-glib/json-glib.h>
 #include "call.h"
 #include "str.h"
 
@@ -56,6 +57,7 @@ struct redis {
 	const char	*auth;
 	mutex_t		lock;
 	unsigned int	pipeline;
+	unsigned int	gen; // incremented for every new connection
 
 	int		state;
 	int		no_redis_required;
@@ -67,6 +69,9 @@ struct redis {
 	mutex_t                   async_lock;
 	GQueue                    async_queue;
 	int                       async_last;
+
+	struct redis		**pool; // additional write connections, see --redis-write-connections
+	unsigned int		pool_len;
 };
 
 struct redis_hash {
@@ -80,9 +85,29 @@ struct redis_list {
 };
 
 
+struct redis_restore_stats {
+	mutex_t		lock;
+	int		running;
+	struct timeval	start, end;
+	unsigned int	keys; // found in the database
+	unsigned int	restored;
+	unsigned int	failed;
+	unsigned int	kernelized; // streams
+};
+
+
+struct redis_shard {
+	struct redis	*write;
+	struct redis	*notify; // NULL without subscribed keyspaces
+};
+
+
 extern struct redis		*rtpe_redis;
 extern struct redis		*rtpe_redis_write;
 extern struct redis		*rtpe_redis_notify;
+extern struct redis_restore_stats	rtpe_redis_restore_stats;
+extern struct redis_shard	*rtpe_redis_shards; // in addition to rtpe_redis_write
+extern unsigned int		rtpe_redis_num_shards;
 
 
 
@@ -103,6 +128,11 @@ INLINE gboolean g_hash_table_insert_check(GHashTable *h, gpointer k, gpointer v)
 
 void redis_notify_loop(void *d);
 void redis_delete_async_loop(void *d);
+void redis_writer_loop(void *d);
+void redis_writer_flush(void);
+void redis_notify_worker_loop(void *d);
+void redis_notify_workers_init(void);
+void redis_notify_workers_free(void);
 
 
 struct redis *redis_new(const endpoint_t *, int, const char *, enum redis_role, int);
@@ -110,12 +140,26 @@ void redis_close(struct redis *r);
 int redis_restore(struct redis *);
 void redis_update(struct call *, struct redis *);
 void redis_update_onekey(struct call *c, struct redis *r);
+void redis_update_async(struct call *c, struct redis *r);
 void redis_delete(struct call *, struct redis *);
+void redis_publish(struct redis *, const char *, const str *, unsigned int);
 void redis_wipe(struct redis *);
+GString *redis_call_snapshot(struct call *);
+int redis_restore_snapshot(const str *callid, const char *s, size_t len);
+GHashTable *redis_call_fields(struct call *);
+int redis_restore_fields(const str *callid, GHashTable *fields, int foreign);
+GString *redis_bin_encode_node(JsonNode *);
+JsonNode *redis_bin_decode_node(const char *, size_t);
 int redis_async_event_base_action(struct redis *r, enum event_base_action);
 int redis_notify_subscribe_action(struct redis *r, enum subscribe_action action, int keyspace);
 int redis_set_timeout(struct redis* r, int timeout);
 int redis_reconnect(struct redis* r);
+void redis_shards_init(void);
+void redis_shards_free(void);
+struct redis *redis_shard_for(const str *callid, struct redis *r);
+void redis_write_pool_init(struct redis *r);
+struct redis *redis_pool_conn(const str *callid, struct redis *r);
+void redis_notify_subscribe_all(enum subscribe_action action, int keyspace);
 
 
 
@@ -0,0 +1,20 @@
+#ifndef _REPLICATION_H_
+#define _REPLICATION_H_
+
+
+// Replication of call state to a co-located standby over a persistent TCP link.
+// The active node (--replicate-to) sends the top-level fields of the binary call
+// encoding, and after the first update only those which have changed. The standby
+// (--replicate-listen) keeps the complete set for each call and maintains it as a
+// foreign call with its sockets open, so that "rtpengine-ctl active" is all that's
+// needed to take over.
+
+struct call;
+
+void replication_init(void);
+void replication_update(struct call *); // lock-free
+void replication_sender_loop(void *);
+void replication_standby_loop(void *);
+
+
+#endif
@@ -38,8 +38,8 @@ rtcp_filter_func rtcp_avpf2avp_filter;
 void rtcp_init(void);
 
 
-GString *rtcp_sender_report(uint32_t ssrc, uint32_t ts, uint32_t packets, uint32_t octets, GQueue *rrs);
+void rtcp_sender_report(GString *, uint32_t ssrc, uint32_t ts, uint32_t packets, uint32_t octets, GQueue *rrs);
 void rtcp_receiver_reports(GQueue *out, struct ssrc_hash *hash, struct call_monologue *ml);
-void rtcp_send_report(struct call_media *media, struct ssrc_ctx *ssrc_out);
+void rtcp_send_report(struct call_media *media, struct ssrc_ctx *ssrc_out, GString *buf);
 
 #endif
@@ -21,6 +21,7 @@ struct ssrc_ctx;
 const struct rtp_payload_type *rtp_payload_type(unsigned int, GHashTable *);
 
 int rtp_avp2savp(str *, struct crypto_context *, struct ssrc_ctx *);
+void rtp_avp2savp_batch(str *const *, unsigned int, struct crypto_context *, struct ssrc_ctx *, int *);
 int rtp_savp2avp(str *, struct crypto_context *, struct ssrc_ctx *);
 
 void rtp_append_mki(str *s, struct crypto_context *c);
@@ -7,14 +7,17 @@
 #include "media_socket.h"
 
 
+// The rewritten SDP is kept as an iovec array. Unchanged spans point into the input and
+// generated text is collected into the string chunk, so that the response can be encoded
+// without first copying the whole SDP.
 struct sdp_chopper {
 	str *input;
 	int position;
-	GString *output;
-//	GStringChunk *chunk;
-//	GArray *iov;
-//	int iov_num;
-//	int str_len;
+	GString *output;	// generated text not yet moved into the chunk
+	GStringChunk *chunk;
+	GArray *iov;
+	int iov_num;
+	int str_len;
 };
 
 extern const str rtpe_instance_id;
@@ -29,6 +32,8 @@ int sdp_is_duplicate(GQueue *sessions);
 
 struct sdp_chopper *sdp_chopper_new(str *input);
 void sdp_chopper_destroy(struct sdp_chopper *chop);
+int sdp_chopper_cmp(struct sdp_chopper *chop, const str *s);
+void sdp_chopper_collapse(struct sdp_chopper *chop, char *out);
 
 INLINE int is_trickle_ice_address(const struct endpoint *ep) {
 	if (is_addr_unspecified(&ep->address) && ep->port == 9)
@@ -0,0 +1,30 @@
+#ifndef _SIMULCAST_H_
+#define _SIMULCAST_H_
+
+
+// Selective forwarding of simulcast video (SFU mode): of the layers that a sender announces
+// through a=ssrc-group:SIM, only one is forwarded to the receiver, under the SSRC of the
+// first layer and with continuous sequence numbers and timestamps. The layer is chosen
+// from the receiver's REMB and receiver reports, and switched on key frames.
+
+
+struct call_media;
+struct stream_params;
+struct sdp_ng_flags;
+struct ssrc_ctx;
+struct media_packet;
+struct simulcast;
+
+
+void simulcast_update(struct call_media *, const struct stream_params *, const struct sdp_ng_flags *);
+void simulcast_free(struct simulcast **);
+
+void simulcast_ssrc_map(struct call_media *, struct ssrc_ctx *);
+
+// these return 1 if the packet should be dropped
+int simulcast_rtp(struct media_packet *);
+int simulcast_rtcp_in(struct media_packet *);
+int simulcast_rtcp_out(struct media_packet *);
+
+
+#endif
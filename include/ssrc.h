@@ -8,6 +8,7 @@
 #include "aux.h"
 #include "obj.h"
 #include "codeclib.h"
+#include "rtpengine_replay.h"
 
 
 
@@ -22,6 +23,12 @@ enum ssrc_dir;
 
 
 
+#define SSRC_HASH_FAST_SLOTS 4
+#define SSRC_TIME_REPORTS 10 // SRs and XR RR times remembered per SSRC
+#define SSRC_RECENT_STATS 10 // stats blocks kept for the MOS progression
+#define SSRC_MOS_BUCKETS 51 // MOS histogram, one bucket per 0.1 from 0.0 to 5.0
+
+
 typedef struct ssrc_entry *(*ssrc_create_func_t)(void *uptr);
 
 
@@ -31,8 +38,11 @@ struct ssrc_hash {
 	rwlock_t lock;
 	ssrc_create_func_t create_func;
 	void *uptr;
-	struct ssrc_entry *cache; // last used entry
+	// the first SSRCs seen, looked up without locking. slots are filled once and never
+	// changed until the hash is freed, and the entries in them are never evicted
+	struct ssrc_entry *fast[SSRC_HASH_FAST_SLOTS];
 	struct ssrc_entry *precreat; // next used entry
+	atomic64 *mem; // owning call's memory accounting, or NULL
 };
 struct payload_tracker {
 	mutex_t lock;
@@ -51,6 +61,7 @@ struct ssrc_ctx {
 	// XXX lock this?
 	u_int64_t srtp_index,
 		  srtcp_index;
+	struct re_replay srtp_replay; // input only, protected by the stream's in_lock
 	// XXX move entire crypto context in here?
 
 	// for transcoding
@@ -76,23 +87,42 @@ struct ssrc_stats_block {
 	u_int64_t mos; // nominal range of 10 - 50 for MOS values 1.0 to 5.0
 };
 
+struct ssrc_time_item {
+	struct timeval received;
+	u_int32_t ntp_middle_bits; // to match up with lsr/dlrr
+	double ntp_ts; // XXX convert to int?
+};
+// fixed ring of the last SSRC_TIME_REPORTS time reports, overwriting the oldest
+struct ssrc_time_ring {
+	struct ssrc_time_item items[SSRC_TIME_REPORTS];
+	unsigned int idx; // next slot to be written
+	unsigned int len;
+};
+
 struct ssrc_entry {
 	struct obj obj;
 	mutex_t lock;
 	u_int32_t ssrc;
 	time_t last_used;
+	int pinned; // in one of the fast slots, protected by the hash's write lock
 };
 
 struct ssrc_entry_call {
 	struct ssrc_entry h; // must be first
 	struct ssrc_ctx input_ctx,
 			output_ctx;
-	GQueue sender_reports; // as received via RTCP
-	GQueue rr_time_reports; // as received via RTCP
-	GQueue stats_blocks; // calculated
-	struct ssrc_stats_block *lowest_mos,
-				*highest_mos,
-				average_mos; // contains a running tally of all stats blocks
+	struct ssrc_time_ring sender_reports; // as received via RTCP
+	struct ssrc_time_ring rr_time_reports; // as received via RTCP
+	// calculated stats blocks are aggregated as they come in and not kept individually
+	unsigned int num_stats_blocks;
+	struct ssrc_stats_block lowest_mos,
+				highest_mos,
+				average_mos, // contains a running tally of all stats blocks
+				min_stats, // lowest value of each field
+				max_stats; // highest value of each field
+	unsigned int mos_histogram[SSRC_MOS_BUCKETS];
+	struct ssrc_stats_block recent_stats[SSRC_RECENT_STATS]; // ring of the last stats blocks
+	unsigned int recent_stats_idx; // next slot to be written
 	unsigned int last_rtt; // last calculated raw rtt without rtt from opposide side
 
 	// for transcoding
@@ -107,11 +137,6 @@ enum ssrc_dir { // these values must not be used externally
 	SSRC_DIR_OUTPUT = G_STRUCT_OFFSET(struct ssrc_entry_call, output_ctx),
 };
 
-struct ssrc_time_item {
-	struct timeval received;
-	u_int32_t ntp_middle_bits; // to match up with lsr/dlrr
-	double ntp_ts; // XXX convert to int?
-};
 struct ssrc_sender_report {
 	u_int32_t ssrc;
 	u_int32_t ntp_msw;
@@ -120,10 +145,6 @@ struct ssrc_sender_report {
 	u_int32_t packet_count;
 	u_int32_t octet_count;
 };
-struct ssrc_sender_report_item {
-	struct ssrc_time_item time_item; // must be first;
-	struct ssrc_sender_report report;
-};
 
 struct ssrc_receiver_report {
 	u_int32_t from;
@@ -145,9 +166,6 @@ struct ssrc_xr_rr_time {
 	u_int32_t ntp_msw;
 	u_int32_t ntp_lsw;
 };
-struct ssrc_rr_time_item {
-	struct ssrc_time_item time_item; // must be first;
-};
 
 struct ssrc_xr_dlrr {
 	u_int32_t from;
@@ -210,6 +228,20 @@ void payload_tracker_init(struct payload_tracker *t);
 void payload_tracker_add(struct payload_tracker *, int);
 
 
+// most recent entry, or NULL. entry must be locked
+INLINE struct ssrc_time_item *ssrc_time_ring_last(struct ssrc_time_ring *r) {
+	if (!r->len)
+		return NULL;
+	return &r->items[(r->idx + SSRC_TIME_REPORTS - 1) % SSRC_TIME_REPORTS];
+}
+// n = 0 is the oldest retained stats block. entry must be locked
+INLINE struct ssrc_stats_block *ssrc_recent_stats(struct ssrc_entry_call *e, unsigned int n) {
+	unsigned int len = MIN(e->num_stats_blocks, SSRC_RECENT_STATS);
+	if (n >= len)
+		return NULL;
+	return &e->recent_stats[(e->recent_stats_idx + SSRC_RECENT_STATS - len + n) % SSRC_RECENT_STATS];
+}
+
 INLINE void ssrc_ctx_put(struct ssrc_ctx **c) {
 	if (!c || !*c)
 		return;
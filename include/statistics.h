@@ -11,6 +11,7 @@ struct stats {
 	atomic64			packets;
 	atomic64			bytes;
 	atomic64			errors;
+	atomic64			junk; // dropped by the kernel's junk filter
 	u_int64_t			delay_min;
 	u_int64_t			delay_avg;
 	u_int64_t			delay_max;
@@ -20,11 +21,15 @@ struct stats {
 	atomic64			answers;
 	atomic64			deletes;
 	atomic64			transcoded_media;
+	atomic64			transcode_queue; // packets waiting for a transcoding worker
+	atomic64			transcode_queue_max; // high-water mark of the above
+	atomic64			dtls_queue; // DTLS packets waiting for a handshake worker
+	atomic64			t38_queue; // packets waiting for a T.38 gateway thread
+	atomic64			t38_busy_us; // processing time of the T.38 gateway threads
 };
 
 
 struct request_time {
-	mutex_t lock;
 	u_int64_t count;
 	struct timeval time_min, time_max, time_avg;
 };
@@ -58,7 +63,6 @@ struct totalstats {
 	u_int64_t               own_sessions;
 	u_int64_t               total_sessions;
 
-	mutex_t			total_average_lock; /* for these two below */
 	u_int64_t		total_managed_sess;
 	struct timeval		total_average_call_dur;
 
@@ -66,13 +70,79 @@ struct totalstats {
 	u_int64_t		managed_sess_max; /* per graphite interval statistic */
 	u_int64_t		managed_sess_min; /* per graphite interval statistic */
 
-	mutex_t			total_calls_duration_lock; /* for these two below */
 	struct timeval		total_calls_duration_interval;
 
 	struct request_time	offer, answer, delete;
 	struct requests_ps	offers_ps, answers_ps, deletes_ps;
 };
 
+// log-linear histogram: exact values below 4, then four buckets per power of two
+#define LATENCY_BUCKETS 128
+
+struct latency_histogram {
+	unsigned int		buckets[LATENCY_BUCKETS];
+};
+
+// userspace packet processing, split by what the packet went through
+enum packet_latency_type {
+	PKT_LAT_PASSTHROUGH = 0,
+	PKT_LAT_DECRYPT,
+	PKT_LAT_TRANSCODE,
+	PKT_LAT_JITTER_BUFFER,
+
+	__PKT_LAT_LAST
+};
+
+// from the kernel's receive timestamp to the start of userspace processing, split by
+// how the poller thread waits for packets
+enum wakeup_latency_type {
+	WAKE_LAT_EPOLL = 0,
+	WAKE_LAT_BUSY,
+
+	__WAKE_LAT_LAST
+};
+
+struct request_counters {
+	atomic64		count;
+	atomic64		time_sum; // microseconds
+	atomic64		time_min; // in the current epoch only
+	atomic64		time_max;
+};
+
+/* Running totals of the counters above. Every thread that updates them owns one of these
+ * blocks and is the only writer to it, so that updates are plain stores to a thread-local
+ * cache line. Readers sum up all blocks; interval values are computed as the difference
+ * to the previous sum. Blocks are never freed while the daemon is running, so that counts
+ * from threads that have exited remain included. */
+struct totalstats_block {
+	atomic64		total_timeout_sess;
+	atomic64		total_foreign_sessions;
+	atomic64		total_rejected_sess;
+	atomic64		total_silent_timeout_sess;
+	atomic64		total_offer_timeout_sess;
+	atomic64		total_final_timeout_sess;
+	atomic64		total_regular_term_sess;
+	atomic64		total_forced_term_sess;
+	atomic64		total_relayed_packets;
+	atomic64		total_relayed_errors;
+	atomic64		total_relayed_bytes;
+	atomic64		total_nopacket_relayed_sess;
+	atomic64		total_oneway_stream_sess;
+	atomic64		total_managed_sess;
+	atomic64		total_sess_duration; // microseconds, for the average call duration
+	atomic64		total_calls_duration_interval; // microseconds, cut off at graphite intervals
+	atomic64		total_dtls_handshakes; // full handshakes
+	atomic64		total_dtls_resumed; // abbreviated handshakes using a session ticket
+
+	// min/max request times are only valid within one graphite interval
+	unsigned int		epoch;
+	struct request_counters	offer, answer, delete;
+
+	struct latency_histogram packet_latency[__PKT_LAT_LAST]; // nanoseconds
+	struct latency_histogram wakeup_latency[__WAKE_LAT_LAST]; // microseconds
+	struct latency_histogram relay_latency; // microseconds, from --timestamping
+} __attribute__ ((aligned (64)));
+
 struct rtp_stats {
 	unsigned int		payload_type;
 	atomic64		packets;
@@ -92,6 +162,7 @@ struct codec_stats {
 	atomic64		packets_input[3];
 	atomic64		bytes_input[3];
 	atomic64		pcm_samples[3];
+	atomic64		time_ns; // total decoding and encoding time
 };
 
 struct stats_metric {
@@ -121,6 +192,12 @@ extern struct totalstats       rtpe_totalstats_interval;
 extern mutex_t		       rtpe_totalstats_lastinterval_lock;
 extern struct totalstats       rtpe_totalstats_lastinterval;
 
+extern __thread struct totalstats_block *rtpe_totalstats_local;
+extern volatile unsigned int rtpe_totalstats_epoch;
+
+extern struct latency_histogram rtpe_redis_write_latency; // microseconds
+extern struct latency_histogram rtpe_dtls_handshake_latency; // microseconds
+
 extern mutex_t rtpe_codec_stats_lock;
 extern GHashTable *rtpe_codec_stats;
 
@@ -128,12 +205,48 @@ void statistics_update_oneway(struct call *);
 void statistics_update_foreignown_dec(struct call *);
 void statistics_update_foreignown_inc(struct call* c);
 void statistics_update_totals(struct packet_stream *) ;
+void statistics_update_request_time(struct request_counters *, const struct timeval *);
+void statistics_update_calls_duration(const struct timeval *);
+
+unsigned long latency_histogram_percentile(const struct latency_histogram *, unsigned int pct);
+void statistics_packet_latency(enum packet_latency_type, const struct timespec *start);
+void statistics_wakeup_latency(const struct timeval *rx);
+void statistics_relay_latency(unsigned long us);
+
+struct totalstats_block *__totalstats_block_new(void);
+void statistics_sum_totals(struct totalstats_block *out);
 
 GQueue *statistics_gather_metrics(void);
 void statistics_free_metrics(GQueue **);
+void statistics_snapshot_update(void);
+void statistics_prometheus(GString *);
 const char *statistics_ng(bencode_item_t *input, bencode_item_t *output);
 
 void statistics_init(void);
 void statistics_free(void);
 
+
+INLINE struct totalstats_block *totalstats_block(void) {
+	if (G_UNLIKELY(!rtpe_totalstats_local))
+		rtpe_totalstats_local = __totalstats_block_new();
+	return rtpe_totalstats_local;
+}
+
+INLINE unsigned int latency_bucket(unsigned long v) {
+	if (v < 4)
+		return v;
+	unsigned int l = (sizeof(long) * 8 - 1) - __builtin_clzl(v);
+	unsigned int idx = 4 * (l - 1) + ((v >> (l - 2)) & 3);
+	if (idx >= LATENCY_BUCKETS)
+		idx = LATENCY_BUCKETS - 1;
+	return idx;
+}
+// for histograms shared between threads
+INLINE void latency_histogram_add(struct latency_histogram *h, unsigned long v) {
+	g_atomic_int_inc(&h->buckets[latency_bucket(v)]);
+}
+
+#define TOTALSTATS_ADD(field, n) atomic64_add_na(&totalstats_block()->field, n)
+#define TOTALSTATS_INC(field) TOTALSTATS_ADD(field, 1)
+
 #endif /* STATISTICS_H_ */
@@ -49,9 +49,15 @@ INLINE int is_stun(const str *s) {
 }
 
 
+struct ice_hmac;
+
+
 int stun(const str *, struct stream_fd *, const endpoint_t *);
 
-int stun_binding_request(const endpoint_t *dst, u_int32_t transaction[3], str *pwd,
+void stun_hmac_set(struct ice_hmac *, const str *pwd);
+void stun_hmac_free(struct ice_hmac *);
+
+int stun_binding_request(const endpoint_t *dst, u_int32_t transaction[3], str *pwd, struct ice_hmac *,
 		str ufrags[2], int controlling, u_int64_t tiebreaker, u_int32_t priority,
 		socket_t *, int);
 
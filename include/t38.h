@@ -46,11 +46,22 @@ struct t38_options {
 
 
 
+struct call;
 struct call_media;
 struct media_packet;
 struct media_player;
 
 
+#define T38_TX_BUF_SAMPLES 320 // 40 ms of PCM generated ahead of the player by the T.38 threads
+#define UDPTL_FEC_RING 128 // received IFPs kept for FEC recovery
+
+
+struct udptl_fec_slot {
+	int seq; // -1 if unused
+	GString *s;
+};
+
+
 struct t38_gateway {
 	struct obj obj; // use refcount as this struct is shared between two medias
 	mutex_t lock;
@@ -61,27 +72,45 @@ struct t38_gateway {
 
 	struct t38_options options;
 
-	// udptl outgoing stuff
+	// udptl outgoing stuff, all buffers are reused from one packet to the next
 	uint16_t seqnum;
-	GQueue udptl_ec_out; // seq, seq-1, seq-2, ...
+	GString **udptl_ec_out; // ring of the last sent IFPs, max_ec_entries * fec_span
+	unsigned int udptl_ec_out_size;
+	unsigned int udptl_ec_out_len;
+	unsigned int udptl_ec_out_pos; // next slot to write
+	GString *udptl_out; // packet being built
+	GString *udptl_ec; // its error correction part
+	GString *udptl_fec_out[0x80]; // FEC entries being built
 	// udptl incoming stuff
 	packet_sequencer_t sequencer;
-	GHashTable *udptl_fec;
+	struct udptl_fec_slot udptl_fec[UDPTL_FEC_RING]; // indexed by seq
+	GQueue udptl_spare; // struct udptl_packet for reuse
+	GString *udptl_rec; // FEC recovery scratch
 
 	// player for PCM data
 	struct media_player *pcm_player;
 	unsigned long long pts;
+
+	// offloading to the T.38 threads (--t38-threads), protected by the pool lock
+	GQueue jobs;
+	struct call *sched_call; // reference held while waiting for a worker
+	int scheduled;
+	int stopped;
+	int16_t tx_buf[T38_TX_BUF_SAMPLES];
+	unsigned int tx_len;
 };
 
 
 
 void t38_init(void);
+void t38_cleanup(void);
 
 int t38_gateway_pair(struct call_media *t38_media, struct call_media *pcm_media, const struct t38_options *);
 void t38_gateway_start(struct t38_gateway *);
 int t38_gateway_input_samples(struct t38_gateway *, int16_t amp[], int len);
 int t38_gateway_input_udptl(struct t38_gateway *, const str *);
 void t38_gateway_stop(struct t38_gateway *);
+void t38_worker_loop(void *);
 
 
 INLINE void t38_gateway_put(struct t38_gateway **tp) {
@@ -98,9 +127,11 @@ INLINE void t38_gateway_put(struct t38_gateway **tp) {
 
 // stubs
 INLINE void t38_init(void) { }
+INLINE void t38_cleanup(void) { }
 INLINE void t38_gateway_start(struct t38_gateway *tg) { }
 INLINE void t38_gateway_stop(struct t38_gateway *tg) { }
 INLINE void t38_gateway_put(struct t38_gateway **tp) { }
+INLINE void t38_worker_loop(void *p) { }
 
 
 #endif
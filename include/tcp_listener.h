@@ -40,6 +40,7 @@ int streambuf_listener_init(struct streambuf_listener *listener, struct poller *
 		streambuf_callback_t closed_func,
 		streambuf_callback_t timer_func,
 		struct obj *obj);
+void streambuf_listener_close(struct streambuf_listener *);
 void streambuf_listener_shutdown(struct streambuf_listener *);
 
 void streambuf_stream_close(struct streambuf_stream *);
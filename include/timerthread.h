@@ -7,11 +7,51 @@
 #include "auxlib.h"
 
 
+struct poller;
+
+
+#define TT_WHEEL_LEVELS 4
+#define TT_WHEEL_BITS 8
+#define TT_WHEEL_SIZE (1 << TT_WHEEL_BITS)
+#define TT_WHEEL_MASK (TT_WHEEL_SIZE - 1)
+
+
+// hierarchical timing wheel with 1 ms resolution, alternative to the GTree
+struct timerthread_wheel {
+	uint64_t cur; // current tick (ms), all earlier ticks have been processed
+	GQueue slots[TT_WHEEL_LEVELS][TT_WHEEL_SIZE];
+	GQueue expired; // due objects, in order
+};
+
 struct timerthread {
 	GTree *tree;
+	struct timerthread_wheel *wheel; // used instead of tree if set
 	mutex_t lock;
 	cond_t cond;
 	void (*func)(void *);
+	void (*idle_func)(void); // optional, before going to sleep after running objects
+	long long slack; // us, objects due within this time are run early
+
+	// set for instances of a timerthread_pollers: objects are run from a timerfd
+	// by the threads of this poller, instead of by timerthread_run()
+	struct poller *poller;
+	int timerfd;
+	struct timeval armed; // protected by ->lock, zero if not armed
+};
+
+// one timer thread per poller, created on first use. lets objects that belong to a
+// call run on the same threads that handle the call's sockets
+struct timerthread_pollers {
+	void (*func)(void *);
+	void *(*init)(struct timerthread *); // optional, result is stored as ->priv
+	mutex_t lock;
+	GHashTable *tts; // struct poller * -> struct timerthread_poller
+};
+
+struct timerthread_poller {
+	struct obj obj;
+	struct timerthread tt;
+	void *priv;
 };
 
 struct timerthread_obj {
@@ -20,6 +60,8 @@ struct timerthread_obj {
 	struct timerthread *tt;
 	struct timeval next_check; /* protected by ->lock */
 	struct timeval last_run; /* ditto */
+	GList wheel_link; /* ditto */
+	GQueue *wheel_slot; /* ditto */
 };
 
 struct timerthread_queue {
@@ -47,6 +89,12 @@ void timerthread_run(void *);
 
 void timerthread_obj_schedule_abs_nl(struct timerthread_obj *, const struct timeval *);
 void timerthread_obj_deschedule(struct timerthread_obj *);
+void timerthread_obj_move(struct timerthread_obj *, struct timerthread *);
+
+void timerthread_pollers_init(struct timerthread_pollers *, void (*)(void *), void *(*)(struct timerthread *));
+void timerthread_pollers_free(struct timerthread_pollers *);
+// without a poller (e.g. in tests), the objects are kept but never run
+struct timerthread_poller *timerthread_pollers_get(struct timerthread_pollers *, struct poller *);
 
 // run_now_func = called if newly inserted object can be processed immediately by timerthread_queue_push within its calling context
 // run_later_func = called from the separate timer thread
@@ -61,12 +109,33 @@ void timerthread_queue_flush_data(void *ptr);
 void timerthread_queue_push(struct timerthread_queue *, struct timerthread_queue_entry *);
 unsigned int timerthread_queue_flush(struct timerthread_queue *, void *);
 
+// locks the timer thread that the object currently belongs to, see timerthread_obj_move()
+INLINE struct timerthread *timerthread_obj_lock(struct timerthread_obj *tt_obj) {
+	while (1) {
+		struct timerthread *tt = g_atomic_pointer_get(&tt_obj->tt);
+		mutex_lock(&tt->lock);
+		if (tt == tt_obj->tt)
+			return tt;
+		mutex_unlock(&tt->lock);
+	}
+}
+
 INLINE void timerthread_obj_schedule_abs(struct timerthread_obj *tt_obj, const struct timeval *tv) {
 	if (!tt_obj)
 		return;
-	mutex_lock(&tt_obj->tt->lock);
+	struct timerthread *tt = timerthread_obj_lock(tt_obj);
 	timerthread_obj_schedule_abs_nl(tt_obj, tv);
-	mutex_unlock(&tt_obj->tt->lock);
+	mutex_unlock(&tt->lock);
+}
+
+// moves the object over to the timer thread of the given poller, if it's not there already
+INLINE void timerthread_obj_follow(struct timerthread_obj *tt_obj, struct timerthread_pollers *ttps,
+		struct poller *p)
+{
+	struct timerthread *tt = g_atomic_pointer_get(&tt_obj->tt);
+	if (tt->poller == p)
+		return;
+	timerthread_obj_move(tt_obj, &timerthread_pollers_get(ttps, p)->tt);
 }
 
 
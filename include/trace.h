@@ -0,0 +1,74 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+
+// Binary per-packet tracing. Events are written into one mmap'ed ring file per thread
+// and decoded offline with utils/rtpengine-trace-dump. Only calls that have a trace ID
+// assigned (CLI "trace <callid>") produce events.
+
+
+#define TRACE_MAGIC		"RTPETRC1"
+#define TRACE_VERSION		1
+
+// name, then the meaning of the four arguments
+#define TRACE_EVENTS(X) \
+	X(PACKET_IN,		"packet-in",		"len",		"pt",		"seq",		"ssrc") \
+	X(PACKET_OUT,		"packet-out",		"ret",		"rtcp",		"kernelize",	"handler_ret") \
+	X(ADDRESS_CHECK,	"address-check",	"ret",		"confirmed",	"update",	"unkernelize") \
+	X(KERNELIZE,		"kernelize",		"ok",		"rtcp_only",	"payload_types","dtmf_mask") \
+	X(SEQ_INSERT,		"seq-insert",		"seq",		"ts",		"ret",		"next_seq") \
+	X(SEQ_OUTPUT,		"seq-output",		"seq",		"ts",		"lost",		"ret") \
+	X(JB_QUEUE,		"jb-queue",		"seq",		"ts",		"ring_count",	"delay_ms") \
+	X(JB_PLAY,		"jb-play",		"seq",		"ts",		"ring_count",	"late_ms")
+
+#define TRACE_ENUM(id, ...) TRACE_ ## id,
+enum trace_event_id {
+	TRACE_NONE = 0,
+	TRACE_EVENTS(TRACE_ENUM)
+	__TRACE_LAST
+};
+#undef TRACE_ENUM
+
+struct trace_event {
+	uint64_t		ts;		// nanoseconds since the epoch
+	uint32_t		call;		// call's trace ID
+	uint16_t		port;		// local port of the stream, or 0
+	uint16_t		event;		// enum trace_event_id
+	uint32_t		args[4];
+};
+
+// at the start of each ring file, followed by num_events events
+struct trace_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		event_size;
+	uint32_t		num_events;
+	uint32_t		tid;
+	volatile uint64_t	head;		// total number of events written so far
+	char			_pad[32];
+};
+
+
+#ifndef TRACE_DECODER
+
+struct call;
+
+void trace_init(void);
+void __trace_event(uint32_t id, uint16_t port, enum trace_event_id ev,
+		uint32_t a, uint32_t b, uint32_t c, uint32_t d);
+
+// call must be locked. returns the trace ID, or 0 if tracing was disabled or isn't possible
+unsigned int trace_call_enable(struct call *, int enable);
+
+// cheap enough to leave in the packet path: a single predictable branch for untraced calls
+#define TRACE(call, port, ev, a, b, c, d)							\
+	do {											\
+		if (G_UNLIKELY((call) && (call)->trace_id))					\
+			__trace_event((call)->trace_id, port, TRACE_ ## ev, a, b, c, d);	\
+	} while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef RTPENGINE_DEMUX_H_
+#define RTPENGINE_DEMUX_H_
+
+/*
+ * Packet classification shared between the daemon and the kernel module. The first
+ * RE_DEMUX_BYTES of a packet are loaded once and all protocol checks (RFC 5764 and
+ * RFC 5761 demultiplexing) are made on that copy without branching. Only the RTP
+ * extension length may need another load if a CSRC list pushes it out of the copy.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+
+
+#define RE_DEMUX_BYTES 16
+
+// bit flags, as STUN and DTLS can't be told apart by their first bytes alone
+#define RE_DEMUX_RTP	0x01
+#define RE_DEMUX_RTCP	0x02
+#define RE_DEMUX_STUN	0x04
+#define RE_DEMUX_DTLS	0x08
+
+
+
+struct re_demux {
+	unsigned int			cls; // RE_DEMUX_* bits
+	unsigned int			rtp_hdr_len; // version 2 only: fixed header, CSRCs and
+						     // extension. 0 if invalid or truncated
+};
+
+
+
+static inline void re_demux(struct re_demux *d, const unsigned char *buf, unsigned int len) {
+	unsigned char b[RE_DEMUX_BYTES];
+	const unsigned char *e;
+	unsigned int v2, rtp, rtcp, stun, dtls, hl, x;
+
+	if (len >= RE_DEMUX_BYTES)
+		memcpy(b, buf, RE_DEMUX_BYTES);
+	else {
+		memset(b, 0, sizeof(b));
+		memcpy(b, buf, len);
+	}
+
+	v2 = (b[0] >> 6) == 2;
+	rtcp = v2 & (len >= 8) & ((unsigned char) (b[1] - 194) <= 223 - 194);
+	rtp = v2 & (len >= 12) & !rtcp;
+	stun = (len >= 20) & ((b[0] & 0xc0) == 0) & ((b[3] & 0x3) == 0)
+		& (b[4] == 0x21) & (b[5] == 0x12) & (b[6] == 0xa4) & (b[7] == 0x42);
+	dtls = (len >= 1) & ((unsigned char) (b[0] - 20) <= 63 - 20);
+
+	d->cls = (rtp * RE_DEMUX_RTP) | (rtcp * RE_DEMUX_RTCP)
+		| (stun * RE_DEMUX_STUN) | (dtls * RE_DEMUX_DTLS);
+
+	hl = 12 + ((b[0] & 0xf) << 2);
+	x = v2 & (b[0] >> 4);
+	if ((x & 1)) {
+		if (hl + 4 <= len) {
+			e = (hl + 4 <= RE_DEMUX_BYTES) ? b : buf;
+			hl += 4 + (((e[hl + 2] << 8) | e[hl + 3]) << 2);
+		}
+		else
+			hl = ~0U;
+	}
+	d->rtp_hdr_len = hl & -(unsigned int) (v2 & (hl <= len));
+}
+
+
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef RTPENGINE_REPLAY_H_
+#define RTPENGINE_REPLAY_H_
+
+/*
+ * RFC 3711 section 3.3.2 replay list, shared between the daemon and the kernel module: a
+ * bitmap of the RE_REPLAY_WINDOW packet indexes below the highest one received. It's
+ * checked before the authentication tag, so that duplicated or replayed packets are
+ * rejected without any crypto work, and updated once a packet has been authenticated.
+ * Locking is up to the caller.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/string.h>
+#else
+#include <sys/types.h>
+#include <string.h>
+#endif
+
+
+
+#define RE_REPLAY_WINDOW 128 // bits, multiple of 64. the RFC minimum is 64
+#define RE_REPLAY_WORDS (RE_REPLAY_WINDOW / 64)
+
+
+
+struct re_replay {
+	u_int64_t			top; // highest index received plus one, 0 = none yet
+	u_int64_t			bits[RE_REPLAY_WORDS]; // bit n: index top - 1 - n received
+};
+
+
+
+// returns 0 for a new index, -1 if it was received before or is too old to tell
+static inline int re_replay_check(const struct re_replay *r, u_int64_t idx) {
+	u_int64_t d;
+
+	if (idx >= r->top)
+		return 0;
+	d = r->top - 1 - idx;
+	if (d >= RE_REPLAY_WINDOW)
+		return -1;
+	return ((r->bits[d >> 6] >> (d & 63)) & 1) ? -1 : 0;
+}
+
+static inline void re_replay_add(struct re_replay *r, u_int64_t idx) {
+	u_int64_t d, v;
+	unsigned int w, b, i;
+
+	if (idx >= r->top) {
+		// slide the window up
+		d = idx + 1 - r->top;
+		r->top = idx + 1;
+		if (d >= RE_REPLAY_WINDOW)
+			memset(r->bits, 0, sizeof(r->bits));
+		else {
+			w = d >> 6;
+			b = d & 63;
+			for (i = RE_REPLAY_WORDS; i-- > 0; ) {
+				v = 0;
+				if (i >= w) {
+					v = r->bits[i - w] << b;
+					if (b && i > w)
+						v |= r->bits[i - w - 1] >> (64 - b);
+				}
+				r->bits[i] = v;
+			}
+		}
+		d = 0;
+	}
+	else {
+		d = r->top - 1 - idx;
+		if (d >= RE_REPLAY_WINDOW)
+			return;
+	}
+	r->bits[d >> 6] |= 1ULL << (d & 63);
+}
+
+
+
+#endif
@@ -10,6 +10,14 @@
 #include <linux/crypto.h>
 #include <crypto/aes.h>
 #include <crypto/hash.h>
+#include <crypto/aead.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+#include <crypto/skcipher.h>
+#define RE_HAS_SYNC_SKCIPHER 1
+#else
+#define RE_HAS_SYNC_SKCIPHER 0
+#endif
+#include <linux/scatterlist.h>
 #include <net/icmp.h>
 #include <net/ip.h>
 #include <net/ipv6.h>
@@ -18,15 +26,18 @@
 #include <net/dst.h>
 #include <linux/proc_fs.h>
 #include <linux/spinlock.h>
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
-#include <linux/bsearch.h>
-#endif
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
 #include <asm/atomic.h>
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter_ipv4.h>
 #include <linux/netfilter_ipv6.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/crc32.h>
+#include <linux/random.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #ifndef __RE_EXTERNAL
 #include <linux/netfilter/xt_RTPENGINE.h>
 #else
@@ -34,6 +45,11 @@
 #endif
 
 #include "rtpengine_config.h"
+#include "rtpengine_demux.h"
+#include "rtpengine_replay.h"
+
+#define CREATE_TRACE_POINTS
+#include "xt_RTPENGINE_trace.h"
 
 MODULE_LICENSE("GPL");
 
@@ -173,12 +189,21 @@ MODULE_PARM_DESC(proc_gid, "rtpengine procfs tree group id");
 
 static uint stream_packets_list_limit = 10;
 module_param(stream_packets_list_limit, uint, 0);
-MODULE_PARM_DESC(stream_packets_list_limit, "maximum number of packets to retain for intercept streams");
+MODULE_PARM_DESC(stream_packets_list_limit, "maximum number of packets to retain for intercept streams (rounded up to a power of two)");
 
 static bool log_errors = 0;
 module_param(log_errors, bool, 0);
 MODULE_PARM_DESC(log_errors, "generate kernel log lines from forwarding errors");
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+#define RE_HAS_FASTPATH 1
+static int fastpath_table = -1;
+module_param(fastpath_table, int, 0);
+MODULE_PARM_DESC(fastpath_table, "forwarding table to serve from a PREROUTING hook ahead of conntrack and routing (-1 = none)");
+#else
+#define RE_HAS_FASTPATH 0
+#endif
+
 
 
 #define log_err(fmt, ...) do { if (log_errors) printk(KERN_NOTICE "rtpengine[%s:%i]: " fmt, \
@@ -211,6 +236,11 @@ static int proc_blist_open(struct inode *, struct file *);
 static int proc_blist_close(struct inode *, struct file *);
 static ssize_t proc_blist_read(struct file *, char __user *, size_t, loff_t *);
 
+static int proc_snapshot_open(struct inode *, struct file *);
+static int proc_snapshot_close(struct inode *, struct file *);
+static ssize_t proc_snapshot_read(struct file *, char __user *, size_t, loff_t *);
+static ssize_t proc_snapshot_write(struct file *, const char __user *, size_t, loff_t *);
+
 static int proc_main_list_open(struct inode *, struct file *);
 
 static void *proc_main_list_start(struct seq_file *, loff_t *);
@@ -222,8 +252,13 @@ static int proc_stream_open(struct inode *i, struct file *f);
 static int proc_stream_close(struct inode *i, struct file *f);
 static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t *o);
 static unsigned int proc_stream_poll(struct file *f, struct poll_table_struct *p);
+static int proc_stream_mmap(struct file *f, struct vm_area_struct *vma);
+static int proc_ssrc_stats_mmap(struct file *f, struct vm_area_struct *vma);
+static ssize_t proc_dtmf_read(struct file *f, char __user *b, size_t l, loff_t *o);
+static unsigned int proc_dtmf_poll(struct file *f, struct poll_table_struct *p);
 
 static void table_put(struct rtpengine_table *);
+static int table_new_target(struct rtpengine_table *, struct rtpengine_target_info *, int);
 static struct rtpengine_target *get_target(struct rtpengine_table *, const struct re_address *);
 static int is_valid_address(const struct re_address *rea);
 
@@ -232,6 +267,12 @@ static int srtp_encrypt_aes_cm(struct re_crypto_context *, struct rtpengine_srtp
 		struct rtp_parsed *, u_int64_t);
 static int srtp_encrypt_aes_f8(struct re_crypto_context *, struct rtpengine_srtp *,
 		struct rtp_parsed *, u_int64_t);
+static int srtp_encrypt_aes_gcm(struct re_crypto_context *, struct rtpengine_srtp *,
+		struct rtp_parsed *, u_int64_t);
+static int srtp_decrypt_aes_gcm(struct re_crypto_context *, struct rtpengine_srtp *,
+		struct rtp_parsed *, u_int64_t);
+static void srtcp_crypt_aes_cm(struct re_crypto_context *, unsigned char *, unsigned int, u_int32_t);
+static void srtcp_crypt_aes_f8(struct re_crypto_context *, unsigned char *, unsigned int, u_int32_t);
 
 static void call_put(struct re_call *call);
 static void del_stream(struct re_stream *stream, struct rtpengine_table *);
@@ -246,44 +287,80 @@ static inline int bitfield_clear(unsigned long *bf, unsigned int i);
 
 
 struct re_crypto_context {
-	spinlock_t			lock; /* protects roc and last_index */
+	spinlock_t			lock; /* protects roc, last_index and replay */
 	unsigned char			session_key[32];
 	unsigned char			session_salt[14];
 	unsigned char			session_auth_key[20];
 	u_int32_t			roc;
+	struct re_replay		replay; /* decryption only */
 	struct crypto_cipher		*tfm[2];
 	struct crypto_shash		*shash;
+	struct crypto_aead		*aead;
+	void __percpu			*aead_req; /* one preallocated struct aead_request per CPU */
+#if RE_HAS_SYNC_SKCIPHER
+	struct crypto_sync_skcipher	*ctr; /* whole-buffer CTR mode if available, else tfm[0] is used */
+#endif
 	const struct re_cipher		*cipher;
 	const struct re_hmac		*hmac;
+	atomic_t			*keys_ref; /* the keys and handles above can be shared by the
+						      targets of a REMG_UPDATE, NULL if none */
 };
 
 struct rtpengine_stats_a {
-	atomic64_t			packets;
-	atomic64_t			bytes;
-	atomic64_t			errors;
 	u_int64_t			delay_min;
 	u_int64_t			delay_avg;
 	u_int64_t			delay_max;
+	atomic64_t			delay_packets; /* samples in delay_avg, so the per-CPU counters needn't be summed per packet */
+	atomic_t			have_in_tos;
 	atomic_t          in_tos;
 };
-struct rtpengine_rtp_stats_a {
-	atomic64_t			packets;
-	atomic64_t			bytes;
+/* updated without atomics from the forwarding path, summed up on read */
+struct rtpengine_stats_pcpu {
+	u_int64_t			packets;
+	u_int64_t			bytes;
+	u_int64_t			errors;
+	u_int64_t			junk;
+	struct rtpengine_rtp_stats	rtp_stats[NUM_PAYLOAD_TYPES];
 };
+struct re_output {
+	struct rtpengine_output_info	output;
+	struct re_crypto_context	encrypt;
+};
+
 struct rtpengine_target {
 	atomic_t			refcnt;
 	u_int32_t			table;
 	struct rtpengine_target_info	target;
 
 	struct rtpengine_stats_a	stats;
-	struct rtpengine_rtp_stats_a	rtp_stats[NUM_PAYLOAD_TYPES];
+	struct rtpengine_stats_pcpu __percpu *pcpu_stats;
 	spinlock_t			ssrc_stats_lock;
 	struct rtpengine_ssrc_stats	ssrc_stats;
 
 	struct re_crypto_context	decrypt;
 	struct re_crypto_context	encrypt;
+	struct re_crypto_context	rtcp_decrypt; /* SRTCP session keys, only with rtcp_fw */
+	struct re_crypto_context	rtcp_encrypt;
+	atomic_t			rtcp_count; /* for rtcp_sample */
+	struct crypto_shash		*ice_shash; /* keyed with the local ICE password */
+	int				fastpath; /* served by the PREROUTING hook, ignored by the xt target */
+	struct rtpengine_ssrc_stats_slot *stats_slot; /* in the table's ssrc_stats map, or NULL */
+	u_int32_t			dtmf_ts; /* last reported event, protected by ssrc_stats_lock */
+	int				dtmf_state; /* 1 = start reported, 2 = end reported */
+	unsigned char			pt_index[128]; /* RTP payload type -> index into target.payload_types,
+							  or PT_INDEX_NONE */
+
+	/* target.num_destinations slots. filled in order and never changed afterwards,
+	 * so the packet path only needs to read num_outputs */
+	struct re_output		*outputs;
+	unsigned int			num_outputs;
+	spinlock_t			outputs_lock; /* serializes additions */
+
+	struct rcu_head			rcu;
 };
 
+#define PT_INDEX_NONE 0xff
+
 struct re_bitfield {
 	unsigned long			b[256 / (sizeof(unsigned long) * 8)];
 	unsigned int			used;
@@ -292,6 +369,7 @@ struct re_bitfield {
 struct re_bucket {
 	struct re_bitfield		ports_lo_bf;
 	struct rtpengine_target		*ports_lo[256];
+	struct rcu_head			rcu;
 };
 
 struct re_dest_addr {
@@ -333,13 +411,6 @@ struct re_call {
 	struct list_head		streams; /* protected by streams.lock */
 };
 
-struct re_stream_packet {
-	struct list_head		list_entry;
-	unsigned int			buflen;
-	struct sk_buff			*skbuf;
-	unsigned char			buf[];
-};
-
 struct re_stream {
 	atomic_t			refcnt;
 	struct rtpengine_stream_info	info;
@@ -351,15 +422,22 @@ struct re_stream {
 	struct list_head		call_entry; /* protected by streams.lock */
 	struct hlist_node		streams_hash_entry;
 
-	spinlock_t			packet_list_lock;
-	struct list_head		packet_list;
-	unsigned int			list_count;
+	spinlock_t			ring_lock; /* serialises producers */
+	struct rtpengine_stream_ring	*ring; /* shared with userspace through mmap */
+	unsigned int			ring_slots; /* own copy, as the mapping is writable */
+	struct mutex			read_lock;
 	wait_queue_head_t		read_wq;
 	wait_queue_head_t		close_wq;
-	int				eof; /* protected by packet_list_lock */
+	int				eof; /* protected by ring_lock */
 };
 
 #define RE_HASH_BITS 8 /* make configurable? */
+
+/* The table array, the dest_addr_hash, the ports_hi buckets and the ports_lo
+ * target pointers are published with rcu_assign_pointer() under the respective
+ * write lock, so that the packet path can look them up under rcu_read_lock()
+ * alone. Objects are freed through kfree_rcu() and references are only taken
+ * if the refcount hasn't dropped to zero yet. */
 struct rtpengine_table {
 	atomic_t			refcnt;
 	rwlock_t			target_lock;
@@ -371,11 +449,25 @@ struct rtpengine_table {
 	struct proc_dir_entry		*proc_control;
 	struct proc_dir_entry		*proc_list;
 	struct proc_dir_entry		*proc_blist;
+	struct proc_dir_entry		*proc_snapshot;
 	struct proc_dir_entry		*proc_calls;
+	struct proc_dir_entry		*proc_ssrc_stats;
+	struct proc_dir_entry		*proc_dtmf;
 
 	struct re_dest_addr_hash	dest_addr_hash;
 
+	void				*ssrc_stats_map; /* shared with userspace through mmap */
+
+	spinlock_t			dtmf_lock;
+	wait_queue_head_t		dtmf_wq;
+	struct rtpengine_dtmf_event	*dtmf_ring; /* RTPENGINE_DTMF_RING entries */
+	unsigned int			dtmf_head;
+	unsigned int			dtmf_tail;
+	unsigned int			dtmf_dropped;
+
 	unsigned int			num_targets;
+	u_int32_t			target_epoch; /* changed under target_lock whenever a target
+							 is added, replaced or deleted */
 
 	struct list_head		calls; /* protected by calls.lock */
 
@@ -383,6 +475,8 @@ struct rtpengine_table {
 	struct hlist_head		calls_hash[1 << RE_HASH_BITS];
 	spinlock_t			streams_hash_lock[1 << RE_HASH_BITS];
 	struct hlist_head		streams_hash[1 << RE_HASH_BITS];
+
+	struct rcu_head			rcu;
 };
 
 struct re_cipher {
@@ -394,6 +488,11 @@ struct re_cipher {
 	int				(*encrypt)(struct re_crypto_context *, struct rtpengine_srtp *,
 			struct rtp_parsed *, u_int64_t);
 	int				(*session_key_init)(struct re_crypto_context *, struct rtpengine_srtp *);
+	const char			*aead_name;	/* for AEAD ciphers, tfm_name is NULL */
+	const char			*ctr_name;	/* optional, for AES-CM */
+	/* symmetric, on the SRTCP packet without index, MKI and tag */
+	void				(*rtcp_crypt)(struct re_crypto_context *, unsigned char *,
+			unsigned int, u_int32_t);
 };
 
 struct re_hmac {
@@ -411,10 +510,6 @@ struct rtp_header {
 	u_int32_t ssrc;
 	u_int32_t csrc[];
 } __attribute__ ((packed));
-struct rtp_extension {
-	u_int16_t undefined;
-	u_int16_t length;
-} __attribute__ ((packed));
 
 
 struct rtp_parsed {
@@ -432,6 +527,7 @@ struct rtp_parsed {
 static struct proc_dir_entry *my_proc_root;
 static struct proc_dir_entry *proc_list;
 static struct proc_dir_entry *proc_control;
+static struct proc_dir_entry *proc_crypto_bench;
 
 static struct rtpengine_table *table[MAX_ID];
 static rwlock_t table_lock;
@@ -456,6 +552,7 @@ static struct re_auto_array streams;
 #  define PROC_RELEASE release
 #  define PROC_LSEEK llseek
 #  define PROC_POLL poll
+#  define PROC_MMAP mmap
 #else
 #  define PROC_OP_STRUCT proc_ops
 #  define PROC_OWNER
@@ -465,6 +562,7 @@ static struct re_auto_array streams;
 #  define PROC_RELEASE proc_release
 #  define PROC_LSEEK proc_lseek
 #  define PROC_POLL proc_poll
+#  define PROC_MMAP proc_mmap
 #endif
 
 static const struct PROC_OP_STRUCT proc_control_ops = {
@@ -504,6 +602,30 @@ static const struct PROC_OP_STRUCT proc_blist_ops = {
 	.PROC_RELEASE		= proc_blist_close,
 };
 
+static const struct PROC_OP_STRUCT proc_snapshot_ops = {
+	PROC_OWNER
+	.PROC_OPEN		= proc_snapshot_open,
+	.PROC_READ		= proc_snapshot_read,
+	.PROC_WRITE		= proc_snapshot_write,
+	.PROC_LSEEK		= default_llseek,
+	.PROC_RELEASE		= proc_snapshot_close,
+};
+
+static const struct PROC_OP_STRUCT proc_ssrc_stats_ops = {
+	PROC_OWNER
+	.PROC_MMAP		= proc_ssrc_stats_mmap,
+	.PROC_OPEN		= proc_generic_open_modref,
+	.PROC_RELEASE		= proc_generic_close_modref,
+};
+
+static const struct PROC_OP_STRUCT proc_dtmf_ops = {
+	PROC_OWNER
+	.PROC_READ		= proc_dtmf_read,
+	.PROC_POLL		= proc_dtmf_poll,
+	.PROC_OPEN		= proc_generic_open_modref,
+	.PROC_RELEASE		= proc_generic_close_modref,
+};
+
 static const struct seq_operations proc_list_seq_ops = {
 	.start			= proc_list_start,
 	.next			= proc_list_next,
@@ -511,6 +633,17 @@ static const struct seq_operations proc_list_seq_ops = {
 	.show			= proc_list_show,
 };
 
+static int proc_crypto_bench_open(struct inode *, struct file *);
+static int proc_crypto_bench_close(struct inode *, struct file *);
+
+static const struct PROC_OP_STRUCT proc_crypto_bench_ops = {
+	PROC_OWNER
+	.PROC_OPEN		= proc_crypto_bench_open,
+	.PROC_READ		= seq_read,
+	.PROC_LSEEK		= seq_lseek,
+	.PROC_RELEASE		= proc_crypto_bench_close,
+};
+
 static const struct PROC_OP_STRUCT proc_main_list_ops = {
 	PROC_OWNER
 	.PROC_OPEN		= proc_main_list_open,
@@ -530,6 +663,7 @@ static const struct PROC_OP_STRUCT proc_stream_ops = {
 	PROC_OWNER
 	.PROC_READ		= proc_stream_read,
 	.PROC_POLL		= proc_stream_poll,
+	.PROC_MMAP		= proc_stream_mmap,
 	.PROC_OPEN		= proc_stream_open,
 	.PROC_RELEASE		= proc_stream_close,
 };
@@ -547,8 +681,10 @@ static const struct re_cipher re_ciphers[] = {
 		.id		= REC_AES_CM_128,
 		.name		= "AES-CM-128",
 		.tfm_name	= "aes",
+		.ctr_name	= "ctr(aes)",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.rtcp_crypt	= srtcp_crypt_aes_cm,
 	},
 	[REC_AES_F8] = {
 		.id		= REC_AES_F8,
@@ -557,20 +693,39 @@ static const struct re_cipher re_ciphers[] = {
 		.decrypt	= srtp_encrypt_aes_f8,
 		.encrypt	= srtp_encrypt_aes_f8,
 		.session_key_init = aes_f8_session_key_init,
+		.rtcp_crypt	= srtcp_crypt_aes_f8,
 	},
 	[REC_AES_CM_192] = {
 		.id		= REC_AES_CM_192,
 		.name		= "AES-CM-192",
 		.tfm_name	= "aes",
+		.ctr_name	= "ctr(aes)",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.rtcp_crypt	= srtcp_crypt_aes_cm,
 	},
 	[REC_AES_CM_256] = {
 		.id		= REC_AES_CM_256,
 		.name		= "AES-CM-256",
 		.tfm_name	= "aes",
+		.ctr_name	= "ctr(aes)",
 		.decrypt	= srtp_encrypt_aes_cm,
 		.encrypt	= srtp_encrypt_aes_cm,
+		.rtcp_crypt	= srtcp_crypt_aes_cm,
+	},
+	[REC_AEAD_AES_GCM_128] = {
+		.id		= REC_AEAD_AES_GCM_128,
+		.name		= "AEAD-AES-GCM-128",
+		.aead_name	= "gcm(aes)",
+		.decrypt	= srtp_decrypt_aes_gcm,
+		.encrypt	= srtp_encrypt_aes_gcm,
+	},
+	[REC_AEAD_AES_GCM_256] = {
+		.id		= REC_AEAD_AES_GCM_256,
+		.name		= "AEAD-AES-GCM-256",
+		.aead_name	= "gcm(aes)",
+		.decrypt	= srtp_decrypt_aes_gcm,
+		.encrypt	= srtp_encrypt_aes_gcm,
 	},
 };
 
@@ -590,6 +745,49 @@ static const struct re_hmac re_hmacs[] = {
 	},
 };
 
+/* XXX shared code: same results as decoding and encoding again with lib/codeclib.c */
+static const unsigned char g711_alaw_ulaw[256] = {
+	0x29, 0x2a, 0x27, 0x28, 0x2d, 0x2e, 0x2b, 0x2c, 0x21, 0x22, 0x1f, 0x20, 0x25, 0x26, 0x23, 0x24,
+	0x39, 0x3a, 0x37, 0x38, 0x3d, 0x3e, 0x3b, 0x3c, 0x31, 0x32, 0x2f, 0x30, 0x35, 0x36, 0x33, 0x34,
+	0x0a, 0x0b, 0x08, 0x09, 0x0e, 0x0f, 0x0c, 0x0d, 0x02, 0x03, 0x00, 0x01, 0x06, 0x07, 0x04, 0x05,
+	0x1a, 0x1b, 0x18, 0x19, 0x1e, 0x1f, 0x1c, 0x1d, 0x12, 0x13, 0x10, 0x11, 0x16, 0x17, 0x14, 0x15,
+	0x62, 0x63, 0x60, 0x61, 0x66, 0x67, 0x64, 0x65, 0x5d, 0x5d, 0x5c, 0x5c, 0x5f, 0x5f, 0x5e, 0x5e,
+	0x74, 0x76, 0x70, 0x72, 0x7c, 0x7e, 0x78, 0x7a, 0x6a, 0x6b, 0x68, 0x69, 0x6e, 0x6f, 0x6c, 0x6d,
+	0x48, 0x49, 0x46, 0x47, 0x4c, 0x4d, 0x4a, 0x4b, 0x40, 0x41, 0x3f, 0x3f, 0x44, 0x45, 0x42, 0x43,
+	0x56, 0x57, 0x54, 0x55, 0x5a, 0x5b, 0x58, 0x59, 0x4f, 0x4f, 0x4e, 0x4e, 0x52, 0x53, 0x50, 0x51,
+	0xa9, 0xaa, 0xa7, 0xa8, 0xad, 0xae, 0xab, 0xac, 0xa1, 0xa2, 0x9f, 0xa0, 0xa5, 0xa6, 0xa3, 0xa4,
+	0xb9, 0xba, 0xb7, 0xb8, 0xbd, 0xbe, 0xbb, 0xbc, 0xb1, 0xb2, 0xaf, 0xb0, 0xb5, 0xb6, 0xb3, 0xb4,
+	0x8a, 0x8b, 0x88, 0x89, 0x8e, 0x8f, 0x8c, 0x8d, 0x82, 0x83, 0x80, 0x81, 0x86, 0x87, 0x84, 0x85,
+	0x9a, 0x9b, 0x98, 0x99, 0x9e, 0x9f, 0x9c, 0x9d, 0x92, 0x93, 0x90, 0x91, 0x96, 0x97, 0x94, 0x95,
+	0xe2, 0xe3, 0xe0, 0xe1, 0xe6, 0xe7, 0xe4, 0xe5, 0xdd, 0xdd, 0xdc, 0xdc, 0xdf, 0xdf, 0xde, 0xde,
+	0xf4, 0xf6, 0xf0, 0xf2, 0xfc, 0xfe, 0xf8, 0xfa, 0xea, 0xeb, 0xe8, 0xe9, 0xee, 0xef, 0xec, 0xed,
+	0xc8, 0xc9, 0xc6, 0xc7, 0xcc, 0xcd, 0xca, 0xcb, 0xc0, 0xc1, 0xbf, 0xbf, 0xc4, 0xc5, 0xc2, 0xc3,
+	0xd6, 0xd7, 0xd4, 0xd5, 0xda, 0xdb, 0xd8, 0xd9, 0xcf, 0xcf, 0xce, 0xce, 0xd2, 0xd3, 0xd0, 0xd1,
+};
+static const unsigned char g711_ulaw_alaw[256] = {
+	0x2a, 0x2b, 0x28, 0x29, 0x2e, 0x2f, 0x2c, 0x2d, 0x22, 0x23, 0x20, 0x21, 0x26, 0x27, 0x24, 0x25,
+	0x3a, 0x3b, 0x38, 0x39, 0x3e, 0x3f, 0x3c, 0x3d, 0x32, 0x33, 0x30, 0x31, 0x36, 0x37, 0x34, 0x35,
+	0x0b, 0x08, 0x09, 0x0e, 0x0f, 0x0c, 0x0d, 0x02, 0x03, 0x00, 0x01, 0x06, 0x07, 0x04, 0x05, 0x1a,
+	0x1b, 0x18, 0x19, 0x1e, 0x1f, 0x1c, 0x1d, 0x12, 0x13, 0x10, 0x11, 0x16, 0x17, 0x14, 0x15, 0x6b,
+	0x68, 0x69, 0x6e, 0x6f, 0x6c, 0x6d, 0x62, 0x63, 0x60, 0x61, 0x66, 0x67, 0x64, 0x65, 0x7b, 0x79,
+	0x7e, 0x7f, 0x7c, 0x7d, 0x72, 0x73, 0x70, 0x71, 0x76, 0x77, 0x74, 0x75, 0x4b, 0x49, 0x4f, 0x4d,
+	0x42, 0x43, 0x40, 0x41, 0x46, 0x47, 0x44, 0x45, 0x5a, 0x5b, 0x58, 0x59, 0x5e, 0x5f, 0x5c, 0x5d,
+	0x52, 0x53, 0x53, 0x50, 0x50, 0x51, 0x51, 0x56, 0x56, 0x57, 0x57, 0x54, 0x54, 0x55, 0x55, 0xd5,
+	0xaa, 0xab, 0xa8, 0xa9, 0xae, 0xaf, 0xac, 0xad, 0xa2, 0xa3, 0xa0, 0xa1, 0xa6, 0xa7, 0xa4, 0xa5,
+	0xba, 0xbb, 0xb8, 0xb9, 0xbe, 0xbf, 0xbc, 0xbd, 0xb2, 0xb3, 0xb0, 0xb1, 0xb6, 0xb7, 0xb4, 0xb5,
+	0x8b, 0x88, 0x89, 0x8e, 0x8f, 0x8c, 0x8d, 0x82, 0x83, 0x80, 0x81, 0x86, 0x87, 0x84, 0x85, 0x9a,
+	0x9b, 0x98, 0x99, 0x9e, 0x9f, 0x9c, 0x9d, 0x92, 0x93, 0x90, 0x91, 0x96, 0x97, 0x94, 0x95, 0xeb,
+	0xe8, 0xe9, 0xee, 0xef, 0xec, 0xed, 0xe2, 0xe3, 0xe0, 0xe1, 0xe6, 0xe7, 0xe4, 0xe5, 0xfb, 0xf9,
+	0xfe, 0xff, 0xfc, 0xfd, 0xf2, 0xf3, 0xf0, 0xf1, 0xf6, 0xf7, 0xf4, 0xf5, 0xcb, 0xc9, 0xcf, 0xcd,
+	0xc2, 0xc3, 0xc0, 0xc1, 0xc6, 0xc7, 0xc4, 0xc5, 0xda, 0xdb, 0xd8, 0xd9, 0xde, 0xdf, 0xdc, 0xdd,
+	0xd2, 0xd2, 0xd3, 0xd3, 0xd0, 0xd0, 0xd1, 0xd1, 0xd6, 0xd6, 0xd7, 0xd7, 0xd4, 0xd4, 0xd5, 0xd5,
+};
+
+static const unsigned char *re_xcode_tables[__REX_LAST] = {
+	[REX_ALAW_ULAW]		= g711_alaw_ulaw,
+	[REX_ULAW_ALAW]		= g711_ulaw_alaw,
+};
+
 static const char *re_msm_strings[] = {
 	[MSM_IGNORE]		= "",
 	[MSM_DROP]		= "drop",
@@ -669,6 +867,28 @@ static struct rtpengine_table *new_table(void) {
 	INIT_LIST_HEAD(&t->calls);
 	t->id = -1;
 
+	/* zeroed and suitable for remap_vmalloc_range() */
+	t->ssrc_stats_map = vmalloc_user(RTPENGINE_SSRC_STATS_HDR
+			+ RTPENGINE_SSRC_STATS_SLOTS * sizeof(struct rtpengine_ssrc_stats_slot));
+	if (!t->ssrc_stats_map) {
+		kfree(t);
+		module_put(THIS_MODULE);
+		return NULL;
+	}
+	((struct rtpengine_ssrc_stats_map *) t->ssrc_stats_map)->slots = RTPENGINE_SSRC_STATS_SLOTS;
+	((struct rtpengine_ssrc_stats_map *) t->ssrc_stats_map)->slot_size
+		= sizeof(struct rtpengine_ssrc_stats_slot);
+
+	t->dtmf_ring = kcalloc(RTPENGINE_DTMF_RING, sizeof(*t->dtmf_ring), GFP_KERNEL);
+	if (!t->dtmf_ring) {
+		vfree(t->ssrc_stats_map);
+		kfree(t);
+		module_put(THIS_MODULE);
+		return NULL;
+	}
+	spin_lock_init(&t->dtmf_lock);
+	init_waitqueue_head(&t->dtmf_wq);
+
 	for (i = 0; i < ARRAY_SIZE(t->calls_hash); i++) {
 		INIT_HLIST_HEAD(&t->calls_hash[i]);
 		spin_lock_init(&t->calls_hash_lock[i]);
@@ -760,10 +980,25 @@ static int table_create_proc(struct rtpengine_table *t, u_int32_t id) {
 	if (!t->proc_blist)
 		return -1;
 
+	t->proc_snapshot = proc_create_user("snapshot", S_IFREG | S_IRUGO | S_IWUSR | S_IWGRP,
+			t->proc_root, &proc_snapshot_ops, (void *) (unsigned long) id);
+	if (!t->proc_snapshot)
+		return -1;
+
 	t->proc_calls = proc_mkdir_user("calls", S_IRUGO | S_IXUGO, t->proc_root);
 	if (!t->proc_calls)
 		return -1;
 
+	t->proc_ssrc_stats = proc_create_user("ssrc_stats", S_IFREG | S_IRUSR | S_IRGRP, t->proc_root,
+			&proc_ssrc_stats_ops, (void *) (unsigned long) id);
+	if (!t->proc_ssrc_stats)
+		return -1;
+
+	t->proc_dtmf = proc_create_user("dtmf", S_IFREG | S_IRUSR | S_IRGRP, t->proc_root,
+			&proc_dtmf_ops, (void *) (unsigned long) id);
+	if (!t->proc_dtmf)
+		return -1;
+
 	return 0;
 }
 
@@ -792,7 +1027,7 @@ static struct rtpengine_table *new_table_link(u_int32_t id) {
 	}
 
 	ref_get(t);
-	table[id] = t;
+	rcu_assign_pointer(table[id], t);
 	t->id = id;
 	write_unlock_irqrestore(&table_lock, flags);
 
@@ -810,15 +1045,41 @@ static struct rtpengine_table *new_table_link(u_int32_t id) {
 static void free_crypto_context(struct re_crypto_context *c) {
 	int i;
 
+	/* still in use by another target */
+	if (c->keys_ref && !atomic_dec_and_test(c->keys_ref))
+		goto clear;
+	kfree(c->keys_ref);
+
 	for (i = 0; i < ARRAY_SIZE(c->tfm); i++) {
 		if (c->tfm[i])
 			crypto_free_cipher(c->tfm[i]);
 	}
 	if (c->shash)
 		crypto_free_shash(c->shash);
+	if (c->aead_req)
+		free_percpu(c->aead_req);
+	if (c->aead)
+		crypto_free_aead(c->aead);
+#if RE_HAS_SYNC_SKCIPHER
+	if (c->ctr)
+		crypto_free_sync_skcipher(c->ctr);
+#endif
+
+clear:
+	/* safe to call again */
+	c->keys_ref = NULL;
+	memset(c->tfm, 0, sizeof(c->tfm));
+	c->shash = NULL;
+	c->aead = NULL;
+	c->aead_req = NULL;
+#if RE_HAS_SYNC_SKCIPHER
+	c->ctr = NULL;
+#endif
 }
 
 static void target_put(struct rtpengine_target *t) {
+	unsigned int i;
+
 	if (!t)
 		return;
 
@@ -829,8 +1090,17 @@ static void target_put(struct rtpengine_target *t) {
 
 	free_crypto_context(&t->decrypt);
 	free_crypto_context(&t->encrypt);
-
-	kfree(t);
+	free_crypto_context(&t->rtcp_decrypt);
+	free_crypto_context(&t->rtcp_encrypt);
+	if (t->ice_shash)
+		crypto_free_shash(t->ice_shash);
+	for (i = 0; i < t->num_outputs; i++)
+		free_crypto_context(&t->outputs[i].encrypt);
+	kfree(t->outputs);
+	free_percpu(t->pcpu_stats);
+
+	/* lockless lookups may still be looking at the refcount */
+	kfree_rcu(t, rcu);
 }
 
 
@@ -842,6 +1112,32 @@ static void target_get(struct rtpengine_target *t) {
 	atomic_inc(&t->refcnt);
 }
 
+/* walks all possible CPUs, so only for stats read by userspace, never from the packet path */
+static void target_stats_sum(struct rtpengine_target *g, struct rtpengine_stats *s,
+		struct rtpengine_rtp_stats *rtp_stats)
+{
+	struct rtpengine_stats_pcpu *c;
+	int cpu, i;
+
+	s->packets = s->bytes = s->errors = s->junk = 0;
+	if (rtp_stats)
+		memset(rtp_stats, 0, sizeof(*rtp_stats) * NUM_PAYLOAD_TYPES);
+
+	for_each_possible_cpu(cpu) {
+		c = per_cpu_ptr(g->pcpu_stats, cpu);
+		s->packets += READ_ONCE(c->packets);
+		s->bytes += READ_ONCE(c->bytes);
+		s->errors += READ_ONCE(c->errors);
+		s->junk += READ_ONCE(c->junk);
+		if (!rtp_stats)
+			continue;
+		for (i = 0; i < g->target.num_payload_types; i++) {
+			rtp_stats[i].packets += READ_ONCE(c->rtp_stats[i].packets);
+			rtp_stats[i].bytes += READ_ONCE(c->rtp_stats[i].bytes);
+		}
+	}
+}
+
 
 
 
@@ -870,7 +1166,10 @@ static void clear_table_proc_files(struct rtpengine_table *t) {
 	clear_proc(&t->proc_control);
 	clear_proc(&t->proc_list);
 	clear_proc(&t->proc_blist);
+	clear_proc(&t->proc_snapshot);
 	clear_proc(&t->proc_calls);
+	clear_proc(&t->proc_ssrc_stats);
+	clear_proc(&t->proc_dtmf);
 	clear_proc(&t->proc_root);
 }
 
@@ -914,43 +1213,16 @@ static void table_put(struct rtpengine_table *t) {
 	}
 
 	clear_table_proc_files(t);
-	kfree(t);
+	/* pages still mapped by userspace stay around until unmapped */
+	vfree(t->ssrc_stats_map);
+	kfree(t->dtmf_ring);
+	kfree_rcu(t, rcu);
 
 	module_put(THIS_MODULE);
 }
 
 
 
-/* must be called lock-free */
-static inline void free_packet(struct re_stream_packet *packet) {
-	if (packet->skbuf)
-		kfree_skb(packet->skbuf);
-	kfree(packet);
-}
-
-/* must be called lock-free */
-static void clear_stream_packets(struct re_stream *stream) {
-	struct re_stream_packet *packet;
-	unsigned long flags;
-	LIST_HEAD(delete_list);
-
-	spin_lock_irqsave(&stream->packet_list_lock, flags);
-
-	while (!list_empty(&stream->packet_list)) {
-		DBG("clearing packet from queue\n");
-		packet = list_first_entry(&stream->packet_list, struct re_stream_packet, list_entry);
-		list_del(&packet->list_entry);
-		list_add(&packet->list_entry, &delete_list);
-	}
-
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
-
-	while (!list_empty(&delete_list)) {
-		packet = list_first_entry(&delete_list, struct re_stream_packet, list_entry);
-		list_del(&packet->list_entry);
-		free_packet(packet);
-	}
-}
 static void stream_put(struct re_stream *stream) {
 	DBG("stream_put(%p) - refcnt is %u\n",
 			stream,
@@ -968,8 +1240,8 @@ static void stream_put(struct re_stream *stream) {
 
 	DBG("Freeing stream object\n");
 
-	clear_stream_packets(stream);
 	clear_proc(&stream->file);
+	vfree(stream->ring);
 
 	if (stream->call)
 		call_put(stream->call);
@@ -1043,16 +1315,15 @@ static int unlink_table(struct rtpengine_table *t) {
 
 static struct rtpengine_table *get_table(unsigned int id) {
 	struct rtpengine_table *t;
-	unsigned long flags;
 
 	if (id >= MAX_ID)
 		return NULL;
 
-	read_lock_irqsave(&table_lock, flags);
-	t = table[id];
-	if (t)
-		ref_get(t);
-	read_unlock_irqrestore(&table_lock, flags);
+	rcu_read_lock();
+	t = rcu_dereference(table[id]);
+	if (t && !atomic_inc_not_zero(&t->refcnt))
+		t = NULL;
+	rcu_read_unlock();
 
 	return t;
 }
@@ -1331,11 +1602,14 @@ static ssize_t proc_blist_read(struct file *f, char __user *b, size_t l, loff_t
 	u_int32_t id;
 	struct rtpengine_table *t;
 	struct rtpengine_list_entry *opp;
-	int err, port, addr_bucket, i;
+	int err, port, addr_bucket;
 	struct rtpengine_target *g;
 	unsigned long flags;
+	size_t done = 0;
 
-	if (l != sizeof(*opp))
+	/* any multiple of the entry size is accepted, so that the whole table
+	 * can be pulled in with a handful of syscalls */
+	if (!l || (l % sizeof(*opp)))
 		return -EINVAL;
 	if (*o < 0)
 		return -EINVAL;
@@ -1346,48 +1620,52 @@ static ssize_t proc_blist_read(struct file *f, char __user *b, size_t l, loff_t
 	if (!t)
 		return -ENOENT;
 
-	addr_bucket = ((int) *o) >> 17;
-	port = ((int) *o) & 0x1ffff;
-	g = find_next_target(t, &addr_bucket, &port);
-	*o = (addr_bucket << 17) | port;
-	err = 0;
-	if (!g)
+	err = -ENOMEM;
+	opp = kmalloc(sizeof(*opp), GFP_KERNEL);
+	if (!opp)
 		goto err;
 
-	opp = kzalloc(sizeof(*opp), GFP_KERNEL);
+	while (done < l) {
+		addr_bucket = ((int) *o) >> 17;
+		port = ((int) *o) & 0x1ffff;
+		g = find_next_target(t, &addr_bucket, &port);
+		*o = (addr_bucket << 17) | port;
+		if (!g)
+			break;
 
-	memcpy(&opp->target, &g->target, sizeof(opp->target));
+		memset(opp, 0, sizeof(*opp));
+		memcpy(&opp->target, &g->target, sizeof(opp->target));
 
-	opp->stats.packets = atomic64_read(&g->stats.packets);
-	opp->stats.bytes = atomic64_read(&g->stats.bytes);
-	opp->stats.errors = atomic64_read(&g->stats.errors);
-	opp->stats.delay_min = g->stats.delay_min;
-	opp->stats.delay_max = g->stats.delay_max;
-	opp->stats.delay_avg = g->stats.delay_avg;
-	opp->stats.in_tos = atomic_read(&g->stats.in_tos);
+		target_stats_sum(g, &opp->stats, opp->rtp_stats);
+		opp->stats.delay_min = g->stats.delay_min;
+		opp->stats.delay_max = g->stats.delay_max;
+		opp->stats.delay_avg = g->stats.delay_avg;
+		opp->stats.in_tos = atomic_read(&g->stats.in_tos);
 
-	for (i = 0; i < g->target.num_payload_types; i++) {
-		opp->rtp_stats[i].packets = atomic64_read(&g->rtp_stats[i].packets);
-		opp->rtp_stats[i].bytes = atomic64_read(&g->rtp_stats[i].bytes);
-	}
+		spin_lock_irqsave(&g->ssrc_stats_lock, flags);
+		opp->ssrc_stats = g->ssrc_stats;
+		spin_unlock_irqrestore(&g->ssrc_stats_lock, flags);
 
-	spin_lock_irqsave(&g->decrypt.lock, flags);
-	opp->target.decrypt.last_index = g->target.decrypt.last_index;
-	spin_unlock_irqrestore(&g->decrypt.lock, flags);
+		spin_lock_irqsave(&g->decrypt.lock, flags);
+		opp->target.decrypt.last_index = g->target.decrypt.last_index;
+		spin_unlock_irqrestore(&g->decrypt.lock, flags);
 
-	spin_lock_irqsave(&g->encrypt.lock, flags);
-	opp->target.encrypt.last_index = g->target.encrypt.last_index;
-	spin_unlock_irqrestore(&g->encrypt.lock, flags);
+		spin_lock_irqsave(&g->encrypt.lock, flags);
+		opp->target.encrypt.last_index = g->target.encrypt.last_index;
+		spin_unlock_irqrestore(&g->encrypt.lock, flags);
 
-	target_put(g);
+		target_put(g);
 
-	err = -EFAULT;
-	if (copy_to_user(b, opp, sizeof(*opp)))
-		goto err2;
+		err = -EFAULT;
+		if (copy_to_user(b + done, opp, sizeof(*opp)))
+			goto err2;
+
+		done += sizeof(*opp);
+	}
 
 	table_put(t);
 	kfree(opp);
-	return l;
+	return done;
 
 err2:
 	kfree(opp);
@@ -1396,6 +1674,254 @@ err:
 	return err;
 }
 
+/* per open file, guarded by `lock` */
+struct re_snapshot {
+	struct mutex			lock;
+	u_int32_t			since;
+	int				have_since;
+	void				*buf; /* header and entries, vmalloc'd */
+	size_t				len;
+};
+
+static int proc_snapshot_open(struct inode *i, struct file *f) {
+	u_int32_t id;
+	struct rtpengine_table *t;
+	struct re_snapshot *s;
+	int err;
+
+	if ((err = proc_generic_open_modref(i, f)))
+		return err;
+
+	id = (u_int32_t) (unsigned long) PDE_DATA(i);
+	t = get_table(id);
+	if (!t) {
+		proc_generic_close_modref(i, f);
+		return -ENOENT;
+	}
+	table_put(t);
+
+	s = kzalloc(sizeof(*s), GFP_KERNEL);
+	if (!s) {
+		proc_generic_close_modref(i, f);
+		return -ENOMEM;
+	}
+	mutex_init(&s->lock);
+	f->private_data = s;
+
+	return 0;
+}
+
+static int proc_snapshot_close(struct inode *i, struct file *f) {
+	struct re_snapshot *s = f->private_data;
+
+	vfree(s->buf);
+	kfree(s);
+
+	proc_generic_close_modref(i, f);
+
+	return 0;
+}
+
+static ssize_t proc_snapshot_write(struct file *f, const char __user *b, size_t l, loff_t *o) {
+	struct re_snapshot *s = f->private_data;
+	u_int32_t epoch;
+
+	if (l != sizeof(epoch))
+		return -EINVAL;
+	if (copy_from_user(&epoch, b, sizeof(epoch)))
+		return -EFAULT;
+
+	mutex_lock(&s->lock);
+	s->since = epoch;
+	s->have_since = 1;
+	mutex_unlock(&s->lock);
+
+	return l;
+}
+
+static void target_snapshot(struct rtpengine_target *g, struct rtpengine_snapshot_entry *e) {
+	memset(e, 0, sizeof(*e));
+
+	e->local = g->target.local;
+	e->expected_src = g->target.expected_src;
+	e->ssrc = g->target.ssrc;
+	e->ssrc_out = g->target.ssrc_out;
+	e->num_destinations = g->target.num_destinations;
+
+	if (g->target.rtcp_fw)
+		e->flags |= RTPENGINE_SNAPSHOT_F_RTCP;
+	if (g->target.dtls)
+		e->flags |= RTPENGINE_SNAPSHOT_F_DTLS;
+	if (g->target.stun)
+		e->flags |= RTPENGINE_SNAPSHOT_F_STUN;
+	if (g->target.decrypt.cipher > REC_NULL || g->target.encrypt.cipher > REC_NULL)
+		e->flags |= RTPENGINE_SNAPSHOT_F_SRTP;
+	if (g->fastpath)
+		e->flags |= RTPENGINE_SNAPSHOT_F_FASTPATH;
+
+	target_stats_sum(g, &e->stats, NULL);
+	e->stats.delay_min = g->stats.delay_min;
+	e->stats.delay_max = g->stats.delay_max;
+	e->stats.delay_avg = g->stats.delay_avg;
+	e->stats.in_tos = atomic_read(&g->stats.in_tos);
+
+	/* without ssrc_stats_lock, so possibly torn while a packet is being counted */
+	e->ssrc_stats = g->ssrc_stats;
+}
+
+/* takes a reference to up to `max` targets in a single RCU walk of the table. returns
+ * the number of targets, or max + 1 if there are more */
+static unsigned int table_collect_targets(struct rtpengine_table *t, struct rtpengine_target **out,
+		unsigned int max)
+{
+	unsigned int n = 0, ab, hi, lo;
+	struct re_dest_addr *rda;
+	struct re_bucket *b;
+	struct rtpengine_target *g;
+
+	rcu_read_lock();
+
+	for (ab = 0; ab < 256; ab++) {
+		rda = rcu_dereference(t->dest_addr_hash.addrs[ab]);
+		if (!rda)
+			continue;
+		for (hi = 0; hi < 256; hi++) {
+			/* the bitfields are only a hint here, the pointers are authoritative */
+			if (!READ_ONCE(rda->ports_hi_bf.b[bitfield_slot(hi)])) {
+				hi |= sizeof(unsigned long) * 8 - 1;
+				continue;
+			}
+			b = rcu_dereference(rda->ports_hi[hi]);
+			if (!b)
+				continue;
+			for (lo = 0; lo < 256; lo++) {
+				if (!READ_ONCE(b->ports_lo_bf.b[bitfield_slot(lo)])) {
+					lo |= sizeof(unsigned long) * 8 - 1;
+					continue;
+				}
+				g = rcu_dereference(b->ports_lo[lo]);
+				if (!g)
+					continue;
+				if (n == max) {
+					n++;
+					goto out;
+				}
+				if (!atomic_inc_not_zero(&g->refcnt))
+					continue;
+				out[n++] = g;
+			}
+		}
+	}
+
+out:
+	rcu_read_unlock();
+
+	return n;
+}
+
+static int table_snapshot(struct rtpengine_table *t, struct re_snapshot *s) {
+	struct rtpengine_snapshot_hdr *h;
+	struct rtpengine_snapshot_entry *e;
+	struct rtpengine_target **targets = NULL;
+	unsigned int max = 0, num = 0, i;
+	u_int32_t epoch;
+
+	vfree(s->buf);
+	s->buf = NULL;
+	s->len = 0;
+
+	epoch = READ_ONCE(t->target_epoch);
+	smp_rmb();
+
+	if (!s->have_since || s->since != epoch) {
+		/* the table may grow while we're walking it, in which case we start over */
+		for (;;) {
+			max = READ_ONCE(t->num_targets) + 64;
+			targets = vmalloc(sizeof(*targets) * max);
+			if (!targets)
+				return -ENOMEM;
+			num = table_collect_targets(t, targets, max);
+			if (num <= max)
+				break;
+			for (i = 0; i < max; i++)
+				target_put(targets[i]);
+			vfree(targets);
+			epoch = READ_ONCE(t->target_epoch);
+			smp_rmb();
+		}
+	}
+
+	s->len = sizeof(*h) + sizeof(*e) * num;
+	s->buf = vmalloc(s->len);
+	if (!s->buf) {
+		s->len = 0;
+		for (i = 0; i < num; i++)
+			target_put(targets[i]);
+		vfree(targets);
+		return -ENOMEM;
+	}
+
+	h = s->buf;
+	memset(h, 0, sizeof(*h));
+	h->version = RTPENGINE_SNAPSHOT_VERSION;
+	h->entry_size = sizeof(*e);
+	h->count = num;
+	h->epoch = epoch;
+	if (!targets)
+		h->flags |= RTPENGINE_SNAPSHOT_UNCHANGED;
+
+	e = (void *) (h + 1);
+	for (i = 0; i < num; i++) {
+		target_snapshot(targets[i], &e[i]);
+		target_put(targets[i]);
+	}
+
+	vfree(targets);
+
+	return 0;
+}
+
+static ssize_t proc_snapshot_read(struct file *f, char __user *b, size_t l, loff_t *o) {
+	struct re_snapshot *s = f->private_data;
+	u_int32_t id;
+	struct rtpengine_table *t;
+	ssize_t ret;
+
+	if (*o < 0)
+		return -EINVAL;
+
+	mutex_lock(&s->lock);
+
+	if (*o == 0) {
+		id = (u_int32_t) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
+		t = get_table(id);
+		ret = -ENOENT;
+		if (!t)
+			goto out;
+		ret = table_snapshot(t, s);
+		table_put(t);
+		if (ret)
+			goto out;
+	}
+
+	ret = 0;
+	if (*o >= s->len)
+		goto out;
+	if (l > s->len - *o)
+		l = s->len - *o;
+
+	ret = -EFAULT;
+	if (copy_to_user(b, s->buf + *o, l))
+		goto out;
+
+	*o += l;
+	ret = l;
+
+out:
+	mutex_unlock(&s->lock);
+	return ret;
+}
+
 static int proc_list_open(struct inode *i, struct file *f) {
 	int err;
 	struct seq_file *p;
@@ -1539,8 +2065,12 @@ static void proc_list_crypto_print(struct seq_file *f, struct re_crypto_context
 
 static int proc_list_show(struct seq_file *f, void *v) {
 	struct rtpengine_target *g = v;
+	struct rtpengine_stats stats;
+	struct rtpengine_rtp_stats rtp_stats[NUM_PAYLOAD_TYPES];
 	int i;
 
+	target_stats_sum(g, &stats, rtp_stats);
+
 	seq_printf(f, "local ");
 	seq_addr_print(f, &g->target.local);
 	seq_printf(f, "\n");
@@ -1551,18 +2081,29 @@ static int proc_list_show(struct seq_file *f, void *v) {
 	if (g->target.src_mismatch > 0 && g->target.src_mismatch <= ARRAY_SIZE(re_msm_strings))
 		seq_printf(f, "    src mismatch action: %s\n", re_msm_strings[g->target.src_mismatch]);
 	seq_printf(f, "    stats: %20llu bytes, %20llu packets, %20llu errors\n",
-		(unsigned long long) atomic64_read(&g->stats.bytes),
-		(unsigned long long) atomic64_read(&g->stats.packets),
-		(unsigned long long) atomic64_read(&g->stats.errors));
-	for (i = 0; i < g->target.num_payload_types; i++)
+		(unsigned long long) stats.bytes,
+		(unsigned long long) stats.packets,
+		(unsigned long long) stats.errors);
+	if (g->target.junk_filter)
+		seq_printf(f, "    junk: %20llu packets\n", (unsigned long long) stats.junk);
+	for (i = 0; i < g->target.num_payload_types; i++) {
 		seq_printf(f, "        RTP payload type %3u: %20llu bytes, %20llu packets\n",
 			g->target.payload_types[i],
-			(unsigned long long) atomic64_read(&g->rtp_stats[i].bytes),
-			(unsigned long long) atomic64_read(&g->rtp_stats[i].packets));
+			(unsigned long long) rtp_stats[i].bytes,
+			(unsigned long long) rtp_stats[i].packets);
+		if (g->target.pt_rewrite && g->target.pt_output[i] != g->target.payload_types[i])
+			seq_printf(f, "            output as payload type %3u\n", g->target.pt_output[i]);
+		if (g->target.xcode[i] == REX_ALAW_ULAW)
+			seq_printf(f, "            converting A-law to mu-law\n");
+		else if (g->target.xcode[i] == REX_ULAW_ALAW)
+			seq_printf(f, "            converting mu-law to A-law\n");
+	}
 	if (g->target.ssrc)
 		seq_printf(f, "  SSRC in: %08x\n", g->target.ssrc);
 	if (g->target.ssrc_out)
 		seq_printf(f, " SSRC out: %08x\n", g->target.ssrc_out);
+	if (g->target.seq_diff)
+		seq_printf(f, "  seq out: %+i\n", (int) (int16_t) g->target.seq_diff);
 	proc_list_crypto_print(f, &g->decrypt, &g->target.decrypt, "decryption (incoming)");
 	proc_list_crypto_print(f, &g->encrypt, &g->target.encrypt, "encryption (outgoing)");
 	if (g->target.rtcp_mux)
@@ -1571,12 +2112,35 @@ static int proc_list_show(struct seq_file *f, void *v) {
 		seq_printf(f, "    option: dtls\n");
 	if (g->target.stun)
 		seq_printf(f, "    option: stun\n");
+	if (g->target.ice.pwd_len)
+		seq_printf(f, "    option: STUN responder\n");
 	if (g->target.transcoding)
 		seq_printf(f, "    option: transcoding\n");
 	if (g->target.non_forwarding)
 		seq_printf(f, "    option: non forwarding\n");
 	if (g->target.rtp_stats)
 		seq_printf(f, "    option: RTP stats\n");
+	if (g->target.junk_filter)
+		seq_printf(f, "    option: junk filter\n");
+	if (g->fastpath)
+		seq_printf(f, "    option: PREROUTING fast path\n");
+	if (g->stats_slot)
+		seq_printf(f, "    option: SSRC stats slot %u\n", g->target.stats_slot);
+	if (g->target.dtmf_mask)
+		seq_printf(f, "    option: DTMF events\n");
+	for (i = 0; i < g->num_outputs; i++) {
+		seq_printf(f, "    output %i:\n", i);
+		proc_list_addr_print(f, "src", &g->outputs[i].output.src_addr);
+		proc_list_addr_print(f, "dst", &g->outputs[i].output.dst_addr);
+		if (g->outputs[i].output.ssrc_out)
+			seq_printf(f, " SSRC out: %08x\n", g->outputs[i].output.ssrc_out);
+		proc_list_crypto_print(f, &g->outputs[i].encrypt, &g->outputs[i].output.encrypt,
+				"encryption (output)");
+	}
+	if (g->target.rtcp_fw)
+		seq_printf(f, "    option: RTCP forwarding%s\n", g->target.rtcp ? " (RTCP only)" : "");
+	if (g->target.rtcp_sample)
+		seq_printf(f, "    option: RTCP sample 1/%u\n", g->target.rtcp_sample);
 
 	target_put(g);
 
@@ -1643,8 +2207,9 @@ static struct re_dest_addr *find_dest_addr(const struct re_dest_addr_hash *h, co
 
 	i = rda_hash = re_address_hash(local);
 
+	/* called either under target_lock or under rcu_read_lock() */
 	while (1) {
-		rda = h->addrs[i];
+		rda = rcu_dereference_raw(h->addrs[i]);
 		if (!rda)
 			return NULL;
 		if (re_address_match(local, &rda->destination))
@@ -1662,40 +2227,158 @@ static struct re_dest_addr *find_dest_addr(const struct re_dest_addr_hash *h, co
 
 
 
-static int table_get_target_stats(struct rtpengine_table *t, struct rtpengine_stats_info *i, int reset) {
-	struct rtpengine_target *g;
+static struct rtpengine_ssrc_stats_slot *ssrc_stats_slot(struct rtpengine_table *t, unsigned int slot) {
+	if (!slot || slot > RTPENGINE_SSRC_STATS_SLOTS)
+		return NULL;
+	return t->ssrc_stats_map + RTPENGINE_SSRC_STATS_HDR
+		+ (slot - 1) * sizeof(struct rtpengine_ssrc_stats_slot);
+}
 
-	g = get_target(t, &i->local);
-	if (!g)
-		return -ENOENT;
+/* ssrc_stats_lock must be held. during a REMG_UPDATE the old and the new target can
+ * briefly write to the same slot, so the sequence is always restarted from an even value */
+static void ssrc_stats_publish(struct rtpengine_target *g) {
+	struct rtpengine_ssrc_stats_slot *s = g->stats_slot;
+	u_int32_t seq;
 
-	i->ssrc = g->target.ssrc;
-	spin_lock(&g->ssrc_stats_lock);
-	i->ssrc_stats = g->ssrc_stats;
+	if (!s)
+		return;
 
-	if (reset) {
-		g->ssrc_stats.basic_stats.packets = 0;
-		g->ssrc_stats.basic_stats.bytes = 0;
-		g->ssrc_stats.total_lost = 0;
-	}
+	seq = READ_ONCE(s->seq) & ~1U;
+	WRITE_ONCE(s->seq, seq + 1);
+	smp_wmb();
+	s->ssrc = g->target.ssrc;
+	s->local = g->target.local;
+	s->stats = g->ssrc_stats;
+	smp_wmb();
+	WRITE_ONCE(s->seq, seq + 2);
+}
 
-	spin_unlock(&g->ssrc_stats_lock);
+static int proc_ssrc_stats_mmap(struct file *f, struct vm_area_struct *vma) {
+	u_int32_t id;
+	struct rtpengine_table *t;
+	int err;
 
-	target_put(g);
+	if ((vma->vm_flags & VM_WRITE))
+		return -EPERM;
 
-	return 0;
-}
+	id = (u_int32_t) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
+	t = get_table(id);
+	if (!t)
+		return -ENOENT;
 
+	err = remap_vmalloc_range(vma, t->ssrc_stats_map, vma->vm_pgoff);
 
+	table_put(t);
 
-static int table_del_target(struct rtpengine_table *t, const struct re_address *local) {
-	unsigned char hi, lo;
-	struct re_dest_addr *rda;
-	struct re_bucket *b;
-	struct rtpengine_target *g = NULL;
+	return err;
+}
+
+static int dtmf_readable(struct rtpengine_table *t) {
+	return READ_ONCE(t->dtmf_head) != READ_ONCE(t->dtmf_tail);
+}
+
+static ssize_t proc_dtmf_read(struct file *f, char __user *b, size_t l, loff_t *o) {
+	u_int32_t id;
+	struct rtpengine_table *t;
+	struct rtpengine_dtmf_event e;
 	unsigned long flags;
+	ssize_t ret;
 
-	if (!local || !is_valid_address(local))
+	if (l < sizeof(e))
+		return -EINVAL;
+
+	id = (u_int32_t) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
+	t = get_table(id);
+	if (!t)
+		return -ENOENT;
+
+	while (!dtmf_readable(t)) {
+		ret = -EAGAIN;
+		if ((f->f_flags & O_NONBLOCK))
+			goto out;
+		ret = -ERESTARTSYS;
+		if (wait_event_interruptible(t->dtmf_wq, dtmf_readable(t)))
+			goto out;
+	}
+
+	ret = 0;
+	while (l - ret >= sizeof(e)) {
+		spin_lock_irqsave(&t->dtmf_lock, flags);
+		if (t->dtmf_head == t->dtmf_tail) {
+			spin_unlock_irqrestore(&t->dtmf_lock, flags);
+			break;
+		}
+		e = t->dtmf_ring[t->dtmf_tail % RTPENGINE_DTMF_RING];
+		t->dtmf_tail++;
+		spin_unlock_irqrestore(&t->dtmf_lock, flags);
+
+		if (copy_to_user(b + ret, &e, sizeof(e))) {
+			if (!ret)
+				ret = -EFAULT;
+			break;
+		}
+		ret += sizeof(e);
+	}
+
+out:
+	table_put(t);
+	return ret;
+}
+
+static unsigned int proc_dtmf_poll(struct file *f, struct poll_table_struct *p) {
+	u_int32_t id;
+	struct rtpengine_table *t;
+	unsigned int ret = 0;
+
+	id = (u_int32_t) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
+	t = get_table(id);
+	if (!t)
+		return POLLERR;
+
+	poll_wait(f, &t->dtmf_wq, p);
+	if (dtmf_readable(t))
+		ret |= POLLIN | POLLRDNORM;
+
+	table_put(t);
+	return ret;
+}
+
+static int table_get_target_stats(struct rtpengine_table *t, struct rtpengine_stats_info *i, int reset) {
+	struct rtpengine_target *g;
+
+	g = get_target(t, &i->local);
+	if (!g)
+		return -ENOENT;
+
+	i->ssrc = g->target.ssrc;
+	spin_lock(&g->ssrc_stats_lock);
+	i->ssrc_stats = g->ssrc_stats;
+
+	if (reset) {
+		g->ssrc_stats.basic_stats.packets = 0;
+		g->ssrc_stats.basic_stats.bytes = 0;
+		g->ssrc_stats.total_lost = 0;
+		g->ssrc_stats.reordered = 0;
+		ssrc_stats_publish(g);
+	}
+
+	spin_unlock(&g->ssrc_stats_lock);
+
+	target_put(g);
+
+	return 0;
+}
+
+
+
+static int table_del_target(struct rtpengine_table *t, const struct re_address *local) {
+	unsigned char hi, lo;
+	struct re_dest_addr *rda;
+	struct re_bucket *b;
+	struct rtpengine_target *g = NULL;
+	unsigned long flags;
+
+	if (!local || !is_valid_address(local))
 		return -EINVAL;
 
 	hi = (local->port & 0xff00) >> 8;
@@ -1716,6 +2399,7 @@ static int table_del_target(struct rtpengine_table *t, const struct re_address *
 	b->ports_lo[lo] = NULL;
 	re_bitfield_clear(&b->ports_lo_bf, lo);
 	t->num_targets--;
+	WRITE_ONCE(t->target_epoch, t->target_epoch + 1);
 	if (!b->ports_lo_bf.used) {
 		rda->ports_hi[hi] = NULL;
 		re_bitfield_clear(&rda->ports_hi_bf, hi);
@@ -1731,8 +2415,9 @@ out:
 	if (!g)
 		return -ENOENT;
 	if (b)
-		kfree(b);
+		kfree_rcu(b, rcu);
 
+	trace_rtpengine_target_del(g->target.local.port, g->target.num_payload_types);
 	target_put(g);
 
 	return 0;
@@ -1741,6 +2426,37 @@ out:
 
 
 
+static int table_batch(struct rtpengine_table *t, struct rtpengine_batch_info *bi,
+		struct rtpengine_batch_entry *e, size_t len)
+{
+	unsigned int i;
+
+	if (bi->num > len / sizeof(*e))
+		return -EINVAL;
+
+	for (i = 0; i < bi->num; i++) {
+		switch (e[i].cmd) {
+			case REMG_ADD:
+				e[i].result = table_new_target(t, &e[i].target, 0);
+				break;
+			case REMG_UPDATE:
+				e[i].result = table_new_target(t, &e[i].target, 1);
+				break;
+			case REMG_DEL:
+				e[i].result = table_del_target(t, &e[i].target.local);
+				break;
+			default:
+				e[i].result = -EINVAL;
+				break;
+		}
+	}
+
+	return 0;
+}
+
+
+
+
 static int is_valid_address(const struct re_address *rea) {
 	switch (rea->family) {
 		case AF_INET:
@@ -1777,8 +2493,28 @@ static int validate_srtp(struct rtpengine_srtp *s) {
 		return -1;
 	if (s->auth_tag_len > 20)
 		return -1;
+	if (s->rtcp_auth_tag_len > 20)
+		return -1;
 	if (s->mki_len > sizeof(s->mki))
 		return -1;
+	/* MKI placement after the AEAD tag isn't handled */
+	if (re_ciphers[s->cipher].aead_name && s->mki_len)
+		return -1;
+	return 0;
+}
+
+static int validate_ice(struct rtpengine_target_info *i) {
+	if (!i->ice.pwd_len)
+		return 0;
+	if (i->ice.pwd_len > sizeof(i->ice.pwd))
+		return -1;
+	if (!i->ice.ufrag_len || i->ice.ufrag_len > sizeof(i->ice.ufrag))
+		return -1;
+	/* requests are only answered for the established candidate pair */
+	if (!is_valid_address(&i->expected_src))
+		return -1;
+	if (i->expected_src.family != i->local.family)
+		return -1;
 	return 0;
 }
 
@@ -1894,6 +2630,29 @@ done:
 	;
 }
 
+static void re_aes_ctr(struct re_crypto_context *c, unsigned char *buf, unsigned int len,
+		const unsigned char *iv)
+{
+#if RE_HAS_SYNC_SKCIPHER
+	if (c->ctr) {
+		SYNC_SKCIPHER_REQUEST_ON_STACK(req, c->ctr);
+		struct scatterlist sg;
+		unsigned char ivx[16]; /* updated by the cipher */
+
+		memcpy(ivx, iv, 16);
+		/* the packet is linear, same as for AEAD */
+		sg_init_one(&sg, buf, len);
+		skcipher_request_set_sync_tfm(req, c->ctr);
+		skcipher_request_set_callback(req, 0, NULL, NULL);
+		skcipher_request_set_crypt(req, &sg, &sg, len, ivx);
+		crypto_skcipher_encrypt(req);
+		skcipher_request_zero(req);
+		return;
+	}
+#endif
+	aes_ctr(buf, buf, len, c->tfm[0], iv);
+}
+
 static int aes_ctr_128_no_ctx(unsigned char *out, const char *in, int in_len,
 			      const unsigned char *key, unsigned int key_len, const unsigned char *iv)
 {
@@ -1977,20 +2736,21 @@ error:
 	return ret;
 }
 
-static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s) {
-	int ret;
+/* label is 0x00 for SRTP and 0x03 for SRTCP, rfc 3711 section 4.3.2 */
+static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s, unsigned char label) {
+	int ret, cpu;
 	const char *err;
 
 	if (s->cipher == REC_NULL && s->hmac == REH_NULL)
 		return 0;
 	err = "failed to generate session key";
-	ret = gen_session_key(c->session_key, s->session_key_len, s, 0x00);
+	ret = gen_session_key(c->session_key, s->session_key_len, s, label);
 	if (ret)
 		goto error;
-	ret = gen_session_key(c->session_auth_key, 20, s, 0x01);
+	ret = gen_session_key(c->session_auth_key, 20, s, label + 1);
 	if (ret)
 		goto error;
-	ret = gen_session_key(c->session_salt, 14, s, 0x02);
+	ret = gen_session_key(c->session_salt, 14, s, label + 2);
 	if (ret)
 		goto error;
 
@@ -2005,6 +2765,47 @@ static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *
 		crypto_cipher_setkey(c->tfm[0], c->session_key, s->session_key_len);
 	}
 
+#if RE_HAS_SYNC_SKCIPHER
+	/* lets the crypto API use a bulk implementation (e.g. AES-NI) for whole packets. optional,
+	 * the single-block cipher above is used if it's not available */
+	if (c->cipher->ctr_name) {
+		c->ctr = crypto_alloc_sync_skcipher(c->cipher->ctr_name, 0, 0);
+		if (IS_ERR(c->ctr))
+			c->ctr = NULL;
+		else if (crypto_sync_skcipher_setkey(c->ctr, c->session_key, s->session_key_len)) {
+			crypto_free_sync_skcipher(c->ctr);
+			c->ctr = NULL;
+		}
+	}
+#endif
+
+	if (c->cipher->aead_name) {
+		err = "failed to load AEAD";
+		c->aead = crypto_alloc_aead(c->cipher->aead_name, 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(c->aead)) {
+			ret = PTR_ERR(c->aead);
+			c->aead = NULL;
+			goto error;
+		}
+		err = "failed to set AEAD key";
+		ret = crypto_aead_setkey(c->aead, c->session_key, s->session_key_len);
+		if (ret)
+			goto error;
+		ret = crypto_aead_setauthsize(c->aead, 16);
+		if (ret)
+			goto error;
+
+		/* set up once here instead of being allocated for each packet */
+		err = "failed to allocate AEAD requests";
+		ret = -ENOMEM;
+		c->aead_req = __alloc_percpu(sizeof(struct aead_request) + crypto_aead_reqsize(c->aead),
+				CRYPTO_MINALIGN);
+		if (!c->aead_req)
+			goto error;
+		for_each_possible_cpu(cpu)
+			aead_request_set_tfm(per_cpu_ptr(c->aead_req, cpu), c->aead);
+	}
+
 	if (c->cipher->session_key_init) {
 		ret = c->cipher->session_key_init(c, s);
 		if (ret)
@@ -2022,6 +2823,13 @@ static int gen_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *
 		crypto_shash_setkey(c->shash, c->session_auth_key, 20);
 	}
 
+	err = "failed to allocate key reference";
+	ret = -ENOMEM;
+	c->keys_ref = kmalloc(sizeof(*c->keys_ref), GFP_KERNEL);
+	if (!c->keys_ref)
+		goto error;
+	atomic_set(c->keys_ref, 1);
+
 	switch(s->master_key_len) {
 	case 16:
 		DBG("master key %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n",
@@ -2104,6 +2912,95 @@ error:
 	return ret;
 }
 
+/* session keys only depend on the master key and the crypto suite */
+static int srtp_same_keys(const struct rtpengine_srtp *a, const struct rtpengine_srtp *b) {
+	if (a->cipher != b->cipher || a->hmac != b->hmac)
+		return 0;
+	if (a->master_key_len != b->master_key_len || a->session_key_len != b->session_key_len)
+		return 0;
+	if (memcmp(a->master_key, b->master_key, sizeof(a->master_key)))
+		return 0;
+	if (memcmp(a->master_salt, b->master_salt, sizeof(a->master_salt)))
+		return 0;
+	return 1;
+}
+
+/* for REMG_UPDATE: takes over the keys and crypto API handles of the target being replaced
+ * if they're still valid, instead of deriving and loading them again */
+static int update_session_keys(struct re_crypto_context *c, struct rtpengine_srtp *s,
+		const struct re_crypto_context *oc, const struct rtpengine_srtp *os, unsigned char label)
+{
+	if (!oc || !srtp_same_keys(s, os))
+		return gen_session_keys(c, s, label);
+
+	memcpy(c->session_key, oc->session_key, sizeof(c->session_key));
+	memcpy(c->session_salt, oc->session_salt, sizeof(c->session_salt));
+	memcpy(c->session_auth_key, oc->session_auth_key, sizeof(c->session_auth_key));
+	memcpy(c->tfm, oc->tfm, sizeof(c->tfm));
+	c->shash = oc->shash;
+	c->aead = oc->aead;
+	c->aead_req = oc->aead_req;
+#if RE_HAS_SYNC_SKCIPHER
+	c->ctr = oc->ctr;
+#endif
+	c->keys_ref = oc->keys_ref;
+	if (c->keys_ref)
+		atomic_inc(c->keys_ref);
+	return 0;
+}
+
+static void carry_srtp_index(struct re_crypto_context *c, struct rtpengine_srtp *s,
+		struct re_crypto_context *oc, struct re_crypto_context *orc, struct rtpengine_srtp *os)
+{
+	spin_lock(&oc->lock);
+	if (os->last_index > s->last_index) {
+		s->last_index = os->last_index;
+		c->roc = oc->roc;
+	}
+	c->replay = oc->replay;
+	spin_unlock(&oc->lock);
+
+	spin_lock(&orc->lock);
+	if (os->rtcp_index > s->rtcp_index)
+		s->rtcp_index = os->rtcp_index;
+	spin_unlock(&orc->lock);
+}
+
+/* for REMG_UPDATE of the same stream: the copy of the SRTP and SRTCP indexes that userspace
+ * sent along may be behind the target being replaced, and the replay list is only known to
+ * the kernel. target_lock is held */
+static void update_srtp_index(struct rtpengine_target *g, struct rtpengine_target *og) {
+	if (g->target.ssrc != og->target.ssrc || g->target.ssrc_out != og->target.ssrc_out)
+		return;
+	if (srtp_same_keys(&g->target.decrypt, &og->target.decrypt))
+		carry_srtp_index(&g->decrypt, &g->target.decrypt,
+				&og->decrypt, &og->rtcp_decrypt, &og->target.decrypt);
+	if (srtp_same_keys(&g->target.encrypt, &og->target.encrypt))
+		carry_srtp_index(&g->encrypt, &g->target.encrypt,
+				&og->encrypt, &og->rtcp_encrypt, &og->target.encrypt);
+}
+
+static int ice_init_hmac(struct rtpengine_target *g) {
+	int ret;
+
+	if (!g->target.ice.pwd_len)
+		return 0;
+
+	g->ice_shash = crypto_alloc_shash("hmac(sha1)", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(g->ice_shash)) {
+		ret = PTR_ERR(g->ice_shash);
+		g->ice_shash = NULL;
+		printk(KERN_ERR "Failed to load HMAC for STUN responder\n");
+		return ret;
+	}
+	ret = crypto_shash_setkey(g->ice_shash, g->target.ice.pwd, g->target.ice.pwd_len);
+	if (ret) {
+		crypto_free_shash(g->ice_shash);
+		g->ice_shash = NULL;
+	}
+	return ret;
+}
+
 
 
 
@@ -2118,7 +3015,7 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 	struct rtpengine_target *g;
 	struct re_dest_addr *rda;
 	struct re_bucket *b, *ba = NULL;
-	struct rtpengine_target *og = NULL;
+	struct rtpengine_target *og = NULL, *ok = NULL;
 	int err, j;
 	unsigned long flags;
 
@@ -2144,6 +3041,18 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 		return -EINVAL;
 	if (validate_srtp(&i->encrypt))
 		return -EINVAL;
+	if (validate_ice(i))
+		return -EINVAL;
+	if (i->junk_filter && (!i->rtp || !is_valid_address(&i->expected_src)))
+		return -EINVAL;
+	if (i->num_payload_types > NUM_PAYLOAD_TYPES)
+		return -EINVAL;
+	for (j = 0; j < i->num_payload_types; j++) {
+		if (i->xcode[j] >= __REX_LAST)
+			return -EINVAL;
+	}
+	if (i->stats_slot > RTPENGINE_SSRC_STATS_SLOTS)
+		return -EINVAL;
 
 	DBG("Creating new target\n");
 
@@ -2154,20 +3063,86 @@ static int table_new_target(struct rtpengine_table *t, struct rtpengine_target_i
 	if (!g)
 		goto fail1;
 
+	g->pcpu_stats = alloc_percpu(struct rtpengine_stats_pcpu);
+	if (!g->pcpu_stats)
+		goto fail2;
+
 	g->table = t->id;
 	atomic_set(&g->refcnt, 1);
 	spin_lock_init(&g->decrypt.lock);
 	spin_lock_init(&g->encrypt.lock);
+	spin_lock_init(&g->rtcp_decrypt.lock);
+	spin_lock_init(&g->rtcp_encrypt.lock);
 	memcpy(&g->target, i, sizeof(*i));
+	memset(g->pt_index, PT_INDEX_NONE, sizeof(g->pt_index));
+	for (j = 0; j < g->target.num_payload_types; j++) {
+		if (g->target.payload_types[j] < ARRAY_SIZE(g->pt_index))
+			g->pt_index[g->target.payload_types[j]] = j;
+	}
 	crypto_context_init(&g->decrypt, &g->target.decrypt);
 	crypto_context_init(&g->encrypt, &g->target.encrypt);
+	crypto_context_init(&g->rtcp_decrypt, &g->target.decrypt);
+	crypto_context_init(&g->rtcp_encrypt, &g->target.encrypt);
 	spin_lock_init(&g->ssrc_stats_lock);
 	g->ssrc_stats.lost_bits = -1;
 
-	err = gen_session_keys(&g->decrypt, &g->target.decrypt);
+	/* no SRTCP support for AEAD ciphers, leave RTCP to userspace */
+	if (g->target.rtcp_fw && (g->rtcp_decrypt.cipher->aead_name || g->rtcp_encrypt.cipher->aead_name))
+		g->target.rtcp_fw = 0;
+	if (!g->target.rtcp_fw)
+		g->target.rtcp = 0;
+
+#if (RE_HAS_FASTPATH)
+	/* SRTP streams stay on the xt path */
+	if ((int) t->id == fastpath_table
+			&& g->target.decrypt.cipher == REC_NULL && g->target.decrypt.hmac == REH_NULL
+			&& g->target.encrypt.cipher == REC_NULL && g->target.encrypt.hmac == REH_NULL)
+		g->fastpath = 1;
+#endif
+
+	g->stats_slot = ssrc_stats_slot(t, g->target.stats_slot);
+
+	if (g->target.num_destinations > RTPENGINE_MAX_DESTINATIONS)
+		goto fail2;
+	spin_lock_init(&g->outputs_lock);
+	if (g->target.num_destinations) {
+		err = -ENOMEM;
+		g->outputs = kcalloc(g->target.num_destinations, sizeof(*g->outputs), GFP_KERNEL);
+		if (!g->outputs)
+			goto fail2;
+	}
+
+	/* an update (new destination, SSRC, payload types...) mostly keeps the crypto state
+	 * of the target it replaces, which then doesn't have to be set up again */
+	if (update)
+		ok = get_target(t, &i->local);
+
+	err = update_session_keys(&g->decrypt, &g->target.decrypt,
+			ok ? &ok->decrypt : NULL, ok ? &ok->target.decrypt : NULL, 0x00);
+	if (err)
+		goto fail2;
+	err = update_session_keys(&g->encrypt, &g->target.encrypt,
+			ok ? &ok->encrypt : NULL, ok ? &ok->target.encrypt : NULL, 0x00);
 	if (err)
 		goto fail2;
-	err = gen_session_keys(&g->encrypt, &g->target.encrypt);
+	if (g->target.rtcp_fw) {
+		if (ok && !ok->target.rtcp_fw) {
+			target_put(ok);
+			ok = NULL;
+		}
+		err = update_session_keys(&g->rtcp_decrypt, &g->target.decrypt,
+				ok ? &ok->rtcp_decrypt : NULL, ok ? &ok->target.decrypt : NULL, 0x03);
+		if (err)
+			goto fail2;
+		err = update_session_keys(&g->rtcp_encrypt, &g->target.encrypt,
+				ok ? &ok->rtcp_encrypt : NULL, ok ? &ok->target.encrypt : NULL, 0x03);
+		if (err)
+			goto fail2;
+	}
+	target_put(ok);
+	ok = NULL;
+
+	err = ice_init_hmac(g);
 	if (err)
 		goto fail2;
 
@@ -2215,7 +3190,7 @@ retry:
 		goto retry;
 	}
 
-	t->dest_addr_hash.addrs[rh_it] = rda;
+	rcu_assign_pointer(t->dest_addr_hash.addrs[rh_it], rda);
 	re_bitfield_set(&t->dest_addr_hash.addrs_bf, rh_it);
 
 got_rda:
@@ -2238,7 +3213,7 @@ got_rda:
 	write_lock_irqsave(&t->target_lock, flags);
 
 	if (!rda->ports_hi[hi]) {
-		rda->ports_hi[hi] = b;
+		rcu_assign_pointer(rda->ports_hi[hi], b);
 		re_bitfield_set(&rda->ports_hi_bf, hi);
 	}
 	else {
@@ -2253,18 +3228,16 @@ got_bucket:
 		if (!og)
 			goto fail4;
 
-		atomic64_set(&g->stats.packets, atomic64_read(&og->stats.packets));
-		atomic64_set(&g->stats.bytes, atomic64_read(&og->stats.bytes));
-		atomic64_set(&g->stats.errors, atomic64_read(&og->stats.errors));
+		for_each_possible_cpu(j)
+			memcpy(per_cpu_ptr(g->pcpu_stats, j), per_cpu_ptr(og->pcpu_stats, j),
+					sizeof(struct rtpengine_stats_pcpu));
 		g->stats.delay_min = og->stats.delay_min;
 		g->stats.delay_max = og->stats.delay_max;
 		g->stats.delay_avg = og->stats.delay_avg;
+		atomic64_set(&g->stats.delay_packets, atomic64_read(&og->stats.delay_packets));
+		atomic_set(&g->stats.have_in_tos, atomic_read(&og->stats.have_in_tos));
 		atomic_set(&g->stats.in_tos, atomic_read(&og->stats.in_tos));
-
-		for (j = 0; j < NUM_PAYLOAD_TYPES; j++) {
-			atomic64_set(&g->rtp_stats[j].packets, atomic64_read(&og->rtp_stats[j].packets));
-			atomic64_set(&g->rtp_stats[j].bytes, atomic64_read(&og->rtp_stats[j].bytes));
-		}
+		update_srtp_index(g, og);
 	}
 	else {
 		err = -EEXIST;
@@ -2274,7 +3247,8 @@ got_bucket:
 		t->num_targets++;
 	}
 
-	b->ports_lo[lo] = g;
+	rcu_assign_pointer(b->ports_lo[lo], g);
+	WRITE_ONCE(t->target_epoch, t->target_epoch + 1);
 	g = NULL;
 	write_unlock_irqrestore(&t->target_lock, flags);
 
@@ -2283,6 +3257,8 @@ got_bucket:
 	if (og)
 		target_put(og);
 
+	trace_rtpengine_target_add(i->local.port, i->num_payload_types);
+
 	return 0;
 
 fail4:
@@ -2290,11 +3266,71 @@ fail4:
 	if (ba)
 		kfree(ba);
 fail2:
+	target_put(ok);
+	free_crypto_context(&g->decrypt);
+	free_crypto_context(&g->encrypt);
+	free_crypto_context(&g->rtcp_decrypt);
+	free_crypto_context(&g->rtcp_encrypt);
+	if (g->ice_shash)
+		crypto_free_shash(g->ice_shash);
+	kfree(g->outputs);
+	free_percpu(g->pcpu_stats);
 	kfree(g);
 fail1:
 	return err;
 }
 
+static int table_add_destination(struct rtpengine_table *t, struct rtpengine_destination_info *i) {
+	struct rtpengine_target *g;
+	struct re_output o;
+	unsigned long flags;
+	int err;
+
+	err = -EINVAL;
+	if (!is_valid_address(&i->output.src_addr) || !is_valid_address(&i->output.dst_addr))
+		return err;
+	if (i->output.src_addr.family != i->output.dst_addr.family)
+		return err;
+	if (validate_srtp(&i->output.encrypt))
+		return err;
+
+	g = get_target(t, &i->local);
+	if (!g)
+		return -ENOENT;
+
+	if (i->num >= g->target.num_destinations)
+		goto out;
+
+	/* key setup allocates and may sleep, so do it before taking the lock */
+	memset(&o, 0, sizeof(o));
+	memcpy(&o.output, &i->output, sizeof(o.output));
+	crypto_context_init(&o.encrypt, &o.output.encrypt);
+	err = gen_session_keys(&o.encrypt, &o.output.encrypt, 0x00);
+	if (err)
+		goto fail;
+
+	err = -EBUSY;
+	spin_lock_irqsave(&g->outputs_lock, flags);
+	if (i->num != g->num_outputs) {
+		spin_unlock_irqrestore(&g->outputs_lock, flags);
+		goto fail;
+	}
+	memcpy(&g->outputs[i->num], &o, sizeof(o));
+	spin_lock_init(&g->outputs[i->num].encrypt.lock);
+	/* publish the slot only once it's complete */
+	smp_store_release(&g->num_outputs, i->num + 1);
+	spin_unlock_irqrestore(&g->outputs_lock, flags);
+
+	target_put(g);
+	return 0;
+
+fail:
+	free_crypto_context(&o.encrypt);
+out:
+	target_put(g);
+	return err;
+}
+
 
 
 
@@ -2302,8 +3338,8 @@ fail1:
 static struct rtpengine_target *get_target(struct rtpengine_table *t, const struct re_address *local) {
 	unsigned char hi, lo;
 	struct re_dest_addr *rda;
-	struct rtpengine_target *r;
-	unsigned long flags;
+	struct re_bucket *b;
+	struct rtpengine_target *r = NULL;
 
 	if (!t)
 		return NULL;
@@ -2313,13 +3349,20 @@ static struct rtpengine_target *get_target(struct rtpengine_table *t, const stru
 	hi = (local->port & 0xff00) >> 8;
 	lo = local->port & 0xff;
 
-	read_lock_irqsave(&t->target_lock, flags);
+	rcu_read_lock();
 
 	rda = find_dest_addr(&t->dest_addr_hash, local);
-	r = rda ? (rda->ports_hi[hi] ? rda->ports_hi[hi]->ports_lo[lo] : NULL) : NULL;
-	if (r)
-		target_get(r);
-	read_unlock_irqrestore(&t->target_lock, flags);
+	if (!rda)
+		goto out;
+	b = rcu_dereference(rda->ports_hi[hi]);
+	if (!b)
+		goto out;
+	r = rcu_dereference(b->ports_lo[lo]);
+	if (r && !atomic_inc_not_zero(&r->refcnt))
+		r = NULL;
+
+out:
+	rcu_read_unlock();
 
 	return r;
 }
@@ -2764,6 +3807,27 @@ static void del_call(struct re_call *call, struct rtpengine_table *table) {
 
 
 
+static int stream_ring_alloc(struct re_stream *stream, unsigned int max_packets) {
+	unsigned long size;
+
+	if (max_packets > (1U << 20))
+		return -EINVAL;
+
+	stream->ring_slots = roundup_pow_of_two(max_packets);
+	size = PAGE_ALIGN(RTPENGINE_STREAM_RING_HDR
+			+ (unsigned long) stream->ring_slots * RTPENGINE_STREAM_SLOT_SIZE);
+
+	/* zeroed and suitable for remap_vmalloc_range() */
+	stream->ring = vmalloc_user(size);
+	if (!stream->ring)
+		return -ENOMEM;
+
+	stream->ring->slots = stream->ring_slots;
+	stream->ring->size = size;
+
+	return 0;
+}
+
 static int table_new_stream(struct rtpengine_table *table, struct rtpengine_stream_info *info) {
 	int err;
 	struct re_call *call;
@@ -2798,11 +3862,16 @@ static int table_new_stream(struct rtpengine_table *table, struct rtpengine_stre
 		goto fail2;
 
 	atomic_set(&stream->refcnt, 1);
-	INIT_LIST_HEAD(&stream->packet_list);
-	spin_lock_init(&stream->packet_list_lock);
+	spin_lock_init(&stream->ring_lock);
+	mutex_init(&stream->read_lock);
 	init_waitqueue_head(&stream->read_wq);
 	init_waitqueue_head(&stream->close_wq);
 
+	if (!info->max_packets)
+		info->max_packets = stream_packets_list_limit;
+	if ((err = stream_ring_alloc(stream, info->max_packets)))
+		goto fail3;
+
 	/* check for name collisions */
 
 	stream->hash_bucket = crc32_le(0x52342 ^ info->call_idx, info->stream_name, strlen(info->stream_name));
@@ -2845,8 +3914,6 @@ not_found:
 
 	info->stream_idx = idx;
 	memcpy(&stream->info, info, sizeof(call->info));
-	if (!stream->info.max_packets)
-		stream->info.max_packets = stream_packets_list_limit;
 
 	list_add(&stream->call_entry, &call->streams); /* new ref here */
 	ref_get(stream);
@@ -2857,7 +3924,8 @@ not_found:
 	_w_unlock(&streams.lock, flags);
 
 	/* proc_ functions may sleep, so this must be done outside of the lock */
-	pde = stream->file = proc_create_user(info->stream_name, S_IFREG | S_IRUSR | S_IRGRP, call->root,
+	/* write permission is needed for a shared writable mapping of the ring */
+	pde = stream->file = proc_create_user(info->stream_name, S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP, call->root,
 			&proc_stream_ops, (void *) (unsigned long) info->stream_idx);
 	err = -ENOMEM;
 	if (!pde)
@@ -2890,22 +3958,21 @@ static void del_stream(struct re_stream *stream, struct rtpengine_table *table)
 
 	DBG("del_stream()\n");
 
-	DBG("locking stream's packet list lock\n");
-	spin_lock_irqsave(&stream->packet_list_lock, flags);
+	DBG("locking stream's ring lock\n");
+	spin_lock_irqsave(&stream->ring_lock, flags);
 
 	if (stream->eof) {
 		/* already done this */
-		spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+		spin_unlock_irqrestore(&stream->ring_lock, flags);
 		DBG("stream is EOF\n");
 		stream_put(stream);
 		return;
 	}
 
 	stream->eof = 1;
+	smp_store_release(&stream->ring->eof, 1);
 
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
-
-	clear_stream_packets(stream);
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
 
 	DBG("stream is finished (EOF), waking up threads\n");
 	wake_up_interruptible(&stream->read_wq);
@@ -2980,13 +4047,22 @@ out:
 
 
 
+static inline struct rtpengine_stream_slot *stream_ring_slot(struct re_stream *stream, u_int32_t idx) {
+	return (void *) stream->ring + RTPENGINE_STREAM_RING_HDR
+		+ (unsigned long) (idx & (stream->ring_slots - 1)) * RTPENGINE_STREAM_SLOT_SIZE;
+}
+static inline int stream_ring_readable(struct re_stream *stream) {
+	return READ_ONCE(stream->eof)
+		|| smp_load_acquire(&stream->ring->head) != READ_ONCE(stream->ring->tail);
+}
+
+/* fallback for consumers that don't use the mmap'ed ring */
 static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t *o) {
 	unsigned int stream_idx = (unsigned int) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
 	struct re_stream *stream;
-	unsigned long flags;
-	struct re_stream_packet *packet;
+	struct rtpengine_stream_slot *slot;
+	u_int32_t tail;
 	ssize_t ret;
-	const char *to_copy;
 
 	DBG("entering proc_stream_read()\n");
 
@@ -2994,61 +4070,46 @@ static ssize_t proc_stream_read(struct file *f, char __user *b, size_t l, loff_t
 	if (!stream)
 		return -EINVAL;
 
-	DBG("locking stream's packet list lock\n");
-	spin_lock_irqsave(&stream->packet_list_lock, flags);
+	while (1) {
+		ret = -ERESTARTSYS;
+		if (mutex_lock_interruptible(&stream->read_lock))
+			goto out;
+
+		ret = 0;
+		if (READ_ONCE(stream->eof)) {
+			DBG("eof\n");
+			goto unlock;
+		}
+
+		tail = READ_ONCE(stream->ring->tail);
+		if (smp_load_acquire(&stream->ring->head) != tail)
+			break;
 
-	while (list_empty(&stream->packet_list) && !stream->eof) {
-		spin_unlock_irqrestore(&stream->packet_list_lock, flags);
-		DBG("list is empty\n");
+		mutex_unlock(&stream->read_lock);
+		DBG("ring is empty\n");
 		ret = -EAGAIN;
 		if ((f->f_flags & O_NONBLOCK))
 			goto out;
 		DBG("going to sleep\n");
 		ret = -ERESTARTSYS;
-		if (wait_event_interruptible(stream->read_wq, !list_empty(&stream->packet_list) || stream->eof))
+		if (wait_event_interruptible(stream->read_wq, stream_ring_readable(stream)))
 			goto out;
 		DBG("awakened\n");
-		spin_lock_irqsave(&stream->packet_list_lock, flags);
 	}
 
-	ret = 0;
-	if (stream->eof) {
-		DBG("eof\n");
-		spin_unlock_irqrestore(&stream->packet_list_lock, flags);
-		goto out;
-	}
+	slot = stream_ring_slot(stream, tail);
+	ret = min_t(u_int32_t, READ_ONCE(slot->len), sizeof(slot->data));
+	DBG("removing packet from ring, reading %i bytes\n", (int) ret);
 
-	DBG("removing packet from queue, reading %i bytes\n", (int) l);
-	packet = list_first_entry(&stream->packet_list, struct re_stream_packet, list_entry);
-	list_del(&packet->list_entry);
-	stream->list_count--;
+	if (ret > l)
+		ret = l;
+	if (copy_to_user(b, slot->data, ret))
+		ret = -EFAULT;
 
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
-
-	if (packet->buflen) {
-		ret = packet->buflen;
-		to_copy = packet->buf;
-		DBG("packet is from userspace, %i bytes\n", (int) ret);
-	}
-	else if (packet->skbuf) {
-		ret = packet->skbuf->len;
-		to_copy = packet->skbuf->data;
-		DBG("packet is from kernel, %i bytes\n", (int) ret);
-	}
-	else {
-		printk(KERN_WARNING "BUG in packet stream list buffer\n");
-		ret = -ENXIO;
-		goto err;
-	}
-
-	if (ret > l)
-		ret = l;
-	if (copy_to_user(b, to_copy, ret))
-		ret = -EFAULT;
-
-err:
-	free_packet(packet);
+	smp_store_release(&stream->ring->tail, tail + 1);
 
+unlock:
+	mutex_unlock(&stream->read_lock);
 out:
 	stream_put(stream);
 	return ret;
@@ -3056,7 +4117,6 @@ out:
 static unsigned int proc_stream_poll(struct file *f, struct poll_table_struct *p) {
 	unsigned int stream_idx = (unsigned int) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
 	struct re_stream *stream;
-	unsigned long flags;
 	unsigned int ret = 0;
 
 	DBG("entering proc_stream_poll()\n");
@@ -3065,21 +4125,35 @@ static unsigned int proc_stream_poll(struct file *f, struct poll_table_struct *p
 	if (!stream)
 		return POLLERR;
 
-	DBG("locking stream's packet list lock\n");
-	spin_lock_irqsave(&stream->packet_list_lock, flags);
+	poll_wait(f, &stream->read_wq, p);
 
-	if (!list_empty(&stream->packet_list) || stream->eof)
+	if (stream_ring_readable(stream))
 		ret |= POLLIN | POLLRDNORM;
 
 	DBG("returning from proc_stream_poll()\n");
 
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+	stream_put(stream);
 
-	poll_wait(f, &stream->read_wq, p);
+	return ret;
+}
+
+static int proc_stream_mmap(struct file *f, struct vm_area_struct *vma) {
+	unsigned int stream_idx = (unsigned int) (unsigned long) PDE_DATA(f->f_path.dentry->d_inode);
+	struct re_stream *stream;
+	int err;
+
+	DBG("entering proc_stream_mmap()\n");
+
+	stream = get_stream_lock(NULL, stream_idx);
+	if (!stream)
+		return -EIO;
+
+	/* the file reference held by the mapping keeps our ref from _open alive */
+	err = remap_vmalloc_range(vma, stream->ring, vma->vm_pgoff);
 
 	stream_put(stream);
 
-	return ret;
+	return err;
 }
 
 static int proc_stream_open(struct inode *i, struct file *f) {
@@ -3097,13 +4171,13 @@ static int proc_stream_open(struct inode *i, struct file *f) {
 	if (!stream)
 		return -EIO;
 
-	spin_lock_irqsave(&stream->packet_list_lock, flags);
+	spin_lock_irqsave(&stream->ring_lock, flags);
 	if (stream->eof) {
-		spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+		spin_unlock_irqrestore(&stream->ring_lock, flags);
 		stream_put(stream);
 		return -ETXTBSY;
 	}
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
 
 	return 0;
 }
@@ -3129,97 +4203,77 @@ static int proc_stream_close(struct inode *i, struct file *f) {
 
 
 
-static void add_stream_packet(struct re_stream *stream, struct re_stream_packet *packet) {
-	int err;
-	unsigned long flags;
-	LIST_HEAD(delete_list);
-
-	/* append */
+/* returns the slot to fill in with the ring lock held, or NULL if the packet must be discarded */
+static struct rtpengine_stream_slot *stream_ring_reserve(struct re_stream *stream, unsigned int len,
+		unsigned long *flags)
+{
+	struct rtpengine_stream_ring *ring = stream->ring;
+	u_int32_t head;
 
-	DBG("entering add_stream_packet()\n");
-	DBG("locking stream's packet list lock\n");
-	spin_lock_irqsave(&stream->packet_list_lock, flags);
+	DBG("locking stream's ring lock\n");
+	spin_lock_irqsave(&stream->ring_lock, *flags);
 
-	err = 0;
 	if (stream->eof)
-		goto err; /* we accept, but ignore/discard */
-
-	DBG("adding packet to queue\n");
-	list_add_tail(&packet->list_entry, &stream->packet_list);
-	stream->list_count++;
-
-	DBG("%u packets now in queue\n", stream->list_count);
+		goto drop; /* we accept, but ignore/discard */
+	if (len > sizeof(((struct rtpengine_stream_slot *) 0)->data))
+		goto drop;
 
-	/* discard older packets */
-	while (stream->list_count > stream->info.max_packets) {
-		DBG("discarding old packet from queue\n");
-		packet = list_first_entry(&stream->packet_list, struct re_stream_packet, list_entry);
-		list_del(&packet->list_entry);
-		list_add(&packet->list_entry, &delete_list);
-		stream->list_count--;
+	head = ring->head;
+	if (head - READ_ONCE(ring->tail) >= stream->ring_slots) {
+		DBG("ring is full, discarding packet\n");
+		goto drop;
 	}
 
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
+	return stream_ring_slot(stream, head);
 
-	DBG("stream's packet list lock is unlocked, now awakening processes\n");
+drop:
+	ring->dropped++;
+	spin_unlock_irqrestore(&stream->ring_lock, *flags);
+	return NULL;
+}
 
-	wake_up_interruptible(&stream->read_wq);
+static void stream_ring_commit(struct re_stream *stream, struct rtpengine_stream_slot *slot,
+		unsigned int len, unsigned long flags)
+{
+	slot->len = len;
+	/* publishes the slot contents together with the new head */
+	smp_store_release(&stream->ring->head, stream->ring->head + 1);
 
-	while (!list_empty(&delete_list)) {
-		packet = list_first_entry(&delete_list, struct re_stream_packet, list_entry);
-		list_del(&packet->list_entry);
-		free_packet(packet);
-	}
+	spin_unlock_irqrestore(&stream->ring_lock, flags);
 
-	return;
+	DBG("stream's ring lock is unlocked, now awakening processes\n");
 
-err:
-	DBG("error adding packet to stream\n");
-	spin_unlock_irqrestore(&stream->packet_list_lock, flags);
-	free_packet(packet);
-	return;
+	wake_up_interruptible(&stream->read_wq);
 }
 
 static int stream_packet(struct rtpengine_table *t, const struct rtpengine_packet_info *info,
 		const unsigned char *data, unsigned int len)
 {
 	struct re_stream *stream;
-	int err;
-	struct re_stream_packet *packet;
+	struct rtpengine_stream_slot *slot;
+	unsigned long flags;
 
 	if (!len) /* can't have empty packets */
 		return -EINVAL;
+	if (len > sizeof(slot->data))
+		return -EMSGSIZE;
 
 	DBG("received %u bytes of data from userspace\n", len);
 
-	err = -ENOENT;
 	stream = get_stream_lock(NULL, info->stream_idx);
 	if (!stream)
-		goto out;
+		return -ENOENT;
 
 	DBG("data for stream %s\n", stream->info.stream_name);
 
-	/* alloc and copy */
-
-	err = -ENOMEM;
-	packet = kmalloc(sizeof(*packet) + len, GFP_KERNEL);
-	if (!packet)
-		goto out2;
-	memset(packet, 0, sizeof(*packet));
-
-	memcpy(packet->buf, data, len);
-	packet->buflen = len;
-
-	/* append */
-	add_stream_packet(stream, packet);
-
-	err = 0;
-	goto out2;
+	slot = stream_ring_reserve(stream, len, &flags);
+	if (slot) {
+		memcpy(slot->data, data, len);
+		stream_ring_commit(stream, slot, len, flags);
+	}
 
-out2:
 	stream_put(stream);
-out:
-	return err;
+	return 0;
 }
 
 
@@ -3276,6 +4330,10 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 			err = table_new_target(t, &msg->u.target, 1);
 			break;
 
+		case REMG_ADD_DESTINATION:
+			err = table_add_destination(t, &msg->u.destination);
+			break;
+
 		case REMG_GET_STATS:
 			err = -EINVAL;
 			if (!writeable)
@@ -3316,6 +4374,13 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 			err = stream_packet(t, &msg->u.packet, msg->data, buflen - sizeof(*msg));
 			break;
 
+		case REMG_BATCH:
+			err = -EINVAL;
+			if (!writeable)
+				goto err;
+			err = table_batch(t, &msg->u.batch, (void *) msg->data, buflen - sizeof(*msg));
+			break;
+
 		default:
 			printk(KERN_WARNING "xt_RTPENGINE unimplemented op %u\n", msg->cmd);
 			err = -EINVAL;
@@ -3329,7 +4394,8 @@ static inline ssize_t proc_control_read_write(struct file *file, char __user *ub
 
 	if (writeable) {
 		err = -EFAULT;
-		if (copy_to_user(ubuf, msg, sizeof(*msg)))
+		/* batches return per-entry results */
+		if (copy_to_user(ubuf, msg, msg->cmd == REMG_BATCH ? buflen : sizeof(*msg)))
 			goto out;
 	}
 
@@ -3564,37 +4630,14 @@ drop:
 
 
 /* XXX shared code */
-static void parse_rtp(struct rtp_parsed *rtp, struct sk_buff *skb) {
-	struct rtp_extension *ext;
-	int ext_len;
-
-	if (skb->len < sizeof(*rtp->header))
+static void parse_rtp(struct rtp_parsed *rtp, struct sk_buff *skb, const struct re_demux *d) {
+	if (!d->rtp_hdr_len)
 		goto error;
 	rtp->header = (void *) skb->data;
-	if ((rtp->header->v_p_x_cc & 0xc0) != 0x80) /* version 2 */
-		goto error;
-	rtp->header_len = sizeof(*rtp->header);
-
-	/* csrc list */
-	rtp->header_len += (rtp->header->v_p_x_cc & 0xf) * 4;
-	if (skb->len < rtp->header_len)
-		goto error;
+	rtp->header_len = d->rtp_hdr_len;
 	rtp->payload = skb->data + rtp->header_len;
 	rtp->payload_len = skb->len - rtp->header_len;
 
-	if ((rtp->header->v_p_x_cc & 0x10)) {
-		/* extension */
-		if (rtp->payload_len < sizeof(*ext))
-			goto error;
-		ext = (void *) rtp->payload;
-		ext_len = 4 + ntohs(ext->length) * 4;
-		if (rtp->payload_len < ext_len)
-			goto error;
-		rtp->payload += ext_len;
-		rtp->payload_len -= ext_len;
-		rtp->header_len += ext_len;
-	}
-
 	DBG("rtp header parsed, payload length is %u\n", rtp->payload_len);
 
 	rtp->ok = 1;
@@ -3649,6 +4692,37 @@ static u_int64_t packet_index(struct re_crypto_context *c,
 	return index;
 }
 
+/* rfc 3711 section 3.3.2. replay protection needs authentication, either an HMAC tag or
+ * an AEAD cipher */
+static inline int srtp_replay_protected(struct re_crypto_context *c, struct rtpengine_srtp *s) {
+	return s->auth_tag_len || c->aead;
+}
+
+static int srtp_replay_check(struct re_crypto_context *c, struct rtpengine_srtp *s, u_int64_t idx) {
+	unsigned long flags;
+	int ret;
+
+	if (!srtp_replay_protected(c, s))
+		return 0;
+
+	spin_lock_irqsave(&c->lock, flags);
+	ret = re_replay_check(&c->replay, idx);
+	spin_unlock_irqrestore(&c->lock, flags);
+
+	return ret;
+}
+
+static void srtp_replay_add(struct re_crypto_context *c, struct rtpengine_srtp *s, u_int64_t idx) {
+	unsigned long flags;
+
+	if (!srtp_replay_protected(c, s))
+		return;
+
+	spin_lock_irqsave(&c->lock, flags);
+	re_replay_add(&c->replay, idx);
+	spin_unlock_irqrestore(&c->lock, flags);
+}
+
 static void update_packet_index(struct re_crypto_context *c,
 		struct rtpengine_srtp *s, u_int64_t idx)
 {
@@ -3660,37 +4734,67 @@ static void update_packet_index(struct re_crypto_context *c,
 	spin_unlock_irqrestore(&c->lock, flags);
 }
 
-static int srtp_hash(unsigned char *hmac,
-		struct re_crypto_context *c,
-		struct rtpengine_srtp *s, struct rtp_parsed *r,
-		u_int64_t pkt_idx)
+/* the HMAC key schedule is precomputed in c->shash by crypto_shash_setkey(), so all
+ * that's needed per packet is a descriptor, which lives on the stack where possible */
+static int re_hmac_calc(unsigned char *hmac, struct re_crypto_context *c,
+		const void *buf, unsigned int len, const void *buf2, unsigned int len2)
 {
-	u_int32_t roc;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0)
+	SHASH_DESC_ON_STACK(dsc, c->shash);
+#else
 	struct shash_desc *dsc;
 	size_t alloc_size;
+#endif
 
-	if (!s->auth_tag_len)
-		return 0;
-
-	roc = htonl((pkt_idx & 0xffffffff0000ULL) >> 16);
-
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0)
 	alloc_size = sizeof(*dsc) + crypto_shash_descsize(c->shash);
 	dsc = kmalloc(alloc_size, GFP_ATOMIC);
 	if (!dsc)
 		return -1;
 	memset(dsc, 0, alloc_size);
+#endif
 
 	dsc->tfm = c->shash;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0) && LINUX_VERSION_CODE < KERNEL_VERSION(5,1,0)
+	dsc->flags = 0;
+#endif
 
 	if (crypto_shash_init(dsc))
 		goto error;
 
-	crypto_shash_update(dsc, (void *) r->header, r->header_len + r->payload_len);
-	crypto_shash_update(dsc, (void *) &roc, sizeof(roc));
+	crypto_shash_update(dsc, buf, len);
+	if (len2)
+		crypto_shash_update(dsc, buf2, len2);
 
 	crypto_shash_final(dsc, hmac);
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0)
+	kfree(dsc);
+#endif
+
+	return 0;
+
+error:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0)
 	kfree(dsc);
+#endif
+	return -1;
+}
+
+static int srtp_hash(unsigned char *hmac,
+		struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtp_parsed *r,
+		u_int64_t pkt_idx)
+{
+	u_int32_t roc;
+
+	if (!s->auth_tag_len)
+		return 0;
+
+	roc = htonl((pkt_idx & 0xffffffff0000ULL) >> 16);
+
+	if (re_hmac_calc(hmac, c, r->header, r->header_len + r->payload_len, &roc, sizeof(roc)))
+		return -1;
 
 	DBG("calculated HMAC %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x\n",
 			hmac[0], hmac[1], hmac[2], hmac[3],
@@ -3700,10 +4804,6 @@ static int srtp_hash(unsigned char *hmac,
 			hmac[16], hmac[17], hmac[18], hmac[19]);
 
 	return 0;
-
-error:
-	kfree(dsc);
-	return -1;
 }
 
 /* XXX shared code */
@@ -3834,7 +4934,7 @@ static int srtp_encrypt_aes_cm(struct re_crypto_context *c,
 	ivi[2] ^= idxh;
 	ivi[3] ^= idxl;
 
-	aes_ctr(r->payload, r->payload, r->payload_len, c->tfm[0], iv);
+	re_aes_ctr(c, r->payload, r->payload_len, iv);
 
 	return 0;
 }
@@ -3857,6 +4957,75 @@ static int srtp_encrypt_aes_f8(struct re_crypto_context *c,
 }
 
 
+/* rfc 7714 sections 8.1 and 8.2
+ * the RTP header is the AAD and the 16-byte tag follows the payload */
+static int srtp_crypt_aes_gcm(struct re_crypto_context *c,
+		struct rtp_parsed *r, u_int64_t pkt_idx, int enc)
+{
+	unsigned char iv[12];
+	u_int32_t roc;
+	u_int16_t seq;
+	struct aead_request *req;
+	struct scatterlist sg;
+	unsigned int len;
+	int i, ret;
+
+	if (!c->aead || !c->aead_req)
+		return -1;
+	if (!enc && r->payload_len < 16)
+		return -1;
+
+	roc = htonl((pkt_idx & 0xffffffff0000ULL) >> 16);
+	seq = htons(pkt_idx & 0xffffULL);
+	iv[0] = iv[1] = 0;
+	memcpy(&iv[2], &r->header->ssrc, 4);
+	memcpy(&iv[6], &roc, 4);
+	memcpy(&iv[10], &seq, 2);
+	for (i = 0; i < 12; i++)
+		iv[i] ^= c->session_salt[i];
+
+	/* the packet is linear and the skb has enough tail room for the tag */
+	len = r->header_len + r->payload_len + (enc ? 16 : 0);
+	sg_init_one(&sg, r->header, len);
+
+	/* the per-CPU request can't be used by a softirq interrupting us */
+	local_bh_disable();
+	req = this_cpu_ptr(c->aead_req);
+
+	aead_request_set_callback(req, 0, NULL, NULL);
+	aead_request_set_ad(req, r->header_len);
+	aead_request_set_crypt(req, &sg, &sg, r->payload_len, iv);
+
+	ret = enc ? crypto_aead_encrypt(req) : crypto_aead_decrypt(req);
+
+	local_bh_enable();
+
+	if (ret)
+		return -1;
+
+	if (enc)
+		r->payload_len += 16;
+	else
+		r->payload_len -= 16;
+
+	return 0;
+}
+
+static int srtp_encrypt_aes_gcm(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtp_parsed *r,
+		u_int64_t pkt_idx)
+{
+	return srtp_crypt_aes_gcm(c, r, pkt_idx, 1);
+}
+
+static int srtp_decrypt_aes_gcm(struct re_crypto_context *c,
+		struct rtpengine_srtp *s, struct rtp_parsed *r,
+		u_int64_t pkt_idx)
+{
+	return srtp_crypt_aes_gcm(c, r, pkt_idx, 0);
+}
+
+
 static inline int srtp_encrypt(struct re_crypto_context *c,
 		struct rtpengine_srtp *s, struct rtp_parsed *r,
 		u_int64_t pkt_idx)
@@ -3877,128 +5046,252 @@ static inline int srtp_decrypt(struct re_crypto_context *c,
 	return c->cipher->decrypt(c, s, r, pkt_idx);
 }
 
-static inline int is_muxed_rtcp(struct rtp_parsed *r) {
-	if (r->header->m_pt < 194)
-		return 0;
-	if (r->header->m_pt > 223)
-		return 0;
-	return 1;
-}
+/* rfc 3711 section 4.1.1, with the SRTCP index in place of the packet index */
+static void srtcp_crypt_aes_cm(struct re_crypto_context *c, unsigned char *pkt, unsigned int len,
+		u_int32_t idx)
+{
+	unsigned char iv[16];
+	u_int32_t *ivi;
+	u_int32_t ssrc;
 
-static inline int is_dtls(struct sk_buff *skb) {
-	if (skb->len < 1)
-		return 0;
-	if (skb->data[0] < 20)
-		return 0;
-	if (skb->data[0] > 63)
-		return 0;
-	return 1;
-}
+	memcpy(&ssrc, pkt + 4, sizeof(ssrc));
+	memcpy(iv, c->session_salt, 14);
+	iv[14] = iv[15] = '\0';
+	ivi = (void *) iv;
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
-static int rtp_payload_match(const void *a, const void *b) {
-	const unsigned char *A = a, *B = b;
+	ivi[1] ^= ssrc;
+	ivi[2] ^= htonl(idx >> 16);
+	ivi[3] ^= htonl((idx & 0xffff) << 16);
 
-	if (*A < *B)
-		return -1;
-	if (*A > *B)
-		return 1;
-	return 0;
+	re_aes_ctr(c, pkt + 8, len - 8, iv);
 }
-#endif
 
-static inline int rtp_payload_type(const struct rtp_header *hdr, const struct rtpengine_target_info *tg) {
-	unsigned char pt;
-	const unsigned char *match;
-
-	pt = hdr->m_pt & 0x7f;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,0,0)
-	match = bsearch(&pt, tg->payload_types, tg->num_payload_types, sizeof(pt), rtp_payload_match);
-#else
-	for (match = tg->payload_types; match < tg->payload_types + tg->num_payload_types; match++) {
-		if (*match == pt)
-			goto found;
-	}
-	match = NULL;
-found:
-#endif
-	if (!match)
-		return -1;
-	return match - tg->payload_types;
-}
+/* rfc 3711 section 4.1.2.3 */
+static void srtcp_crypt_aes_f8(struct re_crypto_context *c, unsigned char *pkt, unsigned int len,
+		u_int32_t idx)
+{
+	unsigned char iv[16];
+	u_int32_t e_idx;
 
-static struct sk_buff *intercept_skb_copy(struct sk_buff *oskb, const struct re_address *src) {
-	struct sk_buff *ret;
-	struct udphdr *uh;
-	struct iphdr *ih;
-	struct ipv6hdr *ih6;
+	memset(iv, 0, 4);
+	e_idx = htonl(0x80000000UL | idx);
+	memcpy(&iv[4], &e_idx, 4);
+	memcpy(&iv[8], pkt, 8);
 
-	ret = skb_copy_expand(oskb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
-	if (!ret)
-		return NULL;
+	aes_f8(pkt + 8, len - 8, c->tfm[0], c->tfm[1], iv);
+}
 
-	// restore original header. it's still present in the copied skb, so we just need
-	// to push back our head room. the payload lengths might be wrong and must be fixed.
-	// checksums might also be wrong, but can be ignored.
+/* rfc 3711 section 3.4. leaves the plain RTCP packet in the skb */
+static int srtcp_decrypt(struct re_crypto_context *c, struct rtpengine_srtp *s, struct sk_buff *skb) {
+	unsigned char hmac[20];
+	unsigned int len = skb->len, tag_len = 0;
+	u_int32_t idx;
+	unsigned long flags;
 
-	// restore transport header
-	skb_push(ret, ret->data - skb_transport_header(ret));
-	uh = (void *) skb_transport_header(ret);
-	uh->len = htons(ret->len);
+	if (s->cipher == REC_NULL && s->hmac == REH_NULL)
+		return 0;
+	if (s->hmac != REH_NULL)
+		tag_len = s->rtcp_auth_tag_len;
 
-	// restore network header
-	skb_push(ret, ret->data - skb_network_header(ret));
+	if (len < 8 + sizeof(idx) + s->mki_len + tag_len)
+		return -1;
 
-	// restore network length field
-	switch (src->family) {
-		case AF_INET:
-			ih = (void *) skb_network_header(ret);
-			ih->tot_len = htons(ret->len);
-			break;
-		case AF_INET6:
-			ih6 = (void *) skb_network_header(ret);
-			ih6->payload_len = htons(ret->len - sizeof(*ih6));
-			break;
-		default:
-			kfree_skb(ret);
-			return NULL;
+	len -= tag_len;
+	if (tag_len) {
+		if (!c->shash)
+			return -1;
+		if (re_hmac_calc(hmac, c, skb->data, len - s->mki_len, NULL, 0))
+			return -1;
+		if (memcmp(skb->data + len, hmac, tag_len))
+			return -1;
 	}
 
-	return ret;
-}
-
+	len -= s->mki_len + sizeof(idx);
+	memcpy(&idx, skb->data + len, sizeof(idx));
+	idx = ntohl(idx);
 
+	if ((idx & 0x80000000UL) && c->cipher->rtcp_crypt)
+		c->cipher->rtcp_crypt(c, skb->data, len, idx & 0x7fffffffUL);
 
+	spin_lock_irqsave(&c->lock, flags);
+	s->rtcp_index = idx & 0x7fffffffUL;
+	spin_unlock_irqrestore(&c->lock, flags);
 
+	skb_trim(skb, len);
+	return 0;
+}
 
-static void rtp_stats(struct rtpengine_target *g, struct rtp_parsed *rtp, s64 arrival_time, int pt_idx) {
+static int srtcp_encrypt(struct re_crypto_context *c, struct rtpengine_srtp *s, struct sk_buff *skb) {
+	unsigned char hmac[20];
+	unsigned int auth_len;
+	unsigned char *p;
+	u_int32_t idx, e_idx;
 	unsigned long flags;
-	struct rtpengine_ssrc_stats *s = &g->ssrc_stats;
-	u_int16_t old_seq_trunc;
-	u_int32_t last_seq;
-	u_int16_t seq_diff;
-	u_int32_t clockrate;
-	u_int32_t transit;
-	int32_t d;
 
-	u_int16_t seq = ntohs(rtp->header->seq_num);
-	u_int32_t ts = ntohl(rtp->header->timestamp);
+	if (s->cipher == REC_NULL && s->hmac == REH_NULL)
+		return 0;
+	if (skb->len < 8)
+		return -1;
+	if (skb_tailroom(skb) < sizeof(e_idx) + s->mki_len + sizeof(hmac))
+		return -1;
 
-	spin_lock_irqsave(&g->ssrc_stats_lock, flags);
+	spin_lock_irqsave(&c->lock, flags);
+	idx = s->rtcp_index++ & 0x7fffffffUL;
+	spin_unlock_irqrestore(&c->lock, flags);
 
-	s->basic_stats.packets++;
-	s->basic_stats.bytes += rtp->payload_len;
-	s->timestamp = ts;
+	if (c->cipher->rtcp_crypt)
+		c->cipher->rtcp_crypt(c, skb->data, skb->len, idx);
 
-	// track sequence numbers and lost frames
+	e_idx = htonl(0x80000000UL | idx);
+	p = skb_put(skb, sizeof(e_idx));
+	memcpy(p, &e_idx, sizeof(e_idx));
+	auth_len = skb->len;
 
-	last_seq = s->ext_seq;
+	if (s->mki_len) {
+		p = skb_put(skb, s->mki_len);
+		memcpy(p, s->mki, s->mki_len);
+	}
 
-	// old seq or seq reset?
+	if (s->hmac != REH_NULL && s->rtcp_auth_tag_len) {
+		if (!c->shash)
+			return -1;
+		if (re_hmac_calc(hmac, c, skb->data, auth_len, NULL, 0))
+			return -1;
+		p = skb_put(skb, s->rtcp_auth_tag_len);
+		memcpy(p, hmac, s->rtcp_auth_tag_len);
+	}
+
+	return 0;
+}
+
+static void rtp_xcode(struct rtp_parsed *r, const unsigned char *table) {
+	unsigned int len = r->payload_len;
+	unsigned int i;
+
+	/* leave RTP padding alone */
+	if ((r->header->v_p_x_cc & 0x20) && len && r->payload[len - 1] <= len)
+		len -= r->payload[len - 1];
+
+	for (i = 0; i < len; i++)
+		r->payload[i] = table[r->payload[i]];
+}
+
+static inline int rtp_payload_type(const struct rtp_header *hdr, const struct rtpengine_target *g) {
+	unsigned char idx = g->pt_index[hdr->m_pt & 0x7f];
+
+	if (idx == PT_INDEX_NONE)
+		return -1;
+	return idx;
+}
+
+// with junk_filter set, a packet not coming from the expected source must at least look
+// like something the daemon would accept: DTLS if enabled, STUN (handled before), or
+// RTP/RTCP version 2 and, for RTP, one of the target's payload types. anything else is
+// dropped right here instead of being passed to userspace or forwarded
+static int is_junk(struct sk_buff *skb, struct rtpengine_target *g, const struct re_address *src,
+		const struct re_demux *d)
+{
+	if (!g->target.junk_filter)
+		return 0;
+	if (!memcmp(&g->target.expected_src, src, sizeof(*src)))
+		return 0;
+	if (g->target.dtls && (d->cls & RE_DEMUX_DTLS))
+		return 0;
+	if ((d->cls & RE_DEMUX_RTCP))
+		return 0;
+	if (!(d->cls & RE_DEMUX_RTP))
+		return 1;
+	if (g->target.num_payload_types && rtp_payload_type((void *) skb->data, g) < 0)
+		return 1;
+	return 0;
+}
+
+// copies the packet including its original network and transport headers into the
+// stream's ring. the payload lengths might be wrong in the headers and must be fixed.
+// checksums might also be wrong, but can be ignored.
+static void intercept_stream_packet(struct re_stream *stream, struct sk_buff *skb,
+		const struct re_address *src)
+{
+	struct rtpengine_stream_slot *slot;
+	unsigned long flags;
+	unsigned int hdr_len, th_off, len;
+	struct udphdr *uh;
+	struct iphdr *ih;
+	struct ipv6hdr *ih6;
+
+	if (src->family != AF_INET && src->family != AF_INET6)
+		return;
+
+	// headers are still present in front of the UDP payload
+	hdr_len = skb->data - skb_network_header(skb);
+	th_off = skb_transport_header(skb) - skb_network_header(skb);
+	len = hdr_len + skb->len;
+
+	slot = stream_ring_reserve(stream, len, &flags);
+	if (!slot)
+		return;
+
+	memcpy(slot->data, skb_network_header(skb), hdr_len);
+	if (skb_copy_bits(skb, 0, slot->data + hdr_len, skb->len)) {
+		spin_unlock_irqrestore(&stream->ring_lock, flags);
+		return;
+	}
+
+	// restore transport and network length fields
+	uh = (void *) (slot->data + th_off);
+	uh->len = htons(len - th_off);
+
+	switch (src->family) {
+		case AF_INET:
+			ih = (void *) slot->data;
+			ih->tot_len = htons(len);
+			break;
+		case AF_INET6:
+			ih6 = (void *) slot->data;
+			ih6->payload_len = htons(len - sizeof(*ih6));
+			break;
+	}
+
+	stream_ring_commit(stream, slot, len, flags);
+}
+
+
+
+
+
+static void rtp_stats(struct rtpengine_target *g, struct rtp_parsed *rtp, s64 arrival_time, int pt_idx) {
+	unsigned long flags;
+	struct rtpengine_ssrc_stats *s = &g->ssrc_stats;
+	u_int16_t old_seq_trunc;
+	u_int32_t last_seq;
+	u_int16_t seq_diff;
+	u_int32_t clockrate;
+	u_int32_t transit;
+	int32_t d;
+
+	u_int16_t seq = ntohs(rtp->header->seq_num);
+	u_int32_t ts = ntohl(rtp->header->timestamp);
+
+	spin_lock_irqsave(&g->ssrc_stats_lock, flags);
+
+	s->basic_stats.packets++;
+	s->basic_stats.bytes += rtp->payload_len;
+	s->timestamp = ts;
+
+	// track sequence numbers and lost frames
+
+	last_seq = s->ext_seq;
+
+	// old seq or seq reset?
 	old_seq_trunc = last_seq & 0xffff;
 	seq_diff = seq - old_seq_trunc;
-	if (seq_diff == 0 || seq_diff >= 0xfeff) // old/dup seq - ignore
-		;
+	if (seq_diff == 0 || seq_diff >= 0xfeff) { // old/dup seq
+		// a late arrival if it's still within the loss window and not a duplicate
+		old_seq_trunc -= seq;
+		if (old_seq_trunc && old_seq_trunc < (sizeof(s->lost_bits) * 8)
+				&& !(s->lost_bits & (1U << old_seq_trunc)))
+			s->reordered++;
+	}
 	else if (seq_diff > 0x100) {
 		// reset seq and loss tracker
 		s->ext_seq = seq;
@@ -4049,9 +5342,333 @@ static void rtp_stats(struct rtpengine_target *g, struct rtp_parsed *rtp, s64 ar
 		d = -d;
 	s->jitter += d - ((s->jitter + 8) >> 4);
 
+	ssrc_stats_publish(g);
+
+	spin_unlock_irqrestore(&g->ssrc_stats_lock, flags);
+}
+
+
+/* RFC 4733 */
+struct telephone_event {
+	unsigned char			event;
+	unsigned char			end_vol; /* E:1 R:1 volume:6 */
+	u_int16_t			duration;
+} __attribute__ ((packed));
+
+/* packets are forwarded as usual, only a compact record goes to userspace */
+static void queue_dtmf_event(struct rtpengine_table *t, struct rtpengine_target *g, struct rtp_parsed *rtp,
+		const struct re_address *src, int pt_idx)
+{
+	struct telephone_event *te;
+	struct rtpengine_dtmf_event *e;
+	unsigned long flags;
+	u_int32_t ts;
+	int state;
+
+	if (rtp->payload_len < sizeof(*te))
+		return;
+	te = (void *) rtp->payload;
+	ts = ntohl(rtp->header->timestamp);
+	state = (te->end_vol & 0x80) ? 2 : 1;
+
+	spin_lock_irqsave(&g->ssrc_stats_lock, flags);
+	if (g->dtmf_ts == ts && g->dtmf_state >= state) {
+		spin_unlock_irqrestore(&g->ssrc_stats_lock, flags);
+		return;
+	}
+	g->dtmf_ts = ts;
+	g->dtmf_state = state;
 	spin_unlock_irqrestore(&g->ssrc_stats_lock, flags);
+
+	spin_lock_irqsave(&t->dtmf_lock, flags);
+	if (t->dtmf_head - t->dtmf_tail >= RTPENGINE_DTMF_RING) {
+		t->dtmf_dropped++;
+		spin_unlock_irqrestore(&t->dtmf_lock, flags);
+		return;
+	}
+	e = &t->dtmf_ring[t->dtmf_head % RTPENGINE_DTMF_RING];
+	memset(e, 0, sizeof(*e));
+	e->local = g->target.local;
+	e->src = *src;
+	e->ssrc = ntohl(rtp->header->ssrc);
+	e->timestamp = ts;
+	e->clock_rate = g->target.clock_rates[pt_idx];
+	e->duration = ntohs(te->duration);
+	e->event = te->event;
+	e->volume = te->end_vol & 0x3f;
+	e->end = state == 2;
+	t->dtmf_head++;
+	spin_unlock_irqrestore(&t->dtmf_lock, flags);
+
+	wake_up_interruptible(&t->dtmf_wq);
+}
+
+
+#define STUN_COOKIE			0x2112A442UL
+#define STUN_CRC_XOR			0x5354554eUL
+
+#define STUN_BINDING_REQUEST		0x0001
+#define STUN_BINDING_SUCCESS_RESPONSE	0x0101
+
+#define STUN_USERNAME			0x0006
+#define STUN_MESSAGE_INTEGRITY		0x0008
+#define STUN_XOR_MAPPED_ADDRESS		0x0020
+#define STUN_PRIORITY			0x0024
+#define STUN_USE_CANDIDATE		0x0025
+#define STUN_FINGERPRINT		0x8028
+#define STUN_ICE_CONTROLLED		0x8029
+#define STUN_ICE_CONTROLLING		0x802a
+
+struct stun_header {
+	u_int16_t			msg_type;
+	u_int16_t			msg_len;
+	u_int32_t			cookie;
+	u_int32_t			transaction[3];
+} __attribute__ ((packed));
+
+struct stun_tlv {
+	u_int16_t			type;
+	u_int16_t			len;
+} __attribute__ ((packed));
+
+/* HMAC over the first `len` bytes of the message in `buf`, with `hdr` used in place of its
+ * header. lets the header be adjusted without touching the packet itself */
+static int stun_hmac(unsigned char *digest, struct rtpengine_target *g, const struct stun_header *hdr,
+		const unsigned char *buf, unsigned int len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0)
+	SHASH_DESC_ON_STACK(dsc, g->ice_shash);
+#else
+	struct shash_desc *dsc;
+	size_t alloc_size;
+
+	alloc_size = sizeof(*dsc) + crypto_shash_descsize(g->ice_shash);
+	dsc = kmalloc(alloc_size, GFP_ATOMIC);
+	if (!dsc)
+		return -1;
+	memset(dsc, 0, alloc_size);
+#endif
+
+	dsc->tfm = g->ice_shash;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,18,0) && LINUX_VERSION_CODE < KERNEL_VERSION(5,1,0)
+	dsc->flags = 0;
+#endif
+
+	if (crypto_shash_init(dsc))
+		goto error;
+	crypto_shash_update(dsc, (const void *) hdr, sizeof(*hdr));
+	crypto_shash_update(dsc, buf + sizeof(*hdr), len - sizeof(*hdr));
+	crypto_shash_final(dsc, digest);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0)
+	kfree(dsc);
+#endif
+	return 0;
+
+error:
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,18,0)
+	kfree(dsc);
+#endif
+	return -1;
+}
+
+static inline u_int32_t stun_crc(const unsigned char *buf, unsigned int len) {
+	/* same as zlib's crc32() */
+	return (crc32_le(~0, buf, len) ^ ~0) ^ STUN_CRC_XOR;
+}
+
+/* Answers a binding request (i.e. ICE consent freshness) from the established candidate pair.
+ * Anything that needs the ICE state machine, or that doesn't look exactly as expected, is left
+ * to userspace. Returns 0 if the skb was consumed, -1 otherwise. The packet is already known
+ * to be STUN with a trailing FINGERPRINT. */
+static int stun_responder(struct sk_buff *skb, struct rtpengine_target *g, struct re_address *src,
+		const struct xt_action_param *par)
+{
+	struct stun_header *hdr, mi_hdr;
+	struct stun_tlv *tlv;
+	unsigned char *buf = skb->data;
+	unsigned int len = skb->len, pos, attr_len = 0, mi_pos = 0, resp_len;
+	unsigned char *username = NULL;
+	unsigned int username_len = 0;
+	int controlling = 0, controlled = 0, err;
+	u_int32_t transaction[3];
+	unsigned char digest[20];
+	u_int16_t *u16;
+	u_int32_t *u32;
+
+	if (!g->ice_shash)
+		return -1;
+	if (memcmp(&g->target.expected_src, src, sizeof(*src)))
+		return -1;
+
+	hdr = (void *) buf;
+	if (hdr->msg_type != htons(STUN_BINDING_REQUEST))
+		return -1;
+	if (ntohs(hdr->msg_len) + sizeof(*hdr) != len)
+		return -1;
+
+	u32 = (void *) &buf[len - 4];
+	if (stun_crc(buf, len - 8) != ntohl(*u32))
+		return -1;
+
+	for (pos = sizeof(*hdr); pos < len - 8; pos += sizeof(*tlv) + ((attr_len + 3) & ~3U)) {
+		/* only FINGERPRINT may follow MESSAGE-INTEGRITY */
+		if (mi_pos)
+			return -1;
+		if (pos + sizeof(*tlv) > len - 8)
+			return -1;
+		tlv = (void *) &buf[pos];
+		attr_len = ntohs(tlv->len);
+		if (pos + sizeof(*tlv) + ((attr_len + 3) & ~3U) > len - 8)
+			return -1;
+
+		switch (ntohs(tlv->type)) {
+			case STUN_USERNAME:
+				username = &buf[pos + sizeof(*tlv)];
+				username_len = attr_len;
+				break;
+			case STUN_MESSAGE_INTEGRITY:
+				if (attr_len != 20)
+					return -1;
+				mi_pos = pos;
+				break;
+			case STUN_ICE_CONTROLLING:
+				controlling = 1;
+				break;
+			case STUN_ICE_CONTROLLED:
+				controlled = 1;
+				break;
+			case STUN_PRIORITY:
+			case STUN_USE_CANDIDATE:
+				break;
+			default:
+				/* comprehension required, userspace sends the error response */
+				if (!(ntohs(tlv->type) & 0x8000))
+					return -1;
+				break;
+		}
+	}
+	if (pos != len - 8)
+		return -1;
+	if (!mi_pos)
+		return -1;
+
+	/* USERNAME is "local:remote" */
+	if (username_len <= g->target.ice.ufrag_len)
+		return -1;
+	if (username[g->target.ice.ufrag_len] != ':')
+		return -1;
+	if (memcmp(username, g->target.ice.ufrag, g->target.ice.ufrag_len))
+		return -1;
+
+	if (controlling && g->target.ice_controlling)
+		return -1;
+	if (controlled && g->target.ice_controlled)
+		return -1;
+
+	/* the length used for MESSAGE-INTEGRITY excludes FINGERPRINT. it goes into a copy of the
+	 * header, so that the skb stays untouched unless the request checks out */
+	mi_hdr = *hdr;
+	mi_hdr.msg_len = htons(mi_pos + sizeof(*tlv) + 20 - sizeof(*hdr));
+	if (stun_hmac(digest, g, &mi_hdr, buf, mi_pos))
+		return -1;
+	if (memcmp(digest, &buf[mi_pos + sizeof(*tlv)], 20))
+		return -1;
+
+	/* from here on, the skb is ours to modify */
+
+	/* build the response in place: header, XOR-MAPPED-ADDRESS, MESSAGE-INTEGRITY, FINGERPRINT */
+	resp_len = sizeof(*hdr) + sizeof(*tlv) + (src->family == AF_INET ? 8 : 20)
+		+ sizeof(*tlv) + 20 + sizeof(*tlv) + 4;
+	if (skb->len + skb_tailroom(skb) < resp_len)
+		return -1;
+
+	memcpy(transaction, hdr->transaction, sizeof(transaction));
+	skb_trim(skb, 0);
+	buf = (void *) skb_put(skb, resp_len);
+
+	hdr = (void *) buf;
+	hdr->msg_type = htons(STUN_BINDING_SUCCESS_RESPONSE);
+	hdr->cookie = htonl(STUN_COOKIE);
+	memcpy(hdr->transaction, transaction, sizeof(transaction));
+	pos = sizeof(*hdr);
+
+	tlv = (void *) &buf[pos];
+	tlv->type = htons(STUN_XOR_MAPPED_ADDRESS);
+	u16 = (void *) &buf[pos + sizeof(*tlv)];
+	u32 = (void *) &buf[pos + sizeof(*tlv) + 4];
+	u16[1] = htons(src->port ^ (STUN_COOKIE >> 16));
+	if (src->family == AF_INET) {
+		tlv->len = htons(8);
+		u16[0] = htons(0x01);
+		u32[0] = src->u.ipv4 ^ htonl(STUN_COOKIE);
+	}
+	else {
+		tlv->len = htons(20);
+		u16[0] = htons(0x02);
+		u32[0] = src->u.u32[0] ^ htonl(STUN_COOKIE);
+		u32[1] = src->u.u32[1] ^ transaction[0];
+		u32[2] = src->u.u32[2] ^ transaction[1];
+		u32[3] = src->u.u32[3] ^ transaction[2];
+	}
+	pos += sizeof(*tlv) + ntohs(tlv->len);
+
+	tlv = (void *) &buf[pos];
+	tlv->type = htons(STUN_MESSAGE_INTEGRITY);
+	tlv->len = htons(20);
+	hdr->msg_len = htons(pos + sizeof(*tlv) + 20 - sizeof(*hdr));
+	if (stun_hmac(&buf[pos + sizeof(*tlv)], g, hdr, buf, pos))
+		return -1;
+	pos += sizeof(*tlv) + 20;
+
+	tlv = (void *) &buf[pos];
+	tlv->type = htons(STUN_FINGERPRINT);
+	tlv->len = htons(4);
+	hdr->msg_len = htons(resp_len - sizeof(*hdr));
+	u32 = (void *) &buf[pos + sizeof(*tlv)];
+	*u32 = htonl(stun_crc(buf, pos));
+
+	err = send_proxy_packet(skb, &g->target.local, src, g->target.tos, par);
+	if (err)
+		this_cpu_inc(g->pcpu_stats->errors);
+
+	return 0;
 }
 
+/* sends a copy of the decrypted packet in skb to an additional output */
+static void forward_output(struct rtpengine_target *g, struct re_output *o, struct sk_buff *skb,
+		const struct re_demux *d, int rtp_pt_idx, const struct xt_action_param *par)
+{
+	struct sk_buff *skb2;
+	struct rtp_parsed rtp;
+	u_int64_t pkt_idx;
+	int err;
+
+	skb2 = skb_copy_expand(skb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
+	if (!skb2) {
+		this_cpu_inc(g->pcpu_stats->errors);
+		return;
+	}
+
+	rtp.ok = 0;
+	if (d)
+		parse_rtp(&rtp, skb2, d);
+	if (rtp.ok) {
+		if (o->output.ssrc_out)
+			rtp.header->ssrc = o->output.ssrc_out;
+		if (o->output.pt_rewrite && rtp_pt_idx >= 0)
+			rtp.header->m_pt = (rtp.header->m_pt & 0x80) | o->output.pt_output[rtp_pt_idx];
+
+		pkt_idx = packet_index(&o->encrypt, &o->output.encrypt, rtp.header);
+		srtp_encrypt(&o->encrypt, &o->output.encrypt, &rtp, pkt_idx);
+		srtp_authenticate(&o->encrypt, &o->output.encrypt, &rtp, pkt_idx);
+		skb_put(skb2, rtp.header_len + rtp.payload_len - skb2->len);
+	}
+
+	err = send_proxy_packet(skb2, &o->output.src_addr, &o->output.dst_addr, o->output.tos, par);
+	if (err)
+		this_cpu_inc(g->pcpu_stats->errors);
+}
 
 static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t, struct re_address *src,
 		struct re_address *dst, u_int8_t in_tos, const struct xt_action_param *par)
@@ -4061,17 +5678,19 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 	struct sk_buff *skb2;
 	int err;
 	int error_nf_action = XT_CONTINUE;
+	int rtcp_nf_action;
 	int rtp_pt_idx = -2;
+	unsigned int i, num_outputs;
 	unsigned int datalen;
 	u_int32_t *u32;
 	struct rtp_parsed rtp;
+	struct re_demux demux;
 	u_int64_t pkt_idx;
 	struct re_stream *stream;
-	struct re_stream_packet *packet;
 	const char *errstr = NULL;
 
 #if (RE_HAS_MEASUREDELAY)
-	u_int64_t starttime, endtime, delay;
+	u_int64_t starttime, endtime, delay, delay_packets;
 #endif
 
 	skb_reset_transport_header(skb);
@@ -4093,11 +5712,21 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 		goto skip2;
 
 	DBG("target found, src "MIPF" -> dst "MIPF"\n", MIPP(g->target.src_addr), MIPP(g->target.dst_addr));
+
+#if (RE_HAS_FASTPATH)
+	/* already seen in PREROUTING. only packets that were handed back to the stack get here */
+	if (g->fastpath && par->state->hook != NF_INET_PRE_ROUTING)
+		goto skip1;
+#endif
 	DBG("target decrypt hmac and cipher are %s and %s", g->decrypt.hmac->name,
 			g->decrypt.cipher->name);
 
+	re_demux(&demux, skb->data, skb->len);
+
 	if (!g->target.stun)
 		goto not_stun;
+	if (!(demux.cls & RE_DEMUX_STUN))
+		goto not_stun;
 	if (datalen < 28)
 		goto not_stun;
 	if ((datalen & 0x3))
@@ -4111,10 +5740,23 @@ static unsigned int rtpengine46(struct sk_buff *skb, struct rtpengine_table *t,
 	if (u32[0] != htonl(0x80280004UL)) /* required fingerprint attribute */
 		goto not_stun;
 
-	/* probably stun, pass to application */
+	/* probably stun. answer it if we can, otherwise pass to application */
+	if (g->target.ice.pwd_len && !stun_responder(skb, g, src, par)) {
+		target_put(g);
+		table_put(t);
+		return NF_DROP;
+	}
 	goto skip1;
 
 not_stun:
+	if (unlikely(is_junk(skb, g, src, &demux))) {
+		this_cpu_inc(g->pcpu_stats->junk);
+		trace_rtpengine_skip(g->target.local.port, "junk");
+		error_nf_action = NF_DROP;
+		target_put(g);
+		goto skip2;
+	}
+
 	if (g->target.src_mismatch == MSM_IGNORE)
 		goto src_check_ok;
 	if (!memcmp(&g->target.expected_src, src, sizeof(*src)))
@@ -4129,24 +5771,28 @@ not_stun:
 src_check_ok:
 	if (g->target.non_forwarding)
 		goto skip1;
-	if (g->target.dtls && is_dtls(skb))
+	if (g->target.dtls && (demux.cls & RE_DEMUX_DTLS))
+		goto skip1;
+	if (g->target.rtcp_fw && (g->target.rtcp || g->target.rtcp_mux) && (demux.cls & RE_DEMUX_RTCP))
+		goto do_rtcp;
+	if (g->target.rtcp)
 		goto skip1;
 
 	rtp.ok = 0;
 	if (!g->target.rtp)
 		goto not_rtp;
 
-	parse_rtp(&rtp, skb);
+	parse_rtp(&rtp, skb, &demux);
 	if (!rtp.ok) {
 		if (g->target.rtp_only)
 			goto skip1;
 		goto not_rtp;
 	}
 
-	if (g->target.rtcp_mux && is_muxed_rtcp(&rtp))
+	if (g->target.rtcp_mux && (demux.cls & RE_DEMUX_RTCP))
 		goto skip1;
 
-	rtp_pt_idx = rtp_payload_type(rtp.header, &g->target);
+	rtp_pt_idx = rtp_payload_type(rtp.header, g);
 
 	// Pass to userspace if SSRC has changed.
 	errstr = "SSRC mismatch";
@@ -4154,6 +5800,12 @@ src_check_ok:
 		goto skip_error;
 
 	pkt_idx = packet_index(&g->decrypt, &g->target.decrypt, rtp.header);
+	/* userspace would drop it as well */
+	errstr = "SRTP packet replayed or too old";
+	if (unlikely(srtp_replay_check(&g->decrypt, &g->target.decrypt, pkt_idx))) {
+		error_nf_action = NF_DROP;
+		goto skip_error;
+	}
 	errstr = "SRTP authentication tag mismatch";
 	if (srtp_auth_validate(&g->decrypt, &g->target.decrypt, &rtp, &pkt_idx))
 		goto skip_error;
@@ -4165,11 +5817,14 @@ src_check_ok:
 	errstr = "SRTP decryption failed";
 	if (srtp_decrypt(&g->decrypt, &g->target.decrypt, &rtp, pkt_idx))
 		goto skip_error;
+	srtp_replay_add(&g->decrypt, &g->target.decrypt, pkt_idx);
 
 	skb_trim(skb, rtp.header_len + rtp.payload_len);
 
 	if (g->target.rtp_stats)
 		rtp_stats(g, &rtp, ktime_to_us(skb->tstamp), rtp_pt_idx);
+	if (rtp_pt_idx >= 0 && (g->target.dtmf_mask & (1U << rtp_pt_idx)))
+		queue_dtmf_event(t, g, &rtp, src, rtp_pt_idx);
 
 	DBG("packet payload decrypted as %02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x...\n",
 			rtp.payload[0], rtp.payload[1], rtp.payload[2], rtp.payload[3],
@@ -4185,7 +5840,7 @@ not_rtp:
 		err = send_proxy_packet(skb2, &g->target.src_addr, &g->target.mirror_addr, g->target.tos,
 				par);
 		if (err)
-			atomic64_inc(&g->stats.errors);
+			this_cpu_inc(g->pcpu_stats->errors);
 	}
 
 	if (g->target.do_intercept) {
@@ -4193,48 +5848,54 @@ not_rtp:
 		stream = get_stream_lock(NULL, g->target.intercept_stream_idx);
 		if (!stream)
 			goto no_intercept;
-		packet = kzalloc(sizeof(*packet), GFP_ATOMIC);
-		if (!packet)
-			goto intercept_done;
-		packet->skbuf = intercept_skb_copy(skb, src);
-		if (!packet->skbuf)
-			goto no_intercept_free;
-		add_stream_packet(stream, packet);
-		goto intercept_done;
-
-no_intercept_free:
-		free_packet(packet);
-intercept_done:
+		intercept_stream_packet(stream, skb, src);
 		stream_put(stream);
 	}
 
 no_intercept:
+	/* the outputs need the packet before the primary rewrites and encryption */
+	num_outputs = smp_load_acquire(&g->num_outputs);
+	for (i = 0; i < num_outputs; i++)
+		forward_output(g, &g->outputs[i], skb, rtp.ok ? &demux : NULL, rtp_pt_idx, par);
+
 	if (rtp.ok) {
-		// SSRC substitution
+		if (rtp_pt_idx >= 0) {
+			if (g->target.xcode[rtp_pt_idx])
+				rtp_xcode(&rtp, re_xcode_tables[g->target.xcode[rtp_pt_idx]]);
+			if (g->target.pt_rewrite)
+				rtp.header->m_pt = (rtp.header->m_pt & 0x80) | g->target.pt_output[rtp_pt_idx];
+		}
+
+		// SSRC and sequence number substitution
 		if (g->target.transcoding && g->target.ssrc_out)
 			rtp.header->ssrc = g->target.ssrc_out;
+		if (g->target.transcoding && g->target.seq_diff)
+			rtp.header->seq_num = htons(ntohs(rtp.header->seq_num) + g->target.seq_diff);
 
 		pkt_idx = packet_index(&g->encrypt, &g->target.encrypt, rtp.header);
 		srtp_encrypt(&g->encrypt, &g->target.encrypt, &rtp, pkt_idx);
-		skb_put(skb, g->target.encrypt.mki_len + g->target.encrypt.auth_tag_len);
 		srtp_authenticate(&g->encrypt, &g->target.encrypt, &rtp, pkt_idx);
+		/* AEAD tag, MKI and auth tag were written into the tail room */
+		skb_put(skb, rtp.header_len + rtp.payload_len - skb->len);
 	}
 
 	err = send_proxy_packet(skb, &g->target.src_addr, &g->target.dst_addr, g->target.tos, par);
+	trace_rtpengine_forward(g->target.local.port, datalen, rtp_pt_idx, err);
 
-	if (atomic64_read(&g->stats.packets)==0)
+	if (unlikely(!atomic_read(&g->stats.have_in_tos))
+			&& !atomic_cmpxchg(&g->stats.have_in_tos, 0, 1))
 		atomic_set(&g->stats.in_tos,in_tos);
 
 	if (err)
-		atomic64_inc(&g->stats.errors);
+		this_cpu_inc(g->pcpu_stats->errors);
 	else {
-		atomic64_inc(&g->stats.packets);
-		atomic64_add(datalen, &g->stats.bytes);
+		this_cpu_inc(g->pcpu_stats->packets);
+		this_cpu_add(g->pcpu_stats->bytes, datalen);
 	}
 
 	if (rtp_pt_idx >= 0) {
-		atomic64_inc(&g->rtp_stats[rtp_pt_idx].packets);
-		atomic64_add(datalen, &g->rtp_stats[rtp_pt_idx].bytes);
+		this_cpu_inc(g->pcpu_stats->rtp_stats[rtp_pt_idx].packets);
+		this_cpu_add(g->pcpu_stats->rtp_stats[rtp_pt_idx].bytes, datalen);
 
 #if (RE_HAS_MEASUREDELAY)
 		starttime = ktime_to_ns(skb->tstamp);
@@ -4243,7 +5904,8 @@ no_intercept:
 		delay = endtime - starttime;
 
 		/* XXX needs locking - not atomic */
-		if (atomic64_read(&g->stats.packets)==1) {
+		delay_packets = atomic64_inc_return(&g->stats.delay_packets);
+		if (delay_packets==1) {
 			g->stats.delay_min=delay;
 			g->stats.delay_avg=delay;
 			g->stats.delay_max=delay;
@@ -4255,26 +5917,58 @@ no_intercept:
 				g->stats.delay_max = delay;
 			}
 
-			g->stats.delay_avg = g->stats.delay_avg * (atomic64_read(&g->stats.packets)-1);
+			g->stats.delay_avg = g->stats.delay_avg * (delay_packets-1);
 			g->stats.delay_avg = g->stats.delay_avg + delay;
-			g->stats.delay_avg = g->stats.delay_avg / atomic64_read(&g->stats.packets);
+			g->stats.delay_avg = g->stats.delay_avg / delay_packets;
 		}
 #endif
 	}
 	else if (rtp_pt_idx == -2)
 		/* not RTP */ ;
 	else if (rtp_pt_idx == -1)
-		atomic64_inc(&g->stats.errors);
+		this_cpu_inc(g->pcpu_stats->errors);
 
 	target_put(g);
 	table_put(t);
 
 	return NF_DROP;
 
+do_rtcp:
+	errstr = "SRTCP authentication or decryption failed";
+	if (srtcp_decrypt(&g->rtcp_decrypt, &g->target.decrypt, skb))
+		goto skip_error;
+	errstr = "SRTCP encryption failed";
+	if (srtcp_encrypt(&g->rtcp_encrypt, &g->target.encrypt, skb))
+		goto skip_error;
+
+	/* the original packet goes on to the socket, where userspace only looks at it */
+	rtcp_nf_action = NF_DROP;
+	if (g->target.rtcp_sample
+			&& !(atomic_inc_return(&g->rtcp_count) % g->target.rtcp_sample))
+		rtcp_nf_action = XT_CONTINUE;
+
+	err = send_proxy_packet(skb, &g->target.src_addr, &g->target.dst_addr, g->target.tos, par);
+	trace_rtpengine_forward(g->target.local.port, datalen, -2, err);
+	if (err)
+		this_cpu_inc(g->pcpu_stats->errors);
+	else {
+		this_cpu_inc(g->pcpu_stats->packets);
+		this_cpu_add(g->pcpu_stats->bytes, datalen);
+	}
+
+	target_put(g);
+	table_put(t);
+
+	return rtcp_nf_action;
+
 skip_error:
 	log_err("x_tables action failed: %s", errstr);
-	atomic64_inc(&g->stats.errors);
+	this_cpu_inc(g->pcpu_stats->errors);
+	trace_rtpengine_skip(g->target.local.port, errstr);
+	target_put(g);
+	goto skip2;
 skip1:
+	trace_rtpengine_skip(g->target.local.port, NULL);
 	target_put(g);
 skip2:
 	kfree_skb(skb);
@@ -4371,6 +6065,139 @@ skip:
 
 
 
+#if (RE_HAS_FASTPATH)
+
+/* peeks at the UDP header of the original packet, so that packets for other targets
+ * can be passed on without making a copy. rtpengine46() repeats the lookup */
+static int fastpath_target(struct rtpengine_table *t, struct re_address *dst, struct sk_buff *skb,
+		unsigned int thoff)
+{
+	struct udphdr _uh, *uh;
+	struct rtpengine_target *g;
+	int ret;
+
+	uh = skb_header_pointer(skb, thoff, sizeof(_uh), &_uh);
+	if (!uh)
+		return 0;
+	dst->port = ntohs(uh->dest);
+
+	g = get_target(t, dst);
+	if (!g)
+		return 0;
+	ret = g->fastpath;
+	target_put(g);
+	return ret;
+}
+
+static unsigned int rtpengine_fastpath4(void *priv, struct sk_buff *oskb, const struct nf_hook_state *state) {
+	struct xt_action_param par = { .state = state };
+	struct sk_buff *skb;
+	struct iphdr *ih;
+	struct rtpengine_table *t;
+	struct re_address src, dst;
+
+	ih = ip_hdr(oskb);
+	if (ih->protocol != IPPROTO_UDP)
+		return NF_ACCEPT;
+	if (ip_is_fragment(ih))
+		return NF_ACCEPT;
+
+	t = get_table(fastpath_table);
+	if (!t)
+		return NF_ACCEPT;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.family = AF_INET;
+	dst.u.ipv4 = ih->daddr;
+	if (!fastpath_target(t, &dst, oskb, ih->ihl << 2))
+		goto skip;
+
+	skb = skb_copy_expand(oskb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
+	if (!skb)
+		goto skip;
+
+	skb_reset_network_header(skb);
+	ih = ip_hdr(skb);
+	skb_pull(skb, (ih->ihl << 2));
+
+	memset(&src, 0, sizeof(src));
+	src.family = AF_INET;
+	src.u.ipv4 = ih->saddr;
+
+	if (rtpengine46(skb, t, &src, &dst, (u_int8_t)ih->tos, &par) == NF_DROP)
+		return NF_DROP;
+	return NF_ACCEPT;
+
+skip:
+	table_put(t);
+	return NF_ACCEPT;
+}
+
+static unsigned int rtpengine_fastpath6(void *priv, struct sk_buff *oskb, const struct nf_hook_state *state) {
+	struct xt_action_param par = { .state = state };
+	struct sk_buff *skb;
+	struct ipv6hdr *ih;
+	struct rtpengine_table *t;
+	struct re_address src, dst;
+
+	/* extension headers (including fragments) are left to the xt path */
+	ih = ipv6_hdr(oskb);
+	if (ih->nexthdr != IPPROTO_UDP)
+		return NF_ACCEPT;
+
+	t = get_table(fastpath_table);
+	if (!t)
+		return NF_ACCEPT;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.family = AF_INET6;
+	memcpy(&dst.u.ipv6, &ih->daddr, sizeof(dst.u.ipv6));
+	if (!fastpath_target(t, &dst, oskb, sizeof(*ih)))
+		goto skip;
+
+	skb = skb_copy_expand(oskb, MAX_HEADER, MAX_SKB_TAIL_ROOM, GFP_ATOMIC);
+	if (!skb)
+		goto skip;
+
+	skb_reset_network_header(skb);
+	ih = ipv6_hdr(skb);
+	skb_pull(skb, sizeof(*ih));
+
+	memset(&src, 0, sizeof(src));
+	src.family = AF_INET6;
+	memcpy(&src.u.ipv6, &ih->saddr, sizeof(src.u.ipv6));
+
+	if (rtpengine46(skb, t, &src, &dst, ipv6_get_dsfield(ih), &par) == NF_DROP)
+		return NF_DROP;
+	return NF_ACCEPT;
+
+skip:
+	table_put(t);
+	return NF_ACCEPT;
+}
+
+/* after defragmentation, but ahead of the raw table and connection tracking */
+static const struct nf_hook_ops rtpengine_fastpath_ops[] = {
+	{
+		.hook		= rtpengine_fastpath4,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_PRE_ROUTING,
+		.priority	= NF_IP_PRI_CONNTRACK_DEFRAG + 1,
+	},
+	{
+		.hook		= rtpengine_fastpath6,
+		.pf		= NFPROTO_IPV6,
+		.hooknum	= NF_INET_PRE_ROUTING,
+		.priority	= NF_IP6_PRI_CONNTRACK_DEFRAG + 1,
+	},
+};
+
+#endif
+
+
+
+
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
 #define CHECK_ERR false
 #define CHECK_SCC true
@@ -4420,6 +6247,102 @@ static struct xt_target xt_rtpengine_regs[] = {
 	},
 };
 
+/* encrypts and authenticates a fixed number of RTCP-sized buffers with each cipher suite, using
+ * random keys, and reports the throughput. runs when the file is read, so it's only readable
+ * by root */
+#define CRYPTO_BENCH_PACKETS 10000
+#define CRYPTO_BENCH_LEN 172 /* 20 ms of G.711 plus RTP header */
+
+static void crypto_bench_suite(struct seq_file *f, unsigned char *buf, enum rtpengine_cipher cipher,
+		unsigned int key_len, enum rtpengine_hmac hmac)
+{
+	struct rtpengine_srtp s;
+	struct re_crypto_context c;
+	unsigned char tag[20];
+	const char *impl = "-";
+	u64 start, ns;
+	unsigned int i;
+
+	memset(&s, 0, sizeof(s));
+	memset(&c, 0, sizeof(c));
+	s.cipher = cipher;
+	s.hmac = hmac;
+	s.master_key_len = s.session_key_len = key_len;
+	get_random_bytes(s.master_key, key_len);
+	get_random_bytes(s.master_salt, sizeof(s.master_salt));
+
+	crypto_context_init(&c, &s);
+	if (gen_session_keys(&c, &s, 0x03)) {
+		seq_printf(f, "%-20s failed to initialise\n", c.cipher->name);
+		goto out;
+	}
+
+	if (c.tfm[0])
+		impl = "single-block";
+	else if (c.shash)
+		impl = crypto_tfm_alg_driver_name(crypto_shash_tfm(c.shash));
+#if RE_HAS_SYNC_SKCIPHER
+	if (c.ctr)
+		impl = crypto_tfm_alg_driver_name(crypto_skcipher_tfm(&c.ctr->base));
+#endif
+
+	start = ktime_get_ns();
+	for (i = 0; i < CRYPTO_BENCH_PACKETS; i++) {
+		if (c.cipher->rtcp_crypt)
+			c.cipher->rtcp_crypt(&c, buf, CRYPTO_BENCH_LEN, i);
+		if (c.shash)
+			re_hmac_calc(tag, &c, buf, CRYPTO_BENCH_LEN, NULL, 0);
+	}
+	ns = ktime_get_ns() - start;
+	if (!ns)
+		ns = 1;
+
+	seq_printf(f, "%-20s %-10s %-24s %8llu packets/s %6llu MB/s\n",
+			c.cipher->name, c.hmac->name, impl,
+			div64_u64((u64) CRYPTO_BENCH_PACKETS * NSEC_PER_SEC, ns),
+			div64_u64((u64) CRYPTO_BENCH_PACKETS * CRYPTO_BENCH_LEN * (NSEC_PER_SEC / 1000000), ns));
+
+out:
+	free_crypto_context(&c);
+}
+
+static int proc_crypto_bench_show(struct seq_file *f, void *v) {
+	unsigned char *buf;
+
+	buf = kzalloc(CRYPTO_BENCH_LEN, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	seq_printf(f, "%u packets of %u bytes per suite\n", CRYPTO_BENCH_PACKETS, CRYPTO_BENCH_LEN);
+	crypto_bench_suite(f, buf, REC_AES_CM_128, 16, REH_NULL);
+	crypto_bench_suite(f, buf, REC_AES_CM_192, 24, REH_NULL);
+	crypto_bench_suite(f, buf, REC_AES_CM_256, 32, REH_NULL);
+	crypto_bench_suite(f, buf, REC_AES_F8, 16, REH_NULL);
+	crypto_bench_suite(f, buf, REC_NULL, 16, REH_HMAC_SHA1);
+	crypto_bench_suite(f, buf, REC_AES_CM_128, 16, REH_HMAC_SHA1);
+
+	kfree(buf);
+	return 0;
+}
+
+static int proc_crypto_bench_open(struct inode *i, struct file *f) {
+	int err;
+	if ((err = proc_generic_open_modref(i, f)))
+		return err;
+	err = single_open(f, proc_crypto_bench_show, NULL);
+	if (err)
+		proc_generic_close_modref(i, f);
+	return err;
+}
+
+static int proc_crypto_bench_close(struct inode *i, struct file *f) {
+	proc_generic_close_modref(i, f);
+	return single_release(i, f);
+}
+
+
+
+
 static int __init init(void) {
 	int ret;
 	const char *err;
@@ -4428,6 +6351,11 @@ static int __init init(void) {
 	ret = -EINVAL;
 	if (stream_packets_list_limit <= 0)
 		goto fail;
+#if (RE_HAS_FASTPATH)
+	err = "fastpath_table parameter out of range";
+	if (fastpath_table < -1 || fastpath_table >= MAX_ID)
+		goto fail;
+#endif
 
 	printk(KERN_NOTICE "Registering xt_RTPENGINE module - version %s\n", RTPENGINE_VERSION);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,10,0)
@@ -4455,16 +6383,35 @@ static int __init init(void) {
 	if (!proc_list)
 		goto fail;
 
+	proc_crypto_bench = proc_create_user("crypto_bench", S_IFREG | S_IRUSR, my_proc_root,
+			&proc_crypto_bench_ops, NULL);
+	if (!proc_crypto_bench)
+		goto fail;
+
 	err = "could not register xtables target";
 	ret = xt_register_targets(xt_rtpengine_regs, ARRAY_SIZE(xt_rtpengine_regs));
 	if (ret)
 		goto fail;
 
+#if (RE_HAS_FASTPATH)
+	/* initial network namespace only */
+	if (fastpath_table >= 0) {
+		err = "could not register netfilter hooks";
+		ret = nf_register_net_hooks(&init_net, rtpengine_fastpath_ops,
+				ARRAY_SIZE(rtpengine_fastpath_ops));
+		if (ret) {
+			xt_unregister_targets(xt_rtpengine_regs, ARRAY_SIZE(xt_rtpengine_regs));
+			goto fail;
+		}
+	}
+#endif
+
 	return 0;
 
 fail:
 	clear_proc(&proc_control);
 	clear_proc(&proc_list);
+	clear_proc(&proc_crypto_bench);
 	clear_proc(&my_proc_root);
 
 	printk(KERN_ERR "Failed to load xt_RTPENGINE module: %s\n", err);
@@ -4474,10 +6421,16 @@ fail:
 
 static void __exit fini(void) {
 	printk(KERN_NOTICE "Unregistering xt_RTPENGINE module\n");
+#if (RE_HAS_FASTPATH)
+	if (fastpath_table >= 0)
+		nf_unregister_net_hooks(&init_net, rtpengine_fastpath_ops,
+				ARRAY_SIZE(rtpengine_fastpath_ops));
+#endif
 	xt_unregister_targets(xt_rtpengine_regs, ARRAY_SIZE(xt_rtpengine_regs));
 
 	clear_proc(&proc_control);
 	clear_proc(&proc_list);
+	clear_proc(&proc_crypto_bench);
 	clear_proc(&my_proc_root);
 
 	auto_array_free(&streams);
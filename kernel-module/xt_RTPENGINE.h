@@ -4,6 +4,11 @@
 
 
 #define NUM_PAYLOAD_TYPES 16
+#define RTPENGINE_MAX_DESTINATIONS 16
+#define ICE_UFRAG_MAX_LEN 32
+#define ICE_PWD_MAX_LEN 32
+#define RTPENGINE_SSRC_STATS_SLOTS 16384
+#define RTPENGINE_DTMF_RING 256
 
 
 
@@ -15,6 +20,7 @@ struct rtpengine_stats {
 	u_int64_t			packets;
 	u_int64_t			bytes;
 	u_int64_t			errors;
+	u_int64_t			junk; // dropped by the junk filter
 	u_int64_t			delay_min;
 	u_int64_t			delay_avg;
 	u_int64_t			delay_max;
@@ -32,6 +38,7 @@ struct rtpengine_ssrc_stats {
 	u_int32_t			total_lost;
 	u_int32_t			transit;
 	u_int32_t			jitter;
+	u_int32_t			reordered; // late arrivals within the loss window
 };
 
 struct re_address {
@@ -54,6 +61,8 @@ enum rtpengine_cipher {
 	REC_AES_F8,
 	REC_AES_CM_192,
 	REC_AES_CM_256,
+	REC_AEAD_AES_GCM_128,
+	REC_AEAD_AES_GCM_256,
 
 	__REC_LAST
 };
@@ -78,9 +87,29 @@ struct rtpengine_srtp {
 	u_int64_t			last_index;
 	unsigned int			auth_tag_len; /* in bytes */
 	unsigned int			mki_len;
+	u_int64_t			rtcp_index; /* next SRTCP index for encryption, last seen for decryption */
+	unsigned int			rtcp_auth_tag_len; /* in bytes */
 };
 
 
+/* local ICE credentials, used to answer STUN binding requests (consent freshness) in the kernel */
+struct rtpengine_ice {
+	unsigned char			ufrag[ICE_UFRAG_MAX_LEN];
+	unsigned int			ufrag_len;
+	unsigned char			pwd[ICE_PWD_MAX_LEN];
+	unsigned int			pwd_len; /* zero = pass all STUN to userspace */
+};
+
+
+/* payload conversions done in the kernel, per RTP payload type */
+enum rtpengine_xcode {
+	REX_NONE	= 0,
+	REX_ALAW_ULAW,
+	REX_ULAW_ALAW,
+
+	__REX_LAST
+};
+
 enum rtpengine_src_mismatch {
 	MSM_IGNORE	= 0,	/* process packet as normal */
 	MSM_DROP,		/* drop packet */
@@ -100,23 +129,64 @@ struct rtpengine_target_info {
 
 	struct rtpengine_srtp		decrypt;
 	struct rtpengine_srtp		encrypt;
+	struct rtpengine_ice		ice; /* requires expected_src to be set */
         u_int32_t                       ssrc; // Expose the SSRC to userspace when we resync.
         u_int32_t                       ssrc_out; // Rewrite SSRC
+	u_int16_t			seq_diff; // added to the RTP sequence number along with ssrc_out
 
 	unsigned char			payload_types[NUM_PAYLOAD_TYPES]; /* must be sorted */
 	u_int32_t			clock_rates[NUM_PAYLOAD_TYPES];
+	unsigned char			pt_output[NUM_PAYLOAD_TYPES]; /* for each of payload_types[], with pt_rewrite */
+	unsigned char			xcode[NUM_PAYLOAD_TYPES]; /* enum rtpengine_xcode */
 	unsigned int			num_payload_types;
 
+	unsigned int			rtcp_sample; /* pass every Nth forwarded RTCP packet to userspace, 0 = none */
+
+	unsigned int			num_destinations; /* additional ones, see rtpengine_destination_info */
+
+	unsigned int			stats_slot; /* 1-based index into the ssrc_stats map, 0 = none */
+
+	u_int32_t			dtmf_mask; /* payload_types[] entries that carry RFC 4733
+						      events to be reported through the dtmf file */
+
 	unsigned char			tos;
 	int				rtcp_mux:1,
 					dtls:1,
 					stun:1,
+					ice_controlling:1, // own role, for role conflict detection.
+					ice_controlled:1, // neither is set for ICE lite
 					rtp:1,
 					rtp_only:1,
 					do_intercept:1,
 					transcoding:1, // SSRC subst and RTP PT filtering
 					non_forwarding:1, // empty src/dst addr
-					rtp_stats:1; // requires SSRC and clock_rates to be set
+					rtp_stats:1, // requires SSRC and clock_rates to be set
+					pt_rewrite:1, // use pt_output
+					rtcp:1, // RTCP-only port, all packets are RTCP
+					rtcp_fw:1, // forward (S)RTCP in the kernel instead of passing it to userspace
+					junk_filter:1; // drop malformed packets not from expected_src, requires rtp
+};
+
+/* an additional output of a target. RTP packets are decrypted once and then rewritten
+ * and encrypted separately for each output. non-RTP packets are copied unchanged.
+ * RTCP forwarded by the kernel (rtcp_fw) only goes to the primary destination */
+struct rtpengine_output_info {
+	struct re_address		src_addr;
+	struct re_address		dst_addr;
+	struct rtpengine_srtp		encrypt;
+	u_int32_t			ssrc_out; // Rewrite SSRC, zero = keep
+	unsigned char			pt_output[NUM_PAYLOAD_TYPES]; // for each of payload_types[], with pt_rewrite
+	unsigned char			tos;
+	int				pt_rewrite:1;
+};
+
+/* REMG_ADD_DESTINATION: outputs are added to an existing target in order, `num` going
+ * from zero up to num_destinations - 1. they are dropped on REMG_UPDATE and must be
+ * added again */
+struct rtpengine_destination_info {
+	struct re_address		local;
+	unsigned int			num;
+	struct rtpengine_output_info	output;
 };
 
 struct rtpengine_call_info {
@@ -136,12 +206,80 @@ struct rtpengine_packet_info {
 	unsigned int			stream_idx;
 };
 
+// Each intercept stream's proc file can be mmap'ed to consume its packets without
+// read() calls. The mapping starts with this header, followed by `slots` (a power
+// of two) slots of RTPENGINE_STREAM_SLOT_SIZE bytes each, at RTPENGINE_STREAM_RING_HDR.
+// The kernel fills slot `head % slots` and then advances `head`. The consumer reads
+// slot `tail % slots` and then advances `tail`. Packets arriving while the ring is
+// full are discarded and counted in `dropped`.
+#define RTPENGINE_STREAM_RING_HDR	4096
+#define RTPENGINE_STREAM_SLOT_SIZE	2048
+
+struct rtpengine_stream_ring {
+	u_int32_t			head;		// written by kernel
+	u_int32_t			__pad1[15];
+	u_int32_t			tail;		// written by consumer
+	u_int32_t			__pad2[15];
+	u_int32_t			slots;
+	u_int32_t			size;		// of the complete mapping
+	u_int32_t			dropped;
+	u_int32_t			eof;
+};
+
+struct rtpengine_stream_slot {
+	u_int32_t			len;
+	unsigned char			data[RTPENGINE_STREAM_SLOT_SIZE - sizeof(u_int32_t)];
+};
+
+// /proc/rtpengine/$ID/ssrc_stats is a read-only mapping of RTPENGINE_SSRC_STATS_HDR
+// bytes of header followed by RTPENGINE_SSRC_STATS_SLOTS slots. The daemon picks a
+// target's slot through stats_slot and the kernel copies the target's SSRC stats into it
+// after each RTP packet. `seq` is odd while the kernel is writing; readers retry until
+// they see the same even value before and after copying the slot.
+#define RTPENGINE_SSRC_STATS_HDR	4096
+
+struct rtpengine_ssrc_stats_map {
+	u_int32_t			slots;
+	u_int32_t			slot_size;
+};
+
+struct rtpengine_ssrc_stats_slot {
+	u_int32_t			seq;
+	u_int32_t			ssrc;
+	struct re_address		local;
+	struct rtpengine_ssrc_stats	stats;
+};
+
+// read from /proc/rtpengine/$ID/dtmf, one or more records per read(). For each event,
+// the first packet and the first one with the end bit set are reported
+struct rtpengine_dtmf_event {
+	struct re_address		local;
+	struct re_address		src;
+	u_int32_t			ssrc;
+	u_int32_t			timestamp;
+	u_int32_t			clock_rate;
+	u_int16_t			duration;	// in clock_rate units, host byte order
+	unsigned char			event;
+	unsigned char			volume;
+	unsigned char			end;
+};
+
 struct rtpengine_stats_info {
 	struct re_address		local;		// input
 	u_int32_t			ssrc;		// output
 	struct rtpengine_ssrc_stats	ssrc_stats;	// output
 };
 
+struct rtpengine_batch_info {
+	unsigned int			num;		// input, entries follow in data[]
+};
+
+struct rtpengine_batch_entry {
+	int				cmd;		// input: REMG_ADD, REMG_UPDATE or REMG_DEL
+	int				result;		// output: 0 or negative errno
+	struct rtpengine_target_info	target;		// input
+};
+
 struct rtpengine_message {
 	enum {
 		REMG_NOOP = 1,
@@ -149,7 +287,11 @@ struct rtpengine_message {
 		/* target_info: */
 		REMG_ADD,
 		REMG_DEL,
-		REMG_UPDATE,
+		REMG_UPDATE,	/* replaces an existing target atomically. stats, SRTP indexes and
+				   unchanged crypto keys carry over */
+
+		/* destination_info: */
+		REMG_ADD_DESTINATION,
 
 		/* call_info: */
 		REMG_ADD_CALL,
@@ -166,15 +308,20 @@ struct rtpengine_message {
 		REMG_GET_STATS,
 		REMG_GET_RESET_STATS,
 
+		/* batch_info: */
+		REMG_BATCH,
+
 		__REMG_LAST
 	}				cmd;
 
 	union {
 		struct rtpengine_target_info	target;
+		struct rtpengine_destination_info destination;
 		struct rtpengine_call_info	call;
 		struct rtpengine_stream_info	stream;
 		struct rtpengine_packet_info	packet;
 		struct rtpengine_stats_info	stats;
+		struct rtpengine_batch_info	batch;
 	} u;
 
 	unsigned char			data[];
@@ -184,7 +331,45 @@ struct rtpengine_list_entry {
 	struct rtpengine_target_info	target;
 	struct rtpengine_stats		stats;
 	struct rtpengine_rtp_stats	rtp_stats[NUM_PAYLOAD_TYPES];
+	struct rtpengine_ssrc_stats	ssrc_stats;	// snapshot, not reset
+};
+
+// /proc/rtpengine/$ID/snapshot: a read() at offset 0 collects all targets in a single pass
+// under RCU, without taking the target lock or any per-target lock, and returns the
+// header followed by `count` entries. Further reads continue from the file offset. The
+// counters of a target are read while packets are being forwarded and so aren't
+// necessarily consistent with each other. `epoch` changes whenever targets are added,
+// replaced or deleted. If the reader write()s the last epoch it saw (u_int32_t) before
+// reading, and the table hasn't changed since, only the header is returned with
+// RTPENGINE_SNAPSHOT_UNCHANGED set.
+#define RTPENGINE_SNAPSHOT_VERSION	1
+#define RTPENGINE_SNAPSHOT_UNCHANGED	0x1
+
+struct rtpengine_snapshot_hdr {
+	u_int32_t			version;	// RTPENGINE_SNAPSHOT_VERSION
+	u_int32_t			entry_size;	// sizeof(struct rtpengine_snapshot_entry)
+	u_int32_t			count;
+	u_int32_t			flags;		// RTPENGINE_SNAPSHOT_*
+	u_int32_t			epoch;
+	u_int32_t			reserved;
 };
 
+struct rtpengine_snapshot_entry {
+	struct re_address		local;
+	struct re_address		expected_src;
+	u_int32_t			ssrc;
+	u_int32_t			ssrc_out;
+	u_int32_t			num_destinations;
+	u_int32_t			flags;		// RTPENGINE_SNAPSHOT_F_*
+	struct rtpengine_stats		stats;
+	struct rtpengine_ssrc_stats	ssrc_stats;
+};
+
+#define RTPENGINE_SNAPSHOT_F_RTCP	0x1	// rtcp_fw
+#define RTPENGINE_SNAPSHOT_F_DTLS	0x2
+#define RTPENGINE_SNAPSHOT_F_STUN	0x4
+#define RTPENGINE_SNAPSHOT_F_SRTP	0x8	// decrypt or encrypt configured
+#define RTPENGINE_SNAPSHOT_F_FASTPATH	0x10
+
 
 #endif
@@ -0,0 +1,82 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM rtpengine
+
+#if !defined(_XT_RTPENGINE_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _XT_RTPENGINE_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,10,0)
+#define re_trace_assign_str(dst, src) __assign_str(dst)
+#else
+#define re_trace_assign_str(dst, src) __assign_str(dst, src)
+#endif
+
+/* a packet was forwarded by the kernel module */
+TRACE_EVENT(rtpengine_forward,
+	TP_PROTO(unsigned int local_port, unsigned int len, int pt_idx, int err),
+	TP_ARGS(local_port, len, pt_idx, err),
+	TP_STRUCT__entry(
+		__field(unsigned int, local_port)
+		__field(unsigned int, len)
+		__field(int, pt_idx)
+		__field(int, err)
+	),
+	TP_fast_assign(
+		__entry->local_port = local_port;
+		__entry->len = len;
+		__entry->pt_idx = pt_idx;
+		__entry->err = err;
+	),
+	TP_printk("port=%u len=%u pt_idx=%d err=%d", __entry->local_port, __entry->len,
+		__entry->pt_idx, __entry->err)
+);
+
+/* a packet for a known target was handed back to the stack, i.e. to userspace */
+TRACE_EVENT(rtpengine_skip,
+	TP_PROTO(unsigned int local_port, const char *reason),
+	TP_ARGS(local_port, reason),
+	TP_STRUCT__entry(
+		__field(unsigned int, local_port)
+		__string(reason, reason ? reason : "")
+	),
+	TP_fast_assign(
+		__entry->local_port = local_port;
+		re_trace_assign_str(reason, reason ? reason : "");
+	),
+	TP_printk("port=%u reason=%s", __entry->local_port, __get_str(reason))
+);
+
+DECLARE_EVENT_CLASS(rtpengine_target,
+	TP_PROTO(unsigned int local_port, unsigned int num_payload_types),
+	TP_ARGS(local_port, num_payload_types),
+	TP_STRUCT__entry(
+		__field(unsigned int, local_port)
+		__field(unsigned int, num_payload_types)
+	),
+	TP_fast_assign(
+		__entry->local_port = local_port;
+		__entry->num_payload_types = num_payload_types;
+	),
+	TP_printk("port=%u payload_types=%u", __entry->local_port, __entry->num_payload_types)
+);
+
+DEFINE_EVENT(rtpengine_target, rtpengine_target_add,
+	TP_PROTO(unsigned int local_port, unsigned int num_payload_types),
+	TP_ARGS(local_port, num_payload_types)
+);
+
+DEFINE_EVENT(rtpengine_target, rtpengine_target_del,
+	TP_PROTO(unsigned int local_port, unsigned int num_payload_types),
+	TP_ARGS(local_port, num_payload_types)
+);
+
+#endif
+
+/* must stay outside of the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xt_RTPENGINE_trace
+#include <trace/define_trace.h>
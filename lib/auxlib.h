@@ -20,6 +20,7 @@ struct rtpengine_common_config {
 	int log_stderr;
 	int split_logs;
 	int no_log_timestamps;
+	int log_async;
 	char *log_mark_prefix;
 	char *log_mark_suffix;
 	char *pidfile;
@@ -269,6 +270,19 @@ INLINE void timeval_lowest(struct timeval *l, const struct timeval *n) {
 	if (!l->tv_sec || timeval_cmp(l, n) == 1)
 		*l = *n;
 }
+// for threads that only need rtpe_now to the millisecond or so. this can lag behind
+// gettimeofday() by up to one kernel tick, so don't mix the two within the same thread
+INLINE void rtpe_now_coarse(void) {
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+	if (!clock_gettime(CLOCK_REALTIME_COARSE, &ts)) {
+		rtpe_now.tv_sec = ts.tv_sec;
+		rtpe_now.tv_usec = ts.tv_nsec / 1000;
+		return;
+	}
+#endif
+	gettimeofday(&rtpe_now, NULL);
+}
 INLINE double ntp_ts_to_double(u_int32_t whole, u_int32_t frac) {
 	return (double) whole + (double) frac / 4294967296.0;
 }
@@ -5,6 +5,7 @@
 #include <libavutil/opt.h>
 #include <glib.h>
 #include <arpa/inet.h>
+#include <time.h>
 #ifdef HAVE_BCG729
 #include <bcg729/encoder.h>
 #include <bcg729/decoder.h>
@@ -19,8 +20,9 @@
 
 
 
-#define PACKET_SEQ_DUPE_THRES 100
+#define PACKET_SEQ_DUPE_THRES 100 // must not be larger than PACKET_SEQ_RING
 #define PACKET_TS_RESET_THRES 5000 // milliseconds
+#define OPUS_LOW_COMPLEXITY 2 // libopus complexity (0 - 10) under overload, default 10
 
 
 
@@ -41,11 +43,14 @@ static packetizer_f packetizer_amr;
 
 static format_init_f opus_init;
 static set_enc_options_f opus_set_enc_options;
+static dtx_frame_f opus_dtx_frame;
+static set_complexity_f opus_set_complexity;
 
 static set_enc_options_f ilbc_set_enc_options;
 static set_dec_options_f ilbc_set_dec_options;
 
 static set_enc_options_f amr_set_enc_options;
+static dtx_frame_f amr_dtx_frame;
 static set_dec_options_f amr_set_dec_options;
 
 static void avc_def_init(codec_def_t *);
@@ -55,9 +60,13 @@ static void avc_decoder_close(decoder_t *);
 static const char *avc_encoder_init(encoder_t *enc, const str *, const str *);
 static int avc_encoder_input(encoder_t *enc, AVFrame **frame);
 static void avc_encoder_close(encoder_t *enc);
+static void avc_decoder_reset(decoder_t *);
+static int avc_encoder_reset(encoder_t *);
 
 static int amr_decoder_input(decoder_t *dec, const str *data, GQueue *out);
 static void amr_encoder_got_packet(encoder_t *enc);
+static void amr_decoder_reset(decoder_t *);
+static int amr_encoder_reset(encoder_t *);
 static int ilbc_decoder_input(decoder_t *dec, const str *data, GQueue *out);
 
 static const char *dtmf_decoder_init(decoder_t *, const str *, const str *);
@@ -67,8 +76,18 @@ static int cn_decoder_input(decoder_t *dec, const str *data, GQueue *out);
 
 static int format_cmp_ignore(const struct rtp_payload_type *, const struct rtp_payload_type *);
 
+static void g711_def_init(codec_def_t *);
+static const char *g711_decoder_init(decoder_t *, const str *, const str *);
+static int g711_decoder_input(decoder_t *dec, const str *data, GQueue *out);
+static const char *g711_encoder_init(encoder_t *enc, const str *, const str *);
+static int g711_encoder_input(encoder_t *enc, AVFrame **frame);
+static void g711_decoder_reset(decoder_t *);
+static int g711_encoder_reset(encoder_t *);
+
 static int amr_packet_lost(decoder_t *, GQueue *);
 
+static void codec_pool_free(void);
+
 
 
 
@@ -77,28 +96,43 @@ static const codec_type_t codec_type_avcodec = {
 	.decoder_init = avc_decoder_init,
 	.decoder_input = avc_decoder_input,
 	.decoder_close = avc_decoder_close,
+	.decoder_reset = avc_decoder_reset,
 	.encoder_init = avc_encoder_init,
 	.encoder_input = avc_encoder_input,
 	.encoder_close = avc_encoder_close,
+	.encoder_reset = avc_encoder_reset,
 };
 static const codec_type_t codec_type_ilbc = {
 	.def_init = avc_def_init,
 	.decoder_init = avc_decoder_init,
 	.decoder_input = ilbc_decoder_input,
 	.decoder_close = avc_decoder_close,
+	.decoder_reset = avc_decoder_reset,
 	.encoder_init = avc_encoder_init,
 	.encoder_input = avc_encoder_input,
 	.encoder_close = avc_encoder_close,
+	.encoder_reset = avc_encoder_reset,
 };
 static const codec_type_t codec_type_amr = {
 	.def_init = avc_def_init,
 	.decoder_init = avc_decoder_init,
 	.decoder_input = amr_decoder_input,
 	.decoder_close = avc_decoder_close,
+	.decoder_reset = amr_decoder_reset,
 	.encoder_init = avc_encoder_init,
 	.encoder_input = avc_encoder_input,
 	.encoder_got_packet = amr_encoder_got_packet,
 	.encoder_close = avc_encoder_close,
+	.encoder_reset = amr_encoder_reset,
+};
+static const codec_type_t codec_type_g711 = {
+	.def_init = g711_def_init,
+	.decoder_init = g711_decoder_init,
+	.decoder_input = g711_decoder_input,
+	.decoder_reset = g711_decoder_reset,
+	.encoder_init = g711_encoder_init,
+	.encoder_input = g711_encoder_input,
+	.encoder_reset = g711_encoder_reset,
 };
 static const codec_type_t codec_type_dtmf = {
 	.decoder_init = dtmf_decoder_init,
@@ -109,8 +143,31 @@ static const codec_type_t codec_type_cn = {
 	.decoder_init = avc_decoder_init,
 	.decoder_input = cn_decoder_input,
 	.decoder_close = avc_decoder_close,
+	.decoder_reset = avc_decoder_reset,
 };
 
+#ifdef HAVE_LIBOPUS
+// decoding through libopus directly, as libavcodec doesn't give access to the in-band FEC
+static void libopus_def_init(codec_def_t *);
+static const char *libopus_decoder_init(decoder_t *, const str *, const str *);
+static int libopus_decoder_input(decoder_t *dec, const str *data, GQueue *out);
+static void libopus_decoder_close(decoder_t *);
+static void libopus_decoder_reset(decoder_t *);
+static int libopus_packet_fec(decoder_t *, const str *, unsigned int, GQueue *);
+
+static const codec_type_t codec_type_opus = {
+	.def_init = libopus_def_init,
+	.decoder_init = libopus_decoder_init,
+	.decoder_input = libopus_decoder_input,
+	.decoder_close = libopus_decoder_close,
+	.decoder_reset = libopus_decoder_reset,
+	.encoder_init = avc_encoder_init,
+	.encoder_input = avc_encoder_input,
+	.encoder_close = avc_encoder_close,
+	.encoder_reset = avc_encoder_reset,
+};
+#endif
+
 #ifdef HAVE_BCG729
 static packetizer_f packetizer_g729; // aggregate some frames into packets
 
@@ -146,7 +203,7 @@ static codec_def_t __codec_defs[] = {
 		.packetizer = packetizer_samplestream,
 		.bits_per_sample = 8,
 		.media_type = MT_AUDIO,
-		.codec_type = &codec_type_avcodec,
+		.codec_type = &codec_type_g711,
 	},
 	{
 		.rtpname = "PCMU",
@@ -158,7 +215,7 @@ static codec_def_t __codec_defs[] = {
 		.packetizer = packetizer_samplestream,
 		.bits_per_sample = 8,
 		.media_type = MT_AUDIO,
-		.codec_type = &codec_type_avcodec,
+		.codec_type = &codec_type_g711,
 	},
 	{
 		.rtpname = "G723",
@@ -290,9 +347,16 @@ static codec_def_t __codec_defs[] = {
 		.default_ptime = 20,
 		.packetizer = packetizer_passthrough,
 		.media_type = MT_AUDIO,
+#ifdef HAVE_LIBOPUS
+		.codec_type = &codec_type_opus,
+		.packet_fec = libopus_packet_fec,
+#else
 		.codec_type = &codec_type_avcodec,
+#endif
 		.init = opus_init,
 		.set_enc_options = opus_set_enc_options,
+		.set_complexity = opus_set_complexity,
+		.dtx_frame = opus_dtx_frame,
 	},
 	{
 		.rtpname = "vorbis",
@@ -381,6 +445,7 @@ static codec_def_t __codec_defs[] = {
 		.set_enc_options = amr_set_enc_options,
 		.set_dec_options = amr_set_dec_options,
 		.packet_lost = amr_packet_lost,
+		.dtx_frame = amr_dtx_frame,
 	},
 	{
 		.rtpname = "AMR-WB",
@@ -399,6 +464,7 @@ static codec_def_t __codec_defs[] = {
 		.set_enc_options = amr_set_enc_options,
 		.set_dec_options = amr_set_dec_options,
 		.packet_lost = amr_packet_lost,
+		.dtx_frame = amr_dtx_frame,
 	},
 	{
 		.rtpname = "telephone-event",
@@ -437,6 +503,13 @@ static codec_def_t __codec_defs[] = {
 		.media_type = MT_AUDIO,
 		.codec_type = &codec_type_avcodec,
 	},
+	{
+		.rtpname = "PCM-S16BE",
+		.avcodec_id = AV_CODEC_ID_PCM_S16BE,
+		.packetizer = packetizer_passthrough,
+		.media_type = MT_AUDIO,
+		.codec_type = &codec_type_avcodec,
+	},
 	{
 		.rtpname = "PCM-U8",
 		.avcodec_id = AV_CODEC_ID_PCM_U8,
@@ -456,6 +529,10 @@ static codec_def_t __codec_defs[] = {
 static GQueue __supplemental_codecs = G_QUEUE_INIT;
 const GQueue * const codec_supplemental_codecs = &__supplemental_codecs;
 
+int codeclib_low_complexity;
+int codeclib_no_fec;
+int codeclib_output_dtx;
+
 
 
 static GHashTable *codecs_ht;
@@ -582,10 +659,102 @@ void decoder_close(decoder_t *dec) {
 		dec->def->codec_type->decoder_close(dec);
 
 	resample_shutdown(&dec->resampler);
+	codec_buffer_pool_free(&dec->frame_pool);
+	g_free(dec->pool_key);
 	g_slice_free1(sizeof(*dec), dec);
 }
 
 
+#ifndef AV_INPUT_BUFFER_PADDING_SIZE
+#define AV_INPUT_BUFFER_PADDING_SIZE FF_INPUT_BUFFER_PADDING_SIZE
+#endif
+
+#define FRAME_CACHE_MAX 32
+
+// threads live for the lifetime of the process, so this is never freed
+static __thread GQueue *frame_cache;
+
+AVFrame *codeclib_frame_alloc(void) {
+	if (frame_cache) {
+		AVFrame *frame = g_queue_pop_head(frame_cache);
+		if (frame)
+			return frame;
+	}
+	return av_frame_alloc();
+}
+
+void codeclib_frame_free(AVFrame **fp) {
+	AVFrame *frame = *fp;
+	if (!frame)
+		return;
+	*fp = NULL;
+	if (G_UNLIKELY(!frame_cache))
+		frame_cache = g_queue_new();
+	if (frame_cache->length >= FRAME_CACHE_MAX) {
+		av_frame_free(&frame);
+		return;
+	}
+	av_frame_unref(frame);
+	g_queue_push_tail(frame_cache, frame);
+}
+
+static int codec_buffer_pool_ensure(struct codec_buffer_pool *p, int size) {
+	if (p->pool && p->size >= size)
+		return 0;
+	// outstanding buffers keep the old pool alive until they're returned
+	av_buffer_pool_uninit(&p->pool);
+	p->pool = av_buffer_pool_init(size, NULL);
+	if (!p->pool) {
+		p->size = 0;
+		return -1;
+	}
+	p->size = size;
+	return 0;
+}
+
+// `frame` must have format, nb_samples and channel_layout set
+int codec_buffer_pool_frame(struct codec_buffer_pool *p, AVFrame *frame) {
+	int channels = av_get_channel_layout_nb_channels(frame->channel_layout);
+	if (channels < 1 || av_sample_fmt_is_planar(frame->format))
+		return av_frame_get_buffer(frame, 0);
+
+	int linesize;
+	int size = av_samples_get_buffer_size(&linesize, channels, frame->nb_samples, frame->format, 0);
+	if (size < 0)
+		return size;
+	if (codec_buffer_pool_ensure(p, size))
+		return AVERROR(ENOMEM);
+	frame->buf[0] = av_buffer_pool_get(p->pool);
+	if (!frame->buf[0])
+		return AVERROR(ENOMEM);
+	frame->channels = channels;
+	frame->data[0] = frame->buf[0]->data;
+	frame->extended_data = frame->data;
+	frame->linesize[0] = linesize;
+	return 0;
+}
+
+int codec_buffer_pool_packet(struct codec_buffer_pool *p, AVPacket *pkt, int size) {
+	if (size < 0)
+		return -1;
+	if (codec_buffer_pool_ensure(p, size + AV_INPUT_BUFFER_PADDING_SIZE))
+		return -1;
+	AVBufferRef *buf = av_buffer_pool_get(p->pool);
+	if (!buf)
+		return -1;
+	memset(buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+	pkt->buf = buf;
+	pkt->data = buf->data;
+	pkt->size = size;
+	return 0;
+}
+
+void codec_buffer_pool_free(struct codec_buffer_pool *p) {
+	av_buffer_pool_uninit(&p->pool);
+	p->size = 0;
+}
+
+
 static int avc_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
 	const char *err;
 	int av_ret = 0;
@@ -602,7 +771,7 @@ static int avc_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
 		keep_going = 0;
 		int got_frame = 0;
 		err = "failed to alloc av frame";
-		frame = av_frame_alloc();
+		frame = codeclib_frame_alloc();
 		if (!frame)
 			goto err;
 
@@ -677,18 +846,18 @@ static int avc_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
 		}
 	} while (keep_going);
 
-	av_frame_free(&frame);
+	codeclib_frame_free(&frame);
 	return 0;
 
 err:
 	ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error decoding media packet: %s", err);
 	if (av_ret)
 		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Error returned from libav: %s", av_error(av_ret));
-	av_frame_free(&frame);
+	codeclib_frame_free(&frame);
 	return -1;
 }
 
-static int __decoder_input_data(decoder_t *dec, const str *data, unsigned long ts,
+static int __decoder_input_data(decoder_t *dec, const str *data, unsigned long ts, unsigned int lost,
 		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2)
 {
 	GQueue frames = G_QUEUE_INIT;
@@ -722,8 +891,11 @@ static int __decoder_input_data(decoder_t *dec, const str *data, unsigned long t
 	}
 	dec->rtp_ts = ts;
 
-	if (data)
+	if (data) {
+		if (lost && dec->def->packet_fec && !g_atomic_int_get(&codeclib_no_fec))
+			dec->def->packet_fec(dec, data, lost, &frames);
 		dec->def->codec_type->decoder_input(dec, data, &frames);
+	}
 	else
 		dec->def->packet_lost(dec, &frames);
 
@@ -739,22 +911,27 @@ static int __decoder_input_data(decoder_t *dec, const str *data, unsigned long t
 			if (callback(dec, rsmp_frame, u1, u2))
 				ret = -1;
 		}
-		av_frame_free(&frame);
+		codeclib_frame_free(&frame);
 	}
 
 	return ret;
 }
 int decoder_input_data(decoder_t *dec, const str *data, unsigned long ts,
 		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2)
+{
+	return decoder_input_data_fec(dec, data, ts, 0, callback, u1, u2);
+}
+int decoder_input_data_fec(decoder_t *dec, const str *data, unsigned long ts, unsigned int lost,
+		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2)
 {
 	if (!data || !data->s || !data->len)
 		return 0;
-	return __decoder_input_data(dec, data, ts, callback, u1, u2);
+	return __decoder_input_data(dec, data, ts, lost, callback, u1, u2);
 }
 int decoder_lost_packet(decoder_t *dec, unsigned long ts,
 		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2)
 {
-	return __decoder_input_data(dec, NULL, ts, callback, u1, u2);
+	return __decoder_input_data(dec, NULL, ts, 0, callback, u1, u2);
 }
 
 
@@ -816,6 +993,8 @@ static void avc_def_init(codec_def_t *def) {
 void codeclib_free(void) {
 	g_hash_table_destroy(codecs_ht);
 	g_hash_table_destroy(codecs_ht_by_av);
+	codec_pool_free();
+	resample_cleanup();
 	avformat_network_deinit();
 }
 
@@ -897,103 +1076,269 @@ void codeclib_init(int print) {
 
 
 
+// Encoding, decoding and resampling cost of each audio codec on this machine, measured
+// with one second of noise in the codec's default format and given as thread CPU time.
+// Packets go through the packetizer the same way as on RTP output, so that the decoder
+// sees what it would see on the wire.
 
+#define BENCH_MS 1000
+#define BENCH_RESAMPLE_RATE 8000 // the other side of the resampler: G.711, mostly
 
+static int64_t bench_cpu_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-static int ptr_cmp(const void *a, const void *b, void *dummy) {
-	if (a < b)
-		return -1;
-	if (a > b)
-		return 1;
+static int bench_encoded(encoder_t *enc, void *u1, void *u2) {
+	GQueue *packets = u1;
+	GString *sample_buf = u2;
+	AVPacket *in_pkt = &enc->avpkt;
+
+	while (1) {
+		unsigned int len = MAX(enc->avpkt.size, (enc->samples_per_packet ? : enc->samples_per_frame)
+				* enc->def->bits_per_sample / 8);
+		str *out = g_malloc(sizeof(*out) + len);
+		str_init_len(out, (char *) (out + 1), len);
+		int ret = enc->def->packetizer(in_pkt, sample_buf, out, enc);
+		if (ret == -1 || enc->avpkt.pts == AV_NOPTS_VALUE) {
+			g_free(out);
+			break;
+		}
+		g_queue_push_tail(packets, out);
+		if (ret == 0)
+			break;
+		in_pkt = NULL;
+	}
 	return 0;
 }
 
+static int bench_decoded(decoder_t *dec, AVFrame *frame, void *u1, void *u2) {
+	GQueue *frames = u1;
+	g_queue_push_tail(frames, frame);
+	return 0;
+}
+
+static void bench_frames_free(GQueue *frames) {
+	AVFrame *frame;
+	while ((frame = g_queue_pop_head(frames)))
+		codeclib_frame_free(&frame);
+}
+
+static int codeclib_benchmark_one(codec_def_t *def) {
+	const char *err;
+	format_t req_fmt = {
+		.clockrate = def->default_clockrate * def->clockrate_mult,
+		.channels = def->default_channels,
+		.format = -1,
+	};
+	format_t enc_fmt, s16_fmt, rsmp_fmt;
+	int ptime = def->default_ptime > 0 ? def->default_ptime : 20;
+	GQueue input = G_QUEUE_INIT, packets = G_QUEUE_INIT, output = G_QUEUE_INIT;
+	GString *sample_buf = g_string_new("");
+	resample_t conv = {0,}, rsmp = {0,};
+	decoder_t *dec = NULL;
+	encoder_t *enc = encoder_new();
+	str *pkt;
+	int64_t start;
+
+	err = "failed to create encoder";
+	if (encoder_config(enc, def, def->default_bitrate, ptime, &req_fmt, &enc_fmt))
+		goto err;
+
+	// input: noise, converted to what the encoder takes before the clock starts
+	s16_fmt = enc_fmt;
+	s16_fmt.format = AV_SAMPLE_FMT_S16;
+	unsigned int frame_samples = enc_fmt.clockrate * ptime / 1000;
+	unsigned int seed = 1;
+	err = "failed to prepare input";
+	for (int ms = 0; ms < BENCH_MS; ms += ptime) {
+		AVFrame *frame = av_frame_alloc();
+		frame->nb_samples = frame_samples;
+		frame->format = AV_SAMPLE_FMT_S16;
+		frame->sample_rate = enc_fmt.clockrate;
+		frame->channel_layout = av_get_default_channel_layout(enc_fmt.channels);
+		frame->pts = (int64_t) ms * enc_fmt.clockrate / 1000;
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			av_frame_free(&frame);
+			goto err;
+		}
+		int16_t *samples = (int16_t *) frame->extended_data[0];
+		for (unsigned int i = 0; i < frame_samples * enc_fmt.channels; i++)
+			samples[i] = (int16_t) (rand_r(&seed) & 0x1fff) - 0x1000;
+		AVFrame *conv_frame = resample_frame(&conv, frame, &enc_fmt);
+		av_frame_free(&frame);
+		if (!conv_frame)
+			goto err;
+		g_queue_push_tail(&input, conv_frame);
+	}
+
+	err = "failed to encode";
+	start = bench_cpu_ns();
+	for (GList *l = input.head; l; l = l->next) {
+		if (encoder_input_fifo(enc, l->data, bench_encoded, &packets, sample_buf))
+			goto err;
+	}
+	int64_t encode_ns = bench_cpu_ns() - start;
+
+	err = "failed to create decoder";
+	dec = decoder_new_fmt(def, def->default_clockrate, def->default_channels, ptime, NULL);
+	if (!dec)
+		goto err;
+
+	err = "failed to decode";
+	unsigned long ts = 0;
+	start = bench_cpu_ns();
+	for (GList *l = packets.head; l; l = l->next) {
+		if (decoder_input_data(dec, l->data, ts, bench_decoded, &output, NULL))
+			goto err;
+		ts += def->default_clockrate * ptime / 1000;
+	}
+	int64_t decode_ns = bench_cpu_ns() - start;
+
+	err = "no audio decoded";
+	if (!output.length)
+		goto err;
+
+	AVFrame *first = output.head->data;
+	rsmp_fmt = (format_t) {
+		.clockrate = first->sample_rate == BENCH_RESAMPLE_RATE ? 16000 : BENCH_RESAMPLE_RATE,
+		.channels = 1,
+		.format = AV_SAMPLE_FMT_S16,
+	};
+	err = "failed to resample";
+	start = bench_cpu_ns();
+	for (GList *l = output.head; l; l = l->next) {
+		AVFrame *rsmp_frame = resample_frame(&rsmp, l->data, &rsmp_fmt);
+		if (!rsmp_frame)
+			goto err;
+		codeclib_frame_free(&rsmp_frame);
+	}
+	int64_t resample_ns = bench_cpu_ns() - start;
+
+	def->bench_encode_ns = MAX(encode_ns * 1000 / BENCH_MS, 1);
+	def->bench_decode_ns = MAX(decode_ns * 1000 / BENCH_MS, 1);
+	def->bench_resample_ns = MAX(resample_ns * 1000 / BENCH_MS, 1);
+
+	ilog(LOG_INFO, "Codec %s costs %.3f%% of one core to encode, %.3f%% to decode, and %.3f%% "
+			"to resample (%.1f / %.1f / %.1f us per %i ms frame)",
+			def->rtpname,
+			(double) def->bench_encode_ns / 10000000.0,
+			(double) def->bench_decode_ns / 10000000.0,
+			(double) def->bench_resample_ns / 10000000.0,
+			(double) def->bench_encode_ns * ptime / 1000000.0,
+			(double) def->bench_decode_ns * ptime / 1000000.0,
+			(double) def->bench_resample_ns * ptime / 1000000.0,
+			ptime);
+
+	err = NULL;
+
+err:
+	if (err)
+		ilog(LOG_WARN, "Benchmark of codec %s failed: %s", def->rtpname, err);
+	bench_frames_free(&input);
+	bench_frames_free(&output);
+	g_queue_clear_full(&packets, g_free);
+	g_string_free(sample_buf, TRUE);
+	resample_shutdown(&conv);
+	resample_shutdown(&rsmp);
+	if (dec)
+		decoder_close(dec);
+	encoder_free(enc);
+	return err ? -1 : 0;
+}
+
+// runs in the calling thread, taking a few seconds in total
+void codeclib_benchmark(void) {
+	ilog(LOG_INFO, "Measuring codec costs");
+	for (int i = 0; i < G_N_ELEMENTS(__codec_defs); i++) {
+		codec_def_t *def = &__codec_defs[i];
+		if (!def->support_encoding || !def->support_decoding || def->supplemental
+				|| def->media_type != MT_AUDIO || def->default_clockrate <= 0
+				|| def->default_channels <= 0)
+			continue;
+		codeclib_benchmark_one(def);
+	}
+}
+
+void codeclib_benchmarked(void (*func)(const codec_def_t *, void *), void *arg) {
+	for (int i = 0; i < G_N_ELEMENTS(__codec_defs); i++) {
+		const codec_def_t *def = &__codec_defs[i];
+		if (def->bench_encode_ns)
+			func(def, arg);
+	}
+}
+
+
+
+
+
+
 void __packet_sequencer_init(packet_sequencer_t *ps, GDestroyNotify ffunc) {
-	ps->packets = g_tree_new_full(ptr_cmp, NULL, NULL, ffunc);
+	ps->packets = g_slice_alloc0(sizeof(*ps->packets) * PACKET_SEQ_RING);
+	ps->free_func = ffunc;
 	ps->seq = -1;
 }
+static void packet_sequencer_clear(packet_sequencer_t *ps) {
+	for (unsigned int i = 0; ps->num_packets && i < PACKET_SEQ_RING; i++) {
+		if (!ps->packets[i])
+			continue;
+		if (ps->free_func)
+			ps->free_func(ps->packets[i]);
+		ps->packets[i] = NULL;
+		ps->num_packets--;
+	}
+}
 void packet_sequencer_destroy(packet_sequencer_t *ps) {
-	if (ps->packets)
-		g_tree_destroy(ps->packets);
+	if (!ps->packets)
+		return;
+	packet_sequencer_clear(ps);
+	g_slice_free1(sizeof(*ps->packets) * PACKET_SEQ_RING, ps->packets);
 	ps->packets = NULL;
 }
-struct tree_searcher {
-	int find_seq,
-	    found_seq;
-};
-static int packet_tree_search(const void *testseq_p, const void *ts_p) {
-	struct tree_searcher *ts = (void *) ts_p;
-	int testseq = GPOINTER_TO_INT(testseq_p);
-	// called as a binary search test function. we're looking for the lowest
-	// seq number that is higher than find_seq. if our test number is too low,
-	// we proceed with higher numbers. if it's too high, we proceed to the lower
-	// numbers, but remember the lowest we've seen along that path.
-	if (G_UNLIKELY(testseq == ts->find_seq)) {
-		// we've struck gold
-		ts->found_seq = testseq;
-		return 0;
-	}
-	if (testseq < ts->find_seq)
-		return 1;
-	// testseq > ts->find_seq
-	if (ts->found_seq == -1 || testseq < ts->found_seq)
-		ts->found_seq = testseq;
-	return -1;
+INLINE seq_packet_t **packet_sequencer_slot(packet_sequencer_t *ps, int seq) {
+	return &ps->packets[seq & (PACKET_SEQ_RING - 1)];
 }
 // caller must take care of locking
 static void *__packet_sequencer_next_packet(packet_sequencer_t *ps, int num_wait) {
 	// see if we have a packet with the correct seq nr in the queue
-	seq_packet_t *packet = g_tree_lookup(ps->packets, GINT_TO_POINTER(ps->seq));
-	if (G_LIKELY(packet != NULL)) {
+	seq_packet_t **slot = packet_sequencer_slot(ps, ps->seq);
+	seq_packet_t *packet = *slot;
+	if (G_LIKELY(packet != NULL && packet->seq == ps->seq)) {
 		dbg("returning in-sequence packet (seq %i)", ps->seq);
 		goto out;
 	}
 
 	// why not? do we have anything? (we should)
-	int nnodes = g_tree_nnodes(ps->packets);
-	if (G_UNLIKELY(nnodes == 0)) {
+	if (G_UNLIKELY(ps->num_packets == 0)) {
 		dbg("packet queue empty");
 		return NULL;
 	}
-	if (G_LIKELY(nnodes < num_wait)) {
-		dbg("only %i packets in queue - waiting for more", nnodes);
+	if (G_LIKELY(ps->num_packets < (unsigned int) num_wait)) {
+		dbg("only %u packets in queue - waiting for more", ps->num_packets);
 		return NULL; // need to wait for more
 	}
 
-	// packet was probably lost. search for the next highest seq
-	struct tree_searcher ts = { .find_seq = ps->seq + 1, .found_seq = -1 };
-	packet = g_tree_search(ps->packets, packet_tree_search, &ts);
-	if (packet) {
-		// bullseye
-		dbg("lost packet - returning packet with next seq %i", packet->seq);
-		goto out;
-	}
-	if (G_UNLIKELY(ts.found_seq == -1)) {
-		// didn't find anything. seq must have wrapped around. retry
-		// starting from zero
-		ts.find_seq = 0;
-		packet = g_tree_search(ps->packets, packet_tree_search, &ts);
-		if (packet) {
-			dbg("lost packet - returning packet with next seq %i (after wrap)", packet->seq);
-			goto out;
-		}
-		if (G_UNLIKELY(ts.found_seq == -1))
-			abort();
+	// packet was probably lost. everything we have is ahead of the expected seq,
+	// so the next one along the ring is the one with the next highest seq
+	for (int i = 1; i < PACKET_SEQ_RING; i++) {
+		slot = packet_sequencer_slot(ps, ps->seq + i);
+		packet = *slot;
+		if (packet)
+			break;
 	}
-
-	// pull out the packet we found
-	packet = g_tree_lookup(ps->packets, GINT_TO_POINTER(ts.found_seq));
 	if (G_UNLIKELY(packet == NULL))
 		abort();
 
-	dbg("lost multiple packets - returning packet with next highest seq %i", packet->seq);
+	dbg("lost packet(s) - returning packet with next highest seq %i", packet->seq);
 
 out:
 	;
 	u_int16_t l = packet->seq - ps->seq;
 	ps->lost_count += l;
 
-	g_tree_steal(ps->packets, GINT_TO_POINTER(packet->seq));
+	*slot = NULL;
+	ps->num_packets--;
 	ps->seq = (packet->seq + 1) & 0xffff;
 
 	if (packet->seq < ps->ext_seq)
@@ -1010,7 +1355,8 @@ void *packet_sequencer_force_next_packet(packet_sequencer_t *ps) {
 }
 
 int packet_sequencer_next_ok(packet_sequencer_t *ps) {
-	if (g_tree_lookup(ps->packets, GINT_TO_POINTER(ps->seq)))
+	seq_packet_t *packet = *packet_sequencer_slot(ps, ps->seq);
+	if (packet && packet->seq == ps->seq)
 		return 1;
 	return 0;
 }
@@ -1044,11 +1390,14 @@ int packet_sequencer_insert(packet_sequencer_t *ps, seq_packet_t *p) {
 	ps->seq = p->seq;
 	ret = 1;
 	// seq ok - fall through
-	g_tree_clear(ps->packets);
+	packet_sequencer_clear(ps);
 seq_ok:
-	if (g_tree_lookup(ps->packets, GINT_TO_POINTER(p->seq)))
+	;
+	seq_packet_t **slot = packet_sequencer_slot(ps, p->seq);
+	if (*slot)
 		return -1;
-	g_tree_insert(ps->packets, GINT_TO_POINTER(p->seq), p);
+	*slot = p;
+	ps->num_packets++;
 
 	return ret;
 }
@@ -1136,6 +1485,7 @@ int encoder_config_fmtp(encoder_t *enc, const codec_def_t *def, int bitrate, int
 	enc->def = def;
 	enc->ptime = ptime / def->clockrate_mult;
 	enc->bitrate = bitrate;
+	enc->low_complexity = def->set_complexity ? g_atomic_int_get(&codeclib_low_complexity) : 0;
 
 	err = def->codec_type->encoder_init ? def->codec_type->encoder_init(enc, fmtp, extra_opts) : 0;
 	if (err)
@@ -1176,6 +1526,25 @@ err:
 	return -1;
 }
 
+static void avc_decoder_reset(decoder_t *dec) {
+	avcodec_flush_buffers(dec->u.avc.avcctx);
+	av_init_packet(&dec->u.avc.avpkt);
+	dec->u.avc.avpkt.data = NULL;
+	dec->u.avc.avpkt.size = 0;
+}
+
+static int avc_encoder_reset(encoder_t *enc) {
+#ifdef AV_CODEC_CAP_ENCODER_FLUSH
+	// without this the encoder can only be drained, not reused
+	if (!(enc->u.avc.codec->capabilities & AV_CODEC_CAP_ENCODER_FLUSH))
+		return -1;
+	avcodec_flush_buffers(enc->u.avc.avcctx);
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 static void avc_encoder_close(encoder_t *enc) {
 	if (enc->u.avc.avcctx) {
 		avcodec_close(enc->u.avc.avcctx);
@@ -1194,15 +1563,182 @@ void encoder_close(encoder_t *enc) {
 	format_init(&enc->actual_format);
 	av_audio_fifo_free(enc->fifo);
 	av_frame_free(&enc->frame);
+	codec_buffer_pool_free(&enc->packet_pool);
 	enc->mux_dts = 0;
 	enc->fifo = NULL;
 	enc->fifo_pts = 0;
 }
 void encoder_free(encoder_t *enc) {
 	encoder_close(enc);
+	g_free(enc->pool_key);
 	g_slice_free1(sizeof(*enc), enc);
 }
 
+
+// Pool of idle decoders and encoders, keyed by everything that goes into their setup,
+// so that set-up costs (opening libavcodec contexts in particular) aren't paid again
+// for each new call. Only codec types that know how to reset themselves take part.
+
+#define CODEC_POOL_MAX 16 // idle instances per key
+
+static mutex_t codec_pool_lock = MUTEX_STATIC_INIT;
+static GHashTable *codec_pool_ht; // char * -> GQueue of decoder_t or encoder_t
+
+static char *codec_pool_key(char type, const codec_def_t *def, int a, int b, int c, const format_t *fmt,
+		const str *fmtp, const str *opts)
+{
+	format_t f = { 0, };
+	if (fmt)
+		f = *fmt;
+	return g_strdup_printf("%c/%s/%i/%i/%i/%i/%i/%i/%.*s/%.*s", type, def->rtpname, a, b, c,
+			f.clockrate, f.channels, f.format,
+			(fmtp && fmtp->s) ? (int) fmtp->len : 0, (fmtp && fmtp->s) ? fmtp->s : "",
+			(opts && opts->s) ? (int) opts->len : 0, (opts && opts->s) ? opts->s : "");
+}
+
+static void *codec_pool_pop(const char *key) {
+	void *ret = NULL;
+	mutex_lock(&codec_pool_lock);
+	if (codec_pool_ht) {
+		GQueue *q = g_hash_table_lookup(codec_pool_ht, key);
+		if (q)
+			ret = g_queue_pop_head(q);
+	}
+	mutex_unlock(&codec_pool_lock);
+	return ret;
+}
+
+// returns 0 if taken
+static int codec_pool_push(char *key, void *p) {
+	int ret = -1;
+	mutex_lock(&codec_pool_lock);
+	if (!codec_pool_ht)
+		codec_pool_ht = g_hash_table_new(g_str_hash, g_str_equal);
+	GQueue *q = g_hash_table_lookup(codec_pool_ht, key);
+	if (!q) {
+		q = g_queue_new();
+		g_hash_table_insert(codec_pool_ht, g_strdup(key), q);
+	}
+	if (q->length < CODEC_POOL_MAX) {
+		g_queue_push_tail(q, p);
+		ret = 0;
+	}
+	mutex_unlock(&codec_pool_lock);
+	return ret;
+}
+
+decoder_t *decoder_pool_get(const codec_def_t *def, int clockrate, int channels, int ptime,
+		const format_t *resample_fmt,
+		const str *fmtp, const str *extra_opts)
+{
+	if (!def->codec_type || !def->codec_type->decoder_reset)
+		return decoder_new_fmtp(def, clockrate, channels, ptime, resample_fmt, fmtp, extra_opts);
+
+	char *key = codec_pool_key('d', def, clockrate, channels, ptime, resample_fmt, fmtp, extra_opts);
+	decoder_t *dec = codec_pool_pop(key);
+	if (dec) {
+		ilog(LOG_DEBUG, "Reusing pooled decoder for %s", def->rtpname);
+		g_free(key);
+		return dec;
+	}
+
+	dec = decoder_new_fmtp(def, clockrate, channels, ptime, resample_fmt, fmtp, extra_opts);
+	if (dec)
+		dec->pool_key = key;
+	else
+		g_free(key);
+	return dec;
+}
+
+void decoder_pool_put(decoder_t *dec) {
+	if (!dec)
+		return;
+	if (!dec->pool_key)
+		goto close;
+
+	dec->def->codec_type->decoder_reset(dec);
+	resample_shutdown(&dec->resampler);
+	dec->pts = (uint64_t) -1LL;
+	dec->rtp_ts = (unsigned long) -1L;
+	dec->event_func = NULL;
+	dec->event_data = NULL;
+
+	if (!codec_pool_push(dec->pool_key, dec))
+		return;
+
+close:
+	decoder_close(dec);
+}
+
+encoder_t *encoder_pool_get(const codec_def_t *def, int bitrate, int ptime,
+		const format_t *requested_format, format_t *actual_format, const str *fmtp,
+		const str *extra_opts)
+{
+	char *key = NULL;
+	encoder_t *enc = NULL;
+
+	if (def->codec_type && def->codec_type->encoder_reset) {
+		key = codec_pool_key('e', def, bitrate, ptime, 0, requested_format, fmtp, extra_opts);
+		enc = codec_pool_pop(key);
+	}
+	if (enc) {
+		ilog(LOG_DEBUG, "Reusing pooled encoder for %s", def->rtpname);
+		g_free(key);
+		if (actual_format)
+			*actual_format = enc->actual_format;
+		return enc;
+	}
+
+	enc = encoder_new();
+	if (encoder_config_fmtp(enc, def, bitrate, ptime, requested_format, actual_format, fmtp,
+				extra_opts))
+	{
+		g_free(key);
+		encoder_free(enc);
+		return NULL;
+	}
+	enc->pool_key = key;
+	return enc;
+}
+
+int encoder_pool_put(encoder_t *enc) {
+	if (!enc->pool_key)
+		return -1;
+	if (enc->def->codec_type->encoder_reset(enc))
+		return -1;
+
+	av_packet_unref(&enc->avpkt);
+	enc->avpkt.size = 0;
+	if (enc->fifo)
+		av_audio_fifo_reset(enc->fifo);
+	enc->fifo_pts = 0;
+	enc->mux_dts = 0;
+
+	return codec_pool_push(enc->pool_key, enc);
+}
+
+static void codec_pool_free(void) {
+	if (!codec_pool_ht)
+		return;
+	GHashTableIter iter;
+	g_hash_table_iter_init(&iter, codec_pool_ht);
+	char *key;
+	GQueue *q;
+	while (g_hash_table_iter_next(&iter, (void **) &key, (void **) &q)) {
+		void *p;
+		while ((p = g_queue_pop_head(q))) {
+			if (key[0] == 'd')
+				decoder_close(p);
+			else
+				encoder_free(p);
+		}
+		g_queue_free(q);
+		g_free(key);
+	}
+	g_hash_table_destroy(codec_pool_ht);
+	codec_pool_ht = NULL;
+}
+
 static int avc_encoder_input(encoder_t *enc, AVFrame **frame) {
 	int keep_going = 0;
 	int got_packet = 0;
@@ -1283,6 +1819,16 @@ int encoder_input_data(encoder_t *enc, AVFrame *frame,
 {
 	enc->avpkt.size = 0;
 
+	if (G_UNLIKELY(enc->def->set_complexity)) {
+		int low = g_atomic_int_get(&codeclib_low_complexity);
+		if (G_UNLIKELY(low != enc->low_complexity)) {
+			ilog(LOG_DEBUG, "Switching %s encoder to %s complexity", enc->def->rtpname,
+					low ? "low" : "normal");
+			enc->def->set_complexity(enc, low);
+			enc->low_complexity = low; // not retried if it failed
+		}
+	}
+
 	while (1) {
 		if (!enc->def->codec_type->encoder_input)
 			break;
@@ -1452,8 +1998,54 @@ static void opus_init(struct rtp_payload_type *pt) {
 static void opus_set_enc_options(encoder_t *enc, const str *fmtp, const str *codec_opts) {
 	if (enc->ptime)
 		codeclib_set_av_opt_int(enc, "frame_duration", enc->ptime);
+	if (enc->low_complexity) {
+		codeclib_set_av_opt_int(enc, "compression_level", OPUS_LOW_COMPLEXITY);
+		codeclib_set_av_opt_int(enc, "fec", 0);
+	}
+	if (codeclib_output_dtx)
+		codeclib_set_av_opt_int(enc, "dtx", 1);
 	// XXX additional opus options
 }
+// during DTX, libopus produces frames of at most two bytes, with a full one every 400 ms
+static int opus_dtx_frame(const AVPacket *pkt) {
+	return pkt->size <= 2;
+}
+
+// libavcodec's libopus wrapper takes these options only when the context is opened,
+// so a new context is opened with the same parameters. this loses the encoder's
+// lookahead once, which is barely audible
+static int opus_set_complexity(encoder_t *enc, int low) {
+	AVCodecContext *old = enc->u.avc.avcctx;
+	if (!old)
+		return -1;
+
+	AVCodecContext *c = avcodec_alloc_context3(enc->u.avc.codec);
+	if (!c)
+		return -1;
+
+	c->channels = old->channels;
+	c->channel_layout = old->channel_layout;
+	c->sample_rate = old->sample_rate;
+	c->sample_fmt = old->sample_fmt;
+	c->time_base = old->time_base;
+	c->bit_rate = old->bit_rate;
+
+	enc->u.avc.avcctx = c;
+	enc->low_complexity = low;
+	opus_set_enc_options(enc, NULL, NULL);
+
+	int ret = avcodec_open2(c, enc->u.avc.codec, NULL);
+	if (ret) {
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to reopen Opus encoder: %s", av_error(ret));
+		avcodec_free_context(&c);
+		enc->u.avc.avcctx = old;
+		return -1;
+	}
+
+	avcodec_close(old);
+	avcodec_free_context(&old);
+	return 0;
+}
 
 static int ilbc_mode(int ptime, const str *fmtp, const char *direction) {
 	int mode = 0;
@@ -1725,6 +2317,9 @@ static void amr_set_enc_codec_options(str *key, str *value, void *data) {
 static void amr_set_enc_options(encoder_t *enc, const str *fmtp, const str *codec_opts) {
 	amr_set_encdec_options(&enc->codec_options, fmtp, enc->def);
 
+	if (codeclib_output_dtx)
+		codeclib_set_av_opt_int(enc, "dtx", 1);
+
 	codeclib_key_value_parse(codec_opts, 1, amr_set_enc_codec_options, enc);
 
 	// if a mode-set was given, pick the highest supported bitrate
@@ -1753,6 +2348,10 @@ static void amr_set_enc_options(encoder_t *enc, const str *fmtp, const str *code
 		}
 	}
 }
+// NO_DATA between SID frames. these are dropped by the packetizer anyway
+static int amr_dtx_frame(const AVPacket *pkt) {
+	return pkt->size >= 1 && ((pkt->data[0] >> 3) & 0xf) == 15;
+}
 static void amr_set_dec_options(decoder_t *dec, const str *fmtp, const str *codec_opts) {
 	amr_set_encdec_options(&dec->codec_options, fmtp, dec->def);
 	codeclib_key_value_parse(codec_opts, 1, amr_set_dec_codec_options, dec);
@@ -1810,6 +2409,12 @@ static void amr_bitrate_tracker(decoder_t *dec, unsigned int ft) {
 
 	dec->u.avc.u.amr.bitrate_tracker[ft]++;
 }
+static void amr_decoder_reset(decoder_t *dec) {
+	avc_decoder_reset(dec);
+	ZERO(dec->u.avc.u.amr);
+	ZERO(dec->codec_options.amr.cmr);
+}
+
 static int amr_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
 	const char *err = NULL;
 
@@ -2037,6 +2642,16 @@ static void amr_encoder_got_packet(encoder_t *enc) {
 	amr_encoder_mode_change(enc);
 	enc->u.avc.u.amr.pkt_seq++;
 }
+
+static int amr_encoder_reset(encoder_t *enc) {
+	if (avc_encoder_reset(enc))
+		return -1;
+	ZERO(enc->u.avc.u.amr);
+	ZERO(enc->codec_options.amr.cmr);
+	// undo any mode changes requested through CMR
+	enc->u.avc.avcctx->bit_rate = enc->bitrate;
+	return 0;
+}
 static int packetizer_amr(AVPacket *pkt, GString *buf, str *output, encoder_t *enc) {
 	assert(pkt->size >= 1);
 
@@ -2120,6 +2735,305 @@ static int amr_packet_lost(decoder_t *dec, GQueue *out) {
 
 
 
+// native G.711, see the reference implementation in ITU-T G.191
+
+static int16_t g711_alaw_dec[256];
+static int16_t g711_ulaw_dec[256];
+static unsigned char g711_alaw_enc[8192]; // indexed by the top 13 bits of the sample
+static unsigned char g711_ulaw_enc[16384]; // indexed by the top 14 bits of the sample
+static unsigned char g711_alaw_ulaw[256];
+static unsigned char g711_ulaw_alaw[256];
+
+static int16_t g711_alaw_to_linear(unsigned char a) {
+	a ^= 0x55;
+	int t = (a & 0x0f) << 4;
+	int seg = (a & 0x70) >> 4;
+	if (seg == 0)
+		t += 8;
+	else
+		t = (t + 0x108) << (seg - 1);
+	return (a & 0x80) ? t : -t;
+}
+static int16_t g711_ulaw_to_linear(unsigned char u) {
+	u = ~u;
+	int t = (((u & 0x0f) << 3) + 0x84) << ((u & 0x70) >> 4);
+	return (u & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+static unsigned char g711_linear_to_alaw(int pcm) {
+	unsigned char mask;
+	int seg;
+
+	pcm >>= 3;
+	if (pcm >= 0)
+		mask = 0xd5;
+	else {
+		mask = 0x55;
+		pcm = -pcm - 1;
+	}
+	for (seg = 0; seg < 8; seg++) {
+		if (pcm < (0x20 << seg))
+			break;
+	}
+	if (seg >= 8)
+		return 0x7f ^ mask;
+	unsigned char aval = seg << 4;
+	if (seg < 2)
+		aval |= (pcm >> 1) & 0x0f;
+	else
+		aval |= (pcm >> seg) & 0x0f;
+	return aval ^ mask;
+}
+static unsigned char g711_linear_to_ulaw(int pcm) {
+	unsigned char mask;
+	int seg;
+
+	pcm >>= 2;
+	if (pcm < 0) {
+		pcm = -pcm;
+		mask = 0x7f;
+	}
+	else
+		mask = 0xff;
+	if (pcm > 8159)
+		pcm = 8159;
+	pcm += 0x84 >> 2;
+	for (seg = 0; seg < 8; seg++) {
+		if (pcm < (0x40 << seg))
+			break;
+	}
+	if (seg >= 8)
+		return 0x7f ^ mask;
+	return (((seg << 4) | ((pcm >> (seg + 1)) & 0x0f))) ^ mask;
+}
+
+static void g711_def_init(codec_def_t *def) {
+	static int tables_done;
+
+	// the AVCodecs are still looked up for anything that needs them by ID
+	avc_def_init(def);
+	def->support_encoding = 1;
+	def->support_decoding = 1;
+
+	// single threaded during codeclib_init()
+	if (tables_done)
+		return;
+	tables_done = 1;
+
+	for (int i = 0; i < 256; i++) {
+		g711_alaw_dec[i] = g711_alaw_to_linear(i);
+		g711_ulaw_dec[i] = g711_ulaw_to_linear(i);
+	}
+	for (int i = 0; i < G_N_ELEMENTS(g711_alaw_enc); i++)
+		g711_alaw_enc[i] = g711_linear_to_alaw((int16_t) (i << 3));
+	for (int i = 0; i < G_N_ELEMENTS(g711_ulaw_enc); i++)
+		g711_ulaw_enc[i] = g711_linear_to_ulaw((int16_t) (i << 2));
+	// same result as decoding to PCM and encoding again
+	for (int i = 0; i < 256; i++) {
+		g711_alaw_ulaw[i] = g711_ulaw_enc[(uint16_t) g711_alaw_dec[i] >> 2];
+		g711_ulaw_alaw[i] = g711_alaw_enc[(uint16_t) g711_ulaw_dec[i] >> 3];
+	}
+}
+
+static const char *g711_decoder_init(decoder_t *dec, const str *fmtp, const str *extra_opts) {
+	if (dec->in_format.channels < 1)
+		return "invalid number of channels";
+	return NULL;
+}
+
+static int g711_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
+	const int16_t *table = (dec->def->avcodec_id == AV_CODEC_ID_PCM_ALAW) ? g711_alaw_dec : g711_ulaw_dec;
+	int channels = dec->in_format.channels;
+	unsigned int samples = data->len / channels;
+
+	if (!samples)
+		return 0;
+
+	AVFrame *frame = codeclib_frame_alloc();
+	frame->nb_samples = samples;
+	frame->format = AV_SAMPLE_FMT_S16;
+	frame->sample_rate = dec->in_format.clockrate;
+	frame->channel_layout = av_get_default_channel_layout(channels);
+	frame->pts = dec->pts;
+	if (codec_buffer_pool_frame(&dec->frame_pool, frame) < 0)
+		abort();
+
+	int16_t *o = (void *) frame->extended_data[0];
+	const unsigned char *i = (void *) data->s;
+	for (unsigned int n = samples * channels; n; n--)
+		*o++ = table[*i++];
+
+	g_queue_push_tail(out, frame);
+	return 0;
+}
+
+static const char *g711_encoder_init(encoder_t *enc, const str *fmtp, const str *extra_opts) {
+	enc->actual_format.format = AV_SAMPLE_FMT_S16;
+	enc->actual_format.channels = enc->requested_format.channels;
+	if (enc->actual_format.channels < 1)
+		enc->actual_format.channels = 1;
+	enc->actual_format.clockrate = enc->requested_format.clockrate;
+	if (enc->actual_format.clockrate < 1)
+		enc->actual_format.clockrate = 8000;
+	enc->samples_per_frame = enc->actual_format.clockrate * enc->ptime / 1000;
+	enc->samples_per_packet = enc->samples_per_frame;
+	return NULL;
+}
+
+static int g711_encoder_input(encoder_t *enc, AVFrame **frame) {
+	if (!*frame)
+		return 0;
+
+	unsigned int len = (*frame)->nb_samples * enc->actual_format.channels;
+	if (codec_buffer_pool_packet(&enc->packet_pool, &enc->avpkt, len) < 0)
+		return -1;
+
+	const int16_t *i = (void *) (*frame)->extended_data[0];
+	unsigned char *o = enc->avpkt.data;
+	if (enc->def->avcodec_id == AV_CODEC_ID_PCM_ALAW) {
+		for (unsigned int n = len; n; n--)
+			*o++ = g711_alaw_enc[(uint16_t) *i++ >> 3];
+	}
+	else {
+		for (unsigned int n = len; n; n--)
+			*o++ = g711_ulaw_enc[(uint16_t) *i++ >> 2];
+	}
+
+	enc->avpkt.pts = (*frame)->pts;
+	enc->avpkt.dts = (*frame)->pts;
+	enc->avpkt.duration = (*frame)->nb_samples;
+
+	return 0;
+}
+
+int codec_frame_unit(const codec_def_t *def, int channels, unsigned int *bytes, unsigned int *ticks) {
+	if (!def || channels < 1)
+		return -1;
+	if (def->packetizer == packetizer_samplestream) {
+		if (!def->bits_per_sample || (def->bits_per_sample % 8))
+			return -1;
+		*bytes = channels * def->bits_per_sample / 8;
+		*ticks = 1;
+		return 0;
+	}
+	if (channels != 1)
+		return -1;
+	// RFC 3551 frame-based codecs with fixed frame sizes
+	if (!strcmp(def->rtpname, "G729") || !strcmp(def->rtpname, "G729a")) {
+		*bytes = 10;
+		*ticks = 80;
+		return 0;
+	}
+	if (!strcmp(def->rtpname, "GSM")) {
+		*bytes = 33;
+		*ticks = 160;
+		return 0;
+	}
+	return -1;
+}
+
+// both directions are stateless
+static void g711_decoder_reset(decoder_t *dec) {
+}
+static int g711_encoder_reset(encoder_t *enc) {
+	return 0;
+}
+
+const unsigned char *codec_g711_transcode_table(const codec_def_t *src, const codec_def_t *dst) {
+	if (!src || !dst)
+		return NULL;
+	if (src->codec_type != &codec_type_g711 || dst->codec_type != &codec_type_g711)
+		return NULL;
+	if (src->avcodec_id == dst->avcodec_id)
+		return NULL;
+	return (src->avcodec_id == AV_CODEC_ID_PCM_ALAW) ? g711_alaw_ulaw : g711_ulaw_alaw;
+}
+
+
+
+
+#ifdef HAVE_LIBOPUS
+static void libopus_def_init(codec_def_t *def) {
+	// encoding still goes through libavcodec
+	avc_def_init(def);
+	def->support_decoding = 1;
+}
+
+static const char *libopus_decoder_init(decoder_t *dec, const str *fmtp, const str *extra_opts) {
+	int err = 0;
+	dec->u.opus = opus_decoder_create(dec->in_format.clockrate, dec->in_format.channels, &err);
+	if (!dec->u.opus)
+		return "failed to create Opus decoder";
+	return NULL;
+}
+
+// decodes one packet, or one lost frame of `samples` duration from the FEC data in
+// the packet, or conceals one lost frame if there's no packet
+static int libopus_decode(decoder_t *dec, const str *data, int samples, int fec, uint64_t pts,
+		GQueue *out)
+{
+	AVFrame *frame = codeclib_frame_alloc();
+	frame->nb_samples = samples;
+	frame->format = AV_SAMPLE_FMT_S16;
+	frame->sample_rate = dec->in_format.clockrate;
+	frame->channel_layout = av_get_default_channel_layout(dec->in_format.channels);
+	frame->pts = pts;
+	if (codec_buffer_pool_frame(&dec->frame_pool, frame) < 0)
+		abort();
+
+	int ret = opus_decode(dec->u.opus, data ? (unsigned char *) data->s : NULL, data ? data->len : 0,
+			(opus_int16 *) frame->extended_data[0], samples, fec);
+	if (ret <= 0) {
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "Error decoding Opus packet: %s", opus_strerror(ret));
+		codeclib_frame_free(&frame);
+		return -1;
+	}
+
+	frame->nb_samples = ret;
+	g_queue_push_tail(out, frame);
+	return 0;
+}
+
+static int libopus_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
+	int samples = opus_packet_get_nb_samples((unsigned char *) data->s, data->len,
+			dec->in_format.clockrate);
+	if (samples <= 0) {
+		ilog(LOG_WARN | LOG_FLAG_LIMIT, "Invalid Opus packet: %s", opus_strerror(samples));
+		return -1;
+	}
+	return libopus_decode(dec, data, samples, 0, dec->pts, out);
+}
+
+// dec->pts is already set to the one of `next`. the last lost frame is taken from the
+// LBRR data of `next` if present, everything before that is concealed. this keeps the
+// decoder state intact, which otherwise suffers badly from a burst of lost packets
+static int libopus_packet_fec(decoder_t *dec, const str *next, unsigned int lost, GQueue *out) {
+	int samples = opus_packet_get_nb_samples((unsigned char *) next->s, next->len,
+			dec->in_format.clockrate);
+	if (samples <= 0)
+		return -1;
+
+	ilog(LOG_DEBUG, "Recovering %u lost Opus frame(s)", lost);
+
+	for (unsigned int i = lost; i > 0; i--)
+		libopus_decode(dec, i == 1 ? next : NULL, samples, i == 1,
+				dec->pts - (uint64_t) i * samples, out);
+	return 0;
+}
+
+static void libopus_decoder_close(decoder_t *dec) {
+	if (dec->u.opus)
+		opus_decoder_destroy(dec->u.opus);
+	dec->u.opus = NULL;
+}
+
+static void libopus_decoder_reset(decoder_t *dec) {
+	opus_decoder_ctl(dec->u.opus, OPUS_RESET_STATE);
+}
+#endif
+
+
+
+
 #ifdef HAVE_BCG729
 static void bcg729_def_init(codec_def_t *def) {
 	// test init
@@ -2152,13 +3066,13 @@ static int bcg729_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
 		inp_frame.len = frame_len;
 		str_shift(&input, frame_len);
 
-		AVFrame *frame = av_frame_alloc();
+		AVFrame *frame = codeclib_frame_alloc();
 		frame->nb_samples = 80;
 		frame->format = AV_SAMPLE_FMT_S16;
 		frame->sample_rate = dec->in_format.clockrate; // 8000
 		frame->channel_layout = av_get_default_channel_layout(dec->in_format.channels); // 1 channel
 		frame->pts = pts;
-		if (av_frame_get_buffer(frame, 0) < 0)
+		if (codec_buffer_pool_frame(&dec->frame_pool, frame) < 0)
 			abort();
 
 		pts += frame->nb_samples;
@@ -2202,7 +3116,8 @@ static int bcg729_encoder_input(encoder_t *enc, AVFrame **frame) {
 		return -1;
 	}
 
-	av_new_packet(&enc->avpkt, 10);
+	if (codec_buffer_pool_packet(&enc->packet_pool, &enc->avpkt, 10) < 0)
+		return -1;
 	unsigned char len = 0;
 
 	bcg729Encoder(enc->u.bcg729, (void *) (*frame)->extended_data[0], enc->avpkt.data, &len);
@@ -2311,13 +3226,13 @@ static int dtmf_decoder_input(decoder_t *dec, const str *data, GQueue *out) {
 
 	// synthesise PCM
 	// first get our frame and figure out how many samples we need, and the start offset
-	AVFrame *frame = av_frame_alloc();
+	AVFrame *frame = codeclib_frame_alloc();
 	frame->nb_samples = num_samples;
 	frame->format = AV_SAMPLE_FMT_S16;
 	frame->sample_rate = dec->in_format.clockrate;
 	frame->channel_layout = AV_CH_LAYOUT_MONO;
 	frame->pts = frame_ts;
-	if (av_frame_get_buffer(frame, 0) < 0)
+	if (codec_buffer_pool_frame(&dec->frame_pool, frame) < 0)
 		abort();
 
 	// fill samples
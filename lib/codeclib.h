@@ -45,6 +45,9 @@ INLINE enum media_type codec_get_type(const str *type) {
 #include <bcg729/encoder.h>
 #include <bcg729/decoder.h>
 #endif
+#ifdef HAVE_LIBOPUS
+#include <opus/opus.h>
+#endif
 
 #define AMR_FT_TYPES 14
 
@@ -52,6 +55,7 @@ INLINE enum media_type codec_get_type(const str *type) {
 
 struct codec_type_s;
 struct decoder_s;
+struct resample_filter;
 struct encoder_s;
 struct format_s;
 struct resample_s;
@@ -73,6 +77,9 @@ typedef void set_enc_options_f(encoder_t *, const str *, const str *);
 typedef void set_dec_options_f(decoder_t *, const str *, const str *);
 typedef int format_cmp_f(const struct rtp_payload_type *, const struct rtp_payload_type *);
 typedef int packet_lost_f(decoder_t *, GQueue *);
+typedef int packet_fec_f(decoder_t *, const str *next, unsigned int lost, GQueue *);
+typedef int set_complexity_f(encoder_t *, int low);
+typedef int dtx_frame_f(const AVPacket *);
 
 
 
@@ -82,11 +89,13 @@ struct codec_type_s {
 	const char *(*decoder_init)(decoder_t *, const str *, const str *);
 	int (*decoder_input)(decoder_t *, const str *data, GQueue *);
 	void (*decoder_close)(decoder_t *);
+	void (*decoder_reset)(decoder_t *); // optional, for pooling
 
 	const char *(*encoder_init)(encoder_t *, const str *, const str *);
 	int (*encoder_input)(encoder_t *, AVFrame **);
 	void (*encoder_got_packet)(encoder_t *);
 	void (*encoder_close)(encoder_t *);
+	int (*encoder_reset)(encoder_t *); // optional, for pooling
 };
 
 struct amr_cmr {
@@ -138,6 +147,9 @@ struct codec_def_s {
 	set_enc_options_f *set_enc_options;
 	set_dec_options_f *set_dec_options;
 	packet_lost_f *packet_lost;
+	packet_fec_f *packet_fec; // recovers frames lost right before `next`, e.g. from in-band FEC
+	set_complexity_f *set_complexity; // switches a running encoder to or from cheaper settings
+	dtx_frame_f *dtx_frame; // with codeclib_output_dtx: encoded frame needs no transmission
 
 	// filled in by codeclib_init()
 	str rtpname_str;
@@ -145,6 +157,12 @@ struct codec_def_s {
 	int support_encoding:1,
 	    support_decoding:1;
 
+	// CPU time in ns per second of audio on this machine, or 0 if not measured. filled
+	// in by codeclib_benchmark()
+	int64_t bench_encode_ns;
+	int64_t bench_decode_ns;
+	int64_t bench_resample_ns;
+
 	// flags
 	int supplemental:1,
 	    dtmf:1; // special case
@@ -162,8 +180,25 @@ struct format_s {
 	int format; // enum AVSampleFormat
 };
 
+// fixed-size buffers handed out to frames and packets and returned on unref
+struct codec_buffer_pool {
+	AVBufferPool *pool;
+	int size;
+};
+
 struct resample_s {
 	SwrContext *swresample;
+	struct codec_buffer_pool frame_pool;
+
+	// built-in polyphase filter for integer ratios, see resample.c
+	const struct resample_filter *filter;
+	int16_t *history; // (taps - 1) samples per channel
+	int16_t *work;
+	unsigned int work_len;
+	unsigned int offset; // phase carried over into the next frame
+
+	format_t in_format; // what the current state was set up for
+	int low_quality; // same, see resample_low_quality
 };
 
 enum codec_event {
@@ -179,6 +214,7 @@ struct decoder_s {
 		 out_format;
 
 	resample_t resampler;
+	struct codec_buffer_pool frame_pool;
 
 	union {
 		struct {
@@ -195,6 +231,9 @@ struct decoder_s {
 		} avc;
 #ifdef HAVE_BCG729
 		bcg729DecoderChannelContextStruct *bcg729;
+#endif
+#ifdef HAVE_LIBOPUS
+		OpusDecoder *opus;
 #endif
 		struct {
 			unsigned long start_ts;
@@ -209,6 +248,8 @@ struct decoder_s {
 
 	int (*event_func)(enum codec_event event, void *ptr, void *event_data);
 	void *event_data;
+
+	char *pool_key; // set if this can go back into the pool
 };
 
 struct encoder_s {
@@ -237,6 +278,7 @@ struct encoder_s {
 #endif
 	} u;
 	AVPacket avpkt;
+	struct codec_buffer_pool packet_pool;
 	AVAudioFifo *fifo;
 	int64_t fifo_pts; // pts of first data in fifo
 	int ptime;
@@ -245,13 +287,21 @@ struct encoder_s {
 	int samples_per_packet; // for frame packetizer
 	AVFrame *frame; // to pull samples from the fifo
 	int64_t mux_dts; // last dts passed to muxer
+	int low_complexity; // what the encoder was last set up with, see codeclib_low_complexity
+
+	char *pool_key; // set if this can go back into the pool
 };
 
 struct seq_packet_s {
 	int seq;
 };
+// Packets are kept in a ring indexed by seq. Only packets less than PACKET_SEQ_DUPE_THRES
+// ahead of the next expected seq are accepted, so no two of them share a slot.
+#define PACKET_SEQ_RING 128
 struct packet_sequencer_s {
-	GTree *packets;
+	seq_packet_t **packets; // PACKET_SEQ_RING entries
+	unsigned int num_packets;
+	GDestroyNotify free_func;
 	unsigned int lost_count;
 	int seq; // next expected
 	unsigned int ext_seq; // last received
@@ -261,9 +311,18 @@ struct packet_sequencer_s {
 
 extern const GQueue * const codec_supplemental_codecs;
 
+// Cheaper settings to shed CPU under overload. Set by the application at any time and
+// picked up by running encoders and decoders with their next frame.
+extern int codeclib_low_complexity; // encoders with set_complexity, e.g. Opus: lower complexity, no FEC
+extern int codeclib_no_fec; // decoders: don't recover lost frames from in-band FEC
+// Set once before any encoders are created: encoders with dtx_frame use codec-native DTX
+extern int codeclib_output_dtx;
+
 
 void codeclib_init(int);
 void codeclib_free(void);
+void codeclib_benchmark(void);
+void codeclib_benchmarked(void (*)(const codec_def_t *, void *), void *);
 
 
 const codec_def_t *codec_find(const str *name, enum media_type);
@@ -280,6 +339,15 @@ int decoder_input_data(decoder_t *dec, const str *data, unsigned long ts,
 		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2);
 int decoder_lost_packet(decoder_t *dec, unsigned long ts,
 		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2);
+// same as decoder_input_data, but `lost` packets went missing right before this one
+int decoder_input_data_fec(decoder_t *dec, const str *data, unsigned long ts, unsigned int lost,
+		int (*callback)(decoder_t *, AVFrame *, void *u1, void *u2), void *u1, void *u2);
+
+// same as decoder_new_fmtp, but possibly returns a reset instance released earlier
+decoder_t *decoder_pool_get(const codec_def_t *def, int clockrate, int channels, int ptime,
+		const format_t *resample_fmt,
+		const str *fmtp, const str *codec_opts);
+void decoder_pool_put(decoder_t *dec);
 
 
 encoder_t *encoder_new(void);
@@ -294,6 +362,28 @@ int encoder_input_data(encoder_t *enc, AVFrame *frame,
 int encoder_input_fifo(encoder_t *enc, AVFrame *frame,
 		int (*callback)(encoder_t *, void *u1, void *u2), void *u1, void *u2);
 
+// returns a configured encoder, possibly one released earlier, or NULL
+encoder_t *encoder_pool_get(const codec_def_t *def, int bitrate, int ptime,
+		const format_t *requested_format, format_t *actual_format, const str *fmtp, const str *codec_opts);
+// returns 0 if the encoder was taken back, or -1 if it must be flushed and freed as usual
+int encoder_pool_put(encoder_t *enc);
+
+// AVFrames recycled per thread, with sample buffers taken from a pool. Frames
+// returned by decoders and resamplers should be released through codeclib_frame_free
+AVFrame *codeclib_frame_alloc(void);
+void codeclib_frame_free(AVFrame **);
+int codec_buffer_pool_frame(struct codec_buffer_pool *, AVFrame *);
+int codec_buffer_pool_packet(struct codec_buffer_pool *, AVPacket *, int size);
+void codec_buffer_pool_free(struct codec_buffer_pool *);
+
+// for codecs whose payloads can be split and joined at fixed byte boundaries: fills in
+// the size of the smallest such unit in bytes and RTP timestamp ticks, returns 0 or -1
+int codec_frame_unit(const codec_def_t *def, int channels, unsigned int *bytes, unsigned int *ticks);
+
+// 256-byte table translating G.711 A-law to µ-law or vice versa, or NULL if `src` and
+// `dst` are not such a pair
+const unsigned char *codec_g711_transcode_table(const codec_def_t *src, const codec_def_t *dst);
+
 
 void __packet_sequencer_init(packet_sequencer_t *ps, GDestroyNotify);
 INLINE void packet_sequencer_init(packet_sequencer_t *ps, GDestroyNotify);
@@ -361,6 +451,9 @@ INLINE void codeclib_init(int print) {
 INLINE void codeclib_free(void) {
 	;
 }
+INLINE void codeclib_benchmark(void) {
+	;
+}
 
 INLINE const codec_def_t *codec_find(const str *name, enum media_type type) {
 	return NULL;
@@ -1,7 +1,9 @@
 #include "dtmflib.h"
 #include <math.h>
+#include <string.h>
 #include "compat.h"
 #include "log.h"
+#include "auxlib.h"
 
 struct dtmf_freq {
 	unsigned int prim,
@@ -35,11 +37,64 @@ INLINE double freq2iter(unsigned int hz, unsigned int sample_rate) {
 	return ret;
 }
 
+static void dtmf_samples_calc(int16_t *samples, unsigned long offset, unsigned long num,
+		const struct dtmf_freq *df, unsigned int volume, unsigned int sample_rate)
+{
+	double vol = pow(1.122018, volume) * 2.0;
+
+	double prim_freq = freq2iter(df->prim, sample_rate);
+	double sec_freq = freq2iter(df->sec, sample_rate);
+
+	num += offset; // end here
+	while (offset < num) {
+		double prim = sin(prim_freq * offset) / vol;
+		double sec = sin(sec_freq * offset) / vol;
+		int16_t sample = prim * 32767.0 + sec * 32767.0;
+		*samples++ = sample;
+		offset++;
+	}
+}
+
+// The first half second of each tone is computed once per event, volume and sample rate
+// and then copied out, which covers typical digit lengths. Longer tones are computed from
+// there on. Tables are never freed.
+#define DTMF_TABLE_MS 500
+
+struct dtmf_table {
+	unsigned long len;
+	int16_t samples[0];
+};
+
+static mutex_t dtmf_tables_lock = MUTEX_STATIC_INIT;
+static GHashTable *dtmf_tables; // (sample rate << 16 | volume << 8 | event) -> struct dtmf_table
+
+static const struct dtmf_table *dtmf_table_get(unsigned int event, unsigned int volume,
+		unsigned int sample_rate)
+{
+	uint64_t key = (uint64_t) sample_rate << 16 | (volume & 0xff) << 8 | event;
+
+	mutex_lock(&dtmf_tables_lock);
+	if (!dtmf_tables)
+		dtmf_tables = g_hash_table_new(g_int64_hash, g_int64_equal);
+	struct dtmf_table *t = g_hash_table_lookup(dtmf_tables, &key);
+	if (!t) {
+		unsigned long len = (unsigned long) sample_rate * DTMF_TABLE_MS / 1000;
+		t = g_malloc(sizeof(*t) + len * sizeof(*t->samples));
+		t->len = len;
+		dtmf_samples_calc(t->samples, 0, len, &dtmf_freqs[event], volume, sample_rate);
+		uint64_t *k = g_new(uint64_t, 1);
+		*k = key;
+		g_hash_table_insert(dtmf_tables, k, t);
+	}
+	mutex_unlock(&dtmf_tables_lock);
+
+	return t;
+}
+
 void dtmf_samples(void *buf, unsigned long offset, unsigned long num, unsigned int event, unsigned int volume,
 		unsigned int sample_rate)
 {
 	int16_t *samples = buf;
-	const struct dtmf_freq *df;
 
 	if (event == 0xff) {
 		// pause - silence samples
@@ -47,25 +102,168 @@ void dtmf_samples(void *buf, unsigned long offset, unsigned long num, unsigned i
 		return;
 	}
 
-	if (event > G_N_ELEMENTS(dtmf_freqs)) {
+	if (event >= G_N_ELEMENTS(dtmf_freqs)) {
 		ilog(LOG_WARN | LOG_FLAG_LIMIT, "Unsupported DTMF event %u", event);
 		memset(buf, 0, num * 2);
 		return;
 	}
-	df = &dtmf_freqs[event];
 
-	// XXX initialise/save these when the DTMF event starts
-	double vol = pow(1.122018, volume) * 2.0;
+	const struct dtmf_table *t = dtmf_table_get(event, volume, sample_rate);
+	if (offset < t->len) {
+		unsigned long n = MIN(num, t->len - offset);
+		memcpy(samples, t->samples + offset, n * sizeof(*samples));
+		samples += n;
+		offset += n;
+		num -= n;
+	}
+	if (num)
+		dtmf_samples_calc(samples, offset, num, &dtmf_freqs[event], volume, sample_rate);
+}
 
-	double prim_freq = freq2iter(df->prim, sample_rate);
-	double sec_freq = freq2iter(df->sec, sample_rate);
 
-	num += offset; // end here
-	while (offset < num) {
-		double prim = sin(prim_freq * offset) / vol;
-		double sec = sin(sec_freq * offset) / vol;
-		int16_t sample = prim * 32767.0 + sec * 32767.0;
-		*samples++ = sample;
-		offset++;
+
+// 102 samples per Goertzel block at 8 kHz (12.75 ms), same as spandsp
+#define DTMF_BLOCK 102
+// 0 dBm0 in linear 16-bit PCM is a sine with amplitude 22930, i.e. a mean power of 22930^2/2
+#define DTMF_DBM0_POWER 262892450.0f
+// each tone must be at least -30 dBm0: (22930 * 10^(-30/20) * DTMF_BLOCK/2)^2
+#define DTMF_THRESHOLD 1.3676e9f
+// high group may be at most 8 dB stronger than low group, low group at most 4 dB stronger
+#define DTMF_NORMAL_TWIST 6.3f
+#define DTMF_REVERSE_TWIST 2.5f
+// strongest tone of each group must be 8 dB above the others in its group
+#define DTMF_RELATIVE_PEAK 6.3f
+// share of total block energy that must be found in the two tones
+#define DTMF_TO_TOTAL_ENERGY (0.4f * DTMF_BLOCK)
+
+// 2 * cos(2 * pi * f / 8000) for 697, 770, 852, 941, 1209, 1336, 1477, 1633 Hz
+static const float dtmf_detect_coeffs[DTMF_DETECT_FREQS] = {
+	1.707738f, 1.645281f, 1.568687f, 1.478205f,
+	1.164104f, 0.996370f, 0.798618f, 0.568533f,
+};
+static const char dtmf_detect_codes[4][4] = {
+	{ '1', '2', '3', 'A' },
+	{ '4', '5', '6', 'B' },
+	{ '7', '8', '9', 'C' },
+	{ '*', '0', '#', 'D' },
+};
+
+
+void dtmf_detect_init(struct dtmf_detect *dd, dtmf_detect_cb *callback, void *ptr) {
+	*dd = (struct dtmf_detect) { .callback = callback, .callback_ptr = ptr };
+}
+
+static char dtmf_detect_block(struct dtmf_detect *dd) {
+	float mag[DTMF_DETECT_FREQS];
+
+	for (unsigned int k = 0; k < DTMF_DETECT_FREQS; k++)
+		mag[k] = dd->q1[k] * dd->q1[k] + dd->q2[k] * dd->q2[k]
+			- dtmf_detect_coeffs[k] * dd->q1[k] * dd->q2[k];
+
+	unsigned int row = 0, col = 4;
+	for (unsigned int k = 1; k < 4; k++) {
+		if (mag[k] > mag[row])
+			row = k;
+		if (mag[k + 4] > mag[col])
+			col = k + 4;
+	}
+
+	char hit = 0;
+
+	if (mag[row] < DTMF_THRESHOLD || mag[col] < DTMF_THRESHOLD)
+		goto out;
+	if (mag[col] > mag[row] * DTMF_NORMAL_TWIST || mag[row] > mag[col] * DTMF_REVERSE_TWIST)
+		goto out;
+	for (unsigned int k = 0; k < DTMF_DETECT_FREQS; k++) {
+		if (k == row || k == col)
+			continue;
+		if (mag[k] * DTMF_RELATIVE_PEAK > mag[k < 4 ? row : col])
+			goto out;
+	}
+	if (mag[row] + mag[col] < dd->energy * DTMF_TO_TOTAL_ENERGY)
+		goto out;
+
+	hit = dtmf_detect_codes[row][col - 4];
+	dd->level = lrintf(10.0f * log10f(dd->energy / DTMF_BLOCK / DTMF_DBM0_POWER));
+
+out:
+	memset(dd->q1, 0, sizeof(dd->q1));
+	memset(dd->q2, 0, sizeof(dd->q2));
+	dd->energy = 0;
+	return hit;
+}
+
+static void dtmf_detect_report(struct dtmf_detect *dd, char hit) {
+	// two consecutive blocks with the same result are required for a state change
+	if (hit == dd->last_hit && hit != dd->current) {
+		dd->current = hit;
+		if (dd->callback)
+			dd->callback(dd->callback_ptr, hit, hit ? dd->level : -99, dd->delay);
+		dd->delay = 0;
+	}
+	dd->last_hit = hit;
+}
+
+void dtmf_detect(struct dtmf_detect *dd, const int16_t *samples, unsigned int num) {
+	while (num) {
+		unsigned int len = DTMF_BLOCK - dd->block_pos;
+		if (len > num)
+			len = num;
+
+		// the inner loop runs all eight filters in lock step so that the compiler
+		// can keep them in vector registers
+		float q1[DTMF_DETECT_FREQS], q2[DTMF_DETECT_FREQS];
+		memcpy(q1, dd->q1, sizeof(q1));
+		memcpy(q2, dd->q2, sizeof(q2));
+		float energy = dd->energy;
+
+		for (unsigned int i = 0; i < len; i++) {
+			float x = samples[i];
+			energy += x * x;
+			for (unsigned int k = 0; k < DTMF_DETECT_FREQS; k++) {
+				float q0 = dtmf_detect_coeffs[k] * q1[k] - q2[k] + x;
+				q2[k] = q1[k];
+				q1[k] = q0;
+			}
+		}
+
+		memcpy(dd->q1, q1, sizeof(q1));
+		memcpy(dd->q2, q2, sizeof(q2));
+		dd->energy = energy;
+
+		samples += len;
+		num -= len;
+		dd->delay += len;
+		dd->block_pos += len;
+
+		if (dd->block_pos == DTMF_BLOCK) {
+			dd->block_pos = 0;
+			dtmf_detect_report(dd, dtmf_detect_block(dd));
+		}
 	}
 }
+
+// feeds `num` samples of silence into the detector
+void dtmf_detect_fillin(struct dtmf_detect *dd, unsigned int num) {
+	static const int16_t silence[DTMF_BLOCK];
+
+	// three blocks of silence are enough to settle the state, anything beyond
+	// that only needs to be accounted for
+	unsigned int rem = 0;
+	if (num > DTMF_BLOCK * 3) {
+		rem = num - DTMF_BLOCK * 3;
+		num = DTMF_BLOCK * 3;
+	}
+	while (num) {
+		unsigned int len = MIN(num, DTMF_BLOCK);
+		dtmf_detect(dd, silence, len);
+		num -= len;
+	}
+	dd->delay += rem;
+}
+
+// processes several independent streams in one pass, sharing the coefficient tables
+void dtmf_detect_batch(const struct dtmf_detect_job *jobs, unsigned int num_jobs) {
+	for (unsigned int i = 0; i < num_jobs; i++)
+		dtmf_detect(jobs[i].dd, jobs[i].samples, jobs[i].num);
+}
@@ -26,4 +26,38 @@ void dtmf_samples(void *buf, unsigned long offset, unsigned long num, unsigned i
 		unsigned int sample_rate);
 
 
+// Goertzel based DTMF detector for 8 kHz S16 mono audio. The callback is invoked
+// with the same semantics as spandsp's realtime callback: an ASCII event code at
+// the start of a tone, code 0 and level -99 at its end, and the number of samples
+// since the previous report as `delay`.
+#define DTMF_DETECT_FREQS 8
+
+typedef void dtmf_detect_cb(void *, int code, int level, int delay);
+
+struct dtmf_detect {
+	dtmf_detect_cb *callback;
+	void *callback_ptr;
+	float q1[DTMF_DETECT_FREQS],
+	      q2[DTMF_DETECT_FREQS];
+	float energy;
+	unsigned int block_pos;
+	unsigned int delay;
+	char last_hit,
+	     current;
+	int level;
+};
+
+// one stream's worth of work for dtmf_detect_batch()
+struct dtmf_detect_job {
+	struct dtmf_detect *dd;
+	const int16_t *samples;
+	unsigned int num;
+};
+
+void dtmf_detect_init(struct dtmf_detect *, dtmf_detect_cb *, void *);
+void dtmf_detect(struct dtmf_detect *, const int16_t *samples, unsigned int num);
+void dtmf_detect_fillin(struct dtmf_detect *, unsigned int num);
+void dtmf_detect_batch(const struct dtmf_detect_job *, unsigned int num_jobs);
+
+
 #endif
@@ -17,6 +17,23 @@ struct log_limiter_entry {
 	char *msg;
 };
 
+// single producer (the owning thread), single consumer (the log thread). head and tail
+// are running byte offsets, entries are 8-byte aligned and never wrap around the end
+struct log_ring {
+	volatile unsigned int head;
+	volatile unsigned int tail;
+	volatile unsigned int dropped;
+	unsigned int dropped_reported;
+	volatile int orphaned;
+	char buf[LOG_RING_SIZE];
+};
+
+struct log_ring_entry {
+	int prio; // -1: skip to the start of the buffer
+	unsigned int len;
+	char msg[];
+};
+
 typedef struct _fac_code {
 	char	*c_name;
 	int	c_val;
@@ -76,6 +93,14 @@ static pthread_mutex_t __log_limiter_lock;
 static GStringChunk *__log_limiter_strings;
 static unsigned int __log_limiter_count;
 
+static write_log_t *log_async_dest;
+static GList *log_rings;
+static pthread_mutex_t log_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_ring_key;
+static pthread_t log_async_thread;
+static volatile int log_async_running;
+static __thread struct log_ring *log_ring;
+
 
 
 
@@ -127,6 +152,184 @@ static void log_both(int facility_priority, const char *format, ...) {
 
 
 
+
+#define LOG_RING_ALIGN(l) (((l) + 7) & ~7U)
+
+static void log_ring_orphan(void *p) {
+	struct log_ring *r = p;
+	g_atomic_int_set(&r->orphaned, 1);
+}
+
+static struct log_ring *log_ring_get(void) {
+	if (G_LIKELY(log_ring))
+		return log_ring;
+
+	log_ring = g_malloc(sizeof(*log_ring));
+	log_ring->head = log_ring->tail = 0;
+	log_ring->dropped = log_ring->dropped_reported = 0;
+	log_ring->orphaned = 0;
+	pthread_setspecific(log_ring_key, log_ring);
+
+	pthread_mutex_lock(&log_rings_lock);
+	log_rings = g_list_prepend(log_rings, log_ring);
+	pthread_mutex_unlock(&log_rings_lock);
+
+	return log_ring;
+}
+
+// never blocks: if the log thread can't keep up, the message is dropped and counted
+static void log_ring_push(struct log_ring *r, int prio, const char *msg, unsigned int len) {
+	if (len > LOG_RING_SIZE / 4)
+		len = LOG_RING_SIZE / 4;
+
+	unsigned int need = LOG_RING_ALIGN(sizeof(struct log_ring_entry) + len + 1);
+	unsigned int head = r->head;
+	unsigned int space = LOG_RING_SIZE - (head - g_atomic_int_get(&r->tail));
+	unsigned int off = head % LOG_RING_SIZE;
+	unsigned int contig = LOG_RING_SIZE - off;
+
+	if (contig < need) {
+		if (space < contig + need)
+			goto drop;
+		struct log_ring_entry *skip = (void *) (r->buf + off);
+		skip->prio = -1;
+		head += contig;
+		off = 0;
+	}
+	else if (space < need)
+		goto drop;
+
+	struct log_ring_entry *e = (void *) (r->buf + off);
+	e->prio = prio;
+	e->len = len;
+	memcpy(e->msg, msg, len);
+	e->msg[len] = '\0';
+
+	g_atomic_int_set(&r->head, head + need);
+	return;
+
+drop:
+	g_atomic_int_inc(&r->dropped);
+}
+
+// returns the number of messages written out
+static unsigned int log_ring_drain(struct log_ring *r) {
+	unsigned int num = 0;
+	unsigned int tail = r->tail;
+	unsigned int head = g_atomic_int_get(&r->head);
+
+	while (tail != head) {
+		unsigned int off = tail % LOG_RING_SIZE;
+		struct log_ring_entry *e = (void *) (r->buf + off);
+		if (e->prio == -1) {
+			tail += LOG_RING_SIZE - off;
+			continue;
+		}
+		log_async_dest(e->prio, "%s", e->msg);
+		tail += LOG_RING_ALIGN(sizeof(*e) + e->len + 1);
+		num++;
+	}
+	g_atomic_int_set(&r->tail, tail);
+
+	unsigned int dropped = g_atomic_int_get(&r->dropped);
+	if (dropped != r->dropped_reported) {
+		log_async_dest(LOG_WARN, "WARNING: %u log messages dropped from a full log buffer",
+				dropped - r->dropped_reported);
+		r->dropped_reported = dropped;
+	}
+
+	return num;
+}
+
+// returns the number of messages written out
+static unsigned int log_rings_drain(void) {
+	unsigned int num = 0;
+
+	pthread_mutex_lock(&log_rings_lock);
+	for (GList *l = log_rings; l; ) {
+		struct log_ring *r = l->data;
+		GList *next = l->next;
+		// read the flag first, so that nothing written before the thread exited is missed
+		int orphaned = g_atomic_int_get(&r->orphaned);
+		num += log_ring_drain(r);
+		if (orphaned) {
+			log_rings = g_list_delete_link(log_rings, l);
+			g_free(r);
+		}
+		l = next;
+	}
+	pthread_mutex_unlock(&log_rings_lock);
+
+	return num;
+}
+
+static void *log_async_loop(void *p) {
+	while (g_atomic_int_get(&log_async_running)) {
+		if (!log_rings_drain())
+			usleep(LOG_ASYNC_SLEEP_US);
+	}
+	log_rings_drain();
+	return NULL;
+}
+
+static void log_async(int facility_priority, const char *format, ...) {
+	va_list ap;
+	char buf[1024];
+	char *msg = buf;
+
+	// fatal messages usually precede an exit() and must not get lost
+	if (LOG_LEVEL_MASK(facility_priority) <= LOG_CRIT || !g_atomic_int_get(&log_async_running)) {
+		va_start(ap, format);
+		char *s = g_strdup_vprintf(format, ap);
+		va_end(ap);
+		log_async_dest(facility_priority, "%s", s);
+		g_free(s);
+		return;
+	}
+
+	va_start(ap, format);
+	int len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	if (len < 0)
+		return;
+	if ((size_t) len >= sizeof(buf)) {
+		va_start(ap, format);
+		len = g_vasprintf(&msg, format, ap);
+		va_end(ap);
+	}
+
+	log_ring_push(log_ring_get(), facility_priority, msg, len);
+
+	if (msg != buf)
+		g_free(msg);
+}
+
+// must be called once the final log destination is known, i.e. after daemonize()
+void log_async_start(void) {
+	if (!rtpe_common_config_ptr->log_async || log_async_running)
+		return;
+
+	pthread_key_create(&log_ring_key, log_ring_orphan);
+	log_async_dest = write_log;
+	log_async_running = 1;
+	if (pthread_create(&log_async_thread, NULL, log_async_loop, NULL)) {
+		log_async_running = 0;
+		return;
+	}
+	write_log = (write_log_t *) log_async;
+}
+
+static void log_async_stop(void) {
+	if (!log_async_running)
+		return;
+	g_atomic_int_set(&log_async_running, 0);
+	pthread_join(log_async_thread, NULL);
+	write_log = log_async_dest;
+	log_rings_drain();
+}
+
+
+
 void __vpilog(int prio, const char *prefix, const char *fmt, va_list ap) {
 	AUTO_CLEANUP_GBUF(msg);
 	char *piece;
@@ -245,6 +448,7 @@ void log_init(const char *handle) {
 }
 
 void log_free() {
+	log_async_stop();
 	g_hash_table_destroy(__log_limiter);
 	g_string_chunk_free(__log_limiter_strings);
 	pthread_mutex_destroy(&__log_limiter_lock);
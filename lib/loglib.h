@@ -14,6 +14,10 @@ extern int ilog_facility;
 extern unsigned int max_log_line_length;
 
 
+#define LOG_RING_SIZE		65536	// per thread, only with --log-async
+#define LOG_ASYNC_SLEEP_US	5000
+
+
 typedef void write_log_t(int facility_priority, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
 extern write_log_t *write_log;
 
@@ -23,6 +27,7 @@ void print_available_log_facilities (void);
 void log_to_stderr(int facility_priority, const char *format, ...) __attribute__ ((format (printf, 2, 3)));
 
 void log_init(const char *);
+void log_async_start(void);
 void log_free(void);
 
 void __vpilog(int prio, const char *prefix, const char *fmt, va_list);
@@ -0,0 +1,29 @@
+#ifndef _METACHUNK_H_
+#define _METACHUNK_H_
+
+#include <stdint.h>
+
+
+// Besides appending to the metadata file in the spool directory, rtpengine also sends
+// each chunk as one datagram to this unix socket in the same directory if the
+// recording daemon is listening on it. The datagram carries the chunk's position in
+// the file, so that the recording daemon can skip chunks it has already read from the
+// file and go back to reading the file if it missed one.
+
+#define METACHUNK_SOCKET_NAME	"metadata.sock"
+#define METACHUNK_MAGIC		0x524d4331 // "RMC1"
+#define METACHUNK_MAX_SIZE	(256 * 1024)
+
+struct metachunk_hdr {
+	uint32_t	magic;
+	uint16_t	name_len;	// metadata file name, without the directory
+	uint16_t	label_len;	// section header
+	uint32_t	content_len;
+	uint32_t	__pad;
+	uint64_t	file_start;	// offset of this chunk in the metadata file
+	uint64_t	file_end;	// offset past the end of this chunk
+	// followed by name, label and content, not NUL-terminated
+};
+
+
+#endif
@@ -6,6 +6,7 @@
 #include <libavutil/channel_layout.h>
 #include <libavutil/mathematics.h>
 #include <inttypes.h>
+#include <math.h>
 #include <libswresample/swresample.h>
 #include <libavutil/opt.h>
 #include <libavutil/frame.h>
@@ -14,6 +15,212 @@
 #include "fix_frame_channel_layout.h"
 
 
+// Integer ratio conversions (8k <> 16k, 8k <> 48k etc) between S16 formats with
+// the same channel count are done with a built-in polyphase FIR filter instead of
+// swresample. Filters depend only on the conversion parameters and are shared
+// between all resamplers once built.
+
+#define RESAMPLE_MAX_RATIO 12
+#define RESAMPLE_TAPS 16 // per phase, multiplied by the ratio when decimating
+#define RESAMPLE_TAPS_LOW 6 // same, with resample_low_quality
+#define SWR_FILTER_SIZE_LOW 8 // swresample's default is 32
+#define RESAMPLE_COEFF_SHIFT 14
+
+struct resample_filter {
+	int in_rate,
+	    out_rate,
+	    channels,
+	    format,
+	    low_quality;
+	unsigned int up,
+		     down;
+	unsigned int taps; // per phase
+	int16_t *coeffs; // `up` phases of `taps` each, stored in input sample order
+};
+
+static mutex_t resample_filters_lock = MUTEX_STATIC_INIT;
+static GQueue resample_filters = G_QUEUE_INIT; // only ever a handful of entries
+
+int resample_low_quality;
+
+
+
+
+static struct resample_filter *resample_filter_new(int in_rate, int out_rate, int channels, int format,
+		int low_quality, unsigned int up, unsigned int down)
+{
+	unsigned int ratio = up > down ? up : down;
+	unsigned int taps = (low_quality ? RESAMPLE_TAPS_LOW : RESAMPLE_TAPS) * (down > 1 ? down : 1);
+	unsigned int len = taps * up; // prototype filter, running at the upsampled rate
+	double cutoff = 0.45 / ratio; // a bit under Nyquist of the lower rate
+	double centre = (len - 1) / 2.0;
+	double proto[len];
+	double sum = 0;
+
+	for (unsigned int n = 0; n < len; n++) {
+		double x = n - centre;
+		double v = (x == 0) ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * x) / (M_PI * x);
+		// Blackman window
+		v *= 0.42 - 0.5 * cos(2.0 * M_PI * n / (len - 1)) + 0.08 * cos(4.0 * M_PI * n / (len - 1));
+		proto[n] = v;
+		sum += v;
+	}
+
+	struct resample_filter *f = g_slice_alloc0(sizeof(*f));
+	f->in_rate = in_rate;
+	f->out_rate = out_rate;
+	f->channels = channels;
+	f->format = format;
+	f->low_quality = low_quality;
+	f->up = up;
+	f->down = down;
+	f->taps = taps;
+	f->coeffs = g_malloc(sizeof(*f->coeffs) * len);
+
+	// unity gain, and split into phases. the coefficient applied to the newest
+	// input sample goes last so that filtering is a plain dot product
+	double gain = up / sum * (1 << RESAMPLE_COEFF_SHIFT);
+	for (unsigned int p = 0; p < up; p++) {
+		for (unsigned int k = 0; k < taps; k++)
+			f->coeffs[p * taps + (taps - 1 - k)] = lrint(proto[p + k * up] * gain);
+	}
+
+	return f;
+}
+
+static const struct resample_filter *resample_filter_get(const AVFrame *frame, const format_t *to_format,
+		int low_quality)
+{
+	if (frame->format != AV_SAMPLE_FMT_S16 || to_format->format != AV_SAMPLE_FMT_S16)
+		return NULL;
+	if (frame->channels != to_format->channels)
+		return NULL;
+	if (frame->sample_rate <= 0 || to_format->clockrate <= 0)
+		return NULL;
+
+	unsigned int up = 1, down = 1;
+	if (to_format->clockrate % frame->sample_rate == 0)
+		up = to_format->clockrate / frame->sample_rate;
+	else if (frame->sample_rate % to_format->clockrate == 0)
+		down = frame->sample_rate / to_format->clockrate;
+	else
+		return NULL;
+	if (up > RESAMPLE_MAX_RATIO || down > RESAMPLE_MAX_RATIO)
+		return NULL;
+
+	struct resample_filter *ret = NULL;
+
+	mutex_lock(&resample_filters_lock);
+	for (GList *l = resample_filters.head; l; l = l->next) {
+		struct resample_filter *f = l->data;
+		if (f->in_rate == frame->sample_rate && f->out_rate == to_format->clockrate
+				&& f->channels == frame->channels && f->format == frame->format
+				&& f->low_quality == low_quality)
+		{
+			ret = f;
+			break;
+		}
+	}
+	if (!ret) {
+		ret = resample_filter_new(frame->sample_rate, to_format->clockrate, frame->channels,
+				frame->format, low_quality, up, down);
+		g_queue_push_tail(&resample_filters, ret);
+	}
+	mutex_unlock(&resample_filters_lock);
+
+	return ret;
+}
+
+// kept free of anything that stops the compiler from vectorising it
+INLINE int32_t resample_dot(const int16_t *x, const int16_t *c, unsigned int n) {
+	int32_t acc = 0;
+	for (unsigned int i = 0; i < n; i++)
+		acc += (int32_t) x[i] * c[i];
+	return acc;
+}
+
+static AVFrame *resample_native(resample_t *resample, AVFrame *frame, const format_t *to_format,
+		uint64_t to_channel_layout)
+{
+	const struct resample_filter *f = resample->filter;
+	unsigned int channels = f->channels;
+	unsigned int hist_len = f->taps - 1;
+	unsigned int n = frame->nb_samples;
+
+	if (!resample->history)
+		resample->history = g_malloc0(sizeof(*resample->history) * hist_len * channels);
+	if (resample->work_len < hist_len + n) {
+		g_free(resample->work);
+		resample->work_len = hist_len + n;
+		resample->work = g_malloc(sizeof(*resample->work) * resample->work_len);
+	}
+
+	// position of the first output sample at the upsampled rate
+	unsigned int in_end = n * f->up;
+	unsigned int out_samples = 0;
+	if (in_end > resample->offset)
+		out_samples = (in_end - resample->offset + f->down - 1) / f->down;
+
+	AVFrame *out = codeclib_frame_alloc();
+	if (!out)
+		return NULL;
+	av_frame_copy_props(out, frame);
+	out->format = to_format->format;
+	out->channel_layout = to_channel_layout;
+	out->nb_samples = out_samples;
+	out->sample_rate = to_format->clockrate;
+	if (out_samples && codec_buffer_pool_frame(&resample->frame_pool, out) < 0) {
+		codeclib_frame_free(&out);
+		return NULL;
+	}
+
+	const int16_t *src = (const int16_t *) frame->extended_data[0];
+	int16_t *dst = out_samples ? (int16_t *) out->extended_data[0] : NULL;
+	int16_t *work = resample->work;
+	unsigned int pos = resample->offset;
+
+	for (unsigned int c = 0; c < channels; c++) {
+		int16_t *hist = resample->history + c * hist_len;
+
+		// history followed by this frame's samples for this channel
+		memcpy(work, hist, sizeof(*work) * hist_len);
+		for (unsigned int i = 0; i < n; i++)
+			work[hist_len + i] = src[i * channels + c];
+
+		pos = resample->offset;
+		for (unsigned int o = 0; o < out_samples; o++, pos += f->down) {
+			unsigned int idx = pos / f->up;
+			unsigned int phase = pos % f->up;
+			int32_t acc = resample_dot(work + idx, f->coeffs + phase * f->taps, f->taps);
+			acc = (acc + (1 << (RESAMPLE_COEFF_SHIFT - 1))) >> RESAMPLE_COEFF_SHIFT;
+			if (acc > INT16_MAX)
+				acc = INT16_MAX;
+			else if (acc < INT16_MIN)
+				acc = INT16_MIN;
+			dst[o * channels + c] = acc;
+		}
+
+		memcpy(hist, work + n, sizeof(*hist) * hist_len);
+	}
+
+	resample->offset = pos - in_end;
+	out->pts = av_rescale(frame->pts, to_format->clockrate, frame->sample_rate);
+	return out;
+}
+
+static void resample_reset(resample_t *resample) {
+	swr_free(&resample->swresample);
+	resample->filter = NULL;
+	g_free(resample->history);
+	resample->history = NULL;
+	g_free(resample->work);
+	resample->work = NULL;
+	resample->work_len = 0;
+	resample->offset = 0;
+	ZERO(resample->in_format);
+	codec_buffer_pool_free(&resample->frame_pool);
+}
+
 
 
 AVFrame *resample_frame(resample_t *resample, AVFrame *frame, const format_t *to_format) {
@@ -30,10 +237,39 @@ AVFrame *resample_frame(resample_t *resample, AVFrame *frame, const format_t *to
 	if (frame->channel_layout != to_channel_layout)
 		goto resample;
 
-	return av_frame_clone(frame);
+	AVFrame *clone = codeclib_frame_alloc();
+	if (clone && av_frame_ref(clone, frame) < 0)
+		codeclib_frame_free(&clone);
+	return clone;
 
 resample:
 
+	int low_quality = g_atomic_int_get(&resample_low_quality);
+
+	// input format or quality change: start over
+	if (resample->in_format.clockrate && (resample->in_format.clockrate != frame->sample_rate
+				|| resample->in_format.channels != frame->channels
+				|| resample->in_format.format != frame->format
+				|| resample->low_quality != low_quality))
+		resample_reset(resample);
+
+	if (!resample->in_format.clockrate) {
+		resample->in_format.clockrate = frame->sample_rate;
+		resample->in_format.channels = frame->channels;
+		resample->in_format.format = frame->format;
+		resample->low_quality = low_quality;
+		if (frame->channel_layout == to_channel_layout)
+			resample->filter = resample_filter_get(frame, to_format, low_quality);
+	}
+
+	if (resample->filter) {
+		AVFrame *ret = resample_native(resample, frame, to_format, to_channel_layout);
+		err = "failed to alloc resampling frame";
+		if (!ret)
+			goto err;
+		return ret;
+	}
+
 	if (G_UNLIKELY(!resample->swresample)) {
 		resample->swresample = swr_alloc_set_opts(NULL,
 				to_channel_layout,
@@ -47,6 +283,9 @@ resample:
 		if (!resample->swresample)
 			goto err;
 
+		if (resample->low_quality)
+			av_opt_set_int(resample->swresample, "filter_size", SWR_FILTER_SIZE_LOW, 0);
+
 		err = "failed to init resample context";
 		if ((errcode = swr_init(resample->swresample)) < 0)
 			goto err;
@@ -58,7 +297,7 @@ resample:
 			+ frame->nb_samples,
 				to_format->clockrate, frame->sample_rate, AV_ROUND_UP);
 
-	AVFrame *swr_frame = av_frame_alloc();
+	AVFrame *swr_frame = codeclib_frame_alloc();
 
 	err = "failed to alloc resampling frame";
 	if (!swr_frame)
@@ -69,7 +308,7 @@ resample:
 	swr_frame->nb_samples = dst_samples;
 	swr_frame->sample_rate = to_format->clockrate;
 	err = "failed to get resample buffers";
-	if ((errcode = av_frame_get_buffer(swr_frame, 0)) < 0)
+	if ((errcode = codec_buffer_pool_frame(&resample->frame_pool, swr_frame)) < 0)
 		goto err;
 
 	int ret_samples = swr_convert(resample->swresample, swr_frame->extended_data,
@@ -95,5 +334,13 @@ err:
 
 
 void resample_shutdown(resample_t *resample) {
-	swr_free(&resample->swresample);
+	resample_reset(resample);
+}
+
+void resample_cleanup(void) {
+	struct resample_filter *f;
+	while ((f = g_queue_pop_head(&resample_filters))) {
+		g_free(f->coeffs);
+		g_slice_free1(sizeof(*f), f);
+	}
 }
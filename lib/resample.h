@@ -6,8 +6,14 @@
 #include <libavutil/frame.h>
 
 
+// shorter filters for cheaper resampling under overload. can be changed at any time,
+// running resamplers start over with their next frame
+extern int resample_low_quality;
+
+
 AVFrame *resample_frame(resample_t *resample, AVFrame *frame, const format_t *to_format);
 void resample_shutdown(resample_t *resample);
+void resample_cleanup(void);
 
 
 #endif
@@ -6,14 +6,6 @@
 
 
 
-struct rtp_extension {
-	u_int16_t undefined;
-	u_int16_t length;
-} __attribute__ ((packed));
-
-
-
-
 #define RFC_TYPE_FULL(type, name, c_rate, chans, pt)			\
 	[type] = {							\
 		.payload_type		= type,				\
@@ -60,43 +52,31 @@ const int num_rfc_rtp_payload_types = G_N_ELEMENTS(rfc_rtp_payload_types);
 
 
 int rtp_payload(struct rtp_header **out, str *p, const str *s) {
-	struct rtp_header *rtp;
-	struct rtp_extension *ext;
+	struct re_demux d;
+
+	re_demux(&d, (const unsigned char *) s->s, s->len);
+	return rtp_payload_demuxed(out, p, s, &d);
+}
+
+int rtp_payload_demuxed(struct rtp_header **out, str *p, const str *s, const struct re_demux *d) {
 	const char *err;
 
 	err = "short packet (header)";
-	if (s->len < sizeof(*rtp))
+	if (s->len < sizeof(struct rtp_header))
 		goto error;
-
-	rtp = (void *) s->s;
 	err = "invalid header version";
-	if ((rtp->v_p_x_cc & 0xc0) != 0x80) /* version 2 */
+	if ((s->s[0] & 0xc0) != 0x80) /* version 2 */
 		goto error;
-
-	if (!p)
-		goto done;
-
-	*p = *s;
-	/* fixed header */
-	str_shift(p, sizeof(*rtp));
-	/* csrc list */
-	err = "short packet (CSRC list)";
-	if (str_shift(p, (rtp->v_p_x_cc & 0xf) * 4))
+	err = "short packet (CSRC list or header extensions)";
+	if (!d->rtp_hdr_len)
 		goto error;
 
-	if ((rtp->v_p_x_cc & 0x10)) {
-		/* extension */
-		err = "short packet (extension header)";
-		if (p->len < sizeof(*ext))
-			goto error;
-		ext = (void *) p->s;
-		err = "short packet (header extensions)";
-		if (str_shift(p, 4 + ntohs(ext->length) * 4))
-			goto error;
+	if (p) {
+		*p = *s;
+		str_shift(p, d->rtp_hdr_len);
 	}
 
-done:
-	*out = rtp;
+	*out = (void *) s->s;
 
 	return 0;
 
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include "str.h"
 #include "codeclib.h"
+#include "rtpengine_demux.h"
 
 
 struct rtp_header {
@@ -41,6 +42,7 @@ extern const int num_rfc_rtp_payload_types;
 
 
 int rtp_payload(struct rtp_header **out, str *p, const str *s);
+int rtp_payload_demuxed(struct rtp_header **out, str *p, const str *s, const struct re_demux *);
 int rtp_padding(struct rtp_header *header, str *payload);
 const struct rtp_payload_type *rtp_get_rfc_payload_type(unsigned int type);
 const struct rtp_payload_type *rtp_get_rfc_codec(const str *codec);
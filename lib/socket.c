@@ -7,10 +7,18 @@
 #include <netinet/ip6.h>
 #include <netinet/udp.h>
 #include <sys/socket.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
 #include "str.h"
 #include "xt_RTPENGINE.h"
 #include "log.h"
 
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+static enum socket_ts_mode socket_ts_mode;
+
 static int __ip4_addr_parse(sockaddr_t *dst, const char *src);
 static int __ip6_addr_parse(sockaddr_t *dst, const char *src);
 static int __ip4_addr_print(const sockaddr_t *a, char *buf, size_t len);
@@ -35,8 +43,10 @@ static int __ip4_addrport2sockaddr(void *, const sockaddr_t *, unsigned int);
 static int __ip6_addrport2sockaddr(void *, const sockaddr_t *, unsigned int);
 static ssize_t __ip_recvfrom(socket_t *s, void *buf, size_t len, endpoint_t *ep);
 static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *);
+static int __ip_recvmmsg_ts(socket_t *s, struct socket_mmsg *, unsigned int);
 static ssize_t __ip_sendmsg(socket_t *s, struct msghdr *mh, const endpoint_t *ep);
 static ssize_t __ip_sendto(socket_t *s, const void *buf, size_t len, const endpoint_t *ep);
+static int __ip_sendmmsg(socket_t *s, struct socket_mmsg *, unsigned int, unsigned int);
 static int __ip4_tos(socket_t *, unsigned int);
 static int __ip6_tos(socket_t *, unsigned int);
 static int __ip_error(socket_t *s);
@@ -82,8 +92,10 @@ static struct socket_family __socket_families[__SF_LAST] = {
 		.timestamping		= __ip_timestamping,
 		.recvfrom		= __ip_recvfrom,
 		.recvfrom_ts		= __ip_recvfrom_ts,
+		.recvmmsg_ts		= __ip_recvmmsg_ts,
 		.sendmsg		= __ip_sendmsg,
 		.sendto			= __ip_sendto,
+		.sendmmsg		= __ip_sendmmsg,
 		.tos			= __ip4_tos,
 		.error			= __ip_error,
 		.endpoint2kernel	= __ip4_endpoint2kernel,
@@ -113,8 +125,10 @@ static struct socket_family __socket_families[__SF_LAST] = {
 		.timestamping		= __ip_timestamping,
 		.recvfrom		= __ip_recvfrom,
 		.recvfrom_ts		= __ip_recvfrom_ts,
+		.recvmmsg_ts		= __ip_recvmmsg_ts,
 		.sendmsg		= __ip_sendmsg,
 		.sendto			= __ip_sendto,
+		.sendmmsg		= __ip_sendmmsg,
 		.tos			= __ip6_tos,
 		.error			= __ip_error,
 		.endpoint2kernel	= __ip6_endpoint2kernel,
@@ -298,13 +312,64 @@ static int __ip_accept(socket_t *s, socket_t *newsock) {
 
 	return 0;
 }
+static void __ip_msg_ts(struct msghdr *msg, struct timeval *tv, struct timespec *hwts) {
+	struct cmsghdr *cm;
+
+	if (hwts)
+		ZERO(*hwts);
+
+	if (tv) {
+		for (cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+			if (cm->cmsg_level != SOL_SOCKET)
+				continue;
+			if (cm->cmsg_type == SO_TIMESTAMP) {
+				*tv = *((struct timeval *) CMSG_DATA(cm));
+				tv = NULL;
+				break;
+			}
+			if (cm->cmsg_type == SO_TIMESTAMPING) {
+				const struct timespec *ts = (void *) CMSG_DATA(cm);
+				// [0] is the software timestamp, [2] the raw hardware one
+				tv->tv_sec = ts[0].tv_sec;
+				tv->tv_usec = ts[0].tv_nsec / 1000;
+				if (hwts)
+					*hwts = ts[2];
+				tv = NULL;
+				break;
+			}
+		}
+		if (G_UNLIKELY(tv)) {
+			ilog(LOG_WARNING, "No receive timestamp received from kernel");
+			ZERO(*tv);
+		}
+	}
+	if (G_UNLIKELY((msg->msg_flags & MSG_TRUNC)))
+		ilog(LOG_WARNING, "Kernel indicates that data was truncated");
+	if (G_UNLIKELY((msg->msg_flags & MSG_CTRUNC)))
+		ilog(LOG_WARNING, "Kernel indicates that ancillary data was truncated");
+}
+// the kernel reports its cumulative drop count with each datagram
+static void __ip_msg_ovfl(socket_t *s, struct msghdr *msg) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+			s->rx_drops = *((uint32_t *) CMSG_DATA(cm));
+			return;
+		}
+	}
+}
+static unsigned int __ip_msg_gro(struct msghdr *msg) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level == IPPROTO_UDP && cm->cmsg_type == UDP_GRO)
+			return *((int *) CMSG_DATA(cm));
+	}
+	return 0;
+}
 static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *ep, struct timeval *tv) {
 	ssize_t ret;
 	struct sockaddr_storage sin;
 	struct msghdr msg;
 	struct iovec iov;
-	char ctrl[64];
-	struct cmsghdr *cm;
+	char ctrl[96];
 
 	ZERO(msg);
 	msg.msg_name = &sin;
@@ -322,23 +387,45 @@ static ssize_t __ip_recvfrom_ts(socket_t *s, void *buf, size_t len, endpoint_t *
 		return ret;
 	s->family->sockaddr2endpoint(ep, &sin);
 
-	if (tv) {
-		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
-			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMP) {
-				*tv = *((struct timeval *) CMSG_DATA(cm));
-				tv = NULL;
-				break;
-			}
-		}
-		if (G_UNLIKELY(tv)) {
-			ilog(LOG_WARNING, "No receive timestamp received from kernel");
-			ZERO(*tv);
-		}
+	__ip_msg_ts(&msg, tv, NULL);
+	__ip_msg_ovfl(s, &msg);
+
+	return ret;
+}
+// returns the number of messages received, or -1 on error (with errno set)
+static int __ip_recvmmsg_ts(socket_t *s, struct socket_mmsg *mm, unsigned int num) {
+	struct mmsghdr mmh[MAX_RECVMMSG];
+	struct sockaddr_storage sin[MAX_RECVMMSG];
+	struct iovec iov[MAX_RECVMMSG];
+	char ctrl[MAX_RECVMMSG][128]; // room for SO_TIMESTAMPING, UDP_GRO and SO_RXQ_OVFL
+	int ret;
+
+	if (num > MAX_RECVMMSG)
+		num = MAX_RECVMMSG;
+
+	for (unsigned int i = 0; i < num; i++) {
+		ZERO(mmh[i]);
+		iov[i].iov_base = mm[i].buf;
+		iov[i].iov_len = mm[i].len;
+		mmh[i].msg_hdr.msg_name = &sin[i];
+		mmh[i].msg_hdr.msg_namelen = s->family->sockaddr_size;
+		mmh[i].msg_hdr.msg_iov = &iov[i];
+		mmh[i].msg_hdr.msg_iovlen = 1;
+		mmh[i].msg_hdr.msg_control = ctrl[i];
+		mmh[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
 	}
-	if (G_UNLIKELY((msg.msg_flags & MSG_TRUNC)))
-		ilog(LOG_WARNING, "Kernel indicates that data was truncated");
-	if (G_UNLIKELY((msg.msg_flags & MSG_CTRUNC)))
-		ilog(LOG_WARNING, "Kernel indicates that ancillary data was truncated");
+
+	ret = recvmmsg(s->fd, mmh, num, 0, NULL);
+	if (ret <= 0)
+		return ret;
+
+	for (int i = 0; i < ret; i++) {
+		s->family->sockaddr2endpoint(&mm[i].ep, &sin[i]);
+		mm[i].len = mmh[i].msg_len;
+		__ip_msg_ts(&mmh[i].msg_hdr, &mm[i].tv, &mm[i].hwts);
+		mm[i].gro_size = __ip_msg_gro(&mmh[i].msg_hdr);
+	}
+	__ip_msg_ovfl(s, &mmh[ret - 1].msg_hdr);
 
 	return ret;
 }
@@ -352,13 +439,79 @@ static ssize_t __ip_sendmsg(socket_t *s, struct msghdr *mh, const endpoint_t *ep
 	mh->msg_name = &sin;
 	mh->msg_namelen = s->family->sockaddr_size;
 
-	return sendmsg(s->fd, mh, 0);
+	ssize_t ret = sendmsg(s->fd, mh, 0);
+	if (ret >= 0)
+		s->tx_seq++;
+	return ret;
 }
 static ssize_t __ip_sendto(socket_t *s, const void *buf, size_t len, const endpoint_t *ep) {
 	struct sockaddr_storage sin;
 
 	s->family->endpoint2sockaddr(&sin, ep);
-	return sendto(s->fd, buf, len, 0, (void *) &sin, s->family->sockaddr_size);
+	ssize_t ret = sendto(s->fd, buf, len, 0, (void *) &sin, s->family->sockaddr_size);
+	if (ret >= 0)
+		s->tx_seq++;
+	return ret;
+}
+// gso_size == 0: sends each message to its own destination using sendmmsg()
+// gso_size > 0: all messages must be of gso_size length (except the last one, which may be
+// shorter) and go to the destination of the first message. They're handed to the kernel as
+// a single UDP_SEGMENT send.
+// returns the number of messages sent, or -1 on error (with errno set)
+static int __ip_sendmmsg(socket_t *s, struct socket_mmsg *mm, unsigned int num, unsigned int gso_size) {
+	struct mmsghdr mmh[MAX_SENDMMSG];
+	struct sockaddr_storage sin[MAX_SENDMMSG];
+	struct iovec iov[MAX_SENDMMSG];
+
+	if (num > MAX_SENDMMSG)
+		num = MAX_SENDMMSG;
+
+	if (gso_size) {
+		struct msghdr mh;
+		char ctrl[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr *cm;
+
+		for (unsigned int i = 0; i < num; i++) {
+			iov[i].iov_base = mm[i].buf;
+			iov[i].iov_len = mm[i].len;
+		}
+
+		ZERO(mh);
+		s->family->endpoint2sockaddr(&sin[0], &mm[0].ep);
+		mh.msg_name = &sin[0];
+		mh.msg_namelen = s->family->sockaddr_size;
+		mh.msg_iov = iov;
+		mh.msg_iovlen = num;
+		mh.msg_control = ctrl;
+		mh.msg_controllen = sizeof(ctrl);
+
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_UDP;
+		cm->cmsg_type = UDP_SEGMENT;
+		cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*((uint16_t *) CMSG_DATA(cm)) = gso_size;
+
+		if (sendmsg(s->fd, &mh, 0) < 0)
+			return -1;
+		s->tx_seq++; // one key for the whole batch
+		return num;
+	}
+
+	for (unsigned int i = 0; i < num; i++) {
+		ZERO(mmh[i]);
+		s->family->endpoint2sockaddr(&sin[i], &mm[i].ep);
+		iov[i].iov_base = mm[i].buf;
+		iov[i].iov_len = mm[i].len;
+		mmh[i].msg_hdr.msg_name = &sin[i];
+		mmh[i].msg_hdr.msg_namelen = s->family->sockaddr_size;
+		mmh[i].msg_hdr.msg_iov = &iov[i];
+		mmh[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int ret = sendmmsg(s->fd, mmh, num, 0);
+	if (ret > 0)
+		s->tx_seq += ret;
+	return ret;
 }
 static int __ip4_tos(socket_t *s, unsigned int tos) {
 	unsigned char ctos;
@@ -381,10 +534,78 @@ static int __ip_error(socket_t *s) {
 }
 static int __ip_timestamping(socket_t *s) {
 	int one = 1;
+
+	if (socket_ts_mode != SOCKET_TS_DEFAULT) {
+		unsigned int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE
+			| SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+		unsigned int hw = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE
+			| SOF_TIMESTAMPING_RAW_HARDWARE;
+
+		unsigned int all = flags | hw;
+
+		if (socket_ts_mode == SOCKET_TS_HARDWARE
+				&& !setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMPING, &all, sizeof(all)))
+			return 0;
+		if (!setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)))
+			return 0;
+		// fall back to receive timestamps only
+	}
+
 	if (setsockopt(s->fd, SOL_SOCKET, SO_TIMESTAMP, &one, sizeof(one)))
 		return -1;
 	return 0;
 }
+
+void socket_timestamping_mode(enum socket_ts_mode m) {
+	socket_ts_mode = m;
+}
+
+// reads one transmit timestamp from the socket's error queue
+int socket_tx_timestamp(socket_t *s, struct socket_tx_ts *out) {
+	char ctrl[256];
+	char buf[64];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+
+	while (1) {
+		struct msghdr msg = {
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = ctrl,
+			.msg_controllen = sizeof(ctrl),
+		};
+
+		if (recvmsg(s->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		int got_ts = 0, got_key = 0;
+		ZERO(*out);
+
+		for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMPING) {
+				const struct timespec *ts = (void *) CMSG_DATA(cm);
+				out->sw = ts[0];
+				out->hw = ts[2];
+				got_ts = 1;
+			}
+			else if ((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+					|| (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+			{
+				const struct sock_extended_err *ee = (void *) CMSG_DATA(cm);
+				if (ee->ee_errno != ENOMSG || ee->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+					continue;
+				out->key = ee->ee_data;
+				got_key = 1;
+			}
+		}
+
+		if (got_ts && got_key)
+			return 1;
+		// something else, try the next one
+	}
+}
 static void __ip4_endpoint2kernel(struct re_address *ra, const endpoint_t *ep) {
 	ZERO(*ra);
 	ra->family = AF_INET;
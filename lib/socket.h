@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 
 
 
@@ -37,10 +38,19 @@ typedef const struct socket_family sockfamily_t;
 
 
 #define MAX_PACKET_HEADER_LEN 48 // 40 bytes IPv6 + 8 bytes UDP
+#define MAX_RECVMMSG 64 // upper limit of packets per recvmmsg() call
+#define MAX_SENDMMSG 64 // upper limit of packets per sendmmsg() call
+#define MAX_GSO_SIZE 65000 // upper limit of total payload per UDP_SEGMENT send
+#define MAX_GRO_SIZE 65535 // largest coalesced datagram received with UDP_GRO
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 
 
 
 struct local_intf;
+struct socket_mmsg;
 
 
 struct socket_type {
@@ -71,8 +81,10 @@ struct socket_family {
 	int				(*timestamping)(socket_t *);
 	ssize_t				(*recvfrom)(socket_t *, void *, size_t, endpoint_t *);
 	ssize_t				(*recvfrom_ts)(socket_t *, void *, size_t, endpoint_t *, struct timeval *);
+	int				(*recvmmsg_ts)(socket_t *, struct socket_mmsg *, unsigned int);
 	ssize_t				(*sendmsg)(socket_t *, struct msghdr *, const endpoint_t *);
 	ssize_t				(*sendto)(socket_t *, const void *, size_t, const endpoint_t *);
+	int				(*sendmmsg)(socket_t *, struct socket_mmsg *, unsigned int, unsigned int);
 	int				(*tos)(socket_t *, unsigned int);
 	int				(*error)(socket_t *);
 	void				(*endpoint2kernel)(struct re_address *, const endpoint_t *);
@@ -96,6 +108,28 @@ struct socket {
 	sockfamily_t			*family;
 	endpoint_t			local;
 	endpoint_t			remote;
+	unsigned int			tx_seq; // datagrams sent, matches the SOF_TIMESTAMPING_OPT_ID key
+	unsigned int			rx_drops; // receive queue overflows as last reported through SO_RXQ_OVFL
+};
+struct socket_mmsg {
+	void				*buf;
+	size_t				len; // receive: buffer size on input, received length on output
+	endpoint_t			ep; // receive: source address; send: destination address
+	struct timeval			tv; // receive timestamp
+	struct timespec			hwts; // receive timestamp from the NIC, or zero
+	unsigned int			gro_size; // receive: segment size if coalesced through UDP_GRO, or zero
+};
+// transmit timestamp read from the error queue
+struct socket_tx_ts {
+	unsigned int			key; // value of tx_seq when the datagram was sent
+	struct timespec			sw;
+	struct timespec			hw; // zero if not available
+};
+
+enum socket_ts_mode {
+	SOCKET_TS_DEFAULT = 0,		// SO_TIMESTAMP, receive only
+	SOCKET_TS_SOFTWARE,		// SO_TIMESTAMPING, receive and transmit
+	SOCKET_TS_HARDWARE,		// same, plus hardware timestamps where supported
 };
 
 
@@ -164,8 +198,10 @@ INLINE int is_addr_unspecified(const sockaddr_t *a) {
 }
 #define socket_recvfrom(s,a...) (s)->family->recvfrom((s), a)
 #define socket_recvfrom_ts(s,a...) (s)->family->recvfrom_ts((s), a)
+#define socket_recvmmsg_ts(s,a...) (s)->family->recvmmsg_ts((s), a)
 #define socket_sendmsg(s,a...) (s)->family->sendmsg((s), a)
 #define socket_sendto(s,a...) (s)->family->sendto((s), a)
+#define socket_sendmmsg(s,a...) (s)->family->sendmmsg((s), a)
 #define socket_error(s) (s)->family->error((s))
 #define socket_timestamping(s) (s)->family->timestamping((s))
 INLINE ssize_t socket_sendiov(socket_t *s, const struct iovec *v, unsigned int len, const endpoint_t *dst) {
@@ -192,10 +228,42 @@ INLINE void ipv6only(int fd, int yn) {
 	// coverity[check_return : FALSE]
 	setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &yn, sizeof(yn));
 }
+INLINE int busy_poll(int fd, int usec) {
+#ifdef SO_PREFER_BUSY_POLL
+	int one = 1;
+	// coverity[check_return : FALSE]
+	setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+#endif
+	return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec));
+}
+INLINE int udp_gro(int fd) {
+	int one = 1;
+	return setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one));
+}
+INLINE int rxq_ovfl(int fd) {
+	int one = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+}
+INLINE int rcvbuf_size(int fd, int size) {
+	// the privileged variant isn't capped by net.core.rmem_max
+	if (!setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)))
+		return 0;
+	return setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+// as requested, not the doubled value reported by the kernel
+INLINE int rcvbuf_get(int fd) {
+	int size;
+	socklen_t len = sizeof(size);
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len))
+		return -1;
+	return size / 2;
+}
 
 
 
 void socket_init(void);
+void socket_timestamping_mode(enum socket_ts_mode);
+int socket_tx_timestamp(socket_t *, struct socket_tx_ts *); // 1 = got one, 0 = none left
 
 int open_socket(socket_t *r, int type, unsigned int port, const sockaddr_t *);
 int connect_socket(socket_t *r, int type, const endpoint_t *ep);
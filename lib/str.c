@@ -54,6 +54,67 @@ void str_slice_free(void *p) {
 }
 
 
+static struct str_map_entry *str_map_find(const struct str_map *m, const str *key, guint hash) {
+	struct str_map_entry *e = m->entries ? m->entries : (struct str_map_entry *) m->inl;
+	for (unsigned int i = 0; i < m->num; i++, e++) {
+		if (e->hash == hash && e->key->len == key->len && !memcmp(e->key->s, key->s, key->len))
+			return e;
+	}
+	return NULL;
+}
+
+void *str_map_lookup(const struct str_map *m, const str *key) {
+	if (!m->num)
+		return NULL;
+	struct str_map_entry *e = str_map_find(m, key, str_hash(key));
+	return e ? e->val : NULL;
+}
+
+void str_map_insert(struct str_map *m, const str *key, void *val) {
+	guint hash = str_hash(key);
+	struct str_map_entry *e = str_map_find(m, key, hash);
+	if (!e) {
+		if (!m->entries && m->num == STR_MAP_INLINE) {
+			m->alloc = STR_MAP_INLINE * 2;
+			m->entries = g_new(struct str_map_entry, m->alloc);
+			memcpy(m->entries, m->inl, sizeof(m->inl));
+		}
+		else if (m->entries && m->num == m->alloc) {
+			m->alloc *= 2;
+			m->entries = g_renew(struct str_map_entry, m->entries, m->alloc);
+		}
+		e = &(m->entries ? m->entries : m->inl)[m->num++];
+	}
+	e->key = key;
+	e->hash = hash;
+	e->val = val;
+}
+
+void str_map_remove(struct str_map *m, const str *key) {
+	if (!m->num)
+		return;
+	struct str_map_entry *e = str_map_find(m, key, str_hash(key));
+	if (!e)
+		return;
+	struct str_map_entry *base = m->entries ? m->entries : m->inl;
+	m->num--;
+	memmove(e, e + 1, (base + m->num - e) * sizeof(*e));
+}
+
+GList *str_map_values(const struct str_map *m) {
+	GList *ret = NULL;
+	for (unsigned int i = m->num; i > 0; i--)
+		ret = g_list_prepend(ret, str_map_val(m, i - 1));
+	return ret;
+}
+
+void str_map_free(struct str_map *m) {
+	g_free(m->entries);
+	m->entries = NULL;
+	m->num = m->alloc = 0;
+}
+
+
 /**
  * Generates a random hexadecimal string representing n random bytes.
  * rand_str length must be 2*num_bytes + 1.
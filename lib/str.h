@@ -92,6 +92,11 @@ INLINE int str_token(str *new_token, str *ori_and_remainder, int sep);
 INLINE int str_token_sep(str *new_token, str *ori_and_remainder, int sep);
 /* copy a string to a regular C string buffer, limiting the max size */
 INLINE char *str_ncpy(char *dst, size_t bufsize, const str *src);
+/* same characters as PCRE's \s */
+INLINE int str_isspace(char c);
+/* splits on white space into at most "max" tokens without modifying the string. returns
+ * the number of tokens, or max+1 if there are more */
+INLINE unsigned int str_split_ws(str *out, unsigned int max, const str *s);
 
 /* asprintf() analogs */
 #define str_sprintf(fmt, ...) __str_sprintf(STR_MALLOC_PADDING fmt, ##__VA_ARGS__)
@@ -119,6 +124,34 @@ INLINE int str_uri_encode(char *out, const str *in);
 /* reverse of the above. returns newly allocated str + buffer as per str_alloc (must be free'd) */
 str *str_uri_decode_len(const char *in, int in_len);
 
+/* Small map of str keys to pointers, for the handful of entries typical of tags and branches
+ * of a call. Entries are kept in an array together with the hash of their key and are searched
+ * linearly. The first few are stored inline. Keys are not copied and must remain valid while
+ * they are in the map. A zeroed struct is an empty map. Insert replaces both key and value of
+ * an existing entry. */
+#define STR_MAP_INLINE 4
+struct str_map_entry {
+	const str *key;
+	guint hash;
+	void *val;
+};
+struct str_map {
+	unsigned int num, alloc;
+	struct str_map_entry *entries; /* NULL while using inl[] */
+	struct str_map_entry inl[STR_MAP_INLINE];
+};
+void *str_map_lookup(const struct str_map *, const str *key);
+void str_map_insert(struct str_map *, const str *key, void *val);
+void str_map_remove(struct str_map *, const str *key);
+GList *str_map_values(const struct str_map *);
+void str_map_free(struct str_map *);
+INLINE unsigned int str_map_size(const struct str_map *m) {
+	return m->num;
+}
+INLINE void *str_map_val(const struct str_map *m, unsigned int i) {
+	return (m->entries ? m->entries : m->inl)[i].val;
+}
+
 
 
 
@@ -390,6 +423,29 @@ INLINE int str_token_sep(str *new_token, str *ori_and_remainder, int sep) {
 	return 0;
 }
 
+INLINE int str_isspace(char c) {
+	return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+INLINE unsigned int str_split_ws(str *out, unsigned int max, const str *s) {
+	unsigned int n = 0;
+	char *p = s->s, *e = s->s + s->len;
+
+	while (1) {
+		while (p < e && str_isspace(*p))
+			p++;
+		if (p == e)
+			return n;
+		if (n == max)
+			return max + 1;
+		out[n].s = p;
+		while (p < e && !str_isspace(*p))
+			p++;
+		out[n].len = p - out[n].s;
+		n++;
+	}
+}
+
 INLINE int str_uri_encode(char *out, const str *in) {
 	return str_uri_encode_len(out, in->s, in->len);
 }
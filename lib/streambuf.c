@@ -177,6 +177,51 @@ char *streambuf_getline(struct streambuf *b) {
 	return s;
 }
 
+// extracts one "LENGTH:DATA" frame, skipping any white space in between frames. returns 1 and a
+// newly allocated and null-terminated string in *out if a complete frame was found, 0 if more data
+// is needed, or -1 if the buffer doesn't contain a valid frame header or the frame is too large
+int streambuf_getframe(struct streambuf *b, str *out, unsigned int max_len) {
+	int ret = 0;
+
+	mutex_lock(&b->lock);
+
+	unsigned int skip = 0;
+	while (skip < b->buf->len && g_ascii_isspace(b->buf->str[skip]))
+		skip++;
+	if (skip)
+		g_string_erase(b->buf, 0, skip);
+
+	unsigned int pos = 0;
+	unsigned long len = 0;
+	while (pos < b->buf->len && b->buf->str[pos] >= '0' && b->buf->str[pos] <= '9') {
+		len = len * 10 + (b->buf->str[pos] - '0');
+		pos++;
+		if (len > max_len)
+			goto err;
+	}
+	if (pos == b->buf->len)
+		goto out; // header incomplete
+	if (pos == 0 || b->buf->str[pos] != ':')
+		goto err;
+	pos++;
+	if (b->buf->len - pos < len)
+		goto out; // body incomplete
+
+	out->s = malloc(len + 1);
+	memcpy(out->s, b->buf->str + pos, len);
+	out->s[len] = '\0';
+	out->len = len;
+	g_string_erase(b->buf, 0, pos + len);
+	ret = 1;
+	goto out;
+
+err:
+	ret = -1;
+out:
+	mutex_unlock(&b->lock);
+	return ret;
+}
+
 unsigned int streambuf_bufsize(struct streambuf *b) {
 	return b->buf->len;
 }
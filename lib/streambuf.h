@@ -41,6 +41,7 @@ void streambuf_destroy(struct streambuf *);
 int streambuf_writeable(struct streambuf *);
 int streambuf_readable(struct streambuf *);
 char *streambuf_getline(struct streambuf *);
+int streambuf_getframe(struct streambuf *, str *, unsigned int);
 unsigned int streambuf_bufsize(struct streambuf *);
 void streambuf_printf(struct streambuf *, const char *, ...) __attribute__ ((format (printf, 2, 3)));
 void streambuf_vprintf(struct streambuf *, const char *, va_list);
@@ -122,6 +122,8 @@ sub offer_answer {
 	$regexp =~ s/ICEBASE/([0-9a-zA-Z]{16})/gs;
 	$regexp =~ s/ICEUFRAG/([0-9a-zA-Z]{8})/gs;
 	$regexp =~ s/ICEPWD/([0-9a-zA-Z]{26})/gs;
+	$regexp =~ s/CRYPTO128S/([0-9a-zA-Z\/+]{38})/gs;
+	$regexp =~ s/CRYPTO256S/([0-9a-zA-Z\/+]{59})/gs;
 	$regexp =~ s/CRYPTO128/([0-9a-zA-Z\/+]{40})/gs;
 	$regexp =~ s/CRYPTO192/([0-9a-zA-Z\/+]{51})/gs;
 	$regexp =~ s/CRYPTO256/([0-9a-zA-Z\/+]{62})/gs;
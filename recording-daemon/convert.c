@@ -0,0 +1,436 @@
+#include "convert.h"
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <arpa/inet.h>
+#include <mysql.h>
+#include "log.h"
+#include "main.h"
+#include "metafile.h"
+#include "stream.h"
+#include "pipeline.h"
+
+
+// Batch conversion of recordings made with the "pcap" recording method. Each recording is
+// a metadata file ("metadata/*.txt" in the spool dir) naming its pcap file, followed by
+// the SDP bodies seen during the call and the call's metadata. The recordings are spread
+// over worker threads, and each one is run through the usual decoding, mixing and output
+// pipeline as if its packets had come from the kernel. Packets are grouped into streams
+// by destination address, and all payload types from all SDP bodies apply to the whole
+// recording.
+
+#define PCAP_MAGIC		0xa1b2c3d4
+#define PCAP_MAGIC_NSEC		0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET	1
+#define PCAP_LINKTYPE_RAW	101
+#define PCAP_MAX_PACKET		65535
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+
+static char **convert_files;
+static unsigned int convert_num_files;
+static volatile gint convert_next;
+
+// totals, for the summary
+static volatile gint convert_done;
+static volatile gint convert_failed;
+static uint64_t convert_packets;
+static uint64_t convert_bytes;
+
+
+
+static void convert_add_file(GPtrArray *list, const char *path) {
+	if (!g_file_test(path, G_FILE_TEST_IS_DIR)) {
+		g_ptr_array_add(list, g_strdup(path));
+		return;
+	}
+
+	GDir *dir = g_dir_open(path, 0, NULL);
+	if (!dir) {
+		ilog(LOG_ERR, "Failed to open directory '%s'", path);
+		return;
+	}
+	const char *fn;
+	while ((fn = g_dir_read_name(dir))) {
+		if (g_str_has_suffix(fn, ".txt"))
+			g_ptr_array_add(list, g_build_filename(path, fn, NULL));
+	}
+	g_dir_close(dir);
+}
+
+
+// the "a=ptime" of the media section starting at lines[i] must be known before its payload
+// types are, as that's the order in which the proc method gives them
+static int convert_sdp_ptime(char **lines, unsigned int i) {
+	int ptime;
+	for (i++; lines[i]; i++) {
+		char *l = lines[i];
+		if (!g_ascii_islower(l[0]) || l[1] != '=' || l[0] == 'm')
+			break;
+		if (sscanf(l, "a=ptime:%i", &ptime) == 1)
+			return ptime;
+	}
+	return 0;
+}
+
+
+// mf is locked. turns the metadata file of a pcap recording into metafile sections and
+// returns the path of the pcap file
+static char *convert_meta(metafile_t *mf, char *contents) {
+	char **lines = g_strsplit(contents, "\n", -1);
+	char *pcap_path = NULL;
+	char section[64];
+	GString *metadata = NULL;
+	unsigned int media = 0;
+	int in_sdp = 0;
+
+	if (!lines[0] || !lines[0][0])
+		goto out;
+	pcap_path = g_strdup(lines[0]);
+
+	for (unsigned int i = 1; lines[i]; i++) {
+		char *l = lines[i];
+
+		if (metadata) {
+			if (metadata->len || l[0])
+				g_string_append_printf(metadata, "%s\n", l);
+			continue;
+		}
+
+		if (!strncmp(l, "SDP before RTP packet: ", 23)) {
+			in_sdp = 1;
+			media = 0;
+			continue;
+		}
+		if (!strncmp(l, "Label: ", 7) || !strncmp(l, "Timestamp ", 10)) {
+			in_sdp = 0;
+			continue;
+		}
+		if (!strncmp(l, "call end time: ", 15)) {
+			// everything that follows is the call's metadata
+			metadata = g_string_new("");
+			continue;
+		}
+		if (!in_sdp)
+			continue;
+
+		g_strchomp(l);
+		unsigned int pt;
+		int n = 0;
+
+		if (!strncmp(l, "m=", 2)) {
+			media++;
+			int ptime = convert_sdp_ptime(lines, i);
+			if (ptime > 0) {
+				snprintf(section, sizeof(section), "MEDIA %u PTIME %i", media, ptime);
+				metafile_section(mf, section, "");
+			}
+		}
+		else if (sscanf(l, "a=rtpmap:%u %n", &pt, &n) == 1 && n) {
+			snprintf(section, sizeof(section), "MEDIA %u PAYLOAD TYPE %u", media, pt);
+			metafile_section(mf, section, l + n);
+		}
+		else if (sscanf(l, "a=fmtp:%u %n", &pt, &n) == 1 && n) {
+			snprintf(section, sizeof(section), "MEDIA %u FMTP %u", media, pt);
+			metafile_section(mf, section, l + n);
+		}
+	}
+
+	if (metadata) {
+		g_strchomp(metadata->str);
+		if (metadata->str[0])
+			metafile_section(mf, "METADATA", metadata->str);
+		g_string_free(metadata, TRUE);
+	}
+
+out:
+	g_strfreev(lines);
+	return pcap_path;
+}
+
+
+// the spool dir may have been moved or copied since the recording was made. the pcap file
+// is then looked for in the "pcaps" dir next to the metadata dir
+static FILE *convert_pcap_open(const char *meta_path, const char *pcap_path) {
+	FILE *fp = fopen(pcap_path, "r");
+	if (fp)
+		return fp;
+
+	char *meta_dir = g_path_get_dirname(meta_path);
+	char *pcap_name = g_path_get_basename(pcap_path);
+	char *alt = g_build_filename(meta_dir, "..", "pcaps", pcap_name, NULL);
+	fp = fopen(alt, "r");
+	g_free(alt);
+	g_free(pcap_name);
+	g_free(meta_dir);
+	return fp;
+}
+
+
+// returns the IP packet within a pcap record and makes up a stream name from its UDP
+// destination, or NULL if it's not a UDP packet
+static unsigned char *convert_packet(unsigned char *buf, unsigned int *len, unsigned int linktype,
+		char *name, size_t name_len)
+{
+	char addr[INET6_ADDRSTRLEN];
+	unsigned int hlen;
+	uint16_t port;
+
+	if (linktype == PCAP_LINKTYPE_ETHERNET) {
+		if (*len < 14)
+			return NULL;
+		buf += 14;
+		*len -= 14;
+	}
+
+	if (*len < 1)
+		return NULL;
+	if ((buf[0] >> 4) == 4) {
+		hlen = (buf[0] & 0xf) << 2;
+		if (*len < 20 || hlen < 20 || *len < hlen + 8 || buf[9] != 17)
+			return NULL;
+		inet_ntop(AF_INET, buf + 16, addr, sizeof(addr));
+		memcpy(&port, buf + hlen + 2, 2);
+		snprintf(name, name_len, "%s:%u", addr, ntohs(port));
+	}
+	else if ((buf[0] >> 4) == 6) {
+		hlen = 40;
+		if (*len < hlen + 8 || buf[6] != 17)
+			return NULL;
+		inet_ntop(AF_INET6, buf + 24, addr, sizeof(addr));
+		memcpy(&port, buf + hlen + 2, 2);
+		snprintf(name, name_len, "[%s]:%u", addr, ntohs(port));
+	}
+	else
+		return NULL;
+
+	return buf;
+}
+
+
+// mf is unlocked
+static int convert_pcap(metafile_t *mf, FILE *fp, const char *pcap_path) {
+	struct pcap_file_hdr fh;
+	struct pcap_rec_hdr rh;
+	unsigned char *buf = NULL;
+	GHashTable *streams = NULL;
+	unsigned long num_streams = 0;
+	uint64_t packets = 0, bytes = 0;
+	int swap, ret = -1;
+
+	if (fread(&fh, sizeof(fh), 1, fp) != 1) {
+		ilog(LOG_ERR, "Failed to read pcap file header from '%s'", pcap_path);
+		goto out;
+	}
+	if (fh.magic == PCAP_MAGIC || fh.magic == PCAP_MAGIC_NSEC)
+		swap = 0;
+	else if (fh.magic == GUINT32_SWAP_LE_BE(PCAP_MAGIC) || fh.magic == GUINT32_SWAP_LE_BE(PCAP_MAGIC_NSEC))
+		swap = 1;
+	else {
+		ilog(LOG_ERR, "'%s' is not a pcap file", pcap_path);
+		goto out;
+	}
+
+	unsigned int linktype = swap ? GUINT32_SWAP_LE_BE(fh.linktype) : fh.linktype;
+	// DLT_RAW has a different value on some platforms
+	if (linktype == 12 || linktype == 14)
+		linktype = PCAP_LINKTYPE_RAW;
+	if (linktype != PCAP_LINKTYPE_RAW && linktype != PCAP_LINKTYPE_ETHERNET) {
+		ilog(LOG_ERR, "Unsupported link type %u in pcap file '%s'", linktype, pcap_path);
+		goto out;
+	}
+
+	buf = malloc(PCAP_MAX_PACKET);
+	streams = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	while (fread(&rh, sizeof(rh), 1, fp) == 1) {
+		unsigned int caplen = swap ? GUINT32_SWAP_LE_BE(rh.caplen) : rh.caplen;
+		if (caplen > PCAP_MAX_PACKET) {
+			ilog(LOG_ERR, "Invalid packet length %u in pcap file '%s'", caplen, pcap_path);
+			goto out;
+		}
+		if (fread(buf, caplen, 1, fp) != 1 && caplen)
+			break; // truncated, e.g. by a restart while recording
+
+		char name[INET6_ADDRSTRLEN + 16];
+		unsigned int len = caplen;
+		unsigned char *pkt = convert_packet(buf, &len, linktype, name, sizeof(name));
+		if (!pkt)
+			continue;
+
+		stream_t *stream = g_hash_table_lookup(streams, name);
+		if (!stream) {
+			char section[64];
+			unsigned long snum = num_streams++;
+			snprintf(section, sizeof(section), "STREAM %lu interface", snum);
+			pthread_mutex_lock(&mf->lock);
+			metafile_section(mf, section, name);
+			stream = g_ptr_array_index(mf->streams, snum);
+			pthread_mutex_unlock(&mf->lock);
+			g_hash_table_insert(streams, g_strdup(name), stream);
+		}
+
+		stream_inject(stream, pkt, len);
+		packets++;
+		bytes += len;
+	}
+
+	ilog(LOG_INFO, "Read %" PRIu64 " packets in %lu streams from '%s'", packets, num_streams,
+			pcap_path);
+	ret = 0;
+
+out:
+	__atomic_fetch_add(&convert_packets, packets, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&convert_bytes, bytes, __ATOMIC_RELAXED);
+	if (streams)
+		g_hash_table_destroy(streams);
+	free(buf);
+	return ret;
+}
+
+
+static int convert_one(const char *meta_path) {
+	char *contents = NULL;
+	char *pcap_path = NULL;
+	FILE *fp = NULL;
+	int ret = -1;
+
+	if (!g_file_get_contents(meta_path, &contents, NULL, NULL)) {
+		ilog(LOG_ERR, "Failed to read metadata file '%s'", meta_path);
+		return -1;
+	}
+
+	// named after the metadata file, which is "<escaped call ID>-<random>.txt"
+	char *name = g_path_get_basename(meta_path);
+	char *ext = strrchr(name, '.');
+	if (ext)
+		*ext = '\0';
+
+	metafile_t *mf = metafile_offline_open(name);
+	log_info_call = mf->name;
+
+	metafile_section(mf, "PARENT", name);
+	char *sep = strrchr(name, '-');
+	if (sep) {
+		char *call_id = g_uri_unescape_segment(name, sep, NULL);
+		if (call_id)
+			metafile_section(mf, "CALL-ID", call_id);
+		g_free(call_id);
+	}
+
+	pcap_path = convert_meta(mf, contents);
+
+	pthread_mutex_unlock(&mf->lock);
+
+	if (!pcap_path) {
+		ilog(LOG_ERR, "No pcap file given in metadata file '%s'", meta_path);
+		goto out;
+	}
+	fp = convert_pcap_open(meta_path, pcap_path);
+	if (!fp) {
+		ilog(LOG_ERR, "Failed to open pcap file '%s': %s", pcap_path, strerror(errno));
+		goto out;
+	}
+
+	ret = convert_pcap(mf, fp, pcap_path);
+
+out:
+	if (fp)
+		fclose(fp);
+	metafile_offline_close(mf);
+	log_info_call = NULL;
+	g_free(pcap_path);
+	g_free(name);
+	g_free(contents);
+	return ret;
+}
+
+
+static void *convert_thread(void *p) {
+	mysql_thread_init();
+
+	while (!shutdown_flag) {
+		unsigned int i = g_atomic_int_add(&convert_next, 1);
+		if (i >= convert_num_files)
+			break;
+		if (convert_one(convert_files[i]))
+			g_atomic_int_inc(&convert_failed);
+		else
+			g_atomic_int_inc(&convert_done);
+	}
+
+	mysql_thread_end();
+
+	return NULL;
+}
+
+
+// converts all given recordings and waits for everything to have been written out
+void convert_run(char **paths) {
+	GPtrArray *list = g_ptr_array_new_with_free_func(g_free);
+	for (char **p = paths; *p; p++)
+		convert_add_file(list, *p);
+	convert_files = (char **) list->pdata;
+	convert_num_files = list->len;
+
+	int num = MIN(num_threads, (int) convert_num_files);
+	if (num < 1)
+		num = 1;
+
+	ilog(LOG_INFO, "Converting %u pcap recordings using %i threads", convert_num_files, num);
+
+	int64_t start = g_get_monotonic_time();
+
+	pthread_t *threads = g_new(pthread_t, num);
+	for (int i = 0; i < num; i++) {
+		if (pthread_create(&threads[i], NULL, convert_thread, NULL))
+			die_errno("pthread_create failed");
+	}
+	for (int i = 0; i < num; i++)
+		pthread_join(threads[i], NULL);
+	g_free(threads);
+
+	// finish decoding and writing before taking the time
+	pipeline_stats();
+	pipeline_stop(PIPELINE_DECODE);
+	pipeline_stop(PIPELINE_OUTPUT);
+	pipeline_stop(PIPELINE_WRITE);
+
+	double secs = (g_get_monotonic_time() - start) / 1000000.0;
+	if (secs <= 0)
+		secs = 0.000001;
+
+	ilog(LOG_INFO, "Converted %i pcap recordings (%i failed) with %" PRIu64 " packets and "
+			"%" PRIu64 " bytes in %.3f seconds: %.1f recordings/s, %.0f packets/s, %.2f MB/s",
+			convert_done, convert_failed, convert_packets, convert_bytes, secs,
+			convert_done / secs, convert_packets / secs,
+			convert_bytes / secs / 1000000.0);
+
+	convert_files = NULL;
+	convert_num_files = 0;
+	g_ptr_array_free(list, TRUE);
+}
+
+
+int convert_failures(void) {
+	return g_atomic_int_get(&convert_failed);
+}
@@ -0,0 +1,7 @@
+#ifndef _CONVERT_H_
+#define _CONVERT_H_
+
+void convert_run(char **paths);
+int convert_failures(void);
+
+#endif
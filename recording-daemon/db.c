@@ -1,7 +1,9 @@
 #include "db.h"
 #include <mysql.h>
+#include <errmsg.h>
 #include <glib.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include "types.h"
 #include "main.h"
@@ -52,6 +54,38 @@ CREATE TABLE `recording_metakeys` (
 
 
 
+enum db_op_type {
+	DB_OP_CALL = 0,
+	DB_OP_METADATA,
+	DB_OP_CLOSE_CALL,
+	DB_OP_STREAM,
+	DB_OP_CLOSE_STREAM,
+	DB_OP_DELETE_STREAM,
+	DB_OP_CONFIG_STREAM,
+};
+
+// database row ID shared between the object it belongs to and the queued operations
+// referring to it. only the writer thread touches the ID
+struct db_ref {
+	unsigned long long id;
+	volatile gint refs;
+};
+
+typedef struct {
+	enum db_op_type type;
+	struct db_ref *call;
+	struct db_ref *stream;
+	int64_t queued; // monotonic usec
+	double now;
+	char *s[5]; // meaning depends on type
+	unsigned long stream_id;
+	unsigned long ssrc;
+	int channels;
+	int clockrate;
+	int assigned:1; // ID was set during the current batch
+} db_op_t;
+
+
 static MYSQL __thread *mysql_conn;
 static MYSQL_STMT __thread
 	*stm_insert_call,
@@ -59,8 +93,18 @@ static MYSQL_STMT __thread
 	*stm_insert_stream,
 	*stm_close_stream,
 	*stm_delete_stream,
-	*stm_config_stream,
-	*stm_insert_metadata;
+	*stm_config_stream;
+static unsigned int __thread conn_gen; // changes when the connection is reset
+
+static pthread_mutex_t db_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t db_queue_cond = PTHREAD_COND_INITIALIZER;
+static GQueue db_queue = G_QUEUE_INIT;
+static pthread_t db_thread;
+static int db_running;
+static int db_stop;
+
+
+static void db_batch_run(GQueue *ops);
 
 
 static void my_stmt_close(MYSQL_STMT **st) {
@@ -78,9 +122,9 @@ static void reset_conn(void) {
 	my_stmt_close(&stm_close_stream);
 	my_stmt_close(&stm_delete_stream);
 	my_stmt_close(&stm_config_stream);
-	my_stmt_close(&stm_insert_metadata);
 	mysql_close(mysql_conn);
 	mysql_conn = NULL;
+	conn_gen++;
 }
 
 
@@ -96,10 +140,15 @@ INLINE int prep(MYSQL_STMT **st, const char *str) {
 }
 
 
+static int db_configured(void) {
+	return c_mysql_host && c_mysql_db;
+}
+
+
 static int check_conn(void) {
 	if (mysql_conn)
 		return 0;
-	if (!c_mysql_host || !c_mysql_db)
+	if (!db_configured())
 		return -1;
 
 	dbg("connecting to MySQL");
@@ -145,9 +194,6 @@ static int check_conn(void) {
 		goto err;
 	if (prep(&stm_config_stream, "update recording_streams set channels = ?, sample_rate = ? where id = ?"))
 		goto err;
-	if (prep(&stm_insert_metadata, "insert into recording_metakeys (`call`, `key`, `value`) values " \
-				"(?,?,?)"))
-		goto err;
 
 	dbg("Connection to MySQL established");
 
@@ -205,41 +251,53 @@ INLINE void my_d(MYSQL_BIND *b, const double *d) {
 }
 
 
-static void execute_wrap(MYSQL_STMT **stmt, MYSQL_BIND *binds, unsigned long long *auto_id) {
-	int retr = 0;
-	while (1) {
-		if (check_conn())
-			goto err;
-		if (mysql_stmt_bind_param(*stmt, binds))
-			goto err;
-		if (mysql_stmt_execute(*stmt))
-			goto err;
-		if (auto_id) {
-			*auto_id = mysql_insert_id(mysql_conn);
-			if (*auto_id == 0)
-				goto err;
-		}
-		if (mysql_commit(mysql_conn))
-			goto err;
+// client-side error codes mean that the connection is unusable
+static void check_errno(unsigned int err) {
+	if (err >= CR_MIN_ERROR && err <= CR_MAX_ERROR)
+		reset_conn();
+}
 
-		return;
+
+// executes without committing. returns -1 if this statement failed
+static int execute_wrap(MYSQL_STMT **stmt, MYSQL_BIND *binds, unsigned long long *auto_id) {
+	if (check_conn())
+		return -1;
+	if (mysql_stmt_bind_param(*stmt, binds))
+		goto err;
+	if (mysql_stmt_execute(*stmt))
+		goto err;
+	if (auto_id) {
+		*auto_id = mysql_insert_id(mysql_conn);
+		if (*auto_id == 0)
+			goto err;
+	}
+	return 0;
 
 err:
-		if (retr > 5) {
-			// fatal
-			ilog(LOG_ERR, "Failed to bind or execute prepared statement: %s",
-					mysql_stmt_error(*stmt));
-			reset_conn();
-			return;
-		}
-		if (retr > 2) {
-			reset_conn();
-			if (check_conn())
-				return;
-		}
+	ilog(LOG_ERR, "Failed to bind or execute prepared statement: %s",
+			mysql_stmt_error(*stmt));
+	check_errno(mysql_stmt_errno(*stmt));
+	return -1;
+}
 
-		retr++;
-	}
+static int query_wrap(GString *q) {
+	if (check_conn())
+		return -1;
+	if (!mysql_real_query(mysql_conn, q->str, q->len))
+		return 0;
+	ilog(LOG_ERR, "Failed to execute batched statement: %s", mysql_error(mysql_conn));
+	check_errno(mysql_errno(mysql_conn));
+	return -1;
+}
+
+static void query_escape(GString *q, const char *s) {
+	size_t len = strlen(s);
+	gsize pos = q->len;
+	g_string_set_size(q, pos + len * 2 + 3);
+	q->str[pos] = '\'';
+	unsigned long elen = mysql_real_escape_string(mysql_conn, q->str + pos + 1, s, len);
+	q->str[pos + 1 + elen] = '\'';
+	g_string_set_size(q, pos + elen + 2);
 }
 
 
@@ -249,151 +307,119 @@ static double now_double(void) {
 	return tv.tv_sec + tv.tv_usec / 1000000.0;
 }
 
-static void db_do_call_id(metafile_t *mf) {
-	if (mf->db_id > 0)
-		return;
-	if (!mf->call_id)
-		return;
-
-	double now = now_double();
-
-	MYSQL_BIND b[2];
-	my_cstr(&b[0], mf->call_id);
-	my_d(&b[1], &now);
 
-	execute_wrap(&stm_insert_call, b, &mf->db_id);
+static struct db_ref *db_ref_new(void) {
+	struct db_ref *r = g_slice_alloc0(sizeof(*r));
+	r->refs = 1;
+	return r;
+}
+static struct db_ref *db_ref_get(struct db_ref *r) {
+	if (r)
+		g_atomic_int_inc(&r->refs);
+	return r;
+}
+static void db_ref_put(struct db_ref *r) {
+	if (r && g_atomic_int_dec_and_test(&r->refs))
+		g_slice_free1(sizeof(*r), r);
+}
+void db_release(struct db_ref **r) {
+	db_ref_put(*r);
+	*r = NULL;
 }
-static void db_do_call_metadata(metafile_t *mf) {
-	if (!mf->metadata_db)
-		return;
-	if (mf->db_id == 0)
-		return;
 
-	MYSQL_BIND b[3];
-	my_ull(&b[0], &mf->db_id); // stays persistent
 
-	// XXX offload this parsing to proxy module -> bencode list/dictionary
-	str all_meta;
-	str_init(&all_meta, mf->metadata_db);
-	while (all_meta.len > 1) {
-		str token;
-		if (str_token_sep(&token, &all_meta, '|'))
-			break;
+static void db_op_free(db_op_t *op) {
+	db_ref_put(op->call);
+	db_ref_put(op->stream);
+	for (int i = 0; i < G_N_ELEMENTS(op->s); i++)
+		g_free(op->s[i]);
+	g_slice_free1(sizeof(*op), op);
+}
 
-		str key;
-		if (str_token(&key, &token, ':')) {
-			// key:value separator not found, skip
-			continue;
-		}
 
-		my_str(&b[1], &key);
-		my_str(&b[2], &token);
+static void db_op_push(db_op_t *op) {
+	op->queued = g_get_monotonic_time();
 
-		execute_wrap(&stm_insert_metadata, b, NULL);
+	if (!db_running) {
+		// not started yet or already gone: do it right here
+		GQueue q = G_QUEUE_INIT;
+		g_queue_push_tail(&q, op);
+		db_batch_run(&q);
+		return;
 	}
 
-	mf->metadata_db = NULL;
+	pthread_mutex_lock(&db_queue_lock);
+	g_queue_push_tail(&db_queue, op);
+	// the first one starts the batch delay timer, which the thread otherwise doesn't know about
+	if (db_queue.length == 1 || db_queue.length >= db_batch_size)
+		pthread_cond_signal(&db_queue_cond);
+	pthread_mutex_unlock(&db_queue_lock);
 }
 
-void db_do_call(metafile_t *mf) {
-	if (check_conn())
+
+// all of these run in the writer thread
+
+static void db_run_call(db_op_t *op) {
+	if (op->call->id)
 		return;
 
-	db_do_call_id(mf);
-	db_do_call_metadata(mf);
-}
+	MYSQL_BIND b[2];
+	my_cstr(&b[0], op->s[0]);
+	my_d(&b[1], &op->now);
 
+	if (!execute_wrap(&stm_insert_call, b, &op->call->id))
+		op->assigned = 1;
+}
 
-// mf is locked
-void db_do_stream(metafile_t *mf, output_t *op, const char *type, stream_t *stream, unsigned long ssrc) {
-	if (check_conn())
+static void db_run_stream(db_op_t *op) {
+	if (op->call->id == 0)
 		return;
-	if (mf->db_id == 0)
+	if (op->stream->id)
 		return;
-	if (op->db_id > 0)
-		return;
-
-	unsigned long id = stream ? stream->id : 0;
-	double now = now_double();
 
 	MYSQL_BIND b[11];
-	my_ull(&b[0], &mf->db_id);
-	my_cstr(&b[1], op->file_name);
-	my_cstr(&b[2], op->file_format);
-	my_cstr(&b[3], op->full_filename);
-	my_cstr(&b[4], op->file_format);
-	my_cstr(&b[5], op->file_format);
-	my_cstr(&b[6], type);
+	my_ull(&b[0], &op->call->id);
+	my_cstr(&b[1], op->s[0]); // file name
+	my_cstr(&b[2], op->s[1]); // format
+	my_cstr(&b[3], op->s[2]); // full file name
+	my_cstr(&b[4], op->s[1]);
+	my_cstr(&b[5], op->s[1]);
+	my_cstr(&b[6], op->s[3]); // type
 	b[7] = (MYSQL_BIND) {
 		.buffer_type = MYSQL_TYPE_LONG,
-		.buffer = &id,
-		.buffer_length = sizeof(id),
+		.buffer = &op->stream_id,
+		.buffer_length = sizeof(op->stream_id),
 		.is_unsigned = 1,
 	};
 	b[8] = (MYSQL_BIND) {
 		.buffer_type = MYSQL_TYPE_LONG,
-		.buffer = &ssrc,
-		.buffer_length = sizeof(ssrc),
+		.buffer = &op->ssrc,
+		.buffer_length = sizeof(op->ssrc),
 		.is_unsigned = 1,
 	};
-	if (stream && stream->tag != (unsigned long) -1) {
-		tag_t *tag = tag_get(mf, stream->tag);
-		my_cstr(&b[9], tag->label ? : "");
-	}
-	else
-		my_cstr(&b[9], "");
-	my_d(&b[10], &now);
+	my_cstr(&b[9], op->s[4]); // tag label
+	my_d(&b[10], &op->now);
 
-	execute_wrap(&stm_insert_stream, b, &op->db_id);
+	if (!execute_wrap(&stm_insert_stream, b, &op->stream->id))
+		op->assigned = 1;
 }
 
-void db_close_call(metafile_t *mf) {
-	if (check_conn())
+static void db_run_close_stream(db_op_t *op) {
+	if (op->stream->id == 0)
 		return;
-	if (mf->db_id == 0)
-		return;
-
-	double now = now_double();
-
-	MYSQL_BIND b[2];
-	my_d(&b[0], &now);
-	my_ull(&b[1], &mf->db_id);
-
-	execute_wrap(&stm_close_call, b, NULL);
-}
-
-void db_close_stream(output_t *op) {
-	if (check_conn())
-		return;
-	if (op->db_id == 0)
-		return;
-
-	double now = now_double();
 
 	str stream;
-        char *filename = 0;
+        char *filename = op->s[0];
         MYSQL_BIND b[3];
         stream.s = 0;
         stream.len = 0;
 
 	if ((output_storage & OUTPUT_STORAGE_DB)) {
-		filename = malloc(strlen(op->full_filename) +
-				  strlen(op->file_format) + 2);
-		if (!filename) {
-			ilog(LOG_ERR, "Failed to allocate memory for filename");
-			if ((output_storage & OUTPUT_STORAGE_FILE))
-				goto file;
-			return;
-		}
-		strcpy(filename, op->full_filename);
-		strcat(filename, ".");
-		strcat(filename, op->file_format);
 		FILE *f = fopen(filename, "rb");
 		if (!f) {
 			ilog(LOG_ERR, "Failed to open file: %s%s%s", FMT_M(filename));
 			if ((output_storage & OUTPUT_STORAGE_FILE))
 				goto file;
-			free(filename);
 			return;
 		}
 		fseek(f, 0, SEEK_END);
@@ -404,9 +430,12 @@ void db_close_stream(output_t *op) {
 			size_t count = fread(stream.s, 1, stream.len, f);
 			if (count != stream.len) {
 				ilog(LOG_ERR, "Failed to read from stream");
+				fclose(f);
+				free(stream.s);
+				stream.s = NULL;
+				stream.len = 0;
 				if ((output_storage & OUTPUT_STORAGE_FILE))
 					goto file;
-				free(filename);
 				return;
 			}
 		}
@@ -415,42 +444,389 @@ void db_close_stream(output_t *op) {
 
 file:;
 	int par_idx = 0;
-	my_d(&b[par_idx++], &now);
+	my_d(&b[par_idx++], &op->now);
 	if ((output_storage & OUTPUT_STORAGE_DB))
 		my_str(&b[par_idx++], &stream);
-	my_ull(&b[par_idx++], &op->db_id);
+	my_ull(&b[par_idx++], &op->stream->id);
 
 	execute_wrap(&stm_close_stream, b, NULL);
 
         if (stream.s)
 		free(stream.s);
-	if (!(output_storage & OUTPUT_STORAGE_FILE))
-		remove(filename);
-        free(filename);
 }
 
-void db_delete_stream(output_t *op) {
-	if (check_conn())
+static void db_run_config_stream(db_op_t *op) {
+	if (op->stream->id == 0)
+		return;
+
+	MYSQL_BIND b[3];
+	my_i(&b[0], &op->channels);
+	my_i(&b[1], &op->clockrate);
+	my_ull(&b[2], &op->stream->id);
+
+	execute_wrap(&stm_config_stream, b, NULL);
+}
+
+// the following handle a run of consecutive operations of the same type with a single
+// statement, and return the number of operations used up
+static unsigned int db_run_metadata(GList *l) {
+	GString *q = g_string_new("insert into recording_metakeys (`call`, `key`, `value`) values ");
+	unsigned int num = 0, rows = 0;
+
+	for (; l; l = l->next) {
+		db_op_t *op = l->data;
+		if (op->type != DB_OP_METADATA)
+			break;
+		num++;
+		if (op->call->id == 0)
+			continue;
+		if (rows++)
+			g_string_append_c(q, ',');
+		g_string_append_printf(q, "(%llu,", op->call->id);
+		query_escape(q, op->s[0]);
+		g_string_append_c(q, ',');
+		query_escape(q, op->s[1]);
+		g_string_append_c(q, ')');
+	}
+
+	if (rows)
+		query_wrap(q);
+	g_string_free(q, TRUE);
+	return num;
+}
+
+static unsigned int db_run_close_calls(GList *l) {
+	GString *q = g_string_new("update recording_calls set status = 'completed', " \
+			"end_timestamp = case id");
+	GString *ids = g_string_new("");
+	unsigned int num = 0;
+
+	for (; l; l = l->next) {
+		db_op_t *op = l->data;
+		if (op->type != DB_OP_CLOSE_CALL)
+			break;
+		num++;
+		if (op->call->id == 0)
+			continue;
+		g_string_append_printf(q, " when %llu then %.3f", op->call->id, op->now);
+		g_string_append_printf(ids, "%s%llu", ids->len ? "," : "", op->call->id);
+	}
+
+	if (ids->len) {
+		g_string_append_printf(q, " end where id in (%s)", ids->str);
+		query_wrap(q);
+	}
+	g_string_free(q, TRUE);
+	g_string_free(ids, TRUE);
+	return num;
+}
+
+static unsigned int db_run_delete_streams(GList *l) {
+	GString *ids = g_string_new("");
+	unsigned int num = 0;
+
+	for (; l; l = l->next) {
+		db_op_t *op = l->data;
+		if (op->type != DB_OP_DELETE_STREAM)
+			break;
+		num++;
+		if (op->stream->id == 0)
+			continue;
+		g_string_append_printf(ids, "%s%llu", ids->len ? "," : "", op->stream->id);
+	}
+
+	if (ids->len) {
+		GString *q = g_string_new("");
+		g_string_append_printf(q, "delete from recording_streams where id in (%s)", ids->str);
+		query_wrap(q);
+		g_string_free(q, TRUE);
+	}
+	g_string_free(ids, TRUE);
+	return num;
+}
+
+
+// runs the operations in order, stopping short if the connection was lost
+static void db_batch_exec(GQueue *ops, unsigned int gen) {
+	GList *l = ops->head;
+
+	while (l && gen == conn_gen) {
+		db_op_t *op = l->data;
+		unsigned int num = 1;
+
+		switch (op->type) {
+			case DB_OP_CALL:
+				db_run_call(op);
+				break;
+			case DB_OP_METADATA:
+				num = db_run_metadata(l);
+				break;
+			case DB_OP_CLOSE_CALL:
+				num = db_run_close_calls(l);
+				break;
+			case DB_OP_STREAM:
+				db_run_stream(op);
+				break;
+			case DB_OP_CLOSE_STREAM:
+				db_run_close_stream(op);
+				break;
+			case DB_OP_DELETE_STREAM:
+				num = db_run_delete_streams(l);
+				break;
+			case DB_OP_CONFIG_STREAM:
+				db_run_config_stream(op);
+				break;
+		}
+
+		while (num-- && l)
+			l = l->next;
+	}
+}
+
+// all operations of a batch are committed as one transaction. if the connection is
+// lost on the way, the transaction is gone, so any IDs assigned during it are forgotten
+// and the whole batch is run again
+static void db_batch_run(GQueue *ops) {
+	for (int attempt = 0; attempt < 3; attempt++) {
+		if (check_conn())
+			break;
+
+		unsigned int gen = conn_gen;
+		db_batch_exec(ops, gen);
+
+		if (gen == conn_gen) {
+			if (!mysql_commit(mysql_conn))
+				goto done;
+			ilog(LOG_ERR, "Failed to commit to MySQL: %s", mysql_error(mysql_conn));
+			reset_conn();
+		}
+
+		for (GList *l = ops->head; l; l = l->next) {
+			db_op_t *op = l->data;
+			if (!op->assigned)
+				continue;
+			if (op->type == DB_OP_CALL)
+				op->call->id = 0;
+			else
+				op->stream->id = 0;
+			op->assigned = 0;
+		}
+	}
+
+	if (db_configured())
+		ilog(LOG_ERR, "Giving up on %u database operations", ops->length);
+
+done:
+	// files only kept in the database can go now
+	for (GList *l = ops->head; l; l = l->next) {
+		db_op_t *op = l->data;
+		if (op->type == DB_OP_CLOSE_STREAM && !(output_storage & OUTPUT_STORAGE_FILE))
+			remove(op->s[0]);
+	}
+
+	g_queue_clear_full(ops, (GDestroyNotify) db_op_free);
+}
+
+
+static void db_thread_end(void *ptr) {
+	reset_conn();
+	mysql_thread_end();
+}
+
+// collects operations until either enough of them are waiting, or the oldest has waited
+// long enough, and then runs them as one batch
+static void *db_thread_loop(void *ptr) {
+	mysql_thread_init();
+	pthread_cleanup_push(db_thread_end, NULL);
+
+	pthread_mutex_lock(&db_queue_lock);
+
+	while (1) {
+		db_op_t *first = g_queue_peek_head(&db_queue);
+		if (!first) {
+			if (db_stop)
+				break;
+			pthread_cond_wait(&db_queue_cond, &db_queue_lock);
+			continue;
+		}
+
+		int64_t due = first->queued + (int64_t) db_batch_delay * 1000;
+		if (!db_stop && db_queue.length < db_batch_size && g_get_monotonic_time() < due) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			int64_t wait = due - g_get_monotonic_time();
+			if (wait > 0) {
+				ts.tv_sec += wait / 1000000;
+				ts.tv_nsec += (wait % 1000000) * 1000;
+				if (ts.tv_nsec >= 1000000000) {
+					ts.tv_sec++;
+					ts.tv_nsec -= 1000000000;
+				}
+				pthread_cond_timedwait(&db_queue_cond, &db_queue_lock, &ts);
+			}
+			continue;
+		}
+
+		GQueue batch = G_QUEUE_INIT;
+		while (batch.length < db_batch_size && db_queue.length)
+			g_queue_push_tail(&batch, g_queue_pop_head(&db_queue));
+
+		pthread_mutex_unlock(&db_queue_lock);
+		db_batch_run(&batch);
+		pthread_mutex_lock(&db_queue_lock);
+	}
+
+	pthread_mutex_unlock(&db_queue_lock);
+
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+
+void db_init(void) {
+	if (!db_configured())
 		return;
-	if (op->db_id == 0)
+	if (pthread_create(&db_thread, NULL, db_thread_loop, NULL))
+		die_errno("pthread_create failed");
+	db_running = 1;
+}
+
+// writes out everything still queued
+void db_cleanup(void) {
+	if (!db_running)
 		return;
+	pthread_mutex_lock(&db_queue_lock);
+	db_stop = 1;
+	pthread_cond_signal(&db_queue_cond);
+	pthread_mutex_unlock(&db_queue_lock);
+	pthread_join(db_thread, NULL);
+	db_running = 0;
+}
+
 
-        MYSQL_BIND b[1];
-	my_ull(&b[0], &op->db_id);
+// the following only queue up the operations
 
-	execute_wrap(&stm_delete_stream, b, NULL);
+static db_op_t *db_op_new(enum db_op_type type) {
+	db_op_t *op = g_slice_alloc0(sizeof(*op));
+	op->type = type;
+	op->now = now_double();
+	return op;
 }
 
-void db_config_stream(output_t *op) {
-	if (check_conn())
+static void db_do_call_id(metafile_t *mf) {
+	if (mf->db)
 		return;
-	if (op->db_id == 0)
+	if (!mf->call_id)
 		return;
 
-	MYSQL_BIND b[3];
-	my_i(&b[0], &op->encoder->actual_format.channels);
-	my_i(&b[1], &op->encoder->actual_format.clockrate);
-	my_ull(&b[2], &op->db_id);
+	mf->db = db_ref_new();
 
-	execute_wrap(&stm_config_stream, b, NULL);
+	db_op_t *op = db_op_new(DB_OP_CALL);
+	op->call = db_ref_get(mf->db);
+	op->s[0] = g_strdup(mf->call_id);
+	db_op_push(op);
+}
+static void db_do_call_metadata(metafile_t *mf) {
+	if (!mf->metadata_db)
+		return;
+	if (!mf->db)
+		return;
+
+	// XXX offload this parsing to proxy module -> bencode list/dictionary
+	str all_meta;
+	str_init(&all_meta, mf->metadata_db);
+	while (all_meta.len > 1) {
+		str token;
+		if (str_token_sep(&token, &all_meta, '|'))
+			break;
+
+		str key;
+		if (str_token(&key, &token, ':')) {
+			// key:value separator not found, skip
+			continue;
+		}
+
+		db_op_t *op = db_op_new(DB_OP_METADATA);
+		op->call = db_ref_get(mf->db);
+		op->s[0] = g_strndup(key.s, key.len);
+		op->s[1] = g_strndup(token.s, token.len);
+		db_op_push(op);
+	}
+
+	mf->metadata_db = NULL;
+}
+
+void db_do_call(metafile_t *mf) {
+	if (!db_configured())
+		return;
+
+	db_do_call_id(mf);
+	db_do_call_metadata(mf);
+}
+
+
+// mf is locked
+void db_do_stream(metafile_t *mf, output_t *op, const char *type, stream_t *stream, unsigned long ssrc) {
+	if (!mf->db)
+		return;
+	if (op->db)
+		return;
+
+	op->db = db_ref_new();
+
+	db_op_t *dop = db_op_new(DB_OP_STREAM);
+	dop->call = db_ref_get(mf->db);
+	dop->stream = db_ref_get(op->db);
+	dop->s[0] = g_strdup(op->file_name);
+	dop->s[1] = g_strdup(op->file_format);
+	dop->s[2] = g_strdup(op->full_filename);
+	dop->s[3] = g_strdup(type);
+	if (stream && stream->tag != (unsigned long) -1) {
+		tag_t *tag = tag_get(mf, stream->tag);
+		dop->s[4] = g_strdup(tag->label ? : "");
+	}
+	else
+		dop->s[4] = g_strdup("");
+	dop->stream_id = stream ? stream->id : 0;
+	dop->ssrc = ssrc;
+	db_op_push(dop);
+}
+
+void db_close_call(metafile_t *mf) {
+	if (!mf->db)
+		return;
+
+	db_op_t *op = db_op_new(DB_OP_CLOSE_CALL);
+	op->call = db_ref_get(mf->db);
+	db_op_push(op);
+}
+
+void db_close_stream(output_t *op) {
+	if (!op->db)
+		return;
+
+	db_op_t *dop = db_op_new(DB_OP_CLOSE_STREAM);
+	dop->stream = db_ref_get(op->db);
+	dop->s[0] = g_strdup_printf("%s.%s", op->full_filename, op->file_format);
+	db_op_push(dop);
+}
+
+void db_delete_stream(output_t *op) {
+	if (!op->db)
+		return;
+
+	db_op_t *dop = db_op_new(DB_OP_DELETE_STREAM);
+	dop->stream = db_ref_get(op->db);
+	db_op_push(dop);
+}
+
+void db_config_stream(output_t *op) {
+	if (!op->db)
+		return;
+
+	db_op_t *dop = db_op_new(DB_OP_CONFIG_STREAM);
+	dop->stream = db_ref_get(op->db);
+	dop->channels = op->encoder->actual_format.channels;
+	dop->clockrate = op->encoder->actual_format.clockrate;
+	db_op_push(dop);
 }
@@ -4,6 +4,10 @@
 #include "types.h"
 
 
+void db_init(void);
+void db_cleanup(void);
+void db_release(struct db_ref **);
+
 void db_do_call(metafile_t *);
 void db_close_call(metafile_t *);
 void db_do_stream(metafile_t *mf, output_t *op, const char *type, stream_t *, unsigned long ssrc);
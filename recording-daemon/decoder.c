@@ -92,12 +92,65 @@ decode_t *decoder_new(const char *payload_str, const char *format, int ptime, ou
 }
 
 
+// Versions of one decoded frame, one per sample format, so that outputs asking for the
+// same format share a single conversion. The first entry is the decoded frame itself.
+// Entries stay owned by the cache and users get their own reference to the same data.
+#define FRAME_CACHE_SIZE 3 // decoded, mix, TLS
+
+struct frame_cache {
+	unsigned int num;
+	format_t formats[FRAME_CACHE_SIZE];
+	AVFrame *frames[FRAME_CACHE_SIZE];
+};
+
+static void frame_cache_init(struct frame_cache *fc, AVFrame *frame) {
+	fc->num = 1;
+	fc->formats[0] = (format_t) {
+		.clockrate = frame->sample_rate,
+		.channels = frame->channels,
+		.format = frame->format,
+	};
+	fc->frames[0] = frame;
+}
+
+static AVFrame *frame_cache_ref(AVFrame *frame) {
+	AVFrame *ret = codeclib_frame_alloc();
+	if (ret && av_frame_ref(ret, frame) < 0)
+		codeclib_frame_free(&ret);
+	return ret;
+}
+
+// returns a new reference, to be released through codeclib_frame_free
+static AVFrame *frame_cache_get(struct frame_cache *fc, resample_t *resampler, const format_t *fmt) {
+	for (unsigned int i = 0; i < fc->num; i++) {
+		if (format_eq(&fc->formats[i], fmt))
+			return frame_cache_ref(fc->frames[i]);
+	}
+
+	AVFrame *ret = resample_frame(resampler, fc->frames[0], fmt);
+	if (!ret || fc->num >= FRAME_CACHE_SIZE)
+		return ret;
+
+	fc->formats[fc->num] = *fmt;
+	fc->frames[fc->num++] = ret;
+	return frame_cache_ref(ret);
+}
+
+static void frame_cache_clear(struct frame_cache *fc) {
+	// the first one belongs to the caller
+	for (unsigned int i = 1; i < fc->num; i++)
+		codeclib_frame_free(&fc->frames[i]);
+	fc->num = 0;
+}
+
+
 static int decoder_got_frame(decoder_t *dec, AVFrame *frame, void *sp, void *dp) {
 	ssrc_t *ssrc = sp;
 	metafile_t *metafile = ssrc->metafile;
 	output_t *output = ssrc->output;
 	stream_t *stream = ssrc->stream;
 	decode_t *deco = dp;
+	struct frame_cache fc;
 
 	dbg("got frame pts %llu samples %u contents %02x%02x%02x%02x...", (unsigned long long) frame->pts, frame->nb_samples,
 			(unsigned int) frame->extended_data[0][0],
@@ -105,6 +158,8 @@ static int decoder_got_frame(decoder_t *dec, AVFrame *frame, void *sp, void *dp)
 			(unsigned int) frame->extended_data[0][2],
 			(unsigned int) frame->extended_data[0][3]);
 
+	frame_cache_init(&fc, frame);
+
 	if (!metafile->recording_on)
 		goto no_recording;
 
@@ -118,8 +173,7 @@ static int decoder_got_frame(decoder_t *dec, AVFrame *frame, void *sp, void *dp)
 		if (output_config(metafile->mix_out, &dec->out_format, &actual_format))
 			goto no_mix_out;
 		mix_config(metafile->mix, &actual_format);
-		// XXX might be a second resampling to same format
-		AVFrame *dec_frame = resample_frame(&deco->mix_resampler, frame, &actual_format);
+		AVFrame *dec_frame = frame_cache_get(&fc, &deco->mix_resampler, &actual_format);
 		if (!dec_frame) {
 			pthread_mutex_unlock(&metafile->mix_lock);
 			goto err;
@@ -140,9 +194,10 @@ no_mix_out:
 
 no_recording:
 	if (ssrc->tls_fwd_stream) {
-		// XXX might be a second resampling to same format
 		dbg("SSRC %lx of stream #%lu has TLS forwarding stream", ssrc->ssrc, stream->id);
-		AVFrame *dec_frame = resample_frame(&ssrc->tls_fwd_resampler, frame, &ssrc->tls_fwd_format);
+		AVFrame *dec_frame = frame_cache_get(&fc, &ssrc->tls_fwd_resampler, &ssrc->tls_fwd_format);
+		if (!dec_frame)
+			goto err;
 
 		ssrc_tls_state(ssrc);
 
@@ -159,17 +214,18 @@ no_recording:
 		}
 
 		dbg("Writing %u bytes PCM to TLS", dec_frame->linesize[0]);
-		streambuf_write(ssrc->tls_fwd_stream, (char *) dec_frame->extended_data[0],
-				dec_frame->linesize[0]);
-		av_frame_free(&dec_frame);
+		ssrc_tls_fwd(ssrc, (char *) dec_frame->extended_data[0], dec_frame->linesize[0]);
+		codeclib_frame_free(&dec_frame);
 
 	}
 
-	av_frame_free(&frame);
+	frame_cache_clear(&fc);
+	codeclib_frame_free(&frame);
 	return 0;
 
 err:
-	av_frame_free(&frame);
+	frame_cache_clear(&fc);
+	codeclib_frame_free(&frame);
 	return -1;
 }
 
@@ -3,9 +3,16 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
 #include "main.h"
 #include "log.h"
 
+
+// room for at least one packet of any size
+#define FORWARD_BATCH_BYTES (0x10000 + sizeof(struct forward_hdr))
+
+
 void start_forwarding_capture(metafile_t *mf, char *meta_info) {
 	int sock;
 	struct sockaddr_un addr;
@@ -50,7 +57,82 @@ err:
 	close(sock);
 }
 
-int forward_packet(metafile_t *mf, unsigned char *buf, unsigned len) {
+static int forward_send(metafile_t *mf, const void *buf, size_t len) {
+	if (send(mf->forward_fd, buf, len, 0) == -1) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			ilog(LOG_DEBUG, "Dropping packet since call would block");
+		else
+			ilog(LOG_ERR, "Error sending: %s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// forward_lock must be held
+static void forward_flush(metafile_t *mf) {
+	if (!mf->forward_batch_num)
+		return;
+
+	if (forward_send(mf, mf->forward_buf, mf->forward_buf_len))
+		g_atomic_int_add(&mf->forward_failed, mf->forward_batch_num);
+	else
+		g_atomic_int_add(&mf->forward_count, mf->forward_batch_num);
+
+	mf->forward_buf_len = 0;
+	mf->forward_batch_num = 0;
+}
+
+// packets are collected per call and sent out together once enough of them have come in,
+// or the first of them has been waiting for long enough
+static void forward_batch_packet(stream_t *stream, unsigned char *buf, unsigned len) {
+	metafile_t *mf = stream->metafile;
+	struct forward_hdr hdr = {
+		.stream = htonl(stream->id),
+		.len = htons(len),
+	};
+
+	if (len > 0xffff) {
+		g_atomic_int_inc(&mf->forward_failed);
+		return;
+	}
+
+	pthread_mutex_lock(&mf->forward_lock);
+
+	if (mf->forward_fd == -1) {
+		pthread_mutex_unlock(&mf->forward_lock);
+		ilog(LOG_ERR, "Trying to send packets, but connection not initialized!");
+		g_atomic_int_inc(&mf->forward_failed);
+		return;
+	}
+
+	if (mf->forward_buf_len + sizeof(hdr) + len > FORWARD_BATCH_BYTES)
+		forward_flush(mf);
+	if (!mf->forward_buf)
+		mf->forward_buf = malloc(FORWARD_BATCH_BYTES);
+
+	int64_t now = g_get_monotonic_time();
+	if (!mf->forward_batch_num)
+		mf->forward_batch_start = now;
+
+	memcpy(mf->forward_buf + mf->forward_buf_len, &hdr, sizeof(hdr));
+	memcpy(mf->forward_buf + mf->forward_buf_len + sizeof(hdr), buf, len);
+	mf->forward_buf_len += sizeof(hdr) + len;
+	mf->forward_batch_num++;
+
+	if (mf->forward_batch_num >= forward_batch
+			|| now - mf->forward_batch_start >= (int64_t) forward_batch_delay * 1000)
+		forward_flush(mf);
+
+	pthread_mutex_unlock(&mf->forward_lock);
+}
+
+void forward_packet(stream_t *stream, unsigned char *buf, unsigned len) {
+	metafile_t *mf = stream->metafile;
+
+	if (forward_batch > 1) {
+		forward_batch_packet(stream, buf, len);
+		return;
+	}
 
 	if (mf->forward_fd == -1) {
 		ilog(LOG_ERR,
@@ -58,17 +140,26 @@ int forward_packet(metafile_t *mf, unsigned char *buf, unsigned len) {
 		goto err;
 	}
 
-	if (send(mf->forward_fd, buf, len, 0) == -1) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK)
-			ilog(LOG_DEBUG, "Dropping packet since call would block");
-		else
-			ilog(LOG_ERR, "Error sending: %s", strerror(errno));
+	if (forward_send(mf, buf, len))
 		goto err;
-	}
 
-	return 0;
+	g_atomic_int_inc(&mf->forward_count);
+	return;
 
 err:
-	return -1;
+	g_atomic_int_inc(&mf->forward_failed);
 }
 
+// mf is locked
+void forward_close(metafile_t *mf) {
+	pthread_mutex_lock(&mf->forward_lock);
+	if (mf->forward_fd >= 0) {
+		forward_flush(mf);
+		dbg("call [%s%s%s] forwarded %d packets. %d failed sends.", FMT_M(mf->call_id),
+				(int )g_atomic_int_get(&mf->forward_count),
+				(int )g_atomic_int_get(&mf->forward_failed));
+		close(mf->forward_fd);
+		mf->forward_fd = -1;
+	}
+	pthread_mutex_unlock(&mf->forward_lock);
+}
@@ -1,9 +1,19 @@
 #ifndef _FORWARD_H_
 #define _FORWARD_H_
 
+#include <stdint.h>
 #include "types.h"
 
+// with --forward-batch, each message on the socket holds one or more records made of
+// this header followed by the raw packet. all fields are in network byte order
+struct forward_hdr {
+	uint32_t stream; // stream number as used in the metadata file
+	uint16_t len; // length of the packet that follows
+	uint16_t reserved;
+};
+
 void start_forwarding_capture(metafile_t *mf, char *meta_info);
-int forward_packet(metafile_t *mf, unsigned char *buf, unsigned len);
+void forward_packet(stream_t *stream, unsigned char *buf, unsigned len);
+void forward_close(metafile_t *mf);
 
 #endif
@@ -4,97 +4,176 @@
 #include "log.h"
 
 
-typedef struct {
+// Deferred frees use quiescent-state based reclamation. A global epoch is advanced
+// for every garbage entry and the entry remembers the new value. Each poller thread
+// publishes the epoch it last saw whenever it passes through garbage_collect(), i.e.
+// outside of epoll_wait(). Once every thread has published an epoch at least as new
+// as an entry's, no thread can still be looking at the removed fd and the entry is
+// freed.
+
+typedef struct garbage {
 	void *ptr;
 	void (*free_func)(void *);
-	int *wait_threads;
-	unsigned int array_len;
-	unsigned int threads_left;
+	int epoch;
+	struct garbage *next;
 } garbage_t;
 
+typedef struct garbage_thread {
+	unsigned int num;
+	volatile int epoch; // last epoch seen by this thread
+	struct garbage_thread *next;
+} garbage_thread_t;
 
-static pthread_mutex_t garbage_lock = PTHREAD_MUTEX_INITIALIZER;
-static GQueue garbage = G_QUEUE_INIT;
+
+static volatile int garbage_epoch;
+static garbage_t *volatile garbage_retired; // lock-free stack of new entries
+static garbage_thread_t *volatile garbage_threads; // only ever grows
 static volatile int garbage_thread_num;
 
+// held by whichever thread is freeing entries. others don't wait for it
+static pthread_mutex_t garbage_reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static garbage_t *garbage_pending; // LOCK: garbage_reclaim_lock
+static volatile int garbage_num_pending;
 
-unsigned int garbage_new_thread_num(void) {
+static __thread garbage_thread_t *garbage_self;
+
+
+// epoch a is at least as new as b, allowing for wrap-around
+static inline int garbage_epoch_passed(int a, int b) {
+	return (int) ((unsigned int) a - (unsigned int) b) >= 0;
+}
+
+static inline int garbage_fetch_add(volatile int *i, int val) {
 #if GLIB_CHECK_VERSION(2,30,0)
-	return g_atomic_int_add(&garbage_thread_num, 1);
+	return g_atomic_int_add(i, val);
 #else
-	return g_atomic_int_exchange_and_add(&garbage_thread_num, 1);
+	return g_atomic_int_exchange_and_add(i, val);
 #endif
 }
 
 
-void garbage_add(void *ptr, free_func_t *free_func) {
-	// Each running poller thread has a unique number associated with it, starting
-	// with 0. A garbage entry uses an array of boolean flags, one for each running
-	// thread, to keep track of which threads have seen this entry. Once a garbage
-	// entry has been seen by all threads, the free function is finally called.
-	// This is to make sure that all poller threads have left epoll_wait() after
-	// an fd has been removed from the watch list.
+unsigned int garbage_new_thread_num(void) {
+	// called before the thread is started, so that entries added from now on also
+	// wait for the new thread
+	garbage_thread_t *t = g_slice_alloc0(sizeof(*t));
+	t->num = garbage_fetch_add(&garbage_thread_num, 1);
+	t->epoch = g_atomic_int_get(&garbage_epoch);
 
+	do
+		t->next = g_atomic_pointer_get(&garbage_threads);
+	while (!g_atomic_pointer_compare_and_exchange(&garbage_threads, t->next, t));
+
+	return t->num;
+}
+
+
+void garbage_add(void *ptr, free_func_t *free_func) {
 	garbage_t *garb = g_slice_alloc(sizeof(*garb));
 	garb->ptr = ptr;
 	garb->free_func = free_func;
+	garb->epoch = garbage_fetch_add(&garbage_epoch, 1) + 1;
 
-	pthread_mutex_lock(&garbage_lock);
-
-	garb->array_len = g_atomic_int_get(&garbage_thread_num);
-	garb->threads_left = garb->array_len;
-	garb->wait_threads = malloc(sizeof(int) * garb->array_len);
-	memset(garb->wait_threads, 0, sizeof(int) * garb->array_len);
-
-	g_queue_push_tail(&garbage, garb);
+	do
+		garb->next = g_atomic_pointer_get(&garbage_retired);
+	while (!g_atomic_pointer_compare_and_exchange(&garbage_retired, garb->next, garb));
 
-	pthread_mutex_unlock(&garbage_lock);
+	g_atomic_int_inc(&garbage_num_pending);
 }
 
 
 static void garbage_collect1(garbage_t *garb) {
 	garb->free_func(garb->ptr);
-
-	free(garb->wait_threads);
 	g_slice_free1(sizeof(*garb), garb);
 }
 
 
+static garbage_t *garbage_take_retired(void) {
+	garbage_t *list;
+	do
+		list = g_atomic_pointer_get(&garbage_retired);
+	while (list && !g_atomic_pointer_compare_and_exchange(&garbage_retired, list, NULL));
+	return list;
+}
+
+
 void garbage_collect(unsigned int num) {
+	if (G_UNLIKELY(!garbage_self)) {
+		for (garbage_thread_t *t = g_atomic_pointer_get(&garbage_threads); t; t = t->next) {
+			if (t->num == num) {
+				garbage_self = t;
+				break;
+			}
+		}
+		if (!garbage_self)
+			return;
+	}
+
+	int epoch = g_atomic_int_get(&garbage_epoch);
+	g_atomic_int_set(&garbage_self->epoch, epoch);
+
+	if (G_LIKELY(!g_atomic_int_get(&garbage_num_pending)))
+		return;
+	if (pthread_mutex_trylock(&garbage_reclaim_lock))
+		return;
+
 	dbg("running garbage collection thread %u", num);
 
-restart:
-	pthread_mutex_lock(&garbage_lock);
+	// oldest epoch that some thread may still be in
+	int oldest = epoch;
+	for (garbage_thread_t *t = g_atomic_pointer_get(&garbage_threads); t; t = t->next) {
+		int e = g_atomic_int_get(&t->epoch);
+		if (!garbage_epoch_passed(e, oldest))
+			oldest = e;
+	}
 
-	for (GList *l = garbage.head; l; l = l->next) {
-		garbage_t *garb = l->data;
-		// has this been created before we were running?
-		if (garb->array_len <= num)
-			continue;
-		// have we processed this already?
-		if (garb->wait_threads[num])
+	// move new entries to the pending list
+	garbage_t *list = garbage_take_retired();
+	while (list) {
+		garbage_t *garb = list;
+		list = garb->next;
+		garb->next = garbage_pending;
+		garbage_pending = garb;
+	}
+
+	garbage_t *done = NULL;
+	for (garbage_t **pp = &garbage_pending; *pp; ) {
+		garbage_t *garb = *pp;
+		if (!garbage_epoch_passed(oldest, garb->epoch)) {
+			pp = &garb->next;
 			continue;
-		dbg("marking garbage entry %p as seen by %u with %u threads left", garb, num,
-				garb->threads_left);
-		garb->wait_threads[num] = 1;
-		garb->threads_left--;
-		// anything left?
-		if (!garb->threads_left) {
-			// remove from list and process
-			g_queue_delete_link(&garbage, l);
-			pthread_mutex_unlock(&garbage_lock);
-			garbage_collect1(garb);
-
-			goto restart;
 		}
+		*pp = garb->next;
+		garb->next = done;
+		done = garb;
+		g_atomic_int_add(&garbage_num_pending, -1);
 	}
 
-	pthread_mutex_unlock(&garbage_lock);
+	pthread_mutex_unlock(&garbage_reclaim_lock);
+
+	while (done) {
+		garbage_t *garb = done;
+		done = garb->next;
+		dbg("freeing garbage entry %p from epoch %i", garb, garb->epoch);
+		garbage_collect1(garb);
+	}
 }
 
 
 void garbage_collect_all(void) {
 	garbage_t *garb;
-	while ((garb = g_queue_pop_head(&garbage)))
+
+	pthread_mutex_lock(&garbage_reclaim_lock);
+	while ((garb = garbage_pending)) {
+		garbage_pending = garb->next;
 		garbage_collect1(garb);
+	}
+	pthread_mutex_unlock(&garbage_reclaim_lock);
+
+	garbage_t *list = garbage_take_retired();
+	while ((garb = list)) {
+		list = garb->next;
+		garbage_collect1(garb);
+	}
+
+	g_atomic_int_set(&garbage_num_pending, 0);
 }
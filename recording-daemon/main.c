@@ -16,6 +16,7 @@
 #include "log.h"
 #include "epoll.h"
 #include "inotify.h"
+#include "metasock.h"
 #include "metafile.h"
 #include "garbage.h"
 #include "loglib.h"
@@ -26,6 +27,9 @@
 #include "codeclib.h"
 #include "socket.h"
 #include "ssllib.h"
+#include "pipeline.h"
+#include "db.h"
+#include "convert.h"
 
 
 
@@ -37,6 +41,7 @@ char *output_dir = NULL;
 static char *output_format = NULL;
 int output_mixed;
 int output_single;
+enum mix_method_enum mix_method = MIX_METHOD_AMIX;
 int output_enabled = 1;
 int decoding_enabled;
 char *c_mysql_host,
@@ -44,10 +49,24 @@ char *c_mysql_host,
       *c_mysql_pass,
       *c_mysql_db;
 int c_mysql_port;
+unsigned int db_batch_size = 100;
+int db_batch_delay = 200;
 char *forward_to = NULL;
+int forward_batch;
+int forward_batch_delay = 20;
+int tls_batch_delay;
 static char *tls_send_to = NULL;
 endpoint_t tls_send_to_ep;
+static char *stream_to = NULL;
+endpoint_t stream_to_ep;
 int tls_resample = 8000;
+int decode_threads;
+int output_threads;
+unsigned int pipeline_queue_len = 1000;
+int output_buffer;
+enum output_fsync_enum output_fsync = OUTPUT_FSYNC_NEVER;
+static int stats_interval;
+static char **convert_pcap; // batch mode if set
 
 static GQueue threads = G_QUEUE_INIT; // only accessed from main thread
 
@@ -77,7 +96,7 @@ static void setup(void) {
 		codeclib_init(0);
 	if (output_enabled) {
 		output_init(output_format);
-		if (!g_file_test(output_dir, G_FILE_TEST_IS_DIR)) {
+		if (!stream_to_ep.port && !g_file_test(output_dir, G_FILE_TEST_IS_DIR)) {
 			ilog(LOG_INFO, "Creating output dir '%s'", output_dir);
 			if (mkdir(output_dir, 0700))
 				die_errno("Failed to create output dir '%s'", output_dir);
@@ -86,8 +105,11 @@ static void setup(void) {
 	mysql_library_init(0, NULL, NULL);
 	signals();
 	metafile_setup();
+	if (convert_pcap)
+		return;
 	epoll_setup();
 	inotify_setup();
+	metasock_setup();
 
 }
 
@@ -133,7 +155,16 @@ static void wait_for_signal(void) {
 	sigaddset(&ss, SIGTERM);
 
 	while (1) {
-		ret = sigwait(&ss, &sig);
+		if (stats_interval > 0) {
+			struct timespec ts = { .tv_sec = stats_interval };
+			ret = sig = sigtimedwait(&ss, NULL, &ts);
+			if (ret == -1 && errno == EAGAIN) {
+				pipeline_stats();
+				continue;
+			}
+		}
+		else
+			ret = sigwait(&ss, &sig);
 		if (ret == -1) {
 			if (errno == EAGAIN || errno == EINTR)
 				continue;
@@ -148,14 +179,23 @@ static void wait_for_signal(void) {
 static void cleanup(void) {
 	garbage_collect_all();
 	metafile_cleanup();
-	inotify_cleanup();
-	epoll_cleanup();
+	// all outputs are closed now
+	pipeline_stop(PIPELINE_OUTPUT);
+	pipeline_stop(PIPELINE_WRITE);
+	db_cleanup();
+	if (!convert_pcap) {
+		metasock_cleanup();
+		inotify_cleanup();
+		epoll_cleanup();
+	}
 	mysql_library_end();
 }
 
 
 static void options(int *argc, char ***argv) {
 	char *os_str = NULL;
+	char *mix_method_str = NULL;
+	char *fsync_str = NULL;
 
 	GOptionEntry e[] = {
 		{ "table",		't', 0, G_OPTION_ARG_INT,	&ktable,	"Kernel table rtpengine uses",		"INT"		},
@@ -163,19 +203,33 @@ static void options(int *argc, char ***argv) {
 		{ "num-threads",	0,   0, G_OPTION_ARG_INT,	&num_threads,	"Number of worker threads",		"INT"		},
 		{ "output-storage",	0,   0, G_OPTION_ARG_STRING,	&os_str,	"Where to store audio streams",	        "file|db|both"	},
 		{ "output-dir",		0,   0, G_OPTION_ARG_STRING,	&output_dir,	"Where to write media files to",	"PATH"		},
-		{ "output-format",	0,   0, G_OPTION_ARG_STRING,	&output_format,	"Write audio files of this type",	"wav|mp3|none"	},
+		{ "output-format",	0,   0, G_OPTION_ARG_STRING,	&output_format,	"Write audio files of this type",	"wav|mp3|rtp|none"},
+		{ "stream-to",		0,   0, G_OPTION_ARG_STRING,	&stream_to,	"Where to send RTP output to",		"IP:PORT"	},
 		{ "resample-to",	0,   0, G_OPTION_ARG_INT,	&resample_audio,"Resample all output audio",		"INT"		},
 		{ "mp3-bitrate",	0,   0, G_OPTION_ARG_INT,	&mp3_bitrate,	"Bits per second for MP3 encoding",	"INT"		},
+		{ "output-buffer",	0,   0, G_OPTION_ARG_INT,	&output_buffer,	"Buffer output files in memory and write them out in chunks of this size","KB"},
+		{ "output-fsync",	0,   0, G_OPTION_ARG_STRING,	&fsync_str,	"When to sync buffered output files to disk","never|close|flush"},
 		{ "output-mixed",	0,   0, G_OPTION_ARG_NONE,	&output_mixed,	"Mix participating sources into a single output",NULL	},
 		{ "output-single",	0,   0, G_OPTION_ARG_NONE,	&output_single,	"Create one output file for each source",NULL		},
+		{ "mix-method",		0,   0, G_OPTION_ARG_STRING,	&mix_method_str,"How to mix audio sources",		"amix|native"	},
 		{ "mysql-host",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_host,	"MySQL host for storage of call metadata","HOST|IP"	},
 		{ "mysql-port",		0,   0,	G_OPTION_ARG_INT,	&c_mysql_port,	"MySQL port"				,"INT"		},
 		{ "mysql-user",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_user,	"MySQL connection credentials",		"USERNAME"	},
 		{ "mysql-pass",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_pass,	"MySQL connection credentials",		"PASSWORD"	},
 		{ "mysql-db",		0,   0,	G_OPTION_ARG_STRING,	&c_mysql_db,	"MySQL database name",			"STRING"	},
+		{ "mysql-batch-size",	0,   0,	G_OPTION_ARG_INT,	&db_batch_size,	"Max number of MySQL operations per transaction","INT"	},
+		{ "mysql-batch-delay",	0,   0,	G_OPTION_ARG_INT,	&db_batch_delay,"How long MySQL operations may be held back for batching","MS"},
 		{ "forward-to", 	0,   0, G_OPTION_ARG_STRING,	&forward_to,	"Where to forward to (unix socket)",	"PATH"		},
+		{ "forward-batch",	0,   0, G_OPTION_ARG_INT,	&forward_batch,	"Max number of forwarded packets per message","INT"	},
+		{ "forward-batch-delay",0,   0, G_OPTION_ARG_INT,	&forward_batch_delay,"How long forwarded packets may be held back for batching","MS"},
 		{ "tls-send-to", 	0,   0, G_OPTION_ARG_STRING,	&tls_send_to,	"Where to send to (TLS destination)",	"IP:PORT"	},
 		{ "tls-resample", 	0,   0, G_OPTION_ARG_INT,	&tls_resample,	"Sampling rate for TLS PCM output",	"INT"		},
+		{ "tls-batch-delay",	0,   0, G_OPTION_ARG_INT,	&tls_batch_delay,"How long TLS PCM output may be held back for batching","MS"},
+		{ "decode-threads",	0,   0, G_OPTION_ARG_INT,	&decode_threads,"Number of threads for decoding and mixing","INT"	},
+		{ "output-threads",	0,   0, G_OPTION_ARG_INT,	&output_threads,"Number of threads for writing output files","INT"	},
+		{ "queue-length",	0,   0, G_OPTION_ARG_INT,	&pipeline_queue_len,"Max number of jobs queued for each decoding or output thread","INT"},
+		{ "stats-interval",	0,   0, G_OPTION_ARG_INT,	&stats_interval,"Seconds between logging queue statistics","SECS"	},
+		{ "convert-pcap",	0,   0, G_OPTION_ARG_STRING_ARRAY,&convert_pcap,"Convert pcap recordings given by their metadata files and exit","PATH"},
 		{ NULL, }
 	};
 
@@ -197,6 +251,15 @@ static void options(int *argc, char ***argv) {
 			die("Failed to parse 'tls-send-to' option");
 	}
 
+	if (!strcmp(output_format, "rtp")) {
+		if (!stream_to)
+			die("Output format 'rtp' requires the 'stream-to' option");
+		if (endpoint_parse_any_getaddrinfo_full(&stream_to_ep, stream_to))
+			die("Failed to parse 'stream-to' option");
+	}
+	else if (stream_to)
+		die("The 'stream-to' option can only be used with output format 'rtp'");
+
 	if (!strcmp(output_format, "none")) {
 		output_enabled = 0;
 		if (output_mixed || output_single)
@@ -221,11 +284,50 @@ static void options(int *argc, char ***argv) {
 		output_storage = OUTPUT_STORAGE_BOTH;
 	else
 		die("Invalid 'output-storage' option");
+	if (stream_to_ep.port && (output_storage & OUTPUT_STORAGE_DB))
+		die("RTP output cannot be stored in the database");
+
+	if (decode_threads < 0)
+		die("Invalid negative 'decode-threads' option");
+	if (output_threads < 0)
+		die("Invalid negative 'output-threads' option");
+	if ((int) pipeline_queue_len <= 0)
+		die("Invalid 'queue-length' option");
+
+	if ((int) db_batch_size <= 0)
+		die("Invalid 'mysql-batch-size' option");
+	if (db_batch_delay < 0)
+		die("Invalid negative 'mysql-batch-delay' option");
+
+	if (forward_batch < 0)
+		die("Invalid negative 'forward-batch' option");
+	if (forward_batch_delay < 0)
+		die("Invalid negative 'forward-batch-delay' option");
+
+	if (output_buffer < 0)
+		die("Invalid negative 'output-buffer' option");
+	if (!fsync_str || !strcmp(fsync_str, "never"))
+		output_fsync = OUTPUT_FSYNC_NEVER;
+	else if (!strcmp(fsync_str, "close"))
+		output_fsync = OUTPUT_FSYNC_CLOSE;
+	else if (!strcmp(fsync_str, "flush"))
+		output_fsync = OUTPUT_FSYNC_FLUSH;
+	else
+		die("Invalid 'output-fsync' option");
+
+	if (!mix_method_str || !strcmp(mix_method_str, "amix"))
+		mix_method = MIX_METHOD_AMIX;
+	else if (!strcmp(mix_method_str, "native"))
+		mix_method = MIX_METHOD_NATIVE;
+	else
+		die("Invalid 'mix-method' option");
 
 	if ((output_storage & OUTPUT_STORAGE_FILE) && !strcmp(output_dir, spool_dir))
 		die("The spool-dir cannot be the same as the output-dir");
 
 	g_free(os_str);
+	g_free(mix_method_str);
+	g_free(fsync_str);
 }
 
 static void options_free(void) {
@@ -239,19 +341,44 @@ static void options_free(void) {
 	g_free(c_mysql_db);
 	g_free(forward_to);
 	g_free(tls_send_to);
+	g_free(stream_to);
+	g_strfreev(convert_pcap);
 
 	// free common config options
 	config_load_free(&rtpe_common_config);
 }
 
+// runs the pipeline on pcap recordings instead of live calls, from the foreground
+static int convert_main(void) {
+	db_init();
+	pipeline_init();
+
+	convert_run(convert_pcap);
+
+	if (decoding_enabled)
+		codeclib_free();
+
+	cleanup();
+	options_free();
+	log_free();
+
+	return convert_failures() ? 1 : 0;
+}
+
 int main(int argc, char **argv) {
 	options(&argc, &argv);
 	setup();
+	if (convert_pcap)
+		return convert_main();
 	daemonize();
+	log_async_start();
 	wpidfile();
 
 	service_notify("READY=1\n");
 
+	db_init();
+	pipeline_init();
+
 	for (int i = 0; i < num_threads; i++)
 		start_poller_thread();
 
@@ -261,6 +388,9 @@ int main(int argc, char **argv) {
 	dbg("shutting down");
 
 	wait_threads_finish();
+	// no more packets coming in. finish decoding what's queued up
+	pipeline_stats();
+	pipeline_stop(PIPELINE_DECODE);
 
 	if (decoding_enabled)
 		codeclib_free();
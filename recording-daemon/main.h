@@ -11,6 +11,15 @@ enum output_storage_enum {
 	OUTPUT_STORAGE_DB = 0x2,
 	OUTPUT_STORAGE_BOTH = 0x3,
 };
+enum output_fsync_enum {
+	OUTPUT_FSYNC_NEVER = 0,
+	OUTPUT_FSYNC_CLOSE,
+	OUTPUT_FSYNC_FLUSH,
+};
+enum mix_method_enum {
+	MIX_METHOD_AMIX = 0,
+	MIX_METHOD_NATIVE,
+};
 
 extern int ktable;
 extern int num_threads;
@@ -19,6 +28,7 @@ extern char *spool_dir;
 extern char *output_dir;
 extern int output_mixed;
 extern int output_single;
+extern enum mix_method_enum mix_method;
 extern int output_enabled;
 extern int decoding_enabled;
 extern char *c_mysql_host,
@@ -26,9 +36,20 @@ extern char *c_mysql_host,
       *c_mysql_pass,
       *c_mysql_db;
 extern int c_mysql_port;
+extern unsigned int db_batch_size;
+extern int db_batch_delay;
 extern char *forward_to;
+extern int forward_batch;
+extern int forward_batch_delay;
 extern endpoint_t tls_send_to_ep;
+extern endpoint_t stream_to_ep;
 extern int tls_resample;
+extern int tls_batch_delay;
+extern int decode_threads;
+extern int output_threads;
+extern unsigned int pipeline_queue_len;
+extern int output_buffer;
+extern enum output_fsync_enum output_fsync;
 
 extern volatile int shutdown_flag;
 
@@ -17,9 +17,19 @@
 #include "db.h"
 #include "forward.h"
 #include "tag.h"
+#include "pipeline.h"
 
-static pthread_mutex_t metafiles_lock = PTHREAD_MUTEX_INITIALIZER;
-static GHashTable *metafiles;
+// Active metafiles are spread over several tables by name hash. Each table lock is only
+// held for the lookup itself; a metafile found there is kept alive by its reference count
+// while the caller waits for its own lock, so a busy call doesn't hold up any other.
+#define METAFILE_SHARDS 64
+
+struct metafile_shard {
+	pthread_rwlock_t lock;
+	GHashTable *ht; // holds one reference to each metafile
+};
+
+static struct metafile_shard metafiles[METAFILE_SHARDS];
 
 
 static void meta_free(void *ptr) {
@@ -42,10 +52,38 @@ static void meta_free(void *ptr) {
 	g_ptr_array_free(mf->tags, TRUE);
 	if (mf->ssrc_hash)
 		g_hash_table_destroy(mf->ssrc_hash);
+	db_release(&mf->db);
+	free(mf->forward_buf);
 	g_slice_free1(sizeof(*mf), mf);
 }
 
 
+static void meta_free_job(void *ptr, void *arg, unsigned long len) {
+	meta_free(ptr);
+}
+// called once no poller thread can be using the metafile any more. packets may still be
+// waiting to be decoded though, so get in line behind them
+static void meta_free_later(void *ptr) {
+	metafile_t *mf = ptr;
+	pipeline_push(PIPELINE_DECODE, mf->pipeline_hash, meta_free_job, mf, NULL, 0, PIPELINE_FORCE);
+}
+
+
+static void meta_put(metafile_t *mf) {
+	if (!g_atomic_int_dec_and_test(&mf->refs))
+		return;
+	if (mf->offline)
+		meta_free_later(mf); // never seen by a poller thread
+	else
+		garbage_add(mf, meta_free_later);
+}
+
+
+static struct metafile_shard *meta_shard(unsigned int hash) {
+	return &metafiles[hash % METAFILE_SHARDS];
+}
+
+
 // mf is locked
 static void meta_destroy(metafile_t *mf) {
 	// close all streams
@@ -56,13 +94,7 @@ static void meta_destroy(metafile_t *mf) {
 		pthread_mutex_unlock(&stream->lock);
 	}
 	//close forward socket
-	if (mf->forward_fd >= 0) {
-		dbg("call [%s%s%s] forwarded %d packets. %d failed sends.", FMT_M(mf->call_id),
-				(int )g_atomic_int_get(&mf->forward_count),
-				(int )g_atomic_int_get(&mf->forward_failed));
-		close(mf->forward_fd);
-		mf->forward_fd = -1;
-	}
+	forward_close(mf);
 	db_close_call(mf);
 }
 
@@ -195,21 +227,17 @@ static void meta_section(metafile_t *mf, char *section, char *content, unsigned
 }
 
 
-// returns mf locked
-static metafile_t *metafile_get(char *name) {
-	// get or create metafile metadata
-	pthread_mutex_lock(&metafiles_lock);
-	metafile_t *mf = g_hash_table_lookup(metafiles, name);
-	if (mf)
-		goto out;
-
+static metafile_t *meta_new(char *name, unsigned int hash) {
 	dbg("allocating metafile info for %s%s%s", FMT_M(name));
-	mf = g_slice_alloc0(sizeof(*mf));
+	metafile_t *mf = g_slice_alloc0(sizeof(*mf));
 	mf->gsc = g_string_chunk_new(0);
 	mf->name = g_string_chunk_insert(mf->gsc, name);
+	mf->pipeline_hash = hash;
+	mf->refs = 1;
 	pthread_mutex_init(&mf->lock, NULL);
 	mf->streams = g_ptr_array_new();
 	mf->tags = g_ptr_array_new();
+	pthread_mutex_init(&mf->forward_lock, NULL);
 	mf->forward_fd = -1;
 	mf->forward_count = 0;
 	mf->forward_failed = 0;
@@ -221,19 +249,50 @@ static metafile_t *metafile_get(char *name) {
 		mf->ssrc_hash = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, ssrc_free);
 	}
 
-	g_hash_table_insert(metafiles, mf->name, mf);
+	return mf;
+}
+
 
-out:
-	// switch locks
-	pthread_mutex_lock(&mf->lock);
-	pthread_mutex_unlock(&metafiles_lock);
+// returns mf referenced and locked, or NULL if it doesn't exist and `create` isn't set
+static metafile_t *metafile_get(char *name, int create) {
+	unsigned int hash = g_str_hash(name);
+	struct metafile_shard *sh = meta_shard(hash);
+	metafile_t *mf;
 
-	return mf;
+	while (1) {
+		pthread_rwlock_rdlock(&sh->lock);
+		mf = g_hash_table_lookup(sh->ht, name);
+		if (mf)
+			g_atomic_int_inc(&mf->refs);
+		pthread_rwlock_unlock(&sh->lock);
+
+		if (!mf) {
+			if (!create)
+				return NULL;
+
+			pthread_rwlock_wrlock(&sh->lock);
+			mf = g_hash_table_lookup(sh->ht, name);
+			if (!mf) {
+				mf = meta_new(name, hash);
+				g_hash_table_insert(sh->ht, mf->name, mf);
+			}
+			g_atomic_int_inc(&mf->refs);
+			pthread_rwlock_unlock(&sh->lock);
+		}
+
+		pthread_mutex_lock(&mf->lock);
+		if (!mf->deleted)
+			return mf;
+
+		// deleted while we were waiting for the lock. a new one may exist by now
+		pthread_mutex_unlock(&mf->lock);
+		meta_put(mf);
+	}
 }
 
 
 void metafile_change(char *name) {
-	metafile_t *mf = metafile_get(name);
+	metafile_t *mf = metafile_get(name, 1);
 
 	char fnbuf[PATH_MAX];
 	snprintf(fnbuf, sizeof(fnbuf), "%s/%s", spool_dir, name);
@@ -333,44 +392,110 @@ void metafile_change(char *name) {
 
 out:
 	pthread_mutex_unlock(&mf->lock);
+	meta_put(mf);
 }
 
 
-void metafile_delete(char *name) {
-	// get metafile metadata
-	pthread_mutex_lock(&metafiles_lock);
-	metafile_t *mf = g_hash_table_lookup(metafiles, name);
+// a chunk received through the metadata socket, already NUL-terminated
+void metafile_chunk(char *name, char *section, char *content, unsigned long len,
+		uint64_t start, uint64_t end)
+{
+	// only take chunks for files we've seen already, reading the file takes care of the rest
+	metafile_t *mf = metafile_get(name, 0);
+
 	if (!mf) {
-		// nothing to do
-		pthread_mutex_unlock(&metafiles_lock);
+		metafile_change(name);
 		return;
 	}
-	// switch locks and remove entry
-	pthread_mutex_lock(&mf->lock);
-	g_hash_table_remove(metafiles, name);
-	pthread_mutex_unlock(&metafiles_lock);
 
-	meta_destroy(mf);
+	if (start < mf->pos) {
+		// already read from the file
+		pthread_mutex_unlock(&mf->lock);
+		meta_put(mf);
+		return;
+	}
+	if (start > mf->pos) {
+		// we've missed something, catch up from the file
+		dbg("metadata chunk for %s%s%s beyond last read position, reading file", FMT_M(name));
+		pthread_mutex_unlock(&mf->lock);
+		meta_put(mf);
+		metafile_change(name);
+		return;
+	}
+
+	dbg("section %s", section);
+	meta_section(mf, section, content, len);
+	mf->pos = end;
+
+	pthread_mutex_unlock(&mf->lock);
+	meta_put(mf);
+}
+
+
+void metafile_delete(char *name) {
+	struct metafile_shard *sh = meta_shard(g_str_hash(name));
+
+	// take the entry out of the table, along with its reference
+	pthread_rwlock_wrlock(&sh->lock);
+	metafile_t *mf = g_hash_table_lookup(sh->ht, name);
+	if (mf)
+		g_hash_table_remove(sh->ht, name);
+	pthread_rwlock_unlock(&sh->lock);
+
+	if (!mf)
+		return; // nothing to do
 
-	// add to garbage
-	garbage_add(mf, meta_free);
+	pthread_mutex_lock(&mf->lock);
+	mf->deleted = 1;
+	meta_destroy(mf);
 	pthread_mutex_unlock(&mf->lock);
+
+	// freed through the garbage list once the last reference is gone
+	meta_put(mf);
+}
+
+
+// a metafile for converting a recording, fed through metafile_section() instead of
+// being read from the spool dir. returned referenced and locked
+metafile_t *metafile_offline_open(char *name) {
+	metafile_t *mf = metafile_get(name, 1);
+	mf->offline = 1;
+	return mf;
+}
+
+
+// mf is locked
+void metafile_section(metafile_t *mf, char *section, char *content) {
+	meta_section(mf, section, content, strlen(content));
+}
+
+
+// mf is unlocked. closes the call as if its metadata file had been deleted and releases
+// the reference from metafile_offline_open()
+void metafile_offline_close(metafile_t *mf) {
+	metafile_delete(mf->name);
+	meta_put(mf);
 }
 
 
 void metafile_setup(void) {
-	metafiles = g_hash_table_new(g_str_hash, g_str_equal);
+	for (int i = 0; i < METAFILE_SHARDS; i++) {
+		pthread_rwlock_init(&metafiles[i].lock, NULL);
+		metafiles[i].ht = g_hash_table_new(g_str_hash, g_str_equal);
+	}
 }
 
 
 void metafile_cleanup(void) {
-	GList *mflist = g_hash_table_get_values(metafiles);
-	for (GList *l = mflist; l; l = l->next) {
-		metafile_t *mf = l->data;
-		meta_destroy(mf);
-		meta_free(mf);
-		
+	for (int i = 0; i < METAFILE_SHARDS; i++) {
+		GList *mflist = g_hash_table_get_values(metafiles[i].ht);
+		for (GList *l = mflist; l; l = l->next) {
+			metafile_t *mf = l->data;
+			meta_destroy(mf);
+			meta_free(mf);
+		}
+		g_list_free(mflist);
+		g_hash_table_destroy(metafiles[i].ht);
+		pthread_rwlock_destroy(&metafiles[i].lock);
 	}
-	g_list_free(mflist);
-	g_hash_table_destroy(metafiles);
 }
@@ -7,6 +7,12 @@ void metafile_setup(void);
 void metafile_cleanup(void);
 
 void metafile_change(char *name);
+void metafile_chunk(char *name, char *section, char *content, unsigned long len,
+		uint64_t start, uint64_t end);
 void metafile_delete(char *name);
 
+metafile_t *metafile_offline_open(char *name);
+void metafile_section(metafile_t *mf, char *section, char *content);
+void metafile_offline_close(metafile_t *mf);
+
 #endif
@@ -0,0 +1,133 @@
+#include "metasock.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+#include "main.h"
+#include "epoll.h"
+#include "metafile.h"
+#include "metachunk.h"
+
+
+// receives metadata chunks from rtpengine as they're appended to the metadata files,
+// so that changes don't have to be picked up by re-reading the file through inotify
+
+
+static int metasock_fd = -1;
+static char metasock_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+
+static handler_func metasock_handler_func;
+static handler_t metasock_handler = {
+	.func = metasock_handler_func,
+};
+
+
+static void metasock_chunk(char *buf, size_t len) {
+	struct metachunk_hdr *hdr = (void *) buf;
+	char name[NAME_MAX + 1];
+	char section[256];
+
+	if (len < sizeof(*hdr) || hdr->magic != METACHUNK_MAGIC) {
+		ilog(LOG_WARN, "Invalid datagram received on metadata socket");
+		return;
+	}
+	if (len != sizeof(*hdr) + hdr->name_len + hdr->label_len + hdr->content_len
+			|| hdr->file_end < hdr->file_start)
+	{
+		ilog(LOG_WARN, "Invalid metadata chunk length received");
+		return;
+	}
+	if (!hdr->name_len || hdr->name_len >= sizeof(name) || !hdr->label_len
+			|| hdr->label_len >= sizeof(section))
+	{
+		ilog(LOG_WARN, "Invalid metadata file name or section header received");
+		return;
+	}
+
+	char *p = buf + sizeof(*hdr);
+	memcpy(name, p, hdr->name_len);
+	name[hdr->name_len] = '\0';
+	p += hdr->name_len;
+	memcpy(section, p, hdr->label_len);
+	section[hdr->label_len] = '\0';
+	p += hdr->label_len;
+
+	if (strchr(name, '/') || strlen(name) != hdr->name_len) {
+		ilog(LOG_WARN, "Invalid metadata file name received");
+		return;
+	}
+	if (strlen(section) != hdr->label_len) {
+		ilog(LOG_WARN, "NUL character in section header in %s%s%s", FMT_M(name));
+		return;
+	}
+	if (memchr(p, '\0', hdr->content_len)) {
+		ilog(LOG_WARN, "NUL character in content in section %s in %s%s%s", section, FMT_M(name));
+		return;
+	}
+	p[hdr->content_len] = '\0'; // the receive buffer has room for this
+
+	dbg("metadata chunk %s for %s%s%s at %llu", section, FMT_M(name),
+			(unsigned long long) hdr->file_start);
+	metafile_chunk(name, section, p, hdr->content_len, hdr->file_start, hdr->file_end);
+}
+
+
+static void metasock_handler_func(handler_t *handler) {
+	static __thread char *buf;
+
+	if (!buf)
+		buf = malloc(METACHUNK_MAX_SIZE + 1);
+
+	while (1) {
+		ssize_t ret = recv(metasock_fd, buf, METACHUNK_MAX_SIZE, MSG_TRUNC);
+		if (ret == -1) {
+			if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN)
+				break;
+			die_errno("recv on metadata socket failed");
+		}
+		if (ret > METACHUNK_MAX_SIZE) {
+			ilog(LOG_WARN, "Oversized datagram received on metadata socket");
+			continue;
+		}
+		metasock_chunk(buf, ret);
+	}
+}
+
+
+void metasock_setup(void) {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+
+	if (snprintf(metasock_path, sizeof(metasock_path), "%s/%s", spool_dir, METACHUNK_SOCKET_NAME)
+			>= sizeof(metasock_path))
+	{
+		ilog(LOG_WARN, "Spool directory path too long for metadata socket, "
+				"using inotify only");
+		metasock_path[0] = '\0';
+		return;
+	}
+	memcpy(sun.sun_path, metasock_path, sizeof(sun.sun_path));
+
+	metasock_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (metasock_fd == -1)
+		die_errno("failed to create metadata socket");
+
+	unlink(metasock_path); // left over from a previous run
+	if (bind(metasock_fd, (struct sockaddr *) &sun, sizeof(sun)))
+		die_errno("failed to bind metadata socket to '%s'", metasock_path);
+
+	if (epoll_add(metasock_fd, EPOLLIN, &metasock_handler))
+		die_errno("failed to add metadata socket to epoll");
+}
+
+
+void metasock_cleanup(void) {
+	if (metasock_fd == -1)
+		return;
+	close(metasock_fd);
+	unlink(metasock_path);
+}
@@ -0,0 +1,7 @@
+#ifndef _METASOCK_H_
+#define _METASOCK_H_
+
+void metasock_setup(void);
+void metasock_cleanup(void);
+
+#endif
@@ -11,9 +11,11 @@
 #include "log.h"
 #include "output.h"
 #include "resample.h"
+#include "main.h"
 
 
 #define NUM_INPUTS 4
+#define NATIVE_BUF_SECS 2 // ring buffer length for the native mixer
 
 
 struct mix_s {
@@ -33,6 +35,12 @@ struct mix_s {
 	uint64_t out_pts; // starting at zero
 
 	AVFrame *silence_frame;
+
+	// native mixer: interleaved ring buffer of 32-bit sums indexed by adjusted pts
+	int32_t *native_buf;
+	unsigned int native_len; // in samples per channel
+	uint64_t native_pts; // next pts to be output
+	struct codec_buffer_pool frame_pool;
 };
 
 
@@ -54,6 +62,10 @@ static void mix_shutdown(mix_t *mix) {
 	resample_shutdown(&mix->resample);
 	avfilter_graph_free(&mix->graph);
 
+	av_freep(&mix->native_buf);
+	mix->native_len = 0;
+	codec_buffer_pool_free(&mix->frame_pool);
+
 	format_init(&mix->format);
 }
 
@@ -84,6 +96,24 @@ int mix_config(mix_t *mix, const format_t *format) {
 
 	mix->format = *format;
 
+	// packed S16 can be summed directly. anything else goes through amix
+	if (mix_method == MIX_METHOD_NATIVE && mix->format.format == AV_SAMPLE_FMT_S16
+			&& mix->format.channels > 0 && mix->format.clockrate >= 100)
+	{
+		mix->native_len = mix->format.clockrate * NATIVE_BUF_SECS;
+		mix->native_buf = av_mallocz(mix->native_len * mix->format.channels * sizeof(*mix->native_buf));
+		err = "failed to allocate mix buffer";
+		if (!mix->native_buf)
+			goto err;
+		// pick up where a previous configuration left off
+		mix->native_pts = mix->out_pts;
+		for (int i = 0; i < NUM_INPUTS; i++) {
+			if (mix->in_pts[i] < mix->native_pts)
+				mix->in_pts[i] = mix->native_pts;
+		}
+		return 0;
+	}
+
 	// filter graph
 	err = "failed to alloc filter graph";
 	mix->graph = avfilter_graph_alloc();
@@ -175,6 +205,12 @@ static void mix_silence_fill_idx_upto(mix_t *mix, unsigned int idx, uint64_t upt
 			break;
 		}
 
+		if (mix->native_buf) {
+			// the ring buffer is kept zeroed, so just move the input along
+			mix->in_pts[idx] = upto;
+			break;
+		}
+
 		if (G_UNLIKELY(!mix->silence_frame)) {
 			mix->silence_frame = av_frame_alloc();
 			mix->silence_frame->format = mix->format.format;
@@ -218,6 +254,95 @@ static void mix_silence_fill(mix_t *mix) {
 }
 
 
+// sums interleaved S16 samples into the 32-bit buffer, which can't overflow with
+// NUM_INPUTS sources. clipping happens only once, on output. both loops are written
+// so that the compiler turns them into vector instructions
+static void mix_native_sum(int32_t *restrict dst, const int16_t *restrict src, unsigned int num) {
+	for (unsigned int i = 0; i < num; i++)
+		dst[i] += src[i];
+}
+
+static void mix_native_clip(int16_t *restrict dst, const int32_t *restrict src, unsigned int num) {
+	for (unsigned int i = 0; i < num; i++) {
+		int32_t s = src[i];
+		dst[i] = s > INT16_MAX ? INT16_MAX : (s < INT16_MIN ? INT16_MIN : s);
+	}
+}
+
+
+// outputs all mixed media up to the given pts and clears the consumed part of the ring buffer
+static int mix_native_output(mix_t *mix, output_t *output, uint64_t upto) {
+	unsigned int channels = mix->format.channels;
+	unsigned int chunk = mix->format.clockrate / 50;
+
+	while (mix->native_pts < upto) {
+		unsigned int pos = mix->native_pts % mix->native_len;
+		unsigned int num = MIN(upto - mix->native_pts, chunk);
+		num = MIN(num, mix->native_len - pos);
+
+		AVFrame *frame = codeclib_frame_alloc();
+		if (!frame)
+			return -1;
+		frame->format = mix->format.format;
+		frame->channel_layout = av_get_default_channel_layout(channels);
+		frame->sample_rate = mix->format.clockrate;
+		frame->nb_samples = num;
+		frame->pts = mix->native_pts;
+		if (codec_buffer_pool_frame(&mix->frame_pool, frame) < 0) {
+			ilog(LOG_ERR, "Failed to get buffers for mixed frame");
+			codeclib_frame_free(&frame);
+			return -1;
+		}
+
+		int32_t *src = mix->native_buf + pos * channels;
+		mix_native_clip((void *) frame->extended_data[0], src, num * channels);
+		memset(src, 0, num * channels * sizeof(*src));
+		mix->native_pts += num;
+
+		int ret = output_add(output, frame);
+		codeclib_frame_free(&frame);
+		if (ret)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+static int mix_native_add(mix_t *mix, AVFrame *frame, output_t *output) {
+	unsigned int channels = mix->format.channels;
+	const int16_t *src = (void *) frame->extended_data[0];
+	uint64_t pts = frame->pts;
+	unsigned int num = frame->nb_samples;
+
+	// drop whatever has been output already
+	if (pts + num <= mix->native_pts)
+		return 0;
+	if (pts < mix->native_pts) {
+		unsigned int skip = mix->native_pts - pts;
+		src += skip * channels;
+		num -= skip;
+		pts = mix->native_pts;
+	}
+	if (G_UNLIKELY(num > mix->native_len))
+		num = mix->native_len;
+
+	// input running too far ahead of the others: make room
+	if (pts + num > mix->native_pts + mix->native_len) {
+		if (mix_native_output(mix, output, pts + num - mix->native_len))
+			return -1;
+	}
+
+	unsigned int pos = pts % mix->native_len;
+	unsigned int first = MIN(num, mix->native_len - pos);
+	mix_native_sum(mix->native_buf + pos * channels, src, first * channels);
+	if (first < num)
+		mix_native_sum(mix->native_buf, src + first * channels, (num - first) * channels);
+
+	return 0;
+}
+
+
 int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
 	const char *err;
 
@@ -226,7 +351,7 @@ int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
 		goto err;
 
 	err = "mixer not initialized";
-	if (!mix->src_ctxs[idx])
+	if (!mix->src_ctxs[idx] && !mix->native_buf)
 		goto err;
 
 	dbg("stream %i pts_off %llu in pts %llu in frame pts %llu samples %u mix out pts %llu", 
@@ -248,11 +373,36 @@ int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
 	// check for pts gap. this is the opposite of silence fill-in. if the frame
 	// pts is behind the expected input pts, there was a gap and we reset our
 	// pts adjustment
-	if (G_UNLIKELY(frame->pts < mix->in_pts[idx]))
+	if (G_UNLIKELY(frame->pts < mix->in_pts[idx])) {
 		mix->pts_offs[idx] += mix->in_pts[idx] - frame->pts;
+		// the native mixer would otherwise sum the overlap onto itself
+		if (mix->native_buf)
+			frame->pts = mix->in_pts[idx];
+	}
 
 	uint64_t next_pts = frame->pts + frame->nb_samples;
 
+	if (mix->native_buf) {
+		err = "failed to add frame to mixer";
+		if (mix_native_add(mix, frame, output))
+			goto err;
+
+		if (next_pts > mix->out_pts)
+			mix->out_pts = next_pts;
+		if (next_pts > mix->in_pts[idx])
+			mix->in_pts[idx] = next_pts;
+
+		codeclib_frame_free(&frame);
+
+		mix_silence_fill(mix);
+
+		// output what all inputs have caught up to
+		uint64_t upto = mix->in_pts[0];
+		for (int i = 1; i < NUM_INPUTS; i++)
+			upto = MIN(upto, mix->in_pts[i]);
+		return mix_native_output(mix, output, upto);
+	}
+
 	err = "failed to add frame to mixer";
 	if (av_buffersrc_add_frame(mix->src_ctxs[idx], frame))
 		goto err;
@@ -263,7 +413,7 @@ int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
 	if (next_pts > mix->in_pts[idx])
 		mix->in_pts[idx] = next_pts;
 
-	av_frame_free(&frame);
+	codeclib_frame_free(&frame);
 
 	mix_silence_fill(mix);
 
@@ -281,7 +431,7 @@ int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
 		ret = output_add(output, frame);
 
 		av_frame_unref(mix->sink_frame);
-		av_frame_free(&frame);
+		codeclib_frame_free(&frame);
 
 		if (ret)
 			return -1;
@@ -291,6 +441,6 @@ int mix_add(mix_t *mix, AVFrame *frame, unsigned int idx, output_t *output) {
 
 err:
 	ilog(LOG_ERR, "Failed to add frame to mixer: %s", err);
-	av_frame_free(&frame);
+	codeclib_frame_free(&frame);
 	return -1;
 }
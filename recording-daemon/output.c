@@ -1,16 +1,50 @@
 #include "output.h"
 #include <libavcodec/avcodec.h>
+#include <libavutil/intreadwrite.h>
 #include <limits.h>
 #include <string.h>
 #include <stdint.h>
 #include <glib.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "log.h"
 #include "db.h"
+#include "pipeline.h"
+#include "main.h"
+
+
+#define OUTPUT_AVIO_BUFLEN 32768
+#define OUTPUT_WAV_BUFLEN (256 * 1024) // chunk size for WAV files without output-buffer
+#define OUTPUT_WAV_HDRLEN 44
+
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define AVIO_WRITE_CONST const
+#else
+#define AVIO_WRITE_CONST
+#endif
+
+
+// buffered file output. the muxer writes into memory, and full buffers are handed to the
+// file writer thread, together with the file offset they belong to
+struct output_file {
+	int fd;
+	int64_t pos; // where the next write from the muxer goes
+	int64_t size;
+	size_t chunk_size;
+	struct output_chunk *chunk; // being filled, or NULL
+};
+struct output_chunk {
+	int fd;
+	int64_t offset;
+	size_t len;
+	unsigned char data[0];
+};
 
 
 //static int output_codec_id;
 static const codec_def_t *output_codec;
 static const char *output_file_format;
+static int output_native; // WAV files are written directly, without libavformat
 
 int mp3_bitrate;
 
@@ -20,6 +54,239 @@ static int output_shutdown(output_t *output);
 
 
 
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 12, 100)
+static void output_write_job(void *ptr, void *arg, unsigned long len) {
+	AVFormatContext *fmtctx = ptr;
+	AVPacket *pkt = arg;
+
+	av_write_frame(fmtctx, pkt);
+	av_packet_free(&pkt);
+}
+#endif
+
+
+static void output_chunk_write(void *ptr, void *arg, unsigned long len) {
+	struct output_chunk *chunk = ptr;
+	size_t done = 0;
+
+	while (done < chunk->len) {
+		ssize_t ret = pwrite(chunk->fd, chunk->data + done, chunk->len - done, chunk->offset + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to write %zu bytes to output file: %s",
+					chunk->len - done, strerror(errno));
+			break;
+		}
+		done += ret;
+	}
+
+	if (output_fsync == OUTPUT_FSYNC_FLUSH && fdatasync(chunk->fd))
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to sync output file: %s", strerror(errno));
+
+	g_free(chunk);
+}
+
+static void output_file_close(void *ptr, void *arg, unsigned long fd) {
+	if (output_fsync != OUTPUT_FSYNC_NEVER && fsync(fd))
+		ilog(LOG_ERR, "Failed to sync output file: %s", strerror(errno));
+	close(fd);
+}
+
+static void output_file_flush(output_t *output) {
+	struct output_file *of = output->file;
+	struct output_chunk *chunk = of->chunk;
+	if (!chunk)
+		return;
+	of->chunk = NULL;
+	if (!chunk->len) {
+		g_free(chunk);
+		return;
+	}
+	pipeline_push(PIPELINE_WRITE, output->pipeline_hash, output_chunk_write, chunk, NULL, 0,
+			PIPELINE_BLOCK);
+}
+
+static void output_file_write(output_t *output, const unsigned char *buf, size_t left) {
+	struct output_file *of = output->file;
+	size_t flush_size = of->chunk_size;
+
+	while (left > 0) {
+		struct output_chunk *chunk = of->chunk;
+		// start a new buffer when the muxer has seeked elsewhere
+		if (chunk && (chunk->offset + chunk->len != of->pos || chunk->len >= flush_size)) {
+			output_file_flush(output);
+			chunk = NULL;
+		}
+		if (!chunk) {
+			chunk = of->chunk = g_malloc(sizeof(*chunk) + flush_size);
+			chunk->fd = of->fd;
+			chunk->offset = of->pos;
+			chunk->len = 0;
+		}
+
+		size_t num = MIN(left, flush_size - chunk->len);
+		memcpy(chunk->data + chunk->len, buf, num);
+		chunk->len += num;
+		buf += num;
+		left -= num;
+		of->pos += num;
+		if (of->pos > of->size)
+			of->size = of->pos;
+	}
+}
+
+static int output_avio_write(void *opaque, AVIO_WRITE_CONST uint8_t *buf, int buf_size) {
+	output_file_write(opaque, buf, buf_size);
+	return buf_size;
+}
+
+static int64_t output_avio_seek(void *opaque, int64_t offset, int whence) {
+	output_t *output = opaque;
+	struct output_file *of = output->file;
+
+	switch (whence & ~AVSEEK_FORCE) {
+		case AVSEEK_SIZE:
+			return of->size;
+		case SEEK_SET:
+			break;
+		case SEEK_CUR:
+			offset += of->pos;
+			break;
+		case SEEK_END:
+			offset += of->size;
+			break;
+		default:
+			return AVERROR(EINVAL);
+	}
+	if (offset < 0)
+		return AVERROR(EINVAL);
+	of->pos = offset;
+	return offset;
+}
+
+static struct output_file *output_file_new(int fd, size_t chunk_size) {
+	struct output_file *of = g_slice_alloc0(sizeof(*of));
+	of->fd = fd;
+	of->chunk_size = chunk_size;
+	return of;
+}
+
+// writes out what's left and closes the file
+static void output_file_finish(output_t *output) {
+	output_file_flush(output);
+	pipeline_push(PIPELINE_WRITE, output->pipeline_hash, output_file_close, NULL, NULL,
+			output->file->fd, PIPELINE_FORCE);
+	g_slice_free1(sizeof(*output->file), output->file);
+	output->file = NULL;
+}
+
+static int output_avio_open(output_t *output, const char *fn) {
+	int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return AVERROR(errno);
+
+	unsigned char *buf = av_malloc(OUTPUT_AVIO_BUFLEN);
+	if (!buf) {
+		close(fd);
+		return AVERROR(ENOMEM);
+	}
+	output->fmtctx->pb = avio_alloc_context(buf, OUTPUT_AVIO_BUFLEN, 1, output, NULL,
+			output_avio_write, output_avio_seek);
+	if (!output->fmtctx->pb) {
+		av_free(buf);
+		close(fd);
+		return AVERROR(ENOMEM);
+	}
+	output->fmtctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+	output->file = output_file_new(fd, (size_t) output_buffer * 1024);
+
+	return 0;
+}
+
+static void output_avio_close(output_t *output) {
+	AVIOContext *pb = output->fmtctx->pb;
+	avio_flush(pb);
+	output_file_finish(output);
+
+	av_freep(&pb->buffer);
+#if LIBAVFORMAT_VERSION_INT >= AV_VERSION_INT(57, 80, 100)
+	avio_context_free(&pb);
+#else
+	av_freep(&pb);
+#endif
+	output->fmtctx->pb = NULL;
+
+	// the file must be complete before anyone looks at it
+	pipeline_sync(PIPELINE_WRITE, output->pipeline_hash);
+}
+
+
+// Decoded audio already is in the sample format of a PCM WAV file, so no encoder or muxer
+// is needed: frames are copied straight into the file's write buffer, and the sizes in
+// the header are filled in when the file is closed.
+static void output_wav_header(unsigned char *h, const format_t *fmt, int64_t data_len) {
+	uint32_t len = MIN(data_len, (int64_t) UINT32_MAX - 36);
+	uint32_t block_align = fmt->channels * 2;
+
+	memcpy(h, "RIFF", 4);
+	AV_WL32(h + 4, len + 36);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	AV_WL32(h + 16, 16);
+	AV_WL16(h + 20, 1); // PCM
+	AV_WL16(h + 22, fmt->channels);
+	AV_WL32(h + 24, fmt->clockrate);
+	AV_WL32(h + 28, fmt->clockrate * block_align);
+	AV_WL16(h + 32, block_align);
+	AV_WL16(h + 34, 16);
+	memcpy(h + 36, "data", 4);
+	AV_WL32(h + 40, len);
+}
+
+static int output_wav_open(output_t *output, const char *fn) {
+	int fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		ilog(LOG_ERR, "Failed to open output file '%s%s%s': %s", FMT_M(fn), strerror(errno));
+		return -1;
+	}
+
+	output->file = output_file_new(fd, output_buffer > 0 ? (size_t) output_buffer * 1024
+			: OUTPUT_WAV_BUFLEN);
+
+	// placeholder until the length is known
+	unsigned char hdr[OUTPUT_WAV_HDRLEN];
+	output_wav_header(hdr, &output->encoder->actual_format, 0);
+	output_file_write(output, hdr, sizeof(hdr));
+
+	return 0;
+}
+
+static int output_wav_add(output_t *output, AVFrame *frame) {
+	if (frame->format != AV_SAMPLE_FMT_S16) {
+		ilog(LOG_ERR | LOG_FLAG_LIMIT, "Unexpected sample format %s for WAV output",
+				av_get_sample_fmt_name(frame->format));
+		return -1;
+	}
+	output_file_write(output, frame->extended_data[0],
+			(size_t) frame->nb_samples * output->encoder->actual_format.channels * 2);
+	return 0;
+}
+
+static void output_wav_close(output_t *output) {
+	struct output_file *of = output->file;
+	unsigned char hdr[OUTPUT_WAV_HDRLEN];
+
+	output_wav_header(hdr, &output->encoder->actual_format, of->size - OUTPUT_WAV_HDRLEN);
+	of->pos = 0;
+	output_file_write(output, hdr, sizeof(hdr));
+	output_file_finish(output);
+
+	// the file must be complete before anyone looks at it
+	pipeline_sync(PIPELINE_WRITE, output->pipeline_hash);
+}
+
+
 static int output_got_packet(encoder_t *enc, void *u1, void *u2) {
 	output_t *output = u1;
 
@@ -28,6 +295,20 @@ static int output_got_packet(encoder_t *enc, void *u1, void *u2) {
 			(long) enc->avpkt.dts);
 	dbg("{%s%s%s} output dts %li", FMT_M(output->file_name), (long) output->encoder->mux_dts);
 
+#if LIBAVCODEC_VERSION_INT >= AV_VERSION_INT(57, 12, 100)
+	if (pipeline_active(PIPELINE_OUTPUT)) {
+		// the encoder reuses its avpkt, so hand a reference to the writer
+		AVPacket *pkt = av_packet_clone(&enc->avpkt);
+		if (!pkt) {
+			ilog(LOG_ERR | LOG_FLAG_LIMIT, "Failed to allocate output packet");
+			return 0;
+		}
+		pipeline_push(PIPELINE_OUTPUT, output->pipeline_hash, output_write_job, output->fmtctx, pkt,
+				0, PIPELINE_BLOCK);
+		return 0;
+	}
+#endif
+
 	av_write_frame(output->fmtctx, &enc->avpkt);
 
 	return 0;
@@ -37,6 +318,11 @@ static int output_got_packet(encoder_t *enc, void *u1, void *u2) {
 int output_add(output_t *output, AVFrame *frame) {
 	if (!output)
 		return -1;
+	if (output_native) {
+		if (!output->file) // not configured
+			return -1;
+		return output_wav_add(output, frame);
+	}
 	if (!output->encoder) // not ready - not configured
 		return -1;
 	return encoder_input_fifo(output->encoder, frame, output_got_packet, output, NULL);
@@ -48,12 +334,26 @@ output_t *output_new(const char *path, const char *filename) {
 	g_strlcpy(ret->file_path, path, sizeof(ret->file_path));
 	g_strlcpy(ret->file_name, filename, sizeof(ret->file_name));
 	snprintf(ret->full_filename, sizeof(ret->full_filename), "%s/%s", path, filename);
+	ret->pipeline_hash = g_str_hash(ret->full_filename);
 	ret->file_format = output_file_format;
 	ret->encoder = encoder_new();
 	return ret;
 }
 
 
+// finds an unused file name for this output
+static int output_file_name(output_t *output, char *buf, size_t len) {
+	char suff[16] = "";
+	for (int i = 1; i < 20; i++) {
+		snprintf(buf, len, "%s%s.%s", output->full_filename, suff, output->file_format);
+		if (!g_file_test(buf, G_FILE_TEST_EXISTS))
+			return 0;
+		snprintf(suff, sizeof(suff), "-%i", i);
+	}
+	return -1;
+}
+
+
 int output_config(output_t *output, const format_t *requested_format, format_t *actual_format) {
 	const char *err;
 	int av_ret = 0;
@@ -67,6 +367,24 @@ int output_config(output_t *output, const format_t *requested_format, format_t *
 
 	output_shutdown(output);
 
+	char full_fn[PATH_MAX*2];
+
+	if (output_native) {
+		output->encoder->requested_format = *requested_format;
+		output->encoder->actual_format = *requested_format;
+		output->encoder->actual_format.format = AV_SAMPLE_FMT_S16;
+		if (actual_format)
+			*actual_format = output->encoder->actual_format;
+
+		err = "failed to find unused output file number";
+		if (output_file_name(output, full_fn, sizeof(full_fn)))
+			goto err;
+		err = "failed to open output file";
+		if (output_wav_open(output, full_fn))
+			goto err;
+		goto configured;
+	}
+
 	err = "failed to alloc format context";
 	output->fmtctx = avformat_alloc_context();
 	if (!output->fmtctx)
@@ -98,27 +416,45 @@ int output_config(output_t *output, const format_t *requested_format, format_t *
 	avcodec_parameters_from_context(output->avst->codecpar, output->encoder->u.avc.avcctx);
 #endif
 
-	char full_fn[PATH_MAX*2];
-	char suff[16] = "";
-	for (int i = 1; i < 20; i++) {
-		snprintf(full_fn, sizeof(full_fn), "%s%s.%s", output->full_filename, suff, output->file_format);
-		if (!g_file_test(full_fn, G_FILE_TEST_EXISTS))
-			goto got_fn;
-		snprintf(suff, sizeof(suff), "-%i", i);
+	if (stream_to_ep.port) {
+		snprintf(full_fn, sizeof(full_fn), "rtp://%s", endpoint_print_buf(&stream_to_ep));
+		goto got_url;
 	}
 
 	err = "failed to find unused output file number";
-	goto err;
+	if (output_file_name(output, full_fn, sizeof(full_fn)))
+		goto err;
 
-got_fn:
 	err = "failed to open avio";
-	av_ret = avio_open(&output->fmtctx->pb, full_fn, AVIO_FLAG_WRITE);
+	if (output_buffer > 0)
+		av_ret = output_avio_open(output, full_fn);
+	else
+		av_ret = avio_open(&output->fmtctx->pb, full_fn, AVIO_FLAG_WRITE);
 	if (av_ret < 0)
 		goto err;
 	err = "failed to write header";
 	av_ret = avformat_write_header(output->fmtctx, NULL);
 	if (av_ret)
 		goto err;
+	goto configured;
+
+got_url:
+	// all outputs go to the same destination and are told apart by their SSRC
+	err = "failed to open RTP output";
+	av_ret = avio_open(&output->fmtctx->pb, full_fn, AVIO_FLAG_WRITE);
+	if (av_ret < 0)
+		goto err;
+	AVDictionary *opts = NULL;
+	av_dict_set_int(&opts, "ssrc", (int32_t) output->pipeline_hash, 0);
+	err = "failed to write header";
+	av_ret = avformat_write_header(output->fmtctx, &opts);
+	av_dict_free(&opts);
+	if (av_ret)
+		goto err;
+	ilog(LOG_INFO, "Streaming output '%s%s%s' to %s with SSRC %x", FMT_M(output->file_name),
+			endpoint_print_buf(&stream_to_ep), output->pipeline_hash);
+
+configured:
 
 	db_config_stream(output);
 done:
@@ -136,13 +472,28 @@ err:
 static int output_shutdown(output_t *output) {
 	if (!output)
 		return 0;
+	if (output_native) {
+		int ret = 0;
+		if (output->file) {
+			output_wav_close(output);
+			ret = 1;
+		}
+		encoder_close(output->encoder);
+		return ret;
+	}
 	if (!output->fmtctx)
 		return 0;
 
+	// anything still queued for writing must go out first
+	pipeline_sync(PIPELINE_OUTPUT, output->pipeline_hash);
+
 	int ret = 0;
 	if (output->fmtctx->pb) {
 		av_write_trailer(output->fmtctx);
-		avio_closep(&output->fmtctx->pb);
+		if (output->file)
+			output_avio_close(output);
+		else
+			avio_closep(&output->fmtctx->pb);
 		ret = 1;
 	}
 	avformat_free_context(output->fmtctx);
@@ -168,6 +519,7 @@ void output_close(output_t *output) {
 		db_close_stream(output);
 	else
 		db_delete_stream(output);
+	db_release(&output->db);
 	encoder_free(output->encoder);
 	g_slice_free1(sizeof(*output), output);
 }
@@ -179,11 +531,17 @@ void output_init(const char *format) {
 	if (!strcmp(format, "wav")) {
 		str_init(&codec, "PCM-S16LE");
 		output_file_format = "wav";
+		output_native = 1;
 	}
 	else if (!strcmp(format, "mp3")) {
 		str_init(&codec, "MP3");
 		output_file_format = "mp3";
 	}
+	else if (!strcmp(format, "rtp")) {
+		// L16, sent to stream_to_ep instead of being written to a file
+		str_init(&codec, "PCM-S16BE");
+		output_file_format = "rtp";
+	}
 	else
 		die("Unknown output format '%s'", format);
 
@@ -18,6 +18,9 @@
 #include "resample.h"
 
 
+#define TLS_BATCH_BYTES 16384 // max plaintext of one TLS record
+
+
 static ssize_t ssrc_tls_write(void *, const void *, size_t);
 static ssize_t ssrc_tls_read(void *, void *, size_t);
 
@@ -82,7 +85,17 @@ static void packet_free(void *p) {
 }
 
 
+static void ssrc_tls_flush(ssrc_t *ssrc) {
+	if (!ssrc->tls_fwd_buf || !ssrc->tls_fwd_buf->len)
+		return;
+	streambuf_write(ssrc->tls_fwd_stream, ssrc->tls_fwd_buf->str, ssrc->tls_fwd_buf->len);
+	g_string_truncate(ssrc->tls_fwd_buf, 0);
+}
+
 static void ssrc_tls_shutdown(ssrc_t *ssrc) {
+	if (ssrc->tls_fwd_buf)
+		g_string_free(ssrc->tls_fwd_buf, TRUE);
+	ssrc->tls_fwd_buf = NULL;
 	streambuf_destroy(ssrc->tls_fwd_stream);
 	ssrc->tls_fwd_stream = NULL;
 	resample_shutdown(&ssrc->tls_fwd_resampler);
@@ -140,6 +153,28 @@ void ssrc_tls_state(ssrc_t *ssrc) {
 	ssrc_tls_log_errors();
 }
 
+// PCM is collected into one TLS record's worth and written out once that's full, or
+// when more arrives after the first of it has been held back for long enough
+void ssrc_tls_fwd(ssrc_t *ssrc, const char *buf, unsigned int len) {
+	if (tls_batch_delay <= 0) {
+		streambuf_write(ssrc->tls_fwd_stream, buf, len);
+		return;
+	}
+
+	if (!ssrc->tls_fwd_buf)
+		ssrc->tls_fwd_buf = g_string_sized_new(TLS_BATCH_BYTES);
+
+	int64_t now = g_get_monotonic_time();
+	if (!ssrc->tls_fwd_buf->len)
+		ssrc->tls_fwd_batch_start = now;
+
+	g_string_append_len(ssrc->tls_fwd_buf, buf, len);
+
+	if (ssrc->tls_fwd_buf->len >= TLS_BATCH_BYTES
+			|| now - ssrc->tls_fwd_batch_start >= (int64_t) tls_batch_delay * 1000)
+		ssrc_tls_flush(ssrc);
+}
+
 
 void ssrc_free(void *p) {
 	ssrc_t *s = p;
@@ -147,8 +182,10 @@ void ssrc_free(void *p) {
 	output_close(s->output);
 	for (int i = 0; i < G_N_ELEMENTS(s->decoders); i++)
 		decoder_free(s->decoders[i]);
-	if (s->tls_fwd_stream)
+	if (s->tls_fwd_stream) {
+		ssrc_tls_flush(s);
 		ssrc_tls_shutdown(s);
+	}
 	g_slice_free1(sizeof(*s), s);
 }
 
@@ -196,6 +233,10 @@ out:
 			ssrc_tls_shutdown(ret);
 			goto tls_out;
 		}
+#ifdef SSL_OP_ENABLE_KTLS
+		// record encryption is done by the kernel if it supports the negotiated cipher
+		SSL_CTX_set_options(ret->ssl_ctx, SSL_OP_ENABLE_KTLS);
+#endif
 		ret->ssl = SSL_new(ret->ssl_ctx);
 		if (!ret->ssl) {
 			ilog(LOG_ERR, "Failed to create TLS connection");
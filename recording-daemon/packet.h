@@ -8,5 +8,6 @@ void ssrc_free(void *p);
 void packet_process(stream_t *, unsigned char *, unsigned len);
 
 void ssrc_tls_state(ssrc_t *ssrc);
+void ssrc_tls_fwd(ssrc_t *ssrc, const char *buf, unsigned int len);
 
 #endif
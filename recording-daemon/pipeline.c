@@ -0,0 +1,250 @@
+#include "pipeline.h"
+#include <glib.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <mysql.h>
+#include "log.h"
+#include "main.h"
+
+
+typedef struct {
+	pipeline_func *func;
+	void *ptr;
+	void *arg;
+	unsigned long len;
+} pipeline_job_t;
+
+struct pipeline_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond; // signalled when a job is added
+	pthread_cond_t space_cond; // signalled when a job is taken off
+	GQueue jobs;
+	pthread_t thread;
+	int stop:1;
+
+	// statistics, protected by the lock
+	unsigned int max_len;
+	uint64_t processed;
+	uint64_t dropped;
+	uint64_t waits;
+};
+
+struct pipeline_sync {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done;
+};
+
+
+static const char *pipeline_names[__PIPELINE_STAGES] = {
+	[PIPELINE_DECODE] = "decode",
+	[PIPELINE_OUTPUT] = "output",
+	[PIPELINE_WRITE] = "write",
+};
+
+static struct pipeline_queue *pipeline_queues[__PIPELINE_STAGES];
+static unsigned int pipeline_num[__PIPELINE_STAGES];
+
+
+static void *pipeline_thread(void *p) {
+	struct pipeline_queue *q = p;
+
+	mysql_thread_init();
+
+	pthread_mutex_lock(&q->lock);
+	while (1) {
+		pipeline_job_t *job = g_queue_pop_head(&q->jobs);
+		if (!job) {
+			// only leave once everything has been processed
+			if (q->stop)
+				break;
+			pthread_cond_wait(&q->cond, &q->lock);
+			continue;
+		}
+		q->processed++;
+		pthread_cond_signal(&q->space_cond);
+		pthread_mutex_unlock(&q->lock);
+
+		job->func(job->ptr, job->arg, job->len);
+		g_slice_free1(sizeof(*job), job);
+
+		pthread_mutex_lock(&q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	mysql_thread_end();
+
+	return NULL;
+}
+
+
+static void pipeline_start(enum pipeline_stage stage, int num) {
+	if (num <= 0)
+		return;
+
+	struct pipeline_queue *qs = g_malloc0(sizeof(*qs) * num);
+
+	for (int i = 0; i < num; i++) {
+		struct pipeline_queue *q = &qs[i];
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_cond_init(&q->cond, NULL);
+		pthread_cond_init(&q->space_cond, NULL);
+		g_queue_init(&q->jobs);
+		if (pthread_create(&q->thread, NULL, pipeline_thread, q))
+			die_errno("pthread_create failed");
+	}
+
+	pipeline_queues[stage] = qs;
+	pipeline_num[stage] = num;
+}
+
+
+void pipeline_init(void) {
+	pipeline_start(PIPELINE_WRITE, output_buffer > 0 ? 1 : 0);
+	pipeline_start(PIPELINE_OUTPUT, output_threads);
+	pipeline_start(PIPELINE_DECODE, decode_threads);
+}
+
+
+// lets the threads finish all queued jobs and waits for them to exit. jobs pushed
+// afterwards are run directly by the caller
+void pipeline_stop(enum pipeline_stage stage) {
+	struct pipeline_queue *qs = pipeline_queues[stage];
+	unsigned int num = pipeline_num[stage];
+
+	if (!num)
+		return;
+
+	for (unsigned int i = 0; i < num; i++) {
+		struct pipeline_queue *q = &qs[i];
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_broadcast(&q->cond);
+		pthread_cond_broadcast(&q->space_cond);
+		pthread_mutex_unlock(&q->lock);
+		pthread_join(q->thread, NULL);
+	}
+
+	pipeline_num[stage] = 0;
+	pipeline_queues[stage] = NULL;
+
+	for (unsigned int i = 0; i < num; i++) {
+		struct pipeline_queue *q = &qs[i];
+		pthread_cond_destroy(&q->cond);
+		pthread_cond_destroy(&q->space_cond);
+		pthread_mutex_destroy(&q->lock);
+	}
+	g_free(qs);
+}
+
+
+int pipeline_active(enum pipeline_stage stage) {
+	return pipeline_num[stage] != 0;
+}
+
+
+// returns 0 if the job was queued or has been run already, or -1 if it was dropped.
+// the caller must release whatever the job would otherwise have consumed in that case.
+int pipeline_push(enum pipeline_stage stage, unsigned int hash, pipeline_func *func, void *ptr, void *arg,
+		unsigned long len, enum pipeline_mode mode)
+{
+	if (!pipeline_num[stage]) {
+		func(ptr, arg, len);
+		return 0;
+	}
+
+	struct pipeline_queue *q = &pipeline_queues[stage][hash % pipeline_num[stage]];
+
+	pthread_mutex_lock(&q->lock);
+
+	if (mode != PIPELINE_FORCE && q->jobs.length >= pipeline_queue_len && !q->stop) {
+		if (mode == PIPELINE_DROP) {
+			q->dropped++;
+			pthread_mutex_unlock(&q->lock);
+			ilog(LOG_WARN | LOG_FLAG_LIMIT, "The %s queue is full, dropping job",
+					pipeline_names[stage]);
+			return -1;
+		}
+		q->waits++;
+		while (q->jobs.length >= pipeline_queue_len && !q->stop)
+			pthread_cond_wait(&q->space_cond, &q->lock);
+	}
+
+	if (G_UNLIKELY(q->stop)) {
+		// thread is exiting or gone already
+		pthread_mutex_unlock(&q->lock);
+		func(ptr, arg, len);
+		return 0;
+	}
+
+	pipeline_job_t *job = g_slice_alloc(sizeof(*job));
+	job->func = func;
+	job->ptr = ptr;
+	job->arg = arg;
+	job->len = len;
+	g_queue_push_tail(&q->jobs, job);
+	if (q->jobs.length > q->max_len)
+		q->max_len = q->jobs.length;
+	pthread_cond_signal(&q->cond);
+
+	pthread_mutex_unlock(&q->lock);
+
+	return 0;
+}
+
+
+static void pipeline_sync_done(void *ptr, void *arg, unsigned long len) {
+	struct pipeline_sync *s = ptr;
+	pthread_mutex_lock(&s->lock);
+	s->done = 1;
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+}
+
+// waits until all jobs that are currently queued for the given hash have been run
+void pipeline_sync(enum pipeline_stage stage, unsigned int hash) {
+	if (!pipeline_num[stage])
+		return;
+
+	struct pipeline_sync s = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+	};
+
+	pipeline_push(stage, hash, pipeline_sync_done, &s, NULL, 0, PIPELINE_FORCE);
+
+	pthread_mutex_lock(&s.lock);
+	while (!s.done)
+		pthread_cond_wait(&s.cond, &s.lock);
+	pthread_mutex_unlock(&s.lock);
+
+	pthread_cond_destroy(&s.cond);
+	pthread_mutex_destroy(&s.lock);
+}
+
+
+void pipeline_stats(void) {
+	for (int stage = 0; stage < __PIPELINE_STAGES; stage++) {
+		unsigned int len = 0, max_len = 0;
+		uint64_t processed = 0, dropped = 0, waits = 0;
+
+		for (unsigned int i = 0; i < pipeline_num[stage]; i++) {
+			struct pipeline_queue *q = &pipeline_queues[stage][i];
+			pthread_mutex_lock(&q->lock);
+			len += q->jobs.length;
+			max_len = MAX(max_len, q->max_len);
+			processed += q->processed;
+			dropped += q->dropped;
+			waits += q->waits;
+			pthread_mutex_unlock(&q->lock);
+		}
+
+		if (!pipeline_num[stage])
+			continue;
+
+		ilog(LOG_INFO, "Pipeline stage '%s': %u threads, %u jobs queued, longest queue %u, "
+				"%" PRIu64 " jobs processed, %" PRIu64 " dropped, %" PRIu64 " waits for queue space",
+				pipeline_names[stage], pipeline_num[stage], len, max_len,
+				processed, dropped, waits);
+	}
+}
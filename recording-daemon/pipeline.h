@@ -0,0 +1,35 @@
+#ifndef _PIPELINE_H_
+#define _PIPELINE_H_
+
+#include "types.h"
+
+
+enum pipeline_stage {
+	PIPELINE_DECODE = 0, // decoding and mixing, one queue per call
+	PIPELINE_OUTPUT, // encoded packets to be written out
+	PIPELINE_WRITE, // buffered file contents to be written to disk
+
+	__PIPELINE_STAGES
+};
+
+enum pipeline_mode {
+	PIPELINE_DROP = 0, // discard the job if the queue is full
+	PIPELINE_BLOCK, // wait for the queue to drain if it's full
+	PIPELINE_FORCE, // ignore the queue limit
+};
+
+typedef void pipeline_func(void *ptr, void *arg, unsigned long len);
+
+
+void pipeline_init(void);
+void pipeline_stop(enum pipeline_stage);
+
+int pipeline_active(enum pipeline_stage);
+int pipeline_push(enum pipeline_stage, unsigned int hash, pipeline_func *, void *ptr, void *arg,
+		unsigned long len, enum pipeline_mode);
+void pipeline_sync(enum pipeline_stage, unsigned int hash);
+
+void pipeline_stats(void);
+
+
+#endif
@@ -4,13 +4,18 @@
 #include <unistd.h>
 #include <limits.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
 #include <libavcodec/avcodec.h>
+#include "xt_RTPENGINE.h"
 #include "metafile.h"
 #include "epoll.h"
 #include "log.h"
 #include "main.h"
 #include "packet.h"
 #include "forward.h"
+#include "pipeline.h"
 
 
 #define MAXBUFLEN 65535
@@ -20,7 +25,10 @@
 #ifndef FF_INPUT_BUFFER_PADDING_SIZE
 #define FF_INPUT_BUFFER_PADDING_SIZE 0
 #endif
-#define ALLOCLEN (MAXBUFLEN + AV_INPUT_BUFFER_PADDING_SIZE + FF_INPUT_BUFFER_PADDING_SIZE)
+#define PADDING (AV_INPUT_BUFFER_PADDING_SIZE + FF_INPUT_BUFFER_PADDING_SIZE)
+#define ALLOCLEN (MAXBUFLEN + PADDING)
+// max number of packets taken from the ring before they're processed
+#define RING_BATCH 32
 
 
 // stream is locked
@@ -28,6 +36,9 @@ void stream_close(stream_t *stream) {
 	if (stream->fd == -1)
 		return;
 	epoll_del(stream->fd);
+	if (stream->ring)
+		munmap(stream->ring, stream->ring_size);
+	stream->ring = NULL;
 	close(stream->fd);
 	stream->fd = -1;
 }
@@ -37,6 +48,104 @@ void stream_free(stream_t *stream) {
 }
 
 
+static inline struct rtpengine_stream_slot *stream_ring_slot(stream_t *stream, uint32_t idx) {
+	return (void *) stream->ring + RTPENGINE_STREAM_RING_HDR
+		+ (size_t) (idx & (stream->ring_slots - 1)) * RTPENGINE_STREAM_SLOT_SIZE;
+}
+
+
+static void stream_decode_job(void *ptr, void *buf, unsigned long len) {
+	stream_t *stream = ptr;
+	const char *prev_call = log_info_call, *prev_stream = log_info_stream;
+
+	log_info_call = stream->metafile->name;
+	log_info_stream = stream->name;
+
+	packet_process(stream, buf, len); // consumes buf
+
+	log_info_call = prev_call;
+	log_info_stream = prev_stream;
+}
+
+
+static void stream_packet(stream_t *stream, unsigned char *buf, int len, enum pipeline_mode mode) {
+	if (forward_to)
+		forward_packet(stream, buf, len); // leaves buf intact
+	if (!decoding_enabled)
+		free(buf);
+	// all packets of one call go to the same thread, which keeps them in order
+	else if (pipeline_push(PIPELINE_DECODE, stream->metafile->pipeline_hash, stream_decode_job,
+				stream, buf, len, mode))
+		free(buf);
+}
+
+
+// a packet that doesn't come from the kernel, e.g. read from a pcap recording. nothing
+// is lost if the decoder can't keep up, the caller waits instead
+void stream_inject(stream_t *stream, const unsigned char *buf, unsigned int len) {
+	unsigned char *copy = malloc(len + PADDING);
+	memcpy(copy, buf, len);
+	stream_packet(stream, copy, len, PIPELINE_BLOCK);
+}
+
+
+// stream is locked, returns unlocked. takes all packets currently present in the
+// mmap'ed ring, in batches, and without any syscall.
+static void stream_ring_handler(stream_t *stream) {
+	unsigned char *bufs[RING_BATCH];
+	int lens[RING_BATCH];
+
+	while (1) {
+		struct rtpengine_stream_ring *ring = stream->ring;
+		uint32_t tail = ring->tail;
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned int num = 0;
+
+		while (tail != head && num < RING_BATCH) {
+			struct rtpengine_stream_slot *slot = stream_ring_slot(stream, tail);
+			unsigned int len = slot->len;
+			if (len > sizeof(slot->data))
+				len = sizeof(slot->data);
+			bufs[num] = malloc(len + PADDING);
+			memcpy(bufs[num], slot->data, len);
+			lens[num] = len;
+			num++;
+			tail++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		// report overflows while they happen, not only at the end
+		uint32_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != stream->ring_dropped) {
+			ilog(LOG_WARN, "Kernel ring buffer of stream %s overflowed, %u packets dropped "
+					"(%u in total)",
+					stream->name, dropped - stream->ring_dropped, dropped);
+			stream->ring_dropped = dropped;
+		}
+
+		if (!num) {
+			if (__atomic_load_n(&ring->eof, __ATOMIC_ACQUIRE)) {
+				ilog(LOG_INFO, "EOF on stream %s (%u packets dropped by kernel)",
+						stream->name, ring->dropped);
+				stream_close(stream);
+			}
+			break;
+		}
+
+		pthread_mutex_unlock(&stream->lock);
+
+		for (unsigned int i = 0; i < num; i++)
+			stream_packet(stream, bufs[i], lens[i], PIPELINE_DROP);
+
+		pthread_mutex_lock(&stream->lock);
+		if (!stream->ring) // closed in the meantime
+			break;
+	}
+
+	pthread_mutex_unlock(&stream->lock);
+}
+
+
 static void stream_handler(handler_t *handler) {
 	stream_t *stream = handler->ptr;
 	unsigned char *buf = NULL;
@@ -51,6 +160,13 @@ static void stream_handler(handler_t *handler) {
 	if (stream->fd == -1)
 		goto out;
 
+	if (stream->ring) {
+		stream_ring_handler(stream); // unlocks
+		log_info_call = NULL;
+		log_info_stream = NULL;
+		return;
+	}
+
 	buf = malloc(ALLOCLEN);
 	int ret = read(stream->fd, buf, MAXBUFLEN);
 	if (ret == 0) {
@@ -69,16 +185,7 @@ static void stream_handler(handler_t *handler) {
 	// got a packet
 	pthread_mutex_unlock(&stream->lock);
 
-	if (forward_to){
-		if (forward_packet(stream->metafile,buf,ret)) // leaves buf intact
-			g_atomic_int_inc(&stream->metafile->forward_failed);
-		else
-			g_atomic_int_inc(&stream->metafile->forward_count);
-	}
-	if (decoding_enabled)
-		packet_process(stream, buf, ret); // consumes buf
-	else
-		free(buf);
+	stream_packet(stream, buf, ret, PIPELINE_DROP);
 
 	log_info_call = NULL;
 	log_info_stream = NULL;
@@ -113,6 +220,38 @@ out:
 }
 
 
+// stream is locked or new
+static void stream_ring_map(stream_t *stream) {
+	struct rtpengine_stream_ring *hdr = mmap(NULL, RTPENGINE_STREAM_RING_HDR, PROT_READ, MAP_SHARED,
+			stream->fd, 0);
+	if (hdr == MAP_FAILED) {
+		dbg("Kernel stream %s can't be mapped, using read(): %s", stream->name, strerror(errno));
+		return;
+	}
+	size_t size = hdr->size;
+	unsigned int slots = hdr->slots;
+	munmap(hdr, RTPENGINE_STREAM_RING_HDR);
+
+	if (!slots || (slots & (slots - 1)) || size < RTPENGINE_STREAM_RING_HDR
+			+ (size_t) slots * RTPENGINE_STREAM_SLOT_SIZE)
+	{
+		ilog(LOG_WARN, "Invalid ring buffer layout on kernel stream %s", stream->name);
+		return;
+	}
+
+	void *ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, stream->fd, 0);
+	if (ring == MAP_FAILED) {
+		dbg("Kernel stream %s can't be mapped, using read(): %s", stream->name, strerror(errno));
+		return;
+	}
+
+	stream->ring = ring;
+	stream->ring_size = size;
+	stream->ring_slots = slots;
+	dbg("mapped ring buffer with %u slots for stream %s", slots, stream->name);
+}
+
+
 // mf is locked
 void stream_open(metafile_t *mf, unsigned long id, char *name) {
 	dbg("opening stream %lu/%s", id, name);
@@ -121,15 +260,23 @@ void stream_open(metafile_t *mf, unsigned long id, char *name) {
 
 	stream->name = g_string_chunk_insert(mf->gsc, name);
 
+	if (mf->offline)
+		return; // packets are passed in through stream_inject()
+
 	char fnbuf[PATH_MAX];
 	snprintf(fnbuf, sizeof(fnbuf), "/proc/rtpengine/%u/calls/%s/%s", ktable, mf->parent, name);
 
-	stream->fd = open(fnbuf, O_RDONLY | O_NONBLOCK);
+	// read-write access is needed to map the ring. fall back to plain read() otherwise.
+	stream->fd = open(fnbuf, O_RDWR | O_NONBLOCK);
+	if (stream->fd == -1)
+		stream->fd = open(fnbuf, O_RDONLY | O_NONBLOCK);
 	if (stream->fd == -1) {
 		ilog(LOG_ERR, "Failed to open kernel stream %s: %s", fnbuf, strerror(errno));
 		return;
 	}
 
+	stream_ring_map(stream);
+
 	// add to epoll
 	stream->handler.ptr = stream;
 	stream->handler.func = stream_handler;
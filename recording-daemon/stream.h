@@ -8,5 +8,6 @@ void stream_details(metafile_t *mf, unsigned long id, unsigned int tag);
 void stream_forwarding_on(metafile_t *mf, unsigned long id, unsigned int on);
 void stream_close(stream_t *stream);
 void stream_free(stream_t *stream);
+void stream_inject(stream_t *stream, const unsigned char *buf, unsigned int len);
 
 #endif
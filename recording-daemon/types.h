@@ -23,6 +23,9 @@ struct ip6_hdr;
 struct udphdr;
 struct rtp_header;
 struct streambuf;
+struct rtpengine_stream_ring;
+struct output_file;
+struct db_ref;
 
 
 struct handler_s;
@@ -54,6 +57,10 @@ struct stream_s {
 	unsigned long tag;
 	int fd;
 	handler_t handler;
+	struct rtpengine_stream_ring *ring; // mmap'ed from the kernel, or NULL to use read()
+	size_t ring_size;
+	unsigned int ring_slots;
+	unsigned int ring_dropped; // last seen value of the kernel's overflow counter
 	int forwarding_on:1;
 };
 typedef struct stream_s stream_t;
@@ -91,6 +98,8 @@ struct ssrc_s {
 	SSL *ssl;
 	struct streambuf *tls_fwd_stream;
 	struct poller tls_fwd_poller;
+	GString *tls_fwd_buf; // PCM held back for batching
+	int64_t tls_fwd_batch_start;
 	int sent_intro:1;
 };
 typedef struct ssrc_s ssrc_t;
@@ -106,13 +115,15 @@ typedef struct tag_s tag_t;
 
 struct metafile_s {
 	pthread_mutex_t lock;
+	volatile gint refs; // one held by the metafile table while listed there
 	char *name;
 	char *parent;
 	char *call_id;
 	char *metadata;
 	char *metadata_db;
+	unsigned int pipeline_hash; // selects the decoding thread
 	off_t pos;
-	unsigned long long db_id;
+	struct db_ref *db;
 
 	GStringChunk *gsc; // XXX limit max size
 
@@ -124,9 +135,14 @@ struct metafile_s {
 	mix_t *mix;
 	output_t *mix_out;
 
+	pthread_mutex_t forward_lock;
 	int forward_fd;
 	volatile gint forward_count;
 	volatile gint forward_failed;
+	unsigned char *forward_buf; // batched packets, LOCK: forward_lock
+	size_t forward_buf_len;
+	unsigned int forward_batch_num;
+	int64_t forward_batch_start; // monotonic usec
 
 	pthread_mutex_t payloads_lock;
 	char *payload_types[128];
@@ -136,6 +152,8 @@ struct metafile_s {
 
 	int recording_on:1;
 	int forwarding_on:1;
+	int deleted:1;
+	int offline:1; // converted from a recording, no kernel streams and no poller threads
 };
 
 
@@ -144,7 +162,8 @@ struct output_s {
 		file_path[PATH_MAX],
 		file_name[PATH_MAX];
 	const char *file_format;
-	unsigned long long db_id;
+	struct db_ref *db;
+	unsigned int pipeline_hash; // selects the output thread
 
 //	format_t requested_format,
 //		 actual_format;
@@ -152,6 +171,7 @@ struct output_s {
 //	AVCodecContext *avcctx;
 	AVFormatContext *fmtctx;
 	AVStream *avst;
+	struct output_file *file; // set when using buffered output, and for WAV files
 //	AVPacket avpkt;
 //	AVAudioFifo *fifo;
 //	int64_t fifo_pts; // pts of first data in fifo
@@ -112,6 +112,95 @@ uint8_t aes_256_srtp_ciphertext[38] = {
 };
 
 
+// AEAD AES-GCM test vectors (rfc 7714). session key 00 01 .. 0f (or .. 1f for 256 bits) and the
+// session salt, RTP packet and SRTCP packet from rfc 7714 section 16, with ROC 0 and SRTCP
+// index 0x5d4. the "auth_tag" vectors are the tags of the unencrypted variants, which have the
+// whole packet as AAD
+uint8_t aead_session_salt[12] = {
+	0x51, 0x75, 0x69, 0x64, 0x20, 0x70, 0x72, 0x6f,
+	0x20, 0x71, 0x75, 0x6f
+};
+
+uint8_t aead_rtp_plaintext_ref[49] = {
+	0x80, 0x40, 0xf1, 0x7b, 0x80, 0x41, 0xf8, 0xd3,
+	0x55, 0x01, 0xa0, 0xb2,
+	'G', 'a', 'l', 'i', 'a', ' ', 'e', 's', 't', ' ', 'o', 'm', 'n', 'i', 's', ' ',
+	'd', 'i', 'v', 'i', 's', 'a', ' ', 'i', 'n', ' ', 'p', 'a', 'r', 't', 'e', 's',
+	' ', 't', 'r', 'e', 's'
+};
+
+uint8_t aead_rtcp_plaintext_ref[52] = {
+	0x81, 0xc8, 0x00, 0x0d, 0x4d, 0x61, 0x72, 0x73,
+	0x4e, 0x54, 0x50, 0x31, 0x4e, 0x54, 0x50, 0x32,
+	0x52, 0x54, 0x50, 0x20, 0x00, 0x00, 0x04, 0x2a,
+	0x00, 0x00, 0xe9, 0x30, 0x4c, 0x75, 0x6e, 0x61,
+	0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef,
+	0xde, 0xad, 0xbe, 0xef, 0xde, 0xad, 0xbe, 0xef,
+	0xde, 0xad, 0xbe, 0xef
+};
+
+uint8_t aead_128_srtp[53] = {
+	0xf2, 0x4d, 0xe3, 0xa6, 0xf3, 0x75, 0x9b, 0x7a,
+	0xab, 0xee, 0xc9, 0x1e, 0x9e, 0x79, 0x51, 0x99,
+	0xfa, 0x6e, 0x24, 0xca, 0x17, 0x3b, 0x0f, 0x26,
+	0x45, 0xeb, 0xa4, 0x6b, 0x42, 0xc1, 0xc0, 0x8d,
+	0x65, 0x8a, 0x3c, 0xc8, 0x9e, 0x82, 0xb3, 0x00,
+	0xc5, 0x0d, 0x62, 0xe6, 0xef, 0x75, 0x27, 0xbc,
+	0x4a, 0xa9, 0xe2, 0xa2, 0x65
+};
+
+uint8_t aead_128_srtp_auth_tag[16] = {
+	0xd1, 0x44, 0xc6, 0x8a, 0x5b, 0xa3, 0x3d, 0x93,
+	0xf9, 0xa8, 0x78, 0x00, 0x0f, 0xbf, 0x86, 0x43
+};
+
+uint8_t aead_128_srtcp[60] = {
+	0x63, 0xe9, 0x48, 0x85, 0xdc, 0xda, 0xb6, 0x7c,
+	0xa7, 0x27, 0xd7, 0x66, 0x2f, 0x6b, 0x7e, 0x99,
+	0x7f, 0xf5, 0xc0, 0xf7, 0x6c, 0x06, 0xf3, 0x2d,
+	0xc6, 0x76, 0xa5, 0xf1, 0x73, 0x0d, 0x6f, 0xda,
+	0x4c, 0xe0, 0x9b, 0x46, 0x86, 0x30, 0x3d, 0xed,
+	0x0b, 0xb9, 0x27, 0x5b, 0xc8, 0x4a, 0xa4, 0x58,
+	0x96, 0xcf, 0x4d, 0x2f, 0xc5, 0xab, 0xf8, 0x72,
+	0x45, 0xd9, 0xea, 0xde
+};
+
+uint8_t aead_128_srtcp_auth_tag[16] = {
+	0x84, 0x1d, 0xd9, 0x68, 0x3d, 0xd7, 0x8e, 0xc9,
+	0x2a, 0xe5, 0x87, 0x90, 0x12, 0x5f, 0x62, 0xb3
+};
+
+uint8_t aead_256_srtp[53] = {
+	0x32, 0xb1, 0xde, 0x7d, 0xa0, 0x63, 0xbb, 0x04,
+	0xe8, 0xcb, 0x37, 0xf8, 0x30, 0x29, 0x29, 0xf9,
+	0xf5, 0x8d, 0x0d, 0x27, 0x80, 0x4a, 0xa3, 0xba,
+	0xb2, 0x45, 0x7a, 0x13, 0x65, 0xf9, 0xbf, 0x19,
+	0x48, 0xf2, 0x31, 0x8e, 0xae, 0x05, 0x39, 0x78,
+	0x09, 0xf0, 0x91, 0x52, 0xfb, 0xd8, 0xe9, 0x2e,
+	0x17, 0xdc, 0x3f, 0xbf, 0x85
+};
+
+uint8_t aead_256_srtp_auth_tag[16] = {
+	0x60, 0xb1, 0x74, 0x9a, 0xe4, 0x25, 0x51, 0xf0,
+	0xc3, 0x48, 0xb8, 0x43, 0xf0, 0xbf, 0x13, 0x07
+};
+
+uint8_t aead_256_srtcp[60] = {
+	0xd5, 0x0a, 0xe4, 0xd1, 0xf5, 0xce, 0x5d, 0x30,
+	0x4b, 0xa2, 0x97, 0xe4, 0x7d, 0x47, 0x0c, 0x28,
+	0x2c, 0x3e, 0xce, 0x5d, 0xbf, 0xfe, 0x0a, 0x50,
+	0xa2, 0xea, 0xa5, 0xc1, 0x11, 0x05, 0x55, 0xbe,
+	0x84, 0x15, 0xf6, 0x58, 0xc6, 0x1d, 0xe0, 0x47,
+	0x6f, 0x1b, 0x6f, 0xad, 0x1d, 0x1e, 0xb3, 0x0c,
+	0x44, 0x46, 0x83, 0x9f, 0x57, 0xff, 0x6f, 0x6c,
+	0xb2, 0x6a, 0xc3, 0xbe
+};
+
+uint8_t aead_256_srtcp_auth_tag[16] = {
+	0x91, 0xdb, 0x4a, 0xfb, 0xfe, 0xee, 0x5a, 0x97,
+	0x8f, 0xab, 0x43, 0x93, 0xed, 0x26, 0x15, 0xfe
+};
+
 #define RTP_HEADER_LEN 12
 #define RTCP_HEADER_LEN 8
 // Test: AES-128 CM
@@ -178,6 +267,116 @@ void srtp_validate (struct crypto_context *c, struct crypto_context *c2, char* m
 	printf("%s RTCP decrypt: PASS\n", message);
 }
 
+// Test: AEAD AES-GCM, encrypted and unencrypted, including forged tags
+void aead_validate(struct crypto_context *c, char *message, uint8_t *srtp_ct, uint8_t *srtp_tag,
+		uint8_t *srtcp_ct, uint8_t *srtcp_tag)
+{
+	str payload;
+	char buf[128];
+	struct rtp_header *rtp = (void *) buf;
+	struct rtcp_packet *rtcp = (void *) buf;
+	const unsigned int rtp_pl_len = sizeof(aead_rtp_plaintext_ref) - RTP_HEADER_LEN;
+	const unsigned int rtcp_pl_len = sizeof(aead_rtcp_plaintext_ref) - RTCP_HEADER_LEN;
+
+	// encrypted SRTP
+	c->params.session_params.unencrypted_srtp = 0;
+	memcpy(buf, aead_rtp_plaintext_ref, sizeof(aead_rtp_plaintext_ref));
+	str_init_len(&payload, buf + RTP_HEADER_LEN, rtp_pl_len);
+	assert(crypto_encrypt_rtp(c, rtp, &payload, 0xf17b) == 0);
+	assert(payload.len == rtp_pl_len + 16);
+	assert(memcmp(payload.s, srtp_ct, payload.len) == 0);
+
+	printf("%s RTP encrypt: PASS\n", message);
+
+	assert(crypto_decrypt_rtp(c, rtp, &payload, 0xf17b) == 0);
+	assert(payload.len == rtp_pl_len);
+	assert(memcmp(buf, aead_rtp_plaintext_ref, sizeof(aead_rtp_plaintext_ref)) == 0);
+
+	memcpy(buf + RTP_HEADER_LEN, srtp_ct, rtp_pl_len + 16);
+	buf[RTP_HEADER_LEN + rtp_pl_len + 15] ^= 0x01;
+	str_init_len(&payload, buf + RTP_HEADER_LEN, rtp_pl_len + 16);
+	assert(crypto_decrypt_rtp(c, rtp, &payload, 0xf17b) != 0);
+
+	printf("%s RTP decrypt: PASS\n", message);
+
+	// unencrypted SRTP, still authenticated
+	c->params.session_params.unencrypted_srtp = 1;
+	memcpy(buf, aead_rtp_plaintext_ref, sizeof(aead_rtp_plaintext_ref));
+	str_init_len(&payload, buf + RTP_HEADER_LEN, rtp_pl_len);
+	assert(crypto_encrypt_rtp(c, rtp, &payload, 0xf17b) == 0);
+	assert(payload.len == rtp_pl_len + 16);
+	assert(memcmp(buf, aead_rtp_plaintext_ref, sizeof(aead_rtp_plaintext_ref)) == 0);
+	assert(memcmp(payload.s + rtp_pl_len, srtp_tag, 16) == 0);
+
+	assert(crypto_decrypt_rtp(c, rtp, &payload, 0xf17b) == 0);
+	assert(payload.len == rtp_pl_len);
+
+	str_init_len(&payload, buf + RTP_HEADER_LEN, rtp_pl_len + 16);
+	buf[RTP_HEADER_LEN] ^= 0x01; // tampered payload
+	assert(crypto_decrypt_rtp(c, rtp, &payload, 0xf17b) != 0);
+	c->params.session_params.unencrypted_srtp = 0;
+
+	printf("%s unencrypted RTP: PASS\n", message);
+
+	// encrypted SRTCP, index with the E flag
+	memcpy(buf, aead_rtcp_plaintext_ref, sizeof(aead_rtcp_plaintext_ref));
+	str_init_len(&payload, buf + RTCP_HEADER_LEN, rtcp_pl_len);
+	assert(crypto_encrypt_rtcp(c, rtcp, &payload, 0x800005d4) == 0);
+	assert(payload.len == rtcp_pl_len + 16);
+	assert(memcmp(payload.s, srtcp_ct, payload.len) == 0);
+
+	printf("%s RTCP encrypt: PASS\n", message);
+
+	assert(crypto_decrypt_rtcp(c, rtcp, &payload, 0x800005d4) == 0);
+	assert(payload.len == rtcp_pl_len);
+	assert(memcmp(buf, aead_rtcp_plaintext_ref, sizeof(aead_rtcp_plaintext_ref)) == 0);
+
+	// the same packet with the E flag cleared must not pass
+	memcpy(buf + RTCP_HEADER_LEN, srtcp_ct, rtcp_pl_len + 16);
+	str_init_len(&payload, buf + RTCP_HEADER_LEN, rtcp_pl_len + 16);
+	assert(crypto_decrypt_rtcp(c, rtcp, &payload, 0x5d4) != 0);
+
+	printf("%s RTCP decrypt: PASS\n", message);
+
+	// unencrypted SRTCP: E flag clear, still authenticated
+	memcpy(buf, aead_rtcp_plaintext_ref, sizeof(aead_rtcp_plaintext_ref));
+	str_init_len(&payload, buf + RTCP_HEADER_LEN, rtcp_pl_len);
+	assert(crypto_encrypt_rtcp(c, rtcp, &payload, 0x5d4) == 0);
+	assert(payload.len == rtcp_pl_len + 16);
+	assert(memcmp(buf, aead_rtcp_plaintext_ref, sizeof(aead_rtcp_plaintext_ref)) == 0);
+	assert(memcmp(payload.s + rtcp_pl_len, srtcp_tag, 16) == 0);
+
+	assert(crypto_decrypt_rtcp(c, rtcp, &payload, 0x5d4) == 0);
+	assert(payload.len == rtcp_pl_len);
+
+	// forged tag
+	str_init_len(&payload, buf + RTCP_HEADER_LEN, rtcp_pl_len + 16);
+	buf[RTCP_HEADER_LEN + rtcp_pl_len] ^= 0x80;
+	assert(crypto_decrypt_rtcp(c, rtcp, &payload, 0x5d4) != 0);
+
+	// valid tag, tampered payload
+	buf[RTCP_HEADER_LEN + rtcp_pl_len] ^= 0x80;
+	buf[RTCP_HEADER_LEN + 4] ^= 0x01;
+	str_init_len(&payload, buf + RTCP_HEADER_LEN, rtcp_pl_len + 16);
+	assert(crypto_decrypt_rtcp(c, rtcp, &payload, 0x5d4) != 0);
+
+	printf("%s unencrypted RTCP: PASS\n", message);
+}
+
+void aead_init(struct crypto_context *c, const char *name, unsigned int key_len) {
+	str suite;
+
+	memset(c, 0, sizeof(*c));
+	str_init(&suite, (char *) name);
+	c->params.crypto_suite = crypto_find_suite(&suite);
+	assert(c->params.crypto_suite);
+	for (unsigned int i = 0; i < key_len; i++)
+		c->session_key[i] = i;
+	memcpy(c->session_salt, aead_session_salt, sizeof(aead_session_salt));
+	c->have_session_key = 1;
+	crypto_init_session_key(c);
+}
+
 extern void crypto_init_main(void);
 
 void check_session_keys(struct crypto_context *c, int i) {
@@ -288,4 +487,12 @@ int main(int argc, char** argv) {
 	srtp_validate(&ctx, NULL, "extra AES-CM-256", aes_256_rtp_plaintext_ref, aes_256_srtp_ciphertext,
 		      NULL, NULL);
 
+	aead_init(&ctx, "AEAD_AES_128_GCM", 16);
+	aead_validate(&ctx, "SRTP AEAD-AES-128-GCM", aead_128_srtp, aead_128_srtp_auth_tag,
+		      aead_128_srtcp, aead_128_srtcp_auth_tag);
+
+	aead_init(&ctx, "AEAD_AES_256_GCM", 32);
+	aead_validate(&ctx, "SRTP AEAD-AES-256-GCM", aead_256_srtp, aead_256_srtp_auth_tag,
+		      aead_256_srtcp, aead_256_srtcp_auth_tag);
+
 }
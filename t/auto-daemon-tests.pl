@@ -3749,6 +3749,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=setup:actpass
 a=fingerprint:sha-1 FINGERPRINT
 SDP
@@ -3792,6 +3794,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=setup:actpass
 a=fingerprint:sha-1 FINGERPRINT
 SDP
@@ -3841,6 +3845,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('stray answer protocol changes, default', {
@@ -3916,6 +3922,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('stray answer protocol changes, proto accept', {
@@ -3992,6 +4000,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('stray answer protocol changes, proto accept', {
@@ -4363,6 +4373,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=setup:actpass
 a=fingerprint:sha-1 FINGERPRINT
 a=ptime:20
@@ -4479,6 +4491,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=setup:actpass
 a=fingerprint:sha-1 FINGERPRINT
 a=ptime:20
@@ -4610,6 +4624,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=ptime:20
 SDP
 
@@ -4704,6 +4720,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=ptime:20
 SDP
 
@@ -4802,6 +4820,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=ptime:20
 SDP
 
@@ -4862,6 +4882,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 a=ptime:20
 SDP
 
@@ -5099,6 +5121,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b, undef, $srtp_key_b) = answer('reg SRTP offer, accept, diff suite',
@@ -5184,6 +5208,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('OSRTP offer, accept, same suite',
@@ -5257,6 +5283,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b, undef, $srtp_key_b) = answer('OSRTP offer, accept, diff suite',
@@ -5339,6 +5367,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('OSRTP offer, reject',
@@ -5401,6 +5431,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b, undef, $srtp_key_a) = answer('OSRTP offer, reject w/ accept flag',
@@ -5474,6 +5506,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('non-OSRTP offer with offer flag, accept',
@@ -5547,6 +5581,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('non-OSRTP offer with offer flag and protocol, accept',
@@ -5621,6 +5657,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('non-OSRTP offer with offer flag, reject',
@@ -5808,6 +5846,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128|2^31
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128|2^31
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128|2^31
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128|2^31
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S|2^31
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S|2^31
 SDP
 
 
@@ -7266,6 +7306,8 @@ a=crypto:9 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:11 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:12 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:13 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:14 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('gh829 control',
@@ -7341,6 +7383,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 ($port_b) = answer('gh829',
@@ -8657,6 +8701,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 plain', { ICE => 'remove' }, <<SDP);
@@ -8714,6 +8760,8 @@ a=crypto:6 AES_192_CM_HMAC_SHA1_32 inline:CRYPTO192
 a=crypto:7 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:8 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:10 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:11 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 suppress one', { ICE => 'remove' }, <<SDP);
@@ -8771,6 +8819,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 remove one', { ICE => 'remove' }, <<SDP);
@@ -8828,6 +8878,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 remove first', { ICE => 'remove' }, <<SDP);
@@ -9025,6 +9077,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 plain from RTP', { ICE => 'remove' }, <<SDP);
@@ -9077,6 +9131,8 @@ a=crypto:6 AES_256_CM_HMAC_SHA1_32 inline:CRYPTO256
 a=crypto:7 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:8 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:10 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:11 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 from RTP suppress one', { ICE => 'remove' }, <<SDP);
@@ -9129,6 +9185,8 @@ a=crypto:6 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:7 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:8 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:10 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:11 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('gh 661 from RTP suppress first', { ICE => 'remove' }, <<SDP);
@@ -9881,6 +9939,8 @@ a=crypto:7 F8_128_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:8 F8_128_HMAC_SHA1_32 inline:CRYPTO128
 a=crypto:9 NULL_HMAC_SHA1_80 inline:CRYPTO128
 a=crypto:10 NULL_HMAC_SHA1_32 inline:CRYPTO128
+a=crypto:11 AEAD_AES_128_GCM inline:CRYPTO128S
+a=crypto:12 AEAD_AES_256_GCM inline:CRYPTO256S
 SDP
 
 answer('media playback, SRTP', { replace => ['origin'] }, <<SDP);
@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "codec.h"
+#include "call.h"
+#include "call_interfaces.h"
+#include "crypto.h"
+#include "rtp.h"
+#include "rtplib.h"
+#include "timerthread.h"
+#include "log.h"
+#include "main.h"
+#include "ssrc.h"
+
+// Microbenchmark for the per-packet userspace paths. Prints the average time and the
+// number of heap allocations per packet for each codec pair, SRTP suite and the
+// timer queue. Not a pass/fail test; run through `make bench` and compare the output
+// against a previous build.
+
+int _log_facility_rtcp;
+int _log_facility_cdr;
+int _log_facility_dtmf;
+struct rtpengine_config rtpe_config;
+struct poller *rtpe_poller;
+struct poller **rtpe_media_pollers;
+void control_listeners_close(void) { }
+GString *dtmf_logs;
+
+
+// count all heap allocations, including those made by glib (run with G_SLICE=always-malloc)
+static unsigned long allocs;
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size) {
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+void *calloc(size_t n, size_t size) {
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(n, size);
+}
+void *realloc(void *p, size_t size) {
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(p, size);
+}
+
+
+static unsigned int iterations = 100000;
+
+struct bench {
+	struct timespec start;
+	unsigned long allocs;
+};
+
+static void bench_start(struct bench *b) {
+	b->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+	clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+static void bench_stop(struct bench *b, const char *what, const char *name, unsigned int num) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	unsigned long num_allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - b->allocs;
+	double ns = (end.tv_sec - b->start.tv_sec) * 1e9 + (end.tv_nsec - b->start.tv_nsec);
+	printf("%-12s %-28s %10.1f ns/packet %8.2f allocs/packet\n", what, name,
+			ns / num, (double) num_allocs / num);
+}
+
+static void fill_payload(char *s, unsigned int len) {
+	for (unsigned int i = 0; i < len; i++)
+		s[i] = random();
+}
+
+
+// codec handlers, set up the same way as in transcode-test.c
+
+static struct call call;
+static struct sdp_ng_flags flags;
+static struct call_media *media_A;
+static struct call_media *media_B;
+static struct call_monologue ml_A;
+static struct call_monologue ml_B;
+static GQueue rtp_types = G_QUEUE_INIT;
+
+static void flags_init(void) {
+	g_queue_clear(&rtp_types);
+	memset(&flags, 0, sizeof(flags));
+	flags.codec_strip = g_hash_table_new_full(str_case_hash, str_case_equal, free, NULL);
+	flags.codec_mask = g_hash_table_new_full(str_case_hash, str_case_equal, free, NULL);
+	flags.codec_except = g_hash_table_new_full(str_case_hash, str_case_equal, free, NULL);
+	flags.codec_set = g_hash_table_new_full(str_case_hash, str_case_equal, free, free);
+	flags.codec_consume = g_hash_table_new_full(str_case_hash, str_case_equal, free, NULL);
+	flags.codec_accept = g_hash_table_new_full(str_case_hash, str_case_equal, free, NULL);
+}
+
+static void bench_call_init(void) {
+	call = (struct call) {{0,},};
+	call.ssrc_hash = create_ssrc_hash_call();
+	call.tags = g_hash_table_new(g_str_hash, g_str_equal);
+	str_init(&call.callid, "bench-call");
+	bencode_buffer_init(&call.buffer);
+	media_A = call_media_new(&call);
+	media_B = call_media_new(&call);
+	ml_A = (struct call_monologue) {0,};
+	str_init(&ml_A.tag, "tag_A");
+	media_A->monologue = &ml_A;
+	media_A->protocol = &transport_protocols[PROTO_RTP_AVP];
+	ml_B = (struct call_monologue) {0,};
+	str_init(&ml_B.tag, "tag_B");
+	media_B->monologue = &ml_B;
+	media_B->protocol = &transport_protocols[PROTO_RTP_AVP];
+	flags_init();
+}
+
+static void sdp_pt(int num, char *codec, int clockrate) {
+	struct rtp_payload_type *pt = g_slice_alloc(sizeof(*pt));
+	str enc, full;
+	str_init(&enc, codec);
+	str_init(&full, g_strdup_printf("%s/%i", codec, clockrate));
+	*pt = (struct rtp_payload_type) { num, full, enc,
+		clockrate, STR_CONST_INIT(""), 1, STR_CONST_INIT(""), {0,0}, {0,0}, 0, 0, NULL };
+	g_queue_push_tail(&rtp_types, pt);
+}
+
+static void bench_codec(int pt_in, char *codec_in, int pt_out, char *codec_out) {
+	char name[64];
+	snprintf(name, sizeof(name), "%s -> %s", codec_in, codec_out);
+
+	bench_call_init();
+
+	sdp_pt(pt_in, codec_in, 8000);
+	if (pt_in != pt_out) {
+		str s;
+		str_init(&s, codec_out);
+		g_queue_push_tail(&flags.codec_transcode, str_dup(&s));
+	}
+	flags.opmode = OP_OFFER;
+	codec_tracker_init(media_B);
+	codec_rtp_payload_types(media_B, media_A, &rtp_types, &flags);
+	codec_handlers_update(media_B, media_A, &flags, NULL);
+	codec_tracker_finish(media_B);
+	flags_init();
+
+	sdp_pt(pt_out, codec_out, 8000);
+	flags.opmode = OP_ANSWER;
+	codec_tracker_init(media_A);
+	codec_rtp_payload_types(media_A, media_B, &rtp_types, &flags);
+	codec_handlers_update(media_A, media_B, &flags, NULL);
+	codec_tracker_finish(media_A);
+	flags_init();
+
+	uint32_t ssrc = htonl(0x12345678);
+	struct ssrc_ctx *ssrc_in = get_ssrc_ctx(ntohl(ssrc), call.ssrc_hash, SSRC_DIR_INPUT, NULL);
+	if (!MEDIA_ISSET(media_A, TRANSCODE))
+		ssrc_in->ssrc_map_out = ntohl(ssrc);
+	struct ssrc_ctx *ssrc_out = get_ssrc_ctx(ssrc_in->ssrc_map_out, call.ssrc_hash, SSRC_DIR_OUTPUT,
+			NULL);
+	payload_tracker_add(&ssrc_in->tracker, pt_in);
+
+	char packet[sizeof(struct rtp_header) + 160];
+	fill_payload(packet + sizeof(struct rtp_header), 160);
+
+	struct bench b;
+	bench_start(&b);
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		struct rtp_header *rtp = (void *) packet;
+		*rtp = (struct rtp_header) {
+			.v_p_x_cc = 0x80,
+			.m_pt = pt_in,
+			.ssrc = ssrc,
+			.seq_num = htons(i),
+			.timestamp = htonl(i * 160),
+		};
+
+		struct codec_handler *h = codec_handler_get(media_A, pt_in);
+		struct media_packet mp = {
+			.call = &call,
+			.media = media_A,
+			.ssrc_in = ssrc_in,
+			.ssrc_out = ssrc_out,
+			.rtp = rtp,
+		};
+		str_init_len(&mp.payload, packet + sizeof(*rtp), 160);
+		str_init_len(&mp.raw, packet, sizeof(packet));
+
+		h->func(h, &mp);
+
+		g_queue_clear_full(&mp.packets_out, codec_packet_free);
+	}
+
+	bench_stop(&b, "codec", name, iterations);
+}
+
+
+// SRTP encryption and decryption
+
+static void bench_srtp(const struct crypto_suite *suite) {
+	struct crypto_context enc = {0,}, dec = {0,};
+
+	enc.params.crypto_suite = suite;
+	fill_payload((char *) enc.params.master_key, suite->master_key_len);
+	fill_payload((char *) enc.params.master_salt, suite->master_salt_len);
+	dec.params = enc.params;
+
+	struct ssrc_hash *hash = create_ssrc_hash_call();
+	struct ssrc_ctx *ssrc_enc = get_ssrc_ctx(0x12345678, hash, SSRC_DIR_OUTPUT, NULL);
+	struct ssrc_ctx *ssrc_dec = get_ssrc_ctx(0x12345678, hash, SSRC_DIR_INPUT, NULL);
+
+	// room for the auth tag and MKI
+	const unsigned int pkt_size = sizeof(struct rtp_header) + 160 + 64;
+	char *packets = malloc(pkt_size * iterations);
+	str *s = malloc(sizeof(*s) * iterations);
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		char *p = packets + i * pkt_size;
+		struct rtp_header *rtp = (void *) p;
+		*rtp = (struct rtp_header) {
+			.v_p_x_cc = 0x80,
+			.m_pt = 0,
+			.ssrc = htonl(0x12345678),
+			.seq_num = htons(i),
+			.timestamp = htonl(i * 160),
+		};
+		fill_payload(p + sizeof(*rtp), 160);
+		str_init_len(&s[i], p, sizeof(*rtp) + 160);
+	}
+
+	struct bench b;
+	bench_start(&b);
+	for (unsigned int i = 0; i < iterations; i++) {
+		if (rtp_avp2savp(&s[i], &enc, ssrc_enc)) {
+			printf("%-12s %-28s failed\n", "srtp-enc", suite->name);
+			goto out;
+		}
+	}
+	bench_stop(&b, "srtp-enc", suite->name, iterations);
+
+	bench_start(&b);
+	for (unsigned int i = 0; i < iterations; i++) {
+		if (rtp_savp2avp(&s[i], &dec, ssrc_dec) < 0) {
+			printf("%-12s %-28s failed\n", "srtp-dec", suite->name);
+			goto out;
+		}
+	}
+	bench_stop(&b, "srtp-dec", suite->name, iterations);
+
+out:
+	free(packets);
+	free(s);
+	crypto_cleanup(&enc);
+	crypto_cleanup(&dec);
+}
+
+
+// timer queue used for delayed packet delivery
+
+static struct timerthread bench_tt;
+
+static void bench_ttq_run(struct timerthread_queue *ttq, void *p) {
+	g_slice_free1(sizeof(struct timerthread_queue_entry), p);
+}
+static void bench_ttq_free(void *p) {
+	g_slice_free1(sizeof(struct timerthread_queue_entry), p);
+}
+
+static void bench_timerthread(void) {
+	timerthread_init(&bench_tt, timerthread_queue_run);
+	struct timerthread_queue *ttq = timerthread_queue_new("bench", sizeof(*ttq), &bench_tt,
+			bench_ttq_run, NULL, NULL, bench_ttq_free);
+
+	gettimeofday(&rtpe_now, NULL);
+
+	struct bench b;
+	bench_start(&b);
+	for (unsigned int i = 0; i < iterations; i++) {
+		struct timerthread_queue_entry *ttqe = g_slice_alloc0(sizeof(*ttqe));
+		// all in the future, so that everything gets queued
+		ttqe->when = rtpe_now;
+		timeval_add_usec(&ttqe->when, 1000000 + (i % 500) * 20000);
+		timerthread_queue_push(ttq, ttqe);
+	}
+	bench_stop(&b, "timerthread", "queue push", iterations);
+
+	timeval_add_usec(&rtpe_now, 20000000);
+	bench_start(&b);
+	timerthread_queue_run(ttq);
+	bench_stop(&b, "timerthread", "queue run", iterations);
+
+	obj_put(&ttq->tt_obj);
+}
+
+
+int main(int argc, char **argv) {
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (!iterations)
+		iterations = 1;
+
+	codeclib_init(0);
+	srandom(time(NULL));
+	statistics_init();
+	codecs_init();
+	crypto_init_main();
+
+	printf("%u packets per run\n\n", iterations);
+
+	bench_codec(0, "PCMU", 0, "PCMU");
+	bench_codec(8, "PCMA", 8, "PCMA");
+	bench_codec(0, "PCMU", 8, "PCMA");
+	bench_codec(8, "PCMA", 0, "PCMU");
+	bench_codec(0, "PCMU", 9, "G722");
+	bench_codec(9, "G722", 0, "PCMU");
+
+	for (unsigned int i = 0; i < num_crypto_suites; i++)
+		bench_srtp(&crypto_suites[i]);
+
+	bench_timerthread();
+
+	return 0;
+}
@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <mysql.h>
+#include "main.h"
+#include "log.h"
+#include "metafile.h"
+#include "stream.h"
+#include "pipeline.h"
+#include "output.h"
+#include "decoder.h"
+#include "db.h"
+#include "garbage.h"
+#include "codeclib.h"
+#include "resample.h"
+#include "ssllib.h"
+
+// Throughput benchmark for the recording daemon. Runs N concurrent two-party calls, each
+// with a codec taken in turn from the given mix, through the usual decoding, mixing and
+// output pipeline, with the media synthesised in memory instead of being read from the
+// kernel. Prints the real-time factor, the CPU time used per call and the rate at which
+// output was written. Not a pass/fail test; built and run through `make bench-recording`
+// in t/, with options passed through RECORDING_BENCH_OPTS.
+//
+// All packets are fed in as fast as the pipeline takes them, so the real-time factor is
+// the wall clock time taken over the duration of the audio: below 1 means the host keeps
+// up with the given number of calls.
+
+int ktable;
+int num_threads = 4;
+enum output_storage_enum output_storage = OUTPUT_STORAGE_FILE;
+char *spool_dir;
+char *output_dir;
+int output_mixed;
+int output_single;
+enum mix_method_enum mix_method = MIX_METHOD_NATIVE;
+int output_enabled = 1;
+int decoding_enabled = 1;
+char *c_mysql_host,
+      *c_mysql_user,
+      *c_mysql_pass,
+      *c_mysql_db;
+int c_mysql_port;
+unsigned int db_batch_size = 100;
+int db_batch_delay = 200;
+char *forward_to;
+int forward_batch;
+int forward_batch_delay = 20;
+endpoint_t tls_send_to_ep;
+endpoint_t stream_to_ep;
+int tls_resample = 8000;
+int tls_batch_delay;
+int decode_threads;
+int output_threads;
+unsigned int pipeline_queue_len = 1000;
+int output_buffer;
+enum output_fsync_enum output_fsync = OUTPUT_FSYNC_NEVER;
+
+volatile int shutdown_flag;
+
+struct rtpengine_common_config rtpe_common_config;
+
+
+#define PT_BASE 96
+
+struct bench_codec {
+	const codec_def_t *def;
+	unsigned int pt;
+	int ptime;
+	unsigned int ts_step;
+	GPtrArray *payloads; // str *, one per packet
+};
+
+struct bench_call {
+	metafile_t *mf;
+	struct bench_codec *codec;
+	stream_t *streams[2];
+	unsigned int ssrcs[2];
+};
+
+static int calls = 50;
+static int duration = 10;
+static char *codec_list;
+static char *output_format;
+static int keep_output;
+
+static GPtrArray *codecs;
+static struct bench_call *bench_calls;
+static volatile gint next_call;
+static uint64_t packets_in, bytes_in;
+
+
+
+static int encoded_cb(encoder_t *enc, void *u1, void *u2) {
+	GPtrArray *payloads = u1;
+	GString *sample_buf = u2;
+	AVPacket *in_pkt = &enc->avpkt;
+
+	while (1) {
+		unsigned int len = MAX(enc->avpkt.size, (enc->samples_per_packet ? : enc->samples_per_frame)
+				* enc->def->bits_per_sample / 8);
+		str *out = g_malloc(sizeof(*out) + len);
+		str_init_len(out, (char *) (out + 1), len);
+		int ret = enc->def->packetizer(in_pkt, sample_buf, out, enc);
+		if (ret == -1 || enc->avpkt.pts == AV_NOPTS_VALUE) {
+			g_free(out);
+			break;
+		}
+		g_ptr_array_add(payloads, out);
+		if (ret == 0)
+			break;
+		in_pkt = NULL;
+	}
+	return 0;
+}
+
+// noise, converted to what the encoder takes and encoded into RTP payloads of one ptime each
+static struct bench_codec *codec_prepare(const char *name, unsigned int pt) {
+	str s;
+	str_init(&s, (char *) name);
+	const codec_def_t *def = codec_find(&s, MT_AUDIO);
+	if (!def || !def->packetizer)
+		die("Codec '%s' is not supported", name);
+
+	struct bench_codec *c = g_slice_alloc0(sizeof(*c));
+	c->def = def;
+	c->pt = pt;
+	c->ptime = def->default_ptime > 0 ? def->default_ptime : 20;
+	c->ts_step = def->default_clockrate * c->ptime / 1000;
+	c->payloads = g_ptr_array_new_with_free_func(g_free);
+
+	format_t req_fmt = {
+		.clockrate = def->default_clockrate * def->clockrate_mult,
+		.channels = def->default_channels,
+		.format = -1,
+	};
+	format_t enc_fmt;
+	encoder_t *enc = encoder_new();
+	if (encoder_config(enc, def, def->default_bitrate, c->ptime, &req_fmt, &enc_fmt))
+		die("Failed to create encoder for '%s'", name);
+
+	GString *sample_buf = g_string_new("");
+	resample_t conv = {0,};
+	unsigned int frame_samples = enc_fmt.clockrate * c->ptime / 1000;
+	unsigned int seed = pt;
+
+	for (int ms = 0; ms < duration * 1000; ms += c->ptime) {
+		AVFrame *frame = av_frame_alloc();
+		frame->nb_samples = frame_samples;
+		frame->format = AV_SAMPLE_FMT_S16;
+		frame->sample_rate = enc_fmt.clockrate;
+		frame->channel_layout = av_get_default_channel_layout(enc_fmt.channels);
+		frame->pts = (int64_t) ms * enc_fmt.clockrate / 1000;
+		if (av_frame_get_buffer(frame, 0) < 0)
+			die("Out of memory");
+		int16_t *samples = (int16_t *) frame->extended_data[0];
+		for (unsigned int i = 0; i < frame_samples * enc_fmt.channels; i++)
+			samples[i] = (int16_t) (rand_r(&seed) & 0x1fff) - 0x1000;
+		AVFrame *conv_frame = resample_frame(&conv, frame, &enc_fmt);
+		av_frame_free(&frame);
+		if (!conv_frame)
+			die("Failed to resample input for '%s'", name);
+		if (encoder_input_fifo(enc, conv_frame, encoded_cb, c->payloads, sample_buf))
+			die("Failed to encode '%s'", name);
+		av_frame_free(&conv_frame);
+	}
+
+	resample_shutdown(&conv);
+	g_string_free(sample_buf, TRUE);
+	encoder_free(enc);
+
+	if (!c->payloads->len)
+		die("No packets encoded for '%s'", name);
+
+	return c;
+}
+
+static void codec_free(void *p) {
+	struct bench_codec *c = p;
+	g_ptr_array_free(c->payloads, TRUE);
+	g_slice_free1(sizeof(*c), c);
+}
+
+
+// as the metadata file written by the daemon would have it
+static void call_open(struct bench_call *bc, unsigned int num) {
+	struct bench_codec *c = bc->codec;
+	char name[64], section[64], content[128];
+
+	snprintf(name, sizeof(name), "bench-call-%u-%08x", num, g_random_int());
+	bc->mf = metafile_offline_open(name);
+
+	metafile_section(bc->mf, "PARENT", name);
+	metafile_section(bc->mf, "CALL-ID", name);
+	snprintf(section, sizeof(section), "MEDIA 1 PTIME %i", c->ptime);
+	metafile_section(bc->mf, section, "");
+	snprintf(section, sizeof(section), "MEDIA 1 PAYLOAD TYPE %u", c->pt);
+	if (c->def->default_channels > 1)
+		snprintf(content, sizeof(content), "%s/%i/%i", c->def->rtpname,
+				c->def->default_clockrate, c->def->default_channels);
+	else
+		snprintf(content, sizeof(content), "%s/%i", c->def->rtpname, c->def->default_clockrate);
+	metafile_section(bc->mf, section, content);
+	if (c->def->default_fmtp) {
+		snprintf(section, sizeof(section), "MEDIA 1 FMTP %u", c->pt);
+		metafile_section(bc->mf, section, (char *) c->def->default_fmtp);
+	}
+
+	for (unsigned int i = 0; i < 2; i++) {
+		snprintf(section, sizeof(section), "TAG %u", i);
+		snprintf(content, sizeof(content), "party-%u", i);
+		metafile_section(bc->mf, section, content);
+		snprintf(section, sizeof(section), "STREAM %u interface", i);
+		snprintf(content, sizeof(content), "192.0.2.%u:%u", i + 1, 30000 + num * 2 + i);
+		metafile_section(bc->mf, section, content);
+		snprintf(section, sizeof(section), "STREAM %u details", i);
+		snprintf(content, sizeof(content), "TAG %u MEDIA 1 TAG-MEDIA 1 COMPONENT 1 FLAGS 0", i);
+		metafile_section(bc->mf, section, content);
+		bc->streams[i] = g_ptr_array_index(bc->mf->streams, i);
+		bc->ssrcs[i] = g_random_int();
+	}
+
+	pthread_mutex_unlock(&bc->mf->lock);
+}
+
+
+static void packet_send(struct bench_call *bc, unsigned int side, unsigned int idx, unsigned char *buf) {
+	struct bench_codec *c = bc->codec;
+	str *payload = g_ptr_array_index(c->payloads, idx);
+	unsigned int len = 20 + 8 + 12 + payload->len;
+
+	// IPv4 and UDP headers: only the header length is looked at
+	memset(buf, 0, 28);
+	buf[0] = 0x45;
+	buf[9] = 17;
+	// RTP
+	unsigned char *rtp = buf + 28;
+	rtp[0] = 0x80;
+	rtp[1] = c->pt;
+	*(uint16_t *) (rtp + 2) = htons(idx);
+	*(uint32_t *) (rtp + 4) = htonl(idx * c->ts_step);
+	*(uint32_t *) (rtp + 8) = htonl(bc->ssrcs[side]);
+	memcpy(rtp + 12, payload->s, payload->len);
+
+	stream_inject(bc->streams[side], buf, len);
+	__atomic_fetch_add(&packets_in, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&bytes_in, len, __ATOMIC_RELAXED);
+}
+
+
+// each thread takes a share of the calls and sends their packets in turn, one ptime at a
+// time, so that all calls are in progress at once
+static void *feed_thread(void *p) {
+	GPtrArray *mine = g_ptr_array_new();
+	unsigned char *buf = g_malloc(65536);
+	unsigned int max_packets = 0;
+
+	mysql_thread_init();
+
+	while (1) {
+		unsigned int i = g_atomic_int_add(&next_call, 1);
+		if (i >= (unsigned int) calls)
+			break;
+		struct bench_call *bc = &bench_calls[i];
+		g_ptr_array_add(mine, bc);
+		max_packets = MAX(max_packets, bc->codec->payloads->len);
+	}
+
+	for (unsigned int idx = 0; idx < max_packets; idx++) {
+		for (unsigned int i = 0; i < mine->len; i++) {
+			struct bench_call *bc = g_ptr_array_index(mine, i);
+			if (idx >= bc->codec->payloads->len)
+				continue;
+			packet_send(bc, 0, idx, buf);
+			packet_send(bc, 1, idx, buf);
+		}
+	}
+
+	mysql_thread_end();
+
+	g_free(buf);
+	g_ptr_array_free(mine, TRUE);
+	return NULL;
+}
+
+
+static uint64_t output_size(const char *path, int remove) {
+	uint64_t total = 0;
+	GDir *dir = g_dir_open(path, 0, NULL);
+	if (!dir)
+		return 0;
+	const char *fn;
+	while ((fn = g_dir_read_name(dir))) {
+		char *full = g_build_filename(path, fn, NULL);
+		GStatBuf st;
+		if (!g_stat(full, &st))
+			total += st.st_size;
+		if (remove)
+			g_unlink(full);
+		g_free(full);
+	}
+	g_dir_close(dir);
+	if (remove)
+		g_rmdir(path);
+	return total;
+}
+
+
+static double cpu_secs(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0
+		+ ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+
+static void options(int *argc, char ***argv) {
+	GOptionEntry e[] = {
+		{ "calls",		'n', 0, G_OPTION_ARG_INT,	&calls,		"Number of concurrent calls",		"INT"		},
+		{ "duration",		'd', 0, G_OPTION_ARG_INT,	&duration,	"Seconds of audio per call",		"INT"		},
+		{ "codecs",		'c', 0, G_OPTION_ARG_STRING,	&codec_list,	"Codecs to assign to the calls in turn","LIST"		},
+		{ "threads",		't', 0, G_OPTION_ARG_INT,	&num_threads,	"Number of threads feeding packets",	"INT"		},
+		{ "decode-threads",	0,   0, G_OPTION_ARG_INT,	&decode_threads,"Number of decoding and mixing threads","INT"		},
+		{ "output-threads",	0,   0, G_OPTION_ARG_INT,	&output_threads,"Number of output encoding threads",	"INT"		},
+		{ "output-buffer",	0,   0, G_OPTION_ARG_INT,	&output_buffer,	"Buffer output files in memory and write them out in chunks of this size","KB"},
+		{ "output-format",	0,   0, G_OPTION_ARG_STRING,	&output_format,	"Write audio files of this type",	"wav|mp3"	},
+		{ "output-dir",		0,   0, G_OPTION_ARG_STRING,	&output_dir,	"Where to write media files to",	"PATH"		},
+		{ "output-mixed",	0,   0, G_OPTION_ARG_NONE,	&output_mixed,	"Mix participating sources into a single output",NULL	},
+		{ "output-single",	0,   0, G_OPTION_ARG_NONE,	&output_single,	"Create one output file for each source",NULL		},
+		{ "keep-output",	0,   0, G_OPTION_ARG_NONE,	&keep_output,	"Don't delete the output files",	NULL		},
+		{ NULL, }
+	};
+
+	GOptionContext *c = g_option_context_new(" - recording daemon throughput benchmark");
+	g_option_context_add_main_entries(c, e, NULL);
+	GError *er = NULL;
+	if (!g_option_context_parse(c, argc, argv, &er))
+		die("Bad command line: %s", er->message);
+	g_option_context_free(c);
+
+	if (calls <= 0 || duration <= 0 || num_threads <= 0)
+		die("Invalid number of calls, duration or threads");
+	if (decode_threads < 0 || output_threads < 0 || output_buffer < 0)
+		die("Invalid negative option");
+	if (!codec_list)
+		codec_list = g_strdup("PCMA,PCMU,G722,opus");
+	if (!output_format)
+		output_format = g_strdup("wav");
+	if (!output_mixed && !output_single)
+		output_mixed = output_single = 1;
+	if (!output_dir) {
+		output_dir = g_dir_make_tmp("recording-bench-XXXXXX", NULL);
+		if (!output_dir)
+			die("Failed to create output dir");
+	}
+	else if (!keep_output)
+		die("The output dir is only removed if it was created, use --keep-output");
+}
+
+
+int main(int argc, char **argv) {
+	rtpe_common_config_ptr = &rtpe_common_config;
+	rtpe_common_config.log_level = LOG_WARN;
+	rtpe_common_config.log_stderr = 1;
+
+	options(&argc, &argv);
+
+	log_init("recording-bench");
+	rtpe_ssl_init();
+	socket_init();
+	codeclib_init(0);
+	output_init(output_format);
+	mysql_library_init(0, NULL, NULL);
+	metafile_setup();
+
+	codecs = g_ptr_array_new_with_free_func(codec_free);
+	char **names = g_strsplit(codec_list, ",", -1);
+	for (char **n = names; *n; n++)
+		g_ptr_array_add(codecs, codec_prepare(*n, PT_BASE + codecs->len));
+	g_strfreev(names);
+
+	db_init();
+	pipeline_init();
+
+	bench_calls = g_new0(struct bench_call, calls);
+	for (int i = 0; i < calls; i++) {
+		bench_calls[i].codec = g_ptr_array_index(codecs, i % codecs->len);
+		call_open(&bench_calls[i], i);
+	}
+
+	int64_t start = g_get_monotonic_time();
+	double cpu_start = cpu_secs();
+
+	pthread_t *threads = g_new(pthread_t, num_threads);
+	for (int i = 0; i < num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, feed_thread, NULL))
+			die_errno("pthread_create failed");
+	}
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+	g_free(threads);
+
+	// closing the calls flushes the mixers and the outputs, which are part of the work
+	for (int i = 0; i < calls; i++)
+		metafile_offline_close(bench_calls[i].mf);
+
+	pipeline_stop(PIPELINE_DECODE);
+	pipeline_stop(PIPELINE_OUTPUT);
+	pipeline_stop(PIPELINE_WRITE);
+
+	double secs = (g_get_monotonic_time() - start) / 1000000.0;
+	double cpu = cpu_secs() - cpu_start;
+	if (secs <= 0)
+		secs = 0.000001;
+
+	uint64_t out_bytes = output_size(output_dir, !keep_output);
+
+	printf("%i calls of %i seconds, codecs %s, output %s%s%s, %i feed / %i decode / %i output threads\n",
+			calls, duration, codec_list, output_format,
+			output_mixed ? " mixed" : "", output_single ? " single" : "",
+			num_threads, decode_threads, output_threads);
+	printf("%-24s %12.3f s\n", "wall time", secs);
+	printf("%-24s %12.3f (%.1f calls in real time)\n", "real-time factor",
+			secs / duration, calls * duration / secs);
+	printf("%-24s %12.3f s (%.2f%% of a core per call)\n", "CPU time", cpu,
+			cpu * 100.0 / calls / duration);
+	printf("%-24s %12.0f packets/s, %.2f MB/s\n", "input", packets_in / secs,
+			bytes_in / secs / 1000000.0);
+	printf("%-24s %12.2f MB/s (%.1f MB total)\n", "output written", out_bytes / secs / 1000000.0,
+			out_bytes / 1000000.0);
+	if (keep_output)
+		printf("%-24s %s\n", "output dir", output_dir);
+
+	g_free(bench_calls);
+	g_ptr_array_free(codecs, TRUE);
+	codeclib_free();
+	garbage_collect_all();
+	metafile_cleanup();
+	db_cleanup();
+	mysql_library_end();
+	log_free();
+
+	g_free(codec_list);
+	g_free(output_format);
+	g_free(output_dir);
+
+	return 0;
+}
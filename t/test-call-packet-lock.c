@@ -0,0 +1,104 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <assert.h>
+#include "call.h"
+#include "log.h"
+#include "main.h"
+
+int _log_facility_rtcp;
+int _log_facility_cdr;
+int _log_facility_dtmf;
+struct rtpengine_config rtpe_config;
+struct poller *rtpe_poller;
+struct poller **rtpe_media_pollers;
+void control_listeners_close(void) { }
+GString *dtmf_logs;
+
+
+// call_lock_w(), which the handover uses to quiesce a call before taking its snapshot,
+// must wait for packet handlers inside call_packet_lock(), and keep new ones out
+
+static struct call call_a, call_b;
+static int reader_in, reader_done;
+
+static void *reader_hold(void *p) {
+	struct call *c = p;
+	call_packet_lock(c);
+	g_atomic_int_set(&reader_in, 1);
+	usleep(200000);
+	g_atomic_int_set(&reader_done, 1);
+	call_packet_unlock(c);
+	return NULL;
+}
+
+static void *reader_enter(void *p) {
+	struct call *c = p;
+	call_packet_lock(c);
+	g_atomic_int_set(&reader_in, 1);
+	call_packet_unlock(c);
+	return NULL;
+}
+
+static void start(pthread_t *t, void *(*fn)(void *), struct call *c) {
+	reader_in = reader_done = 0;
+	int ret = pthread_create(t, NULL, fn, c);
+	assert(ret == 0);
+}
+
+int main(void) {
+	pthread_t t;
+
+	rwlock_init(&call_a.master_lock);
+	rwlock_init(&call_b.master_lock);
+
+	// a writer waits for a reader that is already in
+	start(&t, reader_hold, &call_a);
+	while (!g_atomic_int_get(&reader_in))
+		usleep(1000);
+	call_lock_w(&call_a);
+	if (!g_atomic_int_get(&reader_done)) {
+		printf("test nok: writer got in while a packet handler was running\n");
+		abort();
+	}
+	call_unlock_w(&call_a);
+	pthread_join(t, NULL);
+	printf("test ok: writer waits for packet handler\n");
+
+	// a reader of a different call doesn't hold up the writer
+	start(&t, reader_hold, &call_b);
+	while (!g_atomic_int_get(&reader_in))
+		usleep(1000);
+	call_lock_w(&call_a);
+	if (g_atomic_int_get(&reader_done)) {
+		printf("test nok: writer waited for a packet handler of another call\n");
+		abort();
+	}
+	call_unlock_w(&call_a);
+	pthread_join(t, NULL);
+	printf("test ok: writer ignores other calls\n");
+
+	// a reader arriving while the writer is in waits for it
+	call_lock_w(&call_a);
+	start(&t, reader_enter, &call_a);
+	usleep(100000);
+	if (g_atomic_int_get(&reader_in)) {
+		printf("test nok: packet handler got in while the writer was running\n");
+		abort();
+	}
+	call_unlock_w(&call_a);
+	pthread_join(t, NULL);
+	assert(reader_in == 1);
+	assert(call_a.packet_writers == 0);
+	printf("test ok: packet handler waits for writer\n");
+
+	// and the fast path works again afterwards, also from the same thread
+	call_packet_lock(&call_a);
+	call_packet_unlock(&call_a);
+	call_lock_w(&call_a);
+	call_unlock_w(&call_a);
+	printf("test ok: fast path\n");
+
+	return 0;
+}
@@ -8,6 +8,7 @@
 #include <spandsp/logging.h>
 #include <spandsp/dtmf.h>
 #include <glib.h>
+#include "dtmflib.h"
 
 static unsigned char samples[] = {
   0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
@@ -646,5 +647,30 @@ int main(int argc, char **argv) {
 				"code 0 level -99 delay 816, "))
 		abort();
 
+	// same again with the native Goertzel detector, two streams in one batch
+	GString *outputs[2] = { g_string_new(""), g_string_new("") };
+	struct dtmf_detect dds[2];
+	for (int i = 0; i < 2; i++)
+		dtmf_detect_init(&dds[i], report_func, outputs[i]);
+
+	reader = samples;
+	while (1) {
+		unsigned char *packet_end = reader + packetise * 2;
+		if (packet_end > end)
+			break;
+		struct dtmf_detect_job jobs[2] = {
+			{ &dds[0], (void *) reader, packetise },
+			{ &dds[1], (void *) reader, packetise },
+		};
+		dtmf_detect_batch(jobs, 2);
+		reader += packetise * 2;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		printf("goertzel result: %s\n", outputs[i]->str);
+		if (strcmp(outputs[i]->str, output->str))
+			abort();
+	}
+
 	return 0;
 }
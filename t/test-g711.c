@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <libavcodec/avcodec.h>
+#include "codeclib.h"
+#include "str.h"
+
+// checks the native G.711 codec and the A-law <> µ-law tables for all possible inputs.
+// decoding must match libavcodec exactly. encoders differ in how they round at the
+// decision levels, so encoding is checked for round trips, monotonicity and the
+// quantisation error instead
+
+static const format_t fmt = { .clockrate = 8000, .channels = 1, .format = AV_SAMPLE_FMT_S16 };
+
+static int16_t pcm_all[65536];
+static unsigned char g711_all[256];
+
+
+static int dec_cb(decoder_t *dec, AVFrame *frame, void *u1, void *u2) {
+	int16_t *out = u1;
+	unsigned int *len = u2;
+	memcpy(out + *len, frame->extended_data[0], frame->nb_samples * sizeof(*out));
+	*len += frame->nb_samples;
+	codeclib_frame_free(&frame);
+	return 0;
+}
+
+static void native_decode(const codec_def_t *def, const unsigned char *in, unsigned int num, int16_t *out) {
+	decoder_t *dec = decoder_new_fmt(def, 8000, 1, 20, &fmt);
+	assert(dec);
+	str s = STR_CONST_INIT_LEN((char *) in, num);
+	unsigned int len = 0;
+	int ret = decoder_input_data(dec, &s, 0, dec_cb, out, &len);
+	assert(ret == 0);
+	assert(len == num);
+	decoder_close(dec);
+}
+
+static int enc_cb(encoder_t *enc, void *u1, void *u2) {
+	unsigned char *out = u1;
+	unsigned int *len = u2;
+	memcpy(out + *len, enc->avpkt.data, enc->avpkt.size);
+	*len += enc->avpkt.size;
+	return 0;
+}
+
+static AVFrame *pcm_frame(const int16_t *in, unsigned int num) {
+	AVFrame *frame = av_frame_alloc();
+	assert(frame);
+	frame->nb_samples = num;
+	frame->format = AV_SAMPLE_FMT_S16;
+	frame->sample_rate = 8000;
+	frame->channel_layout = AV_CH_LAYOUT_MONO;
+	int ret = av_frame_get_buffer(frame, 0);
+	assert(ret >= 0);
+	memcpy(frame->extended_data[0], in, num * sizeof(*in));
+	return frame;
+}
+
+static void native_encode(const codec_def_t *def, const int16_t *in, unsigned int num, unsigned char *out) {
+	encoder_t *enc = encoder_new();
+	assert(enc);
+	format_t actual;
+	int ret = encoder_config(enc, def, 64000, 20, &fmt, &actual);
+	assert(ret == 0);
+	assert(actual.format == AV_SAMPLE_FMT_S16);
+
+	AVFrame *frame = pcm_frame(in, num);
+	unsigned int len = 0;
+	ret = encoder_input_data(enc, frame, enc_cb, out, &len);
+	assert(ret == 0);
+	assert(len == num);
+	av_frame_free(&frame);
+	encoder_free(enc);
+}
+
+static AVCodecContext *av_open(const AVCodec *codec) {
+	assert(codec);
+	AVCodecContext *avcctx = avcodec_alloc_context3(codec);
+	assert(avcctx);
+	avcctx->sample_rate = 8000;
+	avcctx->channels = 1;
+	avcctx->channel_layout = AV_CH_LAYOUT_MONO;
+	avcctx->sample_fmt = AV_SAMPLE_FMT_S16;
+	int ret = avcodec_open2(avcctx, codec, NULL);
+	assert(ret == 0);
+	return avcctx;
+}
+
+static void av_decode(const codec_def_t *def, const unsigned char *in, unsigned int num, int16_t *out) {
+	AVCodecContext *avcctx = av_open(avcodec_find_decoder(def->avcodec_id));
+	AVPacket *pkt = av_packet_alloc();
+	int ret = av_new_packet(pkt, num);
+	assert(ret == 0);
+	memcpy(pkt->data, in, num);
+	ret = avcodec_send_packet(avcctx, pkt);
+	assert(ret == 0);
+
+	AVFrame *frame = av_frame_alloc();
+	ret = avcodec_receive_frame(avcctx, frame);
+	assert(ret == 0);
+	assert(frame->nb_samples == num);
+	assert(frame->format == AV_SAMPLE_FMT_S16);
+	memcpy(out, frame->extended_data[0], num * sizeof(*out));
+
+	av_frame_free(&frame);
+	av_packet_free(&pkt);
+	avcodec_free_context(&avcctx);
+}
+
+static const codec_def_t *find(const char *name) {
+	str s;
+	str_init(&s, (char *) name);
+	const codec_def_t *def = codec_find(&s, MT_AUDIO);
+	assert(def);
+	return def;
+}
+
+static void test_codec(const char *name) {
+	const codec_def_t *def = find(name);
+	assert(def->support_encoding);
+	assert(def->support_decoding);
+	static int16_t native_pcm[256], av_pcm[256], round_pcm[65536];
+	static unsigned char native_g711[65536], round_g711[256];
+
+	native_decode(def, g711_all, 256, native_pcm);
+	av_decode(def, g711_all, 256, av_pcm);
+	for (unsigned int i = 0; i < 256; i++) {
+		if (native_pcm[i] == av_pcm[i])
+			continue;
+		printf("test nok: %s decoding %02x: got %i, expected %i\n", name, i,
+				native_pcm[i], av_pcm[i]);
+		abort();
+	}
+	printf("test ok: %s decoder\n", name);
+
+	// every code decodes to a value that encodes back to the same code. µ-law has two
+	// codes for zero, of which the encoder uses the positive one
+	native_encode(def, native_pcm, 256, round_g711);
+	for (unsigned int i = 0; i < 256; i++) {
+		unsigned char exp = (!strcmp(name, "PCMU") && i == 0x7f) ? 0xff : i;
+		if (round_g711[i] == exp)
+			continue;
+		printf("test nok: %s round trip %02x: got %02x\n", name, i, round_g711[i]);
+		abort();
+	}
+	printf("test ok: %s round trip\n", name);
+
+	native_encode(def, pcm_all, 65536, native_g711);
+	native_decode(def, native_g711, 65536, round_pcm);
+	int prev = -32768;
+	for (int x = -32768; x < 32768; x++) {
+		int y = round_pcm[(uint16_t) x];
+		// one quantisation step at most: 16 in the two lowest A-law segments, 8 in
+		// the lowest µ-law segment, doubling with each segment after that
+		int tolerance = MAX(32, abs(x) / 8);
+		if (y < prev || abs(y - x) > tolerance) {
+			printf("test nok: %s encoding %i: decodes to %i (previous %i)\n", name, x, y, prev);
+			abort();
+		}
+		prev = y;
+	}
+	printf("test ok: %s encoder\n", name);
+}
+
+static void test_transcode(const char *src_name, const char *dst_name) {
+	const codec_def_t *src = find(src_name), *dst = find(dst_name);
+	static int16_t pcm[256];
+	static unsigned char exp[256];
+
+	const unsigned char *table = codec_g711_transcode_table(src, dst);
+	assert(table);
+
+	// must be the same as decoding and encoding again
+	av_decode(src, g711_all, 256, pcm);
+	native_encode(dst, pcm, 256, exp);
+	for (unsigned int i = 0; i < 256; i++) {
+		if (table[i] == exp[i])
+			continue;
+		printf("test nok: %s -> %s %02x: got %02x, expected %02x\n", src_name, dst_name, i,
+				table[i], exp[i]);
+		abort();
+	}
+	printf("test ok: %s -> %s table\n", src_name, dst_name);
+}
+
+int main(void) {
+	codeclib_init(0);
+
+	for (unsigned int i = 0; i < 65536; i++)
+		pcm_all[i] = (int16_t) i;
+	for (unsigned int i = 0; i < 256; i++)
+		g711_all[i] = i;
+
+	test_codec("PCMA");
+	test_codec("PCMU");
+	test_transcode("PCMA", "PCMU");
+	test_transcode("PCMU", "PCMA");
+
+	// only between different laws
+	assert(codec_g711_transcode_table(find("PCMA"), find("PCMA")) == NULL);
+	assert(codec_g711_transcode_table(find("PCMU"), find("PCMU")) == NULL);
+	assert(codec_g711_transcode_table(find("PCMA"), find("G722")) == NULL);
+	printf("test ok: no table for other pairs\n");
+
+	return 0;
+}
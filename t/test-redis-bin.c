@@ -0,0 +1,169 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <json-glib/json-glib.h>
+#include "redis.h"
+#include "log.h"
+#include "main.h"
+#include "str.h"
+
+int _log_facility_rtcp;
+int _log_facility_cdr;
+int _log_facility_dtmf;
+struct rtpengine_config rtpe_config;
+struct poller *rtpe_poller;
+struct poller **rtpe_media_pollers;
+void control_listeners_close(void) { }
+GString *dtmf_logs;
+
+
+// round trips of the binary call format: a tree encoded with redis_bin_encode_node() must
+// decode into the same tree that the JSON format produces, which has its strings URI encoded
+
+static char *node_str(JsonNode *node) {
+	JsonGenerator *gen = json_generator_new();
+	json_generator_set_root(gen, node);
+	char *ret = json_generator_to_data(gen, NULL);
+	g_object_unref(gen);
+	return ret;
+}
+
+// the same tree with all strings URI encoded, as the JSON format stores them
+static void uri_enc_node(JsonBuilder *b, JsonNode *node) {
+	GList *l, *list;
+	JsonObject *o;
+
+	switch (json_node_get_node_type(node)) {
+		case JSON_NODE_OBJECT:
+			json_builder_begin_object(b);
+			o = json_node_get_object(node);
+			list = json_object_get_members(o);
+			for (l = list; l; l = l->next) {
+				json_builder_set_member_name(b, l->data);
+				uri_enc_node(b, json_object_get_member(o, l->data));
+			}
+			g_list_free(list);
+			json_builder_end_object(b);
+			break;
+		case JSON_NODE_ARRAY:
+			json_builder_begin_array(b);
+			list = json_array_get_elements(json_node_get_array(node));
+			for (l = list; l; l = l->next)
+				uri_enc_node(b, l->data);
+			g_list_free(list);
+			json_builder_end_array(b);
+			break;
+		default:;
+			const char *s = json_node_get_string(node);
+			assert(s != NULL);
+			char *enc = g_malloc(strlen(s) * 3 + 1);
+			str_uri_encode_len(enc, s, strlen(s));
+			json_builder_add_string_value(b, enc);
+			g_free(enc);
+			break;
+	}
+}
+
+static void test_node(const char *name, JsonNode *in) {
+	JsonBuilder *b = json_builder_new();
+	uri_enc_node(b, in);
+	JsonNode *exp_node = json_builder_get_root(b);
+	g_object_unref(b);
+	char *exp = node_str(exp_node);
+
+	GString *bin = redis_bin_encode_node(in);
+	JsonNode *out_node = redis_bin_decode_node(bin->str, bin->len);
+	if (!out_node) {
+		printf("test nok: %s: failed to decode\n", name);
+		abort();
+	}
+	char *out = node_str(out_node);
+	if (strcmp(out, exp)) {
+		printf("test nok: %s\nexpected: %.200s\ngot:      %.200s\n", name, exp, out);
+		abort();
+	}
+
+	// anything cut short must be rejected. only some of the cut-off points for the big one
+	gsize step = bin->len > 4096 ? bin->len / 256 : 1;
+	for (gsize len = 0; len < bin->len; len = (len + step < bin->len) ? len + step : len + 1) {
+		JsonNode *trunc = redis_bin_decode_node(bin->str, len);
+		if (!trunc)
+			continue;
+		printf("test nok: %s: decoded from %zu of %zu bytes\n", name, len, bin->len);
+		abort();
+	}
+
+	printf("test ok: %s (%zu bytes)\n", name, bin->len);
+
+	g_free(out);
+	g_free(exp);
+	json_node_free(out_node);
+	json_node_free(exp_node);
+	g_string_free(bin, TRUE);
+}
+
+static void test_json(const char *json) {
+	JsonParser *parser = json_parser_new();
+	gboolean ok = json_parser_load_from_data(parser, json, -1, NULL);
+	assert(ok);
+	test_node(json, json_parser_get_root(parser));
+	g_object_unref(parser);
+}
+
+// strings around the boundaries of one, two and three byte varint lengths
+static void test_long_strings(void) {
+	static const unsigned int lens[] = { 127, 128, 300, 16383, 16384, 20000 };
+	JsonBuilder *b = json_builder_new();
+
+	json_builder_begin_object(b);
+	json_builder_set_member_name(b, "json");
+	json_builder_begin_object(b);
+	for (unsigned int i = 0; i < G_N_ELEMENTS(lens); i++) {
+		char *s = g_malloc(lens[i] + 1);
+		for (unsigned int j = 0; j < lens[i]; j++)
+			s[j] = "abc %;:/\"\\"[j % 10];
+		s[lens[i]] = '\0';
+		char *member = g_strdup_printf("s%u", lens[i]);
+		json_builder_set_member_name(b, member);
+		json_builder_add_string_value(b, s);
+		g_free(member);
+		g_free(s);
+	}
+	json_builder_end_object(b);
+	json_builder_set_member_name(b, "list");
+	json_builder_begin_array(b);
+	char *s = g_strnfill(70000, 'x');
+	json_builder_add_string_value(b, s);
+	g_free(s);
+	json_builder_end_array(b);
+	json_builder_end_object(b);
+
+	JsonNode *node = json_builder_get_root(b);
+	test_node("long strings", node);
+	json_node_free(node);
+	g_object_unref(b);
+}
+
+int main(void) {
+	test_json("{}");
+	test_json("[]");
+	test_json("{\"json\":{}}");
+	test_json("{\"json\":[]}");
+	test_json("[\"a\",\"\",\"c\"]");
+	test_json("[[],[[]],{}]");
+	test_json("{\"json\":{\"callid\":\"abc@host\",\"created\":\"1700000000\",\"deleted\":\"\"}}");
+	// special characters, which the JSON format URI encodes
+	test_json("{\"json\":{\"tag\":\"a;b;c\",\"addr\":\"::ffff:10.0.0.1\",\"x\":\"% \\\" \\\\ / \\u00b5\"}}");
+	// member names repeated within a top-level key are sent as references, and the
+	// references start over with each top-level key
+	test_json("{\"json\":{\"a\":{\"k\":\"1\",\"l\":\"2\"},\"b\":{\"k\":\"3\",\"l\":\"4\"},\"c\":[{\"k\":\"5\"}]},"
+			"\"sfd-0\":{\"l\":\"6\",\"k\":\"7\"},"
+			"\"sfd-1\":{\"k\":\"8\",\"a\":{\"k\":\"9\"}}}");
+	// nesting
+	test_json("{\"stream-0\":{\"a\":[{\"b\":[\"c\",{\"d\":[[\"e\"],{}]}]},[],\"f\"],\"g\":{\"h\":{\"i\":{\"j\":\"k\"}}}},"
+			"\"rtp_payload_types-0\":[\"0/PCMU/8000\",\"8/PCMA/8000\",\"101/telephone-event/8000\"]}");
+	test_long_strings();
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "timerthread.h"
+#include "poller.h"
+#include "main.h"
+#include "log.h"
+
+struct rtpengine_config rtpe_config;
+
+// only used for timer threads that belong to a poller, which we don't have here
+int poller_add_item(struct poller *p, struct poller_item *i) {
+	abort();
+}
+
+
+struct test_obj {
+	struct timerthread_obj tt_obj;
+	int id;
+	struct timeval due;
+};
+
+static mutex_t ran_lock = MUTEX_STATIC_INIT;
+static int ran[16];
+static unsigned int num_ran;
+
+static void test_run(void *p) {
+	struct test_obj *o = p;
+	struct timeval now;
+	gettimeofday(&now, NULL);
+
+	if (timeval_cmp(&now, &o->due) < 0) {
+		printf("test nok: object %i ran %lli us early\n", o->id, timeval_diff(&o->due, &now));
+		abort();
+	}
+
+	mutex_lock(&ran_lock);
+	assert(num_ran < G_N_ELEMENTS(ran));
+	ran[num_ran++] = o->id;
+	mutex_unlock(&ran_lock);
+}
+
+static void *test_thread(void *p) {
+	timerthread_run(p);
+	return NULL;
+}
+
+static struct test_obj *test_obj_new(struct timerthread *tt, int id) {
+	struct test_obj *o = obj_alloc0("test_obj", sizeof(*o), NULL);
+	o->tt_obj.tt = tt;
+	o->id = id;
+	return o;
+}
+
+static void test_schedule(struct test_obj *o, const struct timeval *start, long long us) {
+	o->due = *start;
+	timeval_add_usec(&o->due, us);
+	timerthread_obj_schedule_abs(&o->tt_obj, &o->due);
+}
+
+static void test_expect(const char *backend, const int *exp, unsigned int num, const char *file, int line) {
+	mutex_lock(&ran_lock);
+	if (num_ran != num)
+		goto nok;
+	for (unsigned int i = 0; i < num; i++) {
+		if (ran[i] != exp[i])
+			goto nok;
+	}
+	mutex_unlock(&ran_lock);
+	printf("test ok: %s:%i (%s)\n", file, line, backend);
+	return;
+
+nok:
+	printf("test nok: %s:%i (%s)\n", file, line, backend);
+	printf("expected:");
+	for (unsigned int i = 0; i < num; i++)
+		printf(" %i", exp[i]);
+	printf("\ngot:");
+	for (unsigned int i = 0; i < num_ran; i++)
+		printf(" %i", ran[i]);
+	printf("\n");
+	abort();
+}
+#define expect(...) do { \
+		const int __exp[] = { __VA_ARGS__ }; \
+		test_expect(backend, __exp, G_N_ELEMENTS(__exp), __FILE__, __LINE__); \
+	} while (0)
+
+static void test_backend(int wheel) {
+	const char *backend = wheel ? "timing wheel" : "tree";
+	struct timerthread tt;
+	struct test_obj *o[8];
+	struct timeval start;
+	pthread_t thread;
+
+	rtpe_config.timer_wheel = wheel;
+	rtpe_shutdown = 0;
+	num_ran = 0;
+
+	timerthread_init(&tt, test_run);
+	for (int i = 0; i < G_N_ELEMENTS(o); i++)
+		o[i] = test_obj_new(&tt, i);
+
+	gettimeofday(&start, NULL);
+
+	test_schedule(o[1], &start, 50000);
+	test_schedule(o[2], &start, 20000);
+	// same millisecond as the previous one, but later
+	test_schedule(o[3], &start, 20500);
+	// more than one revolution of the lowest level of the wheel (256 ms) ahead,
+	// and more than two
+	test_schedule(o[4], &start, 300000);
+	test_schedule(o[5], &start, 700000);
+	// cancelled before it's due
+	test_schedule(o[6], &start, 100000);
+	// moved to an earlier time: only the earlier one counts
+	test_schedule(o[7], &start, 150000);
+	test_schedule(o[7], &start, 10000);
+	// a later time doesn't replace an earlier one
+	test_schedule(o[0], &start, 30000);
+	test_schedule(o[0], &start, 400000);
+
+	timerthread_obj_deschedule(&o[6]->tt_obj);
+
+	pthread_create(&thread, NULL, test_thread, &tt);
+
+	usleep(200000);
+	expect(7, 2, 3, 0, 1);
+
+	usleep(1000000);
+	expect(7, 2, 3, 0, 1, 4, 5);
+
+	rtpe_shutdown = 1;
+	pthread_join(thread, NULL);
+
+	for (int i = 0; i < G_N_ELEMENTS(o); i++)
+		obj_put(&o[i]->tt_obj);
+	timerthread_free(&tt);
+}
+
+int main(void) {
+	test_backend(0);
+	test_backend(1);
+	return 0;
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <pcre.h>
+#include "control_udp.h"
+#include "log.h"
+#include "main.h"
+#include "str.h"
+
+int _log_facility_rtcp;
+int _log_facility_cdr;
+int _log_facility_dtmf;
+struct rtpengine_config rtpe_config;
+struct poller *rtpe_poller;
+struct poller **rtpe_media_pollers;
+void control_listeners_close(void) { }
+GString *dtmf_logs;
+
+
+// the UDP command tokenizer must either produce the same fields as parse_re, or give up
+// and leave the line to the RE
+
+static pcre *parse_re;
+static pcre_extra *parse_ree;
+
+#define TOKENIZED 1
+#define FALLBACK 0
+
+static void test_line(const char *line, int exp_tokenized, const char *file, int line_no) {
+	size_t len = strlen(line);
+	char *re_buf = g_strdup(line), *tok_buf = g_strdup(line);
+	str s = STR_CONST_INIT_LEN(tok_buf, len);
+	int ovec[100];
+	const char **re_out = NULL;
+	char *tok_out[RE_UDP_V_PARMS + 2];
+	char cmd[2];
+	struct udp_tokens tok;
+
+	int ret = pcre_exec(parse_re, parse_ree, re_buf, len, 0, 0, ovec, G_N_ELEMENTS(ovec));
+	if (ret > 0)
+		pcre_get_substring_list(re_buf, ovec, ret, &re_out);
+
+	int tok_ok = !control_udp_tokenize(&tok, &s);
+	if (tok_ok != exp_tokenized) {
+		printf("test nok: %s:%i: tokenizer %s\n", file, line_no,
+				tok_ok ? "accepted the line" : "gave up");
+		abort();
+	}
+	if (!tok_ok) {
+		printf("test ok: %s:%i (fallback, RE %s)\n", file, line_no, ret > 0 ? "matches" : "doesn't match");
+		goto out;
+	}
+
+	if (ret <= 0) {
+		printf("test nok: %s:%i: tokenized, but the RE doesn't match\n", file, line_no);
+		abort();
+	}
+
+	control_udp_tokens_out(tok_out, &tok, cmd);
+	assert(tok_out[RE_UDP_V_PARMS + 1] == NULL);
+	for (int i = RE_UDP_COOKIE; i <= RE_UDP_V_PARMS; i++) {
+		const char *exp = (i < ret) ? re_out[i] : "";
+		if (!strcmp(tok_out[i], exp))
+			continue;
+		printf("test nok: %s:%i: field %i is '%s', expected '%s'\n", file, line_no, i,
+				tok_out[i], exp);
+		abort();
+	}
+	printf("test ok: %s:%i\n", file, line_no);
+
+out:
+	if (re_out)
+		pcre_free_substring_list(re_out);
+	g_free(re_buf);
+	g_free(tok_buf);
+}
+#define tokenized(l) test_line(l, TOKENIZED, __FILE__, __LINE__)
+#define fallback(l) test_line(l, FALLBACK, __FILE__, __LINE__)
+
+int main(void) {
+	parse_re = control_udp_parse_re(&parse_ree);
+	assert(parse_re != NULL);
+
+	// update / lookup
+	tokenized("5d28f8 U callid1;branch 10.0.0.1 30000 fromtag;1");
+	tokenized("5d28f8 U callid1;branch 10.0.0.1 30000 fromtag;1\n");
+	tokenized("5d28f8 U callid1;branch 10.0.0.1 30000 fromtag;1\r\n");
+	tokenized("5d28f8 U callid1 10.0.0.1 30000 fromtag;1\r");
+	tokenized("c1 Uc0,8,101 abc@host 10.0.0.1 30000 ft;1 tt;2");
+	tokenized("c1 Uc0,8,101 abc@host 10.0.0.1 30000 ft;1 tt;2\r\n");
+	tokenized("c2 l abc@host 10.0.0.1 0 ft;1 tt;1");
+	tokenized("c3 L abc@host 2001:db8::1 30000 ft;1 tt;1 anything else\r\n");
+	tokenized("c4 U abc@host fe80::A:b 30000 ft;1");
+	// tags with several semicolons: the tag ends before the last number
+	tokenized("c5 U abc 10.0.0.1 30000 ft;a;b;1 tt;x;2");
+	tokenized("c5 U abc 10.0.0.1 30000 ft;1;2 tt;3;4\n");
+	tokenized("c5 U abc 10.0.0.1 30000 ;;1");
+	// IPv4-mapped addresses are left to the RE
+	fallback("c6 U abc@host ::ffff:10.0.0.1 30000 ft;1 tt;1");
+	fallback("c6 L abc@host ::ffff:10.0.0.1 30000 ft;1 tt;1\r\n");
+	// call-IDs with white space
+	fallback("c7 U abc def 10.0.0.1 30000 ft;1");
+	fallback("c7 U abc def;branch 10.0.0.1 30000 ft;1 tt;1\r\n");
+	fallback("c7 U abc  def 10.0.0.1 30000 ft;1");
+	fallback("c7 U abc\tdef 10.0.0.1 30000 ft;1");
+	// malformed or unusual
+	fallback("c8 U abc; 10.0.0.1 30000 ft;1");
+	fallback("c8 U abc 10.0.0.1 30000 ft");
+	fallback("c8 U abc 10.0.0.1 port ft;1");
+	fallback("c8 U abc 10.0.0.1 30000 ft;1 tt");
+	fallback("c8 U abc 10.0.0.1 30000 ft;1\n\n");
+	fallback("c8 U abc 10.0.0.1 30000 ft;1\n\r");
+	fallback("c8 U abc 10.0.0.1 30000 ft;1 ");
+	fallback(" c8 U abc 10.0.0.1 30000 ft;1");
+	fallback("c8 U abc 10.0.0.1 30000");
+
+	// delete / query
+	tokenized("c9 D abc@host ft tt");
+	tokenized("c9 D abc@host ft tt\r\n");
+	tokenized("c9 d abc ft");
+	tokenized("c9 Q abc;branch ft;1;2 tt;3\n");
+	tokenized("c9 Q abc;branch ft;x tt;y;z");
+	tokenized("c9 Dflags abc ft;1 tt;2\r");
+	fallback("c10 D abc");
+	fallback("c10 D abc ft tt extra");
+	fallback("c10 D abc; ft tt");
+	fallback("c10 D abc ft tt\n\n");
+
+	// version
+	tokenized("c11 V");
+	tokenized("c11 V\n");
+	tokenized("c11 VF 20040107");
+	tokenized("c11 vf 20050322\r\n");
+	tokenized("c11 VF 20060704 something else");
+
+	// nothing the tokenizer knows
+	fallback("c12");
+	fallback("c12 X abc");
+	fallback("");
+	fallback("\r\n");
+
+	pcre_free_study(parse_ree);
+	pcre_free(parse_re);
+
+	return 0;
+}
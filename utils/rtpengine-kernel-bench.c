@@ -0,0 +1,731 @@
+// rtpengine-kernel-bench: forwarding benchmark for the xt_RTPENGINE kernel module. Installs
+// a number of synthetic targets into a kernel table through its control file, sends RTP
+// to them as fast as possible (or at a given rate) through an AF_PACKET socket, receives
+// what the module forwards and reports the packet rates, the latency added and all drop
+// and error counters.
+//
+// It's normally run through kernel-forwarding-bench, which sets up a network namespace
+// with a veth pair, the iptables rule and the kernel table. Packets are sent out of
+// --interface to --remote, where the module forwards them back to --local.
+//
+// With --suite, each target is a pair of targets: the first one encrypts the plain RTP it
+// receives and sends it to the second one, which decrypts it again before sending it back
+// out. Both run in the kernel, so no SRTP is needed here, and every packet received has
+// been through both the encryption and the decryption path.
+//
+// "Kernel CPU" is the system, IRQ and softirq time of all CPUs during the test, taken from
+// /proc/stat. It includes the cost of sending and receiving on this side of the veth pair,
+// so the pps per core figure is a lower bound for the module itself.
+//
+// Sample usage:
+// ./kernel-forwarding-bench --targets=1000 --duration=10
+// ./kernel-forwarding-bench --targets=1000 --suite=AEAD_AES_128_GCM --threads=4
+// ./kernel-forwarding-bench --targets=10000 --rate=200000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <glib.h>
+#include "xt_RTPENGINE.h"
+
+
+#define LATENCY_BUCKET_US	10
+#define LATENCY_BUCKETS		5000 // up to 50 ms, plus one overflow bucket
+#define SEND_BATCH		64
+#define RECV_BATCH		64
+#define PAYLOAD_MAGIC		0x4b42656e // "KBen"
+#define BASE_PORT		30000
+#define RECV_PORT		40000
+#define HDR_LEN			(14 + 20 + 8)
+
+
+struct suite {
+	const char *name;
+	enum rtpengine_cipher cipher;
+	enum rtpengine_hmac hmac;
+	unsigned int key_len;
+	unsigned int salt_len;
+	unsigned int auth_tag_len;
+};
+
+static const struct suite suites[] = {
+	{ "AES_CM_128_HMAC_SHA1_80",	REC_AES_CM_128,		REH_HMAC_SHA1,	16, 14, 10 },
+	{ "AES_CM_128_HMAC_SHA1_32",	REC_AES_CM_128,		REH_HMAC_SHA1,	16, 14, 4 },
+	{ "AES_256_CM_HMAC_SHA1_80",	REC_AES_CM_256,		REH_HMAC_SHA1,	32, 14, 10 },
+	{ "AEAD_AES_128_GCM",		REC_AEAD_AES_GCM_128,	REH_NULL,	16, 12, 0 },
+	{ "AEAD_AES_256_GCM",		REC_AEAD_AES_GCM_256,	REH_NULL,	32, 12, 0 },
+	{ "NULL_HMAC_SHA1_80",		REC_NULL,		REH_HMAC_SHA1,	16, 14, 10 },
+};
+
+// all written by one thread only and read after it has finished
+struct stats {
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t bad; // received, but not sent by us
+	uint64_t latency_sum_us;
+	uint64_t latency_max_us;
+	uint64_t latency_hist[LATENCY_BUCKETS + 1];
+};
+
+struct sender {
+	pthread_t thread;
+	unsigned int idx;
+	struct stats stats;
+};
+
+struct receiver {
+	pthread_t thread;
+	int fd;
+	struct stats stats;
+};
+
+struct counters {
+	uint64_t kernel_jiffies; // system + irq + softirq of all CPUs
+	uint64_t udp_rcvbuf_errors;
+	uint64_t udp_in_errors;
+	uint64_t if_tx_dropped;
+	uint64_t if_rx_dropped;
+	uint64_t target_packets;
+	uint64_t target_errors;
+	uint64_t target_junk;
+};
+
+
+static int table = 42;
+static char *if_name;
+static char *dst_mac_str;
+static char *local_str;
+static char *remote_str;
+static int num_targets = 100;
+static int num_threads = 1;
+static int num_receivers = 1;
+static int duration = 10;
+static int rate; // total packets per second, 0 = unlimited
+static int payload_len = 160;
+static char *suite_name;
+
+static const struct suite *suite;
+static struct in_addr local_addr, remote_addr;
+static unsigned char src_mac[6], dst_mac[6];
+static int if_index;
+static int control_fd = -1;
+
+static volatile int shutdown_flag;
+static volatile int receiving = 1;
+static struct sender *senders;
+static struct receiver *receivers;
+
+
+
+static void __attribute__((noreturn, format(printf, 1, 2))) die(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void random_bytes(unsigned char *p, unsigned int len) {
+	for (unsigned int i = 0; i < len; i++)
+		p[i] = g_random_int();
+}
+
+static const struct suite *suite_find(const char *name) {
+	for (unsigned int i = 0; i < G_N_ELEMENTS(suites); i++) {
+		if (!strcmp(suites[i].name, name))
+			return &suites[i];
+	}
+	return NULL;
+}
+
+
+// the port a target listens on. with SRTP, the decrypting half of target i is at
+// num_targets + i
+static unsigned int target_port(unsigned int i) {
+	return BASE_PORT + i;
+}
+
+static void re_addr(struct re_address *a, struct in_addr addr, unsigned int port) {
+	memset(a, 0, sizeof(*a));
+	a->family = AF_INET;
+	a->u.ipv4 = addr.s_addr;
+	a->port = port;
+}
+
+static void control_write(struct rtpengine_message *msg, const char *what) {
+	if (write(control_fd, msg, sizeof(*msg)) <= 0)
+		die("Failed to %s: %s", what, strerror(errno));
+}
+
+static void target_add(unsigned int port, unsigned int dst_port, struct in_addr dst,
+		const struct rtpengine_srtp *decrypt, const struct rtpengine_srtp *encrypt)
+{
+	struct rtpengine_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.cmd = REMG_ADD;
+	struct rtpengine_target_info *ti = &msg.u.target;
+	re_addr(&ti->local, remote_addr, port);
+	re_addr(&ti->src_addr, remote_addr, port);
+	re_addr(&ti->dst_addr, dst, dst_port);
+	ti->decrypt = *decrypt;
+	ti->encrypt = *encrypt;
+	ti->rtp = 1;
+	control_write(&msg, "add kernel target");
+}
+
+static void target_del(unsigned int port) {
+	struct rtpengine_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.cmd = REMG_DEL;
+	re_addr(&msg.u.target.local, remote_addr, port);
+	if (write(control_fd, &msg, sizeof(msg)) <= 0)
+		fprintf(stderr, "Failed to delete kernel target on port %u: %s\n", port, strerror(errno));
+}
+
+static void targets_setup(void) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/rtpengine/%i/control", table);
+	control_fd = open(path, O_RDWR | O_TRUNC);
+	if (control_fd == -1)
+		die("Failed to open %s: %s", path, strerror(errno));
+
+	struct rtpengine_message msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.cmd = REMG_NOOP;
+	control_write(&msg, "talk to kernel module (version mismatch?)");
+
+	struct rtpengine_srtp null = { .cipher = REC_NULL, .hmac = REH_NULL };
+	struct rtpengine_srtp srtp = null;
+	if (suite) {
+		srtp.cipher = suite->cipher;
+		srtp.hmac = suite->hmac;
+		srtp.master_key_len = suite->key_len;
+		srtp.session_key_len = suite->key_len;
+		srtp.auth_tag_len = suite->auth_tag_len;
+		srtp.rtcp_auth_tag_len = suite->auth_tag_len;
+	}
+
+	for (int i = 0; i < num_targets; i++) {
+		if (!suite) {
+			target_add(target_port(i), RECV_PORT, local_addr, &null, &null);
+			continue;
+		}
+		random_bytes(srtp.master_key, suite->key_len);
+		random_bytes(srtp.master_salt, suite->salt_len);
+		target_add(target_port(i), target_port(num_targets + i), remote_addr, &null, &srtp);
+		target_add(target_port(num_targets + i), RECV_PORT, local_addr, &srtp, &null);
+	}
+}
+
+static void targets_cleanup(void) {
+	if (control_fd == -1)
+		return;
+	for (int i = 0; i < num_targets * (suite ? 2 : 1); i++)
+		target_del(target_port(i));
+	close(control_fd);
+	control_fd = -1;
+}
+
+
+static uint16_t ip_csum(const unsigned char *p, unsigned int len) {
+	uint32_t sum = 0;
+	for (unsigned int i = 0; i < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htons(~sum);
+}
+
+// Ethernet, IPv4 and UDP headers, the RTP header and the payload are filled in per packet
+static void frame_init(unsigned char *f, unsigned int target, unsigned int len) {
+	memcpy(f, dst_mac, 6);
+	memcpy(f + 6, src_mac, 6);
+	f[12] = 0x08;
+	f[13] = 0x00;
+
+	unsigned char *ip = f + 14;
+	memset(ip, 0, 20);
+	ip[0] = 0x45;
+	*(uint16_t *) (ip + 2) = htons(len - 14);
+	ip[8] = 64;
+	ip[9] = IPPROTO_UDP;
+	memcpy(ip + 12, &local_addr, 4);
+	memcpy(ip + 16, &remote_addr, 4);
+	*(uint16_t *) (ip + 10) = ip_csum(ip, 20);
+
+	unsigned char *udp = ip + 20;
+	*(uint16_t *) (udp + 0) = htons(RECV_PORT);
+	*(uint16_t *) (udp + 2) = htons(target_port(target));
+	*(uint16_t *) (udp + 4) = htons(len - 14 - 20);
+	*(uint16_t *) (udp + 6) = 0;
+}
+
+static void *sender_thread(void *p) {
+	struct sender *s = p;
+	unsigned int frame_len = HDR_LEN + 12 + payload_len;
+	unsigned char (*frames)[frame_len] = g_malloc0(SEND_BATCH * frame_len);
+	struct mmsghdr mm[SEND_BATCH];
+	struct iovec iov[SEND_BATCH];
+	struct sockaddr_ll sll = {
+		.sll_family = AF_PACKET,
+		.sll_protocol = htons(ETH_P_IP),
+		.sll_ifindex = if_index,
+		.sll_halen = 6,
+	};
+	memcpy(sll.sll_addr, dst_mac, 6);
+
+	int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+	if (fd == -1)
+		die("Failed to create packet socket: %s", strerror(errno));
+	int one = 1;
+	setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one, sizeof(one));
+
+	memset(mm, 0, sizeof(mm));
+	for (unsigned int i = 0; i < SEND_BATCH; i++) {
+		iov[i].iov_base = frames[i];
+		iov[i].iov_len = frame_len;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+		mm[i].msg_hdr.msg_name = &sll;
+		mm[i].msg_hdr.msg_namelen = sizeof(sll);
+	}
+
+	// this thread's targets are idx, idx + num_threads, ...
+	unsigned int my_targets = (num_targets - s->idx + num_threads - 1) / num_threads;
+	uint16_t *seqs = g_malloc0(sizeof(*seqs) * my_targets);
+	unsigned int next = 0;
+	uint64_t batch_ns = rate ? 1000000000ULL * SEND_BATCH * num_threads / rate : 0;
+	uint64_t due = now_ns();
+
+	while (!shutdown_flag) {
+		for (unsigned int i = 0; i < SEND_BATCH; i++) {
+			unsigned int t = next;
+			next = (next + 1) % my_targets;
+			unsigned int target = s->idx + t * num_threads;
+			unsigned char *f = frames[i];
+			frame_init(f, target, frame_len);
+			unsigned char *rtp = f + HDR_LEN;
+			uint16_t seq = seqs[t]++;
+			rtp[0] = 0x80;
+			rtp[1] = 0;
+			*(uint16_t *) (rtp + 2) = htons(seq);
+			*(uint32_t *) (rtp + 4) = htonl(seq * 160);
+			*(uint32_t *) (rtp + 8) = htonl(0x10000 + target);
+			unsigned char *pl = rtp + 12;
+			*(uint32_t *) (pl + 0) = htonl(PAYLOAD_MAGIC);
+			*(uint32_t *) (pl + 4) = htonl(target);
+			uint64_t ts = now_ns();
+			memcpy(pl + 8, &ts, sizeof(ts));
+		}
+
+		int ret = sendmmsg(fd, mm, SEND_BATCH, 0);
+		if (ret < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN)
+				die("Failed to send: %s", strerror(errno));
+			s->stats.errors += SEND_BATCH;
+			continue;
+		}
+		s->stats.packets += ret;
+		s->stats.bytes += ret * (frame_len - HDR_LEN);
+		s->stats.errors += SEND_BATCH - ret;
+
+		if (batch_ns) {
+			due += batch_ns;
+			uint64_t now = now_ns();
+			if (due > now) {
+				struct timespec ts = { .tv_sec = (due - now) / 1000000000ULL,
+					.tv_nsec = (due - now) % 1000000000ULL };
+				nanosleep(&ts, NULL);
+			}
+		}
+	}
+
+	close(fd);
+	g_free(seqs);
+	g_free(frames);
+	return NULL;
+}
+
+
+static void latency_add(struct stats *st, uint64_t ns) {
+	uint64_t us = ns / 1000;
+	st->latency_sum_us += us;
+	if (us > st->latency_max_us)
+		st->latency_max_us = us;
+	uint64_t bucket = us / LATENCY_BUCKET_US;
+	if (bucket > LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS;
+	st->latency_hist[bucket]++;
+}
+
+static void *receiver_thread(void *p) {
+	struct receiver *r = p;
+	unsigned int buf_len = 12 + payload_len + 64;
+	unsigned char (*bufs)[buf_len] = g_malloc(RECV_BATCH * buf_len);
+	struct mmsghdr mm[RECV_BATCH];
+	struct iovec iov[RECV_BATCH];
+
+	memset(mm, 0, sizeof(mm));
+	for (unsigned int i = 0; i < RECV_BATCH; i++) {
+		iov[i].iov_base = bufs[i];
+		iov[i].iov_len = buf_len;
+		mm[i].msg_hdr.msg_iov = &iov[i];
+		mm[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (receiving) {
+		int ret = recvmmsg(r->fd, mm, RECV_BATCH, 0, NULL);
+		if (ret <= 0)
+			continue; // timeout
+		uint64_t now = now_ns();
+		for (int i = 0; i < ret; i++) {
+			unsigned char *b = bufs[i];
+			unsigned int len = mm[i].msg_len;
+			if (len < 12 + 16 || ntohl(*(uint32_t *) (b + 12)) != PAYLOAD_MAGIC) {
+				r->stats.bad++;
+				continue;
+			}
+			uint64_t ts;
+			memcpy(&ts, b + 12 + 8, sizeof(ts));
+			r->stats.packets++;
+			r->stats.bytes += len;
+			latency_add(&r->stats, now > ts ? now - ts : 0);
+		}
+	}
+
+	g_free(bufs);
+	return NULL;
+}
+
+static int receiver_socket(void) {
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1)
+		die("Failed to create UDP socket: %s", strerror(errno));
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	int size = 16 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+	struct timeval tv = { .tv_usec = 100000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	struct sockaddr_in sin = {
+		.sin_family = AF_INET,
+		.sin_addr = local_addr,
+		.sin_port = htons(RECV_PORT),
+	};
+	if (bind(fd, (struct sockaddr *) &sin, sizeof(sin)))
+		die("Failed to bind UDP socket: %s", strerror(errno));
+	return fd;
+}
+
+
+static uint64_t read_u64_file(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	unsigned long long v = 0;
+	if (fscanf(fp, "%llu", &v) != 1)
+		v = 0;
+	fclose(fp);
+	return v;
+}
+
+static void read_proc_stat(struct counters *c) {
+	FILE *fp = fopen("/proc/stat", "r");
+	if (!fp)
+		return;
+	unsigned long long user, nice, system, idle, iowait, irq, softirq;
+	if (fscanf(fp, "cpu %llu %llu %llu %llu %llu %llu %llu", &user, &nice, &system, &idle,
+				&iowait, &irq, &softirq) == 7)
+		c->kernel_jiffies = system + irq + softirq;
+	fclose(fp);
+}
+
+// the second "Udp:" line has the values, in the order given by the first one
+static void read_udp_snmp(struct counters *c) {
+	FILE *fp = fopen("/proc/net/snmp", "r");
+	if (!fp)
+		return;
+	char line[1024];
+	char **names = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "Udp: ", 5))
+			continue;
+		g_strchomp(line);
+		char **fields = g_strsplit(line + 5, " ", -1);
+		if (!names) {
+			names = fields;
+			continue;
+		}
+		for (unsigned int i = 0; names[i] && fields[i]; i++) {
+			if (!strcmp(names[i], "RcvbufErrors"))
+				c->udp_rcvbuf_errors = g_ascii_strtoull(fields[i], NULL, 10);
+			else if (!strcmp(names[i], "InErrors"))
+				c->udp_in_errors = g_ascii_strtoull(fields[i], NULL, 10);
+		}
+		g_strfreev(fields);
+		break;
+	}
+	g_strfreev(names);
+	fclose(fp);
+}
+
+// all targets' counters in one read, see struct rtpengine_snapshot_hdr
+static void read_snapshot(struct counters *c) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/rtpengine/%i/snapshot", table);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+
+	GString *buf = g_string_sized_new(65536);
+	char chunk[65536];
+	ssize_t ret;
+	while ((ret = read(fd, chunk, sizeof(chunk))) > 0)
+		g_string_append_len(buf, chunk, ret);
+	close(fd);
+
+	struct rtpengine_snapshot_hdr *hdr = (void *) buf->str;
+	if (buf->len < sizeof(*hdr) || hdr->version != RTPENGINE_SNAPSHOT_VERSION
+			|| hdr->entry_size < sizeof(struct rtpengine_snapshot_entry))
+		goto out;
+	for (unsigned int i = 0; i < hdr->count; i++) {
+		size_t off = sizeof(*hdr) + (size_t) i * hdr->entry_size;
+		if (off + sizeof(struct rtpengine_snapshot_entry) > buf->len)
+			break;
+		struct rtpengine_snapshot_entry *e = (void *) (buf->str + off);
+		c->target_packets += e->stats.packets;
+		c->target_errors += e->stats.errors;
+		c->target_junk += e->stats.junk;
+	}
+
+out:
+	g_string_free(buf, TRUE);
+}
+
+static void read_counters(struct counters *c) {
+	char path[128];
+	memset(c, 0, sizeof(*c));
+	read_proc_stat(c);
+	read_udp_snmp(c);
+	read_snapshot(c);
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/tx_dropped", if_name);
+	c->if_tx_dropped = read_u64_file(path);
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/rx_dropped", if_name);
+	c->if_rx_dropped = read_u64_file(path);
+}
+
+static void print_proc_status(void) {
+	char path[64], buf[256];
+	snprintf(path, sizeof(path), "/proc/rtpengine/%i/status", table);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	ssize_t ret = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret <= 0)
+		return;
+	buf[ret] = '\0';
+	printf("Kernel table %i status:\n%s", table, buf);
+}
+
+
+static void stats_merge(struct stats *to, const struct stats *from) {
+	to->packets += from->packets;
+	to->bytes += from->bytes;
+	to->errors += from->errors;
+	to->bad += from->bad;
+	to->latency_sum_us += from->latency_sum_us;
+	if (from->latency_max_us > to->latency_max_us)
+		to->latency_max_us = from->latency_max_us;
+	for (unsigned int i = 0; i <= LATENCY_BUCKETS; i++)
+		to->latency_hist[i] += from->latency_hist[i];
+}
+
+static double latency_percentile(const struct stats *s, double pct) {
+	uint64_t want = s->packets * pct / 100, seen = 0;
+	for (unsigned int i = 0; i <= LATENCY_BUCKETS; i++) {
+		seen += s->latency_hist[i];
+		if (seen > want)
+			return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+	}
+	return LATENCY_BUCKETS * LATENCY_BUCKET_US / 1000.0;
+}
+
+
+static void sighandler(int sig) {
+	shutdown_flag = 1;
+}
+
+static void options(int *argc, char ***argv) {
+	GOptionEntry e[] = {
+		{ "table",		'T', 0, G_OPTION_ARG_INT,	&table,		"Kernel table to install the targets in",	"INT"		},
+		{ "interface",		'i', 0, G_OPTION_ARG_STRING,	&if_name,	"Interface to send packets out of",		"NAME"		},
+		{ "dst-mac",		'm', 0, G_OPTION_ARG_STRING,	&dst_mac_str,	"MAC address of the other end of the interface","MAC"		},
+		{ "local",		'l', 0, G_OPTION_ARG_STRING,	&local_str,	"Local IPv4 address, where packets come back to","IP"		},
+		{ "remote",		'r', 0, G_OPTION_ARG_STRING,	&remote_str,	"IPv4 address the targets listen on",		"IP"		},
+		{ "targets",		'n', 0, G_OPTION_ARG_INT,	&num_targets,	"Number of targets",				"INT"		},
+		{ "threads",		't', 0, G_OPTION_ARG_INT,	&num_threads,	"Number of sending threads",			"INT"		},
+		{ "receivers",		0,   0, G_OPTION_ARG_INT,	&num_receivers,	"Number of receiving threads",			"INT"		},
+		{ "duration",		'd', 0, G_OPTION_ARG_INT,	&duration,	"Seconds to send packets for",			"INT"		},
+		{ "rate",		0,   0, G_OPTION_ARG_INT,	&rate,		"Total packets per second, 0 for unlimited",	"INT"		},
+		{ "payload",		'p', 0, G_OPTION_ARG_INT,	&payload_len,	"RTP payload size in bytes",			"INT"		},
+		{ "suite",		's', 0, G_OPTION_ARG_STRING,	&suite_name,	"Encrypt and decrypt with this SRTP suite",	"NAME"		},
+		{ NULL, }
+	};
+
+	GOptionContext *c = g_option_context_new(" - xt_RTPENGINE forwarding benchmark");
+	g_option_context_add_main_entries(c, e, NULL);
+	GError *er = NULL;
+	if (!g_option_context_parse(c, argc, argv, &er))
+		die("Bad command line: %s", er->message);
+	g_option_context_free(c);
+
+	if (!if_name || !dst_mac_str || !local_str || !remote_str)
+		die("--interface, --dst-mac, --local and --remote must be given");
+	if (num_targets <= 0 || num_threads <= 0 || num_receivers <= 0 || duration <= 0 || rate < 0)
+		die("Invalid number given");
+	if (payload_len < 16 || payload_len > 1400)
+		die("Invalid payload size");
+	if (num_threads > num_targets)
+		num_threads = num_targets;
+	if (suite_name) {
+		suite = suite_find(suite_name);
+		if (!suite)
+			die("Unsupported SRTP suite '%s'", suite_name);
+	}
+	if (target_port(num_targets * (suite ? 2 : 1)) > 65536)
+		die("Too many targets");
+	if (inet_pton(AF_INET, local_str, &local_addr) != 1)
+		die("Invalid address '%s'", local_str);
+	if (inet_pton(AF_INET, remote_str, &remote_addr) != 1)
+		die("Invalid address '%s'", remote_str);
+	if (sscanf(dst_mac_str, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &dst_mac[0], &dst_mac[1], &dst_mac[2],
+				&dst_mac[3], &dst_mac[4], &dst_mac[5]) != 6)
+		die("Invalid MAC address '%s'", dst_mac_str);
+
+	if_index = if_nametoindex(if_name);
+	if (!if_index)
+		die("Unknown interface '%s'", if_name);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	g_strlcpy(ifr.ifr_name, if_name, sizeof(ifr.ifr_name));
+	if (fd == -1 || ioctl(fd, SIOCGIFHWADDR, &ifr))
+		die("Failed to get MAC address of '%s': %s", if_name, strerror(errno));
+	memcpy(src_mac, ifr.ifr_hwaddr.sa_data, 6);
+	close(fd);
+}
+
+int main(int argc, char **argv) {
+	options(&argc, &argv);
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	printf("Installing %i targets%s%s in table %i\n", num_targets, suite ? " with " : "",
+			suite ? suite->name : "", table);
+	uint64_t setup_start = now_ns();
+	targets_setup();
+	printf("Installed %i kernel targets in %.3f s\n", num_targets * (suite ? 2 : 1),
+			(now_ns() - setup_start) / 1e9);
+	print_proc_status();
+	fflush(stdout);
+
+	receivers = g_malloc0(sizeof(*receivers) * num_receivers);
+	for (int i = 0; i < num_receivers; i++) {
+		receivers[i].fd = receiver_socket();
+		if (pthread_create(&receivers[i].thread, NULL, receiver_thread, &receivers[i]))
+			die("Failed to create thread");
+	}
+
+	struct counters before, after;
+	read_counters(&before);
+	uint64_t start = now_ns();
+
+	senders = g_malloc0(sizeof(*senders) * num_threads);
+	for (int i = 0; i < num_threads; i++) {
+		senders[i].idx = i;
+		if (pthread_create(&senders[i].thread, NULL, sender_thread, &senders[i]))
+			die("Failed to create thread");
+	}
+
+	for (int i = 0; i < duration * 10 && !shutdown_flag; i++)
+		usleep(100000);
+	shutdown_flag = 1;
+
+	struct stats sent = {0,}, received = {0,};
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(senders[i].thread, NULL);
+		stats_merge(&sent, &senders[i].stats);
+	}
+	double secs = (now_ns() - start) / 1e9;
+
+	// let the last packets arrive
+	usleep(200000);
+	read_counters(&after);
+	receiving = 0;
+	for (int i = 0; i < num_receivers; i++) {
+		pthread_join(receivers[i].thread, NULL);
+		close(receivers[i].fd);
+		stats_merge(&received, &receivers[i].stats);
+	}
+
+	print_proc_status();
+	targets_cleanup();
+
+	long hz = sysconf(_SC_CLK_TCK);
+	double cores = (after.kernel_jiffies - before.kernel_jiffies) / (double) hz / secs;
+
+	printf("%i targets%s%s, %i byte payload, %i sending threads, %.3f s\n", num_targets,
+			suite ? ", " : "", suite ? suite->name : "", payload_len, num_threads, secs);
+	printf("%-24s %12.0f pps  %10.2f Mbit/s  (%" PRIu64 " send errors)\n", "sent",
+			sent.packets / secs, sent.bytes * 8 / secs / 1e6, sent.errors);
+	printf("%-24s %12.0f pps  %10.2f Mbit/s  (%" PRIu64 " lost, %" PRIu64 " unexpected)\n",
+			"received", received.packets / secs, received.bytes * 8 / secs / 1e6,
+			sent.packets > received.packets ? sent.packets - received.packets : 0,
+			received.bad);
+	printf("%-24s %12.0f pps  (%" PRIu64 " errors, %" PRIu64 " junk)\n", "forwarded by module",
+			(after.target_packets - before.target_packets) / secs,
+			after.target_errors - before.target_errors, after.target_junk - before.target_junk);
+	printf("%-24s %12.2f cores  %10.0f pps/core\n", "kernel CPU", cores,
+			cores > 0 ? received.packets / secs / cores : 0);
+	if (received.packets)
+		printf("%-24s avg %.3f p50 %.3f p99 %.3f max %.3f ms\n", "latency",
+				received.latency_sum_us / 1000.0 / received.packets,
+				latency_percentile(&received, 50), latency_percentile(&received, 99),
+				received.latency_max_us / 1000.0);
+	printf("%-24s %s tx %" PRIu64 " rx %" PRIu64 ", UDP rcvbuf %" PRIu64 " in %" PRIu64 "\n",
+			"drops", if_name,
+			after.if_tx_dropped - before.if_tx_dropped, after.if_rx_dropped - before.if_rx_dropped,
+			after.udp_rcvbuf_errors - before.udp_rcvbuf_errors,
+			after.udp_in_errors - before.udp_in_errors);
+
+	g_free(senders);
+	g_free(receivers);
+
+	return 0;
+}
@@ -0,0 +1,1107 @@
+// rtpengine-load-tester: sets up a number of calls through a running rtpengine
+// instance using the NG protocol, then sends and receives timed RTP on both legs of
+// each call and reports packet loss, jitter and latency added by rtpengine.
+//
+// Each call consists of two legs (A and B), each with its own local UDP socket. The
+// offer is sent on behalf of A and the answer on behalf of B, so that all media
+// passes through rtpengine in both directions. Whether rtpengine forwards the media
+// in kernel or in userspace depends on its own configuration; transcoding is
+// requested with --transcode, and SDES-SRTP on both legs with --srtp.
+//
+// Sample usage:
+// ./rtpengine-load-tester --ng-address=127.0.0.1:2223 --calls=1000 --duration=60
+// ./rtpengine-load-tester --calls=200 --codec=PCMA --transcode=PCMU --threads=4
+// ./rtpengine-load-tester --calls=500 --srtp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include "str.h"
+#include "bencode.h"
+
+
+#define LATENCY_BUCKET_US	10
+#define LATENCY_BUCKETS		5000 // up to 50 ms, plus one overflow bucket
+#define SEND_RING		256 // must be a power of two
+#define PAYLOAD_MAGIC		0x4c6f6144 // "LoaD"
+
+#define SRTP_KEY_LEN		16
+#define SRTP_SALT_LEN		14
+#define SRTP_AUTH_KEY_LEN	20
+#define SRTP_AUTH_TAG_LEN	10
+#define SRTP_SUITE		"AES_CM_128_HMAC_SHA1_80"
+
+
+struct codec_def {
+	const char *name;
+	unsigned int pt;
+	unsigned int clock_rate;
+	unsigned int bytes_per_ms;
+	unsigned char silence;
+};
+
+static const struct codec_def codecs[] = {
+	{ "PCMU",	0,	8000,	8,	0xff },
+	{ "PCMA",	8,	8000,	8,	0xd5 },
+	{ "G722",	9,	8000,	8,	0x00 },
+	{ "G729",	18,	8000,	1,	0x00 },
+};
+
+
+struct srtp_ctx {
+	unsigned char master_key[SRTP_KEY_LEN];
+	unsigned char master_salt[SRTP_SALT_LEN];
+	unsigned char session_key[SRTP_KEY_LEN];
+	unsigned char session_salt[SRTP_SALT_LEN];
+	unsigned char session_auth_key[SRTP_AUTH_KEY_LEN];
+	EVP_CIPHER_CTX *cipher;
+	uint64_t index; // last seen or sent, rfc 3711 section 3.3.1
+	int have_index:1;
+};
+
+struct leg {
+	struct call *call;
+	struct leg *peer;
+	int fd;
+	struct sockaddr_in local;
+	struct sockaddr_in remote;
+
+	// sending
+	uint32_t ssrc;
+	uint16_t seq;
+	uint32_t ts;
+	const struct codec_def *tx_codec;
+	unsigned int tx_pt;
+	uint64_t packets_sent;
+	uint64_t send_ns[SEND_RING];
+	struct srtp_ctx srtp_tx;
+
+	// receiving
+	const struct codec_def *rx_codec;
+	uint64_t packets_received;
+	uint32_t rx_ts_base;
+	int64_t last_transit;
+	unsigned int jitter; // rfc 3550 A.8, in RTP timestamp units times 16
+	int have_rx:1;
+	struct srtp_ctx srtp_rx;
+};
+
+struct call {
+	unsigned int idx;
+	char call_id[64];
+	char from_tag[32];
+	char to_tag[32];
+	struct leg legs[2];
+	uint64_t next_send;
+	int established:1;
+};
+
+struct stats {
+	uint64_t calls_ok;
+	uint64_t calls_failed;
+	uint64_t sent;
+	uint64_t received;
+	uint64_t srtp_errors;
+	uint64_t latency_count;
+	uint64_t latency_sum_us;
+	uint64_t latency_max_us;
+	uint64_t latency_hist[LATENCY_BUCKETS + 1];
+};
+
+struct worker {
+	unsigned int idx;
+	pthread_t thread;
+	struct call *calls;
+	unsigned int num_calls;
+	int ng_fd;
+	unsigned int cookie_seq;
+	struct stats stats;
+	bencode_buffer_t ng_buf;
+};
+
+
+static char *ng_address = "127.0.0.1:2223";
+static char *local_address_str = "127.0.0.1";
+static int num_calls = 100;
+static int num_threads = 1;
+static int setup_rate = 50;
+static int duration = 30;
+static int ptime = 20;
+static int report_interval = 5;
+static char *codec_name = "PCMU";
+static char *transcode_name;
+static int srtp;
+static char **ng_flags;
+
+static const struct codec_def *codec;
+static const struct codec_def *transcode_codec;
+static struct sockaddr_in ng_sockaddr;
+static struct in_addr local_address;
+static unsigned int payload_len;
+static pthread_barrier_t setup_barrier;
+static volatile int shutdown_flag;
+static struct worker *workers;
+static uint64_t media_start_ns;
+
+
+static void __attribute__((noreturn, format(printf, 1, 2))) die(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// the worker is the only writer, the reporting thread only reads
+#define STATS_ADD(w, field, n) __atomic_add_fetch(&(w)->stats.field, n, __ATOMIC_RELAXED)
+#define STATS_GET(w, field) __atomic_load_n(&(w)->stats.field, __ATOMIC_RELAXED)
+
+static const struct codec_def *codec_find(const char *name) {
+	for (unsigned int i = 0; i < G_N_ELEMENTS(codecs); i++) {
+		if (!strcasecmp(codecs[i].name, name))
+			return &codecs[i];
+	}
+	return NULL;
+}
+
+
+
+// SRTP, AES_CM_128_HMAC_SHA1_80 only (rfc 3711)
+
+static void srtp_aes_cm(EVP_CIPHER_CTX *ctx, const unsigned char *iv, unsigned char *buf, unsigned int len) {
+	int outlen;
+	EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv);
+	EVP_EncryptUpdate(ctx, buf, &outlen, buf, len);
+}
+
+// rfc 3711 section 4.3.1, with a key derivation rate of zero
+static void srtp_derive(const struct srtp_ctx *c, unsigned char label, unsigned char *out, unsigned int len) {
+	unsigned char iv[16] = {0,};
+	memcpy(iv, c->master_salt, SRTP_SALT_LEN);
+	iv[7] ^= label;
+
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, c->master_key, NULL);
+	memset(out, 0, len);
+	srtp_aes_cm(ctx, iv, out, len);
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+static void srtp_init(struct srtp_ctx *c) {
+	srtp_derive(c, 0x00, c->session_key, SRTP_KEY_LEN);
+	srtp_derive(c, 0x01, c->session_auth_key, SRTP_AUTH_KEY_LEN);
+	srtp_derive(c, 0x02, c->session_salt, SRTP_SALT_LEN);
+	c->cipher = EVP_CIPHER_CTX_new();
+	EVP_EncryptInit_ex(c->cipher, EVP_aes_128_ctr(), NULL, c->session_key, NULL);
+}
+
+static void srtp_cleanup(struct srtp_ctx *c) {
+	if (c->cipher)
+		EVP_CIPHER_CTX_free(c->cipher);
+	c->cipher = NULL;
+}
+
+// rfc 3711 section 4.1.1
+static void srtp_crypt(struct srtp_ctx *c, uint32_t ssrc, uint64_t index, unsigned char *buf,
+		unsigned int len)
+{
+	unsigned char iv[16] = {0,};
+	memcpy(iv, c->session_salt, SRTP_SALT_LEN);
+	uint32_t ssrc_n = htonl(ssrc);
+	for (int i = 0; i < 4; i++)
+		iv[4 + i] ^= ((unsigned char *) &ssrc_n)[i];
+	for (int i = 0; i < 6; i++)
+		iv[8 + i] ^= (index >> (40 - i * 8)) & 0xff;
+	srtp_aes_cm(c->cipher, iv, buf, len);
+}
+
+// the buffer must have room for the ROC after `len`
+static void srtp_hash(struct srtp_ctx *c, unsigned char *out, unsigned char *buf, unsigned int len,
+		uint64_t index)
+{
+	uint32_t roc = htonl(index >> 16);
+	memcpy(buf + len, &roc, sizeof(roc));
+	unsigned char hmac[20];
+	HMAC(EVP_sha1(), c->session_auth_key, SRTP_AUTH_KEY_LEN, buf, len + sizeof(roc), hmac, NULL);
+	memcpy(out, hmac, SRTP_AUTH_TAG_LEN);
+}
+
+// rfc 3711 appendix A
+static uint64_t srtp_rx_index(struct srtp_ctx *c, uint16_t seq) {
+	if (!c->have_index) {
+		c->have_index = 1;
+		c->index = seq;
+		return seq;
+	}
+	uint16_t s_l = c->index & 0xffff;
+	uint32_t roc = c->index >> 16;
+	uint32_t v = roc;
+	if (s_l < 0x8000) {
+		if ((int) seq - s_l > 0x8000 && roc > 0)
+			v = roc - 1;
+	}
+	else if (s_l - 0x8000 > seq)
+		v = roc + 1;
+	uint64_t index = ((uint64_t) v << 16) | seq;
+	if (index > c->index)
+		c->index = index;
+	return index;
+}
+
+static void srtp_key_b64(const struct srtp_ctx *c, char *out, size_t len) {
+	unsigned char key[SRTP_KEY_LEN + SRTP_SALT_LEN];
+	memcpy(key, c->master_key, SRTP_KEY_LEN);
+	memcpy(key + SRTP_KEY_LEN, c->master_salt, SRTP_SALT_LEN);
+	gchar *b64 = g_base64_encode(key, sizeof(key));
+	snprintf(out, len, "%s", b64);
+	g_free(b64);
+}
+
+static int srtp_key_parse(struct srtp_ctx *c, const char *b64, size_t b64_len) {
+	char buf[128];
+	if (b64_len >= sizeof(buf))
+		return -1;
+	memcpy(buf, b64, b64_len);
+	buf[b64_len] = '\0';
+	gsize len;
+	guchar *key = g_base64_decode(buf, &len);
+	int ret = -1;
+	if (len >= SRTP_KEY_LEN + SRTP_SALT_LEN) {
+		memcpy(c->master_key, key, SRTP_KEY_LEN);
+		memcpy(c->master_salt, key + SRTP_KEY_LEN, SRTP_SALT_LEN);
+		ret = 0;
+	}
+	g_free(key);
+	return ret;
+}
+
+
+
+// SDP
+
+static void sdp_build(GString *s, const struct leg *leg, const struct codec_def *cd, unsigned int pt) {
+	char addr[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &leg->local.sin_addr, addr, sizeof(addr));
+
+	g_string_append_printf(s,
+			"v=0\r\n"
+			"o=- %u 1 IN IP4 %s\r\n"
+			"s=rtpengine-load-tester\r\n"
+			"c=IN IP4 %s\r\n"
+			"t=0 0\r\n"
+			"m=audio %u RTP/%s %u\r\n"
+			"a=rtpmap:%u %s/%u\r\n"
+			"a=ptime:%i\r\n"
+			"a=sendrecv\r\n",
+			leg->call->idx, addr, addr,
+			ntohs(leg->local.sin_port), srtp ? "SAVP" : "AVP", pt,
+			pt, cd->name, cd->clock_rate,
+			ptime);
+	if (srtp) {
+		char key[64];
+		srtp_key_b64(&leg->srtp_tx, key, sizeof(key));
+		g_string_append_printf(s, "a=crypto:1 " SRTP_SUITE " inline:%s\r\n", key);
+	}
+}
+
+struct sdp_info {
+	struct sockaddr_in remote;
+	int pts[32];
+	unsigned int num_pts;
+	int pt; // payload type of the wanted codec, -1 if not offered
+	int have_crypto;
+	struct srtp_ctx crypto;
+};
+
+// minimal parser for the SDP that rtpengine generates: one audio stream, IPv4
+static int sdp_parse(const char *sdp, size_t len, const struct codec_def *want, struct sdp_info *out) {
+	char *buf = g_strndup(sdp, len);
+	char *saveptr, *line;
+	int ret = -1;
+
+	memset(out, 0, sizeof(*out));
+	out->remote.sin_family = AF_INET;
+	out->pt = -1;
+
+	for (line = strtok_r(buf, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+		char addr[64], name[32];
+		unsigned int port, pt, tag;
+		int n;
+
+		if (sscanf(line, "c=IN IP4 %63s", addr) == 1)
+			inet_pton(AF_INET, addr, &out->remote.sin_addr);
+		else if (sscanf(line, "m=audio %u %*s%n", &port, &n) == 1) {
+			out->remote.sin_port = htons(port);
+			char *p = line + n;
+			while (out->num_pts < G_N_ELEMENTS(out->pts)) {
+				char *end;
+				long l = strtol(p, &end, 10);
+				if (end == p)
+					break;
+				out->pts[out->num_pts++] = l;
+				p = end;
+			}
+			// static payload types don't need an rtpmap
+			for (unsigned int i = 0; i < out->num_pts; i++) {
+				if (out->pts[i] == want->pt) {
+					out->pt = want->pt;
+					break;
+				}
+			}
+		}
+		else if (sscanf(line, "a=rtpmap:%u %31[^/]", &pt, name) == 2) {
+			if (out->pt == -1 && !strcasecmp(name, want->name))
+				out->pt = pt;
+		}
+		else if (!out->have_crypto
+				&& sscanf(line, "a=crypto:%u " SRTP_SUITE " inline:%n", &tag, &n) == 1
+				&& n > 0)
+		{
+			char *key = line + n;
+			size_t key_len = strcspn(key, "|; ");
+			if (!srtp_key_parse(&out->crypto, key, key_len))
+				out->have_crypto = 1;
+		}
+	}
+
+	if (!out->remote.sin_port || out->pt < 0)
+		goto out;
+	if (srtp && !out->have_crypto)
+		goto out;
+
+	ret = 0;
+out:
+	g_free(buf);
+	return ret;
+}
+
+
+
+// NG protocol
+
+static bencode_item_t *ng_request(struct worker *w, bencode_item_t *req) {
+	char cookie[64];
+	snprintf(cookie, sizeof(cookie), "%u_%u_%u ", (unsigned int) getpid(), w->idx, w->cookie_seq++);
+	size_t cookie_len = strlen(cookie);
+
+	int len;
+	char *msg = bencode_collapse(req, &len);
+	if (!msg)
+		return NULL;
+	struct iovec iov[2] = {
+		{ .iov_base = cookie, .iov_len = cookie_len },
+		{ .iov_base = msg, .iov_len = len },
+	};
+	struct msghdr mh = { .msg_iov = iov, .msg_iovlen = 2 };
+
+	for (int attempt = 0; attempt < 3; attempt++) {
+		if (sendmsg(w->ng_fd, &mh, 0) < 0)
+			return NULL;
+
+		uint64_t deadline = now_ns() + 2000000000ULL;
+		while (1) {
+			uint64_t now = now_ns();
+			if (now >= deadline)
+				break;
+			struct pollfd pfd = { .fd = w->ng_fd, .events = POLLIN };
+			if (poll(&pfd, 1, (deadline - now) / 1000000 + 1) <= 0)
+				continue;
+
+			char *reply = bencode_buffer_alloc(&w->ng_buf, 65536);
+			ssize_t ret = recv(w->ng_fd, reply, 65535, 0);
+			if (ret <= 0)
+				continue;
+			// replies to earlier attempts of other requests are discarded here
+			if (ret <= cookie_len || memcmp(reply, cookie, cookie_len))
+				continue;
+			return bencode_decode_expect(&w->ng_buf, reply + cookie_len, ret - cookie_len,
+					BENCODE_DICTIONARY);
+		}
+	}
+
+	return NULL;
+}
+
+static bencode_item_t *ng_command(struct worker *w, struct call *c, const char *command) {
+	bencode_item_t *req = bencode_dictionary(&w->ng_buf);
+	bencode_dictionary_add_string(req, "command", command);
+	bencode_dictionary_add_string(req, "call-id", c->call_id);
+	bencode_dictionary_add_string(req, "from-tag", c->from_tag);
+	return req;
+}
+
+static void ng_add_flags(bencode_item_t *req) {
+	bencode_item_t *replace = bencode_dictionary_add_list(req, "replace");
+	bencode_list_add_string(replace, "origin");
+	bencode_list_add_string(replace, "session-connection");
+	bencode_dictionary_add_string(req, "ICE", "remove");
+	if (ng_flags) {
+		bencode_item_t *flags = bencode_dictionary_add_list(req, "flags");
+		for (char **f = ng_flags; *f; f++)
+			bencode_list_add_string(flags, *f);
+	}
+}
+
+// returns the SDP from a successful reply
+static int ng_result_sdp(bencode_item_t *resp, const char *command, struct call *c, str *sdp) {
+	if (!resp) {
+		fprintf(stderr, "No reply to '%s' for call %s\n", command, c->call_id);
+		return -1;
+	}
+	if (bencode_dictionary_get_strcmp(resp, "result", "ok")) {
+		str reason = STR_NULL;
+		bencode_dictionary_get_str(resp, "error-reason", &reason);
+		fprintf(stderr, "'%s' for call %s failed: %.*s\n", command, c->call_id, STR_FMT(&reason));
+		return -1;
+	}
+	if (!bencode_dictionary_get_str(resp, "sdp", sdp)) {
+		fprintf(stderr, "No SDP in reply to '%s' for call %s\n", command, c->call_id);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+// call setup and media
+
+static int leg_socket(struct leg *leg) {
+	leg->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (leg->fd < 0)
+		return -1;
+	leg->local = (struct sockaddr_in) {
+		.sin_family = AF_INET,
+		.sin_addr = local_address,
+	};
+	socklen_t sl = sizeof(leg->local);
+	if (bind(leg->fd, (struct sockaddr *) &leg->local, sl))
+		return -1;
+	if (getsockname(leg->fd, (struct sockaddr *) &leg->local, &sl))
+		return -1;
+	return 0;
+}
+
+static void leg_init(struct call *c, struct leg *leg, struct leg *peer) {
+	leg->call = c;
+	leg->peer = peer;
+	leg->fd = -1;
+	RAND_bytes((unsigned char *) &leg->ssrc, sizeof(leg->ssrc));
+	RAND_bytes((unsigned char *) &leg->seq, sizeof(leg->seq));
+	RAND_bytes((unsigned char *) &leg->ts, sizeof(leg->ts));
+	if (srtp) {
+		RAND_bytes(leg->srtp_tx.master_key, SRTP_KEY_LEN);
+		RAND_bytes(leg->srtp_tx.master_salt, SRTP_SALT_LEN);
+	}
+}
+
+static int call_setup(struct worker *w, struct call *c) {
+	struct leg *a = &c->legs[0], *b = &c->legs[1];
+	GString *sdp = g_string_new("");
+	struct sdp_info si;
+	str resp_sdp;
+	int ret = -1;
+
+	snprintf(c->call_id, sizeof(c->call_id), "load-%u-%u", (unsigned int) getpid(), c->idx);
+	snprintf(c->from_tag, sizeof(c->from_tag), "a-%u", c->idx);
+	snprintf(c->to_tag, sizeof(c->to_tag), "b-%u", c->idx);
+
+	leg_init(c, a, b);
+	leg_init(c, b, a);
+	if (leg_socket(a) || leg_socket(b)) {
+		fprintf(stderr, "Failed to create media sockets: %s\n", strerror(errno));
+		goto out;
+	}
+
+	// B sends and receives the codec that rtpengine transcodes to, if any
+	a->tx_codec = a->rx_codec = codec;
+	a->tx_pt = codec->pt;
+	b->tx_codec = b->rx_codec = transcode_codec ? transcode_codec : codec;
+
+	// offer from A
+	bencode_item_t *req = ng_command(w, c, "offer");
+	sdp_build(sdp, a, codec, codec->pt);
+	bencode_dictionary_add_string(req, "sdp", sdp->str);
+	ng_add_flags(req);
+	if (transcode_codec) {
+		bencode_item_t *cod = bencode_dictionary_add_dictionary(req, "codec");
+		bencode_item_t *tc = bencode_dictionary_add_list(cod, "transcode");
+		bencode_list_add_string(tc, transcode_codec->name);
+	}
+	if (ng_result_sdp(ng_request(w, req), "offer", c, &resp_sdp))
+		goto out;
+	if (sdp_parse(resp_sdp.s, resp_sdp.len, b->rx_codec, &si)) {
+		fprintf(stderr, "Unusable SDP in reply to 'offer' for call %s\n", c->call_id);
+		goto out;
+	}
+	b->remote = si.remote;
+	b->tx_pt = si.pt;
+	if (srtp) {
+		memcpy(&b->srtp_rx, &si.crypto, sizeof(si.crypto));
+		srtp_init(&b->srtp_rx);
+		srtp_init(&b->srtp_tx);
+	}
+
+	// answer from B
+	req = ng_command(w, c, "answer");
+	bencode_dictionary_add_string(req, "to-tag", c->to_tag);
+	g_string_truncate(sdp, 0);
+	sdp_build(sdp, b, b->tx_codec, b->tx_pt);
+	bencode_dictionary_add_string(req, "sdp", sdp->str);
+	ng_add_flags(req);
+	if (ng_result_sdp(ng_request(w, req), "answer", c, &resp_sdp))
+		goto out;
+	if (sdp_parse(resp_sdp.s, resp_sdp.len, codec, &si)) {
+		fprintf(stderr, "Unusable SDP in reply to 'answer' for call %s\n", c->call_id);
+		goto out;
+	}
+	a->remote = si.remote;
+	if (srtp) {
+		memcpy(&a->srtp_rx, &si.crypto, sizeof(si.crypto));
+		srtp_init(&a->srtp_rx);
+		srtp_init(&a->srtp_tx);
+	}
+
+	c->established = 1;
+	ret = 0;
+
+out:
+	g_string_free(sdp, TRUE);
+	bencode_buffer_free(&w->ng_buf);
+	bencode_buffer_init(&w->ng_buf);
+	return ret;
+}
+
+static void call_teardown(struct worker *w, struct call *c) {
+	if (c->established) {
+		bencode_item_t *req = ng_command(w, c, "delete");
+		bencode_item_t *resp = ng_request(w, req);
+		if (!resp || bencode_dictionary_get_strcmp(resp, "result", "ok"))
+			fprintf(stderr, "'delete' for call %s failed\n", c->call_id);
+		bencode_buffer_free(&w->ng_buf);
+		bencode_buffer_init(&w->ng_buf);
+	}
+	for (int i = 0; i < 2; i++) {
+		struct leg *leg = &c->legs[i];
+		if (leg->fd != -1)
+			close(leg->fd);
+		srtp_cleanup(&leg->srtp_tx);
+		srtp_cleanup(&leg->srtp_rx);
+	}
+}
+
+static void leg_send(struct worker *w, struct leg *leg, uint64_t now) {
+	unsigned char buf[12 + 1024 + SRTP_AUTH_TAG_LEN + 4];
+	unsigned int samples = leg->tx_codec->clock_rate / 1000 * ptime;
+
+	buf[0] = 0x80;
+	buf[1] = leg->tx_pt & 0x7f;
+	uint16_t seq = htons(leg->seq);
+	uint32_t ts = htonl(leg->ts);
+	uint32_t ssrc = htonl(leg->ssrc);
+	memcpy(buf + 2, &seq, 2);
+	memcpy(buf + 4, &ts, 4);
+	memcpy(buf + 8, &ssrc, 4);
+
+	// packet number and send time, to match up packets that arrive unchanged
+	unsigned char *pl = buf + 12;
+	memset(pl, leg->tx_codec->silence, payload_len);
+	uint32_t magic = PAYLOAD_MAGIC;
+	memcpy(pl, &magic, 4);
+	memcpy(pl + 4, &leg->packets_sent, 8);
+	memcpy(pl + 12, &now, 8);
+
+	unsigned int len = 12 + payload_len;
+	if (srtp) {
+		if (leg->seq == 0 && leg->srtp_tx.have_index)
+			leg->srtp_tx.index += 0x10000;
+		leg->srtp_tx.index = (leg->srtp_tx.index & ~0xffffULL) | leg->seq;
+		leg->srtp_tx.have_index = 1;
+		srtp_crypt(&leg->srtp_tx, leg->ssrc, leg->srtp_tx.index, pl, payload_len);
+		srtp_hash(&leg->srtp_tx, buf + len, buf, len, leg->srtp_tx.index);
+		len += SRTP_AUTH_TAG_LEN;
+	}
+
+	leg->send_ns[leg->packets_sent & (SEND_RING - 1)] = now;
+
+	if (sendto(leg->fd, buf, len, 0, (struct sockaddr *) &leg->remote, sizeof(leg->remote)) == len)
+		STATS_ADD(w, sent, 1);
+
+	leg->packets_sent++;
+	leg->seq++;
+	leg->ts += samples;
+}
+
+static void latency_add(struct worker *w, uint64_t ns) {
+	uint64_t us = ns / 1000;
+	unsigned int bucket = us / LATENCY_BUCKET_US;
+	if (bucket > LATENCY_BUCKETS)
+		bucket = LATENCY_BUCKETS;
+	STATS_ADD(w, latency_hist[bucket], 1);
+	STATS_ADD(w, latency_count, 1);
+	STATS_ADD(w, latency_sum_us, us);
+	if (us > w->stats.latency_max_us)
+		__atomic_store_n(&w->stats.latency_max_us, us, __ATOMIC_RELAXED);
+}
+
+static void leg_receive(struct worker *w, struct leg *leg, unsigned char *buf, unsigned int len,
+		uint64_t now)
+{
+	if (len < 12 || (buf[0] & 0xc0) != 0x80)
+		return;
+	// RTCP
+	if (buf[1] >= 200 && buf[1] <= 207)
+		return;
+
+	uint16_t seq;
+	uint32_t ts, ssrc;
+	memcpy(&seq, buf + 2, 2);
+	memcpy(&ts, buf + 4, 4);
+	memcpy(&ssrc, buf + 8, 4);
+	seq = ntohs(seq);
+	ts = ntohl(ts);
+	ssrc = ntohl(ssrc);
+
+	unsigned int hdr_len = 12 + (buf[0] & 0x0f) * 4;
+	if (hdr_len > len)
+		return;
+
+	unsigned char *pl = buf + hdr_len;
+	unsigned int pl_len = len - hdr_len;
+
+	if (srtp) {
+		if (pl_len < SRTP_AUTH_TAG_LEN)
+			goto srtp_error;
+		pl_len -= SRTP_AUTH_TAG_LEN;
+		uint64_t index = srtp_rx_index(&leg->srtp_rx, seq);
+		unsigned char tag[SRTP_AUTH_TAG_LEN], hmac[SRTP_AUTH_TAG_LEN];
+		memcpy(tag, buf + len - SRTP_AUTH_TAG_LEN, SRTP_AUTH_TAG_LEN);
+		srtp_hash(&leg->srtp_rx, hmac, buf, len - SRTP_AUTH_TAG_LEN, index);
+		if (memcmp(tag, hmac, SRTP_AUTH_TAG_LEN))
+			goto srtp_error;
+		srtp_crypt(&leg->srtp_rx, ssrc, index, pl, pl_len);
+	}
+
+	STATS_ADD(w, received, 1);
+	__atomic_store_n(&leg->packets_received, leg->packets_received + 1, __ATOMIC_RELAXED);
+
+	// rfc 3550 A.8, in RTP timestamp units
+	unsigned int clock_rate = leg->rx_codec->clock_rate;
+	int64_t arrival = (int64_t) (now / 1000) * clock_rate / 1000000;
+	int64_t transit = arrival - ts;
+	if (leg->have_rx) {
+		int64_t d = transit - leg->last_transit;
+		if (d < 0)
+			d = -d;
+		unsigned int jitter = leg->jitter + d - ((leg->jitter + 8) >> 4);
+		__atomic_store_n(&leg->jitter, jitter, __ATOMIC_RELAXED);
+	}
+	else {
+		leg->have_rx = 1;
+		leg->rx_ts_base = ts;
+	}
+	leg->last_transit = transit;
+
+	// find the time the packet was sent at
+	struct leg *peer = leg->peer;
+	uint32_t magic;
+	uint64_t sent_at = 0;
+	if (pl_len >= 20 && (memcpy(&magic, pl, 4), magic == PAYLOAD_MAGIC))
+		memcpy(&sent_at, pl + 12, 8);
+	else {
+		// transcoded: use the timestamp offset from the first received packet, assuming that
+		// this was the first one sent
+		unsigned int samples = clock_rate / 1000 * ptime;
+		uint64_t pkt = (uint32_t) (ts - leg->rx_ts_base) / samples;
+		if (pkt < peer->packets_sent && peer->packets_sent - pkt <= SEND_RING)
+			sent_at = peer->send_ns[pkt & (SEND_RING - 1)];
+	}
+	if (sent_at && now >= sent_at)
+		latency_add(w, now - sent_at);
+
+	return;
+
+srtp_error:
+	STATS_ADD(w, srtp_errors, 1);
+}
+
+static void worker_media(struct worker *w, int efd, int tfd, uint64_t start, uint64_t end) {
+	uint64_t period = ptime * 1000000ULL;
+	unsigned int cursor = 0;
+	unsigned int num = w->num_calls;
+	struct epoll_event evs[64];
+	unsigned char buf[2048];
+
+	// spread out all calls evenly over one packet period
+	for (unsigned int i = 0; i < num; i++)
+		w->calls[i].next_send = start + period * i / (num ? num : 1)
+			+ period * w->idx / num_threads / (num ? num : 1);
+
+	int sending = 1;
+	uint64_t linger = end + 500000000ULL; // keep receiving packets still in flight
+
+	while (!shutdown_flag) {
+		uint64_t now = now_ns();
+
+		if (sending && now >= end)
+			sending = 0;
+		if (!sending && now >= linger)
+			break;
+
+		while (sending && num) {
+			struct call *c = &w->calls[cursor];
+			if (c->next_send > now)
+				break;
+			if (c->established) {
+				leg_send(w, &c->legs[0], now);
+				leg_send(w, &c->legs[1], now);
+			}
+			c->next_send += period;
+			cursor = (cursor + 1) % num;
+		}
+
+		uint64_t next = sending && num ? w->calls[cursor].next_send : linger;
+		struct itimerspec its = {
+			.it_value = { .tv_sec = next / 1000000000ULL, .tv_nsec = next % 1000000000ULL },
+		};
+		timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+
+		int n = epoll_wait(efd, evs, G_N_ELEMENTS(evs), 1000);
+		now = now_ns();
+		for (int i = 0; i < n; i++) {
+			struct leg *leg = evs[i].data.ptr;
+			if (!leg) {
+				uint64_t exp;
+				ssize_t ret = read(tfd, &exp, sizeof(exp));
+				(void) ret;
+				continue;
+			}
+			while (1) {
+				ssize_t ret = recv(leg->fd, buf, sizeof(buf), 0);
+				if (ret < 0)
+					break;
+				leg_receive(w, leg, buf, ret, now);
+			}
+		}
+	}
+}
+
+static void *worker_thread(void *p) {
+	struct worker *w = p;
+	uint64_t setup_interval = 1000000000ULL * num_threads / setup_rate;
+
+	bencode_buffer_init(&w->ng_buf);
+
+	w->ng_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (w->ng_fd < 0 || connect(w->ng_fd, (struct sockaddr *) &ng_sockaddr, sizeof(ng_sockaddr)))
+		die("Failed to create NG socket: %s", strerror(errno));
+
+	uint64_t next = now_ns();
+	for (unsigned int i = 0; i < w->num_calls && !shutdown_flag; i++) {
+		uint64_t now = now_ns();
+		if (now < next) {
+			struct timespec ts = { .tv_sec = (next - now) / 1000000000ULL,
+				.tv_nsec = (next - now) % 1000000000ULL };
+			nanosleep(&ts, NULL);
+		}
+		next += setup_interval;
+		if (call_setup(w, &w->calls[i]))
+			STATS_ADD(w, calls_failed, 1);
+		else
+			STATS_ADD(w, calls_ok, 1);
+	}
+
+	int efd = epoll_create1(EPOLL_CLOEXEC);
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (efd < 0 || tfd < 0)
+		die("Failed to create epoll or timer fd: %s", strerror(errno));
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+	epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+	for (unsigned int i = 0; i < w->num_calls; i++) {
+		for (int j = 0; j < 2; j++) {
+			struct leg *leg = &w->calls[i].legs[j];
+			if (leg->fd == -1)
+				continue;
+			ev.data.ptr = leg;
+			epoll_ctl(efd, EPOLL_CTL_ADD, leg->fd, &ev);
+		}
+	}
+
+	// start media in all threads at the same time
+	pthread_barrier_wait(&setup_barrier);
+
+	worker_media(w, efd, tfd, media_start_ns, media_start_ns + duration * 1000000000ULL);
+
+	close(tfd);
+	close(efd);
+	for (unsigned int i = 0; i < w->num_calls; i++)
+		call_teardown(w, &w->calls[i]);
+	close(w->ng_fd);
+	bencode_buffer_free(&w->ng_buf);
+
+	return NULL;
+}
+
+
+
+// reporting
+
+static void stats_sum(struct stats *out) {
+	memset(out, 0, sizeof(*out));
+	for (int i = 0; i < num_threads; i++) {
+		struct worker *w = &workers[i];
+		out->calls_ok += STATS_GET(w, calls_ok);
+		out->calls_failed += STATS_GET(w, calls_failed);
+		out->sent += STATS_GET(w, sent);
+		out->received += STATS_GET(w, received);
+		out->srtp_errors += STATS_GET(w, srtp_errors);
+		out->latency_count += STATS_GET(w, latency_count);
+		out->latency_sum_us += STATS_GET(w, latency_sum_us);
+		out->latency_max_us = MAX(out->latency_max_us, STATS_GET(w, latency_max_us));
+		for (unsigned int j = 0; j <= LATENCY_BUCKETS; j++)
+			out->latency_hist[j] += STATS_GET(w, latency_hist[j]);
+	}
+}
+
+static double latency_percentile(const struct stats *s, const struct stats *prev, double pct) {
+	uint64_t total = s->latency_count - prev->latency_count;
+	if (!total)
+		return 0;
+	uint64_t want = ceil(total * pct / 100.0), sum = 0;
+	for (unsigned int i = 0; i <= LATENCY_BUCKETS; i++) {
+		sum += s->latency_hist[i] - prev->latency_hist[i];
+		if (sum >= want)
+			return (i + 1) * LATENCY_BUCKET_US / 1000.0;
+	}
+	return LATENCY_BUCKETS * LATENCY_BUCKET_US / 1000.0;
+}
+
+// average and maximum of the current jitter of all receiving legs, in ms
+static void jitter_get(double *avg, double *max) {
+	double sum = 0;
+	unsigned int num = 0;
+	*max = 0;
+	for (int i = 0; i < num_threads; i++) {
+		struct worker *w = &workers[i];
+		for (unsigned int j = 0; j < w->num_calls; j++) {
+			for (int k = 0; k < 2; k++) {
+				struct leg *leg = &w->calls[j].legs[k];
+				if (!__atomic_load_n(&leg->packets_received, __ATOMIC_RELAXED))
+					continue;
+				double ms = __atomic_load_n(&leg->jitter, __ATOMIC_RELAXED) / 16.0
+					* 1000.0 / leg->rx_codec->clock_rate;
+				sum += ms;
+				num++;
+				*max = MAX(*max, ms);
+			}
+		}
+	}
+	*avg = num ? sum / num : 0;
+}
+
+static void report(const char *label, const struct stats *s, const struct stats *prev, double secs) {
+	uint64_t sent = s->sent - prev->sent;
+	uint64_t received = s->received - prev->received;
+	uint64_t lat = s->latency_count - prev->latency_count;
+	double loss = sent && received < sent ? (sent - received) * 100.0 / sent : 0;
+	double jitter_avg, jitter_max;
+	jitter_get(&jitter_avg, &jitter_max);
+
+	printf("%-8s %7.0f pps out %7.0f pps in, loss %6.3f%%, srtp errors %" PRIu64 ", "
+			"latency avg %.3f p50 %.3f p99 %.3f max %.3f ms, jitter avg %.3f max %.3f ms\n",
+			label, sent / secs, received / secs, loss, s->srtp_errors - prev->srtp_errors,
+			lat ? (double) (s->latency_sum_us - prev->latency_sum_us) / lat / 1000.0 : 0,
+			latency_percentile(s, prev, 50), latency_percentile(s, prev, 99),
+			s->latency_max_us / 1000.0,
+			jitter_avg, jitter_max);
+	fflush(stdout);
+}
+
+static void sighandler(int sig) {
+	shutdown_flag = 1;
+}
+
+static void options(int *argc, char ***argv) {
+	GOptionEntry e[] = {
+		{ "ng-address",		'n', 0, G_OPTION_ARG_STRING,	&ng_address,	"rtpengine NG listener",			"IP:PORT"	},
+		{ "local-address",	'l', 0, G_OPTION_ARG_STRING,	&local_address_str,"Local IPv4 address for media",		"IP"		},
+		{ "calls",		'c', 0, G_OPTION_ARG_INT,	&num_calls,	"Number of concurrent calls",			"INT"		},
+		{ "threads",		't', 0, G_OPTION_ARG_INT,	&num_threads,	"Number of sending and receiving threads",	"INT"		},
+		{ "setup-rate",		'r', 0, G_OPTION_ARG_INT,	&setup_rate,	"Calls to set up per second",			"INT"		},
+		{ "duration",		'd', 0, G_OPTION_ARG_INT,	&duration,	"Seconds to send media for",			"INT"		},
+		{ "ptime",		'p', 0, G_OPTION_ARG_INT,	&ptime,		"Packetization interval in ms",			"INT"		},
+		{ "interval",		'i', 0, G_OPTION_ARG_INT,	&report_interval,"Seconds between interim reports",		"INT"		},
+		{ "codec",		0,   0, G_OPTION_ARG_STRING,	&codec_name,	"Codec offered and sent by the A leg",		"PCMU|PCMA|G722|G729"},
+		{ "transcode",		0,   0, G_OPTION_ARG_STRING,	&transcode_name,"Codec for rtpengine to transcode to for the B leg","PCMU|PCMA|G722|G729"},
+		{ "srtp",		's', 0, G_OPTION_ARG_NONE,	&srtp,		"Use SDES-SRTP (" SRTP_SUITE ") on both legs",	NULL		},
+		{ "flag",		'f', 0, G_OPTION_ARG_STRING_ARRAY,&ng_flags,	"Additional flag for offer and answer",		"STRING"	},
+		{ NULL, }
+	};
+
+	GOptionContext *c = g_option_context_new(" - rtpengine load tester");
+	g_option_context_add_main_entries(c, e, NULL);
+	GError *er = NULL;
+	if (!g_option_context_parse(c, argc, argv, &er))
+		die("Bad command line: %s", er->message);
+	g_option_context_free(c);
+
+	if (num_calls <= 0 || num_threads <= 0 || setup_rate <= 0 || duration <= 0 || report_interval <= 0)
+		die("Invalid number given");
+	if (ptime < 10 || ptime > 100 || ptime % 10)
+		die("Invalid ptime");
+	if (num_threads > num_calls)
+		num_threads = num_calls;
+
+	codec = codec_find(codec_name);
+	if (!codec)
+		die("Unsupported codec '%s'", codec_name);
+	if (transcode_name) {
+		transcode_codec = codec_find(transcode_name);
+		if (!transcode_codec)
+			die("Unsupported codec '%s'", transcode_name);
+		if (transcode_codec == codec)
+			transcode_codec = NULL;
+	}
+	payload_len = codec->bytes_per_ms * ptime;
+	if (payload_len < 20)
+		die("Payload too small for the given codec and ptime");
+
+	if (inet_pton(AF_INET, local_address_str, &local_address) != 1)
+		die("Invalid local address '%s'", local_address_str);
+
+	char *host = g_strdup(ng_address);
+	char *colon = strrchr(host, ':');
+	if (!colon)
+		die("Invalid NG address '%s'", ng_address);
+	*colon = '\0';
+	struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM }, *res;
+	if (getaddrinfo(host, colon + 1, &hints, &res))
+		die("Invalid NG address '%s'", ng_address);
+	memcpy(&ng_sockaddr, res->ai_addr, sizeof(ng_sockaddr));
+	freeaddrinfo(res);
+	g_free(host);
+}
+
+int main(int argc, char **argv) {
+	options(&argc, &argv);
+
+	// two sockets per call
+	struct rlimit rlim;
+	if (!getrlimit(RLIMIT_NOFILE, &rlim)) {
+		rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+		if (rlim.rlim_cur != RLIM_INFINITY && rlim.rlim_cur < num_calls * 2 + num_threads * 4 + 16)
+			fprintf(stderr, "Warning: open file limit %llu is too low for %i calls\n",
+					(unsigned long long) rlim.rlim_cur, num_calls);
+	}
+
+	signal(SIGINT, sighandler);
+	signal(SIGTERM, sighandler);
+
+	pthread_barrier_init(&setup_barrier, NULL, num_threads + 1);
+
+	struct call *calls = g_malloc0(sizeof(*calls) * num_calls);
+	workers = g_malloc0(sizeof(*workers) * num_threads);
+	unsigned int call_idx = 0;
+	for (int i = 0; i < num_threads; i++) {
+		struct worker *w = &workers[i];
+		w->idx = i;
+		w->calls = calls + call_idx;
+		w->num_calls = num_calls / num_threads + (i < num_calls % num_threads ? 1 : 0);
+		for (unsigned int j = 0; j < w->num_calls; j++) {
+			w->calls[j].idx = call_idx + j;
+			w->calls[j].legs[0].fd = w->calls[j].legs[1].fd = -1;
+		}
+		call_idx += w->num_calls;
+	}
+
+	printf("Setting up %i calls (%s%s%s%s, ptime %i) at %i calls/s in %i threads\n",
+			num_calls, codec->name, transcode_codec ? " -> " : "",
+			transcode_codec ? transcode_codec->name : "", srtp ? ", SRTP" : "",
+			ptime, setup_rate, num_threads);
+	fflush(stdout);
+
+	uint64_t setup_start = now_ns();
+	for (int i = 0; i < num_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]))
+			die("Failed to create thread");
+	}
+
+	// let the workers finish their call setup. media_start_ns is set before the barrier
+	// releases them
+	while (!shutdown_flag) {
+		uint64_t done = 0;
+		for (int i = 0; i < num_threads; i++)
+			done += STATS_GET(&workers[i], calls_ok) + STATS_GET(&workers[i], calls_failed);
+		if (done >= num_calls)
+			break;
+		usleep(10000);
+	}
+	media_start_ns = now_ns() + 100000000ULL;
+	pthread_barrier_wait(&setup_barrier);
+
+	struct stats total, prev = {0,}, zero = {0,};
+	stats_sum(&total);
+	printf("Set up %" PRIu64 " calls (%" PRIu64 " failed) in %.1f s, sending media for %i s\n",
+			total.calls_ok, total.calls_failed, (media_start_ns - setup_start) / 1e9, duration);
+	fflush(stdout);
+
+	uint64_t next_report = media_start_ns + report_interval * 1000000000ULL;
+	uint64_t end = media_start_ns + duration * 1000000000ULL;
+	uint64_t last_report = media_start_ns;
+	while (!shutdown_flag) {
+		uint64_t now = now_ns();
+		if (now >= end)
+			break;
+		if (now < next_report) {
+			uint64_t until = MIN(next_report, end) - now;
+			struct timespec ts = { .tv_sec = until / 1000000000ULL, .tv_nsec = until % 1000000000ULL };
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		struct stats s;
+		stats_sum(&s);
+		report("interval", &s, &prev, (now - last_report) / 1e9);
+		prev = s;
+		last_report = now;
+		next_report += report_interval * 1000000000ULL;
+	}
+
+	for (int i = 0; i < num_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	stats_sum(&total);
+	report("total", &total, &zero, duration);
+
+	g_free(workers);
+	g_free(calls);
+	pthread_barrier_destroy(&setup_barrier);
+
+	return total.calls_failed ? 1 : 0;
+}
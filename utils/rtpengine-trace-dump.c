@@ -0,0 +1,141 @@
+// rtpengine-trace-dump: decodes the binary trace files written by rtpengine with
+// --trace-dir into one text line per event. Events of all given files (one per
+// thread) are merged and printed in chronological order.
+//
+// Sample usage:
+// ./rtpengine-trace-dump /var/spool/rtpengine-trace/rtpengine-trace.*
+// ./rtpengine-trace-dump --call=3 --event=jb-play /tmp/trace/rtpengine-trace.1234.*
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <glib.h>
+
+#define TRACE_DECODER
+#include "trace.h"
+
+
+struct event {
+	struct trace_event ev;
+	uint32_t tid;
+};
+
+#define TRACE_NAME(id, name, ...) [TRACE_ ## id] = name,
+static const char * const event_names[__TRACE_LAST] = {
+	TRACE_EVENTS(TRACE_NAME)
+};
+#undef TRACE_NAME
+
+#define TRACE_ARGS(id, name, a, b, c, d) [TRACE_ ## id] = { a, b, c, d },
+static const char * const event_args[__TRACE_LAST][4] = {
+	TRACE_EVENTS(TRACE_ARGS)
+};
+#undef TRACE_ARGS
+
+
+static int call_filter;
+static char *event_filter;
+
+
+static void __attribute__((noreturn, format(printf, 1, 2))) die(const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+static int event_wanted(const struct trace_event *ev) {
+	if (ev->event <= TRACE_NONE || ev->event >= __TRACE_LAST)
+		return 0;
+	if (call_filter && ev->call != call_filter)
+		return 0;
+	if (event_filter && strcmp(event_filter, event_names[ev->event]))
+		return 0;
+	return 1;
+}
+
+// a ring that is still being written to may contain a partially written newest event,
+// which the timestamp ordering takes care of well enough for a diagnostic tool
+static void read_file(const char *path, GArray *events) {
+	gchar *buf;
+	gsize len;
+	GError *er = NULL;
+
+	if (!g_file_get_contents(path, &buf, &len, &er))
+		die("Failed to read '%s': %s", path, er->message);
+
+	const struct trace_header *hdr = (void *) buf;
+	if (len < sizeof(*hdr) || memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)))
+		die("'%s' is not a trace file", path);
+	if (hdr->version != TRACE_VERSION || hdr->event_size != sizeof(struct trace_event))
+		die("'%s' has an unsupported format version", path);
+	if (len < sizeof(*hdr) + (gsize) hdr->num_events * sizeof(struct trace_event) || !hdr->num_events)
+		die("'%s' is truncated", path);
+
+	const struct trace_event *ring = (void *) (hdr + 1);
+	uint64_t head = hdr->head;
+	uint64_t start = head > hdr->num_events ? head - hdr->num_events : 0;
+
+	for (uint64_t i = start; i < head; i++) {
+		const struct trace_event *ev = &ring[i % hdr->num_events];
+		if (!event_wanted(ev))
+			continue;
+		struct event e = { .ev = *ev, .tid = hdr->tid };
+		g_array_append_val(events, e);
+	}
+
+	g_free(buf);
+}
+
+static gint event_cmp(gconstpointer a, gconstpointer b) {
+	const struct event *A = a, *B = b;
+	if (A->ev.ts < B->ev.ts)
+		return -1;
+	if (A->ev.ts > B->ev.ts)
+		return 1;
+	return 0;
+}
+
+static void print_event(const struct event *e) {
+	printf("%" PRIu64 ".%09" PRIu64 " tid %u call %u port %5u %-14s",
+			e->ev.ts / 1000000000, e->ev.ts % 1000000000,
+			e->tid, e->ev.call, e->ev.port, event_names[e->ev.event]);
+	for (unsigned int i = 0; i < 4; i++)
+		printf(" %s=%" PRIu32, event_args[e->ev.event][i], e->ev.args[i]);
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	GOptionEntry e[] = {
+		{ "call",	'c', 0, G_OPTION_ARG_INT,	&call_filter,	"Only show events of this trace ID",	"INT"		},
+		{ "event",	'e', 0, G_OPTION_ARG_STRING,	&event_filter,	"Only show events of this type",	"NAME"		},
+		{ NULL, }
+	};
+
+	GOptionContext *c = g_option_context_new("FILE... - decode rtpengine trace files");
+	g_option_context_add_main_entries(c, e, NULL);
+	GError *er = NULL;
+	if (!g_option_context_parse(c, &argc, &argv, &er))
+		die("Bad command line: %s", er->message);
+	g_option_context_free(c);
+
+	if (argc < 2)
+		die("No trace files given");
+
+	GArray *events = g_array_new(FALSE, FALSE, sizeof(struct event));
+	for (int i = 1; i < argc; i++)
+		read_file(argv[i], events);
+
+	g_array_sort(events, event_cmp);
+
+	for (unsigned int i = 0; i < events->len; i++)
+		print_event(&g_array_index(events, struct event, i));
+
+	g_array_free(events, TRUE);
+	return 0;
+}